@@ -42,7 +42,8 @@ class ThreadPool {
   // thread(s) for every task in [begin, end). init_func() must return a Status
   // indicating whether the initialization succeeded.
   // "thread" is an integer smaller than num_threads.
-  // Not thread-safe - no two calls to Run may overlap.
+  // Calls may only overlap or be nested if the runner supports it, as
+  // JxlThreadParallelRunner does.
   // Subsequent calls will reuse the same threads.
   //
   // Precondition: begin <= end.
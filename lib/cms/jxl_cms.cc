@@ -55,7 +55,7 @@ struct JxlCms {
   IccBytes icc_src, icc_dst;
   skcms_ICCProfile profile_src, profile_dst;
 #else
-  void* lcms_transform;
+  void* lcms_transform = nullptr;
 #endif
 
   // These fields are used when the HLG OOTF or inverse OOTF must be applied.
@@ -76,6 +76,14 @@ struct JxlCms {
   bool skip_lcms = false;
   ExtraTF preprocess = ExtraTF::kNone;
   ExtraTF postprocess = ExtraTF::kNone;
+  // Exponents of ExtraTF::kGamma pre- and postprocessing.
+  float preprocess_exponent = 1.0f;
+  float postprocess_exponent = 1.0f;
+
+  // If set, the CMS is not used: after preprocessing, linear source RGB is
+  // converted to linear destination RGB by multiplying with matrix.
+  bool use_matrix = false;
+  Matrix3x3 matrix{};
 };
 
 Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
@@ -89,10 +97,57 @@ HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
 
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Vec;
+
 #if JXL_CMS_VERBOSE >= 2
 const size_t kX = 0;  // pixel index, multiplied by 3 for RGB
 #endif
 
+// Returns sign(x) * |x|^exponent (and 0 for x = 0), i.e. a pure gamma curve
+// extended to negative inputs by mirroring, as for the other transfer
+// functions.
+template <class DF, class V>
+V MirroredPow(DF df, V x, V exponent) {
+  const V abs = Abs(x);
+  const V magnitude =
+      IfThenZeroElse(Eq(abs, Zero(df)), FastPowf(df, abs, exponent));
+  return CopySignToAbs(magnitude, x);
+}
+
+// Multiplies interleaved RGB pixels by t->matrix; src may equal dst.
+void ApplyMatrix(const JxlCms* t, const float* src, float* dst,
+                 size_t xsize) {
+  const HWY_FULL(float) df;
+  const Matrix3x3& m = t->matrix;
+  const auto m00 = Set(df, m[0][0]);
+  const auto m01 = Set(df, m[0][1]);
+  const auto m02 = Set(df, m[0][2]);
+  const auto m10 = Set(df, m[1][0]);
+  const auto m11 = Set(df, m[1][1]);
+  const auto m12 = Set(df, m[1][2]);
+  const auto m20 = Set(df, m[2][0]);
+  const auto m21 = Set(df, m[2][1]);
+  const auto m22 = Set(df, m[2][2]);
+  size_t x = 0;
+  for (; x + Lanes(df) <= xsize; x += Lanes(df)) {
+    Vec<decltype(df)> r, g, b;  // NOLINT
+    LoadInterleaved3(df, src + 3 * x, r, g, b);
+    const auto out_r = MulAdd(m00, r, MulAdd(m01, g, Mul(m02, b)));
+    const auto out_g = MulAdd(m10, r, MulAdd(m11, g, Mul(m12, b)));
+    const auto out_b = MulAdd(m20, r, MulAdd(m21, g, Mul(m22, b)));
+    StoreInterleaved3(out_r, out_g, out_b, df, dst + 3 * x);
+  }
+  for (; x < xsize; ++x) {
+    const float r = src[3 * x + 0];
+    const float g = src[3 * x + 1];
+    const float b = src[3 * x + 2];
+    for (size_t c = 0; c < 3; ++c) {
+      dst[3 * x + c] = m[c][0] * r + m[c][1] * g + m[c][2] * b;
+    }
+  }
+}
+
 // xform_src = UndoGammaCompression(buf_src).
 Status BeforeTransform(JxlCms* t, const float* buf_src, float* xform_src,
                        size_t buf_size) {
@@ -146,6 +201,16 @@ Status BeforeTransform(JxlCms* t, const float* buf_src, float* xform_src,
              xform_src[3 * kX + 1], xform_src[3 * kX + 2]);
 #endif
       break;
+
+    case ExtraTF::kGamma: {
+      HWY_FULL(float) df;
+      const auto exponent = Set(df, t->preprocess_exponent);
+      for (size_t i = 0; i < buf_size; i += Lanes(df)) {
+        const auto val = Load(df, buf_src + i);
+        Store(MirroredPow(df, val, exponent), df, xform_src + i);
+      }
+      break;
+    }
   }
   return true;
 }
@@ -196,6 +261,15 @@ Status AfterTransform(JxlCms* t, float* JXL_RESTRICT buf_dst, size_t buf_size) {
              buf_dst[3 * kX + 1], buf_dst[3 * kX + 2]);
 #endif
       break;
+    case ExtraTF::kGamma: {
+      HWY_FULL(float) df;
+      const auto exponent = Set(df, t->postprocess_exponent);
+      for (size_t i = 0; i < buf_size; i += Lanes(df)) {
+        const auto val = Load(df, buf_dst + i);
+        Store(MirroredPow(df, val, exponent), df, buf_dst + i);
+      }
+      break;
+    }
   }
   return true;
 }
@@ -214,6 +288,14 @@ Status DoColorSpaceTransform(void* cms_data, const size_t thread,
     xform_src = mutable_xform_src;
   }
 
+  if (t->use_matrix) {
+    ApplyMatrix(t, xform_src, buf_dst, xsize);
+    if (t->postprocess != ExtraTF::kNone) {
+      JXL_RETURN_IF_ERROR(AfterTransform(t, buf_dst, xsize * t->channels_dst));
+    }
+    return true;
+  }
+
 #if JPEGXL_ENABLE_SKCMS
   if (t->channels_src == 1 && !t->skip_lcms) {
     // Expand from 1 to 3 channels, starting from the end in case
@@ -1081,7 +1163,9 @@ void JxlCmsDestroy(void* cms_data) {
   if (cms_data == nullptr) return;
   JxlCms* t = reinterpret_cast<JxlCms*>(cms_data);
 #if !JPEGXL_ENABLE_SKCMS
-  TransformDeleter()(t->lcms_transform);
+  if (t->lcms_transform != nullptr) {
+    TransformDeleter()(t->lcms_transform);
+  }
 #endif
   delete t;
 }
@@ -1101,6 +1185,96 @@ void AllocateBuffer(size_t length, size_t num_threads,
   }
 }
 
+// Returns the ExtraTF (and its exponent) that converts between tf and linear,
+// or false if tf is not a pure curve supported by the matrix path.
+bool MatrixPathTransferFunction(const cms::CustomTransferFunction& tf,
+                                bool to_linear, ExtraTF* extra_tf,
+                                float* exponent) {
+  if (tf.IsLinear()) {
+    *extra_tf = ExtraTF::kNone;
+  } else if (tf.IsSRGB()) {
+    *extra_tf = ExtraTF::kSRGB;
+  } else if (tf.have_gamma) {
+    // Encoded values are linear^gamma.
+    const double gamma = tf.GetGamma();
+    *extra_tf = ExtraTF::kGamma;
+    *exponent = static_cast<float>(to_linear ? 1.0 / gamma : gamma);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Sets up t to convert between matrix/TRC color spaces (RGB or gray, with
+// sRGB, gamma or linear curves) without the CMS: the source curve is undone
+// by preprocessing, linear RGB is converted by a relative colorimetric
+// (Bradford-adapted) matrix, and the destination curve is applied by
+// postprocessing. Returns false, leaving t unchanged, for other conversions.
+bool InitMatrixTransform(const ColorEncoding& c_src,
+                         const ColorEncoding& c_dst, JxlCms* t) {
+  if (!c_src.have_fields || !c_dst.have_fields || c_src.cmyk || c_dst.cmyk) {
+    return false;
+  }
+  const bool is_gray = c_src.color_space == ColorSpace::kGray;
+  if (is_gray != (c_dst.color_space == ColorSpace::kGray)) return false;
+  if (!is_gray && (c_src.color_space != ColorSpace::kRGB ||
+                   c_dst.color_space != ColorSpace::kRGB)) {
+    return false;
+  }
+  ExtraTF preprocess;
+  ExtraTF postprocess;
+  float preprocess_exponent = 1.0f;
+  float postprocess_exponent = 1.0f;
+  if (!MatrixPathTransferFunction(c_src.tf, /*to_linear=*/true, &preprocess,
+                                  &preprocess_exponent) ||
+      !MatrixPathTransferFunction(c_dst.tf, /*to_linear=*/false, &postprocess,
+                                  &postprocess_exponent)) {
+    return false;
+  }
+  const CIExy wp_src = c_src.GetWhitePoint();
+  const CIExy wp_dst = c_dst.GetWhitePoint();
+  const bool same_white = cms::ApproxEq(wp_src.x, wp_dst.x) &&
+                          cms::ApproxEq(wp_src.y, wp_dst.y);
+  // Absolute colorimetric intent does not map white to white.
+  if (c_dst.rendering_intent == RenderingIntent::kAbsolute && !same_white) {
+    return false;
+  }
+
+  bool use_matrix = false;
+  Matrix3x3 matrix{};
+  if (!is_gray && !(same_white && c_src.SameColorSpace(c_dst))) {
+    PrimariesCIExy p_src;
+    PrimariesCIExy p_dst;
+    Matrix3x3 src_to_xyz;
+    Matrix3x3 dst_to_xyz;
+    if (!c_src.GetPrimaries(p_src) || !c_dst.GetPrimaries(p_dst) ||
+        !PrimariesToXYZD50(p_src.r.x, p_src.r.y, p_src.g.x, p_src.g.y,
+                           p_src.b.x, p_src.b.y, wp_src.x, wp_src.y,
+                           src_to_xyz) ||
+        !PrimariesToXYZD50(p_dst.r.x, p_dst.r.y, p_dst.g.x, p_dst.g.y,
+                           p_dst.b.x, p_dst.b.y, wp_dst.x, wp_dst.y,
+                           dst_to_xyz) ||
+        !Inv3x3Matrix(dst_to_xyz)) {
+      return false;
+    }
+    Mul3x3Matrix(dst_to_xyz, src_to_xyz, matrix);
+    use_matrix = true;
+  }
+
+  t->preprocess = preprocess;
+  t->postprocess = postprocess;
+  t->preprocess_exponent = preprocess_exponent;
+  t->postprocess_exponent = postprocess_exponent;
+  t->use_matrix = use_matrix;
+  t->matrix = matrix;
+  // Gray, or RGB with the same primaries: only the curves change.
+  t->skip_lcms = !use_matrix;
+  t->apply_hlg_ootf = false;
+  t->channels_src = c_src.Channels();
+  t->channels_dst = c_dst.Channels();
+  return true;
+}
+
 void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
                  const JxlColorProfile* input, const JxlColorProfile* output,
                  float intensity_target) {
@@ -1166,6 +1340,18 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
 #endif
   }
 
+  if (!t->skip_lcms && InitMatrixTransform(c_src, c_dst, t.get())) {
+#if JXL_CMS_VERBOSE
+    printf("Matrix/TRC transform without CMS\n");
+#endif
+    AllocateBuffer(xsize * t->channels_src, num_threads, &t->src_storage,
+                   &t->buf_src);
+    AllocateBuffer(xsize * t->channels_dst, num_threads, &t->dst_storage,
+                   &t->buf_dst);
+    t->intensity_target = intensity_target;
+    return t.release();
+  }
+
   t->apply_hlg_ootf = c_src.tf.IsHLG() != c_dst.tf.IsHLG();
   if (t->apply_hlg_ootf) {
     const ColorEncoding* c_hlg = c_src.tf.IsHLG() ? &c_src : &c_dst;
@@ -38,6 +38,7 @@ enum class ExtraTF {
   kPQ,
   kHLG,
   kSRGB,
+  kGamma,
 };
 
 static Status PrimariesToXYZ(float rx, float ry, float gx, float gy, float bx,
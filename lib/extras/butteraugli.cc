@@ -24,17 +24,20 @@
 #include "lib/extras/butteraugli.h"
 
 #include <algorithm>
-#include <atomic>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <mutex>
+#include <utility>
 
 #include "lib/base/common.h"
 #include "lib/base/compiler_specific.h"
+#include "lib/base/data_parallel.h"
 #include "lib/base/memory_manager.h"
+#include "lib/base/rect.h"
 #include "lib/extras/image.h"
 
 #undef HWY_TARGET_INCLUDE
@@ -233,6 +236,8 @@ Status ConvolutionWithTranspose(const ImageF& in,
 // or fall back to the previous truncated FIR followed by a transpose.
 Status Blur(const ImageF& in, float sigma, const ButteraugliParams& params,
             BlurTemp* temp, ImageF* out) {
+  // The approximate mode works on 2x downsampled images.
+  if (params.approximate) sigma *= 0.5f;
   std::vector<float> kernel = ComputeKernel(sigma);
   // Separable5 does an in-place convolution, so this fast path is not safe if
   // in aliases out.
@@ -261,6 +266,16 @@ Status Blur(const ImageF& in, float sigma, const ButteraugliParams& params,
   return true;
 }
 
+// Allocates image, unless it already has the given size, e.g. because it was
+// recycled by ButteraugliComparator.
+template <typename Image>
+Status EnsureSize(JxlMemoryManager* memory_manager, size_t xsize, size_t ysize,
+                  Image* image) {
+  if (image->xsize() == xsize && image->ysize() == ysize) return true;
+  JXL_ASSIGN_OR_RETURN(*image, Image::Create(memory_manager, xsize, ysize));
+  return true;
+}
+
 // Allows PaddedMaltaUnit to call either function via overloading.
 struct MaltaTagLF {};
 struct MaltaTag {};
@@ -420,8 +435,8 @@ Status SeparateMFAndHF(const ButteraugliParams& params, Image3F* mf, ImageF* hf,
   const size_t xsize = mf->xsize();
   const size_t ysize = mf->ysize();
   JxlMemoryManager* memory_manager = mf[0].memory_manager();
-  JXL_ASSIGN_OR_RETURN(hf[0], ImageF::Create(memory_manager, xsize, ysize));
-  JXL_ASSIGN_OR_RETURN(hf[1], ImageF::Create(memory_manager, xsize, ysize));
+  JXL_RETURN_IF_ERROR(EnsureSize(memory_manager, xsize, ysize, &hf[0]));
+  JXL_RETURN_IF_ERROR(EnsureSize(memory_manager, xsize, ysize, &hf[1]));
   for (int i = 0; i < 3; ++i) {
     if (i == 2) {
       JXL_RETURN_IF_ERROR(
@@ -478,8 +493,8 @@ Status SeparateHFAndUHF(const ButteraugliParams& params, ImageF* hf,
   const size_t ysize = hf[0].ysize();
   JxlMemoryManager* memory_manager = hf[0].memory_manager();
   static const double kSigmaUhf = 1.56416327805;
-  JXL_ASSIGN_OR_RETURN(uhf[0], ImageF::Create(memory_manager, xsize, ysize));
-  JXL_ASSIGN_OR_RETURN(uhf[1], ImageF::Create(memory_manager, xsize, ysize));
+  JXL_RETURN_IF_ERROR(EnsureSize(memory_manager, xsize, ysize, &uhf[0]));
+  JXL_RETURN_IF_ERROR(EnsureSize(memory_manager, xsize, ysize, &uhf[1]));
   for (int i = 0; i < 2; ++i) {
     // Divide hf into hf and uhf.
     for (size_t y = 0; y < ysize; ++y) {
@@ -544,10 +559,10 @@ Status SeparateFrequencies(size_t xsize, size_t ysize,
                            const ButteraugliParams& params, BlurTemp* blur_temp,
                            const Image3F& xyb, PsychoImage& ps) {
   JxlMemoryManager* memory_manager = xyb.memory_manager();
-  JXL_ASSIGN_OR_RETURN(
-      ps.lf, Image3F::Create(memory_manager, xyb.xsize(), xyb.ysize()));
-  JXL_ASSIGN_OR_RETURN(
-      ps.mf, Image3F::Create(memory_manager, xyb.xsize(), xyb.ysize()));
+  JXL_RETURN_IF_ERROR(
+      EnsureSize(memory_manager, xyb.xsize(), xyb.ysize(), &ps.lf));
+  JXL_RETURN_IF_ERROR(
+      EnsureSize(memory_manager, xyb.xsize(), xyb.ysize(), &ps.mf));
   JXL_RETURN_IF_ERROR(SeparateLFAndMF(params, xyb, &ps.lf, &ps.mf, blur_temp));
   JXL_RETURN_IF_ERROR(SeparateMFAndHF(params, &ps.mf, &ps.hf[0], blur_temp));
   JXL_RETURN_IF_ERROR(
@@ -1211,23 +1226,22 @@ void FuzzyErosion(const ImageF& from, ImageF* to) {
 // in the two images. img_diff_ac may be null.
 Status Mask(const ImageF& mask0, const ImageF& mask1,
             const ButteraugliParams& params, BlurTemp* blur_temp,
-            ImageF* BUTTERAUGLI_RESTRICT mask,
+            MaskTemp* temp, ImageF* BUTTERAUGLI_RESTRICT mask,
             ImageF* BUTTERAUGLI_RESTRICT diff_ac) {
   const size_t xsize = mask0.xsize();
   const size_t ysize = mask0.ysize();
   JxlMemoryManager* memory_manager = mask0.memory_manager();
-  JXL_ASSIGN_OR_RETURN(*mask, ImageF::Create(memory_manager, xsize, ysize));
+  JXL_RETURN_IF_ERROR(EnsureSize(memory_manager, xsize, ysize, mask));
   static const float kMul = 6.19424080439;
   static const float kBias = 12.61050594197;
   static const float kRadius = 2.7;
-  JXL_ASSIGN_OR_RETURN(ImageF diff0,
-                       ImageF::Create(memory_manager, xsize, ysize));
-  JXL_ASSIGN_OR_RETURN(ImageF diff1,
-                       ImageF::Create(memory_manager, xsize, ysize));
-  JXL_ASSIGN_OR_RETURN(ImageF blurred0,
-                       ImageF::Create(memory_manager, xsize, ysize));
-  JXL_ASSIGN_OR_RETURN(ImageF blurred1,
-                       ImageF::Create(memory_manager, xsize, ysize));
+  ImageF& diff0 = temp->diff0;
+  ImageF& diff1 = temp->diff1;
+  ImageF& blurred0 = temp->blurred0;
+  ImageF& blurred1 = temp->blurred1;
+  for (ImageF* image : {&diff0, &diff1, &blurred0, &blurred1}) {
+    JXL_RETURN_IF_ERROR(EnsureSize(memory_manager, xsize, ysize, image));
+  }
   DiffPrecompute(mask0, kMul, kBias, &diff0);
   DiffPrecompute(mask1, kMul, kBias, &diff1);
   JXL_RETURN_IF_ERROR(Blur(diff0, kRadius, params, blur_temp, &blurred0));
@@ -1250,16 +1264,15 @@ Status Mask(const ImageF& mask0, const ImageF& mask1,
 Status MaskPsychoImage(const PsychoImage& pi0, const PsychoImage& pi1,
                        const size_t xsize, const size_t ysize,
                        const ButteraugliParams& params, BlurTemp* blur_temp,
-                       ImageF* BUTTERAUGLI_RESTRICT mask,
+                       MaskTemp* temp, ImageF* BUTTERAUGLI_RESTRICT mask,
                        ImageF* BUTTERAUGLI_RESTRICT diff_ac) {
   JxlMemoryManager* memory_manager = pi0.hf[0].memory_manager();
-  JXL_ASSIGN_OR_RETURN(ImageF mask0,
-                       ImageF::Create(memory_manager, xsize, ysize));
-  JXL_ASSIGN_OR_RETURN(ImageF mask1,
-                       ImageF::Create(memory_manager, xsize, ysize));
-  CombineChannelsForMasking(&pi0.hf[0], &pi0.uhf[0], &mask0);
-  CombineChannelsForMasking(&pi1.hf[0], &pi1.uhf[0], &mask1);
-  JXL_RETURN_IF_ERROR(Mask(mask0, mask1, params, blur_temp, mask, diff_ac));
+  JXL_RETURN_IF_ERROR(EnsureSize(memory_manager, xsize, ysize, &temp->mask0));
+  JXL_RETURN_IF_ERROR(EnsureSize(memory_manager, xsize, ysize, &temp->mask1));
+  CombineChannelsForMasking(&pi0.hf[0], &pi0.uhf[0], &temp->mask0);
+  CombineChannelsForMasking(&pi1.hf[0], &pi1.uhf[0], &temp->mask1);
+  JXL_RETURN_IF_ERROR(Mask(temp->mask0, temp->mask1, params, blur_temp, temp,
+                           mask, diff_ac));
   return true;
 }
 
@@ -1642,8 +1655,9 @@ Status ButteraugliDiffmapInPlace(Image3F& image0, Image3F& image1,
     CombineChannelsForMasking(&hf1[0], &uhf1[0], &mask1);
     DeallocateHFAndUHF(&hf1[0], &uhf1[0]);
     DeallocateHFAndUHF(&hf0[0], &uhf0[0]);
-    JXL_RETURN_IF_ERROR(
-        Mask(mask0, mask1, params, &blur_temp, &mask, &block_diff_ac));
+    MaskTemp mask_temp;
+    JXL_RETURN_IF_ERROR(Mask(mask0, mask1, params, &blur_temp, &mask_temp,
+                             &mask, &block_diff_ac));
   }
 
   // compute final diffmap from mask image and ac and dc diff images
@@ -1775,86 +1789,177 @@ static void AddSupersampled2x(const ImageF& src, float w, ImageF& dest) {
   }
 }
 
-Image3F* ButteraugliComparator::Temp() const {
-  bool was_in_use = temp_in_use_.test_and_set(std::memory_order_acq_rel);
-  if (was_in_use) return nullptr;
-  return &temp_;
+StatusOr<ImageF> ButteraugliComparator::AcquirePlane(
+    JxlMemoryManager* memory_manager) const {
+  {
+    std::lock_guard<std::mutex> lock(free_planes_mutex_);
+    if (!free_planes_.empty()) {
+      ImageF plane = std::move(free_planes_.back());
+      free_planes_.pop_back();
+      return plane;
+    }
+  }
+  return ImageF::Create(memory_manager, xsize_, ysize_);
 }
 
-void ButteraugliComparator::ReleaseTemp() const { temp_in_use_.clear(); }
+StatusOr<Image3F> ButteraugliComparator::AcquireImage3(
+    JxlMemoryManager* memory_manager) const {
+  Image3F image;
+  for (size_t c = 0; c < 3; ++c) {
+    JXL_ASSIGN_OR_RETURN(image.Plane(c), AcquirePlane(memory_manager));
+  }
+  return image;
+}
+
+void ButteraugliComparator::Release(ImageF& plane) const {
+  if (plane.xsize() == xsize_ && plane.ysize() == ysize_) {
+    std::lock_guard<std::mutex> lock(free_planes_mutex_);
+    free_planes_.push_back(std::move(plane));
+  }
+  plane = ImageF();
+}
+
+void ButteraugliComparator::Release(Image3F& image) const {
+  for (size_t c = 0; c < 3; ++c) Release(image.Plane(c));
+}
+
+Status ButteraugliComparator::AcquirePsychoImage(const Image3F& xyb,
+                                                 PsychoImage& pi) const {
+  JxlMemoryManager* memory_manager = xyb.memory_manager();
+  JXL_ASSIGN_OR_RETURN(pi.lf, AcquireImage3(memory_manager));
+  JXL_ASSIGN_OR_RETURN(pi.mf, AcquireImage3(memory_manager));
+  for (size_t c = 0; c < 2; ++c) {
+    JXL_ASSIGN_OR_RETURN(pi.hf[c], AcquirePlane(memory_manager));
+    JXL_ASSIGN_OR_RETURN(pi.uhf[c], AcquirePlane(memory_manager));
+  }
+  return HWY_DYNAMIC_DISPATCH(SeparateFrequencies)(xsize_, ysize_, params_,
+                                                   &blur_temp_, xyb, pi);
+}
 
 ButteraugliComparator::ButteraugliComparator(size_t xsize, size_t ysize,
                                              const ButteraugliParams& params)
-    : xsize_(xsize), ysize_(ysize), params_(params) {}
+    : xsize_(xsize),
+      ysize_(ysize),
+      image_xsize_(xsize),
+      image_ysize_(ysize),
+      params_(params) {}
 
 StatusOr<std::unique_ptr<ButteraugliComparator>> ButteraugliComparator::Make(
     const Image3F& rgb0, const ButteraugliParams& params) {
+  if (!params.approximate) {
+    return MakeScale(rgb0, params, /*multiscale=*/true);
+  }
+  if (rgb0.xsize() < 16 || rgb0.ysize() < 16) {
+    ButteraugliParams full_params = params;
+    full_params.approximate = false;
+    return MakeScale(rgb0, full_params, /*multiscale=*/true);
+  }
+  JXL_ASSIGN_OR_RETURN(Image3F subsampled_rgb0, SubSample2x(rgb0));
+  JXL_ASSIGN_OR_RETURN(
+      std::unique_ptr<ButteraugliComparator> result,
+      MakeScale(subsampled_rgb0, params, /*multiscale=*/false));
+  result->image_xsize_ = rgb0.xsize();
+  result->image_ysize_ = rgb0.ysize();
+  return result;
+}
+
+StatusOr<std::unique_ptr<ButteraugliComparator>>
+ButteraugliComparator::MakeScale(const Image3F& rgb0,
+                                 const ButteraugliParams& params,
+                                 bool multiscale) {
   size_t xsize = rgb0.xsize();
   size_t ysize = rgb0.ysize();
   JxlMemoryManager* memory_manager = rgb0.memory_manager();
   std::unique_ptr<ButteraugliComparator> result =
       std::unique_ptr<ButteraugliComparator>(
           new ButteraugliComparator(xsize, ysize, params));
-  JXL_ASSIGN_OR_RETURN(result->temp_,
-                       Image3F::Create(memory_manager, xsize, ysize));
 
   if (xsize < 8 || ysize < 8) {
     return result;
   }
 
-  JXL_ASSIGN_OR_RETURN(Image3F xyb0,
-                       Image3F::Create(memory_manager, xsize, ysize));
+  // The intermediate images go to the pool, to be reused by the first
+  // comparison.
+  JXL_ASSIGN_OR_RETURN(Image3F xyb0, result->AcquireImage3(memory_manager));
+  JXL_ASSIGN_OR_RETURN(Image3F blurred,
+                       result->AcquireImage3(memory_manager));
   JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(OpsinDynamicsImage)(
-      rgb0, params, result->Temp(), &result->blur_temp_, &xyb0));
-  result->ReleaseTemp();
+      rgb0, params, &blurred, &result->blur_temp_, &xyb0));
+  result->Release(blurred);
   JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(SeparateFrequencies)(
       xsize, ysize, params, &result->blur_temp_, xyb0, result->pi0_));
+  result->Release(xyb0);
+  if (!multiscale) return result;
 
   // Awful recursive construction of samples of different resolution.
   // This is an after-thought and possibly somewhat parallel in
   // functionality with the PsychoImage multi-resolution approach.
   JXL_ASSIGN_OR_RETURN(Image3F subsampledRgb0, SubSample2x(rgb0));
   JXL_ASSIGN_OR_RETURN(result->sub_,
-                       ButteraugliComparator::Make(subsampledRgb0, params));
+                       MakeScale(subsampledRgb0, params, /*multiscale=*/true));
   return result;
 }
 
 Status ButteraugliComparator::Mask(ImageF* BUTTERAUGLI_RESTRICT mask) const {
-  return HWY_DYNAMIC_DISPATCH(MaskPsychoImage)(
-      pi0_, pi0_, xsize_, ysize_, params_, &blur_temp_, mask, nullptr);
+  MaskTemp mask_temp;
+  return HWY_DYNAMIC_DISPATCH(MaskPsychoImage)(pi0_, pi0_, xsize_, ysize_,
+                                               params_, &blur_temp_,
+                                               &mask_temp, mask, nullptr);
 }
 
 Status ButteraugliComparator::Diffmap(const Image3F& rgb1,
                                       ImageF& result) const {
   JxlMemoryManager* memory_manager = rgb1.memory_manager();
+  if (params_.approximate) {
+    JXL_ASSIGN_OR_RETURN(Image3F subsampled_rgb1, SubSample2x(rgb1));
+    ImageF subresult;
+    JXL_RETURN_IF_ERROR(DiffmapSingleScale(subsampled_rgb1, subresult));
+    // Nearest neighbour upsampling keeps the maximum of the diffmap.
+    JXL_ASSIGN_OR_RETURN(
+        result, ImageF::Create(memory_manager, image_xsize_, image_ysize_));
+    for (size_t y = 0; y < image_ysize_; ++y) {
+      const float* BUTTERAUGLI_RESTRICT row_in = subresult.ConstRow(y / 2);
+      float* BUTTERAUGLI_RESTRICT row_out = result.Row(y);
+      for (size_t x = 0; x < image_xsize_; ++x) {
+        row_out[x] = row_in[x / 2];
+      }
+    }
+    return true;
+  }
   if (xsize_ < 8 || ysize_ < 8) {
     ZeroFillImage(&result);
     return true;
   }
-  JXL_ASSIGN_OR_RETURN(Image3F xyb1,
-                       Image3F::Create(memory_manager, xsize_, ysize_));
-  JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(OpsinDynamicsImage)(
-      rgb1, params_, Temp(), &blur_temp_, &xyb1));
-  ReleaseTemp();
-  JXL_RETURN_IF_ERROR(DiffmapOpsinDynamicsImage(xyb1, result));
+  JXL_RETURN_IF_ERROR(DiffmapSingleScale(rgb1, result));
   if (sub_) {
     if (sub_->xsize_ < 8 || sub_->ysize_ < 8) {
       return true;
     }
-    JXL_ASSIGN_OR_RETURN(
-        Image3F sub_xyb,
-        Image3F::Create(memory_manager, sub_->xsize_, sub_->ysize_));
     JXL_ASSIGN_OR_RETURN(Image3F subsampledRgb1, SubSample2x(rgb1));
-    JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(OpsinDynamicsImage)(
-        subsampledRgb1, params_, sub_->Temp(), &sub_->blur_temp_, &sub_xyb));
-    sub_->ReleaseTemp();
     ImageF subresult;
-    JXL_RETURN_IF_ERROR(sub_->DiffmapOpsinDynamicsImage(sub_xyb, subresult));
+    JXL_RETURN_IF_ERROR(sub_->DiffmapSingleScale(subsampledRgb1, subresult));
     AddSupersampled2x(subresult, 0.5, result);
   }
   return true;
 }
 
+Status ButteraugliComparator::DiffmapSingleScale(const Image3F& rgb1,
+                                                 ImageF& result) const {
+  JxlMemoryManager* memory_manager = rgb1.memory_manager();
+  JXL_ASSIGN_OR_RETURN(Image3F xyb1, AcquireImage3(memory_manager));
+  {
+    JXL_ASSIGN_OR_RETURN(Image3F blurred, AcquireImage3(memory_manager));
+    JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(OpsinDynamicsImage)(
+        rgb1, params_, &blurred, &blur_temp_, &xyb1));
+    Release(blurred);
+  }
+  PsychoImage pi1;
+  JXL_RETURN_IF_ERROR(AcquirePsychoImage(xyb1, pi1));
+  Release(xyb1);
+  JXL_ASSIGN_OR_RETURN(result, ImageF::Create(memory_manager, xsize_, ysize_));
+  return DiffmapPsychoImage(pi1, &pi1, result);
+}
+
 Status ButteraugliComparator::DiffmapOpsinDynamicsImage(const Image3F& xyb1,
                                                         ImageF& result) const {
   JxlMemoryManager* memory_manager = xyb1.memory_manager();
@@ -1863,10 +1968,9 @@ Status ButteraugliComparator::DiffmapOpsinDynamicsImage(const Image3F& xyb1,
     return true;
   }
   PsychoImage pi1;
-  JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(SeparateFrequencies)(
-      xsize_, ysize_, params_, &blur_temp_, xyb1, pi1));
+  JXL_RETURN_IF_ERROR(AcquirePsychoImage(xyb1, pi1));
   JXL_ASSIGN_OR_RETURN(result, ImageF::Create(memory_manager, xsize_, ysize_));
-  return DiffmapPsychoImage(pi1, result);
+  return DiffmapPsychoImage(pi1, &pi1, result);
 }
 
 namespace {
@@ -1891,6 +1995,12 @@ Status MaltaDiffMapLF(const ImageF& lum0, const ImageF& lum1,
 
 Status ButteraugliComparator::DiffmapPsychoImage(const PsychoImage& pi1,
                                                  ImageF& diffmap) const {
+  return DiffmapPsychoImage(pi1, nullptr, diffmap);
+}
+
+Status ButteraugliComparator::DiffmapPsychoImage(const PsychoImage& pi1,
+                                                 PsychoImage* consumed_pi1,
+                                                 ImageF& diffmap) const {
   JxlMemoryManager* memory_manager = diffmap.memory_manager();
   if (xsize_ < 8 || ysize_ < 8) {
     ZeroFillImage(&diffmap);
@@ -1900,10 +2010,8 @@ Status ButteraugliComparator::DiffmapPsychoImage(const PsychoImage& pi1,
   const float hf_asymmetry_ = params_.hf_asymmetry;
   const float xmul_ = params_.xmul;
 
-  JXL_ASSIGN_OR_RETURN(ImageF diffs,
-                       ImageF::Create(memory_manager, xsize_, ysize_));
-  JXL_ASSIGN_OR_RETURN(Image3F block_diff_ac,
-                       Image3F::Create(memory_manager, xsize_, ysize_));
+  JXL_ASSIGN_OR_RETURN(ImageF diffs, AcquirePlane(memory_manager));
+  JXL_ASSIGN_OR_RETURN(Image3F block_diff_ac, AcquireImage3(memory_manager));
   ZeroFillImage(&block_diff_ac);
   JXL_RETURN_IF_ERROR(MaltaDiffMap(
       pi0_.uhf[1], pi1.uhf[1], wUhfMalta * hf_asymmetry_,
@@ -1924,9 +2032,9 @@ Status ButteraugliComparator::DiffmapPsychoImage(const PsychoImage& pi1,
   JXL_RETURN_IF_ERROR(MaltaDiffMapLF(pi0_.mf.Plane(0), pi1.mf.Plane(0),
                                      wMfMaltaX, wMfMaltaX, norm1MfX, &diffs,
                                      &block_diff_ac, 0));
+  Release(diffs);
 
-  JXL_ASSIGN_OR_RETURN(Image3F block_diff_dc,
-                       Image3F::Create(memory_manager, xsize_, ysize_));
+  JXL_ASSIGN_OR_RETURN(Image3F block_diff_dc, AcquireImage3(memory_manager));
   for (size_t c = 0; c < 3; ++c) {
     if (c < 2) {  // No blue channel error accumulated at HF.
       HWY_DYNAMIC_DISPATCH(L2DiffAsymmetric)
@@ -1938,14 +2046,39 @@ Status ButteraugliComparator::DiffmapPsychoImage(const PsychoImage& pi1,
     HWY_DYNAMIC_DISPATCH(SetL2Diff)
     (pi0_.lf.Plane(c), pi1.lf.Plane(c), wmul[6 + c], &block_diff_dc.Plane(c));
   }
+  if (consumed_pi1 != nullptr) {
+    // The masking only needs the HF and UHF planes.
+    Release(consumed_pi1->mf);
+    Release(consumed_pi1->lf);
+  }
 
-  ImageF mask;
+  MaskTemp mask_temp;
+  for (ImageF* plane : {&mask_temp.mask0, &mask_temp.mask1, &mask_temp.diff0,
+                        &mask_temp.diff1, &mask_temp.blurred0,
+                        &mask_temp.blurred1}) {
+    JXL_ASSIGN_OR_RETURN(*plane, AcquirePlane(memory_manager));
+  }
+  JXL_ASSIGN_OR_RETURN(ImageF mask, AcquirePlane(memory_manager));
   JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(MaskPsychoImage)(
-      pi0_, pi1, xsize_, ysize_, params_, &blur_temp_, &mask,
+      pi0_, pi1, xsize_, ysize_, params_, &blur_temp_, &mask_temp, &mask,
       &block_diff_ac.Plane(1)));
+  for (ImageF* plane : {&mask_temp.mask0, &mask_temp.mask1, &mask_temp.diff0,
+                        &mask_temp.diff1, &mask_temp.blurred0,
+                        &mask_temp.blurred1}) {
+    Release(*plane);
+  }
+  if (consumed_pi1 != nullptr) {
+    for (size_t c = 0; c < 2; ++c) {
+      Release(consumed_pi1->hf[c]);
+      Release(consumed_pi1->uhf[c]);
+    }
+  }
 
   JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(CombineChannelsToDiffmap)(
       mask, block_diff_dc, block_diff_ac, xmul_, &diffmap));
+  Release(mask);
+  Release(block_diff_ac);
+  Release(block_diff_dc);
   return true;
 }
 
@@ -2028,6 +2161,58 @@ Status ButteraugliDiffmap(const Image3F& rgb0, const Image3F& rgb1,
   return true;
 }
 
+Status ButteraugliDiffmapTiled(const Image3F& rgb0, const Image3F& rgb1,
+                               const ButteraugliParams& params,
+                               ThreadPool* pool, ImageF& diffmap) {
+  const size_t xsize = rgb0.xsize();
+  const size_t ysize = rgb0.ysize();
+  const size_t tile_size = params.tile_size;
+  if (tile_size == 0 || (xsize <= tile_size && ysize <= tile_size)) {
+    return ButteraugliDiffmap(rgb0, rgb1, params, diffmap);
+  }
+  if (!SameSize(rgb0, rgb1)) {
+    return JXL_FAILURE("Size mismatch");
+  }
+  JxlMemoryManager* memory_manager = rgb0.memory_manager();
+  JXL_ASSIGN_OR_RETURN(diffmap, ImageF::Create(memory_manager, xsize, ysize));
+  const size_t xtiles = DivCeil(xsize, tile_size);
+  const size_t ytiles = DivCeil(ysize, tile_size);
+  const auto process_tile = [&](const uint32_t task,
+                                size_t /*thread*/) -> Status {
+    const size_t tx = task % xtiles;
+    const size_t ty = task / xtiles;
+    const Rect rect(tx * tile_size, ty * tile_size, tile_size, tile_size,
+                    xsize, ysize);
+    // The borders are even so that the half-resolution pass of each tile
+    // samples the same pixel pairs as the whole-image pass would.
+    const size_t x0 = rect.x0() - std::min(rect.x0(), kButteraugliTileBorder);
+    const size_t y0 = rect.y0() - std::min(rect.y0(), kButteraugliTileBorder);
+    const size_t x1 = std::min(rect.x1() + kButteraugliTileBorder, xsize);
+    const size_t y1 = std::min(rect.y1() + kButteraugliTileBorder, ysize);
+    const Rect padded(x0, y0, x1 - x0, y1 - y0);
+    JXL_ASSIGN_OR_RETURN(
+        Image3F tile0,
+        Image3F::Create(memory_manager, padded.xsize(), padded.ysize()));
+    JXL_ASSIGN_OR_RETURN(
+        Image3F tile1,
+        Image3F::Create(memory_manager, padded.xsize(), padded.ysize()));
+    JXL_RETURN_IF_ERROR(CopyImageTo(padded, rgb0, Rect(tile0), &tile0));
+    JXL_RETURN_IF_ERROR(CopyImageTo(padded, rgb1, Rect(tile1), &tile1));
+    JXL_ASSIGN_OR_RETURN(
+        ImageF tile_diffmap,
+        ImageF::Create(memory_manager, padded.xsize(), padded.ysize()));
+    JXL_RETURN_IF_ERROR(ButteraugliDiffmap(tile0, tile1, params, tile_diffmap));
+    const Rect inner(rect.x0() - x0, rect.y0() - y0, rect.xsize(),
+                     rect.ysize());
+    JXL_RETURN_IF_ERROR(CopyImageTo(inner, tile_diffmap, rect, &diffmap));
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, static_cast<uint32_t>(xtiles * ytiles),
+                                ThreadPool::NoInit, process_tile,
+                                "ButteraugliTiles"));
+  return true;
+}
+
 bool ButteraugliInterface(const Image3F& rgb0, const Image3F& rgb1,
                           float hf_asymmetry, float xmul, ImageF& diffmap,
                           double& diffvalue) {
@@ -2058,6 +2243,9 @@ Status ButteraugliInterfaceInPlace(Image3F&& rgb0, Image3F&& rgb1,
   if (!SameSize(rgb0, rgb1)) {
     return JXL_FAILURE("Size mismatch");
   }
+  if (params.approximate) {
+    return ButteraugliInterface(rgb0, rgb1, params, diffmap, diffvalue);
+  }
   static const int kMax = 8;
   if (xsize < kMax || ysize < kMax) {
     bool ok = ButteraugliDiffmapSmall<kMax>(rgb0, rgb1, params, diffmap);
@@ -9,13 +9,15 @@
 #ifndef LIB_EXTRAS_BUTTERAUGLI_H_
 #define LIB_EXTRAS_BUTTERAUGLI_H_
 
-#include <atomic>
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include "lib/base/compiler_specific.h"
+#include "lib/base/data_parallel.h"
 #include "lib/base/memory_manager.h"
 #include "lib/base/status.h"
 #include "lib/extras/image.h"
@@ -41,8 +43,28 @@ struct ButteraugliParams {
 
   // Number of nits that correspond to 1.0f input values.
   float intensity_target = 80.0f;
+
+  // If nonzero, ButteraugliDiffmapTiled computes the diffmap in independent
+  // tiles of at most tile_size x tile_size pixels, each extended with
+  // kButteraugliTileBorder pixels of context on every side. This bounds the
+  // working set and lets the tiles run in parallel, at the cost of small
+  // deviations from the whole-image diffmap. Should be even.
+  size_t tile_size = 0;
+
+  // If true, computes a fast approximation of the diffmap for ranking
+  // candidates, e.g. in rate control searches: a single scale on 2x
+  // downsampled images, with the blur radii halved to match, and the diffmap
+  // upsampled to the image size. Several times faster than the full diffmap,
+  // but the scores are not calibrated, so the final result should be verified
+  // with the full diffmap. Images smaller than 16x16 are not downsampled.
+  bool approximate = false;
 };
 
+// Context pixels added around each tile by ButteraugliDiffmapTiled; covers
+// the support of the largest blurs at both resolutions closely enough that
+// the deviation from the whole-image diffmap is negligible.
+static constexpr size_t kButteraugliTileBorder = 64;
+
 // ButteraugliInterface defines the public interface for butteraugli.
 //
 // It calculates the difference between rgb0 and rgb1.
@@ -163,6 +185,17 @@ struct BlurTemp {
   ImageF transposed_temp;
 };
 
+// Intermediate planes of the masking. Empty planes are allocated on demand,
+// ButteraugliComparator passes planes recycled from earlier comparisons.
+struct MaskTemp {
+  ImageF mask0;
+  ImageF mask1;
+  ImageF diff0;
+  ImageF diff1;
+  ImageF blurred0;
+  ImageF blurred1;
+};
+
 class ButteraugliComparator {
  public:
   // Butteraugli is calibrated at xmul = 1.0. We add a multiplier here so that
@@ -177,7 +210,9 @@ class ButteraugliComparator {
   // constructor and the distorted image give here.
   Status Diffmap(const Image3F &rgb1, ImageF &result) const;
 
-  // Same as above, but OpsinDynamicsImage() was already applied.
+  // Same as above, but OpsinDynamicsImage() was already applied. In
+  // approximate mode, this and the functions below work on the downsampled
+  // images.
   Status DiffmapOpsinDynamicsImage(const Image3F &xyb1, ImageF &result) const;
 
   // Same as above, but the frequency decomposition was already applied.
@@ -188,18 +223,47 @@ class ButteraugliComparator {
  private:
   ButteraugliComparator(size_t xsize, size_t ysize,
                         const ButteraugliParams &params);
-  Image3F *Temp() const;
-  void ReleaseTemp() const;
+  // Creates the comparator of rgb0 at its resolution, and if multiscale is
+  // true, of the lower resolutions recursively.
+  static StatusOr<std::unique_ptr<ButteraugliComparator>> MakeScale(
+      const Image3F &rgb0, const ButteraugliParams &params, bool multiscale);
+
+  // Returns planes of xsize_ x ysize_, recycled from free_planes_ if there
+  // are any.
+  StatusOr<ImageF> AcquirePlane(JxlMemoryManager *memory_manager) const;
+  StatusOr<Image3F> AcquireImage3(JxlMemoryManager *memory_manager) const;
+  // Moves the planes to free_planes_, which leaves them empty.
+  void Release(ImageF &plane) const;
+  void Release(Image3F &image) const;
+
+  // Computes the diffmap at the resolution of this comparator, without the
+  // lower resolutions.
+  Status DiffmapSingleScale(const Image3F &rgb1, ImageF &result) const;
+
+  // Separates the frequencies of xyb into recycled planes.
+  Status AcquirePsychoImage(const Image3F &xyb, PsychoImage &pi) const;
+
+  // Same as DiffmapPsychoImage(pi1, diffmap), but if consumed_pi1 is not null,
+  // it must point to pi1, and its planes are released as soon as they are not
+  // needed any more, to reduce the peak memory usage.
+  Status DiffmapPsychoImage(const PsychoImage &pi1, PsychoImage *consumed_pi1,
+                            ImageF &diffmap) const;
 
   const size_t xsize_;
   const size_t ysize_;
+  // Size of the image given to Make() and of the diffmap of Diffmap(); twice
+  // xsize_ x ysize_ (up to rounding) in approximate mode.
+  size_t image_xsize_;
+  size_t image_ysize_;
   ButteraugliParams params_;
   PsychoImage pi0_;
 
-  // Shared temporary image storage to reduce the number of allocations;
-  // obtained via Temp(), must call ReleaseTemp when no longer needed.
-  mutable Image3F temp_;
-  mutable std::atomic_flag temp_in_use_ = ATOMIC_FLAG_INIT;
+  // Planes of xsize_ x ysize_ that are not in use. The intermediate images
+  // of a comparison are recycled in the next ones, and the planes that a step
+  // no longer needs are reused by the later steps, which bounds the memory
+  // usage to the peak of one comparison.
+  mutable std::mutex free_planes_mutex_;
+  mutable std::vector<ImageF> free_planes_;
 
   mutable BlurTemp blur_temp_;
   std::unique_ptr<ButteraugliComparator> sub_;
@@ -212,6 +276,12 @@ Status ButteraugliDiffmap(const Image3F &rgb0, const Image3F &rgb1,
 Status ButteraugliDiffmap(const Image3F &rgb0, const Image3F &rgb1,
                           const ButteraugliParams &params, ImageF &diffmap);
 
+// Same as ButteraugliDiffmap, but if params.tile_size is nonzero, splits the
+// image into tiles which are processed independently on the thread pool.
+Status ButteraugliDiffmapTiled(const Image3F &rgb0, const Image3F &rgb1,
+                               const ButteraugliParams &params,
+                               ThreadPool *pool, ImageF &diffmap);
+
 double ButteraugliScoreFromDiffmap(const ImageF &diffmap,
                                    const ButteraugliParams *params = nullptr);
 
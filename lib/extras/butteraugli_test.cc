@@ -9,11 +9,13 @@
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <utility>
 
 #include "lib/base/memory_manager.h"
 #include "lib/base/random.h"
 #include "lib/base/testing.h"
+#include "lib/cms/cms.h"
 #include "lib/extras/image.h"
 #include "lib/extras/image_ops.h"
 #include "lib/extras/metrics.h"
@@ -111,5 +113,158 @@ TEST(ButteraugliInPlaceTest, LargeImage) {
   EXPECT_NEAR(distp, distp2, 1e-7);
 }
 
+TEST(ButteraugliTiledTest, LargeImage) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 1000;
+  const size_t ysize = 700;
+  TestImage img;
+  ASSERT_TRUE(img.SetDimensions(xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(auto frame, img.AddFrame());
+  frame.RandomFill(777);
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb0, GetColorImage(img.ppf()));
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb1,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  ASSERT_TRUE(CopyImageTo(rgb0, &rgb1));
+  AddUniformNoise(&rgb1, 0.02f, 7777);
+  AddEdge(&rgb1, 0.1f, xsize / 2, xsize / 2);
+  ButteraugliParams butteraugli_params;
+  ImageF diffmap;
+  ASSERT_TRUE(ButteraugliDiffmap(rgb0, rgb1, butteraugli_params, diffmap));
+  double diffval = ButteraugliScoreFromDiffmap(diffmap, &butteraugli_params);
+  JXL_TEST_ASSIGN_OR_DIE(double distp,
+                         ComputeDistanceP(diffmap, butteraugli_params, 3.0));
+  butteraugli_params.tile_size = 256;
+  ImageF diffmap2;
+  ASSERT_TRUE(ButteraugliDiffmapTiled(rgb0, rgb1, butteraugli_params,
+                                      /*pool=*/nullptr, diffmap2));
+  ASSERT_TRUE(SameSize(diffmap, diffmap2));
+  double diffval2 = ButteraugliScoreFromDiffmap(diffmap2, &butteraugli_params);
+  JXL_TEST_ASSIGN_OR_DIE(double distp2,
+                         ComputeDistanceP(diffmap2, butteraugli_params, 3.0));
+  EXPECT_NEAR(diffval, diffval2, 0.02 * diffval);
+  EXPECT_NEAR(distp, distp2, 0.01 * distp);
+}
+
+TEST(ButteraugliApproximateTest, RanksLikeFullDiffmap) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 301;
+  const size_t ysize = 200;
+  TestImage img;
+  ASSERT_TRUE(img.SetDimensions(xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(auto frame, img.AddFrame());
+  frame.RandomFill(777);
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb0, GetColorImage(img.ppf()));
+  ButteraugliParams full_params;
+  ButteraugliParams approximate_params;
+  approximate_params.approximate = true;
+  double prev_full = 0.0;
+  double prev_approximate = 0.0;
+  for (float d : {0.005f, 0.01f, 0.02f, 0.04f}) {
+    JXL_TEST_ASSIGN_OR_DIE(Image3F rgb1,
+                           Image3F::Create(memory_manager, xsize, ysize));
+    ASSERT_TRUE(CopyImageTo(rgb0, &rgb1));
+    AddUniformNoise(&rgb1, d, 7777);
+    AddEdge(&rgb1, 5 * d, xsize / 2, ysize / 4);
+    ImageF diffmap;
+    double full;
+    ASSERT_TRUE(ButteraugliInterface(rgb0, rgb1, full_params, diffmap, full));
+    ImageF approximate_diffmap;
+    double approximate;
+    ASSERT_TRUE(ButteraugliInterface(rgb0, rgb1, approximate_params,
+                                     approximate_diffmap, approximate));
+    ASSERT_TRUE(SameSize(diffmap, approximate_diffmap));
+    EXPECT_GT(full, prev_full) << d;
+    EXPECT_GT(approximate, prev_approximate) << d;
+    prev_full = full;
+    prev_approximate = approximate;
+  }
+}
+
+TEST(ButteraugliComparatorTest, ReusedComparatorMatchesFreshOne) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 301;
+  const size_t ysize = 200;
+  TestImage img;
+  ASSERT_TRUE(img.SetDimensions(xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(auto frame, img.AddFrame());
+  frame.RandomFill(777);
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb0, GetColorImage(img.ppf()));
+  ButteraugliParams params;
+  JXL_TEST_ASSIGN_OR_DIE(std::unique_ptr<ButteraugliComparator> reused,
+                         ButteraugliComparator::Make(rgb0, params));
+  for (float d : {0.04f, 0.005f, 0.02f}) {
+    JXL_TEST_ASSIGN_OR_DIE(Image3F rgb1,
+                           Image3F::Create(memory_manager, xsize, ysize));
+    ASSERT_TRUE(CopyImageTo(rgb0, &rgb1));
+    AddUniformNoise(&rgb1, d, 7777);
+    AddEdge(&rgb1, 5 * d, xsize / 2, ysize / 4);
+    JXL_TEST_ASSIGN_OR_DIE(std::unique_ptr<ButteraugliComparator> fresh,
+                           ButteraugliComparator::Make(rgb0, params));
+    ImageF expected;
+    ASSERT_TRUE(fresh->Diffmap(rgb1, expected));
+    // The second call on the same comparator runs on recycled planes.
+    for (int i = 0; i < 2; ++i) {
+      ImageF diffmap;
+      ASSERT_TRUE(reused->Diffmap(rgb1, diffmap));
+      ASSERT_TRUE(SameSize(expected, diffmap));
+      for (size_t y = 0; y < ysize; ++y) {
+        for (size_t x = 0; x < xsize; ++x) {
+          ASSERT_EQ(expected.ConstRow(y)[x], diffmap.ConstRow(y)[x]);
+        }
+      }
+    }
+  }
+}
+
+TEST(ReferenceMetricStateTest, MatchesSingleComparisons) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 256;
+  const size_t ysize = 128;
+  TestImage ref;
+  ASSERT_TRUE(ref.SetDimensions(xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(auto ref_frame, ref.AddFrame());
+  ref_frame.RandomFill(777);
+  JXL_TEST_ASSIGN_OR_DIE(std::unique_ptr<ReferenceMetricState> state,
+                         ReferenceMetricState::Create(memory_manager,
+                                                      ref.ppf()));
+  for (uint16_t seed : {1, 2}) {
+    TestImage distorted;
+    ASSERT_TRUE(distorted.SetDimensions(xsize, ysize));
+    JXL_TEST_ASSIGN_OR_DIE(auto frame, distorted.AddFrame());
+    frame.RandomFill(seed);
+    float score;
+    ASSERT_TRUE(state->ButteraugliDistance(distorted.ppf(), score));
+    EXPECT_EQ(score,
+              ButteraugliDistance(memory_manager, ref.ppf(), distorted.ppf()));
+    JXL_TEST_ASSIGN_OR_DIE(double psnr, state->ComputePSNR(distorted.ppf()));
+    EXPECT_EQ(psnr, ComputePSNR(memory_manager, ref.ppf(), distorted.ppf(),
+                                *JxlGetDefaultCms()));
+  }
+}
+
+TEST(MetricsTest, PackedPSNRMatchesConvertedPSNR) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  for (size_t num_channels : {1, 3, 4}) {
+    // Big-endian samples are not read directly, so they take the conversion
+    // path.
+    double psnr[2];
+    for (JxlEndianness endianness : {JXL_LITTLE_ENDIAN, JXL_BIG_ENDIAN}) {
+      TestImage images[2];
+      for (uint16_t seed : {1, 2}) {
+        TestImage& image = images[seed - 1];
+        ASSERT_TRUE(image.SetDimensions(67, 33));
+        ASSERT_TRUE(image.SetChannels(num_channels));
+        image.SetAllBitDepths(16).SetEndianness(endianness);
+        JXL_TEST_ASSIGN_OR_DIE(auto frame, image.AddFrame());
+        frame.RandomFill(seed);
+      }
+      psnr[endianness == JXL_BIG_ENDIAN] =
+          ComputePSNR(memory_manager, images[0].ppf(), images[1].ppf(),
+                      *JxlGetDefaultCms());
+    }
+    EXPECT_NEAR(psnr[0], psnr[1], 1e-4) << num_channels;
+  }
+}
+
 }  // namespace
 }  // namespace jxl
@@ -4,10 +4,12 @@
 // license that can be found in the LICENSE file or at
 // https://developers.google.com/open-source/licenses/bsd
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 
+#include "lib/base/common.h"
 #include "lib/base/compiler_specific.h"
 #include "lib/base/data_parallel.h"
 #include "lib/base/status.h"
@@ -108,7 +110,9 @@ class Separable5Impl {
     }
   }
 
-  template <size_t kSizeModN, bool kBorder>
+  // If !kMainLoop, only the first/last vectors are written; the interior of
+  // the row is left to ConvolveColumns.
+  template <size_t kSizeModN, bool kBorder, bool kMainLoop = true>
   JXL_NOINLINE void ConvolveRow(const uint32_t y) {
     const D d;
     const int64_t stride = in->PixelsPerRow();
@@ -184,6 +188,7 @@ class Separable5Impl {
 
     // Main loop: load inputs without padding
     for (; x + Lanes(d) + kRadius <= xsize; x += Lanes(d)) {
+      if (!kMainLoop) continue;  // Done by ConvolveColumns.
       const V conv0 = Mul(HorzConvolve(row_m + x, wh0, wh1, wh2), wv0);
 
       const V conv1t = HorzConvolve(row_t1 + x, wh0, wh1, wh2);
@@ -271,18 +276,70 @@ class Separable5Impl {
     }
   }
 
+  // Interior rows are processed in strips of kStripRows. Within a strip, the
+  // main part of each row is convolved by ConvolveColumns, which reuses the
+  // horizontal convolution of each input row for all five output rows that
+  // depend on it.
+  static constexpr size_t kStripRows = 32;
+
   template <size_t kSizeModN>
   JXL_INLINE void RunInteriorRows(const size_t ybegin, const size_t yend) {
-    const auto process_row = [&](const uint32_t y, size_t /*thread*/) HWY_ATTR {
-      ConvolveRow<kSizeModN, false>(y);
+    const uint32_t num_strips =
+        static_cast<uint32_t>(DivCeil(yend - ybegin, kStripRows));
+    const auto process_strip = [&](const uint32_t strip,
+                                   size_t /*thread*/) HWY_ATTR {
+      const size_t y0 = ybegin + strip * kStripRows;
+      const size_t y1 = std::min(y0 + kStripRows, yend);
+      for (size_t y = y0; y < y1; ++y) {
+        ConvolveRow<kSizeModN, false, /*kMainLoop=*/false>(y);
+      }
+      ConvolveColumns(y0, y1);
       return true;
     };
-    Status status = RunOnPool(pool, ybegin, yend, ThreadPool::NoInit,
-                              process_row, "Convolve");
+    Status status = RunOnPool(pool, 0, num_strips, ThreadPool::NoInit,
+                              process_strip, "Convolve");
     JXL_DASSERT(status);
     (void)status;
   }
 
+  // Same result as the main loop of ConvolveRow for rows [ybegin, yend), which
+  // must have kRadius valid rows above and below. Walks down each column of
+  // vectors, holding the horizontal convolutions of the 5-row vertical window
+  // in registers so that each input row is only convolved horizontally once.
+  JXL_NOINLINE void ConvolveColumns(const size_t ybegin, const size_t yend) {
+    const D d;
+    const int64_t stride = in->PixelsPerRow();
+    const size_t xsize = rect.xsize();
+
+    const V wh0 = LoadDup128(d, weights->horz + 0 * 4);
+    const V wh1 = LoadDup128(d, weights->horz + 1 * 4);
+    const V wh2 = LoadDup128(d, weights->horz + 2 * 4);
+    const V wv0 = LoadDup128(d, weights->vert + 0 * 4);
+    const V wv1 = LoadDup128(d, weights->vert + 1 * 4);
+    const V wv2 = LoadDup128(d, weights->vert + 2 * 4);
+
+    // Skip the vectors handled by HorzConvolveFirst, as in ConvolveRow.
+    size_t x = RoundUpTo(static_cast<size_t>(kRadius), Lanes(d));
+    for (; x + Lanes(d) + kRadius <= xsize; x += Lanes(d)) {
+      const float* JXL_RESTRICT pos = rect.ConstRow(*in, ybegin) + x;
+      V conv_t2 = HorzConvolve(pos - 2 * stride, wh0, wh1, wh2);
+      V conv_t1 = HorzConvolve(pos - 1 * stride, wh0, wh1, wh2);
+      V conv_m = HorzConvolve(pos, wh0, wh1, wh2);
+      V conv_b1 = HorzConvolve(pos + 1 * stride, wh0, wh1, wh2);
+      for (size_t y = ybegin; y < yend; ++y, pos += stride) {
+        const V conv_b2 = HorzConvolve(pos + 2 * stride, wh0, wh1, wh2);
+        const V conv0 = Mul(conv_m, wv0);
+        const V conv1 = MulAdd(Add(conv_t1, conv_b1), wv1, conv0);
+        const V conv2 = MulAdd(Add(conv_t2, conv_b2), wv2, conv1);
+        Store(conv2, d, out->Row(y) + x);
+        conv_t2 = conv_t1;
+        conv_t1 = conv_m;
+        conv_m = conv_b1;
+        conv_b1 = conv_b2;
+      }
+    }
+  }
+
   // Returns IndicesFromVec(d, indices) such that TableLookupLanes on the
   // rightmost unaligned vector (rightmost sample in its most-significant lane)
   // returns the mirrored values, with the mirror outside the last valid sample.
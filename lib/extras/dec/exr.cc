@@ -6,6 +6,7 @@
 
 #include "lib/extras/dec/exr.h"
 
+#include <cstddef>
 #include <cstdint>
 
 #include "lib/base/span.h"
@@ -20,6 +21,8 @@ namespace jxl {
 namespace extras {
 bool CanDecodeEXR() { return false; }
 
+void SetEXRDecodeThreads(size_t num_threads) { (void)num_threads; }
+
 Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
                       PackedPixelFile* ppf,
                       const SizeConstraints* constraints) {
@@ -38,10 +41,10 @@ Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
 #include <ImfRgba.h>
 #include <ImfRgbaFile.h>
 #include <ImfStandardAttributes.h>
+#include <ImfThreading.h>
 #include <OpenEXRConfig.h>
 
 #include <algorithm>
-#include <cstddef>
 #include <cstring>
 #include <memory>
 #include <utility>
@@ -128,6 +131,10 @@ class InMemoryIStream : public OpenEXR::IStream {
 
 bool CanDecodeEXR() { return true; }
 
+void SetEXRDecodeThreads(size_t num_threads) {
+  OpenEXR::setGlobalThreadCount(static_cast<int>(num_threads));
+}
+
 Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
                       PackedPixelFile* ppf,
                       const SizeConstraints* constraints) {
@@ -184,42 +191,55 @@ Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
   }
   const auto& frame = ppf->frames.back();
 
-  const int row_size = input.dataWindow().size().x + 1;
-  // Number of rows to read at a time.
-  // https://www.openexr.com/documentation/ReadingAndWritingImageFiles.pdf
-  // recommends reading the whole file at once.
-  const int y_chunk_size = input.displayWindow().size().y + 1;
-  std::vector<OpenEXR::Rgba> input_rows(row_size * y_chunk_size);
-  for (int start_y =
-           std::max(input.dataWindow().min.y, input.displayWindow().min.y);
-       start_y <=
-       std::min(input.dataWindow().max.y, input.displayWindow().max.y);
-       start_y += y_chunk_size) {
-    // Inclusive.
-    const int end_y = std::min(
-        start_y + y_chunk_size - 1,
-        std::min(input.dataWindow().max.y, input.displayWindow().max.y));
+  const auto& data_window = input.dataWindow();
+  const auto& display_window = input.displayWindow();
+  const int row_size = data_window.size().x + 1;
+  const int first_x = std::max(data_window.min.x, display_window.min.x);
+  const int last_x = std::min(data_window.max.x, display_window.max.x);
+  const int first_y = std::max(data_window.min.y, display_window.min.y);
+  const int last_y = std::min(data_window.max.y, display_window.max.y);
+  if (has_alpha && data_window.min.x == display_window.min.x &&
+      data_window.max.x == display_window.max.x && first_y <= last_y &&
+      frame.color.stride % sizeof(OpenEXR::Rgba) == 0) {
+    // The frame has the same layout as the OpenEXR::Rgba rows, so the pixels
+    // are decoded right into it in one call, which OpenEXR splits between
+    // its worker threads.
+    static_assert(sizeof(OpenEXR::Rgba) == 4 * kExrBitsPerSample / 8,
+                  "OpenEXR::Rgba is not made of four halfs");
+    const size_t y_stride = frame.color.stride / sizeof(OpenEXR::Rgba);
+    OpenEXR::Rgba* frame_pixels =
+        static_cast<OpenEXR::Rgba*>(frame.color.pixels());
     input.setFrameBuffer(
-        input_rows.data() - input.dataWindow().min.x - start_y * row_size,
-        /*xStride=*/1, /*yStride=*/row_size);
-    input.readPixels(start_y, end_y);
-    for (int exr_y = start_y; exr_y <= end_y; ++exr_y) {
-      const int image_y = exr_y - input.displayWindow().min.y;
-      const OpenEXR::Rgba* const JXL_RESTRICT input_row =
-          &input_rows[(exr_y - start_y) * row_size];
-      uint8_t* row = static_cast<uint8_t*>(frame.color.pixels()) +
-                     frame.color.stride * image_y;
-      const uint32_t pixel_size =
-          (3 + (has_alpha ? 1 : 0)) * kExrBitsPerSample / 8;
-      for (int exr_x =
-               std::max(input.dataWindow().min.x, input.displayWindow().min.x);
-           exr_x <=
-           std::min(input.dataWindow().max.x, input.displayWindow().max.x);
-           ++exr_x) {
-        const int image_x = exr_x - input.displayWindow().min.x;
-        // TODO(eustas): UB: OpenEXR::Rgba is not TriviallyCopyable
-        memcpy(row + image_x * pixel_size,
-               input_row + (exr_x - input.dataWindow().min.x), pixel_size);
+        frame_pixels - data_window.min.x - display_window.min.y * y_stride,
+        /*xStride=*/1, /*yStride=*/y_stride);
+    input.readPixels(first_y, last_y);
+  } else {
+    // Reads a chunk of rows at a time, so that only the chunk is kept in the
+    // OpenEXR::Rgba format, and its line buffers are still decoded on the
+    // worker threads of OpenEXR.
+    constexpr int kRowsPerChunk = 256;
+    std::vector<OpenEXR::Rgba> input_rows(row_size * kRowsPerChunk);
+    const uint32_t pixel_size =
+        (3 + (has_alpha ? 1 : 0)) * kExrBitsPerSample / 8;
+    for (int start_y = first_y; start_y <= last_y; start_y += kRowsPerChunk) {
+      // Inclusive.
+      const int end_y = std::min(start_y + kRowsPerChunk - 1, last_y);
+      input.setFrameBuffer(
+          input_rows.data() - data_window.min.x - start_y * row_size,
+          /*xStride=*/1, /*yStride=*/row_size);
+      input.readPixels(start_y, end_y);
+      for (int exr_y = start_y; exr_y <= end_y; ++exr_y) {
+        const int image_y = exr_y - display_window.min.y;
+        const OpenEXR::Rgba* const JXL_RESTRICT input_row =
+            &input_rows[(exr_y - start_y) * row_size];
+        uint8_t* row = static_cast<uint8_t*>(frame.color.pixels()) +
+                       frame.color.stride * image_y;
+        for (int exr_x = first_x; exr_x <= last_x; ++exr_x) {
+          const int image_x = exr_x - display_window.min.x;
+          // TODO(eustas): UB: OpenEXR::Rgba is not TriviallyCopyable
+          memcpy(row + image_x * pixel_size,
+                 input_row + (exr_x - data_window.min.x), pixel_size);
+        }
       }
     }
   }
@@ -9,6 +9,7 @@
 
 // Decodes OpenEXR images in memory.
 
+#include <cstddef>
 #include <cstdint>
 
 #include "lib/base/span.h"
@@ -25,6 +26,11 @@ class PackedPixelFile;
 
 bool CanDecodeEXR();
 
+// Sets the number of worker threads of OpenEXR that decode the line buffers of
+// the images in parallel. With 0 (the default), the images are decoded on the
+// calling thread. This is a process-wide setting of OpenEXR.
+void SetEXRDecodeThreads(size_t num_threads);
+
 // Decodes `bytes` into `ppf`. color_hints are ignored.
 Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
                       PackedPixelFile* ppf,
@@ -6,6 +6,7 @@
 
 #include "lib/extras/dec/gif.h"
 
+#include <cstddef>
 #include <cstdint>
 
 #include "lib/base/span.h"
@@ -24,6 +25,12 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
                       const SizeConstraints* constraints) {
   return false;
 }
+Status DecodeImageGIFFrame(Span<const uint8_t> bytes,
+                           const ColorHints& color_hints, size_t frame_index,
+                           PackedPixelFile* ppf,
+                           const SizeConstraints* constraints) {
+  return false;
+}
 }  // namespace extras
 }  // namespace jxl
 
@@ -37,6 +44,7 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
 #include <utility>
 #include <vector>
 
+#include "lib/base/printf_macros.h"
 #include "lib/base/rect.h"
 #include "lib/base/sanitizers.h"
 #include "lib/base/types.h"
@@ -64,6 +72,45 @@ struct PackedRgb {
   uint8_t r, g, b;
 };
 
+int ReadFromSpan(GifFileType* const gif, GifByteType* const bytes, int n) {
+  ReadState* const state = reinterpret_cast<ReadState*>(gif->UserData);
+  // giflib API requires the input size `n` to be signed int.
+  if (static_cast<size_t>(n) > state->bytes.size()) {
+    n = state->bytes.size();
+  }
+  memcpy(bytes, state->bytes.data(), n);
+  if (!state->bytes.remove_prefix(n)) return 0;
+  return n;
+}
+
+// Opens the GIF file of state->bytes, which must outlive *gif. Returns false
+// without an error message if the bytes are not a GIF file.
+Status OpenGif(ReadState* state, GifUniquePtr* gif) {
+  int error = GIF_OK;
+  gif->reset(DGifOpen(state, ReadFromSpan, &error));
+  if (*gif == nullptr) {
+    if (error == D_GIF_ERR_NOT_GIF_FILE) {
+      // Not an error.
+      return false;
+    } else {
+      return JXL_FAILURE("Failed to read GIF: %s", GifErrorString(error));
+    }
+  }
+  return true;
+}
+
+PackedRgba GetBackgroundColor(const GifFileType* gif) {
+  GifColorType background_color;
+  if (gif->SColorMap == nullptr ||
+      gif->SBackGroundColor >= gif->SColorMap->ColorCount) {
+    background_color = {0, 0, 0};
+  } else {
+    background_color = gif->SColorMap->Colors[gif->SBackGroundColor];
+  }
+  return PackedRgba{background_color.Red, background_color.Green,
+                    background_color.Blue, 0};
+}
+
 Status ensure_have_alpha(PackedFrame* frame) {
   if (!frame->extra_channels.empty()) return true;
   const JxlPixelFormat alpha_format{
@@ -88,29 +135,10 @@ bool CanDecodeGIF() { return true; }
 Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
                       PackedPixelFile* ppf,
                       const SizeConstraints* constraints) {
-  int error = GIF_OK;
   ReadState state = {bytes};
-  const auto ReadFromSpan = [](GifFileType* const gif, GifByteType* const bytes,
-                               int n) {
-    ReadState* const state = reinterpret_cast<ReadState*>(gif->UserData);
-    // giflib API requires the input size `n` to be signed int.
-    if (static_cast<size_t>(n) > state->bytes.size()) {
-      n = state->bytes.size();
-    }
-    memcpy(bytes, state->bytes.data(), n);
-    if (!state->bytes.remove_prefix(n)) return 0;
-    return n;
-  };
-  GifUniquePtr gif(DGifOpen(&state, ReadFromSpan, &error));
-  if (gif == nullptr) {
-    if (error == D_GIF_ERR_NOT_GIF_FILE) {
-      // Not an error.
-      return false;
-    } else {
-      return JXL_FAILURE("Failed to read GIF: %s", GifErrorString(error));
-    }
-  }
-  error = DGifSlurp(gif.get());
+  GifUniquePtr gif;
+  JXL_RETURN_IF_ERROR(OpenGif(&state, &gif));
+  int error = DGifSlurp(gif.get());
   if (error != GIF_OK) {
     return JXL_FAILURE("Failed to read GIF: %s", GifErrorString(gif->Error));
   }
@@ -194,21 +222,19 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
       /*align=*/0,
   };
 
-  GifColorType background_color;
-  if (gif->SColorMap == nullptr ||
-      gif->SBackGroundColor >= gif->SColorMap->ColorCount) {
-    background_color = {0, 0, 0};
-  } else {
-    background_color = gif->SColorMap->Colors[gif->SBackGroundColor];
-  }
-  const PackedRgba background_rgba{background_color.Red, background_color.Green,
-                                   background_color.Blue, 0};
+  const PackedRgba background_rgba = GetBackgroundColor(gif.get());
   JXL_ASSIGN_OR_RETURN(
       PackedFrame canvas,
       PackedFrame::Create(gif->SWidth, gif->SHeight, canvas_format));
   std::fill_n(static_cast<PackedRgba*>(canvas.color.pixels()),
               canvas.color.xsize * canvas.color.ysize, background_rgba);
   Rect canvas_rect{0, 0, canvas.color.xsize, canvas.color.ysize};
+  // The canvas is updated through a copy, whose buffer is reused for every
+  // frame.
+  JXL_ASSIGN_OR_RETURN(PackedImage new_canvas_image,
+                       PackedImage::Create(canvas.color.xsize,
+                                           canvas.color.ysize,
+                                           canvas.color.format));
 
   Rect previous_rect_if_restore_to_background;
 
@@ -327,10 +353,6 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
     }
 
     // Update the canvas by creating a copy first.
-    JXL_ASSIGN_OR_RETURN(
-        PackedImage new_canvas_image,
-        PackedImage::Create(canvas.color.xsize, canvas.color.ysize,
-                            canvas.color.format));
     memcpy(new_canvas_image.pixels(), canvas.color.pixels(),
            new_canvas_image.pixels_size);
     for (size_t y = 0, byte_index = 0; y < image_rect.ysize(); ++y) {
@@ -401,7 +423,7 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
 
     switch (gcb.DisposalMode) {
       case DISPOSE_DO_NOT:
-        canvas.color = std::move(new_canvas_image);
+        std::swap(canvas.color, new_canvas_image);
         break;
 
       case DISPOSE_BACKGROUND:
@@ -436,6 +458,183 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
   return true;
 }
 
+Status DecodeImageGIFFrame(Span<const uint8_t> bytes,
+                           const ColorHints& color_hints, size_t frame_index,
+                           PackedPixelFile* ppf,
+                           const SizeConstraints* constraints) {
+  ReadState state = {bytes};
+  GifUniquePtr gif;
+  JXL_RETURN_IF_ERROR(OpenGif(&state, &gif));
+  msan::UnpoisonMemory(gif.get(), sizeof(*gif));
+  if (gif->SColorMap) {
+    msan::UnpoisonMemory(gif->SColorMap, sizeof(*gif->SColorMap));
+    msan::UnpoisonMemory(
+        gif->SColorMap->Colors,
+        sizeof(*gif->SColorMap->Colors) * gif->SColorMap->ColorCount);
+  }
+  JXL_RETURN_IF_ERROR(
+      VerifyDimensions<uint32_t>(constraints, gif->SWidth, gif->SHeight));
+
+  const size_t xsize = gif->SWidth;
+  const size_t ysize = gif->SHeight;
+  const PackedRgba background_rgba = GetBackgroundColor(gif.get());
+  std::vector<PackedRgba> canvas(xsize * ysize, background_rgba);
+  const Rect canvas_rect(0, 0, xsize, ysize);
+
+  // The disposal of the previous frame is applied only when there is a next
+  // frame to draw, and the pixels under it are saved only if it is disposed
+  // to the previous state.
+  Rect previous_rect;
+  int previous_disposal = DISPOSAL_UNSPECIFIED;
+  std::vector<PackedRgba> previous_pixels;
+  GraphicsControlBlock gcb = {DISPOSAL_UNSPECIFIED, false, 0,
+                              NO_TRANSPARENT_COLOR};
+  std::vector<GifByteType> line;
+  for (size_t index = 0;;) {
+    GifRecordType record_type;
+    if (DGifGetRecordType(gif.get(), &record_type) != GIF_OK) {
+      return JXL_FAILURE("Failed to read GIF: %s", GifErrorString(gif->Error));
+    }
+    if (record_type == TERMINATE_RECORD_TYPE) {
+      return JXL_FAILURE("GIF has no frame %" PRIuS, frame_index);
+    }
+    if (record_type == EXTENSION_RECORD_TYPE) {
+      int ext_code;
+      GifByteType* ext;
+      if (DGifGetExtension(gif.get(), &ext_code, &ext) != GIF_OK) {
+        return JXL_FAILURE("Failed to read GIF: %s",
+                           GifErrorString(gif->Error));
+      }
+      if (ext_code == GRAPHICS_EXT_FUNC_CODE && ext != nullptr) {
+        msan::UnpoisonMemory(ext, ext[0] + 1);
+        if (DGifExtensionToGCB(ext[0], ext + 1, &gcb) != GIF_OK) {
+          return JXL_FAILURE("Invalid GIF graphics control block");
+        }
+      }
+      while (ext != nullptr) {
+        if (DGifGetExtensionNext(gif.get(), &ext) != GIF_OK) {
+          return JXL_FAILURE("Failed to read GIF: %s",
+                             GifErrorString(gif->Error));
+        }
+      }
+      continue;
+    }
+    if (record_type != IMAGE_DESC_RECORD_TYPE) continue;
+    if (DGifGetImageDesc(gif.get()) != GIF_OK) {
+      return JXL_FAILURE("Failed to read GIF: %s", GifErrorString(gif->Error));
+    }
+    const GifImageDesc& desc = gif->Image;
+    msan::UnpoisonMemory(&desc, sizeof(desc));
+    const Rect image_rect(desc.Left, desc.Top, desc.Width, desc.Height);
+    if (!image_rect.IsInside(canvas_rect)) {
+      return JXL_FAILURE("GIF frame extends outside of the canvas");
+    }
+    const ColorMapObject* const color_map =
+        desc.ColorMap ? desc.ColorMap : gif->SColorMap;
+    if (!color_map) {
+      return JXL_FAILURE("Missing GIF color map");
+    }
+    msan::UnpoisonMemory(color_map, sizeof(*color_map));
+    msan::UnpoisonMemory(color_map->Colors,
+                         sizeof(*color_map->Colors) * color_map->ColorCount);
+
+    if (previous_disposal == DISPOSE_BACKGROUND ||
+        previous_disposal == DISPOSE_PREVIOUS) {
+      for (size_t y = 0; y < previous_rect.ysize(); ++y) {
+        PackedRgba* row = &canvas[(y + previous_rect.y0()) * xsize +
+                                  previous_rect.x0()];
+        if (previous_disposal == DISPOSE_BACKGROUND) {
+          std::fill_n(row, previous_rect.xsize(), background_rgba);
+        } else {
+          std::copy_n(&previous_pixels[y * previous_rect.xsize()],
+                      previous_rect.xsize(), row);
+        }
+      }
+    }
+    if (gcb.DisposalMode == DISPOSE_PREVIOUS && index < frame_index) {
+      previous_pixels.resize(image_rect.xsize() * image_rect.ysize());
+      for (size_t y = 0; y < image_rect.ysize(); ++y) {
+        std::copy_n(&canvas[(y + image_rect.y0()) * xsize + image_rect.x0()],
+                    image_rect.xsize(),
+                    &previous_pixels[y * image_rect.xsize()]);
+      }
+    }
+
+    // The rows of interlaced frames are stored in four passes.
+    static const size_t kPassStart[4] = {0, 4, 2, 1};
+    static const size_t kPassStep[4] = {8, 8, 4, 2};
+    const size_t num_passes = desc.Interlace ? 4 : 1;
+    line.resize(image_rect.xsize());
+    for (size_t pass = 0; pass < num_passes; ++pass) {
+      const size_t y_start = desc.Interlace ? kPassStart[pass] : 0;
+      const size_t y_step = desc.Interlace ? kPassStep[pass] : 1;
+      for (size_t y = y_start; y < image_rect.ysize(); y += y_step) {
+        if (DGifGetLine(gif.get(), line.data(), desc.Width) != GIF_OK) {
+          return JXL_FAILURE("Failed to read GIF: %s",
+                             GifErrorString(gif->Error));
+        }
+        msan::UnpoisonMemory(line.data(), line.size());
+        PackedRgba* row =
+            &canvas[(y + image_rect.y0()) * xsize + image_rect.x0()];
+        for (size_t x = 0; x < image_rect.xsize(); ++x) {
+          const GifByteType byte = line[x];
+          if (byte >= color_map->ColorCount) {
+            return JXL_FAILURE("GIF color is out of bounds");
+          }
+          if (byte == gcb.TransparentColor) continue;
+          const GifColorType color = color_map->Colors[byte];
+          row[x] = PackedRgba{color.Red, color.Green, color.Blue, 255};
+        }
+      }
+    }
+    if (index == frame_index) break;
+    previous_rect = image_rect;
+    previous_disposal = gcb.DisposalMode;
+    gcb = {DISPOSAL_UNSPECIFIED, false, 0, NO_TRANSPARENT_COLOR};
+    ++index;
+  }
+
+  ppf->info.xsize = xsize;
+  ppf->info.ysize = ysize;
+  ppf->info.bits_per_sample = 8;
+  ppf->info.exponent_bits_per_sample = 0;
+  ppf->info.alpha_bits = 0;
+  ppf->info.alpha_exponent_bits = 0;
+  JXL_RETURN_IF_ERROR(ApplyColorHints(color_hints, /*color_already_set=*/false,
+                                      /*is_gray=*/false, ppf));
+  ppf->info.num_color_channels = 3;
+
+  const JxlPixelFormat packed_frame_format{
+      /*num_channels=*/3u,
+      /*data_type=*/JXL_TYPE_UINT8,
+      /*endianness=*/JXL_NATIVE_ENDIAN,
+      /*align=*/0,
+  };
+  ppf->frames.clear();
+  {
+    JXL_ASSIGN_OR_RETURN(
+        PackedFrame frame,
+        PackedFrame::Create(xsize, ysize, packed_frame_format));
+    ppf->frames.emplace_back(std::move(frame));
+  }
+  PackedFrame* frame = &ppf->frames.back();
+  PackedRgb* pixels = static_cast<PackedRgb*>(frame->color.pixels());
+  bool seen_alpha = false;
+  for (size_t i = 0; i < canvas.size(); ++i) {
+    pixels[i] = PackedRgb{canvas[i].r, canvas[i].g, canvas[i].b};
+    seen_alpha |= canvas[i].a != 255;
+  }
+  if (seen_alpha) {
+    JXL_RETURN_IF_ERROR(ensure_have_alpha(frame));
+    uint8_t* alpha = static_cast<uint8_t*>(frame->extra_channels[0].pixels());
+    for (size_t i = 0; i < canvas.size(); ++i) {
+      alpha[i] = canvas[i].a;
+    }
+    ppf->info.alpha_bits = 8;
+  }
+  return true;
+}
+
 }  // namespace extras
 }  // namespace jxl
 
@@ -9,6 +9,7 @@
 
 // Decodes GIF images in memory.
 
+#include <cstddef>
 #include <cstdint>
 
 #include "lib/base/span.h"
@@ -30,6 +31,14 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
                       PackedPixelFile* ppf,
                       const SizeConstraints* constraints = nullptr);
 
+// Decodes only the frame `frame_index` of `bytes` into `ppf`, composited onto
+// the canvas as a still image, e.g. for thumbnails. The file is read only up to
+// the end of that frame. color_hints are ignored.
+Status DecodeImageGIFFrame(Span<const uint8_t> bytes,
+                           const ColorHints& color_hints, size_t frame_index,
+                           PackedPixelFile* ppf,
+                           const SizeConstraints* constraints = nullptr);
+
 }  // namespace extras
 }  // namespace jxl
 
@@ -9,6 +9,7 @@
 #include <setjmp.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
@@ -21,10 +22,14 @@
 #include "lib/base/compiler_specific.h"
 #include "lib/base/data_parallel.h"
 #include "lib/base/sanitizers.h"
+#include "lib/base/span.h"
 #include "lib/base/status.h"
 #include "lib/base/types.h"
+#include "lib/cms/cms_interface.h"
 #include "lib/cms/color_encoding.h"
+#include "lib/cms/color_encoding_internal.h"
 #include "lib/extras/codestream_header.h"
+#include "lib/extras/image_color_transform.h"
 #include "lib/extras/packed_image.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/decode.h"
@@ -40,7 +45,7 @@ constexpr unsigned char kExifSignature[6] = {0x45, 0x78, 0x69,
 constexpr int kExifMarker = JPEG_APP0 + 1;
 constexpr int kICCMarker = JPEG_APP0 + 2;
 
-inline bool IsJPG(const std::vector<uint8_t>& bytes) {
+inline bool IsJPG(Span<const uint8_t> bytes) {
   if (bytes.size() < 2) return false;
   if (bytes[0] != 0xFF || bytes[1] != 0xD8) return false;
   return true;
@@ -90,6 +95,8 @@ JpegliDataType ConvertDataType(JxlDataType type) {
       return JPEGLI_TYPE_UINT16;
     case JXL_TYPE_FLOAT:
       return JPEGLI_TYPE_FLOAT;
+    case JXL_TYPE_FLOAT16:
+      return JPEGLI_TYPE_FLOAT16;
     default:
       return JPEGLI_TYPE_UINT8;
   }
@@ -135,6 +142,61 @@ void MyOutputMessage(j_common_ptr cinfo) {
   }
 }
 
+// Conversion of the output rows from the ICC profile of the image to sRGB,
+// applied by the decoder while the rows are rendered.
+struct OutputColorTransform {
+  CachedColorTransform transform;
+  std::atomic<bool> failed{false};
+};
+
+void TransformOutputRow(void* opaque, size_t thread, float* rows[],
+                        size_t num_channels, size_t xsize) {
+  auto* output_transform = static_cast<OutputColorTransform*>(opaque);
+  ColorSpaceTransform& c_transform = output_transform->transform.transform();
+  float* JXL_RESTRICT src_buf = c_transform.BufSrc(thread);
+  float* JXL_RESTRICT dst_buf = c_transform.BufDst(thread);
+  for (size_t c = 0; c < num_channels; ++c) {
+    const float* JXL_RESTRICT row = rows[c];
+    for (size_t x = 0; x < xsize; ++x) {
+      src_buf[x * num_channels + c] = row[x];
+    }
+  }
+  if (!c_transform.Run(thread, src_buf, dst_buf, xsize)) {
+    output_transform->failed = true;
+    return;
+  }
+  for (size_t c = 0; c < num_channels; ++c) {
+    float* JXL_RESTRICT row = rows[c];
+    for (size_t x = 0; x < xsize; ++x) {
+      row[x] = dst_buf[x * num_channels + c];
+    }
+  }
+}
+
+// Prepares the conversion of the output rows of cinfo from the color space of
+// icc to sRGB. Returns false if the profile is not one that the output rows
+// can be converted from, or if cms can not convert it.
+bool InitOutputColorTransform(j_decompress_ptr cinfo,
+                              const std::vector<uint8_t>& icc,
+                              const JxlCmsInterface& cms,
+                              OutputColorTransform* output_transform) {
+  jpegli_calc_output_dimensions(cinfo);
+  const bool is_gray = cinfo->out_color_space == JCS_GRAYSCALE;
+  if (!is_gray && cinfo->out_color_space != JCS_RGB) return false;
+  ColorEncoding c_src;
+  if (!c_src.SetICC(IccBytes(icc), &cms)) return false;
+  if (c_src.IsCMYK() || c_src.IsGray() != is_gray) return false;
+  const ColorEncoding& c_dst = ColorEncoding::SRGB(is_gray);
+  const size_t num_threads = JPEGLI_MAX_ROW_TRANSFORM_THREADS;
+  if (!output_transform->transform.Init(c_src, c_dst, 255.0f,
+                                        cinfo->output_width, num_threads,
+                                        cms)) {
+    return false;
+  }
+  jpegli_set_output_row_transform(cinfo, TransformOutputRow, output_transform);
+  return true;
+}
+
 Status UnmapColors(uint8_t* row, size_t xsize, int components,
                    JSAMPARRAY colormap, size_t num_colors) {
   JXL_ENSURE(colormap != nullptr);
@@ -149,11 +211,26 @@ Status UnmapColors(uint8_t* row, size_t xsize, int components,
   return true;
 }
 
-}  // namespace
+size_t BytesPerSample(JxlDataType type) {
+  switch (type) {
+    case JXL_TYPE_UINT16:
+    case JXL_TYPE_FLOAT16:
+      return 2;
+    case JXL_TYPE_FLOAT:
+      return 4;
+    default:
+      return 1;
+  }
+}
 
-Status DecodeJpeg(const std::vector<uint8_t>& compressed,
-                  const JpegDecompressParams& dparams, ThreadPool* pool,
-                  PackedPixelFile* ppf) {
+// The size of the strips of rows that DecodeJpegStreaming() decodes at a time.
+constexpr size_t kStreamingStripBytes = 1 << 20;
+
+// Decodes the pixels into a frame of ppf, or, if write_rows is not nullptr,
+// in strips that are passed to write_rows.
+Status DecodeJpegImpl(Span<const uint8_t> compressed,
+                      const JpegDecompressParams& dparams, ThreadPool* pool,
+                      PackedPixelFile* ppf, const JpegRowWriter* write_rows) {
   // Don't do anything for non-JPEG files (no need to report an error)
   if (!IsJPG(compressed)) return false;
 
@@ -161,7 +238,9 @@ Status DecodeJpeg(const std::vector<uint8_t>& compressed,
 
   // We need to declare all the non-trivial destructor local variables before
   // the call to setjmp().
-  std::unique_ptr<JSAMPLE[]> row;
+  std::vector<uint8_t> strip;
+  std::vector<JSAMPROW> strip_rows;
+  OutputColorTransform output_transform;
 
   jpeg_decompress_struct cinfo;
   const auto try_catch_block = [&]() -> bool {
@@ -178,6 +257,15 @@ Status DecodeJpeg(const std::vector<uint8_t>& compressed,
     cinfo.client_data = static_cast<void*>(&env);
 
     jpegli_create_decompress(&cinfo);
+    if (dparams.memory_manager != nullptr) {
+      jpegli_set_memory_manager(reinterpret_cast<j_common_ptr>(&cinfo),
+                                dparams.memory_manager);
+    }
+    if (dparams.stage_stats != nullptr) {
+      jpegli_enable_stage_stats(reinterpret_cast<j_common_ptr>(&cinfo), TRUE);
+      jpegli_enable_stage_counters(reinterpret_cast<j_common_ptr>(&cinfo),
+                                   TRUE);
+    }
     jpegli_mem_src(&cinfo,
                    reinterpret_cast<const unsigned char*>(compressed.data()),
                    compressed.size());
@@ -204,7 +292,17 @@ Status DecodeJpeg(const std::vector<uint8_t>& compressed,
     } else if (dparams.force_grayscale) {
       cinfo.out_color_space = JCS_GRAYSCALE;
     }
-    if (ReadICCProfile(&cinfo, &ppf->icc)) {
+    cinfo.scale_num = dparams.scale_num;
+    cinfo.scale_denom = dparams.scale_denom;
+    bool has_icc = ReadICCProfile(&cinfo, &ppf->icc);
+    // The conversion to sRGB is done on the rendered rows while they are in
+    // the cache, instead of in a second pass over the decoded image.
+    if (has_icc && dparams.cms != nullptr && dparams.num_colors == 0 &&
+        InitOutputColorTransform(&cinfo, ppf->icc, *dparams.cms,
+                                 &output_transform)) {
+      has_icc = false;
+    }
+    if (has_icc) {
       ppf->primary_color_representation = PackedPixelFile::kIccIsPrimary;
     } else {
       ppf->primary_color_representation =
@@ -231,6 +329,9 @@ Status DecodeJpeg(const std::vector<uint8_t>& compressed,
     } else if (dparams.output_data_type == JXL_TYPE_FLOAT) {
       ppf->info.bits_per_sample = 32;
       ppf->info.exponent_bits_per_sample = 8;
+    } else if (dparams.output_data_type == JXL_TYPE_FLOAT16) {
+      ppf->info.bits_per_sample = 16;
+      ppf->info.exponent_bits_per_sample = 5;
     } else {
       return failure("unsupported data type");
     }
@@ -243,6 +344,10 @@ Status DecodeJpeg(const std::vector<uint8_t>& compressed,
 
     jpegli_set_output_format(&cinfo, ConvertDataType(dparams.output_data_type),
                              ConvertEndianness(dparams.output_endianness));
+    if (pool != nullptr) {
+      jpegli_set_decompress_parallel_runner(&cinfo, pool->runner(),
+                                            pool->runner_opaque());
+    }
 
     if (dparams.num_colors > 0) {
       cinfo.quantize_colors = TRUE;
@@ -253,6 +358,38 @@ Status DecodeJpeg(const std::vector<uint8_t>& compressed,
 
     jpegli_start_decompress(&cinfo);
 
+    JDIMENSION xoffset = 0;
+    JDIMENSION xsize = cinfo.output_width;
+    size_t ysize = cinfo.output_height;
+    const bool crop = dparams.crop_xsize > 0 && dparams.crop_ysize > 0;
+    if (crop) {
+      if (dparams.crop_x0 + dparams.crop_xsize > cinfo.output_width ||
+          dparams.crop_y0 + dparams.crop_ysize > cinfo.output_height) {
+        return failure("crop region is outside of the image");
+      }
+      if (dparams.crop_xsize < cinfo.output_width) {
+        xoffset = dparams.crop_x0;
+        xsize = dparams.crop_xsize;
+        jpegli_crop_scanline(&cinfo, &xoffset, &xsize);
+      }
+      ysize = dparams.crop_ysize;
+      if (dparams.crop_y0 > 0) {
+        jpegli_skip_scanlines(&cinfo, dparams.crop_y0);
+      }
+    }
+    // Reads num_rows rows of the region into rows[].
+    const auto read_rows = [&](JSAMPROW* rows, size_t num_rows) -> bool {
+      size_t num_read = 0;
+      while (num_read < num_rows) {
+        const size_t n = jpegli_read_scanlines(&cinfo, &rows[num_read],
+                                               num_rows - num_read);
+        if (n == 0) return false;
+        num_read += n;
+      }
+      return !output_transform.failed;
+    };
+    ppf->info.xsize = xsize;
+    ppf->info.ysize = ysize;
     ppf->info.num_color_channels = cinfo.out_color_components;
     const JxlPixelFormat format{
         /*num_channels=*/static_cast<uint32_t>(cinfo.out_color_components),
@@ -261,32 +398,86 @@ Status DecodeJpeg(const std::vector<uint8_t>& compressed,
         /*align=*/0,
     };
     ppf->frames.clear();
-    // Allocates the frame buffer.
-    {
-      JXL_ASSIGN_OR_RETURN(
-          PackedFrame frame,
-          PackedFrame::Create(cinfo.image_width, cinfo.image_height, format));
-      ppf->frames.emplace_back(std::move(frame));
-    }
-    const auto& frame = ppf->frames.back();
-    JXL_ENSURE(sizeof(JSAMPLE) * cinfo.out_color_components *
-                   cinfo.image_width <=
-               frame.color.stride);
     if (dparams.num_colors > 0) JXL_ENSURE(cinfo.colormap != nullptr);
-
-    for (size_t y = 0; y < cinfo.image_height; ++y) {
-      JSAMPROW rows[] = {reinterpret_cast<JSAMPLE*>(
-          static_cast<uint8_t*>(frame.color.pixels()) +
-          frame.color.stride * y)};
-      jpegli_read_scanlines(&cinfo, rows, 1);
+    if (write_rows != nullptr) {
+      // Only one strip of rows is kept in memory.
+      const size_t stride = static_cast<size_t>(xsize) *
+                            cinfo.out_color_components *
+                            BytesPerSample(dparams.output_data_type);
+      const size_t strip_height = std::min<size_t>(
+          ysize, std::max<size_t>(1, kStreamingStripBytes / stride));
+      strip.resize(strip_height * stride);
+      strip_rows.resize(strip_height);
+      for (size_t i = 0; i < strip_height; ++i) {
+        strip_rows[i] = &strip[i * stride];
+      }
+      for (size_t y = 0; y < ysize; y += strip_height) {
+        const size_t num_rows = std::min(strip_height, ysize - y);
+        if (!read_rows(strip_rows.data(), num_rows)) {
+          return failure("decoding the rows failed");
+        }
+        if (dparams.num_colors > 0) {
+          for (size_t i = 0; i < num_rows; ++i) {
+            JXL_RETURN_IF_ERROR(UnmapColors(
+                strip_rows[i], xsize, cinfo.out_color_components,
+                cinfo.colormap, cinfo.actual_number_of_colors));
+          }
+        }
+        if (!(*write_rows)(*ppf, y, num_rows, strip.data(), stride)) {
+          return failure("writing the decoded rows failed");
+        }
+      }
+    } else {
+      // Allocates the frame buffer.
+      {
+        JXL_ASSIGN_OR_RETURN(PackedFrame frame,
+                             PackedFrame::Create(xsize, ysize, format));
+        ppf->frames.emplace_back(std::move(frame));
+      }
+      const auto& frame = ppf->frames.back();
+      JXL_ENSURE(sizeof(JSAMPLE) * cinfo.out_color_components * xsize <=
+                 frame.color.stride);
+
+      uint8_t* pixels = static_cast<uint8_t*>(frame.color.pixels());
+      if (!crop) {
+        // The whole output pass is requested at once, so that the parallel
+        // runner renders it on the threads of the pool.
+        jpegli_decode_into(&cinfo, pixels, frame.color.stride);
+        if (output_transform.failed) {
+          return failure("color transform of the output rows failed");
+        }
+      } else {
+        strip_rows.resize(ysize);
+        for (size_t y = 0; y < ysize; ++y) {
+          strip_rows[y] = pixels + frame.color.stride * y;
+        }
+        if (!read_rows(strip_rows.data(), ysize)) {
+          return failure("decoding the rows failed");
+        }
+      }
       if (dparams.num_colors > 0) {
-        JXL_RETURN_IF_ERROR(
-            UnmapColors(rows[0], cinfo.output_width, cinfo.out_color_components,
-                        cinfo.colormap, cinfo.actual_number_of_colors));
+        for (size_t y = 0; y < ysize; ++y) {
+          JXL_RETURN_IF_ERROR(UnmapColors(
+              pixels + frame.color.stride * y, xsize,
+              cinfo.out_color_components, cinfo.colormap,
+              cinfo.actual_number_of_colors));
+        }
       }
     }
+    if (cinfo.output_scanline < cinfo.output_height) {
+      jpegli_skip_scanlines(&cinfo,
+                            cinfo.output_height - cinfo.output_scanline);
+    }
 
     jpegli_finish_decompress(&cinfo);
+    if (dparams.memory_stats != nullptr) {
+      jpegli_get_memory_stats(reinterpret_cast<j_common_ptr>(&cinfo),
+                              dparams.memory_stats);
+    }
+    if (dparams.stage_stats != nullptr) {
+      jpegli_get_stage_stats(reinterpret_cast<j_common_ptr>(&cinfo),
+                             dparams.stage_stats);
+    }
     return true;
   };
   bool success = try_catch_block();
@@ -294,5 +485,26 @@ Status DecodeJpeg(const std::vector<uint8_t>& compressed,
   return success;
 }
 
+}  // namespace
+
+Status DecodeJpeg(const std::vector<uint8_t>& compressed,
+                  const JpegDecompressParams& dparams, ThreadPool* pool,
+                  PackedPixelFile* ppf) {
+  return DecodeJpeg(Bytes(compressed), dparams, pool, ppf);
+}
+
+Status DecodeJpeg(Span<const uint8_t> compressed,
+                  const JpegDecompressParams& dparams, ThreadPool* pool,
+                  PackedPixelFile* ppf) {
+  return DecodeJpegImpl(compressed, dparams, pool, ppf, nullptr);
+}
+
+Status DecodeJpegStreaming(Span<const uint8_t> compressed,
+                           const JpegDecompressParams& dparams,
+                           PackedPixelFile* ppf,
+                           const JpegRowWriter& write_rows) {
+  return DecodeJpegImpl(compressed, dparams, nullptr, ppf, &write_rows);
+}
+
 }  // namespace extras
 }  // namespace jxl
@@ -9,12 +9,20 @@
 
 // Decodes JPG pixels and metadata in memory using the libjpegli library.
 
+#include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <vector>
 
 #include "lib/base/data_parallel.h"
+#include "lib/base/memory_manager.h"
+#include "lib/base/span.h"
 #include "lib/base/status.h"
 #include "lib/base/types.h"
+#include "lib/cms/cms_interface.h"
+
+struct jpegli_memory_stats;
+struct jpegli_stage_stats;
 
 namespace jxl {
 namespace extras {
@@ -30,12 +38,59 @@ struct JpegDecompressParams {
   bool two_pass_quant = true;
   // 0 = none, 1 = ordered, 2 = Floyd-Steinberg
   int dither_mode = 2;
+  // The output is scaled by scale_num / scale_denom, as with the fields of
+  // jpeg_decompress_struct; 1/8 decodes only the DC coefficients.
+  unsigned int scale_num = 1;
+  unsigned int scale_denom = 1;
+  // If crop_xsize and crop_ysize are not 0, only this region of the (scaled)
+  // output is decoded, with jpegli_crop_scanline() and
+  // jpegli_skip_scanlines(). The decoder may widen the region to iMCU column
+  // boundaries, the size of the output is in the image info.
+  size_t crop_x0 = 0;
+  size_t crop_y0 = 0;
+  size_t crop_xsize = 0;
+  size_t crop_ysize = 0;
+  // If not nullptr, the memory blocks of jpegli are allocated with it, see
+  // jpegli_set_memory_manager().
+  JxlMemoryManager* memory_manager = nullptr;
+  // If not nullptr, it is filled in with the memory usage of the jpegli
+  // decompressor after the image is decoded, see jpegli_get_memory_stats().
+  jpegli_memory_stats* memory_stats = nullptr;
+  // If not nullptr, the stage times and, if the system supports it, the
+  // hardware event counts of the decompressor are recorded, and it is filled in
+  // with them after the image is decoded, see jpegli_get_stage_stats().
+  jpegli_stage_stats* stage_stats = nullptr;
+  // If not nullptr, the pixels of images with an RGB or grayscale ICC profile
+  // are converted to sRGB with this CMS as the output rows are rendered, and
+  // the output has no ICC profile. Images whose profile the CMS can not
+  // convert keep it. Not used with color quantization.
+  const JxlCmsInterface* cms = nullptr;
 };
 
+Status DecodeJpeg(Span<const uint8_t> compressed,
+                  const JpegDecompressParams& dparams, ThreadPool* pool,
+                  PackedPixelFile* ppf);
+
 Status DecodeJpeg(const std::vector<uint8_t>& compressed,
                   const JpegDecompressParams& dparams, ThreadPool* pool,
                   PackedPixelFile* ppf);
 
+// Receives num_rows decoded rows of the image starting at row y, where row
+// y + i starts at pixels + i * stride, in the pixel format of the decoder
+// params. ppf has the image info, ICC profile and metadata of the image.
+using JpegRowWriter =
+    std::function<Status(const PackedPixelFile& ppf, size_t y, size_t num_rows,
+                         const uint8_t* pixels, size_t stride)>;
+
+// Decodes the image like DecodeJpeg(), but instead of keeping all of the
+// pixels in a frame of ppf, which gets no frames, passes them to write_rows in
+// strips of about a megabyte, from top to bottom, as soon as they are decoded.
+// The rows are rendered on the calling thread, so pool is not used.
+Status DecodeJpegStreaming(Span<const uint8_t> compressed,
+                           const JpegDecompressParams& dparams,
+                           PackedPixelFile* ppf,
+                           const JpegRowWriter& write_rows);
+
 }  // namespace extras
 }  // namespace jxl
 
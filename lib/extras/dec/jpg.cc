@@ -304,9 +304,33 @@ Status DecodeImageJPG(const Span<const uint8_t> bytes,
       cinfo.two_pass_quantize = static_cast<boolean>(dparams->two_pass_quant);
       cinfo.dither_mode = static_cast<J_DITHER_MODE>(dparams->dither_mode);
     }
+    if (dparams) {
+      cinfo.scale_num = dparams->scale_num;
+      cinfo.scale_denom = dparams->scale_denom;
+    }
 
     jpeg_start_decompress(&cinfo);
     JXL_ENSURE(cinfo.out_color_components == nbcomp);
+    JDIMENSION xsize = cinfo.output_width;
+    size_t ysize = cinfo.output_height;
+    if (dparams && dparams->crop_xsize > 0 && dparams->crop_ysize > 0) {
+      if (dparams->crop_x0 + dparams->crop_xsize > cinfo.output_width ||
+          dparams->crop_y0 + dparams->crop_ysize > cinfo.output_height) {
+        return failure("crop region is outside of the image");
+      }
+      if (dparams->crop_xsize < cinfo.output_width) {
+        JDIMENSION xoffset = dparams->crop_x0;
+        xsize = dparams->crop_xsize;
+        jpeg_crop_scanline(&cinfo, &xoffset, &xsize);
+      }
+      ysize = dparams->crop_ysize;
+      if (dparams->crop_y0 > 0) {
+        jpeg_skip_scanlines(&cinfo, dparams->crop_y0);
+      }
+    }
+    const size_t ystart = cinfo.output_scanline;
+    ppf->info.xsize = xsize;
+    ppf->info.ysize = ysize;
     JxlDataType data_type =
         ppf->info.bits_per_sample <= 8 ? JXL_TYPE_UINT8 : JXL_TYPE_UINT16;
 
@@ -319,14 +343,12 @@ Status DecodeImageJPG(const Span<const uint8_t> bytes,
     ppf->frames.clear();
     // Allocates the frame buffer.
     {
-      JXL_ASSIGN_OR_RETURN(
-          PackedFrame frame,
-          PackedFrame::Create(cinfo.image_width, cinfo.image_height, format));
+      JXL_ASSIGN_OR_RETURN(PackedFrame frame,
+                           PackedFrame::Create(xsize, ysize, format));
       ppf->frames.emplace_back(std::move(frame));
     }
     const auto& frame = ppf->frames.back();
-    JXL_ENSURE(sizeof(JSAMPLE) * cinfo.out_color_components *
-                   cinfo.image_width <=
+    JXL_ENSURE(sizeof(JSAMPLE) * cinfo.out_color_components * xsize <=
                frame.color.stride);
 
     if (cinfo.quantize_colors) {
@@ -342,18 +364,35 @@ Status DecodeImageJPG(const Span<const uint8_t> bytes,
     if (dparams && dparams->num_colors > 0) {
       JXL_ENSURE(cinfo.colormap != nullptr);
     }
-    for (size_t y = 0; y < cinfo.image_height; ++y) {
-      JSAMPROW rows[] = {reinterpret_cast<JSAMPLE*>(
-          static_cast<uint8_t*>(frame.color.pixels()) +
-          frame.color.stride * y)};
-      jpeg_read_scanlines(&cinfo, rows, 1);
-      msan::UnpoisonMemory(rows[0], sizeof(JSAMPLE) * cinfo.output_components *
-                                        cinfo.image_width);
-      if (dparams && dparams->num_colors > 0) {
-        JXL_RETURN_IF_ERROR(
-            UnmapColors(rows[0], cinfo.output_width, cinfo.out_color_components,
-                        cinfo.colormap, cinfo.actual_number_of_colors));
+    // The rows are read straight into the frame, up to kMaxRows rows per call,
+    // of which libjpeg returns the ones that it has ready.
+    constexpr size_t kMaxRows = 16;
+    JSAMPROW rows[kMaxRows];
+    while (cinfo.output_scanline < ystart + ysize) {
+      const size_t y0 = cinfo.output_scanline - ystart;
+      const size_t num_rows = std::min<size_t>(kMaxRows, ysize - y0);
+      for (size_t i = 0; i < num_rows; ++i) {
+        rows[i] = reinterpret_cast<JSAMPLE*>(
+            static_cast<uint8_t*>(frame.color.pixels()) +
+            frame.color.stride * (y0 + i));
+      }
+      const size_t rows_read = jpeg_read_scanlines(&cinfo, rows, num_rows);
+      if (rows_read == 0) {
+        return JXL_FAILURE("Failed to read JPEG scanlines");
       }
+      for (size_t i = 0; i < rows_read; ++i) {
+        msan::UnpoisonMemory(
+            rows[i], sizeof(JSAMPLE) * cinfo.output_components * xsize);
+        if (dparams && dparams->num_colors > 0) {
+          JXL_RETURN_IF_ERROR(UnmapColors(rows[i], xsize,
+                                          cinfo.out_color_components,
+                                          cinfo.colormap,
+                                          cinfo.actual_number_of_colors));
+        }
+      }
+    }
+    if (cinfo.output_scanline < cinfo.output_height) {
+      jpeg_skip_scanlines(&cinfo, cinfo.output_height - cinfo.output_scanline);
     }
 
     jpeg_finish_decompress(&cinfo);
@@ -9,6 +9,7 @@
 
 // Decodes JPG pixels and metadata in memory.
 
+#include <cstddef>
 #include <cstdint>
 
 #include "lib/base/span.h"
@@ -30,6 +31,13 @@ struct JPGDecompressParams {
   bool two_pass_quant = false;
   // 0 = none, 1 = ordered, 2 = Floyd-Steinberg
   int dither_mode = 0;
+  // The output scaling and crop region, as in JpegDecompressParams.
+  unsigned int scale_num = 1;
+  unsigned int scale_denom = 1;
+  size_t crop_x0 = 0;
+  size_t crop_y0 = 0;
+  size_t crop_xsize = 0;
+  size_t crop_ysize = 0;
 };
 
 // Decodes `bytes` into `ppf`. color_hints are ignored.
@@ -326,17 +326,19 @@ class Parser {
 
 }  // namespace
 
-Status DecodeImagePNM(const Span<const uint8_t> bytes,
-                      const ColorHints& color_hints, PackedPixelFile* ppf,
-                      const SizeConstraints* constraints) {
+Status DecodeHeaderPNM(const Span<const uint8_t> bytes,
+                       const ColorHints& color_hints, HeaderPNM* header,
+                       PackedPixelFile* ppf, size_t* pixels_offset,
+                       JxlPixelFormat* format,
+                       const SizeConstraints* constraints) {
   Parser parser(bytes);
-  HeaderPNM header = {};
+  *header = {};
   const uint8_t* pos = nullptr;
-  if (!parser.ParseHeader(&header, &pos)) return false;
+  if (!parser.ParseHeader(header, &pos)) return false;
   JXL_RETURN_IF_ERROR(
-      VerifyDimensions(constraints, header.xsize, header.ysize));
+      VerifyDimensions(constraints, header->xsize, header->ysize));
 
-  if (header.bits_per_sample == 0 || header.bits_per_sample > 32) {
+  if (header->bits_per_sample == 0 || header->bits_per_sample > 32) {
     return JXL_FAILURE("PNM: bits_per_sample invalid");
   }
 
@@ -344,30 +346,31 @@ Status DecodeImagePNM(const Span<const uint8_t> bytes,
   // (BP.709, with gamma number of 2.2). Deviate from the specification and
   // assume `sRGB` in our implementation.
   JXL_RETURN_IF_ERROR(ApplyColorHints(color_hints, /*color_already_set=*/false,
-                                      header.is_gray, ppf));
+                                      header->is_gray, ppf));
 
-  ppf->info.xsize = header.xsize;
-  ppf->info.ysize = header.ysize;
-  if (header.floating_point) {
+  ppf->info.xsize = header->xsize;
+  ppf->info.ysize = header->ysize;
+  if (header->floating_point) {
     ppf->info.bits_per_sample = 32;
     ppf->info.exponent_bits_per_sample = 8;
   } else {
-    ppf->info.bits_per_sample = header.bits_per_sample;
+    ppf->info.bits_per_sample = header->bits_per_sample;
     ppf->info.exponent_bits_per_sample = 0;
   }
 
   ppf->info.orientation = JXL_ORIENT_IDENTITY;
 
   // No alpha in PNM and PFM
-  ppf->info.alpha_bits = (header.has_alpha ? ppf->info.bits_per_sample : 0);
+  ppf->info.alpha_bits = (header->has_alpha ? ppf->info.bits_per_sample : 0);
   ppf->info.alpha_exponent_bits = 0;
-  ppf->info.num_color_channels = (header.is_gray ? 1 : 3);
-  uint32_t num_alpha_channels = (header.has_alpha ? 1 : 0);
+  ppf->info.num_color_channels = (header->is_gray ? 1 : 3);
+  uint32_t num_alpha_channels = (header->has_alpha ? 1 : 0);
   uint32_t num_interleaved_channels =
       ppf->info.num_color_channels + num_alpha_channels;
-  ppf->info.num_extra_channels = num_alpha_channels + header.ec_types.size();
+  ppf->info.num_extra_channels = num_alpha_channels + header->ec_types.size();
 
-  for (auto type : header.ec_types) {
+  ppf->extra_channels_info.clear();
+  for (auto type : header->ec_types) {
     PackedExtraChannel pec = {};
     pec.ec_info.bits_per_sample = ppf->info.bits_per_sample;
     pec.ec_info.type = type;
@@ -375,23 +378,40 @@ Status DecodeImagePNM(const Span<const uint8_t> bytes,
   }
 
   JxlDataType data_type;
-  if (header.floating_point) {
+  if (header->floating_point) {
     // There's no float16 pnm version.
     data_type = JXL_TYPE_FLOAT;
   } else {
-    if (header.bits_per_sample > 8) {
+    if (header->bits_per_sample > 8) {
       data_type = JXL_TYPE_UINT16;
     } else {
       data_type = JXL_TYPE_UINT8;
     }
   }
 
-  const JxlPixelFormat format{
+  *format = {
       /*num_channels=*/num_interleaved_channels,
       /*data_type=*/data_type,
-      /*endianness=*/header.big_endian ? JXL_BIG_ENDIAN : JXL_LITTLE_ENDIAN,
+      /*endianness=*/header->big_endian ? JXL_BIG_ENDIAN : JXL_LITTLE_ENDIAN,
       /*align=*/0,
   };
+  if (ppf->info.exponent_bits_per_sample == 0) {
+    ppf->input_bitdepth.type = JXL_BIT_DEPTH_FROM_CODESTREAM;
+  }
+  *pixels_offset = pos - bytes.data();
+  return true;
+}
+
+Status DecodeImagePNM(const Span<const uint8_t> bytes,
+                      const ColorHints& color_hints, PackedPixelFile* ppf,
+                      const SizeConstraints* constraints) {
+  HeaderPNM header;
+  size_t pixels_offset;
+  JxlPixelFormat format;
+  JXL_RETURN_IF_ERROR(DecodeHeaderPNM(bytes, color_hints, &header, ppf,
+                                      &pixels_offset, &format, constraints));
+  const uint8_t* pos = bytes.data() + pixels_offset;
+  const JxlDataType data_type = format.data_type;
   const JxlPixelFormat ec_format{1, format.data_type, format.endianness, 0};
   ppf->frames.clear();
   {
@@ -441,9 +461,6 @@ Status DecodeImagePNM(const Span<const uint8_t> bytes,
       }
     }
   }
-  if (ppf->info.exponent_bits_per_sample == 0) {
-    ppf->input_bitdepth.type = JXL_BIT_DEPTH_FROM_CODESTREAM;
-  }
   return true;
 }
 
@@ -45,6 +45,17 @@ struct HeaderPNM {
   std::vector<JxlExtraChannelType> ec_types;  // PAM
 };
 
+// Parses the header of the PNM/PFM/PAM file in `bytes` and sets the image info
+// and color encoding of `ppf`, without adding a frame. Sets *pixels_offset to
+// the offset of the pixels in `bytes` and *format to their interleaved format,
+// which is followed by the extra channels of header->ec_types in each pixel.
+// The rows of PFM files are stored bottom-up. Used to read the pixels directly
+// from `bytes`, e.g. by EncodeJpegFromPNM().
+Status DecodeHeaderPNM(Span<const uint8_t> bytes, const ColorHints& color_hints,
+                       HeaderPNM* header, PackedPixelFile* ppf,
+                       size_t* pixels_offset, JxlPixelFormat* format,
+                       const SizeConstraints* constraints = nullptr);
+
 }  // namespace extras
 }  // namespace jxl
 
@@ -9,13 +9,11 @@
 #include <setjmp.h>
 
 #include <algorithm>
-#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <hwy/aligned_allocator.h>
-#include <limits>
 #include <string>
 #include <utility>
 #include <vector>
@@ -23,12 +21,15 @@
 #include "lib/base/byte_order.h"
 #include "lib/base/common.h"
 #include "lib/base/data_parallel.h"
+#include "lib/base/matrix_ops.h"
 #include "lib/base/status.h"
 #include "lib/base/types.h"
 #include "lib/cms/cms.h"
 #include "lib/cms/color_encoding_internal.h"
 #include "lib/extras/codestream_header.h"
+#include "lib/extras/dec/pnm.h"
 #include "lib/extras/enc/encode.h"
+#include "lib/extras/image_color_transform.h"
 #include "lib/extras/packed_image.h"
 #include "lib/extras/simd_util.h"
 #include "lib/extras/xyb_transform.h"
@@ -48,32 +49,58 @@ void MyErrorExit(j_common_ptr cinfo) {
   longjmp(*env, 1);
 }
 
-Status VerifyInput(const PackedPixelFile& ppf) {
-  const JxlBasicInfo& info = ppf.info;
-  JXL_RETURN_IF_ERROR(Encoder::VerifyBasicInfo(info));
-  if (ppf.frames.size() != 1) {
-    return JXL_FAILURE("JPEG input must have exactly one frame.");
+// The interleaved rows of the image to compress, which are read in place from
+// either the frame of a PackedPixelFile or an image file in memory.
+static_assert(PackedImage::kRowPadding >= JPEGLI_ROW_PADDING,
+              "Padded images must satisfy jpegli's row padding.");
+
+struct InputRows {
+  JxlPixelFormat format;
+  size_t xsize;
+  size_t ysize;
+  size_t pixel_stride;
+  const uint8_t* first_row;
+  // Distance between the starts of two rows in bytes, negative if the rows are
+  // stored bottom-up.
+  ptrdiff_t stride;
+  // Number of bytes after each row that can be read, see
+  // PackedImage::row_padding().
+  size_t row_padding = 0;
+
+  const uint8_t* Row(size_t y) const {
+    return first_row + static_cast<ptrdiff_t>(y) * stride;
   }
+};
+
+Status VerifyFormat(const JxlBasicInfo& info, const JxlPixelFormat& format) {
+  JXL_RETURN_IF_ERROR(Encoder::VerifyBasicInfo(info));
   if (info.num_color_channels != 1 && info.num_color_channels != 3) {
     return JXL_FAILURE("Invalid number of color channels %d",
                        info.num_color_channels);
   }
-  const PackedImage& image = ppf.frames[0].color;
-  JXL_RETURN_IF_ERROR(Encoder::VerifyImageSize(image, info));
-  if (image.format.data_type == JXL_TYPE_FLOAT16) {
+  if (format.data_type == JXL_TYPE_FLOAT16) {
     return JXL_FAILURE("FLOAT16 input is not supported.");
   }
-  JXL_RETURN_IF_ERROR(Encoder::VerifyBitDepth(image.format.data_type,
+  JXL_RETURN_IF_ERROR(Encoder::VerifyBitDepth(format.data_type,
                                               info.bits_per_sample,
                                               info.exponent_bits_per_sample));
-  if ((image.format.data_type == JXL_TYPE_UINT8 && info.bits_per_sample != 8) ||
-      (image.format.data_type == JXL_TYPE_UINT16 &&
-       info.bits_per_sample != 16)) {
+  if ((format.data_type == JXL_TYPE_UINT8 && info.bits_per_sample != 8) ||
+      (format.data_type == JXL_TYPE_UINT16 && info.bits_per_sample != 16)) {
     return JXL_FAILURE("Only full bit depth unsigned types are supported.");
   }
   return true;
 }
 
+Status VerifyInput(const PackedPixelFile& ppf) {
+  if (ppf.frames.size() != 1) {
+    return JXL_FAILURE("JPEG input must have exactly one frame.");
+  }
+  const PackedImage& image = ppf.frames[0].color;
+  JXL_RETURN_IF_ERROR(VerifyFormat(ppf.info, image.format));
+  JXL_RETURN_IF_ERROR(Encoder::VerifyImageSize(image, ppf.info));
+  return true;
+}
+
 Status GetColorEncoding(const PackedPixelFile& ppf,
                         ColorEncoding* color_encoding) {
   if (ppf.primary_color_representation == PackedPixelFile::kIccIsPrimary) {
@@ -89,6 +116,42 @@ Status GetColorEncoding(const PackedPixelFile& ppf,
   return true;
 }
 
+// Sets up the tone mapping of the HDR color_encoding to SDR with the peak
+// luminance of jpeg_settings, and sets sdr_encoding to the color encoding of
+// the output, which has the sRGB transfer function.
+Status InitToneMapping(const PackedPixelFile& ppf,
+                       const ColorEncoding& color_encoding,
+                       const JpegSettings& jpeg_settings,
+                       JpegliToneMapping* tone_mapping,
+                       ColorEncoding* sdr_encoding) {
+  tone_mapping->transfer_function = color_encoding.Tf().IsPQ() ? 16 : 18;
+  tone_mapping->source_peak = ppf.info.intensity_target > 0
+                                  ? ppf.info.intensity_target
+                                  : 10000.0f;
+  tone_mapping->target_peak = jpeg_settings.sdr_target_nits;
+  // The luminances of the primaries are the Y row of the RGB to XYZ matrix,
+  // which scales the primaries to sum to the white point.
+  PrimariesCIExy p;
+  JXL_RETURN_IF_ERROR(color_encoding.GetPrimaries(p));
+  const CIExy wp = color_encoding.GetWhitePoint();
+  Matrix3x3d primaries{{{p.r.x, p.g.x, p.b.x},
+                        {p.r.y, p.g.y, p.b.y},
+                        {1.0 - p.r.x - p.r.y, 1.0 - p.g.x - p.g.y,
+                         1.0 - p.b.x - p.b.y}}};
+  const Vector3d y_row = primaries[1];
+  JXL_RETURN_IF_ERROR(Inv3x3Matrix(primaries));
+  const Vector3d white{wp.x / wp.y, 1.0, (1.0 - wp.x - wp.y) / wp.y};
+  Vector3d scale;
+  Mul3x3Vector(primaries, white, scale);
+  for (size_t c = 0; c < 3; ++c) {
+    tone_mapping->primaries_luminances[c] = y_row[c] * scale[c];
+  }
+  *sdr_encoding = color_encoding;
+  sdr_encoding->Tf().SetTransferFunction(TransferFunction::kSRGB);
+  JXL_RETURN_IF_ERROR(sdr_encoding->CreateICC());
+  return true;
+}
+
 bool HasICCProfile(const std::vector<uint8_t>& app_data) {
   size_t pos = 0;
   while (pos < app_data.size()) {
@@ -133,6 +196,8 @@ constexpr unsigned char kICCSignature[12] = {
 constexpr uint8_t kUnknownTf = 2;
 constexpr unsigned char kCICPTagSignature[4] = {0x63, 0x69, 0x63, 0x70};
 constexpr size_t kCICPTagSize = 12;
+// The largest number of image rows in an iMCU row.
+constexpr size_t kMaxIMCURows = MAX_SAMP_FACTOR * DCTSIZE;
 
 bool FindCICPTag(const uint8_t* icc_data, size_t len, bool is_first_chunk,
                  size_t* cicp_offset, size_t* cicp_length, uint8_t* cicp_tag,
@@ -299,92 +364,56 @@ void ToFloatRow(const uint8_t* row_in, JxlPixelFormat format, size_t xsize,
   }
 }
 
-Status EncodeJpegToTargetSize(const PackedPixelFile& ppf,
-                              const JpegSettings& jpeg_settings,
-                              size_t target_size, ThreadPool* pool,
-                              std::vector<uint8_t>* output) {
-  output->clear();
-  size_t best_error = std::numeric_limits<size_t>::max();
-  float distance0 = -1.0f;
-  float distance1 = -1.0f;
-  float distance = 1.0f;
-  for (int step = 0; step < 15; ++step) {
-    JpegSettings settings = jpeg_settings;
-    settings.libjpeg_quality = 0;
-    settings.distance = distance;
-    settings.target_size = 0;
-    std::vector<uint8_t> compressed;
-    JXL_RETURN_IF_ERROR(EncodeJpeg(ppf, settings, pool, &compressed));
-    size_t size = compressed.size();
-    // prefer being under the target size to being over it
-    size_t error = size < target_size
-                       ? target_size - size
-                       : static_cast<size_t>(1.2f * (size - target_size));
-    if (error < best_error) {
-      best_error = error;
-      std::swap(*output, compressed);
-    }
-    float rel_error = size * 1.0f / target_size;
-    if (std::abs(rel_error - 1.0f) < 0.002f) {
-      break;
-    }
-    if (size < target_size) {
-      distance1 = distance;
-    } else {
-      distance0 = distance;
-    }
-    if (distance1 == -1) {
-      distance *= std::pow(rel_error, 1.5) * 1.05;
-    } else if (distance0 == -1) {
-      distance *= std::pow(rel_error, 1.5) * 0.95;
-    } else {
-      distance = 0.5 * (distance0 + distance1);
-    }
-  }
-  return true;
-}
-
-}  // namespace
-
-Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
-                  ThreadPool* pool, std::vector<uint8_t>* compressed) {
-  if (jpeg_settings.libjpeg_quality > 0) {
-    auto encoder = Encoder::FromExtension(".jpg");
-    encoder->SetOption("q", std::to_string(jpeg_settings.libjpeg_quality));
-    if (!jpeg_settings.libjpeg_chroma_subsampling.empty()) {
-      encoder->SetOption("chroma_subsampling",
-                         jpeg_settings.libjpeg_chroma_subsampling);
-    }
-    EncodedImage encoded;
-    JXL_RETURN_IF_ERROR(encoder->Encode(ppf, &encoded, pool));
-    size_t target_size = encoded.bitstreams[0].size();
-    return EncodeJpegToTargetSize(ppf, jpeg_settings, target_size, pool,
-                                  compressed);
-  }
-  if (jpeg_settings.target_size > 0) {
-    return EncodeJpegToTargetSize(ppf, jpeg_settings, jpeg_settings.target_size,
-                                  pool, compressed);
-  }
-  JXL_RETURN_IF_ERROR(VerifyInput(ppf));
-
+// Compresses the rows of `image`, whose metadata is that of `ppf`; the frames
+// of `ppf` are not used.
+Status EncodeRows(const PackedPixelFile& ppf, const InputRows& image,
+                  const JpegSettings& jpeg_settings, ThreadPool* pool,
+                  std::vector<uint8_t>* compressed) {
   ColorEncoding color_encoding;
   JXL_RETURN_IF_ERROR(GetColorEncoding(ppf, &color_encoding));
 
-  ColorSpaceTransform c_transform(*JxlGetDefaultCms());
+  CachedColorTransform c_transform;
   ColorEncoding xyb_encoding;
+  // In XYB mode, 8-bit and 16-bit sRGB input is converted to linear sRGB with
+  // a lookup table instead of the color transform.
+  const JxlDataType data_type = image.format.data_type;
+  const bool use_srgb_lut =
+      jpeg_settings.xyb && color_encoding.IsSRGB() &&
+      ppf.info.num_color_channels == 3 &&
+      (data_type == JXL_TYPE_UINT8 || data_type == JXL_TYPE_UINT16);
+  std::vector<float> srgb_lut;
+  if (use_srgb_lut) {
+    srgb_lut.resize(data_type == JXL_TYPE_UINT8 ? 256 : 65536);
+    ComputeSRGBToLinearLUT(srgb_lut.size(), srgb_lut.data());
+  }
   if (jpeg_settings.xyb) {
     if (HasICCProfile(jpeg_settings.app_data)) {
       return JXL_FAILURE("APP data ICC profile is not supported in XYB mode.");
     }
-    const ColorEncoding& c_desired = ColorEncoding::LinearSRGB(false);
-    JXL_RETURN_IF_ERROR(
-        c_transform.Init(color_encoding, c_desired, 255.0f, ppf.info.xsize, 1));
+    if (!use_srgb_lut) {
+      const ColorEncoding& c_desired = ColorEncoding::LinearSRGB(false);
+      JXL_RETURN_IF_ERROR(c_transform.Init(color_encoding, c_desired, 255.0f,
+                                           ppf.info.xsize, 1,
+                                           *JxlGetDefaultCms()));
+    }
     xyb_encoding.SetColorSpace(jxl::ColorSpace::kXYB);
     xyb_encoding.SetRenderingIntent(jxl::RenderingIntent::kPerceptual);
     JXL_RETURN_IF_ERROR(xyb_encoding.CreateICC());
   }
+  JpegliToneMapping tone_mapping;
+  ColorEncoding sdr_encoding;
+  const bool tone_map =
+      !jpeg_settings.xyb && jpeg_settings.sdr_target_nits > 0.0f &&
+      color_encoding.HaveFields() &&
+      color_encoding.GetColorSpace() == ColorSpace::kRGB &&
+      (color_encoding.Tf().IsPQ() || color_encoding.Tf().IsHLG());
+  if (tone_map) {
+    JXL_RETURN_IF_ERROR(InitToneMapping(ppf, color_encoding, jpeg_settings,
+                                        &tone_mapping, &sdr_encoding));
+  }
   const ColorEncoding& output_encoding =
-      jpeg_settings.xyb ? xyb_encoding : color_encoding;
+      jpeg_settings.xyb ? xyb_encoding
+                        : (tone_map ? sdr_encoding : color_encoding);
 
   // We need to declare all the non-trivial destructor local variables
   // before the call to setjmp().
@@ -393,8 +422,15 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
   std::vector<uint8_t> row_bytes;
   const size_t max_vector_size = MaxVectorSize();
   size_t rowlen = RoundUpTo(ppf.info.xsize, max_vector_size);
-  hwy::AlignedFreeUniquePtr<float[]> xyb_tmp =
-      hwy::AllocateAligned<float>(6 * rowlen);
+  // In XYB mode the input is converted and written kXYBStripRows rows at a
+  // time, with one set of planar scratch rows per thread.
+  constexpr size_t kXYBStripRows = 16;
+  size_t xyb_threads = 0;
+  hwy::AlignedFreeUniquePtr<float[]> xyb_tmp;
+  hwy::AlignedFreeUniquePtr<float[]> xyb_strip;
+  if (jpeg_settings.xyb) {
+    xyb_strip = hwy::AllocateAligned<float>(kXYBStripRows * 3 * rowlen);
+  }
   hwy::AlignedFreeUniquePtr<float[]> premul_absorb =
       hwy::AllocateAligned<float>(max_vector_size * 12);
   ComputePremulAbsorb(255.0f, premul_absorb.get());
@@ -410,6 +446,18 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
     }
     cinfo.client_data = static_cast<void*>(&env);
     jpegli_create_compress(&cinfo);
+    if (jpeg_settings.memory_manager != nullptr) {
+      jpegli_set_memory_manager(reinterpret_cast<j_common_ptr>(&cinfo),
+                                jpeg_settings.memory_manager);
+    }
+    if (jpeg_settings.stage_stats != nullptr) {
+      jpegli_enable_stage_stats(reinterpret_cast<j_common_ptr>(&cinfo), TRUE);
+      jpegli_enable_stage_counters(reinterpret_cast<j_common_ptr>(&cinfo),
+                                   TRUE);
+    }
+    if (pool != nullptr) {
+      jpegli_set_parallel_runner(&cinfo, pool->runner(), pool->runner_opaque());
+    }
     jpegli_mem_dest(&cinfo, &output_buffer, &output_size);
     const JxlBasicInfo& info = ppf.info;
     cinfo.image_width = info.xsize;
@@ -421,8 +469,25 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
       jpegli_set_xyb_mode(&cinfo);
       cinfo.input_components = 3;
       cinfo.in_color_space = JCS_RGB;
-    } else if (jpeg_settings.use_std_quant_tables) {
-      jpegli_use_standard_quant_tables(&cinfo);
+    } else {
+#ifdef JCS_ALPHA_EXTENSIONS
+      if (cinfo.input_components == 3 && image.format.num_channels == 4) {
+        // The alpha channel is skipped or blended in by jpegli, so that the
+        // RGBA rows can be passed in place.
+        cinfo.input_components = 4;
+        cinfo.in_color_space = JCS_EXT_RGBA;
+        if (jpeg_settings.blend_alpha) {
+          jpegli_set_input_alpha_background(&cinfo,
+                                            jpeg_settings.alpha_background);
+        }
+      }
+#endif
+      if (jpeg_settings.use_std_quant_tables) {
+        jpegli_use_standard_quant_tables(&cinfo);
+      }
+      if (tone_map) {
+        jpegli_set_input_tone_mapping(&cinfo, &tone_mapping);
+      }
     }
     uint8_t cicp_tf = kUnknownTf;
     if (!jpeg_settings.app_data.empty()) {
@@ -461,10 +526,28 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
     }
     jpegli_enable_adaptive_quantization(
         &cinfo, TO_JXL_BOOL(jpeg_settings.use_adaptive_quantization));
-    if (jpeg_settings.psnr_target > 0.0) {
+    jpegli_set_aq_mode(&cinfo, jpeg_settings.use_fast_adaptive_quantization
+                                   ? JPEGLI_AQ_FAST
+                                   : JPEGLI_AQ_FULL);
+    jpegli_use_fixed_point_dct(
+        &cinfo, TO_JXL_BOOL(jpeg_settings.use_fixed_point_dct));
+    jpegli_use_compact_tokens(
+        &cinfo, TO_JXL_BOOL(jpeg_settings.use_compact_tokens));
+    jpegli_use_two_pass_tokenization(
+        &cinfo, TO_JXL_BOOL(jpeg_settings.use_two_pass_tokenization));
+    jpegli_optimize_scans(&cinfo, TO_JXL_BOOL(jpeg_settings.optimize_scans));
+    if (jpeg_settings.target_size > 0) {
+      jpegli_set_target_size(&cinfo, jpeg_settings.target_size,
+                             jpeg_settings.min_distance,
+                             jpeg_settings.max_distance);
+    } else if (jpeg_settings.psnr_target > 0.0) {
       jpegli_set_psnr(&cinfo, jpeg_settings.psnr_target,
                       jpeg_settings.search_tolerance,
                       jpeg_settings.min_distance, jpeg_settings.max_distance);
+    } else if (jpeg_settings.butteraugli_target > 0.0) {
+      jpegli_set_butteraugli_target(&cinfo, jpeg_settings.butteraugli_target,
+                                    jpeg_settings.min_distance,
+                                    jpeg_settings.max_distance);
     } else if (jpeg_settings.quality > 0.0) {
       float distance = jpegli_quality_to_distance(jpeg_settings.quality);
       jpegli_set_distance(&cinfo, distance, TRUE);
@@ -473,17 +556,26 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
     }
     jpegli_set_progressive_level(&cinfo, jpeg_settings.progressive_level);
     cinfo.optimize_coding = TO_JXL_BOOL(jpeg_settings.optimize_coding);
+    if (jpeg_settings.effort > 0) {
+      jpegli_set_effort(&cinfo, jpeg_settings.effort);
+    }
     if (!jpeg_settings.app_data.empty()) {
       // Make sure jpegli_start_compress() does not write any APP markers.
       cinfo.write_JFIF_header = JXL_FALSE;
       cinfo.write_Adobe_marker = JXL_FALSE;
     }
-    const PackedImage& image = ppf.frames[0].color;
     if (jpeg_settings.xyb) {
       jpegli_set_input_format(&cinfo, JPEGLI_TYPE_FLOAT, JPEGLI_NATIVE_ENDIAN);
     } else {
       jpegli_set_input_format(&cinfo, ConvertDataType(image.format.data_type),
                               ConvertEndianness(image.format.endianness));
+      // The rows that are copied below are padded, and so may be the ones
+      // that are passed in place.
+      const bool in_place =
+          cinfo.input_components == static_cast<int>(image.format.num_channels);
+      jpegli_set_input_row_padding(
+          &cinfo,
+          TO_JXL_BOOL(!in_place || image.row_padding >= JPEGLI_ROW_PADDING));
     }
     jpegli_start_compress(&cinfo, TRUE);
     if (!jpeg_settings.app_data.empty()) {
@@ -494,68 +586,127 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
       jpegli_write_icc_profile(&cinfo, output_encoding.ICC().data(),
                                output_encoding.ICC().size());
     }
-    const uint8_t* pixels = reinterpret_cast<const uint8_t*>(image.pixels());
     if (jpeg_settings.xyb) {
-      float* src_buf = c_transform.BufSrc(0);
-      float* dst_buf = c_transform.BufDst(0);
-      for (size_t y = 0; y < image.ysize; ++y) {
-        // convert to float
-        ToFloatRow(&pixels[y * image.stride], image.format, image.xsize,
-                   info.num_color_channels, src_buf);
-        // convert to linear srgb
-        if (!c_transform.Run(0, src_buf, dst_buf, image.xsize)) {
-          return false;
+      const ColorEncoding& c_desired = ColorEncoding::LinearSRGB(false);
+      size_t y0 = 0;
+      const auto init = [&](const size_t num_threads) -> Status {
+        if (num_threads <= xyb_threads) return true;
+        if (!use_srgb_lut) {
+          JXL_RETURN_IF_ERROR(c_transform.Init(color_encoding, c_desired,
+                                               255.0f, image.xsize,
+                                               num_threads,
+                                               *JxlGetDefaultCms()));
         }
-        // deinterleave channels
-        float* row0 = &xyb_tmp[0];
-        float* row1 = &xyb_tmp[rowlen];
-        float* row2 = &xyb_tmp[2 * rowlen];
-        for (size_t x = 0; x < image.xsize; ++x) {
-          row0[x] = dst_buf[3 * x + 0];
-          row1[x] = dst_buf[3 * x + 1];
-          row2[x] = dst_buf[3 * x + 2];
+        xyb_tmp = hwy::AllocateAligned<float>(3 * rowlen * num_threads);
+        JXL_ENSURE(xyb_tmp != nullptr);
+        xyb_threads = num_threads;
+        return true;
+      };
+      const auto convert_row = [&](const uint32_t y,
+                                   const size_t thread) -> Status {
+        float* row0 = &xyb_tmp[3 * rowlen * thread];
+        float* row1 = row0 + rowlen;
+        float* row2 = row1 + rowlen;
+        if (use_srgb_lut) {
+          // convert to planar linear srgb
+          const bool is_little_endian =
+              image.format.endianness == JXL_LITTLE_ENDIAN ||
+              (image.format.endianness == JXL_NATIVE_ENDIAN &&
+               IsLittleEndian());
+          SRGBRowToLinear(image.Row(y), image.format.num_channels,
+                          data_type == JXL_TYPE_UINT8 ? 1 : 2,
+                          is_little_endian != IsLittleEndian(),
+                          srgb_lut.data(), image.xsize, row0, row1, row2);
+        } else {
+          ColorSpaceTransform& transform = c_transform.transform();
+          float* src_buf = transform.BufSrc(thread);
+          float* dst_buf = transform.BufDst(thread);
+          // convert to float
+          ToFloatRow(image.Row(y), image.format, image.xsize,
+                     info.num_color_channels, src_buf);
+          // convert to linear srgb
+          JXL_RETURN_IF_ERROR(
+              transform.Run(thread, src_buf, dst_buf, image.xsize));
+          // deinterleave channels
+          for (size_t x = 0; x < image.xsize; ++x) {
+            row0[x] = dst_buf[3 * x + 0];
+            row1[x] = dst_buf[3 * x + 1];
+            row2[x] = dst_buf[3 * x + 2];
+          }
         }
         // convert to xyb
         LinearRGBRowToXYB(row0, row1, row2, premul_absorb.get(), image.xsize);
         // scale xyb
         ScaleXYBRow(row0, row1, row2, image.xsize);
         // interleave channels
-        float* row_out = &xyb_tmp[3 * rowlen];
+        float* row_out = &xyb_strip[3 * rowlen * (y - y0)];
         for (size_t x = 0; x < image.xsize; ++x) {
           row_out[3 * x + 0] = row0[x];
           row_out[3 * x + 1] = row1[x];
           row_out[3 * x + 2] = row2[x];
         }
+        return true;
+      };
+      JSAMPROW rows[kXYBStripRows];
+      for (; y0 < image.ysize; y0 += kXYBStripRows) {
+        const size_t y1 = std::min(y0 + kXYBStripRows, image.ysize);
+        if (!RunOnPool(pool, y0, y1, init, convert_row, "XYB conversion")) {
+          return false;
+        }
         // feed to jpegli as native endian floats
-        JSAMPROW row[] = {reinterpret_cast<uint8_t*>(row_out)};
-        jpegli_write_scanlines(&cinfo, row, 1);
+        for (size_t y = y0; y < y1; ++y) {
+          rows[y - y0] = reinterpret_cast<uint8_t*>(
+              &xyb_strip[3 * rowlen * (y - y0)]);
+        }
+        jpegli_write_scanlines(&cinfo, rows, y1 - y0);
       }
-    } else {
-      row_bytes.resize(image.stride);
-      if (cinfo.num_components == static_cast<int>(image.format.num_channels)) {
-        for (size_t y = 0; y < info.ysize; ++y) {
-          memcpy(row_bytes.data(), pixels + y * image.stride, image.stride);
-          JSAMPROW row[] = {row_bytes.data()};
-          jpegli_write_scanlines(&cinfo, row, 1);
+    } else if (cinfo.input_components ==
+               static_cast<int>(image.format.num_channels)) {
+      // jpegli only reads the input rows (and swaps their byte order as it
+      // does), so they are passed in place, a whole iMCU row at a time, which
+      // the parallel runner processes at once.
+      JSAMPROW rows[kMaxIMCURows];
+      const size_t imcu_rows = cinfo.max_v_samp_factor * DCTSIZE;
+      for (size_t y0 = 0; y0 < info.ysize; y0 += imcu_rows) {
+        const size_t y1 = std::min<size_t>(y0 + imcu_rows, info.ysize);
+        for (size_t y = y0; y < y1; ++y) {
+          rows[y - y0] = const_cast<JSAMPROW>(image.Row(y));
         }
-      } else {
-        for (size_t y = 0; y < info.ysize; ++y) {
-          JXL_RETURN_IF_ERROR(
-              PackedImage::ValidateDataType(image.format.data_type));
-          int bytes_per_channel =
-              PackedImage::BitsPerChannel(image.format.data_type) / 8;
-          int bytes_per_pixel = cinfo.num_components * bytes_per_channel;
+        jpegli_write_scanlines(&cinfo, rows, y1 - y0);
+      }
+    } else {
+      JXL_RETURN_IF_ERROR(
+          PackedImage::ValidateDataType(image.format.data_type));
+      const size_t bytes_per_channel =
+          PackedImage::BitsPerChannel(image.format.data_type) / 8;
+      const size_t bytes_per_pixel = cinfo.input_components * bytes_per_channel;
+      const size_t row_stride =
+          info.xsize * bytes_per_pixel + JPEGLI_ROW_PADDING;
+      const size_t imcu_rows = cinfo.max_v_samp_factor * DCTSIZE;
+      row_bytes.resize(imcu_rows * row_stride);
+      JSAMPROW rows[kMaxIMCURows];
+      for (size_t y0 = 0; y0 < info.ysize; y0 += imcu_rows) {
+        const size_t y1 = std::min<size_t>(y0 + imcu_rows, info.ysize);
+        for (size_t y = y0; y < y1; ++y) {
+          uint8_t* row = &row_bytes[(y - y0) * row_stride];
           for (size_t x = 0; x < info.xsize; ++x) {
-            memcpy(&row_bytes[x * bytes_per_pixel],
-                   &pixels[y * image.stride + x * image.pixel_stride()],
-                   bytes_per_pixel);
+            memcpy(&row[x * bytes_per_pixel],
+                   image.Row(y) + x * image.pixel_stride, bytes_per_pixel);
           }
-          JSAMPROW row[] = {row_bytes.data()};
-          jpegli_write_scanlines(&cinfo, row, 1);
+          rows[y - y0] = row;
         }
+        jpegli_write_scanlines(&cinfo, rows, y1 - y0);
       }
     }
     jpegli_finish_compress(&cinfo);
+    if (jpeg_settings.memory_stats != nullptr) {
+      jpegli_get_memory_stats(reinterpret_cast<j_common_ptr>(&cinfo),
+                              jpeg_settings.memory_stats);
+    }
+    if (jpeg_settings.stage_stats != nullptr) {
+      jpegli_get_stage_stats(reinterpret_cast<j_common_ptr>(&cinfo),
+                             jpeg_settings.stage_stats);
+    }
     compressed->resize(output_size);
     std::copy_n(output_buffer, output_size, compressed->data());
     return true;
@@ -566,5 +717,72 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
   return success;
 }
 
+InputRows FrameRows(const PackedImage& image) {
+  return {image.format,
+          image.xsize,
+          image.ysize,
+          image.pixel_stride(),
+          reinterpret_cast<const uint8_t*>(image.pixels()),
+          static_cast<ptrdiff_t>(image.stride),
+          image.row_padding()};
+}
+
+}  // namespace
+
+Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
+                  ThreadPool* pool, std::vector<uint8_t>* compressed) {
+  if (jpeg_settings.libjpeg_quality > 0) {
+    auto encoder = Encoder::FromExtension(".jpg");
+    encoder->SetOption("q", std::to_string(jpeg_settings.libjpeg_quality));
+    if (!jpeg_settings.libjpeg_chroma_subsampling.empty()) {
+      encoder->SetOption("chroma_subsampling",
+                         jpeg_settings.libjpeg_chroma_subsampling);
+    }
+    EncodedImage encoded;
+    JXL_RETURN_IF_ERROR(encoder->Encode(ppf, &encoded, pool));
+    JpegSettings settings = jpeg_settings;
+    settings.libjpeg_quality = 0;
+    settings.target_size = encoded.bitstreams[0].size();
+    return EncodeJpeg(ppf, settings, pool, compressed);
+  }
+  JXL_RETURN_IF_ERROR(VerifyInput(ppf));
+  return EncodeRows(ppf, FrameRows(ppf.frames[0].color), jpeg_settings, pool,
+                    compressed);
+}
+
+Status EncodeJpegFromPNM(Span<const uint8_t> pnm, const ColorHints& color_hints,
+                         const JpegSettings& jpeg_settings, ThreadPool* pool,
+                         std::vector<uint8_t>* compressed) {
+  PackedPixelFile ppf;
+  HeaderPNM header;
+  size_t pixels_offset;
+  JxlPixelFormat format;
+  JXL_RETURN_IF_ERROR(DecodeHeaderPNM(pnm, color_hints, &header, &ppf,
+                                      &pixels_offset, &format));
+  if (!header.ec_types.empty() || jpeg_settings.libjpeg_quality > 0) {
+    // The extra channels of PAM files are interleaved with the color channels
+    // and the libjpeg encoder needs a frame, so these are decoded first.
+    JXL_RETURN_IF_ERROR(DecodeImagePNM(pnm, color_hints, &ppf));
+    return EncodeJpeg(ppf, jpeg_settings, pool, compressed);
+  }
+  JXL_RETURN_IF_ERROR(VerifyFormat(ppf.info, format));
+  JXL_RETURN_IF_ERROR(PackedImage::ValidateDataType(format.data_type));
+  const size_t pixel_stride =
+      format.num_channels * PackedImage::BitsPerChannel(format.data_type) / 8;
+  const size_t row_size = header.xsize * pixel_stride;
+  if (pnm.size() - pixels_offset < row_size * header.ysize) {
+    return JXL_FAILURE("PNM file too small");
+  }
+  const uint8_t* pixels = pnm.data() + pixels_offset;
+  InputRows rows = {format, header.xsize, header.ysize, pixel_stride,
+                    pixels, static_cast<ptrdiff_t>(row_size)};
+  if (header.bits_per_sample == 32) {
+    // PFM rows are stored bottom-up.
+    rows.first_row = pixels + (header.ysize - 1) * row_size;
+    rows.stride = -rows.stride;
+  }
+  return EncodeRows(ppf, rows, jpeg_settings, pool, compressed);
+}
+
 }  // namespace extras
 }  // namespace jxl
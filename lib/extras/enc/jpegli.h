@@ -15,7 +15,13 @@
 #include <vector>
 
 #include "lib/base/data_parallel.h"
+#include "lib/base/memory_manager.h"
+#include "lib/base/span.h"
 #include "lib/base/status.h"
+#include "lib/extras/dec/color_hints.h"
+
+struct jpegli_memory_stats;
+struct jpegli_stage_stats;
 
 namespace jxl {
 namespace extras {
@@ -28,27 +34,72 @@ struct JpegSettings {
   float quality = 0.0f;
   float distance = 1.f;
   bool use_adaptive_quantization = true;
+  // If true, uses the JPEGLI_AQ_FAST mode of jpegli_set_aq_mode().
+  bool use_fast_adaptive_quantization = false;
+  // Only used if adaptive quantization is disabled, see
+  // jpegli_use_fixed_point_dct().
+  bool use_fixed_point_dct = false;
+  // See jpegli_use_compact_tokens().
+  bool use_compact_tokens = false;
+  // See jpegli_use_two_pass_tokenization().
+  bool use_two_pass_tokenization = false;
   bool use_std_quant_tables = false;
   int progressive_level = 2;
+  // See jpegli_optimize_scans().
+  bool optimize_scans = false;
   bool optimize_coding = true;
+  // If non-zero, overrides the adaptive quantization, DCT, progressive level,
+  // scan optimization and Huffman code optimization settings above, see
+  // jpegli_set_effort().
+  int effort = 0;
   std::string chroma_subsampling;
   int libjpeg_quality = 0;
   std::string libjpeg_chroma_subsampling;
-  // Parameters for selecting distance based on PSNR target.
+  // Parameters for selecting distance based on PSNR, butteraugli or size
+  // target.
   float psnr_target = 0.0f;
+  float butteraugli_target = 0.0f;
   float search_tolerance = 0.01;
   float min_distance = 0.1f;
   float max_distance = 25.0f;
+  // If positive, RGB input with a PQ or HLG transfer function is tone mapped
+  // to SDR with this peak luminance in nits while it is read by jpegli, see
+  // jpegli_set_input_tone_mapping(), and the output has the sRGB transfer
+  // function. Not used in XYB mode.
+  float sdr_target_nits = 0.0f;
+  // If true, RGBA input is composited onto the red, green and blue
+  // alpha_background color, in the [0.0, 1.0] range, while it is read by
+  // jpegli, see jpegli_set_input_alpha_background(). Otherwise the alpha
+  // channel is ignored. Not used in XYB mode.
+  bool blend_alpha = false;
+  float alpha_background[3] = {1.0f, 1.0f, 1.0f};
   // If not empty, must contain concatenated APP marker segments. In this case,
   // these and only these APP marker segments will be written to the JPEG
   // output. In xyb mode app_data must not contain an ICC profile, in this
   // case an additional APP2 ICC profile for the XYB colorspace will be emitted.
   std::vector<uint8_t> app_data;
+  // If not nullptr, the memory blocks of jpegli are allocated with it, see
+  // jpegli_set_memory_manager().
+  JxlMemoryManager* memory_manager = nullptr;
+  // If not nullptr, it is filled in with the memory usage of the jpegli
+  // compressor after the image is encoded, see jpegli_get_memory_stats().
+  jpegli_memory_stats* memory_stats = nullptr;
+  // If not nullptr, the stage times and, if the system supports it, the
+  // hardware event counts of the compressor are recorded, and it is filled in
+  // with them after the image is encoded, see jpegli_get_stage_stats().
+  jpegli_stage_stats* stage_stats = nullptr;
 };
 
 Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
                   ThreadPool* pool, std::vector<uint8_t>* compressed);
 
+// Same as decoding the PNM/PFM file in `pnm` and calling EncodeJpeg(), but the
+// rows of the image are passed to jpegli in place instead of being copied to a
+// PackedPixelFile first, so `pnm` can be a memory mapped file of any size.
+Status EncodeJpegFromPNM(Span<const uint8_t> pnm, const ColorHints& color_hints,
+                         const JpegSettings& jpeg_settings, ThreadPool* pool,
+                         std::vector<uint8_t>* compressed);
+
 }  // namespace extras
 }  // namespace jxl
 
@@ -332,10 +332,16 @@ Status EncodeWithLibJpeg(const PackedImage& image, const JxlBasicInfo& info,
   const uint8_t* pixels = reinterpret_cast<const uint8_t*>(image.pixels());
   if (cinfo.num_components == static_cast<int>(image.format.num_channels) &&
       image.format.data_type == JXL_TYPE_UINT8) {
-    for (size_t y = 0; y < info.ysize; ++y) {
-      memcpy(row_bytes.data(), pixels + y * image.stride, image.stride);
-      JSAMPROW row[] = {row_bytes.data()};
-      jpeg_write_scanlines(&cinfo, row, 1);
+    // libjpeg only reads the input rows, so they are passed in place, a whole
+    // iMCU row at a time.
+    JSAMPROW rows[MAX_SAMP_FACTOR * DCTSIZE];
+    const size_t imcu_rows = cinfo.max_v_samp_factor * DCTSIZE;
+    for (size_t y0 = 0; y0 < info.ysize; y0 += imcu_rows) {
+      const size_t y1 = std::min<size_t>(y0 + imcu_rows, info.ysize);
+      for (size_t y = y0; y < y1; ++y) {
+        rows[y - y0] = const_cast<JSAMPROW>(pixels + y * image.stride);
+      }
+      jpeg_write_scanlines(&cinfo, rows, y1 - y0);
     }
   } else if (image.format.data_type == JXL_TYPE_UINT8) {
     for (size_t y = 0; y < info.ysize; ++y) {
@@ -8,7 +8,12 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
 
+#include "lib/base/common.h"
 #include "lib/base/compiler_specific.h"
 #include "lib/base/data_parallel.h"
 #include "lib/base/memory_manager.h"
@@ -20,13 +25,154 @@
 
 namespace jxl {
 
+struct ColorTransformCacheEntry {
+  uint64_t hash;
+  IccBytes icc_src;
+  IccBytes icc_dst;
+  float intensity_target;
+  jpegxl_cms_init_func cms_init;
+  void* cms_init_data;
+  size_t xsize;
+  size_t num_threads;
+  std::unique_ptr<ColorSpaceTransform> transform;
+
+  bool Matches(const ColorTransformCacheEntry& key) const {
+    return hash == key.hash && intensity_target == key.intensity_target &&
+           cms_init == key.cms_init && cms_init_data == key.cms_init_data &&
+           xsize >= key.xsize && num_threads >= key.num_threads &&
+           icc_src == key.icc_src && icc_dst == key.icc_dst;
+  }
+};
+
+namespace {
+
+constexpr size_t kDefaultColorTransformCacheCapacity = 64;
+
+// FNV-1a, only used to skip comparing the ICC bytes of most non-matching
+// entries.
+uint64_t HashIcc(const IccBytes& icc, uint64_t hash) {
+  for (uint8_t byte : icc) {
+    hash = (hash ^ byte) * 0x100000001B3ull;
+  }
+  return hash;
+}
+
+class ColorTransformCache {
+ public:
+  static ColorTransformCache* Get() {
+    static ColorTransformCache* cache = new ColorTransformCache();
+    return cache;
+  }
+
+  // Removes and returns the most recently used idle entry matching key, or
+  // null if there is none.
+  std::unique_ptr<ColorTransformCacheEntry> Take(
+      const ColorTransformCacheEntry& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = idle_.begin(); it != idle_.end(); ++it) {
+      if ((*it)->Matches(key)) {
+        std::unique_ptr<ColorTransformCacheEntry> entry = std::move(*it);
+        idle_.erase(it);
+        return entry;
+      }
+    }
+    return nullptr;
+  }
+
+  void Put(std::unique_ptr<ColorTransformCacheEntry> entry) {
+    std::list<std::unique_ptr<ColorTransformCacheEntry>> evicted;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      idle_.push_front(std::move(entry));
+      while (idle_.size() > capacity_) {
+        evicted.splice(evicted.end(), idle_, std::prev(idle_.end()));
+      }
+    }
+    // The transforms in evicted are destroyed outside the lock.
+  }
+
+  void SetCapacity(size_t capacity) {
+    std::list<std::unique_ptr<ColorTransformCacheEntry>> evicted;
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = capacity;
+    while (idle_.size() > capacity_) {
+      evicted.splice(evicted.end(), idle_, std::prev(idle_.end()));
+    }
+  }
+
+ private:
+  std::mutex mutex_;
+  // Most recently used first.
+  std::list<std::unique_ptr<ColorTransformCacheEntry>> idle_;
+  size_t capacity_ = kDefaultColorTransformCacheCapacity;
+};
+
+}  // namespace
+
+CachedColorTransform::CachedColorTransform() = default;
+CachedColorTransform::CachedColorTransform(
+    CachedColorTransform&& other) noexcept = default;
+
+CachedColorTransform& CachedColorTransform::operator=(
+    CachedColorTransform&& other) noexcept {
+  if (this != &other) {
+    Release();
+    entry_ = std::move(other.entry_);
+  }
+  return *this;
+}
+
+CachedColorTransform::~CachedColorTransform() { Release(); }
+
+void CachedColorTransform::Release() {
+  if (entry_ != nullptr && entry_->transform != nullptr) {
+    ColorTransformCache::Get()->Put(std::move(entry_));
+  }
+  entry_.reset();
+}
+
+Status CachedColorTransform::Init(const ColorEncoding& c_src,
+                                  const ColorEncoding& c_dst,
+                                  float intensity_target, size_t xsize,
+                                  size_t num_threads,
+                                  const JxlCmsInterface& cms) {
+  Release();
+  ColorTransformCacheEntry key;
+  key.icc_src = c_src.ICC();
+  key.icc_dst = c_dst.ICC();
+  key.hash = HashIcc(key.icc_dst, HashIcc(key.icc_src, 0xCBF29CE484222325ull));
+  key.intensity_target = intensity_target;
+  key.cms_init = cms.init;
+  key.cms_init_data = cms.init_data;
+  key.xsize = xsize;
+  key.num_threads = num_threads;
+  entry_ = ColorTransformCache::Get()->Take(key);
+  if (entry_ != nullptr) return true;
+
+  auto transform = jxl::make_unique<ColorSpaceTransform>(cms);
+  JXL_RETURN_IF_ERROR(transform->Init(c_src, c_dst, intensity_target, xsize,
+                                      num_threads));
+  entry_ = jxl::make_unique<ColorTransformCacheEntry>(std::move(key));
+  entry_->transform = std::move(transform);
+  return true;
+}
+
+ColorSpaceTransform& CachedColorTransform::transform() const {
+  JXL_DASSERT(entry_ != nullptr && entry_->transform != nullptr);
+  return *entry_->transform;
+}
+
+void SetColorTransformCacheCapacity(size_t capacity) {
+  ColorTransformCache::Get()->SetCapacity(capacity);
+}
+
 Status ApplyColorTransform(const ColorEncoding& c_current,
                            float intensity_target, const Image3F& color,
                            const ImageF* black, const Rect& rect,
                            const ColorEncoding& c_desired,
                            const JxlCmsInterface& cms, ThreadPool* pool,
                            Image3F* out) {
-  ColorSpaceTransform c_transform(cms);
+  CachedColorTransform cached_transform;
   // Changing IsGray is probably a bug.
   JXL_ENSURE(c_current.IsGray() == c_desired.IsGray());
   bool is_gray = c_current.IsGray();
@@ -38,12 +184,14 @@ Status ApplyColorTransform(const ColorEncoding& c_current,
     JXL_RETURN_IF_ERROR(out->ShrinkTo(rect.xsize(), rect.ysize()));
   }
   const auto init = [&](const size_t num_threads) -> Status {
-    JXL_RETURN_IF_ERROR(c_transform.Init(c_current, c_desired, intensity_target,
-                                         rect.xsize(), num_threads));
+    JXL_RETURN_IF_ERROR(cached_transform.Init(c_current, c_desired,
+                                              intensity_target, rect.xsize(),
+                                              num_threads, cms));
     return true;
   };
   const auto transform_row = [&](const uint32_t y,
                                  const size_t thread) -> Status {
+    ColorSpaceTransform& c_transform = cached_transform.transform();
     float* mutable_src_buf = c_transform.BufSrc(thread);
     const float* src_buf = mutable_src_buf;
     // Interleave input.
@@ -7,6 +7,9 @@
 #ifndef LIB_EXTRAS_IMAGE_COLOR_TRANSFORM_H_
 #define LIB_EXTRAS_IMAGE_COLOR_TRANSFORM_H_
 
+#include <cstddef>
+#include <memory>
+
 #include "lib/base/data_parallel.h"
 #include "lib/base/rect.h"
 #include "lib/base/status.h"
@@ -16,6 +19,39 @@
 
 namespace jxl {
 
+struct ColorTransformCacheEntry;
+
+// An initialized color transform checked out of the process-wide transform
+// cache. It is used by one owner at a time and goes back to the cache when
+// destroyed, so concurrent conversions between the same profiles get separate
+// transforms and none of them is shared between threads.
+class CachedColorTransform {
+ public:
+  CachedColorTransform();
+  CachedColorTransform(CachedColorTransform&& other) noexcept;
+  CachedColorTransform& operator=(CachedColorTransform&& other) noexcept;
+  ~CachedColorTransform();
+
+  // Same as ColorSpaceTransform::Init, but reuses an idle transform between
+  // the same profiles (by ICC contents), intensity target and CMS if one with
+  // at least xsize pixels and num_threads thread buffers is cached.
+  Status Init(const ColorEncoding& c_src, const ColorEncoding& c_dst,
+              float intensity_target, size_t xsize, size_t num_threads,
+              const JxlCmsInterface& cms);
+
+  // Requires a successful Init.
+  ColorSpaceTransform& transform() const;
+
+ private:
+  void Release();
+
+  std::unique_ptr<ColorTransformCacheEntry> entry_;
+};
+
+// Sets the maximum number of idle transforms kept by the cache; the least
+// recently used ones are destroyed first. 0 disables caching.
+void SetColorTransformCacheCapacity(size_t capacity);
+
 Status ApplyColorTransform(const ColorEncoding& c_current,
                            float intensity_target, const Image3F& color,
                            const ImageF* black, const Rect& rect,
@@ -17,6 +17,7 @@
 #include <utility>
 #include <vector>
 
+#include "lib/base/byte_order.h"
 #include "lib/base/memory_manager.h"
 #include "lib/base/span.h"
 #include "lib/base/status.h"
@@ -152,6 +153,92 @@ TEST(JpegliTest, JpegliGrayscaleDecodeTest) {
             ButteraugliDistance(memory_manager, ppf0, ppf1));
 }
 
+TEST(JpegliTest, JpegliStreamingDecodeTest) {
+  TEST_LIBJPEG_SUPPORT();
+  std::string testimage = "jxl/flower/flower_small.rgb.depth8.ppm";
+  PackedPixelFile ppf0;
+  ASSERT_TRUE(ReadTestImage(testimage, &ppf0));
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithLibjpeg(ppf0, 90, &compressed));
+
+  for (JxlDataType data_type : {JXL_TYPE_UINT8, JXL_TYPE_FLOAT}) {
+    JpegDecompressParams dparams;
+    dparams.output_data_type = data_type;
+    PackedPixelFile ppf1;
+    ASSERT_TRUE(DecodeJpeg(compressed, dparams, nullptr, &ppf1));
+    ASSERT_EQ(1u, ppf1.frames.size());
+    const PackedImage& expected = ppf1.frames[0].color;
+    const size_t row_size = expected.xsize * expected.pixel_stride();
+    std::vector<uint8_t> pixels;
+    size_t next_row = 0;
+    const auto write_rows = [&](const PackedPixelFile& ppf, size_t y,
+                                size_t num_rows, const uint8_t* rows,
+                                size_t stride) -> Status {
+      EXPECT_EQ(next_row, y);
+      EXPECT_EQ(row_size, stride);
+      next_row = y + num_rows;
+      pixels.insert(pixels.end(), rows, rows + num_rows * stride);
+      return true;
+    };
+    PackedPixelFile ppf2;
+    ASSERT_TRUE(
+        DecodeJpegStreaming(Bytes(compressed), dparams, &ppf2, write_rows));
+    EXPECT_TRUE(ppf2.frames.empty());
+    EXPECT_EQ(ppf1.info.xsize, ppf2.info.xsize);
+    EXPECT_EQ(ppf1.info.ysize, ppf2.info.ysize);
+    ASSERT_EQ(expected.ysize, next_row);
+    const uint8_t* expected_pixels =
+        static_cast<const uint8_t*>(expected.pixels());
+    for (size_t y = 0; y < expected.ysize; ++y) {
+      ASSERT_EQ(0, memcmp(&pixels[y * row_size],
+                          expected_pixels + y * expected.stride, row_size));
+    }
+  }
+}
+
+TEST(JpegliTest, JpegliScaledAndCroppedDecodeTest) {
+  TEST_LIBJPEG_SUPPORT();
+  std::string testimage = "jxl/flower/flower_small.rgb.depth8.ppm";
+  PackedPixelFile ppf0;
+  ASSERT_TRUE(ReadTestImage(testimage, &ppf0));
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithLibjpeg(ppf0, 90, &compressed));
+  const size_t xsize = ppf0.info.xsize;
+  const size_t ysize = ppf0.info.ysize;
+
+  JpegDecompressParams dparams;
+  dparams.scale_denom = 8;
+  PackedPixelFile ppf1;
+  ASSERT_TRUE(DecodeJpeg(compressed, dparams, nullptr, &ppf1));
+  EXPECT_EQ((xsize + 7) / 8, ppf1.info.xsize);
+  EXPECT_EQ((ysize + 7) / 8, ppf1.info.ysize);
+  ASSERT_EQ(1u, ppf1.frames.size());
+  EXPECT_EQ(ppf1.info.xsize, ppf1.frames[0].color.xsize);
+  EXPECT_EQ(ppf1.info.ysize, ppf1.frames[0].color.ysize);
+
+  dparams = JpegDecompressParams();
+  dparams.crop_y0 = ysize / 2;
+  dparams.crop_xsize = xsize;
+  dparams.crop_ysize = ysize - ysize / 2;
+  PackedPixelFile ppf2;
+  ASSERT_TRUE(DecodeJpeg(compressed, dparams, nullptr, &ppf2));
+  EXPECT_EQ(xsize, ppf2.info.xsize);
+  EXPECT_EQ(ysize - ysize / 2, ppf2.info.ysize);
+
+  dparams.crop_x0 = xsize / 4;
+  dparams.crop_xsize = xsize / 2;
+  PackedPixelFile ppf3;
+  ASSERT_TRUE(DecodeJpeg(compressed, dparams, nullptr, &ppf3));
+  // The crop region may be widened to iMCU column boundaries.
+  EXPECT_LE(xsize / 2, ppf3.info.xsize);
+  EXPECT_GT(xsize, ppf3.info.xsize);
+  EXPECT_EQ(ysize - ysize / 2, ppf3.info.ysize);
+
+  dparams.crop_ysize = ysize;
+  PackedPixelFile ppf4;
+  EXPECT_FALSE(DecodeJpeg(compressed, dparams, nullptr, &ppf4));
+}
+
 TEST(JpegliTest, JpegliXYBEncodeTest) {
   TEST_LIBJPEG_SUPPORT();
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
@@ -348,6 +435,58 @@ TEST(JpegliTest, JpegliSetAppData) {
   EXPECT_FALSE(EncodeJpeg(ppf_in, settings, nullptr, &compressed));
 }
 
+// Returns a PNM file with the given header and a gradient of
+// bytes_per_sample sized samples, which are floats for PFM files.
+std::vector<uint8_t> CreatePNM(const std::string& header, size_t num_samples,
+                               size_t bytes_per_sample) {
+  std::vector<uint8_t> pnm(header.begin(), header.end());
+  for (size_t i = 0; i < num_samples; ++i) {
+    uint8_t bytes[4];
+    if (bytes_per_sample == 1) {
+      bytes[0] = (i * 7) & 0xff;
+    } else if (bytes_per_sample == 2) {
+      StoreBE16((i * 331) & 0xffff, bytes);
+    } else {
+      float value = ((i * 13) % 1000) / 1000.0f;
+      uint32_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      StoreBE32(bits, bytes);
+    }
+    pnm.insert(pnm.end(), bytes, bytes + bytes_per_sample);
+  }
+  return pnm;
+}
+
+TEST(JpegliTest, JpegliEncodeFromPNM) {
+  const std::vector<uint8_t> inputs[] = {
+      CreatePNM("P6\n67 45\n255\n", 67 * 45 * 3, 1),
+      CreatePNM("P5\n67 45\n255\n", 67 * 45, 1),
+      CreatePNM("P6\n67 45\n65535\n", 67 * 45 * 3, 2),
+      CreatePNM("PF\n67 45\n1.0\n", 67 * 45 * 3, 4),
+      CreatePNM("Pf\n67 45\n1.0\n", 67 * 45, 4),
+  };
+  for (const std::vector<uint8_t>& pnm : inputs) {
+    for (bool xyb : {false, true}) {
+      JpegSettings settings;
+      settings.xyb = xyb;
+      PackedPixelFile ppf;
+      ASSERT_TRUE(DecodeBytes(Bytes(pnm), ColorHints(), &ppf));
+      std::vector<uint8_t> expected;
+      ASSERT_TRUE(EncodeJpeg(ppf, settings, nullptr, &expected));
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeJpegFromPNM(Bytes(pnm), ColorHints(), settings,
+                                    nullptr, &compressed));
+      EXPECT_EQ(expected, compressed);
+    }
+  }
+  // Truncated pixel data.
+  std::vector<uint8_t> pnm = inputs[0];
+  pnm.pop_back();
+  std::vector<uint8_t> compressed;
+  EXPECT_FALSE(EncodeJpegFromPNM(Bytes(pnm), ColorHints(), JpegSettings(),
+                                 nullptr, &compressed));
+}
+
 struct TestConfig {
   int num_colors;
   int passes;
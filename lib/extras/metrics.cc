@@ -6,13 +6,18 @@
 
 #include "lib/extras/metrics.h"
 
+#include <array>
 #include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <limits>
 #include <memory>
+#include <vector>
 
+#include "lib/base/byte_order.h"
+#include "lib/base/common.h"
 #include "lib/base/data_parallel.h"
 #include "lib/base/memory_manager.h"
 #include "lib/cms/cms_interface.h"
@@ -40,8 +45,14 @@ namespace HWY_NAMESPACE {
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Add;
 using hwy::HWY_NAMESPACE::GetLane;
+using hwy::HWY_NAMESPACE::LoadInterleaved2;
+using hwy::HWY_NAMESPACE::LoadInterleaved3;
+using hwy::HWY_NAMESPACE::LoadInterleaved4;
 using hwy::HWY_NAMESPACE::Mul;
+using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::NegMulAdd;
 using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::Vec;
 
 StatusOr<double> ComputeDistanceP(const ImageF& distmap,
                                   const ButteraugliParams& params, double p) {
@@ -148,50 +159,18 @@ StatusOr<double> ComputeDistanceP(const ImageF& distmap,
   }
 }
 
-Status ComputeSumOfSquares(JxlMemoryManager* memory_manager,
-                           const extras::PackedPixelFile& a,
-                           const extras::PackedPixelFile& b,
-                           const JxlCmsInterface& cms,
-                           double sum_of_squares[3]) {
-  sum_of_squares[0] = sum_of_squares[1] = sum_of_squares[2] =
-      std::numeric_limits<double>::max();
-  const size_t xsize = a.xsize();
-  const size_t ysize = a.ysize();
-  const bool is_gray = a.info.num_color_channels == 1;
-  // Convert to sRGB - closer to perception than linear.
-  ColorEncoding c_desired = ColorEncoding::SRGB(is_gray);
-
-  JXL_ASSIGN_OR_RETURN(Image3F srgb0,
-                       Image3F::Create(memory_manager, xsize, ysize));
-  JXL_RETURN_IF_ERROR(ConvertPackedPixelFileToImage3F(a, &srgb0, nullptr));
-  JXL_ASSIGN_OR_RETURN(Image3F srgb1,
-                       Image3F::Create(memory_manager, xsize, ysize));
-  JXL_RETURN_IF_ERROR(ConvertPackedPixelFileToImage3F(b, &srgb1, nullptr));
-
-  ColorEncoding c_enc_a;
-  ColorEncoding c_enc_b;
-  JXL_RETURN_IF_ERROR(GetColorEncoding(a, &c_enc_a));
-  JXL_RETURN_IF_ERROR(GetColorEncoding(b, &c_enc_b));
-  float intensity_a = GetIntensityTarget(a, c_enc_a);
-  float intensity_b = GetIntensityTarget(b, c_enc_b);
-
-  if (!c_enc_a.SameColorEncoding(c_desired)) {
-    JXL_RETURN_IF_ERROR(ApplyColorTransform(c_enc_a, intensity_a, srgb0,
-                                            nullptr, Rect(srgb0), c_desired,
-                                            cms, nullptr, &srgb0));
-  }
-  if (!c_enc_b.SameColorEncoding(c_desired)) {
-    JXL_RETURN_IF_ERROR(ApplyColorTransform(c_enc_b, intensity_b, srgb1,
-                                            nullptr, Rect(srgb1), c_desired,
-                                            cms, nullptr, &srgb1));
-  }
+// PSNR is computed on YUV differences of sRGB samples.
+constexpr float kYUVMatrix[3][3] = {{0.299, 0.587, 0.114},
+                                    {-0.14713, -0.28886, 0.436},
+                                    {0.615, -0.51499, -0.10001}};
 
+void ComputeSumOfSquares(const Image3F& srgb0, const Image3F& srgb1,
+                         double sum_of_squares[3]) {
+  const size_t xsize = srgb0.xsize();
+  const size_t ysize = srgb0.ysize();
   sum_of_squares[0] = sum_of_squares[1] = sum_of_squares[2] = 0.0;
 
   // TODO(veluca): SIMD.
-  float yuvmatrix[3][3] = {{0.299, 0.587, 0.114},
-                           {-0.14713, -0.28886, 0.436},
-                           {0.615, -0.51499, -0.10001}};
   for (size_t y = 0; y < ysize; ++y) {
     const float* JXL_RESTRICT row0[3];
     const float* JXL_RESTRICT row1[3];
@@ -208,7 +187,7 @@ Status ComputeSumOfSquares(JxlMemoryManager* memory_manager,
       float yuvdiff[3] = {};
       for (size_t j = 0; j < 3; j++) {
         for (size_t k = 0; k < 3; k++) {
-          yuvdiff[j] += yuvmatrix[j][k] * cdiff[k];
+          yuvdiff[j] += kYUVMatrix[j][k] * cdiff[k];
         }
       }
       for (size_t j = 0; j < 3; j++) {
@@ -216,6 +195,164 @@ Status ComputeSumOfSquares(JxlMemoryManager* memory_manager,
       }
     }
   }
+}
+
+// Loads Lanes(df) pixels of kChannels interleaved samples and converts their
+// color samples to float. For gray (and gray + alpha), only c0 is set.
+template <size_t kChannels, class DF, typename T>
+void LoadPixels(DF df, const T* JXL_RESTRICT pos, Vec<DF>& c0, Vec<DF>& c1,
+                Vec<DF>& c2) {
+  const Rebind<T, DF> dt;
+  const Rebind<int32_t, DF> di;
+  Vec<decltype(dt)> v0, v1, v2, v3;  // NOLINT
+  if (kChannels == 1) {
+    v0 = LoadU(dt, pos);
+  } else if (kChannels == 2) {
+    LoadInterleaved2(dt, pos, v0, v1);
+  } else if (kChannels == 3) {
+    LoadInterleaved3(dt, pos, v0, v1, v2);
+  } else {
+    LoadInterleaved4(dt, pos, v0, v1, v2, v3);
+  }
+  c0 = ConvertTo(df, PromoteTo(di, v0));
+  if (kChannels >= 3) {
+    c1 = ConvertTo(df, PromoteTo(di, v1));
+    c2 = ConvertTo(df, PromoteTo(di, v2));
+  }
+}
+
+// Adds to sums the products d0*d0, d0*d1, d0*d2, d1*d1, d1*d2, d2*d2 of the
+// color differences dc = row0[c] * scale0 - row1[c] * scale1 of one row. Gray
+// pixels have d0 = d1 = d2, as after ConvertPackedPixelFileToImage3F.
+template <size_t kChannels, typename T>
+void AddRowProducts(const T* JXL_RESTRICT row0, const float scale0,
+                    const T* JXL_RESTRICT row1, const float scale1,
+                    const size_t xsize, double sums[6]) {
+  const HWY_FULL(float) df;
+  using V = Vec<decltype(df)>;
+  const V mul0 = Set(df, scale0);
+  const V mul1 = Set(df, scale1);
+  V s00 = Zero(df);
+  V s01 = Zero(df);
+  V s02 = Zero(df);
+  V s11 = Zero(df);
+  V s12 = Zero(df);
+  V s22 = Zero(df);
+  size_t x = 0;
+  for (; x + Lanes(df) <= xsize; x += Lanes(df)) {
+    V a0, a1, a2, b0, b1, b2;  // NOLINT
+    LoadPixels<kChannels>(df, row0 + x * kChannels, a0, a1, a2);
+    LoadPixels<kChannels>(df, row1 + x * kChannels, b0, b1, b2);
+    const V d0 = NegMulAdd(b0, mul1, Mul(a0, mul0));
+    s00 = MulAdd(d0, d0, s00);
+    if (kChannels >= 3) {
+      const V d1 = NegMulAdd(b1, mul1, Mul(a1, mul0));
+      const V d2 = NegMulAdd(b2, mul1, Mul(a2, mul0));
+      s01 = MulAdd(d0, d1, s01);
+      s02 = MulAdd(d0, d2, s02);
+      s11 = MulAdd(d1, d1, s11);
+      s12 = MulAdd(d1, d2, s12);
+      s22 = MulAdd(d2, d2, s22);
+    }
+  }
+  float row_sums[6] = {
+      GetLane(SumOfLanes(df, s00)), GetLane(SumOfLanes(df, s01)),
+      GetLane(SumOfLanes(df, s02)), GetLane(SumOfLanes(df, s11)),
+      GetLane(SumOfLanes(df, s12)), GetLane(SumOfLanes(df, s22))};
+  for (; x < xsize; ++x) {
+    float d[3];
+    for (size_t c = 0; c < 3; ++c) {
+      const size_t i = x * kChannels + (kChannels >= 3 ? c : 0);
+      d[c] = row0[i] * scale0 - row1[i] * scale1;
+    }
+    row_sums[0] += d[0] * d[0];
+    row_sums[1] += d[0] * d[1];
+    row_sums[2] += d[0] * d[2];
+    row_sums[3] += d[1] * d[1];
+    row_sums[4] += d[1] * d[2];
+    row_sums[5] += d[2] * d[2];
+  }
+  if (kChannels < 3) {
+    for (size_t i = 1; i < 6; ++i) row_sums[i] = row_sums[0];
+  }
+  for (size_t i = 0; i < 6; ++i) sums[i] += row_sums[i];
+}
+
+template <typename T>
+void AddRowProducts(const size_t num_channels, const uint8_t* row0,
+                    const float scale0, const uint8_t* row1,
+                    const float scale1, const size_t xsize, double sums[6]) {
+  const T* in0 = reinterpret_cast<const T*>(row0);
+  const T* in1 = reinterpret_cast<const T*>(row1);
+  if (num_channels == 1) {
+    AddRowProducts<1>(in0, scale0, in1, scale1, xsize, sums);
+  } else if (num_channels == 2) {
+    AddRowProducts<2>(in0, scale0, in1, scale1, xsize, sums);
+  } else if (num_channels == 3) {
+    AddRowProducts<3>(in0, scale0, in1, scale1, xsize, sums);
+  } else {
+    AddRowProducts<4>(in0, scale0, in1, scale1, xsize, sums);
+  }
+}
+
+// Same as ComputeSumOfSquares, but directly on the interleaved uint8/uint16
+// samples of two images with the same layout, each scaled to [0, 1] by its
+// scale. Since the YUV conversion is linear, the YUV sums of squares follow
+// from the sums of products of the per-channel differences, which are
+// accumulated per thread.
+Status ComputePackedSumOfSquares(const extras::PackedImage& image0,
+                                 const float scale0,
+                                 const extras::PackedImage& image1,
+                                 const float scale1, ThreadPool* pool,
+                                 double sum_of_squares[3]) {
+  JXL_ENSURE(image0.xsize == image1.xsize && image0.ysize == image1.ysize);
+  JXL_ENSURE(image0.format.data_type == image1.format.data_type);
+  JXL_ENSURE(image0.format.num_channels == image1.format.num_channels);
+  const size_t num_channels = image0.format.num_channels;
+  const bool is_uint8 = image0.format.data_type == JXL_TYPE_UINT8;
+  JXL_ENSURE(is_uint8 || image0.format.data_type == JXL_TYPE_UINT16);
+  JXL_ENSURE(num_channels >= 1 && num_channels <= 4);
+
+  std::vector<std::array<double, 6>> thread_sums;
+  const auto init = [&](const size_t num_threads) -> Status {
+    thread_sums.assign(num_threads, std::array<double, 6>{});
+    return true;
+  };
+  const auto process_row = [&](const uint32_t y,
+                               const size_t thread) HWY_ATTR {
+    const uint8_t* row0 =
+        reinterpret_cast<const uint8_t*>(image0.pixels()) + y * image0.stride;
+    const uint8_t* row1 =
+        reinterpret_cast<const uint8_t*>(image1.pixels()) + y * image1.stride;
+    double* sums = thread_sums[thread].data();
+    if (is_uint8) {
+      AddRowProducts<uint8_t>(num_channels, row0, scale0, row1, scale1,
+                              image0.xsize, sums);
+    } else {
+      AddRowProducts<uint16_t>(num_channels, row0, scale0, row1, scale1,
+                               image0.xsize, sums);
+    }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, image0.ysize, init, process_row,
+                                "ComputePackedSumOfSquares"));
+
+  double sums[6] = {};
+  for (const auto& partial : thread_sums) {
+    for (size_t i = 0; i < 6; ++i) sums[i] += partial[i];
+  }
+  const double products[3][3] = {{sums[0], sums[1], sums[2]},
+                                 {sums[1], sums[3], sums[4]},
+                                 {sums[2], sums[4], sums[5]}};
+  for (size_t j = 0; j < 3; ++j) {
+    sum_of_squares[j] = 0.0;
+    for (size_t k = 0; k < 3; ++k) {
+      for (size_t l = 0; l < 3; ++l) {
+        sum_of_squares[j] +=
+            kYUVMatrix[j][k] * kYUVMatrix[j][l] * products[k][l];
+      }
+    }
+  }
   return true;
 }
 
@@ -228,17 +365,95 @@ HWY_AFTER_NAMESPACE();
 namespace jxl {
 
 namespace {
+// Decodes 'ppf' into 'out' and converts it to 'c_desired'.
+Status ConvertToColorEncoding(JxlMemoryManager* memory_manager,
+                              const extras::PackedPixelFile& ppf,
+                              const ColorEncoding& c_desired,
+                              const JxlCmsInterface& cms, ThreadPool* pool,
+                              Image3F* out) {
+  JXL_ASSIGN_OR_RETURN(
+      *out, Image3F::Create(memory_manager, ppf.xsize(), ppf.ysize()));
+  JXL_RETURN_IF_ERROR(ConvertPackedPixelFileToImage3F(ppf, out, pool));
+  ColorEncoding c_enc;
+  JXL_RETURN_IF_ERROR(GetColorEncoding(ppf, &c_enc));
+  float intensity = GetIntensityTarget(ppf, c_enc);
+  if (!c_enc.SameColorEncoding(c_desired)) {
+    JXL_RETURN_IF_ERROR(ApplyColorTransform(c_enc, intensity, *out, nullptr,
+                                            Rect(*out), c_desired, cms, pool,
+                                            out));
+  }
+  return true;
+}
+
+// Returns the factor that maps the samples of ppf to [0, 1] if PSNR can be
+// computed directly on its packed pixels, i.e. they are unsigned integers in
+// native byte order and already in c_desired, or 0 otherwise.
+float PackedPSNRScale(const extras::PackedPixelFile& ppf,
+                      const ColorEncoding& c_desired) {
+  if (ppf.frames.empty()) return 0.0f;
+  const extras::PackedImage& img = ppf.frames[0].color;
+  const JxlPixelFormat& format = img.format;
+  if (format.data_type != JXL_TYPE_UINT8 &&
+      format.data_type != JXL_TYPE_UINT16) {
+    return 0.0f;
+  }
+  if (SwapEndianness(format.endianness)) return 0.0f;
+  const size_t num_color_channels = format.num_channels < 3 ? 1 : 3;
+  if (format.num_channels > 4 ||
+      num_color_channels != ppf.info.num_color_channels) {
+    return 0.0f;
+  }
+  ColorEncoding c_enc;
+  if (!GetColorEncoding(ppf, &c_enc) || !c_enc.SameColorEncoding(c_desired)) {
+    return 0.0f;
+  }
+  const size_t bits_per_sample =
+      ppf.input_bitdepth.type == JXL_BIT_DEPTH_FROM_PIXEL_FORMAT
+          ? extras::PackedImage::BitsPerChannel(format.data_type)
+          : ppf.info.bits_per_sample;
+  if (bits_per_sample == 0 ||
+      bits_per_sample > extras::PackedImage::BitsPerChannel(format.data_type)) {
+    return 0.0f;
+  }
+  return 1.0f / ((1ull << bits_per_sample) - 1);
+}
+
+bool SamePackedLayout(const extras::PackedImage& a,
+                      const extras::PackedImage& b) {
+  return a.xsize == b.xsize && a.ysize == b.ysize &&
+         a.format.data_type == b.format.data_type &&
+         a.format.num_channels == b.format.num_channels;
+}
+
+double PSNRFromSumOfSquares(const double sum_of_squares[3],
+                            size_t input_pixels) {
+  constexpr double kChannelWeights[3] = {6.0 / 8, 1.0 / 8, 1.0 / 8};
+  double avg_psnr = 0;
+  for (int i = 0; i < 3; ++i) {
+    const double rmse = std::sqrt(sum_of_squares[i] / input_pixels);
+    const double psnr =
+        sum_of_squares[i] == 0 ? 99.99 : (20 * std::log10(1 / rmse));
+    avg_psnr += kChannelWeights[i] * psnr;
+  }
+  return avg_psnr;
+}
+
 Status ComputeButteraugli(const Image3F& ref, const Image3F& actual,
                           const ButteraugliParams& params,
-                          const JxlCmsInterface& cms, float& score,
-                          ImageF* distmap) {
+                          const JxlCmsInterface& cms, ThreadPool* pool,
+                          float& score, ImageF* distmap) {
   JxlMemoryManager* memory_manager = ref.memory_manager();
-  std::unique_ptr<ButteraugliComparator> comparator;
-  JXL_ASSIGN_OR_RETURN(comparator, ButteraugliComparator::Make(ref, params));
   JXL_ASSIGN_OR_RETURN(
       ImageF temp_distmap,
       ImageF::Create(memory_manager, ref.xsize(), ref.ysize()));
-  JXL_ENSURE(comparator->Diffmap(actual, temp_distmap));
+  if (params.tile_size != 0) {
+    JXL_ENSURE(
+        ButteraugliDiffmapTiled(ref, actual, params, pool, temp_distmap));
+  } else {
+    std::unique_ptr<ButteraugliComparator> comparator;
+    JXL_ASSIGN_OR_RETURN(comparator, ButteraugliComparator::Make(ref, params));
+    JXL_ENSURE(comparator->Diffmap(actual, temp_distmap));
+  }
   score = ButteraugliScoreFromDiffmap(temp_distmap, &params);
   if (distmap != nullptr) {
     distmap->Swap(temp_distmap);
@@ -260,37 +475,19 @@ Status ButteraugliDistance(JxlMemoryManager* memory_manager,
   if (a.info.num_color_channels != b.info.num_color_channels) {
     return JXL_FAILURE("Grayscale vs RGB comparison not supported.");
   }
-  const size_t xsize = a.xsize();
-  const size_t ysize = a.ysize();
   const bool is_gray = a.info.num_color_channels == 1;
   ColorEncoding c_desired = ColorEncoding::LinearSRGB(is_gray);
   const JxlCmsInterface& cms = *JxlGetDefaultCms();
 
-  JXL_ASSIGN_OR_RETURN(Image3F rgb0,
-                       Image3F::Create(memory_manager, xsize, ysize));
-  JXL_ENSURE(ConvertPackedPixelFileToImage3F(a, &rgb0, pool));
-  JXL_ASSIGN_OR_RETURN(Image3F rgb1,
-                       Image3F::Create(memory_manager, xsize, ysize));
-  JXL_ENSURE(ConvertPackedPixelFileToImage3F(b, &rgb1, pool));
-
-  ColorEncoding c_enc_a;
-  ColorEncoding c_enc_b;
-  JXL_ENSURE(GetColorEncoding(a, &c_enc_a));
-  JXL_ENSURE(GetColorEncoding(b, &c_enc_b));
-  float intensity_a = GetIntensityTarget(a, c_enc_a);
-  float intensity_b = GetIntensityTarget(b, c_enc_b);
-
-  if (!c_enc_a.SameColorEncoding(c_desired)) {
-    JXL_ENSURE(ApplyColorTransform(c_enc_a, intensity_a, rgb0, nullptr,
-                                   Rect(rgb0), c_desired, cms, pool, &rgb0));
-  }
-  if (!c_enc_b.SameColorEncoding(c_desired)) {
-    JXL_ENSURE(ApplyColorTransform(c_enc_b, intensity_b, rgb1, nullptr,
-                                   Rect(rgb1), c_desired, cms, pool, &rgb1));
-  }
+  Image3F rgb0;
+  JXL_ENSURE(ConvertToColorEncoding(memory_manager, a, c_desired, cms, pool,
+                                    &rgb0));
+  Image3F rgb1;
+  JXL_ENSURE(ConvertToColorEncoding(memory_manager, b, c_desired, cms, pool,
+                                    &rgb1));
 
   JXL_RETURN_IF_ERROR(
-      ComputeButteraugli(rgb0, rgb1, params, cms, score, distmap));
+      ComputeButteraugli(rgb0, rgb1, params, cms, pool, score, distmap));
   return true;
 }
 
@@ -325,10 +522,11 @@ StatusOr<double> Butteraugli3Norm(JxlMemoryManager* memory_manager,
 }
 
 HWY_EXPORT(ComputeSumOfSquares);
+HWY_EXPORT(ComputePackedSumOfSquares);
 double ComputePSNR(JxlMemoryManager* memory_manager,
                    const extras::PackedPixelFile& a,
                    const extras::PackedPixelFile& b,
-                   const JxlCmsInterface& cms) {
+                   const JxlCmsInterface& cms, ThreadPool* pool) {
   if (a.xsize() != b.xsize() || a.ysize() != b.ysize()) {
     fprintf(stderr, "Images must have the same size for PSNR.");
     return 0.0;
@@ -337,23 +535,121 @@ double ComputePSNR(JxlMemoryManager* memory_manager,
     fprintf(stderr, "Grayscale vs RGB comparison not supported.");
     return 0.0;
   }
+  // Convert to sRGB - closer to perception than linear.
+  const ColorEncoding c_desired =
+      ColorEncoding::SRGB(a.info.num_color_channels == 1);
   double sum_of_squares[3] = {};
-  Status ok = HWY_DYNAMIC_DISPATCH(ComputeSumOfSquares)(memory_manager, a, b,
-                                                        cms, sum_of_squares);
-  if (!ok) {
-    fprintf(stderr, "ComputeSumOfSquares failed.");
+  const float scale_a = PackedPSNRScale(a, c_desired);
+  const float scale_b = PackedPSNRScale(b, c_desired);
+  if (scale_a != 0.0f && scale_b != 0.0f &&
+      SamePackedLayout(a.frames[0].color, b.frames[0].color)) {
+    if (!HWY_DYNAMIC_DISPATCH(ComputePackedSumOfSquares)(
+            a.frames[0].color, scale_a, b.frames[0].color, scale_b, pool,
+            sum_of_squares)) {
+      fprintf(stderr, "PSNR computation failed.");
+      return 0.0;
+    }
+    return PSNRFromSumOfSquares(sum_of_squares, a.xsize() * a.ysize());
+  }
+  Image3F srgb0;
+  Image3F srgb1;
+  if (!ConvertToColorEncoding(memory_manager, a, c_desired, cms, pool,
+                              &srgb0) ||
+      !ConvertToColorEncoding(memory_manager, b, c_desired, cms, pool,
+                              &srgb1)) {
+    fprintf(stderr, "Color conversion for PSNR failed.");
     return 0.0;
   }
-  constexpr double kChannelWeights[3] = {6.0 / 8, 1.0 / 8, 1.0 / 8};
-  double avg_psnr = 0;
-  const size_t input_pixels = a.xsize() * a.ysize();
-  for (int i = 0; i < 3; ++i) {
-    const double rmse = std::sqrt(sum_of_squares[i] / input_pixels);
-    const double psnr =
-        sum_of_squares[i] == 0 ? 99.99 : (20 * std::log10(1 / rmse));
-    avg_psnr += kChannelWeights[i] * psnr;
+  HWY_DYNAMIC_DISPATCH(ComputeSumOfSquares)(srgb0, srgb1, sum_of_squares);
+  return PSNRFromSumOfSquares(sum_of_squares, a.xsize() * a.ysize());
+}
+
+StatusOr<std::unique_ptr<ReferenceMetricState>> ReferenceMetricState::Create(
+    JxlMemoryManager* memory_manager, const extras::PackedPixelFile& ref,
+    const ButteraugliParams& params, ThreadPool* pool) {
+  std::unique_ptr<ReferenceMetricState> state(new ReferenceMetricState());
+  state->memory_manager_ = memory_manager;
+  state->params_ = params;
+  state->num_color_channels_ = ref.info.num_color_channels;
+  const bool is_gray = state->num_color_channels_ == 1;
+  const JxlCmsInterface& cms = *JxlGetDefaultCms();
+  JXL_RETURN_IF_ERROR(ConvertToColorEncoding(
+      memory_manager, ref, ColorEncoding::LinearSRGB(is_gray), cms, pool,
+      &state->linear_));
+  JXL_RETURN_IF_ERROR(ConvertToColorEncoding(memory_manager, ref,
+                                             ColorEncoding::SRGB(is_gray), cms,
+                                             pool, &state->srgb_));
+  state->packed_ref_scale_ = PackedPSNRScale(ref, ColorEncoding::SRGB(is_gray));
+  if (state->packed_ref_scale_ != 0.0f) {
+    state->packed_ref_ = jxl::make_unique<extras::PackedImage>(
+        ref.frames[0].color.Copy());
   }
-  return avg_psnr;
+  if (params.tile_size == 0) {
+    JXL_ASSIGN_OR_RETURN(state->comparator_,
+                         ButteraugliComparator::Make(state->linear_, params));
+  }
+  return state;
+}
+
+Status ReferenceMetricState::CheckCompatible(
+    const extras::PackedPixelFile& distorted) const {
+  if (distorted.xsize() != linear_.xsize() ||
+      distorted.ysize() != linear_.ysize()) {
+    return JXL_FAILURE("Images must have the same size.");
+  }
+  if (distorted.info.num_color_channels != num_color_channels_) {
+    return JXL_FAILURE("Grayscale vs RGB comparison not supported.");
+  }
+  return true;
+}
+
+Status ReferenceMetricState::ButteraugliDistance(
+    const extras::PackedPixelFile& distorted, float& score, ImageF* distmap,
+    ThreadPool* pool) const {
+  JXL_RETURN_IF_ERROR(CheckCompatible(distorted));
+  const bool is_gray = num_color_channels_ == 1;
+  Image3F rgb1;
+  JXL_RETURN_IF_ERROR(ConvertToColorEncoding(
+      memory_manager_, distorted, ColorEncoding::LinearSRGB(is_gray),
+      *JxlGetDefaultCms(), pool, &rgb1));
+  JXL_ASSIGN_OR_RETURN(
+      ImageF temp_distmap,
+      ImageF::Create(memory_manager_, linear_.xsize(), linear_.ysize()));
+  if (comparator_) {
+    JXL_RETURN_IF_ERROR(comparator_->Diffmap(rgb1, temp_distmap));
+  } else {
+    JXL_RETURN_IF_ERROR(
+        ButteraugliDiffmapTiled(linear_, rgb1, params_, pool, temp_distmap));
+  }
+  score = ButteraugliScoreFromDiffmap(temp_distmap, &params_);
+  if (distmap != nullptr) {
+    distmap->Swap(temp_distmap);
+  }
+  return true;
+}
+
+StatusOr<double> ReferenceMetricState::ComputePSNR(
+    const extras::PackedPixelFile& distorted, ThreadPool* pool) const {
+  JXL_RETURN_IF_ERROR(CheckCompatible(distorted));
+  const ColorEncoding c_desired = ColorEncoding::SRGB(num_color_channels_ == 1);
+  double sum_of_squares[3] = {};
+  if (packed_ref_) {
+    const float scale1 = PackedPSNRScale(distorted, c_desired);
+    if (scale1 != 0.0f &&
+        SamePackedLayout(*packed_ref_, distorted.frames[0].color)) {
+      JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(ComputePackedSumOfSquares)(
+          *packed_ref_, packed_ref_scale_, distorted.frames[0].color, scale1,
+          pool, sum_of_squares));
+      return PSNRFromSumOfSquares(sum_of_squares,
+                                  srgb_.xsize() * srgb_.ysize());
+    }
+  }
+  Image3F srgb1;
+  JXL_RETURN_IF_ERROR(ConvertToColorEncoding(memory_manager_, distorted,
+                                             c_desired, *JxlGetDefaultCms(),
+                                             pool, &srgb1));
+  HWY_DYNAMIC_DISPATCH(ComputeSumOfSquares)(srgb_, srgb1, sum_of_squares);
+  return PSNRFromSumOfSquares(sum_of_squares, srgb_.xsize() * srgb_.ysize());
 }
 
 }  // namespace jxl
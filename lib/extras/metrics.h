@@ -7,6 +7,9 @@
 #ifndef LIB_EXTRAS_METRICS_H_
 #define LIB_EXTRAS_METRICS_H_
 
+#include <cstddef>
+#include <memory>
+
 #include "lib/base/data_parallel.h"
 #include "lib/base/memory_manager.h"
 #include "lib/base/status.h"
@@ -35,10 +38,49 @@ StatusOr<double> Butteraugli3Norm(JxlMemoryManager* memory_manager,
                                   const extras::PackedPixelFile& b,
                                   ThreadPool* pool = nullptr);
 
+// Weighted YUV PSNR in sRGB. If both images are already sRGB with the same
+// uint8/uint16 layout, it is computed directly on the packed pixels.
 double ComputePSNR(JxlMemoryManager* memory_manager,
                    const extras::PackedPixelFile& a,
                    const extras::PackedPixelFile& b,
-                   const JxlCmsInterface& cms);
+                   const JxlCmsInterface& cms, ThreadPool* pool = nullptr);
+
+// Reference-side state of the butteraugli and PSNR metrics. Computing it once
+// lets repeated comparisons against the same original (e.g. in a rate control
+// search) skip the reference color conversions and butteraugli precomputation.
+// Not thread-safe: concurrent comparisons need separate states.
+class ReferenceMetricState {
+ public:
+  static StatusOr<std::unique_ptr<ReferenceMetricState>> Create(
+      JxlMemoryManager* memory_manager, const extras::PackedPixelFile& ref,
+      const ButteraugliParams& params = ButteraugliParams(),
+      ThreadPool* pool = nullptr);
+
+  // Same as the free ButteraugliDistance, with the parameters given at
+  // creation time.
+  Status ButteraugliDistance(const extras::PackedPixelFile& distorted,
+                             float& score, ImageF* distmap = nullptr,
+                             ThreadPool* pool = nullptr) const;
+
+  StatusOr<double> ComputePSNR(const extras::PackedPixelFile& distorted,
+                               ThreadPool* pool = nullptr) const;
+
+ private:
+  ReferenceMetricState() = default;
+
+  Status CheckCompatible(const extras::PackedPixelFile& distorted) const;
+
+  JxlMemoryManager* memory_manager_ = nullptr;
+  ButteraugliParams params_;
+  size_t num_color_channels_ = 0;
+  Image3F linear_;
+  Image3F srgb_;
+  // Copy of the reference pixels if PSNR can be computed on them directly.
+  std::unique_ptr<extras::PackedImage> packed_ref_;
+  float packed_ref_scale_ = 0.0f;
+  // Null if params_.tile_size is nonzero.
+  std::unique_ptr<ButteraugliComparator> comparator_;
+};
 
 }  // namespace jxl
 
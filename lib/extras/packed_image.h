@@ -63,6 +63,12 @@ static inline void JxlEncoderInitBasicInfo(JxlBasicInfo* info) {
 // Class representing an interleaved image with a bunch of channels.
 class PackedImage {
  public:
+  // Alignment of the rows of padded images, a cache line and a multiple of the
+  // vector size of all SIMD targets.
+  static constexpr size_t kRowAlignment = 64;
+  // Minimum number of bytes after the last pixel of each row of padded images.
+  static constexpr size_t kRowPadding = 256;
+
   static StatusOr<PackedImage> Create(size_t xsize, size_t ysize,
                                       const JxlPixelFormat& format) {
     PackedImage image(xsize, ysize, format, CalcStride(format, xsize));
@@ -73,23 +79,42 @@ class PackedImage {
     return image;
   }
 
+  // Creates an image whose rows start at multiples of kRowAlignment and are
+  // followed by at least kRowPadding bytes that may be overwritten, so that
+  // SIMD code can process whole vectors up to the end of the rows, e.g.
+  // jpegli with padded input or output rows. Consumers of the image must
+  // honor its stride.
+  static StatusOr<PackedImage> CreatePadded(size_t xsize, size_t ysize,
+                                            const JxlPixelFormat& format) {
+    size_t stride =
+        RoundUpTo(CalcStride(format, xsize) + kRowPadding, kRowAlignment);
+    PackedImage image(xsize, ysize, format, stride, kRowAlignment);
+    if (!image.pixels()) {
+      return JXL_FAILURE("Failed to allocate memory for image");
+    }
+    return image;
+  }
+
   PackedImage Copy() const {
-    PackedImage copy(xsize, ysize, format, CalcStride(format, xsize));
+    PackedImage copy(xsize, ysize, format, stride, alignment_);
     memcpy(reinterpret_cast<uint8_t*>(copy.pixels()),
            reinterpret_cast<const uint8_t*>(pixels()), pixels_size);
     return copy;
   }
 
   // The interleaved pixels as defined in the storage format.
-  void* pixels() const { return pixels_.get(); }
+  void* pixels() const {
+    return pixels_ ? reinterpret_cast<uint8_t*>(pixels_.get()) + offset_
+                   : nullptr;
+  }
 
   uint8_t* pixels(size_t y, size_t x, size_t c) const {
-    return (reinterpret_cast<uint8_t*>(pixels_.get()) + y * stride +
+    return (reinterpret_cast<uint8_t*>(pixels()) + y * stride +
             x * pixel_stride_ + c * bytes_per_channel_);
   }
 
   const uint8_t* const_pixels(size_t y, size_t x, size_t c) const {
-    return (reinterpret_cast<const uint8_t*>(pixels_.get()) + y * stride +
+    return (reinterpret_cast<const uint8_t*>(pixels()) + y * stride +
             x * pixel_stride_ + c * bytes_per_channel_);
   }
 
@@ -106,6 +131,10 @@ class PackedImage {
 
   size_t pixel_stride() const { return pixel_stride_; }
 
+  // The number of bytes after the last pixel of each row, at least
+  // kRowPadding for images created with CreatePadded().
+  size_t row_padding() const { return stride - xsize * pixel_stride_; }
+
   static Status ValidateDataType(JxlDataType data_type) {
     if ((data_type != JXL_TYPE_UINT8) && (data_type != JXL_TYPE_UINT16) &&
         (data_type != JXL_TYPE_FLOAT) && (data_type != JXL_TYPE_FLOAT16)) {
@@ -180,16 +209,20 @@ class PackedImage {
 
  private:
   PackedImage(size_t xsize, size_t ysize, const JxlPixelFormat& format,
-              size_t stride)
+              size_t stride, size_t alignment = 1)
       : xsize(xsize),
         ysize(ysize),
         stride(stride),
         format(format),
         pixels_size(ysize * stride),
-        pixels_(malloc(std::max<size_t>(1, pixels_size)), free) {
+        alignment_(alignment),
+        pixels_(malloc(std::max<size_t>(1, pixels_size) + alignment - 1),
+                free) {
     bytes_per_channel_ = BitsPerChannel(format.data_type) / jxl::kBitsPerByte;
     pixel_stride_ = format.num_channels * bytes_per_channel_;
     swap_endianness_ = SwapEndianness(format.endianness);
+    const uintptr_t address = reinterpret_cast<uintptr_t>(pixels_.get());
+    offset_ = RoundUpTo(address, alignment) - address;
   }
 
   static size_t CalcStride(const JxlPixelFormat& format, size_t xsize) {
@@ -204,6 +237,10 @@ class PackedImage {
   size_t bytes_per_channel_;
   size_t pixel_stride_;
   bool swap_endianness_;
+  // The pixels start at offset_ bytes into the allocation, which is a multiple
+  // of alignment_.
+  size_t alignment_;
+  size_t offset_;
   std::unique_ptr<void, decltype(free)*> pixels_;
 };
 
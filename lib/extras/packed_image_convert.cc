@@ -403,6 +403,32 @@ Status ConvertFromExternal(const uint8_t* data, size_t size, size_t xsize,
       data, xsize, ysize, row_size, bits_per_sample, format, c, pool, channel);
 }
 
+Status ConvertPackedPixelFileRowsToImage3F(const extras::PackedPixelFile& ppf,
+                                           size_t y0, Image3F* color,
+                                           ThreadPool* pool) {
+  JXL_RETURN_IF_ERROR(!ppf.frames.empty());
+  const extras::PackedImage& img = ppf.frames[0].color;
+  const size_t ysize = color->ysize();
+  JXL_ENSURE(color->xsize() == img.xsize);
+  JXL_ENSURE(ysize > 0 && y0 + ysize <= img.ysize);
+  size_t bits_per_sample =
+      ppf.input_bitdepth.type == JXL_BIT_DEPTH_FROM_PIXEL_FORMAT
+          ? extras::PackedImage::BitsPerChannel(img.format.data_type)
+          : ppf.info.bits_per_sample;
+  const uint8_t* data =
+      reinterpret_cast<const uint8_t*>(img.pixels()) + y0 * img.stride;
+  for (size_t c = 0; c < ppf.info.num_color_channels; ++c) {
+    JXL_RETURN_IF_ERROR(ConvertFromExternalNoSizeCheck(
+        data, img.xsize, ysize, img.stride, bits_per_sample, img.format, c,
+        pool, &color->Plane(c)));
+  }
+  if (ppf.info.num_color_channels == 1) {
+    JXL_RETURN_IF_ERROR(CopyImageTo(color->Plane(0), &color->Plane(1)));
+    JXL_RETURN_IF_ERROR(CopyImageTo(color->Plane(0), &color->Plane(2)));
+  }
+  return true;
+}
+
 Status GetColorEncoding(const PackedPixelFile& ppf,
                         ColorEncoding* color_encoding) {
   if (ppf.primary_color_representation == PackedPixelFile::kIccIsPrimary) {
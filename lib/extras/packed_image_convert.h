@@ -27,6 +27,12 @@ Status ConvertPackedPixelFileToImage3F(const extras::PackedPixelFile& ppf,
                                        Image3F* color,
                                        ThreadPool* pool = nullptr);
 
+// Same as above, but converts only the rows [y0, y0 + color->ysize()) of the
+// first frame, which allows processing large images in strips.
+Status ConvertPackedPixelFileRowsToImage3F(const extras::PackedPixelFile& ppf,
+                                           size_t y0, Image3F* color,
+                                           ThreadPool* pool = nullptr);
+
 StatusOr<PackedPixelFile> ConvertImage3FToPackedPixelFile(
     const Image3F& image, const ColorEncoding& c_enc, JxlPixelFormat format,
     ThreadPool* pool);
@@ -0,0 +1,140 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/extras/recycling_memory_manager.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "lib/base/bits.h"
+#include "lib/base/common.h"
+#include "lib/base/memory_manager.h"
+#include "lib/base/status.h"
+#include "lib/extras/memory_manager_internal.h"
+
+namespace jxl {
+
+namespace {
+
+// Precedes each block, keeps the alignment of the inner allocator.
+struct alignas(alignof(std::max_align_t)) BlockHeader {
+  // Zero for blocks that are not recycled.
+  size_t capacity;
+};
+
+BlockHeader* HeaderOf(void* address) {
+  return reinterpret_cast<BlockHeader*>(address) - 1;
+}
+
+// Returns the capacity of the bucket of blocks of `size` bytes, or zero if
+// they are not recycled.
+size_t BucketCapacity(size_t size) {
+  if (size < RecyclingMemoryManager::kMinRecycledSize ||
+      size > std::numeric_limits<size_t>::max() / 2) {
+    return 0;
+  }
+  const size_t step = size_t{1} << (FloorLog2Nonzero(size) - 2);
+  return RoundUpTo(size, step);
+}
+
+}  // namespace
+
+RecyclingMemoryManager::RecyclingMemoryManager(const JxlMemoryManager* inner,
+                                               size_t max_cached_bytes)
+    : max_cached_bytes_(max_cached_bytes) {
+  Status status = MemoryManagerInit(&inner_, inner);
+  JXL_DASSERT(status);
+  (void)status;
+
+  outer_.opaque = reinterpret_cast<void*>(this);
+  outer_.alloc = &Alloc;
+  outer_.free = &Free;
+}
+
+RecyclingMemoryManager::~RecyclingMemoryManager() { Trim(); }
+
+void RecyclingMemoryManager::Trim() {
+  std::map<size_t, std::vector<void*>> free_blocks;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    free_blocks.swap(free_blocks_);
+    cached_bytes_ = 0;
+  }
+  for (const auto& bucket : free_blocks) {
+    for (void* address : bucket.second) {
+      inner_.free(inner_.opaque, HeaderOf(address));
+    }
+  }
+}
+
+size_t RecyclingMemoryManager::cached_bytes() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return cached_bytes_;
+}
+
+uint64_t RecyclingMemoryManager::num_recycled() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return num_recycled_;
+}
+
+void* RecyclingMemoryManager::Alloc(void* opaque, size_t size) {
+  if (opaque == nullptr) {
+    JXL_DEBUG_ABORT("Internal logic error");
+    return nullptr;
+  }
+  RecyclingMemoryManager* self =
+      reinterpret_cast<RecyclingMemoryManager*>(opaque);
+  const size_t capacity = BucketCapacity(size);
+  if (capacity != 0) {
+    std::lock_guard<std::mutex> guard(self->mutex_);
+    auto bucket = self->free_blocks_.find(capacity);
+    if (bucket != self->free_blocks_.end()) {
+      void* address = bucket->second.back();
+      bucket->second.pop_back();
+      if (bucket->second.empty()) self->free_blocks_.erase(bucket);
+      self->cached_bytes_ -= capacity;
+      self->num_recycled_++;
+      return address;
+    }
+  }
+  const size_t block_size = capacity != 0 ? capacity : size;
+  if (block_size > std::numeric_limits<size_t>::max() - sizeof(BlockHeader)) {
+    return nullptr;
+  }
+  void* block =
+      self->inner_.alloc(self->inner_.opaque, sizeof(BlockHeader) + block_size);
+  if (block == nullptr) return nullptr;
+  BlockHeader* header = reinterpret_cast<BlockHeader*>(block);
+  header->capacity = capacity;
+  return header + 1;
+}
+
+void RecyclingMemoryManager::Free(void* opaque, void* address) {
+  if (opaque == nullptr) {
+    JXL_DEBUG_ABORT("Internal logic error");
+    return;
+  }
+  if (address == nullptr) return;
+  RecyclingMemoryManager* self =
+      reinterpret_cast<RecyclingMemoryManager*>(opaque);
+  BlockHeader* header = HeaderOf(address);
+  const size_t capacity = header->capacity;
+  if (capacity != 0) {
+    std::lock_guard<std::mutex> guard(self->mutex_);
+    if (capacity <= self->max_cached_bytes_ - self->cached_bytes_) {
+      self->free_blocks_[capacity].push_back(address);
+      self->cached_bytes_ += capacity;
+      return;
+    }
+  }
+  self->inner_.free(self->inner_.opaque, header);
+}
+
+}  // namespace jxl
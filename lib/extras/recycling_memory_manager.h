@@ -0,0 +1,68 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_EXTRAS_RECYCLING_MEMORY_MANAGER_H_
+#define LIB_EXTRAS_RECYCLING_MEMORY_MANAGER_H_
+
+// Memory manager that recycles freed image planes.
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "lib/base/memory_manager.h"
+
+namespace jxl {
+
+// Keeps freed blocks of at least kMinRecycledSize bytes in buckets by size
+// and hands them out again to later allocations of the same bucket, so that
+// repeated metric and conversion calls on same-sized images stop going back
+// to the inner allocator for every plane and its temporaries. The buckets
+// are a quarter power of two apart, so at most 25% of a block is wasted.
+// Smaller blocks are passed through. Thread-safe.
+class RecyclingMemoryManager {
+ public:
+  static constexpr size_t kMinRecycledSize = 64 << 10;
+  static constexpr size_t kDefaultMaxCachedBytes = size_t{512} << 20;
+
+  // `inner` may be null to use malloc and free, otherwise it must outlive
+  // this object. At most max_cached_bytes of free blocks are kept.
+  explicit RecyclingMemoryManager(
+      const JxlMemoryManager* inner = nullptr,
+      size_t max_cached_bytes = kDefaultMaxCachedBytes);
+  // All blocks must have been freed.
+  ~RecyclingMemoryManager();
+
+  RecyclingMemoryManager(const RecyclingMemoryManager&) = delete;
+  RecyclingMemoryManager& operator=(const RecyclingMemoryManager&) = delete;
+
+  JxlMemoryManager* get() { return &outer_; }
+
+  // Returns the cached free blocks to the inner allocator.
+  void Trim();
+
+  size_t cached_bytes() const;
+  // Number of allocations that were served from the cache.
+  uint64_t num_recycled() const;
+
+ private:
+  static void* Alloc(void* opaque, size_t size);
+  static void Free(void* opaque, void* address);
+
+  mutable std::mutex mutex_;
+  // Free blocks by their capacity, which is the key of the bucket.
+  std::map<size_t, std::vector<void*>> free_blocks_;
+  size_t max_cached_bytes_;
+  size_t cached_bytes_ = 0;
+  uint64_t num_recycled_ = 0;
+  JxlMemoryManager outer_;
+  JxlMemoryManager inner_;
+};
+
+}  // namespace jxl
+
+#endif  // LIB_EXTRAS_RECYCLING_MEMORY_MANAGER_H_
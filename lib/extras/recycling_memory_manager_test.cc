@@ -0,0 +1,87 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/extras/recycling_memory_manager.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "lib/base/data_parallel.h"
+#include "lib/base/memory_manager.h"
+#include "lib/base/status.h"
+#include "lib/base/testing.h"
+#include "lib/extras/image.h"
+#include "lib/extras/test_memory_manager.h"
+#include "lib/threads/test_utils.h"
+
+namespace jxl {
+namespace {
+
+TEST(RecyclingMemoryManagerTest, RecyclesLargeBlocks) {
+  RecyclingMemoryManager recycling(test::MemoryManager());
+  JxlMemoryManager* memory_manager = recycling.get();
+  const size_t size = 3 * RecyclingMemoryManager::kMinRecycledSize;
+  void* first = memory_manager->alloc(memory_manager->opaque, size);
+  ASSERT_NE(first, nullptr);
+  memory_manager->free(memory_manager->opaque, first);
+  EXPECT_EQ(recycling.cached_bytes(), size);
+  // A slightly smaller block falls into the same bucket.
+  void* second = memory_manager->alloc(memory_manager->opaque, size - 100);
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(recycling.num_recycled(), 1u);
+  EXPECT_EQ(recycling.cached_bytes(), 0u);
+  memory_manager->free(memory_manager->opaque, second);
+}
+
+TEST(RecyclingMemoryManagerTest, PassesThroughSmallBlocks) {
+  RecyclingMemoryManager recycling(test::MemoryManager());
+  JxlMemoryManager* memory_manager = recycling.get();
+  void* block = memory_manager->alloc(memory_manager->opaque, 1000);
+  ASSERT_NE(block, nullptr);
+  memory_manager->free(memory_manager->opaque, block);
+  EXPECT_EQ(recycling.cached_bytes(), 0u);
+  memory_manager->free(memory_manager->opaque, nullptr);
+}
+
+TEST(RecyclingMemoryManagerTest, RespectsCacheLimit) {
+  const size_t size = RecyclingMemoryManager::kMinRecycledSize;
+  RecyclingMemoryManager recycling(test::MemoryManager(), 2 * size);
+  JxlMemoryManager* memory_manager = recycling.get();
+  std::vector<void*> blocks;
+  for (size_t i = 0; i < 3; ++i) {
+    blocks.push_back(memory_manager->alloc(memory_manager->opaque, size));
+    ASSERT_NE(blocks.back(), nullptr);
+  }
+  for (void* block : blocks) {
+    memory_manager->free(memory_manager->opaque, block);
+  }
+  EXPECT_EQ(recycling.cached_bytes(), 2 * size);
+  recycling.Trim();
+  EXPECT_EQ(recycling.cached_bytes(), 0u);
+}
+
+TEST(RecyclingMemoryManagerTest, RecyclesImagePlanesAcrossThreads) {
+  RecyclingMemoryManager recycling(test::MemoryManager());
+  JxlMemoryManager* memory_manager = recycling.get();
+  test::ThreadPoolForTests pool(4);
+  const auto process = [&](const uint32_t task, size_t /*thread*/) -> Status {
+    JXL_ASSIGN_OR_RETURN(Image3F image,
+                         Image3F::Create(memory_manager, 256, 256));
+    for (size_t c = 0; c < 3; ++c) {
+      for (size_t y = 0; y < image.ysize(); ++y) {
+        float* JXL_RESTRICT row = image.PlaneRow(c, y);
+        for (size_t x = 0; x < image.xsize(); ++x) row[x] = task;
+      }
+    }
+    return true;
+  };
+  ASSERT_TRUE(RunOnPool(pool.get(), 0, 64, ThreadPool::NoInit, process,
+                        "RecyclePlanes"));
+  EXPECT_GT(recycling.num_recycled(), 0u);
+}
+
+}  // namespace
+}  // namespace jxl
@@ -8,6 +8,8 @@
 
 #include <algorithm>
 #include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
 
 #undef HWY_TARGET_INCLUDE
@@ -25,8 +27,15 @@ namespace HWY_NAMESPACE {
 
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::GatherIndex;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::Or;
+using hwy::HWY_NAMESPACE::PromoteTo;
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::RebindToSigned;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
 using hwy::HWY_NAMESPACE::Sub;
 using hwy::HWY_NAMESPACE::ZeroIfNegative;
 
@@ -101,6 +110,92 @@ void LinearRGBRowToXYB(float* JXL_RESTRICT row0, float* JXL_RESTRICT row1,
   }
 }
 
+// Reverses the byte order of the 16-bit lanes, 8-bit lanes are unchanged.
+template <class V>
+JXL_INLINE V SwapBytes(V v, hwy::SizeTag<2> /* lane size */) {
+  return Or(ShiftLeft<8>(v), ShiftRight<8>(v));
+}
+template <class V>
+JXL_INLINE V SwapBytes(V v, hwy::SizeTag<1> /* lane size */) {
+  return v;
+}
+
+// Loads the first three of the kChannels interleaved samples of N pixels,
+// widened to 32-bit indexes.
+template <size_t kChannels, typename T, class DI>
+JXL_INLINE void LoadIndexes(DI di, const T* JXL_RESTRICT row, bool swap_bytes,
+                            hwy::HWY_NAMESPACE::Vec<DI>* idx0,
+                            hwy::HWY_NAMESPACE::Vec<DI>* idx1,
+                            hwy::HWY_NAMESPACE::Vec<DI>* idx2) {
+  const Rebind<T, DI> dt;
+  hwy::HWY_NAMESPACE::Vec<decltype(dt)> v0, v1, v2, v3;  // NOLINT
+  if (kChannels == 3) {
+    LoadInterleaved3(dt, row, v0, v1, v2);
+  } else {
+    LoadInterleaved4(dt, row, v0, v1, v2, v3);
+  }
+  if (swap_bytes) {
+    v0 = SwapBytes(v0, hwy::SizeTag<sizeof(T)>());
+    v1 = SwapBytes(v1, hwy::SizeTag<sizeof(T)>());
+    v2 = SwapBytes(v2, hwy::SizeTag<sizeof(T)>());
+  }
+  *idx0 = PromoteTo(di, v0);
+  *idx1 = PromoteTo(di, v1);
+  *idx2 = PromoteTo(di, v2);
+}
+
+template <size_t kChannels, typename T>
+void SRGBRowToLinearT(const uint8_t* row_in, bool swap_bytes,
+                      const float* JXL_RESTRICT lut, size_t xsize,
+                      float* JXL_RESTRICT row0, float* JXL_RESTRICT row1,
+                      float* JXL_RESTRICT row2) {
+  const HWY_FULL(float) d;
+  const RebindToSigned<decltype(d)> di;
+  const size_t N = Lanes(d);
+  const T* JXL_RESTRICT row = reinterpret_cast<const T*>(row_in);
+  const size_t simd_xsize = xsize & ~(N - 1);
+  for (size_t x = 0; x < simd_xsize; x += N) {
+    hwy::HWY_NAMESPACE::Vec<decltype(di)> idx0, idx1, idx2;  // NOLINT
+    LoadIndexes<kChannels>(di, row + kChannels * x, swap_bytes, &idx0, &idx1,
+                           &idx2);
+    Store(GatherIndex(d, lut, idx0), d, row0 + x);
+    Store(GatherIndex(d, lut, idx1), d, row1 + x);
+    Store(GatherIndex(d, lut, idx2), d, row2 + x);
+  }
+  float* JXL_RESTRICT rows_out[3] = {row0, row1, row2};
+  for (size_t x = simd_xsize; x < xsize; ++x) {
+    for (size_t c = 0; c < 3; ++c) {
+      uint32_t v = row[kChannels * x + c];
+      if (swap_bytes) {
+        v = ((v & 0xff) << 8) | (v >> 8);
+      }
+      rows_out[c][x] = lut[v];
+    }
+  }
+}
+
+void SRGBRowToLinear(const uint8_t* row_in, size_t num_channels,
+                     size_t bytes_per_sample, bool swap_bytes,
+                     const float* JXL_RESTRICT lut, size_t xsize,
+                     float* JXL_RESTRICT row0, float* JXL_RESTRICT row1,
+                     float* JXL_RESTRICT row2) {
+  if (bytes_per_sample == 1) {
+    if (num_channels == 3) {
+      SRGBRowToLinearT<3, uint8_t>(row_in, false, lut, xsize, row0, row1,
+                                   row2);
+    } else {
+      SRGBRowToLinearT<4, uint8_t>(row_in, false, lut, xsize, row0, row1,
+                                   row2);
+    }
+  } else if (num_channels == 3) {
+    SRGBRowToLinearT<3, uint16_t>(row_in, swap_bytes, lut, xsize, row0, row1,
+                                  row2);
+  } else {
+    SRGBRowToLinearT<4, uint16_t>(row_in, swap_bytes, lut, xsize, row0, row1,
+                                  row2);
+  }
+}
+
 void ComputePremulAbsorb(float intensity_target, float* premul_absorb) {
   const HWY_FULL(float) d;
   const size_t N = Lanes(d);
@@ -139,6 +234,25 @@ void ComputePremulAbsorb(float intensity_target, float* premul_absorb) {
   HWY_DYNAMIC_DISPATCH(ComputePremulAbsorb)(intensity_target, premul_absorb);
 }
 
+void ComputeSRGBToLinearLUT(size_t lut_size, float* lut) {
+  const double mul = 1.0 / (lut_size - 1);
+  for (size_t i = 0; i < lut_size; ++i) {
+    const double v = i * mul;
+    lut[i] = v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4);
+  }
+}
+
+HWY_EXPORT(SRGBRowToLinear);
+void SRGBRowToLinear(const uint8_t* row_in, size_t num_channels,
+                     size_t bytes_per_sample, bool swap_bytes,
+                     const float* JXL_RESTRICT lut, size_t xsize,
+                     float* JXL_RESTRICT row0, float* JXL_RESTRICT row1,
+                     float* JXL_RESTRICT row2) {
+  HWY_DYNAMIC_DISPATCH(SRGBRowToLinear)
+  (row_in, num_channels, bytes_per_sample, swap_bytes, lut, xsize, row0, row1,
+   row2);
+}
+
 void ScaleXYBRow(float* JXL_RESTRICT row0, float* JXL_RESTRICT row1,
                  float* JXL_RESTRICT row2, size_t xsize) {
   for (size_t x = 0; x < xsize; x++) {
@@ -10,11 +10,28 @@
 // Converts to XYB color space.
 
 #include <cstddef>
+#include <cstdint>
 
 #include "lib/base/compiler_specific.h"
 
 namespace jxl {
 
+// Fills in the lut_size entries of lut with the linear values of the sRGB
+// encoded values i / (lut_size - 1), i.e. lut_size is 256 for 8-bit and 65536
+// for 16-bit samples.
+void ComputeSRGBToLinearLUT(size_t lut_size, float* lut);
+
+// Converts the first three channels of a row of xsize pixels of interleaved
+// 8-bit or 16-bit sRGB encoded samples to planar linear RGB rows, by looking up
+// the samples in the lut of ComputeSRGBToLinearLUT(). The pixels have
+// num_channels (3 or 4) samples of bytes_per_sample (1 or 2) bytes, and the
+// byte order of the 16-bit samples is swapped if swap_bytes is true.
+void SRGBRowToLinear(const uint8_t* row_in, size_t num_channels,
+                     size_t bytes_per_sample, bool swap_bytes,
+                     const float* JXL_RESTRICT lut, size_t xsize,
+                     float* JXL_RESTRICT row0, float* JXL_RESTRICT row1,
+                     float* JXL_RESTRICT row2);
+
 void LinearRGBRowToXYB(float* JXL_RESTRICT row0, float* JXL_RESTRICT row1,
                        float* JXL_RESTRICT row2,
                        const float* JXL_RESTRICT premul_absorb, size_t xsize);
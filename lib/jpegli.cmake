@@ -43,6 +43,9 @@ target_include_directories(jpegli-static PUBLIC
   "$<BUILD_INTERFACE:${CMAKE_CURRENT_BINARY_DIR}/include/jpegli>"
 )
 target_link_libraries(jpegli-static PUBLIC ${JPEGLI_INTERNAL_LIBS})
+if(NOT JPEGLI_ENABLE_STAGE_STATS)
+  target_compile_definitions(jpegli-static PUBLIC JPEGLI_ENABLE_STAGE_STATS=0)
+endif()
 
 #
 # Tests for jpegli-static
@@ -102,6 +105,27 @@ foreach (TESTFILE IN LISTS JPEGXL_INTERNAL_JPEGLI_TESTS)
 endforeach ()
 endif()
 
+#
+# Kernel benchmarks for jpegli-static
+#
+
+if(JPEGXL_ENABLE_BENCHMARK)
+find_package(benchmark QUIET)
+if(benchmark_FOUND)
+  add_executable(jpegli_kernel_bench ${JPEGXL_INTERNAL_JPEGLI_GBENCH_SOURCES})
+  target_compile_options(jpegli_kernel_bench PRIVATE ${JPEGXL_INTERNAL_FLAGS})
+  target_include_directories(jpegli_kernel_bench PRIVATE
+    "${PROJECT_SOURCE_DIR}"
+    "${CMAKE_CURRENT_BINARY_DIR}/include"
+  )
+  target_link_libraries(jpegli_kernel_bench
+    hwy
+    jpegli-static
+    benchmark::benchmark
+  )
+endif()
+endif()
+
 #
 # Build libjpeg.so that links to libjpeg-static
 #
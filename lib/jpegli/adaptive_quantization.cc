@@ -10,6 +10,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 
 #include "lib/base/types.h"
 #include "lib/jpegli/common.h"
@@ -35,6 +36,8 @@ using hwy::HWY_NAMESPACE::And;
 using hwy::HWY_NAMESPACE::Div;
 using hwy::HWY_NAMESPACE::Floor;
 using hwy::HWY_NAMESPACE::GetLane;
+using hwy::HWY_NAMESPACE::LoadInterleaved2;
+using hwy::HWY_NAMESPACE::LoadInterleaved4;
 using hwy::HWY_NAMESPACE::Max;
 using hwy::HWY_NAMESPACE::Min;
 using hwy::HWY_NAMESPACE::Mul;
@@ -45,6 +48,7 @@ using hwy::HWY_NAMESPACE::ShiftLeft;
 using hwy::HWY_NAMESPACE::ShiftRight;
 using hwy::HWY_NAMESPACE::Sqrt;
 using hwy::HWY_NAMESPACE::Sub;
+using hwy::HWY_NAMESPACE::Vec;
 using hwy::HWY_NAMESPACE::ZeroIfNegative;
 
 constexpr float kInputScaling = 1.0f / 255.0f;
@@ -263,13 +267,21 @@ V SimpleGamma(const D d, V v) {
 }
 */
 
-template <class D, class V>
-V GammaModulation(const D d, const size_t x, const size_t y,
-                  const RowBuffer<float>& input, const V out_val) {
-  static const float kBias = 0.16f / kInputScaling;
+// ideally -1.0, but likely optimal correction adds some entropy, so slightly
+// less than that.
+// ln(2) constant folded in because we want std::log but have FastLog2f.
+const float kGammaModulation = -0.15526878023684174f * kInvLog2e;
+const float kGammaBias = 0.16f / kInputScaling;
+const float kHfModulation = -2.0052193233688884f * kInputScaling / 112.0;
+
+// Returns the average ratio of derivatives of the 8x8 block at (x, y), the
+// argument of the logarithm of the gamma modulation.
+template <class D>
+float GammaRatio(const D d, const size_t x, const size_t y,
+                 const RowBuffer<float>& input) {
   static const float kScale = kInputScaling / 64.0f;
   auto overall_ratio = Zero(d);
-  const auto bias = Set(d, kBias);
+  const auto bias = Set(d, kGammaBias);
   const auto scale = Set(d, kScale);
   const float* const JXL_RESTRICT block_start = input.Row(y) + x;
   for (size_t dy = 0; dy < 8; ++dy) {
@@ -281,27 +293,21 @@ V GammaModulation(const D d, const size_t x, const size_t y,
       overall_ratio = Add(overall_ratio, ratio_g);
     }
   }
-  overall_ratio = Mul(SumOfLanes(d, overall_ratio), scale);
-  // ideally -1.0, but likely optimal correction adds some entropy, so slightly
-  // less than that.
-  // ln(2) constant folded in because we want std::log but have FastLog2f.
-  const auto kGamma = Set(d, -0.15526878023684174f * kInvLog2e);
-  return MulAdd(kGamma, FastLog2f(d, overall_ratio), out_val);
+  return GetLane(Mul(SumOfLanes(d, overall_ratio), scale));
 }
 
-// Change precision in 8x8 blocks that have high frequency content.
-template <class D, class V>
-V HfModulation(const D d, const size_t x, const size_t y,
-               const RowBuffer<float>& input, const V out_val) {
+// Returns the sum of absolute differences with the right and below neighbours
+// within the 8x8 block at (x, y), which changes precision in blocks that have
+// high frequency content.
+template <class D>
+float HfSum(const D d, const size_t x, const size_t y,
+            const RowBuffer<float>& input) {
   // Zero out the invalid differences for the rightmost value per row.
   const Rebind<uint32_t, D> du;
   HWY_ALIGN constexpr uint32_t kMaskRight[8] = {~0u, ~0u, ~0u, ~0u,
                                                 ~0u, ~0u, ~0u, 0};
 
-  auto sum = Zero(d);  // sum of absolute differences with right and below
-  static const float kSumCoeff = -2.0052193233688884f * kInputScaling / 112.0;
-  auto sumcoeff = Set(d, kSumCoeff);
-
+  auto sum = Zero(d);
   const float* const JXL_RESTRICT block_start = input.Row(y) + x;
   for (size_t dy = 0; dy < 8; ++dy) {
     const float* JXL_RESTRICT row_in = block_start + dy * input.stride();
@@ -317,14 +323,39 @@ V HfModulation(const D d, const size_t x, const size_t y,
       sum = Add(sum, AbsDiff(p, pd));
     }
   }
+  return GetLane(SumOfLanes(d, sum));
+}
+
+// Computes the final quant field values of Lanes(d) blocks from the eroded
+// masking values, the high frequency sums and the gamma ratios of the blocks.
+template <class D, class V>
+V QuantFieldValues(const D d, const V masking, const V hf_sum,
+                   const V gamma_ratio, const float mul, const float add) {
+  auto out_val = ComputeMask(d, masking);
+  out_val = MulAdd(hf_sum, Set(d, kHfModulation), out_val);
+  out_val =
+      MulAdd(Set(d, kGammaModulation), FastLog2f(d, gamma_ratio), out_val);
+  // We want multiplicative quantization field, so everything
+  // until this point has been modulating the exponent.
+  const auto qf = MulAdd(FastPow2f(d, Mul(out_val, Set(d, 1.442695041f))),
+                         Set(d, mul), Set(d, add));
+  return ZeroIfNegative(Sub(Div(Set(d, 0.6f), qf), Set(d, 1.0f)));
+}
 
-  sum = SumOfLanes(d, sum);
-  return MulAdd(sum, sumcoeff, out_val);
+// Applies the modulations to Lanes(d) consecutive blocks of a row of the
+// quant field.
+template <class D>
+void ModulateBlocks(const D d, const float* JXL_RESTRICT hf_sum,
+                    const float* JXL_RESTRICT gamma_ratio, const float mul,
+                    const float add, float* JXL_RESTRICT row) {
+  Store(QuantFieldValues(d, Load(d, row), Load(d, hf_sum),
+                         Load(d, gamma_ratio), mul, add),
+        d, row);
 }
 
-void PerBlockModulations(const float y_quant_01, const RowBuffer<float>& input,
-                         const size_t yb0, const size_t yblen,
-                         RowBuffer<float>* aq_map) {
+// Computes the parameters of the final affine map of the quant field, which
+// dampens the modulations at low qualities.
+void DampenedModulation(const float y_quant_01, float* mul, float* add) {
   static const float kAcQuant = 0.841f;
   float base_level = 0.48f * kAcQuant;
   float kDampenRampStart = 9.0f;
@@ -337,22 +368,38 @@ void PerBlockModulations(const float y_quant_01, const RowBuffer<float>& input,
       dampen = 0;
     }
   }
-  const float mul = kAcQuant * dampen;
-  const float add = (1.0f - dampen) * base_level;
+  *mul = kAcQuant * dampen;
+  *add = (1.0f - dampen) * base_level;
+}
+
+// The per-block reductions are computed first into two rows of the scratch
+// buffer, so that the rest of the modulation chain runs on full vectors.
+void PerBlockModulations(const float y_quant_01, const RowBuffer<float>& input,
+                         const size_t yb0, const size_t yblen,
+                         RowBuffer<float>* scratch, RowBuffer<float>* aq_map) {
+  float mul;
+  float add;
+  DampenedModulation(y_quant_01, &mul, &add);
+  const HWY_CAPPED(float, 8) df;
+  const HWY_FULL(float) d;
+  const HWY_CAPPED(float, 1) d1;
+  const size_t xsize_blocks = aq_map->xsize();
+  float* JXL_RESTRICT hf_sum = scratch->Row(0);
+  float* JXL_RESTRICT gamma_ratio = scratch->Row(1);
   for (size_t iy = 0; iy < yblen; iy++) {
     const size_t yb = yb0 + iy;
     const size_t y = yb * 8;
     float* const JXL_RESTRICT row_out = aq_map->Row(yb);
-    const HWY_CAPPED(float, 8) df;
-    for (size_t ix = 0; ix < aq_map->xsize(); ix++) {
-      size_t x = ix * 8;
-      auto out_val = Set(df, row_out[ix]);
-      out_val = ComputeMask(df, out_val);
-      out_val = HfModulation(df, x, y, input, out_val);
-      out_val = GammaModulation(df, x, y, input, out_val);
-      // We want multiplicative quantization field, so everything
-      // until this point has been modulating the exponent.
-      row_out[ix] = FastPow2f(GetLane(out_val) * 1.442695041f) * mul + add;
+    for (size_t ix = 0; ix < xsize_blocks; ix++) {
+      hf_sum[ix] = HfSum(df, ix * 8, y, input);
+      gamma_ratio[ix] = GammaRatio(df, ix * 8, y, input);
+    }
+    size_t ix = 0;
+    for (; ix + Lanes(d) <= xsize_blocks; ix += Lanes(d)) {
+      ModulateBlocks(d, hf_sum + ix, gamma_ratio + ix, mul, add, row_out + ix);
+    }
+    for (; ix < xsize_blocks; ++ix) {
+      ModulateBlocks(d1, hf_sum + ix, gamma_ratio + ix, mul, add, row_out + ix);
     }
   }
 }
@@ -429,7 +476,14 @@ void FuzzyErosion(const RowBuffer<float>& pre_erosion, const size_t yb0,
     if (iy % 2 == 1) {
       const float* JXL_RESTRICT row_out0 = tmp->Row(y - 1);
       float* JXL_RESTRICT aq_out = aq_map->Row(yb0 + iy / 2);
-      for (int bx = 0, x = 0; bx < xsize_blocks; ++bx, x += 2) {
+      int bx = 0;
+      for (; bx + static_cast<int>(Lanes(d)) <= xsize_blocks; bx += Lanes(d)) {
+        Vec<decltype(d)> even, odd, even0, odd0;
+        LoadInterleaved2(d, row_out + 2 * bx, even, odd);
+        LoadInterleaved2(d, row_out0 + 2 * bx, even0, odd0);
+        Store(Add(Add(Add(even, odd), even0), odd0), d, aq_out + bx);
+      }
+      for (int x = 2 * bx; bx < xsize_blocks; ++bx, x += 2) {
         aq_out[bx] =
             (row_out[x] + row_out[x + 1] + row_out0[x] + row_out0[x + 1]);
       }
@@ -437,22 +491,22 @@ void FuzzyErosion(const RowBuffer<float>& pre_erosion, const size_t yb0,
   }
 }
 
+// The XYB gamma is 3.0 to be able to decode faster with two muls.
+// Butteraugli's gamma is matching the gamma of human eye, around 2.6.
+// We approximate the gamma difference by adding one cubic root into
+// the adaptive quantization. This gives us a total gamma of 2.6666
+// for quantization uses.
+const float kMatchGammaOffset = 0.019 / kInputScaling;
+const float kMaskingLimit = 0.2f;
+
 void ComputePreErosion(const RowBuffer<float>& input, const size_t xsize,
                        const size_t y0, const size_t ylen, int border,
                        float* diff_buffer, RowBuffer<float>* pre_erosion) {
   const size_t xsize_out = xsize / 4;
   const size_t y0_out = y0 / 4;
 
-  // The XYB gamma is 3.0 to be able to decode faster with two muls.
-  // Butteraugli's gamma is matching the gamma of human eye, around 2.6.
-  // We approximate the gamma difference by adding one cubic root into
-  // the adaptive quantization. This gives us a total gamma of 2.6666
-  // for quantization uses.
-  static const float match_gamma_offset = 0.019 / kInputScaling;
-
   const HWY_CAPPED(float, 8) df;
 
-  static const float limit = 0.2f;
   // Computes image (padded to multiple of 8x8) of local pixel differences.
   // Subsample both directions by 4.
   for (size_t iy = 0; iy < ylen; ++iy) {
@@ -461,7 +515,7 @@ void ComputePreErosion(const RowBuffer<float>& input, const size_t xsize,
     const float* row_in1 = input.Row(y + 1);
     const float* row_in2 = input.Row(y - 1);
     float* JXL_RESTRICT row_out = diff_buffer;
-    const auto match_gamma_offset_v = Set(df, match_gamma_offset);
+    const auto match_gamma_offset_v = Set(df, kMatchGammaOffset);
     const auto quarter = Set(df, 0.25f);
     for (size_t x = 0; x < xsize; x += Lanes(df)) {
       const auto in = LoadU(df, row_in + x);
@@ -475,7 +529,7 @@ void ComputePreErosion(const RowBuffer<float>& input, const size_t xsize,
               df, Add(in, match_gamma_offset_v));
       auto diff = Mul(gammacv, Sub(in, base));
       diff = Mul(diff, diff);
-      diff = Min(diff, Set(df, limit));
+      diff = Min(diff, Set(df, kMaskingLimit));
       diff = MaskingSqrt(df, diff);
       if ((iy & 3) != 0) {
         diff = Add(diff, LoadU(df, row_out + x));
@@ -485,7 +539,13 @@ void ComputePreErosion(const RowBuffer<float>& input, const size_t xsize,
     if (iy % 4 == 3) {
       size_t y_out = y0_out + iy / 4;
       float* row_d_out = pre_erosion->Row(y_out);
-      for (size_t x = 0; x < xsize_out; x++) {
+      size_t x = 0;
+      for (; x + Lanes(df) <= xsize_out; x += Lanes(df)) {
+        Vec<decltype(df)> v0, v1, v2, v3;
+        LoadInterleaved4(df, row_out + x * 4, v0, v1, v2, v3);
+        StoreU(Mul(Add(Add(Add(v0, v1), v2), v3), quarter), df, row_d_out + x);
+      }
+      for (; x < xsize_out; x++) {
         row_d_out[x] = (row_out[x * 4] + row_out[x * 4 + 1] +
                         row_out[x * 4 + 2] + row_out[x * 4 + 3]) *
                        0.25f;
@@ -495,6 +555,143 @@ void ComputePreErosion(const RowBuffer<float>& input, const size_t xsize,
   }
 }
 
+// Computes the quant field values of Lanes(d) blocks starting at bx in
+// JPEGLI_AQ_FAST mode, where rows_ds are the downsampled luma rows of the
+// block row, and row_pe0 and row_pe1 are the masking values of the quadrants.
+template <class D>
+void FastModulateBlocks(const D d, const size_t bx, const float* rows_ds[4],
+                        const float* JXL_RESTRICT row_pe0,
+                        const float* JXL_RESTRICT row_pe1, const float mul,
+                        const float add, float* JXL_RESTRICT row_out) {
+  // Instead of the fuzzy erosion of the 3x3 neighbourhoods, the four
+  // quadrants of the block are combined with the same weights.
+  Vec<D> q0, q1, q2, q3;
+  LoadInterleaved2(d, row_pe0 + 2 * bx, q0, q1);
+  LoadInterleaved2(d, row_pe1 + 2 * bx, q2, q3);
+  Sort4(q0, q1, q2, q3);
+  const auto v = Add(Add(Mul(Set(d, 0.125f), q0), Mul(Set(d, 0.075f), q1)),
+                     Add(Mul(Set(d, 0.06f), q2), Mul(Set(d, 0.05f), q3)));
+  const auto masking = Mul(Set(d, 4.0f), v);
+  Vec<D> a, b, c, e;
+  LoadInterleaved4(d, rows_ds[0] + 4 * bx, a, b, c, e);
+  auto hf_sum = Add(Add(AbsDiff(a, b), AbsDiff(b, c)), AbsDiff(c, e));
+  auto sum = Add(Add(a, b), Add(c, e));
+  for (size_t k = 1; k < 4; ++k) {
+    Vec<D> na, nb, nc, ne;
+    LoadInterleaved4(d, rows_ds[k] + 4 * bx, na, nb, nc, ne);
+    hf_sum = Add(hf_sum, Add(Add(AbsDiff(na, nb), AbsDiff(nb, nc)),
+                             AbsDiff(nc, ne)));
+    hf_sum = Add(hf_sum, Add(Add(AbsDiff(a, na), AbsDiff(b, nb)),
+                             Add(AbsDiff(c, nc), AbsDiff(e, ne))));
+    sum = Add(sum, Add(Add(na, nb), Add(nc, ne)));
+    a = na;
+    b = nb;
+    c = nc;
+    e = ne;
+  }
+  // The 24 differences of the downsampled block each span two pixels, while
+  // HfSum() adds up 112 differences of neighbouring pixels, and the
+  // downsampling removes some of the high frequencies. The scale was fitted to
+  // match HfSum() on average.
+  hf_sum = Mul(hf_sum, Set(d, 2.7f));
+  const auto mean = Mul(sum, Set(d, 1.0f / 16));
+  const auto gamma_ratio =
+      Mul(RatioOfDerivativesOfCubicRootToSimpleGamma</*invert=*/true>(
+              d, Add(mean, Set(d, kGammaBias))),
+          Set(d, kInputScaling));
+  Store(QuantFieldValues(d, masking, hf_sum, gamma_ratio, mul, add), d,
+        row_out + bx);
+}
+
+// Computes the quant field of an iMCU row in JPEGLI_AQ_FAST mode. The masking
+// values are computed as in ComputePreErosion(), but from the 2x downsampled
+// luma of the iMCU row only, and the per-block modulations use the sums of
+// differences and the mean of the downsampled block.
+void FastModulations(const float y_quant_01, const RowBuffer<float>& input,
+                     const size_t yb0, const size_t yblen, float* diff_buffer,
+                     RowBuffer<float>* downsampled,
+                     RowBuffer<float>* pre_erosion, RowBuffer<float>* aq_map) {
+  const size_t xsize_blocks = aq_map->xsize();
+  const size_t xsize_ds = 4 * xsize_blocks;
+  const size_t xsize_pe = 2 * xsize_blocks;
+  const size_t ysize_ds = 4 * yblen;
+  const HWY_CAPPED(float, 4) df;
+  const auto quarter = Set(df, 0.25f);
+  for (size_t iy = 0; iy < ysize_ds; ++iy) {
+    const float* JXL_RESTRICT row_in0 = input.Row(yb0 * 8 + 2 * iy);
+    const float* JXL_RESTRICT row_in1 = input.Row(yb0 * 8 + 2 * iy + 1);
+    float* JXL_RESTRICT row_ds = downsampled->Row(iy);
+    for (size_t x = 0; x < xsize_ds; x += Lanes(df)) {
+      Vec<decltype(df)> e0, o0, e1, o1;
+      LoadInterleaved2(df, row_in0 + 2 * x, e0, o0);
+      LoadInterleaved2(df, row_in1 + 2 * x, e1, o1);
+      Store(Mul(Add(Add(e0, o0), Add(e1, o1)), quarter), df, row_ds + x);
+    }
+    downsampled->PadRow(iy, xsize_ds, 1);
+  }
+  const auto match_gamma_offset = Set(df, kMatchGammaOffset);
+  const auto limit = Set(df, kMaskingLimit);
+  float* JXL_RESTRICT row_sum = diff_buffer;
+  for (size_t iy = 0; iy < ysize_ds; ++iy) {
+    const float* row_ds = downsampled->Row(iy);
+    const float* row_t = downsampled->Row(iy > 0 ? iy - 1 : iy);
+    const float* row_b = downsampled->Row(iy + 1 < ysize_ds ? iy + 1 : iy);
+    for (size_t x = 0; x < xsize_ds; x += Lanes(df)) {
+      const auto in = Load(df, row_ds + x);
+      const auto in_r = LoadU(df, row_ds + x + 1);
+      const auto in_l = LoadU(df, row_ds + x - 1);
+      const auto in_t = Load(df, row_t + x);
+      const auto in_b = Load(df, row_b + x);
+      const auto base = Mul(quarter, Add(Add(in_r, in_l), Add(in_t, in_b)));
+      const auto gammacv =
+          RatioOfDerivativesOfCubicRootToSimpleGamma</*invert=*/false>(
+              df, Add(in, match_gamma_offset));
+      auto diff = Mul(gammacv, Sub(in, base));
+      diff = Min(Mul(diff, diff), limit);
+      diff = MaskingSqrt(df, diff);
+      if (iy & 1) {
+        diff = Add(diff, Load(df, row_sum + x));
+      }
+      Store(diff, df, row_sum + x);
+    }
+    // Like the pre-erosion values, these are the sums of the masking values
+    // of 4 rows of the full resolution, averaged horizontally.
+    if (iy & 1) {
+      float* JXL_RESTRICT row_pe = pre_erosion->Row(iy / 2);
+      size_t x = 0;
+      for (; x + Lanes(df) <= xsize_pe; x += Lanes(df)) {
+        Vec<decltype(df)> even, odd;
+        LoadInterleaved2(df, row_sum + 2 * x, even, odd);
+        Store(Add(even, odd), df, row_pe + x);
+      }
+      for (; x < xsize_pe; ++x) {
+        row_pe[x] = row_sum[2 * x] + row_sum[2 * x + 1];
+      }
+    }
+  }
+  float mul;
+  float add;
+  DampenedModulation(y_quant_01, &mul, &add);
+  const HWY_FULL(float) d;
+  const HWY_CAPPED(float, 1) d1;
+  for (size_t iy = 0; iy < yblen; ++iy) {
+    const float* rows_ds[4];
+    for (size_t k = 0; k < 4; ++k) {
+      rows_ds[k] = downsampled->Row(4 * iy + k);
+    }
+    const float* row_pe0 = pre_erosion->Row(2 * iy);
+    const float* row_pe1 = pre_erosion->Row(2 * iy + 1);
+    float* row_out = aq_map->Row(yb0 + iy);
+    size_t bx = 0;
+    for (; bx + Lanes(d) <= xsize_blocks; bx += Lanes(d)) {
+      FastModulateBlocks(d, bx, rows_ds, row_pe0, row_pe1, mul, add, row_out);
+    }
+    for (; bx < xsize_blocks; ++bx) {
+      FastModulateBlocks(d1, bx, rows_ds, row_pe0, row_pe1, mul, add, row_out);
+    }
+  }
+}
+
 }  // namespace
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -505,6 +702,7 @@ HWY_AFTER_NAMESPACE();
 #if HWY_ONCE
 namespace jpegli {
 HWY_EXPORT(ComputePreErosion);
+HWY_EXPORT(FastModulations);
 HWY_EXPORT(FuzzyErosion);
 HWY_EXPORT(PerBlockModulations);
 
@@ -512,16 +710,60 @@ namespace {
 
 constexpr int kPreErosionBorder = 1;
 
-}  // namespace
+// Adds the quant field values of the luma blocks of the current iMCU row to
+// the stats of jpegli_get_encode_stats().
+void AddQuantFieldStats(j_compress_ptr cinfo, const jpeg_component_info* comp,
+                        size_t yb0, size_t yblen) {
+  jpeg_comp_master* m = cinfo->master;
+  const size_t yb_end = std::min<size_t>(yb0 + yblen, comp->height_in_blocks);
+  if (yb_end <= yb0) return;
+  double sum = 0.0;
+  for (size_t by = yb0; by < yb_end; ++by) {
+    const float* row = m->quant_field.Row(by);
+    for (size_t bx = 0; bx < comp->width_in_blocks; ++bx) sum += row[bx];
+  }
+  m->quant_field_sum += sum;
+  m->quant_field_count += (yb_end - yb0) * comp->width_in_blocks;
+}
 
-void ComputeAdaptiveQuantField(j_compress_ptr cinfo) {
+// Copies the quant field rows of the current iMCU row from the field of
+// jpegli_set_quant_field(), repeating its last row below the image.
+void ReadQuantFieldRows(j_compress_ptr cinfo, const jpeg_component_info* comp,
+                        size_t yb0, size_t yblen) {
   jpeg_comp_master* m = cinfo->master;
-  if (!m->use_adaptive_quantization) {
-    return;
+  const size_t xsize_blocks = comp->width_in_blocks;
+  for (size_t by = yb0; by < yb0 + yblen; ++by) {
+    const size_t src_y = std::min<size_t>(by, comp->height_in_blocks - 1);
+    memcpy(m->quant_field.Row(by),
+           m->quant_field_in + src_y * m->quant_field_in_stride,
+           xsize_blocks * sizeof(float));
   }
-  int y_channel = cinfo->jpeg_color_space == JCS_RGB ? 1 : 0;
+}
+
+// Copies the quant field rows of the current iMCU row that are inside the
+// image to the field of jpegli_get_quant_field().
+void WriteQuantFieldRows(j_compress_ptr cinfo, const jpeg_component_info* comp,
+                         size_t yb0, size_t yblen) {
+  jpeg_comp_master* m = cinfo->master;
+  const size_t yb_end = std::min<size_t>(yb0 + yblen, comp->height_in_blocks);
+  for (size_t by = yb0; by < yb_end; ++by) {
+    memcpy(m->quant_field_out + by * m->quant_field_out_stride,
+           m->quant_field.Row(by), comp->width_in_blocks * sizeof(float));
+  }
+}
+
+// Computes the quant field rows of the current iMCU row from the luma input.
+void ComputeQuantFieldRows(j_compress_ptr cinfo, int y_channel,
+                           size_t yb0, size_t yblen) {
+  jpeg_comp_master* m = cinfo->master;
   jpeg_component_info* y_comp = &cinfo->comp_info[y_channel];
   int y_quant_01 = cinfo->quant_tbl_ptrs[y_comp->quant_tbl_no]->quantval[1];
+  if (m->aq_mode == JPEGLI_AQ_FAST) {
+    HWY_DYNAMIC_DISPATCH(FastModulations)
+    (y_quant_01, m->input_buffer[y_channel], yb0, yblen, m->diff_buffer,
+     &m->downsampled_luma, &m->pre_erosion, &m->quant_field);
+    return;
+  }
   if (m->next_iMCU_row == 0) {
     m->input_buffer[y_channel].CopyRow(-1, 0, 1);
   }
@@ -532,8 +774,6 @@ void ComputeAdaptiveQuantField(j_compress_ptr cinfo) {
   const RowBuffer<float>& input = m->input_buffer[y_channel];
   const size_t xsize_blocks = y_comp->width_in_blocks;
   const size_t xsize = xsize_blocks * DCTSIZE;
-  const size_t yb0 = m->next_iMCU_row * cinfo->max_v_samp_factor;
-  const size_t yblen = cinfo->max_v_samp_factor;
   size_t y0 = yb0 * DCTSIZE;
   size_t ylen = cinfo->max_v_samp_factor * DCTSIZE;
   if (y0 == 0) {
@@ -556,13 +796,29 @@ void ComputeAdaptiveQuantField(j_compress_ptr cinfo) {
   HWY_DYNAMIC_DISPATCH(FuzzyErosion)
   (m->pre_erosion, yb0, yblen, &m->fuzzy_erosion_tmp, &m->quant_field);
   HWY_DYNAMIC_DISPATCH(PerBlockModulations)
-  (y_quant_01, input, yb0, yblen, &m->quant_field);
-  for (int y = 0; y < cinfo->max_v_samp_factor; ++y) {
-    float* row = m->quant_field.Row(yb0 + y);
-    for (size_t x = 0; x < xsize_blocks; ++x) {
-      row[x] = std::max(0.0f, (0.6f / row[x]) - 1.0f);
-    }
+  (y_quant_01, input, yb0, yblen, &m->fuzzy_erosion_tmp, &m->quant_field);
+}
+
+}  // namespace
+
+void ComputeAdaptiveQuantField(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  if (!m->use_adaptive_quantization) {
+    return;
+  }
+  int y_channel = cinfo->jpeg_color_space == JCS_RGB ? 1 : 0;
+  jpeg_component_info* y_comp = &cinfo->comp_info[y_channel];
+  const size_t yb0 = m->next_iMCU_row * cinfo->max_v_samp_factor;
+  const size_t yblen = cinfo->max_v_samp_factor;
+  if (m->quant_field_in != nullptr) {
+    ReadQuantFieldRows(cinfo, y_comp, yb0, yblen);
+  } else {
+    ComputeQuantFieldRows(cinfo, y_channel, yb0, yblen);
+  }
+  if (m->quant_field_out != nullptr) {
+    WriteQuantFieldRows(cinfo, y_comp, yb0, yblen);
   }
+  AddQuantFieldStats(cinfo, y_comp, yb0, yblen);
 }
 
 }  // namespace jpegli
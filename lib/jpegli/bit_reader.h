@@ -0,0 +1,149 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef LIB_JPEGLI_BIT_READER_H_
+#define LIB_JPEGLI_BIT_READER_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "lib/base/byte_order.h"
+#include "lib/base/compiler_specific.h"
+#include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/huffman.h"
+
+namespace jpegli {
+
+// Helper structure to read bits from the entropy coded data segment. If
+// destuffed is true, the data has no escape sequences and ends at len, see
+// DestuffRestartInterval().
+struct BitReaderState {
+  BitReaderState(const uint8_t* data, const size_t len, size_t pos,
+                 bool destuffed = false)
+      : data_(data), len_(len), start_pos_(pos), destuffed_(destuffed) {
+    Reset(pos);
+  }
+
+  void Reset(size_t pos) {
+    pos_ = pos;
+    val_ = 0;
+    bits_left_ = 0;
+    next_marker_pos_ = len_;
+    FillBitWindow();
+  }
+
+  // Returns the next byte and skips the 0xff/0x00 escape sequences.
+  uint8_t GetNextByte() {
+    if (pos_ >= next_marker_pos_) {
+      ++pos_;
+      return 0;
+    }
+    uint8_t c = data_[pos_++];
+    if (c == 0xff && !destuffed_) {
+      uint8_t escape = pos_ < len_ ? data_[pos_] : 0;
+      if (escape == 0) {
+        ++pos_;
+      } else {
+        // 0xff was followed by a non-zero byte, which means that we found the
+        // start of the next marker segment.
+        next_marker_pos_ = pos_ - 1;
+      }
+    }
+    return c;
+  }
+
+  void FillBitWindow() {
+    if (bits_left_ <= 16) {
+      // If none of the next 8 bytes is a 0xff or past the next marker, the
+      // bytes that fit into the window are shifted in at once, otherwise the
+      // escape sequences and markers are handled byte by byte.
+      if (pos_ + 8 <= next_marker_pos_) {
+        const uint64_t word = LoadBE64(&data_[pos_]);
+        if (destuffed_ || !HasZeroByte(~word)) {
+          const int num_bits = ((64 - bits_left_) >> 3) * 8;
+          val_ = num_bits == 64
+                     ? word
+                     : (val_ << num_bits) | (word >> (64 - num_bits));
+          bits_left_ += num_bits;
+          pos_ += num_bits >> 3;
+          return;
+        }
+      }
+      while (bits_left_ <= 56) {
+        val_ <<= 8;
+        val_ |= static_cast<uint64_t>(GetNextByte());
+        bits_left_ += 8;
+      }
+    }
+  }
+
+  int ReadBits(int nbits) {
+    FillBitWindow();
+    uint64_t val = (val_ >> (bits_left_ - nbits)) & ((1ULL << nbits) - 1);
+    bits_left_ -= nbits;
+    return val;
+  }
+
+  // Sets *pos to the next stream position, and *bit_pos to the bit position
+  // within the next byte where parsing should continue.
+  // Returns false if the stream ended too early.
+  bool FinishStream(size_t* pos, size_t* bit_pos) {
+    *bit_pos = (8 - (bits_left_ & 7)) & 7;
+    // Give back some bytes that we did not use.
+    int unused_bytes_left = DivCeil(bits_left_, 8);
+    while (unused_bytes_left-- > 0) {
+      --pos_;
+      // If we give back a 0 byte, we need to check if it was a 0xff/0x00 escape
+      // sequence, and if yes, we need to give back one more byte.
+      if (!destuffed_ &&
+          ((pos_ == len_ && pos_ == next_marker_pos_) ||
+           (pos_ > 0 && pos_ < next_marker_pos_ && data_[pos_] == 0)) &&
+          (data_[pos_ - 1] == 0xff)) {
+        --pos_;
+      }
+    }
+    if (pos_ >= next_marker_pos_) {
+      *pos = next_marker_pos_;
+      if (pos_ > next_marker_pos_ || *bit_pos > 0) {
+        // Data ran out before the scan was complete.
+        return false;
+      }
+    }
+    *pos = pos_;
+    return true;
+  }
+
+  const uint8_t* data_;
+  const size_t len_;
+  size_t pos_;
+  uint64_t val_;
+  int bits_left_;
+  size_t next_marker_pos_;
+  size_t start_pos_;
+  const bool destuffed_;
+};
+
+// Returns the next Huffman-coded symbol.
+static JXL_INLINE int ReadSymbol(const HuffmanTableEntry* table,
+                                 BitReaderState* br) {
+  int nbits;
+  br->FillBitWindow();
+  int val = (br->val_ >> (br->bits_left_ - 8)) & 0xff;
+  table += val;
+  nbits = table->bits - 8;
+  if (nbits > 0) {
+    br->bits_left_ -= 8;
+    table += table->value;
+    val = (br->val_ >> (br->bits_left_ - nbits)) & ((1 << nbits) - 1);
+    table += val;
+  }
+  br->bits_left_ -= table->bits;
+  return table->value;
+}
+
+}  // namespace jpegli
+
+#endif  // LIB_JPEGLI_BIT_READER_H_
@@ -20,7 +20,10 @@ namespace jpegli {
 void JpegBitWriterInit(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   JpegBitWriter* bw = &m->bw;
-  size_t buffer_size = m->blocks_per_iMCU_row * (DCTSIZE2 * 16 + 8) + (1 << 16);
+  // In streaming PSNR mode the buffered iMCU rows are encoded all at once.
+  size_t num_iMCU_rows = std::max<size_t>(1, m->num_psnr_search_rows);
+  size_t buffer_size =
+      num_iMCU_rows * m->blocks_per_iMCU_row * (DCTSIZE2 * 16 + 8) + (1 << 16);
   bw->cinfo = cinfo;
   bw->data = Allocate<uint8_t>(cinfo, buffer_size, JPOOL_IMAGE);
   bw->len = buffer_size;
@@ -42,6 +45,7 @@ bool EmptyBitWriterBuffer(JpegBitWriter* bw) {
     size_t copylen = std::min<size_t>(cinfo->dest->free_in_buffer, buflen);
     memcpy(cinfo->dest->next_output_byte, bw->data + bw->output_pos, copylen);
     bw->output_pos += copylen;
+    cinfo->master->num_output_bytes += copylen;
     cinfo->dest->free_in_buffer -= copylen;
     cinfo->dest->next_output_byte += copylen;
   }
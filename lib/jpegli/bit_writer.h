@@ -13,6 +13,7 @@
 #include "lib/base/byte_order.h"
 #include "lib/base/compiler_specific.h"
 #include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
 
 namespace jpegli {
 
@@ -34,12 +35,6 @@ bool EmptyBitWriterBuffer(JpegBitWriter* bw);
 
 void JumpToByteBoundary(JpegBitWriter* bw);
 
-// Returns non-zero if and only if x has a zero byte, i.e. one of
-// x & 0xff, x & 0xff00, ..., x & 0xff00000000000000 is zero.
-static JXL_INLINE uint64_t HasZeroByte(uint64_t x) {
-  return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
-}
-
 /**
  * Writes the given byte to the output, writes an extra zero if byte is 0xFF.
  *
@@ -51,22 +46,36 @@ static JXL_INLINE void EmitByte(JpegBitWriter* bw, int byte) {
   if (byte == 0xFF) bw->data[bw->pos++] = 0;
 }
 
+/**
+ * Same as EmitByte(), but without a data dependent branch. Always writes
+ * 2 bytes to the buffer, but advances the position only by the number of
+ * bytes emitted.
+ */
+static JXL_INLINE void EmitByteBranchless(JpegBitWriter* bw, uint64_t byte) {
+  bw->data[bw->pos] = byte;
+  bw->data[bw->pos + 1] = 0;
+  bw->pos += 1 + (byte == 0xFF);
+}
+
 static JXL_INLINE void DischargeBitBuffer(JpegBitWriter* bw) {
   // At this point we are ready to emit the bytes of put_buffer to the output.
   // The JPEG format requires that after every 0xff byte in the entropy
   // coded section, there is a zero byte, therefore we first check if any of
   // the bytes of put_buffer is 0xFF.
   if (HasZeroByte(~bw->put_buffer)) {
-    // We have a 0xFF byte somewhere, examine each byte and append a zero
-    // byte if necessary.
-    EmitByte(bw, (bw->put_buffer >> 56) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 48) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 40) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 32) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 24) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 16) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 8) & 0xFF);
-    EmitByte(bw, (bw->put_buffer >> 0) & 0xFF);
+    // We have a 0xFF byte somewhere, append a zero byte after each of them.
+    // This writes at most 16 bytes, the same as the worst case of EmitByte(),
+    // since the zero after the last byte is written only if it is 0xFF, or
+    // if there is at most 15 bytes of output.
+    const uint64_t v = bw->put_buffer;
+    EmitByteBranchless(bw, (v >> 56) & 0xFF);
+    EmitByteBranchless(bw, (v >> 48) & 0xFF);
+    EmitByteBranchless(bw, (v >> 40) & 0xFF);
+    EmitByteBranchless(bw, (v >> 32) & 0xFF);
+    EmitByteBranchless(bw, (v >> 24) & 0xFF);
+    EmitByteBranchless(bw, (v >> 16) & 0xFF);
+    EmitByteBranchless(bw, (v >> 8) & 0xFF);
+    EmitByteBranchless(bw, (v >> 0) & 0xFF);
   } else {
     // We don't have any 0xFF bytes, output all 8 bytes without checking.
     StoreBE64(bw->put_buffer, bw->data + bw->pos);
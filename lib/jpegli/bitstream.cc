@@ -13,16 +13,22 @@
 #include <initializer_list>
 #include <vector>
 
+#include "lib/base/bits.h"
 #include "lib/base/compiler_specific.h"
 #include "lib/jpegli/bit_writer.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/entropy_coding.h"
 #include "lib/jpegli/error.h"
+#include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/packed_tokens.h"
+#include "lib/jpegli/parallel.h"
 
 namespace jpegli {
 
 void WriteOutput(j_compress_ptr cinfo, const uint8_t* buf, size_t bufsize) {
+  cinfo->master->num_output_bytes += bufsize;
   size_t pos = 0;
   while (pos < bufsize) {
     if (cinfo->dest->free_in_buffer == 0 &&
@@ -63,6 +69,122 @@ void EncodeAPP14(j_compress_ptr cinfo) {
                       0, 0, color_transform});
 }
 
+void EncodeMPF(j_compress_ptr cinfo, size_t image_size, size_t gain_map_size,
+               size_t marker_pos) {
+  // Big endian TIFF header, an IFD with the MPFVersion, NumberOfImages and
+  // MPEntry tags, and the MP entries of the baseline primary image and the
+  // gain map image (CIPA DC-007 section 5.2).
+  constexpr size_t kTiffStart = 8;
+  constexpr size_t kEntriesOffset = 50;
+  uint8_t data[kMPFMarkerSize] = {
+      0xff, 0xe2, 0, kMPFMarkerSize - 2, 'M', 'P', 'F', 0,     //
+      'M', 'M', 0, 0x2a, 0, 0, 0, 8,                           //
+      0, 3,                                                    //
+      0xb0, 0x00, 0, 7, 0, 0, 0, 4, '0', '1', '0', '0',        //
+      0xb0, 0x01, 0, 4, 0, 0, 0, 1, 0, 0, 0, 2,                //
+      0xb0, 0x02, 0, 7, 0, 0, 0, 32, 0, 0, 0, kEntriesOffset,  //
+      0, 0, 0, 0,                                              //
+  };
+  const auto write32 = [&](size_t pos, size_t value) {
+    for (size_t i = 0; i < 4; ++i) {
+      data[pos + i] = static_cast<uint8_t>(value >> (24 - 8 * i));
+    }
+  };
+  const size_t entries = kTiffStart + kEntriesOffset;
+  write32(entries, 0x00030000);  // primary image
+  write32(entries + 4, image_size);
+  write32(entries + 20, gain_map_size);
+  write32(entries + 24, image_size - marker_pos - kTiffStart);
+  WriteOutput(cinfo, data, sizeof(data));
+}
+
+namespace {
+
+// Appends the end of the data of the scan whose restart offsets are recorded,
+// at the current output position, to its offsets.
+void FinishRestartIndexScan(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  if (m->restart_index_scan < 0) return;
+  AddRestartOffset(cinfo, m->num_output_bytes);
+  m->restart_index_scan = -1;
+}
+
+}  // namespace
+
+void AddRestartOffset(j_compress_ptr cinfo, size_t pos) {
+  jpeg_comp_master* m = cinfo->master;
+  if (m->restart_index_scan < 0) return;
+  ScanTokenInfo* sti = &m->scan_token_info[m->restart_index_scan];
+  if (sti->num_restart_offsets <= sti->num_restarts) {
+    sti->restart_offsets[sti->num_restart_offsets++] =
+        static_cast<uint32_t>(pos - m->restart_index_scan_start);
+  }
+}
+
+size_t RestartIndexSize(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  if (!m->write_restart_index || cinfo->progressive_mode) {
+    return 0;
+  }
+  // Number of scans, and the number of offsets and the offsets of each scan.
+  size_t num_values = 1;
+  bool has_restarts = false;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const ScanTokenInfo& sti = m->scan_token_info[i];
+    num_values += 1;
+    if (sti.restart_offsets != nullptr) {
+      num_values += sti.num_restarts + 1;
+      has_restarts = true;
+    }
+  }
+  // Marker, length, tag, values and the size of the segment at its end.
+  size_t size = 4 + sizeof(kRestartIndexTag) + 4 * num_values + 4;
+  return has_restarts && size <= 65537 ? size : 0;
+}
+
+void EncodeRestartIndex(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  FinishRestartIndexScan(cinfo);
+  const size_t size = RestartIndexSize(cinfo);
+  m->restart_index_bytes = size;
+  if (size == 0) return;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const ScanTokenInfo& sti = m->scan_token_info[i];
+    if (sti.restart_offsets != nullptr &&
+        sti.num_restart_offsets != sti.num_restarts + 1) {
+      // A scan was not written completely, e.g. after a cancellation.
+      m->restart_index_bytes = 0;
+      return;
+    }
+  }
+  // The segment is found by decoders from the end of the image, so its size
+  // is also stored after the index, which has the format of
+  // jpegli_get_restart_index().
+  uint8_t* data = Allocate<uint8_t>(cinfo, size, JPOOL_IMAGE);
+  size_t pos = 0;
+  data[pos++] = 0xFF;
+  data[pos++] = kApp10;
+  data[pos++] = static_cast<uint8_t>((size - 2) >> 8);
+  data[pos++] = static_cast<uint8_t>((size - 2) & 0xFF);
+  memcpy(&data[pos], kRestartIndexTag, sizeof(kRestartIndexTag));
+  pos += sizeof(kRestartIndexTag);
+  StoreLE32(cinfo->num_scans, &data[pos]);
+  pos += 4;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const ScanTokenInfo& sti = m->scan_token_info[i];
+    const size_t num_offsets =
+        sti.restart_offsets != nullptr ? sti.num_restart_offsets : 0;
+    StoreLE32(num_offsets, &data[pos]);
+    pos += 4;
+    for (size_t j = 0; j < num_offsets; ++j) {
+      StoreLE32(sti.restart_offsets[j], &data[pos]);
+      pos += 4;
+    }
+  }
+  StoreLE32(size, &data[pos]);
+  WriteOutput(cinfo, data, size);
+}
+
 void WriteFileHeader(j_compress_ptr cinfo) {
   WriteOutput(cinfo, {0xFF, 0xD8});  // SOI
   if (cinfo->write_JFIF_header) {
@@ -139,7 +261,7 @@ void EncodeSOF(j_compress_ptr cinfo, bool is_baseline) {
                                                  : 0xc1;
   const size_t n_comps = cinfo->num_components;
   const size_t marker_len = 8 + 3 * n_comps;
-  std::vector<uint8_t> data(marker_len + 2);
+  uint8_t data[10 + 3 * kMaxComponents];
   size_t pos = 0;
   data[pos++] = 0xFF;
   data[pos++] = marker;
@@ -161,7 +283,7 @@ void EncodeSOF(j_compress_ptr cinfo, bool is_baseline) {
     }
     data[pos++] = quant_idx;
   }
-  WriteOutput(cinfo, data);
+  WriteOutput(cinfo, data, pos);
 }
 
 void WriteFrameHeader(j_compress_ptr cinfo) {
@@ -197,12 +319,12 @@ void EncodeDHT(j_compress_ptr cinfo, size_t offset, size_t num) {
       marker_len += table.bits[j];
     }
   }
-  std::vector<uint8_t> data(marker_len + 2);
-  size_t pos = 0;
-  data[pos++] = 0xFF;
-  data[pos++] = 0xC4;
-  data[pos++] = marker_len >> 8u;
-  data[pos++] = marker_len & 0xFFu;
+  if (marker_len == 2) {
+    return;
+  }
+  uint8_t header[4] = {0xFF, 0xC4, static_cast<uint8_t>(marker_len >> 8u),
+                       static_cast<uint8_t>(marker_len & 0xFFu)};
+  WriteOutput(cinfo, header, sizeof(header));
   for (size_t t = 0; t < num; ++t) {
     const JHUFF_TBL& table = m->huffman_tables[offset + t];
     if (table.sent_table) continue;
@@ -210,16 +332,11 @@ void EncodeDHT(j_compress_ptr cinfo, size_t offset, size_t num) {
     for (size_t i = 0; i <= kJpegHuffmanMaxBitLength; ++i) {
       total_count += table.bits[i];
     }
-    data[pos++] = m->slot_id_map[offset + t];
-    for (size_t i = 1; i <= kJpegHuffmanMaxBitLength; ++i) {
-      data[pos++] = table.bits[i];
-    }
-    for (size_t i = 0; i < total_count; ++i) {
-      data[pos++] = table.huffval[i];
-    }
-  }
-  if (marker_len > 2) {
-    WriteOutput(cinfo, data);
+    uint8_t data[1 + kJpegHuffmanMaxBitLength + kJpegHuffmanAlphabetSize];
+    data[0] = m->slot_id_map[offset + t];
+    memcpy(&data[1], &table.bits[1], kJpegHuffmanMaxBitLength);
+    memcpy(&data[1 + kJpegHuffmanMaxBitLength], table.huffval, total_count);
+    WriteOutput(cinfo, data, 1 + kJpegHuffmanMaxBitLength + total_count);
   }
 }
 
@@ -227,7 +344,7 @@ void EncodeSOS(j_compress_ptr cinfo, int scan_index) {
   jpeg_comp_master* m = cinfo->master;
   const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
   const size_t marker_len = 6 + 2 * scan_info->comps_in_scan;
-  std::vector<uint8_t> data(marker_len + 2);
+  uint8_t data[8 + 2 * kMaxComponents];
   size_t pos = 0;
   data[pos++] = 0xFF;
   data[pos++] = 0xDA;
@@ -239,18 +356,28 @@ void EncodeSOS(j_compress_ptr cinfo, int scan_index) {
     data[pos++] = cinfo->comp_info[comp_idx].component_id;
     int dc_slot_id = m->slot_id_map[m->context_map[comp_idx]];
     int ac_context = m->ac_ctx_offset[scan_index] + i;
-    int ac_slot_id = m->slot_id_map[m->context_map[ac_context]];
+    // The AC table selector of a DC scan is not used, and a streamed DC scan
+    // is written before the AC Huffman codes are known.
+    int ac_slot_id = m->stream_dc_scan && scan_index == 0
+                         ? 16
+                         : m->slot_id_map[m->context_map[ac_context]];
     data[pos++] = (dc_slot_id << 4u) + (ac_slot_id - 16);
   }
   data[pos++] = scan_info->Ss;
   data[pos++] = scan_info->Se;
   data[pos++] = ((scan_info->Ah << 4u) | (scan_info->Al));
-  WriteOutput(cinfo, data);
+  WriteOutput(cinfo, data, pos);
 }
 
 void WriteScanHeader(j_compress_ptr cinfo, int scan_index) {
   jpeg_comp_master* m = cinfo->master;
   const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
+  FinishRestartIndexScan(cinfo);
+  // The scans are written in order, and those that are written to the null
+  // destination of jpegli_estimate_compressed_size() are written again later.
+  if (scan_index <= JPEGLI_MAX_SCAN_STATS) {
+    m->scan_start_bytes[scan_index] = m->num_output_bytes;
+  }
   cinfo->restart_interval = m->scan_token_info[scan_index].restart_interval;
   if (cinfo->restart_interval != m->last_restart_interval) {
     EncodeDRI(cinfo);
@@ -276,6 +403,13 @@ void WriteScanHeader(j_compress_ptr cinfo, int scan_index) {
     m->next_dht_index += num_dht;
   }
   EncodeSOS(cinfo, scan_index);
+  ScanTokenInfo* sti = &m->scan_token_info[scan_index];
+  if (sti->restart_offsets != nullptr) {
+    m->restart_index_scan = scan_index;
+    m->restart_index_scan_start = m->num_output_bytes;
+    sti->num_restart_offsets = 0;
+    AddRestartOffset(cinfo, m->num_output_bytes);
+  }
 }
 
 void WriteBlock(const int32_t* JXL_RESTRICT symbols,
@@ -285,26 +419,26 @@ void WriteBlock(const int32_t* JXL_RESTRICT symbols,
                 const HuffmanCodeTable* JXL_RESTRICT ac_code,
                 JpegBitWriter* JXL_RESTRICT bw) {
   int symbol = symbols[0];
-  WriteBits(bw, dc_code->depth[symbol], dc_code->code[symbol] | extra_bits[0]);
+  WriteSymbol(bw, dc_code, symbol, extra_bits[0]);
+  // The ZRL symbol is at most 16 bits long, so the (at most 3) ZRL symbols
+  // before a coefficient can always be written with one WriteBits() call.
+  const int zrl_depth = ac_code->depth(0xf0);
+  const uint64_t zrl_code = ac_code->code(0xf0);
   for (int i = 1; i < num_nonzeros; ++i) {
     symbol = symbols[i];
     if (symbol > 255) {
-      WriteBits(bw, ac_code->depth[0xf0], ac_code->code[0xf0]);
-      symbol -= 256;
-      if (symbol > 255) {
-        WriteBits(bw, ac_code->depth[0xf0], ac_code->code[0xf0]);
-        symbol -= 256;
-        if (symbol > 255) {
-          WriteBits(bw, ac_code->depth[0xf0], ac_code->code[0xf0]);
-          symbol -= 256;
-        }
+      const int num_zrl = symbol >> 8;
+      uint64_t zrl_bits = zrl_code;
+      for (int j = 1; j < num_zrl; ++j) {
+        zrl_bits = (zrl_bits << zrl_depth) | zrl_code;
       }
+      WriteBits(bw, num_zrl * zrl_depth, zrl_bits);
+      symbol &= 255;
     }
-    WriteBits(bw, ac_code->depth[symbol],
-              ac_code->code[symbol] | extra_bits[i]);
+    WriteSymbol(bw, ac_code, symbol, extra_bits[i]);
   }
   if (emit_eob) {
-    WriteBits(bw, ac_code->depth[0], ac_code->code[0]);
+    WriteSymbol(bw, ac_code, 0, 0);
   }
 }
 
@@ -315,138 +449,421 @@ JXL_INLINE void EmitMarker(JpegBitWriter* bw, int marker) {
   bw->data[bw->pos++] = marker;
 }
 
-void WriteTokens(j_compress_ptr cinfo, int scan_index, JpegBitWriter* bw) {
-  jpeg_comp_master* m = cinfo->master;
-  HuffmanCodeTable* coding_tables = &m->coding_tables[0];
-  int next_restart_marker = 0;
-  const ScanTokenInfo& sti = m->scan_token_info[scan_index];
-  size_t num_token_arrays = m->cur_token_array + 1;
+// Maximum number of tokens in the restart segments that are coded in parallel
+// at the same time, this limits the size of the segment output buffer.
+constexpr size_t kMaxTokensPerBatch = 1 << 18;
+
+// Upper bound on the number of bytes that the Huffman coding of num_tokens
+// tokens followed by a restart marker can take, including byte stuffing.
+size_t MaxSegmentDataSize(size_t num_tokens) { return num_tokens * 8 + 32; }
+
+// Calls visit(i, token) for the stored tokens with global indexes in
+// [begin, end).
+template <typename Visitor>
+void VisitTokenRange(const jpeg_comp_master* m, size_t begin, size_t end,
+                     const Visitor& visit) {
   size_t total_tokens = 0;
-  size_t restart_idx = 0;
-  size_t next_restart = sti.restarts[restart_idx];
-  uint8_t* context_map = m->context_map;
-  for (size_t ta = 0; ta < num_token_arrays; ++ta) {
-    Token* tokens = m->token_arrays[ta].tokens;
+  for (size_t ta = 0; ta <= m->cur_token_array && total_tokens < end; ++ta) {
     size_t num_tokens = m->token_arrays[ta].num_tokens;
-    if (sti.token_offset < total_tokens + num_tokens &&
-        total_tokens < sti.token_offset + sti.num_tokens) {
-      size_t start_ix =
-          total_tokens < sti.token_offset ? sti.token_offset - total_tokens : 0;
-      size_t end_ix = std::min(sti.token_offset + sti.num_tokens - total_tokens,
-                               num_tokens);
-      size_t cycle_len = bw->len / 8;
-      size_t next_cycle = cycle_len;
-      for (size_t i = start_ix; i < end_ix; ++i) {
-        if (total_tokens + i == next_restart) {
-          JumpToByteBoundary(bw);
-          EmitMarker(bw, 0xD0 + next_restart_marker);
-          next_restart_marker += 1;
-          next_restart_marker &= 0x7;
-          next_restart = sti.restarts[++restart_idx];
-        }
-        Token t = tokens[i];
-        const HuffmanCodeTable* code = &coding_tables[context_map[t.context]];
-        WriteBits(bw, code->depth[t.symbol], code->code[t.symbol] | t.bits);
-        if (--next_cycle == 0) {
-          if (!EmptyBitWriterBuffer(bw)) {
-            JPEGLI_ERROR(
-                "Output suspension is not supported in "
-                "finish_compress");
-          }
-          next_cycle = cycle_len;
-        }
-      }
+    if (begin < total_tokens + num_tokens) {
+      size_t start_ix = begin > total_tokens ? begin - total_tokens : 0;
+      size_t end_ix = std::min(end - total_tokens, num_tokens);
+      VisitTokens(m->token_arrays[ta], start_ix, end_ix,
+                  [&](size_t i, Token t) { visit(total_tokens + i, t); });
     }
     total_tokens += num_tokens;
   }
 }
 
-void WriteACRefinementTokens(j_compress_ptr cinfo, int scan_index,
-                             JpegBitWriter* bw) {
+// Writes the tokens with global indexes in [begin, end).
+void WriteTokenRange(const jpeg_comp_master* m, size_t begin, size_t end,
+                     JpegBitWriter* bw) {
+  const HuffmanCodeTable* coding_tables = &m->coding_tables[0];
+  const uint8_t* context_map = m->context_map;
+  VisitTokenRange(m, begin, end, [&](size_t /* i */, Token t) {
+    const HuffmanCodeTable* code = &coding_tables[context_map[t.context]];
+    WriteSymbol(bw, code, t.symbol, t.bits);
+  });
+}
+
+// Calls visit(i, token) for the tokens of the scan with the given index, where
+// i is the index of the token as used in the restarts array of the scan.
+template <typename Visitor>
+void VisitScanTokens(j_compress_ptr cinfo, int scan_index,
+                     const Visitor& visit) {
   jpeg_comp_master* m = cinfo->master;
+  if (m->use_two_pass_tokenization) {
+    size_t num_done = 0;
+    TokenizeScanInChunks(cinfo, scan_index,
+                         [&](const Token* tokens, size_t num_tokens) {
+                           for (size_t i = 0; i < num_tokens; ++i) {
+                             visit(num_done + i, tokens[i]);
+                           }
+                           num_done += num_tokens;
+                         });
+    return;
+  }
   const ScanTokenInfo& sti = m->scan_token_info[scan_index];
-  const uint8_t context = m->ac_ctx_offset[scan_index];
-  const HuffmanCodeTable* code = &m->coding_tables[m->context_map[context]];
-  size_t cycle_len = bw->len / 64;
-  size_t next_cycle = cycle_len;
-  size_t refbit_idx = 0;
-  size_t eobrun_idx = 0;
-  size_t restart_idx = 0;
-  size_t next_restart = sti.restarts[restart_idx];
-  int next_restart_marker = 0;
-  for (size_t i = 0; i < sti.num_tokens; ++i) {
-    if (i == next_restart) {
-      JumpToByteBoundary(bw);
-      EmitMarker(bw, 0xD0 + next_restart_marker);
-      next_restart_marker += 1;
-      next_restart_marker &= 0x7;
-      next_restart = sti.restarts[++restart_idx];
-    }
-    RefToken t = sti.tokens[i];
-    int symbol = t.symbol & 253;
-    uint16_t bits = 0;
-    if ((symbol & 1) == 0) {
-      int r = symbol >> 4;
-      if (r > 0 && r < 15) {
-        bits = sti.eobruns[eobrun_idx++];
-      }
-    } else {
-      bits = (t.symbol >> 1) & 1;
+  VisitTokenRange(m, sti.token_offset, sti.token_offset + sti.num_tokens,
+                  visit);
+}
+
+// Parallel version of WriteTokens() for scans with restart markers. Since the
+// bit writer is flushed to a byte boundary at every restart marker, each
+// restart segment can be coded independently into its own part of the segment
+// output buffer. The segments are processed in batches of at most
+// kMaxTokensPerBatch tokens (or one segment, if it is larger than that), and
+// the coded segments of each batch are written to the output in order.
+void WriteTokensParallel(j_compress_ptr cinfo, int scan_index,
+                         JpegBitWriter* bw) {
+  jpeg_comp_master* m = cinfo->master;
+  const ScanTokenInfo& sti = m->scan_token_info[scan_index];
+  const size_t num_segments = sti.num_restarts;
+  const auto segment_begin = [&](size_t k) {
+    return k == 0 ? sti.token_offset : sti.restarts[k - 1];
+  };
+  const auto segment_size = [&](size_t k) {
+    return sti.restarts[k] - segment_begin(k);
+  };
+  std::vector<size_t> batch_end;
+  size_t max_batch_data_size = 0;
+  for (size_t k = 0; k < num_segments;) {
+    size_t batch_tokens = segment_size(k);
+    size_t batch_data_size = MaxSegmentDataSize(segment_size(k));
+    ++k;
+    while (k < num_segments &&
+           batch_tokens + segment_size(k) <= kMaxTokensPerBatch) {
+      batch_tokens += segment_size(k);
+      batch_data_size += MaxSegmentDataSize(segment_size(k));
+      ++k;
     }
-    WriteBits(bw, code->depth[symbol], code->code[symbol] | bits);
-    for (int j = 0; j < t.refbits; ++j) {
-      WriteBits(bw, 1, sti.refbits[refbit_idx++]);
+    batch_end.push_back(k);
+    max_batch_data_size = std::max(max_batch_data_size, batch_data_size);
+  }
+  if (m->segment_data_size < max_batch_data_size) {
+    m->segment_data =
+        Allocate<uint8_t>(cinfo, max_batch_data_size, JPOOL_IMAGE);
+    m->segment_data_size = max_batch_data_size;
+  }
+  if (!EmptyBitWriterBuffer(bw)) {
+    JPEGLI_ERROR("Output suspension is not supported in finish_compress");
+  }
+  std::vector<JpegBitWriter> writers;
+  size_t k0 = 0;
+  for (size_t k1 : batch_end) {
+    writers.resize(k1 - k0);
+    size_t data_pos = 0;
+    for (size_t k = k0; k < k1; ++k) {
+      JpegBitWriter* sbw = &writers[k - k0];
+      size_t len = MaxSegmentDataSize(segment_size(k));
+      sbw->cinfo = cinfo;
+      sbw->data = m->segment_data + data_pos;
+      sbw->len = len;
+      sbw->pos = 0;
+      sbw->output_pos = 0;
+      sbw->put_buffer = 0;
+      sbw->free_bits = 64;
+      sbw->healthy = true;
+      data_pos += len;
     }
-    if (--next_cycle == 0) {
-      if (!EmptyBitWriterBuffer(bw)) {
+    const auto write_segment = [&](uint32_t k, size_t /* thread */) {
+      JpegBitWriter* sbw = &writers[k - k0];
+      WriteTokenRange(m, segment_begin(k), sti.restarts[k], sbw);
+      // The end of the last segment would be byte-aligned by WriteScanData()
+      // anyway, so we can do it here for all segments.
+      JumpToByteBoundary(sbw);
+      if (k + 1 < num_segments) {
+        EmitMarker(sbw, 0xD0 + (k & 0x7));
+      }
+    };
+    RunParallel(cinfo, static_cast<uint32_t>(k0), static_cast<uint32_t>(k1),
+                write_segment);
+    for (size_t k = k0; k < k1; ++k) {
+      JpegBitWriter* sbw = &writers[k - k0];
+      if (!sbw->healthy) bw->healthy = false;
+      if (!EmptyBitWriterBuffer(sbw)) {
         JPEGLI_ERROR("Output suspension is not supported in finish_compress");
       }
-      next_cycle = cycle_len;
+      if (k + 1 < num_segments) {
+        AddRestartOffset(cinfo, m->num_output_bytes);
+      }
     }
+    k0 = k1;
   }
 }
 
-void WriteDCRefinementBits(j_compress_ptr cinfo, int scan_index,
-                           JpegBitWriter* bw) {
+// Writes the tokens of a scan with two pass tokenization, which are computed
+// again in chunks and therefore can not be resumed after a suspension.
+void WriteTwoPassTokens(j_compress_ptr cinfo, int scan_index,
+                        JpegBitWriter* bw) {
   jpeg_comp_master* m = cinfo->master;
+  HuffmanCodeTable* coding_tables = &m->coding_tables[0];
+  int next_restart_marker = 0;
   const ScanTokenInfo& sti = m->scan_token_info[scan_index];
   size_t restart_idx = 0;
   size_t next_restart = sti.restarts[restart_idx];
-  int next_restart_marker = 0;
-  size_t cycle_len = bw->len * 4;
+  uint8_t* context_map = m->context_map;
+  size_t cycle_len = bw->len / 8;
   size_t next_cycle = cycle_len;
-  size_t refbit_idx = 0;
-  for (size_t i = 0; i < sti.num_tokens; ++i) {
+  VisitScanTokens(cinfo, scan_index, [&](size_t i, Token t) {
     if (i == next_restart) {
       JumpToByteBoundary(bw);
       EmitMarker(bw, 0xD0 + next_restart_marker);
       next_restart_marker += 1;
       next_restart_marker &= 0x7;
       next_restart = sti.restarts[++restart_idx];
+      AddRestartOffset(cinfo, m->num_output_bytes + bw->pos - bw->output_pos);
     }
-    WriteBits(bw, 1, sti.refbits[refbit_idx++]);
+    const HuffmanCodeTable* code = &coding_tables[context_map[t.context]];
+    WriteSymbol(bw, code, t.symbol, t.bits);
     if (--next_cycle == 0) {
       if (!EmptyBitWriterBuffer(bw)) {
-        JPEGLI_ERROR(
-            "Output suspension is not supported in "
-            "finish_compress");
+        JPEGLI_ERROR("Output suspension is not supported in finish_compress");
       }
       next_cycle = cycle_len;
     }
+  });
+}
+
+// The writers below continue the scan from the position in *s, flush the bit
+// writer after every cycle of tokens, and return false if the destination
+// suspended, with the position of the next cycle saved in *s.
+
+bool WriteTokens(j_compress_ptr cinfo, ScanWriterState* s, JpegBitWriter* bw) {
+  jpeg_comp_master* m = cinfo->master;
+  const HuffmanCodeTable* coding_tables = &m->coding_tables[0];
+  const uint8_t* context_map = m->context_map;
+  const ScanTokenInfo& sti = m->scan_token_info[s->scan_index];
+  const size_t end = sti.token_offset + sti.num_tokens;
+  const size_t cycle_len = bw->len / 8;
+  size_t restart_idx = s->restart_idx;
+  size_t next_restart = sti.restarts[restart_idx];
+  int next_restart_marker = s->next_restart_marker;
+  while (s->token_idx < end) {
+    const size_t cycle_end = std::min(end, s->token_idx + cycle_len);
+    VisitTokenRange(m, s->token_idx, cycle_end, [&](size_t i, Token t) {
+      if (i == next_restart) {
+        JumpToByteBoundary(bw);
+        EmitMarker(bw, 0xD0 + next_restart_marker);
+        next_restart_marker += 1;
+        next_restart_marker &= 0x7;
+        next_restart = sti.restarts[++restart_idx];
+        AddRestartOffset(cinfo, m->num_output_bytes + bw->pos - bw->output_pos);
+      }
+      const HuffmanCodeTable* code = &coding_tables[context_map[t.context]];
+      WriteSymbol(bw, code, t.symbol, t.bits);
+    });
+    s->token_idx = cycle_end;
+    s->restart_idx = restart_idx;
+    s->next_restart_marker = next_restart_marker;
+    if (!EmptyBitWriterBuffer(bw)) return false;
   }
+  return true;
+}
+
+bool WriteACRefinementTokens(j_compress_ptr cinfo, ScanWriterState* s,
+                             JpegBitWriter* bw) {
+  jpeg_comp_master* m = cinfo->master;
+  const ScanTokenInfo& sti = m->scan_token_info[s->scan_index];
+  const uint8_t context = m->ac_ctx_offset[s->scan_index];
+  const HuffmanCodeTable* code = &m->coding_tables[m->context_map[context]];
+  const size_t cycle_len = bw->len / 64;
+  size_t refbit_idx = s->refbit_idx;
+  size_t eobrun_idx = s->eobrun_idx;
+  size_t restart_idx = s->restart_idx;
+  size_t next_restart = sti.restarts[restart_idx];
+  int next_restart_marker = s->next_restart_marker;
+  size_t i = s->token_idx;
+  while (i < sti.num_tokens) {
+    const size_t cycle_end = std::min(sti.num_tokens, i + cycle_len);
+    for (; i < cycle_end; ++i) {
+      if (i == next_restart) {
+        JumpToByteBoundary(bw);
+        EmitMarker(bw, 0xD0 + next_restart_marker);
+        next_restart_marker += 1;
+        next_restart_marker &= 0x7;
+        next_restart = sti.restarts[++restart_idx];
+      }
+      RefToken t = sti.tokens[i];
+      int symbol = t.symbol & 253;
+      uint16_t bits = 0;
+      if ((symbol & 1) == 0) {
+        int r = symbol >> 4;
+        if (r > 0 && r < 15) {
+          bits = sti.eobruns[eobrun_idx++];
+        }
+      } else {
+        bits = (t.symbol >> 1) & 1;
+      }
+      WriteSymbol(bw, code, symbol, bits);
+      for (int j = 0; j < t.refbits; ++j) {
+        WriteBits(bw, 1, sti.refbits[refbit_idx++]);
+      }
+    }
+    s->token_idx = i;
+    s->refbit_idx = refbit_idx;
+    s->eobrun_idx = eobrun_idx;
+    s->restart_idx = restart_idx;
+    s->next_restart_marker = next_restart_marker;
+    if (!EmptyBitWriterBuffer(bw)) return false;
+  }
+  return true;
+}
+
+bool WriteDCRefinementBits(j_compress_ptr cinfo, ScanWriterState* s,
+                           JpegBitWriter* bw) {
+  jpeg_comp_master* m = cinfo->master;
+  const ScanTokenInfo& sti = m->scan_token_info[s->scan_index];
+  const size_t cycle_len = bw->len * 4;
+  size_t restart_idx = s->restart_idx;
+  size_t next_restart = sti.restarts[restart_idx];
+  int next_restart_marker = s->next_restart_marker;
+  size_t i = s->token_idx;
+  while (i < sti.num_tokens) {
+    const size_t cycle_end = std::min(sti.num_tokens, i + cycle_len);
+    for (; i < cycle_end; ++i) {
+      if (i == next_restart) {
+        JumpToByteBoundary(bw);
+        EmitMarker(bw, 0xD0 + next_restart_marker);
+        next_restart_marker += 1;
+        next_restart_marker &= 0x7;
+        next_restart = sti.restarts[++restart_idx];
+      }
+      WriteBits(bw, 1, sti.refbits[i]);
+    }
+    s->token_idx = i;
+    s->restart_idx = restart_idx;
+    s->next_restart_marker = next_restart_marker;
+    if (!EmptyBitWriterBuffer(bw)) return false;
+  }
+  return true;
 }
 
 }  // namespace
 
-void WriteScanData(j_compress_ptr cinfo, int scan_index) {
+void WriteDCScaniMCURow(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  const jpeg_scan_info* scan_info = &cinfo->scan_info[0];
+  const ScanTokenInfo* sti = &m->scan_token_info[0];
+  JpegBitWriter* bw = &m->bw;
+  const size_t restart_interval = sti->restart_interval;
+  const bool is_interleaved = (scan_info->comps_in_scan > 1);
+  const int Al = scan_info->Al;
+  // A non-interleaved scan has one MCU per block, so its MCU rows are the
+  // block rows of the single component.
+  const size_t iMCU_height =
+      is_interleaved ? 1 : cinfo->comp_info[0].v_samp_factor;
+  const size_t mcu_y0 = m->next_iMCU_row * iMCU_height;
+  const size_t mcu_y1 =
+      std::min(mcu_y0 + iMCU_height, sti->MCU_rows_in_scan);
+  for (size_t mcu_y = mcu_y0; mcu_y < mcu_y1; ++mcu_y) {
+    for (size_t mcu_x = 0; mcu_x < sti->MCUs_per_row; ++mcu_x) {
+      const size_t mcu_idx = mcu_y * sti->MCUs_per_row + mcu_x;
+      if (restart_interval > 0 && mcu_idx > 0 &&
+          mcu_idx % restart_interval == 0) {
+        const size_t restart_idx = mcu_idx / restart_interval - 1;
+        JumpToByteBoundary(bw);
+        EmitMarker(bw, 0xD0 + (restart_idx & 0x7));
+        memset(m->dc_scan_pred, 0, sizeof(m->dc_scan_pred));
+      }
+      for (int i = 0; i < scan_info->comps_in_scan; ++i) {
+        const int comp_idx = scan_info->component_index[i];
+        const jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+        const HuffmanCodeTable* code =
+            &m->coding_tables[m->context_map[comp_idx]];
+        const int n_blocks_y = is_interleaved ? comp->v_samp_factor : 1;
+        const int n_blocks_x = is_interleaved ? comp->h_samp_factor : 1;
+        for (int iy = 0; iy < n_blocks_y; ++iy) {
+          const size_t block_y = mcu_y * n_blocks_y + iy;
+          JBLOCKARRAY blocks = block_y < comp->height_in_blocks
+                                   ? GetBlockRow(cinfo, comp_idx, block_y)
+                                   : nullptr;
+          for (int ix = 0; ix < n_blocks_x; ++ix) {
+            const size_t block_x = mcu_x * n_blocks_x + ix;
+            // Same as TokenizeProgressiveDC(), the blocks outside of the
+            // component are coded as zero blocks.
+            int dc = 0;
+            if (blocks != nullptr && block_x < comp->width_in_blocks) {
+              dc = blocks[0][block_x][0] >> Al;
+            }
+            int diff = dc - m->dc_scan_pred[i];
+            m->dc_scan_pred[i] = dc;
+            int bits = diff;
+            if (diff < 0) {
+              diff = -diff;
+              --bits;
+            }
+            const int nbits =
+                (diff == 0) ? 0 : (jxl::FloorLog2Nonzero<uint32_t>(diff) + 1);
+            bits &= (1 << nbits) - 1;
+            WriteSymbol(bw, code, nbits, bits);
+          }
+        }
+      }
+    }
+  }
+  if (!bw->healthy) {
+    JPEGLI_ERROR("Unknown Huffman coded symbol found in scan 0");
+  }
+}
+
+void StartScanData(j_compress_ptr cinfo, int scan_index) {
+  jpeg_comp_master* m = cinfo->master;
   const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
-  JpegBitWriter* bw = &cinfo->master->bw;
+  ScanWriterState* s = &m->scan_writer;
+  s->scan_index = scan_index;
+  // Only the tokens of the first pass are stored with global indexes.
+  s->token_idx =
+      scan_info->Ah == 0 ? m->scan_token_info[scan_index].token_offset : 0;
+  s->restart_idx = 0;
+  s->next_restart_marker = 0;
+  s->refbit_idx = 0;
+  s->eobrun_idx = 0;
+}
+
+bool ResumeScanData(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  ScanWriterState* s = &m->scan_writer;
+  const jpeg_scan_info* scan_info = &cinfo->scan_info[s->scan_index];
+  JpegBitWriter* bw = &m->bw;
+  // The bytes that were left in the buffer by a suspension go first.
+  if (!EmptyBitWriterBuffer(bw)) {
+    return false;
+  }
+  bool done;
   if (scan_info->Ah == 0) {
-    WriteTokens(cinfo, scan_index, bw);
+    done = WriteTokens(cinfo, s, bw);
   } else if (scan_info->Ss > 0) {
-    WriteACRefinementTokens(cinfo, scan_index, bw);
+    done = WriteACRefinementTokens(cinfo, s, bw);
+  } else {
+    done = WriteDCRefinementBits(cinfo, s, bw);
+  }
+  if (!done) {
+    return false;
+  }
+  if (!bw->healthy) {
+    JPEGLI_ERROR("Unknown Huffman coded symbol found in scan %d",
+                 s->scan_index);
+  }
+  JumpToByteBoundary(bw);
+  return EmptyBitWriterBuffer(bw);
+}
+
+void WriteScanData(j_compress_ptr cinfo, int scan_index) {
+  jpeg_comp_master* m = cinfo->master;
+  const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
+  JpegBitWriter* bw = &m->bw;
+  if (scan_info->Ah == 0 && m->use_two_pass_tokenization) {
+    WriteTwoPassTokens(cinfo, scan_index, bw);
+  } else if (scan_info->Ah == 0 && m->runner != nullptr &&
+             m->scan_token_info[scan_index].num_restarts > 1) {
+    WriteTokensParallel(cinfo, scan_index, bw);
   } else {
-    WriteDCRefinementBits(cinfo, scan_index, bw);
+    StartScanData(cinfo, scan_index);
+    if (!ResumeScanData(cinfo)) {
+      JPEGLI_ERROR("Output suspension is not supported in finish_compress");
+    }
+    return;
   }
   if (!bw->healthy) {
     JPEGLI_ERROR("Unknown Huffman coded symbol found in scan %d", scan_index);
@@ -457,4 +874,45 @@ void WriteScanData(j_compress_ptr cinfo, int scan_index) {
   }
 }
 
+size_t ScanDataSize(j_compress_ptr cinfo, int scan_index) {
+  jpeg_comp_master* m = cinfo->master;
+  const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
+  const ScanTokenInfo& sti = m->scan_token_info[scan_index];
+  const HuffmanCodeTable* coding_tables = &m->coding_tables[0];
+  const uint8_t* context_map = m->context_map;
+  uint64_t num_bits = 0;
+  size_t restart_idx = 0;
+  size_t next_restart = sti.restarts[restart_idx];
+  const auto add_restart_marker = [&]() {
+    num_bits = RoundUpTo(num_bits, 8) + 16;
+    next_restart = sti.restarts[++restart_idx];
+  };
+  if (scan_info->Ah == 0) {
+    VisitScanTokens(cinfo, scan_index, [&](size_t i, Token t) {
+      if (i == next_restart) {
+        add_restart_marker();
+      }
+      num_bits += coding_tables[context_map[t.context]].depth(t.symbol);
+    });
+  } else if (scan_info->Ss > 0) {
+    const uint8_t context = m->ac_ctx_offset[scan_index];
+    const HuffmanCodeTable* code = &coding_tables[context_map[context]];
+    for (size_t i = 0; i < sti.num_tokens; ++i) {
+      if (i == next_restart) {
+        add_restart_marker();
+      }
+      RefToken t = sti.tokens[i];
+      num_bits += code->depth(t.symbol & 253) + t.refbits;
+    }
+  } else {
+    for (size_t i = 0; i < sti.num_tokens; ++i) {
+      if (i == next_restart) {
+        add_restart_marker();
+      }
+      ++num_bits;
+    }
+  }
+  return DivCeil(num_bits, 8);
+}
+
 }  // namespace jpegli
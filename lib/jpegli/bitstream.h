@@ -27,6 +27,27 @@ void EncodeAPP0(j_compress_ptr cinfo);
 void EncodeAPP14(j_compress_ptr cinfo);
 void WriteFileHeader(j_compress_ptr cinfo);
 
+// Size of the APP2 marker segment written by EncodeMPF().
+constexpr size_t kMPFMarkerSize = 90;
+
+// Writes the Multi-Picture Format index of an image of image_size bytes that is
+// followed by a gain map image of gain_map_size bytes, where marker_pos is the
+// position of the marker in the image.
+void EncodeMPF(j_compress_ptr cinfo, size_t image_size, size_t gain_map_size,
+               size_t marker_pos);
+
+// Records pos, the output position after a restart marker of the current
+// scan, in the restart index, see jpegli_write_restart_index().
+void AddRestartOffset(j_compress_ptr cinfo, size_t pos);
+
+// Returns the size of the restart index segment that EncodeRestartIndex()
+// writes, or 0 if it is not written.
+size_t RestartIndexSize(j_compress_ptr cinfo);
+
+// Writes the restart index segment before the EOI marker, after the data of
+// the last scan is written.
+void EncodeRestartIndex(j_compress_ptr cinfo);
+
 // Returns true of only baseline 8-bit tables are used.
 bool EncodeDQT(j_compress_ptr cinfo, bool write_all_tables);
 void EncodeSOF(j_compress_ptr cinfo, bool is_baseline);
@@ -44,6 +65,22 @@ void WriteBlock(const int32_t* JXL_RESTRICT symbols,
                 JpegBitWriter* JXL_RESTRICT bw);
 void WriteScanData(j_compress_ptr cinfo, int scan_index);
 
+// Starts writing the data of the scan with the given index with
+// ResumeScanData(), which writes it directly to the destination and returns
+// false if the destination suspended; then the next call continues where that
+// one stopped. Not supported with two pass tokenization, since the tokens of
+// the scan are not stored then.
+void StartScanData(j_compress_ptr cinfo, int scan_index);
+bool ResumeScanData(j_compress_ptr cinfo);
+
+// Writes the DC coefficients of the current iMCU row to the streamed first
+// scan, after they are stored in the coefficient buffers.
+void WriteDCScaniMCURow(j_compress_ptr cinfo);
+
+// Returns the number of bytes that WriteScanData() would write, not counting
+// the stuffed zero bytes.
+size_t ScanDataSize(j_compress_ptr cinfo, int scan_index);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_BITSTREAM_H_
@@ -13,7 +13,6 @@
 #include <cstring>
 #include <limits>
 #include <memory>
-#include <unordered_map>
 #include <vector>
 
 #include "lib/jpegli/common.h"
@@ -197,62 +196,31 @@ void AddToRGBPalette(const uint8_t* red, const uint8_t* green,
   }
 }
 
-struct RGBPixelHasher {
-  // A quick but good-enough hash to get 24 bits of RGB into the lower 12 bits.
-  size_t operator()(uint32_t a) const { return (a ^ (a >> 12)) * 0x9e3779b9; }
-};
-
-struct WangHasher {
-  // Thomas Wang's Hash.  Nearly perfect and still quite fast.  Above (for
-  // pixels) we use a simpler hash because the number of hash calls is
-  // proportional to the number of pixels and that hash dominates; we want the
-  // cost to be minimal and we start with a large table.  We can use a better
-  // hash for the histogram since the number of hash calls is proportional to
-  // the number of unique colors in the image, which is hopefully much smaller.
-  // Note that the difference is slight; e.g. replacing RGBPixelHasher with
-  // WangHasher only slows things down by 5% on an Opteron.
-  size_t operator()(uint32_t a) const {
-    a = (a ^ 61) ^ (a >> 16);
-    a = a + (a << 3);
-    a = a ^ (a >> 4);
-    a = a * 0x27d4eb2d;
-    a = a ^ (a >> 15);
-    return a;
-  }
-};
+// Number of bits per channel of the pre-quantized colors.
+constexpr int kColorIndexBits = 6;
+constexpr int kColorIndexSize = 1 << (3 * kColorIndexBits);
 
 // Build an index of all the different colors in the input
 // image. To do this we map the 24 bit RGB representation of the colors
 // to a unique integer index assigned to the different colors in order of
 // appearance in the image.  Return the number of unique colors found.
-// The colors are pre-quantized to 3 * 6 bits precision.
+// The colors are pre-quantized to 3 * 6 bits precision, so the index is
+// looked up in a direct-mapped table of all the pre-quantized colors.
 int BuildRGBColorIndex(const uint8_t* const image, int const num_pixels,
                        int* const count, uint8_t* const red,
                        uint8_t* const green, uint8_t* const blue) {
-  // Impossible because rgb are in the low 24 bits, and the upper 8 bits is 0.
-  const uint32_t impossible_pixel_value = 0x10000000;
-  std::unordered_map<uint32_t, int, RGBPixelHasher> index_map(1 << 12);
-  std::unordered_map<uint32_t, int, RGBPixelHasher>::iterator index_map_lookup;
+  std::vector<int> index_map(kColorIndexSize, -1);
   const uint8_t* imagep = &image[0];
-  uint32_t prev_pixel = impossible_pixel_value;
-  int index = 0;
   int n = 0;
-  for (int i = 0; i < num_pixels; ++i) {
-    uint8_t r = ((*imagep++) & 0xfc) + 2;
-    uint8_t g = ((*imagep++) & 0xfc) + 2;
-    uint8_t b = ((*imagep++) & 0xfc) + 2;
-    uint32_t pixel = (b << 16) | (g << 8) | r;
-    if (pixel != prev_pixel) {
-      prev_pixel = pixel;
-      index_map_lookup = index_map.find(pixel);
-      if (index_map_lookup != index_map.end()) {
-        index = index_map_lookup->second;
-      } else {
-        index_map[pixel] = index = n++;
-        red[index] = r;
-        green[index] = g;
-        blue[index] = b;
-      }
+  for (int i = 0; i < num_pixels; ++i, imagep += 3) {
+    const int key = ((imagep[0] >> 2) << (2 * kColorIndexBits)) |
+                    ((imagep[1] >> 2) << kColorIndexBits) | (imagep[2] >> 2);
+    int index = index_map[key];
+    if (index < 0) {
+      index_map[key] = index = n++;
+      red[index] = (imagep[0] & 0xfc) + 2;
+      green[index] = (imagep[1] & 0xfc) + 2;
+      blue[index] = (imagep[2] & 0xfc) + 2;
     }
     ++count[index];
   }
@@ -267,7 +235,9 @@ void ChooseColorMap2Pass(j_decompress_ptr cinfo) {
   }
   jpeg_decomp_master* m = cinfo->master;
   const size_t num_pixels = cinfo->output_width * cinfo->output_height;
-  const int max_color_count = std::max<size_t>(num_pixels, 1u << 18);
+  // There are at most kColorIndexSize different pre-quantized colors.
+  const int max_color_count =
+      std::min<size_t>(std::max<size_t>(num_pixels, 1), kColorIndexSize);
   const int max_palette_size = cinfo->desired_number_of_colors;
   std::unique_ptr<uint8_t[]> red(new uint8_t[max_color_count]);
   std::unique_ptr<uint8_t[]> green(new uint8_t[max_color_count]);
@@ -309,9 +279,12 @@ void ChooseColorMap2Pass(j_decompress_ptr cinfo) {
   // Calculation of the multi-resolution density grid.
   std::vector<int> density(n * kMaxLevel);
   std::vector<int> radius(n * kMaxLevel);
-  std::unordered_map<uint32_t, int, WangHasher> histogram[kMaxLevel];
+  // The keys of the colors at each level are their interlaced pre-quantized
+  // bits with the lowest 3 * level bits removed, so the histograms are
+  // direct-mapped tables.
+  std::vector<int> histogram[kMaxLevel];
   for (int level = 0; level < kMaxLevel; ++level) {
-    // This value is never used because key = InterlaceBitsRGB(...) >> 6
+    histogram[level].resize(kColorIndexSize >> (3 * level));
   }
 
   for (int i = 0; i < n; ++i) {
@@ -6,7 +6,9 @@
 
 #include "lib/jpegli/color_transform.h"
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <utility>
 
@@ -29,10 +31,17 @@ namespace HWY_NAMESPACE {
 
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::Clamp;
+using hwy::HWY_NAMESPACE::DemoteTo;
 using hwy::HWY_NAMESPACE::Div;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::NearestInt;
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::StoreInterleaved3;
+using hwy::HWY_NAMESPACE::StoreInterleaved4;
 using hwy::HWY_NAMESPACE::Sub;
+using hwy::HWY_NAMESPACE::Vec;
 
 template <int kRed, int kGreen, int kBlue, int kAlpha>
 void YCbCrToExtRGB(float* row[kMaxComponents], size_t xsize) {
@@ -93,6 +102,105 @@ void YCbCrToABGR(float* row[kMaxComponents], size_t xsize) {
   YCbCrToExtRGB<3, 2, 1, 0>(row, xsize);
 }
 
+// Stores the channel v of an output pixel as its c-th component.
+template <class V>
+HWY_INLINE void SetPixelComponent(int c, V v, V* v0, V* v1, V* v2, V* v3) {
+  if (c == 0) {
+    *v0 = v;
+  } else if (c == 1) {
+    *v1 = v;
+  } else if (c == 2) {
+    *v2 = v;
+  } else {
+    *v3 = v;
+  }
+}
+
+// Same as YCbCrToExtRGB() followed by undoing the centering of the sample
+// values and the 8-bit output of WriteToOutput() in render.cc, but without
+// storing the RGB rows. Writes the len interleaved pixels starting at column
+// x0 of the rows to output, and nothing past them.
+template <int kRed, int kGreen, int kBlue, int kAlpha>
+void YCbCrToExtRGB8(float* row[kMaxComponents], size_t x0, size_t len,
+                    uint8_t* JXL_RESTRICT output) {
+  const HWY_CAPPED(float, 8) df;
+  const Rebind<uint8_t, decltype(df)> du8;
+  using VU8 = Vec<decltype(du8)>;
+  constexpr size_t kChannels = kAlpha >= 0 ? 4 : 3;
+  const float* row_y = row[0] + x0;
+  const float* row_cb = row[1] + x0;
+  const float* row_cr = row[2] + x0;
+
+  const auto crcr = Set(df, 1.402f);
+  const auto cgcb = Set(df, -0.114f * 1.772f / 0.587f);
+  const auto cgcr = Set(df, -0.299f * 1.402f / 0.587f);
+  const auto cbcb = Set(df, 1.772f);
+  const auto c128 = Set(df, 128.0f / 255);
+  const auto zero = Zero(df);
+  const auto mul = Set(df, 255.0f);
+  const auto to_uint8 = [&](Vec<decltype(df)> v) {
+    return DemoteTo(du8, NearestInt(Clamp(zero, Mul(Add(v, c128), mul), mul)));
+  };
+  const VU8 alpha_opaque = to_uint8(Set(df, 127.0f / 255.0f));
+
+  HWY_ALIGN uint8_t tail[4 * 8];
+  for (size_t x = 0; x < len; x += Lanes(df)) {
+    const auto y_vec = LoadU(df, row_y + x);
+    const auto cb_vec = LoadU(df, row_cb + x);
+    const auto cr_vec = LoadU(df, row_cr + x);
+    const auto r_vec = MulAdd(crcr, cr_vec, y_vec);
+    const auto g_vec = MulAdd(cgcr, cr_vec, MulAdd(cgcb, cb_vec, y_vec));
+    const auto b_vec = MulAdd(cbcb, cb_vec, y_vec);
+    VU8 v0 = alpha_opaque;
+    VU8 v1 = alpha_opaque;
+    VU8 v2 = alpha_opaque;
+    VU8 v3 = alpha_opaque;
+    SetPixelComponent(kRed, to_uint8(r_vec), &v0, &v1, &v2, &v3);
+    SetPixelComponent(kGreen, to_uint8(g_vec), &v0, &v1, &v2, &v3);
+    SetPixelComponent(kBlue, to_uint8(b_vec), &v0, &v1, &v2, &v3);
+    const bool is_tail = x + Lanes(df) > len;
+    uint8_t* out = is_tail ? tail : output + kChannels * x;
+    if (kChannels == 3) {
+      StoreInterleaved3(v0, v1, v2, du8, out);
+    } else {
+      StoreInterleaved4(v0, v1, v2, v3, du8, out);
+    }
+    if (is_tail) {
+      memcpy(output + kChannels * x, tail, kChannels * (len - x));
+    }
+  }
+}
+
+void YCbCrToRGB8(float* row[kMaxComponents], size_t x0, size_t len,
+                 uint8_t* JXL_RESTRICT output) {
+  YCbCrToExtRGB8<0, 1, 2, -1>(row, x0, len, output);
+}
+
+void YCbCrToBGR8(float* row[kMaxComponents], size_t x0, size_t len,
+                 uint8_t* JXL_RESTRICT output) {
+  YCbCrToExtRGB8<2, 1, 0, -1>(row, x0, len, output);
+}
+
+void YCbCrToRGBA8(float* row[kMaxComponents], size_t x0, size_t len,
+                  uint8_t* JXL_RESTRICT output) {
+  YCbCrToExtRGB8<0, 1, 2, 3>(row, x0, len, output);
+}
+
+void YCbCrToBGRA8(float* row[kMaxComponents], size_t x0, size_t len,
+                  uint8_t* JXL_RESTRICT output) {
+  YCbCrToExtRGB8<2, 1, 0, 3>(row, x0, len, output);
+}
+
+void YCbCrToARGB8(float* row[kMaxComponents], size_t x0, size_t len,
+                  uint8_t* JXL_RESTRICT output) {
+  YCbCrToExtRGB8<1, 2, 3, 0>(row, x0, len, output);
+}
+
+void YCbCrToABGR8(float* row[kMaxComponents], size_t x0, size_t len,
+                  uint8_t* JXL_RESTRICT output) {
+  YCbCrToExtRGB8<3, 2, 1, 0>(row, x0, len, output);
+}
+
 void YCCKToCMYK(float* row[kMaxComponents], size_t xsize) {
   const HWY_CAPPED(float, 8) df;
   float* JXL_RESTRICT row0 = row[0];
@@ -107,6 +215,261 @@ void YCCKToCMYK(float* row[kMaxComponents], size_t xsize) {
   }
 }
 
+// Loads the pixels at column x of the centered rows of a CMYK image, or of a
+// YCCK image if kYCCK, as CMYK values in the [0.0, 1.0] range. These are
+// inverted, i.e. 1.0 means no ink, as written by Adobe applications.
+template <bool kYCCK, class DF>
+HWY_INLINE void LoadCMYK(DF df, float* row[kMaxComponents], size_t x,
+                         Vec<DF>* c, Vec<DF>* m, Vec<DF>* y, Vec<DF>* k) {
+  const auto zero = Zero(df);
+  const auto one = Set(df, 1.0f);
+  const auto c128 = Set(df, 128.0f / 255);
+  const auto v0 = LoadU(df, row[0] + x);
+  const auto v1 = LoadU(df, row[1] + x);
+  const auto v2 = LoadU(df, row[2] + x);
+  if (kYCCK) {
+    // Same as YCCKToCMYK(), the inverse of the RGB of the YCbCr channels.
+    const auto c127 = Set(df, 127.0f / 255);
+    const auto crcr = Set(df, 1.402f);
+    const auto cgcb = Set(df, -0.114f * 1.772f / 0.587f);
+    const auto cgcr = Set(df, -0.299f * 1.402f / 0.587f);
+    const auto cbcb = Set(df, 1.772f);
+    *c = Sub(c127, MulAdd(crcr, v2, v0));
+    *m = Sub(c127, MulAdd(cgcr, v2, MulAdd(cgcb, v1, v0)));
+    *y = Sub(c127, MulAdd(cbcb, v1, v0));
+  } else {
+    *c = Add(v0, c128);
+    *m = Add(v1, c128);
+    *y = Add(v2, c128);
+  }
+  *k = Add(LoadU(df, row[3] + x), c128);
+  *c = Clamp(*c, zero, one);
+  *m = Clamp(*m, zero, one);
+  *y = Clamp(*y, zero, one);
+  *k = Clamp(*k, zero, one);
+}
+
+// Converts the CMYK or, if kYCCK, YCCK rows to RGB rows for a preview, as
+// R = C * K with the inverted CMYK values of LoadCMYK(), which is the same
+// conversion that TurboJPEG applies to CMYK output. The output rows may alias
+// the input rows.
+template <bool kYCCK, int kRed, int kGreen, int kBlue, int kAlpha>
+void CMYKToExtRGB(float* row[kMaxComponents], size_t xsize) {
+  const HWY_CAPPED(float, 8) df;
+  const auto c128 = Set(df, 128.0f / 255);
+  const auto alpha_opaque = Set(df, 127.0f / 255.0f);
+  Vec<decltype(df)> c, m, y, k;  // NOLINT
+  for (size_t x = 0; x < xsize; x += Lanes(df)) {
+    LoadCMYK<kYCCK>(df, row, x, &c, &m, &y, &k);
+    Store(Sub(Mul(c, k), c128), df, row[kRed] + x);
+    Store(Sub(Mul(m, k), c128), df, row[kGreen] + x);
+    Store(Sub(Mul(y, k), c128), df, row[kBlue] + x);
+    if (kAlpha >= 0) {
+      Store(alpha_opaque, df, row[kAlpha] + x);
+    }
+  }
+}
+
+void CMYKToRGB(float* row[kMaxComponents], size_t xsize) {
+  CMYKToExtRGB<false, 0, 1, 2, -1>(row, xsize);
+}
+
+void CMYKToBGR(float* row[kMaxComponents], size_t xsize) {
+  CMYKToExtRGB<false, 2, 1, 0, -1>(row, xsize);
+}
+
+void CMYKToRGBA(float* row[kMaxComponents], size_t xsize) {
+  CMYKToExtRGB<false, 0, 1, 2, 3>(row, xsize);
+}
+
+void CMYKToBGRA(float* row[kMaxComponents], size_t xsize) {
+  CMYKToExtRGB<false, 2, 1, 0, 3>(row, xsize);
+}
+
+void CMYKToARGB(float* row[kMaxComponents], size_t xsize) {
+  CMYKToExtRGB<false, 1, 2, 3, 0>(row, xsize);
+}
+
+void CMYKToABGR(float* row[kMaxComponents], size_t xsize) {
+  CMYKToExtRGB<false, 3, 2, 1, 0>(row, xsize);
+}
+
+void YCCKToRGB(float* row[kMaxComponents], size_t xsize) {
+  CMYKToExtRGB<true, 0, 1, 2, -1>(row, xsize);
+}
+
+void YCCKToBGR(float* row[kMaxComponents], size_t xsize) {
+  CMYKToExtRGB<true, 2, 1, 0, -1>(row, xsize);
+}
+
+void YCCKToRGBA(float* row[kMaxComponents], size_t xsize) {
+  CMYKToExtRGB<true, 0, 1, 2, 3>(row, xsize);
+}
+
+void YCCKToBGRA(float* row[kMaxComponents], size_t xsize) {
+  CMYKToExtRGB<true, 2, 1, 0, 3>(row, xsize);
+}
+
+void YCCKToARGB(float* row[kMaxComponents], size_t xsize) {
+  CMYKToExtRGB<true, 1, 2, 3, 0>(row, xsize);
+}
+
+void YCCKToABGR(float* row[kMaxComponents], size_t xsize) {
+  CMYKToExtRGB<true, 3, 2, 1, 0>(row, xsize);
+}
+
+// Same as CMYKToExtRGB() followed by the 8-bit output of WriteToOutput(), or
+// YCCKToCMYK() followed by it if kRed < 0, in which case the four inverted
+// CMYK channels are written. Writes the len interleaved pixels starting at
+// column x0 of the rows to output, and nothing past them.
+template <bool kYCCK, int kRed, int kGreen, int kBlue, int kAlpha>
+void CMYKToExtRGB8(float* row[kMaxComponents], size_t x0, size_t len,
+                   uint8_t* JXL_RESTRICT output) {
+  const HWY_CAPPED(float, 8) df;
+  const Rebind<uint8_t, decltype(df)> du8;
+  using VU8 = Vec<decltype(du8)>;
+  constexpr size_t kChannels = kRed < 0 || kAlpha >= 0 ? 4 : 3;
+  const auto mul = Set(df, 255.0f);
+  const auto to_uint8 = [&](Vec<decltype(df)> v) {
+    return DemoteTo(du8, NearestInt(Mul(v, mul)));
+  };
+  const VU8 alpha_opaque = Set(du8, 255);
+  Vec<decltype(df)> c, m, y, k;  // NOLINT
+
+  HWY_ALIGN uint8_t tail[4 * 8];
+  for (size_t x = 0; x < len; x += Lanes(df)) {
+    LoadCMYK<kYCCK>(df, row, x0 + x, &c, &m, &y, &k);
+    VU8 v0 = alpha_opaque;
+    VU8 v1 = alpha_opaque;
+    VU8 v2 = alpha_opaque;
+    VU8 v3 = alpha_opaque;
+    if (kRed < 0) {
+      v0 = to_uint8(c);
+      v1 = to_uint8(m);
+      v2 = to_uint8(y);
+      v3 = to_uint8(k);
+    } else {
+      SetPixelComponent(kRed, to_uint8(Mul(c, k)), &v0, &v1, &v2, &v3);
+      SetPixelComponent(kGreen, to_uint8(Mul(m, k)), &v0, &v1, &v2, &v3);
+      SetPixelComponent(kBlue, to_uint8(Mul(y, k)), &v0, &v1, &v2, &v3);
+    }
+    const bool is_tail = x + Lanes(df) > len;
+    uint8_t* out = is_tail ? tail : output + kChannels * x;
+    if (kChannels == 3) {
+      StoreInterleaved3(v0, v1, v2, du8, out);
+    } else {
+      StoreInterleaved4(v0, v1, v2, v3, du8, out);
+    }
+    if (is_tail) {
+      memcpy(output + kChannels * x, tail, kChannels * (len - x));
+    }
+  }
+}
+
+void YCCKToCMYK8(float* row[kMaxComponents], size_t x0, size_t len,
+                 uint8_t* JXL_RESTRICT output) {
+  CMYKToExtRGB8<true, -1, -1, -1, -1>(row, x0, len, output);
+}
+
+void CMYKToRGB8(float* row[kMaxComponents], size_t x0, size_t len,
+                uint8_t* JXL_RESTRICT output) {
+  CMYKToExtRGB8<false, 0, 1, 2, -1>(row, x0, len, output);
+}
+
+void CMYKToBGR8(float* row[kMaxComponents], size_t x0, size_t len,
+                uint8_t* JXL_RESTRICT output) {
+  CMYKToExtRGB8<false, 2, 1, 0, -1>(row, x0, len, output);
+}
+
+void CMYKToRGBA8(float* row[kMaxComponents], size_t x0, size_t len,
+                 uint8_t* JXL_RESTRICT output) {
+  CMYKToExtRGB8<false, 0, 1, 2, 3>(row, x0, len, output);
+}
+
+void CMYKToBGRA8(float* row[kMaxComponents], size_t x0, size_t len,
+                 uint8_t* JXL_RESTRICT output) {
+  CMYKToExtRGB8<false, 2, 1, 0, 3>(row, x0, len, output);
+}
+
+void CMYKToARGB8(float* row[kMaxComponents], size_t x0, size_t len,
+                 uint8_t* JXL_RESTRICT output) {
+  CMYKToExtRGB8<false, 1, 2, 3, 0>(row, x0, len, output);
+}
+
+void CMYKToABGR8(float* row[kMaxComponents], size_t x0, size_t len,
+                 uint8_t* JXL_RESTRICT output) {
+  CMYKToExtRGB8<false, 3, 2, 1, 0>(row, x0, len, output);
+}
+
+void YCCKToRGB8(float* row[kMaxComponents], size_t x0, size_t len,
+                uint8_t* JXL_RESTRICT output) {
+  CMYKToExtRGB8<true, 0, 1, 2, -1>(row, x0, len, output);
+}
+
+void YCCKToBGR8(float* row[kMaxComponents], size_t x0, size_t len,
+                uint8_t* JXL_RESTRICT output) {
+  CMYKToExtRGB8<true, 2, 1, 0, -1>(row, x0, len, output);
+}
+
+void YCCKToRGBA8(float* row[kMaxComponents], size_t x0, size_t len,
+                 uint8_t* JXL_RESTRICT output) {
+  CMYKToExtRGB8<true, 0, 1, 2, 3>(row, x0, len, output);
+}
+
+void YCCKToBGRA8(float* row[kMaxComponents], size_t x0, size_t len,
+                 uint8_t* JXL_RESTRICT output) {
+  CMYKToExtRGB8<true, 2, 1, 0, 3>(row, x0, len, output);
+}
+
+void YCCKToARGB8(float* row[kMaxComponents], size_t x0, size_t len,
+                 uint8_t* JXL_RESTRICT output) {
+  CMYKToExtRGB8<true, 1, 2, 3, 0>(row, x0, len, output);
+}
+
+void YCCKToABGR8(float* row[kMaxComponents], size_t x0, size_t len,
+                 uint8_t* JXL_RESTRICT output) {
+  CMYKToExtRGB8<true, 3, 2, 1, 0>(row, x0, len, output);
+}
+
+// Full-range BT.601 as defined by JFIF Clause 7:
+// https://www.itu.int/rec/T-REC-T.871-201105-I/en
+template <class DF>
+class RGBToYCbCrTransform {
+ public:
+  explicit RGBToYCbCrTransform(DF df)
+      : c128_(Set(df, 128.0f)),
+        kR_(Set(df, 0.299f)),  // NTSC luma
+        kG_(Set(df, 0.587f)),
+        kB_(Set(df, 0.114f)),
+        kDiffR_(Add(Set(df, 0.701f), kR_)),
+        kDiffB_(Add(Set(df, 0.886f), kB_)),
+        kNormR_(Div(Set(df, 1.0f), Add(Set(df, 0.701f), Add(kG_, kB_)))),
+        kNormB_(Div(Set(df, 1.0f), Add(kR_, Add(kG_, Set(df, 0.886f))))) {}
+
+  HWY_INLINE void Apply(Vec<DF> r, Vec<DF> g, Vec<DF> b, Vec<DF>* y,
+                        Vec<DF>* cb, Vec<DF>* cr) const {
+    const auto r_base = Mul(r, kR_);
+    const auto r_diff = Mul(r, kDiffR_);
+    const auto g_base = Mul(g, kG_);
+    const auto b_base = Mul(b, kB_);
+    const auto b_diff = Mul(b, kDiffB_);
+    const auto y_base = Add(r_base, Add(g_base, b_base));
+    *y = y_base;
+    *cb = MulAdd(Sub(b_diff, y_base), kNormB_, c128_);
+    *cr = MulAdd(Sub(r_diff, y_base), kNormR_, c128_);
+  }
+
+ private:
+  const Vec<DF> c128_;
+  const Vec<DF> kR_;
+  const Vec<DF> kG_;
+  const Vec<DF> kB_;
+  const Vec<DF> kDiffR_;
+  const Vec<DF> kDiffB_;
+  const Vec<DF> kNormR_;
+  const Vec<DF> kNormB_;
+};
+
 template <int kRed, int kGreen, int kBlue>
 void ExtRGBToYCbCr(float* row[kMaxComponents], size_t xsize) {
   const HWY_CAPPED(float, 8) df;
@@ -116,32 +479,14 @@ void ExtRGBToYCbCr(float* row[kMaxComponents], size_t xsize) {
   float* row_y = row[0];
   float* row_cb = row[1];
   float* row_cr = row[2];
-  // Full-range BT.601 as defined by JFIF Clause 7:
-  // https://www.itu.int/rec/T-REC-T.871-201105-I/en
-  const auto c128 = Set(df, 128.0f);
-  const auto kR = Set(df, 0.299f);  // NTSC luma
-  const auto kG = Set(df, 0.587f);
-  const auto kB = Set(df, 0.114f);
-  const auto kAmpR = Set(df, 0.701f);
-  const auto kAmpB = Set(df, 0.886f);
-  const auto kDiffR = Add(kAmpR, kR);
-  const auto kDiffB = Add(kAmpB, kB);
-  const auto kNormR = Div(Set(df, 1.0f), (Add(kAmpR, Add(kG, kB))));
-  const auto kNormB = Div(Set(df, 1.0f), (Add(kR, Add(kG, kAmpB))));
-
+  const RGBToYCbCrTransform<decltype(df)> transform(df);
+  Vec<decltype(df)> y_vec, cb_vec, cr_vec;  // NOLINT
   for (size_t x = 0; x < xsize; x += Lanes(df)) {
     const auto r = Load(df, row_r + x);
     const auto g = Load(df, row_g + x);
     const auto b = Load(df, row_b + x);
-    const auto r_base = Mul(r, kR);
-    const auto r_diff = Mul(r, kDiffR);
-    const auto g_base = Mul(g, kG);
-    const auto b_base = Mul(b, kB);
-    const auto b_diff = Mul(b, kDiffB);
-    const auto y_base = Add(r_base, Add(g_base, b_base));
-    const auto cb_vec = MulAdd(Sub(b_diff, y_base), kNormB, c128);
-    const auto cr_vec = MulAdd(Sub(r_diff, y_base), kNormR, c128);
-    Store(y_base, df, row_y + x);
+    transform.Apply(r, g, b, &y_vec, &cb_vec, &cr_vec);
+    Store(y_vec, df, row_y + x);
     Store(cb_vec, df, row_cb + x);
     Store(cr_vec, df, row_cr + x);
   }
@@ -163,18 +508,79 @@ void ABGRToYCbCr(float* row[kMaxComponents], size_t xsize) {
   ExtRGBToYCbCr<3, 2, 1>(row, xsize);
 }
 
+// Converts an interleaved 8-bit RGB row of len pixels, padded to len_padded
+// by repeating its last pixel, to the YCbCr row_y and the horizontally 2x
+// downsampled row_cb and row_cr. For the first row of a row pair the sums of
+// the horizontal chroma pairs are stored, and for the second row the 2x2
+// averages are completed in place, so that the result is the same as that
+// of RGBToYCbCr() followed by Downsample2x2(). A nullptr row_in is read as
+// all zeros.
+void RGB8ToYCbCr420(const uint8_t* row_in, size_t len, size_t len_padded,
+                    float* JXL_RESTRICT row_y, float* JXL_RESTRICT row_cb,
+                    float* JXL_RESTRICT row_cr, bool second_row) {
+  const HWY_CAPPED(float, 8) df;
+  const Rebind<uint32_t, decltype(df)> du;
+  const Rebind<uint8_t, decltype(df)> du8;
+  const size_t N = Lanes(df);
+  const RGBToYCbCrTransform<decltype(df)> transform(df);
+  const auto quarter = Set(df, 0.25f);
+  HWY_ALIGN uint8_t padded_in[3 * 16];
+  HWY_ALIGN float tmp_cb[16];
+  HWY_ALIGN float tmp_cr[16];
+  Vec<decltype(du8)> r8, g8, b8;                             // NOLINT
+  Vec<decltype(df)> y_vec, cb_vec, cr_vec, cb0, cb1, cr0, cr1;  // NOLINT
+  for (size_t x = 0; x < len_padded; x += 2 * N) {
+    const uint8_t* pixels = padded_in;
+    if (row_in != nullptr && x + 2 * N <= len) {
+      pixels = row_in + 3 * x;
+    } else {
+      for (size_t i = 0; i < 2 * N; ++i) {
+        const size_t ix = std::min(x + i, len - 1);
+        for (size_t c = 0; c < 3; ++c) {
+          padded_in[3 * i + c] = row_in ? row_in[3 * ix + c] : 0;
+        }
+      }
+    }
+    for (size_t k = 0; k < 2; ++k) {
+      LoadInterleaved3(du8, pixels + 3 * k * N, r8, g8, b8);
+      transform.Apply(ConvertTo(df, PromoteTo(du, r8)),
+                      ConvertTo(df, PromoteTo(du, g8)),
+                      ConvertTo(df, PromoteTo(du, b8)), &y_vec, &cb_vec,
+                      &cr_vec);
+      Store(y_vec, df, row_y + x + k * N);
+      Store(cb_vec, df, tmp_cb + k * N);
+      Store(cr_vec, df, tmp_cr + k * N);
+    }
+    LoadInterleaved2(df, tmp_cb, cb0, cb1);
+    LoadInterleaved2(df, tmp_cr, cr0, cr1);
+    auto cb_sum = Add(cb0, cb1);
+    auto cr_sum = Add(cr0, cr1);
+    if (second_row) {
+      cb_sum = Mul(quarter, Add(Load(df, row_cb + x / 2), cb_sum));
+      cr_sum = Mul(quarter, Add(Load(df, row_cr + x / 2), cr_sum));
+    }
+    Store(cb_sum, df, row_cb + x / 2);
+    Store(cr_sum, df, row_cr + x / 2);
+  }
+}
+
 void CMYKToYCCK(float* row[kMaxComponents], size_t xsize) {
   const HWY_CAPPED(float, 8) df;
   float* JXL_RESTRICT row0 = row[0];
   float* JXL_RESTRICT row1 = row[1];
   float* JXL_RESTRICT row2 = row[2];
+  const RGBToYCbCrTransform<decltype(df)> transform(df);
   const auto unity = Set(df, 255.0f);
   for (size_t x = 0; x < xsize; x += Lanes(df)) {
-    Store(Sub(unity, Load(df, row0 + x)), df, row0 + x);
-    Store(Sub(unity, Load(df, row1 + x)), df, row1 + x);
-    Store(Sub(unity, Load(df, row2 + x)), df, row2 + x);
+    const auto r = Sub(unity, Load(df, row0 + x));
+    const auto g = Sub(unity, Load(df, row1 + x));
+    const auto b = Sub(unity, Load(df, row2 + x));
+    Vec<decltype(df)> y, cb, cr;  // NOLINT
+    transform.Apply(r, g, b, &y, &cb, &cr);
+    Store(y, df, row0 + x);
+    Store(cb, df, row1 + x);
+    Store(cr, df, row2 + x);
   }
-  RGBToYCbCr(row, xsize);
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -187,16 +593,48 @@ namespace jpegli {
 
 HWY_EXPORT(CMYKToYCCK);
 HWY_EXPORT(YCCKToCMYK);
+HWY_EXPORT(YCCKToCMYK8);
+HWY_EXPORT(CMYKToRGB);
+HWY_EXPORT(CMYKToBGR);
+HWY_EXPORT(CMYKToRGBA);
+HWY_EXPORT(CMYKToBGRA);
+HWY_EXPORT(CMYKToARGB);
+HWY_EXPORT(CMYKToABGR);
+HWY_EXPORT(YCCKToRGB);
+HWY_EXPORT(YCCKToBGR);
+HWY_EXPORT(YCCKToRGBA);
+HWY_EXPORT(YCCKToBGRA);
+HWY_EXPORT(YCCKToARGB);
+HWY_EXPORT(YCCKToABGR);
+HWY_EXPORT(CMYKToRGB8);
+HWY_EXPORT(CMYKToBGR8);
+HWY_EXPORT(CMYKToRGBA8);
+HWY_EXPORT(CMYKToBGRA8);
+HWY_EXPORT(CMYKToARGB8);
+HWY_EXPORT(CMYKToABGR8);
+HWY_EXPORT(YCCKToRGB8);
+HWY_EXPORT(YCCKToBGR8);
+HWY_EXPORT(YCCKToRGBA8);
+HWY_EXPORT(YCCKToBGRA8);
+HWY_EXPORT(YCCKToARGB8);
+HWY_EXPORT(YCCKToABGR8);
 HWY_EXPORT(YCbCrToRGB);
 HWY_EXPORT(YCbCrToBGR);
 HWY_EXPORT(YCbCrToRGBA);
 HWY_EXPORT(YCbCrToBGRA);
 HWY_EXPORT(YCbCrToARGB);
 HWY_EXPORT(YCbCrToABGR);
+HWY_EXPORT(YCbCrToRGB8);
+HWY_EXPORT(YCbCrToBGR8);
+HWY_EXPORT(YCbCrToRGBA8);
+HWY_EXPORT(YCbCrToBGRA8);
+HWY_EXPORT(YCbCrToARGB8);
+HWY_EXPORT(YCbCrToABGR8);
 HWY_EXPORT(RGBToYCbCr);
 HWY_EXPORT(BGRToYCbCr);
 HWY_EXPORT(ARGBToYCbCr);
 HWY_EXPORT(ABGRToYCbCr);
+HWY_EXPORT(RGB8ToYCbCr420);
 
 bool CheckColorSpaceComponents(int num_components, J_COLOR_SPACE colorspace) {
   switch (colorspace) {
@@ -302,6 +740,8 @@ void RGBToABGR(float* row[kMaxComponents], size_t len) {
 
 void ChooseColorTransform(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
+  m->fused_input_transform =
+      m->use_fused_input ? HWY_DYNAMIC_DISPATCH(RGB8ToYCbCr420) : nullptr;
   if (!CheckColorSpaceComponents(cinfo->input_components,
                                  cinfo->in_color_space)) {
     JPEGLI_ERROR("Invalid number of input components %d for colorspace %d",
@@ -396,6 +836,97 @@ void ChooseColorTransform(j_compress_ptr cinfo) {
   }
 }
 
+namespace {
+
+// Chooses the color transforms from a CMYK or YCCK image to CMYK output or to
+// an RGB preview, and the fused transforms that also write the 8-bit output.
+void ChooseCMYKColorTransform(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  const bool ycck = cinfo->jpeg_color_space == JCS_YCCK;
+  switch (cinfo->out_color_space) {
+    case JCS_CMYK:
+      if (ycck) {
+        m->color_transform = HWY_DYNAMIC_DISPATCH(YCCKToCMYK);
+        m->color_output_uint8 = HWY_DYNAMIC_DISPATCH(YCCKToCMYK8);
+      }
+      break;
+    case JCS_RGB:
+#ifdef JCS_EXTENSIONS
+    case JCS_EXT_RGB:
+#endif
+      m->color_transform = ycck ? HWY_DYNAMIC_DISPATCH(YCCKToRGB)
+                                : HWY_DYNAMIC_DISPATCH(CMYKToRGB);
+      m->color_output_uint8 = ycck ? HWY_DYNAMIC_DISPATCH(YCCKToRGB8)
+                                   : HWY_DYNAMIC_DISPATCH(CMYKToRGB8);
+      break;
+#ifdef JCS_EXTENSIONS
+    case JCS_EXT_BGR:
+      m->color_transform = ycck ? HWY_DYNAMIC_DISPATCH(YCCKToBGR)
+                                : HWY_DYNAMIC_DISPATCH(CMYKToBGR);
+      m->color_output_uint8 = ycck ? HWY_DYNAMIC_DISPATCH(YCCKToBGR8)
+                                   : HWY_DYNAMIC_DISPATCH(CMYKToBGR8);
+      break;
+    case JCS_EXT_RGBX:
+#endif
+#ifdef JCS_ALPHA_EXTENSIONS
+    case JCS_EXT_RGBA:
+#endif
+#if defined(JCS_EXTENSIONS) || defined(JCS_ALPHA_EXTENSIONS)
+      m->color_transform = ycck ? HWY_DYNAMIC_DISPATCH(YCCKToRGBA)
+                                : HWY_DYNAMIC_DISPATCH(CMYKToRGBA);
+      m->color_output_uint8 = ycck ? HWY_DYNAMIC_DISPATCH(YCCKToRGBA8)
+                                   : HWY_DYNAMIC_DISPATCH(CMYKToRGBA8);
+      break;
+#endif
+#ifdef JCS_EXTENSIONS
+    case JCS_EXT_BGRX:
+#endif
+#ifdef JCS_ALPHA_EXTENSIONS
+    case JCS_EXT_BGRA:
+#endif
+#if defined(JCS_EXTENSIONS) || defined(JCS_ALPHA_EXTENSIONS)
+      m->color_transform = ycck ? HWY_DYNAMIC_DISPATCH(YCCKToBGRA)
+                                : HWY_DYNAMIC_DISPATCH(CMYKToBGRA);
+      m->color_output_uint8 = ycck ? HWY_DYNAMIC_DISPATCH(YCCKToBGRA8)
+                                   : HWY_DYNAMIC_DISPATCH(CMYKToBGRA8);
+      break;
+#endif
+#ifdef JCS_EXTENSIONS
+    case JCS_EXT_XRGB:
+#endif
+#ifdef JCS_ALPHA_EXTENSIONS
+    case JCS_EXT_ARGB:
+#endif
+#if defined(JCS_EXTENSIONS) || defined(JCS_ALPHA_EXTENSIONS)
+      m->color_transform = ycck ? HWY_DYNAMIC_DISPATCH(YCCKToARGB)
+                                : HWY_DYNAMIC_DISPATCH(CMYKToARGB);
+      m->color_output_uint8 = ycck ? HWY_DYNAMIC_DISPATCH(YCCKToARGB8)
+                                   : HWY_DYNAMIC_DISPATCH(CMYKToARGB8);
+      break;
+#endif
+#ifdef JCS_EXTENSIONS
+    case JCS_EXT_XBGR:
+#endif
+#ifdef JCS_ALPHA_EXTENSIONS
+    case JCS_EXT_ABGR:
+#endif
+#if defined(JCS_EXTENSIONS) || defined(JCS_ALPHA_EXTENSIONS)
+      m->color_transform = ycck ? HWY_DYNAMIC_DISPATCH(YCCKToABGR)
+                                : HWY_DYNAMIC_DISPATCH(CMYKToABGR);
+      m->color_output_uint8 = ycck ? HWY_DYNAMIC_DISPATCH(YCCKToABGR8)
+                                   : HWY_DYNAMIC_DISPATCH(CMYKToABGR8);
+      break;
+#endif
+    default:
+      break;
+  }
+  if (cinfo->quantize_colors || m->output_data_type_ != JPEGLI_TYPE_UINT8) {
+    m->color_output_uint8 = nullptr;
+  }
+}
+
+}  // namespace
+
 void ChooseColorTransform(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   if (!CheckColorSpaceComponents(cinfo->out_color_components,
@@ -408,6 +939,7 @@ void ChooseColorTransform(j_decompress_ptr cinfo) {
     JPEGLI_ERROR("Invalid number of components %d for colorspace %d",
                  cinfo->num_components, cinfo->jpeg_color_space);
   }
+  m->color_output_uint8 = nullptr;
   if (cinfo->jpeg_color_space == cinfo->out_color_space) {
     if (cinfo->num_components != cinfo->out_color_components) {
       JPEGLI_ERROR("Input/output components mismatch:  %d vs %d",
@@ -538,10 +1070,9 @@ void ChooseColorTransform(j_decompress_ptr cinfo) {
       default:
         m->color_transform = nullptr;
     }
-  } else if (cinfo->jpeg_color_space == JCS_YCCK) {
-    if (cinfo->out_color_space == JCS_CMYK) {
-      m->color_transform = HWY_DYNAMIC_DISPATCH(YCCKToCMYK);
-    }
+  } else if (cinfo->jpeg_color_space == JCS_CMYK ||
+             cinfo->jpeg_color_space == JCS_YCCK) {
+    ChooseCMYKColorTransform(cinfo);
   }
 
   if (m->color_transform == nullptr) {
@@ -549,6 +1080,52 @@ void ChooseColorTransform(j_decompress_ptr cinfo) {
     JPEGLI_ERROR("Unsupported color transform %d -> %d",
                  cinfo->jpeg_color_space, cinfo->out_color_space);
   }
+
+  if (cinfo->jpeg_color_space != JCS_YCbCr || cinfo->quantize_colors ||
+      m->output_data_type_ != JPEGLI_TYPE_UINT8) {
+    return;
+  }
+  switch (cinfo->out_color_space) {
+    case JCS_RGB:
+      m->color_output_uint8 = HWY_DYNAMIC_DISPATCH(YCbCrToRGB8);
+      break;
+#ifdef JCS_EXTENSIONS
+    case JCS_EXT_RGB:
+      m->color_output_uint8 = HWY_DYNAMIC_DISPATCH(YCbCrToRGB8);
+      break;
+    case JCS_EXT_BGR:
+      m->color_output_uint8 = HWY_DYNAMIC_DISPATCH(YCbCrToBGR8);
+      break;
+    case JCS_EXT_RGBX:
+      m->color_output_uint8 = HWY_DYNAMIC_DISPATCH(YCbCrToRGBA8);
+      break;
+    case JCS_EXT_BGRX:
+      m->color_output_uint8 = HWY_DYNAMIC_DISPATCH(YCbCrToBGRA8);
+      break;
+    case JCS_EXT_XRGB:
+      m->color_output_uint8 = HWY_DYNAMIC_DISPATCH(YCbCrToARGB8);
+      break;
+    case JCS_EXT_XBGR:
+      m->color_output_uint8 = HWY_DYNAMIC_DISPATCH(YCbCrToABGR8);
+      break;
+#endif
+#ifdef JCS_ALPHA_EXTENSIONS
+    case JCS_EXT_RGBA:
+      m->color_output_uint8 = HWY_DYNAMIC_DISPATCH(YCbCrToRGBA8);
+      break;
+    case JCS_EXT_BGRA:
+      m->color_output_uint8 = HWY_DYNAMIC_DISPATCH(YCbCrToBGRA8);
+      break;
+    case JCS_EXT_ARGB:
+      m->color_output_uint8 = HWY_DYNAMIC_DISPATCH(YCbCrToARGB8);
+      break;
+    case JCS_EXT_ABGR:
+      m->color_output_uint8 = HWY_DYNAMIC_DISPATCH(YCbCrToABGR8);
+      break;
+#endif
+    default:
+      break;
+  }
 }
 
 }  // namespace jpegli
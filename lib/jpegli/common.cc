@@ -6,11 +6,29 @@
 
 #include "lib/jpegli/common.h"
 
+#include <cstring>
+
+#include "lib/base/types.h"
 #include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/context.h"
 #include "lib/jpegli/decode_internal.h"
+#include "lib/jpegli/encode_internal.h"
 #include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/stage_stats.h"
 #include "lib/jpegli/types.h"
 
+namespace {
+
+jpegli::StageStats* GetStageStats(j_common_ptr cinfo) {
+  if (cinfo->is_decompressor) {
+    return &reinterpret_cast<j_decompress_ptr>(cinfo)->master->stage_stats;
+  } else {
+    return &reinterpret_cast<j_compress_ptr>(cinfo)->master->stage_stats;
+  }
+}
+
+}  // namespace
+
 void jpegli_abort(j_common_ptr cinfo) {
   if (cinfo->mem == nullptr) return;
   for (int pool_id = 0; pool_id < JPOOL_NUMPOOLS; ++pool_id) {
@@ -20,12 +38,32 @@ void jpegli_abort(j_common_ptr cinfo) {
   if (cinfo->is_decompressor) {
     cinfo->global_state = jpegli::kDecStart;
   } else {
+    j_compress_ptr comptr = reinterpret_cast<j_compress_ptr>(cinfo);
+    // A frame of jpegli_set_frame_sequence() that used the kept Huffman codes
+    // turned optimize_coding off.
+    if (comptr->master->frame_reuse) {
+      comptr->optimize_coding = TRUE;
+      comptr->master->frame_reuse = false;
+    }
     cinfo->global_state = jpegli::kEncStart;
   }
 }
 
 void jpegli_destroy(j_common_ptr cinfo) {
   if (cinfo->mem == nullptr) return;
+  if (cinfo->is_decompressor) {
+    jpegli::ReleaseMmapSource(reinterpret_cast<j_decompress_ptr>(cinfo));
+    jpegli::ReleaseReadAheadSource(reinterpret_cast<j_decompress_ptr>(cinfo));
+    jpegli::ReleaseBatchDecoder(reinterpret_cast<j_decompress_ptr>(cinfo));
+  } else {
+    jpegli::ReleaseChunkedDest(reinterpret_cast<j_compress_ptr>(cinfo));
+    jpegli::ReleaseWriteBehindDest(reinterpret_cast<j_compress_ptr>(cinfo));
+    jpegli::ReleaseBatchEncoder(reinterpret_cast<j_compress_ptr>(cinfo));
+    jpegli::ReleaseLadderEncoder(reinterpret_cast<j_compress_ptr>(cinfo));
+    jpegli::ReleaseTileEncoder(reinterpret_cast<j_compress_ptr>(cinfo));
+  }
+  jpegli::CloseStageCounters(GetStageStats(cinfo));
+  jpegli::ReleaseContext(cinfo);
   (*cinfo->mem->self_destruct)(cinfo);
   if (cinfo->is_decompressor) {
     cinfo->global_state = jpegli::kDecNull;
@@ -49,11 +87,92 @@ JHUFF_TBL* jpegli_alloc_huff_table(j_common_ptr cinfo) {
   return table;
 }
 
+void jpegli_keep_image_memory(j_common_ptr cinfo, boolean keep) {
+  jpegli::KeepImageMemory(cinfo, FROM_JXL_BOOL(keep));
+}
+
+void jpegli_use_huge_pages(j_common_ptr cinfo, boolean enable) {
+  jpegli::UseHugePages(cinfo, FROM_JXL_BOOL(enable));
+}
+
+void jpegli_set_memory_manager(j_common_ptr cinfo,
+                               const JxlMemoryManager* memory_manager) {
+  jpegli::SetMemoryManager(cinfo, memory_manager);
+}
+
+void jpegli_set_cancel_flag(j_common_ptr cinfo, const volatile int* flag) {
+  if (cinfo->is_decompressor) {
+    reinterpret_cast<j_decompress_ptr>(cinfo)->master->cancel_flag = flag;
+  } else {
+    reinterpret_cast<j_compress_ptr>(cinfo)->master->cancel_flag = flag;
+  }
+}
+
+void jpegli_set_transform_backend(j_common_ptr cinfo,
+                                  const JpegliTransformBackend* backend) {
+  JpegliTransformBackend* target;
+  if (cinfo->is_decompressor) {
+    j_decompress_ptr dinfo = reinterpret_cast<j_decompress_ptr>(cinfo);
+    target = &dinfo->master->transform_backend;
+  } else {
+    j_compress_ptr comptr = reinterpret_cast<j_compress_ptr>(cinfo);
+    target = &comptr->master->transform_backend;
+  }
+  if (backend != nullptr) {
+    *target = *backend;
+  } else {
+    memset(target, 0, sizeof(*target));
+  }
+}
+
+void jpegli_enable_stage_stats(j_common_ptr cinfo, boolean enable) {
+  jpegli::StageStats* stats = GetStageStats(cinfo);
+  jpegli::ResetStageStats(stats);
+  stats->enabled = FROM_JXL_BOOL(enable);
+}
+
+boolean jpegli_enable_stage_counters(j_common_ptr cinfo, boolean enable) {
+  jpegli::StageStats* stats = GetStageStats(cinfo);
+  if (!enable) {
+    jpegli::CloseStageCounters(stats);
+    return TRUE;
+  }
+  return TO_JXL_BOOL(jpegli::OpenStageCounters(stats));
+}
+
+void jpegli_get_stage_stats(j_common_ptr cinfo,
+                            struct jpegli_stage_stats* stats) {
+  const jpegli::StageStats* s = GetStageStats(cinfo);
+  for (int i = 0; i < JPEGLI_NUM_STAGES; ++i) {
+    stats->seconds[i] = s->nanoseconds[i] * 1e-9;
+    stats->num_calls[i] = s->num_calls[i];
+    stats->instructions[i] = s->counters[jpegli::kCounterInstructions][i];
+    stats->cache_misses[i] = s->counters[jpegli::kCounterCacheMisses][i];
+    stats->branch_misses[i] = s->counters[jpegli::kCounterBranchMisses][i];
+  }
+}
+
+void jpegli_get_memory_stats(j_common_ptr cinfo,
+                             struct jpegli_memory_stats* stats) {
+  jpegli::GetMemoryStats(cinfo, stats);
+}
+
+size_t jpegli_estimate_memory(j_common_ptr cinfo) {
+  if (cinfo->is_decompressor) {
+    return jpegli::EstimateDecoderMemory(
+        reinterpret_cast<j_decompress_ptr>(cinfo));
+  } else {
+    return jpegli::EstimateEncoderMemory(
+        reinterpret_cast<j_compress_ptr>(cinfo));
+  }
+}
+
 int jpegli_bytes_per_sample(JpegliDataType data_type) {
   switch (data_type) {
     case JPEGLI_TYPE_UINT8:
       return 1;
     case JPEGLI_TYPE_UINT16:
+    case JPEGLI_TYPE_FLOAT16:
       return 2;
     case JPEGLI_TYPE_FLOAT:
       return 4;
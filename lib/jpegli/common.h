@@ -22,6 +22,9 @@
 #define LIB_JPEGLI_COMMON_H_
 
 #include "lib/base/include_jpeglib.h"  // IWYU pragma: export
+#include "lib/base/memory_manager.h"
+#include "lib/base/parallel_runner.h"
+#include "lib/jpegli/types.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,6 +40,241 @@ JQUANT_TBL* jpegli_alloc_quant_table(j_common_ptr cinfo);
 
 JHUFF_TBL* jpegli_alloc_huff_table(j_common_ptr cinfo);
 
+// If keep is true, the memory of the image lifetime pool is not released at
+// the end of the image, but is reused for the buffers of the same size of the
+// next image, so that encoding or decoding a sequence of images with the same
+// geometry with the same object needs no further allocations. The memory that
+// the next image does not reuse is released at its end. This is a jpegli
+// extension that is not available in libjpeg.
+void jpegli_keep_image_memory(j_common_ptr cinfo, boolean keep);
+
+// If enable is true, the large buffers of the image, like the coefficient and
+// row buffers, are allocated in huge pages where the operating system supports
+// it, and the zero-initialized ones are not touched before their first use, so
+// that their pages are placed on the NUMA node of the thread that processes
+// them. This is a jpegli extension that is not available in libjpeg.
+void jpegli_use_huge_pages(j_common_ptr cinfo, boolean enable);
+
+// Makes the memory manager of the object allocate its memory blocks with the
+// functions of *memory_manager, which must outlive the object. The aligned
+// blocks are carved out of larger allocations. The blocks that were allocated
+// before the call, like those of the permanent pool allocated by
+// jpegli_create_compress() or jpegli_create_decompress(), are still released
+// with the standard allocator. Can be called only once per object. This is a
+// jpegli extension that is not available in libjpeg.
+void jpegli_set_memory_manager(j_common_ptr cinfo,
+                               const JxlMemoryManager* memory_manager);
+
+// Sets a flag that is polled once per iMCU row, and once per scan when the
+// scans are coded, while the image of cinfo is processed; if it is nonzero,
+// the processing stops with an error through the error manager, after which
+// the object can be aborted or destroyed as usual. The flag can be set from
+// another thread, e.g. when a request times out, and must outlive the
+// processing of the image. A nullptr flag disables the checks. This is a
+// jpegli extension that is not available in libjpeg.
+void jpegli_set_cancel_flag(j_common_ptr cinfo, const volatile int* flag);
+
+struct jpegli_pool_memory_stats {
+  // Number of bytes currently allocated from the pool.
+  size_t current_bytes;
+  // Largest value of current_bytes since the object was created.
+  size_t peak_bytes;
+  // Number of allocations since the pool was last freed.
+  size_t num_allocations;
+};
+
+struct jpegli_memory_stats {
+  // Indexed by JPOOL_PERMANENT and JPOOL_IMAGE.
+  struct jpegli_pool_memory_stats pools[JPOOL_NUMPOOLS];
+  // Totals over all pools.
+  size_t current_bytes;
+  size_t peak_bytes;
+  // Number of allocations since the object was created, unlike that of the
+  // pools this is not reset when a pool is freed.
+  size_t total_allocations;
+  // Number of bytes of the virtual arrays that are stored in temporary files
+  // because of max_memory_to_use, these are not counted in the other fields.
+  size_t backing_store_bytes;
+};
+
+// Fills in *stats with the memory usage of the compressor or decompressor
+// object. This is a jpegli extension that is not available in libjpeg.
+void jpegli_get_memory_stats(j_common_ptr cinfo,
+                             struct jpegli_memory_stats* stats);
+
+struct jpegli_stage_stats {
+  // Indexed by JpegliStage.
+  double seconds[JPEGLI_NUM_STAGES];
+  size_t num_calls[JPEGLI_NUM_STAGES];
+  // Hardware events of the calling thread, recorded after
+  // jpegli_enable_stage_counters(), zero otherwise.
+  double instructions[JPEGLI_NUM_STAGES];
+  double cache_misses[JPEGLI_NUM_STAGES];
+  double branch_misses[JPEGLI_NUM_STAGES];
+};
+
+// If enable is true, the time spent in each stage of the image processing and
+// the number of times the stage was entered are recorded from now on, starting
+// from zero, until it is called with false. A stage that runs on the parallel
+// runner counts its wall time. The recording is cheap, but can be removed
+// from the library by building it with -DJPEGLI_ENABLE_STAGE_STATS=0, in which
+// case all the stats stay zero. This is a jpegli extension that is not
+// available in libjpeg.
+void jpegli_enable_stage_stats(j_common_ptr cinfo, boolean enable);
+
+// If enable is true, the retired instructions, cache misses and branch
+// mispredictions of the stages recorded by jpegli_enable_stage_stats() are
+// also counted, in user space, with the hardware performance counters of the
+// calling thread. Returns FALSE if the counters are not available, e.g. on
+// systems other than Linux or when perf events are not permitted, in which case
+// the counts stay zero. The counters are closed when called with false and by
+// jpegli_destroy(). This is a jpegli extension that is not available in
+// libjpeg.
+boolean jpegli_enable_stage_counters(j_common_ptr cinfo, boolean enable);
+
+// Fills in *stats with the time, call and event counts recorded since the
+// last call of jpegli_enable_stage_stats(), over all the images of the object.
+// This is a jpegli extension that is not available in libjpeg.
+void jpegli_get_stage_stats(j_common_ptr cinfo,
+                            struct jpegli_stage_stats* stats);
+
+// Returns an estimate of the peak memory usage in bytes of the object while
+// processing the current image, to be called after jpegli_set_defaults() and
+// the other compression parameters, or after jpegli_read_header(). The
+// estimate includes the memory that is already allocated, but not the input
+// or output buffers of the application. This is a jpegli extension that is
+// not available in libjpeg.
+size_t jpegli_estimate_memory(j_common_ptr cinfo);
+
+// A context with the state that is derived from the parameters of an image but
+// is the same for many images, shared by any number of compressor and
+// decompressor objects on any threads, e.g. by the codec objects of a server
+// that handles many small images. It holds the caches of the Huffman coding
+// tables of the encoder and of the Huffman decoding tables of the decoder,
+// which are otherwise shared by all the objects of the process, and a parallel
+// runner for the attached objects. The context is reference counted: it is
+// created with one reference, which the caller releases with
+// jpegli_release_context(), and each attached object holds one until it is
+// destroyed or another context is attached. These are jpegli extensions that
+// are not available in libjpeg.
+typedef struct jpegli_context jpegli_context;
+
+jpegli_context* jpegli_create_context(void);
+
+// Sets the parallel runner that the objects attached to the context use, as if
+// set with jpegli_set_parallel_runner() or
+// jpegli_set_decompress_parallel_runner(). Must be called before the context
+// is attached to any object.
+void jpegli_context_set_parallel_runner(jpegli_context* context,
+                                        JxlParallelRunner runner,
+                                        void* runner_opaque);
+
+void jpegli_release_context(jpegli_context* context);
+
+// Attaches the context to cinfo, which must be in its start state, i.e. before
+// jpegli_start_compress() or jpegli_read_header(). A nullptr context detaches
+// the current one.
+void jpegli_attach_context(j_common_ptr cinfo, jpegli_context* context);
+
+// One component of an iMCU row for the forward transform of a backend, see
+// jpegli_set_transform_backend(). The sample (y, x) of block (by, bx), where
+// by < num_block_rows and bx < num_blocks, is at
+// pixels[(by * 8 + y) * pixels_stride + bx * 8 + x], nominally in the
+// [0.0, 255.0] range. Let F(k) be the DCT coefficient with the natural order
+// index k of the block, scaled so that a constant block with sample value p
+// has F(0) = p, i.e. the forward DCT of the JPEG standard divided by 8. The
+// backend stores F(0) - 128.0 multiplied by quant_mul[0] in
+// dc[by * dc_stride + bx], and the quantized AC coefficients of the block in
+// coeffs[(by * coeffs_stride + bx) * 64 + k] for k >= 1: with
+// q = F(k) * quant_mul[k] and the adaptive quantization strength a of the
+// block, round(q) if |q| >= zero_bias_offset[k] + a * zero_bias_mul[k], and
+// 0 otherwise. a is aq_strength[by * aq_stride + bx * aq_step], or 0 if
+// aq_strength is nullptr.
+typedef struct {
+  const float* pixels;
+  size_t pixels_stride;
+  int num_block_rows;
+  JDIMENSION num_blocks;
+  const float* quant_mul;
+  const float* zero_bias_offset;
+  const float* zero_bias_mul;
+  const float* aq_strength;
+  size_t aq_stride;
+  size_t aq_step;
+  int32_t* coeffs;
+  size_t coeffs_stride;
+  float* dc;
+  size_t dc_stride;
+} JpegliForwardTransformComponent;
+
+// One component of an iMCU row for the inverse transform of a backend, see
+// jpegli_set_transform_backend(). coeffs[by][bx] is block (by, bx) in natural
+// order, for by < num_block_rows. Only the blocks with
+// block_begin <= bx < block_end have to be transformed. Each coefficient q at
+// index k is dequantized to 0 if q is 0, otherwise to
+// (q - sign(q) * biases[k]) * dequant[k], and the sample (y, x) of the inverse
+// DCT of the block, scaled so that a block with only a dequantized DC value d
+// has all its samples equal to d, i.e. the inverse DCT of the JPEG standard
+// multiplied by 8, is stored in output[(by * 8 + y) * output_stride +
+// bx * 8 + x].
+typedef struct {
+  JBLOCKARRAY coeffs;
+  int num_block_rows;
+  JDIMENSION block_begin;
+  JDIMENSION block_end;
+  const float* dequant;
+  const float* biases;
+  float* output;
+  size_t output_stride;
+} JpegliInverseTransformComponent;
+
+// Transforms the num_components components of the iMCU row imcu_row, returns
+// FALSE if the row is left to the CPU implementation of jpegli instead.
+typedef boolean (*JpegliForwardTransformFunc)(
+    void* opaque, JDIMENSION imcu_row, int num_components,
+    const JpegliForwardTransformComponent* components);
+typedef boolean (*JpegliInverseTransformFunc)(
+    void* opaque, JDIMENSION imcu_row, int num_components,
+    const JpegliInverseTransformComponent* components);
+
+// A backend that computes the DCT and the quantization of the encoder, or the
+// dequantization and the inverse DCT of the decoder, an iMCU row at a time,
+// e.g. on a GPU, while jpegli keeps the entropy coding and the marker
+// handling. Either function can be nullptr.
+typedef struct {
+  JpegliForwardTransformFunc forward_transform;
+  JpegliInverseTransformFunc inverse_transform;
+  void* opaque;
+} JpegliTransformBackend;
+
+// Sets the transform backend of cinfo, nullptr switches back to the CPU
+// implementation of jpegli, which is the default. The backend is copied. The
+// encoder uses it for the images that it computes from pixels, not for the
+// coefficients of jpegli_write_coefficients(), and the decoder uses it without
+// output scaling and block smoothing. The functions may be called concurrently
+// from the threads of the parallel runner. Must be called before
+// jpegli_start_compress() or jpegli_start_decompress(). This is a jpegli
+// extension that is not available in libjpeg.
+void jpegli_set_transform_backend(j_common_ptr cinfo,
+                                  const JpegliTransformBackend* backend);
+
+// Restricts the SIMD code of jpegli to the Highway targets in mask, a bitwise
+// or of the HWY_* target bits of hwy/targets.h, e.g. to leave out HWY_AVX3 on
+// hosts where the AVX-512 frequency drop slows down the other work. The best
+// remaining target that the CPU supports is used, and the baseline target that
+// the library was compiled for is always kept. A zero mask lifts the
+// restriction. The setting is process-wide, applies to all the Highway code of
+// the process, and must not be changed while any image is being processed.
+// Without a call, the mask is read once from the JPEGLI_SIMD_TARGETS
+// environment variable, a comma separated list of target names such as
+// "AVX2,SSE4" or a number, when the first compressor or decompressor object is
+// created. These are jpegli extensions that are not available in libjpeg.
+void jpegli_set_simd_targets(int64_t mask);
+
+// Returns the name of the Highway target that the SIMD code of jpegli
+// currently dispatches to, e.g. "AVX2".
+const char* jpegli_simd_target_name(void);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
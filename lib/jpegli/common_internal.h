@@ -14,6 +14,7 @@
 #include <hwy/aligned_allocator.h>
 
 #include "lib/base/compiler_specific.h"  // for ssize_t
+#include "lib/jpegli/error.h"
 #include "lib/jpegli/memory_manager.h"
 #include "lib/jpegli/simd.h"
 
@@ -43,12 +44,20 @@ constexpr inline T1 RoundUpTo(T1 a, T2 b) {
   return DivCeil(a, b) * b;
 }
 
+// Returns non-zero if and only if x has a zero byte, i.e. one of
+// x & 0xff, x & 0xff00, ..., x & 0xff00000000000000 is zero. Used to find the
+// 0xff bytes of the entropy coded data eight at a time, as those of ~x.
+static JXL_INLINE uint64_t HasZeroByte(uint64_t x) {
+  return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+}
+
 constexpr size_t kDCTBlockSize = 64;
 // This is set to the same value as MAX_COMPS_IN_SCAN, because that is the
 // maximum number of channels the libjpeg-turbo decoder can decode.
 constexpr int kMaxComponents = 4;
 constexpr int kMaxQuantTables = 4;
 constexpr int kJpegPrecision = 8;
+constexpr int kJpegMaxPrecision = 12;
 constexpr int kMaxHuffmanTables = 4;
 constexpr size_t kJpegHuffmanMaxBitLength = 16;
 constexpr int kJpegHuffmanAlphabetSize = 256;
@@ -57,9 +66,14 @@ constexpr int kMaxDHTMarkers = 512;
 constexpr int kMaxDimPixels = 65535;
 constexpr uint8_t kApp1 = 0xE1;
 constexpr uint8_t kApp2 = 0xE2;
+constexpr uint8_t kApp10 = 0xEA;
 const uint8_t kIccProfileTag[12] = "ICC_PROFILE";
 const uint8_t kExifTag[6] = "Exif\0";
 const uint8_t kXMPTag[29] = "http://ns.adobe.com/xap/1.0/";
+const uint8_t kMPFTag[4] = "MPF";
+// Tag of the APP10 segment of the restart index before the EOI marker, see
+// jpegli_write_restart_index().
+const uint8_t kRestartIndexTag[14] = "JPEGLI_RSTIDX";
 
 /* clang-format off */
 constexpr uint32_t kJPEGNaturalOrder[80] = {
@@ -76,6 +90,22 @@ constexpr uint32_t kJPEGNaturalOrder[80] = {
   63, 63, 63, 63, 63, 63, 63, 63
 };
 
+// Order of the coefficients of the blocks that are kept in zigzag order, see
+// jpegli_set_zigzag_coefficients(), with the same extra entries.
+constexpr uint32_t kJPEGIdentityOrder[80] = {
+  0,   1,  2,  3,  4,  5,  6,  7,
+  8,   9, 10, 11, 12, 13, 14, 15,
+  16, 17, 18, 19, 20, 21, 22, 23,
+  24, 25, 26, 27, 28, 29, 30, 31,
+  32, 33, 34, 35, 36, 37, 38, 39,
+  40, 41, 42, 43, 44, 45, 46, 47,
+  48, 49, 50, 51, 52, 53, 54, 55,
+  56, 57, 58, 59, 60, 61, 62, 63,
+  // extra entries for safety in decoder
+  63, 63, 63, 63, 63, 63, 63, 63,
+  63, 63, 63, 63, 63, 63, 63, 63
+};
+
 constexpr uint32_t kJPEGZigZagOrder[64] = {
   0,   1,  5,  6, 14, 15, 27, 28,
   2,   4,  7, 13, 16, 26, 29, 42,
@@ -88,6 +118,16 @@ constexpr uint32_t kJPEGZigZagOrder[64] = {
 };
 /* clang-format on */
 
+// Stops the processing of the image with an error if the flag of
+// jpegli_set_cancel_flag() is set.
+template <typename CInfoType>
+void CheckCancelFlag(CInfoType cinfo) {
+  const volatile int* flag = cinfo->master->cancel_flag;
+  if (flag != nullptr && *flag != 0) {
+    JPEGLI_ERROR("Processing was cancelled.");
+  }
+}
+
 template <typename T>
 class RowBuffer {
  public:
@@ -0,0 +1,98 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "lib/jpegli/context.h"
+
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/decode.h"
+#include "lib/jpegli/decode_internal.h"
+#include "lib/jpegli/encode.h"
+#include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/error.h"
+
+namespace jpegli {
+
+namespace {
+
+jpegli_context* ProcessContext() {
+  // Never destroyed, since objects may be destroyed at exit in any order.
+  static jpegli_context* context = new jpegli_context();
+  return context;
+}
+
+jpegli_context** ContextSlot(j_common_ptr cinfo) {
+  if (cinfo->is_decompressor) {
+    return &reinterpret_cast<j_decompress_ptr>(cinfo)->master->context;
+  } else {
+    return &reinterpret_cast<j_compress_ptr>(cinfo)->master->context;
+  }
+}
+
+}  // namespace
+
+jpegli_context* GetContext(j_compress_ptr cinfo) {
+  jpegli_context* context = cinfo->master->context;
+  return context != nullptr ? context : ProcessContext();
+}
+
+jpegli_context* GetContext(j_decompress_ptr cinfo) {
+  jpegli_context* context = cinfo->master->context;
+  return context != nullptr ? context : ProcessContext();
+}
+
+void SetContext(jpegli_context** slot, jpegli_context* context) {
+  if (*slot == context) return;
+  if (context != nullptr) context->ref_count.fetch_add(1);
+  jpegli_release_context(*slot);
+  *slot = context;
+}
+
+void ReleaseContext(j_common_ptr cinfo) {
+  SetContext(ContextSlot(cinfo), nullptr);
+}
+
+}  // namespace jpegli
+
+jpegli_context* jpegli_create_context() { return new jpegli_context(); }
+
+void jpegli_context_set_parallel_runner(jpegli_context* context,
+                                        JxlParallelRunner runner,
+                                        void* runner_opaque) {
+  context->runner = runner;
+  context->runner_opaque = runner_opaque;
+}
+
+void jpegli_release_context(jpegli_context* context) {
+  if (context != nullptr && context->ref_count.fetch_sub(1) == 1) {
+    delete context;
+  }
+}
+
+void jpegli_attach_context(j_common_ptr cinfo, jpegli_context* context) {
+  if (cinfo->is_decompressor) {
+    if (cinfo->global_state != jpegli::kDecStart) {
+      JPEGLI_ERROR("jpegli_attach_context: unexpected state %d",
+                   cinfo->global_state);
+    }
+    j_decompress_ptr dinfo = reinterpret_cast<j_decompress_ptr>(cinfo);
+    if (context != nullptr && context->runner != nullptr) {
+      jpegli_set_decompress_parallel_runner(dinfo, context->runner,
+                                            context->runner_opaque);
+    }
+  } else {
+    if (cinfo->global_state != jpegli::kEncStart) {
+      JPEGLI_ERROR("jpegli_attach_context: unexpected state %d",
+                   cinfo->global_state);
+    }
+    j_compress_ptr comptr = reinterpret_cast<j_compress_ptr>(cinfo);
+    if (context != nullptr && context->runner != nullptr) {
+      jpegli_set_parallel_runner(comptr, context->runner,
+                                 context->runner_opaque);
+    }
+  }
+  jpegli::SetContext(jpegli::ContextSlot(cinfo), context);
+}
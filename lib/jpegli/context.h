@@ -0,0 +1,83 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef LIB_JPEGLI_CONTEXT_H_
+#define LIB_JPEGLI_CONTEXT_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include "lib/base/parallel_runner.h"
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/huffman.h"
+
+namespace jpegli {
+
+// Coding table of a Huffman code of the encoder that is not optimized for the
+// image, which is typically the same standard table for every image.
+struct CachedCodeTable {
+  UINT8 bits[kJpegHuffmanMaxBitLength + 1];
+  UINT8 huffval[kJpegHuffmanAlphabetSize];
+  HuffmanCodeTable code;
+};
+
+// Decoding lookup tables of a Huffman code of the decoder, which is typically
+// the same standard table for most images, or the same optimized table for
+// the tiles of one source.
+struct CachedLookupTable {
+  UINT8 bits[kJpegHuffmanMaxBitLength + 1];
+  UINT8 huffval[kJpegHuffmanAlphabetSize];
+  bool is_ac;
+  HuffmanTableEntry lut[kJpegHuffmanLutSize];
+  int16_t fast_ac[kJpegFastACLutSize];
+};
+
+constexpr size_t kNumCachedCodeTables = 8;
+constexpr size_t kNumCachedLookupTables = 16;
+
+}  // namespace jpegli
+
+// The state that is derived from the parameters of an image and is the same
+// for many images, shared by the objects that are attached to the context, see
+// jpegli_attach_context(). The caches are guarded by their mutexes, the other
+// fields do not change after the context is attached.
+struct jpegli_context {
+  std::atomic<int> ref_count{1};
+  JxlParallelRunner runner = nullptr;
+  void* runner_opaque = nullptr;
+
+  jpegli::CachedCodeTable code_tables[jpegli::kNumCachedCodeTables];
+  size_t num_code_tables = 0;
+  size_t next_code_table = 0;
+  std::mutex code_table_mutex;
+
+  jpegli::CachedLookupTable lookup_tables[jpegli::kNumCachedLookupTables];
+  size_t num_lookup_tables = 0;
+  size_t next_lookup_table = 0;
+  std::mutex lookup_table_mutex;
+};
+
+namespace jpegli {
+
+// Returns the context attached to cinfo, or the process-wide context of the
+// objects without one.
+jpegli_context* GetContext(j_compress_ptr cinfo);
+jpegli_context* GetContext(j_decompress_ptr cinfo);
+
+// Replaces the context in *slot with context, which may be nullptr, and
+// updates their reference counts.
+void SetContext(jpegli_context** slot, jpegli_context* context);
+
+// Detaches the context of cinfo when it is destroyed.
+void ReleaseContext(j_common_ptr cinfo);
+
+}  // namespace jpegli
+
+#endif  // LIB_JPEGLI_CONTEXT_H_
@@ -36,59 +36,64 @@ using hwy::HWY_NAMESPACE::Half;
 using hwy::HWY_NAMESPACE::IfThenElseZero;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::MulFixedPoint15;
+using hwy::HWY_NAMESPACE::NearestInt;
+using hwy::HWY_NAMESPACE::PromoteTo;
 using hwy::HWY_NAMESPACE::Rebind;
 using hwy::HWY_NAMESPACE::Round;
 using hwy::HWY_NAMESPACE::Sub;
 using hwy::HWY_NAMESPACE::Vec;
 
-template <size_t N>
+// The 1D DCT functions below work on N rows of kW floats, where kW is 8 times
+// the number of horizontally adjacent blocks that are transformed together.
+template <size_t N, size_t kW>
 void AddReverse(const float* JXL_RESTRICT a_in1,
                 const float* JXL_RESTRICT a_in2, float* JXL_RESTRICT a_out) {
-  HWY_CAPPED(float, 8) d8;
+  HWY_CAPPED(float, kW) d;
   for (size_t i = 0; i < N; i++) {
-    auto in1 = Load(d8, a_in1 + i * 8);
-    auto in2 = Load(d8, a_in2 + (N - i - 1) * 8);
-    Store(Add(in1, in2), d8, a_out + i * 8);
+    auto in1 = Load(d, a_in1 + i * kW);
+    auto in2 = Load(d, a_in2 + (N - i - 1) * kW);
+    Store(Add(in1, in2), d, a_out + i * kW);
   }
 }
 
-template <size_t N>
+template <size_t N, size_t kW>
 void SubReverse(const float* JXL_RESTRICT a_in1,
                 const float* JXL_RESTRICT a_in2, float* JXL_RESTRICT a_out) {
-  HWY_CAPPED(float, 8) d8;
+  HWY_CAPPED(float, kW) d;
   for (size_t i = 0; i < N; i++) {
-    auto in1 = Load(d8, a_in1 + i * 8);
-    auto in2 = Load(d8, a_in2 + (N - i - 1) * 8);
-    Store(Sub(in1, in2), d8, a_out + i * 8);
+    auto in1 = Load(d, a_in1 + i * kW);
+    auto in2 = Load(d, a_in2 + (N - i - 1) * kW);
+    Store(Sub(in1, in2), d, a_out + i * kW);
   }
 }
 
-template <size_t N>
+template <size_t N, size_t kW>
 void B(float* JXL_RESTRICT coeff) {
-  HWY_CAPPED(float, 8) d8;
+  HWY_CAPPED(float, kW) d;
   constexpr float kSqrt2 = 1.41421356237f;
-  auto sqrt2 = Set(d8, kSqrt2);
-  auto in1_0 = Load(d8, coeff);
-  auto in2_0 = Load(d8, coeff + 8);
-  Store(MulAdd(in1_0, sqrt2, in2_0), d8, coeff);
+  auto sqrt2 = Set(d, kSqrt2);
+  auto in1_0 = Load(d, coeff);
+  auto in2_0 = Load(d, coeff + kW);
+  Store(MulAdd(in1_0, sqrt2, in2_0), d, coeff);
   for (size_t i = 1; i + 1 < N; i++) {
-    auto in1 = Load(d8, coeff + i * 8);
-    auto in2 = Load(d8, coeff + (i + 1) * 8);
-    Store(Add(in1, in2), d8, coeff + i * 8);
+    auto in1 = Load(d, coeff + i * kW);
+    auto in2 = Load(d, coeff + (i + 1) * kW);
+    Store(Add(in1, in2), d, coeff + i * kW);
   }
 }
 
 // Ideally optimized away by compiler (except the multiply).
-template <size_t N>
+template <size_t N, size_t kW>
 void InverseEvenOdd(const float* JXL_RESTRICT a_in, float* JXL_RESTRICT a_out) {
-  HWY_CAPPED(float, 8) d8;
+  HWY_CAPPED(float, kW) d;
   for (size_t i = 0; i < N / 2; i++) {
-    auto in1 = Load(d8, a_in + i * 8);
-    Store(in1, d8, a_out + 2 * i * 8);
+    auto in1 = Load(d, a_in + i * kW);
+    Store(in1, d, a_out + 2 * i * kW);
   }
   for (size_t i = N / 2; i < N; i++) {
-    auto in1 = Load(d8, a_in + i * 8);
-    Store(in1, d8, a_out + (2 * (i - N / 2) + 1) * 8);
+    auto in1 = Load(d, a_in + i * kW);
+    Store(in1, d, a_out + (2 * (i - N / 2) + 1) * kW);
   }
 }
 
@@ -122,86 +127,233 @@ constexpr float WcMultipliers<8>::kMultipliers[];
 #endif
 
 // Invoked on full vector.
-template <size_t N>
+template <size_t N, size_t kW>
 void Multiply(float* JXL_RESTRICT coeff) {
-  HWY_CAPPED(float, 8) d8;
+  HWY_CAPPED(float, kW) d;
   for (size_t i = 0; i < N / 2; i++) {
-    auto in1 = Load(d8, coeff + (N / 2 + i) * 8);
-    auto mul = Set(d8, WcMultipliers<N>::kMultipliers[i]);
-    Store(Mul(in1, mul), d8, coeff + (N / 2 + i) * 8);
+    auto in1 = Load(d, coeff + (N / 2 + i) * kW);
+    auto mul = Set(d, WcMultipliers<N>::kMultipliers[i]);
+    Store(Mul(in1, mul), d, coeff + (N / 2 + i) * kW);
   }
 }
 
+template <size_t kW>
 void LoadFromBlock(const float* JXL_RESTRICT pixels, size_t pixels_stride,
                    size_t off, float* JXL_RESTRICT coeff) {
-  HWY_CAPPED(float, 8) d8;
+  HWY_CAPPED(float, kW) d;
   for (size_t i = 0; i < 8; i++) {
-    Store(LoadU(d8, pixels + i * pixels_stride + off), d8, coeff + i * 8);
+    Store(LoadU(d, pixels + i * pixels_stride + off), d, coeff + i * kW);
   }
 }
 
+template <size_t kW>
 void StoreToBlockAndScale(const float* JXL_RESTRICT coeff, float* output,
                           size_t off) {
-  HWY_CAPPED(float, 8) d8;
-  auto mul = Set(d8, 1.0f / 8);
+  HWY_CAPPED(float, kW) d;
+  auto mul = Set(d, 1.0f / 8);
   for (size_t i = 0; i < 8; i++) {
-    StoreU(Mul(mul, Load(d8, coeff + i * 8)), d8, output + i * 8 + off);
+    StoreU(Mul(mul, Load(d, coeff + i * kW)), d, output + i * kW + off);
   }
 }
 
-template <size_t N>
+template <size_t N, size_t kW>
 struct DCT1DImpl;
 
-template <>
-struct DCT1DImpl<1> {
+template <size_t kW>
+struct DCT1DImpl<1, kW> {
   JXL_INLINE void operator()(float* JXL_RESTRICT mem) {}
 };
 
-template <>
-struct DCT1DImpl<2> {
+template <size_t kW>
+struct DCT1DImpl<2, kW> {
   JXL_INLINE void operator()(float* JXL_RESTRICT mem) {
-    HWY_CAPPED(float, 8) d8;
-    auto in1 = Load(d8, mem);
-    auto in2 = Load(d8, mem + 8);
-    Store(Add(in1, in2), d8, mem);
-    Store(Sub(in1, in2), d8, mem + 8);
+    HWY_CAPPED(float, kW) d;
+    auto in1 = Load(d, mem);
+    auto in2 = Load(d, mem + kW);
+    Store(Add(in1, in2), d, mem);
+    Store(Sub(in1, in2), d, mem + kW);
   }
 };
 
-template <size_t N>
+template <size_t N, size_t kW>
 struct DCT1DImpl {
   void operator()(float* JXL_RESTRICT mem) {
-    HWY_ALIGN float tmp[N * 8];
-    AddReverse<N / 2>(mem, mem + N * 4, tmp);
-    DCT1DImpl<N / 2>()(tmp);
-    SubReverse<N / 2>(mem, mem + N * 4, tmp + N * 4);
-    Multiply<N>(tmp);
-    DCT1DImpl<N / 2>()(tmp + N * 4);
-    B<N / 2>(tmp + N * 4);
-    InverseEvenOdd<N>(tmp, mem);
+    HWY_ALIGN float tmp[N * kW];
+    AddReverse<N / 2, kW>(mem, mem + N / 2 * kW, tmp);
+    DCT1DImpl<N / 2, kW>()(tmp);
+    SubReverse<N / 2, kW>(mem, mem + N / 2 * kW, tmp + N / 2 * kW);
+    Multiply<N, kW>(tmp);
+    DCT1DImpl<N / 2, kW>()(tmp + N / 2 * kW);
+    B<N / 2, kW>(tmp + N / 2 * kW);
+    InverseEvenOdd<N, kW>(tmp, mem);
   }
 };
 
+// Computes the 1D DCT of the columns of the 8 rows of kW pixels, and stores
+// the scaled result in rows of kW floats.
+template <size_t kW>
 void DCT1D(const float* JXL_RESTRICT pixels, size_t pixels_stride,
            float* JXL_RESTRICT output) {
-  HWY_CAPPED(float, 8) d8;
-  HWY_ALIGN float tmp[64];
-  for (size_t i = 0; i < 8; i += Lanes(d8)) {
+  HWY_CAPPED(float, kW) d;
+  HWY_ALIGN float tmp[8 * kW];
+  for (size_t i = 0; i < kW; i += Lanes(d)) {
     // TODO(veluca): consider removing the temporary memory here (as is done in
     // IDCT), if it turns out that some compilers don't optimize away the loads
     // and this is performance-critical.
-    LoadFromBlock(pixels, pixels_stride, i, tmp);
-    DCT1DImpl<8>()(tmp);
-    StoreToBlockAndScale(tmp, output, i);
+    LoadFromBlock<kW>(pixels, pixels_stride, i, tmp);
+    DCT1DImpl<8, kW>()(tmp);
+    StoreToBlockAndScale<kW>(tmp, output, i);
+  }
+}
+
+// Number of horizontally adjacent blocks that TransformFromPixelsBatch() can
+// transform with the full vectors of the current target.
+constexpr size_t kDCTBatchSize =
+    HWY_LANES(float) >= 32 ? 4 : (HWY_LANES(float) >= 16 ? 2 : 1);
+
+// Computes the DCT of kBlocks horizontally adjacent blocks, with the
+// coefficients of the ith block stored at coefficients + i * DCTSIZE2. Both
+// coefficients and scratch_space must have room for kBlocks * DCTSIZE2
+// floats.
+template <size_t kBlocks>
+void TransformFromPixelsBatch(const float* JXL_RESTRICT pixels,
+                              size_t pixels_stride,
+                              float* JXL_RESTRICT coefficients,
+                              float* JXL_RESTRICT scratch_space) {
+  constexpr size_t kW = kBlocks * 8;
+  DCT1D<kW>(pixels, pixels_stride, scratch_space);
+  // The transposed blocks are kept side by side, so that the second pass
+  // also works on rows of kW floats.
+  for (size_t i = 0; i < kBlocks; ++i) {
+    Transpose8x8Block(scratch_space + i * 8, kW, coefficients + i * 8, kW);
+  }
+  DCT1D<kW>(coefficients, kW, scratch_space);
+  for (size_t i = 0; i < kBlocks; ++i) {
+    Transpose8x8Block(scratch_space + i * 8, kW, coefficients + i * DCTSIZE2,
+                      8);
   }
 }
 
 JXL_INLINE JXL_MAYBE_UNUSED void TransformFromPixels(
     const float* JXL_RESTRICT pixels, size_t pixels_stride,
     float* JXL_RESTRICT coefficients, float* JXL_RESTRICT scratch_space) {
-  DCT1D(pixels, pixels_stride, scratch_space);
-  Transpose8x8Block(scratch_space, coefficients);
-  DCT1D(coefficients, 8, scratch_space);
+  TransformFromPixelsBatch<1>(pixels, pixels_stride, coefficients,
+                              scratch_space);
+}
+
+// Fixed point version of the DCT above, used for the fast integer path. The
+// centered pixels are converted to int16 with kFixedPointDCTShift fractional
+// bits, the output of the first 1D pass is scaled by 1/8 and the output of the
+// second pass has 3 + kFixedPointDCTShift fractional bits. With this shift the
+// intermediate values stay below 20000 for any 8-bit input.
+constexpr int kFixedPointDCTShift = 4;
+
+// Multiplies v by the constant mul, using integer multiplication for the
+// integral part and 1.15 fixed point multiplication for the fractional part.
+template <class V>
+JXL_INLINE V MulFixedPoint(V v, float mul) {
+  const HWY_CAPPED(int16_t, 8) d16;
+  const int16_t whole = static_cast<int16_t>(mul);
+  const int16_t frac = static_cast<int16_t>((mul - whole) * 32768.0f + 0.5f);
+  V r = MulFixedPoint15(v, Set(d16, frac));
+  return whole == 0 ? r : Add(r, Mul(v, Set(d16, whole)));
+}
+
+template <size_t N>
+struct DCT1DFixedPointImpl;
+
+template <>
+struct DCT1DFixedPointImpl<1> {
+  JXL_INLINE void operator()(int16_t* JXL_RESTRICT mem) {}
+};
+
+template <>
+struct DCT1DFixedPointImpl<2> {
+  JXL_INLINE void operator()(int16_t* JXL_RESTRICT mem) {
+    HWY_CAPPED(int16_t, 8) d16;
+    auto in1 = Load(d16, mem);
+    auto in2 = Load(d16, mem + 8);
+    Store(Add(in1, in2), d16, mem);
+    Store(Sub(in1, in2), d16, mem + 8);
+  }
+};
+
+template <size_t N>
+struct DCT1DFixedPointImpl {
+  void operator()(int16_t* JXL_RESTRICT mem) {
+    HWY_CAPPED(int16_t, 8) d16;
+    HWY_ALIGN int16_t tmp[N * 8];
+    for (size_t i = 0; i < N / 2; i++) {
+      auto in1 = Load(d16, mem + i * 8);
+      auto in2 = Load(d16, mem + (N - i - 1) * 8);
+      Store(Add(in1, in2), d16, tmp + i * 8);
+      Store(MulFixedPoint(Sub(in1, in2), WcMultipliers<N>::kMultipliers[i]),
+            d16, tmp + (N / 2 + i) * 8);
+    }
+    DCT1DFixedPointImpl<N / 2>()(tmp);
+    int16_t* JXL_RESTRICT odd = tmp + N * 4;
+    DCT1DFixedPointImpl<N / 2>()(odd);
+    constexpr float kSqrt2 = 1.41421356237f;
+    Store(Add(MulFixedPoint(Load(d16, odd), kSqrt2), Load(d16, odd + 8)), d16,
+          odd);
+    for (size_t i = 1; i + 1 < N / 2; i++) {
+      Store(Add(Load(d16, odd + i * 8), Load(d16, odd + (i + 1) * 8)), d16,
+            odd + i * 8);
+    }
+    for (size_t i = 0; i < N / 2; i++) {
+      Store(Load(d16, tmp + i * 8), d16, mem + 2 * i * 8);
+      Store(Load(d16, odd + i * 8), d16, mem + (2 * i + 1) * 8);
+    }
+  }
+};
+
+void DCT1DFixedPoint(const int16_t* JXL_RESTRICT input,
+                     int16_t* JXL_RESTRICT output) {
+  HWY_CAPPED(int16_t, 8) d16;
+  HWY_ALIGN int16_t tmp[64];
+  for (size_t i = 0; i < 8; i += Lanes(d16)) {
+    for (size_t y = 0; y < 8; y++) {
+      Store(LoadU(d16, input + y * 8 + i), d16, tmp + y * 8);
+    }
+    DCT1DFixedPointImpl<8>()(tmp);
+    for (size_t y = 0; y < 8; y++) {
+      StoreU(Load(d16, tmp + y * 8), d16, output + y * 8 + i);
+    }
+  }
+}
+
+// Computes the same coefficients as TransformFromPixels() (but without the DC
+// bias) in fixed point arithmetic.
+JXL_INLINE JXL_MAYBE_UNUSED void TransformFromPixelsFixedPoint(
+    const float* JXL_RESTRICT pixels, size_t pixels_stride,
+    float* JXL_RESTRICT coefficients, float* JXL_RESTRICT scratch_space) {
+  const HWY_CAPPED(float, 8) df;
+  const Rebind<int32_t, decltype(df)> di32;
+  const Rebind<int16_t, decltype(df)> di16;
+  HWY_ALIGN int16_t in[DCTSIZE2];
+  HWY_ALIGN int16_t out[DCTSIZE2];
+  const auto bias = Set(df, 128.0f);
+  const auto mul = Set(df, 1 << kFixedPointDCTShift);
+  for (size_t y = 0; y < 8; y++) {
+    for (size_t x = 0; x < 8; x += Lanes(df)) {
+      const auto p = LoadU(df, pixels + y * pixels_stride + x);
+      const auto ival = NearestInt(Mul(Sub(p, bias), mul));
+      StoreU(DemoteTo(di16, ival), di16, in + y * 8 + x);
+    }
+  }
+  DCT1DFixedPoint(in, out);
+  // Transposes and scales the output of the first pass.
+  for (size_t y = 0; y < 8; y++) {
+    for (size_t x = 0; x < 8; x++) {
+      in[x * 8 + y] = static_cast<int16_t>((out[y * 8 + x] + 4) >> 3);
+    }
+  }
+  DCT1DFixedPoint(in, out);
+  const auto scale = Set(df, 1.0f / (8 << kFixedPointDCTShift));
+  for (size_t k = 0; k < DCTSIZE2; k += Lanes(df)) {
+    const auto ival = PromoteTo(di32, LoadU(di16, out + k));
+    Store(Mul(ConvertTo(df, ival), scale), df, scratch_space + k);
+  }
   Transpose8x8Block(scratch_space, coefficients);
 }
 
@@ -238,26 +390,90 @@ void QuantizeBlock(const float* dct, const float* qmc, float aq_strength,
   }
 }
 
+// Used to center DC values around zero.
+constexpr float kDCBias = 128.0f;
+
+// Computes the DCT of the block and quantizes its AC coefficients, and
+// returns the scaled but not yet rounded DC value. The quantized DC value
+// depends on the DC value of the previous block of the same component and is
+// computed separately by QuantizeDC().
 template <typename T>
-void ComputeCoefficientBlock(const float* JXL_RESTRICT pixels, size_t stride,
-                             const float* JXL_RESTRICT qmc,
-                             int16_t last_dc_coeff, float aq_strength,
-                             const float* zero_bias_offset,
-                             const float* zero_bias_mul,
-                             float* JXL_RESTRICT tmp, T* block) {
+float ComputeACCoefficients(const float* JXL_RESTRICT pixels, size_t stride,
+                            const float* JXL_RESTRICT qmc, float aq_strength,
+                            const float* zero_bias_offset,
+                            const float* zero_bias_mul,
+                            float* JXL_RESTRICT tmp, T* block) {
   float* JXL_RESTRICT dct = tmp;
   float* JXL_RESTRICT scratch_space = tmp + DCTSIZE2;
   TransformFromPixels(pixels, stride, dct, scratch_space);
   QuantizeBlock(dct, qmc, aq_strength, zero_bias_offset, zero_bias_mul, block);
-  // Center DC values around zero.
-  static constexpr float kDCBias = 128.0f;
-  const float dc = (dct[0] - kDCBias) * qmc[0];
+  return (dct[0] - kDCBias) * qmc[0];
+}
+
+// Same as ComputeACCoefficients() for kBlocks horizontally adjacent blocks,
+// where the ith block is quantized with aq_strength[i] into blocks[i] and its
+// scaled DC value is stored in dc[i]. The tmp buffer must have room for
+// 2 * kBlocks * DCTSIZE2 floats.
+template <size_t kBlocks, typename T>
+void ComputeACCoefficientsBatch(const float* JXL_RESTRICT pixels,
+                                size_t stride, const float* JXL_RESTRICT qmc,
+                                const float* aq_strength,
+                                const float* zero_bias_offset,
+                                const float* zero_bias_mul,
+                                float* JXL_RESTRICT tmp, T* const* blocks,
+                                float* dc) {
+  float* JXL_RESTRICT dct = tmp;
+  float* JXL_RESTRICT scratch_space = tmp + kBlocks * DCTSIZE2;
+  TransformFromPixelsBatch<kBlocks>(pixels, stride, dct, scratch_space);
+  for (size_t i = 0; i < kBlocks; ++i) {
+    const float* block_dct = dct + i * DCTSIZE2;
+    QuantizeBlock(block_dct, qmc, aq_strength[i], zero_bias_offset,
+                  zero_bias_mul, blocks[i]);
+    dc[i] = (block_dct[0] - kDCBias) * qmc[0];
+  }
+}
+
+// Same as ComputeACCoefficients(), but with the fixed point DCT.
+template <typename T>
+float ComputeACCoefficientsFixedPoint(
+    const float* JXL_RESTRICT pixels, size_t stride,
+    const float* JXL_RESTRICT qmc, float aq_strength,
+    const float* zero_bias_offset, const float* zero_bias_mul,
+    float* JXL_RESTRICT tmp, T* block) {
+  float* JXL_RESTRICT dct = tmp;
+  float* JXL_RESTRICT scratch_space = tmp + DCTSIZE2;
+  TransformFromPixelsFixedPoint(pixels, stride, dct, scratch_space);
+  QuantizeBlock(dct, qmc, aq_strength, zero_bias_offset, zero_bias_mul, block);
+  return dct[0] * qmc[0];
+}
+
+JXL_INLINE JXL_MAYBE_UNUSED int QuantizeDC(float dc, int16_t last_dc_coeff,
+                                           float aq_strength,
+                                           const float* zero_bias_offset,
+                                           const float* zero_bias_mul) {
   float dc_threshold = zero_bias_offset[0] + aq_strength * zero_bias_mul[0];
   if (std::abs(dc - last_dc_coeff) < dc_threshold) {
-    block[0] = last_dc_coeff;
-  } else {
-    block[0] = std::round(dc);
+    return last_dc_coeff;
   }
+  return std::round(dc);
+}
+
+template <typename T>
+void ComputeCoefficientBlock(const float* JXL_RESTRICT pixels, size_t stride,
+                             const float* JXL_RESTRICT qmc,
+                             int16_t last_dc_coeff, float aq_strength,
+                             const float* zero_bias_offset,
+                             const float* zero_bias_mul, bool fixed_point,
+                             float* JXL_RESTRICT tmp, T* block) {
+  const float dc =
+      fixed_point
+          ? ComputeACCoefficientsFixedPoint(pixels, stride, qmc, aq_strength,
+                                            zero_bias_offset, zero_bias_mul,
+                                            tmp, block)
+          : ComputeACCoefficients(pixels, stride, qmc, aq_strength,
+                                  zero_bias_offset, zero_bias_mul, tmp, block);
+  block[0] = QuantizeDC(dc, last_dc_coeff, aq_strength, zero_bias_offset,
+                        zero_bias_mul);
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
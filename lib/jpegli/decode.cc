@@ -11,21 +11,31 @@
 #include <cstdlib>
 #include <cstring>
 #include <hwy/aligned_allocator.h>
+#include <mutex>
+#include <utility>
 #include <vector>
 
 #include "lib/base/byte_order.h"
+#include "lib/base/printf_macros.h"
 #include "lib/base/status.h"
 #include "lib/base/types.h"
 #include "lib/jpegli/color_quantize.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/context.h"
+#include "lib/jpegli/decode_arith.h"
 #include "lib/jpegli/decode_internal.h"
 #include "lib/jpegli/decode_marker.h"
 #include "lib/jpegli/decode_scan.h"
 #include "lib/jpegli/error.h"
+#include "lib/jpegli/fingerprint.h"
 #include "lib/jpegli/huffman.h"
 #include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/quant.h"
 #include "lib/jpegli/render.h"
+#include "lib/jpegli/resize.h"
+#include "lib/jpegli/simd.h"
+#include "lib/jpegli/stage_stats.h"
 #include "lib/jpegli/types.h"
 
 namespace jpegli {
@@ -50,14 +60,20 @@ void InitializeImage(j_decompress_ptr cinfo) {
   cinfo->output_scanline = 0;
   cinfo->unread_marker = 0;
   cinfo->coef_bits = nullptr;
-  // We set all these to zero since we don't yet support arithmetic coding.
+  // Default arithmetic coding conditioning (T.81 section F.1.4.4), which can
+  // be changed by DAC markers.
   memset(cinfo->arith_dc_L, 0, sizeof(cinfo->arith_dc_L));
-  memset(cinfo->arith_dc_U, 0, sizeof(cinfo->arith_dc_U));
-  memset(cinfo->arith_ac_K, 0, sizeof(cinfo->arith_ac_K));
+  memset(cinfo->arith_dc_U, 1, sizeof(cinfo->arith_dc_U));
+  memset(cinfo->arith_ac_K, 5, sizeof(cinfo->arith_ac_K));
   // Initialize the private fields.
   jpeg_decomp_master* m = cinfo->master;
   m->input_buffer_.clear();
   m->input_buffer_pos_ = 0;
+  m->num_mcus_decoded_ = 0;
+  m->num_buffered_bytes_ = 0;
+  jpegli_memory_stats memory_stats;
+  GetMemoryStats(reinterpret_cast<j_common_ptr>(cinfo), &memory_stats);
+  m->num_allocations_before_image_ = memory_stats.total_allocations;
   m->codestream_bits_ahead_ = 0;
   m->is_multiscan_ = false;
   m->found_soi_ = false;
@@ -65,9 +81,14 @@ void InitializeImage(j_decompress_ptr cinfo) {
   m->found_sof_ = false;
   m->found_sos_ = false;
   m->found_eoi_ = false;
+  m->coeff_order_ = kJPEGNaturalOrder;
+  m->saved_marker_bytes_ = 0;
+  m->limit_error_ = JPEGLI_LIMIT_NONE;
   m->icc_index_ = 0;
   m->icc_total_ = 0;
   m->icc_profile_.clear();
+  m->soi_data_ = nullptr;
+  m->mp_images_.clear();
   memset(m->dc_huff_lut_, 0, sizeof(m->dc_huff_lut_));
   memset(m->ac_huff_lut_, 0, sizeof(m->ac_huff_lut_));
   // Initialize the values to an invalid symbol so that we can recognize it
@@ -87,8 +108,30 @@ void InitializeImage(j_decompress_ptr cinfo) {
     m->error_row_[i] = nullptr;
   }
   m->output_passes_done_ = 0;
+  m->has_prev_output_pass_ = false;
+  m->dirty_rows_begin_ = 0;
+  m->dirty_rows_end_ = 0;
   m->xoffset_ = 0;
   m->dequant_ = nullptr;
+  m->restart_index_.clear();
+  m->coeff_band_decoding_ = false;
+  m->band_scans_.clear();
+  m->band_huff_luts_.clear();
+  m->decode_region_ = false;
+  m->resize_width_ = 0;
+  m->resize_height_ = 0;
+  m->resize_filter_ = JPEGLI_FILTER_LANCZOS3;
+  m->tensor_plane_stride_ = 0;
+  m->tensor_mean_ = nullptr;
+  m->tensor_std_dev_ = nullptr;
+  m->output_planes_ = nullptr;
+  m->output_plane_strides_ = nullptr;
+  for (int c = 0; c < kMaxComponents; ++c) {
+    m->dc_only_[c] = false;
+  }
+  m->fingerprint_dc_.clear();
+  m->step_budget_ = -1;
+  m->step_output_started_ = false;
 }
 
 void InitializeDecompressParams(j_decompress_ptr cinfo) {
@@ -209,6 +252,55 @@ void BuildHuffmanLookupTable(j_decompress_ptr cinfo, JHUFF_TBL* table,
   BuildJpegHuffmanTable(&counts[0], &values[0], huff_lut);
 }
 
+bool SameHuffmanTable(const JHUFF_TBL& table, bool is_ac,
+                      const CachedLookupTable& entry) {
+  if (is_ac != entry.is_ac ||
+      memcmp(table.bits, entry.bits, sizeof(entry.bits)) != 0) {
+    return false;
+  }
+  size_t total_count = 0;
+  for (size_t i = 0; i <= kJpegHuffmanMaxBitLength; ++i) {
+    total_count += table.bits[i];
+  }
+  total_count = std::min<size_t>(total_count, kJpegHuffmanAlphabetSize);
+  return memcmp(table.huffval, entry.huffval, total_count) == 0;
+}
+
+// Builds the lookup table of the Huffman code of table, and its fast AC table
+// if fast_ac is not nullptr, or copies them from the cache of the context.
+void GetHuffmanLookupTable(j_decompress_ptr cinfo, JHUFF_TBL* table,
+                           HuffmanTableEntry* huff_lut, int16_t* fast_ac) {
+  const bool is_ac = fast_ac != nullptr;
+  jpegli_context* context = GetContext(cinfo);
+  {
+    std::lock_guard<std::mutex> lock(context->lookup_table_mutex);
+    for (size_t i = 0; i < context->num_lookup_tables; ++i) {
+      const CachedLookupTable& entry = context->lookup_tables[i];
+      if (SameHuffmanTable(*table, is_ac, entry)) {
+        memcpy(huff_lut, entry.lut, sizeof(entry.lut));
+        if (is_ac) memcpy(fast_ac, entry.fast_ac, sizeof(entry.fast_ac));
+        return;
+      }
+    }
+  }
+  // The table is built without holding the lock, since invalid tables are
+  // reported with JPEGLI_ERROR, which does not return.
+  BuildHuffmanLookupTable(cinfo, table, huff_lut);
+  if (is_ac) BuildJpegFastACTable(huff_lut, fast_ac);
+  std::lock_guard<std::mutex> lock(context->lookup_table_mutex);
+  CachedLookupTable* entry =
+      &context->lookup_tables[context->next_lookup_table];
+  context->next_lookup_table =
+      (context->next_lookup_table + 1) % kNumCachedLookupTables;
+  context->num_lookup_tables =
+      std::min(context->num_lookup_tables + 1, kNumCachedLookupTables);
+  memcpy(entry->bits, table->bits, sizeof(entry->bits));
+  memcpy(entry->huffval, table->huffval, sizeof(entry->huffval));
+  entry->is_ac = is_ac;
+  memcpy(entry->lut, huff_lut, sizeof(entry->lut));
+  if (is_ac) memcpy(entry->fast_ac, fast_ac, sizeof(entry->fast_ac));
+}
+
 void PrepareForScan(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   for (int i = 0; i < cinfo->comps_in_scan; ++i) {
@@ -228,7 +320,7 @@ void PrepareForScan(j_decompress_ptr cinfo) {
                            /*is_dc=*/true);
   // Check that all the Huffman tables needed for this scan are defined and
   // build derived lookup tables.
-  for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+  for (int i = 0; i < cinfo->comps_in_scan && !cinfo->arith_code; ++i) {
     if (cinfo->Ss == 0) {
       int dc_tbl_idx = cinfo->cur_comp_info[i]->dc_tbl_no;
       JHUFF_TBL* table = cinfo->dc_huff_tbl_ptrs[dc_tbl_idx];
@@ -237,7 +329,7 @@ void PrepareForScan(j_decompress_ptr cinfo) {
       if (!table) {
         JPEGLI_ERROR("DC Huffman table %d not found", dc_tbl_idx);
       }
-      BuildHuffmanLookupTable(cinfo, table, huff_lut);
+      GetHuffmanLookupTable(cinfo, table, huff_lut, /*fast_ac=*/nullptr);
     }
     if (cinfo->Se > 0) {
       int ac_tbl_idx = cinfo->cur_comp_info[i]->ac_tbl_no;
@@ -247,7 +339,8 @@ void PrepareForScan(j_decompress_ptr cinfo) {
       if (!table) {
         JPEGLI_ERROR("AC Huffman table %d not found", ac_tbl_idx);
       }
-      BuildHuffmanLookupTable(cinfo, table, huff_lut);
+      GetHuffmanLookupTable(cinfo, table, huff_lut,
+                            &m->ac_fast_lut_[ac_tbl_idx * kJpegFastACLutSize]);
     }
   }
   // Copy quantization tables into comp_info.
@@ -284,6 +377,9 @@ void PrepareForScan(j_decompress_ptr cinfo) {
     }
   }
   memset(m->last_dc_coeff_, 0, sizeof(m->last_dc_coeff_));
+  if (cinfo->arith_code) {
+    ResetArithDecoder(cinfo);
+  }
   m->restarts_to_go_ = cinfo->restart_interval;
   m->next_restart_marker_ = 0;
   m->eobrun_ = -1;
@@ -296,8 +392,72 @@ void PrepareForScan(j_decompress_ptr cinfo) {
   cinfo->global_state = kDecProcessScan;
 }
 
+// Parses a restart index in the format of jpegli_get_restart_index(), returns
+// false if it is invalid.
+bool ParseRestartIndex(const uint8_t* data, size_t len,
+                       std::vector<std::vector<uint32_t>>* index) {
+  const uint8_t* p = data;
+  const uint8_t* end = data + len;
+  const auto read_value = [&](uint32_t* value) {
+    if (end - p < 4) return false;
+    *value = LoadLE32(p);
+    p += 4;
+    return true;
+  };
+  uint32_t num_scans;
+  bool ok = data != nullptr && read_value(&num_scans) && num_scans <= len / 4;
+  index->resize(ok ? num_scans : 0);
+  for (size_t i = 0; ok && i < index->size(); ++i) {
+    std::vector<uint32_t>& offsets = (*index)[i];
+    uint32_t num_offsets;
+    ok = read_value(&num_offsets) &&
+         num_offsets <= static_cast<size_t>(end - p) / 4;
+    offsets.resize(ok ? num_offsets : 0);
+    for (size_t j = 0; ok && j < offsets.size(); ++j) {
+      ok = read_value(&offsets[j]);
+    }
+  }
+  return ok && p == end;
+}
+
+// Reads the restart index segment that jpegli_write_restart_index() writes
+// before the EOI marker, if the input buffer ends with it. Since the index is
+// only used to speed up decoding, and it is checked against the scans before
+// it is used, nothing else of the image has to be parsed to find it.
+void ReadTrailingRestartIndex(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  const jpeg_source_mgr* src = cinfo->src;
+  // Marker, length, tag, number of scans and the size of the segment.
+  constexpr size_t kMinSegmentSize = 4 + sizeof(kRestartIndexTag) + 4 + 4;
+  const size_t len = src->bytes_in_buffer;
+  if (len < kMinSegmentSize + 2) return;
+  const uint8_t* end = src->next_input_byte + len;
+  if (end[-2] != 0xFF || end[-1] != 0xD9) return;
+  const size_t size = LoadLE32(end - 6);
+  if (size < kMinSegmentSize || size > len - 2 || size > 65537) return;
+  const uint8_t* segment = end - 2 - size;
+  if (segment[0] != 0xFF || segment[1] != kApp10 ||
+      static_cast<size_t>((segment[2] << 8) + segment[3]) != size - 2 ||
+      memcmp(&segment[4], kRestartIndexTag, sizeof(kRestartIndexTag)) != 0) {
+    return;
+  }
+  const size_t header_size = 4 + sizeof(kRestartIndexTag);
+  std::vector<std::vector<uint32_t>> index;
+  if (ParseRestartIndex(segment + header_size, size - header_size - 4,
+                        &index)) {
+    m->restart_index_ = std::move(index);
+  }
+}
+
 int ConsumeInput(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
+  if (m->step_budget_ == 0) {
+    // The work budget of jpegli_decode_step() is used up, the caller handles
+    // this as a suspension of the source.
+    return JPEG_SUSPENDED;
+  } else if (m->step_budget_ > 0) {
+    --m->step_budget_;
+  }
   if (cinfo->global_state == kDecProcessScan && m->streaming_mode_ &&
       cinfo->input_iMCU_row > cinfo->output_iMCU_row) {
     // Prevent input from getting ahead of output in streaming mode.
@@ -317,8 +477,10 @@ int ConsumeInput(j_decompress_ptr cinfo) {
     }
     size_t pos = 0;
     if (cinfo->global_state == kDecProcessScan) {
+      StageTimer timer(&m->stage_stats, JPEGLI_STAGE_PROCESS_SCAN);
       status = ProcessScan(cinfo, data, len, &pos, &m->codestream_bits_ahead_);
     } else {
+      StageTimer timer(&m->stage_stats, JPEGLI_STAGE_PROCESS_MARKERS);
       status = ProcessMarkers(cinfo, data, len, &pos);
     }
     if (m->input_buffer_.empty()) {
@@ -373,6 +535,14 @@ int ConsumeInput(j_decompress_ptr cinfo) {
       JXL_DASSERT(m->input_buffer_pos_ == 0);
       m->input_buffer_.assign(src->next_input_byte,
                               src->next_input_byte + src->bytes_in_buffer);
+      m->num_buffered_bytes_ += src->bytes_in_buffer;
+    } else if (m->input_buffer_pos_ > 0) {
+      // Drop the consumed bytes, so that only the unconsumed tail is kept
+      // while a source with many small chunks is appended to the buffer.
+      m->input_buffer_.erase(m->input_buffer_.begin(),
+                             m->input_buffer_.begin() + m->input_buffer_pos_);
+      m->input_buffer_pos_ = 0;
+      m->num_buffered_bytes_ += m->input_buffer_.size();
     }
     if (!(*cinfo->src->fill_input_buffer)(cinfo)) {
       m->input_buffer_.clear();
@@ -384,12 +554,14 @@ int ConsumeInput(j_decompress_ptr cinfo) {
     }
     m->input_buffer_.insert(m->input_buffer_.end(), src->next_input_byte,
                             src->next_input_byte + src->bytes_in_buffer);
+    m->num_buffered_bytes_ += src->bytes_in_buffer;
   }
   if (status == JPEG_SCAN_COMPLETED) {
     cinfo->global_state = kDecProcessMarkers;
   } else if (status == JPEG_REACHED_SOS) {
     if (cinfo->global_state == kDecInHeader) {
       cinfo->global_state = kDecHeaderDone;
+      ReadTrailingRestartIndex(cinfo);
     } else {
       PrepareForScan(cinfo);
     }
@@ -414,10 +586,96 @@ bool IsInputReady(j_decompress_ptr cinfo) {
          cinfo->output_iMCU_row + (cinfo->master->streaming_mode_ ? 0 : 2);
 }
 
+void CheckScanlineOutputState(j_decompress_ptr cinfo, const char* caller) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->global_state != kDecProcessScan &&
+      cinfo->global_state != kDecProcessMarkers) {
+    JPEGLI_ERROR("%s: unexpected state %d", caller, cinfo->global_state);
+  }
+  if (cinfo->buffered_image) {
+    if (cinfo->output_scan_number == 0) {
+      JPEGLI_ERROR("%s: jpegli_start_output() was not called", caller);
+    }
+  } else if (m->is_multiscan_ && !m->found_eoi_) {
+    JPEGLI_ERROR("%s: jpegli_start_decompress() did not finish", caller);
+  }
+}
+
+// Returns true if all the input of the current output pass is available.
+bool IsFullInputReady(j_decompress_ptr cinfo) {
+  if (cinfo->master->found_eoi_) {
+    return true;
+  }
+  if (cinfo->input_scan_number != cinfo->output_scan_number) {
+    return cinfo->input_scan_number > cinfo->output_scan_number;
+  }
+  return cinfo->input_iMCU_row == cinfo->total_iMCU_rows;
+}
+
+// Computes the output rows of a buffered image output pass that may differ
+// from the previous output pass, from the iMCU rows whose coefficients were
+// decoded since the start of the previous output pass. Must be called after
+// PrepareForOutput().
+void UpdateDirtyOutputRows(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t total_rows = cinfo->total_iMCU_rows;
+  const int scan = cinfo->input_scan_number;
+  // The iMCU row that is being decoded can be partially updated, so it is
+  // counted as changed both now and at the start of the previous pass.
+  const size_t input_row = std::min<size_t>(cinfo->input_iMCU_row + 1,
+                                            total_rows);
+  size_t changed_begin = 0;
+  size_t changed_end = total_rows;
+  if (m->has_prev_output_pass_ && !cinfo->quantize_colors &&
+      m->prev_output_width_ == cinfo->output_width &&
+      m->prev_output_height_ == cinfo->output_height) {
+    const int prev_scan = m->prev_output_input_scan_;
+    const size_t prev_row = m->prev_output_input_row_;
+    const bool smoothing = m->apply_smoothing || m->prev_output_smoothing_;
+    if (scan == prev_scan) {
+      changed_begin = prev_row;
+      changed_end = input_row;
+    } else if (scan == prev_scan + 1 && !smoothing &&
+               prev_row >= total_rows) {
+      changed_begin = 0;
+      changed_end = input_row;
+    }
+    // The smoothing of the AC coefficients and the upsampling use the
+    // neighbouring iMCU rows.
+    const size_t context = (m->need_context_rows_ ? 1 : 0) +
+                           (m->apply_smoothing ? 2 : 0);
+    if (changed_begin < changed_end) {
+      changed_begin = changed_begin > context ? changed_begin - context : 0;
+      changed_end = std::min(changed_end + context, total_rows);
+      // The dequantization biases of all the later rows depend on the
+      // statistics of the changed rows.
+      if (m->dequant_bias_rows_ == 0 ||
+          changed_begin < m->dequant_bias_rows_) {
+        changed_end = total_rows;
+      }
+    }
+  }
+  const size_t imcu_height = cinfo->max_v_samp_factor * m->min_scaled_dct_size;
+  m->dirty_rows_begin_ =
+      std::min<size_t>(changed_begin * imcu_height, cinfo->output_height);
+  m->dirty_rows_end_ =
+      std::min<size_t>(changed_end * imcu_height, cinfo->output_height);
+  if (m->dirty_rows_end_ < m->dirty_rows_begin_) {
+    m->dirty_rows_end_ = m->dirty_rows_begin_;
+  }
+  m->has_prev_output_pass_ = true;
+  m->prev_output_input_scan_ = scan;
+  m->prev_output_input_row_ = cinfo->input_iMCU_row;
+  m->prev_output_width_ = cinfo->output_width;
+  m->prev_output_height_ = cinfo->output_height;
+  m->prev_output_smoothing_ = m->apply_smoothing;
+}
+
 bool ReadOutputPass(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   if (!m->pixels_) {
     size_t stride = cinfo->out_color_components * cinfo->output_width;
+    if (m->output_rows_padded_) stride += JPEGLI_ROW_PADDING;
     size_t num_samples = cinfo->output_height * stride;
     m->pixels_ = Allocate<uint8_t>(cinfo, num_samples, JPOOL_IMAGE);
     m->scanlines_ =
@@ -488,22 +746,95 @@ void AllocateCoefficientBuffer(j_decompress_ptr cinfo) {
   j_common_ptr comptr = reinterpret_cast<j_common_ptr>(cinfo);
   jvirt_barray_ptr* coef_arrays = jpegli::Allocate<jvirt_barray_ptr>(
       cinfo, cinfo->num_components, JPOOL_IMAGE);
+  JDIMENSION width_in_blocks[jpegli::kMaxComponents];
+  JDIMENSION height_in_blocks[jpegli::kMaxComponents];
+  JDIMENSION rows_per_imcu[jpegli::kMaxComponents];
   for (int c = 0; c < cinfo->num_components; ++c) {
     jpeg_component_info* comp = &cinfo->comp_info[c];
-    size_t height_in_blocks =
+    width_in_blocks[c] = comp->width_in_blocks;
+    height_in_blocks[c] =
         m->streaming_mode_ ? comp->v_samp_factor : comp->height_in_blocks;
-    coef_arrays[c] = (*cinfo->mem->request_virt_barray)(
-        comptr, JPOOL_IMAGE, TRUE, comp->width_in_blocks, height_in_blocks,
-        comp->v_samp_factor);
+    if (m->coeff_band_decoding_) {
+      height_in_blocks[c] = std::min<JDIMENSION>(
+          m->coeff_band_buffer_rows_ * comp->v_samp_factor,
+          comp->height_in_blocks);
+    }
+    rows_per_imcu[c] = comp->v_samp_factor;
+  }
+  if (m->coeff_band_decoding_) {
+    size_t band_memory = 0;
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      band_memory += static_cast<size_t>(width_in_blocks[c]) *
+                     height_in_blocks[c] * sizeof(JBLOCK);
+    }
+    jpegli::CheckDecodeLimit(cinfo, JPEGLI_LIMIT_COEFF_MEMORY, band_memory,
+                             m->max_coeff_memory_);
+  } else if (!m->streaming_mode_) {
+    jpegli::CheckDecodeLimit(cinfo, JPEGLI_LIMIT_COEFF_MEMORY,
+                             jpegli::CoefficientMemory(cinfo),
+                             m->max_coeff_memory_);
+  }
+  if (m->interleave_coefficients_) {
+    // The block rows of each iMCU row are stored together, in component
+    // order, so that decoding and rendering an iMCU row touches one
+    // contiguous range of memory.
+    jpegli::RequestInterleavedBlockArrays(comptr, cinfo->num_components,
+                                          width_in_blocks, height_in_blocks,
+                                          rows_per_imcu, coef_arrays);
+  } else {
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      coef_arrays[c] = (*cinfo->mem->request_virt_barray)(
+          comptr, JPOOL_IMAGE, TRUE, width_in_blocks[c], height_in_blocks[c],
+          rows_per_imcu[c]);
+    }
   }
   cinfo->master->coef_arrays = coef_arrays;
   (*cinfo->mem->realize_virt_arrays)(comptr);
 }
 
+// Returns true if the scans of the image are decoded band by band, see
+// jpegli_set_progressive_band_rows().
+bool UseCoeffBandDecoding(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (m->progressive_band_rows_ == 0 || !cinfo->progressive_mode ||
+      cinfo->arith_code || cinfo->buffered_image || !m->input_buffer_.empty()) {
+    return false;
+  }
+  // The scans are decoded again from the input buffer for each band, so it
+  // must have the whole image.
+  const size_t len = cinfo->src->bytes_in_buffer;
+  const uint8_t* end = cinfo->src->next_input_byte + len;
+  return len >= 2 && end[-2] == 0xFF && end[-1] == 0xD9;
+}
+
+// Allocates the coefficient buffer of the largest band once the scans are
+// indexed, and a sink row for the blocks outside of the bands.
+void AllocateCoeffBandBuffer(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t num_bands =
+      DivCeil(cinfo->total_iMCU_rows, m->progressive_band_rows_);
+  m->coeff_band_buffer_rows_ = 0;
+  for (size_t band = 0; band < num_bands; ++band) {
+    size_t begin;
+    size_t end;
+    GetCoeffBandRows(cinfo, band, &begin, &end);
+    m->coeff_band_buffer_rows_ =
+        std::max(m->coeff_band_buffer_rows_, end - begin);
+  }
+  AllocateCoefficientBuffer(cinfo);
+  size_t max_width = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    max_width =
+        std::max<size_t>(max_width, cinfo->comp_info[c].width_in_blocks);
+  }
+  m->coeff_band_sink_ =
+      Allocate<JBLOCK>(cinfo, max_width, JPOOL_IMAGE_ALIGNED);
+  m->coeff_band_ = num_bands;
+  m->coeff_band_begin_ = 0;
+}
+
 void AllocateOutputBuffers(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
-  size_t iMCU_width = cinfo->max_h_samp_factor * m->min_scaled_dct_size;
-  size_t output_stride = m->iMCU_cols_ * iMCU_width;
   m->need_context_rows_ = false;
   for (int c = 0; c < cinfo->num_components; ++c) {
     if (cinfo->do_fancy_upsampling && m->v_factor[c] == 2) {
@@ -512,33 +843,26 @@ void AllocateOutputBuffers(j_decompress_ptr cinfo) {
   }
   for (int c = 0; c < cinfo->num_components; ++c) {
     const auto& comp = cinfo->comp_info[c];
-    size_t cheight = comp.v_samp_factor * m->scaled_dct_size[c];
-    int downsampled_width = output_stride / m->h_factor[c];
     m->raw_height_[c] = comp.height_in_blocks * m->scaled_dct_size[c];
-    if (m->need_context_rows_) {
-      cheight *= 3;
+  }
+  AllocateRenderBuffers(cinfo, &m->render_buffers_);
+  if (m->resize_width_ != 0) {
+    AllocateResizer(cinfo);
+  }
+  m->band_buffers_ = nullptr;
+  m->num_band_buffers_ = 0;
+  m->band_biases_ = nullptr;
+  // Block smoothing is only done for progressive images, and it predicts the
+  // blocks of a whole block row at once.
+  size_t smoothing_blocks = 1;
+  if (cinfo->progressive_mode) {
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      smoothing_blocks = std::max<size_t>(smoothing_blocks,
+                                          cinfo->comp_info[c].width_in_blocks);
     }
-    m->raw_output_[c].Allocate(cinfo, cheight, downsampled_width);
   }
-  int num_all_components =
-      std::max(cinfo->out_color_components, cinfo->num_components);
-  for (int c = 0; c < num_all_components; ++c) {
-    m->render_output_[c].Allocate(cinfo, cinfo->max_v_samp_factor,
-                                  output_stride);
-  }
-  m->idct_scratch_ = Allocate<float>(cinfo, 5 * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
-  // Padding for horizontal chroma upsampling.
-  constexpr size_t kPaddingLeft = 64;
-  constexpr size_t kPaddingRight = 64;
-  m->upsample_scratch_ = Allocate<float>(
-      cinfo, output_stride + kPaddingLeft + kPaddingRight, JPOOL_IMAGE_ALIGNED);
-  size_t bytes_per_sample = jpegli_bytes_per_sample(m->output_data_type_);
-  size_t bytes_per_pixel = cinfo->out_color_components * bytes_per_sample;
-  size_t scratch_stride = RoundUpTo(output_stride, HWY_ALIGNMENT);
-  m->output_scratch_ = Allocate<uint8_t>(
-      cinfo, bytes_per_pixel * scratch_stride, JPOOL_IMAGE_ALIGNED);
-  m->smoothing_scratch_ =
-      Allocate<int16_t>(cinfo, DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+  m->smoothing_scratch_ = Allocate<int16_t>(
+      cinfo, smoothing_blocks * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
   size_t coeffs_per_block = cinfo->num_components * DCTSIZE2;
   m->nonzeros_ = Allocate<int>(cinfo, coeffs_per_block, JPOOL_IMAGE_ALIGNED);
   m->sumabs_ = Allocate<int>(cinfo, coeffs_per_block, JPOOL_IMAGE_ALIGNED);
@@ -547,6 +871,83 @@ void AllocateOutputBuffers(j_decompress_ptr cinfo) {
   memset(m->dequant_, 0, coeffs_per_block * sizeof(float));
 }
 
+size_t EstimateDecoderMemory(j_decompress_ptr cinfo) {
+  if (cinfo->global_state != kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_estimate_memory: unexpected state %d",
+                 cinfo->global_state);
+  }
+  // Sets out_color_components from the current output parameters.
+  jpegli_calc_output_dimensions(cinfo);
+  jpeg_decomp_master* m = cinfo->master;
+  jpegli_memory_stats stats;
+  GetMemoryStats(reinterpret_cast<j_common_ptr>(cinfo), &stats);
+  const bool full_coefficients =
+      m->is_multiscan_ || FROM_JXL_BOOL(cinfo->buffered_image) ||
+      (FROM_JXL_BOOL(cinfo->quantize_colors) &&
+       FROM_JXL_BOOL(cinfo->two_pass_quantize));
+  const size_t iMCU_width = cinfo->max_h_samp_factor * DCTSIZE;
+  const size_t output_stride =
+      DivCeil(cinfo->image_width, iMCU_width) * iMCU_width;
+  const size_t row_bytes = output_stride * sizeof(float);
+  bool need_context_rows = false;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    if (cinfo->do_fancy_upsampling &&
+        cinfo->max_v_samp_factor == 2 * comp->v_samp_factor) {
+      need_context_rows = true;
+    }
+  }
+  size_t estimate = stats.current_bytes;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    const size_t h_factor = cinfo->max_h_samp_factor / comp->h_samp_factor;
+    // Coefficients, for the whole image or for one iMCU row.
+    size_t block_rows =
+        full_coefficients ? comp->height_in_blocks : comp->v_samp_factor;
+    estimate += comp->width_in_blocks * block_rows * sizeof(JBLOCK);
+    // Raw output rows, including the context rows of the upsampling.
+    size_t num_rows = comp->v_samp_factor * DCTSIZE;
+    if (need_context_rows) num_rows *= 3;
+    estimate += num_rows * row_bytes / h_factor;
+  }
+  // Color converted output rows and the output scratch.
+  const int num_all_components =
+      std::max(cinfo->out_color_components, cinfo->num_components);
+  estimate += num_all_components * cinfo->max_v_samp_factor * row_bytes;
+  estimate += cinfo->out_color_components * output_stride *
+              jpegli_bytes_per_sample(m->output_data_type_);
+  return estimate;
+}
+
+void PrepareTensorOutput(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  for (int c = 0; c < cinfo->out_color_components; ++c) {
+    float mean = m->tensor_mean_ ? m->tensor_mean_[c] : 0.0f;
+    float std_dev = m->tensor_std_dev_ ? m->tensor_std_dev_[c] : 1.0f;
+    if (!(std_dev > 0.0f)) {
+      JPEGLI_ERROR("Invalid tensor standard deviation %f", std_dev);
+    }
+    m->tensor_mul_[c] = 1.0f / std_dev;
+    m->tensor_add_[c] = -mean / std_dev;
+  }
+}
+
+// Stores the DC coefficients of the first component of an iMCU row in
+// m->fingerprint_dc_, as a JpegliCoefficientRowCallback.
+void AddFingerprintRow(void* opaque, JDIMENSION imcu_row, JBLOCKARRAY blocks[],
+                       const int num_block_rows[]) {
+  j_decompress_ptr cinfo = reinterpret_cast<j_decompress_ptr>(opaque);
+  jpeg_decomp_master* m = cinfo->master;
+  const jpeg_component_info* comp = &cinfo->comp_info[0];
+  for (int iy = 0; iy < num_block_rows[0]; ++iy) {
+    size_t by = imcu_row * comp->v_samp_factor + iy;
+    float* row = &m->fingerprint_dc_[by * comp->width_in_blocks];
+    for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+      row[bx] = blocks[0][iy][bx][0];
+    }
+  }
+}
+
 }  // namespace jpegli
 
 void jpegli_CreateDecompress(j_decompress_ptr cinfo, int version,
@@ -556,6 +957,7 @@ void jpegli_CreateDecompress(j_decompress_ptr cinfo, int version,
     JPEGLI_ERROR("jpeg_decompress_struct has wrong size.");
   }
   jpegli::InitMemoryManager(reinterpret_cast<j_common_ptr>(cinfo));
+  jpegli::InitSimdTargets();
   cinfo->is_decompressor = TRUE;
   cinfo->progress = nullptr;
   cinfo->src = nullptr;
@@ -575,7 +977,26 @@ void jpegli_CreateDecompress(j_decompress_ptr cinfo, int version,
     app_marker_parser = nullptr;
   }
   m->com_marker_parser = nullptr;
+  m->runner = nullptr;
+  m->runner_opaque = nullptr;
+  m->context = nullptr;
+  m->row_transform_ = nullptr;
+  m->row_transform_opaque_ = nullptr;
+  m->cancel_flag = nullptr;
+  memset(&m->transform_backend, 0, sizeof(m->transform_backend));
+  memset(&m->stage_stats, 0, sizeof(m->stage_stats));
+  m->batch_decoder = nullptr;
+  m->dequant_bias_rows_ = 0;
+  m->progressive_band_rows_ = 0;
+  m->destuff_scans_ = false;
+  m->interleave_coefficients_ = false;
+  m->zigzag_coefficients_ = false;
+  m->max_pixels_ = 0;
+  m->max_scans_ = 0;
+  m->max_marker_bytes_ = 0;
+  m->max_coeff_memory_ = 0;
   memset(m->markers_to_save_, 0, sizeof(m->markers_to_save_));
+  m->save_markers_in_place_ = false;
   jpegli::InitializeDecompressParams(cinfo);
   jpegli::InitializeImage(cinfo);
 }
@@ -598,6 +1019,10 @@ void jpegli_save_markers(j_decompress_ptr cinfo, int marker_code,
   m->markers_to_save_[marker_code - 0xe0] = 1;
 }
 
+void jpegli_save_markers_in_place(j_decompress_ptr cinfo, boolean in_place) {
+  cinfo->master->save_markers_in_place_ = FROM_JXL_BOOL(in_place);
+}
+
 void jpegli_set_marker_processor(j_decompress_ptr cinfo, int marker_code,
                                  jpeg_marker_parser_method routine) {
   jpeg_decomp_master* m = cinfo->master;
@@ -685,6 +1110,25 @@ boolean jpegli_read_icc_profile(j_decompress_ptr cinfo, JOCTET** icc_data_ptr,
   return TRUE;
 }
 
+boolean jpegli_get_mp_image(j_decompress_ptr cinfo, int index,
+                            const JOCTET** data, size_t* size) {
+  if (cinfo->global_state == jpegli::kDecStart ||
+      cinfo->global_state == jpegli::kDecInHeader) {
+    JPEGLI_ERROR("jpegli_get_mp_image: unexpected state %d",
+                 cinfo->global_state);
+  }
+  jpeg_decomp_master* m = cinfo->master;
+  *data = nullptr;
+  *size = 0;
+  if (index < 0 || static_cast<size_t>(index) >= m->mp_images_.size() ||
+      m->mp_images_[index].data == nullptr) {
+    return FALSE;
+  }
+  *data = m->mp_images_[index].data;
+  *size = m->mp_images_[index].size;
+  return TRUE;
+}
+
 void jpegli_core_output_dimensions(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   if (!m->found_sof_) {
@@ -695,6 +1139,31 @@ void jpegli_core_output_dimensions(j_decompress_ptr cinfo) {
       JPEGLI_ERROR("Output scaling is not supported in raw output mode");
     }
   }
+  if (m->resize_width_ != 0) {
+    if (cinfo->raw_data_out) {
+      JPEGLI_ERROR("Output resizing is not supported in raw output mode");
+    }
+    // The smallest scaled inverse DCT that does not reduce the image below
+    // the output size, the rest of the scaling is done by the resampling.
+    int dctsize = 1;
+    while (dctsize < DCTSIZE &&
+           (jpegli::DivCeil(cinfo->image_width * dctsize, DCTSIZE) <
+                m->resize_width_ ||
+            jpegli::DivCeil(cinfo->image_height * dctsize, DCTSIZE) <
+                m->resize_height_)) {
+      ++dctsize;
+    }
+    m->min_scaled_dct_size = dctsize;
+    m->render_width_ = jpegli::DivCeil(cinfo->image_width * dctsize, DCTSIZE);
+    m->render_height_ =
+        jpegli::DivCeil(cinfo->image_height * dctsize, DCTSIZE);
+    cinfo->output_width = m->resize_width_;
+    cinfo->output_height = m->resize_height_;
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      m->scaled_dct_size[c] = m->min_scaled_dct_size;
+    }
+    return;
+  }
   if (cinfo->scale_num != 1 || cinfo->scale_denom != 1) {
     int dctsize = 16;
     while (cinfo->scale_num * DCTSIZE <= cinfo->scale_denom * (dctsize - 1)) {
@@ -716,6 +1185,8 @@ void jpegli_core_output_dimensions(j_decompress_ptr cinfo) {
       m->scaled_dct_size[c] = DCTSIZE;
     }
   }
+  m->render_width_ = cinfo->output_width;
+  m->render_height_ = cinfo->output_height;
 }
 
 void jpegli_calc_output_dimensions(j_decompress_ptr cinfo) {
@@ -726,7 +1197,7 @@ void jpegli_calc_output_dimensions(j_decompress_ptr cinfo) {
     m->h_factor[c] = cinfo->max_h_samp_factor / comp->h_samp_factor;
     m->v_factor[c] = cinfo->max_v_samp_factor / comp->v_samp_factor;
   }
-  if (cinfo->scale_num != 1 || cinfo->scale_denom != 1) {
+  if (m->min_scaled_dct_size < DCTSIZE) {
     for (int c = 0; c < cinfo->num_components; ++c) {
       // Prefer IDCT scaling over 2x upsampling.
       while (m->scaled_dct_size[c] < DCTSIZE && (m->v_factor[c] % 2) == 0 &&
@@ -790,12 +1261,35 @@ boolean jpegli_input_complete(j_decompress_ptr cinfo) {
 boolean jpegli_start_decompress(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   if (cinfo->global_state == jpegli::kDecHeaderDone) {
+    if (m->resize_width_ != 0 &&
+        (cinfo->buffered_image || cinfo->quantize_colors)) {
+      JPEGLI_ERROR("Output resizing is not supported in buffered image mode "
+                   "or with color quantization");
+    }
     m->streaming_mode_ = !m->is_multiscan_ &&
                          !FROM_JXL_BOOL(cinfo->buffered_image) &&
                          (!FROM_JXL_BOOL(cinfo->quantize_colors) ||
-                          !FROM_JXL_BOOL(cinfo->two_pass_quantize));
-    jpegli::AllocateCoefficientBuffer(cinfo);
+                          !FROM_JXL_BOOL(cinfo->two_pass_quantize)) &&
+                         !jpegli::IsRestartIntervalDecodingEnabled(cinfo);
+    m->coeff_band_decoding_ = jpegli::UseCoeffBandDecoding(cinfo);
+    if (m->tensor_plane_stride_ != 0 &&
+        (cinfo->raw_data_out || cinfo->quantize_colors ||
+         (m->output_data_type_ != JPEGLI_TYPE_FLOAT &&
+          m->output_data_type_ != JPEGLI_TYPE_FLOAT16))) {
+      JPEGLI_ERROR("Tensor output needs float samples, and is not supported "
+                   "in raw data mode or with color quantization");
+    }
+    if (!m->coeff_band_decoding_) {
+      jpegli::AllocateCoefficientBuffer(cinfo);
+    }
     jpegli_calc_output_dimensions(cinfo);
+    if (m->tensor_plane_stride_ != 0) {
+      jpegli::PrepareTensorOutput(cinfo);
+    }
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      // With a 1x1 inverse DCT, the AC coefficients are not used.
+      m->dc_only_[c] = !cinfo->raw_data_out && m->scaled_dct_size[c] == 1;
+    }
     jpegli::PrepareForScan(cinfo);
     if (cinfo->quantize_colors) {
       if (cinfo->colormap != nullptr) {
@@ -829,6 +1323,9 @@ boolean jpegli_start_decompress(j_decompress_ptr cinfo) {
         return FALSE;
       }
     }
+    if (m->coeff_band_decoding_) {
+      jpegli::AllocateCoeffBandBuffer(cinfo);
+    }
   }
   cinfo->output_scan_number = cinfo->input_scan_number;
   jpegli::PrepareForOutput(cinfo);
@@ -856,6 +1353,7 @@ boolean jpegli_start_output(j_decompress_ptr cinfo, int scan_number) {
   }
   jpegli::InitProgressMonitorForOutput(cinfo);
   jpegli::PrepareForOutput(cinfo);
+  jpegli::UpdateDirtyOutputRows(cinfo);
   if (cinfo->quantize_colors) {
     return jpegli::PrepareQuantizedOutput(cinfo);
   } else {
@@ -885,26 +1383,25 @@ boolean jpegli_finish_output(j_decompress_ptr cinfo) {
 JDIMENSION jpegli_read_scanlines(j_decompress_ptr cinfo, JSAMPARRAY scanlines,
                                  JDIMENSION max_lines) {
   jpeg_decomp_master* m = cinfo->master;
-  if (cinfo->global_state != jpegli::kDecProcessScan &&
-      cinfo->global_state != jpegli::kDecProcessMarkers) {
-    JPEGLI_ERROR("jpegli_read_scanlines: unexpected state %d",
-                 cinfo->global_state);
-  }
-  if (cinfo->buffered_image) {
-    if (cinfo->output_scan_number == 0) {
-      JPEGLI_ERROR(
-          "jpegli_read_scanlines: "
-          "jpegli_start_output() was not called");
-    }
-  } else if (m->is_multiscan_ && !m->found_eoi_) {
-    JPEGLI_ERROR(
-        "jpegli_read_scanlines: "
-        "jpegli_start_decompress() did not finish");
-  }
+  jpegli::CheckScanlineOutputState(cinfo, "jpegli_read_scanlines");
   if (cinfo->output_scanline + max_lines > cinfo->output_height) {
     max_lines = cinfo->output_height - cinfo->output_scanline;
   }
   jpegli::ProgressMonitorOutputPass(cinfo);
+  if (scanlines != nullptr && max_lines == cinfo->output_height &&
+      jpegli::CanRenderInParallel(cinfo)) {
+    // The whole output pass was requested at once, so it can be split into
+    // bands that are rendered in parallel once all of its input is available.
+    while (!jpegli::IsFullInputReady(cinfo)) {
+      if (jpegli::ConsumeInput(cinfo) == JPEG_SUSPENDED) {
+        break;
+      }
+    }
+    if (jpegli::IsFullInputReady(cinfo)) {
+      jpegli::RenderInParallel(cinfo, scanlines);
+      return max_lines;
+    }
+  }
   size_t num_output_rows = 0;
   while (num_output_rows < max_lines) {
     if (jpegli::IsInputReady(cinfo)) {
@@ -917,8 +1414,58 @@ JDIMENSION jpegli_read_scanlines(j_decompress_ptr cinfo, JSAMPARRAY scanlines,
 }
 
 JDIMENSION jpegli_skip_scanlines(j_decompress_ptr cinfo, JDIMENSION num_lines) {
-  // TODO(szabadka) Skip the IDCT for skipped over blocks.
-  return jpegli_read_scanlines(cinfo, nullptr, num_lines);
+  jpeg_decomp_master* m = cinfo->master;
+  jpegli::CheckScanlineOutputState(cinfo, "jpegli_skip_scanlines");
+  if (cinfo->output_scanline + num_lines > cinfo->output_height) {
+    num_lines = cinfo->output_height - cinfo->output_scanline;
+  }
+  if (cinfo->quantize_colors || cinfo->raw_data_out) {
+    // The dithering state depends on every output row.
+    return jpegli_read_scanlines(cinfo, nullptr, num_lines);
+  }
+  if (m->resize_width_ != 0) {
+    // The resampling of the next output rows needs the rendered rows under
+    // the vertical filter window.
+    return jpegli_read_scanlines(cinfo, nullptr, num_lines);
+  }
+  const size_t first_scanline = cinfo->output_scanline;
+  const size_t target_scanline = first_scanline + num_lines;
+  const size_t context = m->need_context_rows_ ? 1 : 0;
+  const size_t imcu_height = cinfo->max_v_samp_factor * m->min_scaled_dct_size;
+  // The iMCU rows before skip_end are not needed for rendering the output rows
+  // from target_scanline onwards, so they are only entropy decoded.
+  size_t skip_end = cinfo->total_iMCU_rows;
+  if (target_scanline < cinfo->output_height) {
+    size_t target_imcu_row = target_scanline / imcu_height;
+    skip_end = target_imcu_row > context ? target_imcu_row - context : 0;
+  }
+  bool suspended = false;
+  jpegli::ProgressMonitorOutputPass(cinfo);
+  while (cinfo->output_iMCU_row < skip_end) {
+    if (!jpegli::IsInputReady(cinfo)) {
+      if (jpegli::ConsumeInput(cinfo) == JPEG_SUSPENDED) {
+        suspended = true;
+        break;
+      }
+      continue;
+    }
+    jpegli::SkipCurrentiMCURow(cinfo);
+    // The output rows that depend on the skipped iMCU rows can not be
+    // rendered anymore.
+    size_t next_scanline = std::min<size_t>(
+        (cinfo->output_iMCU_row + context) * imcu_height, target_scanline);
+    if (next_scanline > cinfo->output_scanline) {
+      cinfo->output_scanline = next_scanline;
+      if (cinfo->output_scanline == cinfo->output_height) {
+        ++m->output_passes_done_;
+      }
+    }
+  }
+  if (!suspended && cinfo->output_scanline < target_scanline) {
+    jpegli_read_scanlines(cinfo, nullptr,
+                          target_scanline - cinfo->output_scanline);
+  }
+  return cinfo->output_scanline - first_scanline;
 }
 
 void jpegli_crop_scanline(j_decompress_ptr cinfo, JDIMENSION* xoffset,
@@ -933,16 +1480,19 @@ void jpegli_crop_scanline(j_decompress_ptr cinfo, JDIMENSION* xoffset,
   if (cinfo->raw_data_out) {
     JPEGLI_ERROR("Output cropping is not supported in raw data mode");
   }
+  if (m->resize_width_ != 0) {
+    JPEGLI_ERROR("Output cropping is not supported with a resized output");
+  }
   if (xoffset == nullptr || width == nullptr || *width == 0 ||
       *xoffset + *width > cinfo->output_width) {
     JPEGLI_ERROR("jpegli_crop_scanline: Invalid arguments");
   }
-  // TODO(szabadka) Skip the IDCT for skipped over blocks.
   size_t xend = *xoffset + *width;
   size_t iMCU_width = m->min_scaled_dct_size * cinfo->max_h_samp_factor;
   *xoffset = (*xoffset / iMCU_width) * iMCU_width;
   *width = xend - *xoffset;
   cinfo->master->xoffset_ = *xoffset;
+  cinfo->master->render_width_ = *width;
   cinfo->output_width = *width;
 }
 
@@ -976,6 +1526,14 @@ jvirt_barray_ptr* jpegli_read_coefficients(j_decompress_ptr cinfo) {
   m->streaming_mode_ = false;
   if (!cinfo->buffered_image && cinfo->global_state == jpegli::kDecHeaderDone) {
     jpegli::AllocateCoefficientBuffer(cinfo);
+    if (m->zigzag_coefficients_) {
+      // Nothing is rendered from these coefficients, so they can be stored in
+      // the order in which they are coded.
+      m->coeff_order_ = jpegli::kJPEGIdentityOrder;
+      for (int c = 0; c < cinfo->num_components; ++c) {
+        jpegli::SetZigZagOrder(m->coef_arrays[c], true);
+      }
+    }
     jpegli_calc_output_dimensions(cinfo);
     jpegli::InitProgressMonitor(cinfo, /*coef_only=*/true);
     jpegli::PrepareForScan(cinfo);
@@ -997,6 +1555,167 @@ jvirt_barray_ptr* jpegli_read_coefficients(j_decompress_ptr cinfo) {
   return m->coef_arrays;
 }
 
+boolean jpegli_decode_coefficients_streaming(
+    j_decompress_ptr cinfo, JpegliCoefficientRowCallback callback,
+    void* opaque) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->buffered_image) {
+    JPEGLI_ERROR("jpegli_decode_coefficients_streaming: buffered image mode "
+                 "is not supported");
+  }
+  j_common_ptr comptr = reinterpret_cast<j_common_ptr>(cinfo);
+  JBLOCKARRAY blocks[jpegli::kMaxComponents];
+  int num_block_rows[jpegli::kMaxComponents];
+  if (m->is_multiscan_) {
+    // The coefficients of an iMCU row are only complete after the last scan.
+    jvirt_barray_ptr* coef_arrays = jpegli_read_coefficients(cinfo);
+    if (coef_arrays == nullptr) {
+      return FALSE;
+    }
+    for (; cinfo->output_iMCU_row < cinfo->total_iMCU_rows;
+         ++cinfo->output_iMCU_row) {
+      for (int c = 0; c < cinfo->num_components; ++c) {
+        const jpeg_component_info* comp = &cinfo->comp_info[c];
+        int by0 = cinfo->output_iMCU_row * comp->v_samp_factor;
+        num_block_rows[c] = std::min<int>(comp->v_samp_factor,
+                                          comp->height_in_blocks - by0);
+        blocks[c] = (*cinfo->mem->access_virt_barray)(
+            comptr, coef_arrays[c], by0, num_block_rows[c], FALSE);
+      }
+      (*callback)(opaque, cinfo->output_iMCU_row, blocks, num_block_rows);
+    }
+    return TRUE;
+  }
+  if (cinfo->global_state == jpegli::kDecHeaderDone) {
+    m->streaming_mode_ = true;
+    m->coeff_band_decoding_ = false;
+    jpegli::AllocateCoefficientBuffer(cinfo);
+    if (m->zigzag_coefficients_) {
+      m->coeff_order_ = jpegli::kJPEGIdentityOrder;
+    }
+    jpegli_calc_output_dimensions(cinfo);
+    jpegli::InitProgressMonitor(cinfo, /*coef_only=*/true);
+    jpegli::PrepareForScan(cinfo);
+  }
+  if ((cinfo->global_state != jpegli::kDecProcessScan &&
+       cinfo->global_state != jpegli::kDecProcessMarkers) ||
+      !m->streaming_mode_) {
+    JPEGLI_ERROR("jpegli_decode_coefficients_streaming: unexpected state %d",
+                 cinfo->global_state);
+  }
+  while (cinfo->output_iMCU_row < cinfo->total_iMCU_rows) {
+    // Decoding stops after each iMCU row until it is passed to the callback,
+    // see ConsumeInput(). The rows after a truncated scan are passed on as
+    // zeros once the end of the input is reached.
+    while (cinfo->input_iMCU_row <= cinfo->output_iMCU_row &&
+           !m->found_eoi_) {
+      jpegli::ProgressMonitorInputPass(cinfo);
+      if (jpegli::ConsumeInput(cinfo) == JPEG_SUSPENDED) {
+        return FALSE;
+      }
+    }
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      const jpeg_component_info* comp = &cinfo->comp_info[c];
+      int by0 = cinfo->output_iMCU_row * comp->v_samp_factor;
+      num_block_rows[c] =
+          std::min<int>(comp->v_samp_factor, comp->height_in_blocks - by0);
+      blocks[c] = (*cinfo->mem->access_virt_barray)(
+          comptr, m->coef_arrays[c], 0, num_block_rows[c], TRUE);
+    }
+    (*callback)(opaque, cinfo->output_iMCU_row, blocks, num_block_rows);
+    // The scan decoder expects the blocks of the next iMCU row to be zero.
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      for (int iy = 0; iy < num_block_rows[c]; ++iy) {
+        memset(blocks[c][iy], 0,
+               cinfo->comp_info[c].width_in_blocks * sizeof(JBLOCK));
+      }
+    }
+    ++cinfo->output_iMCU_row;
+  }
+  while (!m->found_eoi_) {
+    jpegli::ProgressMonitorInputPass(cinfo);
+    if (jpegli::ConsumeInput(cinfo) == JPEG_SUSPENDED) {
+      return FALSE;
+    }
+  }
+  cinfo->output_scanline = cinfo->output_height;
+  return TRUE;
+}
+
+void jpegli_export_coefficients(j_decompress_ptr cinfo, boolean zigzag,
+                                JpegliCoefficientLayout* layout,
+                                JCOEF* coeffs) {
+  jpeg_decomp_master* m = cinfo->master;
+  if ((cinfo->global_state != jpegli::kDecProcessScan &&
+       cinfo->global_state != jpegli::kDecProcessMarkers) ||
+      m->streaming_mode_ || m->coeff_band_decoding_ ||
+      m->coef_arrays == nullptr) {
+    JPEGLI_ERROR("jpegli_export_coefficients: unexpected state %d",
+                 cinfo->global_state);
+  }
+  memset(layout, 0, sizeof(*layout));
+  layout->image_width = cinfo->image_width;
+  layout->image_height = cinfo->image_height;
+  layout->num_components = cinfo->num_components;
+  layout->max_h_samp_factor = cinfo->max_h_samp_factor;
+  layout->max_v_samp_factor = cinfo->max_v_samp_factor;
+  layout->zigzag = zigzag ? 1 : 0;
+  size_t num_coeffs = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    layout->h_samp_factor[c] = comp->h_samp_factor;
+    layout->v_samp_factor[c] = comp->v_samp_factor;
+    layout->width_in_blocks[c] = comp->width_in_blocks;
+    layout->height_in_blocks[c] = comp->height_in_blocks;
+    layout->offset[c] = num_coeffs;
+    num_coeffs += static_cast<size_t>(comp->width_in_blocks) *
+                  comp->height_in_blocks * DCTSIZE2;
+    const JQUANT_TBL* table = comp->quant_table;
+    if (table == nullptr) continue;
+    for (int k = 0; k < DCTSIZE2; ++k) {
+      layout->quant_table[c][k] =
+          table->quantval[zigzag ? jpegli::kJPEGNaturalOrder[k] : k];
+    }
+  }
+  layout->num_coeffs = num_coeffs;
+  if (coeffs == nullptr) return;
+  j_common_ptr comptr = reinterpret_cast<j_common_ptr>(cinfo);
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    jvirt_barray_ptr array = m->coef_arrays[c];
+    const bool stored_zigzag = jpegli::IsZigZagOrder(array);
+    const size_t row_size = comp->width_in_blocks * DCTSIZE2;
+    JCOEF* out = coeffs + layout->offset[c];
+    // The rows are accessed in the same groups as they were decoded, in case
+    // the array is backed by a temporary file.
+    for (JDIMENSION by0 = 0; by0 < comp->height_in_blocks;
+         by0 += comp->v_samp_factor) {
+      JDIMENSION num_rows = std::min<JDIMENSION>(
+          comp->v_samp_factor, comp->height_in_blocks - by0);
+      JBLOCKARRAY rows = (*cinfo->mem->access_virt_barray)(comptr, array, by0,
+                                                           num_rows, FALSE);
+      for (JDIMENSION iy = 0; iy < num_rows; ++iy, out += row_size) {
+        const JCOEF* in = rows[iy][0];
+        if (stored_zigzag == FROM_JXL_BOOL(zigzag)) {
+          memcpy(out, in, row_size * sizeof(JCOEF));
+        } else if (zigzag) {
+          for (size_t i = 0; i < row_size; i += DCTSIZE2) {
+            for (int k = 0; k < DCTSIZE2; ++k) {
+              out[i + k] = in[i + jpegli::kJPEGNaturalOrder[k]];
+            }
+          }
+        } else {
+          for (size_t i = 0; i < row_size; i += DCTSIZE2) {
+            for (int k = 0; k < DCTSIZE2; ++k) {
+              out[i + jpegli::kJPEGNaturalOrder[k]] = in[i + k];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
 boolean jpegli_finish_decompress(j_decompress_ptr cinfo) {
   if (cinfo->global_state != jpegli::kDecProcessScan &&
       cinfo->global_state != jpegli::kDecProcessMarkers) {
@@ -1047,6 +1766,7 @@ void jpegli_set_output_format(j_decompress_ptr cinfo, JpegliDataType data_type,
   switch (data_type) {
     case JPEGLI_TYPE_UINT8:
     case JPEGLI_TYPE_UINT16:
+    case JPEGLI_TYPE_FLOAT16:
     case JPEGLI_TYPE_FLOAT:
       cinfo->master->output_data_type_ = data_type;
       break;
@@ -1067,3 +1787,540 @@ void jpegli_set_output_format(j_decompress_ptr cinfo, JpegliDataType data_type,
       JPEGLI_ERROR("Unsupported endianness %d", endianness);
   }
 }
+
+void jpegli_set_output_row_padding(j_decompress_ptr cinfo, boolean padded) {
+  cinfo->master->output_rows_padded_ = FROM_JXL_BOOL(padded);
+}
+
+void jpegli_set_output_size(j_decompress_ptr cinfo, JDIMENSION width,
+                            JDIMENSION height, JpegliResizeFilter filter) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_set_output_size: unexpected state %d",
+                 cinfo->global_state);
+  }
+  switch (filter) {
+    case JPEGLI_FILTER_BOX:
+    case JPEGLI_FILTER_TRIANGLE:
+    case JPEGLI_FILTER_LANCZOS3:
+      break;
+    default:
+      JPEGLI_ERROR("Unsupported resize filter %d", filter);
+  }
+  if (width == 0 || height == 0) {
+    m->resize_width_ = 0;
+    m->resize_height_ = 0;
+    return;
+  }
+  m->resize_width_ = width;
+  m->resize_height_ = height;
+  m->resize_filter_ = filter;
+}
+
+void jpegli_set_tensor_output(j_decompress_ptr cinfo, size_t plane_stride,
+                              const float* mean, const float* std_dev) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_set_tensor_output: unexpected state %d",
+                 cinfo->global_state);
+  }
+  m->tensor_plane_stride_ = plane_stride;
+  m->tensor_mean_ = mean;
+  m->tensor_std_dev_ = std_dev;
+}
+
+void jpegli_set_decompress_parallel_runner(j_decompress_ptr cinfo,
+                                           JxlParallelRunner runner,
+                                           void* runner_opaque) {
+  cinfo->master->runner = runner;
+  cinfo->master->runner_opaque = runner_opaque;
+}
+
+void jpegli_set_output_row_transform(j_decompress_ptr cinfo,
+                                     JpegliRowTransform transform,
+                                     void* opaque) {
+  cinfo->master->row_transform_ = transform;
+  cinfo->master->row_transform_opaque_ = opaque;
+}
+
+void jpegli_set_dequant_bias_rows(j_decompress_ptr cinfo, int num_rows) {
+  if (num_rows < 0) {
+    JPEGLI_ERROR("jpegli_set_dequant_bias_rows: invalid number of rows %d",
+                 num_rows);
+  }
+  cinfo->master->dequant_bias_rows_ = jpegli::RoundUpTo(num_rows, 4);
+}
+
+void jpegli_set_progressive_band_rows(j_decompress_ptr cinfo, int num_rows) {
+  if (num_rows < 0) {
+    JPEGLI_ERROR("jpegli_set_progressive_band_rows: invalid number of rows %d",
+                 num_rows);
+  }
+  cinfo->master->progressive_band_rows_ = num_rows;
+}
+
+void jpegli_set_decode_speed(j_decompress_ptr cinfo, JpegliDecodeSpeed speed) {
+  if (speed != JPEGLI_DECODE_DEFAULT && speed != JPEGLI_DECODE_FAST) {
+    JPEGLI_ERROR("jpegli_set_decode_speed: invalid speed %d", speed);
+  }
+  const bool fast = speed == JPEGLI_DECODE_FAST;
+  cinfo->dct_method = fast ? JDCT_IFAST : JDCT_DEFAULT;
+  cinfo->do_fancy_upsampling = TO_JXL_BOOL(!fast);
+  cinfo->do_block_smoothing = TO_JXL_BOOL(!fast);
+}
+
+void jpegli_set_destuffed_scans(j_decompress_ptr cinfo, boolean enable) {
+  cinfo->master->destuff_scans_ = FROM_JXL_BOOL(enable);
+}
+
+void jpegli_set_interleaved_coefficients(j_decompress_ptr cinfo,
+                                         boolean enable) {
+  cinfo->master->interleave_coefficients_ = FROM_JXL_BOOL(enable);
+}
+
+void jpegli_set_zigzag_coefficients(j_decompress_ptr cinfo, boolean enable) {
+  cinfo->master->zigzag_coefficients_ = FROM_JXL_BOOL(enable);
+}
+
+void jpegli_set_decode_limits(j_decompress_ptr cinfo, size_t max_pixels,
+                              int max_scans, size_t max_marker_bytes,
+                              size_t max_coeff_memory) {
+  if (max_scans < 0) {
+    JPEGLI_ERROR("jpegli_set_decode_limits: invalid scan limit %d", max_scans);
+  }
+  jpeg_decomp_master* m = cinfo->master;
+  m->max_pixels_ = max_pixels;
+  m->max_scans_ = max_scans;
+  m->max_marker_bytes_ = max_marker_bytes;
+  m->max_coeff_memory_ = max_coeff_memory;
+}
+
+JpegliDecodeLimit jpegli_get_decode_limit_error(j_decompress_ptr cinfo) {
+  return cinfo->master->limit_error_;
+}
+
+void jpegli_get_decode_work(j_decompress_ptr cinfo, JpegliDecodeWork* work) {
+  jpeg_decomp_master* m = cinfo->master;
+  jpegli_memory_stats memory_stats;
+  jpegli::GetMemoryStats(reinterpret_cast<j_common_ptr>(cinfo), &memory_stats);
+  work->num_scans = cinfo->input_scan_number;
+  work->num_mcus = m->num_mcus_decoded_;
+  work->buffered_bytes = m->num_buffered_bytes_;
+  work->num_allocations =
+      memory_stats.total_allocations - m->num_allocations_before_image_;
+}
+
+boolean jpegli_probe(const uint8_t* data, size_t size, JpegliImageInfo* info) {
+  return TO_JXL_BOOL(jpegli::ProbeMarkers(data, size, info));
+}
+
+boolean jpegli_estimate_source_quality(j_decompress_ptr cinfo,
+                                       JpegliSourceQuality* quality) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_estimate_source_quality: unexpected state %d",
+                 cinfo->global_state);
+  }
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    if (cinfo->quant_tbl_ptrs[cinfo->comp_info[c].quant_tbl_no] == nullptr) {
+      return FALSE;
+    }
+  }
+  quality->distance = jpegli::QuantValsToDistance(cinfo);
+  quality->libjpeg_quality = jpegli::QuantValsToLibjpegQuality(
+      cinfo->quant_tbl_ptrs[cinfo->comp_info[0].quant_tbl_no]);
+  quality->bits_per_pixel = 0.0f;
+  // The image ends at the end of the first image of the MPF index, or else at
+  // the last EOI marker of the input buffer.
+  size_t size = 0;
+  if (m->soi_data_ != nullptr) {
+    if (!m->mp_images_.empty() && m->mp_images_[0].data == m->soi_data_) {
+      size = m->mp_images_[0].size;
+    } else {
+      const uint8_t* end =
+          cinfo->src->next_input_byte + cinfo->src->bytes_in_buffer;
+      for (const uint8_t* p = end - 1; p > m->soi_data_; --p) {
+        if (p[-1] == 0xff && p[0] == 0xd9) {
+          size = p + 1 - m->soi_data_;
+          break;
+        }
+      }
+    }
+  }
+  if (size > 0) {
+    const float num_pixels =
+        static_cast<float>(cinfo->image_width) * cinfo->image_height;
+    quality->bits_per_pixel = 8.0f * size / num_pixels;
+  }
+  return TRUE;
+}
+
+boolean jpegli_compute_fingerprint(j_decompress_ptr cinfo,
+                                   JpegliFingerprint* fingerprint) {
+  jpeg_decomp_master* m = cinfo->master;
+  const jpeg_component_info* comp = &cinfo->comp_info[0];
+  const size_t xsize = comp->width_in_blocks;
+  const size_t ysize = comp->height_in_blocks;
+  if (cinfo->global_state == jpegli::kDecHeaderDone) {
+    // Nothing is rendered, so only the DC coefficients have to be decoded.
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      m->dc_only_[c] = true;
+    }
+    m->fingerprint_dc_.resize(xsize * ysize);
+  }
+  if (!m->fingerprint_dc_.empty()) {
+    if (!jpegli_decode_coefficients_streaming(cinfo, jpegli::AddFingerprintRow,
+                                              cinfo)) {
+      return FALSE;
+    }
+    jpegli::ComputeFingerprint(m->fingerprint_dc_.data(), xsize, ysize,
+                               fingerprint);
+    std::vector<float>().swap(m->fingerprint_dc_);
+    return TRUE;
+  }
+  if ((cinfo->global_state != jpegli::kDecProcessScan &&
+       cinfo->global_state != jpegli::kDecProcessMarkers) ||
+      !m->found_eoi_ || m->streaming_mode_ || m->coeff_band_decoding_ ||
+      m->coef_arrays == nullptr) {
+    JPEGLI_ERROR("jpegli_compute_fingerprint: unexpected state %d",
+                 cinfo->global_state);
+  }
+  // The coefficients of the whole image are already decoded.
+  std::vector<float> dc(xsize * ysize);
+  for (size_t by = 0; by < ysize; ++by) {
+    JBLOCKARRAY ba = (*cinfo->mem->access_virt_barray)(
+        reinterpret_cast<j_common_ptr>(cinfo), m->coef_arrays[0], by, 1,
+        FALSE);
+    for (size_t bx = 0; bx < xsize; ++bx) {
+      dc[by * xsize + bx] = ba[0][bx][0];
+    }
+  }
+  jpegli::ComputeFingerprint(dc.data(), xsize, ysize, fingerprint);
+  return TRUE;
+}
+
+void jpegli_get_output_dirty_rows(j_decompress_ptr cinfo,
+                                  JDIMENSION* first_row, JDIMENSION* num_rows) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (!cinfo->buffered_image || cinfo->output_scan_number == 0) {
+    JPEGLI_ERROR("jpegli_get_output_dirty_rows: no output pass was started");
+  }
+  *first_row = m->dirty_rows_begin_;
+  *num_rows = m->dirty_rows_end_ - m->dirty_rows_begin_;
+}
+
+JpegliDecompressTables* jpegli_save_decompress_tables(j_decompress_ptr cinfo) {
+  if (cinfo->global_state != jpegli::kDecStart &&
+      cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_save_decompress_tables: unexpected state %d",
+                 cinfo->global_state);
+  }
+  // Build the Huffman lookup tables once here, so that invalid tables are
+  // reported now and the tables are in the lookup table cache when the
+  // abbreviated images are decoded.
+  std::vector<jpegli::HuffmanTableEntry> huff_lut(jpegli::kJpegHuffmanLutSize);
+  std::vector<int16_t> fast_ac(jpegli::kJpegFastACLutSize);
+  for (int i = 0; i < NUM_HUFF_TBLS; ++i) {
+    if (cinfo->dc_huff_tbl_ptrs[i]) {
+      jpegli::GetHuffmanLookupTable(cinfo, cinfo->dc_huff_tbl_ptrs[i],
+                                    huff_lut.data(), /*fast_ac=*/nullptr);
+    }
+    if (cinfo->ac_huff_tbl_ptrs[i]) {
+      jpegli::GetHuffmanLookupTable(cinfo, cinfo->ac_huff_tbl_ptrs[i],
+                                    huff_lut.data(), fast_ac.data());
+    }
+  }
+  JpegliDecompressTables* tables = new JpegliDecompressTables();
+  for (int i = 0; i < NUM_QUANT_TBLS; ++i) {
+    const JQUANT_TBL* table = cinfo->quant_tbl_ptrs[i];
+    tables->has_quant_tbl[i] = table != nullptr;
+    if (table) tables->quant_tbl[i] = *table;
+  }
+  for (int i = 0; i < NUM_HUFF_TBLS; ++i) {
+    const JHUFF_TBL* dc_table = cinfo->dc_huff_tbl_ptrs[i];
+    const JHUFF_TBL* ac_table = cinfo->ac_huff_tbl_ptrs[i];
+    tables->has_dc_huff_tbl[i] = dc_table != nullptr;
+    tables->has_ac_huff_tbl[i] = ac_table != nullptr;
+    if (dc_table) tables->dc_huff_tbl[i] = *dc_table;
+    if (ac_table) tables->ac_huff_tbl[i] = *ac_table;
+  }
+  return tables;
+}
+
+void jpegli_load_decompress_tables(j_decompress_ptr cinfo,
+                                   const JpegliDecompressTables* tables) {
+  if (cinfo->global_state != jpegli::kDecStart) {
+    JPEGLI_ERROR("jpegli_load_decompress_tables: unexpected state %d",
+                 cinfo->global_state);
+  }
+  if (tables == nullptr) {
+    JPEGLI_ERROR("jpegli_load_decompress_tables: missing tables");
+  }
+  j_common_ptr comptr = reinterpret_cast<j_common_ptr>(cinfo);
+  for (int i = 0; i < NUM_QUANT_TBLS; ++i) {
+    if (!tables->has_quant_tbl[i]) continue;
+    if (cinfo->quant_tbl_ptrs[i] == nullptr) {
+      cinfo->quant_tbl_ptrs[i] = jpegli_alloc_quant_table(comptr);
+    }
+    *cinfo->quant_tbl_ptrs[i] = tables->quant_tbl[i];
+  }
+  for (int i = 0; i < NUM_HUFF_TBLS; ++i) {
+    if (tables->has_dc_huff_tbl[i]) {
+      if (cinfo->dc_huff_tbl_ptrs[i] == nullptr) {
+        cinfo->dc_huff_tbl_ptrs[i] = jpegli_alloc_huff_table(comptr);
+      }
+      *cinfo->dc_huff_tbl_ptrs[i] = tables->dc_huff_tbl[i];
+    }
+    if (tables->has_ac_huff_tbl[i]) {
+      if (cinfo->ac_huff_tbl_ptrs[i] == nullptr) {
+        cinfo->ac_huff_tbl_ptrs[i] = jpegli_alloc_huff_table(comptr);
+      }
+      *cinfo->ac_huff_tbl_ptrs[i] = tables->ac_huff_tbl[i];
+    }
+  }
+}
+
+void jpegli_destroy_decompress_tables(JpegliDecompressTables* tables) {
+  delete tables;
+}
+
+JDIMENSION jpegli_decode_into(j_decompress_ptr cinfo, uint8_t* buffer,
+                              size_t stride) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->raw_data_out) {
+    JPEGLI_ERROR("jpegli_decode_into: raw data output is not supported");
+  }
+  size_t bytes_per_sample = cinfo->quantize_colors
+                                ? 1
+                                : jpegli_bytes_per_sample(m->output_data_type_);
+  // With tensor output only the first channel is stored in the row.
+  size_t row_channels =
+      m->tensor_plane_stride_ != 0 ? 1 : cinfo->output_components;
+  size_t row_size = cinfo->output_width * row_channels * bytes_per_sample;
+  if (stride < row_size) {
+    JPEGLI_ERROR("jpegli_decode_into: stride %" PRIuS " is less than %" PRIuS,
+                 stride, row_size);
+  }
+  if (cinfo->output_scanline >= cinfo->output_height) {
+    return 0;
+  }
+  size_t num_rows = cinfo->output_height - cinfo->output_scanline;
+  std::vector<JSAMPROW> rows(num_rows);
+  for (size_t i = 0; i < num_rows; ++i) {
+    rows[i] = &buffer[(cinfo->output_scanline + i) * stride];
+  }
+  return jpegli_read_scanlines(cinfo, rows.data(), num_rows);
+}
+
+JDIMENSION jpegli_decode_planes(j_decompress_ptr cinfo,
+                                uint8_t* const planes[], const size_t strides[],
+                                JpegliPlaneLayout layout) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->global_state != jpegli::kDecProcessScan &&
+      cinfo->global_state != jpegli::kDecProcessMarkers) {
+    JPEGLI_ERROR("jpegli_decode_planes: unexpected state %d",
+                 cinfo->global_state);
+  }
+  const bool nv12 = layout == JPEGLI_PLANES_NV12;
+  if (nv12) {
+    const jpeg_component_info* comp = cinfo->comp_info;
+    if (!cinfo->raw_data_out || cinfo->num_components != 3 ||
+        comp[1].h_samp_factor != comp[2].h_samp_factor ||
+        comp[1].v_samp_factor != comp[2].v_samp_factor) {
+      JPEGLI_ERROR("NV12 planes need raw data mode and two components with "
+                   "the same sampling");
+    }
+  } else if (layout != JPEGLI_PLANES_SEPARATE) {
+    JPEGLI_ERROR("Unsupported plane layout %d", layout);
+  }
+  if (cinfo->quantize_colors || m->tensor_plane_stride_ != 0) {
+    JPEGLI_ERROR("jpegli_decode_planes: unsupported output mode");
+  }
+  size_t bytes_per_sample = jpegli_bytes_per_sample(m->output_data_type_);
+  const int num_planes =
+      cinfo->raw_data_out ? cinfo->num_components : cinfo->output_components;
+  for (int c = 0; c < num_planes; ++c) {
+    if (nv12 && c == 2) continue;
+    size_t width = cinfo->raw_data_out ? cinfo->comp_info[c].downsampled_width
+                                       : cinfo->output_width;
+    size_t row_size = width * (nv12 && c == 1 ? 2 : 1) * bytes_per_sample;
+    if (strides[c] < row_size) {
+      JPEGLI_ERROR("jpegli_decode_planes: stride %" PRIuS
+                   " of plane %d is less than %" PRIuS,
+                   strides[c], c, row_size);
+    }
+  }
+  const size_t first_scanline =
+      std::min(cinfo->output_scanline, cinfo->output_height);
+  if (cinfo->raw_data_out) {
+    jpegli::ProgressMonitorOutputPass(cinfo);
+    while (cinfo->output_iMCU_row < cinfo->total_iMCU_rows) {
+      if (jpegli::IsInputReady(cinfo)) {
+        jpegli::ProcessRawPlanes(cinfo, planes, strides, layout);
+      } else if (jpegli::ConsumeInput(cinfo) == JPEG_SUSPENDED) {
+        break;
+      }
+    }
+    return std::min(cinfo->output_scanline, cinfo->output_height) -
+           first_scanline;
+  }
+  if (first_scanline >= cinfo->output_height) {
+    return 0;
+  }
+  // The output rows point into the first plane, and the other channels are
+  // written to the same rows of the other planes.
+  size_t num_rows = cinfo->output_height - first_scanline;
+  std::vector<JSAMPROW> rows(num_rows);
+  for (size_t i = 0; i < num_rows; ++i) {
+    rows[i] = &planes[0][(first_scanline + i) * strides[0]];
+  }
+  jpegli::SetOutputPlanes(cinfo, planes, strides);
+  JDIMENSION num_output_rows =
+      jpegli_read_scanlines(cinfo, rows.data(), num_rows);
+  jpegli::SetOutputPlanes(cinfo, nullptr, nullptr);
+  return num_output_rows;
+}
+
+JpegliStepStatus jpegli_decode_step(j_decompress_ptr cinfo, uint8_t* buffer,
+                                    size_t stride, int budget) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->global_state != jpegli::kDecHeaderDone &&
+      cinfo->global_state != jpegli::kDecProcessScan &&
+      cinfo->global_state != jpegli::kDecProcessMarkers) {
+    JPEGLI_ERROR("jpegli_decode_step: unexpected state %d",
+                 cinfo->global_state);
+  }
+  if (cinfo->buffered_image || cinfo->raw_data_out) {
+    JPEGLI_ERROR("jpegli_decode_step: unsupported output mode");
+  }
+  if (budget <= 0) {
+    JPEGLI_ERROR("jpegli_decode_step: invalid budget %d", budget);
+  }
+  // Every function below that runs out of budget reports it as a suspension.
+  const auto suspended = [&]() {
+    JpegliStepStatus status =
+        m->step_budget_ == 0 ? JPEGLI_STEP_YIELD : JPEGLI_STEP_NEED_INPUT;
+    m->step_budget_ = -1;
+    return status;
+  };
+  m->step_budget_ = budget;
+  if (!m->step_output_started_) {
+    if (!jpegli_start_decompress(cinfo)) {
+      return suspended();
+    }
+    m->step_output_started_ = true;
+  }
+  size_t bytes_per_sample = cinfo->quantize_colors
+                                ? 1
+                                : jpegli_bytes_per_sample(m->output_data_type_);
+  // With tensor output only the first channel is stored in the row.
+  size_t row_channels =
+      m->tensor_plane_stride_ != 0 ? 1 : cinfo->output_components;
+  size_t row_size = cinfo->output_width * row_channels * bytes_per_sample;
+  if (stride < row_size) {
+    m->step_budget_ = -1;
+    JPEGLI_ERROR("jpegli_decode_step: stride %" PRIuS " is less than %" PRIuS,
+                 stride, row_size);
+  }
+  // An output iMCU row is one unit of work, as is an input iMCU row.
+  const size_t rows_per_unit =
+      jpegli::DivCeil(cinfo->output_height, cinfo->total_iMCU_rows);
+  std::vector<JSAMPROW> rows;
+  while (cinfo->output_scanline < cinfo->output_height) {
+    if (m->step_budget_ == 0) {
+      return suspended();
+    }
+    size_t num_rows = std::min<size_t>(
+        m->step_budget_ * rows_per_unit,
+        cinfo->output_height - cinfo->output_scanline);
+    rows.resize(num_rows);
+    for (size_t i = 0; i < num_rows; ++i) {
+      rows[i] = &buffer[(cinfo->output_scanline + i) * stride];
+    }
+    size_t num_read = jpegli_read_scanlines(cinfo, rows.data(), num_rows);
+    if (m->step_budget_ > 0) {
+      m->step_budget_ -= std::min<size_t>(
+          m->step_budget_, jpegli::DivCeil(num_read, rows_per_unit));
+    }
+    if (num_read < num_rows) {
+      return suspended();
+    }
+  }
+  if (!jpegli_finish_decompress(cinfo)) {
+    return suspended();
+  }
+  m->step_budget_ = -1;
+  return JPEGLI_STEP_DONE;
+}
+
+void jpegli_decode_region(j_decompress_ptr cinfo, JDIMENSION x, JDIMENSION y,
+                          JDIMENSION width, JDIMENSION height) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_decode_region: unexpected state %d",
+                 cinfo->global_state);
+  }
+  if (width == 0 || height == 0 || x + width > cinfo->image_width ||
+      y + height > cinfo->image_height) {
+    JPEGLI_ERROR("jpegli_decode_region: Invalid arguments");
+  }
+  m->decode_region_ = true;
+  m->region_x0_ = x;
+  m->region_y0_ = y;
+  m->region_x1_ = x + width;
+  m->region_y1_ = y + height;
+}
+
+boolean jpegli_get_restart_index(j_decompress_ptr cinfo, JOCTET** index_data,
+                                 unsigned int* index_len) {
+  if (index_data == nullptr || index_len == nullptr) {
+    JPEGLI_ERROR("jpegli_get_restart_index: invalid output buffer");
+  }
+  jpeg_decomp_master* m = cinfo->master;
+  *index_data = nullptr;
+  *index_len = 0;
+  size_t num_values = 1;
+  bool has_index = false;
+  for (const auto& offsets : m->restart_index_) {
+    num_values += 1 + offsets.size();
+    has_index |= !offsets.empty();
+  }
+  if (!has_index) {
+    return FALSE;
+  }
+  *index_len = num_values * 4;
+  *index_data = static_cast<JOCTET*>(malloc(*index_len));
+  if (*index_data == nullptr) {
+    JPEGLI_ERROR("jpegli_get_restart_index: Out of memory");
+  }
+  uint8_t* p = *index_data;
+  StoreLE32(m->restart_index_.size(), p);
+  p += 4;
+  for (const auto& offsets : m->restart_index_) {
+    StoreLE32(offsets.size(), p);
+    p += 4;
+    for (uint32_t offset : offsets) {
+      StoreLE32(offset, p);
+      p += 4;
+    }
+  }
+  return TRUE;
+}
+
+void jpegli_set_restart_index(j_decompress_ptr cinfo, const JOCTET* index_data,
+                              unsigned int index_len) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->global_state != jpegli::kDecHeaderDone) {
+    JPEGLI_ERROR("jpegli_set_restart_index: unexpected state %d",
+                 cinfo->global_state);
+  }
+  m->restart_index_.clear();
+  std::vector<std::vector<uint32_t>> index;
+  if (!jpegli::ParseRestartIndex(index_data, index_len, &index)) {
+    // The index is only used to speed up decoding, so an invalid one is not
+    // an error, the restart markers of the scans are searched for instead.
+    JPEGLI_WARN("jpegli_set_restart_index: invalid restart index");
+    return;
+  }
+  m->restart_index_ = std::move(index);
+}
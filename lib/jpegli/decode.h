@@ -22,8 +22,10 @@
 #define LIB_JPEGLI_DECODE_H_
 
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/types.h"
 
@@ -43,6 +45,19 @@ void jpegli_stdio_src(j_decompress_ptr cinfo, FILE *infile);
 void jpegli_mem_src(j_decompress_ptr cinfo, const unsigned char *inbuffer,
                     unsigned long insize /* NOLINT */);
 
+// Reads the input from the memory mapped file at path, which is unmapped when
+// cinfo is destroyed or another file is set as source.
+void jpegli_mmap_src(j_decompress_ptr cinfo, const char *path);
+
+// Reads the input from infile like jpegli_stdio_src(), but on a helper thread
+// that fills a ring of num_buffers (at least 2) buffers ahead of the decoder,
+// so that the reads of a slow file, e.g. on a network file system, overlap
+// with the decoding. The file may be read past the end of the image. The
+// thread is stopped when cinfo is destroyed or another file is set as source,
+// and infile must stay open until then.
+void jpegli_readahead_src(j_decompress_ptr cinfo, FILE *infile,
+                          int num_buffers);
+
 int jpegli_read_header(j_decompress_ptr cinfo, boolean require_image);
 
 boolean jpegli_start_decompress(j_decompress_ptr cinfo);
@@ -101,9 +116,371 @@ void jpegli_new_colormap(j_decompress_ptr cinfo);
 // the future.
 //
 
+// Sets the sample type and byte order of the output. The samples of images
+// with 12-bit data precision are scaled to the full range of the output type,
+// so JPEGLI_TYPE_UINT16 or JPEGLI_TYPE_FLOAT keeps all of their precision.
+// JPEGLI_TYPE_FLOAT16 outputs half precision floats in the [0.0, 1.0] range,
+// converted directly from the internal float samples.
 void jpegli_set_output_format(j_decompress_ptr cinfo, JpegliDataType data_type,
                               JpegliEndianness endianness);
 
+// Declares whether the rows passed to jpegli_read_scanlines() and
+// jpegli_decode_into() can be overwritten for JPEGLI_ROW_PADDING bytes past
+// their last pixel, e.g. because their stride is at least that much larger
+// than the row size. The output conversion then stores whole vectors up to the
+// end of each row instead of storing the last pixels through a scratch
+// buffer. It has no effect on raw data, planar or tensor output. The default
+// is FALSE.
+void jpegli_set_output_row_padding(j_decompress_ptr cinfo, boolean padded);
+
+// Sets the parallel runner that is used to decode the restart intervals of a
+// sequential scan on multiple threads. This is done only when the whole scan is
+// available in the input buffer, and the image has restart markers. The
+// coefficients of the whole image are kept in memory in this case. The runner
+// is also used to render the output when the whole output pass is requested
+// at once, e.g. with jpegli_decode_into(). A nullptr runner switches back to
+// single threaded decoding. The decoded output does not depend on the runner.
+void jpegli_set_decompress_parallel_runner(j_decompress_ptr cinfo,
+                                           JxlParallelRunner runner,
+                                           void* runner_opaque);
+
+// Sets a transform that is applied to each output row after the color
+// conversion to the output color space and before the conversion to the output
+// sample type, while the row is still in the cache, e.g. an ICC profile
+// conversion. The transform is not applied to the output of
+// jpegli_read_raw_data() and jpegli_decode_into_planes() with raw planes. A
+// nullptr transform switches it off. Must be called before
+// jpegli_start_decompress().
+void jpegli_set_output_row_transform(j_decompress_ptr cinfo,
+                                     JpegliRowTransform transform,
+                                     void* opaque);
+
+// Decodes the remaining rows of the current output pass into buffer, where
+// output row y starts at buffer + y * stride. This can be used instead of
+// jpegli_read_scanlines() after jpegli_start_decompress() or
+// jpegli_start_output(), and returns the number of decoded rows, which is less
+// than the number of remaining rows only if the data source suspended.
+JDIMENSION jpegli_decode_into(j_decompress_ptr cinfo, uint8_t* buffer,
+                              size_t stride);
+
+// Decodes the remaining rows of the current output pass into planes, with
+// arbitrary strides and without row pointer arrays, instead of
+// jpegli_read_scanlines() or jpegli_read_raw_data() after
+// jpegli_start_decompress(). planes[c] points to the first row of plane c, and
+// strides[c] is the distance between its rows in bytes. In raw data mode
+// (cinfo->raw_data_out), plane c gets the comp_info[c].downsampled_width x
+// downsampled_height samples of component c, without the padding to the block
+// boundaries, e.g. I420 for 4:2:0 YCbCr, and with JPEGLI_PLANES_NV12
+// planes[1] gets the interleaved samples of the second and third components
+// and planes[2] is not used. Otherwise plane c gets channel c of the
+// output_width x output_height output, e.g. planar RGB, which is rendered by
+// the parallel runner as with jpegli_decode_into(). The samples are in the
+// data type of jpegli_set_output_format(). Returns the number of output rows
+// that were decoded, which is less than the number of remaining rows only if
+// the data source suspended; in raw data mode it counts whole iMCU rows.
+// Color quantization and jpegli_set_tensor_output() are not supported.
+JDIMENSION jpegli_decode_planes(j_decompress_ptr cinfo,
+                                uint8_t* const planes[], const size_t strides[],
+                                JpegliPlaneLayout layout);
+
+// Decodes the image in steps, for event loops and coroutines that interleave
+// many images on one thread, with a source manager that may suspend. Must be
+// called after jpegli_read_header() and the setup of the output parameters,
+// instead of jpegli_start_decompress(), jpegli_read_scanlines() and
+// jpegli_finish_decompress(); output row y is written to buffer + y * stride.
+// Each step does at most budget units of work, where the decoding of an iMCU
+// row of a scan, a marker segment and the output of an iMCU row are one unit,
+// and returns JPEGLI_STEP_YIELD when the budget is used up, or
+// JPEGLI_STEP_NEED_INPUT when the source suspended. Returns JPEGLI_STEP_DONE
+// when the image is finished and cinfo is back in its start state, as after
+// jpegli_finish_decompress(). Buffered image mode and raw data output are not
+// supported.
+JpegliStepStatus jpegli_decode_step(j_decompress_ptr cinfo, uint8_t* buffer,
+                                    size_t stride, int budget);
+
+// Restricts the decoding of the image to the given region, in image pixels.
+// Must be called after jpegli_read_header() and before
+// jpegli_start_decompress(). For sequential images with restart markers, when
+// the whole scan is in the input buffer, only the restart intervals that
+// overlap with the region (or the MCUs next to it) are entropy decoded, and the
+// output outside of the region is undefined. The region can be read out with
+// jpegli_crop_scanline() and jpegli_skip_scanlines().
+void jpegli_decode_region(j_decompress_ptr cinfo, JDIMENSION x, JDIMENSION y,
+                          JDIMENSION width, JDIMENSION height);
+
+// Decodes the image resized to exactly width x height output pixels, instead of
+// the size given by scale_num and scale_denom. The smallest scaled inverse DCT
+// whose output is at least the requested size (at most the full size) is used,
+// and its rows are resampled with the given filter while they are rendered, so
+// that only the rows under the vertical filter window are kept in memory. Must
+// be called after jpegli_read_header() and before jpegli_start_decompress(); a
+// zero width or height turns the resizing off. Buffered image mode, raw data
+// output, color quantization and jpegli_crop_scanline() are not supported with
+// a resized output, and jpegli_skip_scanlines() renders the skipped rows.
+void jpegli_set_output_size(j_decompress_ptr cinfo, JDIMENSION width,
+                            JDIMENSION height, JpegliResizeFilter filter);
+
+// Writes the output as planes of normalized samples, e.g. for the NCHW input
+// tensors of neural networks, without an interleaved intermediate. Each
+// output row then holds only the first channel, and channel c of the row is
+// written plane_stride * c bytes after it, so that with a plane_stride of
+// output_height row strides the image is stored one plane per channel. Sample
+// x of channel c in the [0.0, 1.0] range is written as
+// (x - mean[c]) / std_dev[c], where a nullptr mean or std_dev stands for 0.0
+// or 1.0 in all channels. The output format must be JPEGLI_TYPE_FLOAT or
+// JPEGLI_TYPE_FLOAT16. Must be called after jpegli_read_header() and before
+// jpegli_start_decompress(), which reads output_components values from mean
+// and std_dev; a zero plane_stride turns the tensor output off. Can be
+// combined with scaled decoding, jpegli_set_output_size() and
+// jpegli_crop_scanline(), but not with raw data output or color quantization.
+void jpegli_set_tensor_output(j_decompress_ptr cinfo, size_t plane_stride,
+                              const float* mean, const float* std_dev);
+
+// Returns in a newly malloc()-ed buffer the restart index of the image that was
+// built while decoding its scans by restart intervals, i.e. with
+// jpegli_decode_region(), with a parallel runner, or with
+// jpegli_set_progressive_band_rows(). Returns FALSE if no scan of
+// the image was indexed. The index can be stored next to the image and given
+// to jpegli_set_restart_index() when it is decoded again, so that the restart
+// markers do not have to be searched for.
+boolean jpegli_get_restart_index(j_decompress_ptr cinfo, JOCTET** index_data,
+                                 unsigned int* index_len);
+
+// Sets the restart index of the image, as returned by
+// jpegli_get_restart_index(). Must be called after jpegli_read_header() and
+// before jpegli_start_decompress(). An index that does not match the image is
+// ignored. Replaces the index that jpegli_read_header() found at the end of the
+// input buffer, see jpegli_write_restart_index().
+void jpegli_set_restart_index(j_decompress_ptr cinfo, const JOCTET* index_data,
+                              unsigned int index_len);
+
+// Decodes progressive Huffman coded images band by band, with a coefficient
+// buffer of about num_rows iMCU rows instead of one for the whole image. While
+// jpegli_start_decompress() reads the input, the scans are only indexed; then
+// each band of num_rows iMCU rows of the output is decoded from the restart
+// intervals of every scan that overlap with it. This reads the entropy coded
+// data of the scans once per band, so it trades decoding speed for memory. The
+// buffer also holds the rows of the block smoothing context and whole restart
+// intervals of the AC refinement scans, so the memory is only bounded if
+// these scans have restart markers. The output is the same as without bands.
+// This is used only if the whole image up to the EOI marker is in the input
+// buffer at jpegli_start_decompress(), e.g. with jpegli_mem_src(), and not in
+// buffered image mode. An invalid scan is then an error. If set before
+// jpegli_read_header(), the coefficient memory limit of
+// jpegli_set_decode_limits() is checked against the band instead of the whole
+// image. The default 0 turns band decoding off.
+void jpegli_set_progressive_band_rows(j_decompress_ptr cinfo, int num_rows);
+
+// Limits the coefficient statistics that the dequantization biases are
+// computed from to the first num_rows iMCU rows of each output pass, rounded up
+// to a multiple of 4. The biases of these rows are used for the rest of the
+// image, which saves a pass over the coefficients of the other rows. The
+// default 0 means that the biases are updated over the whole image.
+void jpegli_set_dequant_bias_rows(j_decompress_ptr cinfo, int num_rows);
+
+// Selects a decoding speed tier by setting dct_method, do_fancy_upsampling and
+// do_block_smoothing. JPEGLI_DECODE_FAST sets dct_method to JDCT_IFAST, which
+// selects a fixed point inverse DCT without dequantization biases, and turns
+// off fancy upsampling and block smoothing. Since jpegli_read_header() resets
+// these fields, it must be called after jpegli_read_header() and before
+// jpegli_start_decompress().
+void jpegli_set_decode_speed(j_decompress_ptr cinfo, JpegliDecodeSpeed speed);
+
+// Sets whether the sequential Huffman coded scans that are entirely in the
+// input buffer are decoded from a scratch copy of their entropy coded data
+// without the 0xff 0x00 byte stuffing, which saves the bit reader the checks
+// for escape sequences and markers. The restart intervals of such scans are
+// decoded independently, in parallel if a parallel runner is set. This keeps
+// the coefficients of the whole image in memory, even for single scan images
+// without restart markers. Other scans, and scans that are not in the input
+// buffer at once, e.g. with a suspending data source, are decoded as before.
+// Must be called before jpegli_start_decompress(); the default is FALSE.
+void jpegli_set_destuffed_scans(j_decompress_ptr cinfo, boolean enable);
+
+// Sets whether the coefficients of each iMCU row are stored together for all
+// components, instead of in a separate array per component. This makes the
+// interleaved scans and the rendering of an iMCU row work on one contiguous
+// range of memory. The arrays returned by jpegli_read_coefficients() are
+// accessed the same way with either layout. Must be called before
+// jpegli_start_decompress() or jpegli_read_coefficients(); the default is
+// FALSE.
+void jpegli_set_interleaved_coefficients(j_decompress_ptr cinfo,
+                                         boolean enable);
+
+// Sets whether jpegli_read_coefficients() without buffered image mode stores
+// the coefficients of each block in zigzag order, i.e. in the order in which
+// they are coded, instead of the natural order. Passing such arrays to
+// jpegli_write_coefficients() skips the reordering of the coefficients in both
+// the decoder and the encoder, but they can not be used with
+// jpegli_transform_coefficients() and other code that expects the natural
+// order. Must be called before jpegli_read_coefficients(); the default is
+// FALSE.
+void jpegli_set_zigzag_coefficients(j_decompress_ptr cinfo, boolean enable);
+
+// Sets resource limits for decoding untrusted input, each 0 meaning no limit.
+// The decoding fails with an error as soon as a limit is exceeded, before the
+// corresponding allocation or work: max_pixels bounds the image width times
+// height and max_coeff_memory the size of the coefficient buffers of
+// progressive images at the SOF marker, max_scans the number of SOS markers,
+// and max_marker_bytes the total payload size of the markers saved by
+// jpegli_save_markers(). The coefficient buffers of the other images are
+// checked when they are allocated, if they hold the whole image. Must be
+// called before jpegli_read_header(); the limits are kept for the next images.
+void jpegli_set_decode_limits(j_decompress_ptr cinfo, size_t max_pixels,
+                              int max_scans, size_t max_marker_bytes,
+                              size_t max_coeff_memory);
+
+// Returns the limit of jpegli_set_decode_limits() that made the decoding of
+// the current image fail, or JPEGLI_LIMIT_NONE if no limit was exceeded. Can
+// be called from the error handler, or after it returned control to the
+// application.
+JpegliDecodeLimit jpegli_get_decode_limit_error(j_decompress_ptr cinfo);
+
+// Fills in *work with the work done on the current image since
+// jpegli_read_header() started it, which can be compared to the size of the
+// input to find inputs that take disproportionately long to decode, e.g.
+// with many progressive scans or a source that suspends often. Can be called
+// from the error handler.
+void jpegli_get_decode_work(j_decompress_ptr cinfo, JpegliDecodeWork* work);
+
+// If in_place is TRUE, the data of the markers that are saved with
+// jpegli_save_markers() points into the input buffer instead of a copy of the
+// marker payload, when the input is given with jpegli_mem_src() or
+// jpegli_mmap_src(). The marker data must not be modified then, and it is
+// valid only as long as the input buffer, i.e. until the memory mapped file is
+// unmapped. The offset of the payload in the input is marker->data minus the
+// start of the input buffer.
+void jpegli_save_markers_in_place(j_decompress_ptr cinfo, boolean in_place);
+
+// Returns in *data and *size the compressed data of the image with the given
+// index in the Multi-Picture Format (MPF) index of the APP2 marker of the
+// current image, e.g. the gain map of an Ultra HDR image at index 1, without
+// copying it. Index 0 is the current image. Must be called after
+// jpegli_read_header(). The data points into the input buffer, so it is
+// available only when the input is given with jpegli_mem_src() or
+// jpegli_mmap_src() and it is valid as long as the input buffer. The image
+// can be decoded with another decompress object, e.g. at a reduced scale.
+// Returns FALSE if there is no such image or its data is not in the input.
+boolean jpegli_get_mp_image(j_decompress_ptr cinfo, int index,
+                            const JOCTET** data, size_t* size);
+
+// Returns the range of output rows of the current output pass of the buffered
+// image mode that may differ from the output of the previous output pass, i.e.
+// the rows whose coefficients, or the coefficients that they depend on, were
+// decoded since the start of the previous output pass. Must be called after
+// jpegli_start_output(). The other rows are the same as in the previous output
+// pass, so they can be skipped with jpegli_skip_scanlines() and the pass can be
+// finished early with jpegli_finish_output(). In the first output pass, and if
+// the output parameters or the color quantization may change the output, all
+// the rows are reported.
+void jpegli_get_output_dirty_rows(j_decompress_ptr cinfo,
+                                  JDIMENSION* first_row, JDIMENSION* num_rows);
+
+// Reads the image properties from the markers at the start of the JPEG data,
+// without a decompress object and without allocating memory. Only the SOF
+// marker segment is parsed, the other marker segments before the first SOS
+// marker are skipped, except that the Exif and ICC profile APP markers are
+// recorded. Returns TRUE if the data has an SOF marker of an image that
+// jpegli can decode, before any SOS marker and within size bytes.
+boolean jpegli_probe(const uint8_t* data, size_t size, JpegliImageInfo* info);
+
+// Copies the quantized DCT coefficients returned by jpegli_read_coefficients()
+// into one contiguous array of layout->num_coeffs values, e.g. for an inverse
+// DCT and color conversion on a GPU that only needs the entropy decoding of
+// jpegli, and fills in *layout with the offsets of the components, their
+// sampling factors and their quantization tables. The blocks are in zigzag
+// order if zigzag is TRUE, otherwise in the natural order. If coeffs is
+// nullptr, only *layout is filled in, e.g. to allocate the array. Must be
+// called after jpegli_read_coefficients() returned the coefficients and
+// before jpegli_finish_decompress().
+void jpegli_export_coefficients(j_decompress_ptr cinfo, boolean zigzag,
+                                JpegliCoefficientLayout* layout,
+                                JCOEF* coeffs);
+
+// Called by jpegli_decode_coefficients_streaming() with the quantized DCT
+// coefficients of iMCU row imcu_row: blocks[c][iy][bx] is the block at column
+// bx and block row imcu_row * v_samp_factor + iy of component c, for iy less
+// than num_block_rows[c]. The blocks are only valid during the call.
+typedef void (*JpegliCoefficientRowCallback)(void* opaque,
+                                             JDIMENSION imcu_row,
+                                             JBLOCKARRAY blocks[],
+                                             const int num_block_rows[]);
+
+// Decodes the coefficients of the image and passes each iMCU row of them to
+// callback once it is complete, in top to bottom order, e.g. for an analysis
+// that does not need the whole image at once. Single-scan images are decoded
+// with a buffer of one iMCU row, which is reused for the next row after the
+// callback returns; images with multiple scans are read with
+// jpegli_read_coefficients() first. The blocks are in zigzag order if
+// jpegli_set_zigzag_coefficients() was enabled, otherwise in the natural
+// order. Must be called after jpegli_read_header() instead of
+// jpegli_start_decompress() or jpegli_read_coefficients(), without buffered
+// image mode, and followed by jpegli_finish_decompress(). Returns FALSE if the
+// source suspended, in which case it can be called again with more input.
+boolean jpegli_decode_coefficients_streaming(
+    j_decompress_ptr cinfo, JpegliCoefficientRowCallback callback,
+    void* opaque);
+
+// Estimates the quality of the image from its quantization tables and its
+// compressed size, without decoding any scan, e.g. to decide whether the image
+// is worth re-encoding. Must be called after jpegli_read_header() and before
+// jpegli_start_decompress(). Returns FALSE if the quantization table of a
+// component is not defined before the first scan.
+boolean jpegli_estimate_source_quality(j_decompress_ptr cinfo,
+                                       JpegliSourceQuality* quality);
+
+// Computes perceptual hashes of the image from the DC coefficients of its
+// first component, i.e. from its luma at 1/8 scale, like the pHash of the
+// decoded image but without the inverse DCT, the upsampling and the color
+// conversion, e.g. to find duplicates of an image. If it is called after
+// jpegli_read_header(), only the DC coefficients are decoded, the AC scans of
+// progressive images are skipped, and it must be followed by
+// jpegli_finish_decompress() or jpegli_abort_decompress(). It can also be
+// called after jpegli_read_coefficients() returned the coefficients, or after
+// jpegli_start_decompress() of an image with multiple scans without buffered
+// image mode, to hash the coefficients of that decoding. Returns FALSE if the
+// source suspended, in which case it can be called again with more input.
+boolean jpegli_compute_fingerprint(j_decompress_ptr cinfo,
+                                   JpegliFingerprint* fingerprint);
+
+// Returns the number of bits that differ between the 64-bit hashes of a and
+// b, or between their 256-bit hashes if long_hash is TRUE.
+int jpegli_fingerprint_distance(const JpegliFingerprint* a,
+                                const JpegliFingerprint* b,
+                                boolean long_hash);
+
+// Returns a new copy of the quantization and Huffman tables that are currently
+// defined in cinfo, e.g. after reading a tables-only stream with
+// jpegli_read_header(cinfo, FALSE). The returned object is not modified by the
+// decoder, so it can be loaded into any number of decompress objects, also on
+// different threads, and must be freed with jpegli_destroy_decompress_tables().
+JpegliDecompressTables* jpegli_save_decompress_tables(j_decompress_ptr cinfo);
+
+// Defines the tables of the saved table set in cinfo, as if the tables-only
+// stream that they were read from was read by cinfo, so that abbreviated
+// images can be decoded without parsing the tables again. Must be called
+// before jpegli_read_header(). Tables that are not in the set are unchanged.
+void jpegli_load_decompress_tables(j_decompress_ptr cinfo,
+                                   const JpegliDecompressTables* tables);
+
+void jpegli_destroy_decompress_tables(JpegliDecompressTables* tables);
+
+// Decompresses num_images images with the output parameters of cinfo, e.g. a
+// set of avatars or map tiles, without setting up a decompressor for each of
+// them. The output color space (if not JCS_UNKNOWN), scaling, DCT method,
+// upsampling and block smoothing options, output format and dequantization
+// bias rows of cinfo are applied to every image, and the tables that are
+// defined in cinfo are loaded before each header is read, so that abbreviated
+// images can be decoded. The ith image is decoded into images[i].pixels.
+// Color quantization, raw data and buffered image output are not supported.
+// The images are decoded by worker decompressors that are kept for later
+// batches and reuse their buffers between images; with a parallel runner, the
+// images are spread over its threads, one worker per thread, starting with the
+// largest ones. cinfo must be in its start state, where it stays. If an image
+// fails, its error is reported on cinfo and the other outputs are undefined.
+void jpegli_decode_batch(j_decompress_ptr cinfo, JpegliBatchImage* images,
+                         size_t num_images);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -5,6 +5,7 @@
 // https://developers.google.com/open-source/licenses/bsd
 
 #include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -21,6 +22,7 @@
 #include "lib/jpegli/decode.h"
 #include "lib/jpegli/encode.h"
 #include "lib/jpegli/libjpeg_test_util.h"
+#include "lib/jpegli/stage_stats.h"
 #include "lib/jpegli/test_params.h"
 #include "lib/jpegli/test_utils.h"
 #include "lib/jpegli/testing.h"
@@ -246,10 +248,23 @@ jxl::StatusOr<std::vector<uint8_t>> GetTestJpegData(TestConfig& config) {
   return compressed;
 }
 
+void SetParallelRunner(const DecompressParams& dparams,
+                       j_decompress_ptr cinfo) {
+  if (dparams.num_threads > 0) {
+    jpegli_set_decompress_parallel_runner(
+        cinfo, &TestParallelRunner,
+        const_cast<void*>(static_cast<const void*>(&dparams.num_threads)));
+  } else {
+    jpegli_set_decompress_parallel_runner(cinfo, nullptr, nullptr);
+  }
+}
+
 void TestAPINonBuffered(const CompressParams& jparams,
                         const DecompressParams& dparams,
                         const TestImage& expected_output,
                         j_decompress_ptr cinfo, TestImage* output) {
+  SetParallelRunner(dparams, cinfo);
+  jpegli_set_destuffed_scans(cinfo, TO_JXL_BOOL(dparams.destuffed_scans));
   if (jparams.add_marker) {
     jpegli_save_markers(cinfo, kSpecialMarker0, 0xffff);
     jpegli_save_markers(cinfo, kSpecialMarker1, 0xffff);
@@ -304,6 +319,8 @@ void TestAPINonBuffered(const CompressParams& jparams,
 void TestAPIBuffered(const CompressParams& jparams,
                      const DecompressParams& dparams, j_decompress_ptr cinfo,
                      std::vector<TestImage>* output_progression) {
+  SetParallelRunner(dparams, cinfo);
+  jpegli_set_destuffed_scans(cinfo, TO_JXL_BOOL(dparams.destuffed_scans));
   EXPECT_EQ(JPEG_REACHED_SOS,
             jpegli_read_header(cinfo, /*require_image=*/TRUE));
   cinfo->buffered_image = TRUE;
@@ -435,168 +452,2245 @@ TEST(DecodeAPITest, ReuseCinfo) {
         }
       }
     }
-    return true;
-  };
-  ASSERT_TRUE(try_catch_block());
-  jpegli_destroy_decompress(&cinfo);
+    return true;
+  };
+  ASSERT_TRUE(try_catch_block());
+  jpegli_destroy_decompress(&cinfo);
+}
+
+std::vector<TestConfig> GenerateBasicConfigs() {
+  std::vector<TestConfig> all_configs;
+  for (int samp : {1, 2}) {
+    for (int progr : {0, 2}) {
+      TestConfig config;
+      config.input.xsize = 257 + samp * 37;
+      config.input.ysize = 265 + (progr / 2) * 17;
+      config.jparams.h_sampling = {samp, 1, 1};
+      config.jparams.v_sampling = {samp, 1, 1};
+      config.jparams.progressive_mode = progr;
+      GeneratePixels(&config.input);
+      all_configs.push_back(config);
+    }
+  }
+  return all_configs;
+}
+
+TEST(DecodeAPITest, ReuseCinfoSameMemSource) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  uint8_t* buffer = nullptr;
+  unsigned long buffer_size = 0;  // NOLINT
+  {
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      for (const TestConfig& config : all_configs) {
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+  }
+  std::vector<TestImage> all_outputs(all_configs.size());
+  {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, buffer, buffer_size);
+      for (size_t i = 0; i < all_configs.size(); ++i) {
+        TestAPINonBuffered(all_configs[i].jparams, DecompressParams(),
+                           all_configs[i].input, &cinfo, &all_outputs[i]);
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+  for (size_t i = 0; i < all_configs.size(); ++i) {
+    VerifyOutputImage(all_configs[i].input, all_outputs[i], 2.35f);
+  }
+  if (buffer) free(buffer);
+}
+
+TEST(DecodeAPITest, MemoryLimit) {
+  TestConfig config;
+  config.input.xsize = 1024;
+  config.input.ysize = 768;
+  config.jparams.h_sampling = {1, 1, 1};
+  config.jparams.v_sampling = {1, 1, 1};
+  config.jparams.progressive_mode = 2;
+  GeneratePixels(&config.input);
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+  for (JpegIOMode output_mode : {PIXELS, COEFFICIENTS}) {
+    DecompressParams dparams;
+    dparams.output_mode = output_mode;
+    TestImage output[2];
+    for (int i = 0; i < 2; ++i) {
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        if (i == 1) {
+          // Smaller than the coefficient buffer, which is then stored in a
+          // temporary file instead.
+          cinfo.mem->max_memory_to_use = 3 << 20;
+        }
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        TestAPINonBuffered(config.jparams, dparams, config.input, &cinfo,
+                           &output[i]);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+    EXPECT_EQ(output[0].pixels, output[1].pixels);
+    EXPECT_EQ(output[0].coeffs, output[1].coeffs);
+  }
+}
+
+TEST(DecodeAPITest, HugePages) {
+  TestConfig config;
+  // Large enough for coefficient buffers of more than a huge page.
+  config.input.xsize = 2048;
+  config.input.ysize = 1536;
+  config.input.AllocatePixels();
+  for (size_t i = 0; i < config.input.pixels.size(); ++i) {
+    config.input.pixels[i] = (i * 7 + (i >> 13) * 3) & 0xff;
+  }
+  config.jparams.progressive_mode = 2;
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+  for (JpegIOMode output_mode : {PIXELS, COEFFICIENTS}) {
+    DecompressParams dparams;
+    dparams.output_mode = output_mode;
+    TestImage output[2];
+    for (int i = 0; i < 2; ++i) {
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_use_huge_pages(reinterpret_cast<j_common_ptr>(&cinfo), i);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        TestAPINonBuffered(config.jparams, dparams, config.input, &cinfo,
+                           &output[i]);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+    EXPECT_EQ(output[0].pixels, output[1].pixels);
+    EXPECT_EQ(output[0].coeffs, output[1].coeffs);
+  }
+}
+
+TEST(DecodeAPITest, EstimateMemory) {
+  std::vector<TestConfig> all_configs;
+  for (int samp : {1, 2}) {
+    for (int progr : {0, 2}) {
+      TestConfig config;
+      config.input.xsize = 1024;
+      config.input.ysize = 768;
+      config.jparams.h_sampling = {samp, 1, 1};
+      config.jparams.v_sampling = {samp, 1, 1};
+      config.jparams.progressive_mode = progr;
+      GeneratePixels(&config.input);
+      all_configs.push_back(config);
+    }
+  }
+  for (const TestConfig& config : all_configs) {
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      j_common_ptr comptr = reinterpret_cast<j_common_ptr>(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      TestImage output;
+      TestAPINonBuffered(config.jparams, DecompressParams(), config.input,
+                         &cinfo, &output);
+      jpegli_memory_stats stats;
+      jpegli_get_memory_stats(comptr, &stats);
+      EXPECT_EQ(0, stats.pools[JPOOL_IMAGE].current_bytes);
+      size_t peak = stats.current_bytes + stats.pools[JPOOL_IMAGE].peak_bytes;
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, TRUE);
+      size_t estimate = jpegli_estimate_memory(comptr);
+      EXPECT_LE(peak / 2, estimate);
+      EXPECT_LE(estimate, 2 * peak);
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+}
+
+#if JPEGLI_ENABLE_STAGE_STATS
+TEST(DecodeAPITest, StageStats) {
+  for (const TestConfig& config : GenerateBasicConfigs()) {
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      j_common_ptr comptr = reinterpret_cast<j_common_ptr>(&cinfo);
+      jpegli_enable_stage_stats(comptr, TRUE);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      TestImage output;
+      TestAPINonBuffered(config.jparams, DecompressParams(), config.input,
+                         &cinfo, &output);
+      jpegli_stage_stats stats;
+      jpegli_get_stage_stats(comptr, &stats);
+      const size_t* calls = stats.num_calls;
+      EXPECT_LT(0, calls[JPEGLI_STAGE_PROCESS_MARKERS]);
+      EXPECT_LT(0, calls[JPEGLI_STAGE_PROCESS_SCAN]);
+      EXPECT_EQ(cinfo.total_iMCU_rows, calls[JPEGLI_STAGE_IDCT]);
+      EXPECT_LT(0, calls[JPEGLI_STAGE_UPSAMPLE]);
+      EXPECT_LT(0, calls[JPEGLI_STAGE_WRITE_OUTPUT]);
+      EXPECT_EQ(0, calls[JPEGLI_STAGE_PARALLEL_RENDER]);
+      for (int i = 0; i < JPEGLI_STAGE_PROCESS_MARKERS; ++i) {
+        EXPECT_EQ(0, calls[i]);
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+}
+
+TEST(DecodeAPITest, StageCounters) {
+  TestConfig config;
+  config.input.xsize = 256;
+  config.input.ysize = 128;
+  GeneratePixels(&config.input);
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    j_common_ptr comptr = reinterpret_cast<j_common_ptr>(&cinfo);
+    jpegli_enable_stage_stats(comptr, TRUE);
+    // The counters are not available in every test environment.
+    const bool has_counters = jpegli_enable_stage_counters(comptr, TRUE);
+    jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+    TestImage output;
+    TestAPINonBuffered(config.jparams, DecompressParams(), config.input,
+                       &cinfo, &output);
+    jpegli_stage_stats stats;
+    jpegli_get_stage_stats(comptr, &stats);
+    for (int i = 0; i < JPEGLI_NUM_STAGES; ++i) {
+      if (!has_counters || stats.num_calls[i] == 0) {
+        EXPECT_EQ(0.0, stats.instructions[i]);
+        EXPECT_EQ(0.0, stats.cache_misses[i]);
+        EXPECT_EQ(0.0, stats.branch_misses[i]);
+      }
+    }
+    if (has_counters) {
+      EXPECT_LT(0.0, stats.instructions[JPEGLI_STAGE_PROCESS_SCAN]);
+      EXPECT_LT(0.0, stats.instructions[JPEGLI_STAGE_IDCT]);
+    }
+    EXPECT_TRUE(jpegli_enable_stage_counters(comptr, FALSE));
+    return true;
+  };
+  EXPECT_TRUE(try_catch_block());
+  jpegli_destroy_decompress(&cinfo);
+}
+#endif  // JPEGLI_ENABLE_STAGE_STATS
+
+TEST(DecodeAPITest, ReuseCinfoSameStdSource) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  FILE* tmpf = tmpfile();
+  ASSERT_TRUE(tmpf);
+  {
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_stdio_dest(&cinfo, tmpf);
+      for (const TestConfig& config : all_configs) {
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+  }
+  fseek(tmpf, 0, SEEK_SET);
+  std::vector<TestImage> all_outputs(all_configs.size());
+  {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_stdio_src(&cinfo, tmpf);
+      for (size_t i = 0; i < all_configs.size(); ++i) {
+        TestAPINonBuffered(all_configs[i].jparams, DecompressParams(),
+                           all_configs[i].input, &cinfo, &all_outputs[i]);
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+  for (size_t i = 0; i < all_configs.size(); ++i) {
+    VerifyOutputImage(all_configs[i].input, all_outputs[i], 2.35f);
+  }
+  fclose(tmpf);
+}
+
+TEST(DecodeAPITest, AbbreviatedStreams) {
+  uint8_t* table_stream = nullptr;
+  unsigned long table_stream_size = 0;  // NOLINT
+  uint8_t* data_stream = nullptr;
+  unsigned long data_stream_size = 0;  // NOLINT
+  {
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_mem_dest(&cinfo, &table_stream, &table_stream_size);
+      cinfo.input_components = 3;
+      cinfo.in_color_space = JCS_RGB;
+      jpegli_set_defaults(&cinfo);
+      jpegli_write_tables(&cinfo);
+      jpegli_mem_dest(&cinfo, &data_stream, &data_stream_size);
+      cinfo.image_width = 1;
+      cinfo.image_height = 1;
+      cinfo.optimize_coding = FALSE;
+      jpegli_set_progressive_level(&cinfo, 0);
+      jpegli_start_compress(&cinfo, FALSE);
+      JSAMPLE image[3] = {0};
+      JSAMPROW row[] = {image};
+      jpegli_write_scanlines(&cinfo, row, 1);
+      jpegli_finish_compress(&cinfo);
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    EXPECT_LT(data_stream_size, 50);
+    jpegli_destroy_compress(&cinfo);
+  }
+  {
+    jpeg_decompress_struct cinfo = {};
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, table_stream, table_stream_size);
+      jpegli_read_header(&cinfo, FALSE);
+      jpegli_mem_src(&cinfo, data_stream, data_stream_size);
+      jpegli_read_header(&cinfo, TRUE);
+      EXPECT_EQ(1, cinfo.image_width);
+      EXPECT_EQ(1, cinfo.image_height);
+      EXPECT_EQ(3, cinfo.num_components);
+      jpegli_start_decompress(&cinfo);
+      JSAMPLE image[3] = {0};
+      JSAMPROW row[] = {image};
+      jpegli_read_scanlines(&cinfo, row, 1);
+      EXPECT_EQ(0, image[0]);
+      EXPECT_EQ(0, image[1]);
+      EXPECT_EQ(0, image[2]);
+      jpegli_finish_decompress(&cinfo);
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+  if (table_stream) free(table_stream);
+  if (data_stream) free(data_stream);
+}
+
+TEST(DecodeAPITest, AbbreviatedStreamsWithSavedTables) {
+  uint8_t* table_stream = nullptr;
+  unsigned long table_stream_size = 0;  // NOLINT
+  uint8_t* data_stream = nullptr;
+  unsigned long data_stream_size = 0;  // NOLINT
+  {
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_mem_dest(&cinfo, &table_stream, &table_stream_size);
+      cinfo.input_components = 3;
+      cinfo.in_color_space = JCS_RGB;
+      jpegli_set_defaults(&cinfo);
+      jpegli_write_tables(&cinfo);
+      jpegli_mem_dest(&cinfo, &data_stream, &data_stream_size);
+      cinfo.image_width = 2;
+      cinfo.image_height = 1;
+      cinfo.optimize_coding = FALSE;
+      jpegli_set_progressive_level(&cinfo, 0);
+      jpegli_start_compress(&cinfo, FALSE);
+      JSAMPLE image[6] = {0, 0, 0, 255, 255, 255};
+      JSAMPROW row[] = {image};
+      jpegli_write_scanlines(&cinfo, row, 1);
+      jpegli_finish_compress(&cinfo);
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+  }
+  JpegliDecompressTables* tables = nullptr;
+  {
+    jpeg_decompress_struct cinfo = {};
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, table_stream, table_stream_size);
+      EXPECT_EQ(JPEG_HEADER_TABLES_ONLY, jpegli_read_header(&cinfo, FALSE));
+      tables = jpegli_save_decompress_tables(&cinfo);
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+  ASSERT_TRUE(tables != nullptr);
+  // The saved tables outlive the decompress object that they were read with,
+  // and can be used by any number of other ones.
+  for (int i = 0; i < 2; ++i) {
+    jpeg_decompress_struct cinfo = {};
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_load_decompress_tables(&cinfo, tables);
+      jpegli_mem_src(&cinfo, data_stream, data_stream_size);
+      jpegli_read_header(&cinfo, TRUE);
+      EXPECT_EQ(2, cinfo.image_width);
+      EXPECT_EQ(1, cinfo.image_height);
+      EXPECT_EQ(3, cinfo.num_components);
+      jpegli_start_decompress(&cinfo);
+      JSAMPLE image[6] = {0};
+      JSAMPROW row[] = {image};
+      jpegli_read_scanlines(&cinfo, row, 1);
+      EXPECT_NEAR(0, image[0], 2);
+      EXPECT_NEAR(255, image[5], 2);
+      jpegli_finish_decompress(&cinfo);
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+  {
+    // Without the tables the abbreviated image can not be decoded.
+    jpeg_decompress_struct cinfo = {};
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, data_stream, data_stream_size);
+      jpegli_read_header(&cinfo, TRUE);
+      jpegli_start_decompress(&cinfo);
+      JSAMPLE image[6] = {0};
+      JSAMPROW row[] = {image};
+      jpegli_read_scanlines(&cinfo, row, 1);
+      return true;
+    };
+    EXPECT_FALSE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+  jpegli_destroy_decompress_tables(tables);
+  if (table_stream) free(table_stream);
+  if (data_stream) free(data_stream);
+}
+
+TEST(DecodeAPITest, BufferedOutputDirtyRows) {
+  TestConfig config;
+  config.input.xsize = 64;
+  config.input.ysize = 256;
+  config.jparams.h_sampling = {1, 1, 1};
+  config.jparams.v_sampling = {1, 1, 1};
+  config.jparams.progressive_mode = 2;
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  jpeg_decompress_struct cinfo;
+  std::vector<uint8_t> outputs[2];
+  JDIMENSION first_row = 0;
+  JDIMENSION num_rows = 0;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+    EXPECT_EQ(JPEG_REACHED_SOS, jpegli_read_header(&cinfo, TRUE));
+    cinfo.buffered_image = TRUE;
+    jpegli_set_dequant_bias_rows(&cinfo, 4);
+    EXPECT_TRUE(jpegli_start_decompress(&cinfo));
+    const size_t stride = cinfo.output_width * cinfo.output_components;
+    for (size_t pass = 0; pass < 2; ++pass) {
+      // Stop the input in the middle of the second scan, and render the
+      // first scan with the coefficients decoded so far.
+      const JDIMENSION input_row = pass == 0 ? 12 : 16;
+      while (cinfo.input_scan_number < 2 || cinfo.input_iMCU_row < input_row) {
+        JPEGLI_TEST_ENSURE_TRUE(jpegli_consume_input(&cinfo) !=
+                                JPEG_REACHED_EOI);
+      }
+      EXPECT_TRUE(jpegli_start_output(&cinfo, 1));
+      jpegli_get_output_dirty_rows(&cinfo, &first_row, &num_rows);
+      if (pass == 0) {
+        EXPECT_EQ(0, first_row);
+        EXPECT_EQ(cinfo.output_height, num_rows);
+      }
+      outputs[pass].resize(cinfo.output_height * stride);
+      while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &outputs[pass][cinfo.output_scanline * stride];
+        JPEGLI_TEST_ENSURE_TRUE(jpegli_read_scanlines(&cinfo, &row, 1) == 1);
+      }
+      EXPECT_TRUE(jpegli_finish_output(&cinfo));
+    }
+    EXPECT_TRUE(jpegli_finish_decompress(&cinfo));
+    return true;
+  };
+  ASSERT_TRUE(try_catch_block());
+  jpegli_destroy_decompress(&cinfo);
+  // Only the rows around the newly decoded iMCU rows are reported.
+  EXPECT_LT(0, first_row);
+  EXPECT_LT(first_row + num_rows, config.input.ysize);
+  const size_t stride = config.input.xsize * 3;
+  for (size_t y = 0; y < config.input.ysize; ++y) {
+    if (y >= first_row && y < first_row + num_rows) continue;
+    EXPECT_EQ(0, memcmp(&outputs[0][y * stride], &outputs[1][y * stride],
+                        stride))
+        << "y = " << y;
+  }
+}
+
+TEST(DecodeAPITest, SaveMarkersInPlace) {
+  TestConfig config;
+  config.input.xsize = 16;
+  config.input.ysize = 16;
+  config.jparams.add_marker = true;
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  const uint8_t* begin = compressed.data();
+  const uint8_t* end = begin + compressed.size();
+  for (boolean in_place : {FALSE, TRUE}) {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_save_markers(&cinfo, kSpecialMarker0, 0xffff);
+      jpegli_save_markers(&cinfo, kSpecialMarker1, 0xffff);
+      jpegli_save_markers_in_place(&cinfo, in_place);
+      jpegli_read_header(&cinfo, TRUE);
+      size_t num_markers = 0;
+      for (jpeg_saved_marker_ptr marker = cinfo.marker_list; marker;
+           marker = marker->next) {
+        ++num_markers;
+        EXPECT_EQ(sizeof(kMarkerData), marker->data_length);
+        EXPECT_EQ(0, memcmp(marker->data, kMarkerData, sizeof(kMarkerData)));
+        bool is_in_input = marker->data >= begin && marker->data < end;
+        EXPECT_EQ(FROM_JXL_BOOL(in_place), is_in_input);
+      }
+      EXPECT_EQ(2, num_markers);
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+}
+
+TEST(DecodeAPITest, GainMap) {
+  TestConfig gain_map_config;
+  gain_map_config.input.xsize = 34;
+  gain_map_config.input.ysize = 22;
+  gain_map_config.input.color_space = JCS_GRAYSCALE;
+  gain_map_config.input.components = 1;
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> gain_map,
+                     GetTestJpegData(gain_map_config),
+                     "Failed to create test data.");
+  for (int progressive_mode : {0, 2}) {
+    for (bool add_marker : {false, true}) {
+      TestConfig config;
+      config.input.xsize = 67;
+      config.input.ysize = 43;
+      config.jparams.progressive_mode = progressive_mode;
+      config.jparams.optimize_coding = 0;
+      config.jparams.add_marker = add_marker;
+      GeneratePixels(&config.input);
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      jpeg_compress_struct cinfo;
+      jpegli_encode_stats stats;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        jpegli_set_gain_map(&cinfo, gain_map.data(), gain_map.size());
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+        jpegli_get_encode_stats(&cinfo, &stats);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_compress(&cinfo);
+      std::vector<uint8_t> compressed(buffer, buffer + buffer_size);
+      free(buffer);
+      const size_t image_size = compressed.size() - gain_map.size();
+      EXPECT_EQ(image_size, stats.total_bytes);
+      EXPECT_EQ(0, memcmp(&compressed[image_size], gain_map.data(),
+                          gain_map.size()));
+
+      // The primary image is decoded as usual, and its MPF index points to
+      // itself and to the gain map in the input buffer.
+      TestImage output;
+      DecodeWithLibjpeg(config.jparams, DecompressParams(), compressed,
+                        &output);
+      VerifyOutputImage(config.input, output, 2.35);
+      jpeg_decompress_struct dinfo;
+      const auto try_catch_block_dec = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&dinfo);
+        jpegli_mem_src(&dinfo, compressed.data(), compressed.size());
+        jpegli_read_header(&dinfo, /*require_image=*/TRUE);
+        const JOCTET* data;
+        size_t size;
+        EXPECT_TRUE(jpegli_get_mp_image(&dinfo, 0, &data, &size));
+        EXPECT_EQ(compressed.data(), data);
+        EXPECT_EQ(image_size, size);
+        EXPECT_TRUE(jpegli_get_mp_image(&dinfo, 1, &data, &size));
+        EXPECT_EQ(&compressed[image_size], data);
+        EXPECT_EQ(gain_map.size(), size);
+        EXPECT_FALSE(jpegli_get_mp_image(&dinfo, 2, &data, &size));
+        jpegli_abort_decompress(&dinfo);
+        // The gain map can be decoded at a reduced scale.
+        jpegli_mem_src(&dinfo, &compressed[image_size], gain_map.size());
+        jpegli_read_header(&dinfo, /*require_image=*/TRUE);
+        EXPECT_FALSE(jpegli_get_mp_image(&dinfo, 0, &data, &size));
+        dinfo.scale_denom = 2;
+        jpegli_start_decompress(&dinfo);
+        EXPECT_EQ(17, dinfo.output_width);
+        EXPECT_EQ(11, dinfo.output_height);
+        std::vector<uint8_t> row(dinfo.output_width);
+        JSAMPROW rows[] = {row.data()};
+        while (dinfo.output_scanline < dinfo.output_height) {
+          jpegli_read_scanlines(&dinfo, rows, 1);
+        }
+        jpegli_finish_decompress(&dinfo);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block_dec());
+      jpegli_destroy_decompress(&dinfo);
+    }
+  }
+}
+
+TEST(DecodeAPITest, DecodeInto) {
+  TestConfig config;
+  config.input.xsize = 517;
+  config.input.ysize = 523;
+  config.jparams.h_sampling = {2, 1, 1};
+  config.jparams.v_sampling = {2, 1, 1};
+  config.jparams.restart_in_rows = 1;
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  for (JpegliDataType data_type : {JPEGLI_TYPE_UINT8, JPEGLI_TYPE_UINT16}) {
+    DecompressParams dparams;
+    dparams.data_type = data_type;
+    TestImage expected;
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      TestAPINonBuffered(config.jparams, dparams, config.input, &cinfo,
+                         &expected);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    size_t row_size = expected.xsize * expected.components *
+                      jpegli_bytes_per_sample(data_type);
+    // Use an odd padding to have unaligned destination rows.
+    size_t stride = row_size + 13;
+    for (size_t num_threads : {0, 3}) {
+      dparams.num_threads = num_threads;
+      std::vector<uint8_t> output(expected.ysize * stride);
+      const auto try_catch_block2 = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        SetParallelRunner(dparams, &cinfo);
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        jpegli_set_output_format(&cinfo, data_type, JPEGLI_NATIVE_ENDIAN);
+        jpegli_start_decompress(&cinfo);
+        EXPECT_EQ(cinfo.output_height,
+                  jpegli_decode_into(&cinfo, output.data(), stride));
+        jpegli_finish_decompress(&cinfo);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block2());
+      for (size_t y = 0; y < expected.ysize; ++y) {
+        ASSERT_EQ(0, memcmp(&expected.pixels[y * row_size], &output[y * stride],
+                            row_size));
+      }
+    }
+    jpegli_destroy_decompress(&cinfo);
+  }
+}
+
+TEST(DecodeAPITest, OutputRowPadding) {
+  TestConfig config;
+  config.input.xsize = 131;
+  config.input.ysize = 37;
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  for (JpegliDataType data_type :
+       {JPEGLI_TYPE_UINT8, JPEGLI_TYPE_UINT16, JPEGLI_TYPE_FLOAT}) {
+    DecompressParams dparams;
+    dparams.data_type = data_type;
+    TestImage expected;
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      TestAPINonBuffered(config.jparams, dparams, config.input, &cinfo,
+                         &expected);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    size_t row_size = expected.xsize * expected.components *
+                      jpegli_bytes_per_sample(data_type);
+    size_t stride = row_size + JPEGLI_ROW_PADDING;
+    std::vector<uint8_t> output(expected.ysize * stride);
+    const auto try_catch_block2 = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      jpegli_set_output_format(&cinfo, data_type, JPEGLI_NATIVE_ENDIAN);
+      jpegli_set_output_row_padding(&cinfo, TRUE);
+      jpegli_start_decompress(&cinfo);
+      EXPECT_EQ(cinfo.output_height,
+                jpegli_decode_into(&cinfo, output.data(), stride));
+      jpegli_finish_decompress(&cinfo);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block2());
+    for (size_t y = 0; y < expected.ysize; ++y) {
+      ASSERT_EQ(0, memcmp(&expected.pixels[y * row_size], &output[y * stride],
+                          row_size));
+    }
+    jpegli_destroy_decompress(&cinfo);
+  }
+}
+
+TEST(DecodeAPITest, DecodePlanes) {
+  TestConfig config;
+  config.input.xsize = 317;
+  config.input.ysize = 123;
+  config.jparams.h_sampling = {2, 1, 1};
+  config.jparams.v_sampling = {2, 1, 1};
+  config.jparams.restart_in_rows = 1;
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  for (JpegIOMode output_mode : {PIXELS, RAW_DATA}) {
+    DecompressParams dparams;
+    dparams.output_mode = output_mode;
+    TestImage expected;
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      TestAPINonBuffered(config.jparams, dparams, config.input, &cinfo,
+                         &expected);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    const bool raw = output_mode == RAW_DATA;
+    for (JpegliPlaneLayout layout :
+         {JPEGLI_PLANES_SEPARATE, JPEGLI_PLANES_NV12}) {
+      // NV12 planes need the chroma components at their coded sampling.
+      if (layout == JPEGLI_PLANES_NV12 && !raw) continue;
+      for (size_t num_threads : {0, 3}) {
+        dparams.num_threads = num_threads;
+        size_t xsize[3];
+        size_t ysize[3];
+        // Use odd paddings to have unaligned destination rows.
+        size_t strides[3];
+        std::vector<uint8_t> planes[3];
+        uint8_t* plane_ptrs[3] = {};
+        const auto try_catch_block2 = [&]() -> bool {
+          ERROR_HANDLER_SETUP(jpegli);
+          jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+          SetParallelRunner(dparams, &cinfo);
+          jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+          cinfo.raw_data_out = TO_JXL_BOOL(raw);
+          jpegli_start_decompress(&cinfo);
+          for (int c = 0; c < 3; ++c) {
+            const jpeg_component_info* comp = &cinfo.comp_info[c];
+            xsize[c] = raw ? comp->downsampled_width : cinfo.output_width;
+            ysize[c] = raw ? comp->downsampled_height : cinfo.output_height;
+            size_t channels = layout == JPEGLI_PLANES_NV12 && c == 1 ? 2 : 1;
+            strides[c] = channels * xsize[c] + 5 + c;
+            planes[c].resize(ysize[c] * strides[c]);
+            plane_ptrs[c] = planes[c].data();
+          }
+          EXPECT_EQ(cinfo.output_height,
+                    jpegli_decode_planes(&cinfo, plane_ptrs, strides, layout));
+          jpegli_finish_decompress(&cinfo);
+          return true;
+        };
+        ASSERT_TRUE(try_catch_block2());
+        for (size_t c = 0; c < 3; ++c) {
+          const bool nv12 = layout == JPEGLI_PLANES_NV12 && c > 0;
+          const uint8_t* plane = nv12 ? planes[1].data() : planes[c].data();
+          const size_t stride = nv12 ? strides[1] : strides[c];
+          const size_t step = nv12 ? 2 : 1;
+          const size_t offset = nv12 ? c - 1 : 0;
+          for (size_t y = 0; y < ysize[c]; ++y) {
+            for (size_t x = 0; x < xsize[c]; ++x) {
+              const uint8_t sample =
+                  raw ? expected.raw_data[c][y * DivCeil(xsize[c], 8) * 8 + x]
+                      : expected.pixels[(y * xsize[c] + x) * 3 + c];
+              ASSERT_EQ(sample, plane[y * stride + x * step + offset]);
+            }
+          }
+        }
+      }
+    }
+    jpegli_destroy_decompress(&cinfo);
+  }
+}
+
+TEST(DecodeAPITest, TensorOutput) {
+  TestConfig config;
+  config.input.xsize = 211;
+  config.input.ysize = 137;
+  config.jparams.h_sampling = {2, 1, 1};
+  config.jparams.v_sampling = {2, 1, 1};
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  const float mean[3] = {0.485f, 0.456f, 0.406f};
+  const float std_dev[3] = {0.229f, 0.224f, 0.225f};
+  // Decodes a center crop of the image at half size into float samples,
+  // interleaved or as tensor planes.
+  const auto decode = [&](bool tensor, size_t* xsize, size_t* ysize,
+                          std::vector<float>* output) {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      jpegli_set_output_format(&cinfo, JPEGLI_TYPE_FLOAT, JPEGLI_NATIVE_ENDIAN);
+      cinfo.scale_num = 4;
+      cinfo.scale_denom = 8;
+      jpegli_calc_output_dimensions(&cinfo);
+      const size_t height = cinfo.output_height / 2;
+      const size_t stride = cinfo.output_width;
+      if (tensor) {
+        jpegli_set_tensor_output(&cinfo, height * stride * sizeof(float), mean,
+                                 std_dev);
+      }
+      jpegli_start_decompress(&cinfo);
+      JDIMENSION xoffset = cinfo.output_width / 4;
+      JDIMENSION width = cinfo.output_width / 2;
+      jpegli_crop_scanline(&cinfo, &xoffset, &width);
+      jpegli_skip_scanlines(&cinfo, cinfo.output_height / 4);
+      *xsize = cinfo.output_width;
+      *ysize = height;
+      output->resize(3 * height * stride);
+      const size_t row_stride = tensor ? stride : 3 * stride;
+      for (size_t y = 0; y < height; ++y) {
+        JSAMPROW row = reinterpret_cast<JSAMPROW>(&(*output)[y * row_stride]);
+        EXPECT_EQ(1u, jpegli_read_scanlines(&cinfo, &row, 1));
+      }
+      jpegli_abort_decompress(&cinfo);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  };
+  size_t xsize;
+  size_t ysize;
+  std::vector<float> expected;
+  decode(/*tensor=*/false, &xsize, &ysize, &expected);
+  size_t tensor_xsize;
+  size_t tensor_ysize;
+  std::vector<float> output;
+  decode(/*tensor=*/true, &tensor_xsize, &tensor_ysize, &output);
+  ASSERT_EQ(xsize, tensor_xsize);
+  ASSERT_EQ(ysize, tensor_ysize);
+  const size_t stride = output.size() / (3 * ysize);
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t y = 0; y < ysize; ++y) {
+      for (size_t x = 0; x < xsize; ++x) {
+        const float sample = expected[(y * stride + x) * 3 + c];
+        const float normalized = output[(c * ysize + y) * stride + x];
+        ASSERT_NEAR((sample - mean[c]) / std_dev[c], normalized, 1e-5f);
+      }
+    }
+  }
+}
+
+TEST(DecodeAPITest, DequantBiasRows) {
+  TestConfig config;
+  config.input.xsize = 517;
+  config.input.ysize = 523;
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  const auto decode = [&](int bias_rows, std::vector<uint8_t>* output) {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      if (bias_rows >= 0) {
+        jpegli_set_dequant_bias_rows(&cinfo, bias_rows);
+      }
+      jpegli_start_decompress(&cinfo);
+      size_t stride = cinfo.output_width * cinfo.output_components;
+      output->resize(cinfo.output_height * stride);
+      EXPECT_EQ(cinfo.output_height,
+                jpegli_decode_into(&cinfo, output->data(), stride));
+      jpegli_finish_decompress(&cinfo);
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  };
+  std::vector<uint8_t> expected;
+  decode(-1, &expected);
+  std::vector<uint8_t> output;
+  // With more rows than the image has, the biases are the same as without.
+  decode(1000, &output);
+  EXPECT_EQ(expected, output);
+  decode(3, &output);
+  ASSERT_EQ(expected.size(), output.size());
+  int max_diff = 0;
+  for (size_t i = 0; i < expected.size(); ++i) {
+    max_diff = std::max(max_diff, std::abs(expected[i] - output[i]));
+  }
+  EXPECT_LE(max_diff, 2);
+}
+
+TEST(DecodeAPITest, DecodeBatch) {
+  std::vector<std::vector<uint8_t>> compressed;
+  for (size_t xsize : {1, 64, 257}) {
+    for (size_t ysize : {1, 39, 128}) {
+      TestConfig config;
+      config.input.xsize = xsize;
+      config.input.ysize = ysize;
+      config.input.components = ysize == 39 ? 1 : 3;
+      config.input.color_space = ysize == 39 ? JCS_GRAYSCALE : JCS_RGB;
+      JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> jpeg, GetTestJpegData(config),
+                         "Failed to create test data.");
+      compressed.emplace_back(std::move(jpeg));
+    }
+  }
+  std::vector<std::vector<uint8_t>> expected(compressed.size());
+  std::vector<JDIMENSION> expected_xsize(compressed.size());
+  for (size_t i = 0; i < compressed.size(); ++i) {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed[i].data(), compressed[i].size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      cinfo.out_color_space = JCS_RGB;
+      jpegli_start_decompress(&cinfo);
+      size_t stride = cinfo.output_width * cinfo.output_components;
+      expected[i].resize(cinfo.output_height * stride);
+      expected_xsize[i] = cinfo.output_width;
+      EXPECT_EQ(cinfo.output_height,
+                jpegli_decode_into(&cinfo, expected[i].data(), stride));
+      jpegli_finish_decompress(&cinfo);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+  std::vector<std::vector<uint8_t>> output(compressed.size());
+  std::vector<JpegliBatchImage> images(compressed.size());
+  for (size_t i = 0; i < compressed.size(); ++i) {
+    output[i].resize(expected[i].size());
+    images[i].data = compressed[i].data();
+    images[i].size = compressed[i].size();
+    images[i].pixels = output[i].data();
+    images[i].stride = expected_xsize[i] * 3;
+    images[i].pixels_size = output[i].size();
+  }
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    cinfo.out_color_space = JCS_RGB;
+    // The same decompressor is used for several batches, so that the workers
+    // of the later batches reuse their memory.
+    for (size_t num_threads : {0, 1, 3, 8}) {
+      DecompressParams dparams;
+      dparams.num_threads = num_threads;
+      SetParallelRunner(dparams, &cinfo);
+      for (auto& pixels : output) std::fill(pixels.begin(), pixels.end(), 0);
+      jpegli_decode_batch(&cinfo, images.data(), images.size());
+      for (size_t i = 0; i < compressed.size(); ++i) {
+        EXPECT_EQ(expected_xsize[i], images[i].output_width);
+        EXPECT_EQ(3, images[i].output_components);
+        EXPECT_EQ(expected[i], output[i]);
+      }
+    }
+    return true;
+  };
+  EXPECT_TRUE(try_catch_block());
+  jpegli_destroy_decompress(&cinfo);
+  // An output buffer that is too small fails the batch.
+  images.back().pixels_size -= 1;
+  EXPECT_FALSE(try_catch_block());
+}
+
+TEST(DecodeAPITest, Probe) {
+  std::vector<TestConfig> all_configs(4);
+  all_configs[0].input.xsize = 517;
+  all_configs[0].input.ysize = 523;
+  all_configs[1].input.xsize = 64;
+  all_configs[1].input.ysize = 33;
+  all_configs[1].jparams.h_sampling = {2, 1, 1};
+  all_configs[1].jparams.v_sampling = {2, 1, 1};
+  all_configs[1].jparams.progressive_mode = 2;
+  all_configs[2].input.xsize = 35;
+  all_configs[2].input.ysize = 17;
+  all_configs[2].input.color_space = JCS_GRAYSCALE;
+  all_configs[2].input.components = 1;
+  all_configs[3].input.xsize = 40;
+  all_configs[3].input.ysize = 41;
+  all_configs[3].jparams.h_sampling = {2, 1, 1};
+  all_configs[3].jparams.v_sampling = {1, 1, 1};
+  all_configs[3].jparams.icc.resize(100000, 0x2a);
+  for (TestConfig& config : all_configs) {
+    JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed,
+                       GetTestJpegData(config), "Failed to create test data.");
+    JpegliImageInfo info;
+    ASSERT_TRUE(jpegli_probe(compressed.data(), compressed.size(), &info));
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      EXPECT_EQ(cinfo.image_width, info.image_width);
+      EXPECT_EQ(cinfo.image_height, info.image_height);
+      EXPECT_EQ(cinfo.num_components, info.num_components);
+      EXPECT_EQ(cinfo.data_precision, info.data_precision);
+      EXPECT_EQ(cinfo.progressive_mode, info.progressive_mode);
+      for (int c = 0; c < cinfo.num_components; ++c) {
+        EXPECT_EQ(cinfo.comp_info[c].h_samp_factor, info.h_samp_factor[c]);
+        EXPECT_EQ(cinfo.comp_info[c].v_samp_factor, info.v_samp_factor[c]);
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+    EXPECT_EQ(0u, info.exif_size);
+    if (config.jparams.icc.empty()) {
+      EXPECT_EQ(0, info.num_icc_markers);
+    } else {
+      EXPECT_EQ(2, info.num_icc_markers);
+      ASSERT_LT(info.icc_offset + 18, compressed.size());
+      EXPECT_EQ(0xe2, compressed[info.icc_offset + 1]);
+      EXPECT_EQ(0, memcmp(&compressed[info.icc_offset + 4], "ICC_PROFILE", 12));
+    }
+    // The SOF marker segment is truncated.
+    size_t sof_pos = 2;
+    while (compressed[sof_pos] != 0xff || (compressed[sof_pos + 1] != 0xc0 &&
+                                           compressed[sof_pos + 1] != 0xc2)) {
+      sof_pos += 2 + (compressed[sof_pos + 2] << 8) + compressed[sof_pos + 3];
+    }
+    EXPECT_FALSE(jpegli_probe(compressed.data(), sof_pos + 10, &info));
+  }
+}
+
+TEST(DecodeAPITest, TwelveBitPrecision) {
+  std::vector<TestConfig> all_configs(2);
+  all_configs[0].input.xsize = 67;
+  all_configs[0].input.ysize = 43;
+  all_configs[0].input.color_space = JCS_GRAYSCALE;
+  all_configs[0].input.components = 1;
+  all_configs[1].input.xsize = 64;
+  all_configs[1].input.ysize = 33;
+  all_configs[1].jparams.h_sampling = {2, 1, 1};
+  all_configs[1].jparams.v_sampling = {2, 1, 1};
+  all_configs[1].jparams.progressive_mode = 2;
+  for (TestConfig& config : all_configs) {
+    JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed,
+                       GetTestJpegData(config), "Failed to create test data.");
+    size_t sof_pos = 2;
+    while (compressed[sof_pos] != 0xff || (compressed[sof_pos + 1] != 0xc0 &&
+                                           compressed[sof_pos + 1] != 0xc2)) {
+      sof_pos += 2 + (compressed[sof_pos + 2] << 8) + compressed[sof_pos + 3];
+    }
+    // Decodes the same coefficients once as an 8-bit and once as a 12-bit
+    // image, where the sample values are 1920 = 2048 - 128 larger.
+    std::vector<float> output[2];
+    for (int precision : {8, 12}) {
+      compressed[sof_pos + 4] = precision;
+      std::vector<float>& pixels = output[precision == 12];
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        EXPECT_EQ(precision, cinfo.data_precision);
+        jpegli_set_output_format(&cinfo, JPEGLI_TYPE_FLOAT,
+                                 JPEGLI_NATIVE_ENDIAN);
+        jpegli_start_decompress(&cinfo);
+        size_t stride = cinfo.output_width * cinfo.out_color_components;
+        pixels.resize(cinfo.output_height * stride);
+        EXPECT_EQ(cinfo.output_height,
+                  jpegli_decode_into(&cinfo,
+                                     reinterpret_cast<uint8_t*>(pixels.data()),
+                                     stride * sizeof(float)));
+        jpegli_finish_decompress(&cinfo);
+        return true;
+      };
+      EXPECT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+    ASSERT_EQ(output[0].size(), output[1].size());
+    for (size_t i = 0; i < output[0].size(); ++i) {
+      ASSERT_NEAR(output[0][i] * 255.0f + 1920.0f, output[1][i] * 4095.0f,
+                  0.05f);
+    }
+  }
+}
+
+TEST(DecodeAPITest, ArithmeticCoding) {
+  std::vector<TestConfig> all_configs(2);
+  all_configs[0].input.xsize = 67;
+  all_configs[0].input.ysize = 43;
+  all_configs[0].input.color_space = JCS_GRAYSCALE;
+  all_configs[0].input.components = 1;
+  all_configs[1].input.xsize = 131;
+  all_configs[1].input.ysize = 75;
+  all_configs[1].jparams.h_sampling = {2, 1, 1};
+  all_configs[1].jparams.v_sampling = {2, 1, 1};
+  for (TestConfig& config : all_configs) {
+    JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed,
+                       GetTestJpegData(config), "Failed to create test data.");
+    for (bool progressive : {false, true}) {
+      for (unsigned int restart_interval : {0u, 3u}) {
+        std::vector<uint8_t> arith_compressed =
+            TranscodeToArithmeticWithLibjpeg(compressed, progressive,
+                                             restart_interval);
+        // The arithmetic coded file has the same coefficients, which are
+        // decoded from small chunks of input to test the input suspension.
+        TestImage output[2];
+        const std::vector<uint8_t>* inputs[2] = {&compressed,
+                                                 &arith_compressed};
+        for (int i = 0; i < 2; ++i) {
+          SourceManager src(inputs[i]->data(), inputs[i]->size(),
+                            /*max_chunk_size=*/i == 0 ? 0 : 61);
+          jpeg_decompress_struct cinfo;
+          const auto try_catch_block = [&]() -> bool {
+            ERROR_HANDLER_SETUP(jpegli);
+            jpegli_create_decompress(&cinfo);
+            cinfo.src = reinterpret_cast<jpeg_source_mgr*>(&src);
+            jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+            EXPECT_EQ(i, cinfo.arith_code);
+            jpegli_start_decompress(&cinfo);
+            ReadOutputImage(config.dparams, &cinfo, &output[i]);
+            jpegli_finish_decompress(&cinfo);
+            return true;
+          };
+          ASSERT_TRUE(try_catch_block());
+          jpegli_destroy_decompress(&cinfo);
+        }
+        VerifyOutputImage(output[0], output[1], 0.0, 0.0);
+      }
+    }
+  }
+}
+
+TEST(DecodeAPITest, DecodeRegion) {
+  TestConfig config;
+  config.input.xsize = 517;
+  config.input.ysize = 523;
+  config.jparams.h_sampling = {2, 1, 1};
+  config.jparams.v_sampling = {2, 1, 1};
+  config.jparams.restart_interval = 3;
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  const size_t x0 = 201;
+  const size_t y0 = 150;
+  const size_t xsize = 100;
+  const size_t ysize = 120;
+  const size_t stride = config.input.xsize * 3;
+  std::vector<uint8_t> index;
+  const auto decode = [&](bool region, bool set_index,
+                          std::vector<uint8_t>* output) {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      if (region) {
+        jpegli_decode_region(&cinfo, x0, y0, xsize, ysize);
+      }
+      if (set_index) {
+        jpegli_set_restart_index(&cinfo, index.data(), index.size());
+      }
+      jpegli_start_decompress(&cinfo);
+      output->resize(cinfo.output_height * stride);
+      EXPECT_EQ(cinfo.output_height,
+                jpegli_decode_into(&cinfo, output->data(), stride));
+      jpegli_finish_decompress(&cinfo);
+      if (region && index.empty()) {
+        JOCTET* index_data = nullptr;
+        unsigned int index_len = 0;
+        EXPECT_TRUE(jpegli_get_restart_index(&cinfo, &index_data, &index_len));
+        index.assign(index_data, index_data + index_len);
+        free(index_data);
+      }
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  };
+  std::vector<uint8_t> expected;
+  std::vector<uint8_t> output0;
+  std::vector<uint8_t> output1;
+  decode(/*region=*/false, /*set_index=*/false, &expected);
+  decode(/*region=*/true, /*set_index=*/false, &output0);
+  ASSERT_FALSE(index.empty());
+  decode(/*region=*/true, /*set_index=*/true, &output1);
+  // The region is decoded from the same coefficients, but the dequantization
+  // biases depend on all the decoded blocks.
+  double sum_sq_diff = 0.0;
+  int max_diff = 0;
+  for (size_t y = y0; y < y0 + ysize; ++y) {
+    for (size_t x = x0 * 3; x < (x0 + xsize) * 3; ++x) {
+      int diff = std::abs(expected[y * stride + x] - output0[y * stride + x]);
+      sum_sq_diff += diff * diff;
+      max_diff = std::max(max_diff, diff);
+    }
+  }
+  EXPECT_LE(std::sqrt(sum_sq_diff / (xsize * ysize * 3)), 1.0);
+  EXPECT_LE(max_diff, 35);
+  // Decoding with the restart index gives the same result.
+  EXPECT_EQ(output0, output1);
+  // An index that does not match the image is ignored.
+  index.resize(index.size() - 4);
+  decode(/*region=*/true, /*set_index=*/true, &output1);
+  EXPECT_EQ(output0, output1);
+  index.assign(index.size(), 0);
+  decode(/*region=*/true, /*set_index=*/true, &output1);
+  EXPECT_EQ(output0, output1);
+}
+
+TEST(DecodeAPITest, RestartIndexSegment) {
+  for (int optimize_coding : {0, 1}) {
+    TestConfig config;
+    config.input.xsize = 217;
+    config.input.ysize = 123;
+    config.jparams.progressive_mode = 0;
+    config.jparams.optimize_coding = optimize_coding;
+    config.jparams.restart_interval = 5;
+    GeneratePixels(&config.input);
+    const auto encode = [&](bool write_index, std::vector<uint8_t>* out) {
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      jpeg_compress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        jpegli_write_restart_index(&cinfo, TO_JXL_BOOL(write_index));
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_compress(&cinfo);
+      out->assign(buffer, buffer + buffer_size);
+      free(buffer);
+    };
+    std::vector<uint8_t> plain;
+    std::vector<uint8_t> indexed;
+    encode(/*write_index=*/false, &plain);
+    encode(/*write_index=*/true, &indexed);
+    // The index segment is inserted before the EOI marker.
+    ASSERT_GT(indexed.size(), plain.size());
+    EXPECT_EQ(0, memcmp(plain.data(), indexed.data(), plain.size() - 2));
+    EXPECT_EQ(0xFF, indexed[plain.size() - 2]);
+    EXPECT_EQ(0xEA, indexed[plain.size() - 1]);
+
+    // The index that the decoder reads from the segment is the same as the
+    // one it finds by searching for the restart markers.
+    const auto decode = [&](const std::vector<uint8_t>& compressed,
+                            bool region, std::vector<uint8_t>* index,
+                            std::vector<uint8_t>* output) {
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        if (region) {
+          jpegli_decode_region(&cinfo, 0, 0, cinfo.image_width,
+                               cinfo.image_height);
+        }
+        jpegli_start_decompress(&cinfo);
+        const size_t stride = cinfo.output_width * cinfo.output_components;
+        output->resize(cinfo.output_height * stride);
+        EXPECT_EQ(cinfo.output_height,
+                  jpegli_decode_into(&cinfo, output->data(), stride));
+        jpegli_finish_decompress(&cinfo);
+        JOCTET* index_data = nullptr;
+        unsigned int index_len = 0;
+        if (jpegli_get_restart_index(&cinfo, &index_data, &index_len)) {
+          index->assign(index_data, index_data + index_len);
+          free(index_data);
+        }
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    };
+    std::vector<uint8_t> expected_index;
+    std::vector<uint8_t> index;
+    std::vector<uint8_t> expected;
+    std::vector<uint8_t> output;
+    decode(plain, /*region=*/true, &expected_index, &expected);
+    decode(indexed, /*region=*/false, &index, &output);
+    ASSERT_FALSE(expected_index.empty());
+    EXPECT_EQ(expected_index, index);
+    EXPECT_EQ(expected, output);
+
+    // Other decoders skip the segment.
+    TestImage libjpeg_output;
+    DecodeWithLibjpeg(config.jparams, DecompressParams(), indexed,
+                      &libjpeg_output);
+    VerifyOutputImage(config.input, libjpeg_output, 2.35);
+  }
+}
+
+TEST(DecodeAPITest, InterleavedCoefficients) {
+  for (int progr : {0, 2}) {
+    TestConfig config;
+    config.input.xsize = 317;
+    config.input.ysize = 223;
+    config.jparams.progressive_mode = progr;
+    config.jparams.h_sampling = {2, 1, 1};
+    config.jparams.v_sampling = {2, 1, 1};
+    JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed,
+                       GetTestJpegData(config), "Failed to create test data.");
+    const auto decode = [&](bool interleaved, bool read_coeffs,
+                            std::vector<uint8_t>* output) {
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        jpegli_set_interleaved_coefficients(&cinfo, TO_JXL_BOOL(interleaved));
+        output->clear();
+        if (read_coeffs) {
+          jvirt_barray_ptr* coef_arrays = jpegli_read_coefficients(&cinfo);
+          for (int c = 0; c < cinfo.num_components; ++c) {
+            const jpeg_component_info* comp = &cinfo.comp_info[c];
+            for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+              JBLOCKARRAY ba = (*cinfo.mem->access_virt_barray)(
+                  reinterpret_cast<j_common_ptr>(&cinfo), coef_arrays[c], by,
+                  1, FALSE);
+              const uint8_t* row = reinterpret_cast<const uint8_t*>(ba[0]);
+              output->insert(output->end(), row,
+                             row + comp->width_in_blocks * sizeof(JBLOCK));
+            }
+          }
+        } else {
+          jpegli_start_decompress(&cinfo);
+          size_t stride = cinfo.output_width * cinfo.out_color_components;
+          output->resize(cinfo.output_height * stride);
+          EXPECT_EQ(cinfo.output_height,
+                    jpegli_decode_into(&cinfo, output->data(), stride));
+        }
+        jpegli_finish_decompress(&cinfo);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    };
+    for (bool read_coeffs : {false, true}) {
+      std::vector<uint8_t> expected;
+      std::vector<uint8_t> output;
+      decode(/*interleaved=*/false, read_coeffs, &expected);
+      decode(/*interleaved=*/true, read_coeffs, &output);
+      EXPECT_EQ(expected, output);
+    }
+  }
+}
+
+TEST(DecodeAPITest, ZigZagCoefficients) {
+  // Position in the natural order of each zigzag index, by walking the
+  // anti-diagonals of the block in alternating directions.
+  std::vector<int> natural_order;
+  for (int d = 0; d < 2 * DCTSIZE - 1; ++d) {
+    for (int i = 0; i <= d; ++i) {
+      int y = (d % 2 == 0) ? d - i : i;
+      int x = d - y;
+      if (x < DCTSIZE && y < DCTSIZE) natural_order.push_back(y * DCTSIZE + x);
+    }
+  }
+  for (int progr : {0, 2}) {
+    TestConfig config;
+    config.input.xsize = 317;
+    config.input.ysize = 223;
+    config.jparams.progressive_mode = progr;
+    config.jparams.h_sampling = {2, 1, 1};
+    config.jparams.v_sampling = {2, 1, 1};
+    JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed,
+                       GetTestJpegData(config), "Failed to create test data.");
+    const auto decode = [&](bool zigzag, std::vector<JCOEF>* output) {
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        jpegli_set_zigzag_coefficients(&cinfo, TO_JXL_BOOL(zigzag));
+        output->clear();
+        jvirt_barray_ptr* coef_arrays = jpegli_read_coefficients(&cinfo);
+        for (int c = 0; c < cinfo.num_components; ++c) {
+          const jpeg_component_info* comp = &cinfo.comp_info[c];
+          for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+            JBLOCKARRAY ba = (*cinfo.mem->access_virt_barray)(
+                reinterpret_cast<j_common_ptr>(&cinfo), coef_arrays[c], by, 1,
+                FALSE);
+            for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+              for (int k = 0; k < DCTSIZE2; ++k) {
+                output->push_back(
+                    ba[0][bx][zigzag ? k : natural_order[k]]);
+              }
+            }
+          }
+        }
+        jpegli_finish_decompress(&cinfo);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    };
+    std::vector<JCOEF> expected;
+    std::vector<JCOEF> output;
+    decode(/*zigzag=*/false, &expected);
+    decode(/*zigzag=*/true, &output);
+    EXPECT_EQ(expected, output);
+  }
+}
+
+TEST(DecodeAPITest, ExportCoefficients) {
+  std::vector<int> natural_order;
+  for (int d = 0; d < 2 * DCTSIZE - 1; ++d) {
+    for (int i = 0; i <= d; ++i) {
+      int y = (d % 2 == 0) ? d - i : i;
+      int x = d - y;
+      if (x < DCTSIZE && y < DCTSIZE) natural_order.push_back(y * DCTSIZE + x);
+    }
+  }
+  TestConfig config;
+  config.input.xsize = 317;
+  config.input.ysize = 223;
+  config.jparams.progressive_mode = 2;
+  config.jparams.h_sampling = {2, 1, 1};
+  config.jparams.v_sampling = {2, 1, 1};
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  for (bool stored_zigzag : {false, true}) {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      jpegli_set_zigzag_coefficients(&cinfo, TO_JXL_BOOL(stored_zigzag));
+      jvirt_barray_ptr* coef_arrays = jpegli_read_coefficients(&cinfo);
+      // The coefficients of all blocks in zigzag order.
+      std::vector<JCOEF> expected;
+      for (int c = 0; c < cinfo.num_components; ++c) {
+        const jpeg_component_info* comp = &cinfo.comp_info[c];
+        for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+          JBLOCKARRAY ba = (*cinfo.mem->access_virt_barray)(
+              reinterpret_cast<j_common_ptr>(&cinfo), coef_arrays[c], by, 1,
+              FALSE);
+          for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+            for (int k = 0; k < DCTSIZE2; ++k) {
+              expected.push_back(
+                  ba[0][bx][stored_zigzag ? k : natural_order[k]]);
+            }
+          }
+        }
+      }
+      for (bool zigzag : {false, true}) {
+        JpegliCoefficientLayout layout;
+        jpegli_export_coefficients(&cinfo, TO_JXL_BOOL(zigzag), &layout,
+                                   nullptr);
+        EXPECT_EQ(expected.size(), layout.num_coeffs);
+        std::vector<JCOEF> coeffs(layout.num_coeffs);
+        jpegli_export_coefficients(&cinfo, TO_JXL_BOOL(zigzag), &layout,
+                                   coeffs.data());
+        EXPECT_EQ(cinfo.num_components, layout.num_components);
+        EXPECT_EQ(zigzag ? 1 : 0, layout.zigzag);
+        size_t offset = 0;
+        for (int c = 0; c < cinfo.num_components; ++c) {
+          const jpeg_component_info* comp = &cinfo.comp_info[c];
+          EXPECT_EQ(comp->h_samp_factor, layout.h_samp_factor[c]);
+          EXPECT_EQ(comp->v_samp_factor, layout.v_samp_factor[c]);
+          EXPECT_EQ(comp->width_in_blocks, layout.width_in_blocks[c]);
+          EXPECT_EQ(comp->height_in_blocks, layout.height_in_blocks[c]);
+          EXPECT_EQ(offset, layout.offset[c]);
+          offset += comp->width_in_blocks * comp->height_in_blocks * DCTSIZE2;
+          for (int k = 0; k < DCTSIZE2; ++k) {
+            EXPECT_EQ(comp->quant_table->quantval[zigzag ? natural_order[k]
+                                                         : k],
+                      layout.quant_table[c][k]);
+          }
+        }
+        for (size_t i = 0; i < coeffs.size(); i += DCTSIZE2) {
+          for (int k = 0; k < DCTSIZE2; ++k) {
+            EXPECT_EQ(expected[i + k],
+                      coeffs[i + (zigzag ? k : natural_order[k])]);
+          }
+        }
+      }
+      jpegli_finish_decompress(&cinfo);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  }
+}
+
+TEST(DecodeAPITest, DecodeCoefficientsStreaming) {
+  for (int progr : {0, 2}) {
+    TestConfig config;
+    config.input.xsize = 317;
+    config.input.ysize = 223;
+    config.jparams.progressive_mode = progr;
+    config.jparams.h_sampling = {2, 1, 1};
+    config.jparams.v_sampling = {2, 1, 1};
+    JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed,
+                       GetTestJpegData(config), "Failed to create test data.");
+    // The coefficients of each component, in block row order.
+    std::vector<std::vector<JCOEF>> expected(3);
+    std::vector<std::vector<JCOEF>> output(3);
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      jvirt_barray_ptr* coef_arrays = jpegli_read_coefficients(&cinfo);
+      for (int c = 0; c < cinfo.num_components; ++c) {
+        const jpeg_component_info* comp = &cinfo.comp_info[c];
+        for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+          JBLOCKARRAY ba = (*cinfo.mem->access_virt_barray)(
+              reinterpret_cast<j_common_ptr>(&cinfo), coef_arrays[c], by, 1,
+              FALSE);
+          for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+            expected[c].insert(expected[c].end(), &ba[0][bx][0],
+                               &ba[0][bx][DCTSIZE2]);
+          }
+        }
+      }
+      jpegli_finish_decompress(&cinfo);
+
+      struct Collector {
+        j_decompress_ptr cinfo;
+        std::vector<std::vector<JCOEF>>* output;
+        JDIMENSION next_imcu_row;
+      } collector = {&cinfo, &output, 0};
+      JpegliCoefficientRowCallback callback =
+          [](void* opaque, JDIMENSION imcu_row, JBLOCKARRAY blocks[],
+             const int num_block_rows[]) {
+            Collector* collector = reinterpret_cast<Collector*>(opaque);
+            EXPECT_EQ(collector->next_imcu_row, imcu_row);
+            ++collector->next_imcu_row;
+            for (int c = 0; c < collector->cinfo->num_components; ++c) {
+              const jpeg_component_info* comp = &collector->cinfo->comp_info[c];
+              std::vector<JCOEF>* coeffs = &(*collector->output)[c];
+              for (int iy = 0; iy < num_block_rows[c]; ++iy) {
+                for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+                  coeffs->insert(coeffs->end(), &blocks[c][iy][bx][0],
+                                 &blocks[c][iy][bx][DCTSIZE2]);
+                }
+              }
+            }
+          };
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      EXPECT_TRUE(
+          jpegli_decode_coefficients_streaming(&cinfo, callback, &collector));
+      EXPECT_EQ(cinfo.total_iMCU_rows, collector.next_imcu_row);
+      jpegli_finish_decompress(&cinfo);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+    EXPECT_EQ(expected, output);
+  }
+}
+
+TEST(DecodeAPITest, Fingerprint) {
+  std::vector<JpegliFingerprint> fingerprints;
+  for (int quality : {90, 50}) {
+    for (int progr : {0, 2}) {
+      TestConfig config;
+      config.input.xsize = 317;
+      config.input.ysize = 223;
+      config.jparams.quality = quality;
+      config.jparams.progressive_mode = progr;
+      config.jparams.h_sampling = {2, 1, 1};
+      config.jparams.v_sampling = {2, 1, 1};
+      JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed,
+                         GetTestJpegData(config),
+                         "Failed to create test data.");
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        JpegliFingerprint fingerprint;
+        EXPECT_TRUE(jpegli_compute_fingerprint(&cinfo, &fingerprint));
+        jpegli_finish_decompress(&cinfo);
+        fingerprints.push_back(fingerprint);
+        // The same hashes from the coefficients of a full decoding.
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        jpegli_read_coefficients(&cinfo);
+        EXPECT_TRUE(jpegli_compute_fingerprint(&cinfo, &fingerprint));
+        EXPECT_EQ(0, jpegli_fingerprint_distance(&fingerprint,
+                                                 &fingerprints.back(), TRUE));
+        jpegli_finish_decompress(&cinfo);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+  }
+  // The progressive and sequential images have the same coefficients.
+  EXPECT_EQ(0, jpegli_fingerprint_distance(&fingerprints[0], &fingerprints[1],
+                                           TRUE));
+  EXPECT_EQ(0, jpegli_fingerprint_distance(&fingerprints[2], &fingerprints[3],
+                                           TRUE));
+  // A lower quality changes only a few bits.
+  EXPECT_LE(jpegli_fingerprint_distance(&fingerprints[0], &fingerprints[2],
+                                        FALSE),
+            6);
+  EXPECT_LE(jpegli_fingerprint_distance(&fingerprints[0], &fingerprints[2],
+                                        TRUE),
+            24);
+}
+
+TEST(DecodeAPITest, CMYKToRGBPreview) {
+  for (J_COLOR_SPACE jpeg_color_space : {JCS_CMYK, JCS_YCCK}) {
+    TestConfig config;
+    config.input.xsize = 317;
+    config.input.ysize = 223;
+    config.input.color_space = JCS_CMYK;
+    config.jparams.set_jpeg_colorspace = true;
+    config.jparams.jpeg_color_space = jpeg_color_space;
+    JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed,
+                       GetTestJpegData(config), "Failed to create test data.");
+    const auto decode = [&](J_COLOR_SPACE out_color_space,
+                            std::vector<uint8_t>* output) {
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        cinfo.out_color_space = out_color_space;
+        jpegli_start_decompress(&cinfo);
+        size_t stride = cinfo.output_width * cinfo.out_color_components;
+        output->resize(cinfo.output_height * stride);
+        EXPECT_EQ(cinfo.output_height,
+                  jpegli_decode_into(&cinfo, output->data(), stride));
+        jpegli_finish_decompress(&cinfo);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    };
+    std::vector<uint8_t> cmyk;
+    std::vector<uint8_t> rgb;
+    decode(JCS_CMYK, &cmyk);
+    decode(JCS_RGB, &rgb);
+    ASSERT_EQ(cmyk.size() / 4 * 3, rgb.size());
+    // The RGB preview is the product of the inverted CMYK channels.
+    for (size_t i = 0; i < rgb.size() / 3; ++i) {
+      for (size_t c = 0; c < 3; ++c) {
+        float expected = cmyk[4 * i + c] * cmyk[4 * i + 3] / 255.0f;
+        ASSERT_NEAR(expected, rgb[3 * i + c], 1.5f);
+      }
+    }
+  }
+}
+
+TEST(DecodeAPITest, DecodeLimits) {
+  TestConfig config;
+  config.input.xsize = 317;
+  config.input.ysize = 223;
+  config.jparams.progressive_mode = 2;
+  config.jparams.override_JFIF = 1;
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  size_t num_scans = 0;
+  size_t coeff_memory = 0;
+  size_t marker_bytes = 0;
+  const auto decode = [&](size_t max_pixels, int max_scans,
+                          size_t max_marker_bytes, size_t max_coeff_memory) {
+    jpeg_decompress_struct cinfo;
+    JpegliDecodeLimit limit_error = JPEGLI_LIMIT_NONE;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_save_markers(&cinfo, JPEG_APP0, 0xffff);
+      jpegli_set_decode_limits(&cinfo, max_pixels, max_scans, max_marker_bytes,
+                               max_coeff_memory);
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      coeff_memory = 0;
+      for (int c = 0; c < cinfo.num_components; ++c) {
+        const jpeg_component_info* comp = &cinfo.comp_info[c];
+        coeff_memory +=
+            comp->width_in_blocks * comp->height_in_blocks * sizeof(JBLOCK);
+      }
+      marker_bytes = 0;
+      for (jpeg_saved_marker_ptr marker = cinfo.marker_list; marker;
+           marker = marker->next) {
+        marker_bytes += marker->data_length;
+      }
+      jpegli_start_decompress(&cinfo);
+      size_t stride = cinfo.output_width * cinfo.out_color_components;
+      std::vector<uint8_t> output(cinfo.output_height * stride);
+      EXPECT_EQ(cinfo.output_height,
+                jpegli_decode_into(&cinfo, output.data(), stride));
+      jpegli_finish_decompress(&cinfo);
+      num_scans = cinfo.input_scan_number;
+      return true;
+    };
+    if (!try_catch_block()) {
+      limit_error = jpegli_get_decode_limit_error(&cinfo);
+    }
+    jpegli_destroy_decompress(&cinfo);
+    return limit_error;
+  };
+  const size_t num_pixels = config.input.xsize * config.input.ysize;
+  ASSERT_EQ(JPEGLI_LIMIT_NONE, decode(0, 0, 0, 0));
+  ASSERT_GT(num_scans, 1);
+  ASSERT_GT(marker_bytes, 0);
+  const int max_scans = static_cast<int>(num_scans);
+  EXPECT_EQ(JPEGLI_LIMIT_NONE,
+            decode(num_pixels, max_scans, marker_bytes, coeff_memory));
+  EXPECT_EQ(JPEGLI_LIMIT_PIXELS, decode(num_pixels - 1, 0, 0, 0));
+  EXPECT_EQ(JPEGLI_LIMIT_SCANS, decode(0, max_scans - 1, 0, 0));
+  EXPECT_EQ(JPEGLI_LIMIT_MARKER_BYTES, decode(0, 0, marker_bytes - 1, 0));
+  EXPECT_EQ(JPEGLI_LIMIT_COEFF_MEMORY, decode(0, 0, 0, coeff_memory - 1));
+}
+
+TEST(DecodeAPITest, DecodeWork) {
+  TestConfig config;
+  config.input.xsize = 317;
+  config.input.ysize = 223;
+  config.jparams.progressive_mode = 2;
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  const auto decode = [&](size_t chunk_size, JpegliDecodeWork* work) {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      SourceManager src(compressed.data(), compressed.size(), chunk_size);
+      if (chunk_size == 0) {
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      } else {
+        cinfo.src = reinterpret_cast<jpeg_source_mgr*>(&src);
+      }
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      jpegli_start_decompress(&cinfo);
+      size_t stride = cinfo.output_width * cinfo.out_color_components;
+      std::vector<uint8_t> output(cinfo.output_height * stride);
+      EXPECT_EQ(cinfo.output_height,
+                jpegli_decode_into(&cinfo, output.data(), stride));
+      jpegli_finish_decompress(&cinfo);
+      jpegli_get_decode_work(&cinfo, work);
+      EXPECT_EQ(static_cast<size_t>(cinfo.input_scan_number), work->num_scans);
+      return true;
+    };
+    bool success = try_catch_block();
+    jpegli_destroy_decompress(&cinfo);
+    return success;
+  };
+  JpegliDecodeWork work;
+  ASSERT_TRUE(decode(0, &work));
+  EXPECT_GT(work.num_scans, 1u);
+  EXPECT_GT(work.num_mcus, 0u);
+  EXPECT_EQ(0u, work.buffered_bytes);
+  EXPECT_GT(work.num_allocations, 0u);
+  // A source that suspends within the MCUs and marker segments decodes some
+  // MCUs again and goes through the internal input buffer.
+  JpegliDecodeWork chunked_work;
+  ASSERT_TRUE(decode(64, &chunked_work));
+  EXPECT_EQ(work.num_scans, chunked_work.num_scans);
+  EXPECT_GE(chunked_work.num_mcus, work.num_mcus);
+  EXPECT_GT(chunked_work.buffered_bytes, 0u);
+}
+
+TEST(DecodeAPITest, ProgressiveBandRows) {
+  for (unsigned int restart_interval : {0u, 1u, 7u}) {
+    TestConfig config;
+    config.input.xsize = 317;
+    config.input.ysize = 223;
+    config.jparams.progressive_mode = 2;
+    config.jparams.h_sampling = {2, 1, 1};
+    config.jparams.v_sampling = {2, 1, 1};
+    config.jparams.restart_interval = restart_interval;
+    JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed,
+                       GetTestJpegData(config), "Failed to create test data.");
+    size_t coeff_memory = 0;
+    const auto decode = [&](int band_rows, size_t max_coeff_memory,
+                            std::vector<uint8_t>* output) {
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        jpegli_set_decode_limits(&cinfo, 0, 0, 0, max_coeff_memory);
+        jpegli_set_progressive_band_rows(&cinfo, band_rows);
+        jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+        coeff_memory = 0;
+        for (int c = 0; c < cinfo.num_components; ++c) {
+          const jpeg_component_info* comp = &cinfo.comp_info[c];
+          coeff_memory +=
+              comp->width_in_blocks * comp->height_in_blocks * sizeof(JBLOCK);
+        }
+        jpegli_start_decompress(&cinfo);
+        size_t stride = cinfo.output_width * cinfo.out_color_components;
+        output->resize(cinfo.output_height * stride);
+        EXPECT_EQ(cinfo.output_height,
+                  jpegli_decode_into(&cinfo, output->data(), stride));
+        jpegli_finish_decompress(&cinfo);
+        return true;
+      };
+      bool ok = try_catch_block();
+      jpegli_destroy_decompress(&cinfo);
+      return ok;
+    };
+    std::vector<uint8_t> expected;
+    ASSERT_TRUE(decode(0, 0, &expected));
+    for (int band_rows : {1, 2, 5}) {
+      std::vector<uint8_t> output;
+      ASSERT_TRUE(decode(band_rows, 0, &output));
+      EXPECT_EQ(expected, output) << "restart interval " << restart_interval
+                                  << " band rows " << band_rows;
+    }
+    // With a restart marker after each block of the AC scans, the buffer has
+    // the rows of a band and its context rows.
+    if (restart_interval == 1) {
+      std::vector<uint8_t> output;
+      ASSERT_FALSE(decode(0, coeff_memory / 2, &output));
+      ASSERT_TRUE(decode(1, coeff_memory / 2, &output));
+      EXPECT_EQ(expected, output);
+    }
+  }
 }
 
-std::vector<TestConfig> GenerateBasicConfigs() {
-  std::vector<TestConfig> all_configs;
-  for (int samp : {1, 2}) {
-    for (int progr : {0, 2}) {
-      TestConfig config;
-      config.input.xsize = 257 + samp * 37;
-      config.input.ysize = 265 + (progr / 2) * 17;
-      config.jparams.h_sampling = {samp, 1, 1};
-      config.jparams.v_sampling = {samp, 1, 1};
-      config.jparams.progressive_mode = progr;
-      GeneratePixels(&config.input);
-      all_configs.push_back(config);
+void InvertOutputRow(void* opaque, size_t thread, float* rows[],
+                     size_t num_channels, size_t xsize) {
+  EXPECT_LT(thread, JPEGLI_MAX_ROW_TRANSFORM_THREADS);
+  for (size_t c = 0; c < num_channels; ++c) {
+    for (size_t x = 0; x < xsize; ++x) {
+      rows[c][x] = 1.0f - rows[c][x];
     }
   }
-  return all_configs;
 }
 
-TEST(DecodeAPITest, ReuseCinfoSameMemSource) {
-  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
-  uint8_t* buffer = nullptr;
-  unsigned long buffer_size = 0;  // NOLINT
-  {
-    jpeg_compress_struct cinfo;
+TEST(DecodeAPITest, OutputRowTransform) {
+  TestConfig config;
+  config.input.xsize = 317;
+  config.input.ysize = 223;
+  config.jparams.h_sampling = {2, 1, 1};
+  config.jparams.v_sampling = {2, 1, 1};
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  DecompressParams dparams;
+  const auto decode = [&](bool invert, std::vector<uint8_t>* output) {
+    jpeg_decompress_struct cinfo;
     const auto try_catch_block = [&]() -> bool {
       ERROR_HANDLER_SETUP(jpegli);
-      jpegli_create_compress(&cinfo);
-      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
-      for (const TestConfig& config : all_configs) {
-        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      SetParallelRunner(dparams, &cinfo);
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      if (invert) {
+        jpegli_set_output_row_transform(&cinfo, InvertOutputRow, nullptr);
       }
+      jpegli_start_decompress(&cinfo);
+      size_t stride = cinfo.output_width * cinfo.out_color_components;
+      output->resize(cinfo.output_height * stride);
+      EXPECT_EQ(cinfo.output_height,
+                jpegli_decode_into(&cinfo, output->data(), stride));
+      jpegli_finish_decompress(&cinfo);
       return true;
     };
-    EXPECT_TRUE(try_catch_block());
-    jpegli_destroy_compress(&cinfo);
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  };
+  for (size_t num_threads : {0, 3}) {
+    dparams.num_threads = num_threads;
+    std::vector<uint8_t> expected;
+    std::vector<uint8_t> output;
+    decode(/*invert=*/false, &expected);
+    decode(/*invert=*/true, &output);
+    ASSERT_EQ(expected.size(), output.size());
+    for (size_t i = 0; i < output.size(); ++i) {
+      ASSERT_NEAR(255 - expected[i], output[i], 1) << " i = " << i;
+    }
   }
-  std::vector<TestImage> all_outputs(all_configs.size());
-  {
+}
+
+// An inverse transform backend with the reference inverse DCT.
+boolean ReferenceInverseTransform(
+    void* opaque, JDIMENSION /*imcu_row*/, int num_components,
+    const JpegliInverseTransformComponent* components) {
+  ++*static_cast<size_t*>(opaque);
+  for (int c = 0; c < num_components; ++c) {
+    const JpegliInverseTransformComponent& ic = components[c];
+    for (int by = 0; by < ic.num_block_rows; ++by) {
+      for (JDIMENSION bx = ic.block_begin; bx < ic.block_end; ++bx) {
+        const JCOEF* block = ic.coeffs[by][bx];
+        float dequant[DCTSIZE2];
+        for (int k = 0; k < DCTSIZE2; ++k) {
+          const float q = block[k];
+          const float sign = q < 0 ? -1.0f : 1.0f;
+          dequant[k] =
+              q == 0 ? 0.0f : (q - sign * ic.biases[k]) * ic.dequant[k];
+        }
+        for (int y = 0; y < DCTSIZE; ++y) {
+          float* row = ic.output + (by * DCTSIZE + y) * ic.output_stride;
+          for (int x = 0; x < DCTSIZE; ++x) {
+            double sum = 0.0;
+            for (int v = 0; v < DCTSIZE; ++v) {
+              for (int u = 0; u < DCTSIZE; ++u) {
+                const double cu = u == 0 ? M_SQRT1_2 : 1.0;
+                const double cv = v == 0 ? M_SQRT1_2 : 1.0;
+                sum += cu * cv * dequant[v * DCTSIZE + u] *
+                       std::cos((2 * x + 1) * u * M_PI / 16) *
+                       std::cos((2 * y + 1) * v * M_PI / 16);
+              }
+            }
+            row[bx * DCTSIZE + x] = 2.0 * sum;
+          }
+        }
+      }
+    }
+  }
+  return TRUE;
+}
+
+TEST(DecodeAPITest, TransformBackend) {
+  TestConfig config;
+  config.input.xsize = 137;
+  config.input.ysize = 75;
+  config.jparams.h_sampling = {2, 1, 1};
+  config.jparams.v_sampling = {2, 1, 1};
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  DecompressParams dparams;
+  const auto decode = [&](size_t* num_calls, std::vector<uint8_t>* output) {
     jpeg_decompress_struct cinfo;
     const auto try_catch_block = [&]() -> bool {
       ERROR_HANDLER_SETUP(jpegli);
       jpegli_create_decompress(&cinfo);
-      jpegli_mem_src(&cinfo, buffer, buffer_size);
-      for (size_t i = 0; i < all_configs.size(); ++i) {
-        TestAPINonBuffered(all_configs[i].jparams, DecompressParams(),
-                           all_configs[i].input, &cinfo, &all_outputs[i]);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      if (num_calls != nullptr) {
+        JpegliTransformBackend backend = {nullptr, ReferenceInverseTransform,
+                                          num_calls};
+        jpegli_set_transform_backend(reinterpret_cast<j_common_ptr>(&cinfo),
+                                     &backend);
       }
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      jpegli_start_decompress(&cinfo);
+      size_t stride = cinfo.output_width * cinfo.out_color_components;
+      output->resize(cinfo.output_height * stride);
+      EXPECT_EQ(cinfo.output_height,
+                jpegli_decode_into(&cinfo, output->data(), stride));
+      jpegli_finish_decompress(&cinfo);
       return true;
     };
-    EXPECT_TRUE(try_catch_block());
+    ASSERT_TRUE(try_catch_block());
     jpegli_destroy_decompress(&cinfo);
+  };
+  std::vector<uint8_t> expected;
+  std::vector<uint8_t> output;
+  size_t num_calls = 0;
+  decode(nullptr, &expected);
+  decode(&num_calls, &output);
+  EXPECT_EQ(DivCeil(config.input.ysize, 16), num_calls);
+  ASSERT_EQ(expected.size(), output.size());
+  for (size_t i = 0; i < output.size(); ++i) {
+    ASSERT_NEAR(expected[i], output[i], 1) << " i = " << i;
   }
-  for (size_t i = 0; i < all_configs.size(); ++i) {
-    VerifyOutputImage(all_configs[i].input, all_outputs[i], 2.35f);
-  }
-  if (buffer) free(buffer);
 }
 
-TEST(DecodeAPITest, ReuseCinfoSameStdSource) {
-  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
-  FILE* tmpf = tmpfile();
-  ASSERT_TRUE(tmpf);
-  {
-    jpeg_compress_struct cinfo;
+TEST(DecodeAPITest, FastDecodeSpeed) {
+  TestConfig config;
+  config.input.xsize = 137;
+  config.input.ysize = 75;
+  config.jparams.h_sampling = {2, 1, 1};
+  config.jparams.v_sampling = {2, 1, 1};
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  const auto decode = [&](bool fast, std::vector<uint8_t>* output) {
+    jpeg_decompress_struct cinfo;
     const auto try_catch_block = [&]() -> bool {
       ERROR_HANDLER_SETUP(jpegli);
-      jpegli_create_compress(&cinfo);
-      jpegli_stdio_dest(&cinfo, tmpf);
-      for (const TestConfig& config : all_configs) {
-        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      if (fast) {
+        jpegli_set_decode_speed(&cinfo, JPEGLI_DECODE_FAST);
+        EXPECT_EQ(JDCT_IFAST, cinfo.dct_method);
+        EXPECT_FALSE(cinfo.do_fancy_upsampling);
+        EXPECT_FALSE(cinfo.do_block_smoothing);
+      } else {
+        cinfo.do_fancy_upsampling = FALSE;
       }
+      jpegli_start_decompress(&cinfo);
+      size_t stride = cinfo.output_width * cinfo.out_color_components;
+      output->resize(cinfo.output_height * stride);
+      EXPECT_EQ(cinfo.output_height,
+                jpegli_decode_into(&cinfo, output->data(), stride));
+      jpegli_finish_decompress(&cinfo);
       return true;
     };
-    EXPECT_TRUE(try_catch_block());
-    jpegli_destroy_compress(&cinfo);
-  }
-  fseek(tmpf, 0, SEEK_SET);
-  std::vector<TestImage> all_outputs(all_configs.size());
-  {
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  };
+  std::vector<uint8_t> expected;
+  std::vector<uint8_t> output;
+  decode(false, &expected);
+  decode(true, &output);
+  ASSERT_EQ(expected.size(), output.size());
+  // The outputs differ by the rounding of the fixed point inverse DCT and by
+  // the dequantization biases.
+  double sum_abs_diff = 0.0;
+  for (size_t i = 0; i < output.size(); ++i) {
+    ASSERT_NEAR(expected[i], output[i], 8) << " i = " << i;
+    sum_abs_diff += std::abs(expected[i] - output[i]);
+  }
+  EXPECT_LT(sum_abs_diff / output.size(), 1.0);
+}
+
+TEST(DecodeAPITest, SharedContext) {
+  TestConfig config;
+  config.input.xsize = 317;
+  config.input.ysize = 223;
+  config.jparams.h_sampling = {2, 1, 1};
+  config.jparams.v_sampling = {2, 1, 1};
+  config.jparams.restart_interval = 5;
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  size_t num_threads = 3;
+  jpegli_context* context = jpegli_create_context();
+  jpegli_context_set_parallel_runner(context, &TestParallelRunner,
+                                     &num_threads);
+  const auto decode = [&](jpegli_context* ctx, std::vector<uint8_t>* output) {
     jpeg_decompress_struct cinfo;
     const auto try_catch_block = [&]() -> bool {
       ERROR_HANDLER_SETUP(jpegli);
       jpegli_create_decompress(&cinfo);
-      jpegli_stdio_src(&cinfo, tmpf);
-      for (size_t i = 0; i < all_configs.size(); ++i) {
-        TestAPINonBuffered(all_configs[i].jparams, DecompressParams(),
-                           all_configs[i].input, &cinfo, &all_outputs[i]);
-      }
+      jpegli_attach_context(reinterpret_cast<j_common_ptr>(&cinfo), ctx);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      jpegli_start_decompress(&cinfo);
+      size_t stride = cinfo.output_width * cinfo.out_color_components;
+      output->resize(cinfo.output_height * stride);
+      EXPECT_EQ(cinfo.output_height,
+                jpegli_decode_into(&cinfo, output->data(), stride));
+      jpegli_finish_decompress(&cinfo);
       return true;
     };
-    EXPECT_TRUE(try_catch_block());
+    ASSERT_TRUE(try_catch_block());
     jpegli_destroy_decompress(&cinfo);
+  };
+  std::vector<uint8_t> expected;
+  decode(nullptr, &expected);
+  // The objects keep the context alive after the caller releases it.
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    jpegli_attach_context(reinterpret_cast<j_common_ptr>(&cinfo), context);
+    return true;
+  };
+  ASSERT_TRUE(try_catch_block());
+  for (int i = 0; i < 3; ++i) {
+    std::vector<uint8_t> output;
+    decode(context, &output);
+    ASSERT_EQ(expected.size(), output.size());
+    EXPECT_EQ(0, memcmp(expected.data(), output.data(), output.size()));
+    if (i == 0) jpegli_release_context(context);
   }
-  for (size_t i = 0; i < all_configs.size(); ++i) {
-    VerifyOutputImage(all_configs[i].input, all_outputs[i], 2.35f);
-  }
-  fclose(tmpf);
+  jpegli_destroy_decompress(&cinfo);
 }
 
-TEST(DecodeAPITest, AbbreviatedStreams) {
-  uint8_t* table_stream = nullptr;
-  unsigned long table_stream_size = 0;  // NOLINT
-  uint8_t* data_stream = nullptr;
-  unsigned long data_stream_size = 0;  // NOLINT
-  {
-    jpeg_compress_struct cinfo;
+TEST(DecodeAPITest, EstimateSourceQuality) {
+  for (bool libjpeg_mode : {false, true}) {
+    TestConfig config;
+    config.input.xsize = 317;
+    config.input.ysize = 223;
+    config.jparams.quality = 75;
+    config.jparams.libjpeg_mode = libjpeg_mode;
+    JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed,
+                       GetTestJpegData(config), "Failed to create test data.");
+    JpegliSourceQuality quality;
+    jpeg_decompress_struct cinfo;
     const auto try_catch_block = [&]() -> bool {
       ERROR_HANDLER_SETUP(jpegli);
-      jpegli_create_compress(&cinfo);
-      jpegli_mem_dest(&cinfo, &table_stream, &table_stream_size);
-      cinfo.input_components = 3;
-      cinfo.in_color_space = JCS_RGB;
-      jpegli_set_defaults(&cinfo);
-      jpegli_write_tables(&cinfo);
-      jpegli_mem_dest(&cinfo, &data_stream, &data_stream_size);
-      cinfo.image_width = 1;
-      cinfo.image_height = 1;
-      cinfo.optimize_coding = FALSE;
-      jpegli_set_progressive_level(&cinfo, 0);
-      jpegli_start_compress(&cinfo, FALSE);
-      JSAMPLE image[3] = {0};
-      JSAMPROW row[] = {image};
-      jpegli_write_scanlines(&cinfo, row, 1);
-      jpegli_finish_compress(&cinfo);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      EXPECT_TRUE(jpegli_estimate_source_quality(&cinfo, &quality));
       return true;
     };
-    EXPECT_TRUE(try_catch_block());
-    EXPECT_LT(data_stream_size, 50);
-    jpegli_destroy_compress(&cinfo);
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+    if (libjpeg_mode) {
+      EXPECT_EQ(75, quality.libjpeg_quality);
+    } else {
+      float distance = jpegli_quality_to_distance(75);
+      EXPECT_NEAR(distance, quality.distance, 0.1f * distance);
+    }
+    const float num_pixels = config.input.xsize * config.input.ysize;
+    EXPECT_FLOAT_EQ(8.0f * compressed.size() / num_pixels,
+                    quality.bits_per_pixel);
   }
-  {
-    jpeg_decompress_struct cinfo = {};
+}
+
+// Returns the normalized weights of the input samples of output sample i of a
+// resampling from in_size to out_size samples with the given filter.
+std::vector<std::pair<size_t, double>> ResizeWeights(size_t in_size,
+                                                     size_t out_size,
+                                                     JpegliResizeFilter filter,
+                                                     size_t i) {
+  const double scale = static_cast<double>(in_size) / out_size;
+  const double filter_scale = std::max(1.0, scale);
+  const double center = (i + 0.5) * scale - 0.5;
+  std::vector<std::pair<size_t, double>> weights;
+  double sum = 0.0;
+  for (size_t x = 0; x < in_size; ++x) {
+    double d = (x - center) / filter_scale;
+    double w = 0.0;
+    if (filter == JPEGLI_FILTER_BOX) {
+      w = d >= -0.5 && d < 0.5 ? 1.0 : 0.0;
+    } else if (filter == JPEGLI_FILTER_TRIANGLE) {
+      w = std::max(0.0, 1.0 - std::abs(d));
+    } else if (std::abs(d) < 3.0) {
+      const auto sinc = [](double v) {
+        const double kPi = 3.14159265358979323846;
+        return v == 0.0 ? 1.0 : std::sin(kPi * v) / (kPi * v);
+      };
+      w = sinc(d) * sinc(d / 3.0);
+    }
+    if (w != 0.0) weights.emplace_back(x, w);
+    sum += w;
+  }
+  for (auto& weight : weights) weight.second /= sum;
+  return weights;
+}
+
+TEST(DecodeAPITest, OutputSize) {
+  TestConfig config;
+  config.input.xsize = 131;
+  config.input.ysize = 75;
+  config.jparams.h_sampling = {2, 1, 1};
+  config.jparams.v_sampling = {2, 1, 1};
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  // Decodes the image as float samples, resized to width x height if width is
+  // not zero, or scaled by scale_num / 8, one row at a time.
+  const auto decode = [&](size_t width, size_t height,
+                          JpegliResizeFilter filter, unsigned int scale_num,
+                          size_t* xsize, size_t* ysize,
+                          std::vector<float>* output) {
+    jpeg_decompress_struct cinfo;
     const auto try_catch_block = [&]() -> bool {
       ERROR_HANDLER_SETUP(jpegli);
       jpegli_create_decompress(&cinfo);
-      jpegli_mem_src(&cinfo, table_stream, table_stream_size);
-      jpegli_read_header(&cinfo, FALSE);
-      jpegli_mem_src(&cinfo, data_stream, data_stream_size);
-      jpegli_read_header(&cinfo, TRUE);
-      EXPECT_EQ(1, cinfo.image_width);
-      EXPECT_EQ(1, cinfo.image_height);
-      EXPECT_EQ(3, cinfo.num_components);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      jpegli_set_output_format(&cinfo, JPEGLI_TYPE_FLOAT, JPEGLI_NATIVE_ENDIAN);
+      if (width != 0) {
+        jpegli_set_output_size(&cinfo, width, height, filter);
+      } else {
+        cinfo.scale_num = scale_num;
+        cinfo.scale_denom = 8;
+      }
       jpegli_start_decompress(&cinfo);
-      JSAMPLE image[3] = {0};
-      JSAMPROW row[] = {image};
-      jpegli_read_scanlines(&cinfo, row, 1);
-      EXPECT_EQ(0, image[0]);
-      EXPECT_EQ(0, image[1]);
-      EXPECT_EQ(0, image[2]);
+      *xsize = cinfo.output_width;
+      *ysize = cinfo.output_height;
+      size_t stride = cinfo.output_width * 3;
+      output->resize(cinfo.output_height * stride);
+      while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = reinterpret_cast<JSAMPROW>(
+            &(*output)[cinfo.output_scanline * stride]);
+        EXPECT_EQ(1u, jpegli_read_scanlines(&cinfo, &row, 1));
+      }
       jpegli_finish_decompress(&cinfo);
       return true;
     };
-    EXPECT_TRUE(try_catch_block());
+    ASSERT_TRUE(try_catch_block());
     jpegli_destroy_decompress(&cinfo);
+  };
+  struct Target {
+    size_t width;
+    size_t height;
+    JpegliResizeFilter filter;
+    // Scale of the inverse DCT that is expected to be used.
+    unsigned int scale_num;
+  };
+  const Target targets[] = {
+      {131, 75, JPEGLI_FILTER_LANCZOS3, 8}, {66, 38, JPEGLI_FILTER_BOX, 4},
+      {40, 23, JPEGLI_FILTER_TRIANGLE, 3},  {40, 23, JPEGLI_FILTER_LANCZOS3, 3},
+      {15, 9, JPEGLI_FILTER_BOX, 1},        {1, 1, JPEGLI_FILTER_TRIANGLE, 1},
+      {200, 90, JPEGLI_FILTER_LANCZOS3, 8},
+  };
+  for (const Target& target : targets) {
+    std::vector<float> expected;
+    std::vector<float> output;
+    size_t src_xsize;
+    size_t src_ysize;
+    size_t xsize;
+    size_t ysize;
+    decode(0, 0, JPEGLI_FILTER_BOX, target.scale_num, &src_xsize, &src_ysize,
+           &expected);
+    decode(target.width, target.height, target.filter, 0, &xsize, &ysize,
+           &output);
+    ASSERT_EQ(target.width, xsize);
+    ASSERT_EQ(target.height, ysize);
+    for (size_t y = 0; y < ysize; ++y) {
+      const auto ywts = ResizeWeights(src_ysize, ysize, target.filter, y);
+      for (size_t x = 0; x < xsize; ++x) {
+        const auto xwts = ResizeWeights(src_xsize, xsize, target.filter, x);
+        for (size_t c = 0; c < 3; ++c) {
+          double sum = 0.0;
+          for (const auto& yw : ywts) {
+            for (const auto& xw : xwts) {
+              sum += yw.second * xw.second *
+                     expected[(yw.first * src_xsize + xw.first) * 3 + c];
+            }
+          }
+          ASSERT_NEAR(sum, output[(y * xsize + x) * 3 + c], 1e-4)
+              << "target " << target.width << "x" << target.height
+              << " filter " << target.filter << " x " << x << " y " << y;
+        }
+      }
+    }
   }
-  if (table_stream) free(table_stream);
-  if (data_stream) free(data_stream);
 }
 
 class DecodeAPITestParam : public ::testing::TestWithParam<TestConfig> {};
@@ -883,8 +2977,8 @@ std::vector<TestConfig> GenerateTests(bool buffered) {
   }
 
   // Tests for output formats.
-  for (JpegliDataType type :
-       {JPEGLI_TYPE_UINT8, JPEGLI_TYPE_UINT16, JPEGLI_TYPE_FLOAT}) {
+  for (JpegliDataType type : {JPEGLI_TYPE_UINT8, JPEGLI_TYPE_UINT16,
+                              JPEGLI_TYPE_FLOAT16, JPEGLI_TYPE_FLOAT}) {
     for (JpegliEndianness endianness :
          {JPEGLI_NATIVE_ENDIAN, JPEGLI_LITTLE_ENDIAN, JPEGLI_BIG_ENDIAN}) {
       if (type == JPEGLI_TYPE_UINT8 && endianness != JPEGLI_NATIVE_ENDIAN) {
@@ -902,11 +2996,23 @@ std::vector<TestConfig> GenerateTests(bool buffered) {
       }
     }
   }
-  // Test for output cropping.
-  {
-    TestConfig config;
-    config.dparams.crop_output = true;
-    all_tests.push_back(config);
+  // Tests for output cropping.
+  for (int samp : {1, 2}) {
+    for (int progr : {0, 2}) {
+      for (bool smoothing : {false, true}) {
+        if (smoothing && progr == 0) continue;
+        TestConfig config;
+        config.jparams.h_sampling = {samp, 1, 1};
+        config.jparams.v_sampling = {samp, 1, 1};
+        config.jparams.progressive_mode = progr;
+        config.dparams.crop_output = true;
+        config.dparams.do_block_smoothing = smoothing;
+        if (smoothing) {
+          config.max_rms_dist = 8.0f;
+        }
+        all_tests.push_back(config);
+      }
+    }
   }
   // Tests for color transforms.
   for (J_COLOR_SPACE out_color_space :
@@ -969,6 +3075,66 @@ std::vector<TestConfig> GenerateTests(bool buffered) {
     config.jparams.restart_in_rows = rr;
     all_tests.push_back(config);
   }
+  // Tests for decoding the restart intervals in parallel.
+  for (size_t r : {1, 17, 1024}) {
+    for (int samp : {1, 2}) {
+      for (float size_factor : {0.5f, 1.0f}) {
+        TestConfig config;
+        config.input.xsize = 517;
+        config.input.ysize = 523;
+        config.jparams.h_sampling = {samp, 1, 1};
+        config.jparams.v_sampling = {samp, 1, 1};
+        config.jparams.restart_interval = r;
+        config.dparams.size_factor = size_factor;
+        config.dparams.num_threads = 3;
+        if (size_factor < 1.0f) {
+          config.max_rms_dist = samp == 1 ? 1.75f : 3.0f;
+          config.max_diff = 255.0f;
+        }
+        all_tests.push_back(config);
+      }
+    }
+  }
+  for (size_t chunk_size : {0, 65536}) {
+    TestConfig config;
+    config.jparams.restart_in_rows = 3;
+    config.dparams.chunk_size = chunk_size;
+    config.dparams.num_threads = 8;
+    all_tests.push_back(config);
+  }
+  // Tests for decoding destuffed scans.
+  for (size_t r : {0, 17}) {
+    for (int progr : {0, 2}) {
+      for (size_t num_threads : {0, 3}) {
+        TestConfig config;
+        config.input.xsize = 517;
+        config.input.ysize = 523;
+        config.jparams.progressive_mode = progr;
+        config.jparams.restart_interval = r;
+        config.dparams.chunk_size = 0;
+        config.dparams.num_threads = num_threads;
+        config.dparams.destuffed_scans = true;
+        all_tests.push_back(config);
+      }
+    }
+  }
+  // Tests for rendering the output in parallel.
+  for (int progr : {0, 2}) {
+    for (int samp : {1, 2}) {
+      for (int scale_denom : {1, 2}) {
+        TestConfig config;
+        config.input.xsize = 517;
+        config.input.ysize = 523;
+        config.jparams.progressive_mode = progr;
+        config.jparams.h_sampling = {samp, 1, 1};
+        config.jparams.v_sampling = {samp, 1, 1};
+        config.dparams.scale_denom = scale_denom;
+        config.dparams.max_output_lines = 0;
+        config.dparams.num_threads = 3;
+        all_tests.push_back(config);
+      }
+    }
+  }
   // Tests for custom quantization tables.
   for (int type : {0, 1, 10, 100, 10000}) {
     for (int scale : {1, 50, 100, 200, 500}) {
@@ -1213,6 +3379,24 @@ std::vector<TestConfig> GenerateTests(bool buffered) {
     }
   }
   // Tests for output scaling.
+  // Tests for decoding only the DC coefficients at 1/8 scale.
+  for (int progr : {0, 2}) {
+    for (int samp : {1, 2}) {
+      for (size_t restart_interval : {0, 5}) {
+        for (size_t chunk_size : {0, 4096}) {
+          TestConfig config;
+          config.jparams.progressive_mode = progr;
+          config.jparams.h_sampling = {samp, 1, 1};
+          config.jparams.v_sampling = {samp, 1, 1};
+          config.jparams.restart_interval = restart_interval;
+          config.dparams.chunk_size = chunk_size;
+          config.dparams.scale_num = 1;
+          config.dparams.scale_denom = 8;
+          all_tests.push_back(config);
+        }
+      }
+    }
+  }
   for (int scale_num = 1; scale_num <= 16; ++scale_num) {
     if (scale_num == 8) continue;
     for (bool crop : {false, true}) {
@@ -1308,6 +3492,12 @@ std::ostream& operator<<(std::ostream& os, const DecompressParams& dparams) {
   if (dparams.skip_scans) {
     os << "SkipScans";
   }
+  if (dparams.num_threads > 0) {
+    os << "Threads" << dparams.num_threads;
+  }
+  if (dparams.destuffed_scans) {
+    os << "Destuffed";
+  }
   return os;
 }
 
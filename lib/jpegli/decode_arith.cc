@@ -0,0 +1,326 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "lib/jpegli/decode_arith.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "lib/jpegli/common_internal.h"
+
+namespace jpegli {
+namespace {
+
+// Probability estimation state machine of ITU-T T.81 Table D.2. Each entry
+// has Qe_Value in bits 16-31, Next_Index_MPS in bits 8-15, Switch_MPS in bit 7
+// and Next_Index_LPS in bits 0-6. The last entry is a fixed 0.5 probability
+// state that is used for the sign and refinement bits.
+constexpr uint32_t kArithTable[114] = {
+    0x5a1d0181, 0x2586020e, 0x11140310, 0x080b0412, 0x03d80514, 0x01da0617,
+    0x00e50719, 0x006f081c, 0x0036091e, 0x001a0a21, 0x000d0b23, 0x00060c09,
+    0x00030d0a, 0x00010d0c, 0x5a7f0f8f, 0x3f251024, 0x2cf21126, 0x207c1227,
+    0x17b91328, 0x1182142a, 0x0cef152b, 0x09a1162d, 0x072f172e, 0x055c1830,
+    0x04061931, 0x03031a33, 0x02401b34, 0x01b11c36, 0x01441d38, 0x00f51e39,
+    0x00b71f3b, 0x008a203c, 0x0068213e, 0x004e223f, 0x003b2320, 0x002c0921,
+    0x5ae125a5, 0x484c2640, 0x3a0d2741, 0x2ef12843, 0x261f2944, 0x1f332a45,
+    0x19a82b46, 0x15182c48, 0x11772d49, 0x0e742e4a, 0x0bfb2f4b, 0x09f8304d,
+    0x0861314e, 0x0706324f, 0x05cd3330, 0x04de3432, 0x040f3532, 0x03633633,
+    0x02d43734, 0x025c3835, 0x01f83936, 0x01a43a37, 0x01603b38, 0x01253c39,
+    0x00f63d3a, 0x00cb3e3b, 0x00ab3f3d, 0x008f203d, 0x5b1241c1, 0x4d044250,
+    0x412c4351, 0x37d84452, 0x2fe84553, 0x293c4654, 0x23794756, 0x1edf4857,
+    0x1aa94957, 0x174e4a48, 0x14244b48, 0x119c4c4a, 0x0f6b4d4a, 0x0d514e4b,
+    0x0bb64f4d, 0x0a40304d, 0x583251d0, 0x4d1c5258, 0x438e5359, 0x3bdd545a,
+    0x34ee555b, 0x2eae565c, 0x299a575d, 0x25164756, 0x557059d8, 0x4ca95a5f,
+    0x44d95b60, 0x3e225c61, 0x38245d63, 0x32b45e63, 0x2e17565d, 0x56a860df,
+    0x4f466165, 0x47e56266, 0x41cf6367, 0x3c3d6468, 0x375e5d63, 0x52316669,
+    0x4c0f676a, 0x4639686b, 0x415e6367, 0x56276ae9, 0x50e76b6c, 0x4b85676d,
+    0x55976d6e, 0x504f6b6f, 0x5a106fee, 0x55226d70, 0x59eb6ff0, 0x5a1d7171,
+};
+
+constexpr uint8_t kFixedBin = 113;
+
+// First statistics bins of the magnitude categories (Tables F.4 and F.5).
+constexpr int kDCMagnitudeBin = 20;
+constexpr int kACLowMagnitudeBin = 189;
+constexpr int kACHighMagnitudeBin = 217;
+
+// Arithmetic decoding procedure of T.81 section D.2 in the formulation of the
+// IJG libjpeg, where the C register is aligned with the A register shifted
+// left by ct bits.
+class ArithDecoder {
+ public:
+  ArithDecoder(ArithCodingState* state, const uint8_t* data, size_t len,
+               size_t pos)
+      : s_(state), data_(data), len_(len), pos_(pos) {}
+
+  // Decodes one binary decision with the statistics bin *st and updates its
+  // probability estimate.
+  int Decode(uint8_t* st) {
+    while (s_->a < 0x8000) {
+      if (--s_->ct < 0) {
+        s_->c = (s_->c << 8) | NextByte();
+        if ((s_->ct += 8) < 0) {
+          // The first two bytes of the interval.
+          if (++s_->ct == 0) s_->a = 0x8000;
+        }
+      }
+      s_->a <<= 1;
+    }
+    int sv = *st;
+    uint32_t qe = kArithTable[sv & 0x7f];
+    const uint8_t nl = qe & 0xff;
+    qe >>= 8;
+    const uint8_t nm = qe & 0xff;
+    qe >>= 8;
+    s_->a -= qe;
+    const int64_t temp = static_cast<int64_t>(s_->a) << s_->ct;
+    if (s_->c >= temp) {
+      s_->c -= temp;
+      // Conditional LPS exchange.
+      if (s_->a < qe) {
+        *st = (sv & 0x80) ^ nm;
+      } else {
+        *st = (sv & 0x80) ^ nl;
+        sv ^= 0x80;
+      }
+      s_->a = qe;
+    } else if (s_->a < 0x8000) {
+      // Conditional MPS exchange.
+      if (s_->a < qe) {
+        *st = (sv & 0x80) ^ nl;
+        sv ^= 0x80;
+      } else {
+        *st = (sv & 0x80) ^ nm;
+      }
+    }
+    return sv >> 7;
+  }
+
+  size_t pos() const { return pos_; }
+  bool need_more_input() const { return need_more_input_; }
+
+ private:
+  // Returns the next byte of the entropy coded data, skipping the 0xff/0x00
+  // escape sequences. After the end of the data, i.e. at the next marker, the
+  // data is padded with zeros (section D.2.6).
+  uint8_t NextByte() {
+    if (pos_ >= len_) {
+      need_more_input_ = true;
+      return 0;
+    }
+    if (data_[pos_] != 0xff) {
+      return data_[pos_++];
+    }
+    size_t next = pos_ + 1;
+    while (next < len_ && data_[next] == 0xff) ++next;
+    if (next >= len_) {
+      need_more_input_ = true;
+      return 0;
+    }
+    if (data_[next] == 0) {
+      pos_ = next + 1;
+      return 0xff;
+    }
+    // Stay at the marker, so that it is found again by the next read and by
+    // the marker processing after the scan.
+    pos_ = next - 1;
+    return 0;
+  }
+
+  ArithCodingState* s_;
+  const uint8_t* data_;
+  size_t len_;
+  size_t pos_;
+  bool need_more_input_ = false;
+};
+
+// Decodes the magnitude bits of a nonzero DC difference or AC coefficient
+// whose magnitude category is m (Figure F.24), where st is the last bin of the
+// magnitude category decisions, and returns its absolute value.
+int DecodeMagnitudeBits(ArithDecoder* dec, uint8_t* st, int m) {
+  int v = m;
+  st += 14;
+  while (m >>= 1) {
+    if (dec->Decode(st)) v |= m;
+  }
+  return v + 1;
+}
+
+// Decodes the DC coefficient of a first DC scan (sections F.2.4.1 and
+// G.1.3.1). Returns false if the magnitude is invalid.
+bool DecodeDCFirst(j_decompress_ptr cinfo, ArithDecoder* dec, int tbl, int c,
+                   int Al, coeff_t* last_dc_coeff, coeff_t* coeffs) {
+  ArithCodingState* s = &cinfo->master->arith_;
+  uint8_t* stats = s->dc_stats[tbl];
+  uint8_t* st = stats + s->dc_context[c];
+  if (dec->Decode(st) == 0) {
+    s->dc_context[c] = 0;
+  } else {
+    const int sign = dec->Decode(st + 1);
+    st += 2 + sign;
+    // Magnitude category (Figure F.23), continued in the X1, X2, ... bins of
+    // Table F.4 after the first decision.
+    int m = dec->Decode(st);
+    if (m != 0) {
+      st = stats + kDCMagnitudeBin;
+      while (dec->Decode(st)) {
+        if ((m <<= 1) == 0x8000) return false;
+        ++st;
+      }
+    }
+    // Conditioning category of the next DC difference (F.1.4.4.1.2).
+    if (m < ((1 << cinfo->arith_dc_L[tbl]) >> 1)) {
+      s->dc_context[c] = 0;
+    } else if (m > ((1 << cinfo->arith_dc_U[tbl]) >> 1)) {
+      s->dc_context[c] = 12 + sign * 4;
+    } else {
+      s->dc_context[c] = 4 + sign * 4;
+    }
+    int v = DecodeMagnitudeBits(dec, st, m);
+    if (sign) v = -v;
+    *last_dc_coeff = static_cast<coeff_t>(*last_dc_coeff + v);
+  }
+  coeffs[0] = static_cast<coeff_t>(*last_dc_coeff * (1 << Al));
+  return true;
+}
+
+// Decodes the AC coefficients Ss..Se of a sequential or first AC scan
+// (sections F.2.4.2 and G.1.3.2). Returns false if the coefficients overflow
+// the block or 16 bits.
+bool DecodeACFirst(j_decompress_ptr cinfo, ArithDecoder* dec, int tbl, int Ss,
+                   int Se, int Al, coeff_t* coeffs) {
+  uint8_t* stats = cinfo->master->arith_.ac_stats[tbl];
+  const uint32_t* order = cinfo->master->coeff_order_;
+  uint8_t fixed_bin = kFixedBin;
+  for (int k = Ss; k <= Se; ++k) {
+    uint8_t* st = stats + 3 * (k - 1);
+    if (dec->Decode(st)) break;  // end of block
+    while (dec->Decode(st + 1) == 0) {
+      st += 3;
+      if (++k > Se) return false;
+    }
+    const int sign = dec->Decode(&fixed_bin);
+    st += 2;
+    // Magnitude category (Figure F.23), where unlike for the DC differences
+    // the first two decisions use the same bin, and the rest continue in the
+    // X2, X3, ... bins of Table F.5.
+    int m = dec->Decode(st);
+    if (m != 0 && dec->Decode(st)) {
+      m <<= 1;
+      st = stats + (k <= cinfo->arith_ac_K[tbl] ? kACLowMagnitudeBin
+                                                : kACHighMagnitudeBin);
+      while (dec->Decode(st)) {
+        if ((m <<= 1) == 0x8000) return false;
+        ++st;
+      }
+    }
+    int v = DecodeMagnitudeBits(dec, st, m);
+    if (sign) v = -v;
+    coeffs[order[k]] = static_cast<coeff_t>(v * (1 << Al));
+  }
+  return true;
+}
+
+// Decodes the refinement bits of the AC coefficients Ss..Se (section G.1.3.3).
+// Returns false if the newly nonzero coefficients overflow the block.
+bool DecodeACRefine(j_decompress_ptr cinfo, ArithDecoder* dec, int tbl, int Ss,
+                    int Se, int Al, coeff_t* coeffs) {
+  uint8_t* stats = cinfo->master->arith_.ac_stats[tbl];
+  const uint32_t* order = cinfo->master->coeff_order_;
+  uint8_t fixed_bin = kFixedBin;
+  const int p1 = 1 << Al;
+  const int m1 = -p1;
+  // End of block index of the previous stage.
+  int kex = Se;
+  while (kex > 0 && coeffs[order[kex]] == 0) --kex;
+  for (int k = Ss; k <= Se; ++k) {
+    uint8_t* st = stats + 3 * (k - 1);
+    if (k > kex && dec->Decode(st)) break;  // end of block
+    for (;;) {
+      coeff_t* coeff = &coeffs[order[k]];
+      if (*coeff != 0) {
+        if (dec->Decode(st + 2)) {
+          *coeff += *coeff < 0 ? m1 : p1;
+        }
+        break;
+      }
+      if (dec->Decode(st + 1)) {
+        *coeff = dec->Decode(&fixed_bin) ? m1 : p1;
+        break;
+      }
+      st += 3;
+      if (++k > Se) return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+void ResetArithDecoder(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  ArithCodingState* s = &m->arith_;
+  s->c = 0;
+  s->a = 0;
+  // Forces the reading of the first two bytes of the interval.
+  s->ct = -16;
+  memset(s->dc_context, 0, sizeof(s->dc_context));
+  memset(s->dc_stats, 0, sizeof(s->dc_stats));
+  memset(s->ac_stats, 0, sizeof(s->ac_stats));
+  memset(m->last_dc_coeff_, 0, sizeof(m->last_dc_coeff_));
+}
+
+bool DecodeArithMCU(j_decompress_ptr cinfo, size_t mcu_y, size_t mcu_x,
+                    const JBLOCKARRAY* coeff_rows, coeff_t* sink_block,
+                    const uint8_t* data, size_t len, size_t* pos,
+                    bool* need_more_input) {
+  jpeg_decomp_master* m = cinfo->master;
+  ArithDecoder dec(&m->arith_, data, len, *pos);
+  uint8_t fixed_bin = kFixedBin;
+  bool mcu_ok = true;
+  for (int i = 0; i < cinfo->comps_in_scan && mcu_ok; ++i) {
+    const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+    int c = comp->component_index;
+    for (int iy = 0; iy < comp->MCU_height && mcu_ok; ++iy) {
+      size_t block_y = mcu_y * comp->MCU_height + iy;
+      size_t biy = block_y % comp->v_samp_factor;
+      for (int ix = 0; ix < comp->MCU_width && mcu_ok; ++ix) {
+        size_t block_x = mcu_x * comp->MCU_width + ix;
+        coeff_t* coeffs;
+        if (block_x >= comp->width_in_blocks ||
+            block_y >= comp->height_in_blocks) {
+          coeffs = sink_block;
+        } else {
+          coeffs = &coeff_rows[c][biy][block_x][0];
+        }
+        if (cinfo->Ss == 0) {
+          if (cinfo->Ah == 0) {
+            mcu_ok = DecodeDCFirst(cinfo, &dec, comp->dc_tbl_no, c, cinfo->Al,
+                                   &m->last_dc_coeff_[c], coeffs);
+          } else if (dec.Decode(&fixed_bin)) {
+            coeffs[0] = static_cast<coeff_t>(coeffs[0] | (1 << cinfo->Al));
+          }
+        }
+        if (mcu_ok && cinfo->Se > 0) {
+          int Ss = std::max(cinfo->Ss, 1);
+          if (cinfo->Ah == 0) {
+            mcu_ok = DecodeACFirst(cinfo, &dec, comp->ac_tbl_no, Ss, cinfo->Se,
+                                   cinfo->Al, coeffs);
+          } else {
+            mcu_ok = DecodeACRefine(cinfo, &dec, comp->ac_tbl_no, Ss,
+                                    cinfo->Se, cinfo->Al, coeffs);
+          }
+        }
+      }
+    }
+  }
+  *need_more_input = dec.need_more_input();
+  if (*need_more_input) return false;
+  *pos = dec.pos();
+  return mcu_ok;
+}
+
+}  // namespace jpegli
@@ -0,0 +1,40 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef LIB_JPEGLI_DECODE_ARITH_H_
+#define LIB_JPEGLI_DECODE_ARITH_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/decode_internal.h"
+
+namespace jpegli {
+
+// Upper bound of the size of the entropy coded data of one MCU of an
+// arithmetic coded scan: at most 33 binary decisions per coefficient, at most
+// 15 bits per decision and 2 bytes per 8 bits (all bytes are escaped 0xff).
+constexpr size_t kMaxArithMCUByteSize =
+    D_MAX_BLOCKS_IN_MCU * DCTSIZE2 * 33 * 15 / 8 * 2 + 4;
+
+// Resets the registers, the statistics and the DC predictions of the
+// arithmetic decoder, at the start of each scan and restart interval.
+void ResetArithDecoder(j_decompress_ptr cinfo);
+
+// Decodes the MCU at (mcu_y, mcu_x) of the current arithmetic coded scan into
+// the block rows of the current iMCU row in coeff_rows, reading the entropy
+// coded data starting at data[*pos], and advances *pos. Sets *need_more_input
+// and returns false if the data ends before the MCU is decoded, and in this
+// case the decoder state is undefined. Returns false for invalid data.
+bool DecodeArithMCU(j_decompress_ptr cinfo, size_t mcu_y, size_t mcu_x,
+                    const JBLOCKARRAY* coeff_rows, coeff_t* sink_block,
+                    const uint8_t* data, size_t len, size_t* pos,
+                    bool* need_more_input);
+
+}  // namespace jpegli
+
+#endif  // LIB_JPEGLI_DECODE_ARITH_H_
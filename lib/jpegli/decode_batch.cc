@@ -0,0 +1,198 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include <setjmp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/context.h"
+#include "lib/jpegli/decode.h"
+#include "lib/jpegli/decode_internal.h"
+#include "lib/jpegli/error.h"
+#include "lib/jpegli/parallel.h"
+
+namespace jpegli {
+
+// A decompressor of jpegli_decode_batch() that is used by one thread at a
+// time. Errors are caught with its own error manager, since they can not be
+// propagated from a worker thread to the error manager of the caller.
+struct BatchDecodeWorker {
+  jpeg_decompress_struct cinfo;
+  jpeg_error_mgr jerr;
+  jmp_buf env;
+  char message[JMSG_STR_PARM_MAX];
+  bool created = false;
+
+  ~BatchDecodeWorker() {
+    if (created) jpegli_destroy_decompress(&cinfo);
+  }
+};
+
+struct BatchDecoder {
+  std::vector<std::unique_ptr<BatchDecodeWorker>> workers;
+};
+
+namespace {
+
+void BatchDecodeWorkerErrorExit(j_common_ptr cinfo) {
+  BatchDecodeWorker* worker =
+      static_cast<BatchDecodeWorker*>(cinfo->client_data);
+  memcpy(worker->message, cinfo->err->msg_parm.s, JMSG_STR_PARM_MAX);
+  worker->message[JMSG_STR_PARM_MAX - 1] = 0;
+  longjmp(worker->env, 1);
+}
+
+bool HasTables(j_decompress_ptr cinfo) {
+  for (int i = 0; i < NUM_QUANT_TBLS; ++i) {
+    if (cinfo->quant_tbl_ptrs[i]) return true;
+  }
+  for (int i = 0; i < NUM_HUFF_TBLS; ++i) {
+    if (cinfo->dc_huff_tbl_ptrs[i] || cinfo->ac_huff_tbl_ptrs[i]) return true;
+  }
+  return false;
+}
+
+// Sets the output parameters of dst, whose header was just read, to those of
+// src.
+void CopyOutputParameters(j_decompress_ptr src, j_decompress_ptr dst) {
+  if (src->out_color_space != JCS_UNKNOWN) {
+    dst->out_color_space = src->out_color_space;
+  }
+  dst->scale_num = src->scale_num;
+  dst->scale_denom = src->scale_denom;
+  dst->dct_method = src->dct_method;
+  dst->do_fancy_upsampling = src->do_fancy_upsampling;
+  dst->do_block_smoothing = src->do_block_smoothing;
+  jpeg_decomp_master* md = dst->master;
+  const jpeg_decomp_master* ms = src->master;
+  md->output_data_type_ = ms->output_data_type_;
+  md->swap_endianness_ = ms->swap_endianness_;
+  md->dequant_bias_rows_ = ms->dequant_bias_rows_;
+  md->destuff_scans_ = ms->destuff_scans_;
+  md->interleave_coefficients_ = ms->interleave_coefficients_;
+  md->cancel_flag = ms->cancel_flag;
+}
+
+void DecodeImage(j_decompress_ptr cinfo, j_decompress_ptr params,
+                 const JpegliDecompressTables* tables,
+                 JpegliBatchImage* image) {
+  jpegli_mem_src(cinfo, image->data, image->size);
+  if (tables) jpegli_load_decompress_tables(cinfo, tables);
+  const jpeg_decomp_master* ms = params->master;
+  // The workers share the caches of the context, but not its runner.
+  SetContext(&cinfo->master->context, ms->context);
+  jpegli_set_decode_limits(cinfo, ms->max_pixels_, ms->max_scans_,
+                           ms->max_marker_bytes_, ms->max_coeff_memory_);
+  jpegli_read_header(cinfo, TRUE);
+  CopyOutputParameters(params, cinfo);
+  jpegli_start_decompress(cinfo);
+  size_t bytes_per_sample =
+      jpegli_bytes_per_sample(cinfo->master->output_data_type_);
+  size_t row_size =
+      cinfo->output_width * cinfo->output_components * bytes_per_sample;
+  if (image->stride < row_size ||
+      (cinfo->output_height - 1) * image->stride + row_size >
+          image->pixels_size) {
+    JPEGLI_ERROR("Output buffer of %u x %u image is too small",
+                 cinfo->output_width, cinfo->output_height);
+  }
+  image->output_width = cinfo->output_width;
+  image->output_height = cinfo->output_height;
+  image->output_components = cinfo->output_components;
+  jpegli_decode_into(cinfo, static_cast<uint8_t*>(image->pixels),
+                     image->stride);
+  // The memory source never suspends, so the whole image was decoded; the
+  // rest of the input is not needed.
+  jpegli_abort_decompress(cinfo);
+}
+
+}  // namespace
+
+void ReleaseBatchDecoder(j_decompress_ptr cinfo) {
+  delete cinfo->master->batch_decoder;
+  cinfo->master->batch_decoder = nullptr;
+}
+
+}  // namespace jpegli
+
+void jpegli_decode_batch(j_decompress_ptr cinfo, JpegliBatchImage* images,
+                         size_t num_images) {
+  if (cinfo->global_state != jpegli::kDecStart) {
+    JPEGLI_ERROR("jpegli_decode_batch: unexpected state %d",
+                 cinfo->global_state);
+  }
+  if (cinfo->quantize_colors || cinfo->raw_data_out || cinfo->buffered_image) {
+    JPEGLI_ERROR("jpegli_decode_batch: unsupported output mode");
+  }
+  if (num_images > UINT32_MAX) {
+    JPEGLI_ERROR("jpegli_decode_batch: too many images");
+  }
+  if (num_images == 0) return;
+  jpeg_decomp_master* m = cinfo->master;
+  if (m->batch_decoder == nullptr) {
+    m->batch_decoder = new jpegli::BatchDecoder;
+  }
+  jpegli::BatchDecoder* batch = m->batch_decoder;
+  JpegliDecompressTables* tables =
+      jpegli::HasTables(cinfo) ? jpegli_save_decompress_tables(cinfo) : nullptr;
+  // The runner hands out the tasks in order, so starting with the largest
+  // images keeps a few large ones at the end from leaving threads idle.
+  std::vector<uint32_t> order(num_images);
+  for (size_t i = 0; i < num_images; ++i) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return images[a].size > images[b].size;
+  });
+  std::atomic<bool> failed{false};
+  size_t failed_image = 0;
+  size_t failed_thread = 0;
+  const auto init = [&](size_t num_threads) {
+    while (batch->workers.size() < num_threads) {
+      std::unique_ptr<jpegli::BatchDecodeWorker> worker(
+          new (std::nothrow) jpegli::BatchDecodeWorker);
+      if (worker == nullptr) return false;
+      batch->workers.emplace_back(std::move(worker));
+    }
+    return true;
+  };
+  const auto decode_image = [&](uint32_t task, size_t thread) {
+    if (failed.load(std::memory_order_relaxed)) return;
+    const uint32_t i = order[task];
+    jpegli::BatchDecodeWorker* worker = batch->workers[thread].get();
+    j_decompress_ptr wcinfo = &worker->cinfo;
+    if (setjmp(worker->env)) {
+      if (!failed.exchange(true)) {
+        failed_image = i;
+        failed_thread = thread;
+      }
+      jpegli_abort_decompress(wcinfo);
+      return;
+    }
+    if (!worker->created) {
+      wcinfo->err = jpegli_std_error(&worker->jerr);
+      worker->jerr.error_exit = &jpegli::BatchDecodeWorkerErrorExit;
+      wcinfo->client_data = worker;
+      jpegli_create_decompress(wcinfo);
+      worker->created = true;
+      jpegli_keep_image_memory(reinterpret_cast<j_common_ptr>(wcinfo), TRUE);
+    }
+    jpegli::DecodeImage(wcinfo, cinfo, tables, &images[i]);
+  };
+  jpegli::RunParallel(cinfo, 0, num_images, init, decode_image);
+  jpegli_destroy_decompress_tables(tables);
+  if (failed) {
+    JPEGLI_ERROR("jpegli_decode_batch: image %d failed: %s",
+                 static_cast<int>(failed_image),
+                 batch->workers[failed_thread]->message);
+  }
+}
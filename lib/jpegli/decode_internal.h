@@ -13,8 +13,10 @@
 
 #include "jpeglib.h"
 #include "lib/base/compiler_specific.h"
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/huffman.h"
+#include "lib/jpegli/stage_stats.h"
 #include "lib/jpegli/types.h"
 
 namespace jpegli {
@@ -24,6 +26,8 @@ static constexpr int kHandleRestart = 101;
 static constexpr int kHandleMarkerProcessor = 102;
 static constexpr int kProcessNextMarker = 103;
 static constexpr size_t kAllHuffLutSize = NUM_HUFF_TBLS * kJpegHuffmanLutSize;
+static constexpr size_t kArithDCStatBins = 64;
+static constexpr size_t kArithACStatBins = 256;
 
 typedef int16_t coeff_t;
 
@@ -35,6 +39,94 @@ struct MCUCodingState {
   coeff_t coeffs[D_MAX_BLOCKS_IN_MCU * DCTSIZE2];
 };
 
+// An image of the Multi-Picture Format index of the APP2 marker, see
+// jpegli_get_mp_image(). The data is nullptr if the image is not in the input
+// buffer of an in-memory source.
+struct MPImage {
+  const uint8_t* data;
+  size_t size;
+};
+
+// Registers and adaptive statistics of the arithmetic decoder (ITU-T T.81
+// Annex D), which are saved together with the MCUCodingState.
+struct ArithCodingState {
+  int64_t c;
+  uint32_t a;
+  int ct;
+  int dc_context[kMaxComponents];
+  uint8_t dc_stats[NUM_HUFF_TBLS][kArithDCStatBins];
+  uint8_t ac_stats[NUM_HUFF_TBLS][kArithACStatBins];
+};
+
+// Row buffers and scratch space of the output rendering. Each band of an output
+// pass that is rendered in parallel has its own copy.
+struct RenderBuffers {
+  RowBuffer<float> raw_output[kMaxComponents];
+  RowBuffer<float> render_output[kMaxComponents];
+  float* idct_scratch;
+  float* upsample_scratch;
+  uint8_t* output_scratch;
+  // The thread argument of the output row transform for the rows rendered
+  // with these buffers.
+  size_t row_transform_thread;
+};
+
+// Filter taps of a resampling in one dimension: output sample i is the sum of
+// weights[i * max_taps + k] * input[start[i] + k] for k < num_taps[i].
+struct ResizeTaps {
+  size_t max_taps;
+  uint32_t* start;
+  uint32_t* num_taps;
+  float* weights;
+};
+
+// State of the resampling of the rendered rows to the output size set by
+// jpegli_set_output_size(). The rendered rows are resampled horizontally as
+// they are rendered, and the last rows of each channel are kept in a ring
+// buffer until the output rows under them are resampled vertically.
+struct Resizer {
+  ResizeTaps xtaps;
+  ResizeTaps ytaps;
+  size_t num_channels;
+  size_t ring_size;
+  // Row (y % ring_size) * num_channels + c is the rendered row y of channel c.
+  RowBuffer<float> rows;
+  RowBuffer<float> output_rows;
+  uint8_t* output_scratch;
+};
+
+// Huffman decoding tables of the progressive scans that are decoded again for
+// each band with jpegli_set_progressive_band_rows(), since the tables can be
+// redefined between the scans.
+struct BandHuffmanLuts {
+  HuffmanTableEntry dc_huff_lut[kAllHuffLutSize];
+  HuffmanTableEntry ac_huff_lut[kAllHuffLutSize];
+  int16_t ac_fast_lut[NUM_HUFF_TBLS * kJpegFastACLutSize];
+};
+
+// Parameters of a progressive scan that is decoded again for each band. The
+// offsets of its restart intervals relative to data are in the restart index,
+// and len is the number of bytes of the input buffer from data.
+struct BandScan {
+  int comps_in_scan;
+  int component_index[MAX_COMPS_IN_SCAN];
+  int dc_tbl_no[MAX_COMPS_IN_SCAN];
+  int ac_tbl_no[MAX_COMPS_IN_SCAN];
+  int Ss;
+  int Se;
+  int Ah;
+  int Al;
+  unsigned int restart_interval;
+  JDIMENSION MCUs_per_row;
+  JDIMENSION MCU_rows_in_scan;
+  size_t scan_index;
+  size_t huff_luts;
+  const uint8_t* data;
+  size_t len;
+};
+
+struct BatchDecoder;
+
 }  // namespace jpegli
 
 // Use this forward-declared libjpeg struct to hold all our private variables.
@@ -43,8 +135,17 @@ struct jpeg_decomp_master {
   //
   // Input handling state.
   //
+  // Bytes of the previous source buffers that are not consumed yet, followed
+  // by a copy of the current source buffer, used while an incomplete marker
+  // segment or MCU spans more than one source buffer. The buffer is cleared
+  // without releasing its capacity, so that it is reused for the next one.
   std::vector<uint8_t> input_buffer_;
   size_t input_buffer_pos_;
+  // Work counts of the current image, see jpegli_get_decode_work().
+  size_t num_mcus_decoded_;
+  size_t num_buffered_bytes_;
+  // Number of allocations of the decompressor before the current image.
+  size_t num_allocations_before_image_;
   // Number of bits after codestream_pos_ that were already processed.
   size_t codestream_bits_ahead_;
 
@@ -54,6 +155,85 @@ struct jpeg_decomp_master {
 
   bool streaming_mode_;
 
+  JxlParallelRunner runner;
+  void* runner_opaque;
+  // Set by jpegli_attach_context(), nullptr otherwise.
+  jpegli_context* context;
+  // Set by jpegli_set_output_row_transform().
+  JpegliRowTransform row_transform_;
+  void* row_transform_opaque_;
+  // Set by jpegli_set_cancel_flag().
+  const volatile int* cancel_flag;
+  // Set by jpegli_set_transform_backend(), all nullptr by default.
+  JpegliTransformBackend transform_backend;
+  // Recorded after jpegli_enable_stage_stats().
+  jpegli::StageStats stage_stats;
+  // Worker decompressors of jpegli_decode_batch(), or nullptr.
+  jpegli::BatchDecoder* batch_decoder;
+
+  // Restart index of the sequential scans: restart_index_[i] has the offsets of
+  // the restart intervals of scan i + 1 relative to the start of its entropy
+  // coded data, followed by the offset of the marker after the scan, or it is
+  // empty if the scan is not indexed.
+  std::vector<std::vector<uint32_t>> restart_index_;
+  // Set by jpegli_set_progressive_band_rows(), 0 if not set.
+  size_t progressive_band_rows_;
+  // Whether the scans of a progressive image are only indexed while reading
+  // the input, and decoded again for each band of progressive_band_rows_ iMCU
+  // rows of the output into a coefficient buffer of coeff_band_buffer_rows_
+  // iMCU rows. The buffer holds the iMCU rows from coeff_band_begin_ of band
+  // coeff_band_, and the blocks of the decoded restart intervals outside of it
+  // go to coeff_band_sink_.
+  bool coeff_band_decoding_;
+  std::vector<jpegli::BandScan> band_scans_;
+  std::vector<jpegli::BandHuffmanLuts> band_huff_luts_;
+  size_t coeff_band_buffer_rows_;
+  size_t coeff_band_;
+  size_t coeff_band_begin_;
+  JBLOCKROW coeff_band_sink_;
+  // Region of the image that is decoded, in image pixel coordinates, if
+  // decode_region_ is set.
+  bool decode_region_;
+  size_t region_x0_;
+  size_t region_y0_;
+  size_t region_x1_;
+  size_t region_y1_;
+  // Set by jpegli_set_destuffed_scans().
+  bool destuff_scans_;
+  // Set by jpegli_set_interleaved_coefficients().
+  bool interleave_coefficients_;
+  // Set by jpegli_set_zigzag_coefficients().
+  bool zigzag_coefficients_;
+  // Position in the coefficient blocks of the coefficient at each zigzag
+  // index, kJPEGNaturalOrder unless the coefficients are read in zigzag order.
+  const uint32_t* coeff_order_;
+  // Set by jpegli_set_decode_limits(), 0 means no limit.
+  size_t max_pixels_;
+  int max_scans_;
+  size_t max_marker_bytes_;
+  size_t max_coeff_memory_;
+  // Payload bytes of the markers saved so far for the current image.
+  size_t saved_marker_bytes_;
+  // The limit whose violation stopped the decoding of the current image.
+  JpegliDecodeLimit limit_error_;
+  // Output size and resampling filter set by jpegli_set_output_size(), or zero
+  // width and height if the output is not resized.
+  size_t resize_width_;
+  size_t resize_height_;
+  JpegliResizeFilter resize_filter_;
+  // Plane stride and normalization set by jpegli_set_tensor_output(), or zero
+  // plane stride if the output is interleaved. The normalization is turned
+  // into a multiplier and an offset per channel by jpegli_start_decompress().
+  size_t tensor_plane_stride_;
+  const float* tensor_mean_;
+  const float* tensor_std_dev_;
+  float tensor_mul_[jpegli::kMaxComponents];
+  float tensor_add_[jpegli::kMaxComponents];
+  // Planes and strides of jpegli_decode_planes() while it renders the output,
+  // or nullptr.
+  uint8_t* const* output_planes_;
+  const size_t* output_plane_strides_;
+
   //
   // Marker data processing state.
   //
@@ -70,9 +250,16 @@ struct jpeg_decomp_master {
   size_t icc_index_;
   size_t icc_total_;
   std::vector<uint8_t> icc_profile_;
+  // Start of the SOI marker of the image in the input buffer of an in-memory
+  // source, or nullptr, and the images of its MPF index.
+  const uint8_t* soi_data_;
+  std::vector<jpegli::MPImage> mp_images_;
   jpegli::HuffmanTableEntry dc_huff_lut_[jpegli::kAllHuffLutSize];
   jpegli::HuffmanTableEntry ac_huff_lut_[jpegli::kAllHuffLutSize];
+  int16_t ac_fast_lut_[NUM_HUFF_TBLS * jpegli::kJpegFastACLutSize];
   uint8_t markers_to_save_[32];
+  // Set by jpegli_save_markers_in_place().
+  bool save_markers_in_place_;
   jpeg_marker_parser_method app_marker_parsers[16];
   jpeg_marker_parser_method com_marker_parser;
 
@@ -96,6 +283,8 @@ struct jpeg_decomp_master {
   int next_restart_marker_;
 
   jpegli::MCUCodingState mcu_;
+  jpegli::ArithCodingState arith_;
+  jpegli::ArithCodingState saved_arith_;
 
   //
   // Rendering state.
@@ -103,30 +292,101 @@ struct jpeg_decomp_master {
   int output_passes_done_;
   JpegliDataType output_data_type_ = JPEGLI_TYPE_UINT8;
   size_t xoffset_;
+  // Size of the rendered rows, which differs from the output size only if the
+  // output is resized, and the number of rendered rows of the output pass.
+  size_t render_width_;
+  size_t render_height_;
+  size_t render_scanline_;
+  jpegli::Resizer resizer_;
   bool swap_endianness_ = false;
+  // Set by jpegli_set_output_row_padding().
+  bool output_rows_padded_ = false;
   bool need_context_rows_;
+  // Input position and output parameters at the start of the previous output
+  // pass of the buffered image mode, and the output rows of the current output
+  // pass that may differ from the previous one.
+  bool has_prev_output_pass_;
+  int prev_output_input_scan_;
+  size_t prev_output_input_row_;
+  size_t prev_output_width_;
+  size_t prev_output_height_;
+  bool prev_output_smoothing_;
+  size_t dirty_rows_begin_;
+  size_t dirty_rows_end_;
   bool regenerate_inverse_colormap_;
   bool apply_smoothing;
 
   int min_scaled_dct_size;
   int scaled_dct_size[jpegli::kMaxComponents];
+  // Whether the output of the component depends only on its DC coefficients,
+  // in which case the AC coefficients are not decoded.
+  bool dc_only_[jpegli::kMaxComponents];
+  // DC coefficients of the first component collected by
+  // jpegli_compute_fingerprint(), empty unless it is decoding the image.
+  std::vector<float> fingerprint_dc_;
 
   size_t raw_height_[jpegli::kMaxComponents];
-  jpegli::RowBuffer<float> raw_output_[jpegli::kMaxComponents];
-  jpegli::RowBuffer<float> render_output_[jpegli::kMaxComponents];
+  jpegli::RenderBuffers render_buffers_;
+  jpegli::RenderBuffers* band_buffers_;
+  size_t num_band_buffers_;
+  // Dequantization biases of every fourth iMCU row for the parallel rendering.
+  float* band_biases_;
 
+  // Inverse transforms num_blocks consecutive blocks of a block row, the
+  // output of the i-th block starts at output + i * dctsize.
   void (*inverse_transform[jpegli::kMaxComponents])(
-      const int16_t* JXL_RESTRICT qblock, const float* JXL_RESTRICT dequant,
-      const float* JXL_RESTRICT biases, float* JXL_RESTRICT scratch_space,
-      float* JXL_RESTRICT output, size_t output_stride, size_t dctsize);
+      const int16_t* JXL_RESTRICT qblocks, size_t num_blocks,
+      const float* JXL_RESTRICT dequant, const float* JXL_RESTRICT biases,
+      float* JXL_RESTRICT scratch_space, float* JXL_RESTRICT output,
+      size_t output_stride, size_t dctsize);
 
   void (*color_transform)(float* row[jpegli::kMaxComponents], size_t len);
+  // If not nullptr, used instead of color_transform and WriteToOutput() to
+  // write len output pixels, starting at column x0 of the rows, as interleaved
+  // 8-bit samples.
+  void (*color_output_uint8)(float* row[jpegli::kMaxComponents], size_t x0,
+                             size_t len, uint8_t* JXL_RESTRICT output);
+
+  // Per-row kernels of the render pipeline, resolved for the CPU once per
+  // output pass by PrepareForOutput() instead of on every call.
+  void (*gather_block_stats)(const int16_t* JXL_RESTRICT coeffs,
+                             size_t coeffs_size, int32_t* JXL_RESTRICT nonzeros,
+                             int32_t* JXL_RESTRICT sumabs);
+  void (*decenter_row)(float* row, size_t xsize);
+  void (*write_to_output)(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
+                          size_t xoffset, size_t len, size_t num_channels,
+                          uint8_t* JXL_RESTRICT scratch_space,
+                          uint8_t* JXL_RESTRICT output);
+  void (*upsample2_horizontal)(float* JXL_RESTRICT row,
+                               float* JXL_RESTRICT scratch_space,
+                               size_t len_out);
+  void (*upsample2_vertical)(const float* JXL_RESTRICT row_top,
+                             const float* JXL_RESTRICT row_mid,
+                             const float* JXL_RESTRICT row_bot,
+                             float* JXL_RESTRICT row_out0,
+                             float* JXL_RESTRICT row_out1, size_t len);
+  void (*upsample2x2)(const float* JXL_RESTRICT row_top,
+                      const float* JXL_RESTRICT row_mid,
+                      const float* JXL_RESTRICT row_bot,
+                      float* JXL_RESTRICT scratch_space,
+                      float* JXL_RESTRICT row_out0,
+                      float* JXL_RESTRICT row_out1, size_t len_out);
+  void (*upsample_horizontal_no_filter)(float* JXL_RESTRICT row,
+                                        float* JXL_RESTRICT scratch_space,
+                                        size_t len_out, size_t factor);
+  // Upsamples, color transforms and writes the output rows [ybegin, yend),
+  // either generically or with a version that is specialized for the sampling
+  // factors and output format of one of the common configurations.
+  void (*render_output_rows)(j_decompress_ptr cinfo, size_t ybegin,
+                             size_t yend, jpegli::RenderBuffers* buffers,
+                             JSAMPARRAY output, jpegli::StageStats* stats);
 
-  float* idct_scratch_;
-  float* upsample_scratch_;
-  uint8_t* output_scratch_;
   int16_t* smoothing_scratch_;
   float* dequant_;
+  // Added to the inverse transformed samples of each component of images with
+  // more than 8 bits of precision, so that they are centered the same way as
+  // 8-bit samples.
+  float sample_offset_[jpegli::kMaxComponents];
   // 1 = 1pass, 2 = 2pass, 3 = external
   int quant_mode_;
   int quant_pass_;
@@ -147,6 +407,13 @@ struct jpeg_decomp_master {
   int* sumabs_;
   size_t num_processed_blocks_[jpegli::kMaxComponents];
   float* biases_;
+  // Set by jpegli_set_dequant_bias_rows(), the number of iMCU rows whose
+  // statistics are gathered, a multiple of 4, or 0 for all rows.
+  size_t dequant_bias_rows_;
+  // Remaining work units of the current jpegli_decode_step(), or -1 outside of
+  // it, and whether the step sequence has started the output pass.
+  int step_budget_;
+  bool step_output_started_;
 #define SAVED_COEFS 10
   // This holds the coef_bits of the scan before the current scan,
   // i.e. the bottom half when rendering incomplete scans.
@@ -154,4 +421,36 @@ struct jpeg_decomp_master {
   int (*prev_coef_bits_latch)[SAVED_COEFS];
 };
 
+// Tables of jpegli_save_decompress_tables(), a table is defined if its
+// pointer in the jpeg_decompress_struct was not nullptr.
+struct JpegliDecompressTables {
+  bool has_quant_tbl[NUM_QUANT_TBLS];
+  bool has_dc_huff_tbl[NUM_HUFF_TBLS];
+  bool has_ac_huff_tbl[NUM_HUFF_TBLS];
+  JQUANT_TBL quant_tbl[NUM_QUANT_TBLS];
+  JHUFF_TBL dc_huff_tbl[NUM_HUFF_TBLS];
+  JHUFF_TBL ac_huff_tbl[NUM_HUFF_TBLS];
+};
+
+namespace jpegli {
+
+// Implements jpegli_estimate_memory() for the decompressor.
+size_t EstimateDecoderMemory(j_decompress_ptr cinfo);
+
+// Unmaps the input file if the source manager was set by jpegli_mmap_src().
+void ReleaseMmapSource(j_decompress_ptr cinfo);
+
+// Stops the reader thread and frees the buffers if the source manager was set
+// by jpegli_readahead_src().
+void ReleaseReadAheadSource(j_decompress_ptr cinfo);
+
+// Returns true if the source manager was set by jpegli_mem_src() or
+// jpegli_mmap_src(), i.e. the input stays in memory until it is destroyed.
+bool IsInMemorySource(j_decompress_ptr cinfo);
+
+// Destroys the worker decompressors of jpegli_decode_batch().
+void ReleaseBatchDecoder(j_decompress_ptr cinfo);
+
+}  // namespace jpegli
+
 #endif  // LIB_JPEGLI_DECODE_INTERNAL_H_
@@ -22,7 +22,6 @@ namespace jpegli {
 namespace {
 
 constexpr int kMaxDimPixels = 65535;
-constexpr uint8_t kIccProfileTag[12] = "ICC_PROFILE";
 
 // Macros for commonly used error conditions.
 
@@ -63,17 +62,25 @@ void ProcessSOF(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
     JPEGLI_ERROR("Duplicate SOF marker.");
   }
   m->found_sof_ = true;
-  cinfo->progressive_mode = TO_JXL_BOOL(cinfo->unread_marker == 0xc2);
-  cinfo->arith_code = 0;
+  cinfo->progressive_mode = TO_JXL_BOOL(cinfo->unread_marker == 0xc2 ||
+                                        cinfo->unread_marker == 0xca);
+  cinfo->arith_code = TO_JXL_BOOL(cinfo->unread_marker == 0xc9 ||
+                                  cinfo->unread_marker == 0xca);
   size_t pos = 2;
   JPEG_VERIFY_LEN(6);
   cinfo->data_precision = ReadUint8(data, &pos);
   cinfo->image_height = ReadUint16(data, &pos);
   cinfo->image_width = ReadUint16(data, &pos);
   cinfo->num_components = ReadUint8(data, &pos);
-  JPEG_VERIFY_INPUT(cinfo->data_precision, kJpegPrecision, kJpegPrecision);
+  if (cinfo->data_precision != kJpegPrecision &&
+      cinfo->data_precision != kJpegMaxPrecision) {
+    JPEGLI_ERROR("Unsupported data precision %d", cinfo->data_precision);
+  }
   JPEG_VERIFY_INPUT(cinfo->image_height, 1, kMaxDimPixels);
   JPEG_VERIFY_INPUT(cinfo->image_width, 1, kMaxDimPixels);
+  const size_t num_pixels =
+      static_cast<size_t>(cinfo->image_width) * cinfo->image_height;
+  CheckDecodeLimit(cinfo, JPEGLI_LIMIT_PIXELS, num_pixels, m->max_pixels_);
   JPEG_VERIFY_INPUT(cinfo->num_components, 1, kMaxComponents);
   JPEG_VERIFY_LEN(3 * cinfo->num_components);
   cinfo->comp_info = jpegli::Allocate<jpeg_component_info>(
@@ -160,6 +167,12 @@ void ProcessSOF(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
     comp->width_in_blocks = DivCeil(comp->downsampled_width, DCTSIZE);
     comp->height_in_blocks = DivCeil(comp->downsampled_height, DCTSIZE);
   }
+  if (cinfo->progressive_mode && m->progressive_band_rows_ == 0) {
+    // Progressive images keep the coefficients of the whole image unless they
+    // are decoded by bands, so this can fail before any scan is read.
+    CheckDecodeLimit(cinfo, JPEGLI_LIMIT_COEFF_MEMORY, CoefficientMemory(cinfo),
+                     m->max_coeff_memory_);
+  }
   memset(m->scan_progression_, 0, sizeof(m->scan_progression_));
 }
 
@@ -169,6 +182,8 @@ void ProcessSOS(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
     JPEGLI_ERROR("Unexpected SOS marker.");
   }
   m->found_sos_ = true;
+  CheckDecodeLimit(cinfo, JPEGLI_LIMIT_SCANS, cinfo->input_scan_number + 1,
+                   m->max_scans_);
   size_t pos = 2;
   JPEG_VERIFY_LEN(1);
   cinfo->comps_in_scan = ReadUint8(data, &pos);
@@ -316,9 +331,7 @@ void ProcessDHT(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
       JPEG_VERIFY_INPUT(total_count, 0, kJpegHuffmanAlphabetSize);
     } else {
       // Allow symbols up to 15 here, we check later whether any invalid symbols
-      // are actually decoded.
-      // TODO(szabadka) Make sure decoder works (does not crash) with up to
-      // 15-nbits DC symbols and then increase kJpegDCAlphabetSize.
+      // for the data precision of the frame are actually decoded.
       JPEG_VERIFY_INPUT(total_count, 0, 16);
     }
     JPEG_VERIFY_LEN(total_count);
@@ -370,6 +383,31 @@ void ProcessDQT(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
   JPEG_VERIFY_MARKER_END();
 }
 
+// Reads the Define Arithmetic Coding conditioning (DAC) marker segment
+// (section B.2.4.3).
+void ProcessDAC(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
+  size_t pos = 2;
+  while (pos < len) {
+    JPEG_VERIFY_LEN(2);
+    int table_class = ReadUint8(data, &pos);
+    int value = ReadUint8(data, &pos);
+    int table_index = table_class & 0xf;
+    table_class >>= 4;
+    JPEG_VERIFY_INPUT(table_class, 0, 1);
+    if (table_class == 1) {
+      JPEG_VERIFY_INPUT(value, 1, 63);
+      cinfo->arith_ac_K[table_index] = value;
+    } else {
+      int lower = value & 0xf;
+      int upper = value >> 4;
+      JPEG_VERIFY_INPUT(lower, 0, upper);
+      cinfo->arith_dc_L[table_index] = lower;
+      cinfo->arith_dc_U[table_index] = upper;
+    }
+  }
+  JPEG_VERIFY_MARKER_END();
+}
+
 void ProcessDNL(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
   // Ignore marker.
 }
@@ -386,6 +424,84 @@ void ProcessDRI(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
   JPEG_VERIFY_MARKER_END();
 }
 
+// Returns true if data[0, len) is in the input buffer of an in-memory source,
+// and not in the copy of an incomplete marker segment, so that it is valid as
+// long as the input.
+bool IsInInputBuffer(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
+  const jpeg_source_mgr* src = cinfo->src;
+  return IsInMemorySource(cinfo) && data >= src->next_input_byte &&
+         len <= src->bytes_in_buffer &&
+         data + len <= src->next_input_byte + src->bytes_in_buffer;
+}
+
+// Records the images of the Multi-Picture Format index (CIPA DC-007), which is
+// a TIFF structure starting at tiff, with image offsets relative to tiff. An
+// index that can not be parsed is ignored, since it does not affect the
+// decoding of the current image.
+void ProcessMPF(j_decompress_ptr cinfo, const uint8_t* tiff, size_t size) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (size < 8) return;
+  bool big_endian;
+  if (memcmp(tiff, "MM\0\x2a", 4) == 0) {
+    big_endian = true;
+  } else if (memcmp(tiff, "II\x2a\0", 4) == 0) {
+    big_endian = false;
+  } else {
+    return;
+  }
+  const auto read16 = [&](size_t pos) -> uint32_t {
+    return big_endian ? (tiff[pos] << 8) | tiff[pos + 1]
+                      : tiff[pos] | (tiff[pos + 1] << 8);
+  };
+  const auto read32 = [&](size_t pos) -> uint32_t {
+    return big_endian ? (read16(pos) << 16) | read16(pos + 2)
+                      : read16(pos) | (read16(pos + 2) << 16);
+  };
+  const size_t ifd_offset = read32(4);
+  if (ifd_offset > size - 2) return;
+  const size_t num_tags = read16(ifd_offset);
+  if (num_tags > (size - ifd_offset - 2) / 12) return;
+  size_t num_images = 0;
+  size_t entries_offset = 0;
+  size_t entries_size = 0;
+  for (size_t i = 0; i < num_tags; ++i) {
+    const size_t pos = ifd_offset + 2 + 12 * i;
+    const uint32_t tag = read16(pos);
+    if (tag == 0xb001) {  // NumberOfImages
+      num_images = read32(pos + 8);
+    } else if (tag == 0xb002) {  // MPEntry
+      entries_size = read32(pos + 4);
+      entries_offset = read32(pos + 8);
+    }
+  }
+  if (num_images == 0 || num_images > entries_size / 16 ||
+      entries_offset > size || entries_size > size - entries_offset) {
+    return;
+  }
+  // The offsets can be resolved only if the rest of the input is in memory.
+  const jpeg_source_mgr* src = cinfo->src;
+  const uint8_t* end = nullptr;
+  if (IsInInputBuffer(cinfo, tiff, size)) {
+    end = src->next_input_byte + src->bytes_in_buffer;
+  }
+  m->mp_images_.clear();
+  for (size_t i = 0; i < num_images; ++i) {
+    const size_t pos = entries_offset + 16 * i;
+    jpegli::MPImage image;
+    image.size = read32(pos + 4);
+    const size_t offset = read32(pos + 8);
+    image.data = nullptr;
+    if (i == 0) {
+      // The offset of the first image is 0, it is the current image.
+      image.data = end ? m->soi_data_ : nullptr;
+    } else if (end && offset <= static_cast<size_t>(end - tiff) &&
+               image.size <= static_cast<size_t>(end - tiff) - offset) {
+      image.data = tiff + offset;
+    }
+    m->mp_images_.push_back(image);
+  }
+}
+
 void ProcessAPP(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
   jpeg_decomp_master* m = cinfo->master;
   const uint8_t marker = cinfo->unread_marker;
@@ -432,6 +548,10 @@ void ProcessAPP(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
       }
       m->icc_profile_.insert(m->icc_profile_.end(), payload + 2,
                              payload + payload_size);
+    } else if (payload_size >= sizeof(kMPFTag) &&
+               memcmp(payload, kMPFTag, sizeof(kMPFTag)) == 0) {
+      ProcessMPF(cinfo, payload + sizeof(kMPFTag),
+                 payload_size - sizeof(kMPFTag));
     }
   }
 }
@@ -446,6 +566,11 @@ void ProcessSOI(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
     JPEGLI_ERROR("Duplicate SOI marker");
   }
   m->found_soi_ = true;
+  // The SOI marker is right before data, unless it was read in an earlier call.
+  if (IsInInputBuffer(cinfo, data - 2, 2) && data[-2] == 0xff &&
+      data[-1] == 0xd8) {
+    m->soi_data_ = data - 2;
+  }
 }
 
 void ProcessEOI(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
@@ -456,6 +581,10 @@ void SaveMarker(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
   const uint8_t marker = cinfo->unread_marker;
   const uint8_t* payload = data + 2;
   size_t payload_size = len - 2;
+  jpeg_decomp_master* m = cinfo->master;
+  m->saved_marker_bytes_ += payload_size;
+  CheckDecodeLimit(cinfo, JPEGLI_LIMIT_MARKER_BYTES, m->saved_marker_bytes_,
+                   m->max_marker_bytes_);
 
   // Insert new saved marker to the head of the list.
   jpeg_saved_marker_ptr next = cinfo->marker_list;
@@ -465,6 +594,11 @@ void SaveMarker(j_decompress_ptr cinfo, const uint8_t* data, size_t len) {
   cinfo->marker_list->marker = marker;
   cinfo->marker_list->original_length = payload_size;
   cinfo->marker_list->data_length = payload_size;
+  if (m->save_markers_in_place_ &&
+      IsInInputBuffer(cinfo, payload, payload_size)) {
+    cinfo->marker_list->data = const_cast<JOCTET*>(payload);
+    return;
+  }
   cinfo->marker_list->data =
       jpegli::Allocate<uint8_t>(cinfo, payload_size, JPOOL_IMAGE);
   memcpy(cinfo->marker_list->data, payload, payload_size);
@@ -478,7 +612,7 @@ uint8_t ProcessNextMarker(j_decompress_ptr cinfo, const uint8_t* const data,
   if (marker == 0) {
     // kIsValidMarker[i] == 1 means (0xc0 + i) is a valid marker.
     static const uint8_t kIsValidMarker[] = {
-        1, 1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 0, 1, 0, 0, 0, 0, 1, 1, 0, 1, 0, 0, 0, 1, 1, 1, 1, 1, 1,
         1, 1, 1, 1, 1, 1, 0, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
         1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0,
     };
@@ -528,10 +662,13 @@ uint8_t ProcessNextMarker(j_decompress_ptr cinfo, const uint8_t* const data,
       SaveMarker(cinfo, marker_data, marker_len);
     }
   }
-  if (marker == 0xc0 || marker == 0xc1 || marker == 0xc2) {
+  if (marker == 0xc0 || marker == 0xc1 || marker == 0xc2 || marker == 0xc9 ||
+      marker == 0xca) {
     ProcessSOF(cinfo, marker_data, marker_len);
   } else if (marker == 0xc4) {
     ProcessDHT(cinfo, marker_data, marker_len);
+  } else if (marker == 0xcc) {
+    ProcessDAC(cinfo, marker_data, marker_len);
   } else if (marker == 0xda) {
     ProcessSOS(cinfo, marker_data, marker_len);
   } else if (marker == 0xdb) {
@@ -575,6 +712,109 @@ jpeg_marker_parser_method GetMarkerProcessor(j_decompress_ptr cinfo) {
   return callback;
 }
 
+void CheckDecodeLimit(j_decompress_ptr cinfo, JpegliDecodeLimit limit,
+                      size_t value, size_t max_value) {
+  if (max_value == 0 || value <= max_value) {
+    return;
+  }
+  static const char* const kLimitNames[] = {"", "Number of pixels",
+                                            "Number of scans",
+                                            "Saved marker bytes",
+                                            "Coefficient memory"};
+  cinfo->master->limit_error_ = limit;
+  JPEGLI_ERROR("%s %" PRIuS " exceeds the decode limit %" PRIuS,
+               kLimitNames[limit], value, max_value);
+}
+
+size_t CoefficientMemory(j_decompress_ptr cinfo) {
+  size_t size = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    size += static_cast<size_t>(comp->width_in_blocks) *
+            comp->height_in_blocks * sizeof(JBLOCK);
+  }
+  return size;
+}
+
+bool ProbeMarkers(const uint8_t* data, size_t len, JpegliImageInfo* info) {
+  memset(info, 0, sizeof(*info));
+  if (len < 2 || data[0] != 0xff || data[1] != 0xd8) {
+    return false;
+  }
+  bool found_sof = false;
+  size_t pos = 2;
+  while (pos + 4 <= len) {
+    // Skip the bytes between markers and the fill bytes.
+    if (data[pos] != 0xff || data[pos + 1] == 0xff) {
+      ++pos;
+      continue;
+    }
+    const uint8_t marker = data[pos + 1];
+    if (marker == 0xd9 || marker == 0xda) {
+      break;
+    }
+    if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8)) {
+      // Markers without marker segment.
+      pos += 2;
+      continue;
+    }
+    const size_t marker_len = (data[pos + 2] << 8) + data[pos + 3];
+    if (marker_len < 2) {
+      return false;
+    }
+    const uint8_t* payload = &data[pos + 4];
+    const size_t available = std::min(marker_len, len - pos - 2) - 2;
+    if (marker == 0xc0 || marker == 0xc1 || marker == 0xc2 || marker == 0xc9 ||
+        marker == 0xca) {
+      if (found_sof || available < 6) {
+        return false;
+      }
+      info->data_precision = payload[0];
+      info->image_height = (payload[1] << 8) + payload[2];
+      info->image_width = (payload[3] << 8) + payload[4];
+      info->num_components = payload[5];
+      info->progressive_mode = (marker == 0xc2 || marker == 0xca);
+      if ((info->data_precision != kJpegPrecision &&
+           info->data_precision != kJpegMaxPrecision) ||
+          info->image_width == 0 || info->image_height == 0 ||
+          info->num_components < 1 ||
+          info->num_components > kMaxComponents ||
+          available < 6 + 3 * static_cast<size_t>(info->num_components)) {
+        return false;
+      }
+      for (int c = 0; c < info->num_components; ++c) {
+        const int factor = payload[6 + 3 * c + 1];
+        info->h_samp_factor[c] = factor >> 4;
+        info->v_samp_factor[c] = factor & 0xf;
+        if (info->h_samp_factor[c] < 1 ||
+            info->h_samp_factor[c] > MAX_SAMP_FACTOR ||
+            info->v_samp_factor[c] < 1 ||
+            info->v_samp_factor[c] > MAX_SAMP_FACTOR) {
+          return false;
+        }
+      }
+      found_sof = true;
+    } else if (marker >= 0xc3 && marker <= 0xcf && marker != 0xc4 &&
+               marker != 0xc8 && marker != 0xc9 && marker != 0xca &&
+               marker != 0xcc) {
+      // Lossless and hierarchical images.
+      return false;
+    } else if (marker == kApp1 && info->exif_size == 0 &&
+               available >= sizeof(kExifTag) &&
+               memcmp(payload, kExifTag, sizeof(kExifTag)) == 0) {
+      info->exif_offset = pos;
+      info->exif_size = marker_len + 2;
+    } else if (marker == kApp2 && available >= sizeof(kIccProfileTag) &&
+               memcmp(payload, kIccProfileTag, sizeof(kIccProfileTag)) == 0) {
+      if (info->num_icc_markers++ == 0) {
+        info->icc_offset = pos;
+      }
+    }
+    pos += marker_len + 2;
+  }
+  return found_sof;
+}
+
 int ProcessMarkers(j_decompress_ptr cinfo, const uint8_t* const data,
                    const size_t len, size_t* pos) {
   for (;;) {
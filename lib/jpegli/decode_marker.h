@@ -11,6 +11,7 @@
 #include <cstdint>
 
 #include "lib/jpegli/common.h"
+#include "lib/jpegli/types.h"
 
 namespace jpegli {
 
@@ -29,6 +30,17 @@ int ProcessMarkers(j_decompress_ptr cinfo, const uint8_t* data, size_t len,
 
 jpeg_marker_parser_method GetMarkerProcessor(j_decompress_ptr cinfo);
 
+// Implements jpegli_probe().
+bool ProbeMarkers(const uint8_t* data, size_t len, JpegliImageInfo* info);
+
+// Fails with an error if value is above the given limit of
+// jpegli_set_decode_limits(), whose maximum is max_value, 0 meaning no limit.
+void CheckDecodeLimit(j_decompress_ptr cinfo, JpegliDecodeLimit limit,
+                      size_t value, size_t max_value);
+
+// Returns the size of the coefficient buffers of the whole image.
+size_t CoefficientMemory(j_decompress_ptr cinfo);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_DECODE_MARKER_H_
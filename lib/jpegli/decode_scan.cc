@@ -9,128 +9,29 @@
 #include <algorithm>
 #include <cstring>
 #include <hwy/base.h>  // HWY_ALIGN_MAX
+#include <vector>
 
+#include "lib/base/bits.h"
+#include "lib/base/byte_order.h"
 #include "lib/base/status.h"
+#include "lib/base/types.h"
+#include "lib/jpegli/bit_reader.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/decode_arith.h"
 #include "lib/jpegli/decode_internal.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/huffman.h"
+#include "lib/jpegli/parallel.h"
 
 namespace jpegli {
 namespace {
 
 // Max 14 block per MCU (when 1 channel is subsampled)
 // Max 64 nonzero coefficients per block
-// Max 16 symbol bits plus 11 extra bits per nonzero symbol
+// Max 16 symbol bits plus 15 extra bits per nonzero symbol (12-bit precision)
 // Max 2 bytes per 8 bits (worst case is all bytes are escaped 0xff)
-constexpr int kMaxMCUByteSize = 6048;
-
-// Helper structure to read bits from the entropy coded data segment.
-struct BitReaderState {
-  BitReaderState(const uint8_t* data, const size_t len, size_t pos)
-      : data_(data), len_(len), start_pos_(pos) {
-    Reset(pos);
-  }
-
-  void Reset(size_t pos) {
-    pos_ = pos;
-    val_ = 0;
-    bits_left_ = 0;
-    next_marker_pos_ = len_;
-    FillBitWindow();
-  }
-
-  // Returns the next byte and skips the 0xff/0x00 escape sequences.
-  uint8_t GetNextByte() {
-    if (pos_ >= next_marker_pos_) {
-      ++pos_;
-      return 0;
-    }
-    uint8_t c = data_[pos_++];
-    if (c == 0xff) {
-      uint8_t escape = pos_ < len_ ? data_[pos_] : 0;
-      if (escape == 0) {
-        ++pos_;
-      } else {
-        // 0xff was followed by a non-zero byte, which means that we found the
-        // start of the next marker segment.
-        next_marker_pos_ = pos_ - 1;
-      }
-    }
-    return c;
-  }
-
-  void FillBitWindow() {
-    if (bits_left_ <= 16) {
-      while (bits_left_ <= 56) {
-        val_ <<= 8;
-        val_ |= static_cast<uint64_t>(GetNextByte());
-        bits_left_ += 8;
-      }
-    }
-  }
-
-  int ReadBits(int nbits) {
-    FillBitWindow();
-    uint64_t val = (val_ >> (bits_left_ - nbits)) & ((1ULL << nbits) - 1);
-    bits_left_ -= nbits;
-    return val;
-  }
-
-  // Sets *pos to the next stream position, and *bit_pos to the bit position
-  // within the next byte where parsing should continue.
-  // Returns false if the stream ended too early.
-  bool FinishStream(size_t* pos, size_t* bit_pos) {
-    *bit_pos = (8 - (bits_left_ & 7)) & 7;
-    // Give back some bytes that we did not use.
-    int unused_bytes_left = DivCeil(bits_left_, 8);
-    while (unused_bytes_left-- > 0) {
-      --pos_;
-      // If we give back a 0 byte, we need to check if it was a 0xff/0x00 escape
-      // sequence, and if yes, we need to give back one more byte.
-      if (((pos_ == len_ && pos_ == next_marker_pos_) ||
-           (pos_ > 0 && pos_ < next_marker_pos_ && data_[pos_] == 0)) &&
-          (data_[pos_ - 1] == 0xff)) {
-        --pos_;
-      }
-    }
-    if (pos_ >= next_marker_pos_) {
-      *pos = next_marker_pos_;
-      if (pos_ > next_marker_pos_ || *bit_pos > 0) {
-        // Data ran out before the scan was complete.
-        return false;
-      }
-    }
-    *pos = pos_;
-    return true;
-  }
-
-  const uint8_t* data_;
-  const size_t len_;
-  size_t pos_;
-  uint64_t val_;
-  int bits_left_;
-  size_t next_marker_pos_;
-  size_t start_pos_;
-};
-
-// Returns the next Huffman-coded symbol.
-int ReadSymbol(const HuffmanTableEntry* table, BitReaderState* br) {
-  int nbits;
-  br->FillBitWindow();
-  int val = (br->val_ >> (br->bits_left_ - 8)) & 0xff;
-  table += val;
-  nbits = table->bits - 8;
-  if (nbits > 0) {
-    br->bits_left_ -= 8;
-    table += table->value;
-    val = (br->val_ >> (br->bits_left_ - nbits)) & ((1 << nbits) - 1);
-    table += val;
-  }
-  br->bits_left_ -= table->bits;
-  return table->value;
-}
+constexpr int kMaxMCUByteSize = 6944;
 
 /**
  * Returns the DC diff or AC value for extra bits value x and prefix code s.
@@ -173,17 +74,30 @@ int HuffExtend(int x, int s) {
   }
 }
 
-// Decodes one 8x8 block of DCT coefficients from the bit stream.
+// Returns the entry of the fast AC lookup table for the next bits of the bit
+// stream, see BuildJpegFastACTable().
+int PeekFastAC(const int16_t* fast_ac, BitReaderState* br) {
+  br->FillBitWindow();
+  return fast_ac[(br->val_ >> (br->bits_left_ - kJpegFastACBits)) &
+                 (kJpegFastACLutSize - 1)];
+}
+
+// Decodes one 8x8 block of DCT coefficients from the bit stream, storing the
+// coefficient at zigzag position k at coeffs[order[k]]. The fast AC lookup
+// table ac_fast can be nullptr, and it must be if Al is large enough for its
+// coefficients to overflow. Symbols with max_bits or more extra bits (after the
+// point transform) are invalid for the data precision of the frame.
 bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
-                    const HuffmanTableEntry* ac_huff, int Ss, int Se, int Al,
-                    int* eobrun, BitReaderState* br, coeff_t* last_dc_coeff,
-                    coeff_t* coeffs) {
+                    const HuffmanTableEntry* ac_huff, const int16_t* ac_fast,
+                    const uint32_t* order, int Ss, int Se, int Al,
+                    int max_bits, int* eobrun, BitReaderState* br,
+                    coeff_t* last_dc_coeff, coeff_t* coeffs) {
   // Nowadays multiplication is even faster than variable shift.
   int Am = 1 << Al;
   bool eobrun_allowed = Ss > 0;
   if (Ss == 0) {
     int s = ReadSymbol(dc_huff, br);
-    if (s >= kJpegDCAlphabetSize) {
+    if (s >= max_bits) {
       return false;
     }
     int diff = 0;
@@ -209,6 +123,19 @@ bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
     return true;
   }
   for (int k = Ss; k <= Se; k++) {
+    if (ac_fast != nullptr) {
+      int fast = PeekFastAC(ac_fast, br);
+      if (fast != 0) {
+        // The symbol and the extra bits of a coefficient in one lookup.
+        k += (fast >> 4) & 15;
+        if (k > Se) {
+          return false;
+        }
+        br->bits_left_ -= fast & 15;
+        coeffs[order[k]] = (fast >> 8) * Am;
+        continue;
+      }
+    }
     int sr = ReadSymbol(ac_huff, br);
     if (sr >= kJpegHuffmanAlphabetSize) {
       return false;
@@ -220,12 +147,12 @@ bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
       if (k > Se) {
         return false;
       }
-      if (s + Al >= kJpegDCAlphabetSize) {
+      if (s + Al >= max_bits) {
         return false;
       }
       int bits = br->ReadBits(s);
       int coeff = HuffExtend(bits, s);
-      coeffs[kJPEGNaturalOrder[k]] = coeff * Am;
+      coeffs[order[k]] = coeff * Am;
     } else if (r == 15) {
       k += 15;
     } else {
@@ -243,8 +170,104 @@ bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
   return true;
 }
 
-bool RefineDCTBlock(const HuffmanTableEntry* ac_huff, int Ss, int Se, int Al,
-                    int* eobrun, BitReaderState* br, coeff_t* coeffs) {
+// Same as DecodeDCTBlock() for the blocks of sequential scans, but the AC
+// coefficients are only parsed and not stored, for the components whose output
+// only depends on the DC coefficients.
+bool DecodeDCOfDCTBlock(const HuffmanTableEntry* dc_huff,
+                        const HuffmanTableEntry* ac_huff,
+                        const int16_t* ac_fast, int Al, int max_bits,
+                        BitReaderState* br, coeff_t* last_dc_coeff,
+                        coeff_t* coeffs) {
+  int s = ReadSymbol(dc_huff, br);
+  if (s >= max_bits) {
+    return false;
+  }
+  int diff = 0;
+  if (s > 0) {
+    int bits = br->ReadBits(s);
+    diff = HuffExtend(bits, s);
+  }
+  int coeff = diff + *last_dc_coeff;
+  const int dc_coeff = coeff * (1 << Al);
+  coeffs[0] = dc_coeff;
+  if (dc_coeff != coeffs[0]) {
+    return false;
+  }
+  *last_dc_coeff = coeff;
+  for (int k = 1; k < DCTSIZE2; k++) {
+    if (ac_fast != nullptr) {
+      int fast = PeekFastAC(ac_fast, br);
+      if (fast != 0) {
+        k += (fast >> 4) & 15;
+        if (k >= DCTSIZE2) {
+          return false;
+        }
+        br->bits_left_ -= fast & 15;
+        continue;
+      }
+    }
+    int sr = ReadSymbol(ac_huff, br);
+    if (sr >= kJpegHuffmanAlphabetSize) {
+      return false;
+    }
+    int r = sr >> 4;
+    int s = sr & 15;
+    if (s > 0) {
+      k += r;
+      if (k >= DCTSIZE2 || s + Al >= max_bits) {
+        return false;
+      }
+      br->FillBitWindow();
+      br->bits_left_ -= s;
+    } else if (r == 15) {
+      k += 15;
+    } else if (r > 0) {
+      // End-of-band runs are not allowed in sequential scans.
+      return false;
+    } else {
+      break;
+    }
+  }
+  return true;
+}
+
+// Returns the mask of the zigzag positions in [Ss, Se] of the nonzero
+// coefficients of the block.
+uint64_t NonzeroCoeffMask(const coeff_t* coeffs, const uint32_t* order,
+                          int Ss, int Se) {
+  uint64_t mask = 0;
+  for (int k = Ss; k <= Se; ++k) {
+    mask |= static_cast<uint64_t>(coeffs[order[k]] != 0) << k;
+  }
+  return mask;
+}
+
+// Reads the correction bits of the nonzero coefficients at the zigzag
+// positions of mask, up to 16 at a time, and refines the coefficients whose
+// bit is set with the bit p1 of their magnitude.
+void RefineNonzeroCoeffs(uint64_t mask, int p1, const uint32_t* order,
+                         BitReaderState* br, coeff_t* coeffs) {
+  while (mask != 0) {
+    int n = std::min(static_cast<int>(hwy::PopCount(mask)), 16);
+    int bits = br->ReadBits(n);
+    for (int i = n - 1; i >= 0; --i) {
+      size_t k = jxl::Num0BitsBelowLS1Bit_Nonzero(mask);
+      mask &= mask - 1;
+      coeff_t& coeff = coeffs[order[k]];
+      if (((bits >> i) & 1) && (coeff & p1) == 0) {
+        coeff += coeff >= 0 ? p1 : -p1;
+      }
+    }
+  }
+}
+
+// Decodes the refinement of one block in a successive approximation scan. The
+// nonzero coefficients of the band are found up front, so that the zero runs
+// are skipped with bit scans, and the correction bits of the nonzero
+// coefficients that they pass over are read together.
+bool RefineDCTBlock(const HuffmanTableEntry* ac_huff, const uint32_t* order,
+                    int Ss, int Se, int Al, int* eobrun, BitReaderState* br,
+                    coeff_t* coeffs) {
   // Nowadays multiplication is even faster than variable shift.
   int Am = 1 << Al;
   bool eobrun_allowed = Ss > 0;
@@ -259,90 +282,567 @@ bool RefineDCTBlock(const HuffmanTableEntry* ac_huff, int Ss, int Se, int Al,
     return true;
   }
   int p1 = Am;
-  int m1 = -Am;
   int k = Ss;
-  int r;
-  int s;
+  const uint64_t band = (~uint64_t{0} >> (63 - Se)) & (~uint64_t{0} << Ss);
+  const uint64_t nonzero = NonzeroCoeffMask(coeffs, order, Ss, Se);
   bool in_zero_run = false;
   if (*eobrun <= 0) {
-    for (; k <= Se; k++) {
-      s = ReadSymbol(ac_huff, br);
+    while (k <= Se) {
+      int s = ReadSymbol(ac_huff, br);
       if (s >= kJpegHuffmanAlphabetSize) {
         return false;
       }
-      r = s >> 4;
+      int r = s >> 4;
       s &= 15;
+      coeff_t value = 0;
       if (s) {
         if (s != 1) {
           return false;
         }
-        s = br->ReadBits(1) ? p1 : m1;
-        in_zero_run = false;
-      } else {
-        if (r != 15) {
-          *eobrun = 1 << r;
-          if (r > 0) {
-            if (!eobrun_allowed) {
-              return false;
-            }
-            *eobrun += br->ReadBits(r);
+        value = br->ReadBits(1) ? p1 : -p1;
+      } else if (r != 15) {
+        *eobrun = 1 << r;
+        if (r > 0) {
+          if (!eobrun_allowed) {
+            return false;
           }
-          break;
+          *eobrun += br->ReadBits(r);
         }
-        in_zero_run = true;
+        break;
       }
-      do {
-        coeff_t thiscoef = coeffs[kJPEGNaturalOrder[k]];
-        if (thiscoef != 0) {
-          if (br->ReadBits(1)) {
-            if ((thiscoef & p1) == 0) {
-              if (thiscoef >= 0) {
-                thiscoef += p1;
-              } else {
-                thiscoef += m1;
-              }
-            }
-          }
-          coeffs[kJPEGNaturalOrder[k]] = thiscoef;
-        } else {
-          if (--r < 0) {
-            break;
-          }
-        }
-        k++;
-      } while (k <= Se);
+      // The new coefficient, or the end of a run of 16 zeros, is at the zero
+      // coefficient after the next r zero coefficients.
+      uint64_t zeros = ~nonzero & band & (~uint64_t{0} << k);
+      for (; r > 0 && zeros != 0; --r) {
+        zeros &= zeros - 1;
+      }
+      if (zeros == 0) {
+        return false;
+      }
+      int z = jxl::Num0BitsBelowLS1Bit_Nonzero(zeros);
+      RefineNonzeroCoeffs(nonzero & ((uint64_t{1} << z) - (uint64_t{1} << k)),
+                          p1, order, br, coeffs);
       if (s) {
-        if (k > Se) {
-          return false;
-        }
-        coeffs[kJPEGNaturalOrder[k]] = s;
+        coeffs[order[z]] = value;
       }
+      in_zero_run = s == 0;
+      k = z + 1;
     }
   }
   if (in_zero_run) {
     return false;
   }
-  if (*eobrun > 0) {
-    for (; k <= Se; k++) {
-      coeff_t thiscoef = coeffs[kJPEGNaturalOrder[k]];
-      if (thiscoef != 0) {
-        if (br->ReadBits(1)) {
-          if ((thiscoef & p1) == 0) {
-            if (thiscoef >= 0) {
-              thiscoef += p1;
-            } else {
-              thiscoef += m1;
-            }
+  if (*eobrun > 0 && k <= Se) {
+    RefineNonzeroCoeffs(nonzero & (~uint64_t{0} << k), p1, order, br,
+                        coeffs);
+  }
+  --(*eobrun);
+  return true;
+}
+
+// Decodes the MCU at (mcu_y, mcu_x) of the current scan. If all_rows is true,
+// coeff_rows[c] has all block rows of component c, otherwise only the block
+// rows of the current iMCU row.
+bool DecodeMCU(j_decompress_ptr cinfo, size_t mcu_y, size_t mcu_x,
+               const JBLOCKARRAY* coeff_rows, bool all_rows,
+               coeff_t* sink_block, coeff_t* last_dc_coeff, int* eobrun,
+               BitReaderState* br) {
+  jpeg_decomp_master* m = cinfo->master;
+  bool scan_ok = true;
+  // The DC differences have at most data_precision + 3 bits, and the AC
+  // coefficients one bit less.
+  const int max_bits = cinfo->data_precision + 4;
+  for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+    const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+    int c = comp->component_index;
+    const HuffmanTableEntry* dc_lut =
+        &m->dc_huff_lut_[comp->dc_tbl_no * kJpegHuffmanLutSize];
+    const HuffmanTableEntry* ac_lut =
+        &m->ac_huff_lut_[comp->ac_tbl_no * kJpegHuffmanLutSize];
+    // The coefficients of the fast AC lookup table have at most
+    // kJpegFastACBits - 1 bits before the point transform.
+    const int16_t* ac_fast =
+        cinfo->Al + kJpegFastACBits - 1 < kJpegDCAlphabetSize
+            ? &m->ac_fast_lut_[comp->ac_tbl_no * kJpegFastACLutSize]
+            : nullptr;
+    for (int iy = 0; iy < comp->MCU_height; ++iy) {
+      size_t block_y = mcu_y * comp->MCU_height + iy;
+      size_t biy = all_rows ? block_y : block_y % comp->v_samp_factor;
+      for (int ix = 0; ix < comp->MCU_width; ++ix) {
+        size_t block_x = mcu_x * comp->MCU_width + ix;
+        coeff_t* coeffs;
+        if (block_x >= comp->width_in_blocks ||
+            block_y >= comp->height_in_blocks) {
+          // Note that it is OK that sink_block is uninitialized because
+          // it will never be used in any branches, even in the RefineDCTBlock
+          // case, because only DC scans can be interleaved and we don't use
+          // the zero-ness of the DC coeff in the DC refinement code-path.
+          coeffs = sink_block;
+        } else {
+          coeffs = &coeff_rows[c][biy][block_x][0];
+        }
+        if (m->dc_only_[c] && cinfo->Ss == 0 && cinfo->Se == DCTSIZE2 - 1) {
+          if (!DecodeDCOfDCTBlock(dc_lut, ac_lut, ac_fast, cinfo->Al,
+                                  max_bits, br, &last_dc_coeff[c], coeffs)) {
+            scan_ok = false;
+          }
+        } else if (cinfo->Ah == 0) {
+          if (!DecodeDCTBlock(dc_lut, ac_lut, ac_fast, m->coeff_order_,
+                              cinfo->Ss, cinfo->Se, cinfo->Al, max_bits,
+                              eobrun, br, &last_dc_coeff[c], coeffs)) {
+            scan_ok = false;
+          }
+        } else {
+          if (!RefineDCTBlock(ac_lut, m->coeff_order_, cinfo->Ss, cinfo->Se,
+                              cinfo->Al, eobrun, br, coeffs)) {
+            scan_ok = false;
           }
         }
-        coeffs[kJPEGNaturalOrder[k]] = thiscoef;
       }
     }
   }
-  --(*eobrun);
+  return scan_ok;
+}
+
+// A restart interval of the entropy coded data, begin is the position of its
+// first byte and end is the position of the marker after it.
+struct RestartInterval {
+  size_t begin;
+  size_t end;
+};
+
+// Returns the number of MCUs in a restart interval of the current scan, which
+// is the whole scan if it has no restart markers.
+size_t MCUsPerRestartInterval(j_decompress_ptr cinfo) {
+  size_t num_mcus = cinfo->MCUs_per_row * cinfo->MCU_rows_in_scan;
+  return cinfo->restart_interval > 0 ? cinfo->restart_interval : num_mcus;
+}
+
+// Finds the restart intervals of the current scan starting at data[pos].
+// Returns false if the end of the scan is not in the input buffer or if the
+// restart markers are not the expected ones.
+bool FindRestartIntervals(j_decompress_ptr cinfo, const uint8_t* data,
+                          size_t len, size_t pos,
+                          std::vector<RestartInterval>* intervals) {
+  size_t num_mcus = cinfo->MCUs_per_row * cinfo->MCU_rows_in_scan;
+  size_t num_intervals = DivCeil(num_mcus, MCUsPerRestartInterval(cinfo));
+  intervals->clear();
+  size_t begin = pos;
+  while (pos + 1 < len) {
+    const void* next = memchr(data + pos, 0xff, len - 1 - pos);
+    if (next == nullptr) {
+      break;
+    }
+    pos = static_cast<const uint8_t*>(next) - data;
+    uint8_t marker = data[pos + 1];
+    if (marker == 0 || marker == 0xff) {
+      // Escaped 0xff byte or fill byte before a marker.
+      ++pos;
+      continue;
+    }
+    intervals->push_back({begin, pos});
+    if (marker < 0xd0 || marker > 0xd7) {
+      // Any other marker ends the scan.
+      return intervals->size() == num_intervals;
+    }
+    if (static_cast<size_t>(marker - 0xd0) != ((intervals->size() - 1) & 7) ||
+        intervals->size() == num_intervals) {
+      return false;
+    }
+    pos += 2;
+    begin = pos;
+  }
+  return false;
+}
+
+// Copies the entropy coded data of the restart interval to out without the 0x00
+// bytes of the 0xff 0x00 escape sequences, and returns the number of bytes
+// written, which is at most the size of the interval. The 0xff bytes are found
+// with memchr(), which is vectorized in the common C libraries, and the bytes
+// between them are copied at once.
+size_t DestuffRestartInterval(const uint8_t* data,
+                              const RestartInterval& interval, uint8_t* out) {
+  size_t pos = interval.begin;
+  size_t out_len = 0;
+  while (pos < interval.end) {
+    const void* next = memchr(data + pos, 0xff, interval.end - pos);
+    size_t chunk_end = next == nullptr
+                           ? interval.end
+                           : static_cast<const uint8_t*>(next) - data + 1;
+    memcpy(out + out_len, data + pos, chunk_end - pos);
+    out_len += chunk_end - pos;
+    pos = chunk_end;
+    if (next != nullptr && pos < interval.end && data[pos] == 0) {
+      ++pos;
+    }
+  }
+  return out_len;
+}
+
+// Decodes the MCUs of one restart interval of the current scan. Returns false
+// if the entropy coded data of the interval is invalid, or it does not end
+// exactly at the next marker. If destuffed is true, data is the output of
+// DestuffRestartInterval() and the interval is its range. Called on worker
+// threads, so it must not report errors or warnings.
+bool DecodeRestartInterval(j_decompress_ptr cinfo, const uint8_t* data,
+                           size_t len, const RestartInterval& interval,
+                           bool destuffed, size_t mcu_begin, size_t mcu_end,
+                           const JBLOCKARRAY* coeff_rows) {
+  HWY_ALIGN_MAX coeff_t sink_block[DCTSIZE2];
+  coeff_t last_dc_coeff[kMaxComponents] = {0};
+  int eobrun = -1;
+  // The destuffed intervals are next to each other, so the bit reader must
+  // not read past the end of this one.
+  BitReaderState br(data, destuffed ? interval.end : len, interval.begin,
+                    destuffed);
+  for (size_t mcu = mcu_begin; mcu < mcu_end; ++mcu) {
+    size_t mcu_y = mcu / cinfo->MCUs_per_row;
+    size_t mcu_x = mcu % cinfo->MCUs_per_row;
+    if (!DecodeMCU(cinfo, mcu_y, mcu_x, coeff_rows, /*all_rows=*/true,
+                   sink_block, last_dc_coeff, &eobrun, &br)) {
+      return false;
+    }
+  }
+  size_t pos;
+  size_t bit_pos;
+  if (eobrun > 0 || !br.FinishStream(&pos, &bit_pos)) {
+    return false;
+  }
+  if (bit_pos > 0) {
+    pos += !destuffed && data[pos] == 0xff ? 2 : 1;
+  }
+  return pos == interval.end;
+}
+
+// Gets the restart intervals of the current scan starting at data[pos] from
+// the restart index. Returns false if there is no index for the scan, or if it
+// does not match the input.
+bool GetIndexedRestartIntervals(j_decompress_ptr cinfo, const uint8_t* data,
+                                size_t len, size_t pos,
+                                std::vector<RestartInterval>* intervals) {
+  jpeg_decomp_master* m = cinfo->master;
+  size_t scan_index = cinfo->input_scan_number - 1;
+  if (scan_index >= m->restart_index_.size()) {
+    return false;
+  }
+  const std::vector<uint32_t>& offsets = m->restart_index_[scan_index];
+  size_t num_mcus = cinfo->MCUs_per_row * cinfo->MCU_rows_in_scan;
+  size_t num_intervals = DivCeil(num_mcus, MCUsPerRestartInterval(cinfo));
+  if (offsets.size() != num_intervals + 1) {
+    return false;
+  }
+  intervals->resize(num_intervals);
+  for (size_t i = 0; i < num_intervals; ++i) {
+    size_t begin = pos + offsets[i];
+    size_t end = pos + offsets[i + 1] - (i + 1 < num_intervals ? 2 : 0);
+    if (offsets[i + 1] < offsets[i] + 2 || end + 1 >= len ||
+        data[end] != 0xff) {
+      return false;
+    }
+    uint8_t marker = data[end + 1];
+    bool is_restart = marker >= 0xd0 && marker <= 0xd7;
+    if (i + 1 < num_intervals
+            ? !is_restart || static_cast<size_t>(marker - 0xd0) != (i & 7)
+            : is_restart || marker == 0 || marker == 0xff) {
+      return false;
+    }
+    (*intervals)[i] = {begin, end};
+  }
+  return true;
+}
+
+// Gets the restart intervals of the current scan starting at data[pos] from the
+// restart index, or finds them by searching for the restart markers and adds
+// them to the index. Returns false if the intervals are not found.
+bool GetRestartIntervals(j_decompress_ptr cinfo, const uint8_t* data,
+                         size_t len, size_t pos,
+                         std::vector<RestartInterval>* intervals) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (GetIndexedRestartIntervals(cinfo, data, len, pos, intervals)) {
+    return true;
+  }
+  if (!FindRestartIntervals(cinfo, data, len, pos, intervals)) {
+    return false;
+  }
+  size_t scan_index = cinfo->input_scan_number - 1;
+  if (m->restart_index_.size() <= scan_index) {
+    m->restart_index_.resize(scan_index + 1);
+  }
+  std::vector<uint32_t>& offsets = m->restart_index_[scan_index];
+  offsets.clear();
+  if (intervals->back().end - pos <= UINT32_MAX) {
+    for (const RestartInterval& interval : *intervals) {
+      offsets.push_back(interval.begin - pos);
+    }
+    offsets.push_back(intervals->back().end - pos);
+  }
   return true;
 }
 
+// Returns true if the restart interval starting at the given MCU contains an
+// MCU of the decoded region, or if the whole image is decoded.
+bool IsRestartIntervalInRegion(j_decompress_ptr cinfo, size_t mcu_begin,
+                               size_t mcu_end) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (!m->decode_region_) {
+    return true;
+  }
+  // Size of the MCUs of the scan in image pixels.
+  size_t mcu_xsize = cinfo->max_h_samp_factor * DCTSIZE;
+  size_t mcu_ysize = cinfo->max_v_samp_factor * DCTSIZE;
+  if (cinfo->comps_in_scan == 1) {
+    mcu_xsize /= cinfo->cur_comp_info[0]->h_samp_factor;
+    mcu_ysize /= cinfo->cur_comp_info[0]->v_samp_factor;
+  }
+  // The MCUs next to the region are also decoded, since they are needed as
+  // context for upsampling and block smoothing.
+  size_t mx0 = m->region_x0_ / mcu_xsize;
+  size_t my0 = m->region_y0_ / mcu_ysize;
+  size_t mx1 = DivCeil(m->region_x1_, mcu_xsize) + 1;
+  size_t my1 = DivCeil(m->region_y1_, mcu_ysize) + 1;
+  mx0 = mx0 > 0 ? mx0 - 1 : 0;
+  my0 = my0 > 0 ? my0 - 1 : 0;
+  size_t row_begin = mcu_begin / cinfo->MCUs_per_row;
+  size_t row_last = (mcu_end - 1) / cinfo->MCUs_per_row;
+  for (size_t row = std::max(row_begin, my0); row <= row_last && row < my1;
+       ++row) {
+    size_t col_first = row == row_begin ? mcu_begin % cinfo->MCUs_per_row : 0;
+    size_t col_last = row == row_last ? (mcu_end - 1) % cinfo->MCUs_per_row
+                                      : cinfo->MCUs_per_row - 1;
+    if (col_first < mx1 && col_last >= mx0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Decodes the restart intervals of the current scan independently of each
+// other, in parallel if a parallel runner is set, if the whole scan is in the
+// input buffer. With jpegli_set_destuffed_scans(), each task first destuffs its
+// interval into its part of a scratch buffer of the size of the scan. When a
+// decoded region is set, only the restart intervals that overlap with it are
+// decoded, and the coefficients of the rest of the scan are left as zero. The
+// restart intervals are found either using the restart index, or by searching
+// for the restart markers; in the latter case they are added to the index.
+//
+// On success, *pos is set to the end of the scan and true is returned.
+// Otherwise the coefficients of the scan are cleared so that the scan can be
+// decoded again sequentially, which also reports the errors in the entropy
+// coded data.
+bool DecodeScanByRestartIntervals(j_decompress_ptr cinfo, const uint8_t* data,
+                                  size_t len, size_t* pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  std::vector<RestartInterval> intervals;
+  if (!GetRestartIntervals(cinfo, data, len, *pos, &intervals)) {
+    return false;
+  }
+  std::vector<JBLOCKROW> rows[kMaxComponents];
+  JBLOCKARRAY coeff_rows[kMaxComponents] = {};
+  for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+    const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+    int c = comp->component_index;
+    rows[c].resize(comp->height_in_blocks);
+    for (JDIMENSION by = 0; by < comp->height_in_blocks;
+         by += comp->v_samp_factor) {
+      JDIMENSION num_rows = std::min<JDIMENSION>(comp->v_samp_factor,
+                                                 comp->height_in_blocks - by);
+      JBLOCKARRAY ba = (*cinfo->mem->access_virt_barray)(
+          reinterpret_cast<j_common_ptr>(cinfo), m->coef_arrays[c], by,
+          num_rows, TRUE);
+      std::copy(ba, ba + num_rows, &rows[c][by]);
+    }
+    coeff_rows[c] = rows[c].data();
+  }
+  const size_t num_mcus = cinfo->MCUs_per_row * cinfo->MCU_rows_in_scan;
+  const size_t restart_interval = MCUsPerRestartInterval(cinfo);
+  std::vector<uint32_t> tasks;
+  for (size_t i = 0; i < intervals.size(); ++i) {
+    size_t mcu_begin = i * restart_interval;
+    size_t mcu_end = std::min(num_mcus, mcu_begin + restart_interval);
+    if (IsRestartIntervalInRegion(cinfo, mcu_begin, mcu_end)) {
+      tasks.push_back(i);
+    }
+  }
+  std::vector<uint8_t> interval_ok(tasks.size());
+  const bool destuff = m->destuff_scans_;
+  const size_t scan_begin = intervals.front().begin;
+  std::vector<uint8_t> destuffed;
+  if (destuff) {
+    destuffed.resize(intervals.back().end - scan_begin);
+  }
+  const auto decode_interval = [&](uint32_t task, size_t /* thread */) {
+    size_t mcu_begin = tasks[task] * restart_interval;
+    size_t mcu_end = std::min(num_mcus, mcu_begin + restart_interval);
+    const RestartInterval& interval = intervals[tasks[task]];
+    if (destuff) {
+      // A destuffed interval is not longer than the original one, so it fits
+      // at the same offset in the scratch buffer.
+      size_t begin = interval.begin - scan_begin;
+      size_t size =
+          DestuffRestartInterval(data, interval, destuffed.data() + begin);
+      interval_ok[task] = DecodeRestartInterval(
+          cinfo, destuffed.data(), destuffed.size(), {begin, begin + size},
+          /*destuffed=*/true, mcu_begin, mcu_end, coeff_rows);
+    } else {
+      interval_ok[task] =
+          DecodeRestartInterval(cinfo, data, len, interval,
+                                /*destuffed=*/false, mcu_begin, mcu_end,
+                                coeff_rows);
+    }
+  };
+  RunParallel(cinfo, 0, static_cast<uint32_t>(tasks.size()), decode_interval);
+  for (uint32_t task : tasks) {
+    size_t mcu_begin = task * restart_interval;
+    m->num_mcus_decoded_ +=
+        std::min(num_mcus, mcu_begin + restart_interval) - mcu_begin;
+  }
+  if (std::find(interval_ok.begin(), interval_ok.end(), 0) !=
+      interval_ok.end()) {
+    for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+      const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+      for (JBLOCKROW row : rows[comp->component_index]) {
+        memset(row, 0, comp->width_in_blocks * sizeof(JBLOCK));
+      }
+    }
+    size_t scan_index = cinfo->input_scan_number - 1;
+    if (scan_index < m->restart_index_.size()) {
+      // The index might be the cause of the failure.
+      m->restart_index_[scan_index].clear();
+    }
+    return false;
+  }
+  *pos = intervals.back().end;
+  return true;
+}
+
+// Records the parameters, the Huffman tables and the restart intervals of the
+// current progressive scan for band decoding, see DecodeCoeffBand(), and skips
+// its entropy coded data. The whole scan must be in the input buffer.
+int IndexScanForBands(j_decompress_ptr cinfo, const uint8_t* data, size_t len,
+                      size_t* pos, size_t* bit_pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  std::vector<RestartInterval> intervals;
+  size_t scan_index = cinfo->input_scan_number - 1;
+  if (!m->input_buffer_.empty() ||
+      !GetRestartIntervals(cinfo, data, len, *pos, &intervals) ||
+      m->restart_index_[scan_index].empty()) {
+    JPEGLI_ERROR("Invalid progressive scan for band decoding");
+  }
+  BandScan scan;
+  scan.comps_in_scan = cinfo->comps_in_scan;
+  for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+    const jpeg_component_info* comp = cinfo->cur_comp_info[i];
+    scan.component_index[i] = comp->component_index;
+    scan.dc_tbl_no[i] = comp->dc_tbl_no;
+    scan.ac_tbl_no[i] = comp->ac_tbl_no;
+  }
+  scan.Ss = cinfo->Ss;
+  scan.Se = cinfo->Se;
+  scan.Ah = cinfo->Ah;
+  scan.Al = cinfo->Al;
+  scan.restart_interval = cinfo->restart_interval;
+  scan.MCUs_per_row = cinfo->MCUs_per_row;
+  scan.MCU_rows_in_scan = cinfo->MCU_rows_in_scan;
+  scan.scan_index = scan_index;
+  scan.data = data + *pos;
+  scan.len = len - *pos;
+  // The tables are only copied again if they were redefined since the
+  // previous scan.
+  std::vector<BandHuffmanLuts>& luts = m->band_huff_luts_;
+  if (luts.empty() ||
+      memcmp(luts.back().dc_huff_lut, m->dc_huff_lut_,
+             sizeof(m->dc_huff_lut_)) != 0 ||
+      memcmp(luts.back().ac_huff_lut, m->ac_huff_lut_,
+             sizeof(m->ac_huff_lut_)) != 0) {
+    luts.emplace_back();
+    memcpy(luts.back().dc_huff_lut, m->dc_huff_lut_, sizeof(m->dc_huff_lut_));
+    memcpy(luts.back().ac_huff_lut, m->ac_huff_lut_, sizeof(m->ac_huff_lut_));
+    memcpy(luts.back().ac_fast_lut, m->ac_fast_lut_, sizeof(m->ac_fast_lut_));
+  }
+  scan.huff_luts = luts.size() - 1;
+  m->band_scans_.push_back(scan);
+  *pos = intervals.back().end;
+  *bit_pos = 0;
+  m->scan_mcu_row_ = cinfo->MCU_rows_in_scan;
+  cinfo->input_iMCU_row = cinfo->total_iMCU_rows;
+  return JPEG_SCAN_COMPLETED;
+}
+
+// Makes scan the current scan of cinfo, for DecodeRestartInterval().
+void SetBandScan(j_decompress_ptr cinfo, const BandScan& scan) {
+  jpeg_decomp_master* m = cinfo->master;
+  cinfo->comps_in_scan = scan.comps_in_scan;
+  for (int i = 0; i < scan.comps_in_scan; ++i) {
+    jpeg_component_info* comp = &cinfo->comp_info[scan.component_index[i]];
+    comp->dc_tbl_no = scan.dc_tbl_no[i];
+    comp->ac_tbl_no = scan.ac_tbl_no[i];
+    comp->MCU_width = scan.comps_in_scan > 1 ? comp->h_samp_factor : 1;
+    comp->MCU_height = scan.comps_in_scan > 1 ? comp->v_samp_factor : 1;
+    cinfo->cur_comp_info[i] = comp;
+  }
+  cinfo->Ss = scan.Ss;
+  cinfo->Se = scan.Se;
+  cinfo->Ah = scan.Ah;
+  cinfo->Al = scan.Al;
+  cinfo->restart_interval = scan.restart_interval;
+  cinfo->MCUs_per_row = scan.MCUs_per_row;
+  cinfo->MCU_rows_in_scan = scan.MCU_rows_in_scan;
+  const BandHuffmanLuts& luts = m->band_huff_luts_[scan.huff_luts];
+  memcpy(m->dc_huff_lut_, luts.dc_huff_lut, sizeof(m->dc_huff_lut_));
+  memcpy(m->ac_huff_lut_, luts.ac_huff_lut, sizeof(m->ac_huff_lut_));
+  memcpy(m->ac_fast_lut_, luts.ac_fast_lut, sizeof(m->ac_fast_lut_));
+}
+
+// Returns the number of MCU rows of scan per iMCU row.
+size_t MCURowsPeriMCURow(j_decompress_ptr cinfo, const BandScan& scan) {
+  return scan.comps_in_scan > 1
+             ? 1
+             : cinfo->comp_info[scan.component_index[0]].v_samp_factor;
+}
+
+// Returns true if the current scan is an AC scan of a progressive image and
+// the output of its components depends only on the DC coefficients.
+bool CanSkipScan(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->Ss == 0) {
+    return false;
+  }
+  for (int i = 0; i < cinfo->comps_in_scan; ++i) {
+    if (!m->dc_only_[cinfo->cur_comp_info[i]->component_index]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Skips the entropy coded data of the current scan, including its restart
+// markers, without decoding it. Returns JPEG_SCAN_COMPLETED with *pos at the
+// marker after the scan, or kNeedMoreInput if that is not in the input buffer.
+int SkipScan(j_decompress_ptr cinfo, const uint8_t* data, size_t len,
+             size_t* pos, size_t* bit_pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  *bit_pos = 0;
+  while (*pos + 1 < len) {
+    const void* next = memchr(data + *pos, 0xff, len - 1 - *pos);
+    if (next == nullptr) {
+      // The last byte might be the start of the next marker.
+      *pos = len - 1;
+      break;
+    }
+    *pos = static_cast<const uint8_t*>(next) - data;
+    uint8_t marker = data[*pos + 1];
+    if (marker == 0 || marker == 0xff || (marker >= 0xd0 && marker <= 0xd7)) {
+      ++(*pos);
+      continue;
+    }
+    m->scan_mcu_row_ = cinfo->MCU_rows_in_scan;
+    m->scan_mcu_col_ = 0;
+    cinfo->input_iMCU_row = cinfo->total_iMCU_rows;
+    return JPEG_SCAN_COMPLETED;
+  }
+  return kNeedMoreInput;
+}
+
 void SaveMCUCodingState(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   memcpy(m->mcu_.last_dc_coeff, m->last_dc_coeff_, sizeof(m->last_dc_coeff_));
@@ -418,8 +918,234 @@ bool FinishScan(j_decompress_ptr cinfo, const uint8_t* data, const size_t len,
   return true;
 }
 
+// Skips the rest of the entropy coded data of an arithmetic coded scan or
+// restart interval, which can end with bytes that the decoder did not need.
+// Returns false if the next marker is not in the input buffer.
+bool SkipToMarker(const uint8_t* data, size_t len, size_t* pos) {
+  while (*pos + 1 < len) {
+    if (data[*pos] == 0xff && data[*pos + 1] != 0 && data[*pos + 1] != 0xff) {
+      return true;
+    }
+    ++(*pos);
+  }
+  return false;
+}
+
+// Same as ProcessScan() for arithmetic coded scans. The decoder state is saved
+// before each MCU that might not be complete in the input buffer, and it is
+// restored if it was not.
+int ProcessArithScan(j_decompress_ptr cinfo, const uint8_t* const data,
+                     const size_t len, size_t* pos) {
+  jpeg_decomp_master* m = cinfo->master;
+  for (;;) {
+    if (m->scan_mcu_row_ == cinfo->MCU_rows_in_scan) {
+      if (!SkipToMarker(data, len, pos)) {
+        return kNeedMoreInput;
+      }
+      break;
+    }
+    if (cinfo->restart_interval > 0 && m->restarts_to_go_ == 0) {
+      if (!SkipToMarker(data, len, pos)) {
+        return kNeedMoreInput;
+      }
+      ResetArithDecoder(cinfo);
+      cinfo->unread_marker = data[*pos + 1];
+      *pos += 2;
+      return kHandleRestart;
+    }
+
+    const bool save_state = *pos + kMaxArithMCUByteSize > len;
+    if (save_state) {
+      SaveMCUCodingState(cinfo);
+      m->saved_arith_ = m->arith_;
+    }
+    HWY_ALIGN_MAX static coeff_t sink_block[DCTSIZE2] = {0};
+    bool need_more_input = false;
+    bool mcu_ok = DecodeArithMCU(cinfo, m->scan_mcu_row_, m->scan_mcu_col_,
+                                 m->coeff_rows, sink_block, data, len, pos,
+                                 &need_more_input);
+    ++m->num_mcus_decoded_;
+    if (need_more_input) {
+      if (!save_state) {
+        JPEGLI_ERROR("Arithmetic coded MCU is too large.");
+      }
+      RestoreMCUCodingState(cinfo);
+      m->arith_ = m->saved_arith_;
+      return kNeedMoreInput;
+    }
+    if (!mcu_ok) {
+      JPEGLI_ERROR("Failed to decode DCT block");
+    }
+    if (m->restarts_to_go_ > 0) {
+      --m->restarts_to_go_;
+    }
+    ++m->scan_mcu_col_;
+    if (m->scan_mcu_col_ == cinfo->MCUs_per_row) {
+      ++m->scan_mcu_row_;
+      m->scan_mcu_col_ = 0;
+      if (m->scan_mcu_row_ < cinfo->MCU_rows_in_scan &&
+          (m->scan_mcu_row_ % m->mcu_rows_per_iMCU_row_) == 0) {
+        // Current iMCU row is done.
+        break;
+      }
+    }
+  }
+  ++cinfo->input_iMCU_row;
+  if (cinfo->input_iMCU_row < cinfo->total_iMCU_rows) {
+    PrepareForiMCURow(cinfo);
+    return JPEG_ROW_COMPLETED;
+  }
+  return JPEG_SCAN_COMPLETED;
+}
+
 }  // namespace
 
+bool IsRestartIntervalDecodingEnabled(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (m->destuff_scans_) {
+    return !FROM_JXL_BOOL(cinfo->progressive_mode) &&
+           !FROM_JXL_BOOL(cinfo->arith_code);
+  }
+  return (m->runner != nullptr || m->decode_region_ ||
+          !m->restart_index_.empty()) &&
+         cinfo->restart_interval > 0 &&
+         !FROM_JXL_BOOL(cinfo->progressive_mode) &&
+         !FROM_JXL_BOOL(cinfo->arith_code);
+}
+
+void GetCoeffBandRows(j_decompress_ptr cinfo, size_t band, size_t* begin,
+                      size_t* end) {
+  jpeg_decomp_master* m = cinfo->master;
+  // The block smoothing looks at two block rows above and below each block.
+  const size_t context = cinfo->do_block_smoothing ? 2 : 0;
+  size_t y0 = band * m->progressive_band_rows_;
+  size_t y1 = std::min<size_t>(y0 + m->progressive_band_rows_ + context,
+                               cinfo->total_iMCU_rows);
+  y0 = y0 > context ? y0 - context : 0;
+  // The AC refinement scans need the coefficients of the earlier scans in all
+  // blocks of their decoded restart intervals, so the rows are extended to
+  // whole restart intervals of these scans.
+  bool extended = true;
+  while (extended) {
+    extended = false;
+    for (const BandScan& scan : m->band_scans_) {
+      if (scan.Ss == 0 || scan.Ah == 0) {
+        continue;
+      }
+      const size_t mcu_rows = MCURowsPeriMCURow(cinfo, scan);
+      const size_t num_mcus =
+          static_cast<size_t>(scan.MCUs_per_row) * scan.MCU_rows_in_scan;
+      const size_t interval =
+          scan.restart_interval > 0 ? scan.restart_interval : num_mcus;
+      size_t row0 = std::min<size_t>(y0 * mcu_rows, scan.MCU_rows_in_scan);
+      size_t row1 = std::min<size_t>(y1 * mcu_rows, scan.MCU_rows_in_scan);
+      if (row1 <= row0) {
+        continue;
+      }
+      size_t mcu0 = row0 * scan.MCUs_per_row / interval * interval;
+      size_t mcu1 = std::min(
+          DivCeil(row1 * scan.MCUs_per_row, interval) * interval, num_mcus);
+      size_t new_y0 = mcu0 / scan.MCUs_per_row / mcu_rows;
+      size_t new_y1 = DivCeil(DivCeil(mcu1, scan.MCUs_per_row), mcu_rows);
+      if (new_y0 < y0 || new_y1 > y1) {
+        y0 = std::min(y0, new_y0);
+        y1 = std::max(y1, new_y1);
+        extended = true;
+      }
+    }
+  }
+  *begin = y0;
+  *end = y1;
+}
+
+void DecodeCoeffBand(j_decompress_ptr cinfo, size_t imcu_row) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t band = imcu_row / m->progressive_band_rows_;
+  if (band == m->coeff_band_) {
+    return;
+  }
+  size_t y0;
+  size_t y1;
+  GetCoeffBandRows(cinfo, band, &y0, &y1);
+  // Block row by of component c is at coeff_rows[c][by], which is the sink row
+  // for the rows outside of the band.
+  std::vector<JBLOCKROW> rows[kMaxComponents];
+  JBLOCKARRAY coeff_rows[kMaxComponents] = {};
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    const JDIMENSION by0 = y0 * comp->v_samp_factor;
+    const JDIMENSION by1 = std::min<JDIMENSION>(y1 * comp->v_samp_factor,
+                                                comp->height_in_blocks);
+    rows[c].assign(comp->height_in_blocks, m->coeff_band_sink_);
+    for (JDIMENSION by = by0; by < by1; by += comp->v_samp_factor) {
+      JDIMENSION num_rows =
+          std::min<JDIMENSION>(comp->v_samp_factor, by1 - by);
+      JBLOCKARRAY ba = (*cinfo->mem->access_virt_barray)(
+          reinterpret_cast<j_common_ptr>(cinfo), m->coef_arrays[c], by - by0,
+          num_rows, TRUE);
+      for (JDIMENSION iy = 0; iy < num_rows; ++iy) {
+        memset(ba[iy], 0, comp->width_in_blocks * sizeof(JBLOCK));
+        rows[c][by + iy] = ba[iy];
+      }
+    }
+    coeff_rows[c] = rows[c].data();
+  }
+  // The band is decoded with the parameters of each scan in turn, and the
+  // parameters of the last scan are restored afterwards.
+  jpeg_component_info comp_info[kMaxComponents];
+  memcpy(comp_info, cinfo->comp_info,
+         cinfo->num_components * sizeof(comp_info[0]));
+  const int comps_in_scan = cinfo->comps_in_scan;
+  jpeg_component_info* cur_comp_info[MAX_COMPS_IN_SCAN];
+  memcpy(cur_comp_info, cinfo->cur_comp_info, sizeof(cur_comp_info));
+  const int Ss = cinfo->Ss;
+  const int Se = cinfo->Se;
+  const int Ah = cinfo->Ah;
+  const int Al = cinfo->Al;
+  const unsigned int restart_interval = cinfo->restart_interval;
+  const JDIMENSION MCUs_per_row = cinfo->MCUs_per_row;
+  const JDIMENSION MCU_rows_in_scan = cinfo->MCU_rows_in_scan;
+  for (const BandScan& scan : m->band_scans_) {
+    SetBandScan(cinfo, scan);
+    const size_t mcu_rows = MCURowsPeriMCURow(cinfo, scan);
+    const size_t row0 = std::min<size_t>(y0 * mcu_rows, scan.MCU_rows_in_scan);
+    const size_t row1 = std::min<size_t>(y1 * mcu_rows, scan.MCU_rows_in_scan);
+    if (row1 <= row0) {
+      continue;
+    }
+    const std::vector<uint32_t>& offsets = m->restart_index_[scan.scan_index];
+    const size_t num_intervals = offsets.size() - 1;
+    const size_t num_mcus = cinfo->MCUs_per_row * cinfo->MCU_rows_in_scan;
+    const size_t interval_mcus = MCUsPerRestartInterval(cinfo);
+    const size_t first = row0 * cinfo->MCUs_per_row / interval_mcus;
+    const size_t last = DivCeil(row1 * cinfo->MCUs_per_row, interval_mcus);
+    for (size_t i = first; i < last; ++i) {
+      const size_t mcu_begin = i * interval_mcus;
+      const size_t mcu_end = std::min(num_mcus, mcu_begin + interval_mcus);
+      const RestartInterval interval = {
+          offsets[i], offsets[i + 1] - (i + 1 < num_intervals ? 2 : 0)};
+      if (!DecodeRestartInterval(cinfo, scan.data, scan.len, interval,
+                                 /*destuffed=*/false, mcu_begin, mcu_end,
+                                 coeff_rows)) {
+        JPEGLI_ERROR("Failed to decode DCT block");
+      }
+    }
+  }
+  memcpy(cinfo->comp_info, comp_info,
+         cinfo->num_components * sizeof(comp_info[0]));
+  cinfo->comps_in_scan = comps_in_scan;
+  memcpy(cinfo->cur_comp_info, cur_comp_info, sizeof(cur_comp_info));
+  cinfo->Ss = Ss;
+  cinfo->Se = Se;
+  cinfo->Ah = Ah;
+  cinfo->Al = Al;
+  cinfo->restart_interval = restart_interval;
+  cinfo->MCUs_per_row = MCUs_per_row;
+  cinfo->MCU_rows_in_scan = MCU_rows_in_scan;
+  m->coeff_band_ = band;
+  m->coeff_band_begin_ = y0;
+}
+
 void PrepareForiMCURow(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   for (int i = 0; i < cinfo->comps_in_scan; ++i) {
@@ -441,6 +1167,25 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* const data,
     return kNeedMoreInput;
   }
   jpeg_decomp_master* m = cinfo->master;
+  CheckCancelFlag(cinfo);
+  if (CanSkipScan(cinfo)) {
+    return SkipScan(cinfo, data, len, pos, bit_pos);
+  }
+  if (m->coeff_band_decoding_) {
+    return IndexScanForBands(cinfo, data, len, pos, bit_pos);
+  }
+  if (cinfo->arith_code) {
+    return ProcessArithScan(cinfo, data, len, pos);
+  }
+  if (IsRestartIntervalDecodingEnabled(cinfo) && !m->streaming_mode_ &&
+      m->scan_mcu_row_ == 0 && m->scan_mcu_col_ == 0 && *bit_pos == 0 &&
+      m->restarts_to_go_ == static_cast<int>(cinfo->restart_interval)) {
+    if (DecodeScanByRestartIntervals(cinfo, data, len, pos)) {
+      m->scan_mcu_row_ = cinfo->MCU_rows_in_scan;
+      cinfo->input_iMCU_row = cinfo->total_iMCU_rows;
+      return JPEG_SCAN_COMPLETED;
+    }
+  }
   for (;;) {
     // Handle the restart intervals.
     if (cinfo->restart_interval > 0 && m->restarts_to_go_ == 0) {
@@ -477,46 +1222,11 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* const data,
 
     // Decode one MCU.
     HWY_ALIGN_MAX static coeff_t sink_block[DCTSIZE2] = {0};
-    bool scan_ok = true;
-    for (int i = 0; i < cinfo->comps_in_scan; ++i) {
-      const jpeg_component_info* comp = cinfo->cur_comp_info[i];
-      int c = comp->component_index;
-      const HuffmanTableEntry* dc_lut =
-          &m->dc_huff_lut_[comp->dc_tbl_no * kJpegHuffmanLutSize];
-      const HuffmanTableEntry* ac_lut =
-          &m->ac_huff_lut_[comp->ac_tbl_no * kJpegHuffmanLutSize];
-      for (int iy = 0; iy < comp->MCU_height; ++iy) {
-        size_t block_y = m->scan_mcu_row_ * comp->MCU_height + iy;
-        int biy = block_y % comp->v_samp_factor;
-        for (int ix = 0; ix < comp->MCU_width; ++ix) {
-          size_t block_x = m->scan_mcu_col_ * comp->MCU_width + ix;
-          coeff_t* coeffs;
-          if (block_x >= comp->width_in_blocks ||
-              block_y >= comp->height_in_blocks) {
-            // Note that it is OK that sink_block is uninitialized because
-            // it will never be used in any branches, even in the RefineDCTBlock
-            // case, because only DC scans can be interleaved and we don't use
-            // the zero-ness of the DC coeff in the DC refinement code-path.
-            coeffs = sink_block;
-          } else {
-            coeffs = &m->coeff_rows[c][biy][block_x][0];
-          }
-          if (cinfo->Ah == 0) {
-            if (!DecodeDCTBlock(dc_lut, ac_lut, cinfo->Ss, cinfo->Se, cinfo->Al,
-                                &m->eobrun_, &br,
-                                &m->last_dc_coeff_[comp->component_index],
-                                coeffs)) {
-              scan_ok = false;
-            }
-          } else {
-            if (!RefineDCTBlock(ac_lut, cinfo->Ss, cinfo->Se, cinfo->Al,
-                                &m->eobrun_, &br, coeffs)) {
-              scan_ok = false;
-            }
-          }
-        }
-      }
-    }
+    bool scan_ok =
+        DecodeMCU(cinfo, m->scan_mcu_row_, m->scan_mcu_col_, m->coeff_rows,
+                  /*all_rows=*/false, sink_block, m->last_dc_coeff_,
+                  &m->eobrun_, &br);
+    ++m->num_mcus_decoded_;
     size_t new_pos;
     size_t new_bit_pos;
     bool stream_ok = br.FinishStream(&new_pos, &new_bit_pos);
@@ -28,6 +28,26 @@ int ProcessScan(j_decompress_ptr cinfo, const uint8_t* data, size_t len,
 
 void PrepareForiMCURow(j_decompress_ptr cinfo);
 
+// Returns true if the restart intervals of the sequential scans are decoded
+// independently of each other when the whole scan is available, which needs
+// the coefficients of the whole image. This is done when they can be decoded
+// in parallel, when only a region of the image is decoded, when a restart
+// index is available, or when the scans are destuffed before decoding, in which
+// case a scan without restart markers is a single restart interval.
+bool IsRestartIntervalDecodingEnabled(j_decompress_ptr cinfo);
+
+// Sets [*begin, *end) to the iMCU rows whose coefficients are decoded for the
+// given band of jpegli_set_progressive_band_rows(). These are the rows of the
+// band, the context rows of the block smoothing, and the rows of the restart
+// intervals of the AC refinement scans that overlap with these.
+void GetCoeffBandRows(j_decompress_ptr cinfo, size_t band, size_t* begin,
+                      size_t* end);
+
+// Decodes the coefficients of the band of the given iMCU row into the
+// coefficient buffer from the scans that were recorded while reading the
+// input, unless it is already there.
+void DecodeCoeffBand(j_decompress_ptr cinfo, size_t imcu_row);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_DECODE_SCAN_H_
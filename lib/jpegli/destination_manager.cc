@@ -4,16 +4,33 @@
 // license that can be found in the LICENSE file or at
 // https://developers.google.com/open-source/licenses/bsd
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/encode.h"
+#include "lib/jpegli/encode_internal.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/memory_manager.h"
 
+#if defined(__unix__) || defined(__unix) || \
+    defined(__APPLE__) && defined(__MACH__)
+#define JPEGLI_HAS_FD_OUTPUT 1
+#include <cerrno>
+
+#include <unistd.h>
+#else
+#define JPEGLI_HAS_FD_OUTPUT 0
+#endif
+
 namespace jpegli {
 
 constexpr size_t kDestBufferSize = 64 << 10;
@@ -53,6 +70,176 @@ struct StdioDestinationManager {
   }
 };
 
+// Larger than the stdio buffer, since every flush is a system call.
+constexpr size_t kFdDestBufferSize = 1 << 20;
+
+struct FdDestinationManager {
+  jpeg_destination_mgr pub;
+  int fd;
+  uint8_t* buffer;
+
+  static void init_destination(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<FdDestinationManager*>(cinfo->dest);
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer = kFdDestBufferSize;
+  }
+
+  static void WriteBuffer(j_compress_ptr cinfo, size_t len) {
+#if JPEGLI_HAS_FD_OUTPUT
+    auto* dest = reinterpret_cast<FdDestinationManager*>(cinfo->dest);
+    const uint8_t* data = dest->buffer;
+    while (len > 0) {
+      ssize_t num_written = write(dest->fd, data, len);
+      if (num_written < 0 && errno == EINTR) continue;
+      if (num_written <= 0) {
+        JPEGLI_ERROR("Failed to write to output file descriptor.");
+      }
+      data += num_written;
+      len -= num_written;
+    }
+#else
+    JPEGLI_ERROR("jpegli_fd_dest: file descriptors are not supported");
+#endif
+  }
+
+  static boolean empty_output_buffer(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<FdDestinationManager*>(cinfo->dest);
+    WriteBuffer(cinfo, kFdDestBufferSize);
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer = kFdDestBufferSize;
+    return TRUE;
+  }
+
+  static void term_destination(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<FdDestinationManager*>(cinfo->dest);
+    WriteBuffer(cinfo, kFdDestBufferSize - dest->pub.free_in_buffer);
+  }
+};
+
+constexpr size_t kWriteBehindBufferSize = 256 << 10;
+
+// The filled buffers are written to the file on a helper thread, while the
+// encoder continues into the next free one of a ring of buffers, so that it
+// only waits for the file when it is faster than the writes. The buffers from
+// next_write on are queued for writing, and the one after them is filled by
+// the encoder. The lock is never held when JPEGLI_ERROR() is called, since it
+// does not return.
+struct WriteBehindState {
+  FILE* f;
+  std::vector<std::vector<uint8_t>> buffers;
+  std::vector<size_t> sizes;
+  size_t next_write = 0;
+  size_t num_queued = 0;
+  bool failed = false;
+  bool stop = false;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::thread thread;
+
+  void Run() {
+    for (;;) {
+      size_t index;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return stop || num_queued > 0; });
+        if (stop) return;
+        index = next_write;
+      }
+      const bool ok = fwrite(buffers[index].data(), 1, sizes[index], f) ==
+                      sizes[index];
+      std::lock_guard<std::mutex> lock(mutex);
+      failed |= !ok;
+      next_write = (next_write + 1) % buffers.size();
+      --num_queued;
+      cv.notify_all();
+    }
+  }
+
+  uint8_t* CurrentBuffer() {
+    return buffers[(next_write + num_queued) % buffers.size()].data();
+  }
+
+  // Queues the first size bytes of the current buffer for writing and returns
+  // the next one when it is free, or nullptr if a write failed.
+  uint8_t* QueueBuffer(size_t size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    const size_t num_buffers = buffers.size();
+    if (size > 0) {
+      sizes[(next_write + num_queued) % num_buffers] = size;
+      ++num_queued;
+      cv.notify_all();
+    }
+    cv.wait(lock, [&] { return failed || num_queued < num_buffers; });
+    return failed ? nullptr : CurrentBuffer();
+  }
+
+  // Waits until the queued buffers are written, returns false if a write
+  // failed.
+  bool Drain() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return num_queued == 0; });
+    return !failed;
+  }
+};
+
+struct WriteBehindDestinationManager {
+  jpeg_destination_mgr pub;
+  WriteBehindState* state;
+
+  static void init_destination(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<WriteBehindDestinationManager*>(cinfo->dest);
+    WriteBehindState* s = dest->state;
+    // The buffers of an aborted image are still written.
+    s->Drain();
+    std::lock_guard<std::mutex> lock(s->mutex);
+    s->failed = false;
+    dest->pub.next_output_byte = s->CurrentBuffer();
+    dest->pub.free_in_buffer = kWriteBehindBufferSize;
+  }
+
+  static boolean empty_output_buffer(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<WriteBehindDestinationManager*>(cinfo->dest);
+    uint8_t* buffer = dest->state->QueueBuffer(kWriteBehindBufferSize);
+    if (buffer == nullptr) {
+      JPEGLI_ERROR("Failed to write to output stream.");
+    }
+    dest->pub.next_output_byte = buffer;
+    dest->pub.free_in_buffer = kWriteBehindBufferSize;
+    return TRUE;
+  }
+
+  static void term_destination(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<WriteBehindDestinationManager*>(cinfo->dest);
+    WriteBehindState* s = dest->state;
+    uint8_t* buffer =
+        s->QueueBuffer(kWriteBehindBufferSize - dest->pub.free_in_buffer);
+    dest->pub.next_output_byte = buffer;
+    dest->pub.free_in_buffer = buffer ? kWriteBehindBufferSize : 0;
+    if (buffer == nullptr || !s->Drain() || fflush(s->f) != 0 ||
+        ferror(s->f)) {
+      JPEGLI_ERROR("Failed to write to output stream.");
+    }
+  }
+};
+
+void ReleaseWriteBehindDest(j_compress_ptr cinfo) {
+  if (!cinfo->dest || cinfo->dest->init_destination !=
+                          WriteBehindDestinationManager::init_destination) {
+    return;
+  }
+  auto* dest = reinterpret_cast<WriteBehindDestinationManager*>(cinfo->dest);
+  WriteBehindState* s = dest->state;
+  if (s == nullptr) return;
+  {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    s->stop = true;
+    s->cv.notify_all();
+  }
+  s->thread.join();
+  delete s;
+  dest->state = nullptr;
+}
+
 struct MemoryDestinationManager {
   jpeg_destination_mgr pub;
   // Output buffer supplied by the application
@@ -90,6 +277,100 @@ struct MemoryDestinationManager {
   }
 };
 
+// Since the total size at least doubles with each chunk, this is enough for
+// any output that fits in memory.
+constexpr size_t kMaxOutputChunks = 48;
+
+struct ChunkedDestinationManager {
+  jpeg_destination_mgr pub;
+  // Output buffer supplied by the application, used as the first chunk.
+  uint8_t* buffer;
+  size_t buffer_size;
+  size_t expected_size;
+  // The size of the last chunk is its capacity until term_destination().
+  JpegliOutputChunk chunks[kMaxOutputChunks];
+  size_t num_chunks;
+  // Total size of the chunks before the last one.
+  size_t full_size;
+
+  static void FreeChunks(ChunkedDestinationManager* dest) {
+    for (size_t i = 0; i < dest->num_chunks; ++i) {
+      if (dest->chunks[i].data != dest->buffer) {
+        free(dest->chunks[i].data);
+      }
+    }
+    dest->num_chunks = 0;
+    dest->full_size = 0;
+  }
+
+  static void AddChunk(j_compress_ptr cinfo, uint8_t* data, size_t size) {
+    auto* dest = reinterpret_cast<ChunkedDestinationManager*>(cinfo->dest);
+    if (dest->num_chunks == kMaxOutputChunks) {
+      free(data);
+      JPEGLI_ERROR("Too many output chunks.");
+    }
+    dest->chunks[dest->num_chunks++] = {data, size};
+    dest->pub.next_output_byte = data;
+    dest->pub.free_in_buffer = size;
+  }
+
+  static void AllocateChunk(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<ChunkedDestinationManager*>(cinfo->dest);
+    size_t expected_size = dest->expected_size;
+    if (expected_size == 0) {
+      // About 3 bits per pixel for 3 components.
+      expected_size = static_cast<size_t>(cinfo->image_width) *
+                      cinfo->image_height * cinfo->input_components / 8;
+    }
+    const size_t remaining =
+        expected_size > dest->full_size ? expected_size - dest->full_size : 0;
+    const size_t size =
+        std::max(std::max(remaining, dest->full_size), kDestBufferSize);
+    uint8_t* data = reinterpret_cast<uint8_t*>(malloc(size));
+    if (data == nullptr) {
+      JPEGLI_ERROR("Failed to allocate output chunk.");
+    }
+    AddChunk(cinfo, data, size);
+  }
+
+  static void init_destination(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<ChunkedDestinationManager*>(cinfo->dest);
+    FreeChunks(dest);
+    if (dest->buffer != nullptr) {
+      AddChunk(cinfo, dest->buffer, dest->buffer_size);
+    } else {
+      AllocateChunk(cinfo);
+    }
+  }
+
+  static boolean empty_output_buffer(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<ChunkedDestinationManager*>(cinfo->dest);
+    dest->full_size += dest->chunks[dest->num_chunks - 1].size;
+    AllocateChunk(cinfo);
+    return TRUE;
+  }
+
+  static void term_destination(j_compress_ptr cinfo) {
+    auto* dest = reinterpret_cast<ChunkedDestinationManager*>(cinfo->dest);
+    JpegliOutputChunk* last = &dest->chunks[dest->num_chunks - 1];
+    last->size -= dest->pub.free_in_buffer;
+    dest->pub.free_in_buffer = 0;
+    if (last->size == 0 && dest->num_chunks > 1) {
+      free(last->data);
+      --dest->num_chunks;
+    }
+  }
+};
+
+void ReleaseChunkedDest(j_compress_ptr cinfo) {
+  if (!cinfo->dest || cinfo->dest->init_destination !=
+                          ChunkedDestinationManager::init_destination) {
+    return;
+  }
+  ChunkedDestinationManager::FreeChunks(
+      reinterpret_cast<ChunkedDestinationManager*>(cinfo->dest));
+}
+
 }  // namespace jpegli
 
 void jpegli_stdio_dest(j_compress_ptr cinfo, FILE* outfile) {
@@ -117,6 +398,69 @@ void jpegli_stdio_dest(j_compress_ptr cinfo, FILE* outfile) {
       jpegli::StdioDestinationManager::term_destination;
 }
 
+void jpegli_fd_dest(j_compress_ptr cinfo, int fd) {
+  if (fd < 0) {
+    JPEGLI_ERROR("jpegli_fd_dest: Invalid destination.");
+  }
+  if (cinfo->dest && cinfo->dest->init_destination !=
+                         jpegli::FdDestinationManager::init_destination) {
+    JPEGLI_ERROR("jpegli_fd_dest: a different dest manager was already set");
+  }
+  if (!cinfo->dest) {
+    auto* dest = jpegli::Allocate<jpegli::FdDestinationManager>(cinfo, 1);
+    dest->buffer =
+        jpegli::Allocate<uint8_t>(cinfo, jpegli::kFdDestBufferSize);
+    cinfo->dest = reinterpret_cast<jpeg_destination_mgr*>(dest);
+  }
+  auto* dest = reinterpret_cast<jpegli::FdDestinationManager*>(cinfo->dest);
+  dest->fd = fd;
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = jpegli::kFdDestBufferSize;
+  dest->pub.init_destination = jpegli::FdDestinationManager::init_destination;
+  dest->pub.empty_output_buffer =
+      jpegli::FdDestinationManager::empty_output_buffer;
+  dest->pub.term_destination = jpegli::FdDestinationManager::term_destination;
+}
+
+void jpegli_writebehind_dest(j_compress_ptr cinfo, FILE* outfile,
+                             int num_buffers) {
+  if (outfile == nullptr || num_buffers < 2) {
+    JPEGLI_ERROR("jpegli_writebehind_dest: Invalid destination.");
+  }
+  if (cinfo->dest &&
+      cinfo->dest->init_destination !=
+          jpegli::WriteBehindDestinationManager::init_destination) {
+    JPEGLI_ERROR(
+        "jpegli_writebehind_dest: a different dest manager was already set");
+  }
+  if (!cinfo->dest) {
+    auto* dest =
+        jpegli::Allocate<jpegli::WriteBehindDestinationManager>(cinfo, 1);
+    dest->state = nullptr;
+    cinfo->dest = reinterpret_cast<jpeg_destination_mgr*>(dest);
+  }
+  jpegli::ReleaseWriteBehindDest(cinfo);
+  auto* dest =
+      reinterpret_cast<jpegli::WriteBehindDestinationManager*>(cinfo->dest);
+  auto* state = new jpegli::WriteBehindState();
+  state->f = outfile;
+  state->buffers.resize(num_buffers);
+  for (auto& buffer : state->buffers) {
+    buffer.resize(jpegli::kWriteBehindBufferSize);
+  }
+  state->sizes.resize(num_buffers);
+  state->thread = std::thread([state] { state->Run(); });
+  dest->state = state;
+  dest->pub.next_output_byte = state->CurrentBuffer();
+  dest->pub.free_in_buffer = jpegli::kWriteBehindBufferSize;
+  dest->pub.init_destination =
+      jpegli::WriteBehindDestinationManager::init_destination;
+  dest->pub.empty_output_buffer =
+      jpegli::WriteBehindDestinationManager::empty_output_buffer;
+  dest->pub.term_destination =
+      jpegli::WriteBehindDestinationManager::term_destination;
+}
+
 void jpegli_mem_dest(j_compress_ptr cinfo, unsigned char** outbuffer,
                      unsigned long* outsize /* NOLINT */) {
   if (outbuffer == nullptr || outsize == nullptr) {
@@ -151,3 +495,44 @@ void jpegli_mem_dest(j_compress_ptr cinfo, unsigned char** outbuffer,
   dest->pub.next_output_byte = dest->current_buffer;
   dest->pub.free_in_buffer = dest->buffer_size;
 }
+
+void jpegli_chunked_dest(j_compress_ptr cinfo, unsigned char* buffer,
+                         size_t buffer_size, size_t expected_size) {
+  if (cinfo->dest && cinfo->dest->init_destination !=
+                         jpegli::ChunkedDestinationManager::init_destination) {
+    JPEGLI_ERROR(
+        "jpegli_chunked_dest: a different dest manager was already set");
+  }
+  if (!cinfo->dest) {
+    auto* dest = jpegli::Allocate<jpegli::ChunkedDestinationManager>(cinfo, 1);
+    dest->buffer = nullptr;
+    dest->num_chunks = 0;
+    cinfo->dest = reinterpret_cast<jpeg_destination_mgr*>(dest);
+  }
+  auto* dest =
+      reinterpret_cast<jpegli::ChunkedDestinationManager*>(cinfo->dest);
+  jpegli::ChunkedDestinationManager::FreeChunks(dest);
+  dest->pub.init_destination =
+      jpegli::ChunkedDestinationManager::init_destination;
+  dest->pub.empty_output_buffer =
+      jpegli::ChunkedDestinationManager::empty_output_buffer;
+  dest->pub.term_destination =
+      jpegli::ChunkedDestinationManager::term_destination;
+  dest->pub.next_output_byte = nullptr;
+  dest->pub.free_in_buffer = 0;
+  dest->buffer = buffer_size > 0 ? buffer : nullptr;
+  dest->buffer_size = buffer_size;
+  dest->expected_size = expected_size;
+}
+
+size_t jpegli_get_output_chunks(j_compress_ptr cinfo,
+                                const JpegliOutputChunk** chunks) {
+  if (!cinfo->dest || cinfo->dest->init_destination !=
+                          jpegli::ChunkedDestinationManager::init_destination) {
+    JPEGLI_ERROR("jpegli_get_output_chunks: not a chunked destination");
+  }
+  auto* dest =
+      reinterpret_cast<jpegli::ChunkedDestinationManager*>(cinfo->dest);
+  *chunks = dest->chunks;
+  return dest->num_chunks;
+}
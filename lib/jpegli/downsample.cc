@@ -6,8 +6,10 @@
 
 #include "lib/jpegli/downsample.h"
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdio>
+#include <cstring>
 
 #include "lib/base/compiler_specific.h"
 #include "lib/jpegli/common.h"
@@ -26,181 +28,340 @@ namespace HWY_NAMESPACE {
 
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::LoadU;
+using hwy::HWY_NAMESPACE::Max;
+using hwy::HWY_NAMESPACE::Min;
 using hwy::HWY_NAMESPACE::Mul;
+using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::Sub;
 using hwy::HWY_NAMESPACE::Vec;
 
-using D = HWY_CAPPED(float, 8);
-constexpr D d;
-
-void DownsampleRow2x1(const float* row_in, size_t len, float* row_out) {
-  const size_t N = Lanes(d);
-  const size_t len_out = len / 2;
-  const auto mul = Set(d, 0.5f);
-  Vec<D> v0, v1;  // NOLINT
-  for (size_t x = 0; x < len_out; x += N) {
-    LoadInterleaved2(d, row_in + 2 * x, v0, v1);
-    Store(Mul(mul, Add(v0, v1)), d, row_out + x);
+using DF = HWY_FULL(float);
+// The downsampled rows are a multiple of DCTSIZE long, the part of them that
+// is not a multiple of the full vector size is done with these vectors.
+using DC = HWY_CAPPED(float, DCTSIZE);
+
+// Returns the sums of the kH consecutive input values of the output values at
+// x .. x + Lanes(d) - 1.
+template <int kH, class D>
+Vec<D> SumRow(D d, const float* row, size_t x) {
+  Vec<D> v0, v1, v2, v3;  // NOLINT
+  if (kH == 2) {
+    LoadInterleaved2(d, row + 2 * x, v0, v1);
+    return Add(v0, v1);
+  } else if (kH == 3) {
+    LoadInterleaved3(d, row + 3 * x, v0, v1, v2);
+    return Add(Add(v0, v1), v2);
+  } else if (kH == 4) {
+    LoadInterleaved4(d, row + 4 * x, v0, v1, v2, v3);
+    return Add(Add(v0, v1), Add(v2, v3));
   }
+  return Load(d, row + x);
 }
 
-void DownsampleRow3x1(const float* row_in, size_t len, float* row_out) {
-  const size_t N = Lanes(d);
-  const size_t len_out = len / 3;
-  const auto mul = Set(d, 1.0f / 3);
-  Vec<D> v0, v1, v2;  // NOLINT
-  for (size_t x = 0; x < len_out; x += N) {
-    LoadInterleaved3(d, row_in + 3 * x, v0, v1, v2);
-    Store(Mul(mul, Add(Add(v0, v1), v2)), d, row_out + x);
+template <int kH, int kV, class D>
+void DownsampleVec(D d, float* const* rows_in, size_t x, float* row_out) {
+  const auto mul = Set(d, 1.0f / (kH * kV));
+  auto sum = SumRow<kH>(d, rows_in[0], x);
+  if (kV == 2) {
+    sum = Add(sum, SumRow<kH>(d, rows_in[1], x));
+  } else if (kV == 3) {
+    sum = Add(Add(sum, SumRow<kH>(d, rows_in[1], x)),
+              SumRow<kH>(d, rows_in[2], x));
+  } else if (kV == 4) {
+    sum = Add(Add(sum, SumRow<kH>(d, rows_in[1], x)),
+              Add(SumRow<kH>(d, rows_in[2], x), SumRow<kH>(d, rows_in[3], x)));
   }
+  Store(Mul(mul, sum), d, row_out + x);
 }
 
-void DownsampleRow4x1(const float* row_in, size_t len, float* row_out) {
-  const size_t N = Lanes(d);
-  const size_t len_out = len / 4;
-  const auto mul = Set(d, 0.25f);
-  Vec<D> v0, v1, v2, v3;  // NOLINT
-  for (size_t x = 0; x < len_out; x += N) {
-    LoadInterleaved4(d, row_in + 4 * x, v0, v1, v2, v3);
-    Store(Mul(mul, Add(Add(v0, v1), Add(v2, v3))), d, row_out + x);
+// Calls op(d, x) for the vectors of a row of len values, where len is a
+// multiple of DCTSIZE, without going past the end of the row.
+template <class Op>
+void ForEachVector(const Op& op, size_t len) {
+  const DF df;
+  const DC dc;
+  size_t x = 0;
+  for (; x + Lanes(df) <= len; x += Lanes(df)) {
+    op(df, x);
+  }
+  for (; x < len; x += Lanes(dc)) {
+    op(dc, x);
   }
 }
 
-void Downsample2x1(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  DownsampleRow2x1(rows_in[0], len, row_out);
+template <int kH, int kV>
+struct DownsampleTwoRowsOp {
+  template <class D>
+  void operator()(D d, size_t x) const {
+    DownsampleVec<kH, kV>(d, rows_in, x, rows_out[0]);
+    DownsampleVec<kH, kV>(d, rows_in + kV, x, rows_out[1]);
+  }
+  float* const* rows_in;
+  float* const* rows_out;
+};
+
+// Box filters the 2 * kV input rows of length len to two output rows.
+template <int kH, int kV>
+void DownsampleTwoRows(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                       float* rows_out[2]) {
+  ForEachVector(DownsampleTwoRowsOp<kH, kV>{rows_in, rows_out}, len / kH);
 }
 
-void Downsample3x1(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  DownsampleRow3x1(rows_in[0], len, row_out);
+void Downsample2x1(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<2, 1>(rows_in, len, rows_out);
 }
 
-void Downsample4x1(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  DownsampleRow4x1(rows_in[0], len, row_out);
+void Downsample3x1(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<3, 1>(rows_in, len, rows_out);
 }
 
-void Downsample1x2(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  const size_t N = Lanes(d);
-  const auto mul = Set(d, 0.5f);
-  float* row0 = rows_in[0];
-  float* row1 = rows_in[1];
-  for (size_t x = 0; x < len; x += N) {
-    Store(Mul(mul, Add(Load(d, row0 + x), Load(d, row1 + x))), d, row_out + x);
-  }
+void Downsample4x1(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<4, 1>(rows_in, len, rows_out);
 }
 
-void Downsample2x2(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  const size_t N = Lanes(d);
-  const size_t len_out = len / 2;
-  const auto mul = Set(d, 0.25f);
-  float* row0 = rows_in[0];
-  float* row1 = rows_in[1];
-  Vec<D> v0, v1, v2, v3;  // NOLINT
-  for (size_t x = 0; x < len_out; x += N) {
-    LoadInterleaved2(d, row0 + 2 * x, v0, v1);
-    LoadInterleaved2(d, row1 + 2 * x, v2, v3);
-    Store(Mul(mul, Add(Add(v0, v1), Add(v2, v3))), d, row_out + x);
-  }
+void Downsample1x2(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<1, 2>(rows_in, len, rows_out);
 }
 
-void Downsample3x2(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  DownsampleRow3x1(rows_in[0], len, rows_in[0]);
-  DownsampleRow3x1(rows_in[1], len, rows_in[1]);
-  Downsample1x2(rows_in, len / 3, row_out);
+void Downsample2x2(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<2, 2>(rows_in, len, rows_out);
 }
 
-void Downsample4x2(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  DownsampleRow4x1(rows_in[0], len, rows_in[0]);
-  DownsampleRow4x1(rows_in[1], len, rows_in[1]);
-  Downsample1x2(rows_in, len / 4, row_out);
+void Downsample3x2(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<3, 2>(rows_in, len, rows_out);
 }
 
-void Downsample1x3(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  const size_t N = Lanes(d);
-  const auto mul = Set(d, 1.0f / 3);
-  float* row0 = rows_in[0];
-  float* row1 = rows_in[1];
-  float* row2 = rows_in[2];
-  for (size_t x = 0; x < len; x += N) {
-    const auto in0 = Load(d, row0 + x);
-    const auto in1 = Load(d, row1 + x);
-    const auto in2 = Load(d, row2 + x);
-    Store(Mul(mul, Add(Add(in0, in1), in2)), d, row_out + x);
-  }
+void Downsample4x2(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<4, 2>(rows_in, len, rows_out);
 }
 
-void Downsample2x3(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  DownsampleRow2x1(rows_in[0], len, rows_in[0]);
-  DownsampleRow2x1(rows_in[1], len, rows_in[1]);
-  DownsampleRow2x1(rows_in[2], len, rows_in[2]);
-  Downsample1x3(rows_in, len / 2, row_out);
+void Downsample1x3(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<1, 3>(rows_in, len, rows_out);
 }
 
-void Downsample3x3(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  DownsampleRow3x1(rows_in[0], len, rows_in[0]);
-  DownsampleRow3x1(rows_in[1], len, rows_in[1]);
-  DownsampleRow3x1(rows_in[2], len, rows_in[2]);
-  Downsample1x3(rows_in, len / 3, row_out);
+void Downsample2x3(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<2, 3>(rows_in, len, rows_out);
 }
 
-void Downsample4x3(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  DownsampleRow4x1(rows_in[0], len, rows_in[0]);
-  DownsampleRow4x1(rows_in[1], len, rows_in[1]);
-  DownsampleRow4x1(rows_in[2], len, rows_in[2]);
-  Downsample1x3(rows_in, len / 4, row_out);
+void Downsample3x3(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<3, 3>(rows_in, len, rows_out);
 }
 
-void Downsample1x4(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  const size_t N = Lanes(d);
-  const auto mul = Set(d, 0.25f);
-  float* row0 = rows_in[0];
-  float* row1 = rows_in[1];
-  float* row2 = rows_in[2];
-  float* row3 = rows_in[3];
-  for (size_t x = 0; x < len; x += N) {
-    const auto in0 = Load(d, row0 + x);
-    const auto in1 = Load(d, row1 + x);
-    const auto in2 = Load(d, row2 + x);
-    const auto in3 = Load(d, row3 + x);
-    Store(Mul(mul, Add(Add(in0, in1), Add(in2, in3))), d, row_out + x);
-  }
+void Downsample4x3(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<4, 3>(rows_in, len, rows_out);
 }
 
-void Downsample2x4(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  DownsampleRow2x1(rows_in[0], len, rows_in[0]);
-  DownsampleRow2x1(rows_in[1], len, rows_in[1]);
-  DownsampleRow2x1(rows_in[2], len, rows_in[2]);
-  DownsampleRow2x1(rows_in[3], len, rows_in[3]);
-  Downsample1x4(rows_in, len / 2, row_out);
+void Downsample1x4(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<1, 4>(rows_in, len, rows_out);
 }
 
-void Downsample3x4(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  DownsampleRow3x1(rows_in[0], len, rows_in[0]);
-  DownsampleRow3x1(rows_in[1], len, rows_in[1]);
-  DownsampleRow3x1(rows_in[2], len, rows_in[2]);
-  DownsampleRow3x1(rows_in[3], len, rows_in[3]);
-  Downsample1x4(rows_in, len / 3, row_out);
+void Downsample2x4(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<2, 4>(rows_in, len, rows_out);
+}
+
+void Downsample3x4(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<3, 4>(rows_in, len, rows_out);
+}
+
+void Downsample4x4(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                   float* rows_out[2]) {
+  DownsampleTwoRows<4, 4>(rows_in, len, rows_out);
+}
+
+// Number of refinement iterations of the sharp downsampling.
+constexpr int kSharpIterations = 3;
+
+void SetRowBorder(float* row, size_t len) {
+  row[-1] = row[0];
+  row[len] = row[len - 1];
+}
+
+// Computes the input values at x .. x + Lanes(d) - 1 of a row that is not
+// downsampled horizontally, or their transposed triangle filter upsampling,
+// i.e. the [1/8 3/8 3/8 1/8] filter centered on 2 * x + 1/2 of a row that is
+// downsampled by two, together with the range of the filtered values.
+template <class D>
+void TransposedUpsampleRow(D d, int h_factor, const float* row, size_t x,
+                           Vec<D>& val, Vec<D>& lo, Vec<D>& hi) {
+  if (h_factor == 1) {
+    val = lo = hi = Load(d, row + x);
+    return;
+  }
+  Vec<D> prev, next, v0, v1, unused;  // NOLINT
+  LoadInterleaved2(d, row + 2 * x - 1, prev, unused);
+  LoadInterleaved2(d, row + 2 * x, v0, v1);
+  LoadInterleaved2(d, row + 2 * x + 1, unused, next);
+  val = MulAdd(Set(d, 0.125f), Add(prev, next),
+               Mul(Set(d, 0.375f), Add(v0, v1)));
+  lo = Min(Min(prev, next), Min(v0, v1));
+  hi = Max(Max(prev, next), Max(v0, v1));
+}
+
+// Computes the transposed upsampling of the four (or one) input rows, and the
+// range of their input values.
+struct TransposedUpsampleOp {
+  template <class D>
+  void operator()(D d, size_t x) const {
+    Vec<D> v, lo, hi;  // NOLINT
+    TransposedUpsampleRow(d, h_factor, rows_in[0], x, v, lo, hi);
+    if (v_factor == 2) {
+      Vec<D> v1, lo1, hi1, v2, lo2, hi2, v3, lo3, hi3;  // NOLINT
+      TransposedUpsampleRow(d, h_factor, rows_in[1], x, v1, lo1, hi1);
+      TransposedUpsampleRow(d, h_factor, rows_in[2], x, v2, lo2, hi2);
+      TransposedUpsampleRow(d, h_factor, rows_in[3], x, v3, lo3, hi3);
+      v = MulAdd(Set(d, 0.125f), Add(v, v3), Mul(Set(d, 0.375f), Add(v1, v2)));
+      lo = Min(Min(lo, lo3), Min(lo1, lo2));
+      hi = Max(Max(hi, hi3), Max(hi1, hi2));
+    }
+    Store(v, d, row_out + x);
+    Store(lo, d, row_lo + x);
+    Store(hi, d, row_hi + x);
+  }
+  int h_factor;
+  int v_factor;
+  const float* rows_in[4];
+  float* row_out;
+  float* row_lo;
+  float* row_hi;
+};
+
+// Computes the [3/16 5/8 3/16] filter of the rows of the downsampled
+// direction.
+struct VerticalBlurOp {
+  template <class D>
+  void operator()(D d, size_t x) const {
+    const auto sum = Add(Load(d, row_t + x), Load(d, row_b + x));
+    Store(MulAdd(Set(d, 0.1875f), sum, Mul(Set(d, 0.625f), Load(d, row_m + x))),
+          d, row_out + x);
+  }
+  const float* row_t;
+  const float* row_m;
+  const float* row_b;
+  float* row_out;
+};
+
+// Applies the horizontal part of the filter of VerticalBlurOp to blur and
+// moves row towards the solution of the target.
+struct SharpenUpdateOp {
+  template <class D>
+  void operator()(D d, size_t x) const {
+    auto b = Load(d, blur + x);
+    if (h_factor == 2) {
+      const auto sum = Add(LoadU(d, blur + x - 1), LoadU(d, blur + x + 1));
+      b = MulAdd(Set(d, 0.1875f), sum, Mul(Set(d, 0.625f), b));
+    }
+    const auto v = Add(Load(d, row + x), Sub(Load(d, target + x), b));
+    Store(Min(Max(v, Load(d, lo + x)), Load(d, hi + x)), d, row + x);
+  }
+  int h_factor;
+  const float* blur;
+  const float* target;
+  const float* lo;
+  const float* hi;
+  float* row;
+};
+
+// Replaces the num_rows box filtered rows of length len, which were
+// downsampled from rows_in by h_factor x v_factor with factors of at most
+// two, with values whose triangle filter upsampling, as done by the decoders,
+// is closer to the input in the least squares sense. The normal equations of
+// the upsampling are solved by a fixed number of Richardson iterations
+// starting from the box filtered values, which are clamped to the range of
+// the input values of their filter to avoid ringing. rows[-1] and rows_in[-1]
+// are the rows above, which are already final. With vertical downsampling
+// the last row is kept as it is, since the rows below are not known yet. tmp
+// must have at least 4 * num_rows rows of at least len values.
+void SharpenDownsampledRows(float** rows_in, float** rows, size_t num_rows,
+                            size_t len, int h_factor, int v_factor,
+                            RowBuffer<float>* tmp) {
+  const size_t num_rows_in = num_rows * v_factor;
+  const size_t len_in = len * h_factor;
+  for (ssize_t y = -1; y < static_cast<ssize_t>(num_rows_in); ++y) {
+    SetRowBorder(rows_in[y], len_in);
+  }
+  // Targets of the refined rows, the transposed upsampling of the input.
+  TransposedUpsampleOp upsample_op;
+  upsample_op.h_factor = h_factor;
+  upsample_op.v_factor = v_factor;
+  for (size_t y = 0; y < num_rows; ++y) {
+    if (v_factor == 2) {
+      for (size_t i = 0; i < 4; ++i) {
+        upsample_op.rows_in[i] =
+            rows_in[std::min(2 * y + i, num_rows_in) - 1];
+      }
+    } else {
+      upsample_op.rows_in[0] = rows_in[y];
+    }
+    upsample_op.row_out = tmp->Row(y);
+    upsample_op.row_lo = tmp->Row(2 * num_rows + y);
+    upsample_op.row_hi = tmp->Row(3 * num_rows + y);
+    ForEachVector(upsample_op, len);
+  }
+  const size_t num_refined = v_factor == 2 ? num_rows - 1 : num_rows;
+  SetRowBorder(rows[-1], len);
+  SetRowBorder(rows[num_rows - 1], len);
+  for (int iter = 0; iter < kSharpIterations; ++iter) {
+    for (size_t y = 0; y < num_refined; ++y) {
+      float* blur = tmp->Row(num_rows + y);
+      if (v_factor == 2) {
+        const VerticalBlurOp blur_op = {rows[y - 1], rows[y], rows[y + 1],
+                                        blur};
+        ForEachVector(blur_op, len);
+      } else {
+        memcpy(blur, rows[y], len * sizeof(blur[0]));
+      }
+      SetRowBorder(blur, len);
+    }
+    for (size_t y = 0; y < num_refined; ++y) {
+      const SharpenUpdateOp update_op = {
+          h_factor, tmp->Row(num_rows + y), tmp->Row(y),
+          tmp->Row(2 * num_rows + y), tmp->Row(3 * num_rows + y), rows[y]};
+      ForEachVector(update_op, len);
+      SetRowBorder(rows[y], len);
+    }
+  }
 }
 
-void Downsample4x4(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                   float* row_out) {
-  DownsampleRow4x1(rows_in[0], len, rows_in[0]);
-  DownsampleRow4x1(rows_in[1], len, rows_in[1]);
-  DownsampleRow4x1(rows_in[2], len, rows_in[2]);
-  DownsampleRow4x1(rows_in[3], len, rows_in[3]);
-  Downsample1x4(rows_in, len / 4, row_out);
+// Applies the 3x3 smoothing filter of jpegli_compress_struct::smoothing_factor
+// to row_m, with weight w0 for the center pixel and w1 for each of its eight
+// neighbours. The rows must have a border of one pixel on both sides.
+struct SmoothRowOp {
+  template <class D>
+  void operator()(D d, size_t x) const {
+    auto sum = Add(LoadU(d, row_t + x - 1), Load(d, row_t + x));
+    sum = Add(sum, LoadU(d, row_t + x + 1));
+    sum = Add(sum, Add(LoadU(d, row_m + x - 1), LoadU(d, row_m + x + 1)));
+    sum = Add(sum, Add(LoadU(d, row_b + x - 1), Load(d, row_b + x)));
+    sum = Add(sum, LoadU(d, row_b + x + 1));
+    Store(MulAdd(Set(d, w0), Load(d, row_m + x), Mul(Set(d, w1), sum)), d,
+          row_out + x);
+  }
+  const float* row_t;
+  const float* row_m;
+  const float* row_b;
+  float w0;
+  float w1;
+  float* row_out;
+};
+
+void SmoothInputRow(const float* row_t, const float* row_m, const float* row_b,
+                    size_t len, float w0, float w1, float* row_out) {
+  ForEachVector(SmoothRowOp{row_t, row_m, row_b, w0, w1, row_out}, len);
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -226,9 +387,18 @@ HWY_EXPORT(Downsample4x1);
 HWY_EXPORT(Downsample4x2);
 HWY_EXPORT(Downsample4x3);
 HWY_EXPORT(Downsample4x4);
+HWY_EXPORT(SharpenDownsampledRows);
+HWY_EXPORT(SmoothInputRow);
 
-void NullDownsample(float* rows_in[MAX_SAMP_FACTOR], size_t len,
-                    float* row_out) {}
+void NullDownsample(float* rows_in[2 * MAX_SAMP_FACTOR], size_t len,
+                    float* rows_out[2]) {}
+
+bool UseSharpDownsampling(j_compress_ptr cinfo, int c) {
+  jpeg_comp_master* m = cinfo->master;
+  return m->downsample_mode == JPEGLI_DOWNSAMPLE_SHARP &&
+         m->h_factor[c] <= 2 && m->v_factor[c] <= 2 &&
+         (m->h_factor[c] > 1 || m->v_factor[c] > 1);
+}
 
 void ChooseDownsampleMethods(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
@@ -259,13 +429,13 @@ void ChooseDownsampleMethods(j_compress_ptr cinfo) {
       }
     } else if (v_factor == 3) {
       if (h_factor == 1) {
-        m->downsample_method[c] = HWY_DYNAMIC_DISPATCH(Downsample1x2);
+        m->downsample_method[c] = HWY_DYNAMIC_DISPATCH(Downsample1x3);
       } else if (h_factor == 2) {
-        m->downsample_method[c] = HWY_DYNAMIC_DISPATCH(Downsample2x2);
+        m->downsample_method[c] = HWY_DYNAMIC_DISPATCH(Downsample2x3);
       } else if (h_factor == 3) {
-        m->downsample_method[c] = HWY_DYNAMIC_DISPATCH(Downsample3x2);
+        m->downsample_method[c] = HWY_DYNAMIC_DISPATCH(Downsample3x3);
       } else if (h_factor == 4) {
-        m->downsample_method[c] = HWY_DYNAMIC_DISPATCH(Downsample4x2);
+        m->downsample_method[c] = HWY_DYNAMIC_DISPATCH(Downsample4x3);
       }
     } else if (v_factor == 4) {
       if (h_factor == 1) {
@@ -300,17 +470,39 @@ void DownsampleInputBuffer(j_compress_ptr cinfo) {
     if (h_factor == 1 && v_factor == 1) {
       continue;
     }
-    auto& input = *m->smooth_input[c];
+    auto& input = m->input_buffer[c];
     auto& output = *m->raw_data[c];
     const size_t y_out0 = y0 / v_factor;
-    float* rows_in[MAX_SAMP_FACTOR];
+    // The number of output rows, DCTSIZE * v_samp_factor, is even.
+    float* rows_in[2 * MAX_SAMP_FACTOR];
+    float* rows_out[2];
     for (size_t y_in = y0, y_out = y_out0; y_in < y1;
-         y_in += v_factor, ++y_out) {
-      for (int iy = 0; iy < v_factor; ++iy) {
+         y_in += 2 * v_factor, y_out += 2) {
+      for (int iy = 0; iy < 2 * v_factor; ++iy) {
         rows_in[iy] = input.Row(y_in + iy);
       }
-      float* row_out = output.Row(y_out);
-      (*m->downsample_method[c])(rows_in, xsize_padded, row_out);
+      rows_out[0] = output.Row(y_out);
+      rows_out[1] = output.Row(y_out + 1);
+      (*m->downsample_method[c])(rows_in, xsize_padded, rows_out);
+    }
+    if (UseSharpDownsampling(cinfo, c)) {
+      // The first rows of these arrays are the ones above the iMCU row, or
+      // the copies of the first rows of the image.
+      const size_t num_rows = comp->v_samp_factor * DCTSIZE;
+      float* rows[MAX_SAMP_FACTOR * DCTSIZE + 1];
+      float* rows_sharp_in[MAX_SAMP_FACTOR * DCTSIZE + 1];
+      const bool first_row = (m->next_iMCU_row == 0);
+      rows[0] = output.Row(first_row ? y_out0 : y_out0 - 1);
+      for (size_t iy = 0; iy < num_rows; ++iy) {
+        rows[iy + 1] = output.Row(y_out0 + iy);
+      }
+      rows_sharp_in[0] = input.Row(first_row ? y0 : y0 - 1);
+      for (size_t iy = 0; iy < num_rows * v_factor; ++iy) {
+        rows_sharp_in[iy + 1] = input.Row(y0 + iy);
+      }
+      HWY_DYNAMIC_DISPATCH(SharpenDownsampledRows)
+      (rows_sharp_in + 1, rows + 1, num_rows, xsize_padded / h_factor,
+       h_factor, v_factor, &m->sharp_downsample_tmp);
     }
   }
 }
@@ -323,41 +515,38 @@ void ApplyInputSmoothing(j_compress_ptr cinfo) {
   const float kW1 = cinfo->smoothing_factor / 1024.0;
   const float kW0 = 1.0f - 8.0f * kW1;
   const size_t iMCU_height = DCTSIZE * cinfo->max_v_samp_factor;
-  const ssize_t y0 = m->next_iMCU_row * iMCU_height;
-  const ssize_t y1 = y0 + iMCU_height;
-  const ssize_t xsize_padded = m->xsize_blocks * DCTSIZE;
+  const bool last_iMCU_row = m->next_iMCU_row + 1 == cinfo->total_iMCU_rows;
+  // The input rows are smoothed in place, ahead of the current iMCU row up to
+  // the last row whose row below is already read, so that the adaptive
+  // quantization of the current iMCU row also sees smoothed rows below it. The
+  // unfiltered copies of the row above and of the current row are kept in
+  // smoothing_rows.
+  const ssize_t y0 = m->next_iMCU_row == 0 ? 0 : m->next_smoothed_row;
+  const ssize_t y1 = (m->next_iMCU_row + 1) * iMCU_height;
+  const ssize_t y_end = last_iMCU_row ? y1 : y1 + iMCU_height - 1;
+  const size_t xsize_padded = m->xsize_blocks * DCTSIZE;
+  const size_t row_bytes = (xsize_padded + 2) * sizeof(float);
   for (int c = 0; c < cinfo->num_components; c++) {
     auto& input = m->input_buffer[c];
-    auto& output = *m->smooth_input[c];
+    auto& orig = m->smoothing_rows[c];
     if (m->next_iMCU_row == 0) {
-      input.CopyRow(-1, 0, 1);
+      memcpy(orig.Row(-1) - 1, input.Row(0) - 1, row_bytes);
     }
-    if (m->next_iMCU_row + 1 == cinfo->total_iMCU_rows) {
+    if (last_iMCU_row) {
       size_t last_row = m->ysize_blocks * DCTSIZE - 1;
       input.CopyRow(last_row + 1, last_row, 1);
     }
-    // TODO(szabadka) SIMDify this.
-    for (ssize_t y = y0; y < y1; ++y) {
-      const float* row_t = input.Row(y - 1);
-      const float* row_m = input.Row(y);
-      const float* row_b = input.Row(y + 1);
-      float* row_out = output.Row(y);
-      for (ssize_t x = 0; x < xsize_padded; ++x) {
-        float val_tl = row_t[x - 1];
-        float val_tm = row_t[x];
-        float val_tr = row_t[x + 1];
-        float val_ml = row_m[x - 1];
-        float val_mm = row_m[x];
-        float val_mr = row_m[x + 1];
-        float val_bl = row_b[x - 1];
-        float val_bm = row_b[x];
-        float val_br = row_b[x + 1];
-        float val1 = (val_tl + val_tm + val_tr + val_ml + val_mr + val_bl +
-                      val_bm + val_br);
-        row_out[x] = val_mm * kW0 + val1 * kW1;
-      }
+    for (ssize_t y = y0; y < y_end; ++y) {
+      float* row = input.Row(y);
+      memcpy(orig.Row(y) - 1, row - 1, row_bytes);
+      HWY_DYNAMIC_DISPATCH(SmoothInputRow)
+      (orig.Row(y - 1), orig.Row(y), input.Row(y + 1), xsize_padded, kW0, kW1,
+       row);
+      row[-1] = row[0];
+      row[xsize_padded] = row[xsize_padded - 1];
     }
   }
+  m->next_smoothed_row = y_end;
 }
 
 }  // namespace jpegli
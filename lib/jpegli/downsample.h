@@ -11,6 +11,10 @@
 
 namespace jpegli {
 
+// Returns true if the downsampled rows of component c are refined with
+// JPEGLI_DOWNSAMPLE_SHARP.
+bool UseSharpDownsampling(j_compress_ptr cinfo, int c);
+
 void ChooseDownsampleMethods(j_compress_ptr cinfo);
 
 void DownsampleInputBuffer(j_compress_ptr cinfo);
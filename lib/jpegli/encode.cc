@@ -29,7 +29,10 @@
 #include "lib/jpegli/input.h"
 #include "lib/jpegli/memory_manager.h"
 #include "lib/jpegli/quant.h"
+#include "lib/jpegli/scan_optimizer.h"
 #include "lib/jpegli/simd.h"
+#include "lib/jpegli/stage_stats.h"
+#include "lib/jpegli/trellis.h"
 #include "lib/jpegli/types.h"
 
 namespace jpegli {
@@ -85,6 +88,9 @@ void InitializeCompressParams(j_compress_ptr cinfo) {
   cinfo->master->psnr_tolerance = 0.01f;
   cinfo->master->min_distance = 0.1f;
   cinfo->master->max_distance = 25.0f;
+  cinfo->master->psnr_search_rows = 0;
+  cinfo->master->target_size = 0;
+  cinfo->master->butteraugli_target = 0.0f;
 }
 
 float LinearQualityToDistance(int scale_factor) {
@@ -115,6 +121,16 @@ void SetDefaultScanScript(j_compress_ptr cinfo) {
   std::vector<ProgressiveScan> progressive_mode;
   bool interleave_dc =
       (cinfo->max_h_samp_factor == 1 && cinfo->max_v_samp_factor == 1);
+  if (cinfo->master->stream_dc_scan_requested &&
+      cinfo->num_components <= MAX_COMPS_IN_SCAN) {
+    // Only a DC scan of all components can be streamed.
+    int mcu_size = 0;
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      const jpeg_component_info* comp = &cinfo->comp_info[c];
+      mcu_size += comp->h_samp_factor * comp->v_samp_factor;
+    }
+    interleave_dc = interleave_dc || mcu_size <= C_MAX_BLOCKS_IN_MCU;
+  }
   if (level == 0) {
     progressive_mode.push_back({0, 63, 0, 0, true});
   } else if (level == 1) {
@@ -239,6 +255,100 @@ void ValidateScanScript(j_compress_ptr cinfo) {
   }
 }
 
+// Returns true if the input rows can be read with the fused 8-bit RGB to
+// YCbCr 4:2:0 input transform.
+bool UseFusedInput(j_compress_ptr cinfo) {
+  if (cinfo->raw_data_in || cinfo->smoothing_factor != 0 ||
+      cinfo->master->tone_mapping_requested ||
+      cinfo->master->downsample_mode != JPEGLI_DOWNSAMPLE_BOX ||
+      cinfo->master->data_type != JPEGLI_TYPE_UINT8 ||
+      cinfo->in_color_space != JCS_RGB || cinfo->input_components != 3 ||
+      cinfo->jpeg_color_space != JCS_YCbCr || cinfo->num_components != 3) {
+    return false;
+  }
+  const jpeg_component_info* comp = cinfo->comp_info;
+  return comp[0].h_samp_factor == 2 && comp[0].v_samp_factor == 2 &&
+         comp[1].h_samp_factor == 1 && comp[1].v_samp_factor == 1 &&
+         comp[2].h_samp_factor == 1 && comp[2].v_samp_factor == 1;
+}
+
+// Validates the scan script and sets up the per-scan state of the encoder.
+// Returns the restart interval that splits the scan into about
+// parallel_decode_segments restart intervals of whole MCU rows, or 0 if the
+// scan is one segment anyway.
+size_t ParallelDecodeRestartInterval(j_compress_ptr cinfo,
+                                     const ScanTokenInfo& sti) {
+  const size_t num_segments = cinfo->master->parallel_decode_segments;
+  size_t rows = DivCeil(sti.MCU_rows_in_scan, num_segments);
+  if (rows >= sti.MCU_rows_in_scan) {
+    return 0;
+  }
+  // The image width is at most 65535, so an MCU row always fits.
+  rows = std::min<size_t>(rows, 65535u / sti.MCUs_per_row);
+  return rows * sti.MCUs_per_row;
+}
+
+void ProcessScanScript(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  cinfo->progressive_mode = TO_JXL_BOOL(cinfo->scan_info->Ss != 0 ||
+                                        cinfo->scan_info->Se != DCTSIZE2 - 1);
+  ValidateScanScript(cinfo);
+  m->scan_token_info =
+      Allocate<ScanTokenInfo>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
+  memset(m->scan_token_info, 0, cinfo->num_scans * sizeof(ScanTokenInfo));
+  m->ac_ctx_offset = Allocate<uint8_t>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
+  size_t num_ac_contexts = 0;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* scan_info = &cinfo->scan_info[i];
+    m->ac_ctx_offset[i] = 4 + num_ac_contexts;
+    if (scan_info->Se > 0) {
+      num_ac_contexts += scan_info->comps_in_scan;
+    }
+    if (num_ac_contexts > 252) {
+      JPEGLI_ERROR("Too many AC scans in image");
+    }
+    ScanTokenInfo* sti = &m->scan_token_info[i];
+    if (scan_info->comps_in_scan == 1) {
+      int comp_idx = scan_info->component_index[0];
+      jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+      sti->MCUs_per_row = comp->width_in_blocks;
+      sti->MCU_rows_in_scan = comp->height_in_blocks;
+      sti->blocks_in_MCU = 1;
+    } else {
+      sti->MCUs_per_row =
+          DivCeil(cinfo->image_width, DCTSIZE * cinfo->max_h_samp_factor);
+      sti->MCU_rows_in_scan =
+          DivCeil(cinfo->image_height, DCTSIZE * cinfo->max_v_samp_factor);
+      sti->blocks_in_MCU = 0;
+      for (int j = 0; j < scan_info->comps_in_scan; ++j) {
+        int comp_idx = scan_info->component_index[j];
+        jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+        sti->blocks_in_MCU += comp->h_samp_factor * comp->v_samp_factor;
+      }
+    }
+    size_t num_MCUs = sti->MCU_rows_in_scan * sti->MCUs_per_row;
+    sti->num_blocks = num_MCUs * sti->blocks_in_MCU;
+    if (m->parallel_decode_segments > 0) {
+      sti->restart_interval = ParallelDecodeRestartInterval(cinfo, *sti);
+    } else if (cinfo->restart_in_rows <= 0) {
+      sti->restart_interval = cinfo->restart_interval;
+    } else {
+      sti->restart_interval =
+          std::min<size_t>(sti->MCUs_per_row * cinfo->restart_in_rows, 65535u);
+    }
+    sti->num_restarts = sti->restart_interval > 0
+                            ? DivCeil(num_MCUs, sti->restart_interval)
+                            : 1;
+    sti->restarts = Allocate<size_t>(cinfo, sti->num_restarts, JPOOL_IMAGE);
+    if (m->write_restart_index && !cinfo->progressive_mode &&
+        sti->restart_interval > 0) {
+      sti->restart_offsets =
+          Allocate<uint32_t>(cinfo, sti->num_restarts + 1, JPOOL_IMAGE);
+    }
+  }
+  m->num_contexts = 4 + num_ac_contexts;
+}
+
 void ProcessCompressionParams(j_compress_ptr cinfo) {
   if (cinfo->dest == nullptr) {
     JPEGLI_ERROR("Missing destination.");
@@ -259,6 +369,21 @@ void ProcessCompressionParams(j_compress_ptr cinfo) {
   if (cinfo->data_precision != kJpegPrecision) {
     JPEGLI_ERROR("Invalid data precision");
   }
+  if (cinfo->master->psnr_target > 0 && cinfo->master->target_size > 0) {
+    JPEGLI_ERROR("PSNR target and target size can not be used together.");
+  }
+  if (cinfo->master->butteraugli_target > 0 &&
+      (cinfo->master->psnr_target > 0 || cinfo->master->target_size > 0)) {
+    JPEGLI_ERROR(
+        "Butteraugli target can not be used with PSNR or size targets.");
+  }
+  if ((cinfo->master->target_size > 0 ||
+       cinfo->master->butteraugli_target > 0) &&
+      (cinfo->master->min_distance <= 0 ||
+       cinfo->master->min_distance > cinfo->master->max_distance)) {
+    JPEGLI_ERROR("Invalid distance range %f .. %f for distance search",
+                 cinfo->master->min_distance, cinfo->master->max_distance);
+  }
   if (cinfo->arith_code) {
     JPEGLI_ERROR("Arithmetic coding is not implemented.");
   }
@@ -328,89 +453,78 @@ void ProcessCompressionParams(j_compress_ptr cinfo) {
       y_comp->v_samp_factor != cinfo->max_v_samp_factor) {
     m->use_adaptive_quantization = false;
   }
+  // The fixed point DCT needs 8-bit input and the zero bias of the adaptive
+  // quantization is not supported.
+  m->use_fixed_point_dct = m->fixed_point_dct_requested &&
+                           !m->use_adaptive_quantization && !m->xyb_mode &&
+                           m->data_type == JPEGLI_TYPE_UINT8;
+  m->use_fused_input = UseFusedInput(cinfo);
+  m->default_scan_script = (cinfo->scan_info == nullptr);
   if (cinfo->scan_info == nullptr) {
     SetDefaultScanScript(cinfo);
   }
-  cinfo->progressive_mode = TO_JXL_BOOL(cinfo->scan_info->Ss != 0 ||
-                                        cinfo->scan_info->Se != DCTSIZE2 - 1);
-  ValidateScanScript(cinfo);
-  m->scan_token_info =
-      Allocate<ScanTokenInfo>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
-  memset(m->scan_token_info, 0, cinfo->num_scans * sizeof(ScanTokenInfo));
-  m->ac_ctx_offset = Allocate<uint8_t>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
-  size_t num_ac_contexts = 0;
-  for (int i = 0; i < cinfo->num_scans; ++i) {
-    const jpeg_scan_info* scan_info = &cinfo->scan_info[i];
-    m->ac_ctx_offset[i] = 4 + num_ac_contexts;
-    if (scan_info->Se > 0) {
-      num_ac_contexts += scan_info->comps_in_scan;
-    }
-    if (num_ac_contexts > 252) {
-      JPEGLI_ERROR("Too many AC scans in image");
-    }
-    ScanTokenInfo* sti = &m->scan_token_info[i];
-    if (scan_info->comps_in_scan == 1) {
-      int comp_idx = scan_info->component_index[0];
-      jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
-      sti->MCUs_per_row = comp->width_in_blocks;
-      sti->MCU_rows_in_scan = comp->height_in_blocks;
-      sti->blocks_in_MCU = 1;
-    } else {
-      sti->MCUs_per_row =
-          DivCeil(cinfo->image_width, DCTSIZE * cinfo->max_h_samp_factor);
-      sti->MCU_rows_in_scan =
-          DivCeil(cinfo->image_height, DCTSIZE * cinfo->max_v_samp_factor);
-      sti->blocks_in_MCU = 0;
-      for (int j = 0; j < scan_info->comps_in_scan; ++j) {
-        int comp_idx = scan_info->component_index[j];
-        jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
-        sti->blocks_in_MCU += comp->h_samp_factor * comp->v_samp_factor;
-      }
-    }
-    size_t num_MCUs = sti->MCU_rows_in_scan * sti->MCUs_per_row;
-    sti->num_blocks = num_MCUs * sti->blocks_in_MCU;
-    if (cinfo->restart_in_rows <= 0) {
-      sti->restart_interval = cinfo->restart_interval;
-    } else {
-      sti->restart_interval =
-          std::min<size_t>(sti->MCUs_per_row * cinfo->restart_in_rows, 65535u);
-    }
-    sti->num_restarts = sti->restart_interval > 0
-                            ? DivCeil(num_MCUs, sti->restart_interval)
-                            : 1;
-    sti->restarts = Allocate<size_t>(cinfo, sti->num_restarts, JPOOL_IMAGE);
-  }
-  m->num_contexts = 4 + num_ac_contexts;
+  ProcessScanScript(cinfo);
+  m->use_trellis_quantization = m->trellis_quantization_requested &&
+                                cinfo->global_state != kEncWriteCoeffs;
+  const jpeg_scan_info* first_scan = cinfo->scan_info;
+  m->stream_dc_scan =
+      m->stream_dc_scan_requested && cinfo->progressive_mode &&
+      m->gain_map == nullptr &&
+      cinfo->global_state != kEncWriteCoeffs &&
+      !IsDeferredQuantization(cinfo) && first_scan->Se == 0 &&
+      first_scan->Ah == 0 && first_scan->comps_in_scan == cinfo->num_components;
 }
 
 bool IsStreamingSupported(j_compress_ptr cinfo) {
   if (cinfo->global_state == kEncWriteCoeffs) {
     return false;
   }
-  // TODO(szabadka) Remove this restriction.
-  if (cinfo->restart_interval > 0 || cinfo->restart_in_rows > 0) {
+  if (cinfo->master->gain_map != nullptr) {
+    // The MPF marker before the frame header depends on the size of the scans.
     return false;
   }
   if (cinfo->num_scans > 1) {
     return false;
   }
-  if (cinfo->master->psnr_target > 0) {
+  if (cinfo->master->psnr_target > 0 && cinfo->master->psnr_search_rows <= 0) {
+    return false;
+  }
+  if (cinfo->master->target_size > 0 ||
+      cinfo->master->butteraugli_target > 0) {
+    return false;
+  }
+  if (cinfo->master->use_trellis_quantization) {
     return false;
   }
   return true;
 }
 
+void AllocateTokenArrays(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  int ysize_blocks = DivCeil(cinfo->image_height, DCTSIZE);
+  int num_arrays = cinfo->num_scans * ysize_blocks;
+  m->token_arrays = Allocate<TokenArray>(cinfo, num_arrays, JPOOL_IMAGE);
+  m->cur_token_array = 0;
+  memset(m->token_arrays, 0, num_arrays * sizeof(TokenArray));
+  m->next_token = nullptr;
+  m->num_tokens = 0;
+  m->total_num_tokens = 0;
+  m->token_staging = nullptr;
+  m->token_staging_size = 0;
+}
+
 void AllocateBuffers(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   memset(m->last_dc_coeff, 0, sizeof(m->last_dc_coeff));
+  m->num_psnr_search_rows = 0;
+  if (m->psnr_target > 0 && IsStreamingSupported(cinfo)) {
+    m->num_psnr_search_rows = std::min<size_t>(m->psnr_search_rows,
+                                               cinfo->total_iMCU_rows);
+  }
+  m->use_two_pass_tokenization = false;
+  m->token_counts = nullptr;
   if (!IsStreamingSupported(cinfo) || cinfo->optimize_coding) {
-    int ysize_blocks = DivCeil(cinfo->image_height, DCTSIZE);
-    int num_arrays = cinfo->num_scans * ysize_blocks;
-    m->token_arrays = Allocate<TokenArray>(cinfo, num_arrays, JPOOL_IMAGE);
-    m->cur_token_array = 0;
-    memset(m->token_arrays, 0, num_arrays * sizeof(TokenArray));
-    m->num_tokens = 0;
-    m->total_num_tokens = 0;
+    AllocateTokenArrays(cinfo);
   }
   if (cinfo->global_state == kEncWriteCoeffs) {
     return;
@@ -420,41 +534,82 @@ void AllocateBuffers(j_compress_ptr cinfo) {
   size_t total_iMCU_cols = DivCeil(cinfo->image_width, iMCU_width);
   size_t xsize_full = total_iMCU_cols * iMCU_width;
   size_t ysize_full = 3 * iMCU_height;
-  if (!cinfo->raw_data_in) {
+  const jpeg_comp_master* leader =
+      m->ladder_leader != nullptr ? m->ladder_leader->master : nullptr;
+  if (!cinfo->raw_data_in && leader == nullptr) {
     int num_all_components =
         std::max(cinfo->input_components, cinfo->num_components);
+    // With the fused input transform only the luma rows are buffered at full
+    // resolution.
+    if (m->use_fused_input) num_all_components = 1;
     for (int c = 0; c < num_all_components; ++c) {
       m->input_buffer[c].Allocate(cinfo, ysize_full, xsize_full);
     }
   }
+  bool sharp_downsampling = false;
   for (int c = 0; c < cinfo->num_components; ++c) {
     jpeg_component_info* comp = &cinfo->comp_info[c];
     size_t xsize = total_iMCU_cols * comp->h_samp_factor * DCTSIZE;
     size_t ysize = 3 * comp->v_samp_factor * DCTSIZE;
+    m->quant_mul[c] = Allocate<float>(cinfo, DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+    if (leader != nullptr) {
+      // The rows are read and downsampled by the leader of the ladder group.
+      m->input_buffer[c] = leader->input_buffer[c];
+      m->raw_data[c] = leader->raw_data[c];
+      continue;
+    }
     if (cinfo->raw_data_in) {
       m->input_buffer[c].Allocate(cinfo, ysize, xsize);
     }
-    m->smooth_input[c] = &m->input_buffer[c];
     if (!cinfo->raw_data_in && cinfo->smoothing_factor) {
-      m->smooth_input[c] = Allocate<RowBuffer<float>>(cinfo, 1, JPOOL_IMAGE);
-      m->smooth_input[c]->Allocate(cinfo, ysize_full, xsize_full);
+      m->smoothing_rows[c].Allocate(cinfo, 2, xsize_full);
     }
-    m->raw_data[c] = m->smooth_input[c];
+    m->raw_data[c] = &m->input_buffer[c];
     if (!cinfo->raw_data_in && (m->h_factor[c] > 1 || m->v_factor[c] > 1)) {
       m->raw_data[c] = Allocate<RowBuffer<float>>(cinfo, 1, JPOOL_IMAGE);
       m->raw_data[c]->Allocate(cinfo, ysize, xsize);
     }
-    m->quant_mul[c] = Allocate<float>(cinfo, DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+    sharp_downsampling |= UseSharpDownsampling(cinfo, c);
+  }
+  if (!cinfo->raw_data_in && sharp_downsampling) {
+    m->sharp_downsample_tmp.Allocate(cinfo, 4 * iMCU_height, xsize_full);
   }
   m->dct_buffer = Allocate<float>(cinfo, 2 * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
   m->block_tmp = Allocate<int32_t>(cinfo, DCTSIZE2 * 4, JPOOL_IMAGE_ALIGNED);
-  if (!IsStreamingSupported(cinfo)) {
+  m->imcu_coeffs = nullptr;
+  m->imcu_dc = nullptr;
+  m->segment_data = nullptr;
+  m->segment_data_size = 0;
+  m->num_output_bytes = 0;
+  m->entropy_coding_done = false;
+  m->step_units_done = 0;
+  m->step_buffer = nullptr;
+  m->step_buffer_size = 0;
+  m->step_output_pos = 0;
+  m->step_output_end = 0;
+  m->step_scan_pending = false;
+  // The blocks of the iMCU row are computed up front if they can be computed
+  // in parallel, if the DCTs of adjacent blocks can be batched, or by the
+  // transform backend.
+  if (m->runner != nullptr || DCTBatchSize() > 1 ||
+      m->transform_backend.forward_transform != nullptr) {
+    m->imcu_coeffs = Allocate<int32_t>(
+        cinfo, m->blocks_per_iMCU_row * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+    m->imcu_dc = Allocate<float>(cinfo, m->blocks_per_iMCU_row, JPOOL_IMAGE);
+  }
+  if (!IsStreamingSupported(cinfo) || m->num_psnr_search_rows > 0) {
     m->coeff_buffers =
         Allocate<jvirt_barray_ptr>(cinfo, cinfo->num_components, JPOOL_IMAGE);
     for (int c = 0; c < cinfo->num_components; ++c) {
       jpeg_component_info* comp = &cinfo->comp_info[c];
       const size_t xsize_blocks = comp->width_in_blocks;
-      const size_t ysize_blocks = comp->height_in_blocks;
+      size_t ysize_blocks = comp->height_in_blocks;
+      if (m->num_psnr_search_rows > 0) {
+        // In streaming PSNR mode we only buffer the coefficients of the iMCU
+        // rows used for the distance search.
+        ysize_blocks = std::min<size_t>(
+            ysize_blocks, m->num_psnr_search_rows * comp->v_samp_factor);
+      }
       m->coeff_buffers[c] = (*cinfo->mem->request_virt_barray)(
           reinterpret_cast<j_common_ptr>(cinfo), JPOOL_IMAGE,
           /*pre_zero=*/FALSE, xsize_blocks, ysize_blocks, comp->v_samp_factor);
@@ -466,12 +621,36 @@ void AllocateBuffers(j_compress_ptr cinfo) {
     const size_t xsize_blocks = y_comp->width_in_blocks;
     const size_t vecsize = VectorSize();
     const size_t xsize_padded = DivCeil(2 * xsize_blocks, vecsize) * vecsize;
-    m->diff_buffer =
-        Allocate<float>(cinfo, xsize_blocks * DCTSIZE + 8, JPOOL_IMAGE_ALIGNED);
-    m->fuzzy_erosion_tmp.Allocate(cinfo, 2, xsize_padded);
-    m->pre_erosion.Allocate(cinfo, 6 * cinfo->max_v_samp_factor, xsize_padded);
+    if (m->quant_field_out != nullptr &&
+        m->quant_field_out_stride < xsize_blocks) {
+      JPEGLI_ERROR("Invalid quant field stride %u",
+                   static_cast<unsigned>(m->quant_field_out_stride));
+    }
+    if (m->quant_field_in != nullptr) {
+      // The quant field of the application replaces the computed one.
+      if (m->quant_field_in_stride < xsize_blocks) {
+        JPEGLI_ERROR("Invalid quant field stride %u",
+                     static_cast<unsigned>(m->quant_field_in_stride));
+      }
+    } else {
+      m->diff_buffer = Allocate<float>(cinfo, xsize_blocks * DCTSIZE + 8,
+                                       JPOOL_IMAGE_ALIGNED);
+      if (m->aq_mode == JPEGLI_AQ_FAST) {
+        // The fast mode works on the 2x downsampled luma of one iMCU row.
+        m->downsampled_luma.Allocate(cinfo, 4 * cinfo->max_v_samp_factor,
+                                     4 * xsize_blocks);
+        m->pre_erosion.Allocate(cinfo, 2 * cinfo->max_v_samp_factor,
+                                xsize_padded);
+      } else {
+        m->fuzzy_erosion_tmp.Allocate(cinfo, 2, xsize_padded);
+        m->pre_erosion.Allocate(cinfo, 6 * cinfo->max_v_samp_factor,
+                                xsize_padded);
+      }
+    }
     size_t qf_height = cinfo->max_v_samp_factor;
-    if (m->psnr_target > 0) {
+    if (m->num_psnr_search_rows > 0) {
+      qf_height *= m->num_psnr_search_rows;
+    } else if (IsDeferredQuantization(cinfo)) {
       qf_height *= cinfo->total_iMCU_rows;
     }
     m->quant_field.Allocate(cinfo, qf_height, xsize_blocks);
@@ -502,31 +681,90 @@ void InitProgressMonitor(j_compress_ptr cinfo) {
   }
 }
 
+// Returns the preset of jpegli_set_huffman_presets() for the current image,
+// or nullptr if there is none.
+const JpegliHuffmanPreset* ChooseHuffmanPreset(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  if (m->num_huffman_presets == 0 || cinfo->data_precision != 8) {
+    return nullptr;
+  }
+  const float distance = QuantValsToDistance(cinfo);
+  const jpeg_component_info* comp = &cinfo->comp_info[0];
+  for (size_t i = 0; i < m->num_huffman_presets; ++i) {
+    const JpegliHuffmanPreset* preset = &m->huffman_presets[i];
+    if (distance > preset->max_distance) continue;
+    if (preset->h_samp_factor == 0 ||
+        (preset->h_samp_factor == comp->h_samp_factor &&
+         preset->v_samp_factor == comp->v_samp_factor)) {
+      return preset;
+    }
+  }
+  return nullptr;
+}
+
+// Decides whether the current frame of jpegli_set_frame_sequence() keeps its
+// optimized Huffman codes for the next frames, or is coded with the kept
+// codes of an earlier frame.
+void ChooseFrameSequenceCodes(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  m->frame_keep_codes = false;
+  m->frame_reuse = false;
+  if (m->frame_max_drift <= 0.0f || !cinfo->optimize_coding ||
+      !IsStreamingSupported(cinfo) || m->psnr_target > 0) {
+    return;
+  }
+  if (m->frame_num_tables > 0 &&
+      m->frame_num_components == cinfo->num_components &&
+      m->frame_data_precision == cinfo->data_precision) {
+    m->frame_reuse = true;
+    cinfo->optimize_coding = FALSE;
+  } else {
+    m->frame_keep_codes = true;
+  }
+}
+
 // Common setup code between streaming and transcoding code paths. Called in
 // both jpegli_start_compress() and jpegli_write_coefficients().
 void InitCompress(j_compress_ptr cinfo, boolean write_all_tables) {
   jpeg_comp_master* m = cinfo->master;
   (*cinfo->err->reset_error_mgr)(reinterpret_cast<j_common_ptr>(cinfo));
   ProcessCompressionParams(cinfo);
+  ChooseFrameSequenceCodes(cinfo);
   InitProgressMonitor(cinfo);
   AllocateBuffers(cinfo);
   if (cinfo->global_state != kEncWriteCoeffs) {
     ChooseInputMethod(cinfo);
+    ChooseiMCURowKernels(cinfo);
     if (!cinfo->raw_data_in) {
       ChooseColorTransform(cinfo);
       ChooseDownsampleMethods(cinfo);
     }
-    QuantPass pass = m->psnr_target > 0 ? QuantPass::SEARCH_FIRST_PASS
-                                        : QuantPass::NO_SEARCH;
+    QuantPass pass = IsDeferredQuantization(cinfo)
+                         ? QuantPass::SEARCH_FIRST_PASS
+                         : QuantPass::NO_SEARCH;
     InitQuantizer(cinfo, pass);
   }
   if (write_all_tables) {
     jpegli_suppress_tables(cinfo, FALSE);
   }
-  if (!cinfo->optimize_coding && !cinfo->progressive_mode) {
-    CopyHuffmanTables(cinfo);
+  if (m->frame_reuse) {
+    UseFrameSequenceCodes(cinfo);
+    InitEntropyCoder(cinfo);
+  } else if (!cinfo->optimize_coding && !cinfo->progressive_mode) {
+    const JpegliHuffmanPreset* preset = ChooseHuffmanPreset(cinfo);
+    if (preset != nullptr) {
+      UsePresetHuffmanCodes(cinfo, *preset);
+    } else {
+      CopyHuffmanTables(cinfo);
+    }
     InitEntropyCoder(cinfo);
   }
+  memset(&m->cur_encode_stats, 0, sizeof(m->cur_encode_stats));
+  m->image_start_bytes = m->num_output_bytes;
+  m->restart_index_scan = -1;
+  m->restart_index_bytes = 0;
+  m->quant_field_sum = 0.0;
+  m->quant_field_count = 0;
   (*cinfo->dest->init_destination)(cinfo);
   WriteFileHeader(cinfo);
   JpegBitWriterInit(cinfo);
@@ -564,14 +802,68 @@ void ReadInputRow(j_compress_ptr cinfo, const uint8_t* scanline,
     }
     return;
   }
-  (*m->input_method)(scanline, cinfo->image_width, row);
+  // The input buffer rows are padded by at least a vector.
+  (*m->input_method)(scanline,
+                     RoundUpTo(cinfo->image_width, m->input_row_multiple), row);
+  if (m->tone_map_method != nullptr) {
+    float* rgb[3] = {row[m->tone_map_channels[0]], row[m->tone_map_channels[1]],
+                     row[m->tone_map_channels[2]]};
+    (*m->tone_map_method)(m->tone_mapping, rgb, cinfo->image_width);
+  }
+  if (m->alpha_blend_method != nullptr) {
+    float* rgb[3] = {row[m->alpha_blend_channels[0]],
+                     row[m->alpha_blend_channels[1]],
+                     row[m->alpha_blend_channels[2]]};
+    (*m->alpha_blend_method)(m->alpha_background, row[m->alpha_channel], rgb,
+                             cinfo->image_width);
+  }
+}
+
+// Reads an input row with the fused input transform. The luma row is written
+// to the input buffer, and the chroma rows are downsampled directly into the
+// raw data buffers.
+void ReadInputRowFused(j_compress_ptr cinfo, const uint8_t* scanline,
+                       float* row[kMaxComponents]) {
+  jpeg_comp_master* m = cinfo->master;
+  const size_t y = m->next_input_row++;
+  const size_t xsize_padded = m->xsize_blocks * DCTSIZE;
+  row[0] = m->input_buffer[0].Row(y);
+  float* row_cb = m->raw_data[1]->Row(y / 2);
+  float* row_cr = m->raw_data[2]->Row(y / 2);
+  (*m->fused_input_transform)(scanline, cinfo->image_width, xsize_padded,
+                              row[0], row_cb, row_cr, y % 2 == 1);
+  if (m->next_input_row < cinfo->image_height) {
+    return;
+  }
+  // The padding rows below the image repeat its last row, which completes
+  // the last chroma row pair and is the input of the chroma padding rows.
+  const size_t ysize_padded = m->ysize_blocks * DCTSIZE / 2;
+  size_t y_out = y / 2;
+  if (y % 2 == 1) {
+    if (++y_out == ysize_padded) {
+      return;
+    }
+    row_cb = m->raw_data[1]->Row(y_out);
+    row_cr = m->raw_data[2]->Row(y_out);
+    (*m->fused_input_transform)(scanline, cinfo->image_width, xsize_padded,
+                                row[0], row_cb, row_cr, false);
+  }
+  (*m->fused_input_transform)(scanline, cinfo->image_width, xsize_padded,
+                              row[0], row_cb, row_cr, true);
+  for (size_t y_pad = y_out + 1; y_pad < ysize_padded; ++y_pad) {
+    m->raw_data[1]->CopyRow(y_pad, y_out, 0);
+    m->raw_data[2]->CopyRow(y_pad, y_out, 0);
+  }
 }
 
 void PadInputBuffer(j_compress_ptr cinfo, float* row[kMaxComponents]) {
   jpeg_comp_master* m = cinfo->master;
   const size_t len0 = cinfo->image_width;
   const size_t len1 = m->xsize_blocks * DCTSIZE;
-  for (int c = 0; c < cinfo->num_components; ++c) {
+  // The chroma rows of the fused input transform are padded by
+  // ReadInputRowFused().
+  const int num_components = m->use_fused_input ? 1 : cinfo->num_components;
+  for (int c = 0; c < num_components; ++c) {
     // Pad row to a multiple of the iMCU width, plus create a border of 1
     // repeated pixel for adaptive quant field calculation.
     float last_val = row[c][len0 - 1];
@@ -583,7 +875,7 @@ void PadInputBuffer(j_compress_ptr cinfo, float* row[kMaxComponents]) {
   if (m->next_input_row == cinfo->image_height) {
     size_t num_rows = m->ysize_blocks * DCTSIZE - cinfo->image_height;
     for (size_t i = 0; i < num_rows; ++i) {
-      for (int c = 0; c < cinfo->num_components; ++c) {
+      for (int c = 0; c < num_components; ++c) {
         float* dest = m->input_buffer[c].Row(m->next_input_row) - 1;
         memcpy(dest, row[c] - 1, (len1 + 2) * sizeof(dest[0]));
       }
@@ -592,23 +884,146 @@ void PadInputBuffer(j_compress_ptr cinfo, float* row[kMaxComponents]) {
   }
 }
 
-void ProcessiMCURow(j_compress_ptr cinfo) {
-  JPEGLI_CHECK(cinfo->master->next_iMCU_row < cinfo->total_iMCU_rows);
-  if (!cinfo->raw_data_in) {
-    ApplyInputSmoothing(cinfo);
-    DownsampleInputBuffer(cinfo);
+// Reads the next iMCU row of the planes of jpegli_write_planes() to the input
+// buffers, padding each plane by repeating its last column and row.
+void ReadPlanesiMCURow(j_compress_ptr cinfo, const uint8_t* const planes[],
+                       const size_t strides[], JpegliPlaneLayout layout) {
+  jpeg_comp_master* m = cinfo->master;
+  const size_t iMCU_y =
+      m->next_input_row / (DCTSIZE * cinfo->max_v_samp_factor);
+  const bool nv12 = layout == JPEGLI_PLANES_NV12;
+  const InputMethod read_interleaved =
+      nv12 ? GetInputMethod(cinfo, 2) : nullptr;
+  float* rows[kMaxComponents];
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const bool interleaved = nv12 && c == 1;
+    if (nv12 && c == 2) {
+      // Read together with the second component.
+      continue;
+    }
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    const size_t xsize = comp->downsampled_width;
+    const size_t ysize = comp->downsampled_height;
+    const size_t num_rows = comp->v_samp_factor * DCTSIZE;
+    const size_t y0 = iMCU_y * num_rows;
+    for (size_t y = y0; y < y0 + num_rows; ++y) {
+      const uint8_t* row_in = planes[c] + std::min(y, ysize - 1) * strides[c];
+      rows[0] = m->input_buffer[c].Row(y);
+      if (interleaved) {
+        rows[1] = m->input_buffer[c + 1].Row(y);
+        (*read_interleaved)(row_in, xsize, rows);
+        m->input_buffer[c + 1].PadRow(y, xsize, /*border=*/1);
+      } else {
+        (*m->input_method)(row_in, xsize, rows);
+      }
+      // We need a border of 1 repeated pixel for adaptive quant field.
+      m->input_buffer[c].PadRow(y, xsize, /*border=*/1);
+    }
   }
-  ComputeAdaptiveQuantField(cinfo);
-  if (IsStreamingSupported(cinfo)) {
+}
+
+// Chooses the quantization in streaming PSNR mode based on the buffered
+// coefficients of the first iMCU rows, and encodes these iMCU rows.
+void EncodePSNRSearchRows(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  QuantizetoPSNR(cinfo);
+  // The rest of the iMCU rows are quantized directly with the chosen tables.
+  InitQuantizer(cinfo, QuantPass::NO_SEARCH);
+  if (!cinfo->optimize_coding) {
+    WriteFrameHeader(cinfo);
+    WriteScanHeader(cinfo, 0);
+  }
+  memset(m->last_dc_coeff, 0, sizeof(m->last_dc_coeff));
+  const size_t next_iMCU_row = m->next_iMCU_row;
+  for (m->next_iMCU_row = 0; m->next_iMCU_row <= next_iMCU_row;
+       ++m->next_iMCU_row) {
     if (cinfo->optimize_coding) {
-      ComputeTokensForiMCURow(cinfo);
+      (*m->compute_tokens_from_coeffs_for_imcu_row)(cinfo);
     } else {
-      WriteiMCURow(cinfo);
+      (*m->write_imcu_row_from_coeffs)(cinfo);
+    }
+  }
+  m->next_iMCU_row = next_iMCU_row;
+}
+
+// Writes the frame header and the header of the first scan before the first
+// input row, if the first scan is coded while the input is read.
+void WriteStreamedScanHeader(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  if (IsStreamingSupported(cinfo) && !cinfo->optimize_coding &&
+      m->num_psnr_search_rows == 0) {
+    WriteFrameHeader(cinfo);
+    WriteScanHeader(cinfo, 0);
+  } else if (m->stream_dc_scan) {
+    CopyDCHuffmanTables(cinfo);
+    InitEntropyCoder(cinfo);
+    WriteFrameHeader(cinfo);
+    WriteScanHeader(cinfo, 0);
+    memset(m->dc_scan_pred, 0, sizeof(m->dc_scan_pred));
+  }
+}
+
+// Computes the adaptive quantization field and the coefficients, tokens or
+// entropy coded data of the current iMCU row from the downsampled rows.
+void CodeiMCURow(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  StageStats* stats = &m->stage_stats;
+  {
+    StageTimer timer(stats, JPEGLI_STAGE_ADAPTIVE_QUANTIZATION);
+    ComputeAdaptiveQuantField(cinfo);
+  }
+  StageTimer timer(stats, JPEGLI_STAGE_DCT);
+  if (m->next_iMCU_row < m->num_psnr_search_rows) {
+    (*m->compute_coefficients_for_imcu_row)(cinfo);
+    if (m->next_iMCU_row + 1 == m->num_psnr_search_rows) {
+      EncodePSNRSearchRows(cinfo);
+    }
+  } else if (IsStreamingSupported(cinfo)) {
+    if (cinfo->optimize_coding) {
+      (*m->compute_tokens_for_imcu_row)(cinfo);
+    } else {
+      (*m->write_imcu_row)(cinfo);
     }
   } else {
-    ComputeCoefficientsForiMCURow(cinfo);
+    (*m->compute_coefficients_for_imcu_row)(cinfo);
+    if (m->stream_dc_scan) {
+      WriteDCScaniMCURow(cinfo);
+    }
+  }
+  ++m->next_iMCU_row;
+}
+
+// Codes the current iMCU row of a rung compressor of jpegli_encode_ladder()
+// from the rows that its ladder leader has just downsampled.
+void ProcessLadderiMCURow(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  JPEGLI_CHECK(m->next_iMCU_row < cinfo->total_iMCU_rows);
+  if (cinfo->global_state == kEncHeader) {
+    WriteStreamedScanHeader(cinfo);
+    cinfo->global_state = kEncReadImage;
+  }
+  CodeiMCURow(cinfo);
+  m->next_input_row = m->ladder_leader->master->next_input_row;
+  cinfo->next_scanline =
+      std::min<size_t>(m->next_input_row, cinfo->image_height);
+  if (!EmptyBitWriterBuffer(&m->bw)) {
+    JPEGLI_ERROR("Output suspension is not supported in ladder encoding");
+  }
+}
+
+void ProcessiMCURow(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  JPEGLI_CHECK(m->next_iMCU_row < cinfo->total_iMCU_rows);
+  CheckCancelFlag(cinfo);
+  if (!cinfo->raw_data_in && !m->use_fused_input) {
+    StageTimer timer(&m->stage_stats, JPEGLI_STAGE_DOWNSAMPLE);
+    ApplyInputSmoothing(cinfo);
+    DownsampleInputBuffer(cinfo);
+  }
+  CodeiMCURow(cinfo);
+  for (size_t i = 0; i < m->num_ladder_followers; ++i) {
+    ProcessLadderiMCURow(m->ladder_followers[i]);
   }
-  ++cinfo->master->next_iMCU_row;
 }
 
 void ProcessiMCURows(j_compress_ptr cinfo) {
@@ -632,6 +1047,8 @@ void ProcessiMCURows(j_compress_ptr cinfo) {
 void ZigZagShuffleBlocks(j_compress_ptr cinfo) {
   JCOEF tmp[DCTSIZE2];
   for (int c = 0; c < cinfo->num_components; ++c) {
+    // The coefficients read by a decoder in zigzag order are already there.
+    if (IsZigZagOrder(cinfo->master->coeff_buffers[c])) continue;
     jpeg_component_info* comp = &cinfo->comp_info[c];
     for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
       JBLOCKARRAY blocks = GetBlockRow(cinfo, c, by);
@@ -646,6 +1063,371 @@ void ZigZagShuffleBlocks(j_compress_ptr cinfo) {
   }
 }
 
+// Does the work of jpegli_finish_compress() that precedes the writing of the
+// frame header, i.e. the quantization and entropy coding of the buffered
+// coefficients. Can be called more than once.
+void PrepareEntropyCoding(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  if (m->entropy_coding_done) {
+    return;
+  }
+  if (cinfo->next_scanline < cinfo->image_height) {
+    JPEGLI_ERROR("Incomplete image, expected %d rows, got %d",
+                 cinfo->image_height, cinfo->next_scanline);
+  }
+
+  if (cinfo->global_state == kEncWriteCoeffs) {
+    // Zig-zag shuffle all the blocks. For non-transcoding case it was already
+    // done in EncodeiMCURow().
+    ZigZagShuffleBlocks(cinfo);
+  }
+
+  if (m->psnr_target > 0 && m->num_psnr_search_rows == 0) {
+    QuantizetoPSNR(cinfo);
+  } else if (m->target_size > 0) {
+    QuantizetoTargetSize(cinfo);
+  } else if (m->butteraugli_target > 0) {
+    QuantizetoButteraugliTarget(cinfo);
+  } else if (m->use_trellis_quantization) {
+    TrellisQuantizeCoeffs(cinfo);
+  }
+
+  if (m->optimize_scans && m->default_scan_script && cinfo->progressive_mode) {
+    // The new scan script has to be set up before any tokens are created.
+    OptimizeScanScript(cinfo);
+    ProcessScanScript(cinfo);
+    AllocateTokenArrays(cinfo);
+    InitProgressMonitor(cinfo);
+  }
+
+  if (!IsStreamingSupported(cinfo)) {
+    StageTimer timer(&m->stage_stats, JPEGLI_STAGE_TOKENIZE);
+    TokenizeJpeg(cinfo);
+  }
+  if (!IsStreamingSupported(cinfo) || cinfo->optimize_coding) {
+    StageTimer timer(&m->stage_stats, JPEGLI_STAGE_TOKENIZE);
+    FinishTokens(cinfo);
+  }
+
+  if (cinfo->optimize_coding || cinfo->progressive_mode) {
+    StageTimer timer(&m->stage_stats, JPEGLI_STAGE_OPTIMIZE_HUFFMAN);
+    OptimizeHuffmanCodes(cinfo);
+    InitEntropyCoder(cinfo);
+  }
+  UpdateFrameSequenceCodes(cinfo);
+  m->entropy_coding_done = true;
+}
+
+struct NullDestination {
+  jpeg_destination_mgr pub;
+  uint8_t buffer[1024];
+};
+
+void InitNullDestination(j_compress_ptr /* cinfo */) {}
+
+boolean EmptyNullOutputBuffer(j_compress_ptr cinfo) {
+  NullDestination* dest = reinterpret_cast<NullDestination*>(cinfo->dest);
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = sizeof(dest->buffer);
+  return TRUE;
+}
+
+void TermNullDestination(j_compress_ptr /* cinfo */) {}
+
+// Returns the total size of the frame header and the scan headers that are
+// not written yet, which is measured by writing them to a destination that
+// discards its output, and restoring the marker writing state afterwards.
+size_t FrameAndScanHeadersSize(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  boolean sent_table[NUM_QUANT_TBLS];
+  for (int i = 0; i < NUM_QUANT_TBLS; ++i) {
+    JQUANT_TBL* table = cinfo->quant_tbl_ptrs[i];
+    sent_table[i] = table ? table->sent_table : FALSE;
+  }
+  const unsigned int restart_interval = cinfo->restart_interval;
+  const size_t last_restart_interval = m->last_restart_interval;
+  const size_t next_dht_index = m->next_dht_index;
+  const size_t num_output_bytes = m->num_output_bytes;
+  const int restart_index_scan = m->restart_index_scan;
+  m->restart_index_scan = -1;
+  NullDestination null_dest;
+  null_dest.pub.next_output_byte = null_dest.buffer;
+  null_dest.pub.free_in_buffer = sizeof(null_dest.buffer);
+  null_dest.pub.init_destination = InitNullDestination;
+  null_dest.pub.empty_output_buffer = EmptyNullOutputBuffer;
+  null_dest.pub.term_destination = TermNullDestination;
+  jpeg_destination_mgr* dest = cinfo->dest;
+  cinfo->dest = &null_dest.pub;
+  if (!m->stream_dc_scan) {
+    WriteFrameHeader(cinfo);
+  }
+  for (int i = m->stream_dc_scan ? 1 : 0; i < cinfo->num_scans; ++i) {
+    WriteScanHeader(cinfo, i);
+  }
+  cinfo->dest = dest;
+  const size_t size = m->num_output_bytes - num_output_bytes;
+  m->num_output_bytes = num_output_bytes;
+  m->next_dht_index = next_dht_index;
+  m->last_restart_interval = last_restart_interval;
+  m->restart_index_scan = restart_index_scan;
+  cinfo->restart_interval = restart_interval;
+  for (int i = 0; i < NUM_QUANT_TBLS; ++i) {
+    JQUANT_TBL* table = cinfo->quant_tbl_ptrs[i];
+    if (table) table->sent_table = sent_table[i];
+  }
+  return size;
+}
+
+void InitStepDestination(j_compress_ptr /* cinfo */) {}
+
+// Grows the buffer of the output of the current jpegli_encode_step() unit.
+boolean EmptyStepOutputBuffer(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  size_t size = std::max<size_t>(2 * m->step_buffer_size, 1 << 14);
+  uint8_t* buffer = Allocate<uint8_t>(cinfo, size, JPOOL_IMAGE);
+  if (m->step_buffer_size > 0) {
+    memcpy(buffer, m->step_buffer, m->step_buffer_size);
+  }
+  m->step_dest.next_output_byte = buffer + m->step_buffer_size;
+  m->step_dest.free_in_buffer = size - m->step_buffer_size;
+  m->step_buffer = buffer;
+  m->step_buffer_size = size;
+  return TRUE;
+}
+
+void TermStepDestination(j_compress_ptr /* cinfo */) {}
+
+// Makes the output go to the start of step_buffer, which grows as needed.
+void RedirectToStepBuffer(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  m->step_dest.next_output_byte = m->step_buffer;
+  m->step_dest.free_in_buffer = m->step_buffer_size;
+  m->step_dest.init_destination = InitStepDestination;
+  m->step_dest.empty_output_buffer = EmptyStepOutputBuffer;
+  m->step_dest.term_destination = TermStepDestination;
+  cinfo->dest = &m->step_dest;
+}
+
+bool IsBitstreamDone(j_compress_ptr cinfo) {
+  return IsStreamingSupported(cinfo) && !FROM_JXL_BOOL(cinfo->optimize_coding);
+}
+
+// Completes the stats of the current image after its EOI marker is written, see
+// jpegli_get_encode_stats().
+void FinishEncodeStats(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  jpegli_encode_stats* stats = &m->cur_encode_stats;
+  const size_t end = m->num_output_bytes;
+  stats->total_bytes = end - m->image_start_bytes;
+  stats->num_scans = cinfo->num_scans;
+  const int num_scans = std::min(cinfo->num_scans, JPEGLI_MAX_SCAN_STATS);
+  for (int i = 0; i < num_scans; ++i) {
+    // The last scan ends before the restart index and the EOI marker.
+    const size_t scan_end = i + 1 < cinfo->num_scans
+                                ? m->scan_start_bytes[i + 1]
+                                : end - 2 - m->restart_index_bytes;
+    stats->scan_bytes[i] = scan_end - m->scan_start_bytes[i];
+  }
+  // A DRI marker is written before each scan whose restart interval differs
+  // from that of the previous one.
+  size_t last_restart_interval = 0;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpegli::ScanTokenInfo& sti = m->scan_token_info[i];
+    if (sti.restart_interval != last_restart_interval) {
+      stats->restart_marker_bytes += 6;
+      last_restart_interval = sti.restart_interval;
+    }
+    if (sti.restart_interval > 0) {
+      stats->restart_marker_bytes += 2 * (sti.num_restarts - 1);
+    }
+  }
+  stats->num_huffman_tables = static_cast<int>(m->num_huffman_tables);
+  if (m->quant_field_count > 0) {
+    stats->average_quant_field = m->quant_field_sum / m->quant_field_count;
+  }
+  m->encode_stats = *stats;
+}
+
+// Returns the number of scans that are written by jpegli_finish_compress().
+int NumRemainingScans(j_compress_ptr cinfo) {
+  if (IsBitstreamDone(cinfo)) return 0;
+  return cinfo->num_scans - (cinfo->master->stream_dc_scan ? 1 : 0);
+}
+
+// Returns the number of units of jpegli_encode_step(): the entropy coding setup
+// with the frame header, the remaining scans and the EOI marker. The number of
+// scans is known only after the first unit.
+int NumStepUnits(j_compress_ptr cinfo) {
+  return cinfo->master->step_units_done == 0 ? 1
+                                             : NumRemainingScans(cinfo) + 2;
+}
+
+// Writes the markers of the next unit of the output of jpegli_encode_step() to
+// step_buffer, and also the scan data with two pass tokenization.
+void WriteStepUnit(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  jpeg_destination_mgr* dest = cinfo->dest;
+  RedirectToStepBuffer(cinfo);
+  const int unit = m->step_units_done;
+  if (unit == 0) {
+    PrepareEntropyCoding(cinfo);
+    if (IsBitstreamDone(cinfo) || m->stream_dc_scan) {
+      // The frame header and the streamed scan are already written.
+      JumpToByteBoundary(&m->bw);
+      EmptyBitWriterBuffer(&m->bw);
+    } else {
+      WriteFrameHeader(cinfo);
+    }
+  } else if (unit <= NumRemainingScans(cinfo)) {
+    const int scan_index = unit - 1 + (m->stream_dc_scan ? 1 : 0);
+    CheckCancelFlag(cinfo);
+    WriteScanHeader(cinfo, scan_index);
+    if (m->use_two_pass_tokenization) {
+      StageTimer timer(&m->stage_stats, JPEGLI_STAGE_WRITE_SCANS);
+      WriteScanData(cinfo, scan_index);
+    } else {
+      // The scan data is written after the header, directly to the
+      // destination of the application.
+      StartScanData(cinfo, scan_index);
+      m->step_scan_pending = true;
+    }
+  } else {
+    EncodeRestartIndex(cinfo);
+    WriteOutput(cinfo, {0xFF, 0xD9});  // EOI
+    FinishEncodeStats(cinfo);
+  }
+  cinfo->dest = dest;
+  m->step_output_pos = 0;
+  m->step_output_end = m->step_buffer_size - m->step_dest.free_in_buffer;
+  ++m->step_units_done;
+}
+
+// Average number of tokens per block that is assumed by the estimate of the
+// token memory, which includes the slack of the token array reservations.
+constexpr size_t kEstimatedTokensPerBlock = 24;
+// Estimate of the small allocations of an image.
+constexpr size_t kEstimatedSmallAllocBytes = 1 << 16;
+
+size_t EstimateEncoderMemory(j_compress_ptr cinfo) {
+  CheckState(cinfo, kEncStart);
+  jpeg_comp_master* m = cinfo->master;
+  jpegli_memory_stats stats;
+  GetMemoryStats(reinterpret_cast<j_common_ptr>(cinfo), &stats);
+  if (cinfo->image_width < 1 || cinfo->image_height < 1 ||
+      cinfo->num_components < 1 ||
+      cinfo->num_components > static_cast<int>(kMaxComponents)) {
+    return stats.current_bytes;
+  }
+  int max_h_samp = 1;
+  int max_v_samp = 1;
+  if (cinfo->num_components > 1) {
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      const jpeg_component_info* comp = &cinfo->comp_info[c];
+      max_h_samp = std::max(max_h_samp, comp->h_samp_factor);
+      max_v_samp = std::max(max_v_samp, comp->v_samp_factor);
+    }
+  }
+  const size_t iMCU_width = DCTSIZE * max_h_samp;
+  const size_t iMCU_height = DCTSIZE * max_v_samp;
+  const size_t total_iMCU_cols = DivCeil(cinfo->image_width, iMCU_width);
+  const size_t total_iMCU_rows = DivCeil(cinfo->image_height, iMCU_height);
+  const size_t xsize_full = total_iMCU_cols * iMCU_width;
+  const size_t row_bytes = xsize_full * sizeof(float);
+  const size_t xsize_blocks = total_iMCU_cols * max_h_samp;
+  const size_t ysize_blocks = total_iMCU_rows * max_v_samp;
+  const bool multiscan = cinfo->scan_info != nullptr
+                             ? cinfo->num_scans > 1
+                             : m->progressive_level > 0;
+  const bool progressive =
+      cinfo->scan_info != nullptr
+          ? (cinfo->scan_info->Ss != 0 || cinfo->scan_info->Se != DCTSIZE2 - 1)
+          : m->progressive_level > 0;
+  const bool streaming = !multiscan && m->target_size == 0 &&
+                         m->butteraugli_target <= 0 &&
+                         !m->trellis_quantization_requested &&
+                         (m->psnr_target <= 0 || m->psnr_search_rows > 0);
+  const size_t num_psnr_search_rows =
+      streaming && m->psnr_target > 0
+          ? std::min<size_t>(m->psnr_search_rows, total_iMCU_rows)
+          : 0;
+  size_t estimate = stats.current_bytes + kEstimatedSmallAllocBytes;
+  // Input and downsampled rows.
+  const int num_all_components =
+      UseFusedInput(cinfo)
+          ? 1
+          : std::max(cinfo->input_components, cinfo->num_components);
+  estimate += num_all_components * 3 * iMCU_height * row_bytes;
+  if (cinfo->smoothing_factor) {
+    estimate += cinfo->num_components * 2 * row_bytes;
+  }
+  size_t num_blocks = 0;
+  size_t blocks_per_iMCU = 0;
+  bool sharp_downsampling = false;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    const int h_samp = cinfo->num_components > 1 ? comp->h_samp_factor : 1;
+    const int v_samp = cinfo->num_components > 1 ? comp->v_samp_factor : 1;
+    if (h_samp < 1 || v_samp < 1) {
+      return stats.current_bytes;
+    }
+    const size_t h_factor = max_h_samp / h_samp;
+    const size_t v_factor = max_v_samp / v_samp;
+    if (h_factor > 1 || v_factor > 1) {
+      estimate += 3 * v_samp * DCTSIZE * row_bytes / h_factor;
+      if (m->downsample_mode == JPEGLI_DOWNSAMPLE_SHARP && h_factor <= 2 &&
+          v_factor <= 2) {
+        sharp_downsampling = true;
+      }
+    }
+    num_blocks += DivCeil(DivCeil(cinfo->image_width, h_factor), DCTSIZE) *
+                  DivCeil(DivCeil(cinfo->image_height, v_factor), DCTSIZE);
+    blocks_per_iMCU += h_samp * v_samp;
+  }
+  if (sharp_downsampling) {
+    estimate += 4 * iMCU_height * row_bytes;
+  }
+  // Output buffer of the bit writer.
+  estimate += std::max<size_t>(1, num_psnr_search_rows) * total_iMCU_cols *
+                  blocks_per_iMCU * (DCTSIZE2 * 16 + 8) +
+              (1 << 16);
+  // Coefficients of the non-streaming passes, or of the iMCU rows of the
+  // streaming PSNR search.
+  if (!streaming) {
+    estimate += num_blocks * sizeof(JBLOCK);
+  } else if (num_psnr_search_rows > 0) {
+    estimate += num_blocks * sizeof(JBLOCK) * num_psnr_search_rows /
+                total_iMCU_rows;
+  }
+  // Tokens, unless the scans are tokenized again when they are written.
+  const bool two_pass =
+      m->two_pass_tokenization_requested && !streaming && !progressive;
+  if ((!streaming || cinfo->optimize_coding) && !two_pass) {
+    const size_t num_tokens = num_blocks * kEstimatedTokensPerBlock;
+    if (m->use_compact_tokens) {
+      // The packed tokens take less than half of the memory of the tokens.
+      estimate += num_tokens * sizeof(Token) / 2 +
+                  std::min(num_tokens, kNumStagingTokens) * sizeof(Token);
+    } else {
+      estimate += num_tokens * sizeof(Token);
+    }
+  }
+  // Adaptive quantization buffers and quant field.
+  if (m->use_adaptive_quantization) {
+    const bool deferred = IsDistanceSearch(cinfo) ||
+                          m->trellis_quantization_requested;
+    const size_t qf_rows = deferred ? ysize_blocks : max_v_samp;
+    if (m->quant_field_in != nullptr) {
+      // The quant field is not computed.
+    } else if (m->aq_mode == JPEGLI_AQ_FAST) {
+      estimate += (10 * max_v_samp + 4) * 2 * xsize_blocks * sizeof(float);
+    } else {
+      estimate += (6 * max_v_samp + 2) * 2 * xsize_blocks * sizeof(float);
+    }
+    estimate += qf_rows * xsize_blocks * sizeof(float);
+  }
+  return estimate;
+}
+
 }  // namespace jpegli
 
 //
@@ -659,6 +1441,7 @@ void jpegli_CreateCompress(j_compress_ptr cinfo, int version,
     JPEGLI_ERROR("jpegli_compress_struct has wrong size.");
   }
   jpegli::InitMemoryManager(reinterpret_cast<j_common_ptr>(cinfo));
+  jpegli::InitSimdTargets();
   cinfo->progress = nullptr;
   cinfo->is_decompressor = FALSE;
   cinfo->global_state = jpegli::kEncStart;
@@ -687,12 +1470,73 @@ void jpegli_CreateCompress(j_compress_ptr cinfo, int version,
   cinfo->master->force_baseline = true;
   cinfo->master->xyb_mode = false;
   cinfo->master->cicp_transfer_function = 2;  // unknown transfer function code
+  cinfo->master->tone_mapping_requested = false;
+  cinfo->master->alpha_blending_requested = false;
+  cinfo->master->input_rows_padded = false;
   cinfo->master->use_std_tables = false;
   cinfo->master->use_adaptive_quantization = true;
+  cinfo->master->aq_mode = JPEGLI_AQ_FULL;
+  cinfo->master->downsample_mode = JPEGLI_DOWNSAMPLE_BOX;
+  cinfo->master->fixed_point_dct_requested = false;
+  cinfo->master->use_fixed_point_dct = false;
+  cinfo->master->use_compact_tokens = false;
+  cinfo->master->two_pass_tokenization_requested = false;
+  cinfo->master->trellis_quantization_requested = false;
+  cinfo->master->use_trellis_quantization = false;
   cinfo->master->progressive_level = jpegli::kDefaultProgressiveLevel;
+  cinfo->master->optimize_scans = false;
+  cinfo->master->stream_dc_scan_requested = false;
+  cinfo->master->stream_dc_scan = false;
+  cinfo->master->gain_map = nullptr;
+  cinfo->master->gain_map_size = 0;
+  cinfo->master->write_restart_index = false;
+  cinfo->master->parallel_decode_segments = 0;
+  cinfo->master->restart_index_scan = -1;
+  cinfo->master->restart_index_bytes = 0;
+  cinfo->master->quant_field_in = nullptr;
+  cinfo->master->quant_field_in_stride = 0;
+  cinfo->master->quant_field_out = nullptr;
+  cinfo->master->quant_field_out_stride = 0;
+  cinfo->master->frame_max_drift = 0.0f;
+  cinfo->master->frame_keep_codes = false;
+  cinfo->master->frame_reuse = false;
+  cinfo->master->frame_tables = nullptr;
+  cinfo->master->frame_num_tables = 0;
+  cinfo->master->frame_num_components = 0;
+  cinfo->master->frame_data_precision = 0;
+  cinfo->master->frame_counts = nullptr;
+  cinfo->master->huffman_presets = nullptr;
+  cinfo->master->num_huffman_presets = 0;
   cinfo->master->data_type = JPEGLI_TYPE_UINT8;
   cinfo->master->endianness = JPEGLI_NATIVE_ENDIAN;
   cinfo->master->coeff_buffers = nullptr;
+  cinfo->master->runner = nullptr;
+  cinfo->master->runner_opaque = nullptr;
+  cinfo->master->context = nullptr;
+  cinfo->master->cancel_flag = nullptr;
+  memset(&cinfo->master->transform_backend, 0,
+         sizeof(cinfo->master->transform_backend));
+  memset(&cinfo->master->stage_stats, 0, sizeof(cinfo->master->stage_stats));
+  memset(&cinfo->master->encode_stats, 0, sizeof(cinfo->master->encode_stats));
+  cinfo->master->imcu_coeffs = nullptr;
+  cinfo->master->imcu_dc = nullptr;
+  cinfo->master->segment_data = nullptr;
+  cinfo->master->segment_data_size = 0;
+  cinfo->master->num_output_bytes = 0;
+  cinfo->master->entropy_coding_done = false;
+  cinfo->master->num_psnr_search_rows = 0;
+  cinfo->master->batch_encoder = nullptr;
+  cinfo->master->ladder_encoder = nullptr;
+  cinfo->master->tile_encoder = nullptr;
+  cinfo->master->ladder_leader = nullptr;
+  cinfo->master->ladder_followers = nullptr;
+  cinfo->master->num_ladder_followers = 0;
+  cinfo->master->step_units_done = 0;
+  cinfo->master->step_buffer = nullptr;
+  cinfo->master->step_buffer_size = 0;
+  cinfo->master->step_output_pos = 0;
+  cinfo->master->step_output_end = 0;
+  cinfo->master->step_scan_pending = false;
 }
 
 void jpegli_set_xyb_mode(j_compress_ptr cinfo) {
@@ -705,6 +1549,45 @@ void jpegli_set_cicp_transfer_function(j_compress_ptr cinfo, int code) {
   cinfo->master->cicp_transfer_function = code;
 }
 
+void jpegli_set_input_tone_mapping(j_compress_ptr cinfo,
+                                   const JpegliToneMapping* tone_mapping) {
+  CheckState(cinfo, jpegli::kEncStart);
+  jpeg_comp_master* m = cinfo->master;
+  if (tone_mapping == nullptr) {
+    m->tone_mapping_requested = false;
+    return;
+  }
+  if (tone_mapping->transfer_function != 16 &&
+      tone_mapping->transfer_function != 18) {
+    JPEGLI_ERROR("Invalid tone mapping transfer function %d",
+                 tone_mapping->transfer_function);
+  }
+  if (!(tone_mapping->target_peak > 0.0f) ||
+      (tone_mapping->transfer_function == 16 &&
+       !(tone_mapping->source_peak > 0.0f))) {
+    JPEGLI_ERROR("Invalid tone mapping peak luminance");
+  }
+  m->tone_mapping = *tone_mapping;
+  m->tone_mapping_requested = true;
+}
+
+void jpegli_set_input_alpha_background(j_compress_ptr cinfo,
+                                       const float background[3]) {
+  CheckState(cinfo, jpegli::kEncStart);
+  jpeg_comp_master* m = cinfo->master;
+  if (background == nullptr) {
+    m->alpha_blending_requested = false;
+    return;
+  }
+  for (int c = 0; c < 3; ++c) {
+    if (!(background[c] >= 0.0f && background[c] <= 1.0f)) {
+      JPEGLI_ERROR("Invalid alpha background value %f", background[c]);
+    }
+    m->alpha_background[c] = background[c];
+  }
+  m->alpha_blending_requested = true;
+}
+
 void jpegli_set_defaults(j_compress_ptr cinfo) {
   CheckState(cinfo, jpegli::kEncStart);
   jpegli::InitializeCompressParams(cinfo);
@@ -857,6 +1740,27 @@ void jpegli_set_psnr(j_compress_ptr cinfo, float psnr, float tolerance,
   cinfo->master->max_distance = max_distance;
 }
 
+void jpegli_set_psnr_search_rows(j_compress_ptr cinfo, int num_iMCU_rows) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->psnr_search_rows = num_iMCU_rows;
+}
+
+void jpegli_set_target_size(j_compress_ptr cinfo, size_t target_size,
+                            float min_distance, float max_distance) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->target_size = target_size;
+  cinfo->master->min_distance = min_distance;
+  cinfo->master->max_distance = max_distance;
+}
+
+void jpegli_set_butteraugli_target(j_compress_ptr cinfo, float target,
+                                   float min_distance, float max_distance) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->butteraugli_target = target;
+  cinfo->master->min_distance = min_distance;
+  cinfo->master->max_distance = max_distance;
+}
+
 void jpegli_set_quality(j_compress_ptr cinfo, int quality,
                         boolean force_baseline) {
   CheckState(cinfo, jpegli::kEncStart);
@@ -923,6 +1827,43 @@ void jpegli_enable_adaptive_quantization(j_compress_ptr cinfo, boolean value) {
   cinfo->master->use_adaptive_quantization = FROM_JXL_BOOL(value);
 }
 
+void jpegli_set_aq_mode(j_compress_ptr cinfo, JpegliAQMode mode) {
+  CheckState(cinfo, jpegli::kEncStart);
+  if (mode != JPEGLI_AQ_FULL && mode != JPEGLI_AQ_FAST) {
+    JPEGLI_ERROR("Invalid adaptive quantization mode %d", mode);
+  }
+  cinfo->master->aq_mode = mode;
+}
+
+void jpegli_set_downsample_mode(j_compress_ptr cinfo,
+                                JpegliDownsampleMode mode) {
+  CheckState(cinfo, jpegli::kEncStart);
+  if (mode != JPEGLI_DOWNSAMPLE_BOX && mode != JPEGLI_DOWNSAMPLE_SHARP) {
+    JPEGLI_ERROR("Invalid downsample mode %d", mode);
+  }
+  cinfo->master->downsample_mode = mode;
+}
+
+void jpegli_use_fixed_point_dct(j_compress_ptr cinfo, boolean value) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->fixed_point_dct_requested = FROM_JXL_BOOL(value);
+}
+
+void jpegli_use_compact_tokens(j_compress_ptr cinfo, boolean value) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->use_compact_tokens = FROM_JXL_BOOL(value);
+}
+
+void jpegli_use_two_pass_tokenization(j_compress_ptr cinfo, boolean value) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->two_pass_tokenization_requested = FROM_JXL_BOOL(value);
+}
+
+void jpegli_use_trellis_quantization(j_compress_ptr cinfo, boolean value) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->trellis_quantization_requested = FROM_JXL_BOOL(value);
+}
+
 void jpegli_simple_progression(j_compress_ptr cinfo) {
   CheckState(cinfo, jpegli::kEncStart);
   jpegli_set_progressive_level(cinfo, 2);
@@ -936,6 +1877,112 @@ void jpegli_set_progressive_level(j_compress_ptr cinfo, int level) {
   cinfo->master->progressive_level = level;
 }
 
+void jpegli_optimize_scans(j_compress_ptr cinfo, boolean value) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->optimize_scans = FROM_JXL_BOOL(value);
+}
+
+void jpegli_set_effort(j_compress_ptr cinfo, int effort) {
+  CheckState(cinfo, jpegli::kEncStart);
+  if (effort < 1 || effort > 9) {
+    JPEGLI_ERROR("Invalid effort %d", effort);
+  }
+  jpeg_comp_master* m = cinfo->master;
+  m->use_adaptive_quantization = effort >= 2;
+  m->aq_mode = effort <= 3 ? JPEGLI_AQ_FAST : JPEGLI_AQ_FULL;
+  m->fixed_point_dct_requested = effort == 1;
+  m->progressive_level = effort <= 4 ? 0 : effort == 5 ? 1 : 2;
+  m->optimize_scans = effort == 7 || effort == 9;
+  m->trellis_quantization_requested = effort >= 8;
+  cinfo->optimize_coding = TO_JXL_BOOL(effort >= 3);
+}
+
+void jpegli_stream_dc_scan(j_compress_ptr cinfo, boolean value) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->stream_dc_scan_requested = FROM_JXL_BOOL(value);
+}
+
+void jpegli_set_gain_map(j_compress_ptr cinfo, const JOCTET* data,
+                         size_t size) {
+  CheckState(cinfo, jpegli::kEncStart);
+  if (data != nullptr && size < 4) {
+    JPEGLI_ERROR("Invalid gain map size %u", static_cast<unsigned>(size));
+  }
+  cinfo->master->gain_map = data;
+  cinfo->master->gain_map_size = data != nullptr ? size : 0;
+}
+
+void jpegli_write_restart_index(j_compress_ptr cinfo, boolean value) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->write_restart_index = FROM_JXL_BOOL(value);
+}
+
+void jpegli_set_parallel_decode_target(j_compress_ptr cinfo, int segments) {
+  CheckState(cinfo, jpegli::kEncStart);
+  if (segments < 0) {
+    JPEGLI_ERROR("Invalid number of parallel decode segments %d", segments);
+  }
+  cinfo->master->parallel_decode_segments = segments;
+}
+
+void jpegli_set_quant_field(j_compress_ptr cinfo, const float* field,
+                            size_t stride) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->quant_field_in = field;
+  cinfo->master->quant_field_in_stride = field != nullptr ? stride : 0;
+}
+
+void jpegli_get_quant_field(j_compress_ptr cinfo, float* field,
+                            size_t stride) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->quant_field_out = field;
+  cinfo->master->quant_field_out_stride = field != nullptr ? stride : 0;
+}
+
+void jpegli_set_frame_sequence(j_compress_ptr cinfo, float max_cost_drift) {
+  CheckState(cinfo, jpegli::kEncStart);
+  if (max_cost_drift < 0.0f) {
+    JPEGLI_ERROR("Invalid max cost drift %f", max_cost_drift);
+  }
+  jpeg_comp_master* m = cinfo->master;
+  m->frame_max_drift = max_cost_drift;
+  m->frame_num_tables = 0;
+  if (max_cost_drift > 0.0f) {
+    jpegli_keep_image_memory(reinterpret_cast<j_common_ptr>(cinfo), TRUE);
+  }
+}
+
+void jpegli_set_huffman_presets(j_compress_ptr cinfo,
+                                const JpegliHuffmanPreset* presets,
+                                size_t num_presets) {
+  CheckState(cinfo, jpegli::kEncStart);
+  if (presets == nullptr) num_presets = 0;
+  for (size_t i = 0; i < num_presets; ++i) {
+    const JpegliHuffmanPreset& preset = presets[i];
+    for (int k = 0; k < 2; ++k) {
+      JHUFF_TBL table;
+      for (int is_dc = 0; is_dc < 2; ++is_dc) {
+        jpegli::PresetHuffmanTable(preset, k, is_dc, &table);
+        jpegli::ValidateHuffmanTable(reinterpret_cast<j_common_ptr>(cinfo),
+                                     &table, is_dc);
+        if (!jpegli::HasAllSymbols(table, is_dc, /*data_precision=*/8)) {
+          JPEGLI_ERROR("Incomplete %s Huffman table %d in preset %u",
+                       is_dc ? "DC" : "AC", k, static_cast<unsigned>(i));
+        }
+      }
+    }
+  }
+  cinfo->master->huffman_presets = presets;
+  cinfo->master->num_huffman_presets = num_presets;
+}
+
+void jpegli_set_parallel_runner(j_compress_ptr cinfo, JxlParallelRunner runner,
+                                void* runner_opaque) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->runner = runner;
+  cinfo->master->runner_opaque = runner_opaque;
+}
+
 void jpegli_set_input_format(j_compress_ptr cinfo, JpegliDataType data_type,
                              JpegliEndianness endianness) {
   CheckState(cinfo, jpegli::kEncStart);
@@ -959,6 +2006,11 @@ void jpegli_set_input_format(j_compress_ptr cinfo, JpegliDataType data_type,
   }
 }
 
+void jpegli_set_input_row_padding(j_compress_ptr cinfo, boolean padded) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->input_rows_padded = FROM_JXL_BOOL(padded);
+}
+
 #if JPEG_LIB_VERSION >= 70
 void jpegli_calc_jpeg_dimensions(j_compress_ptr cinfo) {
   // Since input scaling is not supported, we just copy the image dimensions.
@@ -1025,6 +2077,7 @@ void jpegli_start_compress(j_compress_ptr cinfo, boolean write_all_tables) {
   jpegli::InitCompress(cinfo, write_all_tables);
   cinfo->next_scanline = 0;
   cinfo->master->next_input_row = 0;
+  jpegli::ResetTileEncoder(cinfo);
 }
 
 void jpegli_write_coefficients(j_compress_ptr cinfo,
@@ -1122,10 +2175,8 @@ JDIMENSION jpegli_write_scanlines(j_compress_ptr cinfo, JSAMPARRAY scanlines,
     JPEGLI_ERROR("jpegli_write_raw_data() must be called for raw data mode.");
   }
   jpegli::ProgressMonitorInputPass(cinfo);
-  if (cinfo->global_state == jpegli::kEncHeader &&
-      jpegli::IsStreamingSupported(cinfo) && !cinfo->optimize_coding) {
-    jpegli::WriteFrameHeader(cinfo);
-    jpegli::WriteScanHeader(cinfo, 0);
+  if (cinfo->global_state == jpegli::kEncHeader) {
+    jpegli::WriteStreamedScanHeader(cinfo);
   }
   cinfo->global_state = jpegli::kEncReadImage;
   jpeg_comp_master* m = cinfo->master;
@@ -1146,8 +2197,17 @@ JDIMENSION jpegli_write_scanlines(j_compress_ptr cinfo, JSAMPARRAY scanlines,
   }
   float* rows[jpegli::kMaxComponents];
   for (size_t i = input_lag; i < num_lines; ++i) {
-    jpegli::ReadInputRow(cinfo, scanlines[i], rows);
-    (*m->color_transform)(rows, cinfo->image_width);
+    if (m->use_fused_input) {
+      jpegli::StageTimer timer(&m->stage_stats, JPEGLI_STAGE_READ_INPUT);
+      jpegli::ReadInputRowFused(cinfo, scanlines[i], rows);
+    } else {
+      {
+        jpegli::StageTimer timer(&m->stage_stats, JPEGLI_STAGE_READ_INPUT);
+        jpegli::ReadInputRow(cinfo, scanlines[i], rows);
+      }
+      jpegli::StageTimer timer(&m->stage_stats, JPEGLI_STAGE_COLOR_TRANSFORM);
+      (*m->color_transform)(rows, cinfo->image_width);
+    }
     jpegli::PadInputBuffer(cinfo, rows);
     jpegli::ProcessiMCURows(cinfo);
     if (!jpegli::EmptyBitWriterBuffer(&m->bw)) {
@@ -1165,10 +2225,8 @@ JDIMENSION jpegli_write_raw_data(j_compress_ptr cinfo, JSAMPIMAGE data,
     JPEGLI_ERROR("jpegli_write_raw_data(): raw data mode was not set");
   }
   jpegli::ProgressMonitorInputPass(cinfo);
-  if (cinfo->global_state == jpegli::kEncHeader &&
-      jpegli::IsStreamingSupported(cinfo) && !cinfo->optimize_coding) {
-    jpegli::WriteFrameHeader(cinfo);
-    jpegli::WriteScanHeader(cinfo, 0);
+  if (cinfo->global_state == jpegli::kEncHeader) {
+    jpegli::WriteStreamedScanHeader(cinfo);
   }
   cinfo->global_state = jpegli::kEncReadImage;
   jpeg_comp_master* m = cinfo->master;
@@ -1189,22 +2247,25 @@ JDIMENSION jpegli_write_raw_data(j_compress_ptr cinfo, JSAMPIMAGE data,
   }
   size_t iMCU_y = m->next_input_row / iMCU_height;
   float* rows[jpegli::kMaxComponents];
-  for (int c = 0; c < cinfo->num_components; ++c) {
-    JSAMPARRAY plane = data[c];
-    jpeg_component_info* comp = &cinfo->comp_info[c];
-    size_t xsize = comp->width_in_blocks * DCTSIZE;
-    size_t ysize = comp->v_samp_factor * DCTSIZE;
-    size_t y0 = iMCU_y * ysize;
-    auto& buffer = m->input_buffer[c];
-    for (size_t i = 0; i < ysize; ++i) {
-      rows[0] = buffer.Row(y0 + i);
-      if (plane[i] == nullptr) {
-        memset(rows[0], 0, xsize * sizeof(rows[0][0]));
-      } else {
-        (*m->input_method)(plane[i], xsize, rows);
+  {
+    jpegli::StageTimer timer(&m->stage_stats, JPEGLI_STAGE_READ_INPUT);
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      JSAMPARRAY plane = data[c];
+      jpeg_component_info* comp = &cinfo->comp_info[c];
+      size_t xsize = comp->width_in_blocks * DCTSIZE;
+      size_t ysize = comp->v_samp_factor * DCTSIZE;
+      size_t y0 = iMCU_y * ysize;
+      auto& buffer = m->input_buffer[c];
+      for (size_t i = 0; i < ysize; ++i) {
+        rows[0] = buffer.Row(y0 + i);
+        if (plane[i] == nullptr) {
+          memset(rows[0], 0, xsize * sizeof(rows[0][0]));
+        } else {
+          (*m->input_method)(plane[i], xsize, rows);
+        }
+        // We need a border of 1 repeated pixel for adaptive quant field.
+        buffer.PadRow(y0 + i, xsize, /*border=*/1);
       }
-      // We need a border of 1 repeated pixel for adaptive quant field.
-      buffer.PadRow(y0 + i, xsize, /*border=*/1);
     }
   }
   m->next_input_row += iMCU_height;
@@ -1216,45 +2277,120 @@ JDIMENSION jpegli_write_raw_data(j_compress_ptr cinfo, JSAMPIMAGE data,
   return iMCU_height;
 }
 
+JDIMENSION jpegli_write_planes(j_compress_ptr cinfo,
+                               const uint8_t* const planes[],
+                               const size_t strides[],
+                               JpegliPlaneLayout layout) {
+  CheckState(cinfo, jpegli::kEncHeader, jpegli::kEncReadImage);
+  if (!cinfo->raw_data_in) {
+    JPEGLI_ERROR("jpegli_write_planes(): raw data mode was not set");
+  }
+  if (layout == JPEGLI_PLANES_NV12) {
+    const jpeg_component_info* comp = cinfo->comp_info;
+    if (cinfo->num_components != 3 ||
+        comp[1].h_samp_factor != comp[2].h_samp_factor ||
+        comp[1].v_samp_factor != comp[2].v_samp_factor) {
+      JPEGLI_ERROR("NV12 planes need two components with the same sampling");
+    }
+  } else if (layout != JPEGLI_PLANES_SEPARATE) {
+    JPEGLI_ERROR("Unsupported plane layout %d", layout);
+  }
+  if (cinfo->global_state == jpegli::kEncHeader) {
+    jpegli::WriteStreamedScanHeader(cinfo);
+  }
+  cinfo->global_state = jpegli::kEncReadImage;
+  jpeg_comp_master* m = cinfo->master;
+  const size_t iMCU_height = DCTSIZE * cinfo->max_v_samp_factor;
+  const JDIMENSION prev_scanline = cinfo->next_scanline;
+  while (cinfo->next_scanline < cinfo->image_height) {
+    jpegli::ProgressMonitorInputPass(cinfo);
+    // After a suspension, the last iMCU row is already processed.
+    if (m->next_input_row <= cinfo->next_scanline) {
+      {
+        jpegli::StageTimer timer(&m->stage_stats, JPEGLI_STAGE_READ_INPUT);
+        jpegli::ReadPlanesiMCURow(cinfo, planes, strides, layout);
+      }
+      m->next_input_row += iMCU_height;
+      jpegli::ProcessiMCURows(cinfo);
+    }
+    if (!jpegli::EmptyBitWriterBuffer(&m->bw)) {
+      break;
+    }
+    cinfo->next_scanline =
+        std::min<size_t>(m->next_input_row, cinfo->image_height);
+  }
+  return cinfo->next_scanline - prev_scanline;
+}
+
 //
 // Non-streaming part
 //
 
-void jpegli_finish_compress(j_compress_ptr cinfo) {
+size_t jpegli_estimate_compressed_size(j_compress_ptr cinfo) {
   CheckState(cinfo, jpegli::kEncReadImage, jpegli::kEncWriteCoeffs);
   jpeg_comp_master* m = cinfo->master;
-  if (cinfo->next_scanline < cinfo->image_height) {
-    JPEGLI_ERROR("Incomplete image, expected %d rows, got %d",
-                 cinfo->image_height, cinfo->next_scanline);
-  }
-
-  if (cinfo->global_state == jpegli::kEncWriteCoeffs) {
-    // Zig-zag shuffle all the blocks. For non-transcoding case it was already
-    // done in EncodeiMCURow().
-    jpegli::ZigZagShuffleBlocks(cinfo);
+  jpegli::PrepareEntropyCoding(cinfo);
+  const bool bitstream_done = jpegli::IsStreamingSupported(cinfo) &&
+                              !FROM_JXL_BOOL(cinfo->optimize_coding);
+  size_t size = m->num_output_bytes;
+  if (bitstream_done) {
+    // The scan data is already coded, we only need to add what is still in
+    // the bit writer.
+    size += m->bw.pos - m->bw.output_pos;
+    size += jpegli::DivCeil(64 - m->bw.free_bits, 8);
+  } else {
+    int first_scan = 0;
+    if (m->stream_dc_scan) {
+      size += m->bw.pos - m->bw.output_pos;
+      size += jpegli::DivCeil(64 - m->bw.free_bits, 8);
+      first_scan = 1;
+    }
+    size += jpegli::FrameAndScanHeadersSize(cinfo);
+    for (int i = first_scan; i < cinfo->num_scans; ++i) {
+      size += jpegli::ScanDataSize(cinfo, i);
+    }
   }
-
-  if (m->psnr_target > 0) {
-    jpegli::QuantizetoPSNR(cinfo);
+  size += jpegli::RestartIndexSize(cinfo);
+  if (m->gain_map != nullptr) {
+    size += jpegli::kMPFMarkerSize + m->gain_map_size;
   }
+  return size + 2;  // EOI
+}
 
-  const bool tokens_done = jpegli::IsStreamingSupported(cinfo);
-  const bool bitstream_done =
-      tokens_done && !FROM_JXL_BOOL(cinfo->optimize_coding);
+void jpegli_finish_compress(j_compress_ptr cinfo) {
+  CheckState(cinfo, jpegli::kEncReadImage, jpegli::kEncWriteCoeffs);
+  jpeg_comp_master* m = cinfo->master;
+  jpegli::PrepareEntropyCoding(cinfo);
 
-  if (!tokens_done) {
-    jpegli::TokenizeJpeg(cinfo);
-  }
+  const bool bitstream_done = jpegli::IsStreamingSupported(cinfo) &&
+                              !FROM_JXL_BOOL(cinfo->optimize_coding);
 
-  if (cinfo->optimize_coding || cinfo->progressive_mode) {
-    jpegli::OptimizeHuffmanCodes(cinfo);
-    jpegli::InitEntropyCoder(cinfo);
+  // With a gain map, the rest of the image is collected in step_buffer, since
+  // the MPF marker that is written before it depends on its size. The marker
+  // size is counted already, so that the encode stats are correct.
+  jpeg_destination_mgr* dest = cinfo->dest;
+  const size_t mpf_pos = m->num_output_bytes - m->image_start_bytes;
+  if (m->gain_map != nullptr) {
+    m->num_output_bytes += jpegli::kMPFMarkerSize;
+    jpegli::RedirectToStepBuffer(cinfo);
   }
 
   if (!bitstream_done) {
-    jpegli::WriteFrameHeader(cinfo);
-    for (int i = 0; i < cinfo->num_scans; ++i) {
+    int first_scan = 0;
+    if (m->stream_dc_scan) {
+      // The frame header and the first scan are already written.
+      JumpToByteBoundary(&m->bw);
+      if (!EmptyBitWriterBuffer(&m->bw)) {
+        JPEGLI_ERROR("Output suspension is not supported in finish_compress");
+      }
+      first_scan = 1;
+    } else {
+      jpegli::WriteFrameHeader(cinfo);
+    }
+    for (int i = first_scan; i < cinfo->num_scans; ++i) {
+      jpegli::CheckCancelFlag(cinfo);
       jpegli::WriteScanHeader(cinfo, i);
+      jpegli::StageTimer timer(&m->stage_stats, JPEGLI_STAGE_WRITE_SCANS);
       jpegli::WriteScanData(cinfo, i);
     }
   } else {
@@ -1264,13 +2400,81 @@ void jpegli_finish_compress(j_compress_ptr cinfo) {
     }
   }
 
+  jpegli::EncodeRestartIndex(cinfo);
   jpegli::WriteOutput(cinfo, {0xFF, 0xD9});  // EOI
+  jpegli::FinishEncodeStats(cinfo);
+
+  if (m->gain_map != nullptr) {
+    cinfo->dest = dest;
+    const size_t tail_size = m->step_buffer_size - m->step_dest.free_in_buffer;
+    const size_t image_size = m->num_output_bytes - m->image_start_bytes;
+    if (image_size > 0xffffffffu || m->gain_map_size > 0xffffffffu) {
+      JPEGLI_ERROR("Image is too large for the MPF index.");
+    }
+    m->num_output_bytes -= jpegli::kMPFMarkerSize + tail_size;
+    jpegli::EncodeMPF(cinfo, image_size, m->gain_map_size, mpf_pos);
+    jpegli::WriteOutput(cinfo, m->step_buffer, tail_size);
+    jpegli::WriteOutput(cinfo, m->gain_map, m->gain_map_size);
+  }
   (*cinfo->dest->term_destination)(cinfo);
 
   // Release memory and reset global state.
   jpegli_abort_compress(cinfo);
 }
 
+JpegliStepStatus jpegli_encode_step(j_compress_ptr cinfo, int budget) {
+  if (cinfo->global_state == jpegli::kEncHeader ||
+      (cinfo->global_state == jpegli::kEncReadImage &&
+       cinfo->next_scanline < cinfo->image_height)) {
+    return JPEGLI_STEP_NEED_INPUT;
+  }
+  CheckState(cinfo, jpegli::kEncReadImage, jpegli::kEncWriteCoeffs);
+  if (budget <= 0) {
+    JPEGLI_ERROR("jpegli_encode_step: invalid budget %d", budget);
+  }
+  jpeg_comp_master* m = cinfo->master;
+  if (m->gain_map != nullptr) {
+    JPEGLI_ERROR("jpegli_encode_step: gain maps are not supported");
+  }
+  jpeg_destination_mgr* dest = cinfo->dest;
+  for (;;) {
+    while (m->step_output_pos < m->step_output_end) {
+      if (dest->free_in_buffer == 0 && !(*dest->empty_output_buffer)(cinfo)) {
+        return JPEGLI_STEP_NEED_OUTPUT;
+      }
+      size_t len = std::min<size_t>(dest->free_in_buffer,
+                                    m->step_output_end - m->step_output_pos);
+      memcpy(dest->next_output_byte, m->step_buffer + m->step_output_pos, len);
+      m->step_output_pos += len;
+      dest->free_in_buffer -= len;
+      dest->next_output_byte += len;
+    }
+    if (m->step_scan_pending) {
+      jpegli::StageTimer timer(&m->stage_stats, JPEGLI_STAGE_WRITE_SCANS);
+      if (!jpegli::ResumeScanData(cinfo)) {
+        return JPEGLI_STEP_NEED_OUTPUT;
+      }
+      m->step_scan_pending = false;
+    }
+    if (m->step_units_done == jpegli::NumStepUnits(cinfo)) {
+      break;
+    }
+    if (budget == 0) {
+      return JPEGLI_STEP_YIELD;
+    }
+    --budget;
+    jpegli::WriteStepUnit(cinfo);
+  }
+  (*dest->term_destination)(cinfo);
+  jpegli_abort_compress(cinfo);
+  return JPEGLI_STEP_DONE;
+}
+
+void jpegli_get_encode_stats(j_compress_ptr cinfo,
+                             struct jpegli_encode_stats* stats) {
+  *stats = cinfo->master->encode_stats;
+}
+
 void jpegli_abort_compress(j_compress_ptr cinfo) {
   jpegli_abort(reinterpret_cast<j_common_ptr>(cinfo));
 }
@@ -22,8 +22,10 @@
 #define LIB_JPEGLI_ENCODE_H_
 
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/types.h"
 
@@ -39,9 +41,24 @@ void jpegli_CreateCompress(j_compress_ptr cinfo, int version,
 
 void jpegli_stdio_dest(j_compress_ptr cinfo, FILE* outfile);
 
+// Writes the output to the file descriptor fd, which is neither closed nor
+// synced, in batches of 1 MiB.
+void jpegli_fd_dest(j_compress_ptr cinfo, int fd);
+
 void jpegli_mem_dest(j_compress_ptr cinfo, unsigned char** outbuffer,
                      unsigned long* outsize /* NOLINT */);
 
+// Writes the output to outfile like jpegli_stdio_dest(), but on a helper
+// thread, so that the encoder continues into the next free one of a ring of
+// num_buffers (at least 2) buffers of 256 KiB while the filled ones are
+// written, e.g. for large progressive outputs on slow disks. At most
+// num_buffers - 1 buffers are in flight, and jpegli_finish_compress() returns
+// after all of them are written. The thread is stopped when cinfo is
+// destroyed or another file is set as destination, and outfile must stay open
+// until then.
+void jpegli_writebehind_dest(j_compress_ptr cinfo, FILE* outfile,
+                             int num_buffers);
+
 void jpegli_set_defaults(j_compress_ptr cinfo);
 
 void jpegli_default_colorspace(j_compress_ptr cinfo);
@@ -101,6 +118,15 @@ void jpegli_write_coefficients(j_compress_ptr cinfo,
 
 void jpegli_finish_compress(j_compress_ptr cinfo);
 
+// Returns the size in bytes of the output that jpegli_finish_compress() would
+// produce, computed from the Huffman code lengths of the tokens without
+// writing the entropy coded data. The zero bytes stuffed after 0xFF bytes in
+// the entropy coded data are not included (these are usually less than 1% of
+// the scan data), unless the scan data was already written in streaming mode.
+// Can be called after all the image data is provided and before
+// jpegli_finish_compress(), which can still be called afterwards.
+size_t jpegli_estimate_compressed_size(j_compress_ptr cinfo);
+
 void jpegli_abort_compress(j_compress_ptr cinfo);
 
 void jpegli_destroy_compress(j_compress_ptr cinfo);
@@ -126,6 +152,29 @@ float jpegli_quality_to_distance(int quality);
 void jpegli_set_psnr(j_compress_ptr cinfo, float psnr, float tolerance,
                      float min_distance, float max_distance);
 
+// Makes the distance parameter search of jpegli_set_psnr() use only the first
+// num_iMCU_rows iMCU rows of the image, which enables streaming encoding
+// with a psnr target. The psnr target is then met only approximately for the
+// whole image. A value of 0 (the default) searches over the whole image.
+void jpegli_set_psnr_search_rows(j_compress_ptr cinfo, int num_iMCU_rows);
+
+// Enables distance parameter search to get the compressed size close to, but
+// preferably not above, the given target size in bytes. The search is done on
+// the stored DCT coefficients using an estimate of the entropy coded size, so
+// the image is transformed only once. Can not be combined with
+// jpegli_set_psnr().
+void jpegli_set_target_size(j_compress_ptr cinfo, size_t target_size,
+                            float min_distance, float max_distance);
+
+// Enables distance parameter search to get the butteraugli distance of the
+// compressed image close to, but preferably not above, the given target. The
+// search uses a perceptual error estimate computed on the stored DCT
+// coefficients, which is calibrated to match the distance parameter on
+// textured content, so no decoding is needed. Can not be combined with
+// jpegli_set_psnr() or jpegli_set_target_size().
+void jpegli_set_butteraugli_target(j_compress_ptr cinfo, float target,
+                                   float min_distance, float max_distance);
+
 // Changes the default behaviour of the encoder in the selection of quantization
 // matrices and chroma subsampling. Must be called before jpegli_set_defaults()
 // because some default setting depend on the XYB mode.
@@ -137,18 +186,255 @@ void jpegli_set_xyb_mode(j_compress_ptr cinfo);
 // quantization tables.
 void jpegli_set_cicp_transfer_function(j_compress_ptr cinfo, int code);
 
+// Tone maps the PQ or HLG encoded RGB input rows to sRGB encoded SDR rows
+// right after they are read, so that an SDR JPEG can be encoded from an HDR
+// source without a separate pass over the image. The settings are copied, and
+// nullptr disables the tone mapping. The input color space must be an RGB
+// color space, and it can not be combined with jpegli_write_raw_data(). The
+// transfer function of the output is sRGB, so
+// jpegli_set_cicp_transfer_function() should not be called.
+void jpegli_set_input_tone_mapping(j_compress_ptr cinfo,
+                                   const JpegliToneMapping* tone_mapping);
+
+// Composites the input rows onto an opaque background color with their alpha
+// channel right after they are read and tone mapped, so that an image with
+// transparency can be encoded without a separate blending pass over it. The
+// input color space must be JCS_EXT_RGBA, JCS_EXT_BGRA, JCS_EXT_ARGB or
+// JCS_EXT_ABGR, and it can not be combined with jpegli_write_raw_data(). The
+// background has red, green and blue values in the [0.0, 1.0] range and is
+// copied; nullptr disables the blending, in which case the alpha channel is
+// ignored.
+void jpegli_set_input_alpha_background(j_compress_ptr cinfo,
+                                       const float background[3]);
+
 void jpegli_set_input_format(j_compress_ptr cinfo, JpegliDataType data_type,
                              JpegliEndianness endianness);
 
+// Declares whether the rows passed to jpegli_write_scanlines() can be read for
+// JPEGLI_ROW_PADDING bytes past their last pixel, e.g. because their stride
+// is at least that much larger than the row size. The input conversion then
+// converts whole vectors up to the end of each row instead of converting the
+// last pixels one by one. The default is FALSE.
+void jpegli_set_input_row_padding(j_compress_ptr cinfo, boolean padded);
+
+// Writes the raw data of the image, or the rest of it after a suspension,
+// reading the samples of the input data type in place from planes, without
+// row pointer arrays. Raw data mode (cinfo->raw_data_in) must be set.
+// planes[c] points to the first row of the samples of component c, which has
+// comp_info[c].downsampled_width x downsampled_height samples, and strides[c]
+// is the distance between its rows in bytes. Unlike with
+// jpegli_write_raw_data(), the planes are padded to the block boundaries by
+// repeating their last column and row. With JPEGLI_PLANES_NV12, planes[1]
+// holds the interleaved samples of the second and third components, and
+// planes[2] is not used. Returns the number of lines written, which is less
+// than the number of remaining lines only if the destination suspended.
+JDIMENSION jpegli_write_planes(j_compress_ptr cinfo,
+                               const uint8_t* const planes[],
+                               const size_t strides[],
+                               JpegliPlaneLayout layout);
+
+// Writes a tile of the image instead of its rows with
+// jpegli_write_scanlines(). The tile has xsize x ysize pixels with their top
+// left corner at (x, y), in rows of stride bytes of interleaved samples in
+// the input format. The tiles can be written in any order and from several
+// threads at once, but must not overlap, and together they must cover the
+// image. They are copied to buffers of one iMCU row each, and the thread
+// that completes the next iMCU row in image order compresses it and the
+// complete ones after it, exactly as with jpegli_write_scanlines(), while
+// the other threads keep writing tiles. Only the iMCU rows that are not yet
+// compressed are buffered. The destination must not suspend, the errors are
+// reported on the thread that detects them, and the tiles must not be written
+// from the threads of the parallel runner of cinfo. This is a jpegli
+// extension that is not available in libjpeg.
+void jpegli_write_tile(j_compress_ptr cinfo, JDIMENSION x, JDIMENSION y,
+                       JDIMENSION xsize, JDIMENSION ysize, const void* pixels,
+                       size_t stride);
+
 // Sets whether or not the encoder uses adaptive quantization for creating more
 // zero coefficients based on the local properties of the image.
 // Enabled by default.
 void jpegli_enable_adaptive_quantization(j_compress_ptr cinfo, boolean value);
 
+// Sets how the quant field of the adaptive quantization is computed. With
+// JPEGLI_AQ_FAST it is estimated from a 2x downsampled luma plane and simple
+// per-block statistics, which is several times faster than the default
+// JPEGLI_AQ_FULL mode, but gives slightly larger output at the same
+// distortion. Has no effect if adaptive quantization is disabled.
+void jpegli_set_aq_mode(j_compress_ptr cinfo, JpegliAQMode mode);
+
+// Sets how the encoder downsamples the components with a lower sampling
+// factor. JPEGLI_DOWNSAMPLE_BOX, the default, averages the input samples.
+// JPEGLI_DOWNSAMPLE_SHARP refines the averages so that the triangle filter
+// upsampling of the decoders gets closer to the input, which keeps more of
+// the sharpness of the chroma edges with 4:2:0 and 4:2:2 subsampling at a
+// small constant cost per downsampled sample. It is used only for the
+// downsampling ratios of at most two in each direction, the others are
+// always box filtered.
+void jpegli_set_downsample_mode(j_compress_ptr cinfo,
+                                JpegliDownsampleMode mode);
+
+// Sets whether or not the encoder computes the DCT in 16-bit fixed point
+// arithmetic, which is faster but slightly less precise than the default
+// floating point DCT. It only has an effect for 8-bit input when adaptive
+// quantization is disabled and XYB mode is not used. Disabled by default.
+void jpegli_use_fixed_point_dct(j_compress_ptr cinfo, boolean value);
+
+// Sets whether or not the encoder stores the tokens of the non-streaming
+// entropy coding in a packed variable length representation, which needs
+// about half as much memory but is slower to write. The output does not
+// depend on this setting. Disabled by default.
+void jpegli_use_compact_tokens(j_compress_ptr cinfo, boolean value);
+
+// Sets whether or not the encoder tokenizes the scans of sequential images
+// twice when the image can not be encoded in a streaming way, once for the
+// Huffman code optimization and once for writing the scan, instead of storing
+// the tokens in between. This takes less memory but more time; the output
+// does not depend on this setting. Disabled by default.
+void jpegli_use_two_pass_tokenization(j_compress_ptr cinfo, boolean value);
+
+// Sets whether or not the encoder chooses the quantized values of the AC
+// coefficients with a rate-distortion optimization, which trades the weighted
+// quantization error of each block against the number of bits of its Huffman
+// coding, instead of rounding them with a deadzone. This gives smaller output
+// at about the same distortion, but needs the coefficients of the whole image
+// to be buffered and takes more time. With a PSNR or size target, the chosen
+// quantization tables are applied this way. Has no effect with
+// jpegli_write_coefficients(). Disabled by default.
+void jpegli_use_trellis_quantization(j_compress_ptr cinfo, boolean value);
+
 // Sets the default progression parameters, where level 0 is sequential, and
 // greater level value means more progression steps. Default is 2.
 void jpegli_set_progressive_level(j_compress_ptr cinfo, int level);
 
+// Sets whether or not the encoder replaces the default progressive scan
+// script with the one of a set of candidate scripts, which differ in the
+// spectral band split and the successive approximation of the AC scans of
+// each component, that has the smallest estimated size for the quantized
+// coefficients of the image. The estimate is computed from symbol histograms
+// without encoding the candidate scans. Has no effect on sequential images
+// and on images with a scan script set by the application. Disabled by
+// default.
+void jpegli_optimize_scans(j_compress_ptr cinfo, boolean value);
+
+// Sets the speed related encoder settings to one of the following tested
+// combinations, where a higher effort gives smaller output at the same
+// distortion but is slower:
+//
+//   effort  adaptive quant.  DCT          progressive  Huffman   other
+//   1       off              fixed point  sequential   fixed
+//   2       fast             float        sequential   fixed
+//   3       fast             float        sequential   optimized
+//   4       full             float        sequential   optimized
+//   5       full             float        level 1      optimized
+//   6       full             float        level 2      optimized
+//   7       full             float        level 2      optimized optimize_scans
+//   8       full             float        level 2      optimized trellis
+//   9       full             float        level 2      optimized trellis,
+//                                                                optimize_scans
+//
+// This overrides the settings of jpegli_enable_adaptive_quantization(),
+// jpegli_set_aq_mode(), jpegli_use_fixed_point_dct(),
+// jpegli_set_progressive_level(), jpegli_optimize_scans(),
+// jpegli_use_trellis_quantization() and cinfo->optimize_coding, which can
+// still be changed individually afterwards. Since jpegli_set_defaults() resets
+// optimize_coding, it must be called after jpegli_set_defaults(). Effort 6
+// matches the defaults of cjpegli.
+void jpegli_set_effort(j_compress_ptr cinfo, int effort);
+
+// Sets whether or not the first scan of a progressive image is written while
+// the input is read, instead of in jpegli_finish_compress(), if it is a DC
+// scan of all components. The DC coefficients of this scan are coded with the
+// Huffman tables in cinfo->dc_huff_tbl_ptrs, the rest of the scans are coded
+// as usual. With the default scan script, the DC scan is made interleaved
+// for this if the MCU size allows it. Has no effect on sequential images and
+// with a PSNR or size target. Disabled by default.
+void jpegli_stream_dc_scan(j_compress_ptr cinfo, boolean value);
+
+// Sets the compressed gain map image, e.g. of an Ultra HDR image, that is
+// written after the EOI marker of each subsequent image, and referenced from a
+// Multi-Picture Format (MPF) index in an APP2 marker that is written after the
+// markers of the application and before the frame header. The data must be
+// valid until jpegli_finish_compress(), and a nullptr data removes the gain
+// map. Since the MPF index depends on the size of the scans, the whole output
+// of the image is written by jpegli_finish_compress() then, and it can not be
+// used with jpegli_encode_step().
+void jpegli_set_gain_map(j_compress_ptr cinfo, const JOCTET* data,
+                         size_t size);
+
+// Sets whether or not a restart index is written before the EOI marker of each
+// subsequent sequential image with restart markers. The index is an APP10
+// segment with the "JPEGLI_RSTIDX" tag, followed by the offsets of the restart
+// intervals of each scan in the format of jpegli_get_restart_index(), and the
+// size of the segment as a little endian 32-bit value, so that it can be found
+// from the end of the image. The jpegli decoder reads it when the whole image
+// is in the input buffer after jpegli_read_header(), e.g. with
+// jpegli_mem_src(), to decode the restart intervals in parallel or only those
+// of a region without searching for the restart markers first; other decoders
+// ignore it. The index is not written if it would not fit into one segment.
+// Disabled by default.
+void jpegli_write_restart_index(j_compress_ptr cinfo, boolean value);
+
+// Sets the number of restart intervals that each scan of the subsequent images
+// is split into, so that a decoder can decode them in parallel. The restart
+// interval is then chosen per scan as the number of whole MCU rows that gives
+// at most this many intervals, within the limit of 65535 MCUs per interval,
+// and cinfo->restart_interval and cinfo->restart_in_rows are ignored. The
+// bytes of the restart markers are reported in jpegli_encode_stats. A value of
+// 0 (the default) turns this off.
+void jpegli_set_parallel_decode_target(j_compress_ptr cinfo, int segments);
+
+// Sets the adaptive quantization field of each subsequent image, which then
+// replaces the one that is computed from the luma channel. The field has one
+// value per 8x8 luma block, i.e. DivCeil(image_width, 8) values in each of
+// the DivCeil(image_height, 8) rows, with stride floats between the starts of
+// two rows. Larger values quantize more of the small coefficients of a block
+// to zero; a field written by jpegli_get_quant_field() for the same image and
+// quality reproduces the output of that encode, so re-encodes can skip the
+// adaptive quantization. The field must be valid until
+// jpegli_finish_compress(), and a nullptr field switches back to computing
+// it. Has no effect if adaptive quantization is disabled, or with
+// subsampled luma.
+void jpegli_set_quant_field(j_compress_ptr cinfo, const float* field,
+                            size_t stride);
+
+// Sets the buffer that the adaptive quantization field of each subsequent
+// image is written to while the image is compressed, in the layout of
+// jpegli_set_quant_field(). The field must be valid until
+// jpegli_finish_compress(), and a nullptr field stops writing it. Nothing is
+// written if adaptive quantization is disabled, or with subsampled luma.
+void jpegli_get_quant_field(j_compress_ptr cinfo, float* field, size_t stride);
+
+// Turns on the frame sequence mode for the subsequent images, e.g. the frames
+// of a Motion-JPEG stream, which keeps the image memory between frames as
+// jpegli_keep_image_memory() does. A frame with optimize_coding whose only
+// scan is coded while the input is read (sequential mode, no distance search
+// or trellis quantization) keeps its optimized Huffman codes, extended to all
+// the symbols of its data precision, and the next such frames with the same
+// number of components and data precision are coded with these codes in a
+// single pass, as without optimize_coding. The cost drift of the kept codes
+// on such a frame is the relative size of its Huffman coded symbols and
+// tables over that with codes optimized for the frame; if it is larger than
+// max_cost_drift, the next frame optimizes its codes again. A max_cost_drift
+// of 0 turns the frame sequence mode off. The drift of each frame is reported
+// in jpegli_encode_stats.
+void jpegli_set_frame_sequence(j_compress_ptr cinfo, float max_cost_drift);
+
+// Sets the Huffman tables that subsequent 8-bit sequential images without
+// optimize_coding are coded with instead of the tables of the compressor,
+// e.g. tables derived offline from a corpus of images encoded at the given
+// distances. These keep the single pass streaming of fixed tables, with an
+// output size close to that of optimize_coding. The first of the
+// num_presets presets, in order of increasing max_distance, whose distance
+// and sampling match the image is used; the distance is that of the
+// quantization tables, as set by jpegli_set_distance() or
+// jpegli_set_quality(). If no preset matches, the tables of the compressor
+// are used. Each table must have a code for every symbol that can occur in
+// 8-bit images. The presets must be valid until the last image that uses
+// them is finished, and nullptr turns them off.
+void jpegli_set_huffman_presets(j_compress_ptr cinfo,
+                                const JpegliHuffmanPreset* presets,
+                                size_t num_presets);
+
 // If this function is called before starting compression, the quality and
 // linear quality parameters will be used to scale the standard quantization
 // tables from Annex K of the JPEG standard. By default jpegli uses a different
@@ -156,6 +442,173 @@ void jpegli_set_progressive_level(j_compress_ptr cinfo, int level);
 // AC coefficients. Must be called before jpegli_set_defaults().
 void jpegli_use_standard_quant_tables(j_compress_ptr cinfo);
 
+// Sets the parallel runner that is used to process the image data of an iMCU
+// row on multiple threads. The runner is used in all subsequent compressions
+// with this compressor object, a nullptr runner switches back to single
+// threaded processing. The compressed output does not depend on the runner.
+void jpegli_set_parallel_runner(j_compress_ptr cinfo, JxlParallelRunner runner,
+                                void* runner_opaque);
+
+// Writes the compressed output to a list of chunks, which are filled one
+// after the other and are never copied or reallocated. The first chunk is
+// buffer if it is not nullptr and buffer_size is not 0, the others are
+// allocated by the library. The size of the first allocated chunk is
+// expected_size minus the size of the caller supplied buffer if that is
+// larger, e.g. the output of jpegli_estimate_compressed_size() for similar
+// images, or a size computed from the image dimensions if expected_size is 0;
+// then the total size at least doubles with each chunk.
+void jpegli_chunked_dest(j_compress_ptr cinfo, unsigned char* buffer,
+                         size_t buffer_size, size_t expected_size);
+
+// Sets *chunks to the chunks of the output written by jpegli_chunked_dest(),
+// and returns their number. The chunks are valid until the next image is
+// started or cinfo is destroyed, and their sizes are the number of bytes
+// written to them.
+size_t jpegli_get_output_chunks(j_compress_ptr cinfo,
+                                const JpegliOutputChunk** chunks);
+
+// Does the work of jpegli_finish_compress() in steps, for event loops and
+// coroutines that interleave many images on one thread, with a destination
+// manager that may suspend. Each step does at most budget units of work, where
+// the entropy coding setup, the frame header and each scan are one unit, and
+// returns JPEGLI_STEP_YIELD when the budget is used up. When the destination
+// suspends, JPEGLI_STEP_NEED_OUTPUT is returned and the next step continues
+// where this one stopped. The scan data is written directly to the destination,
+// so only the markers of a unit and a bounded part of the scan data are kept
+// in memory while it suspends (all the scan data with two pass tokenization).
+// Returns JPEGLI_STEP_NEED_INPUT while not all the scanlines were written, and
+// JPEGLI_STEP_DONE when the image is finished and cinfo is back in its start
+// state, as after jpegli_finish_compress().
+JpegliStepStatus jpegli_encode_step(j_compress_ptr cinfo, int budget);
+
+// Compresses num_images images with the parameters of cinfo, e.g. many small
+// thumbnails, without setting up a compressor for each of them. The
+// parameters, quantization and Huffman tables are set up as for
+// jpegli_start_compress(), except that the image dimensions are taken from
+// images[i] and raw data input is not supported; cinfo itself stays in its
+// start state and its destination manager is not used. The ith image is
+// written to outputs[i], whose data the caller must free(). The images are
+// compressed by worker compressors that are kept for later batches and reuse
+// their buffers between images; with a parallel runner, the images are
+// spread over its threads, one worker per thread. If an image fails, all
+// outputs are freed and the error is reported on cinfo.
+void jpegli_encode_batch(j_compress_ptr cinfo, const JpegliImageDesc* images,
+                         size_t num_images, JpegliBatchOutput* outputs);
+
+// Compresses one image at several distances and sampling factors, e.g. the
+// renditions of an adaptive streaming ladder, with the other parameters of
+// cinfo as in jpegli_encode_batch(). The ith rendition is written to
+// outputs[i], whose data the caller must free(). The input rows are read,
+// color transformed, smoothed and downsampled once for all the rungs with the
+// same sampling factors, and each rung only computes its own adaptive
+// quantization field, coefficients and entropy coded data from them. The
+// rungs are compressed on the calling thread by compressors that are kept for
+// later calls. Distance search (jpegli_set_psnr(), jpegli_set_target_size(),
+// jpegli_set_butteraugli_target()) is not supported. If a rung fails, all
+// outputs are freed and the error is reported on cinfo.
+void jpegli_encode_ladder(j_compress_ptr cinfo, const JpegliImageDesc* image,
+                          const JpegliLadderRung* rungs, size_t num_rungs,
+                          JpegliBatchOutput* outputs);
+
+// Losslessly transcodes the JPEG image of srcinfo, which must have a source
+// manager that does not suspend and must not have read the header yet, to
+// dstinfo, which must have a destination manager. The critical parameters
+// are copied with jpegli_copy_critical_parameters(), then the coefficients
+// that are read with jpegli_read_coefficients() are coded in place, without
+// a second copy, with the scan structure and Huffman codes of the options.
+// If the options have a transform or a crop region, the coefficients are
+// first transformed, in the DCT domain, into new coefficient arrays of the
+// output. With a nullptr options, the progressive mode of the input is kept,
+// the Huffman codes are optimized and the markers are copied.
+void jpegli_transcode(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+                      const JpegliTranscodeOptions* options);
+
+// Losslessly re-codes the JPEG image of srcinfo, with the same requirements as
+// jpegli_transcode(), to dstinfo with optimized Huffman codes, keeping its
+// markers and scan structure. The whole input must be in the buffer of the
+// source manager, as with jpegli_mem_src(). The entropy coded data is decoded
+// twice straight from the input, first into the symbol histograms of each
+// scan and then to write the symbols again with the new codes of the scan,
+// without storing the coefficients. Images with arithmetic coding or AC
+// refinement scans, or an input that is not in memory, are transcoded with
+// jpegli_transcode() instead.
+void jpegli_optimize_huffman(j_decompress_ptr srcinfo, j_compress_ptr dstinfo);
+
+// Writes the markers of srcinfo that were saved with jpegli_save_markers() to
+// dstinfo, in the order of the input and with their payload as it is, e.g. the
+// Exif, XMP and ICC profile chunks of an image that is re-encoded. The JFIF and
+// Adobe markers are not copied if dstinfo writes its own. Must be called
+// between jpegli_start_compress() or jpegli_write_coefficients() and the first
+// jpegli_write_scanlines(), like jpegli_write_marker().
+void jpegli_copy_markers(j_decompress_ptr srcinfo, j_compress_ptr dstinfo);
+
+// Transcodes the 8-bit JPEG image of srcinfo, with the same requirements as
+// jpegli_transcode(), to a downscaled JPEG image of dstinfo, without decoding
+// the full size image. Each block of the input is converted to one block of
+// 8 / scale_denom by 8 / scale_denom samples of the output with an inverse
+// DCT of its lowest frequency coefficients, or only its DC coefficient for a
+// scale_denom of 8; the sampling factors and the color space of the input are
+// kept. The samples are then compressed as raw data with the quantization of
+// the encoder. With a nullptr options, the image is downscaled by 8 with the
+// default quality, the progressive mode of the input is kept and the markers
+// are copied.
+void jpegli_transcode_scaled(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+                             const JpegliScaledTranscodeOptions* options);
+
+// Re-encodes the JPEG image of srcinfo, with the same requirements as
+// jpegli_transcode(), to dstinfo with the quality of the options, optionally
+// resized with jpegli_set_output_size(). The decoded rows are passed to the
+// encoder in strips of options->strip_height rows, so the decoded image is
+// never held in memory as a whole. Each stage uses the parallel runner of its
+// own object, if it has one. The chroma subsampling and the color space of the
+// input are kept; images with 12-bit data precision are passed to the encoder
+// as 16-bit samples. With a nullptr options, the image keeps its size and the
+// default quality, the progressive mode of the input is kept and the markers
+// are copied.
+void jpegli_recompress(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+                       const JpegliRecompressOptions* options);
+
+// Number of scans whose size is reported in jpegli_encode_stats.
+#define JPEGLI_MAX_SCAN_STATS 64
+
+struct jpegli_encode_stats {
+  // Size of the compressed image in bytes, including all the markers.
+  size_t total_bytes;
+  int num_scans;
+  // Size of each of the first JPEGLI_MAX_SCAN_STATS scans, from the tables
+  // written before its SOS marker to the end of its entropy coded data.
+  size_t scan_bytes[JPEGLI_MAX_SCAN_STATS];
+  // Number of Huffman coded tokens of the scans that were counted for the
+  // optimized Huffman codes, 0 if the Huffman codes were not optimized.
+  size_t num_tokens;
+  // Number of Huffman tables written, which is the number of clusters of the
+  // token histograms with optimized Huffman codes.
+  int num_huffman_tables;
+  // Average of the adaptive quantization field over the luma blocks, 0 if
+  // adaptive quantization is not used.
+  float average_quant_field;
+  // Distance chosen by the distance search of jpegli_set_psnr(),
+  // jpegli_set_target_size() or jpegli_set_butteraugli_target(), 0 if there
+  // was no search.
+  float search_distance;
+  // In the frame sequence mode of jpegli_set_frame_sequence(), 1 if the image
+  // was coded with the Huffman codes of an earlier frame, and then the cost
+  // drift of these codes, 0 otherwise.
+  int reused_huffman_codes;
+  float huffman_cost_drift;
+  // Size of the DRI and RSTn markers of the restart intervals. The padding of
+  // the entropy coded data before each RSTn marker and the cost of the reset
+  // DC predictions are not included.
+  size_t restart_marker_bytes;
+};
+
+// Fills in *stats with the statistics of the last image that was finished
+// with jpegli_finish_compress() or jpegli_encode_step(), which are collected
+// while the image is compressed at a negligible cost. The images of
+// jpegli_encode_batch() are not included.
+void jpegli_get_encode_stats(j_compress_ptr cinfo,
+                             struct jpegli_encode_stats* stats);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -5,6 +5,7 @@
 // https://developers.google.com/open-source/licenses/bsd
 
 #include <algorithm>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
@@ -13,16 +14,28 @@
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include "hwy/targets.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/encode.h"
 #include "lib/jpegli/libjpeg_test_util.h"
+#include "lib/jpegli/stage_stats.h"
 #include "lib/jpegli/test_params.h"
 #include "lib/jpegli/test_utils.h"
 #include "lib/jpegli/testing.h"
 #include "lib/jpegli/types.h"
 
+#if defined(__unix__) || defined(__unix) || \
+    defined(__APPLE__) && defined(__MACH__)
+#include <unistd.h>
+#define JPEGLI_TEST_FD_DEST 1
+#else
+#define JPEGLI_TEST_FD_DEST 0
+#endif
+
 namespace jpegli {
 namespace {
 
@@ -72,68 +85,1293 @@ TEST_P(EncodeAPITestParam, TestAPI) {
   VerifyOutputImage(config.input, output, config.max_dist);
 }
 
-TEST(EncodeAPITest, ReuseCinfoSameImageTwice) {
-  TestImage input;
-  input.xsize = 129;
-  input.ysize = 73;
-  CompressParams jparams;
-  GenerateInput(PIXELS, jparams, &input);
+TEST(EncodeAPITest, ReuseCinfoSameImageTwice) {
+  TestImage input;
+  input.xsize = 129;
+  input.ysize = 73;
+  CompressParams jparams;
+  GenerateInput(PIXELS, jparams, &input);
+  uint8_t* buffer = nullptr;
+  unsigned long buffer_size = 0;  // NOLINT
+  std::vector<uint8_t> compressed0;
+  std::vector<uint8_t> compressed1;
+  jpeg_compress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_compress(&cinfo);
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    EncodeWithJpegli(input, jparams, &cinfo);
+    compressed0.assign(buffer, buffer + buffer_size);
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    EncodeWithJpegli(input, jparams, &cinfo);
+    compressed1.assign(buffer, buffer + buffer_size);
+    return true;
+  };
+  EXPECT_TRUE(try_catch_block());
+  jpegli_destroy_compress(&cinfo);
+  if (buffer) free(buffer);
+  ASSERT_EQ(compressed0.size(), compressed1.size());
+  EXPECT_EQ(0,
+            memcmp(compressed0.data(), compressed1.data(), compressed0.size()));
+}
+
+std::vector<TestConfig> GenerateBasicConfigs() {
+  std::vector<TestConfig> all_configs;
+  for (int samp : {1, 2}) {
+    for (int progr : {0, 2}) {
+      for (int optimize : {0, 1}) {
+        if (progr && optimize) continue;
+        TestConfig config;
+        config.input.xsize = 257 + samp * 37;
+        config.input.ysize = 265 + optimize * 17;
+        config.jparams.h_sampling = {samp, 1, 1};
+        config.jparams.v_sampling = {samp, 1, 1};
+        config.jparams.progressive_mode = progr;
+        config.jparams.optimize_coding = optimize;
+        config.max_dist = 2.4f;
+        GeneratePixels(&config.input);
+        all_configs.push_back(config);
+      }
+    }
+  }
+  return all_configs;
+}
+
+TEST(EncodeAPITest, ParallelRunnerSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  {
+    TestConfig config = all_configs[0];
+    config.jparams.xyb_mode = true;
+    all_configs.push_back(config);
+    config = all_configs[0];
+    config.jparams.use_adaptive_quantization = false;
+    all_configs.push_back(config);
+    config.jparams.use_fixed_point_dct = true;
+    all_configs.push_back(config);
+    config = all_configs[0];
+    config.jparams.restart_interval = 5;
+    all_configs.push_back(config);
+    config.jparams.optimize_coding = 1;
+    all_configs.push_back(config);
+    config.jparams.progressive_mode = 2;
+    all_configs.push_back(config);
+    config = all_configs[0];
+    config.jparams.restart_in_rows = 1;
+    all_configs.push_back(config);
+    config = all_configs[0];
+    config.jparams.progressive_mode = 1;
+    config.jparams.restart_interval = 7;
+    all_configs.push_back(config);
+    config = all_configs[0];
+    config.jparams.use_trellis_quantization = true;
+    all_configs.push_back(config);
+  }
+  for (const TestConfig& config : all_configs) {
+    std::vector<uint8_t> compressed0;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed0));
+    for (size_t num_threads : {1, 3, 8}) {
+      CompressParams jparams = config.jparams;
+      jparams.num_threads = num_threads;
+      std::vector<uint8_t> compressed1;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, jparams, &compressed1));
+      ASSERT_EQ(compressed0.size(), compressed1.size()) << jparams;
+      EXPECT_EQ(0, memcmp(compressed0.data(), compressed1.data(),
+                          compressed0.size()))
+          << jparams;
+    }
+  }
+}
+
+TEST(EncodeAPITest, SimdTargets) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (int64_t target : hwy::SupportedAndGeneratedTargets()) {
+    jpegli_set_simd_targets(target);
+    // The static target is kept even if the mask only has worse targets.
+    if (target <= HWY_STATIC_TARGET) {
+      EXPECT_STREQ(hwy::TargetName(target), jpegli_simd_target_name());
+    }
+    for (const TestConfig& config : all_configs) {
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+      TestImage output;
+      DecodeWithLibjpeg(config.jparams, DecompressParams(), compressed,
+                        &output);
+      VerifyOutputImage(config.input, output, config.max_dist);
+    }
+  }
+  jpegli_set_simd_targets(0);
+}
+
+// A forward transform backend with the reference DCT.
+boolean ReferenceForwardTransform(
+    void* opaque, JDIMENSION /*imcu_row*/, int num_components,
+    const JpegliForwardTransformComponent* components) {
+  ++*static_cast<size_t*>(opaque);
+  for (int c = 0; c < num_components; ++c) {
+    const JpegliForwardTransformComponent& fc = components[c];
+    for (int by = 0; by < fc.num_block_rows; ++by) {
+      for (JDIMENSION bx = 0; bx < fc.num_blocks; ++bx) {
+        const float* pixels =
+            fc.pixels + by * DCTSIZE * fc.pixels_stride + bx * DCTSIZE;
+        const float aq =
+            fc.aq_strength ? fc.aq_strength[by * fc.aq_stride + bx * fc.aq_step]
+                           : 0.0f;
+        int32_t* block = fc.coeffs + (by * fc.coeffs_stride + bx) * DCTSIZE2;
+        for (int v = 0; v < DCTSIZE; ++v) {
+          for (int u = 0; u < DCTSIZE; ++u) {
+            double sum = 0.0;
+            for (int y = 0; y < DCTSIZE; ++y) {
+              for (int x = 0; x < DCTSIZE; ++x) {
+                sum += pixels[y * fc.pixels_stride + x] *
+                       std::cos((2 * x + 1) * u * M_PI / 16) *
+                       std::cos((2 * y + 1) * v * M_PI / 16);
+              }
+            }
+            const double cu = u == 0 ? M_SQRT1_2 : 1.0;
+            const double cv = v == 0 ? M_SQRT1_2 : 1.0;
+            const float coeff = cu * cv * sum / 32;
+            const int k = v * DCTSIZE + u;
+            if (k == 0) {
+              fc.dc[by * fc.dc_stride + bx] =
+                  (coeff - 128.0f) * fc.quant_mul[0];
+              continue;
+            }
+            const float q = coeff * fc.quant_mul[k];
+            const float threshold =
+                fc.zero_bias_offset[k] + aq * fc.zero_bias_mul[k];
+            block[k] = std::abs(q) >= threshold ? std::lround(q) : 0;
+          }
+        }
+      }
+    }
+  }
+  return TRUE;
+}
+
+boolean DeclineForwardTransform(
+    void* opaque, JDIMENSION /*imcu_row*/, int /*num_components*/,
+    const JpegliForwardTransformComponent* /*components*/) {
+  ++*static_cast<size_t*>(opaque);
+  return FALSE;
+}
+
+TEST(EncodeAPITest, TransformBackend) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (const TestConfig& config : all_configs) {
+    const auto encode = [&](JpegliForwardTransformFunc transform,
+                            size_t* num_calls,
+                            std::vector<uint8_t>* compressed) {
+      jpeg_compress_struct cinfo;
+      unsigned char* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        JpegliTransformBackend backend = {transform, nullptr, num_calls};
+        jpegli_set_transform_backend(reinterpret_cast<j_common_ptr>(&cinfo),
+                                     transform ? &backend : nullptr);
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_compress(&cinfo);
+      compressed->assign(buffer, buffer + buffer_size);
+      free(buffer);
+    };
+    std::vector<uint8_t> expected;
+    encode(nullptr, nullptr, &expected);
+    size_t num_calls = 0;
+    std::vector<uint8_t> declined;
+    encode(DeclineForwardTransform, &num_calls, &declined);
+    EXPECT_GT(num_calls, 0u);
+    EXPECT_EQ(expected, declined);
+    num_calls = 0;
+    std::vector<uint8_t> compressed;
+    encode(ReferenceForwardTransform, &num_calls, &compressed);
+    EXPECT_GT(num_calls, 0u);
+    TestImage output;
+    DecodeWithLibjpeg(config.jparams, DecompressParams(), compressed, &output);
+    VerifyOutputImage(config.input, output, config.max_dist);
+  }
+}
+
+TEST(EncodeAPITest, CompactTokensSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  {
+    TestConfig config = all_configs[0];
+    config.jparams.restart_interval = 5;
+    config.jparams.optimize_coding = 1;
+    all_configs.push_back(config);
+    config.jparams.progressive_mode = 2;
+    all_configs.push_back(config);
+    config.jparams.num_threads = 3;
+    all_configs.push_back(config);
+    // Large enough for more than one token array.
+    config = all_configs[0];
+    config.input.xsize = 1024;
+    config.input.ysize = 768;
+    GeneratePixels(&config.input);
+    config.jparams.optimize_coding = 1;
+    all_configs.push_back(config);
+    config.jparams.progressive_mode = 2;
+    all_configs.push_back(config);
+  }
+  for (const TestConfig& config : all_configs) {
+    std::vector<uint8_t> compressed0;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed0));
+    CompressParams jparams = config.jparams;
+    jparams.use_compact_tokens = true;
+    std::vector<uint8_t> compressed1;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, jparams, &compressed1));
+    ASSERT_EQ(compressed0.size(), compressed1.size()) << jparams;
+    EXPECT_EQ(0, memcmp(compressed0.data(), compressed1.data(),
+                        compressed0.size()))
+        << jparams;
+  }
+}
+
+TEST(EncodeAPITest, TwoPassTokenizationSameOutput) {
+  std::vector<TestConfig> all_configs;
+  {
+    TestConfig config = GenerateBasicConfigs()[0];
+    // Sequential scan scripts.
+    for (int script : {3, 4}) {
+      config.jparams.progressive_mode = script;
+      for (int optimize : {0, 1}) {
+        config.jparams.optimize_coding = optimize;
+        all_configs.push_back(config);
+      }
+    }
+    config.jparams.restart_interval = 5;
+    all_configs.push_back(config);
+    config.jparams.num_threads = 3;
+    all_configs.push_back(config);
+    config = GenerateBasicConfigs()[0];
+    config.jparams.optimize_coding = 1;
+    config.jparams.psnr_target = 40.0f;
+    all_configs.push_back(config);
+    // Progressive images are not affected.
+    config = GenerateBasicConfigs()[0];
+    config.jparams.progressive_mode = 2;
+    all_configs.push_back(config);
+  }
+  for (const TestConfig& config : all_configs) {
+    std::vector<uint8_t> compressed0;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed0));
+    CompressParams jparams = config.jparams;
+    jparams.use_two_pass_tokenization = true;
+    std::vector<uint8_t> compressed1;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, jparams, &compressed1));
+    ASSERT_EQ(compressed0.size(), compressed1.size()) << jparams;
+    EXPECT_EQ(0, memcmp(compressed0.data(), compressed1.data(),
+                        compressed0.size()))
+        << jparams;
+  }
+}
+
+TEST(EncodeAPITest, OptimizeScansSmallerOutput) {
+  TestConfig config;
+  config.input.xsize = 1024;
+  config.input.ysize = 768;
+  GeneratePixels(&config.input);
+  for (int quality : {50, 90, 99}) {
+    config.jparams.quality = quality;
+    size_t min_size = 0;
+    for (int progressive_level : {1, 2}) {
+      config.jparams.progressive_mode = progressive_level;
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+      if (min_size == 0 || compressed.size() < min_size) {
+        min_size = compressed.size();
+      }
+    }
+    CompressParams jparams = config.jparams;
+    jparams.optimize_scans = true;
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, jparams, &compressed));
+    EXPECT_LE(compressed.size(), min_size) << jparams;
+    // The scan script of the application is kept.
+    jparams.progressive_mode = 13;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, jparams, &compressed));
+    jparams.optimize_scans = false;
+    std::vector<uint8_t> compressed0;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, jparams, &compressed0));
+    EXPECT_EQ(compressed0, compressed) << jparams;
+  }
+}
+
+TEST(EncodeAPITest, StreamDCScanSameImage) {
+  std::vector<TestConfig> all_configs;
+  for (int samp : {1, 2, 4}) {
+    for (int restart_interval : {0, 5}) {
+      TestConfig config;
+      config.input.xsize = 129;
+      config.input.ysize = 73;
+      config.jparams.h_sampling = {samp, 1, 1};
+      config.jparams.v_sampling = {samp, 1, 1};
+      config.jparams.progressive_mode = 2;
+      config.jparams.restart_interval = restart_interval;
+      all_configs.push_back(config);
+    }
+  }
+  all_configs[1].jparams.optimize_scans = true;
+  all_configs[2].jparams.progressive_mode = 1;
+  all_configs[2].jparams.restart_in_rows = 1;
+  all_configs[3].jparams.num_threads = 4;
+  all_configs[0].jparams.optimize_scans = true;
+  all_configs[0].input.components = 1;
+  all_configs[0].input.color_space = JCS_GRAYSCALE;
+  for (TestConfig& config : all_configs) {
+    GeneratePixels(&config.input);
+    std::vector<uint8_t> compressed0;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed0));
+    CompressParams jparams = config.jparams;
+    jparams.stream_dc_scan = true;
+    std::vector<uint8_t> compressed1;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, jparams, &compressed1));
+    // Only the Huffman coding of the DC scan differs.
+    TestImage output0;
+    TestImage output1;
+    DecodeWithLibjpeg(config.jparams, DecompressParams(), compressed0,
+                      &output0);
+    DecodeWithLibjpeg(jparams, DecompressParams(), compressed1, &output1);
+    EXPECT_EQ(output0.pixels, output1.pixels) << jparams;
+  }
+}
+
+TEST(EncodeAPITest, WritePlanesSameOutput) {
+  std::vector<TestConfig> all_configs;
+  // With odd image dimensions the generated raw data is padded by repeating
+  // its last column and row, like jpegli_write_planes() pads the planes.
+  for (int h_samp : {1, 2}) {
+    for (int v_samp : {1, 2}) {
+      TestConfig config;
+      config.input.xsize = 129;
+      config.input.ysize = 73;
+      config.input.color_space = JCS_YCbCr;
+      config.jparams.h_sampling = {h_samp, 1, 1};
+      config.jparams.v_sampling = {v_samp, 1, 1};
+      all_configs.push_back(config);
+    }
+  }
+  all_configs.back().jparams.optimize_coding = 1;
+  all_configs.back().jparams.progressive_mode = 2;
+  for (TestConfig& config : all_configs) {
+    GenerateInput(RAW_DATA, config.jparams, &config.input);
+    std::vector<uint8_t> compressed0;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed0));
+    for (int layout : {JPEGLI_PLANES_SEPARATE, JPEGLI_PLANES_NV12}) {
+      CompressParams jparams = config.jparams;
+      jparams.plane_layout = layout;
+      std::vector<uint8_t> compressed1;
+      ASSERT_TRUE(EncodeWithJpegli(config.input, jparams, &compressed1));
+      ASSERT_EQ(compressed0.size(), compressed1.size()) << jparams;
+      EXPECT_EQ(0, memcmp(compressed0.data(), compressed1.data(),
+                          compressed0.size()))
+          << jparams;
+    }
+  }
+}
+
+TEST(EncodeAPITest, InputRowPaddingSameOutput) {
+  const size_t xsize = 131;
+  const size_t ysize = 37;
+  for (JpegliDataType data_type : {JPEGLI_TYPE_UINT8, JPEGLI_TYPE_UINT16}) {
+    const size_t row_size = xsize * 3 * jpegli_bytes_per_sample(data_type);
+    const size_t stride = row_size + JPEGLI_ROW_PADDING;
+    // The padding bytes are garbage that must not change the output.
+    std::vector<uint8_t> pixels(ysize * stride, 0xa5);
+    for (size_t y = 0; y < ysize; ++y) {
+      for (size_t i = 0; i < row_size; ++i) {
+        pixels[y * stride + i] = (3 * i + 7 * y) & 0xff;
+      }
+    }
+    const auto encode = [&](bool padded,
+                            std::vector<uint8_t>* compressed) -> bool {
+      jpeg_compress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        uint8_t* buffer = nullptr;
+        unsigned long buffer_size = 0;  // NOLINT
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        cinfo.image_width = xsize;
+        cinfo.image_height = ysize;
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+        jpegli_set_defaults(&cinfo);
+        jpegli_set_input_format(&cinfo, data_type, JPEGLI_NATIVE_ENDIAN);
+        jpegli_set_input_row_padding(&cinfo, padded ? TRUE : FALSE);
+        jpegli_start_compress(&cinfo, TRUE);
+        while (cinfo.next_scanline < cinfo.image_height) {
+          JSAMPROW row[] = {&pixels[cinfo.next_scanline * stride]};
+          jpegli_write_scanlines(&cinfo, row, 1);
+        }
+        jpegli_finish_compress(&cinfo);
+        compressed->assign(buffer, buffer + buffer_size);
+        free(buffer);
+        return true;
+      };
+      bool success = try_catch_block();
+      jpegli_destroy_compress(&cinfo);
+      return success;
+    };
+    std::vector<uint8_t> compressed0;
+    std::vector<uint8_t> compressed1;
+    ASSERT_TRUE(encode(/*padded=*/false, &compressed0));
+    ASSERT_TRUE(encode(/*padded=*/true, &compressed1));
+    ASSERT_EQ(compressed0.size(), compressed1.size());
+    EXPECT_EQ(0, memcmp(compressed0.data(), compressed1.data(),
+                        compressed0.size()));
+  }
+}
+
+TEST(EncodeAPITest, TilesSameOutput) {
+  const size_t xsize = 203;
+  const size_t ysize = 117;
+  const size_t stride = xsize * 3;
+  std::vector<uint8_t> pixels(ysize * stride);
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t i = 0; i < stride; ++i) {
+      pixels[y * stride + i] = (5 * i + 3 * y + (i * y) / 7) & 0xff;
+    }
+  }
+  // Tiles that are not aligned to the iMCU rows, in a shuffled order.
+  const size_t tile_xsize = 48;
+  const size_t tile_ysize = 20;
+  std::vector<std::pair<size_t, size_t>> tiles;
+  for (size_t y = 0; y < ysize; y += tile_ysize) {
+    for (size_t x = 0; x < xsize; x += tile_xsize) {
+      tiles.emplace_back(x, y);
+    }
+  }
+  for (size_t i = 0; i < tiles.size(); ++i) {
+    std::swap(tiles[i], tiles[(7 * i + 3) % tiles.size()]);
+  }
+  const auto encode = [&](size_t num_threads,
+                          std::vector<uint8_t>* compressed) -> bool {
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      cinfo.image_width = xsize;
+      cinfo.image_height = ysize;
+      cinfo.input_components = 3;
+      cinfo.in_color_space = JCS_RGB;
+      jpegli_set_defaults(&cinfo);
+      cinfo.comp_info[0].h_samp_factor = 2;
+      cinfo.comp_info[0].v_samp_factor = 2;
+      jpegli_start_compress(&cinfo, TRUE);
+      if (num_threads == 0) {
+        while (cinfo.next_scanline < cinfo.image_height) {
+          JSAMPROW row[] = {&pixels[cinfo.next_scanline * stride]};
+          jpegli_write_scanlines(&cinfo, row, 1);
+        }
+      } else {
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < num_threads; ++t) {
+          threads.emplace_back([&, t]() {
+            for (size_t i = t; i < tiles.size(); i += num_threads) {
+              const size_t x = tiles[i].first;
+              const size_t y = tiles[i].second;
+              jpegli_write_tile(&cinfo, x, y, std::min(tile_xsize, xsize - x),
+                                std::min(tile_ysize, ysize - y),
+                                &pixels[y * stride + x * 3], stride);
+            }
+          });
+        }
+        for (std::thread& thread : threads) thread.join();
+      }
+      EXPECT_EQ(ysize, cinfo.next_scanline);
+      jpegli_finish_compress(&cinfo);
+      compressed->assign(buffer, buffer + buffer_size);
+      free(buffer);
+      return true;
+    };
+    bool success = try_catch_block();
+    jpegli_destroy_compress(&cinfo);
+    return success;
+  };
+  std::vector<uint8_t> expected;
+  ASSERT_TRUE(encode(0, &expected));
+  for (size_t num_threads : {1, 4}) {
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(encode(num_threads, &compressed));
+    ASSERT_EQ(expected.size(), compressed.size());
+    EXPECT_EQ(0, memcmp(expected.data(), compressed.data(), expected.size()));
+  }
+}
+
+TEST(EncodeAPITest, EstimateMemory) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  {
+    TestConfig config;
+    config.input.xsize = 1024;
+    config.input.ysize = 768;
+    GeneratePixels(&config.input);
+    for (int progressive_mode : {0, 2}) {
+      for (int optimize : {0, 1}) {
+        config.jparams.progressive_mode = progressive_mode;
+        config.jparams.optimize_coding = optimize;
+        all_configs.push_back(config);
+      }
+    }
+    config.jparams.use_compact_tokens = true;
+    all_configs.push_back(config);
+    config.jparams.progressive_mode = 0;
+    config.jparams.use_two_pass_tokenization = true;
+    all_configs.push_back(config);
+  }
+  for (const TestConfig& config : all_configs) {
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      j_common_ptr comptr = reinterpret_cast<j_common_ptr>(&cinfo);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      jpegli_memory_stats stats;
+      jpegli_get_memory_stats(comptr, &stats);
+      EXPECT_EQ(stats.current_bytes,
+                stats.pools[JPOOL_PERMANENT].current_bytes);
+      EXPECT_EQ(0, stats.pools[JPOOL_IMAGE].current_bytes);
+      EXPECT_EQ(0, stats.pools[JPOOL_IMAGE].num_allocations);
+      EXPECT_LT(0, stats.pools[JPOOL_PERMANENT].num_allocations);
+      EXPECT_LT(stats.pools[JPOOL_PERMANENT].num_allocations,
+                stats.total_allocations);
+      // The parameters are kept, so the estimate is for encoding the same
+      // image again.
+      size_t estimate = jpegli_estimate_memory(comptr);
+      size_t peak = stats.current_bytes + stats.pools[JPOOL_IMAGE].peak_bytes;
+      EXPECT_LE(peak / 2, estimate) << config.jparams;
+      EXPECT_LE(estimate, 2 * peak) << config.jparams;
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+    if (buffer) free(buffer);
+  }
+}
+
+#if JPEGLI_ENABLE_STAGE_STATS
+TEST(EncodeAPITest, StageStats) {
+  for (const TestConfig& config : GenerateBasicConfigs()) {
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      j_common_ptr comptr = reinterpret_cast<j_common_ptr>(&cinfo);
+      jpegli_enable_stage_stats(comptr, TRUE);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      jpegli_stage_stats stats;
+      jpegli_get_stage_stats(comptr, &stats);
+      const size_t* calls = stats.num_calls;
+      EXPECT_EQ(config.input.ysize, calls[JPEGLI_STAGE_READ_INPUT]);
+      EXPECT_EQ(cinfo.total_iMCU_rows, calls[JPEGLI_STAGE_DCT]);
+      EXPECT_EQ(cinfo.total_iMCU_rows,
+                calls[JPEGLI_STAGE_ADAPTIVE_QUANTIZATION]);
+      if (config.jparams.progressive_mode || config.jparams.optimize_coding) {
+        EXPECT_EQ(1, calls[JPEGLI_STAGE_OPTIMIZE_HUFFMAN]);
+        EXPECT_EQ(static_cast<size_t>(cinfo.num_scans),
+                  calls[JPEGLI_STAGE_WRITE_SCANS]);
+      } else {
+        // The scan is written while the input is read.
+        EXPECT_EQ(0, calls[JPEGLI_STAGE_OPTIMIZE_HUFFMAN]);
+        EXPECT_EQ(0, calls[JPEGLI_STAGE_WRITE_SCANS]);
+      }
+      for (int i = JPEGLI_STAGE_PROCESS_MARKERS; i < JPEGLI_NUM_STAGES; ++i) {
+        EXPECT_EQ(0, calls[i]);
+      }
+      for (int i = 0; i < JPEGLI_NUM_STAGES; ++i) {
+        EXPECT_LE(0.0, stats.seconds[i]);
+        if (calls[i] == 0) EXPECT_EQ(0.0, stats.seconds[i]);
+      }
+      // Nothing is recorded once the stats are disabled.
+      jpegli_enable_stage_stats(comptr, FALSE);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      jpegli_get_stage_stats(comptr, &stats);
+      for (int i = 0; i < JPEGLI_NUM_STAGES; ++i) {
+        EXPECT_EQ(0, calls[i]);
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+    if (buffer) free(buffer);
+  }
+}
+#endif  // JPEGLI_ENABLE_STAGE_STATS
+
+TEST(EncodeAPITest, EncodeStats) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  TestConfig psnr_config = all_configs[0];
+  psnr_config.jparams.psnr_target = 38.0f;
+  all_configs.push_back(psnr_config);
+  for (const TestConfig& config : all_configs) {
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      jpegli_encode_stats stats;
+      jpegli_get_encode_stats(&cinfo, &stats);
+      EXPECT_EQ(buffer_size, stats.total_bytes);
+      EXPECT_EQ(cinfo.num_scans, stats.num_scans);
+      size_t total_scan_bytes = 0;
+      for (int i = 0; i < stats.num_scans; ++i) {
+        EXPECT_LT(0, stats.scan_bytes[i]);
+        total_scan_bytes += stats.scan_bytes[i];
+      }
+      EXPECT_LT(total_scan_bytes, stats.total_bytes);
+      EXPECT_LT(0, stats.num_huffman_tables);
+      if (config.jparams.progressive_mode || config.jparams.optimize_coding) {
+        EXPECT_LT(0, stats.num_tokens);
+      } else {
+        EXPECT_EQ(0, stats.num_tokens);
+      }
+      EXPECT_LT(0.0f, stats.average_quant_field);
+      if (config.jparams.psnr_target > 0) {
+        EXPECT_LT(0.0f, stats.search_distance);
+      } else {
+        EXPECT_EQ(0.0f, stats.search_distance);
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block()) << config.jparams;
+    jpegli_destroy_compress(&cinfo);
+    if (buffer) free(buffer);
+  }
+}
+
+TEST(EncodeAPITest, ParallelDecodeTarget) {
+  TestConfig config;
+  config.input.xsize = 256;
+  config.input.ysize = 200;
+  config.jparams.h_sampling = {1, 1, 1};
+  config.jparams.v_sampling = {1, 1, 1};
+  GeneratePixels(&config.input);
+  // 32 MCUs per row and 25 MCU rows: no restart markers, 7 rows per interval,
+  // and one row per interval.
+  const int kSegments[] = {1, 4, 100};
+  const size_t kExpectedInterval[] = {0, 224, 32};
+  const size_t kExpectedMarkers[] = {0, 3, 24};
+  for (size_t k = 0; k < 3; ++k) {
+    const int segments = kSegments[k];
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    jpeg_compress_struct cinfo;
+    jpegli_encode_stats stats;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      jpegli_set_parallel_decode_target(&cinfo, segments);
+      EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      jpegli_get_encode_stats(&cinfo, &stats);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+    std::vector<uint8_t> compressed(buffer, buffer + buffer_size);
+    free(buffer);
+    size_t restart_interval = 0;
+    size_t num_restart_markers = 0;
+    for (size_t i = 0; i + 1 < compressed.size(); ++i) {
+      if (compressed[i] != 0xFF) continue;
+      if (compressed[i + 1] == 0xDD) {
+        restart_interval = (compressed[i + 4] << 8) + compressed[i + 5];
+      } else if (compressed[i + 1] >= 0xD0 && compressed[i + 1] <= 0xD7) {
+        ++num_restart_markers;
+      }
+    }
+    EXPECT_EQ(kExpectedInterval[k], restart_interval);
+    EXPECT_EQ(kExpectedMarkers[k], num_restart_markers);
+    EXPECT_EQ(restart_interval > 0 ? 6 + 2 * num_restart_markers : 0,
+              stats.restart_marker_bytes);
+    TestImage output;
+    DecodeWithLibjpeg(config.jparams, DecompressParams(), compressed, &output);
+    VerifyOutputImage(config.input, output, config.max_dist);
+  }
+}
+
+TEST(EncodeAPITest, QuantFieldRoundTrip) {
+  TestImage image;
+  image.xsize = 77;
+  image.ysize = 45;
+  GeneratePixels(&image);
+  const size_t xsize_blocks = DivCeil(image.xsize, 8);
+  const size_t ysize_blocks = DivCeil(image.ysize, 8);
+  const size_t stride = xsize_blocks + 3;
+  std::vector<float> field(ysize_blocks * stride, -1.0f);
+  std::vector<float> coarse_field(ysize_blocks * stride, 2.0f);
+  std::vector<std::vector<uint8_t>> compressed;
+  jpeg_compress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_compress(&cinfo);
+    const auto encode = [&]() {
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      cinfo.image_width = image.xsize;
+      cinfo.image_height = image.ysize;
+      cinfo.input_components = image.components;
+      cinfo.in_color_space = JCS_RGB;
+      jpegli_set_defaults(&cinfo);
+      jpegli_set_quality(&cinfo, 80, TRUE);
+      jpegli_start_compress(&cinfo, TRUE);
+      size_t row_stride = image.xsize * image.components;
+      while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row[] = {const_cast<JSAMPROW>(
+            image.pixels.data() + cinfo.next_scanline * row_stride)};
+        jpegli_write_scanlines(&cinfo, row, 1);
+      }
+      jpegli_finish_compress(&cinfo);
+      compressed.emplace_back(buffer, buffer + buffer_size);
+      free(buffer);
+    };
+    jpegli_get_quant_field(&cinfo, field.data(), stride);
+    encode();
+    jpegli_get_quant_field(&cinfo, nullptr, 0);
+    jpegli_set_quant_field(&cinfo, field.data(), stride);
+    encode();
+    jpegli_set_quant_field(&cinfo, coarse_field.data(), stride);
+    encode();
+    return true;
+  };
+  ASSERT_TRUE(try_catch_block());
+  jpegli_destroy_compress(&cinfo);
+  for (size_t y = 0; y < ysize_blocks; ++y) {
+    for (size_t x = 0; x < xsize_blocks; ++x) {
+      EXPECT_LE(0.0f, field[y * stride + x]);
+    }
+    EXPECT_EQ(-1.0f, field[y * stride + xsize_blocks]);
+  }
+  ASSERT_EQ(3u, compressed.size());
+  EXPECT_EQ(compressed[0], compressed[1]);
+  EXPECT_LT(compressed[2].size(), compressed[0].size());
+}
+
+TEST(EncodeAPITest, FrameSequence) {
+  TestImage image;
+  image.xsize = 192;
+  image.ysize = 128;
+  GeneratePixels(&image);
+  // Frame sequences with a large and a tiny max cost drift.
+  for (float max_drift : {1.0f, 1e-6f}) {
+    std::vector<std::vector<uint8_t>> frames;
+    std::vector<jpegli_encode_stats> stats;
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_set_frame_sequence(&cinfo, max_drift);
+      for (int frame = 0; frame < 4; ++frame) {
+        uint8_t* buffer = nullptr;
+        unsigned long buffer_size = 0;  // NOLINT
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        cinfo.image_width = image.xsize;
+        cinfo.image_height = image.ysize;
+        cinfo.input_components = image.components;
+        cinfo.in_color_space = JCS_RGB;
+        jpegli_set_defaults(&cinfo);
+        cinfo.optimize_coding = TRUE;
+        jpegli_start_compress(&cinfo, TRUE);
+        size_t stride = image.xsize * image.components;
+        while (cinfo.next_scanline < cinfo.image_height) {
+          JSAMPROW row[] = {const_cast<JSAMPROW>(
+              image.pixels.data() + cinfo.next_scanline * stride)};
+          jpegli_write_scanlines(&cinfo, row, 1);
+        }
+        jpegli_finish_compress(&cinfo);
+        EXPECT_TRUE(cinfo.optimize_coding);
+        frames.emplace_back(buffer, buffer + buffer_size);
+        free(buffer);
+        stats.emplace_back();
+        jpegli_get_encode_stats(&cinfo, &stats.back());
+      }
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+    for (int frame = 0; frame < 4; ++frame) {
+      // With the tiny max drift every other frame optimizes its codes again.
+      const bool reused = max_drift > 0.5f ? frame > 0 : frame % 2 == 1;
+      EXPECT_EQ(reused ? 1 : 0, stats[frame].reused_huffman_codes);
+      if (reused) {
+        EXPECT_LT(0.0f, stats[frame].huffman_cost_drift);
+        EXPECT_LT(stats[frame].huffman_cost_drift, 0.5f);
+        EXPECT_GT(frames[frame].size(), frames[0].size());
+      } else {
+        EXPECT_EQ(frames[0], frames[frame]);
+      }
+      TestImage output;
+      DecodeWithLibjpeg(CompressParams(), DecompressParams(), frames[frame],
+                        &output);
+      TestImage expected;
+      DecodeWithLibjpeg(CompressParams(), DecompressParams(), frames[0],
+                        &expected);
+      EXPECT_EQ(expected.pixels, output.pixels);
+    }
+  }
+}
+
+TEST(EncodeAPITest, HuffmanPresets) {
+  TestImage image;
+  image.xsize = 192;
+  image.ysize = 128;
+  GeneratePixels(&image);
+  jpeg_compress_struct cinfo;
+  // The standard tables, which have a code for every 8-bit symbol, in their
+  // usual roles up to distance 0.5 with 1x1 sampling, and with the luma and
+  // chroma tables swapped above.
+  JpegliHuffmanPreset presets[2];
+  memset(presets, 0, sizeof(presets));
+  presets[0].max_distance = 0.5f;
+  presets[0].h_samp_factor = 1;
+  presets[0].v_samp_factor = 1;
+  presets[1].max_distance = 10.0f;
+  {
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      cinfo.in_color_space = JCS_RGB;
+      jpegli_set_defaults(&cinfo);
+      for (int i = 0; i < 2; ++i) {
+        for (int k = 0; k < 2; ++k) {
+          const JHUFF_TBL* dc = cinfo.dc_huff_tbl_ptrs[i == 0 ? k : 1 - k];
+          const JHUFF_TBL* ac = cinfo.ac_huff_tbl_ptrs[i == 0 ? k : 1 - k];
+          memcpy(presets[i].dc_bits[k], dc->bits, sizeof(dc->bits));
+          memcpy(presets[i].dc_huffval[k], dc->huffval, sizeof(dc->huffval));
+          memcpy(presets[i].ac_bits[k], ac->bits, sizeof(ac->bits));
+          memcpy(presets[i].ac_huffval[k], ac->huffval, sizeof(ac->huffval));
+        }
+      }
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+  }
+  const auto encode = [&](float distance, const JpegliHuffmanPreset* p,
+                          size_t num_presets) -> std::vector<uint8_t> {
+    std::vector<uint8_t> compressed;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      cinfo.image_width = image.xsize;
+      cinfo.image_height = image.ysize;
+      cinfo.input_components = image.components;
+      cinfo.in_color_space = JCS_RGB;
+      jpegli_set_defaults(&cinfo);
+      cinfo.optimize_coding = FALSE;
+      jpegli_set_distance(&cinfo, distance, TRUE);
+      jpegli_set_huffman_presets(&cinfo, p, num_presets);
+      jpegli_start_compress(&cinfo, TRUE);
+      size_t stride = image.xsize * image.components;
+      while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row[] = {const_cast<JSAMPROW>(
+            image.pixels.data() + cinfo.next_scanline * stride)};
+        jpegli_write_scanlines(&cinfo, row, 1);
+      }
+      jpegli_finish_compress(&cinfo);
+      compressed.assign(buffer, buffer + buffer_size);
+      free(buffer);
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+    return compressed;
+  };
+  for (float distance : {0.25f, 1.0f}) {
+    std::vector<uint8_t> expected = encode(distance, nullptr, 0);
+    std::vector<uint8_t> compressed = encode(distance, presets, 2);
+    ASSERT_FALSE(compressed.empty());
+    if (distance < 0.5f) {
+      EXPECT_EQ(expected, compressed);
+    } else {
+      EXPECT_NE(expected, compressed);
+    }
+    TestImage output;
+    DecodeWithLibjpeg(CompressParams(), DecompressParams(), compressed,
+                      &output);
+    TestImage expected_output;
+    DecodeWithLibjpeg(CompressParams(), DecompressParams(), expected,
+                      &expected_output);
+    EXPECT_EQ(expected_output.pixels, output.pixels);
+  }
+  // A table without codes for some of the symbols is rejected.
+  presets[1].ac_bits[1][16] = 0;
+  {
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_set_huffman_presets(&cinfo, presets, 2);
+      return true;
+    };
+    EXPECT_FALSE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+  }
+}
+
+struct CountingAllocator {
+  size_t num_allocations = 0;
+  size_t num_live_allocations = 0;
+
+  static void* Alloc(void* opaque, size_t size) {
+    CountingAllocator* self = static_cast<CountingAllocator*>(opaque);
+    ++self->num_allocations;
+    ++self->num_live_allocations;
+    return malloc(size);
+  }
+
+  static void Free(void* opaque, void* address) {
+    if (address == nullptr) return;
+    CountingAllocator* self = static_cast<CountingAllocator*>(opaque);
+    --self->num_live_allocations;
+    free(address);
+  }
+};
+
+TEST(EncodeAPITest, CustomMemoryManager) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  std::vector<std::vector<uint8_t>> expected(all_configs.size());
+  for (size_t i = 0; i < all_configs.size(); ++i) {
+    const TestConfig& config = all_configs[i];
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &expected[i]));
+  }
+  for (boolean keep_image_memory : {FALSE, TRUE}) {
+    CountingAllocator allocator;
+    JxlMemoryManager memory_manager = {&allocator, &CountingAllocator::Alloc,
+                                       &CountingAllocator::Free};
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      j_common_ptr comptr = reinterpret_cast<j_common_ptr>(&cinfo);
+      jpegli_set_memory_manager(comptr, &memory_manager);
+      jpegli_keep_image_memory(comptr, keep_image_memory);
+      for (size_t i = 0; i < all_configs.size(); ++i) {
+        const TestConfig& config = all_configs[i];
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+        EXPECT_EQ(expected[i].size(), buffer_size);
+        if (expected[i].size() == buffer_size) {
+          EXPECT_EQ(0, memcmp(expected[i].data(), buffer, buffer_size));
+        }
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+    if (buffer) free(buffer);
+    EXPECT_LT(0, allocator.num_allocations);
+    EXPECT_EQ(0, allocator.num_live_allocations);
+  }
+}
+
+TEST(EncodeAPITest, ReuseCinfoSameMemOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  uint8_t* buffer = nullptr;
+  unsigned long buffer_size = 0;  // NOLINT
+  {
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      for (const TestConfig& config : all_configs) {
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+  }
+  size_t pos = 0;
+  for (auto& config : all_configs) {
+    TestImage output;
+    pos += DecodeWithLibjpeg(config.jparams, DecompressParams(), nullptr, 0,
+                             buffer + pos, buffer_size - pos, &output);
+    VerifyOutputImage(config.input, output, config.max_dist);
+  }
+  if (buffer) free(buffer);
+}
+
+TEST(EncodeAPITest, ReuseCinfoChunkedOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  std::vector<std::vector<uint8_t>> expected(all_configs.size());
+  for (size_t i = 0; i < all_configs.size(); ++i) {
+    const TestConfig& config = all_configs[i];
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &expected[i]));
+  }
+  std::vector<uint8_t> buffer(1000);
+  jpeg_compress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_compress(&cinfo);
+    // Each image is encoded with and without a caller supplied first chunk,
+    // and with and without a size hint.
+    for (size_t i = 0; i < 4 * all_configs.size(); ++i) {
+      const TestConfig& config = all_configs[i / 4];
+      const std::vector<uint8_t>& compressed = expected[i / 4];
+      const size_t expected_size = (i & 2) ? compressed.size() : 0;
+      if (i & 1) {
+        jpegli_chunked_dest(&cinfo, buffer.data(), buffer.size(),
+                            expected_size);
+      } else {
+        jpegli_chunked_dest(&cinfo, nullptr, 0, expected_size);
+      }
+      EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      const JpegliOutputChunk* chunks;
+      size_t num_chunks = jpegli_get_output_chunks(&cinfo, &chunks);
+      std::vector<uint8_t> output;
+      for (size_t k = 0; k < num_chunks; ++k) {
+        output.insert(output.end(), chunks[k].data,
+                      chunks[k].data + chunks[k].size);
+      }
+      EXPECT_EQ(compressed, output);
+      if (i & 1) {
+        EXPECT_EQ(buffer.data(), chunks[0].data);
+      }
+      if (expected_size > 0) {
+        EXPECT_LE(num_chunks, 2u);
+      }
+    }
+    return true;
+  };
+  EXPECT_TRUE(try_catch_block());
+  jpegli_destroy_compress(&cinfo);
+}
+
+TEST(EncodeAPITest, ReuseCinfoKeepImageMemory) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  std::vector<std::vector<uint8_t>> expected(all_configs.size());
+  for (size_t i = 0; i < all_configs.size(); ++i) {
+    const TestConfig& config = all_configs[i];
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &expected[i]));
+  }
   uint8_t* buffer = nullptr;
   unsigned long buffer_size = 0;  // NOLINT
-  std::vector<uint8_t> compressed0;
-  std::vector<uint8_t> compressed1;
   jpeg_compress_struct cinfo;
   const auto try_catch_block = [&]() -> bool {
     ERROR_HANDLER_SETUP(jpegli);
     jpegli_create_compress(&cinfo);
-    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
-    EncodeWithJpegli(input, jparams, &cinfo);
-    compressed0.assign(buffer, buffer + buffer_size);
-    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
-    EncodeWithJpegli(input, jparams, &cinfo);
-    compressed1.assign(buffer, buffer + buffer_size);
+    jpegli_keep_image_memory(reinterpret_cast<j_common_ptr>(&cinfo), TRUE);
+    // Each image is encoded twice, so that the second one reuses the memory
+    // of the first one.
+    for (size_t i = 0; i < 2 * all_configs.size(); ++i) {
+      const TestConfig& config = all_configs[i / 2];
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      const std::vector<uint8_t>& compressed = expected[i / 2];
+      EXPECT_EQ(compressed.size(), buffer_size);
+      if (compressed.size() == buffer_size) {
+        EXPECT_EQ(0, memcmp(compressed.data(), buffer, buffer_size));
+      }
+    }
     return true;
   };
   EXPECT_TRUE(try_catch_block());
   jpegli_destroy_compress(&cinfo);
   if (buffer) free(buffer);
-  ASSERT_EQ(compressed0.size(), compressed1.size());
-  EXPECT_EQ(0,
-            memcmp(compressed0.data(), compressed1.data(), compressed0.size()));
 }
 
-std::vector<TestConfig> GenerateBasicConfigs() {
-  std::vector<TestConfig> all_configs;
-  for (int samp : {1, 2}) {
-    for (int progr : {0, 2}) {
-      for (int optimize : {0, 1}) {
-        if (progr && optimize) continue;
-        TestConfig config;
-        config.input.xsize = 257 + samp * 37;
-        config.input.ysize = 265 + optimize * 17;
-        config.jparams.h_sampling = {samp, 1, 1};
-        config.jparams.v_sampling = {samp, 1, 1};
-        config.jparams.progressive_mode = progr;
-        config.jparams.optimize_coding = optimize;
-        config.max_dist = 2.4f;
-        GeneratePixels(&config.input);
-        all_configs.push_back(config);
+TEST(EncodeAPITest, EncodeBatchSameOutput) {
+  const auto set_params = [](j_compress_ptr cinfo) {
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_RGB;
+    jpegli_set_defaults(cinfo);
+    jpegli_set_quality(cinfo, 85, TRUE);
+    cinfo->optimize_coding = TRUE;
+  };
+  std::vector<TestImage> images;
+  for (size_t xsize : {1, 17, 64, 128}) {
+    for (size_t ysize : {1, 23, 96}) {
+      TestImage image;
+      image.xsize = xsize;
+      image.ysize = ysize;
+      GeneratePixels(&image);
+      images.push_back(image);
+    }
+  }
+  std::vector<std::vector<uint8_t>> expected(images.size());
+  for (size_t i = 0; i < images.size(); ++i) {
+    const TestImage& image = images[i];
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      cinfo.image_width = image.xsize;
+      cinfo.image_height = image.ysize;
+      set_params(&cinfo);
+      jpegli_start_compress(&cinfo, TRUE);
+      size_t stride = image.xsize * image.components;
+      while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row[] = {const_cast<JSAMPROW>(
+            image.pixels.data() + cinfo.next_scanline * stride)};
+        jpegli_write_scanlines(&cinfo, row, 1);
+      }
+      jpegli_finish_compress(&cinfo);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+    expected[i].assign(buffer, buffer + buffer_size);
+    free(buffer);
+  }
+  std::vector<JpegliImageDesc> descs(images.size());
+  for (size_t i = 0; i < images.size(); ++i) {
+    descs[i].pixels = images[i].pixels.data();
+    descs[i].stride = images[i].xsize * images[i].components;
+    descs[i].width = images[i].xsize;
+    descs[i].height = images[i].ysize;
+  }
+  std::vector<JpegliBatchOutput> outputs(images.size());
+  jpeg_compress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_compress(&cinfo);
+    set_params(&cinfo);
+    // The same compressor is used for several batches, so that the workers
+    // of the later batches reuse their memory.
+    for (size_t num_threads : {0, 1, 3, 8, 3}) {
+      if (num_threads > 0) {
+        jpegli_set_parallel_runner(&cinfo, &TestParallelRunner, &num_threads);
+      } else {
+        jpegli_set_parallel_runner(&cinfo, nullptr, nullptr);
+      }
+      jpegli_encode_batch(&cinfo, descs.data(), descs.size(), outputs.data());
+      for (size_t i = 0; i < images.size(); ++i) {
+        EXPECT_EQ(expected[i].size(), outputs[i].size);
+        if (expected[i].size() == outputs[i].size) {
+          EXPECT_EQ(0, memcmp(expected[i].data(), outputs[i].data,
+                              outputs[i].size));
+        }
+        free(outputs[i].data);
+      }
+    }
+    return true;
+  };
+  EXPECT_TRUE(try_catch_block());
+  jpegli_destroy_compress(&cinfo);
+}
+
+TEST(EncodeAPITest, EncodeLadderSameOutput) {
+  const std::vector<JpegliLadderRung> rungs = {
+      {1.0f, 0, 0}, {2.5f, 2, 2}, {4.0f, 0, 0}, {1.5f, 2, 1}, {6.0f, 2, 2}};
+  for (boolean optimize_coding : {FALSE, TRUE}) {
+    const auto set_params = [&](j_compress_ptr cinfo) {
+      cinfo->input_components = 3;
+      cinfo->in_color_space = JCS_RGB;
+      jpegli_set_defaults(cinfo);
+      cinfo->optimize_coding = optimize_coding;
+    };
+    for (size_t xsize : {1, 17, 128}) {
+      for (size_t ysize : {1, 23, 96}) {
+        TestImage image;
+        image.xsize = xsize;
+        image.ysize = ysize;
+        GeneratePixels(&image);
+        const size_t stride = image.xsize * image.components;
+        std::vector<std::vector<uint8_t>> expected(rungs.size());
+        for (size_t i = 0; i < rungs.size(); ++i) {
+          uint8_t* buffer = nullptr;
+          unsigned long buffer_size = 0;  // NOLINT
+          jpeg_compress_struct cinfo;
+          const auto try_catch_block = [&]() -> bool {
+            ERROR_HANDLER_SETUP(jpegli);
+            jpegli_create_compress(&cinfo);
+            jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+            cinfo.image_width = image.xsize;
+            cinfo.image_height = image.ysize;
+            set_params(&cinfo);
+            if (rungs[i].h_samp_factor > 0) {
+              cinfo.comp_info[0].h_samp_factor = rungs[i].h_samp_factor;
+              cinfo.comp_info[0].v_samp_factor = rungs[i].v_samp_factor;
+              for (int c = 1; c < cinfo.num_components; ++c) {
+                cinfo.comp_info[c].h_samp_factor = 1;
+                cinfo.comp_info[c].v_samp_factor = 1;
+              }
+            }
+            jpegli_set_distance(&cinfo, rungs[i].distance, TRUE);
+            jpegli_start_compress(&cinfo, TRUE);
+            while (cinfo.next_scanline < cinfo.image_height) {
+              JSAMPROW row[] = {const_cast<JSAMPROW>(
+                  image.pixels.data() + cinfo.next_scanline * stride)};
+              jpegli_write_scanlines(&cinfo, row, 1);
+            }
+            jpegli_finish_compress(&cinfo);
+            return true;
+          };
+          ASSERT_TRUE(try_catch_block());
+          jpegli_destroy_compress(&cinfo);
+          expected[i].assign(buffer, buffer + buffer_size);
+          free(buffer);
+        }
+        JpegliImageDesc desc;
+        desc.pixels = image.pixels.data();
+        desc.stride = stride;
+        desc.width = image.xsize;
+        desc.height = image.ysize;
+        std::vector<JpegliBatchOutput> outputs(rungs.size());
+        jpeg_compress_struct cinfo;
+        const auto try_catch_block = [&]() -> bool {
+          ERROR_HANDLER_SETUP(jpegli);
+          jpegli_create_compress(&cinfo);
+          set_params(&cinfo);
+          // The second ladder reuses the rung compressors of the first one.
+          for (int run = 0; run < 2; ++run) {
+            jpegli_encode_ladder(&cinfo, &desc, rungs.data(), rungs.size(),
+                                 outputs.data());
+            for (size_t i = 0; i < rungs.size(); ++i) {
+              EXPECT_EQ(expected[i].size(), outputs[i].size);
+              if (expected[i].size() == outputs[i].size) {
+                EXPECT_EQ(0, memcmp(expected[i].data(), outputs[i].data,
+                                    outputs[i].size));
+              }
+              free(outputs[i].data);
+            }
+          }
+          return true;
+        };
+        EXPECT_TRUE(try_catch_block());
+        jpegli_destroy_compress(&cinfo);
       }
     }
   }
-  return all_configs;
 }
 
-TEST(EncodeAPITest, ReuseCinfoSameMemOutput) {
+TEST(EncodeAPITest, ReuseCinfoSameStdOutput) {
   std::vector<TestConfig> all_configs = GenerateBasicConfigs();
-  uint8_t* buffer = nullptr;
-  unsigned long buffer_size = 0;  // NOLINT
+  FILE* tmpf = tmpfile();
+  ASSERT_TRUE(tmpf);
   {
     jpeg_compress_struct cinfo;
     const auto try_catch_block = [&]() -> bool {
       ERROR_HANDLER_SETUP(jpegli);
       jpegli_create_compress(&cinfo);
-      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      jpegli_stdio_dest(&cinfo, tmpf);
       for (const TestConfig& config : all_configs) {
         EncodeWithJpegli(config.input, config.jparams, &cinfo);
       }
@@ -142,17 +1380,22 @@ TEST(EncodeAPITest, ReuseCinfoSameMemOutput) {
     EXPECT_TRUE(try_catch_block());
     jpegli_destroy_compress(&cinfo);
   }
+  size_t total_size = ftell(tmpf);
+  fseek(tmpf, 0, SEEK_SET);
+  std::vector<uint8_t> compressed(total_size);
+  ASSERT_TRUE(total_size == fread(compressed.data(), 1, total_size, tmpf));
+  fclose(tmpf);
   size_t pos = 0;
   for (auto& config : all_configs) {
     TestImage output;
-    pos += DecodeWithLibjpeg(config.jparams, DecompressParams(), nullptr, 0,
-                             buffer + pos, buffer_size - pos, &output);
+    pos +=
+        DecodeWithLibjpeg(config.jparams, DecompressParams(), nullptr, 0,
+                          &compressed[pos], compressed.size() - pos, &output);
     VerifyOutputImage(config.input, output, config.max_dist);
   }
-  if (buffer) free(buffer);
 }
 
-TEST(EncodeAPITest, ReuseCinfoSameStdOutput) {
+TEST(EncodeAPITest, ReuseCinfoSameWriteBehindOutput) {
   std::vector<TestConfig> all_configs = GenerateBasicConfigs();
   FILE* tmpf = tmpfile();
   ASSERT_TRUE(tmpf);
@@ -161,7 +1404,7 @@ TEST(EncodeAPITest, ReuseCinfoSameStdOutput) {
     const auto try_catch_block = [&]() -> bool {
       ERROR_HANDLER_SETUP(jpegli);
       jpegli_create_compress(&cinfo);
-      jpegli_stdio_dest(&cinfo, tmpf);
+      jpegli_writebehind_dest(&cinfo, tmpf, 2);
       for (const TestConfig& config : all_configs) {
         EncodeWithJpegli(config.input, config.jparams, &cinfo);
       }
@@ -183,7 +1426,44 @@ TEST(EncodeAPITest, ReuseCinfoSameStdOutput) {
                           &compressed[pos], compressed.size() - pos, &output);
     VerifyOutputImage(config.input, output, config.max_dist);
   }
+  EXPECT_EQ(pos, compressed.size());
+}
+
+#if JPEGLI_TEST_FD_DEST
+TEST(EncodeAPITest, ReuseCinfoSameFdOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  FILE* tmpf = tmpfile();
+  ASSERT_TRUE(tmpf);
+  {
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      jpegli_fd_dest(&cinfo, fileno(tmpf));
+      for (const TestConfig& config : all_configs) {
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+      }
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_compress(&cinfo);
+  }
+  size_t total_size = lseek(fileno(tmpf), 0, SEEK_CUR);
+  fseek(tmpf, 0, SEEK_SET);
+  std::vector<uint8_t> compressed(total_size);
+  ASSERT_TRUE(total_size == fread(compressed.data(), 1, total_size, tmpf));
+  fclose(tmpf);
+  size_t pos = 0;
+  for (auto& config : all_configs) {
+    TestImage output;
+    pos +=
+        DecodeWithLibjpeg(config.jparams, DecompressParams(), nullptr, 0,
+                          &compressed[pos], compressed.size() - pos, &output);
+    VerifyOutputImage(config.input, output, config.max_dist);
+  }
+  EXPECT_EQ(pos, compressed.size());
 }
+#endif
 
 TEST(EncodeAPITest, ReuseCinfoChangeParams) {
   TestImage input;
@@ -308,6 +1588,149 @@ void CopyQuantTables(j_compress_ptr cinfo, uint16_t* quant_tables) {
   }
 }
 
+TEST(EncodeAPITest, StreamingPSNRSearch) {
+  TestImage input;
+  input.xsize = 256;
+  input.ysize = 256;
+  CompressParams jparams;
+  GenerateInput(PIXELS, jparams, &input);
+  jparams.psnr_target = 38.0f;
+  for (int optimize : {0, 1}) {
+    jparams.optimize_coding = optimize;
+    jparams.psnr_search_rows = 0;
+    std::vector<uint8_t> compressed0;
+    ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed0));
+    // If all iMCU rows are used for the search, the streaming search must
+    // give the same result as the non-streaming one.
+    jparams.psnr_search_rows = 1000;
+    std::vector<uint8_t> compressed1;
+    ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed1));
+    ASSERT_EQ(compressed0.size(), compressed1.size());
+    EXPECT_EQ(0, memcmp(compressed0.data(), compressed1.data(),
+                        compressed0.size()));
+    TestImage output0;
+    DecodeWithLibjpeg(jparams, DecompressParams(), compressed0, &output0);
+    const double psnr0 = 20.0 * std::log10(255.0 / DistanceRms(input, output0));
+    jparams.psnr_search_rows = 4;
+    std::vector<uint8_t> compressed2;
+    ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed2));
+    TestImage output2;
+    DecodeWithLibjpeg(jparams, DecompressParams(), compressed2, &output2);
+    const double psnr2 = 20.0 * std::log10(255.0 / DistanceRms(input, output2));
+    EXPECT_NEAR(psnr0, psnr2, 2.0) << jparams;
+  }
+}
+
+TEST(EncodeAPITest, TargetSize) {
+  TestImage input;
+  input.xsize = 256;
+  input.ysize = 256;
+  CompressParams jparams;
+  GenerateInput(PIXELS, jparams, &input);
+  for (size_t target_size : {8000, 20000, 40000}) {
+    for (int progressive_mode : {0, 2}) {
+      jparams.target_size = target_size;
+      jparams.progressive_mode = progressive_mode;
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+      // The search is based on an estimate of the compressed size, so we only
+      // check that we are in the right ballpark.
+      EXPECT_LE(compressed.size(), target_size * 1.1) << jparams;
+      EXPECT_GE(compressed.size(), target_size * 0.7) << jparams;
+    }
+  }
+}
+
+TEST(EncodeAPITest, ButteraugliTarget) {
+  TestImage input;
+  input.xsize = 256;
+  input.ysize = 256;
+  CompressParams jparams;
+  GenerateInput(PIXELS, jparams, &input);
+  for (int progressive_mode : {0, 2}) {
+    jparams.progressive_mode = progressive_mode;
+    size_t prev_size = 0;
+    double prev_rms = 0.0;
+    for (float target : {4.0f, 2.0f, 1.0f}) {
+      jparams.butteraugli_target = target;
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+      TestImage output;
+      DecodeWithLibjpeg(jparams, DecompressParams(), compressed, &output);
+      const double rms = DistanceRms(input, output);
+      // Smaller targets have to give larger files with smaller errors.
+      if (prev_size > 0) {
+        EXPECT_GT(compressed.size(), prev_size) << jparams;
+        EXPECT_LT(rms, prev_rms) << jparams;
+      }
+      prev_size = compressed.size();
+      prev_rms = rms;
+    }
+  }
+}
+
+TEST(EncodeAPITest, EstimateCompressedSize) {
+  TestImage input;
+  input.xsize = 256;
+  input.ysize = 256;
+  CompressParams jparams;
+  GenerateInput(PIXELS, jparams, &input);
+  for (int progressive_level : {0, 1, 2}) {
+    for (int optimize : {0, 1}) {
+      for (int restart_interval : {0, 5}) {
+        for (int stream_dc_scan : {0, 1}) {
+          if (stream_dc_scan && progressive_level == 0) continue;
+          uint8_t* buffer = nullptr;
+          unsigned long buffer_size = 0;  // NOLINT
+          size_t estimated_size = 0;
+          int num_scans = 0;
+          jpeg_compress_struct cinfo;
+          const auto try_catch_block = [&]() -> bool {
+            ERROR_HANDLER_SETUP(jpegli);
+            jpegli_create_compress(&cinfo);
+            jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+            cinfo.image_width = input.xsize;
+            cinfo.image_height = input.ysize;
+            cinfo.input_components = input.components;
+            cinfo.in_color_space = JCS_RGB;
+            jpegli_set_defaults(&cinfo);
+            jpegli_set_progressive_level(&cinfo, progressive_level);
+            jpegli_stream_dc_scan(&cinfo, stream_dc_scan);
+            cinfo.optimize_coding = optimize;
+            cinfo.restart_interval = restart_interval;
+            jpegli_start_compress(&cinfo, TRUE);
+            size_t stride = cinfo.image_width * cinfo.input_components;
+            std::vector<uint8_t> row_bytes(stride);
+            for (size_t y = 0; y < cinfo.image_height; ++y) {
+              memcpy(row_bytes.data(), &input.pixels[y * stride], stride);
+              JSAMPROW row[] = {row_bytes.data()};
+              jpegli_write_scanlines(&cinfo, row, 1);
+            }
+            estimated_size = jpegli_estimate_compressed_size(&cinfo);
+            num_scans = cinfo.num_scans;
+            // A second call must not change the result.
+            EXPECT_EQ(estimated_size, jpegli_estimate_compressed_size(&cinfo));
+            jpegli_finish_compress(&cinfo);
+            return true;
+          };
+          EXPECT_TRUE(try_catch_block());
+          jpegli_destroy_compress(&cinfo);
+          // Only the stuffed zero bytes are missing from the estimate.
+          EXPECT_LE(estimated_size, buffer_size);
+          // The 1-bit padding before a restart marker makes a stuffed byte for
+          // about one in seven markers.
+          size_t num_markers = 0;
+          if (restart_interval > 0) {
+            num_markers = num_scans * 1024 / restart_interval;
+          }
+          EXPECT_GE(estimated_size * 1.01 + num_markers / 4, buffer_size);
+          if (buffer) free(buffer);
+        }
+      }
+    }
+  }
+}
+
 TEST(EncodeAPITest, QualitySettings) {
   // Test that jpegli_set_quality, jpegli_set_linear_quality and
   // jpegli_quality_scaling are consistent with each other.
@@ -354,6 +1777,162 @@ TEST(EncodeAPITest, QualitySettings) {
   EXPECT_EQ(0, jpegli_quality_scaling(101));
 }
 
+TEST(EncodeAPITest, InputToneMapping) {
+  // A gray ramp of all PQ code values, which is tone mapped from 1000 nits to
+  // 100 nits.
+  const size_t xsize = 256;
+  const size_t ysize = 8;
+  std::vector<uint8_t> pixels(xsize * ysize * 3);
+  for (size_t i = 0; i < pixels.size(); ++i) {
+    pixels[i] = (i / 3) % xsize;
+  }
+  JpegliToneMapping tone_mapping = {16, 1000.0f, 100.0f,
+                                    {0.2126f, 0.7152f, 0.0722f}};
+  std::vector<uint8_t> compressed;
+  jpeg_compress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_compress(&cinfo);
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    cinfo.image_width = xsize;
+    cinfo.image_height = ysize;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpegli_set_input_tone_mapping(&cinfo, &tone_mapping);
+    jpegli_set_defaults(&cinfo);
+    jpegli_set_quality(&cinfo, 100, TRUE);
+    jpegli_enable_adaptive_quantization(&cinfo, FALSE);
+    jpegli_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+      JSAMPROW row[] = {&pixels[cinfo.next_scanline * xsize * 3]};
+      jpegli_write_scanlines(&cinfo, row, 1);
+    }
+    jpegli_finish_compress(&cinfo);
+    compressed.assign(buffer, buffer + buffer_size);
+    free(buffer);
+    return true;
+  };
+  ASSERT_TRUE(try_catch_block());
+  jpegli_destroy_compress(&cinfo);
+  TestImage output;
+  DecodeWithLibjpeg(CompressParams(), DecompressParams(), compressed, &output);
+  ASSERT_EQ(xsize, output.xsize);
+  ASSERT_EQ(3u, output.components);
+  const uint8_t* row = &output.pixels[(ysize / 2) * xsize * 3];
+  EXPECT_LE(row[0], 3);
+  for (size_t x = 0; x < xsize; ++x) {
+    EXPECT_NEAR(row[3 * x], row[3 * x + 1], 3) << "x = " << x;
+    if (x > 0) {
+      EXPECT_GE(row[3 * x] + 3, row[3 * x - 3]) << "x = " << x;
+    }
+    // PQ code values above 0.76 are brighter than the 1000 nits source peak.
+    if (x >= 200) {
+      EXPECT_GE(row[3 * x], 250) << "x = " << x;
+    }
+  }
+
+  // Tone mapping needs RGB input.
+  const auto try_catch_block_gray = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_compress(&cinfo);
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    cinfo.image_width = xsize;
+    cinfo.image_height = ysize;
+    cinfo.input_components = 1;
+    cinfo.in_color_space = JCS_GRAYSCALE;
+    jpegli_set_input_tone_mapping(&cinfo, &tone_mapping);
+    jpegli_set_defaults(&cinfo);
+    jpegli_start_compress(&cinfo, TRUE);
+    return true;
+  };
+  EXPECT_FALSE(try_catch_block_gray());
+  jpegli_destroy_compress(&cinfo);
+}
+
+#ifdef JCS_ALPHA_EXTENSIONS
+TEST(EncodeAPITest, InputAlphaBlending) {
+  const size_t xsize = 64;
+  const size_t ysize = 32;
+  const float background[3] = {1.0f, 0.5f, 0.0f};
+  // Colors with an alpha ramp, and the same colors composited onto the
+  // background.
+  std::vector<uint8_t> rgba(xsize * ysize * 4);
+  std::vector<uint8_t> blended(xsize * ysize * 3);
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      const size_t i = y * xsize + x;
+      const uint8_t rgb[3] = {static_cast<uint8_t>(4 * x),
+                              static_cast<uint8_t>(8 * y),
+                              static_cast<uint8_t>(255 - 4 * x)};
+      const float alpha = (x + y) % 16 / 15.0f;
+      for (size_t c = 0; c < 3; ++c) {
+        rgba[4 * i + c] = rgb[c];
+        blended[3 * i + c] = std::round(
+            alpha * rgb[c] + (1.0f - alpha) * background[c] * 255.0f);
+      }
+      rgba[4 * i + 3] = std::round(alpha * 255.0f);
+    }
+  }
+  const auto encode = [&](J_COLOR_SPACE in_color_space,
+                          const std::vector<uint8_t>& pixels, bool blend,
+                          std::vector<uint8_t>* compressed) -> bool {
+    jpeg_compress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_compress(&cinfo);
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      cinfo.image_width = xsize;
+      cinfo.image_height = ysize;
+      cinfo.input_components = in_color_space == JCS_RGB ? 3 : 4;
+      cinfo.in_color_space = in_color_space;
+      if (blend) {
+        jpegli_set_input_alpha_background(&cinfo, background);
+      }
+      jpegli_set_defaults(&cinfo);
+      jpegli_set_quality(&cinfo, 100, TRUE);
+      jpegli_enable_adaptive_quantization(&cinfo, FALSE);
+      jpegli_start_compress(&cinfo, TRUE);
+      const size_t stride = xsize * cinfo.input_components;
+      while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row[] = {
+            const_cast<uint8_t*>(&pixels[cinfo.next_scanline * stride])};
+        jpegli_write_scanlines(&cinfo, row, 1);
+      }
+      jpegli_finish_compress(&cinfo);
+      compressed->assign(buffer, buffer + buffer_size);
+      free(buffer);
+      return true;
+    };
+    bool success = try_catch_block();
+    jpegli_destroy_compress(&cinfo);
+    return success;
+  };
+  std::vector<uint8_t> compressed;
+  std::vector<uint8_t> expected_compressed;
+  ASSERT_TRUE(encode(JCS_EXT_RGBA, rgba, /*blend=*/true, &compressed));
+  ASSERT_TRUE(
+      encode(JCS_RGB, blended, /*blend=*/false, &expected_compressed));
+  // Blending needs an alpha channel.
+  std::vector<uint8_t> unused;
+  EXPECT_FALSE(encode(JCS_RGB, blended, /*blend=*/true, &unused));
+  TestImage output;
+  TestImage expected;
+  DecodeWithLibjpeg(CompressParams(), DecompressParams(), compressed, &output);
+  DecodeWithLibjpeg(CompressParams(), DecompressParams(), expected_compressed,
+                    &expected);
+  ASSERT_EQ(expected.pixels.size(), output.pixels.size());
+  for (size_t i = 0; i < output.pixels.size(); ++i) {
+    ASSERT_NEAR(expected.pixels[i], output.pixels[i], 3) << "i = " << i;
+  }
+}
+#endif
+
 std::vector<TestConfig> GenerateTests() {
   std::vector<TestConfig> all_tests;
   for (int h_samp : {1, 2}) {
@@ -412,9 +1991,73 @@ std::vector<TestConfig> GenerateTests() {
         config.max_bpp = 2.05f;
         config.max_dist = 2.3f;
         all_tests.push_back(config);
+        if (!optimize) {
+          config.jparams.use_fixed_point_dct = true;
+          all_tests.push_back(config);
+        }
       }
     }
   }
+  for (int samp : {1, 2}) {
+    for (int progr : {0, 2}) {
+      TestConfig config;
+      config.jparams.h_sampling = {samp, 1, 1};
+      config.jparams.v_sampling = {samp, 1, 1};
+      config.jparams.progressive_mode = progr;
+      config.jparams.aq_mode = JPEGLI_AQ_FAST;
+      config.max_bpp = (samp == 1 ? 1.55 : 1.32) * (progr ? 0.97 : 1.0);
+      config.max_dist = samp == 1 ? 1.95 : 2.0;
+      all_tests.push_back(config);
+    }
+  }
+  for (int h_samp : {1, 2}) {
+    for (int v_samp : {1, 2}) {
+      if (h_samp == 1 && v_samp == 1) continue;
+      TestConfig config;
+      config.jparams.h_sampling = {h_samp, 1, 1};
+      config.jparams.v_sampling = {v_samp, 1, 1};
+      config.jparams.downsample_mode = JPEGLI_DOWNSAMPLE_SHARP;
+      config.max_bpp = h_samp == v_samp ? 1.35 : 1.55;
+      config.max_dist = 2.05;
+      all_tests.push_back(config);
+    }
+  }
+  for (int samp : {1, 2}) {
+    for (int restart_interval : {0, 7}) {
+      TestConfig config;
+      config.jparams.h_sampling = {samp, 1, 1};
+      config.jparams.v_sampling = {samp, 1, 1};
+      config.jparams.progressive_mode = 2;
+      config.jparams.optimize_scans = true;
+      config.jparams.stream_dc_scan = restart_interval > 0;
+      config.jparams.restart_interval = restart_interval;
+      config.max_bpp = (samp == 1 ? 1.55 : 1.32) * 0.97;
+      config.max_dist = samp == 1 ? 1.95 : 2.0;
+      all_tests.push_back(config);
+    }
+  }
+  for (int effort = 1; effort <= 9; ++effort) {
+    TestConfig config;
+    if (effort == 1) {
+      config.input.xsize = 257;
+      config.input.ysize = 265;
+    }
+    config.jparams.effort = effort;
+    config.max_bpp = effort == 1 ? 2.05 : 1.55;
+    config.max_dist = effort == 1 ? 2.3 : 2.05;
+    all_tests.push_back(config);
+  }
+  for (int progr : {0, 2}) {
+    for (bool aq : {true, false}) {
+      TestConfig config;
+      config.jparams.progressive_mode = progr;
+      config.jparams.use_adaptive_quantization = aq;
+      config.jparams.use_trellis_quantization = true;
+      config.max_bpp = 1.32 * (progr ? 0.97 : 1.0) * 0.99;
+      config.max_dist = 2.05;
+      all_tests.push_back(config);
+    }
+  }
   for (int h0_samp : {1, 2, 4}) {
     for (int v0_samp : {1, 2, 4}) {
       for (int h2_samp : {1, 2, 4}) {
@@ -0,0 +1,427 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include <setjmp.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/context.h"
+#include "lib/jpegli/encode.h"
+#include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/error.h"
+#include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/parallel.h"
+
+namespace jpegli {
+
+// A compressor of jpegli_encode_batch() that is used by one thread at a time.
+// Errors are caught with its own error manager, since they can not be
+// propagated from a worker thread to the error manager of the caller.
+struct BatchWorker {
+  jpeg_compress_struct cinfo;
+  jpeg_error_mgr jerr;
+  jmp_buf env;
+  char message[JMSG_STR_PARM_MAX];
+  bool created = false;
+  // Batch whose parameters were copied to cinfo.
+  size_t configured_batch = 0;
+
+  ~BatchWorker() {
+    if (created) jpegli_destroy_compress(&cinfo);
+  }
+};
+
+struct BatchEncoder {
+  std::vector<std::unique_ptr<BatchWorker>> workers;
+  size_t num_batches = 0;
+};
+
+// The rung compressors of jpegli_encode_ladder(). They all run on the thread
+// of the caller and report their errors to env, so that all of them can be
+// aborted before the error is reported on the compressor of the caller.
+struct LadderEncoder {
+  std::vector<std::unique_ptr<BatchWorker>> rungs;
+  // Index of the rung that reads the input rows of each rung.
+  std::vector<size_t> leaders;
+  std::vector<unsigned long> sizes;  // NOLINT
+  jmp_buf env;
+  char message[JMSG_STR_PARM_MAX];
+  size_t failed_rung = 0;
+};
+
+namespace {
+
+void BatchWorkerErrorExit(j_common_ptr cinfo) {
+  BatchWorker* worker = static_cast<BatchWorker*>(cinfo->client_data);
+  memcpy(worker->message, cinfo->err->msg_parm.s, JMSG_STR_PARM_MAX);
+  worker->message[JMSG_STR_PARM_MAX - 1] = 0;
+  longjmp(worker->env, 1);
+}
+
+void LadderRungErrorExit(j_common_ptr cinfo) {
+  LadderEncoder* ladder = static_cast<LadderEncoder*>(cinfo->client_data);
+  for (size_t i = 0; i < ladder->rungs.size(); ++i) {
+    if (reinterpret_cast<j_common_ptr>(&ladder->rungs[i]->cinfo) == cinfo) {
+      ladder->failed_rung = i;
+    }
+  }
+  memcpy(ladder->message, cinfo->err->msg_parm.s, JMSG_STR_PARM_MAX);
+  ladder->message[JMSG_STR_PARM_MAX - 1] = 0;
+  longjmp(ladder->env, 1);
+}
+
+void CopyQuantTable(j_compress_ptr dst, const JQUANT_TBL* src,
+                    JQUANT_TBL** table) {
+  if (src == nullptr) {
+    *table = nullptr;
+    return;
+  }
+  if (*table == nullptr) {
+    *table = jpegli_alloc_quant_table(reinterpret_cast<j_common_ptr>(dst));
+  }
+  memcpy((*table)->quantval, src->quantval, sizeof(src->quantval));
+  (*table)->sent_table = FALSE;
+}
+
+void CopyHuffmanTable(j_compress_ptr dst, const JHUFF_TBL* src,
+                      JHUFF_TBL** table) {
+  if (src == nullptr) {
+    *table = nullptr;
+    return;
+  }
+  if (*table == nullptr) {
+    *table = jpegli_alloc_huff_table(reinterpret_cast<j_common_ptr>(dst));
+  }
+  memcpy((*table)->bits, src->bits, sizeof(src->bits));
+  memcpy((*table)->huffval, src->huffval, sizeof(src->huffval));
+  (*table)->sent_table = FALSE;
+}
+
+// Sets the compression parameters of dst, which is in its start state, to
+// those of src. The scan script is shared with src.
+void CopyCompressParameters(j_compress_ptr src, j_compress_ptr dst) {
+  const jpeg_comp_master* ms = src->master;
+  jpeg_comp_master* md = dst->master;
+  dst->in_color_space = src->in_color_space;
+  dst->input_components = src->input_components;
+  md->xyb_mode = ms->xyb_mode;
+  jpegli_set_defaults(dst);
+  jpegli_set_colorspace(dst, src->jpeg_color_space);
+  for (int c = 0; c < src->num_components; ++c) {
+    const jpeg_component_info* comp_src = &src->comp_info[c];
+    jpeg_component_info* comp_dst = &dst->comp_info[c];
+    comp_dst->component_id = comp_src->component_id;
+    comp_dst->h_samp_factor = comp_src->h_samp_factor;
+    comp_dst->v_samp_factor = comp_src->v_samp_factor;
+    comp_dst->quant_tbl_no = comp_src->quant_tbl_no;
+    comp_dst->dc_tbl_no = comp_src->dc_tbl_no;
+    comp_dst->ac_tbl_no = comp_src->ac_tbl_no;
+  }
+  for (int i = 0; i < NUM_QUANT_TBLS; ++i) {
+    CopyQuantTable(dst, src->quant_tbl_ptrs[i], &dst->quant_tbl_ptrs[i]);
+  }
+  for (int i = 0; i < NUM_HUFF_TBLS; ++i) {
+    CopyHuffmanTable(dst, src->dc_huff_tbl_ptrs[i], &dst->dc_huff_tbl_ptrs[i]);
+    CopyHuffmanTable(dst, src->ac_huff_tbl_ptrs[i], &dst->ac_huff_tbl_ptrs[i]);
+  }
+  dst->input_gamma = src->input_gamma;
+  dst->data_precision = src->data_precision;
+  dst->num_scans = src->num_scans;
+  dst->scan_info = src->scan_info;
+  dst->arith_code = src->arith_code;
+  dst->optimize_coding = src->optimize_coding;
+  dst->CCIR601_sampling = src->CCIR601_sampling;
+  dst->smoothing_factor = src->smoothing_factor;
+  dst->dct_method = src->dct_method;
+  dst->restart_interval = src->restart_interval;
+  dst->restart_in_rows = src->restart_in_rows;
+  dst->write_JFIF_header = src->write_JFIF_header;
+  dst->JFIF_major_version = src->JFIF_major_version;
+  dst->JFIF_minor_version = src->JFIF_minor_version;
+  dst->density_unit = src->density_unit;
+  dst->X_density = src->X_density;
+  dst->Y_density = src->Y_density;
+  dst->write_Adobe_marker = src->write_Adobe_marker;
+#if JPEG_LIB_VERSION >= 70
+  dst->scale_num = src->scale_num;
+  dst->scale_denom = src->scale_denom;
+  dst->do_fancy_downsampling = src->do_fancy_downsampling;
+  dst->min_DCT_h_scaled_size = src->min_DCT_h_scaled_size;
+  dst->min_DCT_v_scaled_size = src->min_DCT_v_scaled_size;
+#endif
+  md->force_baseline = ms->force_baseline;
+  md->cicp_transfer_function = ms->cicp_transfer_function;
+  md->tone_mapping_requested = ms->tone_mapping_requested;
+  md->tone_mapping = ms->tone_mapping;
+  md->use_std_tables = ms->use_std_tables;
+  md->use_adaptive_quantization = ms->use_adaptive_quantization;
+  md->aq_mode = ms->aq_mode;
+  md->downsample_mode = ms->downsample_mode;
+  md->fixed_point_dct_requested = ms->fixed_point_dct_requested;
+  md->use_compact_tokens = ms->use_compact_tokens;
+  md->two_pass_tokenization_requested = ms->two_pass_tokenization_requested;
+  md->trellis_quantization_requested = ms->trellis_quantization_requested;
+  md->progressive_level = ms->progressive_level;
+  md->optimize_scans = ms->optimize_scans;
+  md->stream_dc_scan_requested = ms->stream_dc_scan_requested;
+  md->write_restart_index = ms->write_restart_index;
+  md->parallel_decode_segments = ms->parallel_decode_segments;
+  md->data_type = ms->data_type;
+  md->endianness = ms->endianness;
+  md->psnr_target = ms->psnr_target;
+  md->psnr_tolerance = ms->psnr_tolerance;
+  md->min_distance = ms->min_distance;
+  md->max_distance = ms->max_distance;
+  md->psnr_search_rows = ms->psnr_search_rows;
+  md->target_size = ms->target_size;
+  md->butteraugli_target = ms->butteraugli_target;
+  md->cancel_flag = ms->cancel_flag;
+  md->huffman_presets = ms->huffman_presets;
+  md->num_huffman_presets = ms->num_huffman_presets;
+  // The workers share the caches of the context, but not its runner.
+  SetContext(&md->context, ms->context);
+}
+
+void EncodeImage(j_compress_ptr cinfo, const JpegliImageDesc& image,
+                 JpegliBatchOutput* output) {
+  unsigned long size = 0;  // NOLINT
+  jpegli_mem_dest(cinfo, &output->data, &size);
+  cinfo->image_width = image.width;
+  cinfo->image_height = image.height;
+  jpegli_start_compress(cinfo, TRUE);
+  const uint8_t* pixels = static_cast<const uint8_t*>(image.pixels);
+  while (cinfo->next_scanline < cinfo->image_height) {
+    JSAMPROW row[] = {
+        const_cast<JSAMPROW>(pixels + cinfo->next_scanline * image.stride)};
+    jpegli_write_scanlines(cinfo, row, 1);
+  }
+  jpegli_finish_compress(cinfo);
+  output->size = size;
+}
+
+bool SameSampling(j_compress_ptr a, j_compress_ptr b) {
+  for (int c = 0; c < a->num_components; ++c) {
+    if (a->comp_info[c].h_samp_factor != b->comp_info[c].h_samp_factor ||
+        a->comp_info[c].v_samp_factor != b->comp_info[c].v_samp_factor) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Sets up the compressor of a rung with the parameters of cinfo.
+void ConfigureLadderRung(j_compress_ptr cinfo, const JpegliImageDesc& image,
+                         const JpegliLadderRung& rung, j_compress_ptr rcinfo) {
+  CopyCompressParameters(cinfo, rcinfo);
+  if (rung.h_samp_factor > 0) {
+    for (int c = 0; c < rcinfo->num_components; ++c) {
+      rcinfo->comp_info[c].h_samp_factor = c == 0 ? rung.h_samp_factor : 1;
+      rcinfo->comp_info[c].v_samp_factor = c == 0 ? rung.v_samp_factor : 1;
+    }
+  }
+  jpegli_set_distance(rcinfo, rung.distance,
+                      rcinfo->master->force_baseline ? TRUE : FALSE);
+  rcinfo->image_width = image.width;
+  rcinfo->image_height = image.height;
+  rcinfo->master->ladder_leader = nullptr;
+  rcinfo->master->ladder_followers = nullptr;
+  rcinfo->master->num_ladder_followers = 0;
+}
+
+}  // namespace
+
+void ReleaseBatchEncoder(j_compress_ptr cinfo) {
+  delete cinfo->master->batch_encoder;
+  cinfo->master->batch_encoder = nullptr;
+}
+
+void ReleaseLadderEncoder(j_compress_ptr cinfo) {
+  delete cinfo->master->ladder_encoder;
+  cinfo->master->ladder_encoder = nullptr;
+}
+
+}  // namespace jpegli
+
+void jpegli_encode_batch(j_compress_ptr cinfo, const JpegliImageDesc* images,
+                         size_t num_images, JpegliBatchOutput* outputs) {
+  if (cinfo->global_state != jpegli::kEncStart) {
+    JPEGLI_ERROR("jpegli_encode_batch: unexpected state %d",
+                 cinfo->global_state);
+  }
+  if (cinfo->raw_data_in) {
+    JPEGLI_ERROR("jpegli_encode_batch: raw data input is not supported");
+  }
+  if (num_images > UINT32_MAX) {
+    JPEGLI_ERROR("jpegli_encode_batch: too many images");
+  }
+  for (size_t i = 0; i < num_images; ++i) {
+    outputs[i].data = nullptr;
+    outputs[i].size = 0;
+  }
+  if (num_images == 0) return;
+  jpeg_comp_master* m = cinfo->master;
+  if (m->batch_encoder == nullptr) {
+    m->batch_encoder = new jpegli::BatchEncoder;
+  }
+  jpegli::BatchEncoder* batch = m->batch_encoder;
+  const size_t batch_id = ++batch->num_batches;
+  std::atomic<bool> failed{false};
+  size_t failed_image = 0;
+  size_t failed_thread = 0;
+  const auto init = [&](size_t num_threads) {
+    while (batch->workers.size() < num_threads) {
+      std::unique_ptr<jpegli::BatchWorker> worker(new (std::nothrow)
+                                                      jpegli::BatchWorker);
+      if (worker == nullptr) return false;
+      batch->workers.emplace_back(std::move(worker));
+    }
+    return true;
+  };
+  const auto encode_image = [&](uint32_t i, size_t thread) {
+    if (failed.load(std::memory_order_relaxed)) return;
+    jpegli::BatchWorker* worker = batch->workers[thread].get();
+    j_compress_ptr wcinfo = &worker->cinfo;
+    if (setjmp(worker->env)) {
+      if (!failed.exchange(true)) {
+        failed_image = i;
+        failed_thread = thread;
+      }
+      jpegli_abort_compress(wcinfo);
+      return;
+    }
+    if (!worker->created) {
+      wcinfo->err = jpegli_std_error(&worker->jerr);
+      worker->jerr.error_exit = &jpegli::BatchWorkerErrorExit;
+      wcinfo->client_data = worker;
+      jpegli_create_compress(wcinfo);
+      worker->created = true;
+      jpegli_keep_image_memory(reinterpret_cast<j_common_ptr>(wcinfo), TRUE);
+    }
+    if (worker->configured_batch != batch_id) {
+      jpegli::CopyCompressParameters(cinfo, wcinfo);
+      worker->configured_batch = batch_id;
+    }
+    jpegli::EncodeImage(wcinfo, images[i], &outputs[i]);
+  };
+  jpegli::RunParallel(cinfo, 0, num_images, init, encode_image);
+  if (failed) {
+    for (size_t i = 0; i < num_images; ++i) {
+      free(outputs[i].data);
+      outputs[i].data = nullptr;
+      outputs[i].size = 0;
+    }
+    JPEGLI_ERROR("jpegli_encode_batch: image %d failed: %s",
+                 static_cast<int>(failed_image),
+                 batch->workers[failed_thread]->message);
+  }
+}
+
+void jpegli_encode_ladder(j_compress_ptr cinfo, const JpegliImageDesc* image,
+                          const JpegliLadderRung* rungs, size_t num_rungs,
+                          JpegliBatchOutput* outputs) {
+  if (cinfo->global_state != jpegli::kEncStart) {
+    JPEGLI_ERROR("jpegli_encode_ladder: unexpected state %d",
+                 cinfo->global_state);
+  }
+  if (cinfo->raw_data_in) {
+    JPEGLI_ERROR("jpegli_encode_ladder: raw data input is not supported");
+  }
+  if (jpegli::IsDistanceSearch(cinfo)) {
+    JPEGLI_ERROR("jpegli_encode_ladder: distance search is not supported");
+  }
+  for (size_t i = 0; i < num_rungs; ++i) {
+    outputs[i].data = nullptr;
+    outputs[i].size = 0;
+  }
+  if (num_rungs == 0) return;
+  jpeg_comp_master* m = cinfo->master;
+  if (m->ladder_encoder == nullptr) {
+    m->ladder_encoder = new jpegli::LadderEncoder;
+  }
+  jpegli::LadderEncoder* ladder = m->ladder_encoder;
+  while (ladder->rungs.size() < num_rungs) {
+    ladder->rungs.emplace_back(new jpegli::BatchWorker);
+  }
+  ladder->leaders.assign(num_rungs, 0);
+  ladder->sizes.assign(num_rungs, 0);
+  const auto rung_cinfo = [&](size_t i) { return &ladder->rungs[i]->cinfo; };
+  if (setjmp(ladder->env)) {
+    for (size_t i = 0; i < num_rungs; ++i) {
+      if (ladder->rungs[i]->created) jpegli_abort_compress(rung_cinfo(i));
+      free(outputs[i].data);
+      outputs[i].data = nullptr;
+      outputs[i].size = 0;
+    }
+    JPEGLI_ERROR("jpegli_encode_ladder: rung %d failed: %s",
+                 static_cast<int>(ladder->failed_rung), ladder->message);
+  }
+  for (size_t i = 0; i < num_rungs; ++i) {
+    jpegli::BatchWorker* rung = ladder->rungs[i].get();
+    j_compress_ptr rcinfo = &rung->cinfo;
+    if (!rung->created) {
+      rcinfo->err = jpegli_std_error(&rung->jerr);
+      rung->jerr.error_exit = &jpegli::LadderRungErrorExit;
+      rcinfo->client_data = ladder;
+      jpegli_create_compress(rcinfo);
+      rung->created = true;
+      jpegli_keep_image_memory(reinterpret_cast<j_common_ptr>(rcinfo), TRUE);
+    }
+    jpegli::ConfigureLadderRung(cinfo, *image, rungs[i], rcinfo);
+    jpegli_mem_dest(rcinfo, &outputs[i].data, &ladder->sizes[i]);
+    // The first rung with the same sampling factors reads the input rows.
+    size_t leader = i;
+    for (size_t j = 0; j < i; ++j) {
+      if (ladder->leaders[j] == j &&
+          jpegli::SameSampling(rung_cinfo(j), rcinfo)) {
+        leader = j;
+        break;
+      }
+    }
+    ladder->leaders[i] = leader;
+    if (leader != i) rcinfo->master->ladder_leader = rung_cinfo(leader);
+    jpegli_start_compress(rcinfo, TRUE);
+  }
+  for (size_t i = 0; i < num_rungs; ++i) {
+    if (ladder->leaders[i] != i) continue;
+    jpeg_comp_master* rm = rung_cinfo(i)->master;
+    rm->ladder_followers = jpegli::Allocate<j_compress_ptr>(
+        rung_cinfo(i), num_rungs, JPOOL_IMAGE);
+    for (size_t j = i + 1; j < num_rungs; ++j) {
+      if (ladder->leaders[j] == i) {
+        rm->ladder_followers[rm->num_ladder_followers++] = rung_cinfo(j);
+      }
+    }
+  }
+  const uint8_t* pixels = static_cast<const uint8_t*>(image->pixels);
+  for (size_t i = 0; i < num_rungs; ++i) {
+    if (ladder->leaders[i] != i) continue;
+    j_compress_ptr rcinfo = rung_cinfo(i);
+    while (rcinfo->next_scanline < rcinfo->image_height) {
+      JSAMPROW row[] = {const_cast<JSAMPROW>(
+          pixels + rcinfo->next_scanline * image->stride)};
+      jpegli_write_scanlines(rcinfo, row, 1);
+    }
+  }
+  // The followers are finished first, since their input rows are in the
+  // buffers of their leaders.
+  for (size_t i = 0; i < num_rungs; ++i) {
+    if (ladder->leaders[i] != i) jpegli_finish_compress(rung_cinfo(i));
+  }
+  for (size_t i = 0; i < num_rungs; ++i) {
+    if (ladder->leaders[i] == i) jpegli_finish_compress(rung_cinfo(i));
+  }
+  for (size_t i = 0; i < num_rungs; ++i) {
+    outputs[i].size = ladder->sizes[i];
+  }
+}
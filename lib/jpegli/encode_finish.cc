@@ -11,12 +11,18 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <limits>
 
+#include "lib/base/bits.h"
+#include "lib/jpegli/bitstream.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/entropy_coding.h"
 #include "lib/jpegli/memory_manager.h"
 #include "lib/jpegli/quant.h"
+#include "lib/jpegli/trellis.h"
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jpegli/encode_finish.cc"
@@ -84,6 +90,36 @@ float BlockError(const int16_t* block, const float* qmc, const float* iqmc,
   return GetLane(SumOfLanes(d, err));
 }
 
+// Returns the sum of the squared quantization errors of the block, each
+// measured in units of the quantization step at distance 1, which is given by
+// the inverse of ref_qmc.
+float BlockPerceptualError(const int16_t* block, const float* qmc,
+                           const float* iqmc, const float aq_strength,
+                           const float* zero_bias_offset,
+                           const float* zero_bias_mul, const float* ref_qmc) {
+  D d;
+  DI di;
+  DI16 di16;
+  auto err = Zero(d);
+  const auto aq_mul = Set(d, aq_strength);
+  for (size_t k = 0; k < DCTSIZE2; k += Lanes(d)) {
+    const auto in = Load(di16, block + k);
+    const auto val = ConvertTo(d, PromoteTo(di, in));
+    const auto q = Load(d, qmc + k);
+    const auto qval = Mul(val, q);
+    const auto zb_offset = Load(d, zero_bias_offset + k);
+    const auto zb_mul = Load(d, zero_bias_mul + k);
+    const auto threshold = Add(zb_offset, Mul(zb_mul, aq_mul));
+    const auto nzero_mask = Ge(Abs(qval), threshold);
+    const auto iqval = IfThenElseZero(nzero_mask, Round(qval));
+    const auto invq = Load(d, iqmc + k);
+    const auto rval = Mul(iqval, invq);
+    const auto diff = Mul(Sub(val, rval), Load(d, ref_qmc + k));
+    err = Add(err, Mul(diff, diff));
+  }
+  return GetLane(SumOfLanes(d, err));
+}
+
 void ComputeInverseWeights(const float* qmc, float* iqmc) {
   for (int k = 0; k < 64; ++k) {
     iqmc[k] = 1.0f / qmc[k];
@@ -104,7 +140,8 @@ float ComputePSNR(j_compress_ptr cinfo, int sampling) {
     const float* zero_bias_mul = m->zero_bias_mul[c];
     HWY_ALIGN float iqmc[64];
     ComputeInverseWeights(qmc, iqmc);
-    for (JDIMENSION by = 0; by < comp->height_in_blocks; by += sampling) {
+    const JDIMENSION ysize_blocks = NumBufferedBlockRows(cinfo, c);
+    for (JDIMENSION by = 0; by < ysize_blocks; by += sampling) {
       JBLOCKARRAY blocks = GetBlockRow(cinfo, c, by);
       const float* qf = m->quant_field.Row(by * v_factor);
       for (JDIMENSION bx = 0; bx < comp->width_in_blocks; bx += sampling) {
@@ -117,6 +154,49 @@ float ComputePSNR(j_compress_ptr cinfo, int sampling) {
   return 4.3429448f * log(num / (error / 255. / 255.));
 }
 
+// Returns an estimate of the butteraugli distance of the image quantized with
+// the current quantization matrices, using every sampling-th block row and
+// column. The error of each block is the root mean square of its coefficient
+// errors in units of the quantization steps at distance 1 (ref_qmc holds the
+// DCTSIZE2 quantization multipliers for each component), scaled so that it
+// equals the distance parameter when every coefficient is rounded with a
+// uniformly distributed error. The block errors are pooled with an 8-norm to
+// approximate the max-like pooling of butteraugli.
+float ComputePerceptualDistance(j_compress_ptr cinfo, int sampling,
+                                const float* ref_qmc) {
+  jpeg_comp_master* m = cinfo->master;
+  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  double sum = 0.0;
+  size_t num = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    const float* qmc = m->quant_mul[c];
+    const int h_factor = m->h_factor[c];
+    const int v_factor = m->v_factor[c];
+    const float* zero_bias_offset = m->zero_bias_offset[c];
+    const float* zero_bias_mul = m->zero_bias_mul[c];
+    HWY_ALIGN float iqmc[64];
+    ComputeInverseWeights(qmc, iqmc);
+    const JDIMENSION ysize_blocks = NumBufferedBlockRows(cinfo, c);
+    for (JDIMENSION by = 0; by < ysize_blocks; by += sampling) {
+      JBLOCKARRAY blocks = GetBlockRow(cinfo, c, by);
+      const float* qf = m->quant_field.Row(by * v_factor);
+      for (JDIMENSION bx = 0; bx < comp->width_in_blocks; bx += sampling) {
+        const float err = BlockPerceptualError(
+            &blocks[0][bx][0], qmc, iqmc, qf[bx * h_factor], zero_bias_offset,
+            zero_bias_mul, &ref_qmc[c * DCTSIZE2]);
+        // The mean squared error of uniform rounding is 1/12 of the squared
+        // quantization step.
+        const double dist2 = err * (12.0 / DCTSIZE2);
+        const double dist4 = dist2 * dist2;
+        sum += dist4 * dist4;
+        ++num;
+      }
+    }
+  }
+  return num == 0 ? 0.0f : std::pow(sum / num, 1.0 / 8);
+}
+
 void ReQuantizeCoeffs(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
@@ -127,7 +207,8 @@ void ReQuantizeCoeffs(j_compress_ptr cinfo) {
     const int v_factor = m->v_factor[c];
     const float* zero_bias_offset = m->zero_bias_offset[c];
     const float* zero_bias_mul = m->zero_bias_mul[c];
-    for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+    const JDIMENSION ysize_blocks = NumBufferedBlockRows(cinfo, c);
+    for (JDIMENSION by = 0; by < ysize_blocks; ++by) {
       JBLOCKARRAY block = GetBlockRow(cinfo, c, by);
       const float* qf = m->quant_field.Row(by * v_factor);
       for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
@@ -138,6 +219,68 @@ void ReQuantizeCoeffs(j_compress_ptr cinfo) {
   }
 }
 
+int NumBits(int val) {
+  return val == 0 ? 0 : jxl::FloorLog2Nonzero<uint32_t>(std::abs(val)) + 1;
+}
+
+// Returns the estimated size in bytes of the sequential scan data for the
+// current quantization matrices, computed from per-component Huffman
+// histograms of the requantized coefficients without storing them.
+float EstimateScanDataSize(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  HWY_ALIGN int16_t block[DCTSIZE2];
+  double total_bits = 0.0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    const float* qmc = m->quant_mul[c];
+    const int h_factor = m->h_factor[c];
+    const int v_factor = m->v_factor[c];
+    const float* zero_bias_offset = m->zero_bias_offset[c];
+    const float* zero_bias_mul = m->zero_bias_mul[c];
+    int dc_histo[kJpegHuffmanAlphabetSize] = {};
+    int ac_histo[kJpegHuffmanAlphabetSize] = {};
+    size_t extra_bits = 0;
+    int last_dc = 0;
+    const JDIMENSION ysize_blocks = NumBufferedBlockRows(cinfo, c);
+    for (JDIMENSION by = 0; by < ysize_blocks; ++by) {
+      JBLOCKARRAY blocks = GetBlockRow(cinfo, c, by);
+      const float* qf = m->quant_field.Row(by * v_factor);
+      for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+        memcpy(block, &blocks[0][bx][0], sizeof(block));
+        ReQuantizeBlock(block, qmc, qf[bx * h_factor], zero_bias_offset,
+                        zero_bias_mul);
+        const int dc_bits = NumBits(block[0] - last_dc);
+        last_dc = block[0];
+        ++dc_histo[dc_bits];
+        extra_bits += dc_bits;
+        int run = 0;
+        for (int k = 1; k < DCTSIZE2; ++k) {
+          if (block[k] == 0) {
+            ++run;
+            continue;
+          }
+          for (; run >= 16; run -= 16) {
+            ++ac_histo[0xf0];
+          }
+          const int ac_bits = NumBits(block[k]);
+          ++ac_histo[(run << 4) | ac_bits];
+          extra_bits += ac_bits;
+          run = 0;
+        }
+        if (run > 0) {
+          ++ac_histo[0];
+        }
+      }
+    }
+    total_bits +=
+        HistogramCost(dc_histo) + HistogramCost(ac_histo) + extra_bits;
+  }
+  // On average one in every 256 bytes of entropy coded data needs a stuffed
+  // zero byte.
+  return total_bits / 8 * (1.0 + 1.0 / 256);
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jpegli
@@ -148,8 +291,14 @@ namespace jpegli {
 namespace {
 HWY_EXPORT(ComputePSNR);
 HWY_EXPORT(ReQuantizeCoeffs);
+HWY_EXPORT(EstimateScanDataSize);
+HWY_EXPORT(ComputePerceptualDistance);
 
 void ReQuantizeCoeffs(j_compress_ptr cinfo) {
+  if (cinfo->master->use_trellis_quantization) {
+    TrellisQuantizeCoeffs(cinfo);
+    return;
+  }
   HWY_DYNAMIC_DISPATCH(ReQuantizeCoeffs)(cinfo);
 }
 
@@ -157,6 +306,16 @@ float ComputePSNR(j_compress_ptr cinfo, int sampling) {
   return HWY_DYNAMIC_DISPATCH(ComputePSNR)(cinfo, sampling);
 }
 
+float EstimateScanDataSize(j_compress_ptr cinfo) {
+  return HWY_DYNAMIC_DISPATCH(EstimateScanDataSize)(cinfo);
+}
+
+float ComputePerceptualDistance(j_compress_ptr cinfo, int sampling,
+                                const float* ref_qmc) {
+  return HWY_DYNAMIC_DISPATCH(ComputePerceptualDistance)(cinfo, sampling,
+                                                         ref_qmc);
+}
+
 void UpdateDistance(j_compress_ptr cinfo, float distance) {
   float distances[NUM_QUANT_TBLS] = {distance, distance, distance};
   SetQuantMatrices(cinfo, distances, /*add_two_chroma_tables=*/true);
@@ -166,6 +325,120 @@ float Clamp(float val, float minval, float maxval) {
   return std::max(minval, std::min(maxval, val));
 }
 
+// Histogram of the absolute values of the first pass coefficients, for each
+// component, coefficient position and adaptive quantization strength bin,
+// which is used to estimate the PSNR for a candidate distance in time that
+// does not depend on the number of blocks.
+//
+// Values below 128 have their own bin, larger values are put into bins with
+// a relative width of at most 1/64. The adaptive quantization strengths are
+// put into kNumAQBins uniform bins, each represented by the mean strength of
+// its blocks.
+constexpr int kNumValueBins = 640;
+constexpr int kNumAQBins = 4;
+
+struct PSNRStats {
+  // Indexed by ((c * DCTSIZE2 + k) * kNumAQBins + a) * kNumValueBins + b
+  uint32_t* counts;
+  float aq_strength[kMaxComponents][kNumAQBins];
+  size_t num_coeffs;
+};
+
+int ValueBin(int val) {
+  val = std::min(std::abs(val), 32767);
+  if (val < 128) return val;
+  int shift = jxl::FloorLog2Nonzero<uint32_t>(val) - 6;
+  return 64 * shift + (val >> shift);
+}
+
+float ValueBinCenter(int bin) {
+  if (bin < 128) return bin;
+  int shift = bin / 64 - 1;
+  int mantissa = bin - 64 * shift;
+  return ((mantissa << shift) + ((mantissa + 1) << shift) - 1) * 0.5f;
+}
+
+void ComputePSNRStats(j_compress_ptr cinfo, PSNRStats* stats) {
+  jpeg_comp_master* m = cinfo->master;
+  const size_t num_counts =
+      cinfo->num_components * DCTSIZE2 * kNumAQBins * kNumValueBins;
+  stats->counts = Allocate<uint32_t>(cinfo, num_counts, JPOOL_IMAGE);
+  memset(stats->counts, 0, num_counts * sizeof(stats->counts[0]));
+  stats->num_coeffs = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    const int h_factor = m->h_factor[c];
+    const int v_factor = m->v_factor[c];
+    const JDIMENSION ysize_blocks = NumBufferedBlockRows(cinfo, c);
+    float max_aq_strength = 0.0f;
+    for (JDIMENSION by = 0; by < ysize_blocks; ++by) {
+      const float* qf = m->quant_field.Row(by * v_factor);
+      for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+        max_aq_strength = std::max(max_aq_strength, qf[bx * h_factor]);
+      }
+    }
+    const float aq_bin_scale =
+        max_aq_strength > 0.0f ? (kNumAQBins - 1e-3f) / max_aq_strength : 0.0f;
+    double aq_sum[kNumAQBins] = {};
+    size_t aq_count[kNumAQBins] = {};
+    for (JDIMENSION by = 0; by < ysize_blocks; ++by) {
+      JBLOCKARRAY blocks = GetBlockRow(cinfo, c, by);
+      const float* qf = m->quant_field.Row(by * v_factor);
+      for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+        const float aq_strength = qf[bx * h_factor];
+        const int a = static_cast<int>(aq_strength * aq_bin_scale);
+        aq_sum[a] += aq_strength;
+        ++aq_count[a];
+        const JCOEF* block = &blocks[0][bx][0];
+        uint32_t* counts =
+            &stats->counts[c * DCTSIZE2 * kNumAQBins * kNumValueBins +
+                           a * kNumValueBins];
+        for (int k = 0; k < DCTSIZE2; ++k) {
+          ++counts[k * kNumAQBins * kNumValueBins + ValueBin(block[k])];
+        }
+        stats->num_coeffs += DCTSIZE2;
+      }
+    }
+    for (int a = 0; a < kNumAQBins; ++a) {
+      stats->aq_strength[c][a] =
+          aq_count[a] > 0 ? static_cast<float>(aq_sum[a] / aq_count[a]) : 0.0f;
+    }
+  }
+}
+
+// Estimates the value that ComputePSNR(cinfo, 1) would return, based on the
+// histogram of the coefficients.
+float EstimatePSNR(j_compress_ptr cinfo, const PSNRStats& stats) {
+  jpeg_comp_master* m = cinfo->master;
+  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  double error = 0.0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const float* qmc = m->quant_mul[c];
+    const float* zero_bias_offset = m->zero_bias_offset[c];
+    const float* zero_bias_mul = m->zero_bias_mul[c];
+    for (int k = 0; k < DCTSIZE2; ++k) {
+      const float q = qmc[k];
+      const float iq = 1.0f / q;
+      for (int a = 0; a < kNumAQBins; ++a) {
+        const float threshold =
+            zero_bias_offset[k] + zero_bias_mul[k] * stats.aq_strength[c][a];
+        const uint32_t* counts =
+            &stats.counts[((c * DCTSIZE2 + k) * kNumAQBins + a) *
+                          kNumValueBins];
+        for (int b = 0; b < kNumValueBins; ++b) {
+          if (counts[b] == 0) continue;
+          const float val = ValueBinCenter(b);
+          const float qval = val * q;
+          const float rval = qval >= threshold ? std::round(qval) * iq : 0.0f;
+          const float diff = (val - rval) * (1.0f / 16);
+          error += counts[b] * static_cast<double>(diff * diff);
+        }
+      }
+    }
+  }
+  return 4.3429448f * log(stats.num_coeffs / (error / 255. / 255.));
+}
+
 #define PSNR_SEARCH_DBG 0
 
 float FindDistanceForPSNR(j_compress_ptr cinfo) {
@@ -175,7 +448,11 @@ float FindDistanceForPSNR(j_compress_ptr cinfo) {
   const float min_dist = cinfo->master->min_distance;
   const float max_dist = cinfo->master->max_distance;
   float d = Clamp(1.0f, min_dist, max_dist);
-  for (int sampling : {4, 1}) {
+  // The first search is done on the estimated PSNR values, and the second
+  // search, which refines its result, on the exact ones.
+  PSNRStats stats;
+  ComputePSNRStats(cinfo, &stats);
+  for (bool exact : {false, true}) {
     float best_diff = std::numeric_limits<float>::max();
     float best_distance = 0.0f;
     float best_psnr = 0.0;
@@ -185,7 +462,7 @@ float FindDistanceForPSNR(j_compress_ptr cinfo) {
     bool found_upper_bound = false;
     for (int i = 0; i < kMaxIters; ++i) {
       UpdateDistance(cinfo, d);
-      float psnr = ComputePSNR(cinfo, sampling);
+      float psnr = exact ? ComputePSNR(cinfo, 1) : EstimatePSNR(cinfo, stats);
       if (psnr > psnr_target) {
         dmin = d;
         found_lower_bound = true;
@@ -194,7 +471,7 @@ float FindDistanceForPSNR(j_compress_ptr cinfo) {
         found_upper_bound = true;
       }
 #if (PSNR_SEARCH_DBG > 1)
-      printf("sampling %d iter %2d d %7.4f psnr %.2f", sampling, i, d, psnr);
+      printf("exact %d iter %2d d %7.4f psnr %.2f", exact, i, d, psnr);
       if (found_upper_bound && found_lower_bound) {
         printf("    d-interval: [ %7.4f .. %7.4f ]", dmin, dmax);
       }
@@ -217,7 +494,7 @@ float FindDistanceForPSNR(j_compress_ptr cinfo) {
       d = Clamp(d, min_dist, max_dist);
     }
     d = best_distance;
-    if (sampling == 1 && PSNR_SEARCH_DBG) {
+    if (exact && PSNR_SEARCH_DBG) {
       printf("Final PSNR %.2f at distance %.4f\n", best_psnr, d);
     } else {
       (void)best_psnr;
@@ -226,10 +503,141 @@ float FindDistanceForPSNR(j_compress_ptr cinfo) {
   return d;
 }
 
+// Returns the size of the markers that do not depend on the distance, i.e.
+// the ones already written and the remaining ones except for the DHT markers,
+// whose contents are included in the scan data size estimate.
+size_t FixedOverheadSize(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  bool used_tables[NUM_QUANT_TBLS] = {};
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    used_tables[cinfo->comp_info[c].quant_tbl_no] = true;
+  }
+  size_t size = m->num_output_bytes;
+  for (bool used : used_tables) {
+    size += used ? 2 + 2 + 1 + DCTSIZE2 : 0;  // DQT
+  }
+  size += 2 + 2 + 6 + 3 * cinfo->num_components;  // SOF
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info& si = cinfo->scan_info[i];
+    const ScanTokenInfo& sti = m->scan_token_info[i];
+    size += 2 + 2 + 1 + 2 * si.comps_in_scan + 3;  // SOS
+    size += 2 * (si.comps_in_scan + 1);             // DHT
+    if (sti.num_restarts > 1) {
+      size += 6 + 2 * (sti.num_restarts - 1);  // DRI and RSTn
+    }
+  }
+  size += RestartIndexSize(cinfo);
+  return size + 2;  // EOI
+}
+
+float FindDistanceForTargetSize(j_compress_ptr cinfo) {
+  constexpr int kMaxIters = 14;
+  const float target_size = cinfo->master->target_size;
+  float dmin = cinfo->master->min_distance;
+  float dmax = cinfo->master->max_distance;
+  const float overhead = FixedOverheadSize(cinfo);
+  // The estimated size decreases with the distance, so we look for the
+  // smallest distance where it fits into the target with bisection on a
+  // logarithmic scale.
+  UpdateDistance(cinfo, dmin);
+  if (overhead + EstimateScanDataSize(cinfo) <= target_size) {
+    return dmin;
+  }
+  for (int i = 0; i < kMaxIters && dmax > dmin * 1.005f; ++i) {
+    float d = std::sqrt(dmin * dmax);
+    UpdateDistance(cinfo, d);
+    float size = overhead + EstimateScanDataSize(cinfo);
+#if (PSNR_SEARCH_DBG > 1)
+    printf("iter %2d d %7.4f size %.0f\n", i, d, size);
+#endif
+    if (size <= target_size) {
+      dmax = d;
+    } else {
+      dmin = d;
+    }
+  }
+  return dmax;
+}
+
+// Returns the largest distance in [dmin, dmax] whose perceptual distance
+// estimate is at most the target, found with bisection on a logarithmic scale,
+// or dmin if even that is above the target.
+float BisectPerceptualDistance(j_compress_ptr cinfo, int sampling,
+                               const float* ref_qmc, float dmin, float dmax) {
+  constexpr int kMaxIters = 14;
+  const float target = cinfo->master->butteraugli_target;
+  for (int i = 0; i < kMaxIters && dmax > dmin * 1.005f; ++i) {
+    float d = std::sqrt(dmin * dmax);
+    UpdateDistance(cinfo, d);
+    float dist = ComputePerceptualDistance(cinfo, sampling, ref_qmc);
+#if (PSNR_SEARCH_DBG > 1)
+    printf("sampling %d iter %2d d %7.4f estimate %.3f\n", sampling, i, d,
+           dist);
+#endif
+    if (dist <= target) {
+      dmin = d;
+    } else {
+      dmax = d;
+    }
+  }
+  return dmin;
+}
+
+bool PerceptualDistanceFits(j_compress_ptr cinfo, float d, int sampling,
+                            const float* ref_qmc) {
+  UpdateDistance(cinfo, d);
+  return ComputePerceptualDistance(cinfo, sampling, ref_qmc) <=
+         cinfo->master->butteraugli_target;
+}
+
+float FindDistanceForButteraugliTarget(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  const float min_dist = m->min_distance;
+  const float max_dist = m->max_distance;
+  // The errors are measured in units of the quantization steps at distance 1.
+  HWY_ALIGN float ref_qmc[kMaxComponents * DCTSIZE2];
+  UpdateDistance(cinfo, 1.0f);
+  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    memcpy(&ref_qmc[c * DCTSIZE2], m->quant_mul[c], DCTSIZE2 * sizeof(float));
+  }
+  if (!PerceptualDistanceFits(cinfo, min_dist, 1, ref_qmc)) {
+    return min_dist;
+  }
+  // The first search is done on every other block row and column, and the
+  // second search, which verifies and refines its result, on all blocks.
+  float d = BisectPerceptualDistance(cinfo, 2, ref_qmc, min_dist, max_dist);
+  float dmin = std::max(min_dist, d * 0.8f);
+  float dmax = std::min(max_dist, d * 1.25f);
+  if (!PerceptualDistanceFits(cinfo, dmin, 1, ref_qmc)) {
+    dmax = dmin;
+    dmin = min_dist;
+  } else if (PerceptualDistanceFits(cinfo, dmax, 1, ref_qmc)) {
+    dmin = dmax;
+    dmax = max_dist;
+  }
+  return BisectPerceptualDistance(cinfo, 1, ref_qmc, dmin, dmax);
+}
+
 }  // namespace
 
 void QuantizetoPSNR(j_compress_ptr cinfo) {
   float distance = FindDistanceForPSNR(cinfo);
+  cinfo->master->cur_encode_stats.search_distance = distance;
+  UpdateDistance(cinfo, distance);
+  ReQuantizeCoeffs(cinfo);
+}
+
+void QuantizetoTargetSize(j_compress_ptr cinfo) {
+  float distance = FindDistanceForTargetSize(cinfo);
+  cinfo->master->cur_encode_stats.search_distance = distance;
+  UpdateDistance(cinfo, distance);
+  ReQuantizeCoeffs(cinfo);
+}
+
+void QuantizetoButteraugliTarget(j_compress_ptr cinfo) {
+  float distance = FindDistanceForButteraugliTarget(cinfo);
+  cinfo->master->cur_encode_stats.search_distance = distance;
   UpdateDistance(cinfo, distance);
   ReQuantizeCoeffs(cinfo);
 }
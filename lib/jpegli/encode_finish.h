@@ -13,6 +13,10 @@ namespace jpegli {
 
 void QuantizetoPSNR(j_compress_ptr cinfo);
 
+void QuantizetoTargetSize(j_compress_ptr cinfo);
+
+void QuantizetoButteraugliTarget(j_compress_ptr cinfo);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_ENCODE_FINISH_H_
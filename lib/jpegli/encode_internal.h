@@ -7,12 +7,16 @@
 #ifndef LIB_JPEGLI_ENCODE_INTERNAL_H_
 #define LIB_JPEGLI_ENCODE_INTERNAL_H_
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 
+#include "lib/base/parallel_runner.h"
 #include "lib/jpegli/bit_writer.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/encode.h"
+#include "lib/jpegli/stage_stats.h"
 #include "lib/jpegli/types.h"
 
 namespace jpegli {
@@ -25,21 +29,51 @@ constexpr int kDefaultProgressiveLevel = 0;
 
 typedef int16_t coeff_t;
 
+// Huffman codes of the symbols of an encoder Huffman table, packed into one
+// word per symbol so that the many tables of progressive images take less
+// cache: bits 0-7 are the number of bits written for the symbol including its
+// extra bits, bits 8-11 are the number of extra bits, and bits 16-31 are the
+// Huffman code.
 struct HuffmanCodeTable {
-  int depth[256];
-  int code[256];
+  uint32_t entry[256];
+
+  void Set(int symbol, int code_length, int code, int nbits) {
+    entry[symbol] = (static_cast<uint32_t>(code) << 16) | (nbits << 8) |
+                    (code_length + nbits);
+  }
+  int depth(int symbol) const { return entry[symbol] & 0xff; }
+  // Returns the Huffman code shifted left by the number of extra bits.
+  uint32_t code(int symbol) const {
+    const uint32_t e = entry[symbol];
+    return (e >> 16) << ((e >> 8) & 0xf);
+  }
 };
 
+// Writes the Huffman code of symbol followed by the extra bits, which must fit
+// in the number of extra bits of the symbol.
+static JXL_INLINE void WriteSymbol(JpegBitWriter* bw,
+                                   const HuffmanCodeTable* code, int symbol,
+                                   uint32_t bits) {
+  const uint32_t e = code->entry[symbol];
+  WriteBits(bw, e & 0xff, ((e >> 16) << ((e >> 8) & 0xf)) | bits);
+}
+
 struct Token {
   uint8_t context;
   uint8_t symbol;
   uint16_t bits;
+  Token() = default;
   Token(int c, int s, int b) : context(c), symbol(s), bits(b) {}
 };
 
 struct TokenArray {
   Token* tokens;
   size_t num_tokens;
+  // If the array is packed by PackTokens(), tokens is nullptr and the tokens
+  // are stored in these buffers instead, see packed_tokens.h.
+  uint8_t* packed_symbols;
+  uint8_t* packed_bits;
+  size_t* checkpoints;
 };
 
 struct RefToken {
@@ -54,6 +88,11 @@ struct ScanTokenInfo {
   uint16_t* eobruns;
   size_t* restarts;
   size_t num_restarts;
+  // Offsets of the restart intervals relative to the start of the scan data,
+  // followed by the end of the scan data, recorded while the scan is written
+  // if the restart index is written, with room for num_restarts + 1 values.
+  uint32_t* restart_offsets;
+  size_t num_restart_offsets;
   size_t num_nonzeros;
   size_t num_future_nonzeros;
   size_t token_offset;
@@ -64,18 +103,104 @@ struct ScanTokenInfo {
   size_t num_blocks;
 };
 
+// Position of the scan data writer within a scan, which is kept while the
+// destination suspends. token_idx is the index of the next token as used in
+// the restarts array of the scan.
+struct ScanWriterState {
+  int scan_index;
+  size_t token_idx;
+  size_t restart_idx;
+  int next_restart_marker;
+  size_t refbit_idx;
+  size_t eobrun_idx;
+};
+
+struct BatchEncoder;
+struct LadderEncoder;
+struct TileEncoder;
+
 }  // namespace jpegli
 
 struct jpeg_comp_master {
   jpegli::RowBuffer<float> input_buffer[jpegli::kMaxComponents];
-  jpegli::RowBuffer<float>* smooth_input[jpegli::kMaxComponents];
   jpegli::RowBuffer<float>* raw_data[jpegli::kMaxComponents];
   bool force_baseline;
   bool xyb_mode;
   uint8_t cicp_transfer_function;
   bool use_std_tables;
   bool use_adaptive_quantization;
+  JpegliAQMode aq_mode;
+  JpegliDownsampleMode downsample_mode;
+  // Set by jpegli_use_fixed_point_dct(), use_fixed_point_dct is true if the
+  // fixed point DCT is used for the current image.
+  bool fixed_point_dct_requested;
+  bool use_fixed_point_dct;
+  // True if the 8-bit RGB input rows of a 4:2:0 YCbCr image are read with
+  // fused_input_transform, which writes the luma rows to input_buffer[0] and
+  // the downsampled chroma rows directly to raw_data[1] and raw_data[2].
+  bool use_fused_input;
+  // Set by jpegli_use_compact_tokens(). If true, the token arrays are packed
+  // when they are complete, and the tokens are collected in token_staging, a
+  // buffer of token_staging_size tokens that is reused for every array.
+  bool use_compact_tokens;
+  // Set by jpegli_use_two_pass_tokenization(), use_two_pass_tokenization is
+  // true if the scans of the current image are tokenized again when they are
+  // written instead of storing their tokens.
+  bool two_pass_tokenization_requested;
+  bool use_two_pass_tokenization;
+  // Set by jpegli_use_trellis_quantization(), use_trellis_quantization is true
+  // if the buffered coefficients of the current image are quantized by
+  // TrellisQuantizeCoeffs() in jpegli_finish_compress().
+  bool trellis_quantization_requested;
+  bool use_trellis_quantization;
   int progressive_level;
+  // Set by jpegli_optimize_scans(). default_scan_script is true if the scan
+  // script of the current image was chosen by the encoder, only that one is
+  // replaced by the optimized scan script.
+  bool optimize_scans;
+  bool default_scan_script;
+  // Set by jpegli_stream_dc_scan(), stream_dc_scan is true if the first scan
+  // of the current image is written by WriteDCScaniMCURow(), which predicts
+  // the DC coefficients of its components from dc_scan_pred.
+  bool stream_dc_scan_requested;
+  bool stream_dc_scan;
+  // Set by jpegli_set_gain_map().
+  const uint8_t* gain_map;
+  size_t gain_map_size;
+  // Set by jpegli_write_restart_index().
+  bool write_restart_index;
+  // Set by jpegli_set_parallel_decode_target(), 0 if the restart interval is
+  // set by the application.
+  int parallel_decode_segments;
+  // Set by jpegli_set_quant_field() and jpegli_get_quant_field(), with the
+  // strides in floats.
+  const float* quant_field_in;
+  size_t quant_field_in_stride;
+  float* quant_field_out;
+  size_t quant_field_out_stride;
+  // State of jpegli_set_frame_sequence(): the maximum cost drift (0 if the
+  // frame sequence mode is off), whether the optimized Huffman codes of the
+  // current frame are kept for the next frames, and whether the current frame
+  // uses the kept codes instead, with cinfo->optimize_coding turned off until
+  // the frame is done. The kept codes are frame_num_tables Huffman tables
+  // with their slot ids, and the table index of each context, for frames with
+  // frame_num_components components and frame_data_precision bits; the
+  // symbols of each context of a frame that uses them are counted in
+  // frame_counts.
+  float frame_max_drift;
+  bool frame_keep_codes;
+  bool frame_reuse;
+  JHUFF_TBL* frame_tables;
+  size_t frame_num_tables;
+  uint8_t frame_slot_ids[2 * jpegli::kMaxComponents];
+  uint8_t frame_context_map[2 * jpegli::kMaxComponents];
+  int frame_num_components;
+  int frame_data_precision;
+  int* frame_counts;
+  // Set by jpegli_set_huffman_presets().
+  const JpegliHuffmanPreset* huffman_presets;
+  size_t num_huffman_presets;
+  JCOEF dc_scan_pred[MAX_COMPS_IN_SCAN];
   size_t xsize_blocks;
   size_t ysize_blocks;
   size_t blocks_per_iMCU_row;
@@ -84,9 +209,51 @@ struct jpeg_comp_master {
   JpegliEndianness endianness;
   void (*input_method)(const uint8_t* row_in, size_t len,
                        float* row_out[jpegli::kMaxComponents]);
+  // Set by jpegli_set_input_row_padding().
+  bool input_rows_padded;
+  // The number of pixels of the scanlines that are converted by input_method
+  // is rounded up to a multiple of this, which is the vector size if the
+  // scanlines are padded and 1 otherwise.
+  size_t input_row_multiple;
+  // Set by jpegli_set_input_tone_mapping().
+  bool tone_mapping_requested;
+  JpegliToneMapping tone_mapping;
+  // Tone maps the rows of the input channels tone_map_channels, in R, G, B
+  // order, after input_method, or nullptr if there is no tone mapping.
+  void (*tone_map_method)(const JpegliToneMapping& params, float* rows[3],
+                          size_t len);
+  int tone_map_channels[3];
+  // Set by jpegli_set_input_alpha_background().
+  bool alpha_blending_requested;
+  float alpha_background[3];
+  // Composites the rows of the input channels alpha_blend_channels, in R, G,
+  // B order, onto the background with the alpha channel alpha_channel after
+  // tone_map_method, or nullptr if there is no alpha blending.
+  void (*alpha_blend_method)(const float background[3], const float* alpha,
+                             float* rows[3], size_t len);
+  int alpha_blend_channels[3];
+  int alpha_channel;
   void (*color_transform)(float* row[jpegli::kMaxComponents], size_t len);
+  void (*fused_input_transform)(const uint8_t* row_in, size_t len,
+                                size_t len_padded, float* row_y,
+                                float* row_cb, float* row_cr, bool second_row);
+  // Downsamples 2 * v_factor input rows to two output rows.
   void (*downsample_method[jpegli::kMaxComponents])(
-      float* rows_in[MAX_SAMP_FACTOR], size_t len, float* row_out);
+      float* rows_in[2 * MAX_SAMP_FACTOR], size_t len, float* rows_out[2]);
+  // Per-iMCU-row kernels of the DCT, tokenization and scan writing, resolved
+  // for the CPU once per image by ChooseiMCURowKernels() instead of on every
+  // call.
+  void (*compute_coefficients_for_imcu_row)(j_compress_ptr cinfo);
+  void (*compute_tokens_for_imcu_row)(j_compress_ptr cinfo);
+  void (*write_imcu_row)(j_compress_ptr cinfo);
+  void (*compute_tokens_from_coeffs_for_imcu_row)(j_compress_ptr cinfo);
+  void (*write_imcu_row_from_coeffs)(j_compress_ptr cinfo);
+  // Used only with JPEGLI_DOWNSAMPLE_SHARP.
+  jpegli::RowBuffer<float> sharp_downsample_tmp;
+  // Used only with smoothing_factor, the unfiltered copies of the last two
+  // rows smoothed in place in input_buffer, and the next row to smooth.
+  jpegli::RowBuffer<float> smoothing_rows[jpegli::kMaxComponents];
+  size_t next_smoothed_row;
   float* quant_mul[jpegli::kMaxComponents];
   float* zero_bias_offset[jpegli::kMaxComponents];
   float* zero_bias_mul[jpegli::kMaxComponents];
@@ -117,6 +284,8 @@ struct jpeg_comp_master {
   float* diff_buffer;
   jpegli::RowBuffer<float> fuzzy_erosion_tmp;
   jpegli::RowBuffer<float> pre_erosion;
+  // Used only with JPEGLI_AQ_FAST.
+  jpegli::RowBuffer<float> downsampled_luma;
   jpegli::RowBuffer<float> quant_field;
   jvirt_barray_ptr* coeff_buffers;
   size_t next_input_row;
@@ -132,12 +301,148 @@ struct jpeg_comp_master {
   jpegli::Token* next_token;
   size_t num_tokens;
   size_t total_num_tokens;
+  jpegli::Token* token_staging;
+  size_t token_staging_size;
+  // Symbol counts of the tokens that are not stored with two pass
+  // tokenization, kJpegHuffmanAlphabetSize counts for each of the num_contexts
+  // contexts, or nullptr.
+  int* token_counts;
   jpegli::RefToken* next_refinement_token;
   uint8_t* next_refinement_bit;
   float psnr_target;
   float psnr_tolerance;
   float min_distance;
   float max_distance;
+  // Number of iMCU rows used for the distance search in streaming PSNR mode as
+  // requested by the user, or 0 to use the whole image.
+  int psnr_search_rows;
+  // Number of buffered iMCU rows in streaming PSNR mode, 0 otherwise.
+  size_t num_psnr_search_rows;
+  // Target compressed size in bytes for the distance search, or 0.
+  size_t target_size;
+  // Target butteraugli distance for the distance search, or 0.
+  float butteraugli_target;
+  JxlParallelRunner runner;
+  void* runner_opaque;
+  // Set by jpegli_attach_context(), nullptr otherwise.
+  jpegli_context* context;
+  // Set by jpegli_set_cancel_flag().
+  const volatile int* cancel_flag;
+  // Set by jpegli_set_transform_backend(), all nullptr by default.
+  JpegliTransformBackend transform_backend;
+  // Recorded after jpegli_enable_stage_stats().
+  jpegli::StageStats stage_stats;
+  // Stats of the last finished image, see jpegli_get_encode_stats(), and
+  // those of the current image: the output position at its start and where
+  // the header of each scan was written, and the sum and the number of the
+  // adaptive quantization field values of the luma blocks.
+  jpegli_encode_stats encode_stats;
+  jpegli_encode_stats cur_encode_stats;
+  size_t image_start_bytes;
+  size_t scan_start_bytes[JPEGLI_MAX_SCAN_STATS + 1];
+  // State of the restart index: the scan whose restart offsets are recorded
+  // (-1 if none), the output position of the start of its data, and the size
+  // of the restart index segment written before the EOI marker.
+  int restart_index_scan;
+  size_t restart_index_scan_start;
+  size_t restart_index_bytes;
+  double quant_field_sum;
+  size_t quant_field_count;
+  // Quantized coefficients of the current iMCU row, computed in parallel if
+  // there is a parallel runner, with the block rows of each component one
+  // after the other, each with the blocks of all the MCUs of the row. The DC
+  // coefficients are not quantized yet, their scaled value is stored in
+  // imcu_dc instead. Both are nullptr without a runner, unless the DCT of the
+  // current target works on more than one block or there is a transform
+  // backend.
+  int32_t* imcu_coeffs;
+  float* imcu_dc;
+  // Output buffer of the restart segments that are Huffman coded in parallel,
+  // allocated on first use.
+  uint8_t* segment_data;
+  size_t segment_data_size;
+  // Number of bytes written to the destination since the start of the image.
+  size_t num_output_bytes;
+  // True if the Huffman codes and tokens of the non-streaming part of
+  // jpegli_finish_compress() are computed.
+  bool entropy_coding_done;
+  // Worker compressors of jpegli_encode_batch(), created on first use.
+  jpegli::BatchEncoder* batch_encoder;
+  // Rung compressors of jpegli_encode_ladder(), created on first use.
+  jpegli::LadderEncoder* ladder_encoder;
+  // Buffered tiles of jpegli_write_tile(), created on first use.
+  jpegli::TileEncoder* tile_encoder;
+  // Set by jpegli_encode_ladder() on its rung compressors: the compressor
+  // whose input and downsampled rows are used by this one (nullptr if this one
+  // reads its own input), and the compressors that use the rows of this one.
+  j_compress_ptr ladder_leader;
+  j_compress_ptr* ladder_followers;
+  size_t num_ladder_followers;
+  // State of jpegli_encode_step(): the number of units of the non-streaming
+  // output that were produced, the destination that collects the marker
+  // output of a unit in step_buffer, the range of step_buffer that is not yet
+  // written to the destination of the application, and whether the data of
+  // the last scan is still being written directly to that destination.
+  int step_units_done;
+  jpeg_destination_mgr step_dest;
+  uint8_t* step_buffer;
+  size_t step_buffer_size;
+  size_t step_output_pos;
+  size_t step_output_end;
+  bool step_scan_pending;
+  jpegli::ScanWriterState scan_writer;
 };
 
+namespace jpegli {
+
+// Returns true if the quantization tables are selected by a distance search
+// on the first-pass coefficients.
+inline bool IsDistanceSearch(j_compress_ptr cinfo) {
+  return cinfo->master->psnr_target > 0 || cinfo->master->target_size > 0 ||
+         cinfo->master->butteraugli_target > 0;
+}
+
+// Returns true if the first pass coefficients are buffered without
+// quantization, and are quantized in jpegli_finish_compress().
+inline bool IsDeferredQuantization(j_compress_ptr cinfo) {
+  return IsDistanceSearch(cinfo) || cinfo->master->use_trellis_quantization;
+}
+
+// Returns the number of block rows of component c in the coefficient buffers.
+inline JDIMENSION NumBufferedBlockRows(j_compress_ptr cinfo, int c) {
+  const jpeg_component_info* comp = &cinfo->comp_info[c];
+  const size_t num_iMCU_rows = cinfo->master->num_psnr_search_rows;
+  if (num_iMCU_rows == 0) {
+    return comp->height_in_blocks;
+  }
+  return std::min<JDIMENSION>(comp->height_in_blocks,
+                              num_iMCU_rows * comp->v_samp_factor);
+}
+
+// Implements jpegli_estimate_memory() for the compressor.
+size_t EstimateEncoderMemory(j_compress_ptr cinfo);
+
+// Frees the allocated output chunks if the destination manager was set by
+// jpegli_chunked_dest().
+void ReleaseChunkedDest(j_compress_ptr cinfo);
+
+// Stops the writer thread and frees the buffers if the destination manager was
+// set by jpegli_writebehind_dest().
+void ReleaseWriteBehindDest(j_compress_ptr cinfo);
+
+// Destroys the worker compressors of jpegli_encode_batch().
+void ReleaseBatchEncoder(j_compress_ptr cinfo);
+
+// Destroys the rung compressors of jpegli_encode_ladder().
+void ReleaseLadderEncoder(j_compress_ptr cinfo);
+
+// Drops the tiles of jpegli_write_tile() that were buffered for the previous
+// image.
+void ResetTileEncoder(j_compress_ptr cinfo);
+
+// Destroys the tile buffers of jpegli_write_tile().
+void ReleaseTileEncoder(j_compress_ptr cinfo);
+
+}  // namespace jpegli
+
 #endif  // LIB_JPEGLI_ENCODE_INTERNAL_H_
@@ -12,6 +12,7 @@
 #include <cstring>
 
 #include "lib/base/compiler_specific.h"
+#include "lib/base/types.h"
 #include "lib/jpegli/bit_writer.h"
 #include "lib/jpegli/bitstream.h"
 #include "lib/jpegli/common.h"
@@ -19,6 +20,7 @@
 #include "lib/jpegli/encode_internal.h"
 #include "lib/jpegli/entropy_coding.h"
 #include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/parallel.h"
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jpegli/encode_streaming.cc"
@@ -106,9 +108,170 @@ void ZigZagShuffle(int32_t* JXL_RESTRICT block) {
   tmp[63] = block[63];
   memcpy(block, tmp, DCTSIZE2 * sizeof(tmp[0]));
 }
+
+JXL_INLINE void EmitMarker(JpegBitWriter* bw, int marker) {
+  bw->data[bw->pos++] = 0xFF;
+  bw->data[bw->pos++] = marker;
+}
+
+// Number of MCUs of an iMCU row that are processed by one task of the parallel
+// runner.
+constexpr int kMCUsPerTask = 8;
+
+// Computes where the blocks of each component of an iMCU row start in
+// m->imcu_coeffs and m->imcu_dc, and the number of blocks per block row.
+void GetiMCURowLayout(j_compress_ptr cinfo, size_t* offsets, size_t* strides) {
+  const int xsize_mcus =
+      DivCeil(cinfo->image_width, 8 * cinfo->max_h_samp_factor);
+  size_t offset = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    offsets[c] = offset;
+    strides[c] = xsize_mcus * comp->h_samp_factor;
+    offset += strides[c] * comp->v_samp_factor;
+  }
+}
+
+// Lets the transform backend compute the blocks of the current iMCU row, and
+// returns false if it left them to ComputeiMCURowBlocks().
+bool ComputeiMCURowBlocksWithBackend(j_compress_ptr cinfo,
+                                     const float* const* imcu_start,
+                                     const float* qf) {
+  jpeg_comp_master* m = cinfo->master;
+  const JpegliTransformBackend& backend = m->transform_backend;
+  const int mcu_y = m->next_iMCU_row;
+  size_t offsets[kMaxComponents];
+  size_t strides[kMaxComponents];
+  GetiMCURowLayout(cinfo, offsets, strides);
+  JpegliForwardTransformComponent components[kMaxComponents];
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    JpegliForwardTransformComponent* fc = &components[c];
+    const int by0 = mcu_y * comp->v_samp_factor;
+    fc->pixels = imcu_start[c];
+    fc->pixels_stride = m->raw_data[c]->stride();
+    fc->num_block_rows =
+        std::min<int>(comp->v_samp_factor, comp->height_in_blocks - by0);
+    fc->num_blocks = comp->width_in_blocks;
+    fc->quant_mul = m->quant_mul[c];
+    fc->zero_bias_offset = m->zero_bias_offset[c];
+    fc->zero_bias_mul = m->zero_bias_mul[c];
+    fc->aq_strength = qf;
+    fc->aq_stride = m->quant_field.stride();
+    fc->aq_step = m->h_factor[c];
+    fc->coeffs = m->imcu_coeffs + offsets[c] * DCTSIZE2;
+    fc->coeffs_stride = strides[c];
+    fc->dc = m->imcu_dc + offsets[c];
+    fc->dc_stride = strides[c];
+  }
+  return FROM_JXL_BOOL((*backend.forward_transform)(
+      backend.opaque, mcu_y, cinfo->num_components, components));
+}
+
+// Computes the DCT and the quantized AC coefficients of all blocks of the
+// current iMCU row into m->imcu_coeffs, and their scaled DC values into
+// m->imcu_dc, distributing the MCU columns of the row among the threads of the
+// parallel runner. Horizontally adjacent blocks of a component are transformed
+// kDCTBatchSize at a time.
+void ComputeiMCURowBlocks(j_compress_ptr cinfo,
+                          const float* const* imcu_start, const float* qf) {
+  jpeg_comp_master* m = cinfo->master;
+  if (m->transform_backend.forward_transform != nullptr &&
+      ComputeiMCURowBlocksWithBackend(cinfo, imcu_start, qf)) {
+    return;
+  }
+  const int xsize_mcus =
+      DivCeil(cinfo->image_width, 8 * cinfo->max_h_samp_factor);
+  const int mcu_y = m->next_iMCU_row;
+  const size_t qf_stride = m->quant_field.stride();
+  size_t offsets[kMaxComponents];
+  size_t strides[kMaxComponents];
+  GetiMCURowLayout(cinfo, offsets, strides);
+  const auto compute_blocks = [&](uint32_t task, size_t /* thread */) {
+    HWY_ALIGN float dct_tmp[2 * kDCTBatchSize * DCTSIZE2];
+    const int mcu_x0 = task * kMCUsPerTask;
+    const int mcu_x1 = std::min(xsize_mcus, mcu_x0 + kMCUsPerTask);
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      jpeg_component_info* comp = &cinfo->comp_info[c];
+      const float* JXL_RESTRICT qmc = m->quant_mul[c];
+      const size_t stride = m->raw_data[c]->stride();
+      const int h_samp = comp->h_samp_factor;
+      const int h_factor = m->h_factor[c];
+      const float* zero_bias_offset = m->zero_bias_offset[c];
+      const float* zero_bias_mul = m->zero_bias_mul[c];
+      const size_t bx0 = mcu_x0 * h_samp;
+      const size_t bx1 = std::min<size_t>(mcu_x1 * h_samp,
+                                          comp->width_in_blocks);
+      for (int iy = 0; iy < comp->v_samp_factor; ++iy) {
+        size_t by = mcu_y * comp->v_samp_factor + iy;
+        if (by >= comp->height_in_blocks) {
+          continue;
+        }
+        const auto block_index = [&](size_t bx) {
+          return offsets[c] + iy * strides[c] + bx;
+        };
+        const auto aq_strength = [&](size_t bx) {
+          return qf ? qf[iy * qf_stride + bx * h_factor] : 0.0f;
+        };
+        size_t bx = bx0;
+        if (!m->use_fixed_point_dct) {
+          for (; bx + kDCTBatchSize <= bx1; bx += kDCTBatchSize) {
+            float aq[kDCTBatchSize];
+            int32_t* blocks[kDCTBatchSize];
+            float dc[kDCTBatchSize];
+            for (size_t i = 0; i < kDCTBatchSize; ++i) {
+              aq[i] = aq_strength(bx + i);
+              blocks[i] = m->imcu_coeffs + block_index(bx + i) * DCTSIZE2;
+            }
+            const float* pixels = imcu_start[c] + (iy * stride + bx) * DCTSIZE;
+            ComputeACCoefficientsBatch<kDCTBatchSize>(
+                pixels, stride, qmc, aq, zero_bias_offset, zero_bias_mul,
+                dct_tmp, blocks, dc);
+            for (size_t i = 0; i < kDCTBatchSize; ++i) {
+              m->imcu_dc[block_index(bx + i)] = dc[i];
+            }
+          }
+        }
+        for (; bx < bx1; ++bx) {
+          const float* pixels = imcu_start[c] + (iy * stride + bx) * DCTSIZE;
+          const size_t block_idx = block_index(bx);
+          int32_t* block = m->imcu_coeffs + block_idx * DCTSIZE2;
+          m->imcu_dc[block_idx] =
+              m->use_fixed_point_dct
+                  ? ComputeACCoefficientsFixedPoint(
+                        pixels, stride, qmc, aq_strength(bx),
+                        zero_bias_offset, zero_bias_mul, dct_tmp, block)
+                  : ComputeACCoefficients(pixels, stride, qmc,
+                                          aq_strength(bx), zero_bias_offset,
+                                          zero_bias_mul, dct_tmp, block);
+        }
+      }
+    }
+  };
+  RunParallel(cinfo, 0, DivCeil(xsize_mcus, kMCUsPerTask), compute_blocks);
+}
+
+// Adds the Huffman symbols that WriteBlock() writes for a block to the symbol
+// counts of its DC and AC contexts.
+void CountBlockSymbols(const int32_t* symbols, int num_nonzeros, bool emit_eob,
+                       int* dc_counts, int* ac_counts) {
+  ++dc_counts[symbols[0]];
+  for (int i = 1; i < num_nonzeros; ++i) {
+    int symbol = symbols[i];
+    if (symbol > 255) {
+      ac_counts[0xf0] += symbol >> 8;
+      symbol &= 255;
+    }
+    ++ac_counts[symbol];
+  }
+  if (emit_eob) ++ac_counts[0];
+}
+
 }  // namespace
 
-template <int kMode>
+// If kFromCoeffs is true, the quantized coefficients of the iMCU row are read
+// from the coefficient buffers instead of being computed from the raw data.
+template <int kMode, bool kFromCoeffs>
 void ProcessiMCURow(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   JpegBitWriter* bw = &m->bw;
@@ -119,9 +282,22 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
   int32_t* symbols = m->block_tmp + DCTSIZE2;
   int32_t* nonzero_idx = m->block_tmp + 3 * DCTSIZE2;
   coeff_t* JXL_RESTRICT last_dc_coeff = m->last_dc_coeff;
-  bool adaptive_quant = m->use_adaptive_quantization && m->psnr_target == 0;
+  // The symbols of a frame that reuses the Huffman codes of an earlier frame
+  // of the sequence are counted for estimating the cost drift.
+  int* symbol_counts = nullptr;
+  if (kMode == kStreamingModeBits && m->frame_reuse) {
+    symbol_counts = m->frame_counts;
+  }
+  // In distance search and trellis quantization mode the adaptive
+  // quantization is applied when the buffered coefficients are requantized,
+  // except after a streaming search is done.
+  bool adaptive_quant =
+      m->use_adaptive_quantization &&
+      (!IsDeferredQuantization(cinfo) ||
+       (m->num_psnr_search_rows > 0 &&
+        static_cast<size_t>(mcu_y) >= m->num_psnr_search_rows));
   JBLOCKARRAY blocks[kMaxComponents];
-  if (kMode == kStreamingModeCoefficients) {
+  if (kMode == kStreamingModeCoefficients || kFromCoeffs) {
     for (int c = 0; c < cinfo->num_components; ++c) {
       jpeg_component_info* comp = &cinfo->comp_info[c];
       int by0 = mcu_y * comp->v_samp_factor;
@@ -129,24 +305,13 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
       int max_block_rows = std::min(comp->v_samp_factor, block_rows_left);
       blocks[c] = (*cinfo->mem->access_virt_barray)(
           reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[c], by0,
-          max_block_rows, true);
+          max_block_rows, static_cast<boolean>(!kFromCoeffs));
     }
   }
   if (kMode == kStreamingModeTokens) {
-    TokenArray* ta = &m->token_arrays[m->cur_token_array];
-    int max_tokens_per_mcu_row = MaxNumTokensPerMCURow(cinfo);
-    if (ta->num_tokens + max_tokens_per_mcu_row > m->num_tokens) {
-      if (ta->tokens) {
-        m->total_num_tokens += ta->num_tokens;
-        ++m->cur_token_array;
-        ta = &m->token_arrays[m->cur_token_array];
-      }
-      m->num_tokens =
-          EstimateNumTokens(cinfo, mcu_y, ysize_mcus, m->total_num_tokens,
-                            max_tokens_per_mcu_row);
-      ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
-      m->next_token = ta->tokens;
-    }
+    m->next_token = ReserveTokens(cinfo, m->next_token,
+                                  MaxNumTokensPerMCURow(cinfo), mcu_y,
+                                  ysize_mcus);
   }
   const float* imcu_start[kMaxComponents];
   for (int c = 0; c < cinfo->num_components; ++c) {
@@ -155,12 +320,44 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
   }
   const float* qf = nullptr;
   if (adaptive_quant) {
-    qf = m->quant_field.Row(0);
+    qf = m->quant_field.Row(mcu_y * cinfo->max_v_samp_factor);
+  }
+  // With a parallel runner the DCT and the quantization of the AC coefficients
+  // is done for the whole iMCU row up front, and only the inherently
+  // sequential DC quantization and entropy coding is done here.
+  const bool precomputed = !kFromCoeffs && (m->imcu_coeffs != nullptr);
+  if (precomputed) {
+    ComputeiMCURowBlocks(cinfo, imcu_start, qf);
   }
+  size_t imcu_offsets[kMaxComponents];
+  size_t imcu_strides[kMaxComponents];
+  GetiMCURowLayout(cinfo, imcu_offsets, imcu_strides);
   HuffmanCodeTable* dc_code = nullptr;
   HuffmanCodeTable* ac_code = nullptr;
   const size_t qf_stride = m->quant_field.stride();
+  ScanTokenInfo* sti = &m->scan_token_info[0];
+  const size_t restart_interval = sti->restart_interval;
+  // The DC prediction is reset at the start of every restart interval, but the
+  // DC quantization still uses the previous DC coefficient, so that the
+  // quantized coefficients do not depend on the restart interval.
+  bool reset_dc_pred[kMaxComponents] = {};
   for (int mcu_x = 0; mcu_x < xsize_mcus; ++mcu_x) {
+    const size_t mcu_idx = mcu_y * xsize_mcus + mcu_x;
+    if (kMode != kStreamingModeCoefficients && restart_interval > 0 &&
+        mcu_idx > 0 && mcu_idx % restart_interval == 0) {
+      const size_t restart_idx = mcu_idx / restart_interval - 1;
+      if (kMode == kStreamingModeTokens) {
+        TokenArray* ta = &m->token_arrays[m->cur_token_array];
+        sti->restarts[restart_idx] =
+            m->total_num_tokens + (m->next_token - ta->tokens);
+      } else if (kMode == kStreamingModeBits) {
+        JumpToByteBoundary(bw);
+        EmitMarker(bw, 0xD0 + (restart_idx & 0x7));
+        AddRestartOffset(cinfo,
+                         m->num_output_bytes + bw->pos - bw->output_pos);
+      }
+      std::fill(reset_dc_pred, reset_dc_pred + kMaxComponents, true);
+    }
     for (int c = 0; c < cinfo->num_components; ++c) {
       jpeg_component_info* comp = &cinfo->comp_info[c];
       if (kMode == kStreamingModeBits) {
@@ -182,26 +379,49 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
               *m->next_token++ = Token(c, 0, 0);
               *m->next_token++ = Token(c + 4, 0, 0);
             } else if (kMode == kStreamingModeBits) {
-              WriteBits(bw, dc_code->depth[0], dc_code->code[0]);
-              WriteBits(bw, ac_code->depth[0], ac_code->code[0]);
+              WriteSymbol(bw, dc_code, 0, 0);
+              WriteSymbol(bw, ac_code, 0, 0);
+              if (symbol_counts != nullptr) {
+                ++symbol_counts[c * kJpegHuffmanAlphabetSize];
+                ++symbol_counts[(c + 4) * kJpegHuffmanAlphabetSize];
+              }
             }
             continue;
           }
           if (adaptive_quant) {
             aq_strength = qf[iy * qf_stride + bx * h_factor];
           }
-          const float* pixels = imcu_start[c] + (iy * stride + bx) * DCTSIZE;
-          ComputeCoefficientBlock(pixels, stride, qmc, last_dc_coeff[c],
-                                  aq_strength, zero_bias_offset, zero_bias_mul,
-                                  m->dct_buffer, block);
+          if (kFromCoeffs) {
+            const JCOEF* cblock = &blocks[c][iy][bx][0];
+            for (int k = 0; k < DCTSIZE2; ++k) {
+              block[kJPEGNaturalOrder[k]] = cblock[k];
+            }
+          } else if (precomputed) {
+            const size_t block_idx =
+                imcu_offsets[c] + iy * imcu_strides[c] + bx;
+            block = m->imcu_coeffs + block_idx * DCTSIZE2;
+            block[0] = QuantizeDC(m->imcu_dc[block_idx], last_dc_coeff[c],
+                                  aq_strength, zero_bias_offset, zero_bias_mul);
+          } else {
+            const float* pixels =
+                imcu_start[c] + (iy * stride + bx) * DCTSIZE;
+            ComputeCoefficientBlock(pixels, stride, qmc, last_dc_coeff[c],
+                                    aq_strength, zero_bias_offset,
+                                    zero_bias_mul, m->use_fixed_point_dct,
+                                    m->dct_buffer, block);
+          }
           if (kMode == kStreamingModeCoefficients) {
             JCOEF* cblock = &blocks[c][iy][bx][0];
             for (int k = 0; k < DCTSIZE2; ++k) {
               cblock[k] = block[kJPEGNaturalOrder[k]];
             }
           }
-          block[0] -= last_dc_coeff[c];
-          last_dc_coeff[c] += block[0];
+          const int32_t dc_coeff = block[0];
+          if (!reset_dc_pred[c]) {
+            block[0] -= last_dc_coeff[c];
+          }
+          last_dc_coeff[c] = dc_coeff;
+          reset_dc_pred[c] = false;
           if (kMode == kStreamingModeTokens) {
             ComputeTokensForBlock<int32_t, false>(block, 0, c, c + 4,
                                                   &m->next_token);
@@ -212,6 +432,12 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
             ComputeSymbols(num_nonzeros, nonzero_idx, block, symbols);
             WriteBlock(symbols, block, num_nonzeros, emit_eob, dc_code, ac_code,
                        bw);
+            if (symbol_counts != nullptr) {
+              CountBlockSymbols(
+                  symbols, num_nonzeros, emit_eob,
+                  symbol_counts + c * kJpegHuffmanAlphabetSize,
+                  symbol_counts + (c + 4) * kJpegHuffmanAlphabetSize);
+            }
           }
         }
       }
@@ -220,22 +446,31 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
   if (kMode == kStreamingModeTokens) {
     TokenArray* ta = &m->token_arrays[m->cur_token_array];
     ta->num_tokens = m->next_token - ta->tokens;
-    ScanTokenInfo* sti = &m->scan_token_info[0];
     sti->num_tokens = m->total_num_tokens + ta->num_tokens;
-    sti->restarts[0] = sti->num_tokens;
+    sti->restarts[sti->num_restarts - 1] = sti->num_tokens;
   }
 }
 
+size_t DCTBatchSize() { return kDCTBatchSize; }
+
 void ComputeCoefficientsForiMCURow(j_compress_ptr cinfo) {
-  ProcessiMCURow<kStreamingModeCoefficients>(cinfo);
+  ProcessiMCURow<kStreamingModeCoefficients, false>(cinfo);
 }
 
 void ComputeTokensForiMCURow(j_compress_ptr cinfo) {
-  ProcessiMCURow<kStreamingModeTokens>(cinfo);
+  ProcessiMCURow<kStreamingModeTokens, false>(cinfo);
 }
 
 void WriteiMCURow(j_compress_ptr cinfo) {
-  ProcessiMCURow<kStreamingModeBits>(cinfo);
+  ProcessiMCURow<kStreamingModeBits, false>(cinfo);
+}
+
+void ComputeTokensFromCoeffsForiMCURow(j_compress_ptr cinfo) {
+  ProcessiMCURow<kStreamingModeTokens, true>(cinfo);
+}
+
+void WriteiMCURowFromCoeffs(j_compress_ptr cinfo) {
+  ProcessiMCURow<kStreamingModeBits, true>(cinfo);
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -245,20 +480,25 @@ HWY_AFTER_NAMESPACE();
 
 #if HWY_ONCE
 namespace jpegli {
+HWY_EXPORT(DCTBatchSize);
 HWY_EXPORT(ComputeCoefficientsForiMCURow);
 HWY_EXPORT(ComputeTokensForiMCURow);
 HWY_EXPORT(WriteiMCURow);
+HWY_EXPORT(ComputeTokensFromCoeffsForiMCURow);
+HWY_EXPORT(WriteiMCURowFromCoeffs);
 
-void ComputeCoefficientsForiMCURow(j_compress_ptr cinfo) {
-  HWY_DYNAMIC_DISPATCH(ComputeCoefficientsForiMCURow)(cinfo);
-}
-
-void ComputeTokensForiMCURow(j_compress_ptr cinfo) {
-  HWY_DYNAMIC_DISPATCH(ComputeTokensForiMCURow)(cinfo);
-}
+size_t DCTBatchSize() { return HWY_DYNAMIC_DISPATCH(DCTBatchSize)(); }
 
-void WriteiMCURow(j_compress_ptr cinfo) {
-  HWY_DYNAMIC_DISPATCH(WriteiMCURow)(cinfo);
+void ChooseiMCURowKernels(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  m->compute_coefficients_for_imcu_row =
+      HWY_DYNAMIC_DISPATCH(ComputeCoefficientsForiMCURow);
+  m->compute_tokens_for_imcu_row =
+      HWY_DYNAMIC_DISPATCH(ComputeTokensForiMCURow);
+  m->write_imcu_row = HWY_DYNAMIC_DISPATCH(WriteiMCURow);
+  m->compute_tokens_from_coeffs_for_imcu_row =
+      HWY_DYNAMIC_DISPATCH(ComputeTokensFromCoeffsForiMCURow);
+  m->write_imcu_row_from_coeffs = HWY_DYNAMIC_DISPATCH(WriteiMCURowFromCoeffs);
 }
 
 }  // namespace jpegli
@@ -7,15 +7,21 @@
 #ifndef LIB_JPEGLI_ENCODE_STREAMING_H_
 #define LIB_JPEGLI_ENCODE_STREAMING_H_
 
+#include <cstddef>
+
 #include "lib/jpegli/common.h"
 
 namespace jpegli {
 
-void ComputeCoefficientsForiMCURow(j_compress_ptr cinfo);
-
-void ComputeTokensForiMCURow(j_compress_ptr cinfo);
+// Returns the number of horizontally adjacent blocks that the DCT of the
+// current target transforms at a time.
+size_t DCTBatchSize();
 
-void WriteiMCURow(j_compress_ptr cinfo);
+// Sets the iMCU row kernels of the encoder master, which compute the quantized
+// coefficients of the current iMCU row, and then tokenize or write them, to the
+// implementations for the best target of the CPU. The "from coeffs" variants
+// take the quantized coefficients from the coefficient buffers.
+void ChooseiMCURowKernels(j_compress_ptr cinfo);
 
 }  // namespace jpegli
 
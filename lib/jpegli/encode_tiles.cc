@@ -0,0 +1,185 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/encode.h"
+#include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/error.h"
+
+namespace jpegli {
+
+// The rows of the image written with jpegli_write_tile() that are not yet
+// compressed, in bands of one iMCU row. A band is allocated when the first
+// tile that overlaps it arrives, and freed when it is compressed.
+struct TileEncoder {
+  std::mutex mutex;
+  size_t band_height = 0;
+  size_t row_size = 0;
+  std::vector<std::vector<uint8_t>> bands;
+  // Number of pixels of each band that were written.
+  std::vector<size_t> num_pixels;
+  // Index of the next band to compress.
+  size_t next_band = 0;
+  // True while a thread compresses the complete bands.
+  bool compressing = false;
+};
+
+namespace {
+
+// Serializes the creation of the tile encoders of all the compressors, which
+// happens once per compressor.
+std::mutex& CreateMutex() {
+  static std::mutex* mutex = new std::mutex;
+  return *mutex;
+}
+
+TileEncoder* GetTileEncoder(j_compress_ptr cinfo) {
+  std::lock_guard<std::mutex> guard(CreateMutex());
+  jpeg_comp_master* m = cinfo->master;
+  if (m->tile_encoder == nullptr) {
+    m->tile_encoder = new TileEncoder;
+  }
+  return m->tile_encoder;
+}
+
+size_t BandPixels(j_compress_ptr cinfo, const TileEncoder* tiles,
+                  size_t band) {
+  const size_t y0 = band * tiles->band_height;
+  const size_t y1 =
+      std::min<size_t>(y0 + tiles->band_height, cinfo->image_height);
+  return (y1 - y0) * cinfo->image_width;
+}
+
+// Compresses band by band the complete bands that follow the compressed ones.
+// Called with the mutex locked, which is released while a band is compressed.
+void CompressBands(j_compress_ptr cinfo, TileEncoder* tiles,
+                   std::unique_lock<std::mutex>* lock) {
+  if (tiles->compressing) return;
+  tiles->compressing = true;
+  while (tiles->next_band < tiles->bands.size() &&
+         tiles->num_pixels[tiles->next_band] ==
+             BandPixels(cinfo, tiles, tiles->next_band)) {
+    const size_t band = tiles->next_band;
+    std::vector<uint8_t> data = std::move(tiles->bands[band]);
+    lock->unlock();
+    const size_t y0 = band * tiles->band_height;
+    const size_t num_rows =
+        std::min<size_t>(tiles->band_height, cinfo->image_height - y0);
+    std::vector<JSAMPROW> rows(num_rows);
+    for (size_t y = 0; y < num_rows; ++y) {
+      rows[y] = &data[y * tiles->row_size];
+    }
+    // The errors of the compression are reported with the mutex unlocked.
+    size_t num_written = jpegli_write_scanlines(
+        cinfo, rows.data(), static_cast<JDIMENSION>(num_rows));
+    if (num_written < num_rows) {
+      JPEGLI_ERROR("jpegli_write_tile: suspending destinations are not "
+                   "supported");
+    }
+    lock->lock();
+    ++tiles->next_band;
+  }
+  tiles->compressing = false;
+}
+
+}  // namespace
+
+void ResetTileEncoder(j_compress_ptr cinfo) {
+  TileEncoder* tiles = cinfo->master->tile_encoder;
+  if (tiles == nullptr) return;
+  tiles->bands.clear();
+  tiles->num_pixels.clear();
+  tiles->next_band = 0;
+  tiles->compressing = false;
+}
+
+void ReleaseTileEncoder(j_compress_ptr cinfo) {
+  delete cinfo->master->tile_encoder;
+  cinfo->master->tile_encoder = nullptr;
+}
+
+}  // namespace jpegli
+
+void jpegli_write_tile(j_compress_ptr cinfo, JDIMENSION x, JDIMENSION y,
+                       JDIMENSION xsize, JDIMENSION ysize, const void* pixels,
+                       size_t stride) {
+  if (cinfo->global_state != jpegli::kEncHeader &&
+      cinfo->global_state != jpegli::kEncReadImage) {
+    JPEGLI_ERROR("jpegli_write_tile: unexpected state %d",
+                 cinfo->global_state);
+  }
+  if (cinfo->raw_data_in) {
+    JPEGLI_ERROR("jpegli_write_tile: raw data input is not supported");
+  }
+  if (xsize == 0 || ysize == 0 || x >= cinfo->image_width ||
+      y >= cinfo->image_height || xsize > cinfo->image_width - x ||
+      ysize > cinfo->image_height - y) {
+    JPEGLI_ERROR("jpegli_write_tile: invalid tile %ux%u at (%u, %u)", xsize,
+                 ysize, x, y);
+  }
+  jpeg_comp_master* m = cinfo->master;
+  jpegli::TileEncoder* tiles = jpegli::GetTileEncoder(cinfo);
+  const size_t pixel_size =
+      cinfo->input_components * jpegli_bytes_per_sample(m->data_type);
+  const size_t band_height = DCTSIZE * cinfo->max_v_samp_factor;
+  const size_t first_band = y / band_height;
+  const size_t last_band = (y + ysize - 1) / band_height;
+  std::vector<uint8_t*> band_data(last_band - first_band + 1);
+  // The errors are reported after the mutex is unlocked.
+  bool already_compressed = false;
+  {
+    std::lock_guard<std::mutex> guard(tiles->mutex);
+    if (tiles->bands.empty()) {
+      const size_t num_bands =
+          jpegli::DivCeil(cinfo->image_height, band_height);
+      tiles->band_height = band_height;
+      tiles->row_size = cinfo->image_width * pixel_size;
+      tiles->bands.resize(num_bands);
+      tiles->num_pixels.assign(num_bands, 0);
+    }
+    already_compressed = first_band < tiles->next_band;
+    for (size_t band = first_band; band <= last_band && !already_compressed;
+         ++band) {
+      if (tiles->bands[band].empty()) {
+        tiles->bands[band].resize(jpegli::BandPixels(cinfo, tiles, band) *
+                                  pixel_size);
+      }
+      band_data[band - first_band] = tiles->bands[band].data();
+    }
+  }
+  if (already_compressed) {
+    JPEGLI_ERROR("jpegli_write_tile: row %u is already compressed", y);
+  }
+  const uint8_t* input = reinterpret_cast<const uint8_t*>(pixels);
+  for (size_t ty = 0; ty < ysize; ++ty) {
+    const size_t row = y + ty;
+    uint8_t* band = band_data[row / band_height - first_band];
+    memcpy(band + (row % band_height) * tiles->row_size + x * pixel_size,
+           input + ty * stride, xsize * pixel_size);
+  }
+  std::unique_lock<std::mutex> lock(tiles->mutex);
+  bool overlapping = false;
+  for (size_t band = first_band; band <= last_band; ++band) {
+    const size_t y0 = std::max<size_t>(y, band * band_height);
+    const size_t y1 = std::min<size_t>(y + ysize, (band + 1) * band_height);
+    tiles->num_pixels[band] += (y1 - y0) * xsize;
+    if (tiles->num_pixels[band] > jpegli::BandPixels(cinfo, tiles, band)) {
+      overlapping = true;
+    }
+  }
+  if (overlapping) {
+    lock.unlock();
+    JPEGLI_ERROR("jpegli_write_tile: overlapping tiles");
+  }
+  jpegli::CompressBands(cinfo, tiles, &lock);
+}
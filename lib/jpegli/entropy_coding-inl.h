@@ -160,9 +160,52 @@ int NumNonZero8x8ExceptDC(const T* block) {
   return kDCTBlockSize + GetLane(SumOfLanes(cdi, neg_sum_zero));
 }
 
+// Compress() of 32-bit lanes is a single instruction with AVX-512
+// (VPCOMPRESSD) and SVE (COMPACT), on these targets ComputeTokensForBlock()
+// computes the tokens from the output of CompactBlock() and ComputeSymbols()
+// instead of finding the zero runs one coefficient at a time.
+constexpr bool kHasNativeCompress =
+    (HWY_ARCH_X86 && HWY_TARGET <= HWY_AVX3) || (HWY_TARGET & HWY_ALL_SVE);
+
+template <typename T, bool zig_zag_order>
+void ComputeTokensForBlockCompressed(const T* block, int last_dc, int dc_ctx,
+                                     int ac_ctx, Token** tokens_ptr) {
+  HWY_ALIGN int32_t zz_block[DCTSIZE2];
+  // Leaves room for nonzero_idx[-1], which is set by ComputeSymbols().
+  HWY_ALIGN int32_t idx_storage[2 * DCTSIZE2];
+  HWY_ALIGN int32_t symbols[DCTSIZE2];
+  int32_t* nonzero_idx = idx_storage + DCTSIZE2;
+  zz_block[0] = block[0] - last_dc;
+  for (int k = 1; k < DCTSIZE2; ++k) {
+    zz_block[k] = zig_zag_order ? block[k] : block[kJPEGNaturalOrder[k]];
+  }
+  const int num_nonzeros = CompactBlock(zz_block, nonzero_idx);
+  const bool emit_eob = nonzero_idx[num_nonzeros - 1] < 1008;
+  ComputeSymbols(num_nonzeros, nonzero_idx, zz_block, symbols);
+  Token* next_token = *tokens_ptr;
+  *next_token++ = Token(dc_ctx, symbols[0], zz_block[0]);
+  for (int i = 1; i < num_nonzeros; ++i) {
+    int symbol = symbols[i];
+    while (symbol > 255) {
+      *next_token++ = Token(ac_ctx, 0xf0, 0);
+      symbol -= 256;
+    }
+    *next_token++ = Token(ac_ctx, symbol, zz_block[i]);
+  }
+  if (emit_eob) {
+    *next_token++ = Token(ac_ctx, 0, 0);
+  }
+  *tokens_ptr = next_token;
+}
+
 template <typename T, bool zig_zag_order>
 void ComputeTokensForBlock(const T* block, int last_dc, int dc_ctx, int ac_ctx,
                            Token** tokens_ptr) {
+  if (kHasNativeCompress) {
+    ComputeTokensForBlockCompressed<T, zig_zag_order>(block, last_dc, dc_ctx,
+                                                      ac_ctx, tokens_ptr);
+    return;
+  }
   Token* next_token = *tokens_ptr;
   coeff_t temp2;
   coeff_t temp;
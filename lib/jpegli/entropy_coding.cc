@@ -11,6 +11,7 @@
 #include <cstdint>
 #include <cstring>
 #include <limits>
+#include <mutex>
 #include <vector>
 
 #include "lib/base/bits.h"
@@ -18,10 +19,13 @@
 #include "lib/base/types.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/context.h"
 #include "lib/jpegli/encode_internal.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/huffman.h"
 #include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/packed_tokens.h"
+#include "lib/jpegli/parallel.h"
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jpegli/entropy_coding.cc"
@@ -71,6 +75,46 @@ size_t EstimateNumTokens(j_compress_ptr cinfo, size_t mcu_y, size_t ysize_mcus,
                   std::max(max_per_row, estimate - num_tokens));
 }
 
+Token* ReserveTokens(j_compress_ptr cinfo, Token* next_token,
+                     size_t max_tokens, size_t row, size_t num_rows) {
+  jpeg_comp_master* m = cinfo->master;
+  TokenArray* ta = &m->token_arrays[m->cur_token_array];
+  ta->num_tokens = next_token - ta->tokens;
+  if (ta->num_tokens + max_tokens > m->num_tokens) {
+    if (ta->tokens) {
+      if (m->use_compact_tokens) {
+        PackTokens(cinfo, ta->tokens, ta);
+      }
+      m->total_num_tokens += ta->num_tokens;
+      ++m->cur_token_array;
+      ta = &m->token_arrays[m->cur_token_array];
+    }
+    if (m->use_compact_tokens) {
+      if (m->token_staging_size < max_tokens) {
+        m->token_staging_size = std::max(kNumStagingTokens, max_tokens);
+        m->token_staging =
+            Allocate<Token>(cinfo, m->token_staging_size, JPOOL_IMAGE);
+      }
+      m->num_tokens = m->token_staging_size;
+      ta->tokens = m->token_staging;
+    } else {
+      m->num_tokens = EstimateNumTokens(cinfo, row, num_rows,
+                                        m->total_num_tokens, max_tokens);
+      ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
+    }
+    next_token = ta->tokens;
+  }
+  return next_token;
+}
+
+void FinishTokens(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  TokenArray* ta = &m->token_arrays[m->cur_token_array];
+  if (m->use_compact_tokens && ta->tokens) {
+    PackTokens(cinfo, ta->tokens, ta);
+  }
+}
+
 namespace {
 HWY_EXPORT(ComputeTokensSequential);
 
@@ -91,9 +135,131 @@ void TokenizeProgressiveDC(const coeff_t* coeffs, int context, int Al,
   *(*next_token)++ = Token(context, nbits, bits);
 }
 
-void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
-                               int context, ScanTokenInfo* sti) {
-  jpeg_comp_master* m = cinfo->master;
+// Pointers to the coefficient block rows of each component, so that the scans
+// can be tokenized without accessing the virtual arrays.
+struct CoeffRows {
+  std::vector<JBLOCKROW> rows[kMaxComponents];
+};
+
+void GetCoeffRows(j_compress_ptr cinfo, CoeffRows* coeffs) {
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    coeffs->rows[c].resize(comp->height_in_blocks);
+    for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+      coeffs->rows[c][by] = GetBlockRow(cinfo, c, by)[0];
+    }
+  }
+}
+
+// Appends the tokens to the token arrays of the compressor, allocating new
+// token arrays as needed.
+class TokenArraySink {
+ public:
+  explicit TokenArraySink(j_compress_ptr cinfo) : cinfo_(cinfo) {}
+
+  Token* Begin() const {
+    const TokenArray* ta = CurrentArray();
+    return ta->tokens + ta->num_tokens;
+  }
+
+  // Returns the global index of the token at next_token.
+  size_t Index(const Token* next_token) const {
+    return cinfo_->master->total_num_tokens +
+           (next_token - CurrentArray()->tokens);
+  }
+
+  Token* Reserve(Token* next_token, size_t max_tokens, size_t row,
+                 size_t num_rows) {
+    return ReserveTokens(cinfo_, next_token, max_tokens, row, num_rows);
+  }
+
+  void End(Token* next_token) {
+    jpeg_comp_master* m = cinfo_->master;
+    TokenArray* ta = &m->token_arrays[m->cur_token_array];
+    ta->num_tokens = next_token - ta->tokens;
+    m->next_token = next_token;
+  }
+
+ private:
+  const TokenArray* CurrentArray() const {
+    return &cinfo_->master->token_arrays[cinfo_->master->cur_token_array];
+  }
+
+  j_compress_ptr cinfo_;
+};
+
+// Collects the tokens of one scan in its own buffer, which does not need the
+// memory manager, therefore it can be used on worker threads.
+class TokenVectorSink {
+ public:
+  Token* Begin() { return tokens_.data(); }
+
+  size_t Index(const Token* next_token) const {
+    return next_token - tokens_.data();
+  }
+
+  Token* Reserve(Token* next_token, size_t max_tokens, size_t /* row */,
+                 size_t /* num_rows */) {
+    size_t pos = next_token - tokens_.data();
+    if (pos + max_tokens > tokens_.size()) {
+      tokens_.resize(std::max(2 * tokens_.size(), pos + max_tokens));
+    }
+    return tokens_.data() + pos;
+  }
+
+  void End(Token* next_token) { num_tokens_ = next_token - tokens_.data(); }
+
+  const Token* tokens() const { return tokens_.data(); }
+  size_t num_tokens() const { return num_tokens_; }
+
+ private:
+  std::vector<Token> tokens_;
+  size_t num_tokens_ = 0;
+};
+
+// Passes the tokens to process(tokens, num_tokens) in chunks of at most one
+// MCU row instead of storing them, used for the scans that are tokenized
+// twice with two pass tokenization.
+template <typename Func>
+class ChunkedTokenSink {
+ public:
+  explicit ChunkedTokenSink(const Func& process) : process_(process) {}
+
+  Token* Begin() { return tokens_.data(); }
+
+  size_t Index(const Token* next_token) const {
+    return num_done_ + (next_token - tokens_.data());
+  }
+
+  Token* Reserve(Token* next_token, size_t max_tokens, size_t /* row */,
+                 size_t /* num_rows */) {
+    Flush(next_token);
+    if (tokens_.size() < max_tokens) {
+      tokens_.resize(max_tokens);
+    }
+    return tokens_.data();
+  }
+
+  void End(Token* next_token) { Flush(next_token); }
+
+ private:
+  void Flush(const Token* next_token) {
+    size_t num_tokens = next_token - tokens_.data();
+    if (num_tokens > 0) {
+      process_(tokens_.data(), num_tokens);
+    }
+    num_done_ += num_tokens;
+  }
+
+  const Func& process_;
+  std::vector<Token> tokens_;
+  size_t num_done_ = 0;
+};
+
+template <typename Sink>
+void TokenizeACProgressiveScan(j_compress_ptr cinfo, const CoeffRows& coeffs,
+                               int scan_index, int context, ScanTokenInfo* sti,
+                               Sink* sink) {
   const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
   const int comp_idx = scan_info->component_index[0];
   const jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
@@ -102,48 +268,31 @@ void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
   const int Se = scan_info->Se;
   const size_t restart_interval = sti->restart_interval;
   int restarts_to_go = restart_interval;
-  size_t num_blocks = comp->height_in_blocks * comp->width_in_blocks;
-  size_t num_restarts =
-      restart_interval > 0 ? DivCeil(num_blocks, restart_interval) : 1;
   size_t restart_idx = 0;
   int eob_run = 0;
-  TokenArray* ta = &m->token_arrays[m->cur_token_array];
-  sti->token_offset = m->total_num_tokens + ta->num_tokens;
-  sti->restarts = Allocate<size_t>(cinfo, num_restarts, JPOOL_IMAGE);
+  Token* next_token = sink->Begin();
+  sti->token_offset = sink->Index(next_token);
   const auto emit_eob_run = [&]() {
     int nbits = jxl::FloorLog2Nonzero<uint32_t>(eob_run);
     int symbol = nbits << 4u;
-    *m->next_token++ = Token(context, symbol, eob_run & ((1 << nbits) - 1));
+    *next_token++ = Token(context, symbol, eob_run & ((1 << nbits) - 1));
     eob_run = 0;
   };
   for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
-    JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
-        reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[comp_idx], by,
-        1, FALSE);
+    const JBLOCKROW blocks = coeffs.rows[comp_idx][by];
     // Each coefficient can appear in at most one token, but we have to reserve
     // one extra EOBrun token that was rolled over from the previous block-row
     // and has to be flushed at the end.
     int max_tokens_per_row = 1 + comp->width_in_blocks * (Se - Ss + 1);
-    if (ta->num_tokens + max_tokens_per_row > m->num_tokens) {
-      if (ta->tokens) {
-        m->total_num_tokens += ta->num_tokens;
-        ++m->cur_token_array;
-        ta = &m->token_arrays[m->cur_token_array];
-      }
-      m->num_tokens =
-          EstimateNumTokens(cinfo, by, comp->height_in_blocks,
-                            m->total_num_tokens, max_tokens_per_row);
-      ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
-      m->next_token = ta->tokens;
-    }
+    next_token = sink->Reserve(next_token, max_tokens_per_row, by,
+                               comp->height_in_blocks);
     for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
       if (restart_interval > 0 && restarts_to_go == 0) {
         if (eob_run > 0) emit_eob_run();
-        ta->num_tokens = m->next_token - ta->tokens;
-        sti->restarts[restart_idx++] = m->total_num_tokens + ta->num_tokens;
+        sti->restarts[restart_idx++] = sink->Index(next_token);
         restarts_to_go = restart_interval;
       }
-      const coeff_t* block = &blocks[0][bx][0];
+      const coeff_t* block = &blocks[bx][0];
       coeff_t temp2;
       coeff_t temp;
       int r = 0;
@@ -170,12 +319,12 @@ void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
         }
         if (eob_run > 0) emit_eob_run();
         while (r > 15) {
-          *m->next_token++ = Token(context, 0xf0, 0);
+          *next_token++ = Token(context, 0xf0, 0);
           r -= 16;
         }
         int nbits = jxl::FloorLog2Nonzero<uint32_t>(temp) + 1;
         int symbol = (r << 4u) + nbits;
-        *m->next_token++ = Token(context, symbol, temp2 & ((1 << nbits) - 1));
+        *next_token++ = Token(context, symbol, temp2 & ((1 << nbits) - 1));
         ++num_nzeros;
         r = 0;
       }
@@ -187,18 +336,17 @@ void TokenizeACProgressiveScan(j_compress_ptr cinfo, int scan_index,
       sti->num_future_nonzeros += num_future_nzeros;
       --restarts_to_go;
     }
-    ta->num_tokens = m->next_token - ta->tokens;
   }
   if (eob_run > 0) {
     emit_eob_run();
-    ++ta->num_tokens;
   }
-  sti->num_tokens = m->total_num_tokens + ta->num_tokens - sti->token_offset;
-  sti->restarts[restart_idx++] = m->total_num_tokens + ta->num_tokens;
+  sti->num_tokens = sink->Index(next_token) - sti->token_offset;
+  sti->restarts[restart_idx++] = sink->Index(next_token);
+  sink->End(next_token);
 }
 
-void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
-                              ScanTokenInfo* sti) {
+void TokenizeACRefinementScan(j_compress_ptr cinfo, const CoeffRows& coeffs,
+                              int scan_index, ScanTokenInfo* sti) {
   jpeg_comp_master* m = cinfo->master;
   const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
   const int comp_idx = scan_info->component_index[0];
@@ -211,22 +359,15 @@ void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
   RefToken token;
   int eob_run = 0;
   int eob_refbits = 0;
-  size_t num_blocks = comp->height_in_blocks * comp->width_in_blocks;
-  size_t num_restarts =
-      restart_interval > 0 ? DivCeil(num_blocks, restart_interval) : 1;
   sti->tokens = m->next_refinement_token;
   sti->refbits = m->next_refinement_bit;
-  sti->eobruns = Allocate<uint16_t>(cinfo, num_blocks / 2, JPOOL_IMAGE);
-  sti->restarts = Allocate<size_t>(cinfo, num_restarts, JPOOL_IMAGE);
   RefToken* next_token = sti->tokens;
   RefToken* next_eob_token = next_token;
   uint8_t* next_ref_bit = sti->refbits;
   uint16_t* next_eobrun = sti->eobruns;
   size_t restart_idx = 0;
   for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
-    JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
-        reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[comp_idx], by,
-        1, FALSE);
+    const JBLOCKROW blocks = coeffs.rows[comp_idx][by];
     for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
       if (restart_interval > 0 && restarts_to_go == 0) {
         sti->restarts[restart_idx++] = next_token - sti->tokens;
@@ -234,7 +375,7 @@ void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
         next_eob_token = next_token;
         eob_run = eob_refbits = 0;
       }
-      const coeff_t* block = &blocks[0][bx][0];
+      const coeff_t* block = &blocks[bx][0];
       int num_eob_refinement_bits = 0;
       int num_refinement_bits = 0;
       int num_nzeros = 0;
@@ -314,19 +455,39 @@ void TokenizeACRefinementScan(j_compress_ptr cinfo, int scan_index,
   m->next_refinement_bit = next_ref_bit;
 }
 
-void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
-                  ScanTokenInfo* sti) {
+// Allocates the per-scan buffers that the tokenization of the scan writes,
+// other than the token arrays.
+void AllocateScanBuffers(j_compress_ptr cinfo, int scan_index,
+                         ScanTokenInfo* sti) {
+  const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
+  if (scan_info->Ah == 0) {
+    return;
+  }
+  if (scan_info->Ss == 0) {
+    sti->refbits = Allocate<uint8_t>(cinfo, sti->num_blocks, JPOOL_IMAGE);
+  } else {
+    const int comp_idx = scan_info->component_index[0];
+    const jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+    size_t num_blocks = comp->height_in_blocks * comp->width_in_blocks;
+    sti->eobruns = Allocate<uint16_t>(cinfo, num_blocks / 2, JPOOL_IMAGE);
+  }
+}
+
+template <typename Sink>
+void TokenizeScan(j_compress_ptr cinfo, const CoeffRows& coeffs,
+                  size_t scan_index, int ac_ctx_offset, ScanTokenInfo* sti,
+                  Sink* sink) {
   const jpeg_scan_info* scan_info = &cinfo->scan_info[scan_index];
   if (scan_info->Ss > 0) {
     if (scan_info->Ah == 0) {
-      TokenizeACProgressiveScan(cinfo, scan_index, ac_ctx_offset, sti);
+      TokenizeACProgressiveScan(cinfo, coeffs, scan_index, ac_ctx_offset, sti,
+                                sink);
     } else {
-      TokenizeACRefinementScan(cinfo, scan_index, sti);
+      TokenizeACRefinementScan(cinfo, coeffs, scan_index, sti);
     }
     return;
   }
 
-  jpeg_comp_master* m = cinfo->master;
   size_t restart_interval = sti->restart_interval;
   int restarts_to_go = restart_interval;
   coeff_t last_dc_coeff[MAX_COMPS_IN_SCAN] = {0};
@@ -340,61 +501,27 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
   HWY_ALIGN constexpr coeff_t kSinkBlock[DCTSIZE2] = {0};
 
   size_t restart_idx = 0;
-  TokenArray* ta = &m->token_arrays[m->cur_token_array];
-  sti->token_offset = Ah > 0 ? 0 : m->total_num_tokens + ta->num_tokens;
+  Token* next_token = sink->Begin();
+  sti->token_offset = Ah > 0 ? 0 : sink->Index(next_token);
 
-  if (Ah > 0) {
-    sti->refbits = Allocate<uint8_t>(cinfo, sti->num_blocks, JPOOL_IMAGE);
-  } else if (cinfo->progressive_mode) {
-    if (ta->num_tokens + sti->num_blocks > m->num_tokens) {
-      if (ta->tokens) {
-        m->total_num_tokens += ta->num_tokens;
-        ++m->cur_token_array;
-        ta = &m->token_arrays[m->cur_token_array];
-      }
-      m->num_tokens = sti->num_blocks;
-      ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
-      m->next_token = ta->tokens;
-    }
+  if (Ah == 0 && is_progressive) {
+    next_token = sink->Reserve(next_token, sti->num_blocks, 0, 1);
   }
 
-  JBLOCKARRAY blocks[MAX_COMPS_IN_SCAN];
   size_t block_idx = 0;
   for (size_t mcu_y = 0; mcu_y < sti->MCU_rows_in_scan; ++mcu_y) {
-    for (int i = 0; i < scan_info->comps_in_scan; ++i) {
-      int comp_idx = scan_info->component_index[i];
-      jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
-      int n_blocks_y = is_interleaved ? comp->v_samp_factor : 1;
-      int by0 = mcu_y * n_blocks_y;
-      int block_rows_left = comp->height_in_blocks - by0;
-      int max_block_rows = std::min(n_blocks_y, block_rows_left);
-      blocks[i] = (*cinfo->mem->access_virt_barray)(
-          reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[comp_idx],
-          by0, max_block_rows, FALSE);
-    }
-    if (!cinfo->progressive_mode) {
+    if (!is_progressive) {
       int max_tokens_per_mcu_row = MaxNumTokensPerMCURow(cinfo);
-      if (ta->num_tokens + max_tokens_per_mcu_row > m->num_tokens) {
-        if (ta->tokens) {
-          m->total_num_tokens += ta->num_tokens;
-          ++m->cur_token_array;
-          ta = &m->token_arrays[m->cur_token_array];
-        }
-        m->num_tokens =
-            EstimateNumTokens(cinfo, mcu_y, sti->MCU_rows_in_scan,
-                              m->total_num_tokens, max_tokens_per_mcu_row);
-        ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
-        m->next_token = ta->tokens;
-      }
+      next_token = sink->Reserve(next_token, max_tokens_per_mcu_row, mcu_y,
+                                 sti->MCU_rows_in_scan);
     }
     for (size_t mcu_x = 0; mcu_x < sti->MCUs_per_row; ++mcu_x) {
       // Possibly emit a restart marker.
       if (restart_interval > 0 && restarts_to_go == 0) {
         restarts_to_go = restart_interval;
         memset(last_dc_coeff, 0, sizeof(last_dc_coeff));
-        ta->num_tokens = m->next_token - ta->tokens;
         sti->restarts[restart_idx++] =
-            Ah > 0 ? block_idx : m->total_num_tokens + ta->num_tokens;
+            Ah > 0 ? block_idx : sink->Index(next_token);
       }
       // Encode one MCU
       for (int i = 0; i < scan_info->comps_in_scan; ++i) {
@@ -411,17 +538,17 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
                 block_y >= comp->height_in_blocks) {
               block = kSinkBlock;
             } else {
-              block = &blocks[i][iy][block_x][0];
+              block = &coeffs.rows[comp_idx][block_y][block_x][0];
             }
             if (!is_progressive) {
               HWY_DYNAMIC_DISPATCH(ComputeTokensSequential)
               (block, last_dc_coeff[i], comp_idx, ac_ctx_offset + i,
-               &m->next_token);
+               &next_token);
               last_dc_coeff[i] = block[0];
             } else {
               if (Ah == 0) {
                 TokenizeProgressiveDC(block, comp_idx, Al, last_dc_coeff + i,
-                                      &m->next_token);
+                                      &next_token);
               } else {
                 sti->refbits[block_idx] = (block[0] >> Al) & 1;
               }
@@ -432,24 +559,107 @@ void TokenizeScan(j_compress_ptr cinfo, size_t scan_index, int ac_ctx_offset,
       }
       --restarts_to_go;
     }
-    ta->num_tokens = m->next_token - ta->tokens;
   }
   JXL_DASSERT(block_idx == sti->num_blocks);
-  sti->num_tokens =
-      Ah > 0 ? sti->num_blocks
-             : m->total_num_tokens + ta->num_tokens - sti->token_offset;
+  sti->num_tokens = Ah > 0 ? sti->num_blocks
+                           : sink->Index(next_token) - sti->token_offset;
   sti->restarts[restart_idx++] =
-      Ah > 0 ? sti->num_blocks : m->total_num_tokens + ta->num_tokens;
+      Ah > 0 ? sti->num_blocks : sink->Index(next_token);
   if (Ah == 0 && cinfo->progressive_mode) {
     JXL_DASSERT(sti->num_blocks == sti->num_tokens);
   }
+  sink->End(next_token);
+}
+
+// Tokenizes all scans except the AC refinement scans in parallel, each into
+// its own buffer, which are then appended to the token arrays in scan order.
+// The AC refinement scans share the refinement token and bit buffers, and
+// are left to the serial tokenization.
+void TokenizeScansParallel(j_compress_ptr cinfo, const CoeffRows& coeffs,
+                           std::vector<int>* processed) {
+  jpeg_comp_master* m = cinfo->master;
+  std::vector<int> scans;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info& si = cinfo->scan_info[i];
+    if ((si.Ss > 0 && si.Ah > 0) || (*processed)[i]) continue;
+    AllocateScanBuffers(cinfo, i, &m->scan_token_info[i]);
+    scans.push_back(i);
+  }
+  std::vector<TokenVectorSink> sinks(scans.size());
+  const auto tokenize_scan = [&](uint32_t task, size_t /* thread */) {
+    int i = scans[task];
+    TokenizeScan(cinfo, coeffs, i, m->ac_ctx_offset[i], &m->scan_token_info[i],
+                 &sinks[task]);
+  };
+  RunParallel(cinfo, 0, static_cast<uint32_t>(scans.size()), tokenize_scan);
+  for (size_t k = 0; k < scans.size(); ++k) {
+    int i = scans[k];
+    (*processed)[i] = 1;
+    if (cinfo->scan_info[i].Ah > 0) continue;
+    ScanTokenInfo* sti = &m->scan_token_info[i];
+    const TokenVectorSink& sink = sinks[k];
+    TokenArray* ta = &m->token_arrays[m->cur_token_array];
+    if (ta->tokens) {
+      m->total_num_tokens += ta->num_tokens;
+      ++m->cur_token_array;
+      ta = &m->token_arrays[m->cur_token_array];
+    }
+    ta->num_tokens = sink.num_tokens();
+    sti->token_offset += m->total_num_tokens;
+    for (size_t r = 0; r < sti->num_restarts; ++r) {
+      sti->restarts[r] += m->total_num_tokens;
+    }
+    if (m->use_compact_tokens) {
+      // Pack the tokens directly from the sink and continue with an empty
+      // token array.
+      PackTokens(cinfo, sink.tokens(), ta);
+      m->total_num_tokens += ta->num_tokens;
+      ++m->cur_token_array;
+      m->num_tokens = 0;
+      m->next_token = nullptr;
+      continue;
+    }
+    ta->tokens = Allocate<Token>(cinfo, ta->num_tokens, JPOOL_IMAGE);
+    memcpy(ta->tokens, sink.tokens(), ta->num_tokens * sizeof(Token));
+    m->num_tokens = ta->num_tokens;
+    m->next_token = ta->tokens + ta->num_tokens;
+  }
 }
 
 }  // namespace
 
 void TokenizeJpeg(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
+  CoeffRows coeffs;
+  GetCoeffRows(cinfo, &coeffs);
+  TokenArraySink sink(cinfo);
   std::vector<int> processed(cinfo->num_scans);
+  // With two pass tokenization, the scans of sequential images are only
+  // tokenized here for their histograms and are tokenized again when they
+  // are written, so that their tokens are never stored.
+  m->use_two_pass_tokenization =
+      m->two_pass_tokenization_requested && !cinfo->progressive_mode;
+  int* token_counts = nullptr;
+  if (m->use_two_pass_tokenization) {
+    size_t num_counts = m->num_contexts * kJpegHuffmanAlphabetSize;
+    token_counts = Allocate<int>(cinfo, num_counts, JPOOL_IMAGE);
+    memset(token_counts, 0, num_counts * sizeof(token_counts[0]));
+  }
+  m->token_counts = token_counts;
+  const auto count_tokens = [token_counts](const Token* tokens,
+                                           size_t num_tokens) {
+    for (size_t j = 0; j < num_tokens; ++j) {
+      const Token& t = tokens[j];
+      ++token_counts[t.context * kJpegHuffmanAlphabetSize + t.symbol];
+    }
+  };
+  if (m->stream_dc_scan) {
+    // The first scan is already written.
+    processed[0] = 1;
+  }
+  if (m->runner != nullptr && cinfo->progressive_mode) {
+    TokenizeScansParallel(cinfo, coeffs, &processed);
+  }
   size_t max_refinement_tokens = 0;
   size_t num_refinement_bits = 0;
   int num_refinement_scans[kMaxComponents][DCTSIZE2] = {};
@@ -460,8 +670,11 @@ void TokenizeJpeg(j_compress_ptr cinfo) {
     if (si->Ss > 0 && si->Ah == 0 && si->Al > 0) {
       int offset = m->ac_ctx_offset[i];
       int comp_idx = si->component_index[0];
-      TokenizeScan(cinfo, i, offset, sti);
-      processed[i] = 1;
+      if (!processed[i]) {
+        CheckCancelFlag(cinfo);
+        TokenizeScan(cinfo, coeffs, i, offset, sti, &sink);
+        processed[i] = 1;
+      }
       max_refinement_tokens += sti->num_future_nonzeros;
       for (int k = si->Ss; k <= si->Se; ++k) {
         num_refinement_scans[comp_idx][k] = si->Al;
@@ -492,7 +705,8 @@ void TokenizeJpeg(j_compress_ptr cinfo) {
       if (si->Ss > 0 && si->Ah > 0 &&
           si->Ah == num_refinement_scans[comp_idx][si->Ss] - j) {
         int offset = m->ac_ctx_offset[i];
-        TokenizeScan(cinfo, i, offset, sti);
+        AllocateScanBuffers(cinfo, i, sti);
+        TokenizeScan(cinfo, coeffs, i, offset, sti, &sink);
         processed[i] = 1;
         new_refinement_bits += sti->num_nonzeros;
       }
@@ -505,12 +719,82 @@ void TokenizeJpeg(j_compress_ptr cinfo) {
     if (processed[i]) {
       continue;
     }
+    CheckCancelFlag(cinfo);
     int offset = m->ac_ctx_offset[i];
-    TokenizeScan(cinfo, i, offset, &m->scan_token_info[i]);
+    ScanTokenInfo* sti = &m->scan_token_info[i];
+    AllocateScanBuffers(cinfo, i, sti);
+    if (m->use_two_pass_tokenization) {
+      ChunkedTokenSink<decltype(count_tokens)> counting_sink(count_tokens);
+      TokenizeScan(cinfo, coeffs, i, offset, sti, &counting_sink);
+    } else {
+      TokenizeScan(cinfo, coeffs, i, offset, sti, &sink);
+    }
     processed[i] = 1;
   }
 }
 
+void TokenizeScanInChunks(j_compress_ptr cinfo, int scan_index,
+                          TokenChunkFunc process, void* opaque) {
+  jpeg_comp_master* m = cinfo->master;
+  CoeffRows coeffs;
+  GetCoeffRows(cinfo, &coeffs);
+  const auto process_chunk = [process, opaque](const Token* tokens,
+                                               size_t num_tokens) {
+    process(opaque, tokens, num_tokens);
+  };
+  ChunkedTokenSink<decltype(process_chunk)> sink(process_chunk);
+  // This also recomputes the scan token info of the first pass, which does
+  // not change.
+  TokenizeScan(cinfo, coeffs, scan_index, m->ac_ctx_offset[scan_index],
+               &m->scan_token_info[scan_index], &sink);
+}
+
+float HistogramCost(const int* histo) {
+  uint32_t counts[kJpegHuffmanAlphabetSize + 1];
+  uint8_t depths[kJpegHuffmanAlphabetSize + 1] = {0};
+  for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+    counts[i] = histo[i];
+  }
+  counts[kJpegHuffmanAlphabetSize] = 1;
+  CreateHuffmanTree(counts, kJpegHuffmanAlphabetSize + 1,
+                    kJpegHuffmanMaxBitLength, depths);
+  size_t header_bits = (1 + kJpegHuffmanMaxBitLength) * 8;
+  size_t data_bits = 0;
+  for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+    if (depths[i] > 0) {
+      header_bits += 8;
+      data_bits += counts[i] * depths[i];
+    }
+  }
+  return header_bits + data_bits;
+}
+
+void BuildOptimalHuffmanTable(const int* counts, JHUFF_TBL* table) {
+  uint32_t tree_counts[kJpegHuffmanAlphabetSize + 1];
+  uint8_t depths[kJpegHuffmanAlphabetSize + 1] = {0};
+  for (size_t j = 0; j < kJpegHuffmanAlphabetSize; ++j) {
+    tree_counts[j] = counts[j];
+  }
+  tree_counts[kJpegHuffmanAlphabetSize] = 1;
+  CreateHuffmanTree(tree_counts, kJpegHuffmanAlphabetSize + 1,
+                    kJpegHuffmanMaxBitLength, depths);
+  memset(table, 0, sizeof(JHUFF_TBL));
+  for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+    if (depths[i] > 0) {
+      ++table->bits[depths[i]];
+    }
+  }
+  int offset[kJpegHuffmanMaxBitLength + 1] = {0};
+  for (size_t i = 1; i <= kJpegHuffmanMaxBitLength; ++i) {
+    offset[i] = offset[i - 1] + table->bits[i - 1];
+  }
+  for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+    if (depths[i] > 0) {
+      table->huffval[offset[depths[i]]++] = i;
+    }
+  }
+}
+
 namespace {
 
 struct Histogram {
@@ -518,25 +802,81 @@ struct Histogram {
   Histogram() { memset(count, 0, sizeof(count)); }
 };
 
+// Number of tokens that are counted by one task of BuildHistograms().
+constexpr size_t kNumTokensPerHistogramTask = 1 << 20;
+
+// A range of tokens in one of the token arrays, or if array is -1, the
+// refinement tokens of the AC refinement scan with index scan.
+struct HistogramTask {
+  int array;
+  int scan;
+  size_t begin;
+  size_t end;
+};
+
+void CountTokens(j_compress_ptr cinfo, const HistogramTask& task,
+                 Histogram* histograms) {
+  jpeg_comp_master* m = cinfo->master;
+  if (task.array >= 0) {
+    VisitTokens(m->token_arrays[task.array], task.begin, task.end,
+                [histograms](size_t /* i */, Token t) {
+                  ++histograms[t.context].count[t.symbol];
+                });
+  } else {
+    const ScanTokenInfo& sti = m->scan_token_info[task.scan];
+    int context = m->ac_ctx_offset[task.scan];
+    int* ac_histo = &histograms[context].count[0];
+    for (size_t j = task.begin; j < task.end; ++j) {
+      ++ac_histo[sti.tokens[j].symbol & 253];
+    }
+  }
+}
+
+// With a parallel runner, the tokens are split into chunks that are counted
+// into separate partial histograms, which are then added up.
 void BuildHistograms(j_compress_ptr cinfo, Histogram* histograms) {
   jpeg_comp_master* m = cinfo->master;
+  if (m->token_counts != nullptr) {
+    for (size_t c = 0; c < m->num_contexts; ++c) {
+      const int* counts = &m->token_counts[c * kJpegHuffmanAlphabetSize];
+      for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+        histograms[c].count[i] += counts[i];
+      }
+    }
+  }
+  std::vector<HistogramTask> tasks;
   size_t num_token_arrays = m->cur_token_array + 1;
   for (size_t i = 0; i < num_token_arrays; ++i) {
-    Token* tokens = m->token_arrays[i].tokens;
     size_t num_tokens = m->token_arrays[i].num_tokens;
-    for (size_t j = 0; j < num_tokens; ++j) {
-      Token t = tokens[j];
-      ++histograms[t.context].count[t.symbol];
+    for (size_t j = 0; j < num_tokens; j += kNumTokensPerHistogramTask) {
+      size_t end = std::min(num_tokens, j + kNumTokensPerHistogramTask);
+      tasks.push_back({static_cast<int>(i), -1, j, end});
     }
   }
   for (int i = 0; i < cinfo->num_scans; ++i) {
     const jpeg_scan_info& si = cinfo->scan_info[i];
     const ScanTokenInfo& sti = m->scan_token_info[i];
     if (si.Ss > 0 && si.Ah > 0) {
-      int context = m->ac_ctx_offset[i];
-      int* ac_histo = &histograms[context].count[0];
-      for (size_t j = 0; j < sti.num_tokens; ++j) {
-        ++ac_histo[sti.tokens[j].symbol & 253];
+      tasks.push_back({-1, i, 0, sti.num_tokens});
+    }
+  }
+  if (m->runner == nullptr || tasks.size() <= 1) {
+    for (const HistogramTask& task : tasks) {
+      CountTokens(cinfo, task, histograms);
+    }
+    return;
+  }
+  const size_t num_contexts = m->num_contexts;
+  std::vector<Histogram> partial(tasks.size() * num_contexts);
+  const auto count_tokens = [&](uint32_t task, size_t /* thread */) {
+    CountTokens(cinfo, tasks[task], &partial[task * num_contexts]);
+  };
+  RunParallel(cinfo, 0, static_cast<uint32_t>(tasks.size()), count_tokens);
+  for (size_t t = 0; t < tasks.size(); ++t) {
+    for (size_t c = 0; c < num_contexts; ++c) {
+      const Histogram& histo = partial[t * num_contexts + c];
+      for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+        histograms[c].count[i] += histo.count[i];
       }
     }
   }
@@ -549,23 +889,7 @@ struct JpegClusteredHistograms {
 };
 
 float HistogramCost(const Histogram& histo) {
-  std::vector<uint32_t> counts(kJpegHuffmanAlphabetSize + 1);
-  std::vector<uint8_t> depths(kJpegHuffmanAlphabetSize + 1);
-  for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
-    counts[i] = histo.count[i];
-  }
-  counts[kJpegHuffmanAlphabetSize] = 1;
-  CreateHuffmanTree(counts.data(), counts.size(), kJpegHuffmanMaxBitLength,
-                    depths.data());
-  size_t header_bits = (1 + kJpegHuffmanMaxBitLength) * 8;
-  size_t data_bits = 0;
-  for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
-    if (depths[i] > 0) {
-      header_bits += 8;
-      data_bits += counts[i] * depths[i];
-    }
-  }
-  return header_bits + data_bits;
+  return ::jpegli::HistogramCost(histo.count);
 }
 
 void AddHistograms(const Histogram& a, const Histogram& b, Histogram* c) {
@@ -581,11 +905,19 @@ bool IsEmptyHistogram(const Histogram& histo) {
   return true;
 }
 
+bool IsSameHistogram(const Histogram& a, const Histogram& b) {
+  return memcmp(a.count, b.count, sizeof(a.count)) == 0;
+}
+
 void ClusterJpegHistograms(j_compress_ptr cinfo, const Histogram* histograms,
                            size_t num, JpegClusteredHistograms* clusters) {
   clusters->histogram_indexes.resize(num);
   std::vector<uint32_t> slot_histograms;
   std::vector<float> slot_costs;
+  // Cost of each histogram on its own, or a negative value if it was not
+  // computed. Identical histograms, e.g. of the refinement scans of small
+  // images, reuse the cost of the first one.
+  std::vector<float> histogram_costs(num, -1.0f);
   // Since not all jpeg decoders support the extended sequential mode, i.e. the
   // 0xff 0xc1 SOF marker, we will limit the number of clusters to 2 in
   // sequential mode, unless the quantization tables already require the
@@ -599,9 +931,18 @@ void ClusterJpegHistograms(j_compress_ptr cinfo, const Histogram* histograms,
       continue;
     }
     size_t best_slot = slot_histograms.size();
-    float best_cost = force_baseline && best_slot > 1
-                          ? std::numeric_limits<float>::max()
-                          : HistogramCost(cur);
+    float best_cost = std::numeric_limits<float>::max();
+    if (!force_baseline || best_slot <= 1) {
+      for (size_t j = 0; j < i && histogram_costs[i] < 0; ++j) {
+        if (histogram_costs[j] >= 0 && IsSameHistogram(histograms[j], cur)) {
+          histogram_costs[i] = histogram_costs[j];
+        }
+      }
+      if (histogram_costs[i] < 0) {
+        histogram_costs[i] = HistogramCost(cur);
+      }
+      best_cost = histogram_costs[i];
+    }
     for (size_t j = 0; j < slot_histograms.size(); ++j) {
       size_t prev_idx = slot_histograms[j];
       const Histogram& prev = clusters->histograms[prev_idx];
@@ -668,30 +1009,51 @@ void CopyHuffmanTable(j_compress_ptr cinfo, int index, bool is_dc,
   ++(*num_huffman_tables);
 }
 
-void BuildJpegHuffmanTable(const Histogram& histo, JHUFF_TBL* table) {
-  std::vector<uint32_t> counts(kJpegHuffmanAlphabetSize + 1);
-  std::vector<uint8_t> depths(kJpegHuffmanAlphabetSize + 1);
-  for (size_t j = 0; j < kJpegHuffmanAlphabetSize; ++j) {
-    counts[j] = histo.count[j];
-  }
-  counts[kJpegHuffmanAlphabetSize] = 1;
-  CreateHuffmanTree(counts.data(), counts.size(), kJpegHuffmanMaxBitLength,
-                    depths.data());
-  memset(table, 0, sizeof(JHUFF_TBL));
-  for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
-    if (depths[i] > 0) {
-      ++table->bits[depths[i]];
+// Builds the Huffman table of histo extended to all the symbols that can occur
+// with the data precision of the image, for the kept codes of
+// jpegli_set_frame_sequence().
+void BuildFrameSequenceTable(j_compress_ptr cinfo, const Histogram& histo,
+                             bool is_dc, JHUFF_TBL* table) {
+  Histogram extended = histo;
+  const int max_nbits = cinfo->data_precision + (is_dc ? 3 : 2);
+  if (is_dc) {
+    for (int nbits = 0; nbits <= max_nbits; ++nbits) ++extended.count[nbits];
+  } else {
+    ++extended.count[0];
+    ++extended.count[0xf0];
+    for (int run = 0; run < 16; ++run) {
+      for (int nbits = 1; nbits <= max_nbits; ++nbits) {
+        ++extended.count[(run << 4) + nbits];
+      }
     }
   }
-  int offset[kJpegHuffmanMaxBitLength + 1] = {0};
-  for (size_t i = 1; i <= kJpegHuffmanMaxBitLength; ++i) {
-    offset[i] = offset[i - 1] + table->bits[i - 1];
+  BuildOptimalHuffmanTable(extended.count, table);
+}
+
+// Keeps the optimized Huffman codes of the current frame for the next frames
+// of jpegli_set_frame_sequence().
+void KeepFrameSequenceCodes(j_compress_ptr cinfo,
+                            const JpegClusteredHistograms& dc_clusters,
+                            const JpegClusteredHistograms& ac_clusters) {
+  jpeg_comp_master* m = cinfo->master;
+  if (m->frame_tables == nullptr) {
+    m->frame_tables = Allocate<JHUFF_TBL>(cinfo, 2 * kMaxComponents);
+    m->frame_counts = Allocate<int>(
+        cinfo, 2 * kMaxComponents * kJpegHuffmanAlphabetSize);
   }
-  for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
-    if (depths[i] > 0) {
-      table->huffval[offset[depths[i]]++] = i;
-    }
+  const size_t num_dc_huff = dc_clusters.histograms.size();
+  for (size_t i = 0; i < m->num_huffman_tables; ++i) {
+    const bool is_dc = i < num_dc_huff;
+    const Histogram& histo = is_dc ? dc_clusters.histograms[i]
+                                   : ac_clusters.histograms[i - num_dc_huff];
+    BuildFrameSequenceTable(cinfo, histo, is_dc, &m->frame_tables[i]);
+    m->frame_slot_ids[i] = m->slot_id_map[i];
   }
+  memset(m->frame_context_map, 0, sizeof(m->frame_context_map));
+  memcpy(m->frame_context_map, m->context_map, m->num_contexts);
+  m->frame_num_tables = m->num_huffman_tables;
+  m->frame_num_components = cinfo->num_components;
+  m->frame_data_precision = cinfo->data_precision;
 }
 
 }  // namespace
@@ -730,11 +1092,35 @@ void CopyHuffmanTables(j_compress_ptr cinfo) {
   }
 }
 
+void CopyDCHuffmanTables(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  size_t max_huff_tables = cinfo->num_components;
+  m->huffman_tables = Allocate<JHUFF_TBL>(cinfo, max_huff_tables, JPOOL_IMAGE);
+  m->slot_id_map = Allocate<uint8_t>(cinfo, max_huff_tables, JPOOL_IMAGE);
+  m->num_huffman_tables = 0;
+  int inv_slot_map[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    CopyHuffmanTable(cinfo, comp->dc_tbl_no, /*is_dc=*/true, &inv_slot_map[0],
+                     m->slot_id_map, m->huffman_tables, &m->num_huffman_tables);
+  }
+  m->context_map = Allocate<uint8_t>(cinfo, m->num_contexts, JPOOL_IMAGE);
+  memset(m->context_map, 0, m->num_contexts);
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    m->context_map[c] = inv_slot_map[cinfo->comp_info[c].dc_tbl_no];
+  }
+}
+
 void OptimizeHuffmanCodes(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   // Build DC and AC histograms.
   std::vector<Histogram> histograms(m->num_contexts);
   BuildHistograms(cinfo, histograms.data());
+  size_t num_tokens = 0;
+  for (const Histogram& histo : histograms) {
+    for (int count : histo.count) num_tokens += count;
+  }
+  m->cur_encode_stats.num_tokens = num_tokens;
 
   // Cluster DC histograms.
   JpegClusteredHistograms dc_clusters;
@@ -746,21 +1132,41 @@ void OptimizeHuffmanCodes(j_compress_ptr cinfo) {
   ClusterJpegHistograms(cinfo, histograms.data() + 4, m->num_contexts - 4,
                         &ac_clusters);
 
-  // Create Huffman tables and slot ids clusters.
-  size_t num_dc_huff = dc_clusters.histograms.size();
+  // Create Huffman tables and slot ids clusters. The DC Huffman tables of a
+  // streamed DC scan, which has no tokens, are already written and are kept.
+  const JHUFF_TBL* streamed_dc_tables = m->huffman_tables;
+  const uint8_t* streamed_dc_slot_ids = m->slot_id_map;
+  const uint8_t* streamed_dc_context_map = m->context_map;
+  size_t num_dc_huff = m->stream_dc_scan ? m->num_huffman_tables
+                                         : dc_clusters.histograms.size();
   m->num_huffman_tables = num_dc_huff + ac_clusters.histograms.size();
   m->huffman_tables =
       Allocate<JHUFF_TBL>(cinfo, m->num_huffman_tables, JPOOL_IMAGE);
   m->slot_id_map = Allocate<uint8_t>(cinfo, m->num_huffman_tables, JPOOL_IMAGE);
   for (size_t i = 0; i < m->num_huffman_tables; ++i) {
     JHUFF_TBL huff_table = {};
-    if (i < dc_clusters.histograms.size()) {
-      m->slot_id_map[i] = i;
-      BuildJpegHuffmanTable(dc_clusters.histograms[i], &huff_table);
+    if (i < num_dc_huff && m->stream_dc_scan) {
+      m->slot_id_map[i] = streamed_dc_slot_ids[i];
+      huff_table = streamed_dc_tables[i];
     } else {
-      m->slot_id_map[i] = 16 + ac_clusters.slot_ids[i - num_dc_huff];
-      BuildJpegHuffmanTable(ac_clusters.histograms[i - num_dc_huff],
-                            &huff_table);
+      const bool is_dc = i < num_dc_huff;
+      const JpegClusteredHistograms& clusters =
+          is_dc ? dc_clusters : ac_clusters;
+      const size_t first = is_dc ? 0 : num_dc_huff;
+      const Histogram& histo = clusters.histograms[i - first];
+      m->slot_id_map[i] = is_dc ? i : 16 + clusters.slot_ids[i - first];
+      // Clusters that replaced each other in the same slot can end up with
+      // identical histograms, their Huffman tables are built only once.
+      size_t same = first;
+      while (same < i &&
+             !IsSameHistogram(clusters.histograms[same - first], histo)) {
+        ++same;
+      }
+      if (same < i) {
+        huff_table = m->huffman_tables[same];
+      } else {
+        BuildOptimalHuffmanTable(histo.count, &huff_table);
+      }
     }
     memcpy(&m->huffman_tables[i], &huff_table, sizeof(huff_table));
   }
@@ -770,33 +1176,134 @@ void OptimizeHuffmanCodes(j_compress_ptr cinfo) {
   memset(m->context_map, 0, m->num_contexts);
   for (size_t i = 0; i < m->num_contexts; ++i) {
     if (i < static_cast<size_t>(cinfo->num_components)) {
-      m->context_map[i] = dc_clusters.histogram_indexes[i];
+      m->context_map[i] = m->stream_dc_scan ? streamed_dc_context_map[i]
+                                            : dc_clusters.histogram_indexes[i];
     } else if (i >= 4) {
       m->context_map[i] = num_dc_huff + ac_clusters.histogram_indexes[i - 4];
     }
   }
+  if (m->frame_keep_codes) {
+    KeepFrameSequenceCodes(cinfo, dc_clusters, ac_clusters);
+  }
 }
 
-namespace {
+void UseFrameSequenceCodes(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  m->num_huffman_tables = m->frame_num_tables;
+  m->huffman_tables =
+      Allocate<JHUFF_TBL>(cinfo, m->num_huffman_tables, JPOOL_IMAGE);
+  memcpy(m->huffman_tables, m->frame_tables,
+         m->num_huffman_tables * sizeof(JHUFF_TBL));
+  m->slot_id_map = Allocate<uint8_t>(cinfo, m->num_huffman_tables, JPOOL_IMAGE);
+  memcpy(m->slot_id_map, m->frame_slot_ids, m->num_huffman_tables);
+  m->context_map = Allocate<uint8_t>(cinfo, m->num_contexts, JPOOL_IMAGE);
+  memcpy(m->context_map, m->frame_context_map, m->num_contexts);
+  memset(m->frame_counts, 0,
+         2 * kMaxComponents * kJpegHuffmanAlphabetSize * sizeof(int));
+}
 
-constexpr uint8_t kNumExtraBits[256] = {
-    0,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    1,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    2,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    3,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    4,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    5,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    6,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    7,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    8,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    9,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    10, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    11, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    12, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    13, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    14, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-    0,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
-};
+void UpdateFrameSequenceCodes(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  if (!m->frame_reuse) return;
+  // The counts of the contexts that share a Huffman table are merged.
+  std::vector<Histogram> histograms(m->num_huffman_tables);
+  for (size_t ctx = 0; ctx < m->num_contexts; ++ctx) {
+    if (ctx >= static_cast<size_t>(cinfo->num_components) && ctx < 4) continue;
+    const int* counts = m->frame_counts + ctx * kJpegHuffmanAlphabetSize;
+    Histogram* histo = &histograms[m->context_map[ctx]];
+    for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+      histo->count[i] += counts[i];
+    }
+  }
+  double cost = 0.0;
+  double optimal_cost = 0.0;
+  for (size_t t = 0; t < m->num_huffman_tables; ++t) {
+    const JHUFF_TBL& table = m->huffman_tables[t];
+    const Histogram& histo = histograms[t];
+    cost += (1 + kJpegHuffmanMaxBitLength) * 8;
+    for (size_t len = 1, p = 0; len <= kJpegHuffmanMaxBitLength; ++len) {
+      for (int n = 0; n < table.bits[len]; ++n, ++p) {
+        cost += 8 + static_cast<double>(histo.count[table.huffval[p]]) * len;
+      }
+    }
+    optimal_cost += HistogramCost(histo);
+  }
+  const float drift =
+      optimal_cost > 0.0 ? static_cast<float>(cost / optimal_cost - 1.0) : 0;
+  m->cur_encode_stats.reused_huffman_codes = 1;
+  m->cur_encode_stats.huffman_cost_drift = drift;
+  if (drift > m->frame_max_drift) {
+    m->frame_num_tables = 0;
+  }
+}
+
+void PresetHuffmanTable(const JpegliHuffmanPreset& preset, int k, bool is_dc,
+                        JHUFF_TBL* table) {
+  memset(table, 0, sizeof(*table));
+  memcpy(table->bits, is_dc ? preset.dc_bits[k] : preset.ac_bits[k],
+         sizeof(table->bits));
+  memcpy(table->huffval, is_dc ? preset.dc_huffval[k] : preset.ac_huffval[k],
+         sizeof(table->huffval));
+}
+
+bool HasAllSymbols(const JHUFF_TBL& table, bool is_dc, int data_precision) {
+  bool present[kJpegHuffmanAlphabetSize] = {false};
+  for (size_t len = 1, p = 0; len <= kJpegHuffmanMaxBitLength; ++len) {
+    for (int n = 0; n < table.bits[len]; ++n, ++p) {
+      present[table.huffval[p]] = true;
+    }
+  }
+  // Same symbols as in BuildFrameSequenceTable().
+  const int max_nbits = data_precision + (is_dc ? 3 : 2);
+  if (is_dc) {
+    for (int nbits = 0; nbits <= max_nbits; ++nbits) {
+      if (!present[nbits]) return false;
+    }
+    return true;
+  }
+  if (!present[0] || !present[0xf0]) return false;
+  for (int run = 0; run < 16; ++run) {
+    for (int nbits = 1; nbits <= max_nbits; ++nbits) {
+      if (!present[(run << 4) + nbits]) return false;
+    }
+  }
+  return true;
+}
+
+void UsePresetHuffmanCodes(j_compress_ptr cinfo,
+                           const JpegliHuffmanPreset& preset) {
+  jpeg_comp_master* m = cinfo->master;
+  // Same table order as in CopyHuffmanTables(): the DC and AC table of the
+  // first component, followed by those of the other components.
+  const int num_kinds = cinfo->num_components > 1 ? 2 : 1;
+  m->num_huffman_tables = 2 * num_kinds;
+  m->huffman_tables =
+      Allocate<JHUFF_TBL>(cinfo, m->num_huffman_tables, JPOOL_IMAGE);
+  m->slot_id_map = Allocate<uint8_t>(cinfo, m->num_huffman_tables, JPOOL_IMAGE);
+  for (int k = 0; k < num_kinds; ++k) {
+    PresetHuffmanTable(preset, k, /*is_dc=*/true, &m->huffman_tables[2 * k]);
+    PresetHuffmanTable(preset, k, /*is_dc=*/false,
+                       &m->huffman_tables[2 * k + 1]);
+    m->slot_id_map[2 * k] = k;
+    m->slot_id_map[2 * k + 1] = 0x10 + k;
+  }
+  m->context_map = Allocate<uint8_t>(cinfo, 8, JPOOL_IMAGE);
+  memset(m->context_map, 0, 8);
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    m->context_map[c] = c == 0 ? 0 : 2;
+  }
+  int ac_ctx = 4;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* si = &cinfo->scan_info[i];
+    if (si->Se > 0) {
+      for (int j = 0; j < si->comps_in_scan; ++j) {
+        m->context_map[ac_ctx++] = si->component_index[j] == 0 ? 1 : 3;
+      }
+    }
+  }
+}
+
+namespace {
 
 void BuildHuffmanCodeTable(const JHUFF_TBL& table, HuffmanCodeTable* code) {
   int huff_code[kJpegHuffmanAlphabetSize];
@@ -825,20 +1332,62 @@ void BuildHuffmanCodeTable(const JHUFF_TBL& table, HuffmanCodeTable* code) {
   }
   for (p = 0; p < last_p; p++) {
     int i = table.huffval[p];
-    int nbits = kNumExtraBits[i];
-    code->depth[i] = huff_size[p] + nbits;
-    code->code[i] = huff_code[p] << nbits;
+    code->Set(i, huff_size[p], huff_code[p], kNumExtraBits[i]);
   }
 }
 
+bool SameHuffmanTable(const JHUFF_TBL& table, const CachedCodeTable& entry) {
+  if (memcmp(table.bits, entry.bits, sizeof(entry.bits)) != 0) {
+    return false;
+  }
+  size_t total_count = 0;
+  for (size_t i = 0; i <= kJpegHuffmanMaxBitLength; ++i) {
+    total_count += table.bits[i];
+  }
+  return memcmp(table.huffval, entry.huffval, total_count) == 0;
+}
+
+// Copies the coding table of table from the cache of the context of cinfo, or
+// builds it and adds it to the cache.
+void GetCachedHuffmanCodeTable(j_compress_ptr cinfo, const JHUFF_TBL& table,
+                               HuffmanCodeTable* code) {
+  jpegli_context* context = GetContext(cinfo);
+  std::lock_guard<std::mutex> lock(context->code_table_mutex);
+  for (size_t i = 0; i < context->num_code_tables; ++i) {
+    if (SameHuffmanTable(table, context->code_tables[i])) {
+      memcpy(code, &context->code_tables[i].code, sizeof(*code));
+      return;
+    }
+  }
+  CachedCodeTable* entry = &context->code_tables[context->next_code_table];
+  context->next_code_table =
+      (context->next_code_table + 1) % kNumCachedCodeTables;
+  context->num_code_tables =
+      std::min(context->num_code_tables + 1, kNumCachedCodeTables);
+  memcpy(entry->bits, table.bits, sizeof(entry->bits));
+  memcpy(entry->huffval, table.huffval, sizeof(entry->huffval));
+  memset(&entry->code, 0, sizeof(entry->code));
+  BuildHuffmanCodeTable(table, &entry->code);
+  memcpy(code, &entry->code, sizeof(*code));
+}
+
 }  // namespace
 
 void InitEntropyCoder(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   m->coding_tables =
       Allocate<HuffmanCodeTable>(cinfo, m->num_huffman_tables, JPOOL_IMAGE);
+  // The kept Huffman codes of jpegli_set_frame_sequence() are specific to the
+  // image sequence and are not cached.
+  const bool fixed_tables = !cinfo->optimize_coding &&
+                            !cinfo->progressive_mode && !m->frame_reuse;
   for (size_t i = 0; i < m->num_huffman_tables; ++i) {
-    BuildHuffmanCodeTable(m->huffman_tables[i], &m->coding_tables[i]);
+    if (fixed_tables) {
+      GetCachedHuffmanCodeTable(cinfo, m->huffman_tables[i],
+                                &m->coding_tables[i]);
+    } else {
+      BuildHuffmanCodeTable(m->huffman_tables[i], &m->coding_tables[i]);
+    }
   }
 }
 
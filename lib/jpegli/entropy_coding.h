@@ -10,20 +10,101 @@
 #include <cstddef>
 
 #include "lib/jpegli/common.h"
+#include "lib/jpegli/encode_internal.h"
 
 namespace jpegli {
 
+// Number of tokens that are collected in the staging buffer before they are
+// packed, if compact tokens are used.
+constexpr size_t kNumStagingTokens = 1 << 18;
+
 size_t MaxNumTokensPerMCURow(j_compress_ptr cinfo);
 
 size_t EstimateNumTokens(j_compress_ptr cinfo, size_t mcu_y, size_t ysize_mcus,
                          size_t num_tokens, size_t max_per_row);
 
+// Makes room for max_tokens more tokens in the current token array, where
+// next_token is the position of the next token in it, and returns the new
+// position of the next token. The progress of the scan, row out of num_rows,
+// is used to estimate the size of a new token array.
+Token* ReserveTokens(j_compress_ptr cinfo, Token* next_token,
+                     size_t max_tokens, size_t row, size_t num_rows);
+
+// Packs the last token array if compact tokens are used, called after all the
+// tokens of the image are computed.
+void FinishTokens(j_compress_ptr cinfo);
+
 void TokenizeJpeg(j_compress_ptr cinfo);
 
+typedef void (*TokenChunkFunc)(void* opaque, const Token* tokens,
+                               size_t num_tokens);
+
+// Tokenizes the scan with index scan_index of a sequential image again from
+// the coefficient buffers, and calls process(opaque, tokens, num_tokens) for
+// consecutive chunks of its tokens. Used for writing the scans with two pass
+// tokenization.
+void TokenizeScanInChunks(j_compress_ptr cinfo, int scan_index,
+                          TokenChunkFunc process, void* opaque);
+
+namespace detail {
+
+template <typename Func>
+void CallTokenChunkFunc(void* opaque, const Token* tokens, size_t num_tokens) {
+  (*static_cast<const Func*>(opaque))(tokens, num_tokens);
+}
+
+}  // namespace detail
+
+// Same as above, with a process(tokens, num_tokens) functor.
+template <typename Func>
+void TokenizeScanInChunks(j_compress_ptr cinfo, int scan_index,
+                          const Func& process) {
+  void* opaque = const_cast<void*>(static_cast<const void*>(&process));
+  TokenizeScanInChunks(cinfo, scan_index, &detail::CallTokenChunkFunc<Func>,
+                       opaque);
+}
+
+// Returns the number of bits needed to encode the symbols of the given
+// histogram of kJpegHuffmanAlphabetSize counts with an optimal length-limited
+// Huffman code, including the code's DHT description.
+float HistogramCost(const int* counts);
+
+// Builds the optimal length-limited Huffman table of the given histogram of
+// kJpegHuffmanAlphabetSize symbol counts, which leaves the all ones code
+// unused.
+void BuildOptimalHuffmanTable(const int* counts, JHUFF_TBL* table);
+
 void CopyHuffmanTables(j_compress_ptr cinfo);
 
+// Sets up the DC Huffman tables of the components for the streamed DC scan.
+// These are kept by OptimizeHuffmanCodes().
+void CopyDCHuffmanTables(j_compress_ptr cinfo);
+
 void OptimizeHuffmanCodes(j_compress_ptr cinfo);
 
+// Sets up the Huffman codes that were kept by an earlier frame of
+// jpegli_set_frame_sequence() for the current frame.
+void UseFrameSequenceCodes(j_compress_ptr cinfo);
+
+// Computes the cost drift of the kept Huffman codes of
+// jpegli_set_frame_sequence() on the current frame, if it used them, and
+// drops them if the drift is too large.
+void UpdateFrameSequenceCodes(j_compress_ptr cinfo);
+
+// Copies the table of a jpegli_set_huffman_presets() preset for the first
+// (k = 0) or the other (k = 1) components to table.
+void PresetHuffmanTable(const JpegliHuffmanPreset& preset, int k, bool is_dc,
+                        JHUFF_TBL* table);
+
+// Returns true if table has a code for every symbol that can occur in images
+// of the given data precision.
+bool HasAllSymbols(const JHUFF_TBL& table, bool is_dc, int data_precision);
+
+// Sets up the Huffman codes of a jpegli_set_huffman_presets() preset for the
+// current image, in place of CopyHuffmanTables().
+void UsePresetHuffmanCodes(j_compress_ptr cinfo,
+                           const JpegliHuffmanPreset& preset);
+
 void InitEntropyCoder(j_compress_ptr cinfo);
 
 }  // namespace jpegli
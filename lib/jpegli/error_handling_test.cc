@@ -948,6 +948,37 @@ TEST(EncoderErrorHandlingTest, NonIntegralSamplingRatio) {
   if (buffer) free(buffer);
 }
 
+TEST(EncoderErrorHandlingTest, Cancelled) {
+  uint8_t* buffer = nullptr;
+  unsigned long buffer_size = 0;  // NOLINT
+  volatile int cancel = 0;
+  size_t num_rows_written = 0;
+  jpeg_compress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_compress(&cinfo);
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    cinfo.image_width = 64;
+    cinfo.image_height = 64;
+    cinfo.input_components = 1;
+    jpegli_set_defaults(&cinfo);
+    jpegli_set_cancel_flag(reinterpret_cast<j_common_ptr>(&cinfo), &cancel);
+    jpegli_start_compress(&cinfo, TRUE);
+    JSAMPLE image[64] = {0};
+    JSAMPROW row[] = {image};
+    for (; num_rows_written < 64; ++num_rows_written) {
+      if (num_rows_written == 32) cancel = 1;
+      jpegli_write_scanlines(&cinfo, row, 1);
+    }
+    jpegli_finish_compress(&cinfo);
+    return true;
+  };
+  EXPECT_FALSE(try_catch_block());
+  EXPECT_LT(num_rows_written, 64);
+  jpegli_destroy_compress(&cinfo);
+  if (buffer) free(buffer);
+}
+
 constexpr const char* kAddOnTable[] = {"First message",
                                        "Second message with int param %d",
                                        "Third message with string param %s"};
@@ -1206,7 +1237,7 @@ TEST(DecoderErrorHandlingTest, InvalidSOF) {
     EXPECT_FALSE(ParseCompressed(compressed));
   }
   // invalid data precision
-  for (int val : {0, 1, 127}) {
+  for (int val : {0, 1, 16, 127}) {
     std::vector<uint8_t> compressed(kCompressed0, kCompressed0 + kLen0);
     compressed[kSOFOffset + 4] = val;
     EXPECT_FALSE(ParseCompressed(compressed));
@@ -1272,6 +1303,51 @@ TEST(DecoderErrorHandlingTest, InvalidSOS) {
   }
 }
 
+TEST(DecoderErrorHandlingTest, Cancelled) {
+  std::vector<uint8_t> compressed;
+  {
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    jpeg_compress_struct cinfo;
+    jpegli_create_compress(&cinfo);
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    cinfo.image_width = 64;
+    cinfo.image_height = 64;
+    cinfo.input_components = 1;
+    jpegli_set_defaults(&cinfo);
+    jpegli_start_compress(&cinfo, TRUE);
+    JSAMPLE image[64] = {0};
+    JSAMPROW row[] = {image};
+    for (size_t y = 0; y < 64; ++y) jpegli_write_scanlines(&cinfo, row, 1);
+    jpegli_finish_compress(&cinfo);
+    jpegli_destroy_compress(&cinfo);
+    compressed.assign(buffer, buffer + buffer_size);
+    free(buffer);
+  }
+  volatile int cancel = 0;
+  size_t num_rows_read = 0;
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+    jpegli_set_cancel_flag(reinterpret_cast<j_common_ptr>(&cinfo), &cancel);
+    jpegli_read_header(&cinfo, TRUE);
+    jpegli_start_decompress(&cinfo);
+    std::vector<uint8_t> row_data(cinfo.output_width * cinfo.output_components);
+    JSAMPROW row[] = {row_data.data()};
+    for (; num_rows_read < cinfo.output_height; ++num_rows_read) {
+      if (num_rows_read == 8) cancel = 1;
+      jpegli_read_scanlines(&cinfo, row, 1);
+    }
+    jpegli_finish_decompress(&cinfo);
+    return true;
+  };
+  EXPECT_FALSE(try_catch_block());
+  EXPECT_LT(num_rows_read, cinfo.output_height);
+  jpegli_destroy_decompress(&cinfo);
+}
+
 TEST(DecoderErrorHandlingTest, MutateSingleBytes) {
   for (size_t pos = 0; pos < kLen0; ++pos) {
     std::vector<uint8_t> compressed(kCompressed0, kCompressed0 + kLen0);
@@ -0,0 +1,116 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "lib/jpegli/fingerprint.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/decode.h"
+
+namespace jpegli {
+
+namespace {
+
+// Size of the downscaled image whose DCT is hashed.
+constexpr size_t kHashImageSize = 32;
+
+constexpr double kPi = 3.14159265358979323846;
+
+// Sets the bits of hash to whether each of the size x size lowest frequency
+// coefficients of the DCT, except the first row and column, is above their
+// median, in row-major order, bit i being bit i % 8 of hash[i / 8].
+void HashLowFrequencies(const float* dct, size_t size, unsigned char* hash) {
+  std::vector<float> values;
+  for (size_t k = 1; k <= size; ++k) {
+    for (size_t l = 1; l <= size; ++l) {
+      values.push_back(dct[k * kHashImageSize + l]);
+    }
+  }
+  std::vector<float> sorted = values;
+  std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2,
+                   sorted.end());
+  const float median = sorted[sorted.size() / 2];
+  memset(hash, 0, values.size() / 8);
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (values[i] > median) {
+      hash[i / 8] |= 1u << (i % 8);
+    }
+  }
+}
+
+}  // namespace
+
+void ComputeFingerprint(const float* dc, size_t xsize, size_t ysize,
+                        JpegliFingerprint* fingerprint) {
+  constexpr size_t N = kHashImageSize;
+  // Box filter the DC image to N x N, repeating its pixels if it is smaller.
+  float image[N * N];
+  for (size_t y = 0; y < N; ++y) {
+    size_t y0 = y * ysize / N;
+    size_t y1 = std::max(y0 + 1, (y + 1) * ysize / N);
+    for (size_t x = 0; x < N; ++x) {
+      size_t x0 = x * xsize / N;
+      size_t x1 = std::max(x0 + 1, (x + 1) * xsize / N);
+      float sum = 0.0f;
+      for (size_t iy = y0; iy < y1; ++iy) {
+        for (size_t ix = x0; ix < x1; ++ix) {
+          sum += dc[iy * xsize + ix];
+        }
+      }
+      image[y * N + x] = sum / ((y1 - y0) * (x1 - x0));
+    }
+  }
+  // Unnormalized 2D DCT-II, by rows and then by columns.
+  float cosines[N * N];
+  for (size_t k = 0; k < N; ++k) {
+    for (size_t n = 0; n < N; ++n) {
+      cosines[k * N + n] = std::cos(kPi * (2 * n + 1) * k / (2 * N));
+    }
+  }
+  float rows[N * N];
+  for (size_t y = 0; y < N; ++y) {
+    for (size_t l = 0; l < N; ++l) {
+      float sum = 0.0f;
+      for (size_t n = 0; n < N; ++n) {
+        sum += image[y * N + n] * cosines[l * N + n];
+      }
+      rows[y * N + l] = sum;
+    }
+  }
+  float dct[N * N];
+  for (size_t k = 0; k < N; ++k) {
+    for (size_t l = 0; l < N; ++l) {
+      float sum = 0.0f;
+      for (size_t n = 0; n < N; ++n) {
+        sum += cosines[k * N + n] * rows[n * N + l];
+      }
+      dct[k * N + l] = sum;
+    }
+  }
+  HashLowFrequencies(dct, 8, fingerprint->hash64);
+  HashLowFrequencies(dct, 16, fingerprint->hash256);
+}
+
+}  // namespace jpegli
+
+int jpegli_fingerprint_distance(const JpegliFingerprint* a,
+                                const JpegliFingerprint* b,
+                                boolean long_hash) {
+  const unsigned char* hash_a = long_hash ? a->hash256 : a->hash64;
+  const unsigned char* hash_b = long_hash ? b->hash256 : b->hash64;
+  size_t size = long_hash ? sizeof(a->hash256) : sizeof(a->hash64);
+  int distance = 0;
+  for (size_t i = 0; i < size; ++i) {
+    unsigned int diff = hash_a[i] ^ hash_b[i];
+    for (; diff != 0; diff &= diff - 1) ++distance;
+  }
+  return distance;
+}
@@ -0,0 +1,24 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef LIB_JPEGLI_FINGERPRINT_H_
+#define LIB_JPEGLI_FINGERPRINT_H_
+
+#include <cstddef>
+
+#include "lib/jpegli/common.h"
+
+namespace jpegli {
+
+// Computes the perceptual hashes of jpegli_compute_fingerprint() from the
+// xsize x ysize grid of the DC coefficients of the luma component, i.e. from a
+// 1/8 scaled version of the image.
+void ComputeFingerprint(const float* dc, size_t xsize, size_t ysize,
+                        JpegliFingerprint* fingerprint);
+
+}  // namespace jpegli
+
+#endif  // LIB_JPEGLI_FINGERPRINT_H_
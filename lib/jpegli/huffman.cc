@@ -10,8 +10,6 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
-#include <limits>
-#include <vector>
 
 #include "lib/base/compiler_specific.h"
 #include "lib/base/status.h"
@@ -110,126 +108,190 @@ void BuildJpegHuffmanTable(const uint32_t* count, const uint32_t* symbols,
   }
 }
 
-// A node of a Huffman tree.
-struct HuffmanTree {
-  HuffmanTree(uint32_t count, int16_t left, int16_t right)
-      : total_count(count), index_left(left), index_right_or_value(right) {}
-  uint32_t total_count;
-  int16_t index_left;
-  int16_t index_right_or_value;
-};
-
-void SetDepth(const HuffmanTree& p, HuffmanTree* pool, uint8_t* depth,
-              uint8_t level) {
-  if (p.index_left >= 0) {
-    ++level;
-    SetDepth(pool[p.index_left], pool, depth, level);
-    SetDepth(pool[p.index_right_or_value], pool, depth, level);
-  } else {
-    depth[p.index_right_or_value] = level;
+void BuildJpegFastACTable(const HuffmanTableEntry* lut, int16_t* fast_ac) {
+  constexpr int kExtraBits = kJpegFastACBits - kJpegHuffmanRootTableBits;
+  for (int key = 0; key < kJpegFastACLutSize; ++key) {
+    fast_ac[key] = 0;
+    const HuffmanTableEntry& entry = lut[key >> kExtraBits];
+    // Skip the pointers to second level tables, the invalid symbols, and the
+    // special case of codes with one symbol.
+    if (entry.bits == 0 || entry.bits > kJpegHuffmanRootTableBits ||
+        entry.value >= kJpegHuffmanAlphabetSize) {
+      continue;
+    }
+    int r = entry.value >> 4;
+    int s = entry.value & 15;
+    int nbits = entry.bits + s;
+    if (s == 0 || nbits > kJpegFastACBits) {
+      continue;
+    }
+    int bits = (key >> (kJpegFastACBits - nbits)) & ((1 << s) - 1);
+    int coeff = bits >= (1 << (s - 1)) ? bits : bits - (1 << s) + 1;
+    if (coeff < -128 || coeff > 127) {
+      continue;
+    }
+    fast_ac[key] = static_cast<int16_t>(coeff * 256 + (r << 4) + nbits);
   }
 }
 
-// Compare the root nodes, least popular first; indices are in decreasing order
-// before sorting is applied.
-static JXL_INLINE bool Compare(const HuffmanTree& v0, const HuffmanTree& v1) {
-  return v0.total_count != v1.total_count
-             ? v0.total_count < v1.total_count
-             : v0.index_right_or_value > v1.index_right_or_value;
-}
+namespace {
 
-// This function will create a Huffman tree.
-//
-// The catch here is that the tree cannot be arbitrarily deep.
-// Brotli specifies a maximum depth of 15 bits for "code trees"
-// and 7 bits for "code length code trees."
-//
-// count_limit is the value that is to be faked as the minimum value
-// and this minimum value is raised until the tree matches the
-// maximum length requirement.
-//
-// This algorithm is not of excellent performance for very long data blocks,
-// especially when population counts are longer than 2**tree_limit, but
-// we are not planning to use this with extremely long blocks.
-//
-// See http://en.wikipedia.org/wiki/Huffman_coding
-void CreateHuffmanTree(const uint32_t* data, const size_t length,
-                       const int tree_limit, uint8_t* depth) {
-  // For block sizes below 64 kB, we never need to do a second iteration
-  // of this loop. Probably all of our block sizes will be smaller than
-  // that, so this loop is mostly of academic interest. If we actually
-  // would need this, we would be better off with the Katajainen algorithm.
-  for (uint32_t count_limit = 1;; count_limit *= 2) {
-    std::vector<HuffmanTree> tree;
-    tree.reserve(2 * length + 1);
+constexpr size_t kMaxHuffmanSymbols = kJpegHuffmanAlphabetSize + 1;
 
-    for (size_t i = length; i != 0;) {
-      --i;
-      if (data[i]) {
-        const uint32_t count = std::max(data[i], count_limit - 1);
-        tree.emplace_back(count, -1, static_cast<int16_t>(i));
-      }
+// Computes the code lengths of an optimal prefix code for the n >= 2 weights
+// in a[], which must be in increasing order, in place with the algorithm of
+// Moffat and Katajainen. The code lengths are those of the tree that is built
+// by merging the two least popular nodes, preferring leaves over internal
+// nodes of the same weight; they are in decreasing order.
+void ComputeCodeLengths(uint64_t* a, size_t n) {
+  // First pass, left to right: a[0..next) holds the weights of the internal
+  // nodes that are not yet merged from root on, and the parent indexes of the
+  // merged ones before root.
+  a[0] += a[1];
+  size_t root = 0;
+  size_t leaf = 2;
+  for (size_t next = 1; next + 1 < n; ++next) {
+    if (leaf >= n || a[root] < a[leaf]) {
+      a[next] = a[root];
+      a[root++] = next;
+    } else {
+      a[next] = a[leaf++];
     }
-
-    const size_t n = tree.size();
-    if (n == 1) {
-      // Fake value; will be fixed on upper level.
-      depth[tree[0].index_right_or_value] = 1;
-      break;
+    if (leaf >= n || (root < next && a[root] < a[leaf])) {
+      a[next] += a[root];
+      a[root++] = next;
+    } else {
+      a[next] += a[leaf++];
     }
+  }
+  // Second pass, right to left: depths of the internal nodes.
+  a[n - 2] = 0;
+  for (size_t next = n - 2; next-- > 0;) {
+    a[next] = a[a[next]] + 1;
+  }
+  // Third pass, right to left: depths of the leaves.
+  size_t avail = 1;
+  size_t used = 0;
+  uint64_t depth = 0;
+  ptrdiff_t internal = n - 2;
+  size_t next = n;
+  while (avail > 0) {
+    while (internal >= 0 && a[internal] == depth) {
+      ++used;
+      --internal;
+    }
+    while (avail > used) {
+      a[--next] = depth;
+      --avail;
+    }
+    avail = 2 * used;
+    ++depth;
+    used = 0;
+  }
+}
 
-    std::sort(tree.begin(), tree.end(), Compare);
-
-    // The nodes are:
-    // [0, n): the sorted leaf nodes that we start with.
-    // [n]: we add a sentinel here.
-    // [n + 1, 2n): new parent nodes are added here, starting from
-    //              (n+1). These are naturally in ascending order.
-    // [2n]: we add a sentinel at the end as well.
-    // There will be (2n+1) elements at the end.
-    const HuffmanTree sentinel(std::numeric_limits<uint32_t>::max(), -1, -1);
-    tree.push_back(sentinel);
-    tree.push_back(sentinel);
-
-    size_t i = 0;      // Points to the next leaf node.
-    size_t j = n + 1;  // Points to the next non-leaf node.
-    for (size_t k = n - 1; k != 0; --k) {
-      size_t left;
-      size_t right;
-      if (tree[i].total_count <= tree[j].total_count) {
-        left = i;
-        ++i;
-      } else {
-        left = j;
-        ++j;
-      }
-      if (tree[i].total_count <= tree[j].total_count) {
-        right = i;
-        ++i;
+// Computes the code lengths of an optimal prefix code for the n >= 2 weights
+// in w[], which must be in increasing order, subject to the code lengths
+// being at most limit, with the package-merge algorithm. Requires
+// n <= 2^limit.
+void ComputeLimitedCodeLengths(const uint64_t* w, size_t n, int limit,
+                               uint8_t* lengths) {
+  // The merged list of each level is kept only as the leaf/package flags of
+  // its items, which is enough to find the selected leaves in the end.
+  bool is_leaf[kJpegHuffmanMaxBitLength][2 * kMaxHuffmanSymbols];
+  size_t list_size[kJpegHuffmanMaxBitLength];
+  uint64_t prev[2 * kMaxHuffmanSymbols];
+  uint64_t cur[2 * kMaxHuffmanSymbols];
+  for (size_t i = 0; i < n; ++i) {
+    prev[i] = w[i];
+    is_leaf[limit - 1][i] = true;
+  }
+  list_size[limit - 1] = n;
+  for (int level = limit - 2; level >= 0; --level) {
+    const size_t num_packages = list_size[level + 1] / 2;
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+    while (i < n || j < num_packages) {
+      const bool take_leaf =
+          j >= num_packages ||
+          (i < n && w[i] <= prev[2 * j] + prev[2 * j + 1]);
+      is_leaf[level][k] = take_leaf;
+      if (take_leaf) {
+        cur[k++] = w[i++];
       } else {
-        right = j;
+        cur[k++] = prev[2 * j] + prev[2 * j + 1];
         ++j;
       }
+    }
+    list_size[level] = k;
+    memcpy(prev, cur, k * sizeof(cur[0]));
+  }
+  // The 2n - 2 least items of the top level determine the code: each leaf
+  // item selected at a level adds one bit to the code length of its symbol,
+  // and each selected package selects two items of the next level.
+  memset(lengths, 0, n);
+  size_t num_selected = 2 * n - 2;
+  for (int level = 0; level < limit && num_selected > 0; ++level) {
+    size_t num_leaves = 0;
+    for (size_t k = 0; k < num_selected; ++k) {
+      num_leaves += is_leaf[level][k] ? 1 : 0;
+    }
+    for (size_t i = 0; i < num_leaves; ++i) {
+      ++lengths[i];
+    }
+    num_selected = 2 * (num_selected - num_leaves);
+  }
+}
 
-      // The sentinel node becomes the parent node.
-      size_t j_end = tree.size() - 1;
-      tree[j_end].total_count =
-          tree[left].total_count + tree[right].total_count;
-      tree[j_end].index_left = static_cast<int16_t>(left);
-      tree[j_end].index_right_or_value = static_cast<int16_t>(right);
+}  // namespace
 
-      // Add back the last sentinel node.
-      tree.push_back(sentinel);
+// This function will create a Huffman tree.
+//
+// The catch here is that the tree cannot be arbitrarily deep. The optimal
+// code lengths are computed in place without building the tree, and only if
+// they exceed tree_limit, which is rare for 16-bit JPEG codes, the optimal
+// length-limited code lengths are computed with the package-merge algorithm.
+// Neither of them allocates memory.
+//
+// See http://en.wikipedia.org/wiki/Huffman_coding
+void CreateHuffmanTree(const uint32_t* data, const size_t length,
+                       const int tree_limit, uint8_t* depth) {
+  JXL_DASSERT(length <= kMaxHuffmanSymbols);
+  JXL_DASSERT(tree_limit <= static_cast<int>(kJpegHuffmanMaxBitLength));
+  // The sort keys of the symbols with nonzero counts order them by count, and
+  // by decreasing symbol index for equal counts.
+  uint64_t keys[kMaxHuffmanSymbols];
+  size_t n = 0;
+  for (size_t i = 0; i < length; ++i) {
+    if (data[i]) {
+      keys[n++] = (static_cast<uint64_t>(data[i]) << 16) | (0xFFFF - i);
     }
-    JXL_DASSERT(tree.size() == 2 * n + 1);
-    SetDepth(tree[2 * n - 1], tree.data(), depth, 0);
-
-    // We need to pack the Huffman tree in tree_limit bits.
-    // If this was not successful, add fake entities to the lowest values
-    // and retry.
-    if (*std::max_element(&depth[0], &depth[length]) <= tree_limit) {
-      break;
+  }
+  if (n == 0) return;
+  if (n == 1) {
+    // Fake value; will be fixed on upper level.
+    depth[0xFFFF - (keys[0] & 0xFFFF)] = 1;
+    return;
+  }
+  std::sort(keys, keys + n);
+  uint64_t weights[kMaxHuffmanSymbols];
+  for (size_t k = 0; k < n; ++k) {
+    weights[k] = keys[k] >> 16;
+  }
+  uint64_t lengths[kMaxHuffmanSymbols];
+  memcpy(lengths, weights, n * sizeof(weights[0]));
+  ComputeCodeLengths(lengths, n);
+  if (lengths[0] <= static_cast<uint64_t>(tree_limit)) {
+    for (size_t k = 0; k < n; ++k) {
+      depth[0xFFFF - (keys[k] & 0xFFFF)] = lengths[k];
     }
+    return;
+  }
+  uint8_t limited_lengths[kMaxHuffmanSymbols];
+  ComputeLimitedCodeLengths(weights, n, tree_limit, limited_lengths);
+  for (size_t k = 0; k < n; ++k) {
+    depth[0xFFFF - (keys[k] & 0xFFFF)] = limited_lengths[k];
   }
 }
 
@@ -37,10 +37,24 @@ struct HuffmanTableEntry {
 void BuildJpegHuffmanTable(const uint32_t* count, const uint32_t* symbols,
                            HuffmanTableEntry* lut);
 
+// Number of bits that are looked up at once in the fast AC table.
+constexpr int kJpegFastACBits = 9;
+constexpr int kJpegFastACLutSize = 1 << kJpegFastACBits;
+
+// Builds a lookup table from the next kJpegFastACBits bits of the bit stream
+// for AC coefficient decoding. If the Huffman code of an AC symbol with a
+// non-zero coefficient and the extra bits of the coefficient together fit in
+// these bits, and the coefficient is in [-128, 127], then the entry is
+// (coeff << 8) | (run << 4) | (total number of bits), otherwise it is zero and
+// the symbol has to be decoded with the lut built by BuildJpegHuffmanTable().
+void BuildJpegFastACTable(const HuffmanTableEntry* lut, int16_t* fast_ac);
+
 // This function will create a Huffman tree.
 //
-// The (data,length) contains the population counts.
-// The tree_limit is the maximum bit depth of the Huffman codes.
+// The (data,length) contains the population counts, length must be at most
+// kJpegHuffmanAlphabetSize + 1.
+// The tree_limit is the maximum bit depth of the Huffman codes, at most
+// kJpegHuffmanMaxBitLength.
 //
 // The depth contains the tree, i.e., how many bits are used for
 // the symbol.
@@ -9,6 +9,7 @@
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 
 #include "lib/base/compiler_specific.h"
 #include "lib/base/status.h"
@@ -29,10 +30,13 @@ namespace HWY_NAMESPACE {
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Abs;
 using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::DemoteTo;
 using hwy::HWY_NAMESPACE::Gt;
 using hwy::HWY_NAMESPACE::IfThenElseZero;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::MulFixedPoint15;
+using hwy::HWY_NAMESPACE::NearestInt;
 using hwy::HWY_NAMESPACE::NegMulAdd;
 using hwy::HWY_NAMESPACE::Rebind;
 using hwy::HWY_NAMESPACE::Sub;
@@ -190,18 +194,257 @@ void ComputeScaledIDCT(float* JXL_RESTRICT block0, float* JXL_RESTRICT block1,
   IDCT1D<8>(block1, output, output_stride);
 }
 
+// Returns the size of the top-left square of the block outside of which all
+// coefficients are zero, which is 1, 2, 4 or 8.
+size_t NonzeroExtent(const int16_t* JXL_RESTRICT qblock) {
+  // Each word holds two horizontally adjacent coefficients, the words of
+  // block row y are words[4 * y] .. words[4 * y + 3].
+  uint32_t words[DCTSIZE2 / 2];
+  memcpy(words, qblock, sizeof(words));
+  uint32_t outside4 = 0;
+  for (size_t y = 0; y < 4; ++y) {
+    outside4 |= words[4 * y + 2] | words[4 * y + 3];
+  }
+  for (size_t k = 16; k < DCTSIZE2 / 2; ++k) {
+    outside4 |= words[k];
+  }
+  if (outside4 != 0) {
+    return 8;
+  }
+  if ((words[1] | words[5] | words[8] | words[9] | words[12] | words[13]) !=
+      0) {
+    return 4;
+  }
+  return (qblock[1] | qblock[8] | qblock[9]) != 0 ? 2 : 1;
+}
+
+// Scalar version of DequantBlock() for one coefficient.
+float DequantCoeff(int16_t qval, float mul, float bias) {
+  if (qval == 0) {
+    return 0.0f;
+  }
+  const float quant = qval;
+  return (quant - (qval < 0 ? -bias : bias)) * mul;
+}
+
+// The first four basis functions of IDCT1D<8>.
+constexpr float kIDCTBasis[4][8] = {
+    {1.000000000000, 1.000000000000, 1.000000000000, 1.000000000000,
+     1.000000000000, 1.000000000000, 1.000000000000, 1.000000000000},
+    {1.387039845322, 1.175875602419, 0.785694958387, 0.275899379283,
+     -0.275899379283, -0.785694958387, -1.175875602419, -1.387039845322},
+    {1.306562964876, 0.541196100146, -0.541196100146, -1.306562964876,
+     -1.306562964876, -0.541196100146, 0.541196100146, 1.306562964876},
+    {1.175875602419, -0.275899379283, -1.387039845322, -0.785694958387,
+     0.785694958387, 1.387039845322, 0.275899379283, -1.175875602419},
+};
+
+// Inverse transform of a block whose nonzero coefficients are all in the
+// top-left N x N square, computed as the sum of the separable basis functions
+// of these coefficients.
+template <size_t N>
+void InverseTransformLowFreqBlock(const int16_t* JXL_RESTRICT qblock,
+                                  const float* JXL_RESTRICT dequant,
+                                  const float* JXL_RESTRICT biases,
+                                  float* JXL_RESTRICT scratch_space,
+                                  float* JXL_RESTRICT output,
+                                  size_t output_stride) {
+  float coeffs[N * N];
+  for (size_t v = 0; v < N; ++v) {
+    for (size_t u = 0; u < N; ++u) {
+      const size_t k = v * DCTSIZE + u;
+      coeffs[v * N + u] = DequantCoeff(qblock[k], dequant[k], biases[k]);
+    }
+  }
+  // Horizontal transform of the first N rows.
+  float* JXL_RESTRICT rows = scratch_space;
+  for (size_t v = 0; v < N; ++v) {
+    for (size_t x = 0; x < DCTSIZE; x += Lanes(d8)) {
+      auto out = Mul(Set(d8, coeffs[v * N]), LoadU(d8, &kIDCTBasis[0][x]));
+      for (size_t u = 1; u < N; ++u) {
+        out = MulAdd(Set(d8, coeffs[v * N + u]), LoadU(d8, &kIDCTBasis[u][x]),
+                     out);
+      }
+      Store(out, d8, rows + v * DCTSIZE + x);
+    }
+  }
+  // Vertical transform.
+  for (size_t y = 0; y < DCTSIZE; ++y) {
+    for (size_t x = 0; x < DCTSIZE; x += Lanes(d8)) {
+      auto out = Mul(Set(d8, kIDCTBasis[0][y]), Load(d8, rows + x));
+      for (size_t v = 1; v < N; ++v) {
+        out = MulAdd(Set(d8, kIDCTBasis[v][y]),
+                     Load(d8, rows + v * DCTSIZE + x), out);
+      }
+      StoreU(out, d8, output + y * output_stride + x);
+    }
+  }
+}
+
 void InverseTransformBlock8x8(const int16_t* JXL_RESTRICT qblock,
                               const float* JXL_RESTRICT dequant,
                               const float* JXL_RESTRICT biases,
                               float* JXL_RESTRICT scratch_space,
                               float* JXL_RESTRICT output, size_t output_stride,
                               size_t dctsize) {
+  // Most blocks of typical images have only a few low frequency coefficients,
+  // these are transformed with fewer operations.
+  const size_t extent = NonzeroExtent(qblock);
+  if (extent == 1) {
+    // The IDCT of a DC-only block is constant, and IDCT1D<8> keeps the DC
+    // value exactly.
+    const auto dc = Set(d8, DequantCoeff(qblock[0], dequant[0], biases[0]));
+    for (size_t y = 0; y < DCTSIZE; ++y) {
+      for (size_t x = 0; x < DCTSIZE; x += Lanes(d8)) {
+        StoreU(dc, d8, output + y * output_stride + x);
+      }
+    }
+    return;
+  }
+  if (extent == 2) {
+    InverseTransformLowFreqBlock<2>(qblock, dequant, biases, scratch_space,
+                                    output, output_stride);
+    return;
+  }
+  if (extent == 4) {
+    InverseTransformLowFreqBlock<4>(qblock, dequant, biases, scratch_space,
+                                    output, output_stride);
+    return;
+  }
   float* JXL_RESTRICT block0 = scratch_space;
   float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
   DequantBlock(qblock, dequant, biases, block0);
   ComputeScaledIDCT(block0, block1, output, output_stride);
 }
 
+// Fixed point version of IDCT1DImpl, used when dct_method is JDCT_IFAST. The
+// dequantized coefficients are rounded to int16 in units of
+// 1 / kFixedPointIDCTScale of the output, which keeps all intermediate values
+// of 8-bit images below 10000.
+constexpr float kFixedPointIDCTScale = 2 * 8 * 255;
+
+// Multiplies v by the positive constant mul, using integer multiplication for
+// the integral part and 1.15 fixed point multiplication for the fractional
+// part.
+template <class V>
+JXL_INLINE V MulFixedPoint(V v, float mul) {
+  const HWY_CAPPED(int16_t, 8) d16;
+  const int16_t whole = static_cast<int16_t>(mul);
+  const int16_t frac = static_cast<int16_t>((mul - whole) * 32768.0f + 0.5f);
+  V r = MulFixedPoint15(v, Set(d16, frac));
+  return whole == 0 ? r : Add(r, Mul(v, Set(d16, whole)));
+}
+
+template <size_t N>
+struct IDCT1DFixedPointImpl;
+
+template <>
+struct IDCT1DFixedPointImpl<1> {
+  JXL_INLINE void operator()(const int16_t* from, size_t from_stride,
+                             int16_t* to, size_t to_stride) {
+    const HWY_CAPPED(int16_t, 8) d16;
+    StoreU(LoadU(d16, from), d16, to);
+  }
+};
+
+template <>
+struct IDCT1DFixedPointImpl<2> {
+  JXL_INLINE void operator()(const int16_t* from, size_t from_stride,
+                             int16_t* to, size_t to_stride) {
+    const HWY_CAPPED(int16_t, 8) d16;
+    auto in1 = LoadU(d16, from);
+    auto in2 = LoadU(d16, from + from_stride);
+    StoreU(Add(in1, in2), d16, to);
+    StoreU(Sub(in1, in2), d16, to + to_stride);
+  }
+};
+
+template <size_t N>
+struct IDCT1DFixedPointImpl {
+  void operator()(const int16_t* from, size_t from_stride, int16_t* to,
+                  size_t to_stride) {
+    const HWY_CAPPED(int16_t, 8) d16;
+    HWY_ALIGN int16_t tmp[64];
+    for (size_t i = 0; i < N / 2; i++) {
+      Store(LoadU(d16, from + 2 * i * from_stride), d16, tmp + i * 8);
+      Store(LoadU(d16, from + (2 * i + 1) * from_stride), d16,
+            tmp + (N / 2 + i) * 8);
+    }
+    IDCT1DFixedPointImpl<N / 2>()(tmp, 8, tmp, 8);
+    int16_t* JXL_RESTRICT odd = tmp + N * 4;
+    for (size_t i = N / 2 - 1; i > 0; i--) {
+      Store(Add(Load(d16, odd + i * 8), Load(d16, odd + (i - 1) * 8)), d16,
+            odd + i * 8);
+    }
+    constexpr float kSqrt2 = 1.41421356237f;
+    Store(MulFixedPoint(Load(d16, odd), kSqrt2), d16, odd);
+    IDCT1DFixedPointImpl<N / 2>()(odd, 8, odd, 8);
+    for (size_t i = 0; i < N / 2; i++) {
+      auto in1 = Load(d16, tmp + i * 8);
+      auto in2 = MulFixedPoint(Load(d16, odd + i * 8),
+                               WcMultipliers<N>::kMultipliers[i]);
+      StoreU(Add(in1, in2), d16, to + i * to_stride);
+      StoreU(Sub(in1, in2), d16, to + (N - i - 1) * to_stride);
+    }
+  }
+};
+
+void IDCT1DFixedPoint(const int16_t* JXL_RESTRICT input,
+                      int16_t* JXL_RESTRICT output) {
+  const HWY_CAPPED(int16_t, 8) d16;
+  for (size_t i = 0; i < 8; i += Lanes(d16)) {
+    IDCT1DFixedPointImpl<8>()(input + i, 8, output + i, 8);
+  }
+}
+
+void InverseTransformBlockFixedPoint(const int16_t* JXL_RESTRICT qblock,
+                                     const float* JXL_RESTRICT dequant,
+                                     float* JXL_RESTRICT scratch_space,
+                                     float* JXL_RESTRICT output,
+                                     size_t output_stride) {
+  if (NonzeroExtent(qblock) == 1) {
+    const auto dc = Set(d8, qblock[0] * dequant[0]);
+    for (size_t y = 0; y < DCTSIZE; ++y) {
+      for (size_t x = 0; x < DCTSIZE; x += Lanes(d8)) {
+        StoreU(dc, d8, output + y * output_stride + x);
+      }
+    }
+    return;
+  }
+  const Rebind<int32_t, D8> di32;
+  const Rebind<int16_t, D8> di16;
+  HWY_ALIGN int16_t in[DCTSIZE2];
+  HWY_ALIGN int16_t out[DCTSIZE2];
+  const auto scale = Set(d8, kFixedPointIDCTScale);
+  for (size_t k = 0; k < DCTSIZE2; k += Lanes(d8)) {
+    const auto quant = ConvertTo(d8, PromoteTo(di32, LoadU(di16, qblock + k)));
+    const auto ival = NearestInt(Mul(Mul(quant, Load(d8, dequant + k)), scale));
+    Store(DemoteTo(di16, ival), di16, in + k);
+  }
+  IDCT1DFixedPoint(in, out);
+  for (size_t y = 0; y < 8; y++) {
+    for (size_t x = 0; x < 8; x++) {
+      in[x * 8 + y] = out[y * 8 + x];
+    }
+  }
+  IDCT1DFixedPoint(in, out);
+  // The output of the second pass is transposed.
+  float* JXL_RESTRICT block0 = scratch_space;
+  float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
+  const auto inv_scale = Set(d8, 1.0f / kFixedPointIDCTScale);
+  for (size_t k = 0; k < DCTSIZE2; k += Lanes(d8)) {
+    const auto ival = PromoteTo(di32, Load(di16, out + k));
+    Store(Mul(ConvertTo(d8, ival), inv_scale), d8, block0 + k);
+  }
+  Transpose8x8Block(block0, block1);
+  for (size_t y = 0; y < DCTSIZE; ++y) {
+    for (size_t x = 0; x < DCTSIZE; x += Lanes(d8)) {
+      StoreU(Load(d8, block1 + y * DCTSIZE + x), d8,
+             output + y * output_stride + x);
+    }
+  }
+}
+
 // Computes the N-point IDCT of in[], and stores the result in out[]. The in[]
 // array is at most 8 values long, values in[8:N-1] are assumed to be 0.
 void Compute1dIDCT(const float* in, float* out, size_t N) {
@@ -675,6 +918,52 @@ void InverseTransformBlockGeneric(const int16_t* JXL_RESTRICT qblock,
   }
 }
 
+// Inverse transforms the num_blocks consecutive blocks of a block row, the
+// output of the i-th block starts at output + i * dctsize.
+void InverseTransformRow8x8(const int16_t* JXL_RESTRICT qblocks,
+                            size_t num_blocks,
+                            const float* JXL_RESTRICT dequant,
+                            const float* JXL_RESTRICT biases,
+                            float* JXL_RESTRICT scratch_space,
+                            float* JXL_RESTRICT output, size_t output_stride,
+                            size_t dctsize) {
+  for (size_t i = 0; i < num_blocks; ++i) {
+    InverseTransformBlock8x8(qblocks + i * DCTSIZE2, dequant, biases,
+                             scratch_space, output + i * DCTSIZE,
+                             output_stride, DCTSIZE);
+  }
+}
+
+// Same as InverseTransformRow8x8(), but with the fixed point IDCT and without
+// the dequantization biases.
+void InverseTransformRowFixedPoint(const int16_t* JXL_RESTRICT qblocks,
+                                   size_t num_blocks,
+                                   const float* JXL_RESTRICT dequant,
+                                   const float* JXL_RESTRICT biases,
+                                   float* JXL_RESTRICT scratch_space,
+                                   float* JXL_RESTRICT output,
+                                   size_t output_stride, size_t dctsize) {
+  for (size_t i = 0; i < num_blocks; ++i) {
+    InverseTransformBlockFixedPoint(qblocks + i * DCTSIZE2, dequant,
+                                    scratch_space, output + i * DCTSIZE,
+                                    output_stride);
+  }
+}
+
+void InverseTransformRowGeneric(const int16_t* JXL_RESTRICT qblocks,
+                                size_t num_blocks,
+                                const float* JXL_RESTRICT dequant,
+                                const float* JXL_RESTRICT biases,
+                                float* JXL_RESTRICT scratch_space,
+                                float* JXL_RESTRICT output,
+                                size_t output_stride, size_t dctsize) {
+  for (size_t i = 0; i < num_blocks; ++i) {
+    InverseTransformBlockGeneric(qblocks + i * DCTSIZE2, dequant, biases,
+                                 scratch_space, output + i * dctsize,
+                                 output_stride, dctsize);
+  }
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jpegli
@@ -683,8 +972,9 @@ HWY_AFTER_NAMESPACE();
 #if HWY_ONCE
 namespace jpegli {
 
-HWY_EXPORT(InverseTransformBlock8x8);
-HWY_EXPORT(InverseTransformBlockGeneric);
+HWY_EXPORT(InverseTransformRow8x8);
+HWY_EXPORT(InverseTransformRowFixedPoint);
+HWY_EXPORT(InverseTransformRowGeneric);
 
 jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
@@ -693,11 +983,14 @@ jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo) {
     if (dct_size < 1 || dct_size > 16) {
       return JXL_FAILURE("Compute1dIDCT does not support N=%d", dct_size);
     }
-    if (dct_size == DCTSIZE) {
-      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock8x8);
+    if (dct_size == DCTSIZE && cinfo->dct_method == JDCT_IFAST) {
+      m->inverse_transform[c] =
+          HWY_DYNAMIC_DISPATCH(InverseTransformRowFixedPoint);
+    } else if (dct_size == DCTSIZE) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformRow8x8);
     } else {
       m->inverse_transform[c] =
-          HWY_DYNAMIC_DISPATCH(InverseTransformBlockGeneric);
+          HWY_DYNAMIC_DISPATCH(InverseTransformRowGeneric);
     }
   }
   return true;
@@ -20,6 +20,9 @@
 
 #include "lib/base/byte_order.h"
 #include "lib/base/compiler_specific.h"
+#include "lib/base/matrix_ops.h"
+#include "lib/cms/tone_mapping-inl.h"
+#include "lib/cms/transfer_functions-inl.h"
 #include "lib/jpegli/encode_internal.h"
 #include "lib/jpegli/error.h"
 
@@ -27,8 +30,17 @@ HWY_BEFORE_NAMESPACE();
 namespace jpegli {
 namespace HWY_NAMESPACE {
 
+using hwy::HWY_NAMESPACE::And;
+using hwy::HWY_NAMESPACE::BitCast;
+using hwy::HWY_NAMESPACE::Max;
+using hwy::HWY_NAMESPACE::Min;
 using hwy::HWY_NAMESPACE::Mul;
+using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::Or;
 using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::Sub;
 using hwy::HWY_NAMESPACE::Vec;
 
 using D = HWY_FULL(float);
@@ -44,6 +56,19 @@ constexpr DU16 du16;
 static constexpr double kMul16 = 1.0 / 257.0;
 static constexpr double kMulFloat = 255.0;
 
+// Reverses the byte order of the 16-bit lanes.
+HWY_INLINE Vec<DU16> ByteSwap16(Vec<DU16> v) {
+  return Or(ShiftLeft<8>(v), ShiftRight<8>(v));
+}
+
+// Reverses the byte order of the 32-bit lanes.
+HWY_INLINE Vec<DU> ByteSwap32(Vec<DU> v) {
+  const auto mask = Set(du, 0x00FF00FFu);
+  // Swap the bytes in each 16-bit half, then the two halves.
+  v = Or(ShiftLeft<8>(And(v, mask)), And(ShiftRight<8>(v), mask));
+  return Or(ShiftLeft<16>(v), ShiftRight<16>(v));
+}
+
 template <size_t C>
 void ReadUint8Row(const uint8_t* row_in, size_t x0, size_t len,
                   float* row_out[kMaxComponents]) {
@@ -219,22 +244,86 @@ void ReadUint16RowInterleaved4(const uint8_t* row_in, size_t len,
 
 void ReadUint16RowSingleSwap(const uint8_t* row_in, size_t len,
                              float* row_out[kMaxComponents]) {
-  ReadUint16Row<1, true>(row_in, 0, len, row_out);
+  const size_t N = Lanes(d);
+  const size_t simd_len = len & (~(N - 1));
+  const auto mul = Set(d, kMul16);
+  const uint16_t* JXL_RESTRICT const row =
+      reinterpret_cast<const uint16_t*>(row_in);
+  float* JXL_RESTRICT const row0 = row_out[0];
+  for (size_t x = 0; x < simd_len; x += N) {
+    const auto in = ByteSwap16(LoadU(du16, row + x));
+    Store(Mul(mul, ConvertTo(d, PromoteTo(du, in))), d, row0 + x);
+  }
+  ReadUint16Row<1, true>(row_in, simd_len, len, row_out);
 }
 
 void ReadUint16RowInterleaved2Swap(const uint8_t* row_in, size_t len,
                                    float* row_out[kMaxComponents]) {
-  ReadUint16Row<2, true>(row_in, 0, len, row_out);
+  const size_t N = Lanes(d);
+  const size_t simd_len = len & (~(N - 1));
+  const auto mul = Set(d, kMul16);
+  const uint16_t* JXL_RESTRICT const row =
+      reinterpret_cast<const uint16_t*>(row_in);
+  float* JXL_RESTRICT const row0 = row_out[0];
+  float* JXL_RESTRICT const row1 = row_out[1];
+  Vec<DU16> out0, out1;  // NOLINT
+  for (size_t x = 0; x < simd_len; x += N) {
+    LoadInterleaved2(du16, row + 2 * x, out0, out1);
+    Store(Mul(mul, ConvertTo(d, PromoteTo(du, ByteSwap16(out0)))), d,
+          row0 + x);
+    Store(Mul(mul, ConvertTo(d, PromoteTo(du, ByteSwap16(out1)))), d,
+          row1 + x);
+  }
+  ReadUint16Row<2, true>(row_in, simd_len, len, row_out);
 }
 
 void ReadUint16RowInterleaved3Swap(const uint8_t* row_in, size_t len,
                                    float* row_out[kMaxComponents]) {
-  ReadUint16Row<3, true>(row_in, 0, len, row_out);
+  const size_t N = Lanes(d);
+  const size_t simd_len = len & (~(N - 1));
+  const auto mul = Set(d, kMul16);
+  const uint16_t* JXL_RESTRICT const row =
+      reinterpret_cast<const uint16_t*>(row_in);
+  float* JXL_RESTRICT const row0 = row_out[0];
+  float* JXL_RESTRICT const row1 = row_out[1];
+  float* JXL_RESTRICT const row2 = row_out[2];
+  Vec<DU16> out0, out1, out2;  // NOLINT
+  for (size_t x = 0; x < simd_len; x += N) {
+    LoadInterleaved3(du16, row + 3 * x, out0, out1, out2);
+    Store(Mul(mul, ConvertTo(d, PromoteTo(du, ByteSwap16(out0)))), d,
+          row0 + x);
+    Store(Mul(mul, ConvertTo(d, PromoteTo(du, ByteSwap16(out1)))), d,
+          row1 + x);
+    Store(Mul(mul, ConvertTo(d, PromoteTo(du, ByteSwap16(out2)))), d,
+          row2 + x);
+  }
+  ReadUint16Row<3, true>(row_in, simd_len, len, row_out);
 }
 
 void ReadUint16RowInterleaved4Swap(const uint8_t* row_in, size_t len,
                                    float* row_out[kMaxComponents]) {
-  ReadUint16Row<4, true>(row_in, 0, len, row_out);
+  const size_t N = Lanes(d);
+  const size_t simd_len = len & (~(N - 1));
+  const auto mul = Set(d, kMul16);
+  const uint16_t* JXL_RESTRICT const row =
+      reinterpret_cast<const uint16_t*>(row_in);
+  float* JXL_RESTRICT const row0 = row_out[0];
+  float* JXL_RESTRICT const row1 = row_out[1];
+  float* JXL_RESTRICT const row2 = row_out[2];
+  float* JXL_RESTRICT const row3 = row_out[3];
+  Vec<DU16> out0, out1, out2, out3;  // NOLINT
+  for (size_t x = 0; x < simd_len; x += N) {
+    LoadInterleaved4(du16, row + 4 * x, out0, out1, out2, out3);
+    Store(Mul(mul, ConvertTo(d, PromoteTo(du, ByteSwap16(out0)))), d,
+          row0 + x);
+    Store(Mul(mul, ConvertTo(d, PromoteTo(du, ByteSwap16(out1)))), d,
+          row1 + x);
+    Store(Mul(mul, ConvertTo(d, PromoteTo(du, ByteSwap16(out2)))), d,
+          row2 + x);
+    Store(Mul(mul, ConvertTo(d, PromoteTo(du, ByteSwap16(out3)))), d,
+          row3 + x);
+  }
+  ReadUint16Row<4, true>(row_in, simd_len, len, row_out);
 }
 
 void ReadFloatRowSingle(const uint8_t* row_in, size_t len,
@@ -309,24 +398,164 @@ void ReadFloatRowInterleaved4(const uint8_t* row_in, size_t len,
 
 void ReadFloatRowSingleSwap(const uint8_t* row_in, size_t len,
                             float* row_out[kMaxComponents]) {
-  ReadFloatRow<1, true>(row_in, 0, len, row_out);
+  const size_t N = Lanes(d);
+  const size_t simd_len = len & (~(N - 1));
+  const auto mul = Set(d, kMulFloat);
+  const uint32_t* JXL_RESTRICT const row =
+      reinterpret_cast<const uint32_t*>(row_in);
+  float* JXL_RESTRICT const row0 = row_out[0];
+  for (size_t x = 0; x < simd_len; x += N) {
+    Store(Mul(mul, BitCast(d, ByteSwap32(LoadU(du, row + x)))), d, row0 + x);
+  }
+  ReadFloatRow<1, true>(row_in, simd_len, len, row_out);
 }
 
 void ReadFloatRowInterleaved2Swap(const uint8_t* row_in, size_t len,
                                   float* row_out[kMaxComponents]) {
-  ReadFloatRow<2, true>(row_in, 0, len, row_out);
+  const size_t N = Lanes(d);
+  const size_t simd_len = len & (~(N - 1));
+  const auto mul = Set(d, kMulFloat);
+  const uint32_t* JXL_RESTRICT const row =
+      reinterpret_cast<const uint32_t*>(row_in);
+  float* JXL_RESTRICT const row0 = row_out[0];
+  float* JXL_RESTRICT const row1 = row_out[1];
+  Vec<DU> out0, out1;  // NOLINT
+  for (size_t x = 0; x < simd_len; x += N) {
+    LoadInterleaved2(du, row + 2 * x, out0, out1);
+    Store(Mul(mul, BitCast(d, ByteSwap32(out0))), d, row0 + x);
+    Store(Mul(mul, BitCast(d, ByteSwap32(out1))), d, row1 + x);
+  }
+  ReadFloatRow<2, true>(row_in, simd_len, len, row_out);
 }
 
 void ReadFloatRowInterleaved3Swap(const uint8_t* row_in, size_t len,
                                   float* row_out[kMaxComponents]) {
-  ReadFloatRow<3, true>(row_in, 0, len, row_out);
+  const size_t N = Lanes(d);
+  const size_t simd_len = len & (~(N - 1));
+  const auto mul = Set(d, kMulFloat);
+  const uint32_t* JXL_RESTRICT const row =
+      reinterpret_cast<const uint32_t*>(row_in);
+  float* JXL_RESTRICT const row0 = row_out[0];
+  float* JXL_RESTRICT const row1 = row_out[1];
+  float* JXL_RESTRICT const row2 = row_out[2];
+  Vec<DU> out0, out1, out2;  // NOLINT
+  for (size_t x = 0; x < simd_len; x += N) {
+    LoadInterleaved3(du, row + 3 * x, out0, out1, out2);
+    Store(Mul(mul, BitCast(d, ByteSwap32(out0))), d, row0 + x);
+    Store(Mul(mul, BitCast(d, ByteSwap32(out1))), d, row1 + x);
+    Store(Mul(mul, BitCast(d, ByteSwap32(out2))), d, row2 + x);
+  }
+  ReadFloatRow<3, true>(row_in, simd_len, len, row_out);
 }
 
 void ReadFloatRowInterleaved4Swap(const uint8_t* row_in, size_t len,
                                   float* row_out[kMaxComponents]) {
-  ReadFloatRow<4, true>(row_in, 0, len, row_out);
+  const size_t N = Lanes(d);
+  const size_t simd_len = len & (~(N - 1));
+  const auto mul = Set(d, kMulFloat);
+  const uint32_t* JXL_RESTRICT const row =
+      reinterpret_cast<const uint32_t*>(row_in);
+  float* JXL_RESTRICT const row0 = row_out[0];
+  float* JXL_RESTRICT const row1 = row_out[1];
+  float* JXL_RESTRICT const row2 = row_out[2];
+  float* JXL_RESTRICT const row3 = row_out[3];
+  Vec<DU> out0, out1, out2, out3;  // NOLINT
+  for (size_t x = 0; x < simd_len; x += N) {
+    LoadInterleaved4(du, row + 4 * x, out0, out1, out2, out3);
+    Store(Mul(mul, BitCast(d, ByteSwap32(out0))), d, row0 + x);
+    Store(Mul(mul, BitCast(d, ByteSwap32(out1))), d, row1 + x);
+    Store(Mul(mul, BitCast(d, ByteSwap32(out2))), d, row2 + x);
+    Store(Mul(mul, BitCast(d, ByteSwap32(out3))), d, row3 + x);
+  }
+  ReadFloatRow<4, true>(row_in, simd_len, len, row_out);
 }
 
+// Converts the linear values of a tone mapped row, where 1.0 is the target
+// peak luminance, to sRGB encoded values in the [0, 255] range.
+HWY_INLINE void StoreSRGB(Vec<D> v, float* row) {
+  const jxl::HWY_NAMESPACE::TF_SRGB tf_srgb;
+  const auto linear = Min(Max(v, Zero(d)), Set(d, 1.0f));
+  Store(Mul(tf_srgb.EncodedFromDisplay(d, linear), Set(d, 255.0f)), d, row);
+}
+
+// The rows may be read and written past len, up to a whole vector, since the
+// input buffer rows are padded.
+void ToneMapRowPQ(const JpegliToneMapping& params, float* rows[3],
+                  size_t len) {
+  const jxl::Vector3 luminances = {params.primaries_luminances[0],
+                                   params.primaries_luminances[1],
+                                   params.primaries_luminances[2]};
+  // The display values of tf_pq are relative to the source peak, as expected
+  // by the tone mapper, whose output is relative to the target peak.
+  const jxl::HWY_NAMESPACE::TF_PQ tf_pq(params.source_peak);
+  const jxl::HWY_NAMESPACE::Rec2408ToneMapper<D> tone_mapper(
+      {0.0f, params.source_peak}, {0.0f, params.target_peak}, luminances);
+  const auto inv_mul = Set(d, 1.0f / 255.0f);
+  for (size_t x = 0; x < len; x += Lanes(d)) {
+    auto r = tf_pq.DisplayFromEncoded(d, Mul(Load(d, rows[0] + x), inv_mul));
+    auto g = tf_pq.DisplayFromEncoded(d, Mul(Load(d, rows[1] + x), inv_mul));
+    auto b = tf_pq.DisplayFromEncoded(d, Mul(Load(d, rows[2] + x), inv_mul));
+    tone_mapper.ToneMap(&r, &g, &b);
+    jxl::HWY_NAMESPACE::GamutMap(&r, &g, &b, luminances);
+    StoreSRGB(r, rows[0] + x);
+    StoreSRGB(g, rows[1] + x);
+    StoreSRGB(b, rows[2] + x);
+  }
+}
+
+void ToneMapRowHLG(const JpegliToneMapping& params, float* rows[3],
+                   size_t len) {
+  const jxl::Vector3 luminances = {params.primaries_luminances[0],
+                                   params.primaries_luminances[1],
+                                   params.primaries_luminances[2]};
+  // The HLG signal is scene referred, the OOTF of a display with the target
+  // peak luminance gives display values relative to the target peak.
+  const jxl::HWY_NAMESPACE::TF_HLG tf_hlg;
+  const auto ootf = jxl::HWY_NAMESPACE::HlgOOTF::FromSceneLight(
+      params.target_peak, luminances);
+  const bool gamut_map = ootf.WarrantsGamutMapping();
+  const auto inv_mul = Set(d, 1.0f / 255.0f);
+  for (size_t x = 0; x < len; x += Lanes(d)) {
+    auto r = tf_hlg.DisplayFromEncoded(d, Mul(Load(d, rows[0] + x), inv_mul));
+    auto g = tf_hlg.DisplayFromEncoded(d, Mul(Load(d, rows[1] + x), inv_mul));
+    auto b = tf_hlg.DisplayFromEncoded(d, Mul(Load(d, rows[2] + x), inv_mul));
+    ootf.Apply(&r, &g, &b);
+    if (gamut_map) {
+      jxl::HWY_NAMESPACE::GamutMap(&r, &g, &b, luminances);
+    }
+    StoreSRGB(r, rows[0] + x);
+    StoreSRGB(g, rows[1] + x);
+    StoreSRGB(b, rows[2] + x);
+  }
+}
+
+// Composites the rows onto the background with the alpha row, all in the
+// [0, 255] range, as background + alpha * (row - background). The rows may be
+// read and written past len, up to a whole vector, since the input buffer rows
+// are padded.
+void BlendAlphaRow(const float background[3], const float* alpha,
+                   float* rows[3], size_t len) {
+  const auto inv_mul = Set(d, 1.0f / 255.0f);
+  const auto zero = Zero(d);
+  const auto one = Set(d, 1.0f);
+  const auto bg0 = Set(d, background[0] * 255.0f);
+  const auto bg1 = Set(d, background[1] * 255.0f);
+  const auto bg2 = Set(d, background[2] * 255.0f);
+  for (size_t x = 0; x < len; x += Lanes(d)) {
+    const auto a = Min(Max(Mul(Load(d, alpha + x), inv_mul), zero), one);
+    const auto v0 = Load(d, rows[0] + x);
+    const auto v1 = Load(d, rows[1] + x);
+    const auto v2 = Load(d, rows[2] + x);
+    Store(MulAdd(a, Sub(v0, bg0), bg0), d, rows[0] + x);
+    Store(MulAdd(a, Sub(v1, bg1), bg1), d, rows[1] + x);
+    Store(MulAdd(a, Sub(v2, bg2), bg2), d, rows[2] + x);
+  }
+}
+
+// Returns the number of pixels that the input methods convert with one
+// vector; a row whose length is a multiple of it has no scalar tail.
+size_t InputVectorLanes() { return Lanes(d); }
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jpegli
@@ -355,67 +584,166 @@ HWY_EXPORT(ReadFloatRowSingleSwap);
 HWY_EXPORT(ReadFloatRowInterleaved2Swap);
 HWY_EXPORT(ReadFloatRowInterleaved3Swap);
 HWY_EXPORT(ReadFloatRowInterleaved4Swap);
+HWY_EXPORT(ToneMapRowPQ);
+HWY_EXPORT(ToneMapRowHLG);
+HWY_EXPORT(BlendAlphaRow);
+HWY_EXPORT(InputVectorLanes);
+
+namespace {
+
+// Sets the indexes of the red, green and blue input channels of an RGB input
+// color space, and returns false for other color spaces.
+bool GetRGBChannels(j_compress_ptr cinfo, int channels[3]) {
+  const auto set = [&](int r, int g, int b) {
+    channels[0] = r;
+    channels[1] = g;
+    channels[2] = b;
+    return true;
+  };
+  switch (cinfo->in_color_space) {
+    case JCS_RGB:
+#ifdef JCS_EXTENSIONS
+    case JCS_EXT_RGB:
+    case JCS_EXT_RGBX:
+#endif
+      return set(0, 1, 2);
+#ifdef JCS_EXTENSIONS
+    case JCS_EXT_BGR:
+    case JCS_EXT_BGRX:
+      return set(2, 1, 0);
+    case JCS_EXT_XRGB:
+      return set(1, 2, 3);
+    case JCS_EXT_XBGR:
+      return set(3, 2, 1);
+#endif
+#ifdef JCS_ALPHA_EXTENSIONS
+    case JCS_EXT_RGBA:
+      return set(0, 1, 2);
+    case JCS_EXT_BGRA:
+      return set(2, 1, 0);
+    case JCS_EXT_ARGB:
+      return set(1, 2, 3);
+    case JCS_EXT_ABGR:
+      return set(3, 2, 1);
+#endif
+    default:
+      return false;
+  }
+}
 
-void ChooseInputMethod(j_compress_ptr cinfo) {
+// Returns the index of the alpha channel of the input color space, or -1 if
+// it has none.
+int GetAlphaChannel(j_compress_ptr cinfo) {
+  switch (cinfo->in_color_space) {
+#ifdef JCS_ALPHA_EXTENSIONS
+    case JCS_EXT_RGBA:
+    case JCS_EXT_BGRA:
+      return 3;
+    case JCS_EXT_ARGB:
+    case JCS_EXT_ABGR:
+      return 0;
+#endif
+    default:
+      return -1;
+  }
+}
+
+}  // namespace
+
+InputMethod GetInputMethod(j_compress_ptr cinfo, int num_channels) {
   jpeg_comp_master* m = cinfo->master;
   bool swap_endianness =
       (m->endianness == JPEGLI_LITTLE_ENDIAN && !IsLittleEndian()) ||
       (m->endianness == JPEGLI_BIG_ENDIAN && IsLittleEndian());
-  m->input_method = nullptr;
   if (m->data_type == JPEGLI_TYPE_UINT8) {
-    if (cinfo->raw_data_in || cinfo->input_components == 1) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadUint8RowSingle);
-    } else if (cinfo->input_components == 2) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadUint8RowInterleaved2);
-    } else if (cinfo->input_components == 3) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadUint8RowInterleaved3);
-    } else if (cinfo->input_components == 4) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadUint8RowInterleaved4);
+    if (num_channels == 1) {
+      return HWY_DYNAMIC_DISPATCH(ReadUint8RowSingle);
+    } else if (num_channels == 2) {
+      return HWY_DYNAMIC_DISPATCH(ReadUint8RowInterleaved2);
+    } else if (num_channels == 3) {
+      return HWY_DYNAMIC_DISPATCH(ReadUint8RowInterleaved3);
+    } else if (num_channels == 4) {
+      return HWY_DYNAMIC_DISPATCH(ReadUint8RowInterleaved4);
     }
   } else if (m->data_type == JPEGLI_TYPE_UINT16 && !swap_endianness) {
-    if (cinfo->raw_data_in || cinfo->input_components == 1) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadUint16RowSingle);
-    } else if (cinfo->input_components == 2) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadUint16RowInterleaved2);
-    } else if (cinfo->input_components == 3) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadUint16RowInterleaved3);
-    } else if (cinfo->input_components == 4) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadUint16RowInterleaved4);
+    if (num_channels == 1) {
+      return HWY_DYNAMIC_DISPATCH(ReadUint16RowSingle);
+    } else if (num_channels == 2) {
+      return HWY_DYNAMIC_DISPATCH(ReadUint16RowInterleaved2);
+    } else if (num_channels == 3) {
+      return HWY_DYNAMIC_DISPATCH(ReadUint16RowInterleaved3);
+    } else if (num_channels == 4) {
+      return HWY_DYNAMIC_DISPATCH(ReadUint16RowInterleaved4);
     }
   } else if (m->data_type == JPEGLI_TYPE_UINT16 && swap_endianness) {
-    if (cinfo->raw_data_in || cinfo->input_components == 1) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadUint16RowSingleSwap);
-    } else if (cinfo->input_components == 2) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadUint16RowInterleaved2Swap);
-    } else if (cinfo->input_components == 3) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadUint16RowInterleaved3Swap);
-    } else if (cinfo->input_components == 4) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadUint16RowInterleaved4Swap);
+    if (num_channels == 1) {
+      return HWY_DYNAMIC_DISPATCH(ReadUint16RowSingleSwap);
+    } else if (num_channels == 2) {
+      return HWY_DYNAMIC_DISPATCH(ReadUint16RowInterleaved2Swap);
+    } else if (num_channels == 3) {
+      return HWY_DYNAMIC_DISPATCH(ReadUint16RowInterleaved3Swap);
+    } else if (num_channels == 4) {
+      return HWY_DYNAMIC_DISPATCH(ReadUint16RowInterleaved4Swap);
     }
   } else if (m->data_type == JPEGLI_TYPE_FLOAT && !swap_endianness) {
-    if (cinfo->raw_data_in || cinfo->input_components == 1) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadFloatRowSingle);
-    } else if (cinfo->input_components == 2) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadFloatRowInterleaved2);
-    } else if (cinfo->input_components == 3) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadFloatRowInterleaved3);
-    } else if (cinfo->input_components == 4) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadFloatRowInterleaved4);
+    if (num_channels == 1) {
+      return HWY_DYNAMIC_DISPATCH(ReadFloatRowSingle);
+    } else if (num_channels == 2) {
+      return HWY_DYNAMIC_DISPATCH(ReadFloatRowInterleaved2);
+    } else if (num_channels == 3) {
+      return HWY_DYNAMIC_DISPATCH(ReadFloatRowInterleaved3);
+    } else if (num_channels == 4) {
+      return HWY_DYNAMIC_DISPATCH(ReadFloatRowInterleaved4);
     }
   } else if (m->data_type == JPEGLI_TYPE_FLOAT && swap_endianness) {
-    if (cinfo->raw_data_in || cinfo->input_components == 1) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadFloatRowSingleSwap);
-    } else if (cinfo->input_components == 2) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadFloatRowInterleaved2Swap);
-    } else if (cinfo->input_components == 3) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadFloatRowInterleaved3Swap);
-    } else if (cinfo->input_components == 4) {
-      m->input_method = HWY_DYNAMIC_DISPATCH(ReadFloatRowInterleaved4Swap);
+    if (num_channels == 1) {
+      return HWY_DYNAMIC_DISPATCH(ReadFloatRowSingleSwap);
+    } else if (num_channels == 2) {
+      return HWY_DYNAMIC_DISPATCH(ReadFloatRowInterleaved2Swap);
+    } else if (num_channels == 3) {
+      return HWY_DYNAMIC_DISPATCH(ReadFloatRowInterleaved3Swap);
+    } else if (num_channels == 4) {
+      return HWY_DYNAMIC_DISPATCH(ReadFloatRowInterleaved4Swap);
     }
   }
+  return nullptr;
+}
+
+void ChooseInputMethod(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  m->input_method =
+      GetInputMethod(cinfo, cinfo->raw_data_in ? 1 : cinfo->input_components);
   if (m->input_method == nullptr) {
     JPEGLI_ERROR("Could not find input method.");
   }
+  m->input_row_multiple = 1;
+  if (m->input_rows_padded && !cinfo->raw_data_in) {
+    const size_t lanes = HWY_DYNAMIC_DISPATCH(InputVectorLanes)();
+    const size_t pixel_size =
+        cinfo->input_components * jpegli_bytes_per_sample(m->data_type);
+    // The last vector of a row reads at most lanes - 1 pixels past its end.
+    if ((lanes - 1) * pixel_size <= JPEGLI_ROW_PADDING) {
+      m->input_row_multiple = lanes;
+    }
+  }
+  m->tone_map_method = nullptr;
+  if (m->tone_mapping_requested) {
+    if (cinfo->raw_data_in || !GetRGBChannels(cinfo, m->tone_map_channels)) {
+      JPEGLI_ERROR("Tone mapping requires RGB input.");
+    }
+    m->tone_map_method = m->tone_mapping.transfer_function == 16
+                             ? HWY_DYNAMIC_DISPATCH(ToneMapRowPQ)
+                             : HWY_DYNAMIC_DISPATCH(ToneMapRowHLG);
+  }
+  m->alpha_blend_method = nullptr;
+  if (m->alpha_blending_requested) {
+    m->alpha_channel = GetAlphaChannel(cinfo);
+    if (cinfo->raw_data_in || m->alpha_channel < 0 ||
+        !GetRGBChannels(cinfo, m->alpha_blend_channels)) {
+      JPEGLI_ERROR("Alpha blending requires RGB input with an alpha channel.");
+    }
+    m->alpha_blend_method = HWY_DYNAMIC_DISPATCH(BlendAlphaRow);
+  }
 }
 
 }  // namespace jpegli
@@ -7,10 +7,22 @@
 #ifndef LIB_JPEGLI_INPUT_H_
 #define LIB_JPEGLI_INPUT_H_
 
+#include <cstddef>
+#include <cstdint>
+
 #include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
 
 namespace jpegli {
 
+// Converts len pixels of an input row to float rows, one for each channel.
+typedef void (*InputMethod)(const uint8_t* row_in, size_t len,
+                            float* row_out[kMaxComponents]);
+
+// Returns the input method for rows of num_channels interleaved channels of
+// the input data type, or nullptr if there is none.
+InputMethod GetInputMethod(j_compress_ptr cinfo, int num_channels);
+
 void ChooseInputMethod(j_compress_ptr cinfo);
 
 }  // namespace jpegli
@@ -502,6 +502,62 @@ TEST_P(InputSuspensionTestParam, PreConsumeInputNonBuffered) {
   VerifyOutputImage(output1, output0, config.max_rms_dist);
 }
 
+TEST_P(InputSuspensionTestParam, DecodeStep) {
+  TestConfig config = GetParam();
+  const DecompressParams& dparams = config.dparams;
+  if (dparams.output_mode != PIXELS || dparams.quantize_colors ||
+      dparams.size_factor < 1.0f) {
+    return;
+  }
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, GetTestJpegData(config),
+                     "Failed to create test data.");
+  SourceManager src(compressed.data(), compressed.size(), dparams.chunk_size,
+                    /*is_partial_file=*/false);
+  TestImage output0;
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    cinfo.src = reinterpret_cast<jpeg_source_mgr*>(&src);
+    while (jpegli_read_header(&cinfo, TRUE) == JPEG_SUSPENDED) {
+      JPEGLI_TEST_ENSURE_TRUE(src.LoadNextChunk());
+    }
+    SetDecompressParams(dparams, &cinfo);
+    jpegli_set_output_format(&cinfo, dparams.data_type, dparams.endianness);
+    jpegli_calc_output_dimensions(&cinfo);
+    output0.xsize = cinfo.output_width;
+    output0.ysize = cinfo.output_height;
+    output0.components = cinfo.out_color_components;
+    output0.color_space = cinfo.out_color_space;
+    output0.data_type = dparams.data_type;
+    output0.endianness = dparams.endianness;
+    output0.AllocatePixels();
+    size_t stride = output0.xsize * output0.components *
+                    jpegli_bytes_per_sample(dparams.data_type);
+    size_t num_yields = 0;
+    for (;;) {
+      JpegliStepStatus status =
+          jpegli_decode_step(&cinfo, output0.pixels.data(), stride, 3);
+      if (status == JPEGLI_STEP_DONE) break;
+      if (status == JPEGLI_STEP_YIELD) {
+        ++num_yields;
+      } else {
+        EXPECT_EQ(JPEGLI_STEP_NEED_INPUT, status);
+        JPEGLI_TEST_ENSURE_TRUE(src.LoadNextChunk());
+      }
+    }
+    // Every image has more than 3 iMCU rows to decode.
+    EXPECT_GT(num_yields, 0u);
+    return true;
+  };
+  ASSERT_TRUE(try_catch_block());
+  jpegli_destroy_decompress(&cinfo);
+
+  TestImage output1;
+  DecodeWithLibjpeg(config.jparams, dparams, compressed, &output1);
+  VerifyOutputImage(output1, output0, config.max_rms_dist);
+}
+
 std::vector<TestConfig> GenerateTests() {
   std::vector<TestConfig> all_tests;
   std::vector<std::pair<std::string, std::string>> testfiles({
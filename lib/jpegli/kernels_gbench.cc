@@ -0,0 +1,573 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+// Microbenchmarks of the SIMD kernels of jpegli, each of them registered once
+// for every SIMD target that is compiled in and supported by the CPU, with
+// names like "ReadInput/3/0/AVX2". The kernels of the library are selected
+// through the same dispatch as when encoding or decoding an image.
+
+#include <benchmark/benchmark.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <hwy/aligned_allocator.h>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "lib/jpegli/bitstream.h"
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/decode.h"
+#include "lib/jpegli/decode_internal.h"
+#include "lib/jpegli/encode.h"
+#include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/input.h"
+#include "lib/jpegli/upsample.h"
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jpegli/kernels_gbench.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "lib/jpegli/dct-inl.h"
+#include "lib/jpegli/entropy_coding-inl.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace jpegli {
+namespace HWY_NAMESPACE {
+
+// The kernels of dct-inl.h and entropy_coding-inl.h are inlined into their
+// callers, so they are compiled for each target here.
+
+void ComputeCoefficientBlocks(const float* pixels, size_t stride,
+                              size_t num_blocks, const float* qmc,
+                              const float* zero_bias_offset,
+                              const float* zero_bias_mul, bool fixed_point,
+                              float* tmp, int32_t* blocks) {
+  int16_t last_dc = 0;
+  for (size_t i = 0; i < num_blocks; ++i) {
+    int32_t* block = &blocks[i * DCTSIZE2];
+    ComputeCoefficientBlock(&pixels[i * DCTSIZE], stride, qmc, last_dc, 0.5f,
+                            zero_bias_offset, zero_bias_mul, fixed_point, tmp,
+                            block);
+    last_dc = block[0];
+  }
+}
+
+size_t ComputeTokensForBlocks(const coeff_t* blocks, size_t num_blocks,
+                              Token* tokens) {
+  Token* next_token = tokens;
+  int last_dc = 0;
+  for (size_t i = 0; i < num_blocks; ++i) {
+    const coeff_t* block = &blocks[i * DCTSIZE2];
+    ComputeTokensForBlock<coeff_t, true>(block, last_dc, 0, 4, &next_token);
+    last_dc = block[0];
+  }
+  return next_token - tokens;
+}
+
+// Converts a block of zig-zag ordered coefficients, with the DC difference in
+// its first element, to the input of WriteBlock(). The block is overwritten
+// with the extra bits.
+int ComputeBlockSymbols(int32_t* block, int32_t* symbols, int32_t* nonzero_idx,
+                        bool* emit_eob) {
+  const int num_nonzeros = CompactBlock(block, nonzero_idx);
+  *emit_eob = nonzero_idx[num_nonzeros - 1] < 1008;
+  ComputeSymbols(num_nonzeros, nonzero_idx, block, symbols);
+  return num_nonzeros;
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jpegli
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jpegli {
+
+HWY_EXPORT(ComputeCoefficientBlocks);
+HWY_EXPORT(ComputeTokensForBlocks);
+HWY_EXPORT(ComputeBlockSymbols);
+
+namespace {
+
+constexpr size_t kXSize = 1024;
+constexpr size_t kYSize = 1024;
+// Number of blocks in the block rows of the block level kernels.
+constexpr size_t kNumBlocks = kXSize / DCTSIZE;
+// Padding of the float rows on both sides, for the kernels that read or write
+// beyond the ends of the rows.
+constexpr size_t kPadding = 64;
+
+void FillRandom(float* data, size_t len, float min, float max, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> dist(min, max);
+  for (size_t i = 0; i < len; ++i) data[i] = dist(rng);
+}
+
+// Returns a block row of quantized coefficients in zig-zag order, with the
+// magnitude and the probability of the non-zero coefficients decreasing with
+// the frequency, as in a typical image.
+std::vector<int32_t> RandomCoefficients(size_t num_blocks, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::vector<int32_t> coeffs(num_blocks * DCTSIZE2);
+  for (size_t i = 0; i < num_blocks; ++i) {
+    int32_t* block = &coeffs[i * DCTSIZE2];
+    block[0] = static_cast<int32_t>(rng() % 256) - 128;
+    for (int k = 1; k < DCTSIZE2; ++k) {
+      if (rng() % DCTSIZE2 < static_cast<uint32_t>(k)) continue;
+      int32_t range = 2 + 256 / k;
+      int32_t val = 1 + static_cast<int32_t>(rng() % range);
+      block[k] = (rng() & 1) ? val : -val;
+    }
+  }
+  return coeffs;
+}
+
+// Encodes an RGB test image of the benchmark size with the given luma sampling
+// factors.
+std::vector<uint8_t> CreateTestJpeg(int h_samp, int v_samp) {
+  std::vector<uint8_t> pixels(kXSize * kYSize * 3);
+  std::mt19937 rng(7);
+  for (size_t y = 0; y < kYSize; ++y) {
+    for (size_t x = 0; x < kXSize; ++x) {
+      uint8_t* p = &pixels[(y * kXSize + x) * 3];
+      p[0] = (x + (rng() & 15)) & 0xff;
+      p[1] = (y + (rng() & 15)) & 0xff;
+      p[2] = ((x + y) / 2 + (rng() & 15)) & 0xff;
+    }
+  }
+  jpeg_compress_struct cinfo;
+  jpeg_error_mgr jerr;
+  cinfo.err = jpegli_std_error(&jerr);
+  jpegli_create_compress(&cinfo);
+  unsigned char* buffer = nullptr;
+  unsigned long size = 0;  // NOLINT
+  jpegli_mem_dest(&cinfo, &buffer, &size);
+  cinfo.image_width = kXSize;
+  cinfo.image_height = kYSize;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpegli_set_defaults(&cinfo);
+  cinfo.comp_info[0].h_samp_factor = h_samp;
+  cinfo.comp_info[0].v_samp_factor = v_samp;
+  jpegli_start_compress(&cinfo, TRUE);
+  for (size_t y = 0; y < kYSize; ++y) {
+    JSAMPROW row[] = {&pixels[y * kXSize * 3]};
+    jpegli_write_scanlines(&cinfo, row, 1);
+  }
+  jpegli_finish_compress(&cinfo);
+  jpegli_destroy_compress(&cinfo);
+  std::vector<uint8_t> jpeg(buffer, buffer + size);
+  free(buffer);
+  return jpeg;
+}
+
+const std::vector<uint8_t>& TestJpeg() {
+  static const std::vector<uint8_t>* jpeg =
+      new std::vector<uint8_t>(CreateTestJpeg(2, 2));
+  return *jpeg;
+}
+
+// A compressor that is started with the given settings, so that its kernels
+// are chosen for the current target.
+class StartedCompressor {
+ public:
+  StartedCompressor(int num_channels, JpegliDataType data_type, int h_samp,
+                    int v_samp) {
+    cinfo_.err = jpegli_std_error(&jerr_);
+    jpegli_create_compress(&cinfo_);
+    jpegli_mem_dest(&cinfo_, &buffer_, &size_);
+    cinfo_.image_width = kXSize;
+    cinfo_.image_height = kYSize;
+    cinfo_.input_components = num_channels;
+    cinfo_.in_color_space = num_channels == 1   ? JCS_GRAYSCALE
+                            : num_channels == 3 ? JCS_RGB
+                                                : JCS_UNKNOWN;
+    jpegli_set_input_format(&cinfo_, data_type, JPEGLI_NATIVE_ENDIAN);
+    jpegli_set_defaults(&cinfo_);
+    cinfo_.optimize_coding = FALSE;
+    if (cinfo_.num_components == 3) {
+      cinfo_.comp_info[0].h_samp_factor = h_samp;
+      cinfo_.comp_info[0].v_samp_factor = v_samp;
+    }
+    jpegli_start_compress(&cinfo_, TRUE);
+  }
+  ~StartedCompressor() {
+    jpegli_destroy_compress(&cinfo_);
+    free(buffer_);
+  }
+  StartedCompressor(const StartedCompressor&) = delete;
+  StartedCompressor& operator=(const StartedCompressor&) = delete;
+
+  j_compress_ptr get() { return &cinfo_; }
+
+ private:
+  jpeg_compress_struct cinfo_;
+  jpeg_error_mgr jerr_;
+  unsigned char* buffer_ = nullptr;
+  unsigned long size_ = 0;  // NOLINT
+};
+
+// A decompressor of the test image that is started with the given output
+// color space and scaling, so that its kernels are chosen for the current
+// target.
+class StartedDecompressor {
+ public:
+  StartedDecompressor(J_COLOR_SPACE out_color_space, int scale_num) {
+    const std::vector<uint8_t>& jpeg = TestJpeg();
+    cinfo_.err = jpegli_std_error(&jerr_);
+    jpegli_create_decompress(&cinfo_);
+    jpegli_mem_src(&cinfo_, jpeg.data(), jpeg.size());
+    jpegli_read_header(&cinfo_, TRUE);
+    cinfo_.out_color_space = out_color_space;
+    cinfo_.scale_num = scale_num;
+    cinfo_.scale_denom = DCTSIZE;
+    jpegli_start_decompress(&cinfo_);
+  }
+  ~StartedDecompressor() { jpegli_destroy_decompress(&cinfo_); }
+  StartedDecompressor(const StartedDecompressor&) = delete;
+  StartedDecompressor& operator=(const StartedDecompressor&) = delete;
+
+  j_decompress_ptr get() { return &cinfo_; }
+
+ private:
+  jpeg_decompress_struct cinfo_;
+  jpeg_error_mgr jerr_;
+};
+
+// Returns kMaxComponents padded float rows of kXSize values.
+std::vector<hwy::AlignedFreeUniquePtr<float[]>> AllocateRows(size_t len) {
+  std::vector<hwy::AlignedFreeUniquePtr<float[]>> rows;
+  for (size_t c = 0; c < kMaxComponents; ++c) {
+    rows.emplace_back(hwy::AllocateAligned<float>(len + 2 * kPadding));
+    FillRandom(rows.back().get(), len + 2 * kPadding, 0.0f, 1.0f, c);
+  }
+  return rows;
+}
+
+// Args: number of channels, JpegliDataType.
+void BM_ReadInput(benchmark::State& state) {
+  const int num_channels = state.range(0);
+  const JpegliDataType data_type = static_cast<JpegliDataType>(state.range(1));
+  StartedCompressor compressor(num_channels, data_type, 1, 1);
+  InputMethod input_method = GetInputMethod(compressor.get(), num_channels);
+  const size_t bytes_per_sample = jpegli_bytes_per_sample(data_type);
+  const size_t row_size = kXSize * num_channels * bytes_per_sample;
+  std::vector<uint8_t> row_in(row_size + kPadding);
+  if (data_type == JPEGLI_TYPE_FLOAT) {
+    FillRandom(reinterpret_cast<float*>(row_in.data()), row_size / 4, 0.0f,
+               1.0f, 1);
+  } else {
+    std::mt19937 rng(1);
+    for (uint8_t& v : row_in) v = rng() & 0xff;
+  }
+  auto rows = AllocateRows(kXSize);
+  float* row_out[kMaxComponents];
+  for (size_t c = 0; c < kMaxComponents; ++c) row_out[c] = rows[c].get();
+  for (auto _ : state) {
+    input_method(row_in.data(), kXSize, row_out);
+    benchmark::DoNotOptimize(row_out[0][0]);
+  }
+  state.SetBytesProcessed(state.iterations() * row_size);
+}
+
+void BM_ColorTransformRGBToYCbCr(benchmark::State& state) {
+  StartedCompressor compressor(3, JPEGLI_TYPE_UINT8, 1, 1);
+  auto* color_transform = compressor.get()->master->color_transform;
+  auto rows = AllocateRows(kXSize);
+  float* row[kMaxComponents];
+  for (size_t c = 0; c < kMaxComponents; ++c) row[c] = rows[c].get();
+  for (auto _ : state) {
+    color_transform(row, kXSize);
+    benchmark::DoNotOptimize(row[0][0]);
+  }
+  state.SetItemsProcessed(state.iterations() * kXSize);
+}
+
+// Args: horizontal and vertical downsampling factor.
+void BM_Downsample(benchmark::State& state) {
+  const int h_factor = state.range(0);
+  const int v_factor = state.range(1);
+  StartedCompressor compressor(3, JPEGLI_TYPE_UINT8, h_factor, v_factor);
+  auto* downsample = compressor.get()->master->downsample_method[1];
+  std::vector<hwy::AlignedFreeUniquePtr<float[]>> buffers;
+  float* rows_in[2 * MAX_SAMP_FACTOR];
+  for (float*& row : rows_in) {
+    buffers.emplace_back(hwy::AllocateAligned<float>(kXSize + kPadding));
+    FillRandom(buffers.back().get(), kXSize + kPadding, 0.0f, 1.0f, 2);
+    row = buffers.back().get();
+  }
+  float* rows_out[2];
+  for (float*& row : rows_out) {
+    buffers.emplace_back(hwy::AllocateAligned<float>(kXSize + kPadding));
+    row = buffers.back().get();
+  }
+  for (auto _ : state) {
+    downsample(rows_in, kXSize, rows_out);
+    benchmark::DoNotOptimize(rows_out[0][0]);
+  }
+  state.SetItemsProcessed(state.iterations() * kXSize * 2 * v_factor);
+}
+
+// Args: whether the fixed point DCT is used.
+void BM_ForwardDCT(benchmark::State& state) {
+  const bool fixed_point = state.range(0);
+  const size_t stride = kXSize;
+  auto pixels = hwy::AllocateAligned<float>(DCTSIZE * stride);
+  FillRandom(pixels.get(), DCTSIZE * stride, -128.0f, 127.0f, 3);
+  auto qmc = hwy::AllocateAligned<float>(3 * DCTSIZE2);
+  float* zero_bias_offset = &qmc[DCTSIZE2];
+  float* zero_bias_mul = &qmc[2 * DCTSIZE2];
+  for (int k = 0; k < DCTSIZE2; ++k) {
+    qmc[k] = 1.0f / (8.0f * (1 + k / 4));
+    zero_bias_offset[k] = 0.5f;
+    zero_bias_mul[k] = 0.5f;
+  }
+  auto tmp = hwy::AllocateAligned<float>(2 * DCTSIZE2);
+  auto blocks = hwy::AllocateAligned<int32_t>(kNumBlocks * DCTSIZE2);
+  for (auto _ : state) {
+    HWY_DYNAMIC_DISPATCH(ComputeCoefficientBlocks)
+    (pixels.get(), stride, kNumBlocks, qmc.get(), zero_bias_offset,
+     zero_bias_mul, fixed_point, tmp.get(), blocks.get());
+    benchmark::DoNotOptimize(blocks[0]);
+  }
+  state.SetItemsProcessed(state.iterations() * kNumBlocks);
+}
+
+void BM_ComputeTokens(benchmark::State& state) {
+  const std::vector<int32_t> coeffs = RandomCoefficients(kNumBlocks, 4);
+  auto blocks = hwy::AllocateAligned<coeff_t>(coeffs.size());
+  for (size_t i = 0; i < coeffs.size(); ++i) blocks[i] = coeffs[i];
+  std::vector<Token> tokens(kNumBlocks * (DCTSIZE2 + 1));
+  for (auto _ : state) {
+    size_t num_tokens = HWY_DYNAMIC_DISPATCH(ComputeTokensForBlocks)(
+        blocks.get(), kNumBlocks, tokens.data());
+    benchmark::DoNotOptimize(num_tokens);
+  }
+  state.SetItemsProcessed(state.iterations() * kNumBlocks);
+}
+
+// The bit writer is not SIMD code, so this is registered once; the symbols of
+// the blocks are computed with the best target.
+void BM_WriteBlock(benchmark::State& state) {
+  StartedCompressor compressor(3, JPEGLI_TYPE_UINT8, 1, 1);
+  jpeg_comp_master* m = compressor.get()->master;
+  const HuffmanCodeTable* dc_code = &m->coding_tables[m->context_map[0]];
+  const HuffmanCodeTable* ac_code = &m->coding_tables[m->context_map[4]];
+  std::vector<int32_t> coeffs = RandomCoefficients(kNumBlocks, 5);
+  auto extra_bits = hwy::AllocateAligned<int32_t>(kNumBlocks * DCTSIZE2);
+  auto symbols = hwy::AllocateAligned<int32_t>(kNumBlocks * DCTSIZE2);
+  auto nonzero_idx = hwy::AllocateAligned<int32_t>(2 * DCTSIZE2);
+  std::vector<int> num_nonzeros(kNumBlocks);
+  std::vector<uint8_t> emit_eob(kNumBlocks);
+  for (size_t i = 0; i < kNumBlocks; ++i) {
+    int32_t* block = &extra_bits[i * DCTSIZE2];
+    memcpy(block, &coeffs[i * DCTSIZE2], DCTSIZE2 * sizeof(block[0]));
+    bool eob;
+    num_nonzeros[i] = HWY_DYNAMIC_DISPATCH(ComputeBlockSymbols)(
+        block, &symbols[i * DCTSIZE2], &nonzero_idx[DCTSIZE2], &eob);
+    emit_eob[i] = eob;
+  }
+  std::vector<uint8_t> output(kNumBlocks * (DCTSIZE2 * 16 + 8) + (1 << 16));
+  JpegBitWriter bw;
+  bw.cinfo = compressor.get();
+  bw.data = output.data();
+  bw.len = output.size();
+  bw.output_pos = 0;
+  size_t num_bytes = 0;
+  for (auto _ : state) {
+    bw.pos = 0;
+    bw.put_buffer = 0;
+    bw.free_bits = 64;
+    bw.healthy = true;
+    for (size_t i = 0; i < kNumBlocks; ++i) {
+      WriteBlock(&symbols[i * DCTSIZE2], &extra_bits[i * DCTSIZE2],
+                 num_nonzeros[i], emit_eob[i], dc_code, ac_code, &bw);
+    }
+    num_bytes += bw.pos;
+    benchmark::DoNotOptimize(output[0]);
+  }
+  state.SetItemsProcessed(state.iterations() * kNumBlocks);
+  state.SetBytesProcessed(num_bytes);
+}
+
+// Decodes the scan of the test image into the coefficient buffers. The
+// Huffman decoding (ReadSymbol() and DecodeDCTBlock()) is not SIMD code and
+// is only reachable through the decoder, so this is registered once.
+void BM_DecodeScan(benchmark::State& state) {
+  const std::vector<uint8_t>& jpeg = TestJpeg();
+  jpeg_decompress_struct cinfo;
+  jpeg_error_mgr jerr;
+  cinfo.err = jpegli_std_error(&jerr);
+  jpegli_create_decompress(&cinfo);
+  for (auto _ : state) {
+    jpegli_mem_src(&cinfo, jpeg.data(), jpeg.size());
+    jpegli_read_header(&cinfo, TRUE);
+    jvirt_barray_ptr* coeffs = jpegli_read_coefficients(&cinfo);
+    benchmark::DoNotOptimize(coeffs);
+    jpegli_finish_decompress(&cinfo);
+  }
+  jpegli_destroy_decompress(&cinfo);
+  state.SetBytesProcessed(state.iterations() * jpeg.size());
+}
+
+// Args: scaled DCT size.
+void BM_InverseDCT(benchmark::State& state) {
+  const size_t dctsize = state.range(0);
+  StartedDecompressor decompressor(JCS_RGB, dctsize);
+  auto* inverse_transform = decompressor.get()->master->inverse_transform[0];
+  const std::vector<int32_t> coeffs = RandomCoefficients(kNumBlocks, 6);
+  auto qblocks = hwy::AllocateAligned<int16_t>(coeffs.size());
+  for (size_t i = 0; i < kNumBlocks; ++i) {
+    for (int k = 0; k < DCTSIZE2; ++k) {
+      qblocks[i * DCTSIZE2 + kJPEGNaturalOrder[k]] = coeffs[i * DCTSIZE2 + k];
+    }
+  }
+  auto dequant = hwy::AllocateAligned<float>(2 * DCTSIZE2);
+  float* biases = &dequant[DCTSIZE2];
+  for (int k = 0; k < DCTSIZE2; ++k) {
+    dequant[k] = (1 + k / 4) / 255.0f;
+    biases[k] = 0.0f;
+  }
+  auto scratch = hwy::AllocateAligned<float>(5 * DCTSIZE2);
+  const size_t stride = kNumBlocks * dctsize + kPadding;
+  auto output = hwy::AllocateAligned<float>(dctsize * stride);
+  for (auto _ : state) {
+    inverse_transform(qblocks.get(), kNumBlocks, dequant.get(), biases,
+                      scratch.get(), output.get(), stride, dctsize);
+    benchmark::DoNotOptimize(output[0]);
+  }
+  state.SetItemsProcessed(state.iterations() * kNumBlocks);
+}
+
+void BM_Upsample2Horizontal(benchmark::State& state) {
+  auto rows = AllocateRows(kXSize);
+  float* row = rows[0].get() + kPadding;
+  float* scratch = rows[1].get() + kPadding;
+  for (auto _ : state) {
+    Upsample2Horizontal(row, scratch, kXSize);
+    benchmark::DoNotOptimize(row[0]);
+  }
+  state.SetItemsProcessed(state.iterations() * kXSize);
+}
+
+void BM_Upsample2Vertical(benchmark::State& state) {
+  auto rows = AllocateRows(kXSize);
+  float* out0 = rows[3].get() + kPadding;
+  std::vector<hwy::AlignedFreeUniquePtr<float[]>> out = AllocateRows(kXSize);
+  float* out1 = out[0].get() + kPadding;
+  for (auto _ : state) {
+    Upsample2Vertical(rows[0].get() + kPadding, rows[1].get() + kPadding,
+                      rows[2].get() + kPadding, out0, out1, kXSize);
+    benchmark::DoNotOptimize(out0[0]);
+  }
+  state.SetItemsProcessed(state.iterations() * 2 * kXSize);
+}
+
+void BM_Upsample2x2(benchmark::State& state) {
+  auto rows = AllocateRows(kXSize);
+  auto out = AllocateRows(kXSize);
+  for (auto _ : state) {
+    Upsample2x2(rows[0].get() + kPadding, rows[1].get() + kPadding,
+                rows[2].get() + kPadding, rows[3].get() + kPadding,
+                out[0].get() + kPadding, out[1].get() + kPadding, kXSize);
+    benchmark::DoNotOptimize(out[0][kPadding]);
+  }
+  state.SetItemsProcessed(state.iterations() * 2 * kXSize);
+}
+
+void BM_ColorTransformYCbCrToRGB(benchmark::State& state) {
+  StartedDecompressor decompressor(JCS_RGB, DCTSIZE);
+  auto* color_transform = decompressor.get()->master->color_transform;
+  auto rows = AllocateRows(kXSize);
+  float* row[kMaxComponents];
+  for (size_t c = 0; c < kMaxComponents; ++c) row[c] = rows[c].get();
+  for (auto _ : state) {
+    color_transform(row, kXSize);
+    benchmark::DoNotOptimize(row[0][0]);
+  }
+  state.SetItemsProcessed(state.iterations() * kXSize);
+}
+
+void BM_ColorOutputYCbCrToRGB8(benchmark::State& state) {
+  StartedDecompressor decompressor(JCS_RGB, DCTSIZE);
+  auto* color_output = decompressor.get()->master->color_output_uint8;
+  auto rows = AllocateRows(kXSize);
+  float* row[kMaxComponents];
+  for (size_t c = 0; c < kMaxComponents; ++c) row[c] = rows[c].get();
+  std::vector<uint8_t> output(kXSize * 3 + kPadding);
+  for (auto _ : state) {
+    color_output(row, 0, kXSize, output.data());
+    benchmark::DoNotOptimize(output[0]);
+  }
+  state.SetItemsProcessed(state.iterations() * kXSize);
+}
+
+using BenchmarkFunction = void (*)(benchmark::State&);
+
+// Registers the benchmark for each target, which is selected while it runs.
+void RegisterPerTarget(
+    const char* name, BenchmarkFunction function,
+    const std::function<void(benchmark::internal::Benchmark*)>& set_args) {
+  for (int64_t target : hwy::SupportedAndGeneratedTargets()) {
+    std::string full_name = std::string(name) + "/" + hwy::TargetName(target);
+    benchmark::internal::Benchmark* b = benchmark::RegisterBenchmark(
+        full_name.c_str(), [target, function](benchmark::State& state) {
+          hwy::SetSupportedTargetsForTest(target);
+          function(state);
+          hwy::SetSupportedTargetsForTest(0);
+        });
+    if (set_args) set_args(b);
+  }
+}
+
+void RegisterKernelBenchmarks() {
+  RegisterPerTarget("ReadInput", BM_ReadInput, [](auto* b) {
+    for (int num_channels : {1, 3, 4}) {
+      for (int data_type :
+           {JPEGLI_TYPE_UINT8, JPEGLI_TYPE_UINT16, JPEGLI_TYPE_FLOAT}) {
+        b->Args({num_channels, data_type});
+      }
+    }
+  });
+  RegisterPerTarget("ColorTransformRGBToYCbCr", BM_ColorTransformRGBToYCbCr,
+                    nullptr);
+  RegisterPerTarget("Downsample", BM_Downsample, [](auto* b) {
+    b->Args({2, 1})->Args({2, 2});
+  });
+  RegisterPerTarget("ForwardDCT", BM_ForwardDCT,
+                    [](auto* b) { b->Arg(0)->Arg(1); });
+  RegisterPerTarget("ComputeTokens", BM_ComputeTokens, nullptr);
+  benchmark::RegisterBenchmark("WriteBlock", BM_WriteBlock);
+  benchmark::RegisterBenchmark("DecodeScan", BM_DecodeScan);
+  RegisterPerTarget("InverseDCT", BM_InverseDCT, [](auto* b) {
+    b->Arg(DCTSIZE)->Arg(DCTSIZE / 2);
+  });
+  RegisterPerTarget("Upsample2Horizontal", BM_Upsample2Horizontal, nullptr);
+  RegisterPerTarget("Upsample2Vertical", BM_Upsample2Vertical, nullptr);
+  RegisterPerTarget("Upsample2x2", BM_Upsample2x2, nullptr);
+  RegisterPerTarget("ColorTransformYCbCrToRGB", BM_ColorTransformYCbCrToRGB,
+                    nullptr);
+  RegisterPerTarget("ColorOutputYCbCrToRGB8", BM_ColorOutputYCbCrToRGB8,
+                    nullptr);
+}
+
+}  // namespace
+}  // namespace jpegli
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  jpegli::RegisterKernelBenchmarks();
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
+#endif  // HWY_ONCE
@@ -275,6 +275,55 @@ void DecodeWithLibjpeg(const CompressParams& jparams,
                     compressed.size(), output);
 }
 
+std::vector<uint8_t> TranscodeToArithmeticWithLibjpeg(
+    const std::vector<uint8_t>& compressed, bool progressive,
+    unsigned int restart_interval) {
+  jpeg_decompress_struct dinfo = {};
+  jpeg_compress_struct cinfo = {};
+  unsigned char* buffer = nullptr;
+  unsigned long buffer_size = 0;  // NOLINT
+  jmp_buf env;
+  const auto try_catch_block = [&]() {
+    jpeg_error_mgr jerr;
+    dinfo.err = jpeg_std_error(&jerr);
+    cinfo.err = &jerr;
+    if (setjmp(env)) {
+      return false;
+    }
+    dinfo.client_data = reinterpret_cast<void*>(&env);
+    cinfo.client_data = reinterpret_cast<void*>(&env);
+    jerr.error_exit = [](j_common_ptr cinfo) {
+      (*cinfo->err->output_message)(cinfo);
+      jmp_buf* env = reinterpret_cast<jmp_buf*>(cinfo->client_data);
+      longjmp(*env, 1);
+    };
+    jpeg_create_decompress(&dinfo);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_src(&dinfo, compressed.data(), compressed.size());
+    Check(jpeg_read_header(&dinfo, TRUE) == JPEG_HEADER_OK);
+    jvirt_barray_ptr* coef_arrays = jpeg_read_coefficients(&dinfo);
+    Check(coef_arrays != nullptr);
+    jpeg_mem_dest(&cinfo, &buffer, &buffer_size);
+    jpeg_copy_critical_parameters(&dinfo, &cinfo);
+    cinfo.arith_code = TRUE;
+    cinfo.optimize_coding = FALSE;
+    cinfo.restart_interval = restart_interval;
+    if (progressive) {
+      jpeg_simple_progression(&cinfo);
+    }
+    jpeg_write_coefficients(&cinfo, coef_arrays);
+    jpeg_finish_compress(&cinfo);
+    Check(jpeg_finish_decompress(&dinfo));
+    return true;
+  };
+  Check(try_catch_block());
+  jpeg_destroy_compress(&cinfo);
+  jpeg_destroy_decompress(&dinfo);
+  std::vector<uint8_t> output(buffer, buffer + buffer_size);
+  if (buffer) free(buffer);
+  return output;
+}
+
 }  // namespace jpegli
 
 #undef J_TEST_UTILS
@@ -33,6 +33,12 @@ void DecodeWithLibjpeg(const CompressParams& jparams,
                        const std::vector<uint8_t>& compressed,
                        TestImage* output);
 
+// Losslessly transcodes a jpeg file to an arithmetic coded sequential or
+// progressive jpeg file with libjpeg.
+std::vector<uint8_t> TranscodeToArithmeticWithLibjpeg(
+    const std::vector<uint8_t>& compressed, bool progressive,
+    unsigned int restart_interval);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_LIBJPEG_TEST_UTIL_H_
@@ -7,14 +7,198 @@
 // This file contains wrapper-functions that are used to build the libjpeg.so
 // shared library that is API- and ABI-compatible with libjpeg-turbo's version
 // of libjpeg.so.
-
+//
+// Since the applications that link it can not call the jpegli extensions, some
+// of them are configured once from environment variables, and applied to each
+// object created by jpeg_create_compress() and jpeg_create_decompress():
+//
+//   JPEGLI_THREADS=N        Encodes and decodes each image with N threads.
+//   JPEGLI_FAST_DECODE=1    Selects the fast decoding speed tier by default,
+//                           see jpegli_set_decode_speed(); the application
+//                           can still change the settings after
+//                           jpeg_read_header().
+//   JPEGLI_FAST_ENCODE=1    Uses the fast adaptive quantization mode.
+//   JPEGLI_MEMORY_LIMIT=N   Sets max_memory_to_use to N bytes, N can have a K,
+//                           M or G suffix.
+//   JPEGLI_SIMD_TARGETS=... See jpegli_set_simd_targets().
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/decode.h"
 #include "lib/jpegli/encode.h"
 
+namespace {
+
+// A fixed pool of threads for the parallel runner of the objects created by
+// the wrapper, the calling thread works on the tasks as well. A run that finds
+// the pool busy with the run of another object is done on the calling thread
+// alone, so many concurrent images do not wait for each other.
+class WrapperThreadPool {
+ public:
+  explicit WrapperThreadPool(size_t num_threads) {
+    for (size_t thread_id = 1; thread_id < num_threads; ++thread_id) {
+      workers_.emplace_back([this, thread_id] { WorkerLoop(thread_id); });
+    }
+  }
+
+  static JxlParallelRetCode Runner(void *runner_opaque, void *jpegxl_opaque,
+                                   JxlParallelRunInit init,
+                                   JxlParallelRunFunction func,
+                                   uint32_t start_range, uint32_t end_range) {
+    auto *pool = static_cast<WrapperThreadPool*>(runner_opaque);
+    std::unique_lock<std::mutex> run_lock(pool->run_mutex_, std::try_to_lock);
+    if (!run_lock.owns_lock() || start_range + 1 >= end_range) {
+      JxlParallelRetCode ret = (*init)(jpegxl_opaque, 1);
+      if (ret != JXL_PARALLEL_RET_SUCCESS) return ret;
+      for (uint32_t task = start_range; task < end_range; ++task) {
+        (*func)(jpegxl_opaque, task, 0);
+      }
+      return JXL_PARALLEL_RET_SUCCESS;
+    }
+    JxlParallelRetCode ret = (*init)(jpegxl_opaque, pool->workers_.size() + 1);
+    if (ret != JXL_PARALLEL_RET_SUCCESS) return ret;
+    {
+      std::lock_guard<std::mutex> lock(pool->mutex_);
+      pool->opaque_ = jpegxl_opaque;
+      pool->func_ = func;
+      pool->next_task_ = start_range;
+      pool->end_range_ = end_range;
+      pool->num_busy_ = pool->workers_.size();
+      ++pool->generation_;
+    }
+    pool->start_cv_.notify_all();
+    pool->RunTasks(0);
+    std::unique_lock<std::mutex> lock(pool->mutex_);
+    pool->done_cv_.wait(lock, [pool] { return pool->num_busy_ == 0; });
+    return JXL_PARALLEL_RET_SUCCESS;
+  }
+
+ private:
+  void RunTasks(size_t thread_id) {
+    for (uint32_t task = next_task_++; task < end_range_; task = next_task_++) {
+      (*func_)(opaque_, task, thread_id);
+    }
+  }
+
+  void WorkerLoop(size_t thread_id) {
+    uint64_t seen_generation = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_cv_.wait(lock, [&] { return generation_ != seen_generation; });
+        seen_generation = generation_;
+      }
+      RunTasks(thread_id);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--num_busy_ == 0) done_cv_.notify_one();
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  // Held by the object whose run uses the pool.
+  std::mutex run_mutex_;
+  // Guards the fields of the current run below, except next_task_.
+  std::mutex mutex_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  uint64_t generation_ = 0;
+  void *opaque_ = nullptr;
+  JxlParallelRunFunction func_ = nullptr;
+  std::atomic<uint32_t> next_task_{0};
+  uint32_t end_range_ = 0;
+  size_t num_busy_ = 0;
+};
+
+struct WrapperConfig {
+  // Holds the parallel runner, nullptr if JPEGLI_THREADS is not set.
+  jpegli_context *context = nullptr;
+  bool fast_decode = false;
+  bool fast_encode = false;
+  long max_memory_to_use = 0;  // NOLINT
+};
+
+bool EnvFlag(const char *name) {
+  const char *value = std::getenv(name);
+  return value != nullptr && value[0] != 0 && std::strcmp(value, "0") != 0;
+}
+
+// Returns the value of the environment variable as a size with an optional
+// K, M or G suffix, 0 if it is not set or invalid.
+uint64_t EnvSize(const char *name) {
+  const char *value = std::getenv(name);
+  if (value == nullptr) return 0;
+  char *end;
+  uint64_t size = std::strtoull(value, &end, 10);
+  if (end == value) return 0;
+  switch (*end) {
+    case 'k':
+    case 'K':
+      size <<= 10;
+      ++end;
+      break;
+    case 'm':
+    case 'M':
+      size <<= 20;
+      ++end;
+      break;
+    case 'g':
+    case 'G':
+      size <<= 30;
+      ++end;
+      break;
+    default:
+      break;
+  }
+  return *end == 0 ? size : 0;
+}
+
+WrapperConfig *ReadConfig() {
+  WrapperConfig *config = new WrapperConfig();
+  uint64_t num_threads = EnvSize("JPEGLI_THREADS");
+  if (num_threads > 1) {
+    num_threads = std::min<uint64_t>(num_threads, 256);
+    // The pool and the context are used until the process exits.
+    auto *pool = new WrapperThreadPool(num_threads);
+    config->context = jpegli_create_context();
+    jpegli_context_set_parallel_runner(config->context,
+                                       &WrapperThreadPool::Runner, pool);
+  }
+  config->fast_decode = EnvFlag("JPEGLI_FAST_DECODE");
+  config->fast_encode = EnvFlag("JPEGLI_FAST_ENCODE");
+  config->max_memory_to_use = std::min<uint64_t>(
+      EnvSize("JPEGLI_MEMORY_LIMIT"), static_cast<uint64_t>(LONG_MAX));
+  return config;
+}
+
+const WrapperConfig &GetConfig() {
+  static const WrapperConfig *config = ReadConfig();
+  return *config;
+}
+
+void ApplyConfig(j_common_ptr cinfo) {
+  const WrapperConfig &config = GetConfig();
+  if (config.context != nullptr) {
+    jpegli_attach_context(cinfo, config.context);
+  }
+  if (config.max_memory_to_use > 0) {
+    cinfo->mem->max_memory_to_use = config.max_memory_to_use;
+  }
+}
+
+}  // namespace
+
 struct jpeg_error_mgr *jpeg_std_error(struct jpeg_error_mgr *err) {
   return jpegli_std_error(err);
 }
@@ -34,6 +218,7 @@ JHUFF_TBL *jpeg_alloc_huff_table(j_common_ptr cinfo) {
 void jpeg_CreateDecompress(j_decompress_ptr cinfo, int version,
                            size_t structsize) {
   jpegli_CreateDecompress(cinfo, version, structsize);
+  ApplyConfig(reinterpret_cast<j_common_ptr>(cinfo));
 }
 
 void jpeg_stdio_src(j_decompress_ptr cinfo, FILE *infile) {
@@ -46,7 +231,11 @@ void jpeg_mem_src(j_decompress_ptr cinfo, const unsigned char *inbuffer,
 }
 
 int jpeg_read_header(j_decompress_ptr cinfo, boolean require_image) {
-  return jpegli_read_header(cinfo, require_image);
+  int retcode = jpegli_read_header(cinfo, require_image);
+  if (retcode == JPEG_HEADER_OK && GetConfig().fast_decode) {
+    jpegli_set_decode_speed(cinfo, JPEGLI_DECODE_FAST);
+  }
+  return retcode;
 }
 
 boolean jpeg_start_decompress(j_decompress_ptr cinfo) {
@@ -134,6 +323,10 @@ void jpeg_destroy_decompress(j_decompress_ptr cinfo) {
 
 void jpeg_CreateCompress(j_compress_ptr cinfo, int version, size_t structsize) {
   jpegli_CreateCompress(cinfo, version, structsize);
+  ApplyConfig(reinterpret_cast<j_common_ptr>(cinfo));
+  if (GetConfig().fast_encode) {
+    jpegli_set_aq_mode(cinfo, JPEGLI_AQ_FAST);
+  }
 }
 
 void jpeg_stdio_dest(j_compress_ptr cinfo, FILE *outfile) {
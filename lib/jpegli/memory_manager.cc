@@ -7,41 +7,276 @@
 #include "lib/jpegli/memory_manager.h"
 
 #include <algorithm>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <hwy/aligned_allocator.h>
+#include <utility>
 #include <vector>
 
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/error.h"
 
+#if defined(__unix__) || defined(__unix) || \
+    defined(__APPLE__) && defined(__MACH__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
+#define JPEGLI_BACKING_STORE 1
+#else
+#define JPEGLI_BACKING_STORE 0
+#endif
+
 struct jvirt_sarray_control {
   JSAMPARRAY full_buffer;
   size_t numrows;
   JDIMENSION maxaccess;
+  // Set if the array is stored in a memory mapped temporary file.
+  bool backing_store;
+  size_t row_bytes;
+  // The rows before prefetch_end were already requested from the file.
+  size_t prefetch_end;
 };
 
 struct jvirt_barray_control {
   JBLOCKARRAY full_buffer;
   size_t numrows;
   JDIMENSION maxaccess;
+  bool backing_store;
+  size_t row_bytes;
+  size_t prefetch_end;
+  // Set if the coefficients of the blocks are in zigzag order.
+  bool zigzag_order;
 };
 
 namespace jpegli {
 
 namespace {
 
+// Allocations of at most kMaxArenaAllocSize bytes are carved out of chunks of
+// kArenaChunkSize bytes owned by the pool, so that they cost only a pointer
+// bump, and freeing the pool releases only the chunks. Larger allocations get
+// their own memory block.
+constexpr size_t kArenaChunkSize = 1 << 16;
+constexpr size_t kMaxArenaAllocSize = kArenaChunkSize / 16;
+constexpr size_t kArenaAlignment = alignof(std::max_align_t);
+
+struct Arena {
+  uint8_t* next;
+  size_t bytes_left;
+};
+
+struct MemoryBlock {
+  void* ptr;
+  size_t size;
+  // Set if the block is an anonymous memory mapping.
+  bool mapped;
+  // Set if the block is allocated with the functions of custom_allocator.
+  bool custom;
+};
+
+// Blocks of the aligned pools of at least this size are backed by huge pages
+// if requested by jpegli_use_huge_pages().
+constexpr size_t kHugePageSize = 1 << 21;
+
+// Number of bytes that are requested ahead from the backing store of a
+// virtual array when it is accessed in increasing row order.
+constexpr size_t kPrefetchBytes = 1 << 22;
+
 struct MemoryManager {
   struct jpeg_memory_mgr pub;
-  std::vector<void*> owned_ptrs[2 * JPOOL_NUMPOOLS];
+  std::vector<MemoryBlock> owned_blocks[2 * JPOOL_NUMPOOLS];
+  // If keep_image_memory is set, the blocks of the image pools are moved here
+  // when the pool is freed, and the allocations of the next image are served
+  // from them if their size matches.
+  std::vector<MemoryBlock> cached_blocks[2 * JPOOL_NUMPOOLS];
+  bool keep_image_memory;
+  bool use_huge_pages;
+  // Set by jpegli_set_memory_manager(), the memory blocks are allocated with
+  // these functions if custom_allocator.alloc is not nullptr.
+  JxlMemoryManager custom_allocator;
+  // Memory mapped temporary files of the virtual arrays that do not fit in
+  // max_memory_to_use.
+  std::vector<MemoryBlock> mapped_blocks[2 * JPOOL_NUMPOOLS];
+  Arena arenas[2 * JPOOL_NUMPOOLS];
   uint64_t pool_memory_usage[2 * JPOOL_NUMPOOLS];
   uint64_t total_memory_usage;
   uint64_t peak_memory_usage;
+  // Statistics of the public pools, where the aligned pools are counted
+  // together with their unaligned counterparts.
+  uint64_t pool_peak_memory_usage[JPOOL_NUMPOOLS];
+  size_t pool_num_allocations[JPOOL_NUMPOOLS];
+  size_t total_num_allocations;
 };
 
-void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
+#if JPEGLI_BACKING_STORE
+// Returns a huge page aligned anonymous mapping of the given size, which the
+// kernel is asked to back with transparent huge pages, or nullptr on failure.
+// The pages are zero and are only placed on a NUMA node when they are first
+// written to.
+void* MapHugePages(size_t size) {
+  // Over-allocate so that the start can be aligned to a huge page boundary.
+  const size_t map_size = size + kHugePageSize;
+  void* p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  uintptr_t start = reinterpret_cast<uintptr_t>(p);
+  uintptr_t aligned = RoundUpTo(start, kHugePageSize);
+  if (aligned > start) {
+    munmap(p, aligned - start);
+  }
+  if (aligned + size < start + map_size) {
+    munmap(reinterpret_cast<void*>(aligned + size),
+           start + map_size - aligned - size);
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE);
+#endif
+  return reinterpret_cast<void*>(aligned);
+}
+
+void Unmap(const MemoryBlock& block) { munmap(block.ptr, block.size); }
+#else
+void* MapHugePages(size_t size) { return nullptr; }
+void Unmap(const MemoryBlock& block) {}
+#endif
+
+// If zeroed is not nullptr, it is set to whether the returned block is known
+// to be zero-initialized.
+void* AllocBlock(MemoryManager* mem, int pool_id, size_t size, bool* zeroed) {
+  if (zeroed) *zeroed = false;
+  std::vector<MemoryBlock>& cached = mem->cached_blocks[pool_id];
+  for (size_t i = 0; i < cached.size(); ++i) {
+    if (cached[i].size == size) {
+      MemoryBlock block = cached[i];
+      cached[i] = cached.back();
+      cached.pop_back();
+      mem->owned_blocks[pool_id].push_back(block);
+      return block.ptr;
+    }
+  }
+  void* p = nullptr;
+  bool mapped = false;
+  const JxlMemoryManager& custom = mem->custom_allocator;
+  if (custom.alloc != nullptr) {
+    if (pool_id < JPOOL_NUMPOOLS) {
+      p = custom.alloc(custom.opaque, size);
+    } else {
+      p = hwy::AllocateAlignedBytes(size, custom.alloc, custom.opaque);
+    }
+  } else if (pool_id < JPOOL_NUMPOOLS) {
+    p = malloc(size);
+  } else {
+    if (mem->use_huge_pages && size >= kHugePageSize) {
+      p = MapHugePages(size);
+      mapped = (p != nullptr);
+      if (zeroed) *zeroed = mapped;
+    }
+    if (p == nullptr) {
+      p = hwy::AllocateAlignedBytes(size, nullptr, nullptr);
+    }
+  }
+  if (p != nullptr) {
+    mem->owned_blocks[pool_id].push_back(
+        {p, size, mapped, custom.alloc != nullptr});
+  }
+  return p;
+}
+
+void FreeBlocks(MemoryManager* mem, std::vector<MemoryBlock>* blocks,
+                int pool_id) {
+  const JxlMemoryManager& custom = mem->custom_allocator;
+  for (const MemoryBlock& block : *blocks) {
+    if (block.mapped) {
+      Unmap(block);
+    } else if (block.custom) {
+      if (pool_id < JPOOL_NUMPOOLS) {
+        custom.free(custom.opaque, block.ptr);
+      } else {
+        hwy::FreeAlignedBytes(block.ptr, custom.free, custom.opaque);
+      }
+    } else if (pool_id < JPOOL_NUMPOOLS) {
+      free(block.ptr);
+    } else {
+      hwy::FreeAlignedBytes(block.ptr, nullptr, nullptr);
+    }
+  }
+  blocks->clear();
+}
+
+#if JPEGLI_BACKING_STORE
+// Returns a shared mapping of an unlinked temporary file of the given size,
+// which the operating system can page out to the file under memory pressure,
+// or nullptr on failure.
+void* MapTemporaryFile(size_t size) {
+  const char* dir = getenv("TMPDIR");
+  std::string path = (dir != nullptr && dir[0] != '\0') ? dir : "/tmp";
+  path += "/jpegli-XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd == -1) {
+    return nullptr;
+  }
+  unlink(path.c_str());
+  void* p = MAP_FAILED;
+  if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+    p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  // The mapping keeps the file alive.
+  close(fd);
+  return p == MAP_FAILED ? nullptr : p;
+}
+
+void FreeMappedBlocks(std::vector<MemoryBlock>* blocks) {
+  for (const MemoryBlock& block : *blocks) {
+    Unmap(block);
+  }
+  blocks->clear();
+}
+
+// Asks the operating system to read in the given byte range of a memory
+// mapped file in the background.
+void Prefetch(const uint8_t* start, size_t size) {
+  const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t begin = reinterpret_cast<uintptr_t>(start) & ~(page_size - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(start) + size;
+  posix_madvise(reinterpret_cast<void*>(begin), end - begin,
+                POSIX_MADV_WILLNEED);
+}
+#else
+void* MapTemporaryFile(size_t size) { return nullptr; }
+void FreeMappedBlocks(std::vector<MemoryBlock>* blocks) {}
+void Prefetch(const uint8_t* start, size_t size) {}
+#endif
+
+void* AllocFromArena(MemoryManager* mem, int pool_id, size_t size) {
+  Arena* arena = &mem->arenas[pool_id];
+  const size_t alignment =
+      pool_id < JPOOL_NUMPOOLS ? kArenaAlignment : HWY_ALIGNMENT;
+  size = RoundUpTo(size, alignment);
+  if (arena->bytes_left < size) {
+    void* chunk = AllocBlock(mem, pool_id, kArenaChunkSize, nullptr);
+    if (chunk == nullptr) {
+      return nullptr;
+    }
+    arena->next = static_cast<uint8_t*>(chunk);
+    arena->bytes_left = kArenaChunkSize;
+  }
+  void* p = arena->next;
+  arena->next += size;
+  arena->bytes_left -= size;
+  return p;
+}
+
+// If zeroed is not nullptr, it is set to whether the returned memory is known
+// to be zero-initialized.
+void* AllocImpl(j_common_ptr cinfo, int pool_id, size_t sizeofobject,
+                bool* zeroed) {
   MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
   if (pool_id < 0 || pool_id >= 2 * JPOOL_NUMPOOLS) {
     JPEGLI_ERROR("Invalid pool id %d", pool_id);
@@ -52,56 +287,120 @@ void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
     JPEGLI_ERROR("Total memory usage exceeding %ld",
                  mem->pub.max_memory_to_use);
   }
-  void* p;
-  if (pool_id < JPOOL_NUMPOOLS) {
-    p = malloc(sizeofobject);
-  } else {
-    p = hwy::AllocateAlignedBytes(sizeofobject, nullptr, nullptr);
-  }
+  if (zeroed) *zeroed = false;
+  void* p = sizeofobject <= kMaxArenaAllocSize
+                ? AllocFromArena(mem, pool_id, sizeofobject)
+                : AllocBlock(mem, pool_id, sizeofobject, zeroed);
   if (p == nullptr) {
     JPEGLI_ERROR("Out of memory");
   }
-  mem->owned_ptrs[pool_id].push_back(p);
   mem->pool_memory_usage[pool_id] += sizeofobject;
   mem->total_memory_usage += sizeofobject;
   mem->peak_memory_usage =
       std::max(mem->peak_memory_usage, mem->total_memory_usage);
+  const int pub_pool_id = pool_id % JPOOL_NUMPOOLS;
+  mem->pool_peak_memory_usage[pub_pool_id] =
+      std::max(mem->pool_peak_memory_usage[pub_pool_id],
+               mem->pool_memory_usage[pub_pool_id] +
+                   mem->pool_memory_usage[pub_pool_id + JPOOL_NUMPOOLS]);
+  ++mem->pool_num_allocations[pub_pool_id];
+  ++mem->total_num_allocations;
   return p;
 }
 
+void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
+  return AllocImpl(cinfo, pool_id, sizeofobject, nullptr);
+}
+
 constexpr size_t gcd(size_t a, size_t b) { return b == 0 ? a : gcd(b, a % b); }
 constexpr size_t lcm(size_t a, size_t b) { return (a * b) / gcd(a, b); }
 
+// Returns the distance in bytes between the rows of the 2d arrays.
 template <typename T>
-T** Alloc2dArray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow,
-                 JDIMENSION numrows) {
-  T** array = Allocate<T*>(cinfo, numrows, pool_id);
-  // Always use aligned allocator for large 2d arrays.
-  if (pool_id < JPOOL_NUMPOOLS) {
-    pool_id += JPOOL_NUMPOOLS;
-  }
+size_t RowBytes(JDIMENSION samplesperrow) {
   size_t alignment = lcm(sizeof(T), HWY_ALIGNMENT);
-  size_t memstride = RoundUpTo(samplesperrow * sizeof(T), alignment);
-  size_t stride = memstride / sizeof(T);
-  T* buffer = Allocate<T>(cinfo, numrows * stride, pool_id);
+  return RoundUpTo(samplesperrow * sizeof(T), alignment);
+}
+
+template <typename T>
+T** RowPointers(j_common_ptr cinfo, int pool_id, uint8_t* buffer,
+                size_t row_bytes, JDIMENSION numrows) {
+  T** array = Allocate<T*>(cinfo, numrows, pool_id);
   for (size_t i = 0; i < numrows; ++i) {
-    array[i] = &buffer[i * stride];
+    array[i] = reinterpret_cast<T*>(buffer + i * row_bytes);
   }
   return array;
 }
 
+template <typename T>
+T** Alloc2dArrayImpl(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow,
+                     JDIMENSION numrows, bool* zeroed) {
+  const size_t row_bytes = RowBytes<T>(samplesperrow);
+  // Always use aligned allocator for large 2d arrays.
+  int buffer_pool_id =
+      pool_id < JPOOL_NUMPOOLS ? pool_id + JPOOL_NUMPOOLS : pool_id;
+  uint8_t* buffer = static_cast<uint8_t*>(
+      AllocImpl(cinfo, buffer_pool_id, numrows * row_bytes, zeroed));
+  return RowPointers<T>(cinfo, pool_id, buffer, row_bytes, numrows);
+}
+
+template <typename T>
+T** Alloc2dArray(j_common_ptr cinfo, int pool_id, JDIMENSION samplesperrow,
+                 JDIMENSION numrows) {
+  return Alloc2dArrayImpl<T>(cinfo, pool_id, samplesperrow, numrows, nullptr);
+}
+
+// Returns the 2d array in a memory mapped temporary file, or nullptr if the
+// file could not be created.
+template <typename T>
+T** AllocMapped2dArray(j_common_ptr cinfo, int pool_id,
+                       JDIMENSION samplesperrow, JDIMENSION numrows) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  const size_t row_bytes = RowBytes<T>(samplesperrow);
+  const size_t size = numrows * row_bytes;
+  void* buffer = MapTemporaryFile(size);
+  if (buffer == nullptr) {
+    return nullptr;
+  }
+  mem->mapped_blocks[pool_id].push_back({buffer, size, true, false});
+  return RowPointers<T>(cinfo, pool_id, static_cast<uint8_t*>(buffer),
+                        row_bytes, numrows);
+}
+
 template <typename Control, typename T>
 Control* RequestVirtualArray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
                              JDIMENSION samplesperrow, JDIMENSION numrows,
                              JDIMENSION maxaccess) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
   if (pool_id != JPOOL_IMAGE) {
     JPEGLI_ERROR("Only image lifetime virtual arrays are supported.");
   }
   Control* p = Allocate<Control>(cinfo, 1, pool_id);
-  p->full_buffer = Alloc2dArray<T>(cinfo, pool_id, samplesperrow, numrows);
   p->numrows = numrows;
   p->maxaccess = maxaccess;
-  if (pre_zero) {
+  p->backing_store = false;
+  p->row_bytes = RowBytes<T>(samplesperrow);
+  p->prefetch_end = 0;
+  // Arrays that would exceed the memory limit are stored in a temporary file
+  // instead, which is zero-initialized.
+  const uint64_t size = static_cast<uint64_t>(numrows) * p->row_bytes;
+  if (mem->pub.max_memory_to_use > 0 && size > 0 &&
+      mem->total_memory_usage + size >
+          static_cast<uint64_t>(mem->pub.max_memory_to_use)) {
+    p->full_buffer =
+        AllocMapped2dArray<T>(cinfo, pool_id, samplesperrow, numrows);
+    if (p->full_buffer != nullptr) {
+      p->backing_store = true;
+      return p;
+    }
+  }
+  // Fresh huge page mappings are already zero, and leaving them untouched
+  // here lets the rows be placed on the NUMA node of the thread that first
+  // writes them.
+  bool zeroed;
+  p->full_buffer =
+      Alloc2dArrayImpl<T>(cinfo, pool_id, samplesperrow, numrows, &zeroed);
+  if (pre_zero && !zeroed) {
     for (size_t i = 0; i < numrows; ++i) {
       memset(p->full_buffer[i], 0, samplesperrow * sizeof(T));
     }
@@ -109,6 +408,17 @@ Control* RequestVirtualArray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
   return p;
 }
 
+jvirt_barray_control* RequestBlockArray(j_common_ptr cinfo, int pool_id,
+                                       boolean pre_zero,
+                                       JDIMENSION blocksperrow,
+                                       JDIMENSION numrows,
+                                       JDIMENSION maxaccess) {
+  jvirt_barray_control* p = RequestVirtualArray<jvirt_barray_control, JBLOCK>(
+      cinfo, pool_id, pre_zero, blocksperrow, numrows, maxaccess);
+  p->zigzag_order = false;
+  return p;
+}
+
 void RealizeVirtualArrays(j_common_ptr cinfo) {
   // Nothing to do, the full arrays were realized at request time already.
 }
@@ -127,14 +437,44 @@ T** AccessVirtualArray(j_common_ptr cinfo, Control* ptr, JDIMENSION start_row,
   if (ptr->full_buffer == nullptr) {
     JPEGLI_ERROR("Invalid virtual array access, array not realized.");
   }
+  if (ptr->backing_store) {
+    // The passes over the virtual arrays go through the rows in increasing
+    // order, therefore we request the rows after the accessed ones from the
+    // file, and start again when the next pass begins.
+    const size_t end_row = start_row + num_rows;
+    const size_t num_prefetch_rows =
+        std::max<size_t>(ptr->maxaccess, kPrefetchBytes / ptr->row_bytes);
+    if (start_row + num_prefetch_rows < ptr->prefetch_end) {
+      ptr->prefetch_end = start_row;
+    }
+    if (end_row + num_prefetch_rows / 2 > ptr->prefetch_end) {
+      size_t begin = std::max<size_t>(start_row, ptr->prefetch_end);
+      size_t end = std::min(ptr->numrows, end_row + num_prefetch_rows);
+      if (begin < end) {
+        Prefetch(reinterpret_cast<const uint8_t*>(ptr->full_buffer[begin]),
+                 (end - begin) * ptr->row_bytes);
+      }
+      ptr->prefetch_end = end;
+    }
+  }
   return ptr->full_buffer + start_row;
 }
 
 void ClearPool(j_common_ptr cinfo, int pool_id) {
   MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
-  mem->owned_ptrs[pool_id].clear();
+  // The blocks that were not reused by the last image are released.
+  FreeBlocks(mem, &mem->cached_blocks[pool_id], pool_id);
+  FreeMappedBlocks(&mem->mapped_blocks[pool_id]);
+  if (mem->keep_image_memory && pool_id % JPOOL_NUMPOOLS == JPOOL_IMAGE) {
+    std::swap(mem->cached_blocks[pool_id], mem->owned_blocks[pool_id]);
+  } else {
+    FreeBlocks(mem, &mem->owned_blocks[pool_id], pool_id);
+  }
+  mem->arenas[pool_id].next = nullptr;
+  mem->arenas[pool_id].bytes_left = 0;
   mem->total_memory_usage -= mem->pool_memory_usage[pool_id];
   mem->pool_memory_usage[pool_id] = 0;
+  mem->pool_num_allocations[pool_id % JPOOL_NUMPOOLS] = 0;
 }
 
 void FreePool(j_common_ptr cinfo, int pool_id) {
@@ -142,18 +482,13 @@ void FreePool(j_common_ptr cinfo, int pool_id) {
   if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
     JPEGLI_ERROR("Invalid pool id %d", pool_id);
   }
-  for (void* ptr : mem->owned_ptrs[pool_id]) {
-    free(ptr);
-  }
   ClearPool(cinfo, pool_id);
-  for (void* ptr : mem->owned_ptrs[JPOOL_NUMPOOLS + pool_id]) {
-    hwy::FreeAlignedBytes(ptr, nullptr, nullptr);
-  }
   ClearPool(cinfo, JPOOL_NUMPOOLS + pool_id);
 }
 
 void SelfDestruct(j_common_ptr cinfo) {
   MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  mem->keep_image_memory = false;
   for (int pool_id = 0; pool_id < JPOOL_NUMPOOLS; ++pool_id) {
     FreePool(cinfo, pool_id);
   }
@@ -171,8 +506,7 @@ void InitMemoryManager(j_common_ptr cinfo) {
   mem->pub.alloc_barray = jpegli::Alloc2dArray<JBLOCK>;
   mem->pub.request_virt_sarray =
       jpegli::RequestVirtualArray<jvirt_sarray_control, JSAMPLE>;
-  mem->pub.request_virt_barray =
-      jpegli::RequestVirtualArray<jvirt_barray_control, JBLOCK>;
+  mem->pub.request_virt_barray = jpegli::RequestBlockArray;
   mem->pub.realize_virt_arrays = jpegli::RealizeVirtualArrays;
   mem->pub.access_virt_sarray =
       jpegli::AccessVirtualArray<jvirt_sarray_control, JSAMPLE>;
@@ -181,10 +515,120 @@ void InitMemoryManager(j_common_ptr cinfo) {
   mem->pub.free_pool = jpegli::FreePool;
   mem->pub.self_destruct = jpegli::SelfDestruct;
   mem->pub.max_memory_to_use = 0;
+  mem->keep_image_memory = false;
+  mem->use_huge_pages = false;
+  mem->custom_allocator = {nullptr, nullptr, nullptr};
   mem->total_memory_usage = 0;
   mem->peak_memory_usage = 0;
+  mem->total_num_allocations = 0;
+  memset(mem->arenas, 0, sizeof(mem->arenas));
   memset(mem->pool_memory_usage, 0, sizeof(mem->pool_memory_usage));
+  memset(mem->pool_peak_memory_usage, 0, sizeof(mem->pool_peak_memory_usage));
+  memset(mem->pool_num_allocations, 0, sizeof(mem->pool_num_allocations));
   cinfo->mem = reinterpret_cast<struct jpeg_memory_mgr*>(mem);
 }
 
+void KeepImageMemory(j_common_ptr cinfo, bool keep) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  mem->keep_image_memory = keep;
+}
+
+void UseHugePages(j_common_ptr cinfo, bool enable) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  mem->use_huge_pages = enable;
+}
+
+void SetMemoryManager(j_common_ptr cinfo,
+                      const JxlMemoryManager* memory_manager) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  if (mem->custom_allocator.alloc != nullptr) {
+    JPEGLI_ERROR("Memory manager can be set only once.");
+  }
+  if (memory_manager == nullptr || memory_manager->alloc == nullptr) {
+    return;
+  }
+  if (memory_manager->free == nullptr) {
+    JPEGLI_ERROR("Memory manager has no free function.");
+  }
+  mem->custom_allocator = *memory_manager;
+}
+
+void GetMemoryStats(j_common_ptr cinfo, jpegli_memory_stats* stats) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  for (int pool_id = 0; pool_id < JPOOL_NUMPOOLS; ++pool_id) {
+    jpegli_pool_memory_stats* pool = &stats->pools[pool_id];
+    pool->current_bytes = mem->pool_memory_usage[pool_id] +
+                          mem->pool_memory_usage[pool_id + JPOOL_NUMPOOLS];
+    pool->peak_bytes = mem->pool_peak_memory_usage[pool_id];
+    pool->num_allocations = mem->pool_num_allocations[pool_id];
+  }
+  stats->current_bytes = mem->total_memory_usage;
+  stats->peak_bytes = mem->peak_memory_usage;
+  stats->total_allocations = mem->total_num_allocations;
+  stats->backing_store_bytes = 0;
+  for (const auto& blocks : mem->mapped_blocks) {
+    for (const MemoryBlock& block : blocks) {
+      stats->backing_store_bytes += block.size;
+    }
+  }
+}
+
+void RequestInterleavedBlockArrays(j_common_ptr cinfo, int num_arrays,
+                                   const JDIMENSION* blocksperrow,
+                                   const JDIMENSION* numrows,
+                                   const JDIMENSION* rows_per_group,
+                                   jvirt_barray_ptr* arrays) {
+  MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
+  size_t num_groups = 0;
+  size_t group_bytes = 0;
+  for (int i = 0; i < num_arrays; ++i) {
+    num_groups =
+        std::max<size_t>(num_groups, DivCeil(numrows[i], rows_per_group[i]));
+    group_bytes += rows_per_group[i] * RowBytes<JBLOCK>(blocksperrow[i]);
+  }
+  const uint64_t size = static_cast<uint64_t>(num_groups) * group_bytes;
+  if (mem->pub.max_memory_to_use > 0 &&
+      mem->total_memory_usage + size >
+          static_cast<uint64_t>(mem->pub.max_memory_to_use)) {
+    // The arrays that do not fit are stored in temporary files.
+    for (int i = 0; i < num_arrays; ++i) {
+      arrays[i] = RequestBlockArray(cinfo, JPOOL_IMAGE, TRUE, blocksperrow[i],
+                                    numrows[i], rows_per_group[i]);
+    }
+    return;
+  }
+  bool zeroed;
+  uint8_t* buffer = static_cast<uint8_t*>(
+      AllocImpl(cinfo, JPOOL_IMAGE_ALIGNED, size, &zeroed));
+  if (!zeroed) {
+    memset(buffer, 0, size);
+  }
+  size_t offset = 0;
+  for (int i = 0; i < num_arrays; ++i) {
+    jvirt_barray_control* p =
+        Allocate<jvirt_barray_control>(cinfo, 1, JPOOL_IMAGE);
+    p->numrows = numrows[i];
+    p->maxaccess = rows_per_group[i];
+    p->backing_store = false;
+    p->row_bytes = RowBytes<JBLOCK>(blocksperrow[i]);
+    p->prefetch_end = 0;
+    p->zigzag_order = false;
+    p->full_buffer = Allocate<JBLOCKROW>(cinfo, numrows[i], JPOOL_IMAGE);
+    for (size_t y = 0; y < numrows[i]; ++y) {
+      size_t group = y / rows_per_group[i];
+      size_t row = y % rows_per_group[i];
+      p->full_buffer[y] = reinterpret_cast<JBLOCKROW>(
+          buffer + group * group_bytes + offset + row * p->row_bytes);
+    }
+    offset += rows_per_group[i] * p->row_bytes;
+    arrays[i] = p;
+  }
+}
+
+bool IsZigZagOrder(jvirt_barray_ptr array) { return array->zigzag_order; }
+
+void SetZigZagOrder(jvirt_barray_ptr array, bool zigzag_order) {
+  array->zigzag_order = zigzag_order;
+}
+
 }  // namespace jpegli
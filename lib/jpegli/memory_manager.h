@@ -9,6 +9,7 @@
 
 #include <cstdlib>
 
+#include "lib/base/memory_manager.h"
 #include "lib/jpegli/common.h"
 
 #define JPOOL_PERMANENT_ALIGNED (JPOOL_NUMPOOLS + JPOOL_PERMANENT)
@@ -18,6 +19,35 @@ namespace jpegli {
 
 void InitMemoryManager(j_common_ptr cinfo);
 
+void KeepImageMemory(j_common_ptr cinfo, bool keep);
+
+void UseHugePages(j_common_ptr cinfo, bool enable);
+
+void SetMemoryManager(j_common_ptr cinfo,
+                      const JxlMemoryManager* memory_manager);
+
+void GetMemoryStats(j_common_ptr cinfo, jpegli_memory_stats* stats);
+
+// Requests num_arrays zero-initialized image lifetime block arrays, like
+// request_virt_barray, whose rows are stored in one buffer in groups: group g
+// has rows [g * rows_per_group[i], (g + 1) * rows_per_group[i]) of each array i
+// in turn. The arrays are accessed as any other block array, but the rows of a
+// group are next to each other in memory. If the buffer would exceed the
+// memory limit, the arrays are requested separately instead.
+void RequestInterleavedBlockArrays(j_common_ptr cinfo, int num_arrays,
+                                   const JDIMENSION* blocksperrow,
+                                   const JDIMENSION* numrows,
+                                   const JDIMENSION* rows_per_group,
+                                   jvirt_barray_ptr* arrays);
+
+// Whether the coefficients of the blocks of a block array of this memory
+// manager are in zigzag order instead of the natural order. Only the decoder
+// sets it, see jpegli_set_zigzag_coefficients(), and the encoder writes such
+// arrays without reordering the coefficients.
+bool IsZigZagOrder(jvirt_barray_ptr array);
+
+void SetZigZagOrder(jvirt_barray_ptr array, bool zigzag_order);
+
 template <typename T>
 T* Allocate(j_common_ptr cinfo, size_t len, int pool_id = JPOOL_PERMANENT) {
   const size_t size = len * sizeof(T);  // NOLINT
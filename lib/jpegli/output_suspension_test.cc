@@ -187,6 +187,90 @@ TEST_P(OutputSuspensionTestParam, RawData) {
   VerifyOutputImage(input, output, 3.5);
 }
 
+TEST(OutputSuspensionTest, EncodeStep) {
+  TestImage input;
+  input.xsize = 517;
+  input.ysize = 523;
+  GeneratePixels(&input);
+  // The scan data of mode 1 has restart markers, and that of mode 2 is kept in
+  // memory while the destination suspends.
+  for (int mode : {0, 1, 2}) {
+    for (int progressive_level : {0, 2}) {
+      for (boolean optimize_coding : {FALSE, TRUE}) {
+        if (mode == 2 && (progressive_level > 0 || !optimize_coding)) continue;
+        const auto set_params = [&](j_compress_ptr cinfo) {
+          cinfo->image_width = input.xsize;
+          cinfo->image_height = input.ysize;
+          cinfo->input_components = input.components;
+          cinfo->in_color_space = JCS_RGB;
+          jpegli_set_defaults(cinfo);
+          jpegli_set_progressive_level(cinfo, progressive_level);
+          cinfo->optimize_coding = optimize_coding;
+          if (mode == 1) cinfo->restart_in_rows = 3;
+          if (mode == 2) jpegli_use_two_pass_tokenization(cinfo, TRUE);
+        };
+        std::vector<uint8_t> expected;
+        jpeg_compress_struct cinfo = {};
+        DestinationManager dest;
+        std::vector<uint8_t> compressed;
+        size_t num_yields = 0;
+        size_t num_suspensions = 0;
+        const auto try_catch_block = [&]() -> bool {
+          ERROR_HANDLER_SETUP(jpegli);
+          jpegli_create_compress(&cinfo);
+          // Reference output with a destination that does not suspend.
+          unsigned char* buffer = nullptr;
+          unsigned long buffer_size = 0;  // NOLINT
+          jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+          set_params(&cinfo);
+          jpegli_start_compress(&cinfo, TRUE);
+          size_t stride = cinfo.image_width * cinfo.input_components;
+          std::vector<JSAMPROW> rows(cinfo.image_height);
+          for (size_t y = 0; y < rows.size(); ++y) {
+            rows[y] = &input.pixels[y * stride];
+          }
+          jpegli_write_scanlines(&cinfo, rows.data(), cinfo.image_height);
+          jpegli_finish_compress(&cinfo);
+          expected.assign(buffer, buffer + buffer_size);
+          free(buffer);
+
+          cinfo.dest = reinterpret_cast<jpeg_destination_mgr*>(&dest);
+          set_params(&cinfo);
+          jpegli_start_compress(&cinfo, TRUE);
+          EXPECT_EQ(JPEGLI_STEP_NEED_INPUT, jpegli_encode_step(&cinfo, 1));
+          while (cinfo.next_scanline < cinfo.image_height) {
+            if (jpegli_write_scanlines(&cinfo, &rows[cinfo.next_scanline],
+                                       cinfo.image_height -
+                                           cinfo.next_scanline) == 0) {
+              dest.EmptyTo(&compressed, kInitialBufferSize);
+            }
+          }
+          // With a one byte output buffer, every unit of the step suspends.
+          dest.EmptyTo(&compressed, 1);
+          for (;;) {
+            JpegliStepStatus status = jpegli_encode_step(&cinfo, 1);
+            if (status == JPEGLI_STEP_DONE) break;
+            if (status == JPEGLI_STEP_YIELD) {
+              ++num_yields;
+            } else {
+              EXPECT_EQ(JPEGLI_STEP_NEED_OUTPUT, status);
+              ++num_suspensions;
+              dest.EmptyTo(&compressed);
+            }
+          }
+          dest.EmptyTo(&compressed);
+          return true;
+        };
+        ASSERT_TRUE(try_catch_block());
+        jpegli_destroy_compress(&cinfo);
+        EXPECT_GT(num_yields, 0u);
+        EXPECT_GT(num_suspensions, 0u);
+        EXPECT_EQ(expected, compressed);
+      }
+    }
+  }
+}
+
 std::vector<TestConfig> GenerateTests() {
   std::vector<TestConfig> all_tests;
   const size_t xsize0 = 1920;
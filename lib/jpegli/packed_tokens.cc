@@ -0,0 +1,99 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "lib/jpegli/packed_tokens.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "lib/base/byte_order.h"
+#include "lib/base/status.h"
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/memory_manager.h"
+
+namespace jpegli {
+
+namespace {
+
+// Writes the symbol stream of the tokens and the start of each checkpoint in
+// it, or if symbols is nullptr, only computes its size. Returns the size of
+// the symbol stream.
+size_t PackSymbols(const Token* tokens, size_t num_tokens, uint8_t* symbols,
+                   size_t* checkpoints) {
+  uint8_t next_context[256];
+  int context = 0;
+  size_t pos = 0;
+  const auto emit = [&](int value) {
+    if (symbols) symbols[pos] = value;
+    ++pos;
+  };
+  for (size_t i = 0; i < num_tokens; ++i) {
+    const Token& t = tokens[i];
+    if (i % kPackedTokensPerCheckpoint == 0) {
+      for (int c = 0; c < 256; ++c) next_context[c] = c;
+      if (checkpoints) checkpoints[2 * (i / kPackedTokensPerCheckpoint)] = pos;
+      emit(kContextPrefix);
+      emit(t.context);
+    } else if (t.symbol >= kNextContextPrefix ||
+               (t.context != context && next_context[context] != t.context)) {
+      next_context[context] = t.context;
+      emit(kContextPrefix);
+      emit(t.context);
+    } else if (t.context != context) {
+      emit(kNextContextPrefix);
+    }
+    context = t.context;
+    emit(t.symbol);
+  }
+  return pos;
+}
+
+}  // namespace
+
+void PackTokens(j_compress_ptr cinfo, const Token* tokens, TokenArray* ta) {
+  const size_t num_tokens = ta->num_tokens;
+  ta->tokens = nullptr;
+  if (num_tokens == 0) {
+    return;
+  }
+  const size_t num_symbol_bytes =
+      PackSymbols(tokens, num_tokens, nullptr, nullptr);
+  size_t num_bits = 0;
+  for (size_t i = 0; i < num_tokens; ++i) {
+    num_bits += kNumExtraBits[tokens[i].symbol];
+  }
+  // The reader loads the extra bits 8 bytes at a time.
+  const size_t num_bit_bytes = DivCeil(num_bits, 8) + 8;
+  const size_t num_checkpoints =
+      DivCeil(num_tokens, kPackedTokensPerCheckpoint);
+  uint8_t* symbols = Allocate<uint8_t>(cinfo, num_symbol_bytes, JPOOL_IMAGE);
+  uint8_t* bits = Allocate<uint8_t>(cinfo, num_bit_bytes, JPOOL_IMAGE);
+  size_t* checkpoints =
+      Allocate<size_t>(cinfo, 2 * num_checkpoints, JPOOL_IMAGE);
+  PackSymbols(tokens, num_tokens, symbols, checkpoints);
+  memset(bits, 0, num_bit_bytes);
+  size_t bit_pos = 0;
+  for (size_t i = 0; i < num_tokens; ++i) {
+    const Token& t = tokens[i];
+    if (i % kPackedTokensPerCheckpoint == 0) {
+      checkpoints[2 * (i / kPackedTokensPerCheckpoint) + 1] = bit_pos;
+    }
+    const int nbits = kNumExtraBits[t.symbol];
+    JXL_DASSERT((t.bits >> nbits) == 0);
+    uint8_t* p = bits + (bit_pos >> 3);
+    StoreLE64(LoadLE64(p) | (static_cast<uint64_t>(t.bits) << (bit_pos & 7)),
+              p);
+    bit_pos += nbits;
+  }
+  ta->packed_symbols = symbols;
+  ta->packed_bits = bits;
+  ta->checkpoints = checkpoints;
+}
+
+}  // namespace jpegli
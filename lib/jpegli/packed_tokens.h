@@ -0,0 +1,136 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+// Variable length representation of the token arrays, used with
+// jpegli_use_compact_tokens().
+//
+// The symbols of a packed token array are stored in a byte stream, one byte
+// per token. If the context of a token differs from that of the previous
+// token, its symbol byte is preceded by kNextContextPrefix if the new context
+// is the one that followed the previous context the last time, or otherwise
+// by kContextPrefix and the new context byte. The second form is also used for
+// tokens with a symbol that is one of the prefixes, and for the first token of
+// every kPackedTokensPerCheckpoint tokens, where the reader can start and the
+// table of context successors is reset. The kNumExtraBits[symbol] extra bits
+// of the tokens are stored in a separate LSB-first bit stream.
+
+#ifndef LIB_JPEGLI_PACKED_TOKENS_H_
+#define LIB_JPEGLI_PACKED_TOKENS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "lib/base/byte_order.h"
+#include "lib/base/compiler_specific.h"
+#include "lib/base/status.h"
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/encode_internal.h"
+
+namespace jpegli {
+
+// Number of extra bits that follow the Huffman code of each symbol.
+constexpr uint8_t kNumExtraBits[256] = {
+    0,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    1,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    2,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    3,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    4,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    5,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    6,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    7,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    8,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    9,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    10, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    11, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    12, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    13, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    14, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+    0,  1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,  //
+};
+
+constexpr uint8_t kNextContextPrefix = 0xFE;
+constexpr uint8_t kContextPrefix = 0xFF;
+constexpr size_t kPackedTokensPerCheckpoint = 1024;
+
+// Replaces the tokens of the token array with their packed representation,
+// where tokens points to the ta->num_tokens tokens of the array. Sets
+// ta->tokens to nullptr.
+void PackTokens(j_compress_ptr cinfo, const Token* tokens, TokenArray* ta);
+
+// Reads the tokens of a packed token array sequentially.
+class PackedTokenReader {
+ public:
+  // Starts reading at the token with index pos, which must be smaller than
+  // the number of tokens of the array.
+  PackedTokenReader(const TokenArray& ta, size_t pos)
+      : symbols_(ta.packed_symbols), bits_(ta.packed_bits) {
+    JXL_DASSERT(pos < ta.num_tokens);
+    const size_t* checkpoint =
+        &ta.checkpoints[2 * (pos / kPackedTokensPerCheckpoint)];
+    symbol_pos_ = checkpoint[0];
+    bit_pos_ = checkpoint[1];
+    for (size_t i = pos % kPackedTokensPerCheckpoint; i > 0; --i) {
+      Next();
+    }
+  }
+
+  JXL_INLINE Token Next() {
+    int symbol = symbols_[symbol_pos_++];
+    if (tokens_to_checkpoint_ == 0) {
+      for (int c = 0; c < 256; ++c) next_context_[c] = c;
+      tokens_to_checkpoint_ = kPackedTokensPerCheckpoint;
+      context_ = symbols_[symbol_pos_];
+      symbol = symbols_[symbol_pos_ + 1];
+      symbol_pos_ += 2;
+    } else if (symbol == kContextPrefix) {
+      int context = symbols_[symbol_pos_];
+      next_context_[context_] = context;
+      context_ = context;
+      symbol = symbols_[symbol_pos_ + 1];
+      symbol_pos_ += 2;
+    } else if (symbol == kNextContextPrefix) {
+      context_ = next_context_[context_];
+      symbol = symbols_[symbol_pos_++];
+    }
+    --tokens_to_checkpoint_;
+    int nbits = kNumExtraBits[symbol];
+    uint64_t bits = LoadLE64(bits_ + (bit_pos_ >> 3)) >> (bit_pos_ & 7);
+    bit_pos_ += nbits;
+    return Token(context_, symbol, bits & ((1u << nbits) - 1));
+  }
+
+ private:
+  const uint8_t* symbols_;
+  const uint8_t* bits_;
+  size_t symbol_pos_;
+  size_t bit_pos_;
+  // The first token read is always at a checkpoint.
+  size_t tokens_to_checkpoint_ = 0;
+  int context_ = 0;
+  uint8_t next_context_[256];
+};
+
+// Calls visit(i, token) for the tokens of the token array with indexes in
+// [begin, end), regardless of whether the array is packed or not.
+template <typename Visitor>
+JXL_INLINE void VisitTokens(const TokenArray& ta, size_t begin, size_t end,
+                            const Visitor& visit) {
+  if (begin >= end) return;
+  if (ta.tokens != nullptr) {
+    for (size_t i = begin; i < end; ++i) {
+      visit(i, ta.tokens[i]);
+    }
+  } else {
+    PackedTokenReader reader(ta, begin);
+    for (size_t i = begin; i < end; ++i) {
+      visit(i, reader.Next());
+    }
+  }
+}
+
+}  // namespace jpegli
+
+#endif  // LIB_JPEGLI_PACKED_TOKENS_H_
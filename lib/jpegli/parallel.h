@@ -0,0 +1,109 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef LIB_JPEGLI_PARALLEL_H_
+#define LIB_JPEGLI_PARALLEL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "lib/base/parallel_runner.h"
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/error.h"
+
+namespace jpegli {
+
+namespace detail {
+
+template <typename Func>
+int ParallelInit(void* /* opaque */, size_t /* num_threads */) {
+  return JXL_PARALLEL_RET_SUCCESS;
+}
+
+template <typename Func>
+void ParallelCall(void* opaque, uint32_t value, size_t thread_id) {
+  (*static_cast<const Func*>(opaque))(value, thread_id);
+}
+
+template <typename InitFunc, typename Func>
+struct ParallelFuncs {
+  const InitFunc* init;
+  const Func* func;
+};
+
+template <typename InitFunc, typename Func>
+int ParallelInitWith(void* opaque, size_t num_threads) {
+  const auto* funcs = static_cast<const ParallelFuncs<InitFunc, Func>*>(opaque);
+  return (*funcs->init)(num_threads) ? JXL_PARALLEL_RET_SUCCESS
+                                     : JXL_PARALLEL_RET_RUNNER_ERROR;
+}
+
+template <typename InitFunc, typename Func>
+void ParallelCallWith(void* opaque, uint32_t value, size_t thread_id) {
+  const auto* funcs = static_cast<const ParallelFuncs<InitFunc, Func>*>(opaque);
+  (*funcs->func)(value, thread_id);
+}
+
+}  // namespace detail
+
+// Calls func(task, thread_id) for every task in [begin, end), using the
+// parallel runner of the compressor or decompressor object if one was set, or
+// sequentially on the calling thread otherwise.
+//
+// The calls may happen on worker threads, therefore func must not use any
+// of the libjpeg error handling machinery (including JPEGLI_ERROR and the
+// memory manager), and must only write to data that is not shared between the
+// tasks.
+template <typename CInfoType, typename Func>
+void RunParallel(CInfoType cinfo, uint32_t begin, uint32_t end,
+                 const Func& func) {
+  JxlParallelRunner runner = cinfo->master->runner;
+  if (runner == nullptr || end - begin <= 1) {
+    for (uint32_t i = begin; i < end; ++i) {
+      func(i, 0);
+    }
+    return;
+  }
+  void* opaque = const_cast<void*>(static_cast<const void*>(&func));
+  JxlParallelRetCode ret =
+      (*runner)(cinfo->master->runner_opaque, opaque,
+                &detail::ParallelInit<Func>, &detail::ParallelCall<Func>,
+                begin, end);
+  if (ret != JXL_PARALLEL_RET_SUCCESS) {
+    JPEGLI_ERROR("Parallel runner failed with error code %d", ret);
+  }
+}
+
+// Same as above, but first calls init(num_threads) on the calling thread, where
+// num_threads is larger than any thread_id of the func calls, e.g. to set up
+// per-thread state; init returns false on failure. The restrictions of func
+// apply to init as well.
+template <typename CInfoType, typename InitFunc, typename Func>
+void RunParallel(CInfoType cinfo, uint32_t begin, uint32_t end,
+                 const InitFunc& init, const Func& func) {
+  JxlParallelRunner runner = cinfo->master->runner;
+  if (runner == nullptr || end - begin <= 1) {
+    if (!init(1)) {
+      JPEGLI_ERROR("Parallel initialization failed");
+    }
+    for (uint32_t i = begin; i < end; ++i) {
+      func(i, 0);
+    }
+    return;
+  }
+  detail::ParallelFuncs<InitFunc, Func> funcs = {&init, &func};
+  JxlParallelRetCode ret = (*runner)(
+      cinfo->master->runner_opaque, &funcs,
+      &detail::ParallelInitWith<InitFunc, Func>,
+      &detail::ParallelCallWith<InitFunc, Func>, begin, end);
+  if (ret != JXL_PARALLEL_RET_SUCCESS) {
+    JPEGLI_ERROR("Parallel runner failed with error code %d", ret);
+  }
+}
+
+}  // namespace jpegli
+
+#endif  // LIB_JPEGLI_PARALLEL_H_
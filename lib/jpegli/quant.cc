@@ -10,6 +10,8 @@
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <mutex>
 
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
@@ -571,32 +573,70 @@ float ScaleToDistance(float scale, int k) {
   return std::min<float>(2.0f * scale, mul * std::pow(scale, exp));
 }
 
-float QuantValsToDistance(j_compress_ptr cinfo) {
-  jpeg_comp_master* m = cinfo->master;
-  float global_scale = kGlobalScaleYCbCr;
-  if (m->cicp_transfer_function == kTransferFunctionPQ) {
-    global_scale *= .4f;
-  } else if (m->cicp_transfer_function == kTransferFunctionHLG) {
-    global_scale *= .5f;
+// Process-wide cache of the most recently computed values of a function of
+// Key, which must be zero-initialized before its fields are set, so that the
+// keys can be compared including their padding.
+template <typename Key, typename Value>
+class ComputationCache {
+ public:
+  template <typename Func>
+  Value Get(const Key& key, const Func& compute) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < num_entries_; ++i) {
+      if (memcmp(&entries_[i].key, &key, sizeof(key)) == 0) {
+        return entries_[i].value;
+      }
+    }
+    Entry* entry = &entries_[next_entry_];
+    next_entry_ = (next_entry_ + 1) % kNumEntries;
+    num_entries_ = std::min(num_entries_ + 1, kNumEntries);
+    entry->key = key;
+    entry->value = compute();
+    return entry->value;
   }
-  int quant_max = m->force_baseline ? 255 : 32767U;
+
+ private:
+  static constexpr size_t kNumEntries = 8;
+  struct Entry {
+    Key key;
+    Value value;
+  };
+  Entry entries_[kNumEntries];
+  size_t num_entries_ = 0;
+  size_t next_entry_ = 0;
+  std::mutex mutex_;
+};
+
+// The quantization table values of the components, together with the
+// parameters that are needed to map them back to a distance.
+struct QuantValsKey {
+  float global_scale;
+  int quant_max;
+  int num_components;
+  int quant_tbl_no[kMaxComponents];
+  UINT16 quantval[kMaxComponents][DCTSIZE2];
+};
+
+ComputationCache<QuantValsKey, float> quant_distance_cache;
+
+float QuantValsToDistance(const QuantValsKey& key) {
   static const float kDistMax = 10000.0f;
   float dist_min = 0.0f;
   float dist_max = kDistMax;
-  for (int c = 0; c < cinfo->num_components; ++c) {
-    int quant_idx = cinfo->comp_info[c].quant_tbl_no;
-    uint16_t* quantval = cinfo->quant_tbl_ptrs[quant_idx]->quantval;
-    const float* base_qm = &kBaseQuantMatrixYCbCr[quant_idx * DCTSIZE2];
+  for (int c = 0; c < key.num_components; ++c) {
+    const UINT16* quantval = key.quantval[c];
+    const float* base_qm =
+        &kBaseQuantMatrixYCbCr[key.quant_tbl_no[c] * DCTSIZE2];
     for (int k = 0; k < DCTSIZE2; ++k) {
       float dmin = 0.0;
       float dmax = kDistMax;
-      float invq = 1.0f / base_qm[k] / global_scale;
+      float invq = 1.0f / base_qm[k] / key.global_scale;
       int qval = quantval[k];
       if (qval > 1) {
         float scale_min = (qval - 0.5f) * invq;
         dmin = ScaleToDistance(scale_min, k);
       }
-      if (qval < quant_max) {
+      if (qval < key.quant_max) {
         float scale_max = (qval + 0.5f) * invq;
         dmax = ScaleToDistance(scale_max, k);
       }
@@ -619,6 +659,107 @@ float QuantValsToDistance(j_compress_ptr cinfo) {
   return distance;
 }
 
+}  // namespace
+
+float QuantValsToDistance(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  QuantValsKey key;
+  memset(&key, 0, sizeof(key));
+  key.global_scale = kGlobalScaleYCbCr;
+  if (m->cicp_transfer_function == kTransferFunctionPQ) {
+    key.global_scale *= .4f;
+  } else if (m->cicp_transfer_function == kTransferFunctionHLG) {
+    key.global_scale *= .5f;
+  }
+  key.quant_max = m->force_baseline ? 255 : 32767U;
+  key.num_components = cinfo->num_components;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const int quant_idx = cinfo->comp_info[c].quant_tbl_no;
+    key.quant_tbl_no[c] = quant_idx;
+    memcpy(key.quantval[c], cinfo->quant_tbl_ptrs[quant_idx]->quantval,
+           sizeof(key.quantval[c]));
+  }
+  return quant_distance_cache.Get(
+      key, [&key]() { return QuantValsToDistance(key); });
+}
+
+float QuantValsToDistance(j_decompress_ptr cinfo) {
+  QuantValsKey key;
+  memset(&key, 0, sizeof(key));
+  key.global_scale = kGlobalScaleYCbCr;
+  key.quant_max = 255;
+  key.num_components = cinfo->num_components;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const JQUANT_TBL* table =
+        cinfo->quant_tbl_ptrs[cinfo->comp_info[c].quant_tbl_no];
+    // The chroma components are compared to the base tables of Cb and Cr,
+    // everything else to the base table of Y.
+    key.quant_tbl_no[c] = cinfo->jpeg_color_space == JCS_YCbCr ? c : 0;
+    memcpy(key.quantval[c], table->quantval, sizeof(key.quantval[c]));
+    for (int k = 0; k < DCTSIZE2; ++k) {
+      if (table->quantval[k] > 255) key.quant_max = 32767U;
+    }
+  }
+  return quant_distance_cache.Get(
+      key, [&key]() { return QuantValsToDistance(key); });
+}
+
+int QuantValsToLibjpegQuality(const JQUANT_TBL* table) {
+  // Inverse of jpegli_quality_scaling() for the scaling factor that maps the
+  // Annex K luminance table to the given one on average.
+  float sum_std = 0.0f;
+  float sum = 0.0f;
+  for (int k = 0; k < DCTSIZE2; ++k) {
+    sum_std += kBaseQuantMatrixStd[k];
+    sum += table->quantval[k];
+  }
+  float scale = std::max(1.0f, 100.0f * sum / sum_std);
+  float quality = scale <= 100.0f ? (200.0f - scale) / 2 : 5000.0f / scale;
+  return std::min(100, std::max(1, static_cast<int>(std::lround(quality))));
+}
+
+namespace {
+
+// Everything that the quantization tables of SetQuantMatrices() depend on.
+struct QuantTablesKey {
+  float distances[NUM_QUANT_TBLS];
+  const float* base_quant_matrix[NUM_QUANT_TBLS];
+  int num_base_tables;
+  float global_scale;
+  int quant_max;
+  bool non_linear_scaling;
+  bool is_yuv420;
+};
+
+struct QuantTables {
+  UINT16 quantval[NUM_QUANT_TBLS][DCTSIZE2];
+};
+
+ComputationCache<QuantTablesKey, QuantTables> quant_tables_cache;
+
+QuantTables ComputeQuantTables(const QuantTablesKey& key) {
+  QuantTables tables = {};
+  for (int quant_idx = 0; quant_idx < key.num_base_tables; ++quant_idx) {
+    const float* base_qm = key.base_quant_matrix[quant_idx];
+    const float distance = key.distances[quant_idx];
+    for (int k = 0; k < DCTSIZE2; ++k) {
+      float scale = key.global_scale;
+      if (key.non_linear_scaling) {
+        scale *= DistanceToScale(distance, k);
+        if (key.is_yuv420 && quant_idx > 0) {
+          scale *= k420Rescale[k];
+        }
+      } else {
+        scale *= DistanceToLinearQuality(distance);
+      }
+      int qval = std::round(scale * base_qm[k]);
+      tables.quantval[quant_idx][k] =
+          std::max(1, std::min(qval, key.quant_max));
+    }
+  }
+  return tables;
+}
+
 bool IsYUV420(j_compress_ptr cinfo) {
   return (cinfo->jpeg_color_space == JCS_YCbCr &&
           cinfo->comp_info[0].h_samp_factor == 2 &&
@@ -680,26 +821,26 @@ void SetQuantMatrices(j_compress_ptr cinfo, float distances[NUM_QUANT_TBLS],
     base_quant_matrix[1] = kBaseQuantMatrixStd + DCTSIZE2;
   }
 
-  int quant_max = m->force_baseline ? 255 : 32767U;
+  QuantTablesKey key;
+  memset(&key, 0, sizeof(key));
+  for (int quant_idx = 0; quant_idx < num_base_tables; ++quant_idx) {
+    key.distances[quant_idx] = distances[quant_idx];
+    key.base_quant_matrix[quant_idx] = base_quant_matrix[quant_idx];
+  }
+  key.num_base_tables = num_base_tables;
+  key.global_scale = global_scale;
+  key.quant_max = m->force_baseline ? 255 : 32767U;
+  key.non_linear_scaling = non_linear_scaling;
+  key.is_yuv420 = is_yuv420;
+  const QuantTables tables =
+      quant_tables_cache.Get(key, [&key]() { return ComputeQuantTables(key); });
   for (int quant_idx = 0; quant_idx < num_base_tables; ++quant_idx) {
-    const float* base_qm = base_quant_matrix[quant_idx];
     JQUANT_TBL** qtable = &cinfo->quant_tbl_ptrs[quant_idx];
     if (*qtable == nullptr) {
       *qtable = jpegli_alloc_quant_table(reinterpret_cast<j_common_ptr>(cinfo));
     }
-    for (int k = 0; k < DCTSIZE2; ++k) {
-      float scale = global_scale;
-      if (non_linear_scaling) {
-        scale *= DistanceToScale(distances[quant_idx], k);
-        if (is_yuv420 && quant_idx > 0) {
-          scale *= k420Rescale[k];
-        }
-      } else {
-        scale *= DistanceToLinearQuality(distances[quant_idx]);
-      }
-      int qval = std::round(scale * base_qm[k]);
-      (*qtable)->quantval[k] = std::max(1, std::min(qval, quant_max));
-    }
+    memcpy((*qtable)->quantval, tables.quantval[quant_idx],
+           sizeof((*qtable)->quantval));
     (*qtable)->sent_table = FALSE;
   }
 }
@@ -22,6 +22,19 @@ enum QuantPass {
 
 void InitQuantizer(j_compress_ptr cinfo, QuantPass pass);
 
+// Returns the distance that the quantization tables of the components
+// correspond to.
+float QuantValsToDistance(j_compress_ptr cinfo);
+
+// Returns the distance that the quantization tables of the components of an
+// image being decoded would correspond to if jpegli had made them. All the
+// tables of the components must be present.
+float QuantValsToDistance(j_decompress_ptr cinfo);
+
+// Returns the libjpeg quality whose scaled Annex K luminance table is closest
+// on average to the given table.
+int QuantValsToLibjpegQuality(const JQUANT_TBL* table);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_QUANT_H_
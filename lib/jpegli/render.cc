@@ -22,8 +22,12 @@
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/decode_internal.h"
+#include "lib/jpegli/decode_scan.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/idct.h"
+#include "lib/jpegli/parallel.h"
+#include "lib/jpegli/resize.h"
+#include "lib/jpegli/stage_stats.h"
 #include "lib/jpegli/types.h"
 #include "lib/jpegli/upsample.h"
 
@@ -55,10 +59,12 @@ namespace HWY_NAMESPACE {
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Abs;
 using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::BitCast;
 using hwy::HWY_NAMESPACE::Clamp;
 using hwy::HWY_NAMESPACE::Gt;
 using hwy::HWY_NAMESPACE::IfThenElseZero;
 using hwy::HWY_NAMESPACE::Mul;
+using hwy::HWY_NAMESPACE::MulAdd;
 using hwy::HWY_NAMESPACE::NearestInt;
 using hwy::HWY_NAMESPACE::Or;
 using hwy::HWY_NAMESPACE::Rebind;
@@ -156,6 +162,25 @@ void StoreUnsignedRow(float* JXL_RESTRICT input[], size_t x0, size_t len,
 #endif
 }
 
+// Same as StoreUnsignedRow(), but stores the pixels that fill whole vectors
+// directly into output, and only the rest of them through scratch, so that
+// nothing is written past the end of the output row.
+template <typename T>
+void StoreUnsignedRowDirect(float* JXL_RESTRICT input[], size_t x0,
+                            size_t len, size_t num_channels, float multiplier,
+                            T* JXL_RESTRICT scratch, T* JXL_RESTRICT output) {
+  // The vectors of StoreUnsignedRow() have at most 8 lanes.
+  size_t direct_len = len & ~static_cast<size_t>(7);
+  StoreUnsignedRow(input, x0, direct_len, num_channels, multiplier, output);
+  if (direct_len < len) {
+    size_t tail_len = len - direct_len;
+    StoreUnsignedRow(input, x0 + direct_len, tail_len, num_channels, multiplier,
+                     scratch);
+    memcpy(&output[direct_len * num_channels], scratch,
+           tail_len * num_channels * sizeof(T));
+  }
+}
+
 void StoreFloatRow(float* JXL_RESTRICT input[3], size_t x0, size_t len,
                    size_t num_channels, float* output) {
   const HWY_CAPPED(float, 8) cd;
@@ -182,6 +207,86 @@ void StoreFloatRow(float* JXL_RESTRICT input[3], size_t x0, size_t len,
   }
 }
 
+// Same as StoreFloatRow(), but converts the samples to half precision floats,
+// whose bits are stored in output.
+void StoreHalfFloatRow(float* JXL_RESTRICT input[3], size_t x0, size_t len,
+                       size_t num_channels, uint16_t* output) {
+  const HWY_CAPPED(float, 8) cd;
+  const Rebind<hwy::float16_t, decltype(cd)> cdh;
+  const Rebind<uint16_t, decltype(cd)> cdu;
+  const auto load = [&](size_t c, size_t i) {
+    return BitCast(cdu, DemoteTo(cdh, LoadU(cd, &input[c][x0 + i])));
+  };
+  if (num_channels == 1) {
+    for (size_t i = 0; i < len; i += Lanes(cd)) {
+      StoreU(load(0, i), cdu, &output[i]);
+    }
+  } else if (num_channels == 2) {
+    for (size_t i = 0; i < len; i += Lanes(cd)) {
+      StoreInterleaved2(load(0, i), load(1, i), cdu, &output[2 * i]);
+    }
+  } else if (num_channels == 3) {
+    for (size_t i = 0; i < len; i += Lanes(cd)) {
+      StoreInterleaved3(load(0, i), load(1, i), load(2, i), cdu,
+                        &output[3 * i]);
+    }
+  } else if (num_channels == 4) {
+    for (size_t i = 0; i < len; i += Lanes(cd)) {
+      StoreInterleaved4(load(0, i), load(1, i), load(2, i), load(3, i), cdu,
+                        &output[4 * i]);
+    }
+  }
+}
+
+void SwapBytes16(uint16_t* data, size_t len) {
+  const HWY_CAPPED(uint16_t, 8) du;
+  for (size_t j = 0; j < len; j += Lanes(du)) {
+    auto v = LoadU(du, data + j);
+    auto vswap = Or(ShiftRightSame(v, 8), ShiftLeftSame(v, 8));
+    StoreU(vswap, du, data + j);
+  }
+}
+
+// Stores the channels of the pixels normalized in separate planes for
+// jpegli_set_tensor_output(), with channel c at output + c * plane stride.
+void StoreTensorRow(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
+                    size_t xoffset, size_t len, size_t num_channels,
+                    uint8_t* JXL_RESTRICT scratch_space,
+                    uint8_t* JXL_RESTRICT output) {
+  jpeg_decomp_master* m = cinfo->master;
+  const HWY_CAPPED(float, 8) cd;
+  const Rebind<hwy::float16_t, decltype(cd)> cdh;
+  const Rebind<uint16_t, decltype(cd)> cdu;
+  for (size_t c = 0; c < num_channels; ++c) {
+    const float* JXL_RESTRICT row = rows[c] + xoffset;
+    const auto mul = Set(cd, m->tensor_mul_[c]);
+    const auto add = Set(cd, m->tensor_add_[c]);
+    uint8_t* JXL_RESTRICT plane = output + c * m->tensor_plane_stride_;
+    if (m->output_data_type_ == JPEGLI_TYPE_FLOAT16) {
+      uint16_t* tmp = reinterpret_cast<uint16_t*>(scratch_space);
+      for (size_t i = 0; i < len; i += Lanes(cd)) {
+        auto v = MulAdd(LoadU(cd, row + i), mul, add);
+        StoreU(BitCast(cdu, DemoteTo(cdh, v)), cdu, tmp + i);
+      }
+      if (m->swap_endianness_) {
+        SwapBytes16(tmp, len);
+      }
+      memcpy(plane, tmp, len * sizeof(tmp[0]));
+    } else {
+      float* tmp = reinterpret_cast<float*>(scratch_space);
+      for (size_t i = 0; i < len; i += Lanes(cd)) {
+        StoreU(MulAdd(LoadU(cd, row + i), mul, add), cd, tmp + i);
+      }
+      if (m->swap_endianness_) {
+        for (size_t j = 0; j < len; ++j) {
+          tmp[j] = BSwapFloat(tmp[j]);
+        }
+      }
+      memcpy(plane, tmp, len * sizeof(tmp[0]));
+    }
+  }
+}
+
 static constexpr float kFSWeightMR = 7.0f / 16.0f;
 static constexpr float kFSWeightBL = 3.0f / 16.0f;
 static constexpr float kFSWeightBM = 5.0f / 16.0f;
@@ -197,11 +302,66 @@ float LimitError(float error) {
   return error > 0.0f ? abserror : -abserror;
 }
 
+// Stores the pixels in the output data type of cinfo, with the channels
+// interleaved. If padded, the output row can be overwritten for up to a vector
+// of pixels past its end, and all the pixels are stored directly into it,
+// otherwise those that do not fill a whole vector go through scratch_space.
+void StoreOutputRow(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
+                    size_t xoffset, size_t len, size_t num_channels,
+                    bool padded, uint8_t* JXL_RESTRICT scratch_space,
+                    uint8_t* JXL_RESTRICT output) {
+  jpeg_decomp_master* m = cinfo->master;
+  uint8_t* tmp = padded ? output : scratch_space;
+  if (m->output_data_type_ == JPEGLI_TYPE_UINT8) {
+    const float mul = 255.0;
+    if (padded) {
+      StoreUnsignedRow(rows, xoffset, len, num_channels, mul, output);
+    } else {
+      StoreUnsignedRowDirect(rows, xoffset, len, num_channels, mul,
+                             scratch_space, output);
+    }
+  } else if (m->output_data_type_ == JPEGLI_TYPE_UINT16 &&
+             !m->swap_endianness_) {
+    const float mul = 65535.0;
+    if (padded) {
+      StoreUnsignedRow(rows, xoffset, len, num_channels, mul,
+                       reinterpret_cast<uint16_t*>(output));
+    } else {
+      StoreUnsignedRowDirect(rows, xoffset, len, num_channels, mul,
+                             reinterpret_cast<uint16_t*>(scratch_space),
+                             reinterpret_cast<uint16_t*>(output));
+    }
+  } else if (m->output_data_type_ == JPEGLI_TYPE_UINT16) {
+    const float mul = 65535.0;
+    uint16_t* tmp16 = reinterpret_cast<uint16_t*>(tmp);
+    StoreUnsignedRow(rows, xoffset, len, num_channels, mul, tmp16);
+    SwapBytes16(tmp16, len * num_channels);
+    if (!padded) memcpy(output, tmp, len * num_channels * 2);
+  } else if (m->output_data_type_ == JPEGLI_TYPE_FLOAT16) {
+    uint16_t* tmp16 = reinterpret_cast<uint16_t*>(tmp);
+    StoreHalfFloatRow(rows, xoffset, len, num_channels, tmp16);
+    if (m->swap_endianness_) {
+      SwapBytes16(tmp16, len * num_channels);
+    }
+    if (!padded) memcpy(output, tmp, len * num_channels * 2);
+  } else if (m->output_data_type_ == JPEGLI_TYPE_FLOAT) {
+    float* tmpf = reinterpret_cast<float*>(tmp);
+    StoreFloatRow(rows, xoffset, len, num_channels, tmpf);
+    if (m->swap_endianness_) {
+      size_t output_len = len * num_channels;
+      for (size_t j = 0; j < output_len; ++j) {
+        tmpf[j] = BSwapFloat(tmpf[j]);
+      }
+    }
+    if (!padded) memcpy(output, tmp, len * num_channels * 4);
+  }
+}
+
 void WriteToOutput(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
                    size_t xoffset, size_t len, size_t num_channels,
+                   uint8_t* JXL_RESTRICT scratch_space,
                    uint8_t* JXL_RESTRICT output) {
   jpeg_decomp_master* m = cinfo->master;
-  uint8_t* JXL_RESTRICT scratch_space = m->output_scratch_;
   if (cinfo->quantize_colors && m->quant_pass_ == 1) {
     float* error_row[kMaxComponents];
     float* next_error_row[kMaxComponents];
@@ -249,34 +409,27 @@ void WriteToOutput(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
         }
       }
     }
-  } else if (m->output_data_type_ == JPEGLI_TYPE_UINT8) {
-    const float mul = 255.0;
-    StoreUnsignedRow(rows, xoffset, len, num_channels, mul, scratch_space);
-    memcpy(output, scratch_space, len * num_channels);
-  } else if (m->output_data_type_ == JPEGLI_TYPE_UINT16) {
-    const float mul = 65535.0;
-    uint16_t* tmp = reinterpret_cast<uint16_t*>(scratch_space);
-    StoreUnsignedRow(rows, xoffset, len, num_channels, mul, tmp);
-    if (m->swap_endianness_) {
-      const HWY_CAPPED(uint16_t, 8) du;
-      size_t output_len = len * num_channels;
-      for (size_t j = 0; j < output_len; j += Lanes(du)) {
-        auto v = LoadU(du, tmp + j);
-        auto vswap = Or(ShiftRightSame(v, 8), ShiftLeftSame(v, 8));
-        StoreU(vswap, du, tmp + j);
-      }
-    }
-    memcpy(output, tmp, len * num_channels * 2);
-  } else if (m->output_data_type_ == JPEGLI_TYPE_FLOAT) {
-    float* tmp = reinterpret_cast<float*>(scratch_space);
-    StoreFloatRow(rows, xoffset, len, num_channels, tmp);
-    if (m->swap_endianness_) {
-      size_t output_len = len * num_channels;
-      for (size_t j = 0; j < output_len; ++j) {
-        tmp[j] = BSwapFloat(tmp[j]);
-      }
+  } else if (m->tensor_plane_stride_ != 0) {
+    StoreTensorRow(cinfo, rows, xoffset, len, num_channels, scratch_space,
+                   output);
+  } else if (m->output_planes_ != nullptr) {
+    // The output row is in the first plane of jpegli_decode_planes().
+    const size_t y = (output - m->output_planes_[0]) /
+                     m->output_plane_strides_[0];
+    for (size_t c = 0; c < num_channels; ++c) {
+      StoreOutputRow(cinfo, &rows[c], xoffset, len, 1, /*padded=*/false,
+                     scratch_space,
+                     m->output_planes_[c] + y * m->output_plane_strides_[c]);
     }
-    memcpy(output, tmp, len * num_channels * 4);
+  } else {
+    // The float stores of a padded row also need aligned samples.
+    const bool padded =
+        m->output_rows_padded_ && !cinfo->raw_data_out &&
+        reinterpret_cast<uintptr_t>(output) %
+                jpegli_bytes_per_sample(m->output_data_type_) ==
+            0;
+    StoreOutputRow(cinfo, rows, xoffset, len, num_channels, padded,
+                   scratch_space, output);
   }
 }
 
@@ -293,25 +446,27 @@ HWY_EXPORT(GatherBlockStats);
 HWY_EXPORT(WriteToOutput);
 HWY_EXPORT(DecenterRow);
 
-void GatherBlockStats(const int16_t* JXL_RESTRICT coeffs,
-                      const size_t coeffs_size, int32_t* JXL_RESTRICT nonzeros,
-                      int32_t* JXL_RESTRICT sumabs) {
-  HWY_DYNAMIC_DISPATCH(GatherBlockStats)(coeffs, coeffs_size, nonzeros, sumabs);
-}
+namespace {
 
-void WriteToOutput(j_decompress_ptr cinfo, float* JXL_RESTRICT rows[],
-                   size_t xoffset, size_t len, size_t num_channels,
-                   uint8_t* JXL_RESTRICT output) {
-  HWY_DYNAMIC_DISPATCH(WriteToOutput)
-  (cinfo, rows, xoffset, len, num_channels, output);
+void ChooseRenderKernels(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  m->gather_block_stats = HWY_DYNAMIC_DISPATCH(GatherBlockStats);
+  m->decenter_row = HWY_DYNAMIC_DISPATCH(DecenterRow);
+  m->write_to_output = HWY_DYNAMIC_DISPATCH(WriteToOutput);
+  ChooseUpsampleKernels(cinfo);
 }
 
-void DecenterRow(float* row, size_t xsize) {
-  HWY_DYNAMIC_DISPATCH(DecenterRow)(row, xsize);
-}
+// Sets m->render_output_rows, defined below.
+void ChooseRenderPipeline(j_decompress_ptr cinfo);
+
+}  // namespace
 
 bool ShouldApplyDequantBiases(j_decompress_ptr cinfo, int ci) {
   const auto& compinfo = cinfo->comp_info[ci];
+  // The fixed point inverse transform does not use dequantization biases.
+  if (cinfo->dct_method == JDCT_IFAST) {
+    return false;
+  }
   return (compinfo.h_samp_factor == cinfo->max_h_samp_factor &&
           compinfo.v_samp_factor == cinfo->max_v_samp_factor);
 }
@@ -392,11 +547,16 @@ bool do_smoothing(j_decompress_ptr cinfo) {
   return smoothing_useful;
 }
 
-void PredictSmooth(j_decompress_ptr cinfo, JBLOCKARRAY blocks, int component,
-                   size_t bx, int iy) {
+// Computes the block smoothing predictions of the blocks bx0 .. bx1 - 1 of
+// block row iy of the current iMCU row of the component. The predicted block of
+// block column bx is stored at smoothing_scratch_ + bx * DCTSIZE2. The 5x5
+// neighbourhood of DC values is shifted by one column from block to block, so
+// that every DC value of the row is loaded only once.
+void PredictSmoothRow(j_decompress_ptr cinfo, JBLOCKARRAY blocks,
+                      int component, size_t bx0, size_t bx1, int iy) {
   const size_t imcu_row = cinfo->output_iMCU_row;
-  int16_t* scratch = cinfo->master->smoothing_scratch_;
-  std::vector<int> Q_VAL(SAVED_COEFS);
+  int16_t* scratch_row = cinfo->master->smoothing_scratch_;
+  int Q_VAL[SAVED_COEFS] = {0};
   int* coef_bits;
 
   std::array<std::array<int, 5>, 5> dc_values;
@@ -409,30 +569,19 @@ void PredictSmooth(j_decompress_ptr cinfo, JBLOCKARRAY blocks, int component,
   int next_iy = by + 1 < compinfo.height_in_blocks ? iy + 1 : iy;
   int next_next_iy = by + 2 < compinfo.height_in_blocks ? iy + 2 : next_iy;
 
-  const int16_t* cur_row = blocks[iy][bx];
-  const int16_t* prev_row = blocks[prev_iy][bx];
-  const int16_t* prev_prev_row = blocks[prev_prev_iy][bx];
-  const int16_t* next_row = blocks[next_iy][bx];
-  const int16_t* next_next_row = blocks[next_next_iy][bx];
-
-  int prev_block_ind = bx ? -DCTSIZE2 : 0;
-  int prev_prev_block_ind = bx > 1 ? -2 * DCTSIZE2 : prev_block_ind;
-  int next_block_ind = bx + 1 < compinfo.width_in_blocks ? DCTSIZE2 : 0;
-  int next_next_block_ind =
-      bx + 2 < compinfo.width_in_blocks ? DCTSIZE2 * 2 : next_block_ind;
-
-  std::array<const int16_t*, 5> row_ptrs = {prev_prev_row, prev_row, cur_row,
-                                            next_row, next_next_row};
-  std::array<int, 5> block_inds = {prev_prev_block_ind, prev_block_ind, 0,
-                                   next_block_ind, next_next_block_ind};
-
-  memcpy(scratch, cur_row, DCTSIZE2 * sizeof(cur_row[0]));
+  std::array<JBLOCKROW, 5> row_ptrs = {blocks[prev_prev_iy], blocks[prev_iy],
+                                       blocks[iy], blocks[next_iy],
+                                       blocks[next_next_iy]};
+  // Returns the DC value of block row r of the neighbourhood at block column
+  // bx + dx, where the columns outside of the image are replaced by the
+  // nearest one.
+  const int64_t max_bx = compinfo.width_in_blocks - 1;
+  auto neighbour_dc = [&](int r, size_t bx, int dx) {
+    int64_t x = static_cast<int64_t>(bx) + dx;
+    x = std::min(std::max<int64_t>(x, 0), max_bx);
+    return static_cast<int>(row_ptrs[r][x][0]);
+  };
 
-  for (int r = 0; r < 5; ++r) {
-    for (int c = 0; c < 5; ++c) {
-      dc_values[r][c] = row_ptrs[r][block_inds[c]];
-    }
-  }
   // Get the correct coef_bits: In case of an incomplete scan, we use the
   // prev coefficients.
   if (cinfo->output_iMCU_row + 1 > cinfo->input_iMCU_row) {
@@ -541,14 +690,32 @@ void PredictSmooth(j_decompress_ptr cinfo, JBLOCKARRAY blocks, int component,
     return static_cast<int16_t>(pred);
   };
 
-  int loop_end = change_dc ? SAVED_COEFS : 6;
-  for (int i = 1; i < loop_end; ++i) {
-    if (coef_bits[i] != 0 && scratch[Q_POS[i]] == 0) {
-      scratch[Q_POS[i]] = calculate_dct_value(i);
+  const int loop_end = change_dc ? SAVED_COEFS : 6;
+  for (size_t bx = bx0; bx < bx1; ++bx) {
+    if (bx == bx0) {
+      for (int r = 0; r < 5; ++r) {
+        for (int c = 0; c < 5; ++c) {
+          dc_values[r][c] = neighbour_dc(r, bx, c - 2);
+        }
+      }
+    } else {
+      for (int r = 0; r < 5; ++r) {
+        for (int c = 0; c < 4; ++c) {
+          dc_values[r][c] = dc_values[r][c + 1];
+        }
+        dc_values[r][4] = neighbour_dc(r, bx, 2);
+      }
+    }
+    int16_t* scratch = &scratch_row[bx * DCTSIZE2];
+    memcpy(scratch, row_ptrs[2][bx], DCTSIZE2 * sizeof(scratch[0]));
+    for (int i = 1; i < loop_end; ++i) {
+      if (coef_bits[i] != 0 && scratch[Q_POS[i]] == 0) {
+        scratch[Q_POS[i]] = calculate_dct_value(i);
+      }
+    }
+    if (change_dc) {
+      scratch[0] = calculate_dct_value(0);
     }
-  }
-  if (change_dc) {
-    scratch[0] = calculate_dct_value(0);
   }
 }
 
@@ -563,7 +730,25 @@ void PrepareForOutput(j_decompress_ptr cinfo) {
   memset(m->biases_, 0, coeffs_per_block * sizeof(m->biases_[0]));
   cinfo->output_iMCU_row = 0;
   cinfo->output_scanline = 0;
-  const float kDequantScale = 1.0f / (8 * 255);
+  m->render_scanline_ = 0;
+  // The inverse transformed samples are in units of the maximum sample value
+  // and, after adding sample_offset_, centered around 128/255 regardless of
+  // the data precision, so the rest of the pipeline does not depend on it.
+  // The chroma components are only centered around zero when they are
+  // converted to another color space.
+  const float max_sample = (1 << cinfo->data_precision) - 1;
+  const float kDequantScale = 1.0f / (8 * max_sample);
+  const float center = (1 << (cinfo->data_precision - 1)) / max_sample;
+  const bool chroma_transform =
+      !cinfo->raw_data_out &&
+      (cinfo->jpeg_color_space == JCS_YCbCr ||
+       cinfo->jpeg_color_space == JCS_YCCK) &&
+      cinfo->out_color_space != cinfo->jpeg_color_space;
+  for (int c = 0; c < cinfo->num_components; c++) {
+    const bool is_chroma = c == 1 || c == 2;
+    m->sample_offset_[c] =
+        chroma_transform && is_chroma ? 0.0f : center - 128.0f / 255.0f;
+  }
   for (int c = 0; c < cinfo->num_components; c++) {
     const auto& comp = cinfo->comp_info[c];
     JQUANT_TBL* table = comp.quant_table;
@@ -574,66 +759,157 @@ void PrepareForOutput(j_decompress_ptr cinfo) {
   }
   JPEGLI_CHECK(ChooseInverseTransform(cinfo));
   ChooseColorTransform(cinfo);
+  ChooseRenderKernels(cinfo);
+  m->output_planes_ = nullptr;
+  m->output_plane_strides_ = nullptr;
+  ChooseRenderPipeline(cinfo);
 }
 
-void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
+void SetOutputPlanes(j_decompress_ptr cinfo, uint8_t* const planes[],
+                     const size_t strides[]) {
   jpeg_decomp_master* m = cinfo->master;
-  const size_t imcu_row = cinfo->output_iMCU_row;
-  JBLOCKARRAY blocks[kMaxComponents];
-  for (int c = 0; c < cinfo->num_components; ++c) {
-    const jpeg_component_info* comp = &cinfo->comp_info[c];
-    int by0 = imcu_row * comp->v_samp_factor;
-    int block_rows_left = comp->height_in_blocks - by0;
-    int max_block_rows = std::min(comp->v_samp_factor, block_rows_left);
-    int offset = m->streaming_mode_ ? 0 : by0;
-    blocks[c] = (*cinfo->mem->access_virt_barray)(
-        reinterpret_cast<j_common_ptr>(cinfo), m->coef_arrays[c], offset,
-        max_block_rows, FALSE);
+  m->output_planes_ = planes;
+  m->output_plane_strides_ = strides;
+  ChooseRenderPipeline(cinfo);
+}
+
+namespace {
+
+// Updates the coefficient statistics with the given iMCU row, and re-computes
+// the dequantization biases every few iMCU rows.
+void UpdateDequantBiases(j_decompress_ptr cinfo, size_t imcu_row,
+                         const JBLOCKARRAY* blocks) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (m->dequant_bias_rows_ > 0 && imcu_row >= m->dequant_bias_rows_) {
+    // Since dequant_bias_rows_ is a multiple of 4, the biases were last
+    // re-computed at the previous row.
+    return;
   }
   for (int c = 0; c < cinfo->num_components; ++c) {
+    if (!ShouldApplyDequantBiases(cinfo, c)) {
+      continue;
+    }
     size_t k0 = c * DCTSIZE2;
     auto& compinfo = cinfo->comp_info[c];
     size_t block_row = imcu_row * compinfo.v_samp_factor;
-    if (ShouldApplyDequantBiases(cinfo, c)) {
-      // Update statistics for this iMCU row.
-      for (int iy = 0; iy < compinfo.v_samp_factor; ++iy) {
-        size_t by = block_row + iy;
-        if (by >= compinfo.height_in_blocks) {
-          continue;
-        }
-        int16_t* JXL_RESTRICT coeffs = &blocks[c][iy][0][0];
-        size_t num = compinfo.width_in_blocks * DCTSIZE2;
-        GatherBlockStats(coeffs, num, &m->nonzeros_[k0], &m->sumabs_[k0]);
-        m->num_processed_blocks_[c] += compinfo.width_in_blocks;
-      }
-      if (imcu_row % 4 == 3) {
-        // Re-compute optimal biases every few iMCU-rows.
-        ComputeOptimalLaplacianBiases(m->num_processed_blocks_[c],
-                                      &m->nonzeros_[k0], &m->sumabs_[k0],
-                                      &m->biases_[k0]);
+    for (int iy = 0; iy < compinfo.v_samp_factor; ++iy) {
+      size_t by = block_row + iy;
+      if (by >= compinfo.height_in_blocks) {
+        continue;
       }
+      int16_t* JXL_RESTRICT coeffs = &blocks[c][iy][0][0];
+      size_t num = compinfo.width_in_blocks * DCTSIZE2;
+      (*m->gather_block_stats)(coeffs, num, &m->nonzeros_[k0],
+                               &m->sumabs_[k0]);
+      m->num_processed_blocks_[c] += compinfo.width_in_blocks;
     }
-    RowBuffer<float>* raw_out = &m->raw_output_[c];
+    if (imcu_row % 4 == 3) {
+      // Re-compute optimal biases every few iMCU-rows.
+      ComputeOptimalLaplacianBiases(m->num_processed_blocks_[c],
+                                    &m->nonzeros_[k0], &m->sumabs_[k0],
+                                    &m->biases_[k0]);
+    }
+  }
+}
+
+// Returns the range of columns of the upsampled output rows that have to be
+// rendered for the current output cropping. The range is aligned for the SIMD
+// code of every component, and it includes the columns that are needed as
+// context for horizontal upsampling.
+void GetRenderedColumns(j_decompress_ptr cinfo, size_t* xbegin, size_t* xend) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t hfactor = cinfo->max_h_samp_factor;
+  const size_t imcu_width = hfactor * m->min_scaled_dct_size;
+  const size_t width = m->iMCU_cols_ * imcu_width;
+  const size_t border = 2 * hfactor;
+  const size_t align = hfactor * HWY_ALIGNMENT / sizeof(float);
+  size_t x0 = m->xoffset_ > border ? m->xoffset_ - border : 0;
+  size_t x1 = m->xoffset_ + m->render_width_ + border;
+  *xbegin = (x0 / align) * align;
+  *xend = std::min(RoundUpTo(x1, align), width);
+}
+
+// Lets the transform backend inverse transform the iMCU row, and returns false
+// if it left it to InverseTransformiMCURow().
+bool InverseTransformiMCURowWithBackend(j_decompress_ptr cinfo,
+                                        size_t imcu_row,
+                                        const JBLOCKARRAY* blocks,
+                                        const float* biases,
+                                        RenderBuffers* buffers, size_t xbegin,
+                                        size_t xend) {
+  jpeg_decomp_master* m = cinfo->master;
+  const JpegliTransformBackend& backend = m->transform_backend;
+  if (m->apply_smoothing) return false;
+  JpegliInverseTransformComponent components[kMaxComponents];
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    if (m->scaled_dct_size[c] != DCTSIZE) return false;
+    const auto& compinfo = cinfo->comp_info[c];
+    const size_t by0 = imcu_row * compinfo.v_samp_factor;
+    RowBuffer<float>* raw_out = &buffers->raw_output[c];
+    JpegliInverseTransformComponent* ic = &components[c];
+    ic->coeffs = blocks[c];
+    ic->num_block_rows =
+        std::min<int>(compinfo.v_samp_factor, compinfo.height_in_blocks - by0);
+    ic->block_begin = xbegin / m->h_factor[c] / DCTSIZE;
+    ic->block_end = std::min<size_t>(
+        DivCeil(xend / m->h_factor[c], DCTSIZE), compinfo.width_in_blocks);
+    ic->dequant = &m->dequant_[c * DCTSIZE2];
+    ic->biases = &biases[c * DCTSIZE2];
+    ic->output = raw_out->Row(by0 * DCTSIZE);
+    ic->output_stride = raw_out->stride();
+  }
+  return FROM_JXL_BOOL((*backend.inverse_transform)(
+      backend.opaque, imcu_row, cinfo->num_components, components));
+}
+
+void InverseTransformiMCURow(j_decompress_ptr cinfo, size_t imcu_row,
+                             const JBLOCKARRAY* blocks, const float* biases,
+                             RenderBuffers* buffers) {
+  jpeg_decomp_master* m = cinfo->master;
+  size_t xbegin;
+  size_t xend;
+  GetRenderedColumns(cinfo, &xbegin, &xend);
+  const bool offloaded =
+      m->transform_backend.inverse_transform != nullptr &&
+      InverseTransformiMCURowWithBackend(cinfo, imcu_row, blocks, biases,
+                                         buffers, xbegin, xend);
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    size_t k0 = c * DCTSIZE2;
+    auto& compinfo = cinfo->comp_info[c];
+    size_t block_row = imcu_row * compinfo.v_samp_factor;
+    RowBuffer<float>* raw_out = &buffers->raw_output[c];
+    size_t dctsize = m->scaled_dct_size[c];
+    // Only the blocks that intersect the rendered columns are transformed.
+    size_t bx0 = xbegin / m->h_factor[c] / dctsize;
+    size_t bx1 = std::min<size_t>(DivCeil(xend / m->h_factor[c], dctsize),
+                                  compinfo.width_in_blocks);
     for (int iy = 0; iy < compinfo.v_samp_factor; ++iy) {
       size_t by = block_row + iy;
       if (by >= compinfo.height_in_blocks) {
         continue;
       }
-      size_t dctsize = m->scaled_dct_size[c];
       int16_t* JXL_RESTRICT row_in = &blocks[c][iy][0][0];
       float* JXL_RESTRICT row_out = raw_out->Row(by * dctsize);
-      for (size_t bx = 0; bx < compinfo.width_in_blocks; ++bx) {
-        if (m->apply_smoothing) {
-          PredictSmooth(cinfo, blocks[c], c, bx, iy);
-          (*m->inverse_transform[c])(m->smoothing_scratch_, &m->dequant_[k0],
-                                     &m->biases_[k0], m->idct_scratch_,
-                                     &row_out[bx * dctsize], raw_out->stride(),
-                                     dctsize);
-        } else {
-          (*m->inverse_transform[c])(&row_in[bx * DCTSIZE2], &m->dequant_[k0],
-                                     &m->biases_[k0], m->idct_scratch_,
-                                     &row_out[bx * dctsize], raw_out->stride(),
-                                     dctsize);
+      const int16_t* coeffs = row_in;
+      if (m->apply_smoothing) {
+        PredictSmoothRow(cinfo, blocks[c], c, bx0, bx1, iy);
+        coeffs = m->smoothing_scratch_;
+      }
+      if (bx1 > bx0) {
+        if (!offloaded) {
+          (*m->inverse_transform[c])(&coeffs[bx0 * DCTSIZE2], bx1 - bx0,
+                                     &m->dequant_[k0], &biases[k0],
+                                     buffers->idct_scratch,
+                                     &row_out[bx0 * dctsize],
+                                     raw_out->stride(), dctsize);
+        }
+        if (m->sample_offset_[c] != 0.0f) {
+          for (size_t y = 0; y < dctsize; ++y) {
+            float* JXL_RESTRICT row = raw_out->Row(by * dctsize + y);
+            for (size_t x = bx0 * dctsize; x < bx1 * dctsize; ++x) {
+              row[x] += m->sample_offset_[c];
+            }
+          }
         }
       }
       if (m->streaming_mode_) {
@@ -643,9 +919,400 @@ void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
   }
 }
 
+// Upsamples and color transforms the output rows [ybegin, yend) from the
+// inverse transformed iMCU rows in buffers, and writes row y to
+// output[y - ybegin] if output is not nullptr, or adds it to the resizer if the
+// output is resized. The time of the stages is added to *stats if it is not
+// nullptr.
+void RenderOutputRows(j_decompress_ptr cinfo, size_t ybegin, size_t yend,
+                      RenderBuffers* buffers, JSAMPARRAY output,
+                      StageStats* stats) {
+  jpeg_decomp_master* m = cinfo->master;
+  const int vfactor = cinfo->max_v_samp_factor;
+  size_t xbegin;
+  size_t xend;
+  GetRenderedColumns(cinfo, &xbegin, &xend);
+  const size_t output_width = xend - xbegin;
+  size_t yb = (ybegin / vfactor) * vfactor;
+  size_t ye = DivCeil(yend, vfactor) * vfactor;
+  for (size_t y = yb; y < ye; y += vfactor) {
+    StageTimer upsample_timer(stats, JPEGLI_STAGE_UPSAMPLE);
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      RowBuffer<float>* raw_out = &buffers->raw_output[c];
+      RowBuffer<float>* render_out = &buffers->render_output[c];
+      int line_groups = vfactor / m->v_factor[c];
+      int downsampled_width = output_width / m->h_factor[c];
+      size_t xc = xbegin / m->h_factor[c];
+      size_t yc = y / m->v_factor[c];
+      // The downsampled columns are stored from column xbegin of the render
+      // output, and are upsampled in place.
+      for (int dy = 0; dy < line_groups; ++dy) {
+        size_t ymid = yc + dy;
+        const float* JXL_RESTRICT row_mid = raw_out->Row(ymid) + xc;
+        if (cinfo->do_fancy_upsampling && m->v_factor[c] == 2) {
+          const float* JXL_RESTRICT row_top =
+              ymid == 0 ? row_mid : raw_out->Row(ymid - 1) + xc;
+          const float* JXL_RESTRICT row_bot = ymid + 1 == m->raw_height_[c]
+                                                  ? row_mid
+                                                  : raw_out->Row(ymid + 1) + xc;
+          if (m->h_factor[c] == 2) {
+            (*m->upsample2x2)(row_top, row_mid, row_bot,
+                              buffers->upsample_scratch,
+                              render_out->Row(2 * dy) + xbegin,
+                              render_out->Row(2 * dy + 1) + xbegin,
+                              output_width);
+            continue;
+          }
+          (*m->upsample2_vertical)(row_top, row_mid, row_bot,
+                                   render_out->Row(2 * dy) + xbegin,
+                                   render_out->Row(2 * dy + 1) + xbegin,
+                                   downsampled_width);
+        } else {
+          for (int yix = 0; yix < m->v_factor[c]; ++yix) {
+            memcpy(render_out->Row(m->v_factor[c] * dy + yix) + xbegin,
+                   row_mid, downsampled_width * sizeof(float));
+          }
+        }
+        if (m->h_factor[c] > 1) {
+          for (int yix = 0; yix < m->v_factor[c]; ++yix) {
+            int row_ix = m->v_factor[c] * dy + yix;
+            float* JXL_RESTRICT row = render_out->Row(row_ix) + xbegin;
+            float* JXL_RESTRICT tmp = buffers->upsample_scratch;
+            if (cinfo->do_fancy_upsampling && m->h_factor[c] == 2) {
+              (*m->upsample2_horizontal)(row, tmp, output_width);
+            } else {
+              (*m->upsample_horizontal_no_filter)(row, tmp, output_width,
+                                                  m->h_factor[c]);
+            }
+          }
+        }
+      }
+    }
+    upsample_timer.Stop();
+    StageTimer output_timer(stats, JPEGLI_STAGE_WRITE_OUTPUT);
+    for (int yix = 0; yix < vfactor; ++yix) {
+      if (y + yix < ybegin || y + yix >= yend) continue;
+      float* rows[kMaxComponents];
+      int num_all_components =
+          std::max(cinfo->out_color_components, cinfo->num_components);
+      for (int c = 0; c < num_all_components; ++c) {
+        rows[c] = buffers->render_output[c].Row(yix) + xbegin;
+      }
+      if (output && m->color_output_uint8 != nullptr &&
+          m->output_planes_ == nullptr && m->row_transform_ == nullptr) {
+        (*m->color_output_uint8)(rows, m->xoffset_ - xbegin, m->render_width_,
+                                 output[y + yix - ybegin]);
+        continue;
+      }
+      (*m->color_transform)(rows, output_width);
+      for (int c = 0; c < cinfo->out_color_components; ++c) {
+        // Undo the centering of the sample values around zero.
+        (*m->decenter_row)(rows[c], output_width);
+      }
+      if (m->row_transform_ != nullptr) {
+        float* visible_rows[kMaxComponents];
+        for (int c = 0; c < cinfo->out_color_components; ++c) {
+          visible_rows[c] = rows[c] + m->xoffset_ - xbegin;
+        }
+        (*m->row_transform_)(m->row_transform_opaque_,
+                             buffers->row_transform_thread, visible_rows,
+                             cinfo->out_color_components, m->render_width_);
+      }
+      if (m->resize_width_ != 0) {
+        AddRenderedRow(cinfo, y + yix, rows, m->xoffset_ - xbegin);
+      } else if (output) {
+        (*m->write_to_output)(cinfo, rows, m->xoffset_ - xbegin,
+                              m->render_width_, cinfo->out_color_components,
+                              buffers->output_scratch,
+                              output[y + yix - ybegin]);
+      }
+    }
+  }
+}
+
+// Same as RenderOutputRows() for 8x8 DCTs, 8-bit output without color
+// quantization and kNumComponents = 3 YCbCr components, where the chroma
+// components are subsampled by kChromaFactor in both directions with fancy
+// upsampling and written with the fused m->color_output_uint8, or a single
+// grayscale component (kChromaFactor = 1). The sampling factors are constants
+// and the rows that are not upsampled are read directly from the inverse
+// transformed rows, instead of being copied to the render output first.
+template <int kNumComponents, int kChromaFactor>
+void RenderOutputRowsFixed(j_decompress_ptr cinfo, size_t ybegin, size_t yend,
+                           RenderBuffers* buffers, JSAMPARRAY output,
+                           StageStats* stats) {
+  static_assert(kNumComponents == 1 || kNumComponents == 3,
+                "Only grayscale and YCbCr are specialized.");
+  static_assert(kChromaFactor == 1 || kChromaFactor == 2,
+                "Only 4:4:4 and 4:2:0 are specialized.");
+  jpeg_decomp_master* m = cinfo->master;
+  size_t xbegin;
+  size_t xend;
+  GetRenderedColumns(cinfo, &xbegin, &xend);
+  const size_t output_width = xend - xbegin;
+  const size_t xoffset = m->xoffset_ - xbegin;
+  size_t yb = (ybegin / kChromaFactor) * kChromaFactor;
+  size_t ye = DivCeil(yend, kChromaFactor) * kChromaFactor;
+  for (size_t y = yb; y < ye; y += kChromaFactor) {
+    if (kChromaFactor == 2) {
+      StageTimer upsample_timer(stats, JPEGLI_STAGE_UPSAMPLE);
+      const size_t xc = xbegin / 2;
+      const size_t ymid = y / 2;
+      for (int c = 1; c < kNumComponents; ++c) {
+        RowBuffer<float>* raw_out = &buffers->raw_output[c];
+        RowBuffer<float>* render_out = &buffers->render_output[c];
+        const float* JXL_RESTRICT row_mid = raw_out->Row(ymid) + xc;
+        const float* JXL_RESTRICT row_top =
+            ymid == 0 ? row_mid : raw_out->Row(ymid - 1) + xc;
+        const float* JXL_RESTRICT row_bot = ymid + 1 == m->raw_height_[c]
+                                                ? row_mid
+                                                : raw_out->Row(ymid + 1) + xc;
+        (*m->upsample2x2)(row_top, row_mid, row_bot, buffers->upsample_scratch,
+                          render_out->Row(0) + xbegin,
+                          render_out->Row(1) + xbegin, output_width);
+      }
+    }
+    StageTimer output_timer(stats, JPEGLI_STAGE_WRITE_OUTPUT);
+    for (int yix = 0; yix < kChromaFactor; ++yix) {
+      if (y + yix < ybegin || y + yix >= yend || output == nullptr) continue;
+      uint8_t* JXL_RESTRICT row_out = output[y + yix - ybegin];
+      if (kNumComponents == 1) {
+        // The decentering is done in place, so the row is copied first.
+        float* row = buffers->render_output[0].Row(0) + xbegin;
+        memcpy(row, buffers->raw_output[0].Row(y + yix) + xbegin,
+               output_width * sizeof(float));
+        (*m->decenter_row)(row, output_width);
+        float* rows[1] = {row};
+        (*m->write_to_output)(cinfo, rows, xoffset, cinfo->output_width, 1,
+                              buffers->output_scratch, row_out);
+        continue;
+      }
+      float* rows[kMaxComponents];
+      rows[0] = buffers->raw_output[0].Row(y + yix) + xbegin;
+      for (int c = 1; c < kNumComponents; ++c) {
+        rows[c] = kChromaFactor == 1
+                      ? buffers->raw_output[c].Row(y + yix) + xbegin
+                      : buffers->render_output[c].Row(yix) + xbegin;
+      }
+      (*m->color_output_uint8)(rows, xoffset, cinfo->output_width, row_out);
+    }
+  }
+}
+
+void ChooseRenderPipeline(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  m->render_output_rows = RenderOutputRows;
+  // The fixed pipelines write interleaved output rows.
+  if (cinfo->quantize_colors || m->output_data_type_ != JPEGLI_TYPE_UINT8 ||
+      m->resize_width_ != 0 || m->output_planes_ != nullptr ||
+      m->row_transform_ != nullptr) {
+    return;
+  }
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    if (m->scaled_dct_size[c] != DCTSIZE) return;
+  }
+  if (cinfo->num_components == 1 && cinfo->out_color_components == 1 &&
+      cinfo->jpeg_color_space == JCS_GRAYSCALE &&
+      cinfo->out_color_space == JCS_GRAYSCALE) {
+    m->render_output_rows = RenderOutputRowsFixed<1, 1>;
+    return;
+  }
+  if (cinfo->num_components != 3 || m->color_output_uint8 == nullptr ||
+      m->h_factor[0] != 1 || m->v_factor[0] != 1) {
+    return;
+  }
+  const int factor = m->h_factor[1];
+  for (int c = 1; c < 3; ++c) {
+    if (m->h_factor[c] != factor || m->v_factor[c] != factor) return;
+  }
+  if (factor == 1) {
+    m->render_output_rows = RenderOutputRowsFixed<3, 1>;
+  } else if (factor == 2 && cinfo->do_fancy_upsampling) {
+    m->render_output_rows = RenderOutputRowsFixed<3, 2>;
+  }
+}
+
+// Minimum number of iMCU rows in a band of a parallel output pass, the bands
+// also have to inverse transform the neighbouring iMCU rows above and below
+// them for the vertical upsampling.
+constexpr size_t kMinRenderBandHeight = 4;
+// Each band uses its own render buffers, so this bounds the additional memory
+// used by a parallel output pass.
+constexpr size_t kMaxRenderBands = 16;
+static_assert(kMaxRenderBands <= JPEGLI_MAX_ROW_TRANSFORM_THREADS,
+              "Each band needs its own row transform thread.");
+
+// Renders the output rows of the iMCU rows [imcu_begin, imcu_end) into
+// scanlines, using block_rows[c] as the block rows of component c and
+// biases[((r + 1) / 4) * cinfo->num_components * DCTSIZE2] as the
+// dequantization biases of iMCU row r.
+void RenderBand(j_decompress_ptr cinfo, size_t imcu_begin, size_t imcu_end,
+                const std::vector<JBLOCKROW>* block_rows, const float* biases,
+                RenderBuffers* buffers, JSAMPARRAY scanlines) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t context = m->need_context_rows_ ? 1 : 0;
+  const size_t imcu_height = cinfo->max_v_samp_factor * m->min_scaled_dct_size;
+  const size_t coeffs_per_block = cinfo->num_components * DCTSIZE2;
+  size_t next_row = imcu_begin >= context ? imcu_begin - context : 0;
+  for (size_t imcu_row = imcu_begin; imcu_row < imcu_end; ++imcu_row) {
+    size_t last_row =
+        std::min<size_t>(imcu_row + context, cinfo->total_iMCU_rows - 1);
+    for (; next_row <= last_row; ++next_row) {
+      JBLOCKARRAY blocks[kMaxComponents];
+      for (int c = 0; c < cinfo->num_components; ++c) {
+        size_t by0 = next_row * cinfo->comp_info[c].v_samp_factor;
+        blocks[c] = const_cast<JBLOCKARRAY>(&block_rows[c][by0]);
+      }
+      size_t bias_offset = ((next_row + 1) / 4) * coeffs_per_block;
+      InverseTransformiMCURow(cinfo, next_row, blocks, &biases[bias_offset],
+                              buffers);
+    }
+    size_t ybegin = imcu_row * imcu_height;
+    size_t yend = std::min<size_t>((imcu_row + 1) * imcu_height,
+                                   cinfo->output_height);
+    if (ybegin < yend) {
+      (*m->render_output_rows)(cinfo, ybegin, yend, buffers,
+                               &scanlines[ybegin], /*stats=*/nullptr);
+    }
+  }
+}
+
+}  // namespace
+
+void AllocateRenderBuffers(j_decompress_ptr cinfo, RenderBuffers* buffers) {
+  jpeg_decomp_master* m = cinfo->master;
+  size_t iMCU_width = cinfo->max_h_samp_factor * m->min_scaled_dct_size;
+  size_t output_stride = m->iMCU_cols_ * iMCU_width;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const auto& comp = cinfo->comp_info[c];
+    size_t cheight = comp.v_samp_factor * m->scaled_dct_size[c];
+    int downsampled_width = output_stride / m->h_factor[c];
+    if (m->need_context_rows_) {
+      cheight *= 3;
+    }
+    buffers->raw_output[c].Allocate(cinfo, cheight, downsampled_width);
+  }
+  int num_all_components =
+      std::max(cinfo->out_color_components, cinfo->num_components);
+  for (int c = 0; c < num_all_components; ++c) {
+    buffers->render_output[c].Allocate(cinfo, cinfo->max_v_samp_factor,
+                                       output_stride);
+  }
+  buffers->idct_scratch =
+      Allocate<float>(cinfo, 5 * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+  // Padding for horizontal chroma upsampling.
+  constexpr size_t kPaddingLeft = 64;
+  constexpr size_t kPaddingRight = 64;
+  buffers->upsample_scratch =
+      Allocate<float>(cinfo, output_stride + kPaddingLeft + kPaddingRight,
+                      JPOOL_IMAGE_ALIGNED) +
+      kPaddingLeft;
+  size_t bytes_per_sample = jpegli_bytes_per_sample(m->output_data_type_);
+  size_t bytes_per_pixel = cinfo->out_color_components * bytes_per_sample;
+  size_t scratch_stride = RoundUpTo(output_stride, HWY_ALIGNMENT);
+  buffers->output_scratch = Allocate<uint8_t>(
+      cinfo, bytes_per_pixel * scratch_stride, JPOOL_IMAGE_ALIGNED);
+  buffers->row_transform_thread = 0;
+}
+
+namespace {
+
+void GetCurrentiMCURowBlocks(j_decompress_ptr cinfo, JBLOCKARRAY* blocks) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t imcu_row = cinfo->output_iMCU_row;
+  if (m->coeff_band_decoding_) {
+    DecodeCoeffBand(cinfo, imcu_row);
+  }
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    int by0 = imcu_row * comp->v_samp_factor;
+    int block_rows_left = comp->height_in_blocks - by0;
+    int max_block_rows = std::min(comp->v_samp_factor, block_rows_left);
+    int offset = m->streaming_mode_ ? 0 : by0;
+    if (m->coeff_band_decoding_) {
+      offset -= m->coeff_band_begin_ * comp->v_samp_factor;
+    }
+    blocks[c] = (*cinfo->mem->access_virt_barray)(
+        reinterpret_cast<j_common_ptr>(cinfo), m->coef_arrays[c], offset,
+        max_block_rows, FALSE);
+  }
+}
+
+}  // namespace
+
+void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  StageTimer timer(&m->stage_stats, JPEGLI_STAGE_IDCT);
+  const size_t imcu_row = cinfo->output_iMCU_row;
+  JBLOCKARRAY blocks[kMaxComponents];
+  GetCurrentiMCURowBlocks(cinfo, blocks);
+  UpdateDequantBiases(cinfo, imcu_row, blocks);
+  InverseTransformiMCURow(cinfo, imcu_row, blocks, m->biases_,
+                          &m->render_buffers_);
+}
+
+void SkipCurrentiMCURow(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t imcu_row = cinfo->output_iMCU_row;
+  JBLOCKARRAY blocks[kMaxComponents];
+  GetCurrentiMCURowBlocks(cinfo, blocks);
+  // The statistics of the skipped blocks are still gathered, so that the
+  // dequantization biases of the rows after them do not change.
+  UpdateDequantBiases(cinfo, imcu_row, blocks);
+  if (m->streaming_mode_) {
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      const jpeg_component_info* comp = &cinfo->comp_info[c];
+      for (int iy = 0; iy < comp->v_samp_factor; ++iy) {
+        size_t by = imcu_row * comp->v_samp_factor + iy;
+        if (by >= comp->height_in_blocks) {
+          continue;
+        }
+        memset(blocks[c][iy], 0, comp->width_in_blocks * sizeof(JBLOCK));
+      }
+    }
+  }
+  ++cinfo->output_iMCU_row;
+}
+
+void ProcessRawPlanes(j_decompress_ptr cinfo, uint8_t* const planes[],
+                      const size_t strides[], JpegliPlaneLayout layout) {
+  jpegli::DecodeCurrentiMCURow(cinfo);
+  jpeg_decomp_master* m = cinfo->master;
+  StageTimer timer(&m->stage_stats, JPEGLI_STAGE_WRITE_OUTPUT);
+  const bool nv12 = layout == JPEGLI_PLANES_NV12;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    if (nv12 && c == 2) {
+      // Written together with the second component.
+      continue;
+    }
+    const auto& compinfo = cinfo->comp_info[c];
+    const size_t num_channels = nv12 && c == 1 ? 2 : 1;
+    size_t comp_width = compinfo.width_in_blocks * DCTSIZE;
+    size_t comp_nrows = compinfo.v_samp_factor * DCTSIZE;
+    size_t y0 = cinfo->output_iMCU_row * comp_nrows;
+    size_t y1 = std::min<size_t>(y0 + comp_nrows, compinfo.downsampled_height);
+    for (size_t y = y0; y < y1; ++y) {
+      float* rows[2];
+      for (size_t i = 0; i < num_channels; ++i) {
+        rows[i] = m->render_buffers_.raw_output[c + i].Row(y);
+        (*m->decenter_row)(rows[i], comp_width);
+      }
+      (*m->write_to_output)(cinfo, rows, 0, compinfo.downsampled_width,
+                            num_channels, m->render_buffers_.output_scratch,
+                            planes[c] + y * strides[c]);
+    }
+  }
+  ++cinfo->output_iMCU_row;
+  cinfo->output_scanline += cinfo->max_v_samp_factor * DCTSIZE;
+  if (cinfo->output_scanline >= cinfo->output_height) {
+    ++m->output_passes_done_;
+  }
+}
+
 void ProcessRawOutput(j_decompress_ptr cinfo, JSAMPIMAGE data) {
   jpegli::DecodeCurrentiMCURow(cinfo);
   jpeg_decomp_master* m = cinfo->master;
+  StageTimer timer(&m->stage_stats, JPEGLI_STAGE_WRITE_OUTPUT);
   for (int c = 0; c < cinfo->num_components; ++c) {
     const auto& compinfo = cinfo->comp_info[c];
     size_t comp_width = compinfo.width_in_blocks * DCTSIZE;
@@ -654,10 +1321,11 @@ void ProcessRawOutput(j_decompress_ptr cinfo, JSAMPIMAGE data) {
     size_t y0 = cinfo->output_iMCU_row * compinfo.v_samp_factor * DCTSIZE;
     size_t y1 = std::min(y0 + comp_nrows, comp_height);
     for (size_t y = y0; y < y1; ++y) {
-      float* rows[1] = {m->raw_output_[c].Row(y)};
+      float* rows[1] = {m->render_buffers_.raw_output[c].Row(y)};
       uint8_t* output = data[c][y - y0];
-      DecenterRow(rows[0], comp_width);
-      WriteToOutput(cinfo, rows, 0, comp_width, 1, output);
+      (*m->decenter_row)(rows[0], comp_width);
+      (*m->write_to_output)(cinfo, rows, 0, comp_width, 1,
+                            m->render_buffers_.output_scratch, output);
     }
   }
   ++cinfo->output_iMCU_row;
@@ -667,16 +1335,65 @@ void ProcessRawOutput(j_decompress_ptr cinfo, JSAMPIMAGE data) {
   }
 }
 
+namespace {
+
+// Same as ProcessOutput() for a resized output. The rendered rows are added to
+// the resizer only as far as they are needed for the next output row, so that
+// the rows under its vertical filter window are still in the ring buffer when
+// the output row is resampled.
+void ProcessResizedOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
+                          JSAMPARRAY scanlines, size_t max_output_rows) {
+  jpeg_decomp_master* m = cinfo->master;
+  const size_t context = m->need_context_rows_ ? 1 : 0;
+  const size_t imcu_row = cinfo->output_iMCU_row;
+  const size_t imcu_height = cinfo->max_v_samp_factor * m->min_scaled_dct_size;
+  size_t rows_ready = m->render_height_;
+  if (imcu_row < cinfo->total_iMCU_rows) {
+    rows_ready = imcu_row > context ? (imcu_row - context) * imcu_height : 0;
+  }
+  if (m->render_scanline_ >= rows_ready &&
+      m->render_scanline_ <
+          ResizerRowsNeeded(cinfo, cinfo->output_scanline)) {
+    DecodeCurrentiMCURow(cinfo);
+    ++cinfo->output_iMCU_row;
+    return;
+  }
+  while (*num_output_rows < max_output_rows) {
+    size_t rows_needed = ResizerRowsNeeded(cinfo, cinfo->output_scanline);
+    if (m->render_scanline_ < rows_needed) {
+      if (m->render_scanline_ >= rows_ready) break;
+      size_t yend = std::min(rows_needed, rows_ready);
+      (*m->render_output_rows)(cinfo, m->render_scanline_, yend,
+                               &m->render_buffers_, nullptr, &m->stage_stats);
+      m->render_scanline_ = yend;
+      continue;
+    }
+    StageTimer timer(&m->stage_stats, JPEGLI_STAGE_WRITE_OUTPUT);
+    WriteResizedRow(cinfo, cinfo->output_scanline,
+                    scanlines ? scanlines[*num_output_rows] : nullptr);
+    ++cinfo->output_scanline;
+    ++*num_output_rows;
+    if (cinfo->output_scanline == cinfo->output_height) {
+      ++m->output_passes_done_;
+      break;
+    }
+  }
+}
+
+}  // namespace
+
 void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
                    JSAMPARRAY scanlines, size_t max_output_rows) {
   jpeg_decomp_master* m = cinfo->master;
+  CheckCancelFlag(cinfo);
+  if (m->resize_width_ != 0) {
+    ProcessResizedOutput(cinfo, num_output_rows, scanlines, max_output_rows);
+    return;
+  }
   const int vfactor = cinfo->max_v_samp_factor;
-  const int hfactor = cinfo->max_h_samp_factor;
   const size_t context = m->need_context_rows_ ? 1 : 0;
   const size_t imcu_row = cinfo->output_iMCU_row;
   const size_t imcu_height = vfactor * m->min_scaled_dct_size;
-  const size_t imcu_width = hfactor * m->min_scaled_dct_size;
-  const size_t output_width = m->iMCU_cols_ * imcu_width;
   if (imcu_row == cinfo->total_iMCU_rows ||
       (imcu_row > context &&
        cinfo->output_scanline < (imcu_row - context) * imcu_height)) {
@@ -686,76 +1403,13 @@ void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
                        ? cinfo->output_height
                        : (imcu_row - context) * imcu_height);
     yend = std::min<size_t>(yend, ybegin + max_output_rows - *num_output_rows);
-    size_t yb = (ybegin / vfactor) * vfactor;
-    size_t ye = DivCeil(yend, vfactor) * vfactor;
-    for (size_t y = yb; y < ye; y += vfactor) {
-      for (int c = 0; c < cinfo->num_components; ++c) {
-        RowBuffer<float>* raw_out = &m->raw_output_[c];
-        RowBuffer<float>* render_out = &m->render_output_[c];
-        int line_groups = vfactor / m->v_factor[c];
-        int downsampled_width = output_width / m->h_factor[c];
-        size_t yc = y / m->v_factor[c];
-        for (int dy = 0; dy < line_groups; ++dy) {
-          size_t ymid = yc + dy;
-          const float* JXL_RESTRICT row_mid = raw_out->Row(ymid);
-          if (cinfo->do_fancy_upsampling && m->v_factor[c] == 2) {
-            const float* JXL_RESTRICT row_top =
-                ymid == 0 ? row_mid : raw_out->Row(ymid - 1);
-            const float* JXL_RESTRICT row_bot = ymid + 1 == m->raw_height_[c]
-                                                    ? row_mid
-                                                    : raw_out->Row(ymid + 1);
-            Upsample2Vertical(row_top, row_mid, row_bot,
-                              render_out->Row(2 * dy),
-                              render_out->Row(2 * dy + 1), downsampled_width);
-          } else {
-            for (int yix = 0; yix < m->v_factor[c]; ++yix) {
-              memcpy(render_out->Row(m->v_factor[c] * dy + yix), row_mid,
-                     downsampled_width * sizeof(float));
-            }
-          }
-          if (m->h_factor[c] > 1) {
-            for (int yix = 0; yix < m->v_factor[c]; ++yix) {
-              int row_ix = m->v_factor[c] * dy + yix;
-              float* JXL_RESTRICT row = render_out->Row(row_ix);
-              float* JXL_RESTRICT tmp = m->upsample_scratch_;
-              if (cinfo->do_fancy_upsampling && m->h_factor[c] == 2) {
-                Upsample2Horizontal(row, tmp, output_width);
-              } else {
-                // TODO(szabadka) SIMDify this.
-                for (size_t x = 0; x < output_width; ++x) {
-                  tmp[x] = row[x / m->h_factor[c]];
-                }
-                memcpy(row, tmp, output_width * sizeof(tmp[0]));
-              }
-            }
-          }
-        }
-      }
-      for (int yix = 0; yix < vfactor; ++yix) {
-        if (y + yix < ybegin || y + yix >= yend) continue;
-        float* rows[kMaxComponents];
-        int num_all_components =
-            std::max(cinfo->out_color_components, cinfo->num_components);
-        for (int c = 0; c < num_all_components; ++c) {
-          rows[c] = m->render_output_[c].Row(yix);
-        }
-        (*m->color_transform)(rows, output_width);
-        for (int c = 0; c < cinfo->out_color_components; ++c) {
-          // Undo the centering of the sample values around zero.
-          DecenterRow(rows[c], output_width);
-        }
-        if (scanlines) {
-          uint8_t* output = scanlines[*num_output_rows];
-          WriteToOutput(cinfo, rows, m->xoffset_, cinfo->output_width,
-                        cinfo->out_color_components, output);
-        }
-        JPEGLI_CHECK(cinfo->output_scanline == y + yix);
-        ++cinfo->output_scanline;
-        ++(*num_output_rows);
-        if (cinfo->output_scanline == cinfo->output_height) {
-          ++m->output_passes_done_;
-        }
-      }
+    (*m->render_output_rows)(
+        cinfo, ybegin, yend, &m->render_buffers_,
+        scanlines ? &scanlines[*num_output_rows] : nullptr, &m->stage_stats);
+    cinfo->output_scanline = yend;
+    *num_output_rows += yend - ybegin;
+    if (cinfo->output_scanline == cinfo->output_height) {
+      ++m->output_passes_done_;
     }
   } else {
     DecodeCurrentiMCURow(cinfo);
@@ -763,5 +1417,78 @@ void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
   }
 }
 
+bool CanRenderInParallel(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  return m->runner != nullptr && !m->streaming_mode_ &&
+         !m->coeff_band_decoding_ && !m->apply_smoothing &&
+         !cinfo->quantize_colors && !cinfo->raw_data_out &&
+         m->resize_width_ == 0 &&
+         cinfo->output_iMCU_row == 0 && cinfo->output_scanline == 0 &&
+         cinfo->total_iMCU_rows > kMinRenderBandHeight;
+}
+
+void RenderInParallel(j_decompress_ptr cinfo, JSAMPARRAY scanlines) {
+  jpeg_decomp_master* m = cinfo->master;
+  StageTimer timer(&m->stage_stats, JPEGLI_STAGE_PARALLEL_RENDER);
+  const size_t num_rows = cinfo->total_iMCU_rows;
+  const size_t num_bands =
+      std::min(kMaxRenderBands, DivCeil(num_rows, kMinRenderBandHeight));
+  if (m->num_band_buffers_ < num_bands) {
+    m->band_buffers_ = Allocate<RenderBuffers>(cinfo, num_bands, JPOOL_IMAGE);
+    for (size_t i = 0; i < num_bands; ++i) {
+      AllocateRenderBuffers(cinfo, &m->band_buffers_[i]);
+      m->band_buffers_[i].row_transform_thread = i;
+    }
+    m->num_band_buffers_ = num_bands;
+  }
+  // The coefficient rows are collected here, since the memory manager can not
+  // be used by the parallel tasks.
+  std::vector<JBLOCKROW> block_rows[kMaxComponents];
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    const jpeg_component_info* comp = &cinfo->comp_info[c];
+    block_rows[c].resize(num_rows * comp->v_samp_factor);
+    for (size_t by = 0; by < comp->height_in_blocks;
+         by += comp->v_samp_factor) {
+      JDIMENSION nrows = std::min<JDIMENSION>(comp->v_samp_factor,
+                                              comp->height_in_blocks - by);
+      JBLOCKARRAY ba = (*cinfo->mem->access_virt_barray)(
+          reinterpret_cast<j_common_ptr>(cinfo), m->coef_arrays[c], by, nrows,
+          FALSE);
+      std::copy(ba, ba + nrows, &block_rows[c][by]);
+    }
+  }
+  // The dequantization biases depend on the statistics of all the preceding
+  // iMCU rows, so they are computed here in the same order as in the
+  // sequential output pass, and saved at each update.
+  const size_t coeffs_per_block = cinfo->num_components * DCTSIZE2;
+  if (m->band_biases_ == nullptr) {
+    m->band_biases_ = Allocate<float>(
+        cinfo, (num_rows / 4 + 1) * coeffs_per_block, JPOOL_IMAGE_ALIGNED);
+  }
+  float* biases = m->band_biases_;
+  memcpy(biases, m->biases_, coeffs_per_block * sizeof(float));
+  for (size_t imcu_row = 0; imcu_row < num_rows; ++imcu_row) {
+    JBLOCKARRAY blocks[kMaxComponents];
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      blocks[c] = &block_rows[c][imcu_row * cinfo->comp_info[c].v_samp_factor];
+    }
+    UpdateDequantBiases(cinfo, imcu_row, blocks);
+    if (imcu_row % 4 == 3) {
+      memcpy(&biases[((imcu_row + 1) / 4) * coeffs_per_block], m->biases_,
+             coeffs_per_block * sizeof(float));
+    }
+  }
+  const auto render_band = [&](uint32_t band, size_t /* thread */) {
+    size_t imcu_begin = band * num_rows / num_bands;
+    size_t imcu_end = (band + 1) * num_rows / num_bands;
+    RenderBand(cinfo, imcu_begin, imcu_end, block_rows, biases,
+               &m->band_buffers_[band], scanlines);
+  };
+  RunParallel(cinfo, 0, static_cast<uint32_t>(num_bands), render_band);
+  cinfo->output_iMCU_row = num_rows;
+  cinfo->output_scanline = cinfo->output_height;
+  ++m->output_passes_done_;
+}
+
 }  // namespace jpegli
 #endif  // HWY_ONCE
@@ -8,8 +8,10 @@
 #define LIB_JPEGLI_RENDER_H_
 
 #include <cstddef>
+#include <cstdint>
 
 #include "lib/jpegli/common.h"
+#include "lib/jpegli/decode_internal.h"
 
 namespace jpegli {
 
@@ -20,6 +22,34 @@ void ProcessOutput(j_decompress_ptr cinfo, size_t* num_output_rows,
 
 void ProcessRawOutput(j_decompress_ptr cinfo, JSAMPIMAGE data);
 
+// Same as ProcessRawOutput(), but writes the components of the current iMCU
+// row to the planes of jpegli_decode_planes(), without their padding.
+void ProcessRawPlanes(j_decompress_ptr cinfo, uint8_t* const planes[],
+                      const size_t strides[], JpegliPlaneLayout layout);
+
+// Sets the planes of jpegli_decode_planes() that the channels of the output
+// rows are written to for the rest of the current output pass, where the
+// output row pointers point into the first plane, or switches back to
+// interleaved output rows if planes is nullptr.
+void SetOutputPlanes(j_decompress_ptr cinfo, uint8_t* const planes[],
+                     const size_t strides[]);
+
+// Advances to the next iMCU row without rendering the current one. The
+// output rows that depend on the skipped iMCU row can not be rendered after
+// this.
+void SkipCurrentiMCURow(j_decompress_ptr cinfo);
+
+void AllocateRenderBuffers(j_decompress_ptr cinfo, RenderBuffers* buffers);
+
+// Returns true if the current output pass can be rendered with
+// RenderInParallel(), once all of its input is available.
+bool CanRenderInParallel(j_decompress_ptr cinfo);
+
+// Renders all the output rows of the current output pass into scanlines,
+// which must have cinfo->output_height rows, by splitting the image into bands
+// of iMCU rows that are processed by the parallel runner.
+void RenderInParallel(j_decompress_ptr cinfo, JSAMPARRAY scanlines);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_RENDER_H_
@@ -0,0 +1,158 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "lib/jpegli/resize.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/decode_internal.h"
+#include "lib/jpegli/memory_manager.h"
+
+namespace jpegli {
+
+namespace {
+
+constexpr double kPi = 3.14159265358979323846;
+
+double FilterSupport(JpegliResizeFilter filter) {
+  switch (filter) {
+    case JPEGLI_FILTER_BOX:
+      return 0.5;
+    case JPEGLI_FILTER_TRIANGLE:
+      return 1.0;
+    default:
+      return 3.0;
+  }
+}
+
+double Sinc(double x) {
+  return x == 0.0 ? 1.0 : std::sin(kPi * x) / (kPi * x);
+}
+
+double FilterWeight(JpegliResizeFilter filter, double x) {
+  switch (filter) {
+    case JPEGLI_FILTER_BOX:
+      return x >= -0.5 && x < 0.5 ? 1.0 : 0.0;
+    case JPEGLI_FILTER_TRIANGLE:
+      return std::max(0.0, 1.0 - std::abs(x));
+    default:
+      return std::abs(x) < 3.0 ? Sinc(x) * Sinc(x / 3.0) : 0.0;
+  }
+}
+
+// The output samples are centered at the same relative positions as the
+// input samples. When downscaling, the filter is stretched by the scale factor
+// so that every input sample contributes to the output. The taps outside of
+// the input are dropped, and the weights of the others are normalized.
+void ComputeTaps(j_decompress_ptr cinfo, size_t in_size, size_t out_size,
+                 JpegliResizeFilter filter, ResizeTaps* taps) {
+  const double scale = static_cast<double>(in_size) / out_size;
+  const double filter_scale = std::max(1.0, scale);
+  const double support = FilterSupport(filter) * filter_scale;
+  const ptrdiff_t max_taps = std::ceil(2 * support) + 1;
+  const ptrdiff_t last = in_size - 1;
+  taps->max_taps = max_taps;
+  taps->start = Allocate<uint32_t>(cinfo, out_size, JPOOL_IMAGE);
+  taps->num_taps = Allocate<uint32_t>(cinfo, out_size, JPOOL_IMAGE);
+  taps->weights = Allocate<float>(cinfo, out_size * max_taps, JPOOL_IMAGE);
+  for (size_t i = 0; i < out_size; ++i) {
+    const double center = (i + 0.5) * scale - 0.5;
+    ptrdiff_t lo = std::ceil(center - support);
+    ptrdiff_t hi = std::floor(center + support);
+    lo = std::min(std::max<ptrdiff_t>(lo, 0), last);
+    hi = std::min({std::max(hi, lo), last, lo + max_taps - 1});
+    float* weights = &taps->weights[i * max_taps];
+    const ptrdiff_t num_taps = hi - lo + 1;
+    double sum = 0.0;
+    for (ptrdiff_t k = 0; k < num_taps; ++k) {
+      sum += FilterWeight(filter, (lo + k - center) / filter_scale);
+    }
+    for (ptrdiff_t k = 0; k < num_taps; ++k) {
+      double w = FilterWeight(filter, (lo + k - center) / filter_scale);
+      weights[k] = sum != 0.0 ? w / sum : 1.0 / num_taps;
+    }
+    taps->start[i] = lo;
+    taps->num_taps[i] = num_taps;
+  }
+}
+
+}  // namespace
+
+void AllocateResizer(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  Resizer* r = &m->resizer_;
+  ComputeTaps(cinfo, m->render_width_, cinfo->output_width, m->resize_filter_,
+              &r->xtaps);
+  ComputeTaps(cinfo, m->render_height_, cinfo->output_height,
+              m->resize_filter_, &r->ytaps);
+  r->num_channels = cinfo->out_color_components;
+  r->ring_size = r->ytaps.max_taps;
+  r->rows.Allocate(cinfo, r->ring_size * r->num_channels, cinfo->output_width);
+  r->output_rows.Allocate(cinfo, r->num_channels, cinfo->output_width);
+  size_t bytes_per_sample = jpegli_bytes_per_sample(m->output_data_type_);
+  size_t bytes_per_pixel = r->num_channels * bytes_per_sample;
+  size_t scratch_stride = RoundUpTo(cinfo->output_width, HWY_ALIGNMENT);
+  r->output_scratch = Allocate<uint8_t>(
+      cinfo, bytes_per_pixel * scratch_stride, JPOOL_IMAGE_ALIGNED);
+}
+
+size_t ResizerRowsNeeded(j_decompress_ptr cinfo, size_t y) {
+  const ResizeTaps& taps = cinfo->master->resizer_.ytaps;
+  return taps.start[y] + taps.num_taps[y];
+}
+
+void AddRenderedRow(j_decompress_ptr cinfo, size_t y, float* rows[],
+                    size_t xoffset) {
+  Resizer* r = &cinfo->master->resizer_;
+  const ResizeTaps& taps = r->xtaps;
+  const size_t ring_row = (y % r->ring_size) * r->num_channels;
+  for (size_t c = 0; c < r->num_channels; ++c) {
+    const float* JXL_RESTRICT row_in = rows[c] + xoffset;
+    float* JXL_RESTRICT row_out = r->rows.Row(ring_row + c);
+    for (size_t x = 0; x < cinfo->output_width; ++x) {
+      const float* JXL_RESTRICT weights = &taps.weights[x * taps.max_taps];
+      const float* JXL_RESTRICT in = &row_in[taps.start[x]];
+      float sum = 0.0f;
+      for (size_t k = 0; k < taps.num_taps[x]; ++k) {
+        sum += weights[k] * in[k];
+      }
+      row_out[x] = sum;
+    }
+  }
+}
+
+void WriteResizedRow(j_decompress_ptr cinfo, size_t y, uint8_t* output) {
+  if (output == nullptr) return;
+  jpeg_decomp_master* m = cinfo->master;
+  Resizer* r = &m->resizer_;
+  const ResizeTaps& taps = r->ytaps;
+  const float* weights = &taps.weights[y * taps.max_taps];
+  const size_t width = cinfo->output_width;
+  float* rows[kMaxComponents];
+  for (size_t c = 0; c < r->num_channels; ++c) {
+    float* JXL_RESTRICT row_out = r->output_rows.Row(c);
+    for (size_t k = 0; k < taps.num_taps[y]; ++k) {
+      size_t ring_row = ((taps.start[y] + k) % r->ring_size) * r->num_channels;
+      const float* JXL_RESTRICT row_in = r->rows.Row(ring_row + c);
+      const float w = weights[k];
+      if (k == 0) {
+        for (size_t x = 0; x < width; ++x) row_out[x] = w * row_in[x];
+      } else {
+        for (size_t x = 0; x < width; ++x) row_out[x] += w * row_in[x];
+      }
+    }
+    rows[c] = row_out;
+  }
+  (*m->write_to_output)(cinfo, rows, 0, width, r->num_channels,
+                        r->output_scratch, output);
+}
+
+}  // namespace jpegli
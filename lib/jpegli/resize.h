@@ -0,0 +1,36 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef LIB_JPEGLI_RESIZE_H_
+#define LIB_JPEGLI_RESIZE_H_
+
+#include <cstddef>
+
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/decode_internal.h"
+
+namespace jpegli {
+
+// Computes the filter taps and allocates the buffers of the resampling of the
+// m->render_width_ x m->render_height_ rendered rows to the output size.
+void AllocateResizer(j_decompress_ptr cinfo);
+
+// Returns the number of rendered rows that are needed for output row y.
+size_t ResizerRowsNeeded(j_decompress_ptr cinfo, size_t y);
+
+// Resamples horizontally the rendered row y, whose channel c starts at
+// rows[c] + xoffset, and stores it in the ring buffer of the resizer. The
+// rendered rows must be added in order.
+void AddRenderedRow(j_decompress_ptr cinfo, size_t y, float* rows[],
+                    size_t xoffset);
+
+// Resamples vertically the output row y from the rendered rows in the ring
+// buffer, and writes it to output if output is not nullptr.
+void WriteResizedRow(j_decompress_ptr cinfo, size_t y, uint8_t* output);
+
+}  // namespace jpegli
+
+#endif  // LIB_JPEGLI_RESIZE_H_
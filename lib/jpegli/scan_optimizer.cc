@@ -0,0 +1,239 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "lib/jpegli/scan_optimizer.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "lib/base/bits.h"
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/entropy_coding.h"
+#include "lib/jpegli/error.h"
+#include "lib/jpegli/memory_manager.h"
+
+namespace jpegli {
+
+namespace {
+
+// The candidate AC scans of a component split the spectral band 1..63 after
+// one of these coefficients, where 0 means no split. The lower band is coded
+// in one scan, and the upper band is first coded with its Al least
+// significant bits left out, which are then added by Al refinement scans.
+constexpr int kBandSplits[] = {0, 2, 5, 8, 12, 20};
+constexpr int kNumBandSplits = sizeof(kBandSplits) / sizeof(kBandSplits[0]);
+constexpr int kMaxAl = 3;
+
+// Size of the SOS marker and of the DHT table header of a scan.
+constexpr float kScanOverheadBits = 8 * (2 + 2 + 1 + 2 + 3 + 2 + 1);
+
+// Accumulates the estimated size of an AC scan of one component. The
+// symbols and extra bits are counted the same way as the tokenizer creates
+// them, except that the restart markers are not taken into account.
+class ScanCostEstimator {
+ public:
+  void Init(int Ss, int Se, int Ah, int Al) {
+    Ss_ = Ss;
+    Se_ = Se;
+    Ah_ = Ah;
+    Al_ = Al;
+    memset(histo_, 0, sizeof(histo_));
+    extra_bits_ = 0;
+    eob_run_ = 0;
+    eob_refbits_ = 0;
+  }
+
+  // Adds the next block, given by the zig-zag positions pos and the absolute
+  // values absval of its num nonzero AC coefficients in increasing position
+  // order.
+  void AddBlock(const uint8_t* pos, const uint16_t* absval, int num) {
+    int i = 0;
+    while (i < num && pos[i] < Ss_) ++i;
+    int r = 0;
+    int last = Ss_ - 1;
+    int refbits = 0;
+    for (; i < num && pos[i] <= Se_; ++i) {
+      const int v = absval[i] >> Al_;
+      if (v == 0) continue;
+      r += pos[i] - last - 1;
+      last = pos[i];
+      if (Ah_ > 0 && v > 1) {
+        // Correction bit of a coefficient that is already nonzero.
+        ++extra_bits_;
+        ++refbits;
+        continue;
+      }
+      if (eob_run_ > 0) FlushEobRun();
+      for (; r > 15; r -= 16) ++histo_[0xf0];
+      const int nbits = Ah_ > 0 ? 1 : jxl::FloorLog2Nonzero<uint32_t>(v) + 1;
+      ++histo_[(r << 4) + nbits];
+      extra_bits_ += nbits;
+      r = 0;
+      refbits = 0;
+    }
+    r += Se_ - last;
+    if (r > 0 || refbits > 0) {
+      if (eob_refbits_ + refbits > 255) FlushEobRun();
+      eob_refbits_ += refbits;
+      if (++eob_run_ == 0x7FFF) FlushEobRun();
+    }
+  }
+
+  // Returns the estimated size of the scan in bits.
+  float Finish() {
+    if (eob_run_ > 0) FlushEobRun();
+    return HistogramCost(histo_) + extra_bits_ + kScanOverheadBits;
+  }
+
+ private:
+  void FlushEobRun() {
+    const int nbits = jxl::FloorLog2Nonzero<uint32_t>(eob_run_);
+    ++histo_[nbits << 4];
+    extra_bits_ += nbits;
+    eob_run_ = 0;
+    eob_refbits_ = 0;
+  }
+
+  int Ss_;
+  int Se_;
+  int Ah_;
+  int Al_;
+  int histo_[kJpegHuffmanAlphabetSize];
+  size_t extra_bits_;
+  int eob_run_;
+  int eob_refbits_;
+};
+
+struct ComponentScans {
+  int split;
+  int Al;
+};
+
+// Returns the candidate AC scan structure of the component with the smallest
+// estimated size.
+ComponentScans SelectComponentScans(j_compress_ptr cinfo, int c) {
+  const jpeg_component_info* comp = &cinfo->comp_info[c];
+  // Indexed by split, then lower band scan, Al + 1 upper band first scans
+  // for Al = 0 .. kMaxAl, and kMaxAl upper band refinement scans of bit
+  // 0 .. kMaxAl - 1.
+  constexpr int kScansPerSplit = 1 + (kMaxAl + 1) + kMaxAl;
+  std::vector<ScanCostEstimator> scans(kNumBandSplits * kScansPerSplit);
+  for (int s = 0; s < kNumBandSplits; ++s) {
+    ScanCostEstimator* est = &scans[s * kScansPerSplit];
+    const int split = kBandSplits[s];
+    est[0].Init(1, std::max(split, 1), 0, 0);
+    for (int al = 0; al <= kMaxAl; ++al) {
+      est[1 + al].Init(split + 1, DCTSIZE2 - 1, 0, al);
+    }
+    for (int al = 0; al < kMaxAl; ++al) {
+      est[2 + kMaxAl + al].Init(split + 1, DCTSIZE2 - 1, al + 1, al);
+    }
+  }
+  uint8_t pos[DCTSIZE2];
+  uint16_t absval[DCTSIZE2];
+  for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+    JBLOCKARRAY blocks = GetBlockRow(cinfo, c, by);
+    for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+      const JCOEF* block = &blocks[0][bx][0];
+      int num = 0;
+      for (int k = 1; k < DCTSIZE2; ++k) {
+        if (block[k] != 0) {
+          pos[num] = k;
+          absval[num] = std::abs(block[k]);
+          ++num;
+        }
+      }
+      for (ScanCostEstimator& est : scans) {
+        est.AddBlock(pos, absval, num);
+      }
+    }
+  }
+  ComponentScans best = {0, 0};
+  float best_cost = std::numeric_limits<float>::max();
+  for (int s = 0; s < kNumBandSplits; ++s) {
+    ScanCostEstimator* est = &scans[s * kScansPerSplit];
+    const float lower_cost = kBandSplits[s] > 0 ? est[0].Finish() : 0.0f;
+    float refinement_cost = 0.0f;
+    for (int al = 0; al <= kMaxAl; ++al) {
+      const float cost = lower_cost + est[1 + al].Finish() + refinement_cost;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best = {kBandSplits[s], al};
+      }
+      if (al < kMaxAl) {
+        refinement_cost += est[2 + kMaxAl + al].Finish();
+      }
+    }
+  }
+  return best;
+}
+
+void AddScan(jpeg_scan_info* scan, int c, int Ss, int Se, int Ah, int Al) {
+  scan->comps_in_scan = 1;
+  scan->component_index[0] = c;
+  scan->Ss = Ss;
+  scan->Se = Se;
+  scan->Ah = Ah;
+  scan->Al = Al;
+}
+
+}  // namespace
+
+void OptimizeScanScript(j_compress_ptr cinfo) {
+  ComponentScans comp_scans[kMaxComponents];
+  int num_ac_scans = 0;
+  int max_al = 0;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    comp_scans[c] = SelectComponentScans(cinfo, c);
+    num_ac_scans += (comp_scans[c].split > 0 ? 2 : 1) + comp_scans[c].Al;
+    max_al = std::max(max_al, comp_scans[c].Al);
+  }
+  // The DC scans of the current scan script are kept, since the DC symbols
+  // do not depend on the AC scans, and a streamed DC scan is already written.
+  int num_dc_scans = 0;
+  while (num_dc_scans < cinfo->num_scans &&
+         cinfo->scan_info[num_dc_scans].Ss == 0) {
+    ++num_dc_scans;
+  }
+  const int num_scans = num_dc_scans + num_ac_scans;
+  jpeg_scan_info* scan_info = cinfo->script_space;
+  if (cinfo->script_space == nullptr || cinfo->script_space_size < num_scans) {
+    scan_info = Allocate<jpeg_scan_info>(cinfo, num_scans);
+  }
+  memmove(scan_info, cinfo->scan_info, num_dc_scans * sizeof(scan_info[0]));
+  cinfo->script_space = scan_info;
+  cinfo->script_space_size = std::max(cinfo->script_space_size, num_scans);
+  jpeg_scan_info* next_scan = scan_info + num_dc_scans;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    if (comp_scans[c].split > 0) {
+      AddScan(next_scan++, c, 1, comp_scans[c].split, 0, 0);
+    }
+  }
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    AddScan(next_scan++, c, comp_scans[c].split + 1, DCTSIZE2 - 1, 0,
+            comp_scans[c].Al);
+  }
+  for (int al = max_al - 1; al >= 0; --al) {
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      if (comp_scans[c].Al > al) {
+        AddScan(next_scan++, c, comp_scans[c].split + 1, DCTSIZE2 - 1, al + 1,
+                al);
+      }
+    }
+  }
+  JPEGLI_CHECK(next_scan - cinfo->script_space == num_scans);
+  cinfo->scan_info = cinfo->script_space;
+  cinfo->num_scans = num_scans;
+}
+
+}  // namespace jpegli
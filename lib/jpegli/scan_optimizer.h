@@ -0,0 +1,26 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+// Selection of the progressive scan script from the quantized coefficients,
+// used with jpegli_optimize_scans().
+
+#ifndef LIB_JPEGLI_SCAN_OPTIMIZER_H_
+#define LIB_JPEGLI_SCAN_OPTIMIZER_H_
+
+#include "lib/jpegli/common.h"
+
+namespace jpegli {
+
+// Replaces the scan script of a progressive image with the candidate scan
+// script that has the smallest estimated size for the buffered coefficients,
+// which must be quantized and in zig-zag order. The size of each candidate
+// scan is estimated from the histogram of its symbols and its number of extra
+// bits, which are counted without tokenizing the scan.
+void OptimizeScanScript(j_compress_ptr cinfo);
+
+}  // namespace jpegli
+
+#endif  // LIB_JPEGLI_SCAN_OPTIMIZER_H_
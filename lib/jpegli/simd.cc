@@ -6,8 +6,13 @@
 
 #include "lib/jpegli/simd.h"
 
+#include <cctype>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <mutex>
+
+#include "lib/jpegli/common.h"
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jpegli/simd.cc"
@@ -20,6 +25,8 @@ namespace HWY_NAMESPACE {
 
 size_t GetVectorSize() { return HWY_LANES(uint8_t); }
 
+const char* GetTargetName() { return hwy::TargetName(HWY_TARGET); }
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jpegli
@@ -30,13 +37,73 @@ namespace jpegli {
 namespace {
 
 HWY_EXPORT(GetVectorSize);  // Local function.
+HWY_EXPORT(GetTargetName);  // Local function.
+
+std::once_flag simd_targets_once;
+
+bool NameEquals(const char* name, const char* begin, const char* end) {
+  for (; begin < end; ++begin, ++name) {
+    if (*name == 0 || std::toupper(static_cast<unsigned char>(*begin)) !=
+                          std::toupper(static_cast<unsigned char>(*name))) {
+      return false;
+    }
+  }
+  return *name == 0;
+}
+
+// Parses a comma separated list of target names or a number, returns zero,
+// i.e. no restriction, if the value is empty or invalid.
+int64_t ParseSimdTargets(const char* value) {
+  if (std::isdigit(static_cast<unsigned char>(value[0]))) {
+    char* end;
+    int64_t mask = std::strtoll(value, &end, 0);
+    return *end == 0 ? mask : 0;
+  }
+  int64_t mask = 0;
+  const char* begin = value;
+  while (*begin != 0) {
+    const char* end = begin;
+    while (*end != 0 && *end != ',') ++end;
+    int64_t target = 0;
+    for (int bit = 0; bit < 63 && end > begin; ++bit) {
+      if (NameEquals(hwy::TargetName(int64_t{1} << bit), begin, end)) {
+        target = int64_t{1} << bit;
+        break;
+      }
+    }
+    if (target == 0) return 0;
+    mask |= target;
+    begin = *end == ',' ? end + 1 : end;
+  }
+  return mask;
+}
+
+void ApplySimdTargets(int64_t mask) {
+  hwy::DisableTargets(mask == 0 ? 0 : ~mask);
+}
 
 }  // namespace
 
-size_t VectorSize() {
-  static size_t bytes = HWY_DYNAMIC_DISPATCH(GetVectorSize)();
-  return bytes;
+size_t VectorSize() { return HWY_DYNAMIC_DISPATCH(GetVectorSize)(); }
+
+const char* SimdTargetName() { return HWY_DYNAMIC_DISPATCH(GetTargetName)(); }
+
+void InitSimdTargets() {
+  std::call_once(simd_targets_once, [] {
+    const char* value = std::getenv("JPEGLI_SIMD_TARGETS");
+    if (value != nullptr) ApplySimdTargets(ParseSimdTargets(value));
+  });
 }
 
 }  // namespace jpegli
+
+void jpegli_set_simd_targets(int64_t mask) {
+  // Makes sure that the environment variable does not override the mask later.
+  jpegli::InitSimdTargets();
+  jpegli::ApplySimdTargets(mask);
+}
+
+const char* jpegli_simd_target_name() {
+  return jpegli::SimdTargetName();
+}
 #endif  // HWY_ONCE
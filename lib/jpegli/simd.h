@@ -11,9 +11,17 @@
 
 namespace jpegli {
 
-// Returns SIMD vector size in bytes.
+// Returns SIMD vector size in bytes of the current target.
 size_t VectorSize();
 
+// Returns the name of the current target.
+const char* SimdTargetName();
+
+// Applies the target mask of the JPEGLI_SIMD_TARGETS environment variable, only
+// the first time it is called and only if jpegli_set_simd_targets() was not
+// called before.
+void InitSimdTargets();
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_SIMD_H_
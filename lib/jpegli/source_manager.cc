@@ -4,19 +4,37 @@
 // license that can be found in the LICENSE file or at
 // https://developers.google.com/open-source/licenses/bsd
 
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/decode.h"
+#include "lib/jpegli/decode_internal.h"
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/memory_manager.h"
 
+#if defined(__unix__) || defined(__unix) || \
+    defined(__APPLE__) && defined(__MACH__)
+#define JPEGLI_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define JPEGLI_HAS_MMAP 0
+#endif
+
 namespace jpegli {
 
 void init_mem_source(j_decompress_ptr cinfo) {}
 void init_stdio_source(j_decompress_ptr cinfo) {}
+void init_mmap_source(j_decompress_ptr cinfo) {}
+void init_readahead_source(j_decompress_ptr cinfo) {}
 
 void skip_input_data(j_decompress_ptr cinfo, long num_bytes /* NOLINT */) {
   if (num_bytes <= 0) return;
@@ -57,6 +75,126 @@ struct StdioSourceManager {
   }
 };
 
+// The whole file is exposed as a single input buffer, so that the decoder
+// reads it without any copies or further system calls.
+struct MmapSourceManager {
+  jpeg_source_mgr pub;
+  void* data;
+  size_t size;
+};
+
+void ReleaseMmapSource(j_decompress_ptr cinfo) {
+  if (!cinfo->src || cinfo->src->init_source != init_mmap_source) return;
+  auto* src = reinterpret_cast<MmapSourceManager*>(cinfo->src);
+#if JPEGLI_HAS_MMAP
+  if (src->data != nullptr) {
+    munmap(src->data, src->size);
+  }
+#endif
+  src->data = nullptr;
+  src->size = 0;
+}
+
+constexpr size_t kReadAheadBufferSize = 256 << 10;
+
+// The file is read on a helper thread into a ring of buffers, while the
+// decoder consumes the oldest filled one, so that it only waits for the file
+// when it is faster than the reads. The buffers from next_consume on are the
+// filled ones, the one before it is held by the decoder if holding is true,
+// and the helper thread fills the next free one, outside the lock.
+struct ReadAheadState {
+  FILE* f;
+  std::vector<std::vector<uint8_t>> buffers;
+  std::vector<size_t> sizes;
+  size_t next_read = 0;
+  size_t next_consume = 0;
+  size_t num_filled = 0;
+  bool holding = false;
+  bool eof = false;
+  bool stop = false;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::thread thread;
+
+  void Run() {
+    const size_t num_buffers = buffers.size();
+    for (;;) {
+      size_t index;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] {
+          return stop || num_filled + (holding ? 1 : 0) < num_buffers;
+        });
+        if (stop) return;
+        index = next_read;
+      }
+      size_t num_bytes =
+          fread(buffers[index].data(), 1, kReadAheadBufferSize, f);
+      std::lock_guard<std::mutex> lock(mutex);
+      sizes[index] = num_bytes;
+      next_read = (next_read + 1) % num_buffers;
+      ++num_filled;
+      cv.notify_all();
+      if (num_bytes < kReadAheadBufferSize) {
+        eof = true;
+        return;
+      }
+    }
+  }
+};
+
+struct ReadAheadSourceManager {
+  jpeg_source_mgr pub;
+  ReadAheadState* state;
+
+  static boolean fill_input_buffer(j_decompress_ptr cinfo) {
+    auto* src = reinterpret_cast<ReadAheadSourceManager*>(cinfo->src);
+    ReadAheadState* s = src->state;
+    size_t index;
+    {
+      std::unique_lock<std::mutex> lock(s->mutex);
+      if (s->holding) {
+        s->holding = false;
+        s->cv.notify_all();
+      }
+      s->cv.wait(lock, [&] { return s->num_filled > 0 || s->eof; });
+      if (s->num_filled == 0) {
+        return EmitFakeEoiMarker(cinfo);
+      }
+      index = s->next_consume;
+      s->next_consume = (s->next_consume + 1) % s->buffers.size();
+      --s->num_filled;
+      s->holding = true;
+    }
+    if (s->sizes[index] == 0) {
+      return EmitFakeEoiMarker(cinfo);
+    }
+    src->pub.next_input_byte = s->buffers[index].data();
+    src->pub.bytes_in_buffer = s->sizes[index];
+    return TRUE;
+  }
+};
+
+void ReleaseReadAheadSource(j_decompress_ptr cinfo) {
+  if (!cinfo->src || cinfo->src->init_source != init_readahead_source) return;
+  auto* src = reinterpret_cast<ReadAheadSourceManager*>(cinfo->src);
+  ReadAheadState* s = src->state;
+  if (s == nullptr) return;
+  {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    s->stop = true;
+    s->cv.notify_all();
+  }
+  s->thread.join();
+  delete s;
+  src->state = nullptr;
+}
+
+bool IsInMemorySource(j_decompress_ptr cinfo) {
+  return cinfo->src && (cinfo->src->init_source == init_mem_source ||
+                        cinfo->src->init_source == init_mmap_source);
+}
+
 }  // namespace jpegli
 
 void jpegli_mem_src(j_decompress_ptr cinfo, const unsigned char* inbuffer,
@@ -95,3 +233,91 @@ void jpegli_stdio_src(j_decompress_ptr cinfo, FILE* infile) {
   src->pub.resync_to_restart = jpegli_resync_to_restart;
   src->pub.term_source = jpegli::term_source;
 }
+
+void jpegli_readahead_src(j_decompress_ptr cinfo, FILE* infile,
+                         int num_buffers) {
+  if (cinfo->src && cinfo->src->init_source != jpegli::init_readahead_source) {
+    JPEGLI_ERROR(
+        "jpegli_readahead_src: a different source manager was already set");
+  }
+  if (num_buffers < 2) {
+    JPEGLI_ERROR("jpegli_readahead_src: invalid number of buffers %d",
+                 num_buffers);
+  }
+  if (!cinfo->src) {
+    auto* src = jpegli::Allocate<jpegli::ReadAheadSourceManager>(cinfo, 1);
+    src->state = nullptr;
+    cinfo->src = reinterpret_cast<jpeg_source_mgr*>(src);
+  }
+  jpegli::ReleaseReadAheadSource(cinfo);
+  auto* src = reinterpret_cast<jpegli::ReadAheadSourceManager*>(cinfo->src);
+  src->pub.next_input_byte = nullptr;
+  src->pub.bytes_in_buffer = 0;
+  src->pub.init_source = jpegli::init_readahead_source;
+  src->pub.fill_input_buffer =
+      jpegli::ReadAheadSourceManager::fill_input_buffer;
+  src->pub.skip_input_data = jpegli::skip_input_data;
+  src->pub.resync_to_restart = jpegli_resync_to_restart;
+  src->pub.term_source = jpegli::term_source;
+  auto* state = new jpegli::ReadAheadState();
+  state->f = infile;
+  state->buffers.resize(num_buffers);
+  for (auto& buffer : state->buffers) {
+    buffer.resize(jpegli::kReadAheadBufferSize);
+  }
+  state->sizes.resize(num_buffers);
+  state->thread = std::thread([state] { state->Run(); });
+  src->state = state;
+}
+
+void jpegli_mmap_src(j_decompress_ptr cinfo, const char* path) {
+  if (cinfo->src && cinfo->src->init_source != jpegli::init_mmap_source) {
+    JPEGLI_ERROR("jpegli_mmap_src: a different source manager was already set");
+  }
+  if (!cinfo->src) {
+    auto* src = jpegli::Allocate<jpegli::MmapSourceManager>(cinfo, 1);
+    src->data = nullptr;
+    src->size = 0;
+    cinfo->src = reinterpret_cast<jpeg_source_mgr*>(src);
+  }
+  jpegli::ReleaseMmapSource(cinfo);
+  auto* src = reinterpret_cast<jpegli::MmapSourceManager*>(cinfo->src);
+  src->pub.next_input_byte = nullptr;
+  src->pub.bytes_in_buffer = 0;
+  src->pub.init_source = jpegli::init_mmap_source;
+  src->pub.fill_input_buffer = jpegli::EmitFakeEoiMarker;
+  src->pub.skip_input_data = jpegli::skip_input_data;
+  src->pub.resync_to_restart = jpegli_resync_to_restart;
+  src->pub.term_source = jpegli::term_source;
+#if JPEGLI_HAS_MMAP
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    JPEGLI_ERROR("jpegli_mmap_src: cannot open file %s", path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    JPEGLI_ERROR("jpegli_mmap_src: cannot get the size of file %s", path);
+  }
+  const size_t size = st.st_size;
+  void* data = nullptr;
+  if (size > 0) {
+    data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  // The mapping stays valid after the file descriptor is closed.
+  close(fd);
+  if (data == MAP_FAILED) {
+    JPEGLI_ERROR("jpegli_mmap_src: cannot map file %s", path);
+  }
+  if (data != nullptr) {
+    madvise(data, size, MADV_SEQUENTIAL);
+  }
+  src->data = data;
+  src->size = size;
+  src->pub.next_input_byte = reinterpret_cast<const JOCTET*>(data);
+  src->pub.bytes_in_buffer = size;
+#else
+  (void)path;
+  JPEGLI_ERROR("jpegli_mmap_src: memory mapping is not supported");
+#endif
+}
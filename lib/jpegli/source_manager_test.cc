@@ -21,6 +21,14 @@
 #include "lib/jpegli/test_utils.h"
 #include "lib/jpegli/testing.h"
 
+#if defined(__unix__) || defined(__unix) || \
+    defined(__APPLE__) && defined(__MACH__)
+#include <unistd.h>
+#define JPEGLI_TEST_MMAP 1
+#else
+#define JPEGLI_TEST_MMAP 0
+#endif
+
 namespace jpegli {
 namespace {
 
@@ -85,6 +93,37 @@ TEST_P(SourceManagerTestParam, TestStdioSourceManager) {
   VerifyOutputImage(output1, output0, 1.0f);
 }
 
+TEST_P(SourceManagerTestParam, TestReadAheadSourceManager) {
+  TestConfig config = GetParam();
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, ReadTestData(config.fn),
+                     "Failed to read test data.");
+  if (config.dparams.size_factor < 1.0) {
+    compressed.resize(compressed.size() * config.dparams.size_factor);
+  }
+  for (int num_buffers : {2, 3}) {
+    FILE* src = MemOpen(compressed);
+    ASSERT_TRUE(src);
+    TestImage output0;
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_readahead_src(&cinfo, src, num_buffers);
+      ReadOutputImage(&cinfo, &output0);
+      return true;
+    };
+    bool ok = try_catch_block();
+    jpegli_destroy_decompress(&cinfo);
+    fclose(src);
+    ASSERT_TRUE(ok);
+
+    TestImage output1;
+    DecodeWithLibjpeg(CompressParams(), DecompressParams(), compressed,
+                      &output1);
+    VerifyOutputImage(output1, output0, 1.0f);
+  }
+}
+
 TEST_P(SourceManagerTestParam, TestMemSourceManager) {
   TestConfig config = GetParam();
   JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, ReadTestData(config.fn),
@@ -109,6 +148,41 @@ TEST_P(SourceManagerTestParam, TestMemSourceManager) {
   VerifyOutputImage(output1, output0, 1.0f);
 }
 
+#if JPEGLI_TEST_MMAP
+TEST_P(SourceManagerTestParam, TestMmapSourceManager) {
+  TestConfig config = GetParam();
+  JXL_ASSIGN_OR_QUIT(std::vector<uint8_t> compressed, ReadTestData(config.fn),
+                     "Failed to read test data.");
+  if (config.dparams.size_factor < 1.0f) {
+    compressed.resize(compressed.size() * config.dparams.size_factor);
+  }
+  char path[] = "/tmp/jpegli_mmap_src_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(-1, fd);
+  bool written = write(fd, compressed.data(), compressed.size()) ==
+                 static_cast<ssize_t>(compressed.size());
+  close(fd);
+  ASSERT_TRUE(written);
+  TestImage output0;
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&cinfo);
+    jpegli_mmap_src(&cinfo, path);
+    ReadOutputImage(&cinfo, &output0);
+    return true;
+  };
+  bool ok = try_catch_block();
+  jpegli_destroy_decompress(&cinfo);
+  unlink(path);
+  ASSERT_TRUE(ok);
+
+  TestImage output1;
+  DecodeWithLibjpeg(CompressParams(), DecompressParams(), compressed, &output1);
+  VerifyOutputImage(output1, output0, 1.0f);
+}
+#endif
+
 std::vector<TestConfig> GenerateTests() {
   std::vector<TestConfig> all_tests;
   {
@@ -0,0 +1,104 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "lib/jpegli/stage_stats.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace jpegli {
+
+void ResetStageStats(StageStats* stats) {
+  memset(stats->nanoseconds, 0, sizeof(stats->nanoseconds));
+  memset(stats->num_calls, 0, sizeof(stats->num_calls));
+  memset(stats->counters, 0, sizeof(stats->counters));
+}
+
+#if defined(__linux__)
+
+namespace {
+
+// Opens a counter of the user space events of the calling thread in the group
+// of group_fd, or as the leader of a new group if group_fd is -1. The counter
+// starts running right away.
+int OpenCounter(uint64_t config, int group_fd) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return static_cast<int>(syscall(__NR_perf_event_open, &attr, /*pid=*/0,
+                                  /*cpu=*/-1, group_fd, /*flags=*/0));
+}
+
+}  // namespace
+
+bool OpenStageCounters(StageStats* stats) {
+  if (stats->counters_enabled) return true;
+  static constexpr uint64_t kConfigs[kNumStageCounters] = {
+      PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+      PERF_COUNT_HW_BRANCH_MISSES};
+  int group_fd = -1;
+  for (int i = 0; i < kNumStageCounters; ++i) {
+    int fd = OpenCounter(kConfigs[i], group_fd);
+    if (fd < 0) {
+      for (int j = 0; j < i; ++j) close(stats->counter_fds[j]);
+      return false;
+    }
+    stats->counter_fds[i] = fd;
+    if (i == 0) group_fd = fd;
+  }
+  stats->counters_enabled = true;
+  return true;
+}
+
+void CloseStageCounters(StageStats* stats) {
+  if (!stats->counters_enabled) return;
+  // The group leader is closed last.
+  for (int i = kNumStageCounters - 1; i >= 0; --i) {
+    close(stats->counter_fds[i]);
+  }
+  stats->counters_enabled = false;
+}
+
+bool ReadStageCounters(const StageStats* stats,
+                       uint64_t values[kNumStageCounters]) {
+  if (!stats->counters_enabled) return false;
+  // With PERF_FORMAT_GROUP the leader reads the number of counters followed by
+  // their values.
+  uint64_t buffer[1 + kNumStageCounters];
+  if (read(stats->counter_fds[0], buffer, sizeof(buffer)) !=
+          static_cast<ssize_t>(sizeof(buffer)) ||
+      buffer[0] != kNumStageCounters) {
+    return false;
+  }
+  memcpy(values, &buffer[1], kNumStageCounters * sizeof(values[0]));
+  return true;
+}
+
+#else
+
+bool OpenStageCounters(StageStats* /*stats*/) { return false; }
+
+void CloseStageCounters(StageStats* /*stats*/) {}
+
+bool ReadStageCounters(const StageStats* /*stats*/,
+                       uint64_t /*values*/[kNumStageCounters]) {
+  return false;
+}
+
+#endif  // defined(__linux__)
+
+}  // namespace jpegli
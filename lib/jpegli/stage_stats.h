@@ -0,0 +1,119 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef LIB_JPEGLI_STAGE_STATS_H_
+#define LIB_JPEGLI_STAGE_STATS_H_
+
+#include <chrono>  // NOLINT
+#include <cstdint>
+
+#include "lib/jpegli/types.h"
+
+// The timers of jpegli_enable_stage_stats() can be removed from the library by
+// building it with -DJPEGLI_ENABLE_STAGE_STATS=0.
+#ifndef JPEGLI_ENABLE_STAGE_STATS
+#define JPEGLI_ENABLE_STAGE_STATS 1
+#endif
+
+namespace jpegli {
+
+// Hardware events counted with jpegli_enable_stage_counters().
+enum StageCounter {
+  kCounterInstructions = 0,
+  kCounterCacheMisses = 1,
+  kCounterBranchMisses = 2,
+  kNumStageCounters = 3,
+};
+
+// Cumulative time, number of calls and hardware event counts of the stages of
+// the image processing, see jpegli_get_stage_stats().
+struct StageStats {
+  bool enabled;
+  uint64_t nanoseconds[JPEGLI_NUM_STAGES];
+  uint64_t num_calls[JPEGLI_NUM_STAGES];
+  // The file descriptors of the event counters are only valid if
+  // counters_enabled is true.
+  bool counters_enabled;
+  int counter_fds[kNumStageCounters];
+  uint64_t counters[kNumStageCounters][JPEGLI_NUM_STAGES];
+};
+
+// Sets the recorded times, calls and counts to zero.
+void ResetStageStats(StageStats* stats);
+
+// Opens the per-thread event counters of the calling thread, returns false if
+// the system does not support them. The counters keep running until they are
+// closed.
+bool OpenStageCounters(StageStats* stats);
+void CloseStageCounters(StageStats* stats);
+
+// Reads the current values of the open counters into values, returns false on
+// failure.
+bool ReadStageCounters(const StageStats* stats,
+                       uint64_t values[kNumStageCounters]);
+
+#if JPEGLI_ENABLE_STAGE_STATS
+
+// Adds the time between its construction and destruction, or the first call of
+// Stop(), as one call of `stage` to *stats, if stats is not nullptr and
+// enabled, together with the hardware events counted in between if the
+// counters are enabled. The timers are only used on the thread that calls the
+// library, so the stages that run on the parallel runner count their wall time
+// and only the events of the calling thread.
+class StageTimer {
+ public:
+  StageTimer(StageStats* stats, JpegliStage stage)
+      : stats_(stats != nullptr && stats->enabled ? stats : nullptr),
+        stage_(stage),
+        has_counters_(false) {
+    if (stats_ == nullptr) return;
+    if (stats_->counters_enabled) {
+      has_counters_ = ReadStageCounters(stats_, start_counters_);
+    }
+    start_ = Clock::now();
+  }
+  ~StageTimer() { Stop(); }
+  void Stop() {
+    if (stats_ == nullptr) return;
+    const auto elapsed = Clock::now() - start_;
+    stats_->nanoseconds[stage_] +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    ++stats_->num_calls[stage_];
+    uint64_t counters[kNumStageCounters];
+    if (has_counters_ && ReadStageCounters(stats_, counters)) {
+      for (int i = 0; i < kNumStageCounters; ++i) {
+        stats_->counters[i][stage_] += counters[i] - start_counters_[i];
+      }
+    }
+    stats_ = nullptr;
+  }
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  StageStats* stats_;
+  JpegliStage stage_;
+  bool has_counters_;
+  uint64_t start_counters_[kNumStageCounters];
+  Clock::time_point start_;
+};
+
+#else
+
+class StageTimer {
+ public:
+  StageTimer(StageStats* /*stats*/, JpegliStage /*stage*/) {}
+  void Stop() {}
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+};
+
+#endif  // JPEGLI_ENABLE_STAGE_STATS
+
+}  // namespace jpegli
+
+#endif  // LIB_JPEGLI_STAGE_STATS_H_
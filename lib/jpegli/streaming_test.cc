@@ -123,6 +123,8 @@ TEST_P(StreamingTestParam, TestStreaming) {
     cinfo.in_color_space = static_cast<J_COLOR_SPACE>(input.color_space);
     jpegli_set_defaults(&cinfo);
     cinfo.comp_info[0].v_samp_factor = config.jparams.v_sampling[0];
+    cinfo.restart_interval = config.jparams.restart_interval;
+    cinfo.restart_in_rows = config.jparams.restart_in_rows;
     jpegli_set_progressive_level(&cinfo, 0);
     cinfo.optimize_coding = FALSE;
     jpegli_start_compress(&cinfo, TRUE);
@@ -209,6 +211,73 @@ TEST_P(StreamingTestParam, TestStreaming) {
   jpegli_destroy_compress(&cinfo);
 }
 
+TEST(StreamingTest, StreamDCScan) {
+  TestImage input;
+  input.xsize = 1024;
+  input.ysize = 768;
+  GeneratePixels(&input);
+  for (int stream_dc_scan : {0, 1}) {
+    jpeg_decompress_struct dinfo = {};
+    jpeg_compress_struct cinfo = {};
+    SourceManager src;
+    TestImage output;
+    const auto try_catch_block = [&]() {
+      ERROR_HANDLER_SETUP(jpegli);
+      dinfo.err = cinfo.err;
+      dinfo.client_data = cinfo.client_data;
+      jpegli_create_decompress(&dinfo);
+      jpegli_create_compress(&cinfo);
+      dinfo.src = reinterpret_cast<jpeg_source_mgr*>(&src);
+      DestinationManager dest(&src);
+      cinfo.dest = reinterpret_cast<jpeg_destination_mgr*>(&dest);
+
+      cinfo.image_width = input.xsize;
+      cinfo.image_height = input.ysize;
+      cinfo.input_components = input.components;
+      cinfo.in_color_space = static_cast<J_COLOR_SPACE>(input.color_space);
+      jpegli_set_defaults(&cinfo);
+      cinfo.comp_info[0].h_samp_factor = 2;
+      cinfo.comp_info[0].v_samp_factor = 2;
+      jpegli_set_progressive_level(&cinfo, 2);
+      jpegli_stream_dc_scan(&cinfo, stream_dc_scan);
+      jpegli_start_compress(&cinfo, TRUE);
+
+      size_t stride = cinfo.image_width * cinfo.input_components;
+      for (size_t y = 0; y < cinfo.image_height; ++y) {
+        JSAMPROW row[] = {&input.pixels[y * stride]};
+        EXPECT_EQ(1, jpegli_write_scanlines(&cinfo, row, 1));
+        // Before the end of the input, the whole DC scan is only written if
+        // it is streamed.
+        if (y == cinfo.image_height / 2) {
+          EXPECT_EQ(stream_dc_scan ? JPEG_REACHED_SOS : JPEG_SUSPENDED,
+                    jpegli_read_header(&dinfo, /*require_image=*/TRUE));
+        }
+      }
+      jpegli_finish_compress(&cinfo);
+      if (!stream_dc_scan) {
+        EXPECT_EQ(JPEG_REACHED_SOS,
+                  jpegli_read_header(&dinfo, /*require_image=*/TRUE));
+      }
+      output.xsize = dinfo.image_width;
+      output.ysize = dinfo.image_height;
+      output.components = dinfo.num_components;
+      EXPECT_TRUE(jpegli_start_decompress(&dinfo));
+      output.pixels.resize(output.ysize * stride);
+      for (size_t y = 0; y < output.ysize; ++y) {
+        JSAMPLE* out = reinterpret_cast<JSAMPLE*>(&output.pixels[y * stride]);
+        JSAMPROW row[] = {out};
+        EXPECT_EQ(1, jpegli_read_scanlines(&dinfo, row, 1));
+      }
+      EXPECT_TRUE(jpegli_finish_decompress(&dinfo));
+      return true;
+    };
+    EXPECT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&dinfo);
+    jpegli_destroy_compress(&cinfo);
+    VerifyOutputImage(input, output, 2.5);
+  }
+}
+
 std::vector<TestConfig> GenerateTests() {
   std::vector<TestConfig> all_tests;
   const size_t xsize0 = 1920;
@@ -223,6 +292,22 @@ std::vector<TestConfig> GenerateTests() {
       all_tests.push_back(config);
     }
   }
+  for (int v_sampling : {1, 2}) {
+    for (int restart_interval : {0, 1, 17}) {
+      for (int restart_in_rows : {0, 1, 3}) {
+        if (restart_interval > 0 && restart_in_rows > 0) continue;
+        if (restart_interval == 0 && restart_in_rows == 0) continue;
+        TestConfig config;
+        config.input.xsize = xsize0;
+        config.input.ysize = ysize0 + 9;
+        config.jparams.h_sampling = {1, 1, 1};
+        config.jparams.v_sampling = {v_sampling, 1, 1};
+        config.jparams.restart_interval = restart_interval;
+        config.jparams.restart_in_rows = restart_in_rows;
+        all_tests.push_back(config);
+      }
+    }
+  }
   return all_tests;
 }
 
@@ -106,6 +106,28 @@ struct CompressParams {
   bool xyb_mode = false;
   bool libjpeg_mode = false;
   bool use_adaptive_quantization = true;
+  JpegliAQMode aq_mode = JPEGLI_AQ_FULL;
+  JpegliDownsampleMode downsample_mode = JPEGLI_DOWNSAMPLE_BOX;
+  bool use_fixed_point_dct = false;
+  bool use_compact_tokens = false;
+  bool use_two_pass_tokenization = false;
+  bool use_trellis_quantization = false;
+  bool optimize_scans = false;
+  bool stream_dc_scan = false;
+  // 0 means that jpegli_set_effort() is not called
+  int effort = 0;
+  // -1 writes raw data with jpegli_write_raw_data(), otherwise the raw data
+  // planes are written with jpegli_write_planes() in this layout.
+  int plane_layout = -1;
+  // 0 means no parallel runner
+  size_t num_threads = 0;
+  // 0 means no psnr target
+  float psnr_target = 0.0f;
+  int psnr_search_rows = 0;
+  // 0 means no target size
+  size_t target_size = 0;
+  // 0 means no butteraugli target
+  float butteraugli_target = 0.0f;
   std::vector<uint8_t> icc;
 
   int h_samp(int c) const { return h_sampling.empty() ? 1 : h_sampling[c]; }
@@ -157,6 +179,9 @@ struct DecompressParams {
   bool quantize_colors = false;
   int desired_number_of_colors = 256;
   std::vector<ScanDecompressParams> scan_params;
+  // 0 means no parallel runner
+  size_t num_threads = 0;
+  bool destuffed_scans = false;
 };
 
 }  // namespace jpegli
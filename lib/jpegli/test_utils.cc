@@ -7,6 +7,7 @@
 #include "lib/jpegli/test_utils.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
@@ -18,11 +19,14 @@
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "lib/base/byte_order.h"
 #include "lib/base/compiler_specific.h"
+#include "lib/base/float.h"
+#include "lib/base/parallel_runner.h"
 #include "lib/base/status.h"
 #include "lib/base/types.h"
 #include "lib/jpegli/common.h"
@@ -220,6 +224,8 @@ std::string IOMethodName(JpegliDataType data_type,
     return "";
   } else if (data_type == JPEGLI_TYPE_UINT16) {
     retval = "UINT16";
+  } else if (data_type == JPEGLI_TYPE_FLOAT16) {
+    retval = "FLOAT16";
   } else if (data_type == JPEGLI_TYPE_FLOAT) {
     retval = "FLOAT";
   }
@@ -305,6 +311,37 @@ std::ostream& operator<<(std::ostream& os, const CompressParams& jparams) {
   }
   if (!jparams.use_adaptive_quantization) {
     os << "NoAQ";
+  } else if (jparams.aq_mode == JPEGLI_AQ_FAST) {
+    os << "FastAQ";
+  }
+  if (jparams.downsample_mode == JPEGLI_DOWNSAMPLE_SHARP) {
+    os << "SharpDS";
+  }
+  if (jparams.use_fixed_point_dct) {
+    os << "FixDCT";
+  }
+  if (jparams.use_compact_tokens) {
+    os << "Compact";
+  }
+  if (jparams.use_two_pass_tokenization) {
+    os << "TwoPass";
+  }
+  if (jparams.use_trellis_quantization) {
+    os << "Trellis";
+  }
+  if (jparams.optimize_scans) {
+    os << "OptScans";
+  }
+  if (jparams.stream_dc_scan) {
+    os << "StreamDC";
+  }
+  if (jparams.effort > 0) {
+    os << "E" << jparams.effort;
+  }
+  if (jparams.plane_layout == JPEGLI_PLANES_SEPARATE) {
+    os << "Planes";
+  } else if (jparams.plane_layout == JPEGLI_PLANES_NV12) {
+    os << "NV12";
   }
   if (jparams.restart_interval > 0) {
     os << "R" << jparams.restart_interval;
@@ -332,6 +369,21 @@ std::ostream& operator<<(std::ostream& os, const CompressParams& jparams) {
   if (jparams.smoothing_factor != 0) {
     os << "SF" << jparams.smoothing_factor;
   }
+  if (jparams.num_threads > 0) {
+    os << "Threads" << jparams.num_threads;
+  }
+  if (jparams.psnr_target > 0) {
+    os << "PSNR" << jparams.psnr_target;
+    if (jparams.psnr_search_rows > 0) {
+      os << "SR" << jparams.psnr_search_rows;
+    }
+  }
+  if (jparams.target_size > 0) {
+    os << "Size" << jparams.target_size;
+  }
+  if (jparams.butteraugli_target > 0) {
+    os << "BA" << jparams.butteraugli_target;
+  }
   return os;
 }
 
@@ -567,8 +619,38 @@ void GenerateCoeffs(const CompressParams& jparams, TestImage* img) {
   }
 }
 
+JxlParallelRetCode TestParallelRunner(void* runner_opaque, void* jpegxl_opaque,
+                                      JxlParallelRunInit init,
+                                      JxlParallelRunFunction func,
+                                      uint32_t start_range,
+                                      uint32_t end_range) {
+  const size_t num_threads = *static_cast<const size_t*>(runner_opaque);
+  JxlParallelRetCode ret = (*init)(jpegxl_opaque, num_threads);
+  if (ret != JXL_PARALLEL_RET_SUCCESS) return ret;
+  std::atomic<uint32_t> next_task{start_range};
+  std::vector<std::thread> threads;
+  for (size_t thread_id = 0; thread_id < num_threads; ++thread_id) {
+    threads.emplace_back([&, thread_id]() {
+      for (uint32_t task = next_task++; task < end_range; task = next_task++) {
+        (*func)(jpegxl_opaque, task, thread_id);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return JXL_PARALLEL_RET_SUCCESS;
+}
+
 void EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
                       j_compress_ptr cinfo) {
+  if (jparams.num_threads > 0) {
+    jpegli_set_parallel_runner(
+        cinfo, &TestParallelRunner,
+        const_cast<void*>(static_cast<const void*>(&jparams.num_threads)));
+  } else {
+    jpegli_set_parallel_runner(cinfo, nullptr, nullptr);
+  }
   cinfo->image_width = input.xsize;
   cinfo->image_height = input.ysize;
   cinfo->input_components = input.components;
@@ -605,6 +687,17 @@ void EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
     }
   }
   jpegli_set_quality(cinfo, jparams.quality, TRUE);
+  if (jparams.psnr_target > 0) {
+    jpegli_set_psnr(cinfo, jparams.psnr_target, 0.01f, 0.1f, 25.0f);
+    jpegli_set_psnr_search_rows(cinfo, jparams.psnr_search_rows);
+  }
+  if (jparams.target_size > 0) {
+    jpegli_set_target_size(cinfo, jparams.target_size, 0.1f, 25.0f);
+  }
+  if (jparams.butteraugli_target > 0) {
+    jpegli_set_butteraugli_target(cinfo, jparams.butteraugli_target, 0.1f,
+                                  25.0f);
+  }
   if (!jparams.quant_indexes.empty()) {
     for (int c = 0; c < cinfo->num_components; ++c) {
       cinfo->comp_info[c].quant_tbl_no = jparams.quant_indexes[c];
@@ -639,6 +732,16 @@ void EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
   jpegli_set_input_format(cinfo, input.data_type, input.endianness);
   jpegli_enable_adaptive_quantization(
       cinfo, TO_JXL_BOOL(jparams.use_adaptive_quantization));
+  jpegli_set_aq_mode(cinfo, jparams.aq_mode);
+  jpegli_set_downsample_mode(cinfo, jparams.downsample_mode);
+  jpegli_use_fixed_point_dct(cinfo, TO_JXL_BOOL(jparams.use_fixed_point_dct));
+  jpegli_use_compact_tokens(cinfo, TO_JXL_BOOL(jparams.use_compact_tokens));
+  jpegli_use_two_pass_tokenization(
+      cinfo, TO_JXL_BOOL(jparams.use_two_pass_tokenization));
+  jpegli_use_trellis_quantization(
+      cinfo, TO_JXL_BOOL(jparams.use_trellis_quantization));
+  jpegli_optimize_scans(cinfo, TO_JXL_BOOL(jparams.optimize_scans));
+  jpegli_stream_dc_scan(cinfo, TO_JXL_BOOL(jparams.stream_dc_scan));
   cinfo->restart_interval = jparams.restart_interval;
   cinfo->restart_in_rows = jparams.restart_in_rows;
   cinfo->smoothing_factor = jparams.smoothing_factor;
@@ -647,6 +750,9 @@ void EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
   } else if (jparams.optimize_coding == 0) {
     cinfo->optimize_coding = FALSE;
   }
+  if (jparams.effort > 0) {
+    jpegli_set_effort(cinfo, jparams.effort);
+  }
   cinfo->raw_data_in = TO_JXL_BOOL(!input.raw_data.empty());
   if (jparams.optimize_coding == 0 && jparams.use_flat_dc_luma_code) {
     JHUFF_TBL* tbl = cinfo->dc_huff_tbl_ptrs[0];
@@ -681,7 +787,31 @@ void EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
       jpegli_write_icc_profile(cinfo, jparams.icc.data(), jparams.icc.size());
     }
   }
-  if (cinfo->raw_data_in) {
+  if (cinfo->raw_data_in && jparams.plane_layout >= 0) {
+    const JpegliPlaneLayout layout =
+        static_cast<JpegliPlaneLayout>(jparams.plane_layout);
+    std::vector<const uint8_t*> planes(cinfo->num_components);
+    std::vector<size_t> strides(cinfo->num_components);
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      planes[c] = input.raw_data[c].data();
+      strides[c] = cinfo->comp_info[c].width_in_blocks * DCTSIZE;
+    }
+    std::vector<uint8_t> chroma;
+    if (layout == JPEGLI_PLANES_NV12) {
+      chroma.resize(2 * input.raw_data[1].size());
+      for (size_t i = 0; i < input.raw_data[1].size(); ++i) {
+        chroma[2 * i] = input.raw_data[1][i];
+        chroma[2 * i + 1] = input.raw_data[2][i];
+      }
+      planes[1] = chroma.data();
+      strides[1] *= 2;
+      planes[2] = nullptr;
+    }
+    while (cinfo->next_scanline < cinfo->image_height) {
+      Check(jpegli_write_planes(cinfo, planes.data(), strides.data(), layout) >
+            0);
+    }
+  } else if (cinfo->raw_data_in) {
     // Need to copy because jpeg API requires non-const pointers.
     std::vector<std::vector<uint8_t>> raw_data = input.raw_data;
     size_t max_lines = jparams.max_v_sample() * DCTSIZE;
@@ -806,6 +936,9 @@ double DistanceRms(const TestImage& input, const TestImage& output,
     } else if (im.data_type == JPEGLI_TYPE_UINT16) {
       static const double mul16 = 1.0 / 65535.0;
       return (is_little_endian ? LoadLE16(p) : LoadBE16(p)) * mul16;
+    } else if (im.data_type == JPEGLI_TYPE_FLOAT16) {
+      return ::jxl::detail::LoadFloat16(is_little_endian ? LoadLE16(p)
+                                                         : LoadBE16(p));
     } else if (im.data_type == JPEGLI_TYPE_FLOAT) {
       return (is_little_endian ? LoadLEFloat(p) : LoadBEFloat(p));
     }
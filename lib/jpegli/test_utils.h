@@ -16,6 +16,7 @@
 #include <vector>
 
 #include "lib/base/include_jpeglib.h"  // NOLINT
+#include "lib/base/parallel_runner.h"
 #include "lib/base/status.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/test_params.h"
@@ -102,6 +103,13 @@ void GenerateRawData(const CompressParams& jparams, TestImage* img);
 
 void GenerateCoeffs(const CompressParams& jparams, TestImage* img);
 
+// A simple JxlParallelRunner that runs the tasks on as many threads as the
+// size_t value pointed to by runner_opaque.
+JxlParallelRetCode TestParallelRunner(void* runner_opaque, void* jpegxl_opaque,
+                                      JxlParallelRunInit init,
+                                      JxlParallelRunFunction func,
+                                      uint32_t start_range, uint32_t end_range);
+
 void EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
                       j_compress_ptr cinfo);
 
@@ -0,0 +1,1139 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "lib/base/byte_order.h"
+#include "lib/base/types.h"
+#include "lib/jpegli/bit_reader.h"
+#include "lib/jpegli/bit_writer.h"
+#include "lib/jpegli/bitstream.h"
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/decode.h"
+#include "lib/jpegli/decode_internal.h"
+#include "lib/jpegli/encode.h"
+#include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/entropy_coding.h"
+#include "lib/jpegli/error.h"
+#include "lib/jpegli/huffman.h"
+#include "lib/jpegli/memory_manager.h"
+
+namespace jpegli {
+namespace {
+
+constexpr uint16_t kExifOrientationTag = 274;
+constexpr uint8_t kJFIFTag[5] = {'J', 'F', 'I', 'F', 0};
+constexpr uint8_t kAdobeTag[5] = {'A', 'd', 'o', 'b', 'e'};
+
+bool HasTag(jpeg_saved_marker_ptr marker, const uint8_t* tag, size_t len) {
+  return marker->data_length >= len && memcmp(marker->data, tag, len) == 0;
+}
+
+// Sets the orientation in the IFD0 of the TIFF structure of an Exif marker
+// payload to 1, if it is there.
+void ResetExifOrientation(uint8_t* exif, size_t size) {
+  if (size < 12) return;
+  bool bigendian;
+  if (LoadLE32(exif) == 0x2A004D4D) {
+    bigendian = true;
+  } else if (LoadLE32(exif) == 0x002A4949) {
+    bigendian = false;
+  } else {
+    return;
+  }
+  const uint64_t offset = bigendian ? LoadBE32(exif + 4) : LoadLE32(exif + 4);
+  if (offset < 8 || offset + 2 > size) return;
+  const uint8_t* end = exif + size;
+  uint8_t* t = exif + offset;
+  size_t num_tags = bigendian ? LoadBE16(t) : LoadLE16(t);
+  t += 2;
+  for (; num_tags > 0 && t + 12 <= end; --num_tags, t += 12) {
+    const uint16_t tag = bigendian ? LoadBE16(t) : LoadLE16(t);
+    if (tag != kExifOrientationTag) continue;
+    const uint16_t type = bigendian ? LoadBE16(t + 2) : LoadLE16(t + 2);
+    const uint32_t count = bigendian ? LoadBE32(t + 4) : LoadLE32(t + 4);
+    if (type == 3 && count == 1) {
+      if (bigendian) {
+        StoreBE16(1, t + 8);
+      } else {
+        StoreLE16(1, t + 8);
+      }
+    }
+    return;
+  }
+}
+
+// Writes the saved markers of srcinfo to dstinfo in their original order,
+// except for the JFIF and Adobe markers that the encoder writes itself. The
+// Exif orientation is reset if the image is transformed.
+void CopyMarkers(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+                 bool transformed) {
+  // The decoder inserts the saved markers at the head of the list.
+  std::vector<jpeg_saved_marker_ptr> markers;
+  for (jpeg_saved_marker_ptr marker = srcinfo->marker_list; marker != nullptr;
+       marker = marker->next) {
+    markers.push_back(marker);
+  }
+  for (auto it = markers.rbegin(); it != markers.rend(); ++it) {
+    jpeg_saved_marker_ptr marker = *it;
+    if (transformed && marker->marker == kApp1 &&
+        HasTag(marker, kExifTag, sizeof(kExifTag))) {
+      std::vector<uint8_t> exif(marker->data,
+                                marker->data + marker->data_length);
+      ResetExifOrientation(&exif[sizeof(kExifTag)],
+                           exif.size() - sizeof(kExifTag));
+      jpegli_write_marker(dstinfo, marker->marker, exif.data(), exif.size());
+      continue;
+    }
+    if (dstinfo->write_JFIF_header && marker->marker == JPEG_APP0 &&
+        HasTag(marker, kJFIFTag, sizeof(kJFIFTag))) {
+      continue;
+    }
+    if (dstinfo->write_Adobe_marker && marker->marker == JPEG_APP0 + 14 &&
+        HasTag(marker, kAdobeTag, sizeof(kAdobeTag))) {
+      continue;
+    }
+    jpegli_write_marker(dstinfo, marker->marker, marker->data,
+                        marker->data_length);
+  }
+}
+
+// The transforms are done as an optional transposition followed by optional
+// mirroring of the transposed image.
+struct TransformSteps {
+  bool transpose;
+  bool flip_x;
+  bool flip_y;
+};
+
+TransformSteps GetTransformSteps(JpegliTransform transform) {
+  switch (transform) {
+    case JPEGLI_TRANSFORM_FLIP_H:
+      return {false, true, false};
+    case JPEGLI_TRANSFORM_ROT_180:
+      return {false, true, true};
+    case JPEGLI_TRANSFORM_FLIP_V:
+      return {false, false, true};
+    case JPEGLI_TRANSFORM_TRANSPOSE:
+      return {true, false, false};
+    case JPEGLI_TRANSFORM_ROT_90:
+      return {true, true, false};
+    case JPEGLI_TRANSFORM_TRANSVERSE:
+      return {true, true, true};
+    case JPEGLI_TRANSFORM_ROT_270:
+      return {true, false, true};
+    default:
+      return {false, false, false};
+  }
+}
+
+// Mirroring the image negates the coefficients of the odd frequencies in
+// that direction.
+void TransformBlock(const JCOEF* in, const TransformSteps& steps,
+                    JCOEF* out) {
+  for (int r = 0; r < DCTSIZE; ++r) {
+    for (int c = 0; c < DCTSIZE; ++c) {
+      const int out_r = steps.transpose ? c : r;
+      const int out_c = steps.transpose ? r : c;
+      const bool negate =
+          (steps.flip_x && (out_c & 1)) != (steps.flip_y && (out_r & 1));
+      const JCOEF val = in[r * DCTSIZE + c];
+      out[out_r * DCTSIZE + out_c] = negate ? -val : val;
+    }
+  }
+}
+
+// Sets the image parameters of dstinfo for the transform and crop region of
+// the options, and returns the transformed coefficient arrays.
+jvirt_barray_ptr* TransformCoefficients(j_decompress_ptr srcinfo,
+                                        j_compress_ptr dstinfo,
+                                        jvirt_barray_ptr* src_arrays,
+                                        const JpegliTranscodeOptions& opts) {
+  const auto& cinfo = dstinfo;
+  for (int c = 0; c < srcinfo->num_components; ++c) {
+    if (IsZigZagOrder(src_arrays[c])) {
+      JPEGLI_ERROR("jpegli_transcode: coefficients are in zigzag order");
+    }
+  }
+  const TransformSteps steps = GetTransformSteps(opts.transform);
+  const size_t max_h = steps.transpose ? srcinfo->max_v_samp_factor
+                                       : srcinfo->max_h_samp_factor;
+  const size_t max_v = steps.transpose ? srcinfo->max_h_samp_factor
+                                       : srcinfo->max_v_samp_factor;
+  const size_t imcu_width = max_h * DCTSIZE;
+  const size_t imcu_height = max_v * DCTSIZE;
+  // Size of the transformed image before cropping.
+  size_t xsize = steps.transpose ? srcinfo->image_height : srcinfo->image_width;
+  size_t ysize = steps.transpose ? srcinfo->image_width : srcinfo->image_height;
+  if (steps.flip_x) xsize = xsize / imcu_width * imcu_width;
+  if (steps.flip_y) ysize = ysize / imcu_height * imcu_height;
+  if (xsize == 0 || ysize == 0) {
+    JPEGLI_ERROR("jpegli_transcode: image is too small for the transform");
+  }
+  const size_t x0 = opts.crop_x / imcu_width * imcu_width;
+  const size_t y0 = opts.crop_y / imcu_height * imcu_height;
+  if (x0 >= xsize || y0 >= ysize) {
+    JPEGLI_ERROR("jpegli_transcode: crop region is outside of the image");
+  }
+  const size_t x1 =
+      opts.crop_width > 0
+          ? std::min<size_t>(opts.crop_x + opts.crop_width, xsize)
+          : xsize;
+  const size_t y1 =
+      opts.crop_height > 0
+          ? std::min<size_t>(opts.crop_y + opts.crop_height, ysize)
+          : ysize;
+  dstinfo->image_width = x1 - x0;
+  dstinfo->image_height = y1 - y0;
+  if (steps.transpose) {
+    for (int c = 0; c < dstinfo->num_components; ++c) {
+      jpeg_component_info* comp = &dstinfo->comp_info[c];
+      std::swap(comp->h_samp_factor, comp->v_samp_factor);
+    }
+    for (JQUANT_TBL* table : dstinfo->quant_tbl_ptrs) {
+      if (table == nullptr) continue;
+      for (int r = 0; r < DCTSIZE; ++r) {
+        for (int c = r + 1; c < DCTSIZE; ++c) {
+          std::swap(table->quantval[r * DCTSIZE + c],
+                    table->quantval[c * DCTSIZE + r]);
+        }
+      }
+    }
+    std::swap(dstinfo->X_density, dstinfo->Y_density);
+  }
+  j_common_ptr comptr = reinterpret_cast<j_common_ptr>(dstinfo);
+  jvirt_barray_ptr* dst_arrays = jpegli::Allocate<jvirt_barray_ptr>(
+      dstinfo, dstinfo->num_components, JPOOL_IMAGE);
+  std::vector<JBLOCKROW> src_rows;
+  for (int c = 0; c < dstinfo->num_components; ++c) {
+    const jpeg_component_info* src_comp = &srcinfo->comp_info[c];
+    const jpeg_component_info* comp = &dstinfo->comp_info[c];
+    const size_t h_factor = max_h / comp->h_samp_factor;
+    const size_t v_factor = max_v / comp->v_samp_factor;
+    const size_t width_in_blocks =
+        DivCeil(dstinfo->image_width, h_factor * DCTSIZE);
+    const size_t height_in_blocks =
+        DivCeil(dstinfo->image_height, v_factor * DCTSIZE);
+    // The mirrored sizes and the crop offsets are multiples of the iMCU size,
+    // so these are whole blocks.
+    const size_t xsize_blocks = xsize / (h_factor * DCTSIZE);
+    const size_t ysize_blocks = ysize / (v_factor * DCTSIZE);
+    const size_t bx0 = x0 / (h_factor * DCTSIZE);
+    const size_t by0 = y0 / (v_factor * DCTSIZE);
+    dst_arrays[c] = (*dstinfo->mem->request_virt_barray)(
+        comptr, JPOOL_IMAGE, FALSE, width_in_blocks, height_in_blocks,
+        comp->v_samp_factor);
+    src_rows.resize(src_comp->height_in_blocks);
+    for (size_t by = 0; by < src_rows.size(); ++by) {
+      src_rows[by] = (*srcinfo->mem->access_virt_barray)(
+          reinterpret_cast<j_common_ptr>(srcinfo), src_arrays[c], by, 1,
+          FALSE)[0];
+    }
+    for (size_t by = 0; by < height_in_blocks; ++by) {
+      JBLOCKROW row =
+          (*dstinfo->mem->access_virt_barray)(comptr, dst_arrays[c], by, 1,
+                                              TRUE)[0];
+      for (size_t bx = 0; bx < width_in_blocks; ++bx) {
+        size_t tx = bx0 + bx;
+        size_t ty = by0 + by;
+        if (steps.flip_x) tx = xsize_blocks - 1 - tx;
+        if (steps.flip_y) ty = ysize_blocks - 1 - ty;
+        const size_t src_x = steps.transpose ? ty : tx;
+        const size_t src_y = steps.transpose ? tx : ty;
+        if (src_x < src_comp->width_in_blocks &&
+            src_y < src_comp->height_in_blocks) {
+          TransformBlock(src_rows[src_y][src_x], steps, row[bx]);
+        } else {
+          memset(row[bx], 0, sizeof(JBLOCK));
+        }
+      }
+    }
+  }
+  return dst_arrays;
+}
+
+// Scaled inverse DCT of the lowest frequency n x n coefficients of a block,
+// which gives the average of the n x n areas of 8 / n x 8 / n pixels.
+class ScaledIDCT {
+ public:
+  explicit ScaledIDCT(int n) : n_(n) {
+    const double kPi = 3.14159265358979323846;
+    for (int x = 0; x < n; ++x) {
+      for (int u = 0; u < n; ++u) {
+        const double scale = u == 0 ? 0.5 * std::sqrt(0.5) : 0.5;
+        basis_[x * n + u] = scale * std::cos((2 * x + 1) * u * kPi / (2 * n));
+      }
+    }
+  }
+
+  // Writes the n x n samples of the block, given 0-255 range, scaled to the
+  // 0-1 range of the float input of the encoder, to out with the given
+  // stride.
+  void Compute(const JCOEF* block, const UINT16* quantval, float* out,
+               size_t stride) const {
+    constexpr float kScale = 1.0f / 255;
+    if (n_ == 1) {
+      out[0] = (block[0] * quantval[0] * 0.125f + 128.0f) * kScale;
+      return;
+    }
+    float tmp[DCTSIZE * DCTSIZE];
+    for (int v = 0; v < n_; ++v) {
+      for (int x = 0; x < n_; ++x) {
+        float sum = 0.0f;
+        for (int u = 0; u < n_; ++u) {
+          const int k = v * DCTSIZE + u;
+          sum += basis_[x * n_ + u] * block[k] * quantval[k];
+        }
+        tmp[v * n_ + x] = sum;
+      }
+    }
+    for (int y = 0; y < n_; ++y) {
+      for (int x = 0; x < n_; ++x) {
+        float sum = 128.0f;
+        for (int v = 0; v < n_; ++v) {
+          sum += basis_[y * n_ + v] * tmp[v * n_ + x];
+        }
+        out[y * stride + x] = sum * kScale;
+      }
+    }
+  }
+
+ private:
+  int n_;
+  float basis_[DCTSIZE * DCTSIZE];
+};
+
+// Writes the downscaled samples of the components of srcinfo to dstinfo as
+// raw data, one iMCU row of the output at a time.
+void WriteScaledCoefficients(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+                             jvirt_barray_ptr* coef_arrays, int scale_denom) {
+  const int n = DCTSIZE / scale_denom;
+  const ScaledIDCT idct(n);
+  j_common_ptr src_common = reinterpret_cast<j_common_ptr>(srcinfo);
+  struct ComponentRows {
+    // Samples of the last computed block row of the input, n rows.
+    std::vector<float> block_rows;
+    JDIMENSION block_row_index;
+    // Samples of the current iMCU row of the output.
+    std::vector<float> imcu_rows;
+    std::vector<JSAMPROW> row_ptrs;
+    size_t stride;
+    size_t xsize;
+    size_t ysize;
+  };
+  std::vector<ComponentRows> rows(dstinfo->num_components);
+  JSAMPARRAY planes[kMaxComponents];
+  for (int c = 0; c < dstinfo->num_components; ++c) {
+    const jpeg_component_info* src_comp = &srcinfo->comp_info[c];
+    const jpeg_component_info* comp = &dstinfo->comp_info[c];
+    ComponentRows& r = rows[c];
+    r.stride = std::max<size_t>(comp->width_in_blocks * DCTSIZE,
+                                src_comp->width_in_blocks * n);
+    // The encoder pads the image to full blocks, but beyond the samples of
+    // the input the last sample is repeated.
+    r.xsize = std::min<size_t>(
+        DivCeil(dstinfo->image_width * comp->h_samp_factor,
+                dstinfo->max_h_samp_factor),
+        src_comp->width_in_blocks * n);
+    r.ysize = std::min<size_t>(
+        DivCeil(dstinfo->image_height * comp->v_samp_factor,
+                dstinfo->max_v_samp_factor),
+        src_comp->height_in_blocks * n);
+    r.block_rows.resize(n * r.stride);
+    r.block_row_index = src_comp->height_in_blocks;
+    const size_t imcu_height = comp->v_samp_factor * DCTSIZE;
+    r.imcu_rows.resize(imcu_height * r.stride);
+    r.row_ptrs.resize(imcu_height);
+    for (size_t i = 0; i < imcu_height; ++i) {
+      r.row_ptrs[i] = reinterpret_cast<JSAMPROW>(&r.imcu_rows[i * r.stride]);
+    }
+    planes[c] = r.row_ptrs.data();
+  }
+  const size_t num_imcu_rows =
+      DivCeil(dstinfo->image_height, dstinfo->max_v_samp_factor * DCTSIZE);
+  for (size_t imcu_y = 0; imcu_y < num_imcu_rows; ++imcu_y) {
+    for (int c = 0; c < dstinfo->num_components; ++c) {
+      const jpeg_component_info* src_comp = &srcinfo->comp_info[c];
+      const UINT16* quantval = src_comp->quant_table->quantval;
+      ComponentRows& r = rows[c];
+      const size_t imcu_height = r.row_ptrs.size();
+      for (size_t i = 0; i < imcu_height; ++i) {
+        const size_t y = std::min(imcu_y * imcu_height + i, r.ysize - 1);
+        const JDIMENSION by = y / n;
+        if (by != r.block_row_index) {
+          JBLOCKROW blocks = (*srcinfo->mem->access_virt_barray)(
+              src_common, coef_arrays[c], by, 1, FALSE)[0];
+          for (JDIMENSION bx = 0; bx < src_comp->width_in_blocks; ++bx) {
+            idct.Compute(blocks[bx], quantval, &r.block_rows[bx * n],
+                         r.stride);
+          }
+          r.block_row_index = by;
+        }
+        const float* row_in = &r.block_rows[(y % n) * r.stride];
+        float* row_out = &r.imcu_rows[i * r.stride];
+        memcpy(row_out, row_in, r.xsize * sizeof(row_out[0]));
+        std::fill(row_out + r.xsize, row_out + r.stride, row_in[r.xsize - 1]);
+      }
+    }
+    if (jpegli_write_raw_data(dstinfo, planes,
+                              dstinfo->max_v_samp_factor * DCTSIZE) == 0) {
+      const auto& cinfo = dstinfo;
+      JPEGLI_ERROR("jpegli_transcode_scaled: suspending destinations are "
+                   "not supported");
+    }
+  }
+}
+
+// Number of Huffman code contexts of a scan in jpegli_optimize_huffman(), the
+// DC codes of the table slots 0 to 3 followed by the AC codes of the same
+// slots.
+constexpr int kNumReoptContexts = 8;
+// Size of the output buffer of the re-coded entropy coded data, and an upper
+// bound of the number of bytes written for one block, including the stuffed
+// zero bytes, a flushed bit buffer and a restart marker.
+constexpr size_t kReoptBufferSize = 1 << 16;
+constexpr size_t kMaxReoptBlockSize = 4 * DCTSIZE2 * 4;
+
+// An input scan of jpegli_optimize_huffman().
+struct ReoptScan {
+  int comps_in_scan;
+  int component_index[kMaxComponents];
+  // Huffman tables of the components in the scan, as indexes of the tables
+  // of HuffmanReoptState.
+  int dc_table[kMaxComponents];
+  int ac_table[kMaxComponents];
+  int Ss;
+  int Se;
+  int Ah;
+  int Al;
+};
+
+// Input state of jpegli_optimize_huffman(), which walks the marker segments of
+// the whole input twice, first to collect the symbol histograms of each scan,
+// then to write the image again with the optimized Huffman codes.
+struct HuffmanReoptState {
+  HuffmanReoptState(const uint8_t* input, size_t input_len)
+      : data(input),
+        len(input_len),
+        luts(kNumReoptContexts * kJpegHuffmanLutSize) {}
+
+  const uint8_t* data;
+  size_t len;
+  // Position after the EOI marker, set when the input is parsed.
+  size_t end_pos = 0;
+  bool has_frame = false;
+  bool baseline = false;
+  bool progressive = false;
+  size_t image_width = 0;
+  size_t image_height = 0;
+  int num_components = 0;
+  int component_id[kMaxComponents];
+  int h_samp_factor[kMaxComponents];
+  int v_samp_factor[kMaxComponents];
+  int max_h_samp_factor = 1;
+  int max_v_samp_factor = 1;
+  size_t restart_interval = 0;
+  // Lookup tables of the Huffman tables of the input, DC tables 0 to 3
+  // followed by the AC tables 0 to 3, in the same layout as the contexts.
+  std::vector<HuffmanTableEntry> luts;
+  bool table_defined[kNumReoptContexts] = {};
+  size_t num_scans = 0;
+  // The histograms of the contexts of each scan, kNumReoptContexts histograms
+  // of kJpegHuffmanAlphabetSize counts per scan.
+  std::vector<int> histograms;
+};
+
+// Builds the decoding lookup table of the Huffman code given by the number of
+// codes of each length in bits[1..16] and the symbols in values. Returns false
+// if the code is invalid.
+bool BuildReoptLut(const uint8_t* bits, const uint8_t* values,
+                   HuffmanTableEntry* lut) {
+  uint32_t counts[kJpegHuffmanMaxBitLength + 1] = {};
+  uint32_t symbols[kJpegHuffmanAlphabetSize + 1] = {};
+  bool seen[kJpegHuffmanAlphabetSize] = {};
+  int total_count = 0;
+  int space = 1 << kJpegHuffmanMaxBitLength;
+  int max_depth = 1;
+  for (size_t i = 1; i <= kJpegHuffmanMaxBitLength; ++i) {
+    counts[i] = bits[i];
+    if (bits[i] != 0) max_depth = i;
+    total_count += bits[i];
+    space -= bits[i] * (1 << (kJpegHuffmanMaxBitLength - i));
+  }
+  if (total_count > kJpegHuffmanAlphabetSize) return false;
+  for (int i = 0; i < total_count; ++i) {
+    if (seen[values[i]]) return false;
+    seen[values[i]] = true;
+    symbols[i] = values[i];
+  }
+  // The all ones code decodes to an invalid symbol.
+  ++counts[max_depth];
+  symbols[total_count] = kJpegHuffmanAlphabetSize;
+  space -= 1 << (kJpegHuffmanMaxBitLength - max_depth);
+  if (space < 0) return false;
+  for (int i = 0; i < kJpegHuffmanLutSize; ++i) {
+    lut[i].bits = 0;
+    lut[i].value = 0xffff;
+  }
+  BuildJpegHuffmanTable(counts, symbols, lut);
+  return true;
+}
+
+// Assigns the canonical Huffman codes of table, without extra bits.
+void BuildReoptCodes(const JHUFF_TBL& table, HuffmanCodeTable* codes) {
+  memset(codes, 0, sizeof(*codes));
+  int code = 0;
+  size_t p = 0;
+  for (size_t l = 1; l <= kJpegHuffmanMaxBitLength; ++l) {
+    for (int i = 0; i < table.bits[l]; ++i, ++p) {
+      codes->Set(table.huffval[p], l, code++, 0);
+    }
+    code <<= 1;
+  }
+}
+
+// Returns the table slot of the output of the ith component of a scan; the
+// components other than the first share the second slot in baseline images.
+int ReoptSlot(const HuffmanReoptState& s, int i) {
+  return s.baseline ? std::min(i, 1) : i;
+}
+
+// Symbol sink of the first pass, counts the symbols of each context.
+class ReoptHistogramSink {
+ public:
+  explicit ReoptHistogramSink(int* histograms) : histograms_(histograms) {}
+  void Symbol(int context, int symbol) {
+    ++histograms_[context * kJpegHuffmanAlphabetSize + symbol];
+  }
+  void Bits(int nbits, int bits) {}
+  void EndBlock() {}
+  void Restart(int marker) {}
+  bool Finish() { return true; }
+
+ private:
+  int* histograms_;
+};
+
+// Symbol sink of the second pass, writes the symbols with the optimized codes
+// and the extra bits to the bit writer.
+class ReoptWriterSink {
+ public:
+  ReoptWriterSink(const HuffmanCodeTable* codes, JpegBitWriter* bw)
+      : codes_(codes), bw_(bw) {}
+  void Symbol(int context, int symbol) {
+    WriteSymbol(bw_, &codes_[context], symbol, 0);
+  }
+  void Bits(int nbits, int bits) { WriteBits(bw_, nbits, bits); }
+  void EndBlock() {
+    if (bw_->pos + kMaxReoptBlockSize > bw_->len) Flush();
+  }
+  void Restart(int marker) {
+    JumpToByteBoundary(bw_);
+    bw_->data[bw_->pos++] = 0xFF;
+    bw_->data[bw_->pos++] = 0xD0 + marker;
+  }
+  bool Finish() {
+    JumpToByteBoundary(bw_);
+    Flush();
+    return bw_->healthy;
+  }
+
+ private:
+  void Flush() {
+    if (!EmptyBitWriterBuffer(bw_)) {
+      const auto& cinfo = bw_->cinfo;
+      JPEGLI_ERROR("jpegli_optimize_huffman: suspending destinations are not "
+                   "supported");
+    }
+  }
+
+  const HuffmanCodeTable* codes_;
+  JpegBitWriter* bw_;
+};
+
+// Passes the symbols and extra bits of the next block of the ith component of
+// scan to sink. Returns false for invalid data.
+template <typename Sink>
+bool CopyBlockSymbols(const HuffmanReoptState& s, const ReoptScan& scan,
+                      int i, size_t* eobrun, BitReaderState* br, Sink* sink) {
+  const int slot = ReoptSlot(s, i);
+  if (scan.Ss == 0) {
+    if (scan.Ah > 0) {
+      sink->Bits(1, br->ReadBits(1));
+      return true;
+    }
+    const HuffmanTableEntry* lut =
+        &s.luts[scan.dc_table[i] * kJpegHuffmanLutSize];
+    int nbits = ReadSymbol(lut, br);
+    if (nbits > 15) return false;
+    sink->Symbol(slot, nbits);
+    if (nbits > 0) sink->Bits(nbits, br->ReadBits(nbits));
+    if (scan.Se == 0) return true;
+  }
+  if (*eobrun > 0) {
+    --(*eobrun);
+    return true;
+  }
+  const HuffmanTableEntry* lut =
+      &s.luts[(4 + scan.ac_table[i]) * kJpegHuffmanLutSize];
+  for (int k = std::max(scan.Ss, 1); k <= scan.Se; ++k) {
+    int symbol = ReadSymbol(lut, br);
+    if (symbol >= kJpegHuffmanAlphabetSize) return false;
+    sink->Symbol(4 + slot, symbol);
+    const int r = symbol >> 4;
+    const int nbits = symbol & 15;
+    if (nbits > 0) {
+      k += r;
+      if (k > scan.Se) return false;
+      sink->Bits(nbits, br->ReadBits(nbits));
+    } else if (r == 15) {
+      k += 15;
+      if (k > scan.Se) return false;
+    } else {
+      if (r > 0) {
+        if (!s.progressive) return false;
+        int extra = br->ReadBits(r);
+        sink->Bits(r, extra);
+        *eobrun = (1u << r) + extra - 1;
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+// Passes the symbols of the entropy coded data of scan, which starts at
+// s.data[*pos], to sink, and sets *pos to the marker after the data. Returns
+// false for invalid data.
+template <typename Sink>
+bool CopyScanSymbols(const HuffmanReoptState& s, const ReoptScan& scan,
+                     size_t* pos, Sink* sink) {
+  size_t mcus_per_row;
+  size_t mcu_rows;
+  if (scan.comps_in_scan == 1) {
+    const int c = scan.component_index[0];
+    mcus_per_row = DivCeil(s.image_width * s.h_samp_factor[c],
+                           DCTSIZE * s.max_h_samp_factor);
+    mcu_rows = DivCeil(s.image_height * s.v_samp_factor[c],
+                       DCTSIZE * s.max_v_samp_factor);
+  } else {
+    mcus_per_row = DivCeil(s.image_width, DCTSIZE * s.max_h_samp_factor);
+    mcu_rows = DivCeil(s.image_height, DCTSIZE * s.max_v_samp_factor);
+  }
+  const size_t num_mcus = mcus_per_row * mcu_rows;
+  const size_t interval =
+      s.restart_interval > 0 ? s.restart_interval : num_mcus;
+  int marker = 0;
+  for (size_t mcu = 0; mcu < num_mcus;) {
+    const size_t end = std::min(num_mcus, mcu + interval);
+    BitReaderState br(s.data, s.len, *pos);
+    size_t eobrun = 0;
+    for (; mcu < end; ++mcu) {
+      for (int i = 0; i < scan.comps_in_scan; ++i) {
+        const int c = scan.component_index[i];
+        const int num_blocks = scan.comps_in_scan == 1
+                                   ? 1
+                                   : s.h_samp_factor[c] * s.v_samp_factor[c];
+        for (int b = 0; b < num_blocks; ++b) {
+          if (!CopyBlockSymbols(s, scan, i, &eobrun, &br, sink)) {
+            return false;
+          }
+          sink->EndBlock();
+        }
+      }
+    }
+    size_t bit_pos;
+    if (!br.FinishStream(pos, &bit_pos)) return false;
+    // Skips the padding bits and finds the next marker.
+    size_t p = *pos;
+    while (p + 1 < s.len &&
+           (s.data[p] != 0xFF || s.data[p + 1] == 0 || s.data[p + 1] == 0xFF)) {
+      ++p;
+    }
+    if (p + 1 >= s.len) return false;
+    if (mcu < num_mcus) {
+      if (s.data[p + 1] != 0xD0 + marker) return false;
+      sink->Restart(marker);
+      marker = (marker + 1) & 7;
+      p += 2;
+    }
+    *pos = p;
+  }
+  return sink->Finish();
+}
+
+// Parses the SOF segment of length len at data, returns false if the frame is
+// not a sequential or progressive Huffman coded frame.
+bool ParseReoptFrame(const uint8_t* data, size_t len, HuffmanReoptState* s) {
+  if (s->has_frame || len < 8) return false;
+  s->has_frame = true;
+  s->baseline = data[1] == 0xC0;
+  s->progressive = data[1] == 0xC2;
+  s->image_height = (data[5] << 8) + data[6];
+  s->image_width = (data[7] << 8) + data[8];
+  s->num_components = data[9];
+  if (s->image_width == 0 || s->image_height == 0 || s->num_components == 0 ||
+      s->num_components > kMaxComponents ||
+      len != 8 + 3 * static_cast<size_t>(s->num_components)) {
+    return false;
+  }
+  for (int c = 0; c < s->num_components; ++c) {
+    const uint8_t* comp = &data[10 + 3 * c];
+    s->component_id[c] = comp[0];
+    s->h_samp_factor[c] = comp[1] >> 4;
+    s->v_samp_factor[c] = comp[1] & 15;
+    if (s->h_samp_factor[c] < 1 || s->h_samp_factor[c] > 4 ||
+        s->v_samp_factor[c] < 1 || s->v_samp_factor[c] > 4) {
+      return false;
+    }
+    s->max_h_samp_factor = std::max(s->max_h_samp_factor, s->h_samp_factor[c]);
+    s->max_v_samp_factor = std::max(s->max_v_samp_factor, s->v_samp_factor[c]);
+  }
+  return true;
+}
+
+// Parses the DHT segment of length len at data into the lookup tables.
+bool ParseReoptTables(const uint8_t* data, size_t len, HuffmanReoptState* s) {
+  size_t pos = 4;
+  const size_t end = 2 + len;
+  while (pos < end) {
+    if (pos + 1 + kJpegHuffmanMaxBitLength > end) return false;
+    const int table_class = data[pos] >> 4;
+    const int slot = data[pos] & 15;
+    if (table_class > 1 || slot > 3) return false;
+    uint8_t bits[kJpegHuffmanMaxBitLength + 1] = {};
+    size_t total_count = 0;
+    for (size_t i = 1; i <= kJpegHuffmanMaxBitLength; ++i) {
+      bits[i] = data[pos + i];
+      total_count += bits[i];
+    }
+    pos += 1 + kJpegHuffmanMaxBitLength;
+    if (pos + total_count > end) return false;
+    const int t = table_class * 4 + slot;
+    if (!BuildReoptLut(bits, &data[pos], &s->luts[t * kJpegHuffmanLutSize])) {
+      return false;
+    }
+    s->table_defined[t] = true;
+    pos += total_count;
+  }
+  return true;
+}
+
+// Parses the SOS segment of length len at data.
+bool ParseReoptScan(const uint8_t* data, size_t len,
+                    const HuffmanReoptState& s, ReoptScan* scan) {
+  if (!s.has_frame || len < 6) return false;
+  scan->comps_in_scan = data[4];
+  if (scan->comps_in_scan < 1 || scan->comps_in_scan > s.num_components ||
+      len != 6 + 2 * static_cast<size_t>(scan->comps_in_scan)) {
+    return false;
+  }
+  const uint8_t* params = &data[5 + 2 * scan->comps_in_scan];
+  scan->Ss = params[0];
+  scan->Se = params[1];
+  scan->Ah = params[2] >> 4;
+  scan->Al = params[2] & 15;
+  if (s.progressive) {
+    // Successive approximation of the AC coefficients is not supported.
+    if (scan->Se < scan->Ss || scan->Se > 63 ||
+        (scan->Ss == 0 && scan->Se != 0) ||
+        (scan->Ss > 0 && (scan->comps_in_scan != 1 || scan->Ah > 0))) {
+      return false;
+    }
+  } else if (scan->Ss != 0 || scan->Se != 63 || scan->Ah != 0 ||
+             scan->Al != 0) {
+    return false;
+  }
+  int blocks_in_mcu = 0;
+  for (int i = 0; i < scan->comps_in_scan; ++i) {
+    const int id = data[5 + 2 * i];
+    int c = 0;
+    while (c < s.num_components && s.component_id[c] != id) ++c;
+    if (c == s.num_components) return false;
+    scan->component_index[i] = c;
+    scan->dc_table[i] = data[6 + 2 * i] >> 4;
+    scan->ac_table[i] = data[6 + 2 * i] & 15;
+    if (scan->dc_table[i] > 3 || scan->ac_table[i] > 3) return false;
+    if (scan->Ss == 0 && scan->Ah == 0 &&
+        !s.table_defined[scan->dc_table[i]]) {
+      return false;
+    }
+    if (scan->Se > 0 && !s.table_defined[4 + scan->ac_table[i]]) {
+      return false;
+    }
+    blocks_in_mcu += s.h_samp_factor[c] * s.v_samp_factor[c];
+  }
+  return scan->comps_in_scan == 1 || blocks_in_mcu <= D_MAX_BLOCKS_IN_MCU;
+}
+
+// Writes the DHT segment with the optimized Huffman codes of the contexts that
+// are used by scan, and the SOS segment at sos with the new table selectors.
+// Sets up the codes of the contexts.
+void WriteReoptHeaders(j_compress_ptr cinfo, const HuffmanReoptState& s,
+                       const ReoptScan& scan, const uint8_t* sos,
+                       const int* histograms, HuffmanCodeTable* codes) {
+  bool used[kNumReoptContexts] = {};
+  for (int i = 0; i < scan.comps_in_scan; ++i) {
+    if (scan.Ss == 0 && scan.Ah == 0) used[ReoptSlot(s, i)] = true;
+    if (scan.Se > 0) used[4 + ReoptSlot(s, i)] = true;
+  }
+  std::vector<uint8_t> dht = {0xFF, 0xC4, 0, 0};
+  for (int ctx = 0; ctx < kNumReoptContexts; ++ctx) {
+    if (!used[ctx]) continue;
+    int counts[kJpegHuffmanAlphabetSize];
+    memcpy(counts, &histograms[ctx * kJpegHuffmanAlphabetSize],
+           sizeof(counts));
+    bool empty = true;
+    for (int count : counts) empty &= count == 0;
+    if (empty) counts[0] = 1;
+    JHUFF_TBL table;
+    BuildOptimalHuffmanTable(counts, &table);
+    BuildReoptCodes(table, &codes[ctx]);
+    dht.push_back(((ctx / 4) << 4) + ctx % 4);
+    size_t total_count = 0;
+    for (size_t i = 1; i <= kJpegHuffmanMaxBitLength; ++i) {
+      dht.push_back(table.bits[i]);
+      total_count += table.bits[i];
+    }
+    dht.insert(dht.end(), table.huffval, table.huffval + total_count);
+  }
+  if (dht.size() > 4) {
+    dht[2] = (dht.size() - 2) >> 8;
+    dht[3] = (dht.size() - 2) & 0xFF;
+    WriteOutput(cinfo, dht);
+  }
+  std::vector<uint8_t> header(sos, sos + 8 + 2 * scan.comps_in_scan);
+  for (int i = 0; i < scan.comps_in_scan; ++i) {
+    const int slot = ReoptSlot(s, i);
+    header[6 + 2 * i] = ((used[slot] ? slot : 0) << 4) +
+                        (used[4 + slot] ? slot : 0);
+  }
+  WriteOutput(cinfo, header);
+}
+
+// Walks the marker segments of the input and passes the entropy coded data of
+// each scan to CopyScanSymbols(). Without cinfo, collects the histograms of
+// the scans, otherwise writes the image to cinfo with the optimized Huffman
+// codes of the histograms, with bw as the bit writer of the scan data.
+// Returns false if the image is invalid or not supported.
+bool ReoptimizeHuffmanCodes(HuffmanReoptState* s, j_compress_ptr cinfo,
+                            JpegBitWriter* bw) {
+  const uint8_t* data = s->data;
+  if (s->len < 2 || data[0] != 0xFF || data[1] != 0xD8) return false;
+  if (cinfo) WriteOutput(cinfo, {0xFF, 0xD8});
+  // Starts from the table definitions of the input, which the first pass
+  // changes.
+  s->has_frame = false;
+  s->restart_interval = 0;
+  std::fill(s->table_defined, s->table_defined + kNumReoptContexts, false);
+  s->max_h_samp_factor = s->max_v_samp_factor = 1;
+  size_t scan_index = 0;
+  size_t pos = 2;
+  for (;;) {
+    while (pos + 1 < s->len && data[pos] == 0xFF && data[pos + 1] == 0xFF) {
+      ++pos;
+    }
+    if (pos + 1 >= s->len || data[pos] != 0xFF) return false;
+    const uint8_t marker = data[pos + 1];
+    if (marker == 0xD9) {
+      if (cinfo) WriteOutput(cinfo, {0xFF, 0xD9});
+      s->end_pos = pos + 2;
+      return s->has_frame && scan_index > 0;
+    }
+    if (pos + 4 > s->len) return false;
+    const size_t len = (data[pos + 2] << 8) + data[pos + 3];
+    if (len < 2 || pos + 2 + len > s->len) return false;
+    const uint8_t* segment = &data[pos];
+    pos += 2 + len;
+    if (marker == 0xC4) {
+      if (!ParseReoptTables(segment, len, s)) return false;
+      // The tables are replaced by the tables written before each scan.
+      continue;
+    } else if (marker == 0xC0 || marker == 0xC1 || marker == 0xC2) {
+      if (!ParseReoptFrame(segment, len, s)) return false;
+    } else if (marker <= 0xD8 || marker == 0xDC) {
+      // Lossless, hierarchical and arithmetic coded frames, DNL and misplaced
+      // markers.
+      return false;
+    } else if (marker == 0xDD) {
+      if (len != 4) return false;
+      s->restart_interval = (segment[4] << 8) + segment[5];
+    } else if (marker == kApp10 && len >= 2 + sizeof(kRestartIndexTag) &&
+               memcmp(&segment[4], kRestartIndexTag,
+                      sizeof(kRestartIndexTag)) == 0) {
+      // The offsets of the restart index change with the scan data.
+      continue;
+    }
+    if (marker != 0xDA) {
+      if (cinfo) WriteOutput(cinfo, segment, 2 + len);
+      continue;
+    }
+    ReoptScan scan;
+    if (!ParseReoptScan(segment, len, *s, &scan)) return false;
+    if (!cinfo) {
+      s->histograms.resize((scan_index + 1) * kNumReoptContexts *
+                           kJpegHuffmanAlphabetSize);
+      ReoptHistogramSink sink(&s->histograms[scan_index * kNumReoptContexts *
+                                             kJpegHuffmanAlphabetSize]);
+      if (!CopyScanSymbols(*s, scan, &pos, &sink)) return false;
+    } else {
+      if (scan_index >= s->num_scans) return false;
+      HuffmanCodeTable codes[kNumReoptContexts];
+      WriteReoptHeaders(cinfo, *s, scan, segment,
+                        &s->histograms[scan_index * kNumReoptContexts *
+                                       kJpegHuffmanAlphabetSize],
+                        codes);
+      ReoptWriterSink sink(codes, bw);
+      if (!CopyScanSymbols(*s, scan, &pos, &sink)) return false;
+    }
+    ++scan_index;
+    if (!cinfo) s->num_scans = scan_index;
+  }
+}
+
+}  // namespace
+}  // namespace jpegli
+
+void jpegli_transcode(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+                      const JpegliTranscodeOptions* options) {
+  const auto& cinfo = dstinfo;
+  JpegliTranscodeOptions opts = {};
+  opts.progressive_level = -1;
+  opts.optimize_coding = 1;
+  opts.copy_markers = 1;
+  if (options != nullptr) {
+    opts = *options;
+  }
+  const bool transformed = opts.transform != JPEGLI_TRANSFORM_NONE;
+  const bool cropped = opts.crop_x > 0 || opts.crop_y > 0 ||
+                       opts.crop_width > 0 || opts.crop_height > 0;
+  if (opts.copy_markers) {
+    for (int i = 0; i < 16; ++i) {
+      jpegli_save_markers(srcinfo, JPEG_APP0 + i, 0xffff);
+    }
+  }
+  if (jpegli_read_header(srcinfo, /*require_image=*/TRUE) != JPEG_HEADER_OK) {
+    JPEGLI_ERROR("jpegli_transcode: suspending sources are not supported");
+  }
+  // Without a transform, the coefficients are kept in zigzag order from the
+  // decoder to the encoder.
+  const bool zigzag_coefficients = srcinfo->master->zigzag_coefficients_;
+  jpegli_set_zigzag_coefficients(srcinfo,
+                                 TO_JXL_BOOL(!transformed && !cropped));
+  jvirt_barray_ptr* coef_arrays = jpegli_read_coefficients(srcinfo);
+  jpegli_set_zigzag_coefficients(srcinfo, TO_JXL_BOOL(zigzag_coefficients));
+  if (coef_arrays == nullptr) {
+    JPEGLI_ERROR("jpegli_transcode: suspending sources are not supported");
+  }
+  jpegli_copy_critical_parameters(srcinfo, dstinfo);
+  if (opts.progressive_level >= 0) {
+    jpegli_set_progressive_level(dstinfo, opts.progressive_level);
+  } else {
+    jpegli_set_progressive_level(dstinfo, srcinfo->progressive_mode ? 2 : 0);
+  }
+  dstinfo->optimize_coding = TO_JXL_BOOL(opts.optimize_coding);
+  if (transformed || cropped) {
+    coef_arrays =
+        jpegli::TransformCoefficients(srcinfo, dstinfo, coef_arrays, opts);
+  }
+  // Without a transform, the encoder codes the coefficient buffers of the
+  // decoder in place.
+  jpegli_write_coefficients(dstinfo, coef_arrays);
+  if (opts.copy_markers) {
+    jpegli::CopyMarkers(srcinfo, dstinfo, transformed);
+  }
+  jpegli_finish_compress(dstinfo);
+  jpegli_finish_decompress(srcinfo);
+}
+
+void jpegli_optimize_huffman(j_decompress_ptr srcinfo,
+                             j_compress_ptr dstinfo) {
+  const auto& cinfo = dstinfo;
+  jpeg_source_mgr* src = srcinfo->src;
+  if (src == nullptr || dstinfo->dest == nullptr) {
+    JPEGLI_ERROR("jpegli_optimize_huffman: missing source or destination");
+  }
+  jpegli::HuffmanReoptState state(src->next_input_byte, src->bytes_in_buffer);
+  if (!jpegli::ReoptimizeHuffmanCodes(&state, nullptr, nullptr)) {
+    // The input is not in memory, or it has scans that are not supported.
+    jpegli_transcode(srcinfo, dstinfo, nullptr);
+    return;
+  }
+  (*dstinfo->dest->init_destination)(dstinfo);
+  dstinfo->master->num_output_bytes = 0;
+  jpegli::JpegBitWriter bw;
+  bw.cinfo = dstinfo;
+  bw.data = jpegli::Allocate<uint8_t>(dstinfo, jpegli::kReoptBufferSize,
+                                      JPOOL_IMAGE);
+  bw.len = jpegli::kReoptBufferSize;
+  bw.pos = 0;
+  bw.output_pos = 0;
+  bw.put_buffer = 0;
+  bw.free_bits = 64;
+  bw.healthy = true;
+  if (!jpegli::ReoptimizeHuffmanCodes(&state, dstinfo, &bw)) {
+    JPEGLI_ERROR("jpegli_optimize_huffman: failed to write the scans");
+  }
+  (*dstinfo->dest->term_destination)(dstinfo);
+  src->next_input_byte += state.end_pos;
+  src->bytes_in_buffer -= state.end_pos;
+  jpegli_abort_compress(dstinfo);
+}
+
+void jpegli_copy_markers(j_decompress_ptr srcinfo, j_compress_ptr dstinfo) {
+  jpegli::CopyMarkers(srcinfo, dstinfo, /*transformed=*/false);
+}
+
+void jpegli_transcode_scaled(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+                             const JpegliScaledTranscodeOptions* options) {
+  const auto& cinfo = dstinfo;
+  JpegliScaledTranscodeOptions opts = {/*scale_denom=*/8, /*quality=*/0,
+                                       /*progressive_level=*/-1,
+                                       /*copy_markers=*/1};
+  if (options != nullptr) {
+    opts = *options;
+  }
+  if (opts.scale_denom != 2 && opts.scale_denom != 4 &&
+      opts.scale_denom != 8) {
+    JPEGLI_ERROR("jpegli_transcode_scaled: unsupported scale 1/%d",
+                 opts.scale_denom);
+  }
+  if (opts.copy_markers) {
+    for (int i = 0; i < 16; ++i) {
+      jpegli_save_markers(srcinfo, JPEG_APP0 + i, 0xffff);
+    }
+  }
+  if (jpegli_read_header(srcinfo, /*require_image=*/TRUE) != JPEG_HEADER_OK) {
+    JPEGLI_ERROR("jpegli_transcode_scaled: suspending sources are not "
+                 "supported");
+  }
+  if (srcinfo->data_precision != 8) {
+    JPEGLI_ERROR("jpegli_transcode_scaled: unsupported data precision %d",
+                 srcinfo->data_precision);
+  }
+  // The scaled IDCT needs the coefficients in the natural order.
+  const bool zigzag_coefficients = srcinfo->master->zigzag_coefficients_;
+  jpegli_set_zigzag_coefficients(srcinfo, FALSE);
+  jvirt_barray_ptr* coef_arrays = jpegli_read_coefficients(srcinfo);
+  jpegli_set_zigzag_coefficients(srcinfo, TO_JXL_BOOL(zigzag_coefficients));
+  if (coef_arrays == nullptr) {
+    JPEGLI_ERROR("jpegli_transcode_scaled: suspending sources are not "
+                 "supported");
+  }
+  dstinfo->image_width =
+      jpegli::DivCeil(srcinfo->image_width, opts.scale_denom);
+  dstinfo->image_height =
+      jpegli::DivCeil(srcinfo->image_height, opts.scale_denom);
+  dstinfo->input_components = srcinfo->num_components;
+  dstinfo->in_color_space = srcinfo->jpeg_color_space;
+  jpegli_set_defaults(dstinfo);
+  jpegli_set_colorspace(dstinfo, srcinfo->jpeg_color_space);
+  for (int c = 0; c < dstinfo->num_components; ++c) {
+    dstinfo->comp_info[c].h_samp_factor = srcinfo->comp_info[c].h_samp_factor;
+    dstinfo->comp_info[c].v_samp_factor = srcinfo->comp_info[c].v_samp_factor;
+  }
+  if (opts.quality > 0) {
+    jpegli_set_quality(dstinfo, opts.quality, TRUE);
+  }
+  if (opts.progressive_level >= 0) {
+    jpegli_set_progressive_level(dstinfo, opts.progressive_level);
+  } else {
+    jpegli_set_progressive_level(dstinfo, srcinfo->progressive_mode ? 2 : 0);
+  }
+  dstinfo->raw_data_in = TRUE;
+  jpegli_set_input_format(dstinfo, JPEGLI_TYPE_FLOAT, JPEGLI_NATIVE_ENDIAN);
+  jpegli_start_compress(dstinfo, TRUE);
+  if (opts.copy_markers) {
+    jpegli::CopyMarkers(srcinfo, dstinfo, /*transformed=*/false);
+  }
+  jpegli::WriteScaledCoefficients(srcinfo, dstinfo, coef_arrays,
+                                  opts.scale_denom);
+  jpegli_finish_compress(dstinfo);
+  jpegli_finish_decompress(srcinfo);
+}
+
+void jpegli_recompress(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+                       const JpegliRecompressOptions* options) {
+  const auto& cinfo = dstinfo;
+  JpegliRecompressOptions opts = {};
+  opts.filter = JPEGLI_FILTER_LANCZOS3;
+  opts.progressive_level = -1;
+  opts.copy_markers = 1;
+  if (options != nullptr) {
+    opts = *options;
+  }
+  if (opts.copy_markers) {
+    for (int i = 0; i < 16; ++i) {
+      jpegli_save_markers(srcinfo, JPEG_APP0 + i, 0xffff);
+    }
+  }
+  if (jpegli_read_header(srcinfo, /*require_image=*/TRUE) != JPEG_HEADER_OK) {
+    JPEGLI_ERROR("jpegli_recompress: suspending sources are not supported");
+  }
+  const JpegliDataType data_type =
+      srcinfo->data_precision > 8 ? JPEGLI_TYPE_UINT16 : JPEGLI_TYPE_UINT8;
+  jpegli_set_output_format(srcinfo, data_type, JPEGLI_NATIVE_ENDIAN);
+  if (opts.width > 0 && opts.height > 0) {
+    jpegli_set_output_size(srcinfo, opts.width, opts.height, opts.filter);
+  }
+  if (!jpegli_start_decompress(srcinfo)) {
+    JPEGLI_ERROR("jpegli_recompress: suspending sources are not supported");
+  }
+  dstinfo->image_width = srcinfo->output_width;
+  dstinfo->image_height = srcinfo->output_height;
+  dstinfo->input_components = srcinfo->out_color_components;
+  dstinfo->in_color_space = srcinfo->out_color_space;
+  jpegli_set_defaults(dstinfo);
+  if (dstinfo->num_components == srcinfo->num_components) {
+    for (int c = 0; c < dstinfo->num_components; ++c) {
+      dstinfo->comp_info[c].h_samp_factor =
+          srcinfo->comp_info[c].h_samp_factor;
+      dstinfo->comp_info[c].v_samp_factor =
+          srcinfo->comp_info[c].v_samp_factor;
+    }
+  }
+  if (opts.quality > 0) {
+    jpegli_set_quality(dstinfo, opts.quality, TRUE);
+  }
+  if (opts.progressive_level >= 0) {
+    jpegli_set_progressive_level(dstinfo, opts.progressive_level);
+  } else {
+    jpegli_set_progressive_level(dstinfo, srcinfo->progressive_mode ? 2 : 0);
+  }
+  jpegli_set_input_format(dstinfo, data_type, JPEGLI_NATIVE_ENDIAN);
+  jpegli_start_compress(dstinfo, TRUE);
+  if (opts.copy_markers) {
+    jpegli::CopyMarkers(srcinfo, dstinfo, /*transformed=*/false);
+  }
+  const size_t strip_height = opts.strip_height > 0 ? opts.strip_height : 16;
+  const size_t stride = srcinfo->output_width * srcinfo->out_color_components *
+                        jpegli_bytes_per_sample(data_type);
+  std::vector<uint8_t> strip(strip_height * stride);
+  std::vector<JSAMPROW> rows(strip_height);
+  for (size_t y = 0; y < strip_height; ++y) {
+    rows[y] = &strip[y * stride];
+  }
+  while (srcinfo->output_scanline < srcinfo->output_height) {
+    JDIMENSION num_rows = jpegli_read_scanlines(srcinfo, rows.data(),
+                                                strip_height);
+    if (num_rows == 0) {
+      JPEGLI_ERROR("jpegli_recompress: suspending sources are not supported");
+    }
+    if (jpegli_write_scanlines(dstinfo, rows.data(), num_rows) != num_rows) {
+      JPEGLI_ERROR("jpegli_recompress: suspending destinations are not "
+                   "supported");
+    }
+  }
+  jpegli_finish_compress(dstinfo);
+  jpegli_finish_decompress(srcinfo);
+}
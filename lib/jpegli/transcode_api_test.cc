@@ -4,6 +4,8 @@
 // license that can be found in the LICENSE file or at
 // https://developers.google.com/open-source/licenses/bsd
 
+#include <algorithm>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
@@ -101,6 +103,480 @@ TEST_P(TranscodeAPITestParam, TestAPI) {
   }
 }
 
+TEST(TranscodeAPITest, Transcode) {
+  TestImage input;
+  input.xsize = 259;
+  input.ysize = 131;
+  GeneratePixels(&input);
+  CompressParams jparams;
+  jparams.h_sampling = {2, 1, 1};
+  jparams.v_sampling = {2, 1, 1};
+  jparams.progressive_mode = 0;
+  jparams.optimize_coding = 0;
+  jparams.icc.resize(200, 0x2a);
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+  TestImage output0;
+  DecodeWithLibjpeg(jparams, DecompressParams(), compressed, &output0);
+  for (int progressive_level : {-1, 0, 2}) {
+    for (int copy_markers : {0, 1}) {
+      JpegliTranscodeOptions options = {progressive_level,
+                                        /*optimize_coding=*/1, copy_markers};
+      jpeg_decompress_struct dinfo = {};
+      jpeg_compress_struct cinfo = {};
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        dinfo.err = cinfo.err;
+        dinfo.client_data = cinfo.client_data;
+        jpegli_create_decompress(&dinfo);
+        jpegli_mem_src(&dinfo, compressed.data(), compressed.size());
+        jpegli_create_compress(&cinfo);
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        jpegli_transcode(&dinfo, &cinfo, &options);
+        EXPECT_EQ(progressive_level > 0, !!cinfo.progressive_mode);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&dinfo);
+      jpegli_destroy_compress(&cinfo);
+      std::vector<uint8_t> transcoded(buffer, buffer + buffer_size);
+      free(buffer);
+      JpegliImageInfo info;
+      ASSERT_TRUE(jpegli_probe(transcoded.data(), transcoded.size(), &info));
+      EXPECT_EQ(copy_markers, info.num_icc_markers);
+      EXPECT_LT(transcoded.size(), compressed.size());
+      // The ICC profile of the output is checked if it is in the params.
+      CompressParams output_jparams = jparams;
+      output_jparams.progressive_mode = std::max(progressive_level, 0);
+      output_jparams.optimize_coding = 1;
+      if (!copy_markers) output_jparams.icc.clear();
+      TestImage output1;
+      DecodeWithLibjpeg(output_jparams, DecompressParams(), transcoded,
+                        &output1);
+      ASSERT_EQ(output0.pixels.size(), output1.pixels.size());
+      EXPECT_EQ(0, memcmp(output0.pixels.data(), output1.pixels.data(),
+                          output0.pixels.size()));
+    }
+  }
+}
+
+TEST(TranscodeAPITest, OptimizeHuffman) {
+  TestImage input;
+  input.xsize = 259;
+  input.ysize = 131;
+  GeneratePixels(&input);
+  // Progressive level 2 has AC refinement scans, which are transcoded with
+  // jpegli_transcode().
+  for (int progressive_mode : {0, 1, 2}) {
+    for (unsigned int restart_interval : {0u, 7u}) {
+      CompressParams jparams;
+      jparams.h_sampling = {2, 1, 1};
+      jparams.v_sampling = {2, 1, 1};
+      jparams.progressive_mode = progressive_mode;
+      jparams.restart_interval = restart_interval;
+      jparams.optimize_coding = 0;
+      jparams.icc.resize(200, 0x2a);
+      std::vector<uint8_t> compressed;
+      ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+      TestImage output0;
+      DecodeWithLibjpeg(jparams, DecompressParams(), compressed, &output0);
+      jpeg_decompress_struct dinfo = {};
+      jpeg_compress_struct cinfo = {};
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        dinfo.err = cinfo.err;
+        dinfo.client_data = cinfo.client_data;
+        jpegli_create_decompress(&dinfo);
+        jpegli_mem_src(&dinfo, compressed.data(), compressed.size());
+        jpegli_create_compress(&cinfo);
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        jpegli_optimize_huffman(&dinfo, &cinfo);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&dinfo);
+      jpegli_destroy_compress(&cinfo);
+      std::vector<uint8_t> optimized(buffer, buffer + buffer_size);
+      free(buffer);
+      EXPECT_LT(optimized.size(), compressed.size());
+      JpegliImageInfo info;
+      ASSERT_TRUE(jpegli_probe(optimized.data(), optimized.size(), &info));
+      EXPECT_EQ(1, info.num_icc_markers);
+      TestImage output1;
+      DecodeWithLibjpeg(jparams, DecompressParams(), optimized, &output1);
+      ASSERT_EQ(output0.pixels.size(), output1.pixels.size());
+      EXPECT_EQ(0, memcmp(output0.pixels.data(), output1.pixels.data(),
+                          output0.pixels.size()));
+    }
+  }
+}
+
+// Returns the pixel of the transformed image at (x, y), where xsize and ysize
+// are the dimensions of the transformed image.
+uint8_t TransformedPixel(const TestImage& img, JpegliTransform transform,
+                         size_t xsize, size_t ysize, size_t x, size_t y,
+                         size_t c) {
+  const bool transpose = transform >= JPEGLI_TRANSFORM_TRANSPOSE;
+  const bool flip_x =
+      transform == JPEGLI_TRANSFORM_FLIP_H ||
+      transform == JPEGLI_TRANSFORM_ROT_180 ||
+      transform == JPEGLI_TRANSFORM_ROT_90 ||
+      transform == JPEGLI_TRANSFORM_TRANSVERSE;
+  const bool flip_y =
+      transform == JPEGLI_TRANSFORM_FLIP_V ||
+      transform == JPEGLI_TRANSFORM_ROT_180 ||
+      transform == JPEGLI_TRANSFORM_ROT_270 ||
+      transform == JPEGLI_TRANSFORM_TRANSVERSE;
+  if (flip_x) x = xsize - 1 - x;
+  if (flip_y) y = ysize - 1 - y;
+  if (transpose) std::swap(x, y);
+  return img.pixels[(y * img.xsize + x) * img.components + c];
+}
+
+TEST(TranscodeAPITest, LosslessTransform) {
+  TestImage input;
+  input.xsize = 64;
+  input.ysize = 48;
+  GeneratePixels(&input);
+  CompressParams jparams;
+  jparams.h_sampling = {2, 1, 1};
+  jparams.v_sampling = {1, 1, 1};
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+  TestImage output0;
+  DecodeWithLibjpeg(jparams, DecompressParams(), compressed, &output0);
+  for (int t = 0; t < 8; ++t) {
+    for (bool crop : {false, true}) {
+      const JpegliTransform transform = static_cast<JpegliTransform>(t);
+      JpegliTranscodeOptions options = {};
+      options.progressive_level = 0;
+      options.transform = transform;
+      if (crop) {
+        // The top left corner is moved to the iMCU boundary of the output.
+        options.crop_x = 19;
+        options.crop_y = 9;
+        options.crop_width = 21;
+        options.crop_height = 13;
+      }
+      jpeg_decompress_struct dinfo = {};
+      jpeg_compress_struct cinfo = {};
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        dinfo.err = cinfo.err;
+        dinfo.client_data = cinfo.client_data;
+        jpegli_create_decompress(&dinfo);
+        jpegli_mem_src(&dinfo, compressed.data(), compressed.size());
+        jpegli_create_compress(&cinfo);
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        jpegli_transcode(&dinfo, &cinfo, &options);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&dinfo);
+      jpegli_destroy_compress(&cinfo);
+      std::vector<uint8_t> transcoded(buffer, buffer + buffer_size);
+      free(buffer);
+      const bool transpose = transform >= JPEGLI_TRANSFORM_TRANSPOSE;
+      const size_t xsize = transpose ? input.ysize : input.xsize;
+      const size_t ysize = transpose ? input.xsize : input.ysize;
+      const size_t x0 = crop ? 16 : 0;
+      const size_t y0 = crop ? (transpose ? 0 : 8) : 0;
+      const size_t out_xsize = crop ? 19 + 21 - x0 : xsize;
+      const size_t out_ysize = crop ? 9 + 13 - y0 : ysize;
+      JpegliImageInfo info;
+      ASSERT_TRUE(jpegli_probe(transcoded.data(), transcoded.size(), &info));
+      ASSERT_EQ(out_xsize, info.image_width);
+      ASSERT_EQ(out_ysize, info.image_height);
+      EXPECT_EQ(transpose ? 1 : 2, info.h_samp_factor[0]);
+      EXPECT_EQ(transpose ? 2 : 1, info.v_samp_factor[0]);
+      CompressParams output_jparams = jparams;
+      output_jparams.h_sampling = {info.h_samp_factor[0], 1, 1};
+      output_jparams.v_sampling = {info.v_samp_factor[0], 1, 1};
+      output_jparams.optimize_coding = 1;
+      TestImage output1;
+      DecodeWithLibjpeg(output_jparams, DecompressParams(), transcoded,
+                        &output1);
+      ASSERT_EQ(out_xsize, output1.xsize);
+      ASSERT_EQ(out_ysize, output1.ysize);
+      // The transformed IDCT and upsampling are only equal up to rounding.
+      int max_diff = 0;
+      for (size_t y = 0; y < out_ysize; ++y) {
+        for (size_t x = 0; x < out_xsize; ++x) {
+          for (size_t c = 0; c < output1.components; ++c) {
+            const int expected = TransformedPixel(output0, transform, xsize,
+                                                  ysize, x0 + x, y0 + y, c);
+            const int actual =
+                output1.pixels[(y * out_xsize + x) * output1.components + c];
+            max_diff = std::max(max_diff, std::abs(expected - actual));
+          }
+        }
+      }
+      EXPECT_LE(max_diff, 2) << "transform " << t << " crop " << crop;
+    }
+  }
+}
+
+TEST(TranscodeAPITest, CopyMarkers) {
+  TestImage input;
+  input.xsize = 64;
+  input.ysize = 48;
+  GeneratePixels(&input);
+  CompressParams jparams;
+  jparams.add_marker = true;
+  // An ICC profile of three APP2 chunks, whose order has to be kept.
+  jparams.icc.resize(150000);
+  for (size_t i = 0; i < jparams.icc.size(); ++i) {
+    jparams.icc[i] = i * 7 % 251;
+  }
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+  jpeg_decompress_struct dinfo = {};
+  jpeg_compress_struct cinfo = {};
+  uint8_t* buffer = nullptr;
+  unsigned long buffer_size = 0;  // NOLINT
+  const auto try_catch_block = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    dinfo.err = cinfo.err;
+    dinfo.client_data = cinfo.client_data;
+    jpegli_create_decompress(&dinfo);
+    jpegli_mem_src(&dinfo, compressed.data(), compressed.size());
+    for (int i = 0; i < 16; ++i) {
+      jpegli_save_markers(&dinfo, JPEG_APP0 + i, 0xffff);
+    }
+    jpegli_read_header(&dinfo, TRUE);
+    jpegli_start_decompress(&dinfo);
+    const size_t stride = dinfo.output_width * dinfo.output_components;
+    std::vector<uint8_t> pixels(dinfo.output_height * stride);
+    while (dinfo.output_scanline < dinfo.output_height) {
+      JSAMPROW row = &pixels[dinfo.output_scanline * stride];
+      jpegli_read_scanlines(&dinfo, &row, 1);
+    }
+    jpegli_create_compress(&cinfo);
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    cinfo.image_width = dinfo.output_width;
+    cinfo.image_height = dinfo.output_height;
+    cinfo.input_components = dinfo.output_components;
+    cinfo.in_color_space = dinfo.out_color_space;
+    jpegli_set_defaults(&cinfo);
+    jpegli_start_compress(&cinfo, TRUE);
+    jpegli_copy_markers(&dinfo, &cinfo);
+    while (cinfo.next_scanline < cinfo.image_height) {
+      JSAMPROW row = &pixels[cinfo.next_scanline * stride];
+      jpegli_write_scanlines(&cinfo, &row, 1);
+    }
+    jpegli_finish_compress(&cinfo);
+    jpegli_finish_decompress(&dinfo);
+    return true;
+  };
+  ASSERT_TRUE(try_catch_block());
+  jpegli_destroy_decompress(&dinfo);
+  jpegli_destroy_compress(&cinfo);
+  std::vector<uint8_t> reencoded(buffer, buffer + buffer_size);
+  free(buffer);
+  jpeg_decompress_struct dinfo2 = {};
+  const auto try_catch_block2 = [&]() -> bool {
+    ERROR_HANDLER_SETUP(jpegli);
+    jpegli_create_decompress(&dinfo2);
+    jpegli_mem_src(&dinfo2, reencoded.data(), reencoded.size());
+    jpegli_save_markers(&dinfo2, kSpecialMarker0, 0xffff);
+    jpegli_read_header(&dinfo2, TRUE);
+    uint8_t* icc_data = nullptr;
+    unsigned int icc_len = 0;
+    JPEGLI_TEST_ENSURE_TRUE(
+        jpegli_read_icc_profile(&dinfo2, &icc_data, &icc_len));
+    EXPECT_EQ(jparams.icc.size(), icc_len);
+    EXPECT_EQ(0, memcmp(jparams.icc.data(), icc_data, icc_len));
+    free(icc_data);
+    JPEGLI_TEST_ENSURE_TRUE(dinfo2.marker_list != nullptr);
+    EXPECT_EQ(kSpecialMarker0, dinfo2.marker_list->marker);
+    EXPECT_EQ(sizeof(kMarkerData), dinfo2.marker_list->data_length);
+    EXPECT_EQ(0, memcmp(dinfo2.marker_list->data, kMarkerData,
+                        sizeof(kMarkerData)));
+    return true;
+  };
+  EXPECT_TRUE(try_catch_block2());
+  jpegli_destroy_decompress(&dinfo2);
+}
+
+TEST(TranscodeAPITest, ScaledTranscode) {
+  TestImage input;
+  input.xsize = 259;
+  input.ysize = 131;
+  GeneratePixels(&input);
+  CompressParams jparams;
+  jparams.quality = 95;
+  jparams.h_sampling = {2, 1, 1};
+  jparams.v_sampling = {2, 1, 1};
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+  TestImage output0;
+  DecodeWithLibjpeg(jparams, DecompressParams(), compressed, &output0);
+  for (int scale_denom : {2, 4, 8}) {
+    JpegliScaledTranscodeOptions options = {scale_denom, /*quality=*/95,
+                                            /*progressive_level=*/-1,
+                                            /*copy_markers=*/1};
+    jpeg_decompress_struct dinfo = {};
+    jpeg_compress_struct cinfo = {};
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      dinfo.err = cinfo.err;
+      dinfo.client_data = cinfo.client_data;
+      jpegli_create_decompress(&dinfo);
+      jpegli_mem_src(&dinfo, compressed.data(), compressed.size());
+      jpegli_create_compress(&cinfo);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      jpegli_transcode_scaled(&dinfo, &cinfo, &options);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&dinfo);
+    jpegli_destroy_compress(&cinfo);
+    std::vector<uint8_t> transcoded(buffer, buffer + buffer_size);
+    free(buffer);
+    CompressParams output_jparams = jparams;
+    output_jparams.optimize_coding = 1;
+    TestImage output1;
+    DecodeWithLibjpeg(output_jparams, DecompressParams(), transcoded,
+                      &output1);
+    const size_t xsize = DivCeil(input.xsize, scale_denom);
+    const size_t ysize = DivCeil(input.ysize, scale_denom);
+    ASSERT_EQ(xsize, output1.xsize);
+    ASSERT_EQ(ysize, output1.ysize);
+    // Compare to the box downsampled full size image.
+    double sum_sq_diff = 0.0;
+    for (size_t y = 0; y < ysize; ++y) {
+      for (size_t x = 0; x < xsize; ++x) {
+        for (size_t c = 0; c < output1.components; ++c) {
+          double sum = 0.0;
+          size_t count = 0;
+          for (size_t iy = y * scale_denom;
+               iy < std::min((y + 1) * scale_denom, output0.ysize); ++iy) {
+            for (size_t ix = x * scale_denom;
+                 ix < std::min((x + 1) * scale_denom, output0.xsize); ++ix) {
+              sum += output0.pixels[(iy * output0.xsize + ix) *
+                                        output0.components +
+                                    c];
+              ++count;
+            }
+          }
+          const double diff =
+              sum / count -
+              output1.pixels[(y * xsize + x) * output1.components + c];
+          sum_sq_diff += diff * diff;
+        }
+      }
+    }
+    const double rms =
+        std::sqrt(sum_sq_diff / (xsize * ysize * output1.components));
+    EXPECT_LT(rms, 3.0) << "scale 1/" << scale_denom;
+  }
+}
+
+TEST(TranscodeAPITest, Recompress) {
+  TestImage input;
+  input.xsize = 259;
+  input.ysize = 131;
+  GeneratePixels(&input);
+  CompressParams jparams;
+  jparams.quality = 95;
+  jparams.h_sampling = {2, 1, 1};
+  jparams.v_sampling = {2, 1, 1};
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeWithJpegli(input, jparams, &compressed));
+  const auto recompress = [&](unsigned int width, unsigned int height,
+                              unsigned int strip_height,
+                              std::vector<uint8_t>* output) {
+    JpegliRecompressOptions options = {width,
+                                       height,
+                                       JPEGLI_FILTER_LANCZOS3,
+                                       /*quality=*/95,
+                                       /*progressive_level=*/-1,
+                                       /*copy_markers=*/1,
+                                       strip_height};
+    jpeg_decompress_struct dinfo = {};
+    jpeg_compress_struct cinfo = {};
+    uint8_t* buffer = nullptr;
+    unsigned long buffer_size = 0;  // NOLINT
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      dinfo.err = cinfo.err;
+      dinfo.client_data = cinfo.client_data;
+      jpegli_create_decompress(&dinfo);
+      jpegli_mem_src(&dinfo, compressed.data(), compressed.size());
+      jpegli_create_compress(&cinfo);
+      jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+      jpegli_recompress(&dinfo, &cinfo, &options);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&dinfo);
+    jpegli_destroy_compress(&cinfo);
+    output->assign(buffer, buffer + buffer_size);
+    free(buffer);
+  };
+  // Decodes the input resized to width x height with jpegli.
+  const auto decode_resized = [&](unsigned int width, unsigned int height,
+                                  TestImage* output) {
+    jpeg_decompress_struct cinfo;
+    const auto try_catch_block = [&]() -> bool {
+      ERROR_HANDLER_SETUP(jpegli);
+      jpegli_create_decompress(&cinfo);
+      jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+      jpegli_read_header(&cinfo, /*require_image=*/TRUE);
+      jpegli_set_output_size(&cinfo, width, height, JPEGLI_FILTER_LANCZOS3);
+      jpegli_start_decompress(&cinfo);
+      output->xsize = cinfo.output_width;
+      output->ysize = cinfo.output_height;
+      output->components = cinfo.out_color_components;
+      output->AllocatePixels();
+      size_t stride = output->xsize * output->components;
+      EXPECT_EQ(cinfo.output_height,
+                jpegli_decode_into(&cinfo, output->pixels.data(), stride));
+      jpegli_finish_decompress(&cinfo);
+      return true;
+    };
+    ASSERT_TRUE(try_catch_block());
+    jpegli_destroy_decompress(&cinfo);
+  };
+  CompressParams output_jparams = jparams;
+  output_jparams.optimize_coding = 1;
+  // The output does not depend on the strip height.
+  std::vector<uint8_t> expected;
+  recompress(0, 0, 0, &expected);
+  for (unsigned int strip_height : {1u, 7u, 200u}) {
+    std::vector<uint8_t> output;
+    recompress(0, 0, strip_height, &output);
+    EXPECT_EQ(expected, output) << "strip height " << strip_height;
+  }
+  TestImage original;
+  DecodeWithLibjpeg(jparams, DecompressParams(), compressed, &original);
+  TestImage output0;
+  DecodeWithLibjpeg(output_jparams, DecompressParams(), expected, &output0);
+  ASSERT_EQ(input.xsize, output0.xsize);
+  ASSERT_EQ(input.ysize, output0.ysize);
+  EXPECT_LT(DistanceRms(original, output0), 3.0);
+  for (unsigned int width : {100u, 37u}) {
+    const unsigned int height = width / 2;
+    std::vector<uint8_t> resized;
+    recompress(width, height, 5, &resized);
+    TestImage output1;
+    DecodeWithLibjpeg(output_jparams, DecompressParams(), resized, &output1);
+    ASSERT_EQ(width, output1.xsize);
+    ASSERT_EQ(height, output1.ysize);
+    TestImage reference;
+    decode_resized(width, height, &reference);
+    EXPECT_LT(DistanceRms(reference, output1), 3.0) << "width " << width;
+  }
+}
+
 std::vector<TestConfig> GenerateTests() {
   std::vector<TestConfig> all_tests;
   const size_t xsize0 = 1024;
@@ -22,18 +22,22 @@ namespace jpegli {
 namespace HWY_NAMESPACE {
 namespace {
 
+// Transposes the 8x8 block with rows from_stride floats apart into the 8x8
+// block with rows to_stride floats apart. The strides are multiples of 8, so
+// that any block of a row of horizontally adjacent blocks can be transposed.
 #if HWY_CAP_GE256
 JXL_INLINE void Transpose8x8Block(const float* JXL_RESTRICT from,
-                                  float* JXL_RESTRICT to) {
+                                  size_t from_stride, float* JXL_RESTRICT to,
+                                  size_t to_stride) {
   const HWY_CAPPED(float, 8) d;
   auto i0 = Load(d, from);
-  auto i1 = Load(d, from + 1 * 8);
-  auto i2 = Load(d, from + 2 * 8);
-  auto i3 = Load(d, from + 3 * 8);
-  auto i4 = Load(d, from + 4 * 8);
-  auto i5 = Load(d, from + 5 * 8);
-  auto i6 = Load(d, from + 6 * 8);
-  auto i7 = Load(d, from + 7 * 8);
+  auto i1 = Load(d, from + 1 * from_stride);
+  auto i2 = Load(d, from + 2 * from_stride);
+  auto i3 = Load(d, from + 3 * from_stride);
+  auto i4 = Load(d, from + 4 * from_stride);
+  auto i5 = Load(d, from + 5 * from_stride);
+  auto i6 = Load(d, from + 6 * from_stride);
+  auto i7 = Load(d, from + 7 * from_stride);
 
   const auto q0 = InterleaveLower(d, i0, i2);
   const auto q1 = InterleaveLower(d, i1, i3);
@@ -63,24 +67,25 @@ JXL_INLINE void Transpose8x8Block(const float* JXL_RESTRICT from,
   i7 = ConcatUpperUpper(d, r7, r3);
 
   Store(i0, d, to);
-  Store(i1, d, to + 1 * 8);
-  Store(i2, d, to + 2 * 8);
-  Store(i3, d, to + 3 * 8);
-  Store(i4, d, to + 4 * 8);
-  Store(i5, d, to + 5 * 8);
-  Store(i6, d, to + 6 * 8);
-  Store(i7, d, to + 7 * 8);
+  Store(i1, d, to + 1 * to_stride);
+  Store(i2, d, to + 2 * to_stride);
+  Store(i3, d, to + 3 * to_stride);
+  Store(i4, d, to + 4 * to_stride);
+  Store(i5, d, to + 5 * to_stride);
+  Store(i6, d, to + 6 * to_stride);
+  Store(i7, d, to + 7 * to_stride);
 }
 #elif HWY_TARGET != HWY_SCALAR
 JXL_INLINE void Transpose8x8Block(const float* JXL_RESTRICT from,
-                                  float* JXL_RESTRICT to) {
+                                  size_t from_stride, float* JXL_RESTRICT to,
+                                  size_t to_stride) {
   const HWY_CAPPED(float, 4) d;
   for (size_t n = 0; n < 8; n += 4) {
     for (size_t m = 0; m < 8; m += 4) {
-      auto p0 = Load(d, from + n * 8 + m);
-      auto p1 = Load(d, from + (n + 1) * 8 + m);
-      auto p2 = Load(d, from + (n + 2) * 8 + m);
-      auto p3 = Load(d, from + (n + 3) * 8 + m);
+      auto p0 = Load(d, from + n * from_stride + m);
+      auto p1 = Load(d, from + (n + 1) * from_stride + m);
+      auto p2 = Load(d, from + (n + 2) * from_stride + m);
+      auto p3 = Load(d, from + (n + 3) * from_stride + m);
       const auto q0 = InterleaveLower(d, p0, p2);
       const auto q1 = InterleaveLower(d, p1, p3);
       const auto q2 = InterleaveUpper(d, p0, p2);
@@ -90,24 +95,31 @@ JXL_INLINE void Transpose8x8Block(const float* JXL_RESTRICT from,
       const auto r1 = InterleaveUpper(d, q0, q1);
       const auto r2 = InterleaveLower(d, q2, q3);
       const auto r3 = InterleaveUpper(d, q2, q3);
-      Store(r0, d, to + m * 8 + n);
-      Store(r1, d, to + (1 + m) * 8 + n);
-      Store(r2, d, to + (2 + m) * 8 + n);
-      Store(r3, d, to + (3 + m) * 8 + n);
+      Store(r0, d, to + m * to_stride + n);
+      Store(r1, d, to + (1 + m) * to_stride + n);
+      Store(r2, d, to + (2 + m) * to_stride + n);
+      Store(r3, d, to + (3 + m) * to_stride + n);
     }
   }
 }
 #else
 static JXL_INLINE void Transpose8x8Block(const float* JXL_RESTRICT from,
-                                         float* JXL_RESTRICT to) {
+                                         size_t from_stride,
+                                         float* JXL_RESTRICT to,
+                                         size_t to_stride) {
   for (size_t n = 0; n < 8; ++n) {
     for (size_t m = 0; m < 8; ++m) {
-      to[8 * n + m] = from[8 * m + n];
+      to[to_stride * n + m] = from[from_stride * m + n];
     }
   }
 }
 #endif
 
+JXL_INLINE JXL_MAYBE_UNUSED void Transpose8x8Block(
+    const float* JXL_RESTRICT from, float* JXL_RESTRICT to) {
+  Transpose8x8Block(from, 8, to, 8);
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace
 }  // namespace HWY_NAMESPACE
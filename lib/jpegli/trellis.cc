@@ -0,0 +1,231 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "lib/jpegli/trellis.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "lib/base/bits.h"
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/common_internal.h"
+#include "lib/jpegli/encode_internal.h"
+#include "lib/jpegli/huffman.h"
+#include "lib/jpegli/memory_manager.h"
+#include "lib/jpegli/parallel.h"
+#include "lib/jpegli/quant.h"
+
+namespace jpegli {
+
+namespace {
+
+// Weight of one bit of the Huffman coding relative to a squared error of one
+// quantization step in the cost that is minimized.
+constexpr float kRateWeight = 0.12f;
+
+// Code length that is assumed for the symbols that do not occur in the
+// histogram of the deadzone quantized coefficients.
+constexpr int kUnusedSymbolBits = kJpegHuffmanMaxBitLength;
+
+int NumBits(int val) {
+  return val == 0 ? 0 : jxl::FloorLog2Nonzero<uint32_t>(std::abs(val)) + 1;
+}
+
+// Deadzone quantization of x, i.e. x is given in quantization steps, as done
+// by ReQuantizeBlock().
+int DeadzoneQuantize(float x, float threshold) {
+  return std::abs(x) >= threshold ? static_cast<int>(std::nearbyint(x)) : 0;
+}
+
+// Code lengths of the AC symbols of a component in bits.
+struct RateModel {
+  uint8_t bits[kJpegHuffmanAlphabetSize];
+};
+
+void AddBlockToHistogram(const int* block, int* ac_histo) {
+  int run = 0;
+  for (int k = 1; k < DCTSIZE2; ++k) {
+    if (block[k] == 0) {
+      ++run;
+      continue;
+    }
+    for (; run >= 16; run -= 16) {
+      ++ac_histo[0xf0];
+    }
+    ++ac_histo[(run << 4) | NumBits(block[k])];
+    run = 0;
+  }
+  if (run > 0) {
+    ++ac_histo[0];
+  }
+}
+
+void BuildRateModel(const int* ac_histo, RateModel* model) {
+  uint32_t counts[kJpegHuffmanAlphabetSize + 1];
+  uint8_t depths[kJpegHuffmanAlphabetSize + 1] = {0};
+  for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+    counts[i] = ac_histo[i];
+  }
+  counts[kJpegHuffmanAlphabetSize] = 1;
+  CreateHuffmanTree(counts, kJpegHuffmanAlphabetSize + 1,
+                    kJpegHuffmanMaxBitLength, depths);
+  for (size_t i = 0; i < kJpegHuffmanAlphabetSize; ++i) {
+    model->bits[i] = depths[i] > 0 ? depths[i] : kUnusedSymbolBits;
+  }
+}
+
+// Quantizes the block, whose coefficients are given in zig-zag order together
+// with their quantization multipliers qmc and deadzone thresholds. Only the
+// AC coefficients that the deadzone quantizer would keep are candidates for
+// nonzero levels, which are then chosen with dynamic programming over the
+// position of the last nonzero coefficient.
+void TrellisQuantizeBlock(const float* qmc, const float* thresholds,
+                          const RateModel& model, JCOEF* block) {
+  // Absolute value in quantization steps, squared error weight, and sum of
+  // the weighted squared errors of zero levels for the positions 1..k.
+  float absval[DCTSIZE2];
+  float weight[DCTSIZE2];
+  float zero_error_sum[DCTSIZE2];
+  // Minimal cost of the positions 1..k with a nonzero level at k, and the
+  // level and the previous nonzero position of the minimum.
+  float best_cost[DCTSIZE2];
+  int best_level[DCTSIZE2];
+  int best_prev[DCTSIZE2];
+  int candidates[DCTSIZE2];
+  int num_candidates = 0;
+  // The start of the block is the first "nonzero" position.
+  candidates[num_candidates++] = 0;
+  best_cost[0] = 0.0f;
+  zero_error_sum[0] = 0.0f;
+  const float zrl_cost = kRateWeight * model.bits[0xf0];
+  for (int k = 1; k < DCTSIZE2; ++k) {
+    const float x = block[k] * qmc[k];
+    // A larger deadzone means that the error is less visible.
+    absval[k] = std::abs(x);
+    weight[k] = 0.5f / std::max(0.5f, thresholds[k]);
+    zero_error_sum[k] =
+        zero_error_sum[k - 1] + weight[k] * absval[k] * absval[k];
+    if (absval[k] < std::max(0.5f, thresholds[k])) {
+      continue;
+    }
+    best_cost[k] = std::numeric_limits<float>::max();
+    const int floor_level = static_cast<int>(absval[k]);
+    for (int level = std::max(1, floor_level); level <= floor_level + 1;
+         ++level) {
+      const int nbits = NumBits(level);
+      const float diff = absval[k] - level;
+      const float level_cost = weight[k] * diff * diff +
+                               kRateWeight * nbits + zero_error_sum[k - 1];
+      for (int c = 0; c < num_candidates; ++c) {
+        const int prev = candidates[c];
+        const int run = k - prev - 1;
+        const float cost =
+            best_cost[prev] - zero_error_sum[prev] + level_cost +
+            (run >> 4) * zrl_cost +
+            kRateWeight * model.bits[((run & 15) << 4) | nbits];
+        if (cost < best_cost[k]) {
+          best_cost[k] = cost;
+          best_level[k] = level;
+          best_prev[k] = prev;
+        }
+      }
+    }
+    candidates[num_candidates++] = k;
+  }
+  // Choose the last nonzero position, which is followed by an end of block
+  // symbol unless it is the last coefficient.
+  const float eob_cost = kRateWeight * model.bits[0];
+  int last = 0;
+  float min_cost = std::numeric_limits<float>::max();
+  for (int c = 0; c < num_candidates; ++c) {
+    const int k = candidates[c];
+    const float cost = best_cost[k] + zero_error_sum[DCTSIZE2 - 1] -
+                       zero_error_sum[k] +
+                       (k < DCTSIZE2 - 1 ? eob_cost : 0.0f);
+    if (cost < min_cost) {
+      min_cost = cost;
+      last = k;
+    }
+  }
+  block[0] = DeadzoneQuantize(block[0] * qmc[0], thresholds[0]);
+  for (int k = DCTSIZE2 - 1; k > 0; --k) {
+    if (k != last) {
+      block[k] = 0;
+      continue;
+    }
+    block[k] = block[k] < 0 ? -best_level[k] : best_level[k];
+    last = best_prev[k];
+  }
+}
+
+}  // namespace
+
+void TrellisQuantizeCoeffs(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  InitQuantizer(cinfo, QuantPass::SEARCH_SECOND_PASS);
+  std::vector<RateModel> models(cinfo->num_components);
+  std::vector<JBLOCKROW> rows[kMaxComponents];
+  struct Task {
+    int c;
+    JDIMENSION by;
+  };
+  std::vector<Task> tasks;
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    const float* qmc = m->quant_mul[c];
+    const int h_factor = m->h_factor[c];
+    const int v_factor = m->v_factor[c];
+    const float* zero_bias_offset = m->zero_bias_offset[c];
+    const float* zero_bias_mul = m->zero_bias_mul[c];
+    int ac_histo[kJpegHuffmanAlphabetSize] = {};
+    int block[DCTSIZE2];
+    const JDIMENSION ysize_blocks = NumBufferedBlockRows(cinfo, c);
+    rows[c].resize(ysize_blocks);
+    for (JDIMENSION by = 0; by < ysize_blocks; ++by) {
+      rows[c][by] = GetBlockRow(cinfo, c, by)[0];
+      tasks.push_back({c, by});
+      const float* qf = m->quant_field.Row(by * v_factor);
+      for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+        const JCOEF* coeffs = rows[c][by][bx];
+        const float aq_strength = qf[bx * h_factor];
+        for (int k = 0; k < DCTSIZE2; ++k) {
+          const float threshold =
+              zero_bias_offset[k] + zero_bias_mul[k] * aq_strength;
+          block[k] = DeadzoneQuantize(coeffs[k] * qmc[k], threshold);
+        }
+        AddBlockToHistogram(block, ac_histo);
+      }
+    }
+    BuildRateModel(ac_histo, &models[c]);
+  }
+  const auto quantize_row = [&](uint32_t task, size_t /* thread */) {
+    const int c = tasks[task].c;
+    const JDIMENSION by = tasks[task].by;
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    const float* qmc = m->quant_mul[c];
+    const int h_factor = m->h_factor[c];
+    const float* zero_bias_offset = m->zero_bias_offset[c];
+    const float* zero_bias_mul = m->zero_bias_mul[c];
+    const float* qf = m->quant_field.Row(by * m->v_factor[c]);
+    float thresholds[DCTSIZE2];
+    for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+      const float aq_strength = qf[bx * h_factor];
+      for (int k = 0; k < DCTSIZE2; ++k) {
+        thresholds[k] = zero_bias_offset[k] + zero_bias_mul[k] * aq_strength;
+      }
+      TrellisQuantizeBlock(qmc, thresholds, models[c], rows[c][by][bx]);
+    }
+  };
+  RunParallel(cinfo, 0, static_cast<uint32_t>(tasks.size()), quantize_row);
+}
+
+}  // namespace jpegli
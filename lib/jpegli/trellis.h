@@ -0,0 +1,29 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+// Rate-distortion optimized quantization of the buffered coefficients, used
+// with jpegli_use_trellis_quantization().
+
+#ifndef LIB_JPEGLI_TRELLIS_H_
+#define LIB_JPEGLI_TRELLIS_H_
+
+#include "lib/jpegli/common.h"
+
+namespace jpegli {
+
+// Quantizes the buffered first pass coefficients, which must be in zig-zag
+// order, with the current quantization tables. The DC coefficients are
+// quantized as by the deadzone quantizer, the AC coefficients of each block
+// with the levels that minimize the squared error, measured in quantization
+// steps and weighted by the adaptive quantization, plus the number of bits of
+// their Huffman coding. The code lengths are estimated from the histograms
+// of the deadzone quantized coefficients of each component. The blocks are
+// quantized in parallel if there is a parallel runner.
+void TrellisQuantizeCoeffs(j_compress_ptr cinfo);
+
+}  // namespace jpegli
+
+#endif  // LIB_JPEGLI_TRELLIS_H_
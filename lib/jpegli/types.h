@@ -7,6 +7,8 @@
 #ifndef LIB_JPEGLI_TYPES_H_
 #define LIB_JPEGLI_TYPES_H_
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -22,6 +24,8 @@ typedef enum {
   JPEGLI_TYPE_FLOAT = 0,
   JPEGLI_TYPE_UINT8 = 2,
   JPEGLI_TYPE_UINT16 = 3,
+  // IEEE 754 half precision floats, supported only as decoder output.
+  JPEGLI_TYPE_FLOAT16 = 5,
 } JpegliDataType;
 
 typedef enum {
@@ -30,6 +34,356 @@ typedef enum {
   JPEGLI_BIG_ENDIAN = 2,
 } JpegliEndianness;
 
+typedef enum {
+  JPEGLI_AQ_FULL = 0,
+  JPEGLI_AQ_FAST = 1,
+} JpegliAQMode;
+
+// Speed tiers of jpegli_set_decode_speed().
+typedef enum {
+  // Float inverse DCT with dequantization biases, fancy upsampling and block
+  // smoothing.
+  JPEGLI_DECODE_DEFAULT = 0,
+  // Fixed point inverse DCT without dequantization biases, no fancy
+  // upsampling and no block smoothing.
+  JPEGLI_DECODE_FAST = 1,
+} JpegliDecodeSpeed;
+
+typedef enum {
+  JPEGLI_DOWNSAMPLE_BOX = 0,
+  JPEGLI_DOWNSAMPLE_SHARP = 1,
+} JpegliDownsampleMode;
+
+typedef enum {
+  // One plane per component, e.g. I420 for 4:2:0 YCbCr.
+  JPEGLI_PLANES_SEPARATE = 0,
+  // A plane of the first component followed by one plane with the
+  // interleaved samples of the second and third components, e.g. NV12.
+  JPEGLI_PLANES_NV12 = 1,
+} JpegliPlaneLayout;
+
+// Resampling filters of jpegli_set_output_size().
+typedef enum {
+  JPEGLI_FILTER_BOX = 0,
+  JPEGLI_FILTER_TRIANGLE = 1,
+  JPEGLI_FILTER_LANCZOS3 = 2,
+} JpegliResizeFilter;
+
+// Result of jpegli_encode_step() and jpegli_decode_step().
+typedef enum {
+  // The image is done.
+  JPEGLI_STEP_DONE = 0,
+  // The source suspended, or not all the scanlines of the image were written.
+  JPEGLI_STEP_NEED_INPUT = 1,
+  // The destination suspended.
+  JPEGLI_STEP_NEED_OUTPUT = 2,
+  // The work budget of the step was used up.
+  JPEGLI_STEP_YIELD = 3,
+} JpegliStepStatus;
+
+// Resource limits of the decompressor, see jpegli_set_decode_limits().
+typedef enum {
+  JPEGLI_LIMIT_NONE = 0,
+  // Number of pixels of the image.
+  JPEGLI_LIMIT_PIXELS = 1,
+  // Number of scans of the image.
+  JPEGLI_LIMIT_SCANS = 2,
+  // Total payload size of the saved markers.
+  JPEGLI_LIMIT_MARKER_BYTES = 3,
+  // Size of the coefficient buffers.
+  JPEGLI_LIMIT_COEFF_MEMORY = 4,
+} JpegliDecodeLimit;
+
+// Stages of the image processing whose time is reported by
+// jpegli_get_stage_stats().
+typedef enum {
+  // Compressor stages.
+  // Conversion of the input rows to float, fused with the color transform if
+  // the input format allows it.
+  JPEGLI_STAGE_READ_INPUT = 0,
+  JPEGLI_STAGE_COLOR_TRANSFORM = 1,
+  // Input smoothing and chroma downsampling.
+  JPEGLI_STAGE_DOWNSAMPLE = 2,
+  JPEGLI_STAGE_ADAPTIVE_QUANTIZATION = 3,
+  // DCT and quantization of the iMCU rows, including their tokenization or
+  // Huffman coding when that is done while the input is read.
+  JPEGLI_STAGE_DCT = 4,
+  JPEGLI_STAGE_TOKENIZE = 5,
+  JPEGLI_STAGE_OPTIMIZE_HUFFMAN = 6,
+  JPEGLI_STAGE_WRITE_SCANS = 7,
+  // Decompressor stages.
+  JPEGLI_STAGE_PROCESS_MARKERS = 8,
+  // Entropy decoding of the scans.
+  JPEGLI_STAGE_PROCESS_SCAN = 9,
+  // Dequantization and IDCT.
+  JPEGLI_STAGE_IDCT = 10,
+  JPEGLI_STAGE_UPSAMPLE = 11,
+  // Color conversion and writing of the output rows.
+  JPEGLI_STAGE_WRITE_OUTPUT = 12,
+  // The IDCT, upsampling and output of the output passes that are rendered in
+  // parallel, which are not counted separately.
+  JPEGLI_STAGE_PARALLEL_RENDER = 13,
+  JPEGLI_NUM_STAGES = 14,
+} JpegliStage;
+
+// A contiguous part of the compressed output, see jpegli_chunked_dest().
+typedef struct {
+  unsigned char* data;
+  size_t size;
+} JpegliOutputChunk;
+
+// An input image of jpegli_encode_batch(), with rows of input_components
+// interleaved samples in the input format of the compressor.
+typedef struct {
+  const void* pixels;
+  // Distance between the starts of two rows, in bytes.
+  size_t stride;
+  unsigned int width;
+  unsigned int height;
+} JpegliImageDesc;
+
+// A compressed image of jpegli_encode_batch(), allocated with malloc().
+typedef struct {
+  unsigned char* data;
+  size_t size;
+} JpegliBatchOutput;
+
+// An output of jpegli_encode_ladder(): the Butteraugli distance, and the
+// sampling factors of the first component, with the other components at 1x1.
+// If h_samp_factor is 0, the sampling factors of the compressor are kept.
+typedef struct {
+  float distance;
+  int h_samp_factor;
+  int v_samp_factor;
+} JpegliLadderRung;
+
+// A set of Huffman tables of jpegli_set_huffman_presets() for images whose
+// quantization tables correspond to a Butteraugli distance of at most
+// max_distance and whose first component has the given sampling factors, with
+// the other components at 1x1. If h_samp_factor is 0, the preset is used for
+// any sampling factors. The tables with index 0 code the first component and
+// those with index 1 the other components, in the layout of JHUFF_TBL: the
+// number of codes of each length 1..16 in bits[1..16], followed by the
+// symbols in order of increasing code length in huffval.
+typedef struct {
+  float max_distance;
+  int h_samp_factor;
+  int v_samp_factor;
+  unsigned char dc_bits[2][17];
+  unsigned char dc_huffval[2][256];
+  unsigned char ac_bits[2][17];
+  unsigned char ac_huffval[2][256];
+} JpegliHuffmanPreset;
+
+// An image of jpegli_decode_batch(): the compressed input, the buffer that it
+// is decoded into, and the output dimensions that are filled in by the
+// decoder.
+typedef struct {
+  const unsigned char* data;
+  size_t size;
+  void* pixels;
+  // Distance between the starts of two rows, in bytes.
+  size_t stride;
+  // Size of the pixels buffer, in bytes.
+  size_t pixels_size;
+  unsigned int output_width;
+  unsigned int output_height;
+  int output_components;
+} JpegliBatchImage;
+
+// Image properties found by jpegli_probe().
+typedef struct {
+  unsigned int image_width;
+  unsigned int image_height;
+  int num_components;
+  int data_precision;
+  // Sampling factors of the first num_components components (at most 4).
+  int h_samp_factor[4];
+  int v_samp_factor[4];
+  int progressive_mode;
+  // Offset and size in bytes of the first APP1 Exif marker segment, including
+  // the marker, or 0 if there is none.
+  size_t exif_offset;
+  size_t exif_size;
+  // Offset of the first APP2 ICC profile marker segment, and the number of
+  // those segments, or 0 if there is none.
+  size_t icc_offset;
+  int num_icc_markers;
+} JpegliImageInfo;
+
+// Layout of the coefficients exported by jpegli_export_coefficients().
+typedef struct {
+  unsigned int image_width;
+  unsigned int image_height;
+  int num_components;
+  int max_h_samp_factor;
+  int max_v_samp_factor;
+  // Nonzero if the 64 coefficients of each block and the quantization tables
+  // are in zigzag order instead of the natural order.
+  int zigzag;
+  // Per component (at most 4): the sampling factors, the size in blocks and the
+  // index of its first coefficient in the exported array, where block (by, bx)
+  // of the component starts at offset + (by * width_in_blocks + bx) * 64.
+  int h_samp_factor[4];
+  int v_samp_factor[4];
+  unsigned int width_in_blocks[4];
+  unsigned int height_in_blocks[4];
+  size_t offset[4];
+  // Quantization table of each component, zero if it is not defined.
+  unsigned short quant_table[4][64];
+  // Total number of exported coefficients.
+  size_t num_coeffs;
+} JpegliCoefficientLayout;
+
+// Quality estimate of a JPEG image, see jpegli_estimate_source_quality().
+typedef struct {
+  // Distance whose jpegli quantization tables are closest to those of the
+  // image, exact for images encoded by jpegli and an estimate otherwise.
+  float distance;
+  // libjpeg quality whose luminance table is closest to that of the image.
+  int libjpeg_quality;
+  // Compressed size of the image in bits per pixel, or 0 if the whole image
+  // is not in the input buffer of an in-memory source.
+  float bits_per_pixel;
+} JpegliSourceQuality;
+
+// Work done by the decompressor on the current image, see
+// jpegli_get_decode_work().
+typedef struct {
+  // Number of SOS markers processed.
+  size_t num_scans;
+  // Number of MCUs that were entropy decoded, including the ones that were
+  // decoded again because the source suspended within them. The MCUs decoded
+  // by jpegli_set_progressive_band_rows() are not counted.
+  size_t num_mcus;
+  // Number of bytes copied into or within the internal buffer that holds the
+  // input while a marker segment or an MCU spans several source buffers.
+  size_t buffered_bytes;
+  // Number of memory allocations of the decompressor.
+  size_t num_allocations;
+} JpegliDecodeWork;
+
+// Perceptual hashes of an image, see jpegli_compute_fingerprint(). Similar
+// images, e.g. recompressions or rescalings of the same image, have hashes
+// with a small Hamming distance, see jpegli_fingerprint_distance().
+typedef struct {
+  // Signs of the 8x8 lowest frequencies of the image relative to their median.
+  unsigned char hash64[8];
+  // Signs of the 16x16 lowest frequencies of the image relative to their
+  // median, which also tell apart images that differ in smaller details.
+  unsigned char hash256[32];
+} JpegliFingerprint;
+
+// Transforms the samples of an output row in place, see
+// jpegli_set_output_row_transform(). rows[c] points to the xsize samples of
+// output channel c, nominally in the [0.0, 1.0] range. Calls with different
+// thread values may run concurrently, and thread is less than
+// JPEGLI_MAX_ROW_TRANSFORM_THREADS.
+typedef void (*JpegliRowTransform)(void* opaque, size_t thread, float* rows[],
+                                   size_t num_channels, size_t xsize);
+
+enum { JPEGLI_MAX_ROW_TRANSFORM_THREADS = 16 };
+
+// Number of bytes past the last pixel of each row that may be read or
+// overwritten if the rows are declared padded with
+// jpegli_set_input_row_padding() or jpegli_set_output_row_padding().
+enum { JPEGLI_ROW_PADDING = 256 };
+
+// HDR to SDR tone mapping of the encoder input, see
+// jpegli_set_input_tone_mapping().
+typedef struct {
+  // CICP transfer function code of the input, 16 (PQ) or 18 (HLG).
+  int transfer_function;
+  // Peak luminance of the input in nits, used only for PQ input.
+  float source_peak;
+  // Peak luminance of the SDR output in nits, which is mapped to the maximum
+  // sample value.
+  float target_peak;
+  // Luminances of the red, green and blue primaries of the input, i.e. the Y
+  // row of the RGB to XYZ matrix, which sum to 1.
+  float primaries_luminances[3];
+} JpegliToneMapping;
+
+// Lossless transforms of jpegli_transcode(). The value of each transform is
+// one less than the Exif orientation that it normalizes.
+typedef enum {
+  JPEGLI_TRANSFORM_NONE = 0,
+  // Mirrors the image horizontally.
+  JPEGLI_TRANSFORM_FLIP_H = 1,
+  JPEGLI_TRANSFORM_ROT_180 = 2,
+  // Mirrors the image vertically.
+  JPEGLI_TRANSFORM_FLIP_V = 3,
+  // Mirrors the image across the top left to bottom right diagonal.
+  JPEGLI_TRANSFORM_TRANSPOSE = 4,
+  // Clockwise rotations.
+  JPEGLI_TRANSFORM_ROT_90 = 5,
+  // Mirrors the image across the top right to bottom left diagonal.
+  JPEGLI_TRANSFORM_TRANSVERSE = 6,
+  JPEGLI_TRANSFORM_ROT_270 = 7,
+} JpegliTransform;
+
+// Options of jpegli_transcode().
+typedef struct {
+  // Progressive level of the output as in jpegli_set_progressive_level(), or
+  // -1 to write a sequential output for a sequential input and a progressive
+  // output with the default level 2 otherwise.
+  int progressive_level;
+  // If nonzero, the Huffman codes are optimized for the image.
+  int optimize_coding;
+  // If nonzero, the APPn markers of the input are copied to the output,
+  // otherwise they are stripped. The Exif orientation of a transformed image is
+  // reset to 1.
+  int copy_markers;
+  // Transform of the image. The mirrored edges of the image are trimmed to the
+  // iMCU boundaries first, since the partial iMCUs can not be moved losslessly.
+  JpegliTransform transform;
+  // Region of the transformed image that is kept, in pixels. The top left
+  // corner is moved up and left to the nearest iMCU boundary of the output. A
+  // crop_width or crop_height of 0 keeps the rest of the image.
+  unsigned int crop_x;
+  unsigned int crop_y;
+  unsigned int crop_width;
+  unsigned int crop_height;
+} JpegliTranscodeOptions;
+
+// Options of jpegli_transcode_scaled().
+typedef struct {
+  // Denominator of the scale of the output image, one of 2, 4 or 8.
+  int scale_denom;
+  // Quality of the output as in jpegli_set_quality(), or 0 to keep the
+  // default quality.
+  int quality;
+  // Progressive level of the output as in jpegli_set_progressive_level(), or
+  // -1 to use level 2 for progressive and level 0 for sequential inputs.
+  int progressive_level;
+  // If nonzero, the APPn markers of the input are copied to the output.
+  int copy_markers;
+} JpegliScaledTranscodeOptions;
+
+// Options of jpegli_recompress().
+typedef struct {
+  // Size of the output image in pixels, or zero to keep the size of the input.
+  unsigned int width;
+  unsigned int height;
+  // Resampling filter of a resized image, as in jpegli_set_output_size().
+  JpegliResizeFilter filter;
+  // Quality of the output as in jpegli_set_quality(), or 0 to keep the
+  // default quality.
+  int quality;
+  // Progressive level of the output as in jpegli_set_progressive_level(), or
+  // -1 to use level 2 for progressive and level 0 for sequential inputs.
+  int progressive_level;
+  // If nonzero, the APPn markers of the input are copied to the output.
+  int copy_markers;
+  // Number of rows that are passed from the decoder to the encoder at a time,
+  // which is the height of the only buffer between them, or 0 for 16 rows.
+  unsigned int strip_height;
+} JpegliRecompressOptions;
+
+// Immutable set of quantization and Huffman tables of the decoder, see
+// jpegli_save_decompress_tables().
+typedef struct JpegliDecompressTables JpegliDecompressTables;
+
 int jpegli_bytes_per_sample(JpegliDataType data_type);
 
 #ifdef __cplusplus
@@ -9,6 +9,7 @@
 #include <string.h>
 
 #include "lib/base/compiler_specific.h"
+#include "lib/jpegli/decode_internal.h"
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jpegli/upsample.cc"
@@ -22,6 +23,9 @@ namespace HWY_NAMESPACE {
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::StoreInterleaved2;
+using hwy::HWY_NAMESPACE::StoreInterleaved3;
+using hwy::HWY_NAMESPACE::StoreInterleaved4;
 using hwy::HWY_NAMESPACE::Vec;
 
 #if HWY_CAP_GE512
@@ -75,22 +79,79 @@ void StoreInterleaved(const DF df, V v0, V v1, T* mem) {
 #endif
 }
 
+// Upsamples the len_in values of the aligned row_in, which must have room for
+// one more value on both sides, to row_out.
+void Upsample2HorizontalFrom(float* JXL_RESTRICT row_in, size_t len_in,
+                             float* JXL_RESTRICT row_out) {
+  HWY_FULL(float) df;
+  auto threefour = Set(df, 0.75f);
+  auto onefour = Set(df, 0.25f);
+  row_in[-1] = row_in[0];
+  row_in[len_in] = row_in[len_in - 1];
+  for (size_t x = 0; x < len_in; x += Lanes(df)) {
+    auto current = Mul(Load(df, row_in + x), threefour);
+    auto prev = LoadU(df, row_in + x - 1);
+    auto next = LoadU(df, row_in + x + 1);
+    auto left = MulAdd(onefour, prev, current);
+    auto right = MulAdd(onefour, next, current);
+    StoreInterleaved(df, left, right, row_out + x * 2);
+  }
+}
+
 void Upsample2Horizontal(float* JXL_RESTRICT row,
                          float* JXL_RESTRICT scratch_space, size_t len_out) {
+  const size_t len_in = (len_out + 1) >> 1;
+  memcpy(scratch_space, row, len_in * sizeof(row[0]));
+  Upsample2HorizontalFrom(scratch_space, len_in, row);
+}
+
+void Upsample2x2(const float* JXL_RESTRICT row_top,
+                 const float* JXL_RESTRICT row_mid,
+                 const float* JXL_RESTRICT row_bot,
+                 float* JXL_RESTRICT scratch_space,
+                 float* JXL_RESTRICT row_out0, float* JXL_RESTRICT row_out1,
+                 size_t len_out) {
   HWY_FULL(float) df;
   auto threefour = Set(df, 0.75f);
   auto onefour = Set(df, 0.25f);
   const size_t len_in = (len_out + 1) >> 1;
+  // The vertically upsampled rows are computed into the scratch space, which
+  // is then the input of the horizontal upsampling.
+  const float* JXL_RESTRICT rows_outer[2] = {row_top, row_bot};
+  float* JXL_RESTRICT rows_out[2] = {row_out0, row_out1};
+  for (size_t i = 0; i < 2; ++i) {
+    const float* JXL_RESTRICT row_outer = rows_outer[i];
+    for (size_t x = 0; x < len_in; x += Lanes(df)) {
+      auto im_scaled = Mul(Load(df, row_mid + x), threefour);
+      auto io = Load(df, row_outer + x);
+      Store(MulAdd(io, onefour, im_scaled), df, scratch_space + x);
+    }
+    Upsample2HorizontalFrom(scratch_space, len_in, rows_out[i]);
+  }
+}
+
+void UpsampleHorizontalNoFilter(float* JXL_RESTRICT row,
+                                float* JXL_RESTRICT scratch_space,
+                                size_t len_out, size_t factor) {
+  HWY_FULL(float) df;
+  const size_t len_in = (len_out + factor - 1) / factor;
   memcpy(scratch_space, row, len_in * sizeof(row[0]));
-  scratch_space[-1] = scratch_space[0];
-  scratch_space[len_in] = scratch_space[len_in - 1];
-  for (size_t x = 0; x < len_in; x += Lanes(df)) {
-    auto current = Mul(Load(df, scratch_space + x), threefour);
-    auto prev = LoadU(df, scratch_space + x - 1);
-    auto next = LoadU(df, scratch_space + x + 1);
-    auto left = MulAdd(onefour, prev, current);
-    auto right = MulAdd(onefour, next, current);
-    StoreInterleaved(df, left, right, row + x * 2);
+  size_t x = 0;
+  if (factor >= 2 && factor <= 4) {
+    // The vectors are stored only as long as they fit in the output row.
+    for (; (x + Lanes(df)) * factor <= len_out; x += Lanes(df)) {
+      auto v = Load(df, scratch_space + x);
+      if (factor == 2) {
+        StoreInterleaved2(v, v, df, row + x * factor);
+      } else if (factor == 3) {
+        StoreInterleaved3(v, v, v, df, row + x * factor);
+      } else {
+        StoreInterleaved4(v, v, v, v, df, row + x * factor);
+      }
+    }
+  }
+  for (size_t xo = x * factor; xo < len_out; ++xo) {
+    row[xo] = scratch_space[xo / factor];
   }
 }
 
@@ -122,6 +183,8 @@ namespace jpegli {
 
 HWY_EXPORT(Upsample2Horizontal);
 HWY_EXPORT(Upsample2Vertical);
+HWY_EXPORT(Upsample2x2);
+HWY_EXPORT(UpsampleHorizontalNoFilter);
 
 void Upsample2Horizontal(float* JXL_RESTRICT row,
                          float* JXL_RESTRICT scratch_space, size_t len_out) {
@@ -136,5 +199,32 @@ void Upsample2Vertical(const float* JXL_RESTRICT row_top,
   HWY_DYNAMIC_DISPATCH(Upsample2Vertical)
   (row_top, row_mid, row_bot, row_out0, row_out1, len);
 }
+
+void Upsample2x2(const float* JXL_RESTRICT row_top,
+                 const float* JXL_RESTRICT row_mid,
+                 const float* JXL_RESTRICT row_bot,
+                 float* JXL_RESTRICT scratch_space,
+                 float* JXL_RESTRICT row_out0, float* JXL_RESTRICT row_out1,
+                 size_t len_out) {
+  HWY_DYNAMIC_DISPATCH(Upsample2x2)
+  (row_top, row_mid, row_bot, scratch_space, row_out0, row_out1, len_out);
+}
+
+void UpsampleHorizontalNoFilter(float* JXL_RESTRICT row,
+                                float* JXL_RESTRICT scratch_space,
+                                size_t len_out, size_t factor) {
+  HWY_DYNAMIC_DISPATCH(UpsampleHorizontalNoFilter)
+  (row, scratch_space, len_out, factor);
+}
+
+void ChooseUpsampleKernels(j_decompress_ptr cinfo) {
+  jpeg_decomp_master* m = cinfo->master;
+  m->upsample2_horizontal = HWY_DYNAMIC_DISPATCH(Upsample2Horizontal);
+  m->upsample2_vertical = HWY_DYNAMIC_DISPATCH(Upsample2Vertical);
+  m->upsample2x2 = HWY_DYNAMIC_DISPATCH(Upsample2x2);
+  m->upsample_horizontal_no_filter =
+      HWY_DYNAMIC_DISPATCH(UpsampleHorizontalNoFilter);
+}
+
 }  // namespace jpegli
 #endif  // HWY_ONCE
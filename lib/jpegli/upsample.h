@@ -10,6 +10,7 @@
 #include <stddef.h>
 
 #include "lib/base/compiler_specific.h"
+#include "lib/jpegli/common.h"
 
 namespace jpegli {
 
@@ -22,6 +23,27 @@ void Upsample2Vertical(const float* JXL_RESTRICT row_top,
                        float* JXL_RESTRICT row_out0,
                        float* JXL_RESTRICT row_out1, size_t len);
 
+// Same as Upsample2Vertical() followed by Upsample2Horizontal() on both output
+// rows, but the vertically upsampled rows are only stored in scratch_space.
+// The input rows have (len_out + 1) / 2 values, and scratch_space must have
+// room for one more value on both sides.
+void Upsample2x2(const float* JXL_RESTRICT row_top,
+                 const float* JXL_RESTRICT row_mid,
+                 const float* JXL_RESTRICT row_bot,
+                 float* JXL_RESTRICT scratch_space,
+                 float* JXL_RESTRICT row_out0, float* JXL_RESTRICT row_out1,
+                 size_t len_out);
+
+// Upsamples the first ceil(len_out / factor) values of row in place to len_out
+// values by repeating each of them factor times.
+void UpsampleHorizontalNoFilter(float* JXL_RESTRICT row,
+                                float* JXL_RESTRICT scratch_space,
+                                size_t len_out, size_t factor);
+
+// Sets the upsampling kernels of the decoder master to the implementations for
+// the best target of the CPU.
+void ChooseUpsampleKernels(j_decompress_ptr cinfo);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_UPSAMPLE_H_
@@ -137,6 +137,8 @@ libjxl_extras_sources = [
     "extras/mmap.cc",
     "extras/mmap.h",
     "extras/packed_image.h",
+    "extras/recycling_memory_manager.cc",
+    "extras/recycling_memory_manager.h",
     "extras/simd_util.cc",
     "extras/simd_util.h",
     "extras/size_constraints.h",
@@ -146,6 +148,10 @@ libjxl_extras_sources = [
     "extras/xyb_transform.h",
 ]
 
+libjxl_jpegli_gbench_sources = [
+    "jpegli/kernels_gbench.cc",
+]
+
 libjxl_jpegli_lib_version = 62
 
 libjxl_jpegli_libjpeg_helper_files = [
@@ -156,6 +162,7 @@ libjxl_jpegli_libjpeg_helper_files = [
 libjxl_jpegli_sources = [
     "jpegli/adaptive_quantization.cc",
     "jpegli/adaptive_quantization.h",
+    "jpegli/bit_reader.h",
     "jpegli/bit_writer.cc",
     "jpegli/bit_writer.h",
     "jpegli/bitstream.cc",
@@ -167,9 +174,14 @@ libjxl_jpegli_sources = [
     "jpegli/common.cc",
     "jpegli/common.h",
     "jpegli/common_internal.h",
+    "jpegli/context.cc",
+    "jpegli/context.h",
     "jpegli/dct-inl.h",
     "jpegli/decode.cc",
+    "jpegli/decode_batch.cc",
     "jpegli/decode.h",
+    "jpegli/decode_arith.cc",
+    "jpegli/decode_arith.h",
     "jpegli/decode_internal.h",
     "jpegli/decode_marker.cc",
     "jpegli/decode_marker.h",
@@ -179,17 +191,21 @@ libjxl_jpegli_sources = [
     "jpegli/downsample.cc",
     "jpegli/downsample.h",
     "jpegli/encode.cc",
+    "jpegli/encode_batch.cc",
     "jpegli/encode.h",
     "jpegli/encode_finish.cc",
     "jpegli/encode_finish.h",
     "jpegli/encode_internal.h",
     "jpegli/encode_streaming.cc",
     "jpegli/encode_streaming.h",
+    "jpegli/encode_tiles.cc",
     "jpegli/entropy_coding-inl.h",
     "jpegli/entropy_coding.cc",
     "jpegli/entropy_coding.h",
     "jpegli/error.cc",
     "jpegli/error.h",
+    "jpegli/fingerprint.cc",
+    "jpegli/fingerprint.h",
     "jpegli/huffman.cc",
     "jpegli/huffman.h",
     "jpegli/idct.cc",
@@ -198,14 +214,26 @@ libjxl_jpegli_sources = [
     "jpegli/input.h",
     "jpegli/memory_manager.cc",
     "jpegli/memory_manager.h",
+    "jpegli/packed_tokens.cc",
+    "jpegli/packed_tokens.h",
+    "jpegli/parallel.h",
     "jpegli/quant.cc",
     "jpegli/quant.h",
     "jpegli/render.cc",
     "jpegli/render.h",
+    "jpegli/resize.cc",
+    "jpegli/resize.h",
+    "jpegli/scan_optimizer.cc",
+    "jpegli/scan_optimizer.h",
     "jpegli/simd.cc",
     "jpegli/simd.h",
     "jpegli/source_manager.cc",
+    "jpegli/stage_stats.cc",
+    "jpegli/stage_stats.h",
+    "jpegli/transcode.cc",
     "jpegli/transpose-inl.h",
+    "jpegli/trellis.cc",
+    "jpegli/trellis.h",
     "jpegli/types.h",
     "jpegli/upsample.cc",
     "jpegli/upsample.h",
@@ -257,6 +285,7 @@ libjxl_tests = [
     "extras/codec_test.cc",
     "extras/dec/color_description_test.cc",
     "extras/jpegli_test.cc",
+    "extras/recycling_memory_manager_test.cc",
     "threads/thread_parallel_runner_test.cc",
 ]
 
@@ -134,6 +134,8 @@ set(JPEGXL_INTERNAL_EXTRAS_SOURCES
   extras/mmap.cc
   extras/mmap.h
   extras/packed_image.h
+  extras/recycling_memory_manager.cc
+  extras/recycling_memory_manager.h
   extras/simd_util.cc
   extras/simd_util.h
   extras/size_constraints.h
@@ -143,6 +145,10 @@ set(JPEGXL_INTERNAL_EXTRAS_SOURCES
   extras/xyb_transform.h
 )
 
+set(JPEGXL_INTERNAL_JPEGLI_GBENCH_SOURCES
+  jpegli/kernels_gbench.cc
+)
+
 set(JPEGXL_INTERNAL_JPEGLI_LIBJPEG_HELPER_FILES
   jpegli/libjpeg_test_util.cc
   jpegli/libjpeg_test_util.h
@@ -151,6 +157,7 @@ set(JPEGXL_INTERNAL_JPEGLI_LIBJPEG_HELPER_FILES
 set(JPEGXL_INTERNAL_JPEGLI_SOURCES
   jpegli/adaptive_quantization.cc
   jpegli/adaptive_quantization.h
+  jpegli/bit_reader.h
   jpegli/bit_writer.cc
   jpegli/bit_writer.h
   jpegli/bitstream.cc
@@ -162,9 +169,14 @@ set(JPEGXL_INTERNAL_JPEGLI_SOURCES
   jpegli/common.cc
   jpegli/common.h
   jpegli/common_internal.h
+  jpegli/context.cc
+  jpegli/context.h
   jpegli/dct-inl.h
   jpegli/decode.cc
+  jpegli/decode_batch.cc
   jpegli/decode.h
+  jpegli/decode_arith.cc
+  jpegli/decode_arith.h
   jpegli/decode_internal.h
   jpegli/decode_marker.cc
   jpegli/decode_marker.h
@@ -174,17 +186,21 @@ set(JPEGXL_INTERNAL_JPEGLI_SOURCES
   jpegli/downsample.cc
   jpegli/downsample.h
   jpegli/encode.cc
+  jpegli/encode_batch.cc
   jpegli/encode.h
   jpegli/encode_finish.cc
   jpegli/encode_finish.h
   jpegli/encode_internal.h
   jpegli/encode_streaming.cc
   jpegli/encode_streaming.h
+  jpegli/encode_tiles.cc
   jpegli/entropy_coding-inl.h
   jpegli/entropy_coding.cc
   jpegli/entropy_coding.h
   jpegli/error.cc
   jpegli/error.h
+  jpegli/fingerprint.cc
+  jpegli/fingerprint.h
   jpegli/huffman.cc
   jpegli/huffman.h
   jpegli/idct.cc
@@ -193,14 +209,26 @@ set(JPEGXL_INTERNAL_JPEGLI_SOURCES
   jpegli/input.h
   jpegli/memory_manager.cc
   jpegli/memory_manager.h
+  jpegli/packed_tokens.cc
+  jpegli/packed_tokens.h
+  jpegli/parallel.h
   jpegli/quant.cc
   jpegli/quant.h
   jpegli/render.cc
   jpegli/render.h
+  jpegli/resize.cc
+  jpegli/resize.h
+  jpegli/scan_optimizer.cc
+  jpegli/scan_optimizer.h
   jpegli/simd.cc
   jpegli/simd.h
   jpegli/source_manager.cc
+  jpegli/stage_stats.cc
+  jpegli/stage_stats.h
+  jpegli/transcode.cc
   jpegli/transpose-inl.h
+  jpegli/trellis.cc
+  jpegli/trellis.h
   jpegli/types.h
   jpegli/upsample.cc
   jpegli/upsample.h
@@ -246,6 +274,7 @@ set(JPEGXL_INTERNAL_TESTS
   extras/codec_test.cc
   extras/dec/color_description_test.cc
   extras/jpegli_test.cc
+  extras/recycling_memory_manager_test.cc
   threads/thread_parallel_runner_test.cc
 )
 
@@ -8,9 +8,17 @@
 
 #include <string.h>
 
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
 
 #include "lib/base/memory_manager.h"
 #include "lib/base/parallel_runner.h"
@@ -64,6 +72,52 @@ void ThreadMemoryManagerFree(const JxlMemoryManager* memory_manager,
   memory_manager->free(memory_manager->opaque, address);
 }
 
+void* CreateRunner(const JxlMemoryManager* memory_manager,
+                   size_t num_worker_threads, const std::vector<size_t>& cpus) {
+  JxlMemoryManager local_memory_manager;
+  if (!ThreadMemoryManagerInit(&local_memory_manager, memory_manager))
+    return nullptr;
+
+  void* alloc = ThreadMemoryManagerAlloc(&local_memory_manager,
+                                         sizeof(jpegxl::ThreadParallelRunner));
+  if (!alloc) return nullptr;
+  // Placement new constructor on allocated memory
+  jpegxl::ThreadParallelRunner* runner =
+      new (alloc) jpegxl::ThreadParallelRunner(num_worker_threads, cpus);
+  runner->memory_manager = local_memory_manager;
+
+  return runner;
+}
+
+#if defined(__linux__)
+// Returns the number of CPUs that the CPU quota of the cgroup of the process
+// corresponds to, rounded up, or 0 if there is no quota. Containers typically
+// get a quota that is much smaller than the number of CPUs of the host.
+size_t CgroupCpuQuota() {
+  double quota = -1;
+  double period = 0;
+  // cgroup v2: "<quota> <period>", where the quota may be "max".
+  if (FILE* f = fopen("/sys/fs/cgroup/cpu.max", "r")) {
+    char quota_str[32];
+    if (fscanf(f, "%31s %lf", quota_str, &period) == 2 &&
+        strcmp(quota_str, "max") != 0) {
+      quota = strtod(quota_str, nullptr);
+    }
+    fclose(f);
+  } else if (FILE* fq = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) {
+    // cgroup v1: a quota of -1 means none.
+    if (fscanf(fq, "%lf", &quota) != 1) quota = -1;
+    fclose(fq);
+    if (FILE* fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) {
+      if (fscanf(fp, "%lf", &period) != 1) period = 0;
+      fclose(fp);
+    }
+  }
+  if (quota <= 0 || period <= 0) return 0;
+  return static_cast<size_t>(std::ceil(quota / period));
+}
+#endif
+
 }  // namespace
 
 JxlParallelRetCode JxlThreadParallelRunner(
@@ -73,24 +127,20 @@ JxlParallelRetCode JxlThreadParallelRunner(
       runner_opaque, jpegxl_opaque, init, func, start_range, end_range);
 }
 
-/// Starts the given number of worker threads and blocks until they are ready.
+/// Starts the given number of worker threads.
 /// "num_worker_threads" defaults to one per hyperthread. If zero, all tasks
 /// run on the main thread.
 void* JxlThreadParallelRunnerCreate(const JxlMemoryManager* memory_manager,
                                     size_t num_worker_threads) {
-  JxlMemoryManager local_memory_manager;
-  if (!ThreadMemoryManagerInit(&local_memory_manager, memory_manager))
-    return nullptr;
-
-  void* alloc = ThreadMemoryManagerAlloc(&local_memory_manager,
-                                         sizeof(jpegxl::ThreadParallelRunner));
-  if (!alloc) return nullptr;
-  // Placement new constructor on allocated memory
-  jpegxl::ThreadParallelRunner* runner =
-      new (alloc) jpegxl::ThreadParallelRunner(num_worker_threads);
-  runner->memory_manager = local_memory_manager;
+  return CreateRunner(memory_manager, num_worker_threads, {});
+}
 
-  return runner;
+void* JxlThreadParallelRunnerCreateWithAffinity(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads,
+    const size_t* cpus, size_t num_cpus) {
+  if (num_cpus != 0 && cpus == nullptr) return nullptr;
+  return CreateRunner(memory_manager, num_worker_threads,
+                      std::vector<size_t>(cpus, cpus + num_cpus));
 }
 
 void JxlThreadParallelRunnerDestroy(void* runner_opaque) {
@@ -107,5 +157,16 @@ void JxlThreadParallelRunnerDestroy(void* runner_opaque) {
 // Get default value for num_worker_threads parameter of
 // InitJxlThreadParallelRunner.
 size_t JxlThreadParallelRunnerDefaultNumWorkerThreads() {
-  return std::thread::hardware_concurrency();
+  size_t num_cpus = std::thread::hardware_concurrency();
+#if defined(__linux__)
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+    const size_t num_allowed = CPU_COUNT(&cpu_set);
+    if (num_allowed != 0) num_cpus = std::min(num_cpus, num_allowed);
+  }
+  const size_t quota = CgroupCpuQuota();
+  if (quota != 0) num_cpus = std::min(num_cpus, quota);
+#endif
+  return std::max<size_t>(num_cpus, 1);
 }
@@ -9,8 +9,9 @@
  * multithreading when using the JPEG XL library. This uses std::thread
  * internally and related synchronization functions. The number of threads
  * created is fixed at construction time and the threads are re-used for every
- * ThreadParallelRunner::Runner call. Only one concurrent
- * JxlThreadParallelRunner call per instance is allowed at a time.
+ * ThreadParallelRunner::Runner call. JxlThreadParallelRunner may be called
+ * concurrently from several threads and from within a running task; nested
+ * calls are run by the calling worker with help from idle workers.
  *
  * This is a scalable, lower-overhead thread pool runner, especially suitable
  * for data-parallel computations in the fork-join model, where clients need to
@@ -49,12 +50,25 @@ JXL_THREADS_EXPORT JxlParallelRetCode JxlThreadParallelRunner(
 JXL_THREADS_EXPORT void* JxlThreadParallelRunnerCreate(
     const JxlMemoryManager* memory_manager, size_t num_worker_threads);
 
+/** Creates the runner for @ref JxlThreadParallelRunner like
+ * @ref JxlThreadParallelRunnerCreate, and pins worker thread i to the CPU
+ * cpus[i % num_cpus] before it runs any task. Memory that a task first touches
+ * on a pinned worker, such as per-thread scratch buffers, is therefore
+ * allocated on the NUMA node of that CPU. Pinning is only supported on Linux
+ * and is skipped for CPUs that the process may not run on. If num_cpus is
+ * zero, the workers are not pinned.
+ */
+JXL_THREADS_EXPORT void* JxlThreadParallelRunnerCreateWithAffinity(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads,
+    const size_t* cpus, size_t num_cpus);
+
 /** Destroys the runner created by @ref JxlThreadParallelRunnerCreate.
  */
 JXL_THREADS_EXPORT void JxlThreadParallelRunnerDestroy(void* runner_opaque);
 
 /** Returns a default num_worker_threads value for
- * @ref JxlThreadParallelRunnerCreate.
+ * @ref JxlThreadParallelRunnerCreate: the number of CPUs the process may run
+ * on, further limited by the CPU quota of its cgroup, if any.
  */
 JXL_THREADS_EXPORT size_t JxlThreadParallelRunnerDefaultNumWorkerThreads(void);
 
@@ -18,6 +18,7 @@
 
 #include <cstddef>
 #include <memory>
+#include <vector>
 
 #include "lib/base/memory_manager.h"
 #include "lib/threads/thread_parallel_runner.h"
@@ -62,6 +63,27 @@ static inline JxlThreadParallelRunnerPtr JxlThreadParallelRunnerMake(
       JxlThreadParallelRunnerCreate(memory_manager, num_worker_threads));
 }
 
+/// Creates an instance of JxlThreadParallelRunner whose workers are pinned to
+/// the given CPUs into a JxlThreadParallelRunnerPtr and initializes it.
+///
+/// See @ref JxlThreadParallelRunnerCreateWithAffinity for details on the
+/// pinning.
+///
+/// @param memory_manager custom allocator function. It may be NULL. The memory
+///        manager will be copied internally.
+/// @param num_worker_threads the number of worker threads to create.
+/// @param cpus the CPUs that the worker threads are pinned to, in turn.
+/// @return a @c NULL JxlThreadParallelRunnerPtr if the instance can not be
+/// allocated or initialized
+/// @return initialized JxlThreadParallelRunnerPtr instance otherwise.
+static inline JxlThreadParallelRunnerPtr
+JxlThreadParallelRunnerMakeWithAffinity(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads,
+    const std::vector<size_t>& cpus) {
+  return JxlThreadParallelRunnerPtr(JxlThreadParallelRunnerCreateWithAffinity(
+      memory_manager, num_worker_threads, cpus.data(), cpus.size()));
+}
+
 #endif  // JXL_THREAD_PARALLEL_RUNNER_CXX_H_
 
 /// @}
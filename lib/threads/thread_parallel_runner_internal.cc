@@ -12,11 +12,26 @@
 #include <cstdint>
 #include <mutex>
 #include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "lib/base/compiler_specific.h"
 
 namespace jpegxl {
 
+namespace {
+
+// The runner whose worker thread is the current thread, if any, and the index
+// of that worker. Used to detect nested Runner() calls.
+thread_local const ThreadParallelRunner* tls_runner = nullptr;
+thread_local uint32_t tls_thread = 0;
+
+}  // namespace
+
 // static
 JxlParallelRetCode ThreadParallelRunner::Runner(
     void* runner_opaque, void* jpegxl_opaque, JxlParallelRunInit init,
@@ -39,39 +54,81 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
     return JXL_PARALLEL_RET_SUCCESS;
   }
 
-  if (self->depth_.fetch_add(1, std::memory_order_acq_rel) != 0) {
-    return JXL_PARALLEL_RET_RUNNER_ERROR;  // Must not re-enter.
+  const bool nested = (tls_runner == self);
+  Job job;
+  job.func = func;
+  job.jpegxl_opaque = jpegxl_opaque;
+  job.begin = start_range;
+  job.num_tasks = end_range - start_range;
+  // Nested jobs go to the queue of the calling worker, where they are taken
+  // before older (outer) jobs. Other callers spread their jobs over all queues.
+  job.queue =
+      nested ? tls_thread
+             : self->next_queue_.fetch_add(1, std::memory_order_relaxed) %
+                   self->num_worker_threads_;
+  {
+    WorkQueue& queue = self->queues_[job.queue];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.jobs.push_back(&job);
+    self->num_queued_.fetch_add(1, std::memory_order_release);
   }
-
-  const WorkerCommand worker_command =
-      (static_cast<WorkerCommand>(start_range) << 32) + end_range;
-  // Ensure the inputs do not result in a reserved command.
-  if ((worker_command == kWorkerWait) || (worker_command == kWorkerOnce) ||
-      (worker_command == kWorkerExit)) {
-    return JXL_PARALLEL_RET_RUNNER_ERROR;
+  {
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    ++self->epoch_;
   }
+  self->work_cv_.notify_all();
 
-  self->data_func_ = func;
-  self->jpegxl_opaque_ = jpegxl_opaque;
-  self->num_reserved_.store(0, std::memory_order_relaxed);
+  if (nested) {
+    // The calling worker must not run tasks of other jobs while one of its
+    // tasks is on the stack because they could use the same per-thread
+    // storage, but it can always complete its own job, even if all other
+    // workers are busy.
+    self->RunJob(&job, tls_thread);
+  }
+  self->WaitForJob(&job);
+  return JXL_PARALLEL_RET_SUCCESS;
+}
 
-  self->StartWorkers(worker_command);
-  self->WorkersReadyBarrier();
+ThreadParallelRunner::Job* ThreadParallelRunner::FindJob(
+    const uint32_t thread) {
+  // Avoids taking the locks of all queues when there is no work.
+  if (num_queued_.load(std::memory_order_acquire) == 0) return nullptr;
+  for (uint32_t i = 0; i < num_worker_threads_; ++i) {
+    const uint32_t victim = (thread + i) % num_worker_threads_;
+    WorkQueue& queue = queues_[victim];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.jobs.empty()) continue;
+    Job* job = (victim == thread) ? queue.jobs.back() : queue.jobs.front();
+    // The job can not be removed (and returned by its caller) while the lock
+    // is held.
+    job->num_users.fetch_add(1, std::memory_order_acq_rel);
+    return job;
+  }
+  return nullptr;
+}
 
-  if (self->depth_.fetch_add(-1, std::memory_order_acq_rel) != 1) {
-    return JXL_PARALLEL_RET_RUNNER_ERROR;
+void ThreadParallelRunner::ReleaseJob(Job* job) {
+  // The job may be destroyed as soon as the last user released it.
+  if (job->num_users.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    // Taking the lock ensures that a caller that has just seen a non-zero
+    // number of users is already waiting on done_cv_.
+    { std::lock_guard<std::mutex> lock(mutex_); }
+    done_cv_.notify_all();
   }
-  return JXL_PARALLEL_RET_SUCCESS;
 }
 
-// static
-void ThreadParallelRunner::RunRange(ThreadParallelRunner* self,
-                                    const WorkerCommand command,
-                                    const int thread) {
-  const uint32_t begin = command >> 32;
-  const uint32_t end = command & 0xFFFFFFFF;
-  const uint32_t num_tasks = end - begin;
-  const uint32_t num_worker_threads = self->num_worker_threads_;
+void ThreadParallelRunner::RemoveJob(Job* job) {
+  WorkQueue& queue = queues_[job->queue];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  auto it = std::find(queue.jobs.begin(), queue.jobs.end(), job);
+  if (it == queue.jobs.end()) return;
+  queue.jobs.erase(it);
+  num_queued_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void ThreadParallelRunner::RunJob(Job* job, const uint32_t thread) {
+  const uint32_t num_tasks = job->num_tasks;
+  const uint32_t num_worker_threads = num_worker_threads_;
 
   // OpenMP introduced several "schedule" strategies:
   // "single" (static assignment of exactly one chunk per thread): slower.
@@ -87,82 +144,120 @@ void ThreadParallelRunner::RunRange(ThreadParallelRunner* self,
 #else
     // guided
     const uint32_t num_reserved =
-        self->num_reserved_.load(std::memory_order_relaxed);
+        job->num_reserved.load(std::memory_order_relaxed);
     // It is possible that more tasks are reserved than ready to run.
     const uint32_t num_remaining =
         num_tasks - std::min(num_reserved, num_tasks);
     const uint32_t my_size =
         std::max(num_remaining / (num_worker_threads * 4), 1u);
 #endif
-    const uint32_t my_begin = begin + self->num_reserved_.fetch_add(
-                                          my_size, std::memory_order_relaxed);
-    const uint32_t my_end = std::min(my_begin + my_size, begin + num_tasks);
+    const uint32_t my_begin =
+        job->num_reserved.fetch_add(my_size, std::memory_order_relaxed);
+    const uint32_t my_end = std::min(my_begin + my_size, num_tasks);
     // Another thread already reserved the last task.
     if (my_begin >= my_end) {
       break;
     }
     for (uint32_t task = my_begin; task < my_end; ++task) {
-      self->data_func_(self->jpegxl_opaque_, task, thread);
+      job->func(job->jpegxl_opaque, job->begin + task, thread);
     }
+    job->num_done.fetch_add(my_end - my_begin, std::memory_order_acq_rel);
   }
+  // There is nothing left to reserve, stop handing out the job.
+  RemoveJob(job);
+}
+
+void ThreadParallelRunner::WaitForJob(Job* job) {
+  const auto is_done = [job]() {
+    return job->num_done.load(std::memory_order_acquire) == job->num_tasks &&
+           job->num_users.load(std::memory_order_acquire) == 0;
+  };
+  for (int i = 0; i < kSpinIterations; ++i) {
+    if (is_done()) return;
+    std::this_thread::yield();
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, is_done);
+}
+
+// static
+bool ThreadParallelRunner::PinToCpu(const size_t cpu) {
+#if defined(__linux__)
+  if (cpu >= static_cast<size_t>(CPU_SETSIZE)) return false;
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(cpu, &cpu_set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) ==
+         0;
+#else
+  (void)cpu;
+  return false;
+#endif
 }
 
 // static
 void ThreadParallelRunner::ThreadFunc(ThreadParallelRunner* self,
-                                      const int thread) {
-  // Until kWorkerExit command received:
+                                      const uint32_t thread) {
+  // Pin before touching any memory so that it is allocated on the NUMA node
+  // of the CPU. Failing to pin is not an error, the worker can still run.
+  if (!self->cpus_.empty()) {
+    (void)PinToCpu(self->cpus_[thread % self->cpus_.size()]);
+  }
+  tls_runner = self;
+  tls_thread = thread;
+  int num_idle = 0;
+  // Until exit_ is set:
   for (;;) {
-    std::unique_lock<std::mutex> lock(self->mutex_);
-    // Notify main thread that this thread is ready.
-    if (++self->workers_ready_ == self->num_threads_) {
-      self->workers_ready_cv_.notify_one();
+    Job* job = self->FindJob(thread);
+    if (job != nullptr) {
+      self->RunJob(job, thread);
+      self->ReleaseJob(job);
+      num_idle = 0;
+      continue;
+    }
+    if (++num_idle < kSpinIterations) {
+      std::this_thread::yield();
+      continue;
     }
-  RESUME_WAIT:
-    // Wait for a command.
-    self->worker_start_cv_.wait(lock);
-    const WorkerCommand command = self->worker_start_command_;
-    switch (command) {
-      case kWorkerWait:    // spurious wakeup:
-        goto RESUME_WAIT;  // lock still held, avoid incrementing ready.
-      case kWorkerOnce:
-        lock.unlock();
-        self->data_func_(self->jpegxl_opaque_, thread, thread);
-        break;
-      case kWorkerExit:
-        return;  // exits thread
-      default:
-        lock.unlock();
-        RunRange(self, command, thread);
-        break;
+    num_idle = 0;
+
+    std::unique_lock<std::mutex> lock(self->mutex_);
+    if (self->exit_) return;  // exits thread
+    const uint64_t epoch = self->epoch_;
+    lock.unlock();
+    // Jobs published before reading the epoch are found here, later ones
+    // change the epoch.
+    job = self->FindJob(thread);
+    if (job != nullptr) {
+      self->RunJob(job, thread);
+      self->ReleaseJob(job);
+      continue;
     }
+    lock.lock();
+    self->work_cv_.wait(
+        lock, [self, epoch]() { return self->epoch_ != epoch || self->exit_; });
   }
 }
 
-ThreadParallelRunner::ThreadParallelRunner(const int num_worker_threads)
+ThreadParallelRunner::ThreadParallelRunner(const int num_worker_threads,
+                                           const std::vector<size_t>& cpus)
     : num_worker_threads_(num_worker_threads),
-      num_threads_(std::max(num_worker_threads, 1)) {
+      num_threads_(std::max(num_worker_threads, 1)),
+      cpus_(cpus),
+      queues_(new WorkQueue[std::max(num_worker_threads, 1)]) {
   threads_.reserve(num_worker_threads_);
 
-  // Suppress "unused-private-field" warning.
-  (void)padding1;
-  (void)padding2;
-
-  // Safely handle spurious worker wakeups.
-  worker_start_command_ = kWorkerWait;
-
   for (uint32_t i = 0; i < num_worker_threads_; ++i) {
     threads_.emplace_back(ThreadFunc, this, i);
   }
-
-  if (num_worker_threads_ != 0) {
-    WorkersReadyBarrier();
-  }
 }
 
 ThreadParallelRunner::~ThreadParallelRunner() {
-  if (num_worker_threads_ != 0) {
-    StartWorkers(kWorkerExit);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    exit_ = true;
   }
+  work_cv_.notify_all();
 
   for (std::thread& thread : threads_) {
     if (thread.joinable()) {
@@ -12,19 +12,26 @@
 // JxlParallelRunner when using the JPEG XL library. This uses std::thread
 // internally and related synchronization functions. The number of threads
 // created is fixed at construction time and the threads are re-used for every
-// ThreadParallelRunner::Runner call. Only one concurrent Runner() call per
-// instance is allowed at a time.
+// ThreadParallelRunner::Runner call.
 //
 // This is a scalable, lower-overhead thread pool runner, especially suitable
 // for data-parallel computations in the fork-join model, where clients need to
 // know when all tasks have completed.
 //
-// This thread pool can efficiently load-balance millions of tasks using an
-// atomic counter, thus avoiding per-task virtual or system calls. With 48
+// Each Runner() call publishes a job in the work queue of one thread. Idle
+// workers take the newest job of their own queue, or steal the oldest job of
+// another queue, and then reserve chunks of its range of tasks with an atomic
+// counter, thus avoiding per-task virtual or system calls. With 48
 // hyperthreads and 1M tasks that add to an atomic counter, overall runtime is
 // 10-20x higher when using std::async, and ~200x for a queue-based thread
 // pool.
 //
+// Runner() may be called concurrently from several threads and from within a
+// task, e.g. to parallelize each image of a parallel loop over images. A nested
+// call runs the tasks of the inner job on the calling worker, helped by the
+// idle workers, so it cannot deadlock even when all workers are busy. Workers
+// spin for a short while before sleeping when they find no work.
+//
 // Usage:
 //   ThreadParallelRunner runner;
 //   JxlDecode(
@@ -38,6 +45,8 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <deque>
+#include <memory>
 #include <mutex>   //NOLINT
 #include <thread>  //NOLINT
 #include <vector>
@@ -56,11 +65,13 @@ class ThreadParallelRunner {
                                    JxlParallelRunFunction func,
                                    uint32_t start_range, uint32_t end_range);
 
-  // Starts the given number of worker threads and blocks until they are ready.
+  // Starts the given number of worker threads.
   // "num_worker_threads" defaults to one per hyperthread. If zero, all tasks
-  // run on the main thread.
+  // run on the main thread. If "cpus" is not empty, worker i is pinned to the
+  // CPU cpus[i % cpus.size()].
   explicit ThreadParallelRunner(
-      int num_worker_threads = std::thread::hardware_concurrency());
+      int num_worker_threads = std::thread::hardware_concurrency(),
+      const std::vector<size_t>& cpus = {});
 
   // Waits for all threads to exit.
   ~ThreadParallelRunner();
@@ -69,97 +80,78 @@ class ThreadParallelRunner {
   // for allocating per-thread storage.
   size_t NumThreads() const { return num_threads_; }
 
-  // Runs func(thread, thread) on all thread(s) that may participate in Run.
-  // If NumThreads() == 0, runs on the main thread with thread == 0, otherwise
-  // concurrently called by each worker thread in [0, NumThreads()).
-  template <class Func>
-  void RunOnEachThread(const Func& func) {
-    if (num_worker_threads_ == 0) {
-      const int thread = 0;
-      func(thread, thread);
-      return;
-    }
-
-    data_func_ = reinterpret_cast<JxlParallelRunFunction>(&CallClosure<Func>);
-    jpegxl_opaque_ = const_cast<void*>(static_cast<const void*>(&func));
-    StartWorkers(kWorkerOnce);
-    WorkersReadyBarrier();
-  }
-
   JxlMemoryManager memory_manager;
 
  private:
-  // After construction and between calls to Run, workers are "ready", i.e.
-  // waiting on worker_start_cv_. They are "started" by sending a "command"
-  // and notifying all worker_start_cv_ waiters. (That is why all workers
-  // must be ready/waiting - otherwise, the notification will not reach all of
-  // them and the main thread waits in vain for them to report readiness.)
-  using WorkerCommand = uint64_t;
-
-  // Special values; all others encode the begin/end parameters. Note that all
-  // these are no-op ranges (begin >= end) and therefore never used to encode
-  // ranges.
-  static constexpr WorkerCommand kWorkerWait = ~1ULL;
-  static constexpr WorkerCommand kWorkerOnce = ~2ULL;
-  static constexpr WorkerCommand kWorkerExit = ~3ULL;
-
-  // Calls f(task, thread). Used for type erasure of Func arguments. The
-  // signature must match JxlParallelRunFunction, hence a void* argument.
-  template <class Closure>
-  static void CallClosure(void* f, const uint32_t task, const size_t thread) {
-    (*reinterpret_cast<const Closure*>(f))(task, thread);
-  }
-
-  void WorkersReadyBarrier() {
-    std::unique_lock<std::mutex> lock(mutex_);
-    // Typically only a single iteration.
-    while (workers_ready_ != threads_.size()) {
-      workers_ready_cv_.wait(lock);
-    }
-    workers_ready_ = 0;
-
-    // Safely handle spurious worker wakeups.
-    worker_start_command_ = kWorkerWait;
-  }
-
-  // Precondition: all workers are ready.
-  void StartWorkers(const WorkerCommand worker_command) {
-    mutex_.lock();
-    worker_start_command_ = worker_command;
-    // Workers will need this lock, so release it before they wake up.
-    mutex_.unlock();
-    worker_start_cv_.notify_all();
-  }
-
-  // Attempts to reserve and perform some work from the global range of tasks,
-  // which is encoded within "command". Returns after all tasks are reserved.
-  static void RunRange(ThreadParallelRunner* self, WorkerCommand command,
-                       int thread);
-
-  static void ThreadFunc(ThreadParallelRunner* self, int thread);
+  // State of a Runner() call, owned by the calling thread. It stays in the
+  // work queue of "queue" until all of its tasks are reserved.
+  struct Job {
+    JxlParallelRunFunction func;
+    void* jpegxl_opaque;
+    uint32_t begin;
+    uint32_t num_tasks;
+    uint32_t queue;
+
+    // Updated by all threads running the job; padding avoids false sharing.
+    uint8_t padding1[64];
+    std::atomic<uint32_t> num_reserved{0};
+    std::atomic<uint32_t> num_done{0};
+    // Number of threads other than the caller that may access the job.
+    std::atomic<uint32_t> num_users{0};
+    uint8_t padding2[64];
+  };
+
+  // Jobs that were published by (or assigned to) a worker thread. The owner
+  // takes the newest one, thieves take the oldest one.
+  struct alignas(64) WorkQueue {
+    std::mutex mutex;
+    std::deque<Job*> jobs;
+  };
+
+  // Number of times an idle worker (or a caller waiting for its job) looks
+  // for work before it blocks on a condition variable.
+  static constexpr int kSpinIterations = 2000;
+
+  // Returns a job whose tasks may be run by worker "thread", or nullptr. The
+  // caller must call ReleaseJob() when it is done with the job.
+  Job* FindJob(uint32_t thread);
+  void ReleaseJob(Job* job);
+  void RemoveJob(Job* job);
+
+  // Reserves and runs chunks of the tasks of "job" until all are reserved.
+  void RunJob(Job* job, uint32_t thread);
+
+  // Returns after all tasks of "job" are done and no other thread uses it.
+  void WaitForJob(Job* job);
+
+  // Restricts the calling thread to the given CPU. Returns false if that is
+  // not supported or the CPU is not available.
+  static bool PinToCpu(size_t cpu);
+
+  static void ThreadFunc(ThreadParallelRunner* self, uint32_t thread);
 
   // Unmodified after ctor, but cannot be const because we call thread::join().
   std::vector<std::thread> threads_;
 
   const uint32_t num_worker_threads_;  // == threads_.size()
   const uint32_t num_threads_;
+  // CPUs the workers pin themselves to, see PinToCpu().
+  const std::vector<size_t> cpus_;
 
-  std::atomic<int> depth_{0};  // detects if Run is re-entered (not supported).
+  // One per worker thread.
+  std::unique_ptr<WorkQueue[]> queues_;
+  // Queue of the next job published by a thread that is not a worker.
+  std::atomic<uint32_t> next_queue_{0};
+  // Number of jobs in all queues.
+  std::atomic<uint32_t> num_queued_{0};
 
   std::mutex mutex_;  // guards both cv and their variables.
-  std::condition_variable workers_ready_cv_;
-  uint32_t workers_ready_ = 0;
-  std::condition_variable worker_start_cv_;
-  WorkerCommand worker_start_command_;
-
-  // Written by main thread, read by workers (after mutex lock/unlock).
-  JxlParallelRunFunction data_func_;
-  void* jpegxl_opaque_;
-
-  // Updated by workers; padding avoids false sharing.
-  uint8_t padding1[64];
-  std::atomic<uint32_t> num_reserved_{0};
-  uint8_t padding2[64];
+  // Incremented whenever a job is published, wakes up sleeping workers.
+  std::condition_variable work_cv_;
+  uint64_t epoch_ = 0;
+  bool exit_ = false;
+  // Notified whenever the last user of a job releases it.
+  std::condition_variable done_cv_;
 };
 
 }  // namespace jpegxl
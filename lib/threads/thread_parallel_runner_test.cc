@@ -7,12 +7,14 @@
 #include <algorithm>
 #include <atomic>
 #include <cstdint>
+#include <thread>
 #include <vector>
 
 #include "lib/base/data_parallel.h"
 #include "lib/base/status.h"
 #include "lib/base/testing.h"
 #include "lib/threads/test_utils.h"
+#include "lib/threads/thread_parallel_runner_cxx.h"
 
 using ::jxl::test::ThreadPoolForTests;
 
@@ -126,5 +128,79 @@ TEST(ThreadParallelRunnerTest, TestCounter) {
   EXPECT_EQ(expected, counters[0].counter);
 }
 
+// Nested calls, e.g. from within an outer task, run to completion even when
+// all workers are busy with outer tasks.
+TEST(ThreadParallelRunnerTest, TestNested) {
+  for (int num_threads = 0; num_threads <= 8; ++num_threads) {
+    ThreadPoolForTests pool(num_threads);
+    const int kNumOuter = 3 * num_threads + 1;
+    const int kNumInner = 17;
+    std::atomic<int> sum{0};
+    const auto inner_task = [&sum, num_threads](
+                                const int task,
+                                const int thread) -> jxl::Status {
+      EXPECT_LT(thread, std::max(num_threads, 1));
+      sum.fetch_add(task, std::memory_order_relaxed);
+      return true;
+    };
+    const auto outer_task = [&pool, &inner_task](
+                                const int task,
+                                const int thread) -> jxl::Status {
+      return RunOnPool(pool.get(), 0, kNumInner, jxl::ThreadPool::NoInit,
+                       inner_task, "TestNestedInner");
+    };
+    EXPECT_TRUE(RunOnPool(pool.get(), 0, kNumOuter, jxl::ThreadPool::NoInit,
+                          outer_task, "TestNestedOuter"));
+    EXPECT_EQ(kNumOuter * (kNumInner * (kNumInner - 1) / 2), sum.load());
+  }
+}
+
+// Several threads may share a pool.
+TEST(ThreadParallelRunnerTest, TestConcurrentCallers) {
+  ThreadPoolForTests pool(4);
+  const int kNumCallers = 4;
+  const int kNumTasks = 1000;
+  std::atomic<int> num_calls{0};
+  std::vector<std::thread> callers;
+  for (int i = 0; i < kNumCallers; ++i) {
+    callers.emplace_back([&pool, &num_calls]() {
+      const auto do_task = [&num_calls](const int task,
+                                        const int thread) -> jxl::Status {
+        num_calls.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      };
+      for (int run = 0; run < 10; ++run) {
+        EXPECT_TRUE(RunOnPool(pool.get(), 0, kNumTasks,
+                              jxl::ThreadPool::NoInit, do_task,
+                              "TestConcurrentCallers"));
+      }
+    });
+  }
+  for (std::thread& caller : callers) caller.join();
+  EXPECT_EQ(kNumCallers * 10 * kNumTasks, num_calls.load());
+}
+
+TEST(ThreadParallelRunnerTest, TestAffinity) {
+  const size_t num_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
+  EXPECT_GE(num_threads, 1u);
+  EXPECT_LE(num_threads, std::max(std::thread::hardware_concurrency(), 1u));
+
+  // Pinning all workers to the same CPU must not change the results.
+  const std::vector<size_t> cpus = {0};
+  JxlThreadParallelRunnerPtr runner =
+      JxlThreadParallelRunnerMakeWithAffinity(nullptr, 4, cpus);
+  ASSERT_TRUE(runner);
+  jxl::ThreadPool pool(JxlThreadParallelRunner, runner.get());
+  const int kNumTasks = 100;
+  std::atomic<int> sum{0};
+  const auto do_task = [&sum](const int task, const int thread) -> jxl::Status {
+    sum.fetch_add(task, std::memory_order_relaxed);
+    return true;
+  };
+  EXPECT_TRUE(RunOnPool(&pool, 0, kNumTasks, jxl::ThreadPool::NoInit, do_task,
+                        "TestAffinity"));
+  EXPECT_EQ(kNumTasks * (kNumTasks - 1) / 2, sum.load());
+}
+
 }  // namespace
 }  // namespace jpegxl
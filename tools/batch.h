@@ -0,0 +1,91 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef TOOLS_BATCH_H_
+#define TOOLS_BATCH_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "lib/base/printf_macros.h"
+#include "lib/base/status.h"
+#include "tools/file_io.h"
+#include "tools/thread_pool_internal.h"
+
+namespace jpegxl {
+namespace tools {
+
+// An input and output file pair of the --batch option of the tools.
+struct BatchItem {
+  std::string input;
+  std::string output;
+};
+
+// Reads the file list of the --batch option, which has one INPUT<TAB>OUTPUT
+// pair per line. Empty lines and lines starting with '#' are skipped.
+static inline bool ReadBatchList(const std::string& filename,
+                                 std::vector<BatchItem>* items) {
+  std::vector<uint8_t> bytes;
+  if (!ReadFile(filename, &bytes)) {
+    fprintf(stderr, "Failed to read batch list %s\n", filename.c_str());
+    return false;
+  }
+  const std::string text(bytes.begin(), bytes.end());
+  size_t line_number = 0;
+  for (size_t pos = 0; pos < text.size();) {
+    size_t end = text.find('\n', pos);
+    if (end == std::string::npos) end = text.size();
+    std::string line = text.substr(pos, end - pos);
+    pos = end + 1;
+    ++line_number;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.empty() || line[0] == '#') continue;
+    size_t tab = line.find('\t');
+    if (tab == 0 || tab == std::string::npos || tab + 1 == line.size()) {
+      fprintf(stderr,
+              "Line %" PRIuS " of batch list %s is not INPUT<TAB>OUTPUT\n",
+              line_number, filename.c_str());
+      return false;
+    }
+    items->push_back({line.substr(0, tab), line.substr(tab + 1)});
+  }
+  return true;
+}
+
+// Calls init(num_workers) once and then process(item, worker) for each of the
+// num_items items of a batch on a pool of num_threads threads (on the calling
+// thread if it is 0), where worker is smaller than num_workers and can index
+// state that is reused for the items processed by the same thread. A failed
+// item does not stop the others; returns the number of items for which
+// process() returned false, or num_items if init() failed.
+template <typename InitFunc, typename ProcessFunc>
+size_t RunBatch(size_t num_items, size_t num_threads, const InitFunc& init,
+                const ProcessFunc& process) {
+  ThreadPoolInternal pool(num_threads);
+  std::atomic<size_t> num_failed{0};
+  const auto init_func = [&](size_t num_workers) -> jxl::Status {
+    return init(num_workers);
+  };
+  const auto process_item = [&](uint32_t item,
+                                size_t worker) -> jxl::Status {
+    if (!process(item, worker)) ++num_failed;
+    return true;
+  };
+  if (!pool.get()->Run(0, static_cast<uint32_t>(num_items), init_func,
+                       process_item, "RunBatch")) {
+    return num_items;
+  }
+  return num_failed.load();
+}
+
+}  // namespace tools
+}  // namespace jpegxl
+
+#endif  // TOOLS_BATCH_H_
@@ -9,6 +9,7 @@
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
+#include <hwy/targets.h>
 #include <string>
 #include <vector>
 
@@ -69,6 +70,17 @@ Status BenchmarkArgs::AddCommandLineOptions() {
       &print_more_stats, "print_more_stats",
       "Prints codec-specific stats. Not safe for concurrent benchmark runs.",
       false);
+  AddFlag(&perf_counters, "perf_counters",
+          "Prints the time, retired instructions, cache misses and branch "
+          "mispredictions of each stage of the jpegli encoder and decoder, "
+          "counted with the Linux perf_event hardware counters.",
+          false);
+  AddFlag(&energy_counters, "energy_counters",
+          "Adds the encoding and decoding energy in joules per megapixel to "
+          "the table and to --print_details, measured with the RAPL counters "
+          "of Linux powercap. The counters are for the whole CPU package, so "
+          "use --num_threads=0 and an otherwise idle machine.",
+          false);
   AddFlag(&print_distance_percentiles, "print_distance_percentiles",
           "Prints distance percentiles for the corpus. Not safe for "
           "concurrent benchmark runs.",
@@ -175,6 +187,18 @@ Status BenchmarkArgs::AddCommandLineOptions() {
   AddDouble(&error_pnorm, "error_pnorm",
             "smallest p norm for pooling butteraugli values", 3.0);
 
+  AddUnsigned(&butteraugli_tile_size, "butteraugli_tile_size",
+              "If nonzero, computes butteraugli in independent tiles of this "
+              "size on the inner thread pool. Faster on large images, but "
+              "distances deviate slightly from the whole-image values.",
+              0);
+
+  AddFlag(&approximate_butteraugli, "approximate_butteraugli",
+          "Also computes the approximate butteraugli distance of each image, "
+          "see ButteraugliParams::approximate, and prints its correlation with "
+          "the full distance and its speedup.",
+          false);
+
   AddFlag(&show_progress, "show_progress",
           "Show activity dots per completed file during benchmark.", false);
 
@@ -189,9 +213,23 @@ Status BenchmarkArgs::AddCommandLineOptions() {
       "If true, only decodes, and the input files must be compressed with a "
       "compatible format for the given codec(s). Only measures decompression "
       "speed and sizes, and can only use a single set of compatible decoders. "
-      "Distance numbers and compression speeds shown in the table are invalid.",
+      "Distance numbers and compression speeds shown in the table are invalid. "
+      "Speeds are per decoded pixel. The jpeg codec params dec-scale<N> (1/N "
+      "scaling), dec-dc, dec-crop (center quarter) and dec-skip (bottom "
+      "half) select a decoding variant of libjpeg or of jpegli (dec-jpegli).",
       false);
 
+  AddString(&simd_targets_string, "simd_targets",
+            "Comma separated list of SIMD targets, e.g. AVX3,AVX2,SSE4,SCALAR. "
+            "If not empty, the codecs are run with each of them in turn, and "
+            "their speed and size is compared to that of the first one.");
+
+  AddString(&sweep_string, "sweep",
+            "Comma separated list of quality parameters, e.g. q50,q70,q85,q95. "
+            "If not empty, each codec is run with each of them appended, and "
+            "the BD-rate of each metric and the encoding and decoding time "
+            "of the codecs are compared to those of the first codec.");
+
   AddUnsigned(
       &generations, "generations",
       "If nonzero, enables generation loss testing with this number of "
@@ -199,6 +237,14 @@ Status BenchmarkArgs::AddCommandLineOptions() {
       "That is, the decoded image gets re-encoded, iteratively, N times.",
       0);
 
+  AddUnsigned(
+      &saturation_threads, "saturation_threads",
+      "If nonzero, measures the scaling of the aggregate throughput instead: "
+      "the images are encoded and decoded by 1, 2, 4, ... up to this many "
+      "threads concurrently, and the throughput, the per image latency and "
+      "the memory high-water mark of each level is printed.",
+      0);
+
   if (!AddCommandLineOptionsJPEGCodec(this)) return false;
 
   return true;
@@ -236,6 +282,41 @@ Status BenchmarkArgs::ValidateArgs() {
     return JXL_FAILURE("override_bitdepth must be <= 32");
   }
 
+  for (const std::string& name : SplitString(simd_targets_string, ',')) {
+    if (name.empty()) continue;
+    bool found = false;
+    for (int64_t target : hwy::SupportedAndGeneratedTargets()) {
+      if (name == hwy::TargetName(target)) {
+        simd_targets.push_back(target);
+        found = true;
+      }
+    }
+    if (!found) {
+      std::string available;
+      for (int64_t target : hwy::SupportedAndGeneratedTargets()) {
+        available += std::string(available.empty() ? "" : ",") +
+                     hwy::TargetName(target);
+      }
+      return JXL_FAILURE("SIMD target %s is not supported, try one of %s",
+                         name.c_str(), available.c_str());
+    }
+  }
+
+  for (const std::string& point : SplitString(sweep_string, ',')) {
+    if (!point.empty()) sweep_points.push_back(point);
+  }
+  if (!sweep_points.empty() &&
+      (sweep_points.size() < 2 || decode_only || !simd_targets.empty())) {
+    return JXL_FAILURE(
+        "sweep needs at least two points and can not be used with "
+        "decode_only or simd_targets");
+  }
+
+  if (saturation_threads > 0 && (decode_only || !simd_targets.empty())) {
+    return JXL_FAILURE(
+        "saturation_threads can not be used with decode_only or simd_targets");
+  }
+
   if (!color_hints_string.empty()) {
     std::vector<std::string> hints = SplitString(color_hints_string, ',');
     for (const auto& hint : hints) {
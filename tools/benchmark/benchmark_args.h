@@ -10,6 +10,7 @@
 // Command line parsing and arguments for benchmark_xl
 
 #include <cstddef>
+#include <cstdint>
 #include <deque>
 #include <string>
 #include <vector>
@@ -108,6 +109,8 @@ struct BenchmarkArgs {
   bool print_details;
   bool print_details_csv;
   bool print_more_stats;
+  bool perf_counters;
+  bool energy_counters;
   bool print_distance_percentiles;
   bool silent_errors;
   bool save_compressed;
@@ -119,6 +122,14 @@ struct BenchmarkArgs {
   bool decode_only;
   bool skip_butteraugli;
 
+  std::string simd_targets_string;
+  // Highway targets given with --simd_targets, in the order of the option.
+  std::vector<int64_t> simd_targets;
+
+  std::string sweep_string;
+  // Quality parameters given with --sweep, e.g. "q90" or "d1.5".
+  std::vector<std::string> sweep_points;
+
   float intensity_target;
 
   std::string color_hints_string;
@@ -146,8 +157,11 @@ struct BenchmarkArgs {
   size_t decode_reps;
   size_t encode_reps;
   size_t generations;
+  size_t saturation_threads;
 
   double error_pnorm;
+  size_t butteraugli_tile_size;
+  bool approximate_butteraugli;
   bool show_progress;
 
   std::string extra_metrics;
@@ -76,7 +76,7 @@ ImageCodecPtr CreateImageCodec(const std::string& description,
   }
   ImageCodecPtr result;
   if (name == "jpeg") {
-    result.reset(CreateNewJPEGCodec(*Args()));
+    result.reset(CreateNewJPEGCodec(*Args(), memory_manager));
   }
   if (!result.get()) {
     fprintf(stderr, "Unknown image codec: %s", name.c_str());
@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <memory>
@@ -28,10 +29,15 @@
 #include "lib/extras/enc/pnm.h"
 #include "lib/extras/packed_image.h"
 #include "lib/extras/time.h"
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/decode.h"
 #include "tools/benchmark/benchmark_args.h"
 #include "tools/benchmark/benchmark_codec.h"
+#include "tools/benchmark/benchmark_stats.h"
 #include "tools/benchmark/benchmark_utils.h"
+#include "tools/benchmark/dynamic_libjpeg.h"
 #include "tools/file_io.h"
+#include "tools/jpegli_stage_stats.h"
 #include "tools/speed_stats.h"
 #include "tools/thread_pool_internal.h"
 
@@ -49,6 +55,8 @@ struct JPEGArgs {
   float search_tolerance;
   float search_q_precision;
   float search_first_iter_slope;
+  std::string libjpeg_turbo_library;
+  std::string mozjpeg_library;
 };
 
 static JPEGArgs* const jpegargs = new JPEGArgs;
@@ -85,12 +93,30 @@ Status AddCommandLineOptionsJPEGCodec(BenchmarkArgs* args) {
                  0.0f);
   args->AddSigned(&jpegargs->search_max_iters, "search_max_iters",
                   "Maximum search steps in quality-to-target search.", 0);
+  args->AddString(&jpegargs->libjpeg_turbo_library, "libjpeg_turbo_library",
+                  "Shared library of the enc-turbo jpeg encoder, the default "
+                  "is the jpeg library that benchmark_xl is linked with.");
+  args->AddString(&jpegargs->mozjpeg_library, "mozjpeg_library",
+                  "Shared library of the enc-mozjpeg jpeg encoder.");
   return true;
 }
 
+// Keeps the largest memory usage of the jpegli runs on an image.
+void UpdateMemoryStats(const jpegli_memory_stats& stats,
+                       CodecMemoryStats* memory) {
+  memory->peak_bytes = std::max(memory->peak_bytes, stats.peak_bytes);
+  memory->permanent_peak_bytes = std::max(
+      memory->permanent_peak_bytes, stats.pools[JPOOL_PERMANENT].peak_bytes);
+  memory->image_peak_bytes =
+      std::max(memory->image_peak_bytes, stats.pools[JPOOL_IMAGE].peak_bytes);
+  memory->num_allocations =
+      std::max(memory->num_allocations, stats.total_allocations);
+}
+
 class JPEGCodec : public ImageCodec {
  public:
-  explicit JPEGCodec(const BenchmarkArgs& args) : ImageCodec(args) {}
+  JPEGCodec(const BenchmarkArgs& args, JxlMemoryManager* memory_manager)
+      : ImageCodec(args), memory_manager_(memory_manager) {}
 
   Status ParseParam(const std::string& param) override {
     if (param[0] == 'q' && ImageCodec::ParseParam(param)) {
@@ -108,6 +134,15 @@ class JPEGCodec : public ImageCodec {
       jpeg_encoder_ = "jpegli";
       return true;
     }
+    // Encoders that are loaded in-process with DynamicLibjpeg.
+    if (param == "enc-turbo") {
+      jpeg_encoder_ = "turbo";
+      return true;
+    }
+    if (param == "enc-mozjpeg") {
+      jpeg_encoder_ = "mozjpeg";
+      return true;
+    }
     if (param.compare(0, 3, "yuv") == 0) {
       chroma_subsampling_ = param.substr(3);
       return true;
@@ -116,6 +151,10 @@ class JPEGCodec : public ImageCodec {
       psnr_target_ = std::stof(param.substr(4));
       return true;
     }
+    if (param.compare(0, 8, "batarget") == 0) {
+      ba_target_ = std::stof(param.substr(8));
+      return true;
+    }
     if (param[0] == 'p') {
       progressive_id_ = strtol(param.substr(1).c_str(), nullptr, 10);
       return true;
@@ -137,6 +176,26 @@ class JPEGCodec : public ImageCodec {
       enable_adaptive_quant_ = false;
       return true;
     }
+    if (param == "fastaq") {
+      use_fast_aq_ = true;
+      return true;
+    }
+    if (param == "fixdct") {
+      use_fixed_point_dct_ = true;
+      return true;
+    }
+    if (param == "compact") {
+      use_compact_tokens_ = true;
+      return true;
+    }
+    if (param == "twopass") {
+      use_two_pass_tokenization_ = true;
+      return true;
+    }
+    if (param == "optscans") {
+      optimize_scans_ = true;
+      return true;
+    }
     if (param == "xyb") {
       xyb_mode_ = true;
       return true;
@@ -157,6 +216,24 @@ class JPEGCodec : public ImageCodec {
       num_colors_ = strtol(param.substr(6).c_str(), nullptr, 10);
       return true;
     }
+    // Decoding variants, for both decoders.
+    if (param.compare(0, 9, "dec-scale") == 0) {
+      scale_denom_ = strtol(param.substr(9).c_str(), nullptr, 10);
+      return scale_denom_ == 1 || scale_denom_ == 2 || scale_denom_ == 4 ||
+             scale_denom_ == 8;
+    }
+    if (param == "dec-dc") {
+      scale_denom_ = 8;
+      return true;
+    }
+    if (param == "dec-crop") {
+      crop_mode_ = CropMode::kCenter;
+      return true;
+    }
+    if (param == "dec-skip") {
+      crop_mode_ = CropMode::kBottomHalf;
+      return true;
+    }
     return false;
   }
 
@@ -208,7 +285,24 @@ class JPEGCodec : public ImageCodec {
     }
 
     double elapsed = 0.0;
-    if (jpeg_encoder_ == "jpegli") {
+    if (jpeg_encoder_ == "turbo" || jpeg_encoder_ == "mozjpeg") {
+      if (dynamic_libjpeg_ == nullptr) {
+        const bool is_mozjpeg = jpeg_encoder_ == "mozjpeg";
+        if (is_mozjpeg && jpegargs->mozjpeg_library.empty()) {
+          return JXL_FAILURE("enc-mozjpeg needs --mozjpeg_library");
+        }
+        JXL_ASSIGN_OR_RETURN(
+            dynamic_libjpeg_,
+            DynamicLibjpeg::Load(is_mozjpeg ? jpegargs->mozjpeg_library
+                                            : jpegargs->libjpeg_turbo_library));
+      }
+      DynamicLibjpegParams params;
+      params.quality = static_cast<int>(std::round(q_target_));
+      params.chroma_subsampling = chroma_subsampling_;
+      params.progressive = progressive_id_ > 0;
+      JXL_RETURN_IF_ERROR(
+          dynamic_libjpeg_->Encode(ppf, params, compressed, &elapsed));
+    } else if (jpeg_encoder_ == "jpegli") {
       jxl::extras::JpegSettings settings;
       settings.xyb = xyb_mode_;
       if (!xyb_mode_) {
@@ -225,6 +319,9 @@ class JPEGCodec : public ImageCodec {
       if (psnr_target_ > 0) {
         settings.psnr_target = psnr_target_;
       }
+      if (ba_target_ > 0) {
+        settings.butteraugli_target = ba_target_;
+      }
       if (jpegargs->search_tolerance > 0) {
         settings.search_tolerance = 0.01f * jpegargs->search_tolerance;
       }
@@ -236,14 +333,28 @@ class JPEGCodec : public ImageCodec {
       }
       settings.chroma_subsampling = chroma_subsampling_;
       settings.use_adaptive_quantization = enable_adaptive_quant_;
+      settings.use_fast_adaptive_quantization = use_fast_aq_;
+      settings.use_fixed_point_dct = use_fixed_point_dct_;
+      settings.use_compact_tokens = use_compact_tokens_;
+      settings.use_two_pass_tokenization = use_two_pass_tokenization_;
+      settings.optimize_scans = optimize_scans_;
       settings.libjpeg_quality = libjpeg_quality_;
       settings.libjpeg_chroma_subsampling = libjpeg_chroma_subsampling_;
       settings.optimize_coding = !fix_codes_;
+      jpegli_memory_stats memory_stats;
+      settings.memory_manager = memory_manager_;
+      settings.memory_stats = &memory_stats;
+      jpegli_stage_stats stage_stats;
+      if (Args()->perf_counters) settings.stage_stats = &stage_stats;
       const double start = jxl::Now();
       JXL_RETURN_IF_ERROR(
           jxl::extras::EncodeJpeg(ppf, settings, pool, compressed));
       const double end = jxl::Now();
       elapsed = end - start;
+      UpdateMemoryStats(memory_stats, &enc_memory_);
+      if (Args()->perf_counters) {
+        enc_stages_.Add(stage_stats, ppf.info.xsize * ppf.info.ysize);
+      }
     } else {
       jxl::extras::EncodedImage encoded;
       std::unique_ptr<jxl::extras::Encoder> encoder =
@@ -310,14 +421,25 @@ class JPEGCodec : public ImageCodec {
       dparams.output_data_type =
           bitdepth_ > 8 ? JXL_TYPE_UINT16 : JXL_TYPE_UINT8;
       dparams.num_colors = num_colors_;
+      JXL_RETURN_IF_ERROR(SetDecodeVariant(compressed, &dparams));
+      jpegli_memory_stats memory_stats;
+      dparams.memory_manager = memory_manager_;
+      dparams.memory_stats = &memory_stats;
+      jpegli_stage_stats stage_stats;
+      if (Args()->perf_counters) dparams.stage_stats = &stage_stats;
       JXL_RETURN_IF_ERROR(
           jxl::extras::DecodeJpeg(jpeg_bytes, dparams, pool, ppf));
       const double end = jxl::Now();
       speed_stats->NotifyElapsed(end - start);
+      UpdateMemoryStats(memory_stats, &dec_memory_);
+      if (Args()->perf_counters) {
+        dec_stages_.Add(stage_stats, ppf->info.xsize * ppf->info.ysize);
+      }
     } else {
       const double start = jxl::Now();
       jxl::extras::JPGDecompressParams dparams;
       dparams.num_colors = num_colors_;
+      JXL_RETURN_IF_ERROR(SetDecodeVariant(compressed, &dparams));
       JXL_RETURN_IF_ERROR(
           jxl::extras::DecodeImageJPG(compressed, jxl::extras::ColorHints(),
                                       ppf, /*constraints=*/nullptr, &dparams));
@@ -327,27 +449,94 @@ class JPEGCodec : public ImageCodec {
     return true;
   }
 
+  void GetMoreStats(BenchmarkStats* stats) override {
+    stats->enc_memory.Assimilate(enc_memory_);
+    stats->dec_memory.Assimilate(dec_memory_);
+    enc_memory_ = CodecMemoryStats();
+    dec_memory_ = CodecMemoryStats();
+    stats->enc_stages.Assimilate(enc_stages_);
+    stats->dec_stages.Assimilate(dec_stages_);
+    enc_stages_ = JpegliStageTotals();
+    dec_stages_ = JpegliStageTotals();
+  }
+
  protected:
+  // The region of the image that dec-crop and dec-skip decode.
+  enum class CropMode {
+    kNone,
+    // The center quarter of the image, with jpeg_crop_scanline() and
+    // jpeg_skip_scanlines().
+    kCenter,
+    // The bottom half of the image, after skipping the top half with
+    // jpeg_skip_scanlines().
+    kBottomHalf,
+  };
+
+  // Sets the scaling and crop region of the decoding variant in the params of
+  // either decoder. The crop region is in output pixels, so it is computed
+  // from the image size in the header and the scaling.
+  template <typename Params>
+  Status SetDecodeVariant(const Span<const uint8_t> compressed,
+                          Params* dparams) const {
+    dparams->scale_denom = scale_denom_;
+    if (crop_mode_ == CropMode::kNone) return true;
+    JpegliImageInfo info;
+    JXL_RETURN_IF_ERROR(
+        jpegli_probe(compressed.data(), compressed.size(), &info));
+    const size_t xsize = (info.image_width + scale_denom_ - 1) / scale_denom_;
+    const size_t ysize =
+        (info.image_height + scale_denom_ - 1) / scale_denom_;
+    if (crop_mode_ == CropMode::kCenter) {
+      dparams->crop_x0 = xsize / 4;
+      dparams->crop_y0 = ysize / 4;
+      dparams->crop_xsize = std::max<size_t>(1, xsize / 2);
+      dparams->crop_ysize = std::max<size_t>(1, ysize / 2);
+    } else {
+      dparams->crop_y0 = ysize / 2;
+      dparams->crop_xsize = xsize;
+      dparams->crop_ysize = ysize - ysize / 2;
+    }
+    return true;
+  }
+
+  JxlMemoryManager* memory_manager_;
+  // Memory usage of jpegli on the current image, see GetMoreStats().
+  CodecMemoryStats enc_memory_;
+  CodecMemoryStats dec_memory_;
+  // Stage stats of jpegli on the current image with --perf_counters.
+  JpegliStageTotals enc_stages_;
+  JpegliStageTotals dec_stages_;
   // JPEG encoder and its parameters
   std::string jpeg_encoder_ = "libjpeg";
+  // The library of the enc-turbo and enc-mozjpeg encoders.
+  std::unique_ptr<DynamicLibjpeg> dynamic_libjpeg_;
   std::string chroma_subsampling_;
   int progressive_id_ = -1;
   bool fix_codes_ = false;
   float psnr_target_ = 0.0f;
+  float ba_target_ = 0.0f;
   bool enc_quality_set_ = false;
   int libjpeg_quality_ = 0;
   std::string libjpeg_chroma_subsampling_;
   bool xyb_mode_ = false;
   bool use_std_tables_ = false;
   bool enable_adaptive_quant_ = true;
+  bool use_fast_aq_ = false;
+  bool use_fixed_point_dct_ = false;
+  bool use_compact_tokens_ = false;
+  bool use_two_pass_tokenization_ = false;
+  bool optimize_scans_ = false;
   // JPEG decoder and its parameters
   std::string jpeg_decoder_ = "libjpeg";
   int num_colors_ = 0;
   size_t bitdepth_ = 8;
+  unsigned int scale_denom_ = 1;
+  CropMode crop_mode_ = CropMode::kNone;
 };
 
-ImageCodec* CreateNewJPEGCodec(const BenchmarkArgs& args) {
-  return new JPEGCodec(args);
+ImageCodec* CreateNewJPEGCodec(const BenchmarkArgs& args,
+                               JxlMemoryManager* memory_manager) {
+  return new JPEGCodec(args, memory_manager);
 }
 
 }  // namespace tools
@@ -7,13 +7,17 @@
 #ifndef TOOLS_BENCHMARK_BENCHMARK_CODEC_JPEG_H_
 #define TOOLS_BENCHMARK_BENCHMARK_CODEC_JPEG_H_
 
+#include "lib/base/memory_manager.h"
 #include "lib/base/status.h"
 #include "tools/benchmark/benchmark_args.h"
 #include "tools/benchmark/benchmark_codec.h"
 
 namespace jpegxl {
 namespace tools {
-ImageCodec* CreateNewJPEGCodec(const BenchmarkArgs& args);
+// The jpegli encoder and decoder allocate their memory blocks with
+// memory_manager.
+ImageCodec* CreateNewJPEGCodec(const BenchmarkArgs& args,
+                               JxlMemoryManager* memory_manager);
 
 // Registers the jpeg-specific command line options.
 Status AddCommandLineOptionsJPEGCodec(BenchmarkArgs* args);
@@ -29,8 +29,12 @@ namespace {
 uint32_t ComputeLargestCodecName() {
   std::vector<std::string> methods = SplitString(Args()->codec, ',');
   size_t max = strlen("Aggregate:");  // Include final row's name
+  size_t max_sweep_point = 0;
+  for (const auto& point : Args()->sweep_points) {
+    max_sweep_point = std::max(max_sweep_point, point.size() + 1);
+  }
   for (const auto& method : methods) {
-    max = std::max(max, method.size());
+    max = std::max(max, method.size() + max_sweep_point);
   }
   return max;
 }
@@ -64,8 +68,14 @@ struct ColumnDescriptor {
   uint32_t precision;
   ColumnType type;
   bool more;  // Whether to print only if more_columns is enabled
+  bool energy = false;  // Whether to print only if energy_counters is enabled
 };
 
+bool IsPrinted(const ColumnDescriptor& descriptor) {
+  return (Args()->more_columns || !descriptor.more) &&
+         (Args()->energy_counters || !descriptor.energy);
+}
+
 ColumnDescriptor ExtraMetricDescriptor() {
   ColumnDescriptor d{{"DO NOT USE"}, 12, 4, TYPE_POSITIVE_FLOAT, false};
   return d;
@@ -85,6 +95,8 @@ std::vector<ColumnDescriptor> GetColumnDescriptors(size_t num_extra_metrics) {
       {{"BPP"},            13,  7, TYPE_POSITIVE_FLOAT, false},
       {{"E MP/s"},          8,  3, TYPE_POSITIVE_FLOAT, false},
       {{"D MP/s"},          8,  3, TYPE_POSITIVE_FLOAT, false},
+      {{"E J/MP"},          9,  3, TYPE_POSITIVE_FLOAT, false, true},
+      {{"D J/MP"},          9,  3, TYPE_POSITIVE_FLOAT, false, true},
       {{"Max norm"},       13,  8, TYPE_POSITIVE_FLOAT, false},
       {{"SSIMULACRA2"},    13,  8, TYPE_POSITIVE_FLOAT, false},
       {{"PSNR"},            7,  2, TYPE_POSITIVE_FLOAT, false},
@@ -108,6 +120,51 @@ double ComputeSpeed(size_t pixels, double time_s) {
   return pixels * 1E-6 / time_s;
 }
 
+// Computes energy [joules/megapixel] as reported in the report table
+double ComputeEnergy(size_t pixels, double energy_j) {
+  if (pixels == 0) return 0;
+  return energy_j / (pixels * 1E-6);
+}
+
+double PearsonCorrelation(const std::vector<double>& a,
+                          const std::vector<double>& b) {
+  const size_t n = a.size();
+  double mean_a = 0.0;
+  double mean_b = 0.0;
+  for (size_t i = 0; i < n; ++i) {
+    mean_a += a[i] / n;
+    mean_b += b[i] / n;
+  }
+  double cov = 0.0;
+  double var_a = 0.0;
+  double var_b = 0.0;
+  for (size_t i = 0; i < n; ++i) {
+    cov += (a[i] - mean_a) * (b[i] - mean_b);
+    var_a += (a[i] - mean_a) * (a[i] - mean_a);
+    var_b += (b[i] - mean_b) * (b[i] - mean_b);
+  }
+  if (var_a == 0.0 || var_b == 0.0) return 0.0;
+  return cov / std::sqrt(var_a * var_b);
+}
+
+// Returns the ranks of the values, tied values get their average rank.
+std::vector<double> Ranks(const std::vector<double>& values) {
+  std::vector<size_t> order(values.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::sort(order.begin(), order.end(),
+            [&](size_t a, size_t b) { return values[a] < values[b]; });
+  std::vector<double> ranks(values.size());
+  for (size_t i = 0; i < order.size();) {
+    size_t end = i + 1;
+    while (end < order.size() && values[order[end]] == values[order[i]]) {
+      ++end;
+    }
+    for (size_t j = i; j < end; ++j) ranks[order[j]] = 0.5 * (i + end - 1);
+    i = end;
+  }
+  return ranks;
+}
+
 std::string FormatFloat(const ColumnDescriptor& label, double value) {
   std::string result =
       StringPrintf("%*.*f", label.width - 1, label.precision, value);
@@ -136,6 +193,14 @@ std::string StringPrintf(const char* format, ...) {
   return std::string(buf);
 }
 
+void CodecMemoryStats::Assimilate(const CodecMemoryStats& victim) {
+  peak_bytes = std::max(peak_bytes, victim.peak_bytes);
+  permanent_peak_bytes =
+      std::max(permanent_peak_bytes, victim.permanent_peak_bytes);
+  image_peak_bytes = std::max(image_peak_bytes, victim.image_peak_bytes);
+  num_allocations += victim.num_allocations;
+}
+
 void BenchmarkStats::Assimilate(const BenchmarkStats& victim) {
   total_input_files += victim.total_input_files;
   total_input_pixels += victim.total_input_pixels;
@@ -143,6 +208,8 @@ void BenchmarkStats::Assimilate(const BenchmarkStats& victim) {
   total_adj_compressed_size += victim.total_adj_compressed_size;
   total_time_encode += victim.total_time_encode;
   total_time_decode += victim.total_time_decode;
+  total_energy_encode += victim.total_energy_encode;
+  total_energy_decode += victim.total_energy_decode;
   max_distance += pow(victim.max_distance, 2.0) * victim.total_input_pixels;
   distance_p_norm += victim.distance_p_norm;
   ssimulacra2 += victim.ssimulacra2;
@@ -152,6 +219,11 @@ void BenchmarkStats::Assimilate(const BenchmarkStats& victim) {
   pnorms.insert(pnorms.end(), victim.pnorms.begin(), victim.pnorms.end());
   ssimulacra2s.insert(ssimulacra2s.end(), victim.ssimulacra2s.begin(),
                       victim.ssimulacra2s.end());
+  approximate_distances.insert(approximate_distances.end(),
+                               victim.approximate_distances.begin(),
+                               victim.approximate_distances.end());
+  time_butteraugli += victim.time_butteraugli;
+  time_approximate_butteraugli += victim.time_approximate_butteraugli;
   total_errors += victim.total_errors;
   if (extra_metrics.size() < victim.extra_metrics.size()) {
     extra_metrics.resize(victim.extra_metrics.size());
@@ -159,6 +231,10 @@ void BenchmarkStats::Assimilate(const BenchmarkStats& victim) {
   for (size_t i = 0; i < victim.extra_metrics.size(); i++) {
     extra_metrics[i] += victim.extra_metrics[i];
   }
+  enc_memory.Assimilate(victim.enc_memory);
+  dec_memory.Assimilate(victim.dec_memory);
+  enc_stages.Assimilate(victim.enc_stages);
+  dec_stages.Assimilate(victim.dec_stages);
 }
 
 ::jxl::Status BenchmarkStats::PrintMoreStats() const {
@@ -166,6 +242,10 @@ void BenchmarkStats::Assimilate(const BenchmarkStats& victim) {
     const auto& descriptors = GetColumnDescriptors(0);
     int spaces = 0;
     for (int i = 0; i < 4; i++) spaces += descriptors[i].width;
+    // The percentiles are aligned with the Max norm column.
+    for (int i = 6; i < 8; i++) {
+      if (IsPrinted(descriptors[i])) spaces += descriptors[i].width;
+    }
     JXL_ENSURE(distances.size() == pnorms.size());
     JXL_ENSURE(distances.size() == ssimulacra2s.size());
     std::vector<float> sorted = distances;
@@ -196,6 +276,32 @@ void BenchmarkStats::Assimilate(const BenchmarkStats& victim) {
              sorted3[p5idx], sorted2[p95idx]);
     }
   }
+  const auto print_memory = [](const char* name, const CodecMemoryStats& m) {
+    if (m.num_allocations == 0) return;
+    printf("%s memory: peak %.3f MB (permanent %.3f MB, image %.3f MB), %" PRIuS
+           " allocations\n",
+           name, m.peak_bytes * 1e-6, m.permanent_peak_bytes * 1e-6,
+           m.image_peak_bytes * 1e-6, m.num_allocations);
+  };
+  print_memory("Encoder", enc_memory);
+  print_memory("Decoder", dec_memory);
+  if (approximate_distances.size() > 1) {
+    std::vector<double> full;
+    std::vector<double> approximate;
+    for (const auto& distances : approximate_distances) {
+      full.push_back(distances.first);
+      approximate.push_back(distances.second);
+    }
+    printf("Approximate butteraugli over %" PRIuS
+           " images: Pearson %.4f, Spearman %.4f, %.2fx faster\n",
+           full.size(), PearsonCorrelation(full, approximate),
+           PearsonCorrelation(Ranks(full), Ranks(approximate)),
+           time_approximate_butteraugli > 0
+               ? time_butteraugli / time_approximate_butteraugli
+               : 0.0);
+  }
+  enc_stages.Print("Encoder");
+  dec_stages.Print("Decoder");
   return true;
 }
 
@@ -226,15 +332,17 @@ std::vector<ColumnValue> BenchmarkStats::ComputeColumns(
   values[3].f = comp_bpp;
   values[4].f = compression_speed;
   values[5].f = decompression_speed;
-  values[6].f = static_cast<double>(max_distance_avg);
-  values[7].f = ssimulacra2_avg;
-  values[8].f = psnr_avg;
-  values[9].f = p_norm_avg;
-  values[10].f = bpp_p_norm;
-  values[11].f = adj_comp_bpp;
-  values[12].i = total_errors;
+  values[6].f = ComputeEnergy(total_input_pixels, total_energy_encode);
+  values[7].f = ComputeEnergy(total_input_pixels, total_energy_decode);
+  values[8].f = static_cast<double>(max_distance_avg);
+  values[9].f = ssimulacra2_avg;
+  values[10].f = psnr_avg;
+  values[11].f = p_norm_avg;
+  values[12].f = bpp_p_norm;
+  values[13].f = adj_comp_bpp;
+  values[14].i = total_errors;
   for (size_t i = 0; i < extra_metrics.size(); i++) {
-    values[13 + i].f = extra_metrics[i] / total_input_files;
+    values[15 + i].f = extra_metrics[i] / total_input_files;
   }
   return values;
 }
@@ -245,7 +353,7 @@ static std::string PrintFormattedEntries(
 
   std::string out;
   for (size_t i = 0; i < descriptors.size(); i++) {
-    if (!Args()->more_columns && descriptors[i].more) continue;
+    if (!IsPrinted(descriptors[i])) continue;
     std::string value;
     if (descriptors[i].type == TYPE_STRING) {
       value = values[i].s;
@@ -281,7 +389,7 @@ std::string BenchmarkStats::PrintLine(const std::string& codec_desc) const {
   // Extra metrics are handled separately.
   const auto& descriptors = GetColumnDescriptors(0);
   for (size_t i = 0; i < descriptors.size(); i++) {
-    if (!Args()->more_columns && descriptors[i].more) continue;
+    if (!IsPrinted(descriptors[i])) continue;
     const std::string& label = descriptors[i].label;
     int numspaces = descriptors[i].width - label.size();
     // All except the first one are right-aligned.
@@ -297,7 +405,7 @@ std::string BenchmarkStats::PrintLine(const std::string& codec_desc) const {
   }
   out += '\n';
   for (const auto& descriptor : descriptors) {
-    if (!Args()->more_columns && descriptor.more) continue;
+    if (!IsPrinted(descriptor)) continue;
     out += std::string(descriptor.width, '-');
   }
   out += std::string(ExtraMetricDescriptor().width * extra_metrics_names.size(),
@@ -349,7 +457,7 @@ std::string BenchmarkStats::PrintLine(const std::string& codec_desc) const {
     double geomean = numvalid ? std::exp2(logsum / numvalid) : 0.0;
 
     // ssimulacra2 can get negative, so use arithmetic mean instead
-    if (i == 7) {
+    if (descriptors[i].label == "SSIMULACRA2") {
       geomean = 0;
       for (const auto& column : aggregate) {
         geomean += column[i].f;
@@ -9,9 +9,11 @@
 
 #include <cstddef>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "lib/base/status.h"
+#include "tools/jpegli_stage_stats.h"
 
 namespace jpegxl {
 namespace tools {
@@ -26,6 +28,18 @@ struct ColumnValue {
   double f;       // for TYPE_POSITIVE_FLOAT
 };
 
+// Memory usage of a codec that reports it, e.g. the jpegli codec, see
+// jpegli_get_memory_stats().
+struct CodecMemoryStats {
+  // Keeps the largest peaks and adds up the allocations.
+  void Assimilate(const CodecMemoryStats& victim);
+
+  size_t peak_bytes = 0;
+  size_t permanent_peak_bytes = 0;
+  size_t image_peak_bytes = 0;
+  size_t num_allocations = 0;
+};
+
 struct BenchmarkStats {
   void Assimilate(const BenchmarkStats& victim);
 
@@ -41,6 +55,9 @@ struct BenchmarkStats {
   size_t total_adj_compressed_size = 0;
   double total_time_encode = 0.0;
   double total_time_decode = 0.0;
+  // Energy in joules of one encoding and decoding, with --energy_counters.
+  double total_energy_encode = 0.0;
+  double total_energy_decode = 0.0;
   float max_distance = -1.0;  // Max butteraugli score
   // sum of 8th powers of butteraugli distmap pixels.
   double distance_p_norm = 0.0;
@@ -49,8 +66,18 @@ struct BenchmarkStats {
   std::vector<float> distances;
   std::vector<float> pnorms;
   std::vector<float> ssimulacra2s;
+  // Full and approximate butteraugli distance of each image, and the time
+  // spent on computing them, with --approximate_butteraugli.
+  std::vector<std::pair<float, float>> approximate_distances;
+  double time_butteraugli = 0.0;
+  double time_approximate_butteraugli = 0.0;
   size_t total_errors = 0;
   std::vector<float> extra_metrics;
+  CodecMemoryStats enc_memory;
+  CodecMemoryStats dec_memory;
+  // Recorded by the jpegli codec with --perf_counters.
+  JpegliStageTotals enc_stages;
+  JpegliStageTotals dec_stages;
 };
 
 ::jxl::StatusOr<std::string> PrintHeader(
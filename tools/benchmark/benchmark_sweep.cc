@@ -0,0 +1,208 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "tools/benchmark/benchmark_sweep.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "lib/base/printf_macros.h"
+#include "tools/benchmark/benchmark_args.h"
+#include "tools/benchmark/benchmark_stats.h"
+
+namespace jpegxl {
+namespace tools {
+
+namespace {
+
+// Least squares fit of y with a polynomial in u = (x - offset) / scale, which
+// keeps the normal equations well conditioned.
+struct Polynomial {
+  double offset;
+  double scale;
+  std::vector<double> coeffs;
+
+  // Returns the integral of the polynomial over [x0, x1].
+  double Integral(double x0, double x1) const {
+    const auto antiderivative = [this](double x) {
+      const double u = (x - offset) / scale;
+      double sum = 0.0;
+      double power = u;
+      for (size_t i = 0; i < coeffs.size(); ++i) {
+        sum += coeffs[i] * power / (i + 1);
+        power *= u;
+      }
+      return sum * scale;
+    };
+    return antiderivative(x1) - antiderivative(x0);
+  }
+};
+
+bool FitPolynomial(const std::vector<double>& x, const std::vector<double>& y,
+                   Polynomial* poly) {
+  const size_t n = x.size();
+  const auto minmax = std::minmax_element(x.begin(), x.end());
+  if (n < 2 || *minmax.first == *minmax.second) return false;
+  poly->offset = 0.5 * (*minmax.first + *minmax.second);
+  poly->scale = 0.5 * (*minmax.second - *minmax.first);
+  const size_t num_coeffs = std::min<size_t>(n, 4);
+  // Normal equations, with the right hand side in the last column.
+  std::vector<std::vector<double>> a(num_coeffs,
+                                     std::vector<double>(num_coeffs + 1));
+  for (size_t k = 0; k < n; ++k) {
+    const double u = (x[k] - poly->offset) / poly->scale;
+    std::vector<double> powers(2 * num_coeffs, 1.0);
+    for (size_t i = 1; i < powers.size(); ++i) powers[i] = powers[i - 1] * u;
+    for (size_t i = 0; i < num_coeffs; ++i) {
+      for (size_t j = 0; j < num_coeffs; ++j) a[i][j] += powers[i + j];
+      a[i][num_coeffs] += powers[i] * y[k];
+    }
+  }
+  // Gaussian elimination with partial pivoting.
+  for (size_t col = 0; col < num_coeffs; ++col) {
+    size_t pivot = col;
+    for (size_t row = col + 1; row < num_coeffs; ++row) {
+      if (std::abs(a[row][col]) > std::abs(a[pivot][col])) pivot = row;
+    }
+    if (std::abs(a[pivot][col]) < 1e-12) return false;
+    std::swap(a[col], a[pivot]);
+    for (size_t row = 0; row < num_coeffs; ++row) {
+      if (row == col) continue;
+      const double factor = a[row][col] / a[col][col];
+      for (size_t j = col; j <= num_coeffs; ++j) {
+        a[row][j] -= factor * a[col][j];
+      }
+    }
+  }
+  poly->coeffs.resize(num_coeffs);
+  for (size_t i = 0; i < num_coeffs; ++i) {
+    poly->coeffs[i] = a[i][num_coeffs] / a[i][i];
+  }
+  return true;
+}
+
+std::vector<double> LogRates(const std::vector<double>& rates) {
+  std::vector<double> result;
+  for (double rate : rates) result.push_back(std::log(rate));
+  return result;
+}
+
+}  // namespace
+
+bool BjontegaardDeltaRate(const std::vector<double>& reference_rates,
+                          const std::vector<double>& reference_qualities,
+                          const std::vector<double>& test_rates,
+                          const std::vector<double>& test_qualities,
+                          double* delta_rate) {
+  for (const auto* rates : {&reference_rates, &test_rates}) {
+    for (double rate : *rates) {
+      if (!(rate > 0.0)) return false;
+    }
+  }
+  Polynomial reference;
+  Polynomial test;
+  if (!FitPolynomial(reference_qualities, LogRates(reference_rates),
+                     &reference) ||
+      !FitPolynomial(test_qualities, LogRates(test_rates), &test)) {
+    return false;
+  }
+  const double lo =
+      std::max(*std::min_element(reference_qualities.begin(),
+                                 reference_qualities.end()),
+               *std::min_element(test_qualities.begin(), test_qualities.end()));
+  const double hi =
+      std::min(*std::max_element(reference_qualities.begin(),
+                                 reference_qualities.end()),
+               *std::max_element(test_qualities.begin(), test_qualities.end()));
+  if (!(hi > lo)) return false;
+  const double log_ratio =
+      (test.Integral(lo, hi) - reference.Integral(lo, hi)) / (hi - lo);
+  *delta_rate = std::exp(log_ratio) - 1.0;
+  return true;
+}
+
+void PrintSweepReport(const std::vector<std::string>& codecs,
+                      const std::vector<std::string>& points,
+                      const std::vector<BenchmarkStats>& stats) {
+  // Indices of the columns of BenchmarkStats::ComputeColumns().
+  constexpr size_t kBPP = 3;
+  struct Metric {
+    const char* name;
+    size_t column;
+  };
+  const Metric metrics[] = {
+      {"Max norm", 8}, {"SSIMULACRA2", 9}, {"PSNR", 10}, {"pnorm", 11}};
+
+  // Rates, metric values and times of each codec over the points.
+  struct Curve {
+    std::vector<double> rates;
+    std::vector<std::vector<double>> qualities;
+    double time_encode = 0.0;
+    double time_decode = 0.0;
+  };
+  std::vector<Curve> curves(codecs.size());
+  for (size_t i = 0; i < codecs.size(); ++i) {
+    Curve& curve = curves[i];
+    curve.qualities.resize(sizeof(metrics) / sizeof(metrics[0]));
+    for (size_t j = 0; j < points.size(); ++j) {
+      const BenchmarkStats& s = stats[i * points.size() + j];
+      const std::vector<ColumnValue> values = s.ComputeColumns("");
+      curve.rates.push_back(values[kBPP].f);
+      for (size_t m = 0; m < curve.qualities.size(); ++m) {
+        curve.qualities[m].push_back(values[metrics[m].column].f);
+      }
+      curve.time_encode += s.total_time_encode;
+      curve.time_decode += s.total_time_decode;
+    }
+  }
+
+  size_t codec_width = 5;
+  for (const std::string& codec : codecs) {
+    codec_width = std::max(codec_width, codec.size());
+  }
+  const int width = static_cast<int>(codec_width);
+  const auto print_change = [](double value, bool valid) {
+    if (valid) {
+      printf(" %+11.2f%%", 100.0 * value);
+    } else {
+      printf(" %12s", "n/a");
+    }
+  };
+  if (Args()->markdown) printf("```\n");
+  printf("BD-rate and time change relative to %s over %" PRIuS " points\n",
+         codecs[0].c_str(), points.size());
+  printf("%-*s", width, "Codec");
+  for (const Metric& metric : metrics) printf(" %12s", metric.name);
+  printf(" %12s %12s\n", "EncTime", "DecTime");
+  printf("%s\n", std::string(codec_width + 13 * 6, '-').c_str());
+  const Curve& base = curves[0];
+  for (size_t i = 1; i < codecs.size(); ++i) {
+    const Curve& curve = curves[i];
+    printf("%-*s", width, codecs[i].c_str());
+    for (size_t m = 0; m < curve.qualities.size(); ++m) {
+      double delta_rate = 0.0;
+      bool valid =
+          BjontegaardDeltaRate(base.rates, base.qualities[m], curve.rates,
+                               curve.qualities[m], &delta_rate);
+      print_change(delta_rate, valid);
+    }
+    print_change(curve.time_encode / base.time_encode - 1.0,
+                 base.time_encode > 0);
+    print_change(curve.time_decode / base.time_decode - 1.0,
+                 base.time_decode > 0);
+    printf("\n");
+  }
+  if (Args()->markdown) printf("```\n");
+  printf("\n");
+  fflush(stdout);
+}
+
+}  // namespace tools
+}  // namespace jpegxl
@@ -0,0 +1,40 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef TOOLS_BENCHMARK_BENCHMARK_SWEEP_H_
+#define TOOLS_BENCHMARK_BENCHMARK_SWEEP_H_
+
+#include <string>
+#include <vector>
+
+#include "tools/benchmark/benchmark_stats.h"
+
+namespace jpegxl {
+namespace tools {
+
+// Returns the Bjontegaard delta rate of the rate-quality curve `test` relative
+// to `reference`, i.e. the average relative difference of the bitrate at equal
+// quality over the quality range of both curves, e.g. -0.05 if `test` needs
+// 5% fewer bits. The logarithm of the rate is fitted with a polynomial of
+// degree up to 3 in the quality. Returns false if the curves have less than
+// two points or their quality ranges do not overlap.
+bool BjontegaardDeltaRate(const std::vector<double>& reference_rates,
+                          const std::vector<double>& reference_qualities,
+                          const std::vector<double>& test_rates,
+                          const std::vector<double>& test_qualities,
+                          double* delta_rate);
+
+// Prints the BD-rate of each metric and the change of the total encoding and
+// decoding time of each codec relative to the first one. The stats are those
+// of the methods `codecs[i]:points[j]` in this order.
+void PrintSweepReport(const std::vector<std::string>& codecs,
+                      const std::vector<std::string>& points,
+                      const std::vector<BenchmarkStats>& stats);
+
+}  // namespace tools
+}  // namespace jpegxl
+
+#endif  // TOOLS_BENCHMARK_BENCHMARK_SWEEP_H_
@@ -5,11 +5,13 @@
 // https://developers.google.com/open-source/licenses/bsd
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <hwy/targets.h>
 #include <memory>
 #include <mutex>
 #include <numeric>
@@ -38,12 +40,15 @@
 #include "lib/extras/metrics.h"
 #include "lib/extras/packed_image.h"
 #include "lib/extras/packed_image_convert.h"
+#include "lib/extras/time.h"
 #include "tools/benchmark/benchmark_args.h"
 #include "tools/benchmark/benchmark_codec.h"
 #include "tools/benchmark/benchmark_file_io.h"
 #include "tools/benchmark/benchmark_stats.h"
+#include "tools/benchmark/benchmark_sweep.h"
 #include "tools/benchmark/benchmark_utils.h"
 #include "tools/cmdline.h"
+#include "tools/energy_counters.h"
 #include "tools/file_io.h"
 #include "tools/no_memory_manager.h"
 #include "tools/speed_stats.h"
@@ -51,6 +56,10 @@
 #include "tools/thread_pool_internal.h"
 #include "tools/tracking_memory_manager.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
 namespace jpegxl {
 namespace tools {
 namespace {
@@ -95,6 +104,46 @@ void PrintStats(const TrackingMemoryManager& memory_manager) {
           static_cast<double>(memory_manager.max_bytes_in_use));
 }
 
+// Resets the peak resident set size of the process to its current size, if
+// this is supported (only on Linux).
+void ResetPeakResidentBytes() {
+#if defined(__linux__)
+  FILE* f = fopen("/proc/self/clear_refs", "w");
+  if (f == nullptr) return;
+  fputs("5", f);
+  fclose(f);
+#endif
+}
+
+// Returns the peak resident set size of the process in bytes, since the last
+// ResetPeakResidentBytes() where that is supported, or 0 if it is not known.
+uint64_t PeakResidentBytes() {
+#if defined(__linux__)
+  FILE* f = fopen("/proc/self/status", "r");
+  if (f != nullptr) {
+    char line[256];
+    unsigned long long kib = 0;  // NOLINT
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f)) {
+      found = sscanf(line, "VmHWM: %llu kB", &kib) == 1;
+    }
+    fclose(f);
+    if (found) return kib * 1024;
+  }
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+  return usage.ru_maxrss;
+#else
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#else
+  return 0;
+#endif
+}
+
 Status CreateNonSRGBICCProfile(PackedPixelFile* ppf) {
   ColorEncoding color_encoding;
   JXL_RETURN_IF_ERROR(color_encoding.FromExternal(ppf->color_encoding));
@@ -125,10 +174,12 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
                   const std::vector<std::string>& extra_metrics_commands,
                   ImageCodec* codec, ThreadPool* inner_pool,
                   std::vector<uint8_t>* compressed, BenchmarkStats* s) {
-  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  JxlMemoryManager* memory_manager = jpegxl::tools::MetricsMemoryManager();
   ++s->total_input_files;
 
-  if (ppf.frames.size() != 1) {
+  // In decode_only mode the input is not loaded, only its decoded frames are
+  // counted.
+  if (!Args()->decode_only && ppf.frames.size() != 1) {
     // Multiple frames not supported.
     if (!Args()->silent_errors) {
       JXL_WARNING("multiframe input image not supported %s", filename.c_str());
@@ -141,6 +192,23 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
 
   jpegxl::tools::SpeedStats speed_stats;
   jpegxl::tools::SpeedStats::Summary summary;
+  std::unique_ptr<jpegxl::tools::EnergyCounters> energy_counters;
+  if (Args()->energy_counters) {
+    energy_counters = jxl::make_unique<jpegxl::tools::EnergyCounters>();
+  }
+  const auto start_energy = [&]() {
+    if (energy_counters) energy_counters->Start();
+  };
+  const auto stop_energy = [&]() {
+    double joules;
+    if (energy_counters && energy_counters->Stop(&joules)) {
+      speed_stats.NotifyEnergy(joules);
+    }
+  };
+  const auto energy_per_run = [&]() {
+    double joules;
+    return speed_stats.GetJoulesPerRun(&joules) ? joules : 0.0;
+  };
 
   bool valid = true;  // false if roundtrip, encoding or decoding errors occur.
 
@@ -157,6 +225,7 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
     std::string ext = FileExtension(filename);
     if (valid && !Args()->decode_only) {
       for (size_t i = 0; i < Args()->encode_reps; ++i) {
+        start_energy();
         if (codec->CanRecompressJpeg() && (ext == ".jpg" || ext == ".jpeg")) {
           std::vector<uint8_t> data_in;
           JXL_RETURN_IF_ERROR(ReadFile(filename, &data_in));
@@ -179,9 +248,11 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
             }
           }
         }
+        stop_energy();
       }
       JXL_RETURN_IF_ERROR(speed_stats.GetSummary(&summary));
       s->total_time_encode += summary.central_tendency;
+      s->total_energy_encode += energy_per_run();
     }
 
     if (valid && Args()->decode_only) {
@@ -194,6 +265,7 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
     if (valid) {
       speed_stats = jpegxl::tools::SpeedStats();
       for (size_t i = 0; i < Args()->decode_reps; ++i) {
+        start_energy();
         if (!codec->Decompress(filename, Bytes(*compressed), inner_pool, &ppf2,
                                &speed_stats)) {
           if (!Args()->silent_errors) {
@@ -204,9 +276,11 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
           }
           valid = false;
         }
+        stop_energy();
       }
       JXL_RETURN_IF_ERROR(speed_stats.GetSummary(&summary));
       s->total_time_decode += summary.central_tendency;
+      s->total_energy_decode += energy_per_run();
     }
     ppf1 = &ppf2;
   }
@@ -224,7 +298,7 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
     }
   }
 
-  if (ppf.frames.size() != ppf2.frames.size()) {
+  if (!Args()->decode_only && ppf.frames.size() != ppf2.frames.size()) {
     if (!Args()->silent_errors) {
       // Animated gifs not supported yet?
       fprintf(stderr,
@@ -252,10 +326,23 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
           (transfer_function == JXL_TRANSFER_FUNCTION_PQ)    ? 10000.f
           : (transfer_function == JXL_TRANSFER_FUNCTION_HLG) ? 1000.f
                                                              : 80.f;
+      params.tile_size = Args()->butteraugli_tile_size;
 
+      const double t0 = jxl::Now();
       distance =
           ButteraugliDistance(memory_manager, ppf, ppf2, params, &distmap,
                               inner_pool, codec->IgnoreAlpha());
+      if (Args()->approximate_butteraugli) {
+        const double t1 = jxl::Now();
+        params.approximate = true;
+        const float approximate_distance =
+            ButteraugliDistance(memory_manager, ppf, ppf2, params, nullptr,
+                                inner_pool, codec->IgnoreAlpha());
+        const double t2 = jxl::Now();
+        s->approximate_distances.emplace_back(distance, approximate_distance);
+        s->time_butteraugli += t1 - t0;
+        s->time_approximate_butteraugli += t2 - t1;
+      }
     } else {
       // TODO(veluca): re-upsample and compute proper distance.
       distance = 1e+4f;
@@ -265,13 +352,15 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
     // Update stats
     s->psnr += compressed->empty() ? 0
                                    : jxl::ComputePSNR(memory_manager, ppf, ppf2,
-                                                      *JxlGetDefaultCms()) *
+                                                      *JxlGetDefaultCms(),
+                                                      inner_pool) *
                                          input_pixels;
     JXL_ASSIGN_OR_RETURN(
         double pnorm,
         ComputeDistanceP(distmap, ButteraugliParams(), Args()->error_pnorm));
     s->distance_p_norm += pnorm * input_pixels;
-    JXL_ASSIGN_OR_RETURN(Msssim msssim, ComputeSSIMULACRA2(ppf, ppf2));
+    JXL_ASSIGN_OR_RETURN(Msssim msssim,
+                         ComputeSSIMULACRA2(ppf, ppf2, inner_pool));
     double ssimulacra2 = msssim.Score();
     s->ssimulacra2 += ssimulacra2 * input_pixels;
     s->max_distance = std::max(s->max_distance, distance);
@@ -676,6 +765,10 @@ struct StatPrinter {
         t.stats.total_input_pixels / (1000000.0 * t.stats.total_time_encode);
     const double dec_mps =
         t.stats.total_input_pixels / (1000000.0 * t.stats.total_time_decode);
+    const double enc_jpmp =
+        t.stats.total_energy_encode * 1000000.0 / t.stats.total_input_pixels;
+    const double dec_jpmp =
+        t.stats.total_energy_decode * 1000000.0 / t.stats.total_input_pixels;
     if (Args()->print_details_csv) {
       printf("%s,%s,%" PRIdS ",%" PRIdS ",%" PRIdS
              ",%.8f,%.8f,%.8f,%.8f,%.8f,%.8f,%.8f,%.8f,%.8f",
@@ -684,6 +777,9 @@ struct StatPrinter {
              t.stats.total_errors, t.stats.total_compressed_size, pixels,
              enc_mps, dec_mps, comp_bpp, t.stats.max_distance, ssimulacra2,
              psnr, p_norm, bpp_p_norm, adj_comp_bpp);
+      if (Args()->energy_counters) {
+        printf(",%.8f,%.8f", enc_jpmp, dec_jpmp);
+      }
       for (float m : t.stats.extra_metrics) {
         printf(",%.8f", m);
       }
@@ -707,6 +803,10 @@ struct StatPrinter {
           t.stats.total_errors, t.stats.total_compressed_size, pixels, enc_mps,
           dec_mps, comp_bpp, t.stats.max_distance, psnr, ssimulacra2, p_norm,
           bpp_p_norm, adj_comp_bpp);
+      if (Args()->energy_counters) {
+        printf("   enc_energy:%10.8f    dec_energy:%10.8f ", enc_jpmp,
+               dec_jpmp);
+      }
       for (size_t i = 0; i < t.stats.extra_metrics.size(); i++) {
         printf(" %s:%.8f", (*extra_metrics_names_)[i].c_str(),
                t.stats.extra_metrics[i]);
@@ -810,17 +910,18 @@ class Benchmark {
     TrackingMemoryManager memory_manager{};
     bool ok = true;
     {
-      const StringVec methods = GetMethods();
+      const StringVec codecs = GetMethods();
+      const StringVec methods = SweepMethods(codecs);
       const StringVec extra_metrics_names = GetExtraMetricsNames();
       const StringVec extra_metrics_commands = GetExtraMetricsCommands();
       const StringVec fnames = GetFilenames();
-      // (non-const because Task.stats are updated)
-      JXL_ASSIGN_OR_RETURN(std::vector<Task> tasks,
-                           CreateTasks(methods, fnames, memory_manager.get()));
+      // Without --simd_targets, only the best target is used, denoted by 0.
+      std::vector<int64_t> targets = Args()->simd_targets;
+      if (targets.empty()) targets.push_back(0);
 
       std::unique_ptr<ThreadPoolInternal> pool;
       std::vector<std::unique_ptr<ThreadPoolInternal>> inner_pools;
-      InitThreads(tasks.size(), &pool, &inner_pools);
+      InitThreads(methods.size() * fnames.size(), &pool, &inner_pools);
       if (Args()->generations > 0) {
         fprintf(stderr,
                 "Generation loss testing with %" PRIuS
@@ -829,13 +930,39 @@ class Benchmark {
       }
       std::vector<PackedPixelFile> loaded_images =
           LoadImages(fnames, pool->get());
+      if (Args()->saturation_threads > 0) {
+        return RunSaturation(methods, fnames, loaded_images);
+      }
 
-      if (RunTasks(methods, extra_metrics_names, extra_metrics_commands, fnames,
-                   loaded_images, pool->get(), inner_pools, &tasks) != 0) {
-        ok = false;
-        if (!Args()->silent_errors) {
-          fprintf(stderr, "There were error(s) in the benchmark.\n");
+      // Stats of each method with each target.
+      std::vector<std::vector<BenchmarkStats>> target_stats;
+      for (int64_t target : targets) {
+        if (target != 0) {
+          // The codecs are created for each target, since they may choose
+          // their SIMD functions once.
+          hwy::SetSupportedTargetsForTest(target);
+          fprintf(stderr, "SIMD target %s\n", hwy::TargetName(target));
         }
+        // (non-const because Task.stats are updated)
+        JXL_ASSIGN_OR_RETURN(
+            std::vector<Task> tasks,
+            CreateTasks(methods, fnames, memory_manager.get()));
+        if (RunTasks(methods, extra_metrics_names, extra_metrics_commands,
+                     fnames, loaded_images, pool->get(), inner_pools,
+                     &tasks) != 0) {
+          ok = false;
+        }
+        target_stats.push_back(MethodStats(methods.size(), tasks));
+      }
+      hwy::SetSupportedTargetsForTest(0);
+      if (!ok && !Args()->silent_errors) {
+        fprintf(stderr, "There were error(s) in the benchmark.\n");
+      }
+      if (!Args()->simd_targets.empty()) {
+        PrintTargetComparison(methods, targets, target_stats);
+      }
+      if (!Args()->sweep_points.empty() && codecs.size() > 1) {
+        PrintSweepReport(codecs, Args()->sweep_points, target_stats[0]);
       }
     }
 
@@ -893,7 +1020,8 @@ class Benchmark {
   static void InitThreads(
       size_t num_tasks, std::unique_ptr<ThreadPoolInternal>* pool,
       std::vector<std::unique_ptr<ThreadPoolInternal>>* inner_pools) {
-    const size_t num_hw_threads = std::thread::hardware_concurrency();
+    const size_t num_hw_threads =
+        JxlThreadParallelRunnerDefaultNumWorkerThreads();
     const size_t num_threads = NumOuterThreads(num_hw_threads, num_tasks);
     const size_t num_inner = NumInnerThreads(num_hw_threads, num_threads);
 
@@ -910,6 +1038,190 @@ class Benchmark {
     }
   }
 
+  struct SaturationLevel {
+    size_t num_threads;
+    size_t num_tasks;
+    size_t num_errors;
+    double seconds;
+    double megapixels;
+    // Encode and decode time of each successful task.
+    std::vector<double> latencies;
+    uint64_t max_bytes_in_use;
+    uint64_t peak_resident_bytes;
+  };
+
+  // Returns the nearest-rank p-quantile of the values.
+  static double Percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(std::ceil(p * values.size()));
+    return values[std::max<size_t>(rank, 1) - 1];
+  }
+
+  // Encodes and decodes each image with each method on num_threads threads
+  // concurrently, with one codec instance and no inner threads per task.
+  static StatusOr<SaturationLevel> RunSaturationLevel(
+      const StringVec& methods, const StringVec& fnames,
+      const std::vector<PackedPixelFile>& images, size_t num_threads) {
+    TrackingMemoryManager memory_manager{};
+    const size_t num_pairs = methods.size() * fnames.size();
+    // At least four tasks per thread, so that the threads are busy for most
+    // of the time of the level.
+    const size_t num_tasks =
+        num_pairs * jxl::DivCeil(4 * num_threads, num_pairs);
+    std::vector<double> latencies(num_tasks, -1.0);
+    std::vector<size_t> pixels(num_tasks, 0);
+    std::atomic<size_t> num_errors{0};
+    ThreadPoolInternal pool(num_threads == 1 ? 0 : num_threads);
+    std::vector<std::unique_ptr<ThreadPoolInternal>> inner_pools;
+    const auto init = [&](const size_t num_workers) -> Status {
+      while (inner_pools.size() < num_workers) {
+        inner_pools.emplace_back(new ThreadPoolInternal(0));
+      }
+      return true;
+    };
+    const auto do_task = [&](const uint32_t i, const size_t thread) -> Status {
+      const size_t idx_method = i % methods.size();
+      const size_t idx_image = (i / methods.size()) % fnames.size();
+      const PackedPixelFile& ppf = images[idx_image];
+      ImageCodecPtr codec =
+          CreateImageCodec(methods[idx_method], memory_manager.get());
+      ThreadPool* inner_pool = inner_pools[thread]->get();
+      std::vector<uint8_t> compressed;
+      PackedPixelFile decoded;
+      SpeedStats speed_stats;
+      const double start = jxl::Now();
+      if (!codec->Compress(fnames[idx_image], ppf, inner_pool, &compressed,
+                           &speed_stats) ||
+          !codec->Decompress(fnames[idx_image], Bytes(compressed), inner_pool,
+                             &decoded, &speed_stats)) {
+        ++num_errors;
+        return true;
+      }
+      latencies[i] = jxl::Now() - start;
+      pixels[i] = ppf.info.xsize * ppf.info.ysize;
+      return true;
+    };
+    ResetPeakResidentBytes();
+    const double start = jxl::Now();
+    JPEGXL_TOOLS_CHECK(jxl::RunOnPool(pool.get(), 0, num_tasks, init, do_task,
+                                      "Saturation tasks"));
+    SaturationLevel level;
+    level.num_threads = num_threads;
+    level.num_tasks = num_tasks;
+    level.num_errors = num_errors.load();
+    level.seconds = jxl::Now() - start;
+    level.peak_resident_bytes = PeakResidentBytes();
+    level.max_bytes_in_use = memory_manager.max_bytes_in_use;
+    level.megapixels = 0.0;
+    for (size_t i = 0; i < num_tasks; ++i) {
+      if (latencies[i] < 0) continue;
+      level.latencies.push_back(latencies[i]);
+      level.megapixels += pixels[i] * 1e-6;
+    }
+    return level;
+  }
+
+  // Prints the aggregate encode and decode throughput, its scaling relative to
+  // one thread, the per image latency percentiles and the memory high-water
+  // marks with 1, 2, 4, ... up to --saturation_threads concurrent threads.
+  static Status RunSaturation(const StringVec& methods, const StringVec& fnames,
+                              const std::vector<PackedPixelFile>& images) {
+    std::vector<size_t> levels;
+    for (size_t n = 1; n < Args()->saturation_threads; n *= 2) {
+      levels.push_back(n);
+    }
+    levels.push_back(Args()->saturation_threads);
+    if (Args()->markdown) printf("```\n");
+    printf("%7s %6s %6s %9s %8s %6s %9s %9s %10s %10s\n", "Threads", "Tasks",
+           "Errors", "MP/s", "Speedup", "Eff", "p50 ms", "p99 ms",
+           "MaxMem MB", "PeakRSS MB");
+    printf("%s\n", std::string(89, '-').c_str());
+    fflush(stdout);
+    double base_mps = 0.0;
+    size_t num_errors = 0;
+    for (size_t num_threads : levels) {
+      JXL_ASSIGN_OR_RETURN(
+          SaturationLevel level,
+          RunSaturationLevel(methods, fnames, images, num_threads));
+      num_errors += level.num_errors;
+      const double mps = level.seconds > 0 ? level.megapixels / level.seconds
+                                           : 0.0;
+      if (base_mps == 0.0) base_mps = mps;
+      const double speedup = base_mps > 0 ? mps / base_mps : 0.0;
+      printf("%7" PRIuS " %6" PRIuS " %6" PRIuS
+             " %9.3f %7.2fx %5.1f%% %9.2f %9.2f %10.1f %10.1f\n",
+             level.num_threads, level.num_tasks, level.num_errors, mps, speedup,
+             100.0 * speedup / num_threads,
+             1e3 * Percentile(level.latencies, 0.5),
+             1e3 * Percentile(level.latencies, 0.99),
+             level.max_bytes_in_use / 1048576.0,
+             level.peak_resident_bytes / 1048576.0);
+      fflush(stdout);
+    }
+    if (Args()->markdown) printf("```\n");
+    printf("\n");
+    if (num_errors != 0) {
+      if (!Args()->silent_errors) {
+        fprintf(stderr, "There were error(s) in the benchmark.\n");
+      }
+      return JXL_FAILURE("RunSaturation error");
+    }
+    return true;
+  }
+
+  static std::vector<BenchmarkStats> MethodStats(
+      size_t num_methods, const std::vector<Task>& tasks) {
+    std::vector<BenchmarkStats> stats(num_methods);
+    for (const Task& t : tasks) {
+      stats[t.idx_method].Assimilate(t.stats);
+    }
+    return stats;
+  }
+
+  // Prints the compressed size and the speed of each method with each of the
+  // SIMD targets, and their ratio to those with the first target.
+  static void PrintTargetComparison(
+      const StringVec& methods, const std::vector<int64_t>& targets,
+      const std::vector<std::vector<BenchmarkStats>>& target_stats) {
+    const auto mps = [](const BenchmarkStats& stats, double time) {
+      return time > 0 ? stats.total_input_pixels / (1000000.0 * time) : 0.0;
+    };
+    const auto ratio = [](double value, double base) {
+      return base > 0 ? value / base : 0.0;
+    };
+    size_t method_width = 6;
+    for (const std::string& method : methods) {
+      method_width = std::max(method_width, method.size());
+    }
+    const int width = static_cast<int>(method_width);
+    if (Args()->markdown) printf("```\n");
+    printf("%-*s %-8s %12s %9s %9s %7s %9s %7s\n", width, "Method", "Target",
+           "Compressed", "SizeDiff", "EncMP/s", "EncX", "DecMP/s", "DecX");
+    printf("%s\n", std::string(method_width + 68, '-').c_str());
+    for (size_t i = 0; i < methods.size(); ++i) {
+      const BenchmarkStats& base = target_stats[0][i];
+      const double base_enc = mps(base, base.total_time_encode);
+      const double base_dec = mps(base, base.total_time_decode);
+      for (size_t t = 0; t < targets.size(); ++t) {
+        const BenchmarkStats& stats = target_stats[t][i];
+        const double enc = mps(stats, stats.total_time_encode);
+        const double dec = mps(stats, stats.total_time_decode);
+        const double size_diff =
+            100.0 * (ratio(stats.total_compressed_size,
+                           base.total_compressed_size) -
+                     1.0);
+        printf("%-*s %-8s %12" PRIuS " %+8.3f%% %9.3f %6.2fx %9.3f %6.2fx\n",
+               width, methods[i].c_str(), hwy::TargetName(targets[t]),
+               stats.total_compressed_size, size_diff, enc,
+               ratio(enc, base_enc), dec, ratio(dec, base_dec));
+      }
+    }
+    if (Args()->markdown) printf("```\n");
+    printf("\n");
+    fflush(stdout);
+  }
+
   static StringVec GetMethods() {
     StringVec methods = SplitString(Args()->codec, ',');
     for (auto it = methods.begin(); it != methods.end();) {
@@ -922,6 +1234,19 @@ class Benchmark {
     return methods;
   }
 
+  // Returns the methods of each codec with each point of --sweep, or the codecs
+  // if it is not used.
+  static StringVec SweepMethods(const StringVec& codecs) {
+    if (Args()->sweep_points.empty()) return codecs;
+    StringVec methods;
+    for (const std::string& codec : codecs) {
+      for (const std::string& point : Args()->sweep_points) {
+        methods.push_back(codec + ":" + point);
+      }
+    }
+    return methods;
+  }
+
   static StringVec GetExtraMetricsNames() {
     StringVec metrics = SplitString(Args()->extra_metrics, ',');
     for (auto it = metrics.begin(); it != metrics.end();) {
@@ -974,10 +1299,10 @@ class Benchmark {
       Status ret = true;
 
       if (!Args()->decode_only) {
-        std::vector<uint8_t> encoded;
-        ret = ReadFile(fnames[i], &encoded);
+        InputBytes encoded;
+        ret = encoded.Open(fnames[i]);
         if (ret) {
-          ret = jxl::extras::DecodeBytes(Bytes(encoded), Args()->color_hints,
+          ret = jxl::extras::DecodeBytes(encoded.bytes(), Args()->color_hints,
                                          &loaded_images[i]);
         }
         if (ret && loaded_images[i].icc.empty()) {
@@ -1039,6 +1364,7 @@ class Benchmark {
       printf(
           "method,image,error,size,pixels,enc_speed,dec_speed,"
           "bpp,maxnorm,ssimulacra2,psnr,pnorm,bppp,qabpp");
+      if (Args()->energy_counters) printf(",enc_energy,dec_energy");
       for (const std::string& s : extra_metrics_names) {
         printf(",%s", s.c_str());
       }
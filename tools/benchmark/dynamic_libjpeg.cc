@@ -0,0 +1,262 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "tools/benchmark/dynamic_libjpeg.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lib/base/include_jpeglib.h"
+#include "lib/base/status.h"
+#include "lib/extras/packed_image.h"
+#include "lib/extras/time.h"
+
+// Not supported on Windows and Emscripten, which have no dlopen().
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <dlfcn.h>
+#define JPEGXL_TOOLS_HAS_DLOPEN 1
+#else
+#define JPEGXL_TOOLS_HAS_DLOPEN 0
+#endif
+
+namespace jpegxl {
+namespace tools {
+
+// The functions of the loaded library, with the signatures of the jpeglib.h
+// that the tools are compiled with.
+struct DynamicLibjpeg::Api {
+  decltype(&jpeg_std_error) std_error;
+  decltype(&jpeg_CreateCompress) create_compress;
+  decltype(&jpeg_mem_dest) mem_dest;
+  decltype(&jpeg_set_defaults) set_defaults;
+  decltype(&jpeg_set_quality) set_quality;
+  decltype(&jpeg_simple_progression) simple_progression;
+  decltype(&jpeg_start_compress) start_compress;
+  decltype(&jpeg_write_m_header) write_m_header;
+  decltype(&jpeg_write_m_byte) write_m_byte;
+  decltype(&jpeg_write_scanlines) write_scanlines;
+  decltype(&jpeg_finish_compress) finish_compress;
+  decltype(&jpeg_destroy_compress) destroy_compress;
+};
+
+namespace {
+
+constexpr unsigned char kICCSignature[12] = {
+    0x49, 0x43, 0x43, 0x5F, 0x50, 0x52, 0x4F, 0x46, 0x49, 0x4C, 0x45, 0x00};
+constexpr int kICCMarker = JPEG_APP0 + 2;
+constexpr size_t kMaxIccBytesInMarker = 65533 - sizeof kICCSignature - 2;
+
+struct ErrorManager {
+  jpeg_error_mgr pub;
+  jmp_buf env;
+};
+
+void ErrorExit(j_common_ptr cinfo) {
+  longjmp(reinterpret_cast<ErrorManager*>(cinfo->err)->env, 1);
+}
+
+void OutputMessage(j_common_ptr cinfo) {}
+
+#if JPEGXL_TOOLS_HAS_DLOPEN
+template <typename T>
+jxl::Status LoadSymbol(void* handle, const char* name, T* function) {
+  *function = reinterpret_cast<T>(dlsym(handle, name));
+  if (*function == nullptr) {
+    return JXL_FAILURE("%s not found in the jpeg library", name);
+  }
+  return true;
+}
+#endif
+
+// Returns the sampling factors of the luma component for the chroma
+// subsampling mode, or 0 for the default of the library.
+jxl::Status ParseChromaSubsampling(const std::string& subsampling,
+                                   int* h_samp, int* v_samp) {
+  if (subsampling.empty()) {
+    *h_samp = *v_samp = 0;
+  } else if (subsampling == "444") {
+    *h_samp = *v_samp = 1;
+  } else if (subsampling == "420") {
+    *h_samp = *v_samp = 2;
+  } else if (subsampling == "422") {
+    *h_samp = 2;
+    *v_samp = 1;
+  } else if (subsampling == "440") {
+    *h_samp = 1;
+    *v_samp = 2;
+  } else {
+    return JXL_FAILURE("Unsupported chroma subsampling %s",
+                       subsampling.c_str());
+  }
+  return true;
+}
+
+}  // namespace
+
+jxl::StatusOr<std::unique_ptr<DynamicLibjpeg>> DynamicLibjpeg::Load(
+    const std::string& path) {
+#if JPEGXL_TOOLS_HAS_DLOPEN
+  std::unique_ptr<DynamicLibjpeg> lib(new DynamicLibjpeg());
+  int flags = RTLD_NOW | RTLD_LOCAL;
+#ifdef RTLD_DEEPBIND
+  // The calls within the library go to its own functions, not to the ones of
+  // the same name in the jpeg library of the process.
+  if (!path.empty()) flags |= RTLD_DEEPBIND;
+#endif
+  lib->handle_ = dlopen(path.empty() ? nullptr : path.c_str(), flags);
+  if (lib->handle_ == nullptr) {
+    return JXL_FAILURE("Could not load %s: %s", path.c_str(), dlerror());
+  }
+  lib->api_.reset(new Api());
+  Api* api = lib->api_.get();
+  void* handle = lib->handle_;
+  JXL_RETURN_IF_ERROR(LoadSymbol(handle, "jpeg_std_error", &api->std_error));
+  JXL_RETURN_IF_ERROR(
+      LoadSymbol(handle, "jpeg_CreateCompress", &api->create_compress));
+  JXL_RETURN_IF_ERROR(LoadSymbol(handle, "jpeg_mem_dest", &api->mem_dest));
+  JXL_RETURN_IF_ERROR(
+      LoadSymbol(handle, "jpeg_set_defaults", &api->set_defaults));
+  JXL_RETURN_IF_ERROR(
+      LoadSymbol(handle, "jpeg_set_quality", &api->set_quality));
+  JXL_RETURN_IF_ERROR(LoadSymbol(handle, "jpeg_simple_progression",
+                                 &api->simple_progression));
+  JXL_RETURN_IF_ERROR(
+      LoadSymbol(handle, "jpeg_start_compress", &api->start_compress));
+  JXL_RETURN_IF_ERROR(
+      LoadSymbol(handle, "jpeg_write_m_header", &api->write_m_header));
+  JXL_RETURN_IF_ERROR(
+      LoadSymbol(handle, "jpeg_write_m_byte", &api->write_m_byte));
+  JXL_RETURN_IF_ERROR(
+      LoadSymbol(handle, "jpeg_write_scanlines", &api->write_scanlines));
+  JXL_RETURN_IF_ERROR(
+      LoadSymbol(handle, "jpeg_finish_compress", &api->finish_compress));
+  JXL_RETURN_IF_ERROR(
+      LoadSymbol(handle, "jpeg_destroy_compress", &api->destroy_compress));
+  return lib;
+#else
+  return JXL_FAILURE("Loading jpeg libraries is not supported on this build");
+#endif
+}
+
+DynamicLibjpeg::~DynamicLibjpeg() {
+#if JPEGXL_TOOLS_HAS_DLOPEN
+  if (handle_ != nullptr) dlclose(handle_);
+#endif
+}
+
+jxl::Status DynamicLibjpeg::Encode(const jxl::extras::PackedPixelFile& ppf,
+                                   const DynamicLibjpegParams& params,
+                                   std::vector<uint8_t>* compressed,
+                                   double* elapsed) const {
+  JXL_ENSURE(ppf.frames.size() == 1);
+  const jxl::extras::PackedImage& image = ppf.frames[0].color;
+  const size_t num_channels = ppf.info.num_color_channels;
+  if (image.format.data_type != JXL_TYPE_UINT8 ||
+      (num_channels != 1 && num_channels != 3)) {
+    return JXL_FAILURE("Only 8-bit gray or RGB input is supported");
+  }
+  // The alpha channel, if any, is dropped.
+  const bool has_alpha = image.format.num_channels != num_channels;
+  std::vector<uint8_t> rows_without_alpha;
+  if (has_alpha) {
+    rows_without_alpha.resize(MAX_SAMP_FACTOR * DCTSIZE * image.xsize *
+                              num_channels);
+  }
+  int h_samp;
+  int v_samp;
+  JXL_RETURN_IF_ERROR(
+      ParseChromaSubsampling(params.chroma_subsampling, &h_samp, &v_samp));
+  const Api& api = *api_;
+  const std::vector<uint8_t>& icc = ppf.icc;
+  const uint8_t* pixels = static_cast<const uint8_t*>(image.pixels());
+  jpeg_compress_struct cinfo = {};
+  ErrorManager jerr;
+  unsigned char* buffer = nullptr;
+#ifdef LIBJPEG_TURBO_VERSION
+  unsigned long size = 0;  // NOLINT
+#else
+  size_t size = 0;  // NOLINT
+#endif
+  const double start = jxl::Now();
+  cinfo.err = api.std_error(&jerr.pub);
+  jerr.pub.error_exit = &ErrorExit;
+  jerr.pub.output_message = &OutputMessage;
+  if (setjmp(jerr.env)) {
+    api.destroy_compress(&cinfo);
+    free(buffer);
+    return JXL_FAILURE("The jpeg library failed to compress the image");
+  }
+  api.create_compress(&cinfo, JPEG_LIB_VERSION, sizeof(cinfo));
+  api.mem_dest(&cinfo, &buffer, &size);
+  cinfo.image_width = image.xsize;
+  cinfo.image_height = image.ysize;
+  cinfo.input_components = num_channels;
+  cinfo.in_color_space = num_channels == 1 ? JCS_GRAYSCALE : JCS_RGB;
+  api.set_defaults(&cinfo);
+  if (h_samp > 0 && cinfo.num_components == 3) {
+    cinfo.comp_info[0].h_samp_factor = h_samp;
+    cinfo.comp_info[0].v_samp_factor = v_samp;
+    for (int c = 1; c < 3; ++c) {
+      cinfo.comp_info[c].h_samp_factor = 1;
+      cinfo.comp_info[c].v_samp_factor = 1;
+    }
+  }
+  api.set_quality(&cinfo, params.quality, TRUE);
+  if (params.progressive) {
+    api.simple_progression(&cinfo);
+  }
+  api.start_compress(&cinfo, TRUE);
+  const size_t num_icc_markers =
+      (icc.size() + kMaxIccBytesInMarker - 1) / kMaxIccBytesInMarker;
+  for (size_t i = 0, begin = 0; i < num_icc_markers; ++i) {
+    const size_t length = std::min(kMaxIccBytesInMarker, icc.size() - begin);
+    api.write_m_header(&cinfo, kICCMarker,
+                       length + sizeof kICCSignature + 2);
+    for (const unsigned char c : kICCSignature) {
+      api.write_m_byte(&cinfo, c);
+    }
+    api.write_m_byte(&cinfo, i + 1);
+    api.write_m_byte(&cinfo, num_icc_markers);
+    for (size_t j = 0; j < length; ++j) {
+      api.write_m_byte(&cinfo, icc[begin++]);
+    }
+  }
+  // The library only reads the input rows, so they are passed in place, a
+  // whole iMCU row at a time.
+  JSAMPROW rows[MAX_SAMP_FACTOR * DCTSIZE];
+  const size_t imcu_rows = cinfo.max_v_samp_factor * DCTSIZE;
+  for (size_t y0 = 0; y0 < image.ysize; y0 += imcu_rows) {
+    const size_t y1 = std::min<size_t>(y0 + imcu_rows, image.ysize);
+    for (size_t y = y0; y < y1; ++y) {
+      const uint8_t* row = pixels + y * image.stride;
+      if (has_alpha) {
+        uint8_t* out = &rows_without_alpha[(y - y0) * image.xsize *
+                                           num_channels];
+        for (size_t x = 0; x < image.xsize; ++x) {
+          std::copy_n(row + x * image.pixel_stride(), num_channels,
+                      out + x * num_channels);
+        }
+        row = out;
+      }
+      rows[y - y0] = const_cast<JSAMPROW>(row);
+    }
+    api.write_scanlines(&cinfo, rows, y1 - y0);
+  }
+  api.finish_compress(&cinfo);
+  api.destroy_compress(&cinfo);
+  *elapsed = jxl::Now() - start;
+  compressed->assign(buffer, buffer + size);
+  free(buffer);
+  return true;
+}
+
+}  // namespace tools
+}  // namespace jpegxl
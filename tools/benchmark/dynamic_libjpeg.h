@@ -0,0 +1,62 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef TOOLS_BENCHMARK_DYNAMIC_LIBJPEG_H_
+#define TOOLS_BENCHMARK_DYNAMIC_LIBJPEG_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lib/base/status.h"
+#include "lib/extras/packed_image.h"
+
+namespace jpegxl {
+namespace tools {
+
+struct DynamicLibjpegParams {
+  int quality = 90;
+  // "444", "420", "422" or "440"; empty for the default of the library.
+  std::string chroma_subsampling;
+  // Makes a progressive JPEG with jpeg_simple_progression(), otherwise the
+  // library default is kept, which is progressive for mozjpeg.
+  bool progressive = false;
+};
+
+// The compression API of a libjpeg compatible shared library, e.g. a
+// libjpeg-turbo or mozjpeg build, loaded at run time, so that it can be
+// compared in the same process, on the same buffers, with the jpeg library
+// that the tools are linked with. The library must be built with the same
+// JPEG_LIB_VERSION, which jpeg_CreateCompress() checks.
+class DynamicLibjpeg {
+ public:
+  // Loads the library at path, or, if path is empty, uses the jpeg library
+  // that the process is linked with.
+  static jxl::StatusOr<std::unique_ptr<DynamicLibjpeg>> Load(
+      const std::string& path);
+
+  ~DynamicLibjpeg();
+
+  // Compresses the 8-bit gray or RGB frame of ppf with the ICC profile of ppf,
+  // and sets *elapsed to the time spent in the library.
+  jxl::Status Encode(const jxl::extras::PackedPixelFile& ppf,
+                     const DynamicLibjpegParams& params,
+                     std::vector<uint8_t>* compressed, double* elapsed) const;
+
+  struct Api;
+
+ private:
+  DynamicLibjpeg() = default;
+
+  void* handle_ = nullptr;
+  std::unique_ptr<Api> api_;
+};
+
+}  // namespace tools
+}  // namespace jpegxl
+
+#endif  // TOOLS_BENCHMARK_DYNAMIC_LIBJPEG_H_
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <string>
 #include <vector>
@@ -14,15 +15,25 @@
 #include "lib/base/common.h"
 #include "lib/base/printf_macros.h"
 #include "lib/base/span.h"
+#include "lib/base/status.h"
 #include "lib/extras/dec/decode.h"
+#include "lib/extras/dec/exr.h"
+#include "lib/extras/dec/gif.h"
+#include "lib/extras/dec/pnm.h"
 #include "lib/extras/enc/jpegli.h"
 #include "lib/extras/packed_image.h"
 #include "lib/extras/time.h"
+#include "lib/jpegli/common.h"
+#include "lib/threads/thread_parallel_runner.h"
 #include "lib/jpegli/encode.h"
 #include "tools/args.h"
+#include "tools/batch.h"
 #include "tools/cmdline.h"
+#include "tools/energy_counters.h"
 #include "tools/file_io.h"
+#include "tools/perf_counters.h"
 #include "tools/speed_stats.h"
+#include "tools/tracking_memory_manager.h"
 
 namespace jpegxl {
 namespace tools {
@@ -37,6 +48,18 @@ struct Args {
     cmdline->AddPositionalOption("OUTPUT", /* required = */ true,
                                  "the compressed JPEG output file", &file_out);
 
+    cmdline->AddOptionValue(
+        '\0', "batch", "FILE_LIST",
+        "Compress the files of FILE_LIST, which has one INPUT<TAB>OUTPUT\n"
+        "    pair per line, in parallel instead of INPUT to OUTPUT.",
+        &batch_list, &ParseString, 1);
+
+    cmdline->AddOptionValue(
+        '\0', "num_threads", "N",
+        "Number of worker threads of --batch, or of the decoding of a single\n"
+        "    EXR input, default is one per CPU that the process may use.",
+        &num_threads, &ParseUnsigned, 1);
+
     cmdline->AddOptionFlag('\0', "disable_output",
                            "No output file will be written (for benchmarking)",
                            &disable_output, &SetBooleanTrue, 1);
@@ -47,6 +70,12 @@ struct Args {
         "    icc_pathname refers to a binary file containing an ICC profile.",
         &color_hints_proxy, &ParseAndAppendKeyValue<ColorHintsProxy>, 1);
 
+    cmdline->AddOptionValue(
+        '\0', "frame", "N",
+        "Index of the frame of an animated GIF input that is compressed,\n"
+        "    default is the first one. The rest of the file is not decoded.",
+        &frame_index, &ParseUnsigned, 1);
+
     opt_distance_id = cmdline->AddOptionValue(
         'd', "distance", "maxError",
         "Max. butteraugli distance, lower = higher quality.\n"
@@ -74,9 +103,23 @@ struct Args {
         "    Default: 2. Higher number is more scans, 0 means sequential.",
         &settings.progressive_level, &ParseSigned);
 
+    cmdline->AddOptionValue(
+        'e', "effort", "N",
+        "Encoder effort setting. Range: 1 .. 9.\n"
+        "    Higher is smaller output and slower encoding, 6 matches the\n"
+        "    defaults. Overrides --progressive_level,\n"
+        "    --noadaptive_quantization and --fixed_code.",
+        &settings.effort, &ParseSigned, 1);
+
     cmdline->AddOptionFlag('\0', "xyb", "Convert to XYB colorspace",
                            &settings.xyb, &SetBooleanTrue, 1);
 
+    cmdline->AddOptionValue(
+        '\0', "sdr_target_nits", "NITS",
+        "Tone map PQ or HLG input to SDR with this peak luminance while\n"
+        "    it is encoded, and use the sRGB transfer function for the output.",
+        &settings.sdr_target_nits, &ParseFloat, 1);
+
     cmdline->AddOptionFlag(
         '\0', "std_quant",
         "Use quantization tables based on Annex K of the JPEG standard.",
@@ -102,6 +145,12 @@ struct Args {
                             "How many times to compress. (For benchmarking).",
                             &num_reps, &ParseUnsigned, 1);
 
+    cmdline->AddOptionValue(
+        '\0', "stats_json", "FILE",
+        "Write the timing percentiles of --num_reps and the cycles and\n"
+        "    instructions per pixel to FILE as JSON.",
+        &stats_json, &ParseString, 1);
+
     cmdline->AddOptionFlag('\0', "quiet", "Suppress informative output", &quiet,
                            &SetBooleanTrue, 1);
 
@@ -113,11 +162,15 @@ struct Args {
 
   const char* file_in = nullptr;
   const char* file_out = nullptr;
+  std::string batch_list;
+  size_t num_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
   bool disable_output = false;
   ColorHintsProxy color_hints_proxy;
+  size_t frame_index = 0;
   jxl::extras::JpegSettings settings;
   int quality = 90;
   size_t num_reps = 1;
+  std::string stats_json;
   bool quiet = false;
   bool verbose = false;
   // References (ids) of specific options to check if they were matched.
@@ -144,6 +197,10 @@ bool ValidateArgs(const Args& args) {
     fprintf(stderr, "Invalid --progressive_level argument\n");
     return false;
   }
+  if (settings.effort < 0 || settings.effort > 9) {
+    fprintf(stderr, "Invalid --effort argument\n");
+    return false;
+  }
   if (settings.progressive_level > 0 && !settings.optimize_coding) {
     fprintf(stderr, "--fixed_code must be used together with -p 0\n");
     return false;
@@ -169,6 +226,101 @@ bool SetDistance(const Args& args, const CommandLineParser& cmdline,
   return true;
 }
 
+// PNM/PFM files are compressed from the (memory mapped) input bytes with
+// EncodeJpegFromPNM(), so that they are never copied to a PackedPixelFile.
+bool IsPNM(jxl::Bytes bytes) { return bytes.size() >= 2 && bytes[0] == 'P'; }
+
+// GIF files are decoded only up to the frame that is compressed.
+bool IsGIF(jxl::Bytes bytes) {
+  return bytes.size() >= 3 && memcmp(bytes.data(), "GIF", 3) == 0;
+}
+
+// Reads the input image into *ppf, which only gets the image info and color
+// encoding of PNM/PFM files.
+jxl::Status ReadInput(const Args& args, jxl::Bytes bytes,
+                      jxl::extras::PackedPixelFile* ppf) {
+  if (IsPNM(bytes)) {
+    jxl::extras::HeaderPNM header;
+    size_t pixels_offset;
+    JxlPixelFormat format;
+    return jxl::extras::DecodeHeaderPNM(bytes, args.color_hints_proxy.target,
+                                        &header, ppf, &pixels_offset, &format);
+  }
+  if (IsGIF(bytes)) {
+    return jxl::extras::DecodeImageGIFFrame(
+        bytes, args.color_hints_proxy.target, args.frame_index, ppf);
+  }
+  return jxl::extras::DecodeBytes(bytes, args.color_hints_proxy.target, ppf);
+}
+
+jxl::Status Encode(const Args& args, jxl::Bytes bytes,
+                   const jxl::extras::PackedPixelFile& ppf,
+                   std::vector<uint8_t>* jpeg_bytes) {
+  if (IsPNM(bytes)) {
+    return jxl::extras::EncodeJpegFromPNM(bytes, args.color_hints_proxy.target,
+                                          args.settings, nullptr, jpeg_bytes);
+  }
+  return jxl::extras::EncodeJpeg(ppf, args.settings, nullptr, jpeg_bytes);
+}
+
+// Returns the memory usage of a run from the stats of jpegli and of the
+// allocator of its memory blocks, which is reset for the next run.
+jxl::Status GetMemoryUsage(const jpegli_memory_stats& stats,
+                           TrackingMemoryManager* memory_manager,
+                           SpeedStats::MemoryUsage* usage) {
+  usage->peak_bytes = stats.peak_bytes;
+  usage->permanent_peak_bytes = stats.pools[JPOOL_PERMANENT].peak_bytes;
+  usage->image_peak_bytes = stats.pools[JPOOL_IMAGE].peak_bytes;
+  usage->num_allocations = stats.total_allocations;
+  usage->allocator_peak_bytes = memory_manager->max_bytes_in_use;
+  usage->allocator_num_blocks = memory_manager->total_allocations;
+  return memory_manager->Reset();
+}
+
+// Compresses one file of a --batch run. The output buffer is reused by the
+// images compressed on the same thread.
+jxl::Status EncodeBatchItem(const Args& args, const BatchItem& item,
+                            std::vector<uint8_t>* jpeg_bytes) {
+  InputBytes input;
+  JXL_RETURN_IF_ERROR(input.Open(item.input));
+  jxl::extras::PackedPixelFile ppf;
+  if (!IsPNM(input.bytes())) {
+    JXL_RETURN_IF_ERROR(ReadInput(args, input.bytes(), &ppf));
+  }
+  JXL_RETURN_IF_ERROR(Encode(args, input.bytes(), ppf, jpeg_bytes));
+  if (!args.disable_output) {
+    JXL_RETURN_IF_ERROR(WriteFile(item.output, *jpeg_bytes));
+  }
+  return true;
+}
+
+int CJpegliBatch(const Args& args) {
+  std::vector<BatchItem> items;
+  if (!ReadBatchList(args.batch_list, &items)) {
+    return EXIT_FAILURE;
+  }
+  std::vector<std::vector<uint8_t>> jpeg_bytes;
+  const auto init = [&](size_t num_workers) {
+    jpeg_bytes.resize(num_workers);
+    return true;
+  };
+  const auto process = [&](size_t i, size_t worker) {
+    if (!EncodeBatchItem(args, items[i], &jpeg_bytes[worker])) {
+      fprintf(stderr, "Failed to compress %s\n", items[i].input.c_str());
+      return false;
+    }
+    return true;
+  };
+  const double t0 = jxl::Now();
+  size_t num_failed = RunBatch(items.size(), args.num_threads, init, process);
+  const double t1 = jxl::Now();
+  if (!args.quiet) {
+    fprintf(stderr, "Compressed %" PRIuS " of %" PRIuS " files in %.3f s.\n",
+            items.size() - num_failed, items.size(), t1 - t0);
+  }
+  return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int CJpegliMain(int argc, const char* argv[]) {
   Args args;
   CommandLineParser cmdline;
@@ -180,11 +332,22 @@ int CJpegliMain(int argc, const char* argv[]) {
     return EXIT_FAILURE;
   }
 
-  if (cmdline.HelpFlagPassed() || !args.file_in) {
+  if (cmdline.HelpFlagPassed() || (!args.file_in && args.batch_list.empty())) {
     cmdline.PrintHelp();
     return EXIT_SUCCESS;
   }
 
+  if (!args.batch_list.empty()) {
+    if (args.file_in) {
+      fprintf(stderr, "--batch can not be used with INPUT and OUTPUT.\n");
+      return EXIT_FAILURE;
+    }
+    if (!ValidateArgs(args) || !SetDistance(args, cmdline, &args.settings)) {
+      return EXIT_FAILURE;
+    }
+    return CJpegliBatch(args);
+  }
+
   if (!args.file_out && !args.disable_output) {
     fprintf(stderr,
             "No output file specified and --disable_output flag not passed.\n");
@@ -196,15 +359,16 @@ int CJpegliMain(int argc, const char* argv[]) {
             "Encoding will be performed, but the result will be discarded.\n");
   }
 
-  std::vector<uint8_t> input_bytes;
-  if (!ReadFile(args.file_in, &input_bytes)) {
+  InputBytes input_bytes;
+  if (!input_bytes.Open(args.file_in)) {
     fprintf(stderr, "Failed to read input image %s\n", args.file_in);
     return EXIT_FAILURE;
   }
 
+  // A --batch run decodes its files in parallel instead.
+  jxl::extras::SetEXRDecodeThreads(args.num_threads);
   jxl::extras::PackedPixelFile ppf;
-  if (!jxl::extras::DecodeBytes(jxl::Bytes(input_bytes),
-                                args.color_hints_proxy.target, &ppf)) {
+  if (!ReadInput(args, input_bytes.bytes(), &ppf)) {
     fprintf(stderr, "Failed to decode input image %s\n", args.file_in);
     return EXIT_FAILURE;
   }
@@ -232,16 +396,41 @@ int CJpegliMain(int argc, const char* argv[]) {
   }
 
   jpegxl::tools::SpeedStats stats;
+  jpegxl::tools::PerfCounters counters;
+  jpegxl::tools::EnergyCounters energy_counters;
+  TrackingMemoryManager memory_manager;
+  jpegli_memory_stats memory_stats;
+  args.settings.memory_manager = memory_manager.get();
+  args.settings.memory_stats = &memory_stats;
   std::vector<uint8_t> jpeg_bytes;
   for (size_t num_rep = 0; num_rep < args.num_reps; ++num_rep) {
+    energy_counters.Start();
+    counters.Start();
     const double t0 = jxl::Now();
-    if (!jxl::extras::EncodeJpeg(ppf, args.settings, nullptr, &jpeg_bytes)) {
+    if (!Encode(args, input_bytes.bytes(), ppf, &jpeg_bytes)) {
       fprintf(stderr, "jpegli encoding failed\n");
       return EXIT_FAILURE;
     }
     const double t1 = jxl::Now();
     stats.NotifyElapsed(t1 - t0);
     stats.SetImageSize(ppf.info.xsize, ppf.info.ysize);
+    double cycles;
+    double instructions;
+    if (counters.Stop(&cycles, &instructions)) {
+      stats.NotifyCounters(cycles, instructions);
+    }
+    double joules;
+    if (energy_counters.Stop(&joules)) stats.NotifyEnergy(joules);
+    SpeedStats::MemoryUsage memory_usage;
+    if (!GetMemoryUsage(memory_stats, &memory_manager, &memory_usage)) {
+      fprintf(stderr, "jpegli encoding leaked memory\n");
+      return EXIT_FAILURE;
+    }
+    stats.NotifyMemoryUsage(memory_usage);
+  }
+  if (!args.stats_json.empty() &&
+      !WriteStatsJSON(stats, args.stats_json, "cjpegli")) {
+    return EXIT_FAILURE;
   }
 
   if (args.file_out && !args.disable_output) {
@@ -8,19 +8,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <cerrno>
+#include <cstring>
 #include <memory>
 #include <string>
 #include <vector>
 
 #include "lib/base/printf_macros.h"
+#include "lib/base/span.h"
+#include "lib/base/status.h"
 #include "lib/base/types.h"
 #include "lib/extras/dec/jpegli.h"
 #include "lib/extras/enc/encode.h"
 #include "lib/extras/packed_image.h"
 #include "lib/extras/time.h"
+#include "lib/jpegli/common.h"
+#include "lib/threads/thread_parallel_runner.h"
+#include "tools/batch.h"
 #include "tools/cmdline.h"
+#include "tools/energy_counters.h"
 #include "tools/file_io.h"
+#include "tools/jpegli_stage_stats.h"
+#include "tools/perf_counters.h"
 #include "tools/speed_stats.h"
+#include "tools/tracking_memory_manager.h"
 
 namespace jpegxl {
 namespace tools {
@@ -35,6 +46,18 @@ struct Args {
 
     cmdline->AddPositionalOption("OUTPUT", /* required = */ true, output_help,
                                  &file_out);
+
+    cmdline->AddOptionValue(
+        '\0', "batch", "FILE_LIST",
+        "Decompress the files of FILE_LIST, which has one INPUT<TAB>OUTPUT "
+        "pair per line, in parallel instead of INPUT to OUTPUT.",
+        &batch_list, &ParseString);
+
+    cmdline->AddOptionValue(
+        '\0', "num_threads", "N",
+        "Number of worker threads of --batch, default is one per CPU that the\n"
+        "    process may use.",
+        &num_threads, &ParseUnsigned);
     cmdline->AddOptionFlag('\0', "disable_output",
                            "No output file will be written (for benchmarking)",
                            &disable_output, &SetBooleanTrue);
@@ -50,15 +73,32 @@ struct Args {
                             "Used for benchmarking, the default is 1.",
                             &num_reps, &ParseUnsigned);
 
+    cmdline->AddOptionValue(
+        '\0', "stats_json", "FILE",
+        "Writes the timing percentiles of --num_reps and the cycles and\n"
+        "    instructions per pixel to FILE as JSON.",
+        &stats_json, &ParseString);
+
+    cmdline->AddOptionFlag(
+        '\0', "perf_counters",
+        "Prints the time, retired instructions, cache misses and branch\n"
+        "    mispredictions of each decoding stage of jpegli, counted with\n"
+        "    the Linux perf_event hardware counters.",
+        &perf_counters, &SetBooleanTrue);
+
     cmdline->AddOptionFlag('\0', "quiet", "Silence output (except for errors).",
                            &quiet, &SetBooleanTrue);
   }
 
   const char* file_in = nullptr;
   const char* file_out = nullptr;
+  std::string batch_list;
+  size_t num_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
   bool disable_output = false;
   size_t bitdepth = 8;
   size_t num_reps = 1;
+  std::string stats_json;
+  bool perf_counters = false;
   bool quiet = false;
 };
 
@@ -86,6 +126,180 @@ void SetDecompressParams(const Args& args, const std::string& extension,
   }
 }
 
+// Returns true if the output with this extension can be written by
+// PNMRowWriter while the image is decoded.
+bool IsStreamingExtension(const std::string& extension) {
+  return extension == ".ppm" || extension == ".pgm" || extension == ".pnm" ||
+         extension == ".pfm";
+}
+
+bool SeekFile(FILE* file, int64_t pos) {
+#ifdef _WIN32
+  return _fseeki64(file, pos, SEEK_SET) == 0;
+#else
+  return fseeko(file, pos, SEEK_SET) == 0;
+#endif
+}
+
+// Writes a PPM, PGM or PFM file while the rows of the image are decoded, so
+// that neither the decoded image nor the encoded file is kept in memory. The
+// pixels must be in the format chosen by SetDecompressParams().
+class PNMRowWriter {
+ public:
+  PNMRowWriter(const std::string& filename, const std::string& extension)
+      : file_(filename, "wb"), is_pfm_(extension == ".pfm") {
+    if (!file_) {
+      fprintf(stderr,
+              "Could not open %s for writing\n"
+              "Error: %s",
+              filename.c_str(), strerror(errno));
+    }
+  }
+
+  bool ok() const { return file_ != nullptr; }
+
+  jxl::Status WriteRows(const jxl::extras::PackedPixelFile& ppf, size_t y,
+                        size_t num_rows, const uint8_t* pixels,
+                        size_t stride) {
+    if (y == 0) {
+      JXL_RETURN_IF_ERROR(WriteHeader(ppf));
+    }
+    if (!is_pfm_) {
+      JXL_RETURN_IF_ERROR(fwrite(pixels, stride, num_rows, file_) == num_rows);
+      return true;
+    }
+    // The rows of PFM files are stored from bottom to top, so the strip is
+    // written in reverse order at its mirrored position.
+    const size_t file_row = ppf.info.ysize - y - num_rows;
+    JXL_RETURN_IF_ERROR(SeekFile(file_, header_size_ + file_row * stride));
+    for (size_t i = num_rows; i > 0; --i) {
+      JXL_RETURN_IF_ERROR(
+          fwrite(pixels + (i - 1) * stride, 1, stride, file_) == stride);
+    }
+    return true;
+  }
+
+ private:
+  jxl::Status WriteHeader(const jxl::extras::PackedPixelFile& ppf) {
+    char header[128];
+    const bool is_gray = ppf.info.num_color_channels == 1;
+    int header_size;
+    if (is_pfm_) {
+      // The samples are big endian.
+      header_size = snprintf(header, sizeof(header),
+                             "P%c\n%u %u\n1.0\n", is_gray ? 'f' : 'F',
+                             ppf.info.xsize, ppf.info.ysize);
+    } else {
+      header_size =
+          snprintf(header, sizeof(header), "P%c\n%u %u\n%u\n",
+                   is_gray ? '5' : '6', ppf.info.xsize, ppf.info.ysize,
+                   (1u << ppf.info.bits_per_sample) - 1);
+    }
+    JXL_RETURN_IF_ERROR(header_size > 0 &&
+                        static_cast<size_t>(header_size) < sizeof(header));
+    header_size_ = header_size;
+    JXL_RETURN_IF_ERROR(fwrite(header, 1, header_size_, file_) ==
+                        header_size_);
+    return true;
+  }
+
+  FileWrapper file_;
+  const bool is_pfm_;
+  size_t header_size_ = 0;
+};
+
+// Decodes the image to a PPM, PGM or PFM file, one strip of rows at a time.
+jxl::Status DecodeToPNMFile(jxl::Bytes compressed,
+                            const jxl::extras::JpegDecompressParams& dparams,
+                            const std::string& filename,
+                            const std::string& extension,
+                            jxl::extras::PackedPixelFile* ppf) {
+  PNMRowWriter writer(filename, extension);
+  JXL_RETURN_IF_ERROR(writer.ok());
+  const auto write_rows = [&writer](const jxl::extras::PackedPixelFile& ppf,
+                                    size_t y, size_t num_rows,
+                                    const uint8_t* pixels, size_t stride) {
+    return writer.WriteRows(ppf, y, num_rows, pixels, stride);
+  };
+  return jxl::extras::DecodeJpegStreaming(compressed, dparams, ppf,
+                                          write_rows);
+}
+
+// Returns the memory usage of a run from the stats of jpegli and of the
+// allocator of its memory blocks, which is reset for the next run.
+jxl::Status GetMemoryUsage(const jpegli_memory_stats& stats,
+                           TrackingMemoryManager* memory_manager,
+                           SpeedStats::MemoryUsage* usage) {
+  usage->peak_bytes = stats.peak_bytes;
+  usage->permanent_peak_bytes = stats.pools[JPOOL_PERMANENT].peak_bytes;
+  usage->image_peak_bytes = stats.pools[JPOOL_IMAGE].peak_bytes;
+  usage->num_allocations = stats.total_allocations;
+  usage->allocator_peak_bytes = memory_manager->max_bytes_in_use;
+  usage->allocator_num_blocks = memory_manager->total_allocations;
+  return memory_manager->Reset();
+}
+
+// Decompresses one file of a --batch run. PNM outputs are written while they
+// are decoded, and the pixel buffers of other outputs are reused by the images
+// decompressed on the same thread.
+jxl::Status DecodeBatchItem(const Args& args, const BatchItem& item,
+                            jxl::extras::PackedPixelFile* ppf) {
+  size_t pos = item.output.find_last_of('.');
+  JXL_RETURN_IF_ERROR(pos < item.output.size());
+  std::string extension = item.output.substr(pos);
+  jxl::extras::JpegDecompressParams dparams;
+  SetDecompressParams(args, extension, &dparams);
+  InputBytes input;
+  JXL_RETURN_IF_ERROR(input.Open(item.input));
+  if (!args.disable_output && IsStreamingExtension(extension)) {
+    return DecodeToPNMFile(input.bytes(), dparams, item.output, extension,
+                           ppf);
+  }
+  JXL_RETURN_IF_ERROR(
+      jxl::extras::DecodeJpeg(input.bytes(), dparams, nullptr, ppf));
+  if (args.disable_output) {
+    return true;
+  }
+  if (extension == ".pnm") {
+    extension = ppf->info.num_color_channels == 3 ? ".ppm" : ".pgm";
+  }
+  std::unique_ptr<jxl::extras::Encoder> encoder =
+      jxl::extras::Encoder::FromExtension(extension);
+  JXL_RETURN_IF_ERROR(encoder != nullptr);
+  jxl::extras::EncodedImage encoded_image;
+  JXL_RETURN_IF_ERROR(encoder->Encode(*ppf, &encoded_image, nullptr));
+  JXL_RETURN_IF_ERROR(!encoded_image.bitstreams.empty());
+  return WriteFile(item.output, encoded_image.bitstreams[0]);
+}
+
+int DJpegliBatch(const Args& args) {
+  std::vector<BatchItem> items;
+  if (!ReadBatchList(args.batch_list, &items)) {
+    return EXIT_FAILURE;
+  }
+  std::vector<jxl::extras::PackedPixelFile> ppfs;
+  const auto init = [&](size_t num_workers) {
+    ppfs.resize(num_workers);
+    return true;
+  };
+  const auto process = [&](size_t i, size_t worker) {
+    if (!DecodeBatchItem(args, items[i], &ppfs[worker])) {
+      fprintf(stderr, "Failed to decompress %s\n", items[i].input.c_str());
+      return false;
+    }
+    return true;
+  };
+  const double t0 = jxl::Now();
+  size_t num_failed = RunBatch(items.size(), args.num_threads, init, process);
+  const double t1 = jxl::Now();
+  if (!args.quiet) {
+    fprintf(stderr,
+            "Decompressed %" PRIuS " of %" PRIuS " files in %.3f s.\n",
+            items.size() - num_failed, items.size(), t1 - t0);
+  }
+  return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int DJpegliMain(int argc, const char* argv[]) {
   Args args;
   CommandLineParser cmdline;
@@ -97,11 +311,22 @@ int DJpegliMain(int argc, const char* argv[]) {
     return EXIT_FAILURE;
   }
 
-  if (cmdline.HelpFlagPassed() || !args.file_in) {
+  if (cmdline.HelpFlagPassed() || (!args.file_in && args.batch_list.empty())) {
     cmdline.PrintHelp();
     return EXIT_SUCCESS;
   }
 
+  if (!args.batch_list.empty()) {
+    if (args.file_in) {
+      fprintf(stderr, "--batch can not be used with INPUT and OUTPUT.\n");
+      return EXIT_FAILURE;
+    }
+    if (!ValidateArgs(args)) {
+      return EXIT_FAILURE;
+    }
+    return DJpegliBatch(args);
+  }
+
   if (!args.file_out && !args.disable_output) {
     fprintf(stderr,
             "No output file specified and --disable_output flag not passed.\n");
@@ -117,8 +342,8 @@ int DJpegliMain(int argc, const char* argv[]) {
     return EXIT_FAILURE;
   }
 
-  std::vector<uint8_t> jpeg_bytes;
-  if (!ReadFile(args.file_in, &jpeg_bytes)) {
+  InputBytes jpeg_bytes;
+  if (!jpeg_bytes.Open(args.file_in)) {
     fprintf(stderr, "Failed to read input image %s\n", args.file_in);
     return EXIT_FAILURE;
   }
@@ -144,22 +369,70 @@ int DJpegliMain(int argc, const char* argv[]) {
 
   jxl::extras::PackedPixelFile ppf;
   jpegxl::tools::SpeedStats stats;
+  jpegxl::tools::PerfCounters counters;
+  jpegxl::tools::EnergyCounters energy_counters;
+  TrackingMemoryManager memory_manager;
+  jpegli_memory_stats memory_stats;
+  dparams.memory_manager = memory_manager.get();
+  dparams.memory_stats = &memory_stats;
+  jpegli_stage_stats stage_stats;
+  JpegliStageTotals stage_totals;
+  if (args.perf_counters) dparams.stage_stats = &stage_stats;
+  // A single decoding to a PNM file writes the rows while they are decoded,
+  // without keeping the whole image in memory; repeated decodings for
+  // benchmarking keep the output in memory, so that the file writes are not
+  // timed.
+  const bool stream_output = !args.disable_output && args.num_reps == 1 &&
+                             IsStreamingExtension(extension);
   for (size_t num_rep = 0; num_rep < args.num_reps; ++num_rep) {
+    energy_counters.Start();
+    counters.Start();
     const double t0 = jxl::Now();
-    if (!jxl::extras::DecodeJpeg(jpeg_bytes, dparams, nullptr, &ppf)) {
+    if (stream_output) {
+      if (!DecodeToPNMFile(jpeg_bytes.bytes(), dparams, filename_out,
+                           extension, &ppf)) {
+        fprintf(stderr, "jpegli decoding to %s failed\n",
+                filename_out.c_str());
+        return EXIT_FAILURE;
+      }
+    } else if (!jxl::extras::DecodeJpeg(jpeg_bytes.bytes(), dparams, nullptr,
+                                        &ppf)) {
       fprintf(stderr, "jpegli decoding failed\n");
       return EXIT_FAILURE;
     }
     const double t1 = jxl::Now();
     stats.NotifyElapsed(t1 - t0);
     stats.SetImageSize(ppf.info.xsize, ppf.info.ysize);
+    double cycles;
+    double instructions;
+    if (counters.Stop(&cycles, &instructions)) {
+      stats.NotifyCounters(cycles, instructions);
+    }
+    double joules;
+    if (energy_counters.Stop(&joules)) stats.NotifyEnergy(joules);
+    SpeedStats::MemoryUsage memory_usage;
+    if (!GetMemoryUsage(memory_stats, &memory_manager, &memory_usage)) {
+      fprintf(stderr, "jpegli decoding leaked memory\n");
+      return EXIT_FAILURE;
+    }
+    stats.NotifyMemoryUsage(memory_usage);
+    if (args.perf_counters) {
+      stage_totals.Add(stage_stats, ppf.info.xsize * ppf.info.ysize);
+    }
+  }
+  if (!args.stats_json.empty() &&
+      !WriteStatsJSON(stats, args.stats_json, "djpegli")) {
+    return EXIT_FAILURE;
   }
 
   if (!args.quiet) {
     stats.Print(1);
   }
+  if (args.perf_counters) {
+    stage_totals.Print("djpegli");
+  }
 
-  if (args.disable_output) {
+  if (args.disable_output || stream_output) {
     return EXIT_SUCCESS;
   }
 
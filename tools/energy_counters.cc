@@ -0,0 +1,82 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "tools/energy_counters.h"
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace jpegxl {
+namespace tools {
+
+#if defined(__linux__)
+
+namespace {
+
+// The package domains of intel-rapl, and of amd-rapl on older kernels, have
+// the numbered top level zones; their subzones (core, uncore, dram) are
+// parts of the package and not counted again.
+constexpr const char* kPowercapZone = "/sys/class/powercap/intel-rapl:";
+constexpr int kMaxPackages = 64;
+
+bool ReadValue(const std::string& path, uint64_t* value) {
+  FILE* f = fopen(path.c_str(), "r");
+  if (f == nullptr) return false;
+  const bool ok = fscanf(f, "%" SCNu64, value) == 1;
+  fclose(f);
+  return ok;
+}
+
+}  // namespace
+
+EnergyCounters::EnergyCounters() {
+  for (int package = 0; package < kMaxPackages; ++package) {
+    const std::string zone = kPowercapZone + std::to_string(package);
+    Domain domain;
+    domain.energy_path = zone + "/energy_uj";
+    if (!ReadValue(zone + "/max_energy_range_uj", &domain.max_energy_uj) ||
+        !ReadValue(domain.energy_path, &domain.start_uj)) {
+      break;
+    }
+    domains_.push_back(domain);
+  }
+}
+
+void EnergyCounters::Start() {
+  for (Domain& domain : domains_) {
+    if (!ReadValue(domain.energy_path, &domain.start_uj)) {
+      domains_.clear();
+      return;
+    }
+  }
+}
+
+bool EnergyCounters::Stop(double* joules) {
+  if (!IsAvailable()) return false;
+  uint64_t total_uj = 0;
+  for (const Domain& domain : domains_) {
+    uint64_t end_uj;
+    if (!ReadValue(domain.energy_path, &end_uj)) return false;
+    total_uj += end_uj >= domain.start_uj
+                    ? end_uj - domain.start_uj
+                    : domain.max_energy_uj - domain.start_uj + end_uj;
+  }
+  *joules = total_uj * 1e-6;
+  return true;
+}
+
+#else
+
+EnergyCounters::EnergyCounters() = default;
+void EnergyCounters::Start() {}
+bool EnergyCounters::Stop(double* /*joules*/) { return false; }
+
+#endif  // defined(__linux__)
+
+}  // namespace tools
+}  // namespace jpegxl
@@ -0,0 +1,49 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef TOOLS_ENERGY_COUNTERS_H_
+#define TOOLS_ENERGY_COUNTERS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace jpegxl {
+namespace tools {
+
+// Measures the energy used by the CPU packages with the RAPL counters that
+// Linux exposes in /sys/class/powercap. The counters are not available on
+// other systems, on CPUs without RAPL, or if the energy_uj files are not
+// readable, which they are only for root on recent kernels. The counters are
+// for the whole package, so they include the work of other processes and
+// threads, e.g. of concurrent benchmark tasks.
+class EnergyCounters {
+ public:
+  EnergyCounters();
+
+  bool IsAvailable() const { return !domains_.empty(); }
+
+  // Reads the counters at the start of the measured interval.
+  void Start();
+
+  // Returns the joules used since Start(), or false if the counters are not
+  // available.
+  bool Stop(double* joules);
+
+ private:
+  struct Domain {
+    std::string energy_path;
+    // The counter wraps around at this value.
+    uint64_t max_energy_uj;
+    uint64_t start_uj;
+  };
+  std::vector<Domain> domains_;
+};
+
+}  // namespace tools
+}  // namespace jpegxl
+
+#endif  // TOOLS_ENERGY_COUNTERS_H_
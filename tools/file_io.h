@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 
 #include <cerrno>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
@@ -19,6 +20,9 @@
 #include <vector>
 
 #include "lib/base/compiler_specific.h"
+#include "lib/base/span.h"
+#include "lib/base/status.h"
+#include "lib/extras/mmap.h"
 
 #ifdef _WIN32
 #include <fcntl.h>
@@ -131,6 +135,38 @@ static inline bool ReadFile(const std::string& filename,
   return ReadFile(f, bytes);
 }
 
+// The contents of an input file, which is memory mapped if possible, so that
+// it can be decoded from the page cache without a copy. Files that can not be
+// mapped, such as stdin ("-") or pipes, are read into a buffer with ReadFile().
+class InputBytes {
+ public:
+  bool Open(const std::string& filename) {
+    if (filename != "-" && Map(filename)) {
+      bytes_ = jxl::Bytes(mapped_.data(), mapped_.size());
+      return true;
+    }
+    if (!ReadFile(filename, &buffer_)) {
+      return false;
+    }
+    bytes_ = jxl::Bytes(buffer_.data(), buffer_.size());
+    return true;
+  }
+
+  jxl::Bytes bytes() const { return bytes_; }
+  size_t size() const { return bytes_.size(); }
+
+ private:
+  jxl::Status Map(const std::string& filename) {
+    JXL_ASSIGN_OR_RETURN(mapped_,
+                         jxl::MemoryMappedFile::Init(filename.c_str()));
+    return true;
+  }
+
+  jxl::MemoryMappedFile mapped_;
+  std::vector<uint8_t> buffer_;
+  jxl::Bytes bytes_;
+};
+
 template <typename ContainerType>
 static inline bool WriteFile(const std::string& filename,
                              const ContainerType& bytes) {
@@ -12,10 +12,14 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <utility>
+#include <vector>
 
 #include "lib/base/data_parallel.h"
 #include "lib/base/memory_manager.h"
 #include "lib/base/status.h"
+#include "lib/extras/image.h"
+#include "lib/extras/image_ops.h"
 #include "lib/extras/memory_manager_internal.h"
 
 #undef HWY_TARGET_INCLUDE
@@ -299,11 +303,13 @@ void VerticalBlock(const V& d1_1, const V& d1_3, const V& d1_5, const V& n2_1,
   // clflushopt than clflush but still a significant slowdown.
 }
 
-// Reads/writes one block (kVectors full vectors) in each row.
-template <size_t kVectors>
+// Reads/writes one block (kVectors full vectors) in each row. InRow/OutRow map
+// a row index to a row pointer; they are template parameters so that plane
+// accessors are inlined rather than called through std::function.
+template <size_t kVectors, class InRow, class OutRow>
 void VerticalStrip(const RecursiveGaussian& rg, const size_t x,
                    const size_t ysize, float* ring_buffer, const float* zero,
-                   const GetConstRow& in, const GetRow& out) {
+                   const InRow& in, const OutRow& out) {
   // We're iterating vertically, so use multiple full-length vectors (each lane
   // is one column of row n).
   using D = HWY_FULL(float);
@@ -372,45 +378,81 @@ void VerticalStrip(const RecursiveGaussian& rg, const size_t x,
   }
 }
 
-// Apply 1D vertical scan to multiple columns (one per vector lane).
-// Not yet parallelized.
-Status FastGaussianVertical(JxlMemoryManager* memory_manager,
-                            const RecursiveGaussian& rg, const size_t xsize,
-                            const size_t ysize, const GetConstRow& in,
-                            const GetRow& out, ThreadPool* /* pool */) {
+// Apply 1D vertical scan to multiple columns (one per vector lane). Each task
+// filters one strip of fast_pace columns, so tasks are independent and only
+// need their own ring buffer.
+template <class InRow, class OutRow>
+Status VerticalStrips(JxlMemoryManager* memory_manager,
+                      const RecursiveGaussian& rg, const size_t xsize,
+                      const size_t ysize, const InRow& in, const OutRow& out,
+                      ThreadPool* pool) {
   const HWY_FULL(float) df;
   constexpr size_t kCacheLineLanes = 64 / sizeof(float);
   const size_t unroll = std::max<size_t>(kCacheLineLanes / Lanes(df), 4);
+  if (unroll != 4 && unroll != 8 && unroll != 16) {
+    return JXL_FAILURE("Unexpected vector size");
+  }
   const size_t fast_pace = unroll * Lanes(df);
-  const size_t scratch_size =
-      fast_pace * sizeof(float) * (1 + 3 * kRingBufferLen);
-  JXL_ASSIGN_OR_RETURN(AlignedMemory mem,
-                       AlignedMemory::Create(memory_manager, scratch_size));
-  float* zero = mem.address<float>();
-  float* ring_buffer = zero + fast_pace;
-  memset(zero, 0, fast_pace * sizeof(float));
-  size_t x = 0;
-  if (unroll == 4) {
-    for (; x + fast_pace <= xsize; x += fast_pace) {
-      VerticalStrip<4>(rg, x, ysize, ring_buffer, zero, in, out);
+  const size_t scratch_floats = fast_pace * (1 + 3 * kRingBufferLen);
+
+  std::vector<AlignedMemory> scratch;
+  const auto init = [&](const size_t num_threads) -> Status {
+    scratch.clear();
+    for (size_t i = 0; i < num_threads; ++i) {
+      JXL_ASSIGN_OR_RETURN(
+          AlignedMemory mem,
+          AlignedMemory::Create(memory_manager,
+                                scratch_floats * sizeof(float)));
+      memset(mem.address<float>(), 0, fast_pace * sizeof(float));
+      scratch.emplace_back(std::move(mem));
     }
-  } else if (unroll == 8) {
-    for (; x + fast_pace <= xsize; x += fast_pace) {
-      VerticalStrip<8>(rg, x, ysize, ring_buffer, zero, in, out);
+    return true;
+  };
+
+  const auto process_strip = [&](const uint32_t task,
+                                 const size_t thread) -> Status {
+    float* zero = scratch[thread].address<float>();
+    float* ring_buffer = zero + fast_pace;
+    size_t x = task * fast_pace;
+    if (x + fast_pace <= xsize) {
+      if (unroll == 4) {
+        VerticalStrip<4>(rg, x, ysize, ring_buffer, zero, in, out);
+      } else if (unroll == 8) {
+        VerticalStrip<8>(rg, x, ysize, ring_buffer, zero, in, out);
+      } else {
+        VerticalStrip<16>(rg, x, ysize, ring_buffer, zero, in, out);
+      }
+      return true;
     }
-  } else if (unroll == 16) {
-    for (; x + fast_pace <= xsize; x += fast_pace) {
-      VerticalStrip<16>(rg, x, ysize, ring_buffer, zero, in, out);
+    // Last, partial strip: one vector at a time.
+    for (; x < xsize; x += Lanes(df)) {
+      VerticalStrip<1>(rg, x, ysize, ring_buffer, zero, in, out);
     }
-  } else {
-    JXL_UNREACHABLE("Unexpected vector size");
-  }
-  for (; x < xsize; x += Lanes(df)) {
-    VerticalStrip<1>(rg, x, ysize, ring_buffer, zero, in, out);
-  }
+    return true;
+  };
+
+  const size_t num_strips = DivCeil(xsize, fast_pace);
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, num_strips, init, process_strip,
+                                "FastGaussianVertical"));
   return true;
 }
 
+Status FastGaussianVertical(JxlMemoryManager* memory_manager,
+                            const RecursiveGaussian& rg, const size_t xsize,
+                            const size_t ysize, const GetConstRow& in,
+                            const GetRow& out, ThreadPool* pool) {
+  return VerticalStrips(memory_manager, rg, xsize, ysize, in, out, pool);
+}
+
+// Whole-plane variant: row lookups are inlined into VerticalStrip.
+Status FastGaussianVerticalPlane(const RecursiveGaussian& rg, const ImageF& in,
+                                 ImageF* out, ThreadPool* pool) {
+  const auto in_row = [&in](const size_t y) { return in.ConstRow(y); };
+  const auto out_row = [out](const size_t y) { return out->Row(y); };
+  return VerticalStrips(in.memory_manager(), rg, in.xsize(), in.ysize(),
+                        in_row, out_row, pool);
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -426,7 +468,8 @@ void FastGaussian1D(const RecursiveGaussian& rg, const size_t xsize,
   (rg, static_cast<intptr_t>(xsize), in, out);
 }
 
-HWY_EXPORT(FastGaussianVertical);  // Local function.
+HWY_EXPORT(FastGaussianVertical);       // Local function.
+HWY_EXPORT(FastGaussianVerticalPlane);  // Local function.
 
 // Implements "Recursive Implementation of the Gaussian Filter Using Truncated
 // Cosine Functions" by Charalampidis [2016].
@@ -554,5 +597,24 @@ Status FastGaussian(JxlMemoryManager* memory_manager,
   return true;
 }
 
+Status FastGaussian(const RecursiveGaussian& rg, const ImageF& in,
+                    ImageF* temp, ImageF* out, ThreadPool* pool) {
+  const size_t xsize = in.xsize();
+  const size_t ysize = in.ysize();
+  JXL_ENSURE(SameSize(in, *temp));
+  JXL_ENSURE(SameSize(in, *out));
+  const auto process_line = [&](const uint32_t task,
+                                size_t /*thread*/) -> Status {
+    const size_t y = task;
+    FastGaussian1D(rg, xsize, in.ConstRow(y), temp->Row(y));
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, ysize, ThreadPool::NoInit,
+                                process_line, "FastGaussianHorizontal"));
+  JXL_RETURN_IF_ERROR(
+      HWY_DYNAMIC_DISPATCH(FastGaussianVerticalPlane)(rg, *temp, out, pool));
+  return true;
+}
+
 }  // namespace jxl
 #endif  // HWY_ONCE
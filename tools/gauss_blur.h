@@ -15,6 +15,7 @@
 #include "lib/base/data_parallel.h"
 #include "lib/base/memory_manager.h"
 #include "lib/base/status.h"
+#include "lib/extras/image.h"
 
 namespace jxl {
 
@@ -58,6 +59,11 @@ Status FastGaussian(JxlMemoryManager* memory_manager,
                     const GetConstRow& in, const GetRow& temp,
                     const GetRow& out, ThreadPool* pool = nullptr);
 
+// Same as above for a whole plane, without per-row std::function calls. temp
+// and out must have the same size as in; out must not alias in.
+Status FastGaussian(const RecursiveGaussian& rg, const ImageF& in,
+                    ImageF* temp, ImageF* out, ThreadPool* pool = nullptr);
+
 }  // namespace jxl
 
 #endif  // LIB_JXL_GAUSS_BLUR_H_
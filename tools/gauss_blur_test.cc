@@ -445,6 +445,30 @@ TEST(GaussBlurTest, Test2D) {
   }
 }
 
+TEST(GaussBlurTest, PlaneMatchesRowCallbacks) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  for (size_t xsize : {1, 17, 100, 203}) {
+    const size_t ysize = 61;
+    JXL_TEST_ASSIGN_OR_DIE(ImageF in,
+                           ImageF::Create(memory_manager, xsize, ysize));
+    RandomFillImage(&in, -1.0f, 1.0f, static_cast<int>(1234 + xsize));
+    JXL_TEST_ASSIGN_OR_DIE(ImageF temp,
+                           ImageF::Create(memory_manager, xsize, ysize));
+    JXL_TEST_ASSIGN_OR_DIE(ImageF expected,
+                           ImageF::Create(memory_manager, xsize, ysize));
+    JXL_TEST_ASSIGN_OR_DIE(ImageF out,
+                           ImageF::Create(memory_manager, xsize, ysize));
+    const auto rg = CreateRecursiveGaussian(1.5);
+    ASSERT_TRUE(FastGaussian(
+        memory_manager, rg, xsize, ysize,
+        [&](size_t y) { return in.ConstRow(y); },
+        [&](size_t y) { return temp.Row(y); },
+        [&](size_t y) { return expected.Row(y); }));
+    ASSERT_TRUE(FastGaussian(rg, in, &temp, &out));
+    JXL_TEST_ASSERT_OK(VerifyRelativeError(expected, out, 0.0, 0.0, _));
+  }
+}
+
 // Slow (44 sec). To run, remove the disabled prefix.
 TEST(GaussBlurTest, DISABLED_SlowTestDirac1D) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
@@ -0,0 +1,137 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+package org.jpeg.jpegli.wrapper;
+
+import java.io.IOException;
+import java.nio.ByteBuffer;
+
+/**
+ * Jpegli JNI decoder wrapper.
+ *
+ * A decoder keeps its native state (tables and image buffers) between images:
+ * create it once, then call {@link #reset} and {@link #decode} per image.
+ * Instances are not thread-safe.
+ */
+public class Decoder implements AutoCloseable {
+  static {
+    JniHelper.ensureInitialized();
+  }
+
+  /** R, G, B, A bytes per pixel; alpha is opaque. */
+  public static final int PIXEL_FORMAT_RGBA_8888 = Encoder.PIXEL_FORMAT_RGBA_8888;
+  /** Native endian 16-bit pixels with red in the top 5 bits. */
+  public static final int PIXEL_FORMAT_RGB_565 = Encoder.PIXEL_FORMAT_RGB_565;
+
+  /** Image properties read from the JPEG header. */
+  public static class Info {
+    public final int width;
+    public final int height;
+    public final int numComponents;
+
+    Info(int[] info) {
+      this.width = info[0];
+      this.height = info[1];
+      this.numComponents = info[2];
+    }
+  }
+
+  private static native long nativeCreate();
+
+  private static native void nativeDestroy(long handle);
+
+  private static native int nativeReset(
+      long handle, ByteBuffer data, int offset, int length, int[] info);
+
+  private static native int nativeResetArray(
+      long handle, byte[] data, int offset, int length, int[] info);
+
+  private static native int nativeDecode(long handle, ByteBuffer pixels, int format, int stride);
+
+  private static native int nativeDecodeBitmap(long handle, Object bitmap);
+
+  private final int[] info = new int[3];
+  private long handle;
+
+  public Decoder() {
+    handle = nativeCreate();
+    if (handle == 0) {
+      throw new IllegalStateException("Failed to create native decoder");
+    }
+  }
+
+  /**
+   * Starts decoding the JPEG between position and limit of a direct buffer.
+   * The buffer is read in place and must not change until the image is
+   * decoded.
+   */
+  public Info reset(ByteBuffer jpeg) throws IOException {
+    ensureOpen();
+    if (jpeg == null || !jpeg.isDirect()) {
+      throw new IllegalArgumentException("jpeg is not a direct buffer");
+    }
+    check(nativeReset(handle, jpeg, jpeg.position(), jpeg.remaining(), info));
+    return new Info(info);
+  }
+
+  /** Starts decoding a JPEG held in an array; the data is copied. */
+  public Info reset(byte[] jpeg, int offset, int length) throws IOException {
+    ensureOpen();
+    if (jpeg == null) {
+      throw new IllegalArgumentException("jpeg is null");
+    }
+    if (offset < 0 || length <= 0 || offset + length > jpeg.length) {
+      throw new IllegalArgumentException("invalid jpeg range");
+    }
+    check(nativeResetArray(handle, jpeg, offset, length, info));
+    return new Info(info);
+  }
+
+  /**
+   * Decodes the current image into a direct buffer.
+   *
+   * @param format one of PIXEL_FORMAT_* constants
+   * @param stride distance between rows, in bytes
+   */
+  public void decode(ByteBuffer pixels, int format, int stride) throws IOException {
+    ensureOpen();
+    if (pixels == null || !pixels.isDirect()) {
+      throw new IllegalArgumentException("pixels is not a direct buffer");
+    }
+    check(nativeDecode(handle, pixels, format, stride));
+  }
+
+  /**
+   * Decodes the current image into an android.graphics.Bitmap of the same size
+   * in ARGB_8888 or RGB_565 configuration. Only available on Android.
+   */
+  public void decodeBitmap(Object bitmap) throws IOException {
+    ensureOpen();
+    if (bitmap == null) {
+      throw new IllegalArgumentException("bitmap is null");
+    }
+    check(nativeDecodeBitmap(handle, bitmap));
+  }
+
+  @Override
+  public void close() {
+    if (handle != 0) {
+      nativeDestroy(handle);
+      handle = 0;
+    }
+  }
+
+  private void ensureOpen() {
+    if (handle == 0) {
+      throw new IllegalStateException("Decoder is closed");
+    }
+  }
+
+  private static void check(int status) throws IOException {
+    if (status != 0) {
+      throw new IOException("Jpegli wrapper decoder return code: " + status);
+    }
+  }
+}
@@ -0,0 +1,75 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+package org.jpeg.jpegli.wrapper;
+
+import java.io.ByteArrayOutputStream;
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
+/**
+ * Tests for jpegli decoder wrapper.
+ */
+public class DecoderTest {
+  static void checkTrue(boolean condition) {
+    if (!condition) {
+      throw new IllegalStateException("check failed");
+    }
+  }
+
+  static byte[] encodeGradient(int width, int height) throws IOException {
+    int[] pixels = new int[width * height];
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        pixels[x + width * y] = ((x * 4) << 16) + ((y * 4) << 8);
+      }
+    }
+    ByteArrayOutputStream out = new ByteArrayOutputStream();
+    Encoder.encode(pixels, width, height, 99, out);
+    return out.toByteArray();
+  }
+
+  static void testReuseDecoder() throws IOException {
+    int width = 64;
+    int height = 64;
+    byte[] jpeg = encodeGradient(width, height);
+    ByteBuffer directJpeg = ByteBuffer.allocateDirect(jpeg.length);
+    directJpeg.put(jpeg).flip();
+    ByteBuffer rgba = ByteBuffer.allocateDirect(width * height * 4);
+    ByteBuffer rgb565 = ByteBuffer.allocateDirect(width * height * 2);
+    try (Decoder decoder = new Decoder()) {
+      Decoder.Info info = decoder.reset(jpeg, 0, jpeg.length);
+      checkTrue(info.width == width && info.height == height && info.numComponents == 3);
+      decoder.decode(rgba, Decoder.PIXEL_FORMAT_RGBA_8888, width * 4);
+      for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+          int i = 4 * (x + width * y);
+          checkTrue(Math.abs((rgba.get(i) & 0xFF) - x * 4) <= 4);
+          checkTrue(Math.abs((rgba.get(i + 1) & 0xFF) - y * 4) <= 4);
+          checkTrue((rgba.get(i + 3) & 0xFF) == 255);
+        }
+      }
+
+      // Second image with the same native decoder.
+      info = decoder.reset(directJpeg);
+      checkTrue(info.width == width && info.height == height);
+      decoder.decode(rgb565, Decoder.PIXEL_FORMAT_RGB_565, width * 2);
+      rgb565.order(ByteOrder.nativeOrder());
+      for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+          int v = rgb565.getShort(2 * (x + width * y)) & 0xFFFF;
+          checkTrue(Math.abs((v >> 11) - ((x * 4) >> 3)) <= 1);
+          checkTrue(Math.abs(((v >> 5) & 0x3F) - ((y * 4) >> 2)) <= 1);
+        }
+      }
+    }
+  }
+
+  // Simple executable to avoid extra dependencies.
+  public static void main(String[] args) throws IOException {
+    testReuseDecoder();
+  }
+}
@@ -7,6 +7,8 @@ package org.jpeg.jpegli.wrapper;
 
 import java.io.IOException;
 import java.io.OutputStream;
+import java.nio.Buffer;
+import java.nio.ByteBuffer;
 import java.nio.channels.Channels;
 import java.nio.channels.WritableByteChannel;
 
@@ -39,11 +41,25 @@ public class Encoder {
     }
   }
 
+  /** R, G, B, A bytes per pixel; alpha is ignored. */
+  public static final int PIXEL_FORMAT_RGBA_8888 = 1;
+  /** Native endian 16-bit pixels with red in the top 5 bits. */
+  public static final int PIXEL_FORMAT_RGB_565 = 2;
+
   private static native int nativeInit();
 
   private static native int nativeEncode(
       int width, int height, int[] config, int[] data, WritableByteChannel output);
 
+  private static native int nativeEncodeToBuffer(
+      int width, int height, int[] config, int[] data, ByteBuffer[] output);
+
+  private static native int nativeEncodeBuffer(int width, int height, int[] config,
+      ByteBuffer data, int format, int stride, WritableByteChannel output);
+
+  private static native int nativeEncodeBitmap(
+      int[] config, Object bitmap, WritableByteChannel output);
+
   private static class InitHelper {
     private static final int STATUS = nativeInit();
   }
@@ -76,6 +92,99 @@ public class Encoder {
     }
   }
 
+  /**
+   * One-shot encoding into a direct buffer.
+   *
+   * <p>If the JPEG does not fit into {@code output}, a larger direct buffer is
+   * allocated. Returns the buffer holding the JPEG between position 0 and its
+   * limit; this is {@code output} unless it had to grow.
+   */
+  public static ByteBuffer encode(int[] color, int width, int height, Config config,
+      ByteBuffer output) throws IOException {
+    if (!ensureInitialized()) {
+      throw new IllegalStateException("Native library not initialized");
+    }
+    if (output == null || !output.isDirect()) {
+      throw new IllegalArgumentException("output is not a direct buffer");
+    }
+    if (color == null) {
+      throw new IllegalArgumentException("color is null");
+    }
+    if ((width <= 0) || (height <= 0) || (color.length != width * height)) {
+      throw new IllegalArgumentException("invalid image dimensions");
+    }
+
+    ByteBuffer[] result = {output};
+    int size = nativeEncodeToBuffer(width, height, config.serialized, color, result);
+    if (size < 0) {
+      throw new IOException("Jpegli wrapper nativeProcess return code: " + size);
+    }
+    ((Buffer) result[0]).clear();
+    ((Buffer) result[0]).limit(size);
+    return result[0];
+  }
+
+  /** Called from native code: returns a larger copy of the first used bytes. */
+  private static ByteBuffer growBuffer(ByteBuffer buffer, int used) {
+    long capacity = Math.max(2L * buffer.capacity(), 1 << 16);
+    ByteBuffer grown = ByteBuffer.allocateDirect((int) Math.min(capacity, Integer.MAX_VALUE - 8));
+    ByteBuffer head = buffer.duplicate();
+    ((Buffer) head).clear();
+    ((Buffer) head).limit(used);
+    grown.put(head);
+    return grown;
+  }
+
+  /**
+   * One-shot encoding of pixels read in place from a direct buffer.
+   *
+   * @param format one of PIXEL_FORMAT_* constants
+   * @param stride distance between rows, in bytes
+   */
+  public static void encode(ByteBuffer pixels, int width, int height, int format, int stride,
+      Config config, WritableByteChannel output) throws IOException {
+    if (!ensureInitialized()) {
+      throw new IllegalStateException("Native library not initialized");
+    }
+    if (output == null) {
+      throw new IllegalArgumentException("output is null");
+    }
+    if (pixels == null || !pixels.isDirect()) {
+      throw new IllegalArgumentException("pixels is not a direct buffer");
+    }
+    if ((width <= 0) || (height <= 0) || (stride <= 0)) {
+      throw new IllegalArgumentException("invalid image dimensions");
+    }
+
+    int status =
+        nativeEncodeBuffer(width, height, config.serialized, pixels, format, stride, output);
+    if (status != 0) {
+      throw new IOException("Jpegli wrapper nativeProcess return code: " + status);
+    }
+  }
+
+  /**
+   * One-shot encoding of an android.graphics.Bitmap in ARGB_8888 or RGB_565
+   * configuration; pixels are read in place. Only available on Android.
+   */
+  public static void encodeBitmap(Object bitmap, Config config, WritableByteChannel output)
+      throws IOException {
+    if (!ensureInitialized()) {
+      throw new IllegalStateException("Native library not initialized");
+    }
+    if (output == null) {
+      throw new IllegalArgumentException("output is null");
+    }
+    if (bitmap == null) {
+      throw new IllegalArgumentException("bitmap is null");
+    }
+
+    int status = nativeEncodeBitmap(config.serialized, bitmap, output);
+    if (status != 0) {
+      throw new IOException("Jpegli wrapper nativeProcess return code: " + status);
+    }
+  }
+
   /** One-shot encoding. */
   public static void encode(int[] color, int width, int height, int quality, OutputStream output)
       throws IOException {
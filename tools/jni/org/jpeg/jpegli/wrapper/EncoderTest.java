@@ -9,6 +9,10 @@ import static java.nio.charset.StandardCharsets.UTF_8;
 
 import java.io.ByteArrayOutputStream;
 import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.channels.Channels;
+import java.nio.channels.WritableByteChannel;
+import java.util.Arrays;
 import java.util.Base64;
 
 /**
@@ -38,8 +42,53 @@ public class EncoderTest {
     System.err.println("Base64: " + new String(encoded, UTF_8));
   }
 
+  static void testDirectBufferMatchesIntArray() throws IOException {
+    int width = 64;
+    int height = 64;
+    int[] pixels = new int[width * height];
+    ByteBuffer buffer = ByteBuffer.allocateDirect(width * height * 4);
+    for (int y = 0; y < 64; ++y) {
+      for (int x = 0; x < 64; ++x) {
+        int r = x * 4;
+        int g = y * 4;
+        int b = (x + y) * 2;
+        pixels[x + 64 * y] = (r << 16) | (g << 8) | b;
+        buffer.put((byte) r).put((byte) g).put((byte) b).put((byte) 255);
+      }
+    }
+    ByteArrayOutputStream expected = new ByteArrayOutputStream();
+    Encoder.encode(pixels, width, height, 90, expected);
+    ByteArrayOutputStream out = new ByteArrayOutputStream();
+    try (WritableByteChannel channel = Channels.newChannel(out)) {
+      Encoder.encode(buffer, width, height, Encoder.PIXEL_FORMAT_RGBA_8888, width * 4,
+          new Encoder.Config().setQuality(90), channel);
+    }
+    checkTrue(Arrays.equals(expected.toByteArray(), out.toByteArray()));
+  }
+
+  static void testEncodeToGrowingBuffer() throws IOException {
+    int width = 64;
+    int height = 64;
+    int[] pixels = new int[width * height];
+    for (int i = 0; i < pixels.length; ++i) {
+      pixels[i] = i * 0x9E3779B1;
+    }
+    ByteArrayOutputStream expected = new ByteArrayOutputStream();
+    Encoder.encode(pixels, width, height, 95, expected);
+    // Far too small, so that the buffer has to grow while encoding.
+    ByteBuffer small = ByteBuffer.allocateDirect(16);
+    ByteBuffer out =
+        Encoder.encode(pixels, width, height, new Encoder.Config().setQuality(95), small);
+    checkTrue(out != small);
+    byte[] encoded = new byte[out.remaining()];
+    out.get(encoded);
+    checkTrue(Arrays.equals(expected.toByteArray(), encoded));
+  }
+
   // Simple executable to avoid extra dependencies.
   public static void main(String[] args) throws IOException {
     test64x64();
+    testDirectBufferMatchesIntArray();
+    testEncodeToGrowingBuffer();
   }
 }
@@ -0,0 +1,371 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "decoder_jni.h"  // NOLINT: build/include
+
+#include <jni.h>
+
+#ifdef __ANDROID__
+#include <android/bitmap.h>
+#endif
+
+#include <csetjmp>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "lib/jpegli/common.h"
+#include "lib/jpegli/decode.h"
+
+namespace org_jpeg_jpegli_wrapper {
+namespace {
+
+jint JNI_VERSION = JNI_VERSION_1_6;
+
+enum ReturnCode {
+  OK = 0,
+  ERROR_ALLOCATION = -1,
+  ERROR_INVALID_PARAMS = -2,
+  ERROR_INTERNAL = -3
+};
+
+// Same values as the Encoder.PIXEL_FORMAT_* constants.
+enum PixelFormat {
+  // R, G, B, A bytes per pixel (Android ARGB_8888 layout); alpha is opaque.
+  PIXEL_FORMAT_RGBA_8888 = 1,
+  // Native endian 16-bit pixels with red in the top 5 bits (Android RGB_565).
+  PIXEL_FORMAT_RGB_565 = 2
+};
+
+// #define RETURN_ERROR(T) return ERROR_##T
+#define RETURN_ERROR(T) \
+  return fprintf(stderr, "%s:%d: error " #T "\n", __FILE__, __LINE__), ERROR_##T
+
+// Unlike the encoder, the decompress object outlives the failed image, so it
+// is only aborted (by the caller of setjmp), not destroyed.
+void ExitHandler(j_common_ptr cinfo) {
+  (*cinfo->err->output_message)(cinfo);
+  jmp_buf* env = reinterpret_cast<jmp_buf*>(cinfo->client_data);
+  longjmp(*env, 1);
+}
+
+size_t BytesPerPixel(jint format) {
+  switch (format) {
+    case PIXEL_FORMAT_RGBA_8888:
+      return 4;
+    case PIXEL_FORMAT_RGB_565:
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+// Long-lived decoder; the decompress object, its tables and (with
+// jpegli_keep_image_memory) its image buffers are reused between images.
+class Decoder {
+ public:
+  Decoder() {
+    cinfo_.err = jpegli_std_error(&err_);
+    cinfo_.client_data = reinterpret_cast<void*>(&env_);
+    cinfo_.err->error_exit = &ExitHandler;
+  }
+
+  ~Decoder() {
+    if (created_) jpegli_destroy_decompress(&cinfo_);
+  }
+
+  int Init() {
+    if (setjmp(env_)) {
+      RETURN_ERROR(INTERNAL);
+    }
+    jpegli_create_decompress(&cinfo_);
+    created_ = true;
+    jpegli_keep_image_memory(reinterpret_cast<j_common_ptr>(&cinfo_), TRUE);
+    return OK;
+  }
+
+  // Data must stay valid until the image is decoded or the next Reset.
+  int Reset(const uint8_t* data, size_t size, jint* info) {
+    has_header_ = false;
+    if (setjmp(env_)) {
+      jpegli_abort_decompress(&cinfo_);
+      RETURN_ERROR(INVALID_PARAMS);
+    }
+    jpegli_abort_decompress(&cinfo_);
+    jpegli_mem_src(&cinfo_, data, size);
+    if (jpegli_read_header(&cinfo_, TRUE) != JPEG_HEADER_OK) {
+      jpegli_abort_decompress(&cinfo_);
+      RETURN_ERROR(INVALID_PARAMS);
+    }
+    info[0] = cinfo_.image_width;
+    info[1] = cinfo_.image_height;
+    info[2] = cinfo_.num_components;
+    has_header_ = true;
+    return OK;
+  }
+
+  int ResetArray(JNIEnv* env, jbyteArray input, jint offset, jint length,
+                 jint* info) {
+    if (offset < 0 || length <= 0) RETURN_ERROR(INVALID_PARAMS);
+    input_copy_.resize(length);
+    env->GetByteArrayRegion(input, offset, length,
+                            reinterpret_cast<jbyte*>(input_copy_.data()));
+    if (env->ExceptionCheck()) RETURN_ERROR(INVALID_PARAMS);
+    return Reset(input_copy_.data(), input_copy_.size(), info);
+  }
+
+  size_t width() const { return cinfo_.image_width; }
+  size_t height() const { return cinfo_.image_height; }
+  bool has_header() const { return has_header_; }
+
+  // Writes the image to pixels, which must hold height() rows of stride bytes.
+  int Decode(uint8_t* pixels, size_t stride, PixelFormat format) {
+    if (!has_header_) RETURN_ERROR(INVALID_PARAMS);
+    has_header_ = false;
+    bool in_place = (format == PIXEL_FORMAT_RGBA_8888);
+    if (!in_place) {
+      rgb_row_.resize(cinfo_.image_width * 3);
+    }
+    if (setjmp(env_)) {
+      jpegli_abort_decompress(&cinfo_);
+      RETURN_ERROR(INTERNAL);
+    }
+    cinfo_.out_color_space = in_place ? JCS_EXT_RGBA : JCS_RGB;
+    jpegli_start_decompress(&cinfo_);
+    while (cinfo_.output_scanline < cinfo_.output_height) {
+      uint8_t* row_out = pixels + cinfo_.output_scanline * stride;
+      JSAMPROW rows[] = {in_place ? row_out : rgb_row_.data()};
+      if (jpegli_read_scanlines(&cinfo_, rows, 1) != 1) {
+        jpegli_abort_decompress(&cinfo_);
+        RETURN_ERROR(INTERNAL);
+      }
+      if (!in_place) {
+        const uint8_t* rgb = rgb_row_.data();
+        for (size_t x = 0; x < cinfo_.output_width; ++x) {
+          uint16_t v = ((rgb[3 * x] >> 3) << 11) |
+                       ((rgb[3 * x + 1] >> 2) << 5) | (rgb[3 * x + 2] >> 3);
+          memcpy(row_out + 2 * x, &v, 2);
+        }
+      }
+    }
+    jpegli_finish_decompress(&cinfo_);
+    return OK;
+  }
+
+ private:
+  bool created_ = false;
+  bool has_header_ = false;
+  std::vector<uint8_t> input_copy_;
+  std::vector<uint8_t> rgb_row_;
+
+  // Jpegli decoder
+  jpeg_decompress_struct cinfo_ = {};
+  jpeg_error_mgr err_;
+  jmp_buf env_;
+};
+
+Decoder* FromHandle(jlong handle) {
+  return reinterpret_cast<Decoder*>(static_cast<intptr_t>(handle));
+}
+
+bool WriteInfo(JNIEnv* env, jintArray info, const jint* values) {
+  env->SetIntArrayRegion(info, 0, 3, values);
+  return !env->ExceptionCheck();
+}
+
+char* kCreateName = const_cast<char*>("nativeCreate");
+char* kCreateSig = const_cast<char*>("()J");
+char* kDestroyName = const_cast<char*>("nativeDestroy");
+char* kDestroySig = const_cast<char*>("(J)V");
+char* kResetName = const_cast<char*>("nativeReset");
+char* kResetSig = const_cast<char*>("(JLjava/nio/ByteBuffer;II[I)I");
+char* kResetArrayName = const_cast<char*>("nativeResetArray");
+char* kResetArraySig = const_cast<char*>("(J[BII[I)I");
+char* kDecodeName = const_cast<char*>("nativeDecode");
+char* kDecodeSig = const_cast<char*>("(JLjava/nio/ByteBuffer;II)I");
+char* kDecodeBitmapName = const_cast<char*>("nativeDecodeBitmap");
+char* kDecodeBitmapSig = const_cast<char*>("(JLjava/lang/Object;)I");
+
+const JNINativeMethod kDecoderMethods[] = {
+    {kCreateName, kCreateSig,
+     reinterpret_cast<void*>(
+         Java_org_jpeg_jpegli_wrapper_Decoder_nativeCreate)},
+    {kDestroyName, kDestroySig,
+     reinterpret_cast<void*>(
+         Java_org_jpeg_jpegli_wrapper_Decoder_nativeDestroy)},
+    {kResetName, kResetSig,
+     reinterpret_cast<void*>(Java_org_jpeg_jpegli_wrapper_Decoder_nativeReset)},
+    {kResetArrayName, kResetArraySig,
+     reinterpret_cast<void*>(
+         Java_org_jpeg_jpegli_wrapper_Decoder_nativeResetArray)},
+    {kDecodeName, kDecodeSig,
+     reinterpret_cast<void*>(
+         Java_org_jpeg_jpegli_wrapper_Decoder_nativeDecode)},
+    {kDecodeBitmapName, kDecodeBitmapSig,
+     reinterpret_cast<void*>(
+         Java_org_jpeg_jpegli_wrapper_Decoder_nativeDecodeBitmap)}};
+
+static const size_t kNumDecoderMethods = 6;
+
+}  // namespace
+
+jint DecoderJniRegister(JavaVM* vm) {
+  JNIEnv* env;
+  if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION) != JNI_OK) {
+    return JNI_ERR;
+  }
+
+  jclass localClassRef = env->FindClass("org/jpeg/jpegli/wrapper/Decoder");
+  if (localClassRef == nullptr || env->ExceptionCheck()) {
+    return JNI_ERR;
+  }
+  if (env->RegisterNatives(localClassRef, kDecoderMethods,
+                           kNumDecoderMethods) < 0) {
+    return JNI_ERR;
+  }
+  env->DeleteLocalRef(localClassRef);
+  return JNI_VERSION;
+}
+
+}  // namespace org_jpeg_jpegli_wrapper
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+JNIEXPORT jlong JNICALL Java_org_jpeg_jpegli_wrapper_Decoder_nativeCreate(
+    JNIEnv* env, jobject /*jobj*/) {
+  using org_jpeg_jpegli_wrapper::Decoder;
+  using org_jpeg_jpegli_wrapper::OK;
+
+  std::unique_ptr<Decoder> decoder{new (std::nothrow) Decoder()};
+  if (!decoder || decoder->Init() != OK) return 0;
+  return static_cast<jlong>(reinterpret_cast<intptr_t>(decoder.release()));
+}
+
+JNIEXPORT void JNICALL Java_org_jpeg_jpegli_wrapper_Decoder_nativeDestroy(
+    JNIEnv* env, jobject /*jobj*/, jlong handle) {
+  delete org_jpeg_jpegli_wrapper::FromHandle(handle);
+}
+
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Decoder_nativeReset(
+    JNIEnv* env, jobject /*jobj*/, jlong handle, jobject input, jint offset,
+    jint length, jintArray info) {
+  using org_jpeg_jpegli_wrapper::Decoder;
+  using org_jpeg_jpegli_wrapper::ERROR_INVALID_PARAMS;
+  using org_jpeg_jpegli_wrapper::OK;
+
+  Decoder* decoder = org_jpeg_jpegli_wrapper::FromHandle(handle);
+  if (decoder == nullptr) RETURN_ERROR(INVALID_PARAMS);
+  const uint8_t* data =
+      static_cast<const uint8_t*>(env->GetDirectBufferAddress(input));
+  jlong capacity = env->GetDirectBufferCapacity(input);
+  if (data == nullptr || offset < 0 || length <= 0 ||
+      static_cast<jlong>(offset) + length > capacity) {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+  jint info_values[3];
+  jint result = decoder->Reset(data + offset, length, info_values);
+  if (result != OK) return result;
+  if (!org_jpeg_jpegli_wrapper::WriteInfo(env, info, info_values)) {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+  return OK;
+}
+
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Decoder_nativeResetArray(
+    JNIEnv* env, jobject /*jobj*/, jlong handle, jbyteArray input, jint offset,
+    jint length, jintArray info) {
+  using org_jpeg_jpegli_wrapper::Decoder;
+  using org_jpeg_jpegli_wrapper::ERROR_INVALID_PARAMS;
+  using org_jpeg_jpegli_wrapper::OK;
+
+  Decoder* decoder = org_jpeg_jpegli_wrapper::FromHandle(handle);
+  if (decoder == nullptr) RETURN_ERROR(INVALID_PARAMS);
+  jint info_values[3];
+  jint result =
+      decoder->ResetArray(env, input, offset, length, info_values);
+  if (result != OK) return result;
+  if (!org_jpeg_jpegli_wrapper::WriteInfo(env, info, info_values)) {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+  return OK;
+}
+
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Decoder_nativeDecode(
+    JNIEnv* env, jobject /*jobj*/, jlong handle, jobject output, jint format,
+    jint stride) {
+  using org_jpeg_jpegli_wrapper::BytesPerPixel;
+  using org_jpeg_jpegli_wrapper::Decoder;
+  using org_jpeg_jpegli_wrapper::ERROR_INVALID_PARAMS;
+  using org_jpeg_jpegli_wrapper::PixelFormat;
+
+  Decoder* decoder = org_jpeg_jpegli_wrapper::FromHandle(handle);
+  if (decoder == nullptr || !decoder->has_header()) {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+  size_t bytes_per_pixel = BytesPerPixel(format);
+  if (bytes_per_pixel == 0 || stride <= 0) RETURN_ERROR(INVALID_PARAMS);
+  uint64_t row_size = static_cast<uint64_t>(decoder->width()) * bytes_per_pixel;
+  if (static_cast<uint64_t>(stride) < row_size) RETURN_ERROR(INVALID_PARAMS);
+  uint8_t* pixels = static_cast<uint8_t*>(env->GetDirectBufferAddress(output));
+  jlong capacity = env->GetDirectBufferCapacity(output);
+  if (pixels == nullptr || capacity < 0 ||
+      static_cast<uint64_t>(capacity) <
+          static_cast<uint64_t>(decoder->height() - 1) * stride + row_size) {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+  return decoder->Decode(pixels, stride, static_cast<PixelFormat>(format));
+}
+
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Decoder_nativeDecodeBitmap(
+    JNIEnv* env, jobject /*jobj*/, jlong handle, jobject bitmap) {
+  using org_jpeg_jpegli_wrapper::Decoder;
+  using org_jpeg_jpegli_wrapper::ERROR_INVALID_PARAMS;
+
+  Decoder* decoder = org_jpeg_jpegli_wrapper::FromHandle(handle);
+  if (decoder == nullptr || !decoder->has_header()) {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+#ifdef __ANDROID__
+  using org_jpeg_jpegli_wrapper::ERROR_INTERNAL;
+  using org_jpeg_jpegli_wrapper::PixelFormat;
+
+  AndroidBitmapInfo info;
+  if (AndroidBitmap_getInfo(env, bitmap, &info) !=
+          ANDROID_BITMAP_RESULT_SUCCESS ||
+      info.width != decoder->width() || info.height != decoder->height()) {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+  PixelFormat format;
+  if (info.format == ANDROID_BITMAP_FORMAT_RGBA_8888) {
+    format = org_jpeg_jpegli_wrapper::PIXEL_FORMAT_RGBA_8888;
+  } else if (info.format == ANDROID_BITMAP_FORMAT_RGB_565) {
+    format = org_jpeg_jpegli_wrapper::PIXEL_FORMAT_RGB_565;
+  } else {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+  void* pixels = nullptr;
+  if (AndroidBitmap_lockPixels(env, bitmap, &pixels) !=
+      ANDROID_BITMAP_RESULT_SUCCESS) {
+    RETURN_ERROR(INTERNAL);
+  }
+  jint result =
+      decoder->Decode(static_cast<uint8_t*>(pixels), info.stride, format);
+  AndroidBitmap_unlockPixels(env, bitmap);
+  return result;
+#else
+  // Bitmaps only exist on Android.
+  RETURN_ERROR(INVALID_PARAMS);
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
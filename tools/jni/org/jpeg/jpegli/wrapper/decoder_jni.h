@@ -0,0 +1,63 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef TOOLS_JNI_ORG_JPEG_JPEGLI_WRAPPER_DECODER_JNI
+#define TOOLS_JNI_ORG_JPEG_JPEGLI_WRAPPER_DECODER_JNI
+
+#include <jni.h>
+
+namespace org_jpeg_jpegli_wrapper {
+jint DecoderJniRegister(JavaVM* vm);
+}  // namespace org_jpeg_jpegli_wrapper
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Create native decoder; returns 0 on failure.
+ */
+JNIEXPORT jlong JNICALL Java_org_jpeg_jpegli_wrapper_Decoder_nativeCreate(
+    JNIEnv* env, jobject /*jobj*/);
+
+/**
+ * Destroy native decoder created by nativeCreate.
+ */
+JNIEXPORT void JNICALL Java_org_jpeg_jpegli_wrapper_Decoder_nativeDestroy(
+    JNIEnv* env, jobject /*jobj*/, jlong handle);
+
+/**
+ * Start decoding of a new image held in a direct ByteBuffer and read its
+ * header into info (width, height, number of components).
+ */
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Decoder_nativeReset(
+    JNIEnv* env, jobject /*jobj*/, jlong handle, jobject input, jint offset,
+    jint length, jintArray info);
+
+/**
+ * Same as nativeReset, but the image is copied from a Java array.
+ */
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Decoder_nativeResetArray(
+    JNIEnv* env, jobject /*jobj*/, jlong handle, jbyteArray input, jint offset,
+    jint length, jintArray info);
+
+/**
+ * Decode the current image into a direct ByteBuffer.
+ */
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Decoder_nativeDecode(
+    JNIEnv* env, jobject /*jobj*/, jlong handle, jobject output, jint format,
+    jint stride);
+
+/**
+ * Decode the current image into an Android Bitmap.
+ */
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Decoder_nativeDecodeBitmap(
+    JNIEnv* env, jobject /*jobj*/, jlong handle, jobject bitmap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // TOOLS_JNI_ORG_JPEG_JPEGLI_WRAPPER_DECODER_JNI
@@ -7,6 +7,10 @@
 
 #include <jni.h>
 
+#ifdef __ANDROID__
+#include <android/bitmap.h>
+#endif
+
 #include <algorithm>
 #include <array>
 #include <csetjmp>
@@ -27,6 +31,10 @@ jint JNI_VERSION = JNI_VERSION_1_6;
 
 jclass JC_WritableByteChannel;
 jmethodID JMID_WritableByteChannel_write;
+jmethodID JMID_Buffer_clear;
+jmethodID JMID_Buffer_limit;
+jclass JC_Encoder;
+jmethodID JMID_Encoder_growBuffer;
 
 enum ReturnCode {
   OK = 0,
@@ -35,6 +43,15 @@ enum ReturnCode {
   ERROR_INTERNAL = -3
 };
 
+enum PixelFormat {
+  // Java int[] of 0xAARRGGBB pixels; alpha is ignored.
+  PIXEL_FORMAT_INT_ARGB = 0,
+  // R, G, B, A bytes per pixel (Android ARGB_8888 layout); alpha is ignored.
+  PIXEL_FORMAT_RGBA_8888 = 1,
+  // Native endian 16-bit pixels with red in the top 5 bits (Android RGB_565).
+  PIXEL_FORMAT_RGB_565 = 2
+};
+
 // #define RETURN_ERROR(T) return ERROR_##T
 #define RETURN_ERROR(T) \
   return fprintf(stderr, "%s:%d: error " #T "\n", __FILE__, __LINE__), ERROR_##T
@@ -46,6 +63,9 @@ void ExitHandler(j_common_ptr cinfo) {
   longjmp(*env, 1);
 }
 
+// Writes either to a WritableByteChannel, through a native buffer that is
+// exposed to Java as one direct ByteBuffer for all flushes, or straight into a
+// direct ByteBuffer that Java replaces with a larger one when it is full.
 struct DestinationManager {
   // IMPORTANT: this should always be the first member!
   jpeg_destination_mgr pub;
@@ -55,6 +75,12 @@ struct DestinationManager {
 
   JNIEnv* jenv;
   jobject sink;
+  // Direct ByteBuffer over `output`, created on first flush.
+  jobject sink_buffer = nullptr;
+  // Caller provided direct ByteBuffer; used instead of sink when set.
+  jobject target = nullptr;
+  uint8_t* target_data = nullptr;
+  size_t target_capacity = 0;
   bool has_error = false;
 
   DestinationManager() {
@@ -63,31 +89,77 @@ struct DestinationManager {
     pub.term_destination = term_destination;
   }
 
+  bool SetTarget(jobject buffer) {
+    target_data = static_cast<uint8_t*>(jenv->GetDirectBufferAddress(buffer));
+    jlong capacity = jenv->GetDirectBufferCapacity(buffer);
+    if (target_data == nullptr || capacity < 0 || jenv->ExceptionCheck()) {
+      return false;
+    }
+    target = buffer;
+    target_capacity = capacity;
+    return true;
+  }
+
+  size_t BytesInTarget() const { return pub.next_output_byte - target_data; }
+
   void Rewind() {
+    if (target != nullptr) {
+      pub.next_output_byte = target_data;
+      pub.free_in_buffer = target_capacity;
+      return;
+    }
     pub.next_output_byte = output.get();
     pub.free_in_buffer = output_size;
   }
 
   void WriteAndRewind() {
+    if (target != nullptr) return;
     size_t to_write = pub.next_output_byte - output.get();
     if (to_write == 0) {
       return;
     }
-    jobject byte_buffer = jenv->NewDirectByteBuffer(output.get(), to_write);
-    if (byte_buffer == nullptr || jenv->ExceptionCheck()) {
+    if (sink_buffer == nullptr) {
+      sink_buffer = jenv->NewDirectByteBuffer(output.get(), output_size);
+      if (sink_buffer == nullptr || jenv->ExceptionCheck()) {
+        sink_buffer = nullptr;
+        has_error = true;
+        Rewind();
+        return;
+      }
+    }
+    // Expose [0, to_write) of the persistent buffer to the channel.
+    jobject self = jenv->CallObjectMethod(sink_buffer, JMID_Buffer_clear);
+    if (self != nullptr) jenv->DeleteLocalRef(self);
+    self = jenv->CallObjectMethod(sink_buffer, JMID_Buffer_limit,
+                                  static_cast<jint>(to_write));
+    if (self != nullptr) jenv->DeleteLocalRef(self);
+    if (jenv->ExceptionCheck()) {
       has_error = true;
       Rewind();
       return;
     }
     jint num_written =
-        jenv->CallIntMethod(sink, JMID_WritableByteChannel_write, byte_buffer);
-    jenv->DeleteLocalRef(byte_buffer);
+        jenv->CallIntMethod(sink, JMID_WritableByteChannel_write, sink_buffer);
     if (num_written != static_cast<jint>(to_write) || jenv->ExceptionCheck()) {
       has_error = true;
     }
     Rewind();
   }
 
+  // Asks Java for a larger target that starts with the bytes written so far.
+  void GrowTarget() {
+    size_t used = BytesInTarget();
+    jobject grown = jenv->CallStaticObjectMethod(
+        JC_Encoder, JMID_Encoder_growBuffer, target, static_cast<jint>(used));
+    if (grown == nullptr || jenv->ExceptionCheck() || !SetTarget(grown) ||
+        target_capacity <= used) {
+      has_error = true;
+      return;
+    }
+    pub.next_output_byte = target_data + used;
+    pub.free_in_buffer = target_capacity - used;
+  }
+
   static void init_destination(j_compress_ptr cinfo) {
     auto* self = reinterpret_cast<DestinationManager*>(cinfo->dest);
     self->Rewind();
@@ -96,7 +168,11 @@ struct DestinationManager {
   static boolean empty_output_buffer(j_compress_ptr cinfo) {
     auto* self = reinterpret_cast<DestinationManager*>(cinfo->dest);
     if (self->has_error) return FALSE;
-    self->WriteAndRewind();
+    if (self->target != nullptr) {
+      self->GrowTarget();
+    } else {
+      self->WriteAndRewind();
+    }
     if (self->has_error) return FALSE;
     return TRUE;
   }
@@ -112,8 +188,8 @@ typedef std::array<jint, 33> Config;
 class Encoder {
  public:
   Encoder(JNIEnv* jenv, jint width, jint height, const Config& config,
-          jintArray input, jobject output)
-      : jenv_(jenv), width_(width), height_(height), input_(input) {
+          jobject output)
+      : jenv_(jenv), width_(width), height_(height) {
     healthy_ = (static_cast<jint>(width_) == width) &&
                (static_cast<jint>(height_) == height);
 
@@ -138,6 +214,24 @@ class Encoder {
 
   ~Encoder() { jpegli_destroy_compress(&cinfo_); }
 
+  void SetInput(jintArray input) {
+    input_ = input;
+    format_ = PIXEL_FORMAT_INT_ARGB;
+  }
+
+  // Encode into a direct ByteBuffer instead of the output channel; see
+  // output_buffer() and output_bytes() after Run.
+  bool SetOutputBuffer(jobject buffer) { return dest_.SetTarget(buffer); }
+  jobject output_buffer() const { return dest_.target; }
+  size_t output_bytes() const { return dest_.BytesInTarget(); }
+
+  // Pixels are read in place and must stay valid until Run returns.
+  void SetInput(const uint8_t* pixels, size_t stride, PixelFormat format) {
+    pixels_ = pixels;
+    pixels_stride_ = stride;
+    format_ = format;
+  }
+
   int Run() {
     if (!healthy_) RETURN_ERROR(INVALID_PARAMS);
 
@@ -145,20 +239,27 @@ class Encoder {
                                                JSAMPROW[batch_lines_]};
     if (!batch_rows) RETURN_ERROR(ALLOCATION);
 
-    size_t input_stride = width_ * 4;
-    std::unique_ptr<uint8_t[]> batch{new (std::nothrow)
-                                         uint8_t[input_stride * batch_lines_]};
-    if (!batch) RETURN_ERROR(ALLOCATION);
-
-    size_t stride = width_ * 3;
-    for (size_t i = 0; i < batch_lines_; ++i) {
-      batch_rows[i] = batch.get() + i * stride;
+    // RGBA rows are passed to the encoder as they are; other layouts are
+    // repacked to RGB one batch at a time.
+    bool in_place = (format_ == PIXEL_FORMAT_RGBA_8888);
+    std::unique_ptr<uint8_t[]> batch;
+    if (!in_place) {
+      size_t input_stride = width_ * 4;
+      batch.reset(new (std::nothrow) uint8_t[input_stride * batch_lines_]);
+      if (!batch) RETURN_ERROR(ALLOCATION);
+
+      size_t stride = width_ * 3;
+      for (size_t i = 0; i < batch_lines_; ++i) {
+        batch_rows[i] = batch.get() + i * stride;
+      }
     }
 
-    dest_.output_size = output_buffer_size_;
-    dest_.output = std::unique_ptr<uint8_t[]>{new (std::nothrow)
-                                                  uint8_t[output_buffer_size_]};
-    if (!dest_.output) RETURN_ERROR(ALLOCATION);
+    if (dest_.target == nullptr) {
+      dest_.output_size = output_buffer_size_;
+      dest_.output = std::unique_ptr<uint8_t[]>{
+          new (std::nothrow) uint8_t[output_buffer_size_]};
+      if (!dest_.output) RETURN_ERROR(ALLOCATION);
+    }
     dest_.Rewind();
 
     // Setup error handling.
@@ -174,8 +275,8 @@ class Encoder {
 
     cinfo_.image_width = width_;
     cinfo_.image_height = height_;
-    cinfo_.input_components = 3;
-    cinfo_.in_color_space = JCS_RGB;
+    cinfo_.input_components = in_place ? 4 : 3;
+    cinfo_.in_color_space = in_place ? JCS_EXT_RGBX : JCS_RGB;
     jpegli_set_defaults(&cinfo_);
     jpegli_set_quality(&cinfo_, quality_, TRUE);
     cinfo_.comp_info[0].v_samp_factor = v_sampling_[0];
@@ -186,10 +287,16 @@ class Encoder {
     while (cinfo_.next_scanline < cinfo_.image_height) {
       size_t lines_left = cinfo_.image_height - cinfo_.next_scanline;
       size_t num_lines = std::min(batch_lines_, lines_left);
-      // We use batch buffer both for temporary storage of input RGBA and pixel
-      // data passed to encoder.
-      if (!ReadBatch(cinfo_.next_scanline, num_lines,
-                     reinterpret_cast<jint*>(batch.get()), batch.get())) {
+      if (in_place) {
+        for (size_t i = 0; i < num_lines; ++i) {
+          batch_rows[i] = const_cast<uint8_t*>(pixels_) +
+                          (cinfo_.next_scanline + i) * pixels_stride_;
+        }
+      } else if (!ReadBatch(cinfo_.next_scanline, num_lines,
+                            reinterpret_cast<jint*>(batch.get()),
+                            batch.get())) {
+        // We use batch buffer both for temporary storage of input RGBA and
+        // pixel data passed to encoder.
         RETURN_ERROR(INTERNAL);
       }
       size_t lines_done = 0;
@@ -218,6 +325,23 @@ class Encoder {
  private:
   bool ReadBatch(size_t y0, size_t num_lines, jint* tmp_buffer,
                  uint8_t* buffer) {
+    if (format_ == PIXEL_FORMAT_RGB_565) {
+      for (size_t y = 0; y < num_lines; ++y) {
+        const uint8_t* row_in = pixels_ + (y0 + y) * pixels_stride_;
+        uint8_t* row_out = buffer + y * width_ * 3;
+        for (size_t x = 0; x < width_; ++x) {
+          uint16_t v;
+          memcpy(&v, row_in + 2 * x, 2);
+          uint8_t r = v >> 11;
+          uint8_t g = (v >> 5) & 0x3F;
+          uint8_t b = v & 0x1F;
+          row_out[3 * x] = (r << 3) | (r >> 2);
+          row_out[3 * x + 1] = (g << 2) | (g >> 4);
+          row_out[3 * x + 2] = (b << 3) | (b >> 2);
+        }
+      }
+      return true;
+    }
     size_t num_pixels = num_lines * width_;
     jenv_->GetIntArrayRegion(input_, y0 * width_, num_pixels, tmp_buffer);
     if (jenv_->ExceptionCheck()) return false;
@@ -242,7 +366,10 @@ class Encoder {
   // TODO(eustas): depends on v_sampling_; make configurable
   size_t batch_lines_ = 32;
   size_t output_buffer_size_;
-  jintArray input_;
+  PixelFormat format_ = PIXEL_FORMAT_INT_ARGB;
+  jintArray input_ = nullptr;
+  const uint8_t* pixels_ = nullptr;
+  size_t pixels_stride_ = 0;
 
   // Jpegli encoder
   jpeg_compress_struct cinfo_ = {};
@@ -251,16 +378,62 @@ class Encoder {
   DestinationManager dest_;
 };
 
+bool ReadConfig(JNIEnv* env, jintArray config, Config* config_values) {
+  env->GetIntArrayRegion(config, 0, 33, config_values->data());
+  return !env->ExceptionCheck();
+}
+
+jint EncodePixels(JNIEnv* env, jint width, jint height, jintArray config,
+                  const uint8_t* pixels, size_t stride, PixelFormat format,
+                  jobject output) {
+  Config config_values;
+  if (!ReadConfig(env, config, &config_values)) RETURN_ERROR(INVALID_PARAMS);
+  std::unique_ptr<Encoder> encoder{new (std::nothrow) Encoder(
+      env, width, height, config_values, output)};
+  if (!encoder) RETURN_ERROR(ALLOCATION);
+  encoder->SetInput(pixels, stride, format);
+  return encoder->Run();
+}
+
+size_t BytesPerPixel(jint format) {
+  switch (format) {
+    case PIXEL_FORMAT_RGBA_8888:
+      return 4;
+    case PIXEL_FORMAT_RGB_565:
+      return 2;
+    default:
+      return 0;
+  }
+}
+
 char* kEncodeName = const_cast<char*>("nativeEncode");
 char* kEncodeSig =
-    const_cast<char*>("(III[ILjava/nio/channels/WritableByteChannel;)I");
+    const_cast<char*>("(II[I[ILjava/nio/channels/WritableByteChannel;)I");
+char* kEncodeToBufferName = const_cast<char*>("nativeEncodeToBuffer");
+char* kEncodeToBufferSig =
+    const_cast<char*>("(II[I[I[Ljava/nio/ByteBuffer;)I");
+char* kEncodeBufferName = const_cast<char*>("nativeEncodeBuffer");
+char* kEncodeBufferSig = const_cast<char*>(
+    "(II[ILjava/nio/ByteBuffer;IILjava/nio/channels/WritableByteChannel;)I");
+char* kEncodeBitmapName = const_cast<char*>("nativeEncodeBitmap");
+char* kEncodeBitmapSig = const_cast<char*>(
+    "([ILjava/lang/Object;Ljava/nio/channels/WritableByteChannel;)I");
 
 const JNINativeMethod kEncoderMethods[] = {
     {kEncodeName, kEncodeSig,
      reinterpret_cast<void*>(
-         Java_org_jpeg_jpegli_wrapper_Encoder_nativeEncode)}};
+         Java_org_jpeg_jpegli_wrapper_Encoder_nativeEncode)},
+    {kEncodeToBufferName, kEncodeToBufferSig,
+     reinterpret_cast<void*>(
+         Java_org_jpeg_jpegli_wrapper_Encoder_nativeEncodeToBuffer)},
+    {kEncodeBufferName, kEncodeBufferSig,
+     reinterpret_cast<void*>(
+         Java_org_jpeg_jpegli_wrapper_Encoder_nativeEncodeBuffer)},
+    {kEncodeBitmapName, kEncodeBitmapSig,
+     reinterpret_cast<void*>(
+         Java_org_jpeg_jpegli_wrapper_Encoder_nativeEncodeBitmap)}};
 
-static const size_t kNumEncoderMethods = 1;
+static const size_t kNumEncoderMethods = 4;
 
 }  // namespace
 
@@ -291,7 +464,11 @@ extern "C" {
 JNIEXPORT jint JNICALL
 Java_org_jpeg_jpegli_wrapper_Encoder_nativeInit(JNIEnv* env, jobject /*jobj*/) {
   using org_jpeg_jpegli_wrapper::ERROR_INTERNAL;
+  using org_jpeg_jpegli_wrapper::JC_Encoder;
   using org_jpeg_jpegli_wrapper::JC_WritableByteChannel;
+  using org_jpeg_jpegli_wrapper::JMID_Buffer_clear;
+  using org_jpeg_jpegli_wrapper::JMID_Buffer_limit;
+  using org_jpeg_jpegli_wrapper::JMID_Encoder_growBuffer;
   using org_jpeg_jpegli_wrapper::JMID_WritableByteChannel_write;
   using org_jpeg_jpegli_wrapper::OK;
 
@@ -312,6 +489,39 @@ Java_org_jpeg_jpegli_wrapper_Encoder_nativeInit(JNIEnv* env, jobject /*jobj*/) {
     RETURN_ERROR(INTERNAL);
   }
 
+  // NB: java.nio.Buffer methods are used, as ByteBuffer overrides them with
+  //     covariant return types only since Java 9.
+  localClassRef = env->FindClass("java/nio/Buffer");
+  if (localClassRef == nullptr || env->ExceptionCheck()) {
+    RETURN_ERROR(INTERNAL);
+  }
+  JMID_Buffer_clear =
+      env->GetMethodID(localClassRef, "clear", "()Ljava/nio/Buffer;");
+  JMID_Buffer_limit =
+      env->GetMethodID(localClassRef, "limit", "(I)Ljava/nio/Buffer;");
+  if (JMID_Buffer_clear == nullptr || JMID_Buffer_limit == nullptr ||
+      env->ExceptionCheck()) {
+    RETURN_ERROR(INTERNAL);
+  }
+  env->DeleteLocalRef(localClassRef);
+
+  localClassRef = env->FindClass("org/jpeg/jpegli/wrapper/Encoder");
+  if (localClassRef == nullptr || env->ExceptionCheck()) {
+    RETURN_ERROR(INTERNAL);
+  }
+  JC_Encoder = (jclass)env->NewGlobalRef(localClassRef);
+  if (JC_Encoder == nullptr || env->ExceptionCheck()) {
+    RETURN_ERROR(INTERNAL);
+  }
+  env->DeleteLocalRef(localClassRef);
+
+  JMID_Encoder_growBuffer =
+      env->GetStaticMethodID(JC_Encoder, "growBuffer",
+                             "(Ljava/nio/ByteBuffer;I)Ljava/nio/ByteBuffer;");
+  if (JMID_Encoder_growBuffer == nullptr || env->ExceptionCheck()) {
+    RETURN_ERROR(INTERNAL);
+  }
+
   return OK;
 }
 
@@ -330,11 +540,107 @@ JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Encoder_nativeEncode(
   }
 
   std::unique_ptr<Encoder> encoder{new (std::nothrow) Encoder(
-      env, width, height, config_values, input, output)};
+      env, width, height, config_values, output)};
   if (!encoder) RETURN_ERROR(ALLOCATION);
+  encoder->SetInput(input);
   return encoder->Run();
 }
 
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Encoder_nativeEncodeToBuffer(
+    JNIEnv* env, jobject /*jobj*/, jint width, jint height, jintArray config,
+    jintArray input, jobjectArray output) {
+  using org_jpeg_jpegli_wrapper::Config;
+  using org_jpeg_jpegli_wrapper::Encoder;
+  using org_jpeg_jpegli_wrapper::ERROR_ALLOCATION;
+  using org_jpeg_jpegli_wrapper::ERROR_INTERNAL;
+  using org_jpeg_jpegli_wrapper::ERROR_INVALID_PARAMS;
+  using org_jpeg_jpegli_wrapper::OK;
+
+  Config config_values;
+  env->GetIntArrayRegion(config, 0, 33, config_values.data());
+  if (env->ExceptionCheck()) {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+  jobject buffer = env->GetObjectArrayElement(output, 0);
+  if (buffer == nullptr || env->ExceptionCheck()) {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+
+  std::unique_ptr<Encoder> encoder{new (std::nothrow) Encoder(
+      env, width, height, config_values, nullptr)};
+  if (!encoder) RETURN_ERROR(ALLOCATION);
+  if (!encoder->SetOutputBuffer(buffer)) RETURN_ERROR(INVALID_PARAMS);
+  encoder->SetInput(input);
+  jint result = encoder->Run();
+  if (result != OK) return result;
+  env->SetObjectArrayElement(output, 0, encoder->output_buffer());
+  if (env->ExceptionCheck()) RETURN_ERROR(INTERNAL);
+  return static_cast<jint>(encoder->output_bytes());
+}
+
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Encoder_nativeEncodeBuffer(
+    JNIEnv* env, jobject /*jobj*/, jint width, jint height, jintArray config,
+    jobject input, jint format, jint stride, jobject output) {
+  using org_jpeg_jpegli_wrapper::BytesPerPixel;
+  using org_jpeg_jpegli_wrapper::ERROR_INVALID_PARAMS;
+  using org_jpeg_jpegli_wrapper::PixelFormat;
+
+  size_t bytes_per_pixel = BytesPerPixel(format);
+  if (bytes_per_pixel == 0 || width <= 0 || height <= 0 || stride <= 0) {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+  uint64_t row_size = static_cast<uint64_t>(width) * bytes_per_pixel;
+  if (static_cast<uint64_t>(stride) < row_size) RETURN_ERROR(INVALID_PARAMS);
+  const uint8_t* pixels =
+      static_cast<const uint8_t*>(env->GetDirectBufferAddress(input));
+  jlong capacity = env->GetDirectBufferCapacity(input);
+  if (pixels == nullptr || capacity < 0 ||
+      static_cast<uint64_t>(capacity) <
+          static_cast<uint64_t>(height - 1) * stride + row_size) {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+  return org_jpeg_jpegli_wrapper::EncodePixels(
+      env, width, height, config, pixels, stride,
+      static_cast<PixelFormat>(format), output);
+}
+
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Encoder_nativeEncodeBitmap(
+    JNIEnv* env, jobject /*jobj*/, jintArray config, jobject bitmap,
+    jobject output) {
+  using org_jpeg_jpegli_wrapper::ERROR_INVALID_PARAMS;
+#ifdef __ANDROID__
+  using org_jpeg_jpegli_wrapper::ERROR_INTERNAL;
+  using org_jpeg_jpegli_wrapper::PixelFormat;
+
+  AndroidBitmapInfo info;
+  if (AndroidBitmap_getInfo(env, bitmap, &info) !=
+      ANDROID_BITMAP_RESULT_SUCCESS) {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+  PixelFormat format;
+  if (info.format == ANDROID_BITMAP_FORMAT_RGBA_8888) {
+    format = org_jpeg_jpegli_wrapper::PIXEL_FORMAT_RGBA_8888;
+  } else if (info.format == ANDROID_BITMAP_FORMAT_RGB_565) {
+    format = org_jpeg_jpegli_wrapper::PIXEL_FORMAT_RGB_565;
+  } else {
+    RETURN_ERROR(INVALID_PARAMS);
+  }
+  void* pixels = nullptr;
+  if (AndroidBitmap_lockPixels(env, bitmap, &pixels) !=
+      ANDROID_BITMAP_RESULT_SUCCESS) {
+    RETURN_ERROR(INTERNAL);
+  }
+  jint result = org_jpeg_jpegli_wrapper::EncodePixels(
+      env, info.width, info.height, config, static_cast<uint8_t*>(pixels),
+      info.stride, format, output);
+  AndroidBitmap_unlockPixels(env, bitmap);
+  return result;
+#else
+  // Bitmaps only exist on Android.
+  RETURN_ERROR(INVALID_PARAMS);
+#endif
+}
+
 #ifdef __cplusplus
 }
 #endif
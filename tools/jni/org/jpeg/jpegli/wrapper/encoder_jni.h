@@ -30,6 +30,29 @@ JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Encoder_nativeEncode(
     JNIEnv* env, jobject /*jobj*/, jint width, jint height, jintArray config,
     jintArray input, jobject output);
 
+/**
+ * Encode image with jpegli into the direct ByteBuffer output[0]; when it is
+ * full, it is replaced with a larger one. Returns the encoded size or an error
+ * code.
+ */
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Encoder_nativeEncodeToBuffer(
+    JNIEnv* env, jobject /*jobj*/, jint width, jint height, jintArray config,
+    jintArray input, jobjectArray output);
+
+/**
+ * Encode image with jpegli; pixels are read in place from a direct ByteBuffer.
+ */
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Encoder_nativeEncodeBuffer(
+    JNIEnv* env, jobject /*jobj*/, jint width, jint height, jintArray config,
+    jobject input, jint format, jint stride, jobject output);
+
+/**
+ * Encode image with jpegli; pixels are read in place from an Android Bitmap.
+ */
+JNIEXPORT jint JNICALL Java_org_jpeg_jpegli_wrapper_Encoder_nativeEncodeBitmap(
+    JNIEnv* env, jobject /*jobj*/, jintArray config, jobject bitmap,
+    jobject output);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,6 +5,7 @@
 
 #include <jni.h>
 
+#include "tools/jni/org/jpeg/jpegli/wrapper/decoder_jni.h"
 #include "tools/jni/org/jpeg/jpegli/wrapper/encoder_jni.h"
 
 #ifdef __cplusplus
@@ -12,7 +13,8 @@ extern "C" {
 #endif
 
 JNIEXPORT jint JNI_OnLoad(JavaVM* vm, void* reserved) {
-  return org_jpeg_jpegli_wrapper::JniRegister(vm);
+  if (org_jpeg_jpegli_wrapper::JniRegister(vm) == JNI_ERR) return JNI_ERR;
+  return org_jpeg_jpegli_wrapper::DecoderJniRegister(vm);
 }
 
 JNIEXPORT void JNI_OnUnload(JavaVM* vm, void* reserved) {
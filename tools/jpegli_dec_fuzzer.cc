@@ -8,11 +8,13 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <hwy/targets.h>
 #include <vector>
 
+#include "lib/base/printf_macros.h"
 #include "lib/jpegli/common.h"
 #include "lib/jpegli/decode.h"
 #include "lib/jpegli/fuzztest.h"
@@ -42,6 +44,45 @@ struct FuzzSpec {
   int crop_output;
 };
 
+// State of the error handler, which records the work of the decoder before
+// destroying it.
+struct ErrorContext {
+  jmp_buf env;
+  JpegliDecodeWork* work;
+};
+
+// In the algorithmic complexity mode, which is enabled by setting the
+// JPEGLI_FUZZER_MAX_WORK_RATIO environment variable to a positive number, the
+// fuzzer aborts on inputs whose decoding work, the sum of the decoded MCUs,
+// the bytes copied to the internal input buffer and the allocations, is more
+// than that many times the input size. This finds inputs that make the
+// decoder do superlinear work, e.g. with many progressive scans or with a
+// source that suspends within large marker segments.
+size_t MaxWorkRatio() {
+  static const size_t max_work_ratio = [] {
+    const char* value = getenv("JPEGLI_FUZZER_MAX_WORK_RATIO");
+    return value == nullptr ? 0 : strtoul(value, nullptr, 10);
+  }();
+  return max_work_ratio;
+}
+
+void CheckWork(const JpegliDecodeWork& work, size_t input_size) {
+  const size_t max_work_ratio = MaxWorkRatio();
+  if (max_work_ratio == 0) return;
+  const uint64_t total_work = static_cast<uint64_t>(work.num_mcus) +
+                              work.buffered_bytes + work.num_allocations;
+  if (total_work <= static_cast<uint64_t>(max_work_ratio) * (input_size + 1)) {
+    return;
+  }
+  fprintf(stderr,
+          "Decoding work exceeds %" PRIuS " per input byte: %" PRIuS
+          " input bytes, %" PRIuS " scans, %" PRIuS " MCUs, %" PRIuS
+          " buffered bytes, %" PRIuS " allocations\n",
+          max_work_ratio, input_size, work.num_scans, work.num_mcus,
+          work.buffered_bytes, work.num_allocations);
+  abort();
+}
+
 constexpr uint8_t kFakeEoiMarker[2] = {0xff, 0xd9};
 constexpr size_t kNumSourceBuffers = 4;
 
@@ -125,18 +166,23 @@ bool DecodeJpeg(const uint8_t* data, size_t size, size_t max_pixels,
                 size_t* xsize, size_t* ysize) {
   SourceManager src(data, size, spec.chunk_size);
   jpeg_decompress_struct cinfo;
+  JpegliDecodeWork work = {};
   const auto try_catch_block = [&]() -> bool {
     jpeg_error_mgr jerr;
-    jmp_buf env;
+    ErrorContext context;
+    context.work = &work;
     cinfo.err = jpegli_std_error(&jerr);
-    if (setjmp(env)) {
+    if (setjmp(context.env)) {
       return false;
     }
-    cinfo.client_data = reinterpret_cast<void*>(&env);
+    cinfo.client_data = reinterpret_cast<void*>(&context);
     cinfo.err->error_exit = [](j_common_ptr cinfo) {
-      jmp_buf* env = reinterpret_cast<jmp_buf*>(cinfo->client_data);
+      ErrorContext* context =
+          reinterpret_cast<ErrorContext*>(cinfo->client_data);
+      jpegli_get_decode_work(reinterpret_cast<j_decompress_ptr>(cinfo),
+                             context->work);
       jpegli_destroy(cinfo);
-      longjmp(*env, 1);
+      longjmp(context->env, 1);
     };
     cinfo.err->emit_message = [](j_common_ptr cinfo, int msg_level) {};
     jpegli_create_decompress(&cinfo);
@@ -165,10 +211,12 @@ bool DecodeJpeg(const uint8_t* data, size_t size, size_t max_pixels,
     }
     Consume(pixels->cbegin(), pixels->cend());
     jpegli_finish_decompress(&cinfo);
+    jpegli_get_decode_work(&cinfo, &work);
     return true;
   };
   bool success = try_catch_block();
   jpegli_destroy_decompress(&cinfo);
+  CheckWork(work, size);
   return success;
 }
 
@@ -13,7 +13,6 @@
 #include <cstdlib>
 #include <cstring>
 #include <string>
-#include <thread>
 #include <utility>
 
 #include "lib/base/status.h"
@@ -32,6 +31,7 @@
 #include "lib/base/random.h"
 #include "lib/base/status.h"
 #include "lib/jpegli/encode.h"
+#include "lib/threads/thread_parallel_runner.h"
 #include "tools/file_io.h"
 #include "tools/thread_pool_internal.h"
 
@@ -274,7 +274,7 @@ int main(int argc, const char** argv) {
   const char* dest_dir = nullptr;
   bool regenerate = false;
   bool quiet = false;
-  size_t num_threads = std::thread::hardware_concurrency();
+  size_t num_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
   for (int optind = 1; optind < argc;) {
     if (!strcmp(argv[optind], "-r")) {
       regenerate = true;
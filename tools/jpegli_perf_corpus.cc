@@ -0,0 +1,276 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+// Times jpegli on a fixed corpus of generated images, see
+// tools/scripts/jpegli_perf_regression.py.
+
+#include <setjmp.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lib/base/status.h"
+#include "lib/extras/packed_image.h"
+#include "lib/extras/test_image.h"
+#include "lib/extras/time.h"
+#include "lib/jpegli/decode.h"
+#include "lib/jpegli/encode.h"
+
+namespace {
+
+struct PerfConfig {
+  size_t xsize;
+  size_t ysize;
+  // Sampling factors of the luma component, those of the chroma components
+  // are 1x1.
+  int h_samp_factor;
+  int v_samp_factor;
+  int progressive_level;
+  int restart_in_rows;
+  // Bits per sample of the input of the encoder and of the output of the
+  // decoder, 8 or 16.
+  int bits;
+
+  std::string Name() const {
+    const char* sampling = h_samp_factor == 1   ? "444"
+                           : v_samp_factor == 1 ? "422"
+                                                : "420";
+    char name[100];
+    snprintf(name, sizeof(name), "%dx%d_%s_p%d_r%d_%dbit",
+             static_cast<int>(xsize), static_cast<int>(ysize), sampling,
+             progressive_level, restart_in_rows, bits);
+    return name;
+  }
+};
+
+std::vector<PerfConfig> CorpusConfigs(bool quick) {
+  std::vector<std::pair<size_t, size_t>> sizes = {{256, 256}};
+  if (!quick) {
+    sizes.emplace_back(1024, 768);
+    sizes.emplace_back(2048, 2048);
+  }
+  const std::vector<std::pair<int, int>> samplings = {{1, 1}, {2, 1}, {2, 2}};
+  std::vector<PerfConfig> configs;
+  for (const auto& size : sizes) {
+    for (const auto& sampling : samplings) {
+      for (int progressive_level : {0, 1, 2}) {
+        for (int restart_in_rows : {0, 1}) {
+          for (int bits : {8, 16}) {
+            configs.push_back({size.first, size.second, sampling.first,
+                               sampling.second, progressive_level,
+                               restart_in_rows, bits});
+          }
+        }
+      }
+    }
+  }
+  return configs;
+}
+
+void ErrorExit(j_common_ptr cinfo) {
+  (*cinfo->err->output_message)(cinfo);
+  jmp_buf* env = static_cast<jmp_buf*>(cinfo->client_data);
+  longjmp(*env, 1);
+}
+
+bool Encode(const PerfConfig& config, const jxl::extras::PackedImage& image,
+            std::vector<uint8_t>* compressed) {
+  uint8_t* buffer = nullptr;
+  unsigned long buffer_size = 0;  // NOLINT
+  jpeg_compress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    jpeg_error_mgr jerr;
+    jmp_buf env;
+    cinfo.err = jpegli_std_error(&jerr);
+    jerr.error_exit = &ErrorExit;
+    if (setjmp(env)) {
+      return false;
+    }
+    cinfo.client_data = static_cast<void*>(&env);
+    jpegli_create_compress(&cinfo);
+    jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+    cinfo.image_width = image.xsize;
+    cinfo.image_height = image.ysize;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpegli_set_defaults(&cinfo);
+    jpegli_set_quality(&cinfo, 90, TRUE);
+    cinfo.comp_info[0].h_samp_factor = config.h_samp_factor;
+    cinfo.comp_info[0].v_samp_factor = config.v_samp_factor;
+    jpegli_set_progressive_level(&cinfo, config.progressive_level);
+    cinfo.restart_in_rows = config.restart_in_rows;
+    jpegli_set_input_format(
+        &cinfo, config.bits == 8 ? JPEGLI_TYPE_UINT8 : JPEGLI_TYPE_UINT16,
+        JPEGLI_LITTLE_ENDIAN);
+    jpegli_start_compress(&cinfo, TRUE);
+    const uint8_t* pixels = static_cast<const uint8_t*>(image.pixels());
+    while (cinfo.next_scanline < cinfo.image_height) {
+      // The rows are not modified by the encoder.
+      JSAMPROW row[] = {const_cast<uint8_t*>(pixels) +
+                        cinfo.next_scanline * image.stride};
+      jpegli_write_scanlines(&cinfo, row, 1);
+    }
+    jpegli_finish_compress(&cinfo);
+    return true;
+  };
+  bool success = try_catch_block();
+  jpegli_destroy_compress(&cinfo);
+  if (success) {
+    compressed->assign(buffer, buffer + buffer_size);
+  }
+  if (buffer) free(buffer);
+  return success;
+}
+
+bool Decode(const PerfConfig& config, const std::vector<uint8_t>& compressed,
+            std::vector<uint8_t>* pixels) {
+  jpeg_decompress_struct cinfo;
+  const auto try_catch_block = [&]() -> bool {
+    jpeg_error_mgr jerr;
+    jmp_buf env;
+    cinfo.err = jpegli_std_error(&jerr);
+    jerr.error_exit = &ErrorExit;
+    if (setjmp(env)) {
+      return false;
+    }
+    cinfo.client_data = static_cast<void*>(&env);
+    jpegli_create_decompress(&cinfo);
+    jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+    jpegli_read_header(&cinfo, TRUE);
+    jpegli_set_output_format(
+        &cinfo, config.bits == 8 ? JPEGLI_TYPE_UINT8 : JPEGLI_TYPE_UINT16,
+        JPEGLI_LITTLE_ENDIAN);
+    jpegli_start_decompress(&cinfo);
+    const size_t stride = cinfo.output_width * cinfo.out_color_components *
+                          (config.bits / 8);
+    pixels->resize(stride * cinfo.output_height);
+    while (cinfo.output_scanline < cinfo.output_height) {
+      JSAMPROW row[] = {pixels->data() + cinfo.output_scanline * stride};
+      jpegli_read_scanlines(&cinfo, row, 1);
+    }
+    jpegli_finish_decompress(&cinfo);
+    return true;
+  };
+  bool success = try_catch_block();
+  jpegli_destroy_decompress(&cinfo);
+  return success;
+}
+
+// Returns the time of a fixed workload that does not depend on jpegli, so that
+// the jpegli times can be compared between machines as multiples of it.
+double CalibrationSeconds(size_t num_reps) {
+  std::vector<float> values(1 << 20);
+  for (size_t i = 0; i < values.size(); ++i) {
+    values[i] = static_cast<float>(i % 255);
+  }
+  double best = 1e30;
+  float sum = 0.0f;
+  for (size_t rep = 0; rep < num_reps; ++rep) {
+    const double t0 = jxl::Now();
+    for (int pass = 0; pass < 16; ++pass) {
+      for (float& v : values) {
+        v = v * 0.99f + 1.0f;
+      }
+      sum += values[pass];
+    }
+    best = std::min(best, jxl::Now() - t0);
+  }
+  // Keeps the loop from being optimized away.
+  if (sum == -1.0f) fprintf(stderr, "%f\n", sum);
+  return best;
+}
+
+bool RunConfig(const PerfConfig& config, size_t num_reps, double* encode_time,
+               double* decode_time, size_t* compressed_size) {
+  jxl::test::TestImage image;
+  JXL_RETURN_IF_ERROR(image.SetDimensions(config.xsize, config.ysize));
+  JXL_RETURN_IF_ERROR(image.SetChannels(3));
+  image.SetAllBitDepths(config.bits)
+      .SetDataType(config.bits == 8 ? JXL_TYPE_UINT8 : JXL_TYPE_UINT16)
+      .SetEndianness(JXL_LITTLE_ENDIAN);
+  JXL_ASSIGN_OR_RETURN(jxl::test::TestImage::Frame frame, image.AddFrame());
+  frame.RandomFill();
+  const jxl::extras::PackedImage& pixels = image.ppf().frames[0].color;
+
+  std::vector<uint8_t> compressed;
+  std::vector<uint8_t> decoded;
+  *encode_time = *decode_time = 1e30;
+  for (size_t rep = 0; rep < num_reps; ++rep) {
+    const double t0 = jxl::Now();
+    if (!Encode(config, pixels, &compressed)) return false;
+    const double t1 = jxl::Now();
+    if (!Decode(config, compressed, &decoded)) return false;
+    const double t2 = jxl::Now();
+    *encode_time = std::min(*encode_time, t1 - t0);
+    *decode_time = std::min(*decode_time, t2 - t1);
+  }
+  *compressed_size = compressed.size();
+  return true;
+}
+
+void Usage() {
+  fprintf(stderr,
+          "Use: jpegli_perf_corpus [-n REPS] [-q] [-f FILTER]\n"
+          "\n"
+          "Prints the fastest encoding and decoding time in seconds of each\n"
+          "configuration of the corpus, one line per configuration with the\n"
+          "fields NAME ENCODE_SECONDS DECODE_SECONDS COMPRESSED_SIZE separated\n"
+          "by tabs. The first line is the calibration workload.\n"
+          "\n"
+          "  -n REPS Number of times to encode and decode each image.\n"
+          "  -q Only use the smallest image size.\n"
+          "  -f FILTER Only run the configurations whose name contains FILTER."
+          "\n");
+}
+
+}  // namespace
+
+int main(int argc, const char** argv) {
+  size_t num_reps = 5;
+  bool quick = false;
+  std::string filter;
+  for (int optind = 1; optind < argc;) {
+    if (!strcmp(argv[optind], "-q")) {
+      quick = true;
+      optind++;
+    } else if (!strcmp(argv[optind], "-n") && optind + 1 < argc) {
+      num_reps = std::max(1, atoi(argv[optind + 1]));
+      optind += 2;
+    } else if (!strcmp(argv[optind], "-f") && optind + 1 < argc) {
+      filter = argv[optind + 1];
+      optind += 2;
+    } else {
+      fprintf(stderr, "Unknown parameter: \"%s\".\n", argv[optind]);
+      Usage();
+      return 1;
+    }
+  }
+
+  const double calibration = CalibrationSeconds(num_reps);
+  printf("calibration\t%.9f\t%.9f\t0\n", calibration, calibration);
+  for (const PerfConfig& config : CorpusConfigs(quick)) {
+    const std::string name = config.Name();
+    if (name.find(filter) == std::string::npos) continue;
+    double encode_time;
+    double decode_time;
+    size_t compressed_size;
+    if (!RunConfig(config, num_reps, &encode_time, &decode_time,
+                   &compressed_size)) {
+      fprintf(stderr, "Failed to encode or decode %s\n", name.c_str());
+      return 1;
+    }
+    printf("%s\t%.9f\t%.9f\t%d\n", name.c_str(), encode_time, decode_time,
+           static_cast<int>(compressed_size));
+    fflush(stdout);
+  }
+  return 0;
+}
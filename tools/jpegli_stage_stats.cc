@@ -0,0 +1,93 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "tools/jpegli_stage_stats.h"
+
+#include <cstddef>
+#include <cstdio>
+
+#include "lib/base/printf_macros.h"
+#include "lib/jpegli/common.h"
+
+namespace jpegxl {
+namespace tools {
+
+namespace {
+
+const char* StageName(int stage) {
+  static const char* const kNames[JPEGLI_NUM_STAGES] = {
+      "read_input",
+      "color_transform",
+      "downsample",
+      "adaptive_quant",
+      "dct",
+      "tokenize",
+      "optimize_huffman",
+      "write_scans",
+      "process_markers",
+      "process_scan",
+      "idct",
+      "upsample",
+      "write_output",
+      "parallel_render",
+  };
+  return kNames[stage];
+}
+
+}  // namespace
+
+void JpegliStageTotals::Add(const jpegli_stage_stats& stats,
+                            size_t image_pixels) {
+  ++num_runs;
+  num_pixels += image_pixels;
+  for (int i = 0; i < JPEGLI_NUM_STAGES; ++i) {
+    seconds[i] += stats.seconds[i];
+    num_calls[i] += stats.num_calls[i];
+    instructions[i] += stats.instructions[i];
+    cache_misses[i] += stats.cache_misses[i];
+    branch_misses[i] += stats.branch_misses[i];
+  }
+}
+
+void JpegliStageTotals::Assimilate(const JpegliStageTotals& victim) {
+  num_runs += victim.num_runs;
+  num_pixels += victim.num_pixels;
+  for (int i = 0; i < JPEGLI_NUM_STAGES; ++i) {
+    seconds[i] += victim.seconds[i];
+    num_calls[i] += victim.num_calls[i];
+    instructions[i] += victim.instructions[i];
+    cache_misses[i] += victim.cache_misses[i];
+    branch_misses[i] += victim.branch_misses[i];
+  }
+}
+
+void JpegliStageTotals::Print(const char* title) const {
+  if (num_runs == 0) return;
+  bool has_counters = false;
+  for (double count : instructions) has_counters |= count > 0;
+  printf("%s stages over %" PRIuS " runs:\n", title, num_runs);
+  printf("%-17s %10s %10s %10s %10s %10s\n", "Stage", "Calls", "ms",
+         "Instr/px", "CacheMPKI", "BranchMPKI");
+  for (int i = 0; i < JPEGLI_NUM_STAGES; ++i) {
+    if (num_calls[i] == 0) continue;
+    printf("%-17s %10" PRIuS " %10.3f", StageName(i), num_calls[i],
+           seconds[i] * 1e3);
+    if (has_counters && instructions[i] > 0) {
+      printf(" %10.2f %10.3f %10.3f\n",
+             num_pixels > 0 ? instructions[i] / num_pixels : 0.0,
+             cache_misses[i] * 1e3 / instructions[i],
+             branch_misses[i] * 1e3 / instructions[i]);
+    } else {
+      printf(" %10s %10s %10s\n", "n/a", "n/a", "n/a");
+    }
+  }
+  if (!has_counters) {
+    printf("The hardware performance counters are not available.\n");
+  }
+}
+
+}  // namespace tools
+}  // namespace jpegxl
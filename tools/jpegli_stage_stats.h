@@ -0,0 +1,43 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef TOOLS_JPEGLI_STAGE_STATS_H_
+#define TOOLS_JPEGLI_STAGE_STATS_H_
+
+#include <cstddef>
+
+#include "lib/jpegli/types.h"
+
+struct jpegli_stage_stats;
+
+namespace jpegxl {
+namespace tools {
+
+// Sums of the stage times and hardware event counts of several jpegli runs,
+// see jpegli_get_stage_stats() and jpegli_enable_stage_counters().
+struct JpegliStageTotals {
+  // Adds the stats of a run on an image of image_pixels pixels.
+  void Add(const jpegli_stage_stats& stats, size_t image_pixels);
+  void Assimilate(const JpegliStageTotals& victim);
+
+  // Prints a row per stage that was entered with its calls, time, retired
+  // instructions per pixel, and cache misses and branch mispredictions per
+  // thousand instructions.
+  void Print(const char* title) const;
+
+  size_t num_runs = 0;
+  size_t num_pixels = 0;
+  double seconds[JPEGLI_NUM_STAGES] = {};
+  size_t num_calls[JPEGLI_NUM_STAGES] = {};
+  double instructions[JPEGLI_NUM_STAGES] = {};
+  double cache_misses[JPEGLI_NUM_STAGES] = {};
+  double branch_misses[JPEGLI_NUM_STAGES] = {};
+};
+
+}  // namespace tools
+}  // namespace jpegxl
+
+#endif  // TOOLS_JPEGLI_STAGE_STATS_H_
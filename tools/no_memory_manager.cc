@@ -8,6 +8,7 @@
 #include <cstdlib>
 
 #include "lib/base/memory_manager.h"
+#include "lib/extras/recycling_memory_manager.h"
 
 namespace jpegxl {
 namespace tools {
@@ -20,5 +21,12 @@ JxlMemoryManager kNoMemoryManager{nullptr, &ToolsAlloc, &ToolsFree};
 
 JxlMemoryManager* NoMemoryManager() { return &kNoMemoryManager; };
 
+JxlMemoryManager* MetricsMemoryManager() {
+  // Never destroyed, so that blocks freed during exit still find it.
+  static jxl::RecyclingMemoryManager* recycling =
+      new jxl::RecyclingMemoryManager(NoMemoryManager());
+  return recycling->get();
+}
+
 }  // namespace tools
 }  // namespace jpegxl
@@ -13,6 +13,10 @@ namespace tools {
 
 JxlMemoryManager* NoMemoryManager();
 
+// Like NoMemoryManager(), but keeps large freed blocks for reuse, for the
+// image planes of metrics that are computed on many same-sized images.
+JxlMemoryManager* MetricsMemoryManager();
+
 }  // namespace tools
 }  // namespace jpegxl
 
@@ -0,0 +1,88 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#include "tools/perf_counters.h"
+
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace jpegxl {
+namespace tools {
+
+#if defined(__linux__)
+
+namespace {
+
+int OpenCounter(uint64_t config) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return static_cast<int>(syscall(__NR_perf_event_open, &attr, /*pid=*/0,
+                                  /*cpu=*/-1, /*group_fd=*/-1, /*flags=*/0));
+}
+
+bool ReadCounter(int fd, double* value) {
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) != sizeof(count)) return false;
+  *value = static_cast<double>(count);
+  return true;
+}
+
+}  // namespace
+
+PerfCounters::PerfCounters() {
+  cycles_fd_ = OpenCounter(PERF_COUNT_HW_CPU_CYCLES);
+  instructions_fd_ = OpenCounter(PERF_COUNT_HW_INSTRUCTIONS);
+}
+
+PerfCounters::~PerfCounters() {
+  if (cycles_fd_ >= 0) close(cycles_fd_);
+  if (instructions_fd_ >= 0) close(instructions_fd_);
+}
+
+void PerfCounters::Start() {
+  if (!IsAvailable()) return;
+  for (int fd : {cycles_fd_, instructions_fd_}) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+bool PerfCounters::Stop(double* cycles, double* instructions) {
+  if (!IsAvailable()) return false;
+  for (int fd : {cycles_fd_, instructions_fd_}) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  }
+  return ReadCounter(cycles_fd_, cycles) &&
+         ReadCounter(instructions_fd_, instructions);
+}
+
+#else
+
+PerfCounters::PerfCounters() = default;
+PerfCounters::~PerfCounters() = default;
+void PerfCounters::Start() {}
+bool PerfCounters::Stop(double* /*cycles*/, double* /*instructions*/) {
+  return false;
+}
+
+#endif  // defined(__linux__)
+
+}  // namespace tools
+}  // namespace jpegxl
@@ -0,0 +1,41 @@
+// Copyright (c) the JPEG XL Project Authors.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file or at
+// https://developers.google.com/open-source/licenses/bsd
+
+#ifndef TOOLS_PERF_COUNTERS_H_
+#define TOOLS_PERF_COUNTERS_H_
+
+namespace jpegxl {
+namespace tools {
+
+// Counts the CPU cycles and the retired instructions of the calling thread in
+// user space, with the perf_event counters of Linux. The counters are not
+// available on other systems, or if perf events are restricted, e.g. by
+// /proc/sys/kernel/perf_event_paranoid.
+class PerfCounters {
+ public:
+  PerfCounters();
+  ~PerfCounters();
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  bool IsAvailable() const { return cycles_fd_ >= 0 && instructions_fd_ >= 0; }
+
+  // Resets and starts the counters.
+  void Start();
+
+  // Stops the counters and returns the counts since Start(), or false if the
+  // counters are not available.
+  bool Stop(double* cycles, double* instructions);
+
+ private:
+  int cycles_fd_ = -1;
+  int instructions_fd_ = -1;
+};
+
+}  // namespace tools
+}  // namespace jpegxl
+
+#endif  // TOOLS_PERF_COUNTERS_H_
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+# Copyright (c) the JPEG XL Project Authors.
+#
+# Use of this source code is governed by a BSD-style
+# license that can be found in the LICENSE file or at
+# https://developers.google.com/open-source/licenses/bsd
+
+
+"""jpegli_perf_regression.py: Checks the speed of jpegli against a baseline.
+
+Runs jpegli_perf_corpus, which encodes and decodes a fixed corpus of generated
+images over sizes, chroma subsampling, progressive levels, restart intervals
+and bit depths, and divides each time by that of a calibration workload that
+does not depend on jpegli. These ratios are compared with those stored in the
+baseline file, and the script fails if any of them got slower by more than the
+threshold.
+
+The baseline is recorded with --update, on the machine that runs the check:
+
+  jpegli_perf_regression.py --binary build/tools/jpegli_perf_corpus \
+      --baseline tools/scripts/jpegli_perf_baseline.json --update
+"""
+
+import argparse
+import json
+import subprocess
+import sys
+
+
+def run_corpus(binary, reps, quick, config_filter):
+  """Returns {key: seconds / calibration seconds} and the compressed sizes."""
+  cmd = [binary, '-n', str(reps)]
+  if quick:
+    cmd.append('-q')
+  if config_filter:
+    cmd += ['-f', config_filter]
+  output = subprocess.run(cmd, check=True, stdout=subprocess.PIPE,
+                          universal_newlines=True).stdout
+  ratios = {}
+  sizes = {}
+  calibration = None
+  for line in output.splitlines():
+    name, encode, decode, size = line.split('\t')
+    if name == 'calibration':
+      calibration = float(encode)
+      continue
+    ratios[name + '/enc'] = float(encode) / calibration
+    ratios[name + '/dec'] = float(decode) / calibration
+    sizes[name] = int(size)
+  return ratios, sizes
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+  parser.add_argument('--binary', required=True,
+                      help='path to the jpegli_perf_corpus binary')
+  parser.add_argument('--baseline', required=True,
+                      help='JSON file with the baseline timing ratios')
+  parser.add_argument('--threshold', type=float, default=0.15,
+                      help='largest allowed relative slowdown, default 0.15')
+  parser.add_argument('--reps', type=int, default=5,
+                      help='number of runs per image, the fastest is used')
+  parser.add_argument('--quick', action='store_true',
+                      help='only use the smallest image size')
+  parser.add_argument('--filter', default='',
+                      help='only run the configurations containing FILTER')
+  parser.add_argument('--update', action='store_true',
+                      help='write the baseline instead of checking it')
+  args = parser.parse_args()
+
+  ratios, sizes = run_corpus(args.binary, args.reps, args.quick, args.filter)
+
+  if args.update:
+    with open(args.baseline, 'w') as f:
+      json.dump({'ratios': ratios, 'sizes': sizes}, f, indent=2, sort_keys=True)
+      f.write('\n')
+    print('Wrote %d timing ratios to %s' % (len(ratios), args.baseline))
+    return 0
+
+  try:
+    with open(args.baseline) as f:
+      baseline = json.load(f)
+  except FileNotFoundError:
+    print('No baseline at %s, record one with --update.' % args.baseline,
+          file=sys.stderr)
+    return 1
+
+  regressions = []
+  print('%-40s %10s %10s %8s' % ('Configuration', 'Baseline', 'Current',
+                                 'Change'))
+  for key in sorted(ratios):
+    if key not in baseline['ratios']:
+      print('%-40s %10s %10.3f' % (key, '-', ratios[key]))
+      continue
+    base = baseline['ratios'][key]
+    change = ratios[key] / base - 1.0
+    print('%-40s %10.3f %10.3f %+7.1f%%' % (key, base, ratios[key],
+                                            100 * change))
+    if change > args.threshold:
+      regressions.append((key, change))
+  for name, size in sorted(sizes.items()):
+    base_size = baseline.get('sizes', {}).get(name)
+    if base_size is not None and base_size != size:
+      print('Note: %s compresses to %d bytes instead of %d' %
+            (name, size, base_size))
+
+  if regressions:
+    print('\n%d configurations are more than %.0f%% slower than the baseline:'
+          % (len(regressions), 100 * args.threshold), file=sys.stderr)
+    for key, change in regressions:
+      print('  %s: %+.1f%%' % (key, 100 * change), file=sys.stderr)
+    return 1
+  return 0
+
+
+if __name__ == '__main__':
+  sys.exit(main())
@@ -11,16 +11,43 @@
 #include <cstddef>
 #include <cstdio>
 #include <string>
+#include <vector>
 
 namespace jpegxl {
 namespace tools {
 
 void SpeedStats::NotifyElapsed(double elapsed_seconds) {
   if (elapsed_seconds > 0.0) {
+    if (elapsed_.empty()) {
+      cold_elapsed_ = elapsed_seconds;
+    } else {
+      warm_elapsed_.push_back(elapsed_seconds);
+    }
     elapsed_.push_back(elapsed_seconds);
   }
 }
 
+void SpeedStats::NotifyCounters(double cycles, double instructions) {
+  cycles_.push_back(cycles);
+  instructions_.push_back(instructions);
+}
+
+void SpeedStats::NotifyEnergy(double joules) { joules_.push_back(joules); }
+
+void SpeedStats::NotifyMemoryUsage(const MemoryUsage& usage) {
+  MemoryUsage& m = max_memory_usage_;
+  m.peak_bytes = std::max(m.peak_bytes, usage.peak_bytes);
+  m.permanent_peak_bytes =
+      std::max(m.permanent_peak_bytes, usage.permanent_peak_bytes);
+  m.image_peak_bytes = std::max(m.image_peak_bytes, usage.image_peak_bytes);
+  m.num_allocations = std::max(m.num_allocations, usage.num_allocations);
+  m.allocator_peak_bytes =
+      std::max(m.allocator_peak_bytes, usage.allocator_peak_bytes);
+  m.allocator_num_blocks =
+      std::max(m.allocator_num_blocks, usage.allocator_num_blocks);
+  has_memory_usage_ = true;
+}
+
 bool SpeedStats::GetSummary(SpeedStats::Summary* s) {
   if (elapsed_.empty()) return false;
 
@@ -71,6 +98,62 @@ bool SpeedStats::GetSummary(SpeedStats::Summary* s) {
 
 namespace {
 
+// Nearest-rank percentile of the sorted `values`, which must not be empty.
+double Percentile(const std::vector<double>& values, double p) {
+  size_t rank = static_cast<size_t>(std::ceil(p * values.size()));
+  return values[std::min(std::max<size_t>(rank, 1), values.size()) - 1];
+}
+
+double Median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+}  // namespace
+
+bool SpeedStats::GetPercentiles(SpeedStats::Percentiles* p) const {
+  if (elapsed_.empty()) return false;
+  p->cold = cold_elapsed_;
+  p->num_warm = warm_elapsed_.size();
+  if (warm_elapsed_.empty()) {
+    p->p50 = p->p90 = p->p99 = p->p999 = 0.0;
+    return true;
+  }
+  std::vector<double> sorted = warm_elapsed_;
+  std::sort(sorted.begin(), sorted.end());
+  p->p50 = Percentile(sorted, 0.5);
+  p->p90 = Percentile(sorted, 0.9);
+  p->p99 = Percentile(sorted, 0.99);
+  p->p999 = Percentile(sorted, 0.999);
+  return true;
+}
+
+bool SpeedStats::GetCountersPerPixel(double* cycles,
+                                     double* instructions) const {
+  const double pixels = static_cast<double>(xsize_) * ysize_;
+  if (elapsed_.empty() || cycles_.size() != elapsed_.size() || pixels == 0) {
+    return false;
+  }
+  // Skips the cold run, unless it is the only one.
+  const size_t first = cycles_.size() > 1 ? 1 : 0;
+  *cycles = Median({cycles_.begin() + first, cycles_.end()}) / pixels;
+  *instructions =
+      Median({instructions_.begin() + first, instructions_.end()}) / pixels;
+  return true;
+}
+
+bool SpeedStats::GetJoulesPerRun(double* joules) const {
+  if (elapsed_.empty() || joules_.size() != elapsed_.size()) return false;
+  // Skips the cold run, unless it is the only one.
+  const size_t first = joules_.size() > 1 ? 1 : 0;
+  double sum = 0.0;
+  for (size_t i = first; i < joules_.size(); ++i) sum += joules_[i];
+  *joules = sum / (joules_.size() - first);
+  return true;
+}
+
+namespace {
+
 std::string SummaryStat(double value, const char* unit,
                         const SpeedStats::Summary& s) {
   if (value == 0.) return "";
@@ -106,8 +189,104 @@ bool SpeedStats::Print(size_t worker_threads) {
           static_cast<int>(xsize_), static_cast<int>(ysize_), mps_stats.c_str(),
           mbs_stats.c_str(), static_cast<int>(elapsed_.size()),
           static_cast<int>(worker_threads));
+
+  Percentiles p;
+  if (GetPercentiles(&p) && p.num_warm > 0) {
+    fprintf(stderr,
+            "cold: %.3f ms, warm p50: %.3f ms, p90: %.3f ms, p99: %.3f ms, "
+            "p999: %.3f ms.\n",
+            p.cold * 1e3, p.p50 * 1e3, p.p90 * 1e3, p.p99 * 1e3,
+            p.p999 * 1e3);
+  }
+  double cycles;
+  double instructions;
+  if (GetCountersPerPixel(&cycles, &instructions)) {
+    fprintf(stderr, "%.2f cycles/pixel, %.2f instructions/pixel (IPC %.2f).\n",
+            cycles, instructions, cycles > 0 ? instructions / cycles : 0.0);
+  }
+  double joules;
+  if (GetJoulesPerRun(&joules) && xsize_ * ysize_ > 0) {
+    fprintf(stderr, "%.3f J/MP (%.3f J per run).\n",
+            joules / (xsize_ * ysize_ * 1e-6), joules);
+  }
+  if (has_memory_usage_) {
+    const MemoryUsage& m = max_memory_usage_;
+    fprintf(stderr,
+            "memory: peak %.3f MB (permanent %.3f MB, image %.3f MB) in %.0f "
+            "allocations, %.3f MB in %.0f blocks.\n",
+            m.peak_bytes * 1e-6, m.permanent_peak_bytes * 1e-6,
+            m.image_peak_bytes * 1e-6, static_cast<double>(m.num_allocations),
+            m.allocator_peak_bytes * 1e-6,
+            static_cast<double>(m.allocator_num_blocks));
+  }
   return true;
 }
 
+bool SpeedStats::PrintJSON(FILE* f, const char* name,
+                           size_t worker_threads) const {
+  Percentiles p;
+  if (!GetPercentiles(&p)) return false;
+  const double mp = xsize_ * ysize_ * 1e-6;
+  fprintf(f, "{\n  \"name\": \"%s\",\n", name);
+  fprintf(f, "  \"xsize\": %d,\n  \"ysize\": %d,\n",
+          static_cast<int>(xsize_), static_cast<int>(ysize_));
+  fprintf(f, "  \"threads\": %d,\n  \"reps\": %d,\n",
+          static_cast<int>(worker_threads), static_cast<int>(elapsed_.size()));
+  fprintf(f, "  \"cold_seconds\": %.9f,\n", p.cold);
+  if (p.num_warm > 0) {
+    fprintf(f,
+            "  \"warm_seconds\": {\"p50\": %.9f, \"p90\": %.9f, "
+            "\"p99\": %.9f, \"p999\": %.9f, \"min\": %.9f, "
+            "\"max\": %.9f},\n",
+            p.p50, p.p90, p.p99, p.p999,
+            *std::min_element(warm_elapsed_.begin(), warm_elapsed_.end()),
+            *std::max_element(warm_elapsed_.begin(), warm_elapsed_.end()));
+  }
+  const double typical = p.num_warm > 0 ? p.p50 : p.cold;
+  fprintf(f, "  \"mps\": %.3f", mp / typical);
+  double cycles;
+  double instructions;
+  if (GetCountersPerPixel(&cycles, &instructions)) {
+    fprintf(f,
+            ",\n  \"cycles_per_pixel\": %.3f,\n"
+            "  \"instructions_per_pixel\": %.3f",
+            cycles, instructions);
+  }
+  double joules;
+  if (GetJoulesPerRun(&joules) && mp > 0) {
+    fprintf(f, ",\n  \"joules\": %.6f,\n  \"joules_per_mp\": %.6f", joules,
+            joules / mp);
+  }
+  if (has_memory_usage_) {
+    const MemoryUsage& m = max_memory_usage_;
+    fprintf(f,
+            ",\n  \"memory\": {\"peak_bytes\": %.0f, "
+            "\"permanent_peak_bytes\": %.0f, \"image_peak_bytes\": %.0f, "
+            "\"num_allocations\": %.0f, \"allocator_peak_bytes\": %.0f, "
+            "\"allocator_num_blocks\": %.0f}",
+            static_cast<double>(m.peak_bytes),
+            static_cast<double>(m.permanent_peak_bytes),
+            static_cast<double>(m.image_peak_bytes),
+            static_cast<double>(m.num_allocations),
+            static_cast<double>(m.allocator_peak_bytes),
+            static_cast<double>(m.allocator_num_blocks));
+  }
+  fprintf(f, "\n}\n");
+  return true;
+}
+
+bool WriteStatsJSON(const SpeedStats& stats, const std::string& filename,
+                    const char* name) {
+  FILE* f = fopen(filename.c_str(), "w");
+  if (f == nullptr) {
+    fprintf(stderr, "Could not open %s for writing\n", filename.c_str());
+    return false;
+  }
+  bool ok = stats.PrintJSON(f, name, 1);
+  if (fclose(f) != 0) ok = false;
+  if (!ok) fprintf(stderr, "Could not write stats to %s\n", filename.c_str());
+  return ok;
+}
+
 }  // namespace tools
 }  // namespace jpegxl
@@ -8,6 +8,9 @@
 #define TOOLS_SPEED_STATS_H_
 
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
 #include <vector>
 
 namespace jpegxl {
@@ -17,6 +20,32 @@ class SpeedStats {
  public:
   void NotifyElapsed(double elapsed_seconds);
 
+  // Adds the hardware counters of the run of the last NotifyElapsed() call.
+  void NotifyCounters(double cycles, double instructions);
+
+  // Adds the energy in joules used by the run of the last NotifyElapsed()
+  // call, see EnergyCounters.
+  void NotifyEnergy(double joules);
+
+  // Memory usage of one run of the jpegli codec.
+  struct MemoryUsage {
+    // Peak number of bytes requested from the jpegli memory manager, in total
+    // and in its permanent and image lifetime pools, and the number of
+    // requests, see jpegli_get_memory_stats().
+    uint64_t peak_bytes;
+    uint64_t permanent_peak_bytes;
+    uint64_t image_peak_bytes;
+    uint64_t num_allocations;
+    // Peak number of bytes in use of the JxlMemoryManager that allocated the
+    // memory blocks of jpegli, and the number of blocks.
+    uint64_t allocator_peak_bytes;
+    uint64_t allocator_num_blocks;
+  };
+
+  // Adds the memory usage of a run, Print() and PrintJSON() report the maximum
+  // of each field over the runs.
+  void NotifyMemoryUsage(const MemoryUsage& usage);
+
   struct Summary {
     // How central_tendency was computed - depends on number of reps.
     const char* type;
@@ -31,6 +60,30 @@ class SpeedStats {
   // Non-const, may sort elapsed_.
   bool GetSummary(Summary* summary);
 
+  // Elapsed time of the first (cold) run, and the percentiles of that of the
+  // other (warm) runs, which are zero if there is only one run.
+  struct Percentiles {
+    double cold;
+    size_t num_warm;
+    double p50;
+    double p90;
+    double p99;
+    double p999;
+  };
+
+  bool GetPercentiles(Percentiles* percentiles) const;
+
+  // Returns the median cycles and instructions per pixel of the warm runs, or
+  // of the cold run if there is only one, or false if the counters were not
+  // notified for all runs.
+  bool GetCountersPerPixel(double* cycles, double* instructions) const;
+
+  // Returns the mean energy in joules of the warm runs, or of the cold run if
+  // there is only one, or false if the energy was not notified for all runs.
+  // The mean is used instead of the median because the energy counters are
+  // updated only about every millisecond.
+  bool GetJoulesPerRun(double* joules) const;
+
   // Sets the image size to allow computing MP/s values.
   void SetImageSize(size_t xsize, size_t ysize) {
     xsize_ = xsize;
@@ -44,8 +97,21 @@ class SpeedStats {
   // once before this can be used.
   bool Print(size_t worker_threads);
 
+  // Writes the percentiles, the speed and the counters per pixel as a JSON
+  // object, for comparing runs in CI. SetImageSize() must be called once
+  // before this can be used.
+  bool PrintJSON(FILE* f, const char* name, size_t worker_threads) const;
+
  private:
   std::vector<double> elapsed_;
+  // Elapsed time of the runs except the first, in order.
+  std::vector<double> warm_elapsed_;
+  double cold_elapsed_ = 0.0;
+  std::vector<double> cycles_;
+  std::vector<double> instructions_;
+  std::vector<double> joules_;
+  bool has_memory_usage_ = false;
+  MemoryUsage max_memory_usage_ = {};
   size_t xsize_ = 0;
   size_t ysize_ = 0;
 
@@ -54,6 +120,11 @@ class SpeedStats {
   size_t file_size_ = 0;
 };
 
+// Writes stats.PrintJSON() of a single-threaded run to `filename`, or prints an
+// error and returns false if it can not be written.
+bool WriteStatsJSON(const SpeedStats& stats, const std::string& filename,
+                    const char* name);
+
 }  // namespace tools
 }  // namespace jpegxl
 
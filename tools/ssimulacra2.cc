@@ -89,9 +89,9 @@ Status ToXYB(const ColorEncoding& c_current, float intensity_target,
 Status Downsample(Image3F& in, size_t fx, size_t fy) {
   const size_t out_xsize = (in.xsize() + fx - 1) / fx;
   const size_t out_ysize = (in.ysize() + fy - 1) / fy;
-  JXL_ASSIGN_OR_RETURN(
-      Image3F out,
-      Image3F::Create(jpegxl::tools::NoMemoryManager(), out_xsize, out_ysize));
+  JXL_ASSIGN_OR_RETURN(Image3F out,
+                       Image3F::Create(jpegxl::tools::MetricsMemoryManager(),
+                                       out_xsize, out_ysize));
   const float normalize = 1.0f / (fx * fy);
   for (size_t c = 0; c < 3; ++c) {
     for (size_t oy = 0; oy < out_ysize; ++oy) {
@@ -131,7 +131,7 @@ void Multiply(const Image3F& a, const Image3F& b, Image3F* mul) {
 class Blur {
  public:
   static StatusOr<Blur> Create(const size_t xsize, const size_t ysize) {
-    JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+    JxlMemoryManager* memory_manager = jpegxl::tools::MetricsMemoryManager();
     Blur result;
     JXL_ASSIGN_OR_RETURN(result.temp_,
                          ImageF::Create(memory_manager, xsize, ysize));
@@ -139,16 +139,12 @@ class Blur {
   }
 
   Status BlurPlane(const ImageF& in, ImageF* JXL_RESTRICT out) {
-    JXL_RETURN_IF_ERROR(FastGaussian(
-        in.memory_manager(), rg_, in.xsize(), in.ysize(),
-        [&](size_t y) { return in.ConstRow(y); },
-        [&](size_t y) { return temp_.Row(y); },
-        [&](size_t y) { return out->Row(y); }));
+    JXL_RETURN_IF_ERROR(FastGaussian(rg_, in, &temp_, out));
     return true;
   }
 
   StatusOr<Image3F> operator()(const Image3F& in) {
-    JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+    JxlMemoryManager* memory_manager = jpegxl::tools::MetricsMemoryManager();
     JXL_ASSIGN_OR_RETURN(
         Image3F out, Image3F::Create(memory_manager, in.xsize(), in.ysize()));
     JXL_RETURN_IF_ERROR(BlurPlane(in.Plane(0), &out.Plane(0)));
@@ -173,12 +169,14 @@ double quartic(double x) {
   x *= x;
   return x;
 }
+// Adds the sum of the SSIM error map and of its fourth power over the rows
+// [y0, y1) of each channel c to sums[c * 2] and sums[c * 2 + 1].
 void SSIMMap(const Image3F& m1, const Image3F& m2, const Image3F& s11,
-             const Image3F& s22, const Image3F& s12, double* plane_averages) {
-  const double onePerPixels = 1.0 / (m1.ysize() * m1.xsize());
+             const Image3F& s22, const Image3F& s12, size_t y0, size_t y1,
+             double* sums) {
   for (size_t c = 0; c < 3; ++c) {
     double sum1[2] = {0.0};
-    for (size_t y = 0; y < m1.ysize(); ++y) {
+    for (size_t y = y0; y < y1; ++y) {
       const float* JXL_RESTRICT row_m1 = m1.PlaneRow(c, y);
       const float* JXL_RESTRICT row_m2 = m2.PlaneRow(c, y);
       const float* JXL_RESTRICT row_s11 = s11.PlaneRow(c, y);
@@ -215,17 +213,18 @@ void SSIMMap(const Image3F& m1, const Image3F& m2, const Image3F& s11,
         sum1[1] += quartic(d);
       }
     }
-    plane_averages[c * 2] = onePerPixels * sum1[0];
-    plane_averages[c * 2 + 1] = sqrt(sqrt(onePerPixels * sum1[1]));
+    sums[c * 2] += sum1[0];
+    sums[c * 2 + 1] += sum1[1];
   }
 }
 
+// Adds the sums of the artifact and detail lost maps and of their fourth
+// powers over the rows [y0, y1) of each channel c to sums[c * 4 + 0..3].
 void EdgeDiffMap(const Image3F& img1, const Image3F& mu1, const Image3F& img2,
-                 const Image3F& mu2, double* plane_averages) {
-  const double onePerPixels = 1.0 / (img1.ysize() * img1.xsize());
+                 const Image3F& mu2, size_t y0, size_t y1, double* sums) {
   for (size_t c = 0; c < 3; ++c) {
     double sum1[4] = {0.0};
-    for (size_t y = 0; y < img1.ysize(); ++y) {
+    for (size_t y = y0; y < y1; ++y) {
       const float* JXL_RESTRICT row1 = img1.PlaneRow(c, y);
       const float* JXL_RESTRICT row2 = img2.PlaneRow(c, y);
       const float* JXL_RESTRICT rowm1 = mu1.PlaneRow(c, y);
@@ -248,13 +247,38 @@ void EdgeDiffMap(const Image3F& img1, const Image3F& mu1, const Image3F& img2,
         sum1[3] += quartic(detail_lost);
       }
     }
-    plane_averages[c * 4] = onePerPixels * sum1[0];
-    plane_averages[c * 4 + 1] = sqrt(sqrt(onePerPixels * sum1[1]));
-    plane_averages[c * 4 + 2] = onePerPixels * sum1[2];
-    plane_averages[c * 4 + 3] = sqrt(sqrt(onePerPixels * sum1[3]));
+    for (size_t i = 0; i < 4; ++i) {
+      sums[c * 4 + i] += sum1[i];
+    }
   }
 }
 
+// Sums of the error maps of one scale, see SSIMMap and EdgeDiffMap.
+struct ScaleSums {
+  double ssim[3 * 2] = {};
+  double edgediff[3 * 4] = {};
+
+  void Add(const ScaleSums& other) {
+    for (size_t i = 0; i < 3 * 2; ++i) ssim[i] += other.ssim[i];
+    for (size_t i = 0; i < 3 * 4; ++i) edgediff[i] += other.edgediff[i];
+  }
+
+  // Returns the 1-norms and 4-norms of the error maps with num_pixels pixels.
+  MsssimScale Norms(size_t num_pixels) const {
+    const double onePerPixels = 1.0 / num_pixels;
+    MsssimScale sscale;
+    for (size_t i = 0; i < 3 * 2; i += 2) {
+      sscale.avg_ssim[i] = onePerPixels * ssim[i];
+      sscale.avg_ssim[i + 1] = sqrt(sqrt(onePerPixels * ssim[i + 1]));
+    }
+    for (size_t i = 0; i < 3 * 4; i += 2) {
+      sscale.avg_edgediff[i] = onePerPixels * edgediff[i];
+      sscale.avg_edgediff[i + 1] = sqrt(sqrt(onePerPixels * edgediff[i + 1]));
+    }
+    return sscale;
+  }
+};
+
 /* Get all components in more or less 0..1 range
    Range of Rec2020 with these adjustments:
     X: 0.017223..0.998838
@@ -465,62 +489,59 @@ double Msssim::Score() const {
   return ssim;
 }
 
-StatusOr<Msssim> ComputeSSIMULACRA2(const PackedPixelFile& orig,
-                                    const PackedPixelFile& distorted) {
-  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
-  Msssim msssim;
+namespace {
 
-  if (orig.xsize() != distorted.xsize() || orig.ysize() != distorted.ysize()) {
-    return JXL_FAILURE("Images must have the same size for SSIMULACRA2.");
-  }
-  if (orig.info.num_color_channels != distorted.info.num_color_channels) {
-    return JXL_FAILURE("Grayscale vs RGB comparison not supported.");
-  }
-  const size_t xsize = orig.xsize();
-  const size_t ysize = distorted.ysize();
-  const bool is_gray = orig.info.num_color_channels == 1;
+// Converts 'ppf' to linear sRGB and returns its intensity target.
+StatusOr<float> ToLinearSRGB(const PackedPixelFile& ppf, Image3F* linear) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::MetricsMemoryManager();
+  const bool is_gray = ppf.info.num_color_channels == 1;
   ColorEncoding c_desired = ColorEncoding::LinearSRGB(is_gray);
   const JxlCmsInterface& cms = *JxlGetDefaultCms();
-
-  JXL_ASSIGN_OR_RETURN(Image3F orig2,
-                       Image3F::Create(memory_manager, xsize, ysize));
-  JXL_RETURN_IF_ERROR(
-      jxl::extras::ConvertPackedPixelFileToImage3F(orig, &orig2, nullptr));
-  JXL_ASSIGN_OR_RETURN(Image3F dist2,
-                       Image3F::Create(memory_manager, xsize, ysize));
+  JXL_ASSIGN_OR_RETURN(
+      *linear, Image3F::Create(memory_manager, ppf.xsize(), ppf.ysize()));
   JXL_RETURN_IF_ERROR(
-      jxl::extras::ConvertPackedPixelFileToImage3F(distorted, &dist2, nullptr));
-
-  ColorEncoding c_enc_orig;
-  ColorEncoding c_enc_dist;
-  JXL_ENSURE(GetColorEncoding(orig, &c_enc_orig));
-  JXL_ENSURE(GetColorEncoding(distorted, &c_enc_dist));
-  float intensity_orig = GetIntensityTarget(orig, c_enc_orig);
-  float intensity_dist = GetIntensityTarget(distorted, c_enc_dist);
-
-  if (!c_enc_orig.SameColorEncoding(c_desired)) {
-    JXL_ENSURE(ApplyColorTransform(c_enc_orig, intensity_orig, orig2, nullptr,
-                                   Rect(orig2), c_desired, cms, nullptr,
-                                   &orig2));
-  }
-  if (!c_enc_dist.SameColorEncoding(c_desired)) {
-    JXL_ENSURE(ApplyColorTransform(c_enc_dist, intensity_dist, dist2, nullptr,
-                                   Rect(dist2), c_desired, cms, nullptr,
-                                   &dist2));
+      jxl::extras::ConvertPackedPixelFileToImage3F(ppf, linear, nullptr));
+  ColorEncoding c_enc;
+  JXL_ENSURE(GetColorEncoding(ppf, &c_enc));
+  float intensity_target = GetIntensityTarget(ppf, c_enc);
+  if (!c_enc.SameColorEncoding(c_desired)) {
+    JXL_ENSURE(ApplyColorTransform(c_enc, intensity_target, *linear, nullptr,
+                                   Rect(*linear), c_desired, cms, nullptr,
+                                   linear));
   }
+  return intensity_target;
+}
 
-  JXL_ASSIGN_OR_RETURN(Image3F img1,
-                       Image3F::Create(memory_manager, xsize, ysize));
-  JXL_ASSIGN_OR_RETURN(Image3F img2,
-                       Image3F::Create(memory_manager, xsize, ysize));
-  JXL_RETURN_IF_ERROR(jxl::CopyImageTo(orig2, &img1));
-  JXL_RETURN_IF_ERROR(jxl::CopyImageTo(dist2, &img2));
-  JXL_RETURN_IF_ERROR(ToXYB(c_desired, intensity_orig, nullptr, nullptr, &img1,
-                            *JxlGetDefaultCms()));
-  JXL_RETURN_IF_ERROR(ToXYB(c_desired, intensity_dist, nullptr, nullptr, &img2,
+// Returns the positive XYB version of the linear sRGB image 'linear'.
+StatusOr<Image3F> ToPositiveXYB(const Image3F& linear, bool is_gray,
+                                float intensity_target) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::MetricsMemoryManager();
+  JXL_ASSIGN_OR_RETURN(
+      Image3F xyb,
+      Image3F::Create(memory_manager, linear.xsize(), linear.ysize()));
+  JXL_RETURN_IF_ERROR(jxl::CopyImageTo(linear, &xyb));
+  JXL_RETURN_IF_ERROR(ToXYB(ColorEncoding::LinearSRGB(is_gray),
+                            intensity_target, nullptr, nullptr, &xyb,
                             *JxlGetDefaultCms()));
-  MakePositiveXYB(img1);
-  MakePositiveXYB(img2);
+  MakePositiveXYB(xyb);
+  return xyb;
+}
+
+}  // namespace
+
+StatusOr<Ssimulacra2Reference> Ssimulacra2Reference::Create(
+    const PackedPixelFile& orig) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::MetricsMemoryManager();
+  Ssimulacra2Reference ref;
+  ref.xsize_ = orig.xsize();
+  ref.ysize_ = orig.ysize();
+  ref.num_color_channels_ = orig.info.num_color_channels;
+  const bool is_gray = ref.num_color_channels_ == 1;
+
+  Image3F orig2;
+  JXL_ASSIGN_OR_RETURN(ref.intensity_target_, ToLinearSRGB(orig, &orig2));
+  JXL_ASSIGN_OR_RETURN(Image3F img1,
+                       ToPositiveXYB(orig2, is_gray, ref.intensity_target_));
 
   JXL_ASSIGN_OR_RETURN(
       Image3F mul, Image3F::Create(memory_manager, img1.xsize(), img1.ysize()));
@@ -532,21 +553,183 @@ StatusOr<Msssim> ComputeSSIMULACRA2(const PackedPixelFile& orig,
     }
     if (scale) {
       JXL_RETURN_IF_ERROR(Downsample(orig2, 2, 2));
-      JXL_RETURN_IF_ERROR(img1.ShrinkTo(orig2.xsize(), orig2.ysize()));
-      JXL_RETURN_IF_ERROR(jxl::CopyImageTo(orig2, &img1));
-      JXL_RETURN_IF_ERROR(ToXYB(c_desired, intensity_orig, nullptr, nullptr,
-                                &img1, *JxlGetDefaultCms()));
-      JXL_RETURN_IF_ERROR(Downsample(dist2, 2, 2));
-      JXL_RETURN_IF_ERROR(img2.ShrinkTo(dist2.xsize(), dist2.ysize()));
-      JXL_RETURN_IF_ERROR(jxl::CopyImageTo(dist2, &img2));
-      JXL_RETURN_IF_ERROR(ToXYB(c_desired, intensity_orig, nullptr, nullptr,
-                                &img2, *JxlGetDefaultCms()));
-      MakePositiveXYB(img1);
-      MakePositiveXYB(img2);
+      JXL_ASSIGN_OR_RETURN(
+          img1, ToPositiveXYB(orig2, is_gray, ref.intensity_target_));
     }
     JXL_RETURN_IF_ERROR(mul.ShrinkTo(img1.xsize(), img1.ysize()));
     JXL_RETURN_IF_ERROR(blur.ShrinkTo(img1.xsize(), img1.ysize()));
 
+    Scale s;
+    Multiply(img1, img1, &mul);
+    JXL_ASSIGN_OR_RETURN(s.sigma_sq, blur(mul));
+    JXL_ASSIGN_OR_RETURN(s.mu, blur(img1));
+    JXL_ASSIGN_OR_RETURN(
+        s.img, Image3F::Create(memory_manager, img1.xsize(), img1.ysize()));
+    JXL_RETURN_IF_ERROR(jxl::CopyImageTo(img1, &s.img));
+    ref.scales_.push_back(std::move(s));
+  }
+  return ref;
+}
+
+StatusOr<Msssim> Ssimulacra2Reference::Compare(
+    const PackedPixelFile& distorted) const {
+  JxlMemoryManager* memory_manager = jpegxl::tools::MetricsMemoryManager();
+  Msssim msssim;
+
+  if (xsize_ != distorted.xsize() || ysize_ != distorted.ysize()) {
+    return JXL_FAILURE("Images must have the same size for SSIMULACRA2.");
+  }
+  if (num_color_channels_ != distorted.info.num_color_channels) {
+    return JXL_FAILURE("Grayscale vs RGB comparison not supported.");
+  }
+  const bool is_gray = num_color_channels_ == 1;
+
+  Image3F dist2;
+  JXL_ASSIGN_OR_RETURN(float intensity_dist, ToLinearSRGB(distorted, &dist2));
+  JXL_ASSIGN_OR_RETURN(Image3F img2,
+                       ToPositiveXYB(dist2, is_gray, intensity_dist));
+
+  JXL_ASSIGN_OR_RETURN(
+      Image3F mul, Image3F::Create(memory_manager, img2.xsize(), img2.ysize()));
+  JXL_ASSIGN_OR_RETURN(Blur blur, Blur::Create(img2.xsize(), img2.ysize()));
+
+  for (size_t scale = 0; scale < scales_.size(); scale++) {
+    if (scale) {
+      // Lower scales of the distorted image use the reference intensity
+      // target, as the scores were tuned that way.
+      JXL_RETURN_IF_ERROR(Downsample(dist2, 2, 2));
+      JXL_ASSIGN_OR_RETURN(img2,
+                           ToPositiveXYB(dist2, is_gray, intensity_target_));
+    }
+    const Scale& ref = scales_[scale];
+    JXL_RETURN_IF_ERROR(mul.ShrinkTo(img2.xsize(), img2.ysize()));
+    JXL_RETURN_IF_ERROR(blur.ShrinkTo(img2.xsize(), img2.ysize()));
+
+    Multiply(img2, img2, &mul);
+    JXL_ASSIGN_OR_RETURN(Image3F sigma2_sq, blur(mul));
+
+    Multiply(ref.img, img2, &mul);
+    JXL_ASSIGN_OR_RETURN(Image3F sigma12, blur(mul));
+
+    JXL_ASSIGN_OR_RETURN(Image3F mu2, blur(img2));
+
+    ScaleSums sums;
+    SSIMMap(ref.mu, mu2, ref.sigma_sq, sigma2_sq, sigma12, 0, img2.ysize(),
+            sums.ssim);
+    EdgeDiffMap(ref.img, ref.mu, img2, mu2, 0, img2.ysize(), sums.edgediff);
+    msssim.scales.push_back(sums.Norms(img2.xsize() * img2.ysize()));
+  }
+  return msssim;
+}
+
+namespace {
+
+// Height of the strips of full resolution rows that are processed
+// independently; a multiple of the downsampling factor of the coarsest scale.
+constexpr size_t kStripHeight = 128;
+constexpr size_t kMaxScaleFactor = 1 << (kNumScales - 1);
+// Context rows needed around the output rows of a blur at any scale; the
+// recursive Gaussian depends on input rows at most its radius away.
+constexpr size_t kBlurBorder = 6;
+
+// Source image of the strip computation with its color encoding.
+struct StripSource {
+  const PackedPixelFile* ppf;
+  ColorEncoding c_enc;
+  float intensity_target;
+};
+
+Status InitStripSource(const PackedPixelFile& ppf, StripSource* source) {
+  source->ppf = &ppf;
+  JXL_ENSURE(GetColorEncoding(ppf, &source->c_enc));
+  source->intensity_target = GetIntensityTarget(ppf, source->c_enc);
+  return true;
+}
+
+// Converts rows [y0, y0 + linear->ysize()) of the source to linear sRGB.
+Status ToLinearSRGBRows(const StripSource& source, size_t y0,
+                        Image3F* linear) {
+  JXL_RETURN_IF_ERROR(jxl::extras::ConvertPackedPixelFileRowsToImage3F(
+      *source.ppf, y0, linear, nullptr));
+  const ColorEncoding& c_desired =
+      ColorEncoding::LinearSRGB(source.c_enc.IsGray());
+  if (!source.c_enc.SameColorEncoding(c_desired)) {
+    JXL_ENSURE(ApplyColorTransform(source.c_enc, source.intensity_target,
+                                   *linear, nullptr, Rect(*linear), c_desired,
+                                   *JxlGetDefaultCms(), nullptr, linear));
+  }
+  return true;
+}
+
+// Returns the positive XYB version of rows [y0, y1) of 'linear'.
+StatusOr<Image3F> RowsToPositiveXYB(const Image3F& linear, size_t y0,
+                                    size_t y1, bool is_gray,
+                                    float intensity_target) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::MetricsMemoryManager();
+  JXL_ASSIGN_OR_RETURN(
+      Image3F xyb, Image3F::Create(memory_manager, linear.xsize(), y1 - y0));
+  JXL_RETURN_IF_ERROR(jxl::CopyImageTo(Rect(0, y0, linear.xsize(), y1 - y0),
+                                       linear, Rect(xyb), &xyb));
+  JXL_RETURN_IF_ERROR(ToXYB(ColorEncoding::LinearSRGB(is_gray),
+                            intensity_target, nullptr, nullptr, &xyb,
+                            *JxlGetDefaultCms()));
+  MakePositiveXYB(xyb);
+  return xyb;
+}
+
+// Adds the error map sums of the full resolution rows [y0, y1) for each scale
+// to sums. Only the rows that influence these, which are at most
+// kBlurBorder * kMaxScaleFactor full resolution rows away, are converted,
+// and at each scale only the rows within kBlurBorder of the output rows are
+// blurred, so the memory use does not depend on the image height. Since y0
+// is a multiple of kMaxScaleFactor, the downsampled rows and the blurs of the
+// output rows are the same as for the whole image.
+Status ProcessStrip(const StripSource& orig, const StripSource& dist,
+                    size_t num_scales, size_t y0, size_t y1,
+                    ScaleSums* sums) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::MetricsMemoryManager();
+  const size_t xsize = orig.ppf->xsize();
+  const size_t ysize = orig.ppf->ysize();
+  const bool is_gray = orig.ppf->info.num_color_channels == 1;
+  const size_t border = kBlurBorder * kMaxScaleFactor;
+  size_t win_y0 = y0 - std::min(y0, border);
+  const size_t win_y1 = std::min(y1 + border, ysize);
+  JXL_ASSIGN_OR_RETURN(
+      Image3F lin1, Image3F::Create(memory_manager, xsize, win_y1 - win_y0));
+  JXL_ASSIGN_OR_RETURN(
+      Image3F lin2, Image3F::Create(memory_manager, xsize, win_y1 - win_y0));
+  JXL_RETURN_IF_ERROR(ToLinearSRGBRows(orig, win_y0, &lin1));
+  JXL_RETURN_IF_ERROR(ToLinearSRGBRows(dist, win_y0, &lin2));
+
+  for (size_t scale = 0; scale < num_scales; ++scale) {
+    if (scale) {
+      JXL_RETURN_IF_ERROR(Downsample(lin1, 2, 2));
+      JXL_RETURN_IF_ERROR(Downsample(lin2, 2, 2));
+      win_y0 /= 2;
+    }
+    // Output rows of this strip and the rows needed to blur them, relative
+    // to the window.
+    const size_t out_y0 = (y0 >> scale) - win_y0;
+    const size_t out_y1 = jxl::DivCeil(y1, size_t{1} << scale) - win_y0;
+    const size_t blur_y0 = out_y0 - std::min(out_y0, kBlurBorder);
+    const size_t blur_y1 = std::min(out_y1 + kBlurBorder, lin1.ysize());
+
+    // Lower scales of the distorted image use the reference intensity target,
+    // as the scores were tuned that way.
+    JXL_ASSIGN_OR_RETURN(Image3F img1,
+                         RowsToPositiveXYB(lin1, blur_y0, blur_y1, is_gray,
+                                           orig.intensity_target));
+    JXL_ASSIGN_OR_RETURN(
+        Image3F img2,
+        RowsToPositiveXYB(
+            lin2, blur_y0, blur_y1, is_gray,
+            scale ? orig.intensity_target : dist.intensity_target));
+
+    JXL_ASSIGN_OR_RETURN(
+        Image3F mul,
+        Image3F::Create(memory_manager, img1.xsize(), img1.ysize()));
+    JXL_ASSIGN_OR_RETURN(Blur blur, Blur::Create(img1.xsize(), img1.ysize()));
+
     Multiply(img1, img1, &mul);
     JXL_ASSIGN_OR_RETURN(Image3F sigma1_sq, blur(mul));
 
@@ -559,10 +742,68 @@ StatusOr<Msssim> ComputeSSIMULACRA2(const PackedPixelFile& orig,
     JXL_ASSIGN_OR_RETURN(Image3F mu1, blur(img1));
     JXL_ASSIGN_OR_RETURN(Image3F mu2, blur(img2));
 
-    MsssimScale sscale;
-    SSIMMap(mu1, mu2, sigma1_sq, sigma2_sq, sigma12, sscale.avg_ssim);
-    EdgeDiffMap(img1, mu1, img2, mu2, sscale.avg_edgediff);
-    msssim.scales.push_back(sscale);
+    const size_t row0 = out_y0 - blur_y0;
+    const size_t row1 = out_y1 - blur_y0;
+    SSIMMap(mu1, mu2, sigma1_sq, sigma2_sq, sigma12, row0, row1,
+            sums[scale].ssim);
+    EdgeDiffMap(img1, mu1, img2, mu2, row0, row1, sums[scale].edgediff);
+  }
+  return true;
+}
+
+}  // namespace
+
+StatusOr<Msssim> ComputeSSIMULACRA2(const PackedPixelFile& orig,
+                                    const PackedPixelFile& distorted,
+                                    jxl::ThreadPool* pool) {
+  Msssim msssim;
+  if (orig.xsize() != distorted.xsize() || orig.ysize() != distorted.ysize()) {
+    return JXL_FAILURE("Images must have the same size for SSIMULACRA2.");
+  }
+  if (orig.info.num_color_channels != distorted.info.num_color_channels) {
+    return JXL_FAILURE("Grayscale vs RGB comparison not supported.");
+  }
+  StripSource orig_source;
+  StripSource dist_source;
+  JXL_RETURN_IF_ERROR(InitStripSource(orig, &orig_source));
+  JXL_RETURN_IF_ERROR(InitStripSource(distorted, &dist_source));
+
+  // A scale is computed if the previous one is at least 8x8 pixels.
+  size_t num_scales = 0;
+  size_t scale_xsize[kNumScales];
+  size_t scale_ysize[kNumScales];
+  for (size_t xs = orig.xsize(), ys = orig.ysize();
+       num_scales < kNumScales && xs >= 8 && ys >= 8; ++num_scales) {
+    if (num_scales) {
+      xs = jxl::DivCeil(xs, 2);
+      ys = jxl::DivCeil(ys, 2);
+    }
+    scale_xsize[num_scales] = xs;
+    scale_ysize[num_scales] = ys;
+  }
+  if (num_scales == 0) {
+    return msssim;
+  }
+
+  const size_t num_strips = jxl::DivCeil(orig.ysize(), kStripHeight);
+  std::vector<ScaleSums> strip_sums(num_strips * kNumScales);
+  JXL_RETURN_IF_ERROR(RunOnPool(
+      pool, 0, static_cast<uint32_t>(num_strips), jxl::ThreadPool::NoInit,
+      [&](const uint32_t strip, size_t /*thread*/) -> Status {
+        const size_t y0 = strip * kStripHeight;
+        const size_t y1 = std::min(y0 + kStripHeight, orig.ysize());
+        return ProcessStrip(orig_source, dist_source, num_scales, y0, y1,
+                            &strip_sums[strip * kNumScales]);
+      },
+      "SSIMULACRA2"));
+
+  for (size_t scale = 0; scale < num_scales; ++scale) {
+    ScaleSums sums;
+    for (size_t strip = 0; strip < num_strips; ++strip) {
+      sums.Add(strip_sums[strip * kNumScales + scale]);
+    }
+    msssim.scales.push_back(
+        sums.Norms(scale_xsize[scale] * scale_ysize[scale]));
   }
   return msssim;
 }
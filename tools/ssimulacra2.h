@@ -7,9 +7,12 @@
 #ifndef TOOLS_SSIMULACRA2_H_
 #define TOOLS_SSIMULACRA2_H_
 
+#include <cstddef>
 #include <vector>
 
+#include "lib/base/data_parallel.h"
 #include "lib/base/status.h"
+#include "lib/extras/image.h"
 #include "lib/extras/packed_image.h"
 
 struct MsssimScale {
@@ -23,10 +26,41 @@ struct Msssim {
   double Score() const;
 };
 
+// Reference-side state of SSIMULACRA 2: the XYB image of the original and its
+// blurred mean and variance at every scale. Creating it once allows scoring
+// many distorted images against the same original without recomputing these,
+// at the cost of keeping whole-image buffers in memory.
+class Ssimulacra2Reference {
+ public:
+  static jxl::StatusOr<Ssimulacra2Reference> Create(
+      const jxl::extras::PackedPixelFile& orig);
+
+  jxl::StatusOr<Msssim> Compare(
+      const jxl::extras::PackedPixelFile& distorted) const;
+
+ private:
+  struct Scale {
+    jxl::Image3F img;
+    jxl::Image3F mu;
+    jxl::Image3F sigma_sq;
+  };
+
+  Ssimulacra2Reference() = default;
+
+  size_t xsize_ = 0;
+  size_t ysize_ = 0;
+  size_t num_color_channels_ = 0;
+  float intensity_target_ = 0.0f;
+  std::vector<Scale> scales_;
+};
+
 // Computes the SSIMULACRA 2 score between reference image 'orig' and
-// distorted image 'distorted'.
+// distorted image 'distorted'. The image is processed in horizontal strips,
+// in parallel on the pool if given, so that the memory use beyond the inputs
+// is proportional to the image width, not to its area.
 jxl::StatusOr<Msssim> ComputeSSIMULACRA2(
     const jxl::extras::PackedPixelFile& orig,
-    const jxl::extras::PackedPixelFile& distorted);
+    const jxl::extras::PackedPixelFile& distorted,
+    jxl::ThreadPool* pool = nullptr);
 
 #endif  // TOOLS_SSIMULACRA2_H_
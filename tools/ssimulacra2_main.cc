@@ -74,12 +74,12 @@ int main(int argc, char** argv) {
   std::vector<jxl::extras::PackedPixelFile> ppf(2);
   const char* purpose[] = {"original", "distorted"};
   for (size_t i = 0; i < 2; ++i) {
-    std::vector<uint8_t> encoded;
-    if (!jpegxl::tools::ReadFile(argv[1 + i], &encoded)) {
+    jpegxl::tools::InputBytes encoded;
+    if (!encoded.Open(argv[1 + i])) {
       fprintf(stderr, "Could not load %s image: %s\n", purpose[i], argv[1 + i]);
       return 1;
     }
-    if (!jxl::extras::DecodeBytes(jxl::Bytes(encoded),
+    if (!jxl::extras::DecodeBytes(encoded.bytes(),
                                   jxl::extras::ColorHints(), &ppf[i])) {
       fprintf(stderr, "Could not decode %s image: %s\n", purpose[i],
               argv[1 + i]);
@@ -9,7 +9,6 @@
 
 #include <cstddef>
 #include <memory>
-#include <thread>  // NOLINT
 
 #include "lib/base/common.h"
 #include "lib/base/data_parallel.h"
@@ -24,11 +23,11 @@ using ::jxl::ThreadPool;
 // Helper class to pass an internal ThreadPool-like object using threads.
 class ThreadPoolInternal {
  public:
-  // Starts the given number of worker threads and blocks until they are ready.
-  // "num_worker_threads" defaults to one per hyperthread. If zero, all tasks
-  // run on the main thread.
+  // Starts the given number of worker threads.
+  // "num_worker_threads" defaults to one per CPU that the process may use. If
+  // zero, all tasks run on the main thread.
   explicit ThreadPoolInternal(
-      size_t num_threads = std::thread::hardware_concurrency()) {
+      size_t num_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads()) {
     runner_ =
         JxlThreadParallelRunnerMake(/* memory_manager */ nullptr, num_threads);
     pool_ =